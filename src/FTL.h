@@ -59,12 +59,17 @@
 // Default: -60 (one minute before a full hour)
 #define GCdelay (-60)
 
+// How many queries does the garbage collection remove at most before releasing
+// the lock for other threads? [queries]
+#define GC_SLICE_QUERIES 1000
+
+// For how long does the garbage collection hold the lock at most while
+// removing queries? [microseconds]
+#define GC_SLICE_USEC 2000
+
 // How many client connection do we accept at once?
 #define MAXCONNS 255
 
-// Over how many queries do we iterate at most when trying to find a match?
-#define MAXITER 1000
-
 // How many hours do we want to store in FTL's memory? [hours]
 #define MAXLOGAGE 24
 
@@ -86,12 +91,20 @@
 // Default: 3600 (once every hour)
 #define RERESOLVE_INTERVAL 3600
 
+// Host names which could not be resolved are retried after an exponentially
+// growing delay between these two limits [seconds]
+// Default: 3600 (one hour) up to 86400 (one day)
+#define RESOLVE_BACKOFF_MIN RERESOLVE_INTERVAL
+#define RESOLVE_BACKOFF_MAX 86400
+
 // Privacy mode constants
 #define HIDDEN_DOMAIN "hidden"
 #define HIDDEN_CLIENT "0.0.0.0"
 
 // Used to check memory integrity in various structs
 #define MAGICBYTE 0x57
+// Magic byte of the slots of reclaimed domains and clients (see reclaim.c)
+#define RECLAIMEDBYTE 0x5f
 
 // Some magic database constants
 #define DB_FAILED -2
@@ -0,0 +1,218 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Heap allocation profiling routines
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+// public prototypes
+#include "allocstats.h"
+// monotonic_usec()
+#include "histogram.h"
+
+// The live allocations are tracked in a hash table of their own. It must not
+// be allocated using the wrappers it is called from
+#undef calloc
+#undef free
+
+// Statistics are collected per process, forks start off with a copy of the
+// statistics of the main process. Memory allocated before the accounting
+// has been enabled (ALLOC_STATS) or by libraries is not tracked, freeing it
+// is ignored
+static alloc_site sites[ALLOC_SITES_MAX] = {{ 0 }};
+static unsigned int num_sites = 0;
+
+// Live allocation: open addressing with linear probing, removals shift the
+// following entries back (no tombstones)
+struct live_alloc {
+	void *ptr;
+	size_t size;
+	alloc_site *site;
+};
+#define LIVE_ALLOCS_MIN 4096u
+static struct live_alloc *live = NULL;
+static size_t live_size = 0u, live_count = 0u;
+
+// Protects the call sites and the table of live allocations. Allocations
+// happen in several threads
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t __attribute__((const)) ptr_hash(const void *ptr, const size_t size)
+{
+	// Heap pointers are aligned to at least 8 bytes
+	return (size_t)(((uintptr_t)ptr >> 3) * 0x9E3779B97F4A7C15ull) & (size - 1);
+}
+
+// Find the statistics of a call site, register it if it is not known yet.
+// Returns NULL when all slots are in use. Has to be called with the lock held
+static alloc_site *get_site(const char *file, const char *func, const int line)
+{
+	// Sites are never removed, hence an empty slot terminates the search
+	unsigned int i = ((unsigned int)line * 2654435761u) % ALLOC_SITES_MAX;
+	for(unsigned int probe = 0; probe < ALLOC_SITES_MAX; probe++, i = (i + 1) % ALLOC_SITES_MAX)
+	{
+		if(sites[i].file == NULL)
+		{
+			sites[i].func = func;
+			sites[i].line = line;
+			sites[i].last_report = monotonic_usec();
+			__atomic_store_n(&sites[i].file, file, __ATOMIC_RELEASE);
+			__atomic_store_n(&num_sites, num_sites + 1, __ATOMIC_RELEASE);
+			return &sites[i];
+		}
+		if(sites[i].line == line &&
+		   (sites[i].file == file || strcmp(sites[i].file, file) == 0))
+			return &sites[i];
+	}
+
+	// Table is full
+	return NULL;
+}
+
+static void insert_live(void *ptr, const size_t size, alloc_site *site)
+{
+	size_t i = ptr_hash(ptr, live_size);
+	while(live[i].ptr != NULL && live[i].ptr != ptr)
+		i = (i + 1) & (live_size - 1);
+
+	// A stale entry of memory which has been freed by other means (e.g.,
+	// by a library) is replaced
+	if(live[i].ptr == ptr)
+	{
+		live[i].site->frees++;
+		live[i].site->live_bytes -= live[i].size;
+		live_count--;
+	}
+
+	live[i].ptr = ptr;
+	live[i].size = size;
+	live[i].site = site;
+	live_count++;
+}
+
+// Grow the table of live allocations to keep the load factor below 1/2.
+// Returns false if this is not possible
+static bool grow_live(void)
+{
+	if(2*(live_count + 1) <= live_size)
+		return true;
+
+	const size_t old_size = live_size;
+	struct live_alloc *old = live;
+	const size_t new_size = old_size > 0u ? 2*old_size : LIVE_ALLOCS_MIN;
+	struct live_alloc *new = calloc(new_size, sizeof(*new));
+	if(new == NULL)
+		return false;
+
+	live = new;
+	live_size = new_size;
+	live_count = 0u;
+	for(size_t i = 0u; i < old_size; i++)
+		if(old[i].ptr != NULL)
+			insert_live(old[i].ptr, old[i].size, old[i].site);
+	if(old != NULL)
+		free(old);
+	return true;
+}
+
+// Record an allocation of size bytes at ptr made at the given call site
+void alloc_stats_alloc(void *ptr, const size_t size, const char *file, const char *func, const int line)
+{
+	if(ptr == NULL)
+		return;
+
+	pthread_mutex_lock(&alloc_lock);
+	alloc_site *site = get_site(file, func, line);
+	if(site != NULL)
+	{
+		site->allocs++;
+		site->bytes += size;
+		if(grow_live())
+		{
+			site->live_bytes += size;
+			insert_live(ptr, size, site);
+		}
+	}
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+// Record that the memory at ptr is about to be freed (or moved by realloc()).
+// Returns the size of the allocation, zero if it is not tracked
+size_t alloc_stats_free(void *ptr)
+{
+	size_t size = 0u;
+	if(ptr == NULL)
+		return size;
+
+	pthread_mutex_lock(&alloc_lock);
+	if(live_count > 0u)
+	{
+		size_t i = ptr_hash(ptr, live_size);
+		while(live[i].ptr != NULL && live[i].ptr != ptr)
+			i = (i + 1) & (live_size - 1);
+
+		if(live[i].ptr == ptr)
+		{
+			size = live[i].size;
+			live[i].site->frees++;
+			live[i].site->live_bytes -= live[i].size;
+			live[i].ptr = NULL;
+			live_count--;
+
+			// Move following entries of the same cluster back into
+			// the gap if their home slot is not after the gap
+			size_t gap = i;
+			for(size_t j = (i + 1) & (live_size - 1); live[j].ptr != NULL; j = (j + 1) & (live_size - 1))
+			{
+				const size_t home = ptr_hash(live[j].ptr, live_size);
+				if(((j - home) & (live_size - 1)) >= ((j - gap) & (live_size - 1)))
+				{
+					live[gap] = live[j];
+					live[j].ptr = NULL;
+					gap = j;
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&alloc_lock);
+
+	return size;
+}
+
+// Number of call sites with statistics
+unsigned int alloc_stats_sites(void)
+{
+	return __atomic_load_n(&num_sites, __ATOMIC_ACQUIRE);
+}
+
+// Get the i-th call site with statistics (sites are not stored consecutively)
+alloc_site *alloc_stats_get(const unsigned int i)
+{
+	unsigned int n = 0;
+	for(unsigned int j = 0; j < ALLOC_SITES_MAX; j++)
+	{
+		if(__atomic_load_n(&sites[j].file, __ATOMIC_ACQUIRE) == NULL)
+			continue;
+		if(n++ == i)
+			return &sites[j];
+	}
+	return NULL;
+}
+
+// Allocations per second of a call site since the previous report
+double alloc_stats_rate(alloc_site *site)
+{
+	pthread_mutex_lock(&alloc_lock);
+	const uint64_t now = monotonic_usec();
+	const uint64_t allocs = site->allocs - site->last_allocs;
+	const uint64_t usec = now - site->last_report;
+	site->last_allocs = site->allocs;
+	site->last_report = now;
+	pthread_mutex_unlock(&alloc_lock);
+
+	return usec > 0 ? 1e6 * (double)allocs / (double)usec : 0.0;
+}
@@ -0,0 +1,39 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Heap allocation profiling prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef ALLOCSTATS_H
+#define ALLOCSTATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Maximum number of distinct call sites we keep statistics for
+#define ALLOC_SITES_MAX 1024
+
+typedef struct {
+	const char *func;
+	const char *file;
+	int line;
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t bytes;
+	uint64_t live_bytes;
+	// Allocation count and time [usec] of the previous report, used to
+	// compute the allocation rate
+	uint64_t last_allocs;
+	uint64_t last_report;
+} alloc_site;
+
+void alloc_stats_alloc(void *ptr, const size_t size, const char *file, const char *func, const int line);
+size_t alloc_stats_free(void *ptr);
+unsigned int alloc_stats_sites(void) __attribute__((pure));
+alloc_site *alloc_stats_get(const unsigned int i) __attribute__((pure));
+double alloc_stats_rate(alloc_site *site);
+
+#endif //ALLOCSTATS_H
@@ -13,7 +13,7 @@
 #include "../enums.h"
 // getstr()
 #include "../shmem.h"
-// read_setupVarsconf()
+// setupVars_get()
 #include "../setupVars.h"
 // ssend()
 #include "socket.h"
@@ -30,56 +30,265 @@
 #include "../database/query-table.h"
 // in_auditlist()
 #include "../database/gravity-db.h"
+// bloom_memory()
+#include "../database/bloom.h"
 // struct overTime
 #include "../overTime.h"
 // Version information
 #include "../version.h"
+// get_interfaces()
+#include "netinfo.h"
 // enum REGEX
 #include "../regex_r.h"
 // get_aliasclient_list()
 #include "../database/aliasclients.h"
+// get_db_maintenance_stats()
+#include "../database/database-thread.h"
 // get_edestr()
 #include "api_helper.h"
-// RTF_UP, RTF_GATEWAY
-#include <linux/route.h>
+// lock_stats_get()
+#include "../lockstats.h"
+// db_latency_get()
+#include "../database/dblatency.h"
+// leaderboard_members()
+#include "../leaderboard.h"
+// timeseries_get()
+#include "../timeseries.h"
+// get_resolver_stats()
+#include "../resolve.h"
+// get_statsqueue_stats()
+#include "../statsqueue.h"
+// get_udp_batch_stats()
+#include "../udpbatch.h"
+// debug_limits_active()
+#include "../debuglimit.h"
+// get_dns_workers_stats()
+#include "../workers.h"
+// heavy_hitters_sorted()
+#include "../heavyhitters.h"
+// unique_in_slots()
+#include "../cardinality.h"
+// search_domains()
+#include "../trigram.h"
+// get_prefetch_count()
+#include "../prefetch.h"
+// get_cache_adapt_stats()
+#include "../cacheadapt.h"
+// get_pktdump_stats()
+#include "../pktdump.h"
+// get_querylog_stats()
+#include "../querylog.h"
+// get_dnstap_stats()
+#include "../dnstap.h"
+// get_sigcache_stats()
+#include "../sigcache.h"
+// get_nseccache_stats()
+#include "../nseccache.h"
+// upstream_probe_state()
+#include "../upstream_probe.h"
+// timer_stats_get()
+#include "../timers.h"
+// alloc_stats_get()
+#include "../allocstats.h"
+// queries_kept_since(), max_queries_in_memory
+#include "../gc.h"
+// known_domains(), known_clients()
+#include "../reclaim.h"
+// get_process_memory(), get_child_processes()
+#include "../procps.h"
+// main_pid()
+#include "../signals.h"
 
 // defined in src/dnsmasq/cache.c
 extern char *querystr(char *desc, unsigned short type);
 
 #define min(a,b) ({ __typeof__ (a) _a = (a); __typeof__ (b) _b = (b); _a < _b ? _a : _b; })
 
-/* qsort comparison function (count field), sort ASC */
-static int __attribute__((pure)) cmpasc(const void *a, const void *b)
+// Lazily sorted ranking of (ID, count) pairs. Entries are arranged as a
+// binary heap in O(n) and only as many entries as are actually sent are
+// popped off in O(log n) each, instead of sorting everything in advance.
+// Entries with equal counts are ordered by ID, this is the order the
+// previously used (stable) qsort() produced
+typedef struct {
+	int id;
+	int value;
+} rankEntry;
+
+// Get the current value of an ID, returns false if it should not be ranked
+typedef bool (*rank_value_fn)(const int id, const bool blocked, int *value);
+
+// A ranking can start with the members of a leaderboard (see leaderboard.c).
+// Members above the board's threshold are the exact top entries, only when
+// more entries are requested, the ranking falls back to all IDs
+typedef struct {
+	rankEntry *heap;
+	int n;
+	bool asc;
+	bool partial;
+	bool blocked;
+	int consumed;
+	int total;
+	rank_value_fn value;
+} ranking;
+
+// The memory is reused by all rankings of an API thread
+static __thread rankEntry *rank_buffer = NULL;
+static __thread size_t rank_buffer_size = 0u;
+
+static bool __attribute__((pure)) rank_before(const ranking *r, const rankEntry *a, const rankEntry *b)
 {
-	const int *elem1 = (int*)a;
-	const int *elem2 = (int*)b;
+	if(a->value != b->value)
+		return r->asc ? a->value < b->value : a->value > b->value;
+	return a->id < b->id;
+}
 
-	if (elem1[1] < elem2[1])
-		return -1;
-	else if (elem1[1] > elem2[1])
-		return 1;
-	else
-		return 0;
+// Prepare a ranking for up to max entries
+static bool ranking_init(ranking *r, const int max, const bool asc)
+{
+	r->n = 0;
+	r->asc = asc;
+	r->partial = false;
+	r->consumed = 0;
+	r->heap = NULL;
+	const size_t size = max > 0 ? (size_t)max : 1u;
+	if(size > rank_buffer_size)
+	{
+		rankEntry *buffer = realloc(rank_buffer, size*sizeof(rankEntry));
+		if(buffer == NULL)
+			return false;
+		rank_buffer = buffer;
+		rank_buffer_size = size;
+	}
+	r->heap = rank_buffer;
+	return true;
+}
+
+static void ranking_add(ranking *r, const int id, const int value)
+{
+	r->heap[r->n].id = id;
+	r->heap[r->n].value = value;
+	r->n++;
 }
 
-// qsort subroutine, sort DESC
-static int __attribute__((pure)) cmpdesc(const void *a, const void *b)
+static void rank_sift_down(ranking *r, int i)
 {
-	const int *elem1 = (int*)a;
-	const int *elem2 = (int*)b;
+	const rankEntry entry = r->heap[i];
+	while(2*i + 1 < r->n)
+	{
+		int child = 2*i + 1;
+		if(child + 1 < r->n && rank_before(r, &r->heap[child + 1], &r->heap[child]))
+			child++;
+		if(!rank_before(r, &r->heap[child], &entry))
+			break;
+		r->heap[i] = r->heap[child];
+		i = child;
+	}
+	r->heap[i] = entry;
+}
 
-	if (elem1[1] > elem2[1])
-		return -1;
-	else if (elem1[1] < elem2[1])
-		return 1;
-	else
-		return 0;
+// Arrange all added entries as heap (Floyd's method)
+static void ranking_build(ranking *r)
+{
+	for(int i = r->n/2 - 1; i >= 0; i--)
+		rank_sift_down(r, i);
+}
+
+static void ranking_fill_all(ranking *r)
+{
+	r->n = 0;
+	for(int id = 0; id < r->total; id++)
+	{
+		int value = 0;
+		if(r->value(id, r->blocked, &value))
+			ranking_add(r, id, value);
+	}
+	ranking_build(r);
+}
+
+// Add the values of IDs 0 ... total-1 to the ranking. Descending rankings
+// start with the leaderboard members if the board is available
+static void ranking_fill(ranking *r, const int total, rank_value_fn value,
+                         const bool blocked, const enum leaderboard_type board)
+{
+	r->total = total;
+	r->value = value;
+	r->blocked = blocked;
+
+	int ids[LEADERBOARD_SIZE], threshold = 0;
+	const int members = r->asc ? -1 : leaderboard_members(board, ids, &threshold);
+	if(members < 0)
+	{
+		ranking_fill_all(r);
+		return;
+	}
+
+	// Only members above the threshold are known to rank before all other IDs
+	r->partial = true;
+	for(int i = 0; i < members; i++)
+	{
+		int val = 0;
+		if(ids[i] < total && r->value(ids[i], blocked, &val) && val > threshold)
+			ranking_add(r, ids[i], val);
+	}
+	ranking_build(r);
+}
+
+// Get the next entry in the requested order, returns false when all entries
+// have been returned
+static bool ranking_next(ranking *r, rankEntry *entry)
+{
+	if(r->n < 1 && r->partial)
+	{
+		// The leaderboard is exhausted, rank all IDs and skip what has
+		// already been returned (this is exactly the same prefix)
+		r->partial = false;
+		ranking_fill_all(r);
+		for(int i = 0; i < r->consumed && r->n > 0; i++)
+			ranking_next(r, entry);
+	}
+
+	if(r->n < 1)
+		return false;
+
+	*entry = r->heap[0];
+	r->heap[0] = r->heap[--r->n];
+	if(r->n > 0)
+		rank_sift_down(r, 0);
+	if(r->partial)
+		r->consumed++;
+
+	return true;
+}
+
+static bool domain_rank_value(const int domainID, const bool blocked, int *value)
+{
+	// Get domain pointer
+	const domainsData* domain = getDomain(domainID, true);
+	if(domain == NULL)
+		return false;
+
+	// Count only permitted queries unless blocked ones are requested
+	*value = blocked ? domain->blockedcount : domain->count - domain->blockedcount;
+	return true;
+}
+
+static bool client_rank_value(const int clientID, const bool blocked, int *value)
+{
+	// Get client pointer
+	const clientsData* client = getClient(clientID, true);
+	// Skip invalid clients and also those managed by alias clients
+	if(client == NULL || (!client->flags.aliasclient && client->aliasclient_id >= 0))
+		return false;
+
+	// Use either blocked or total count based on request string
+	*value = blocked ? client->blockedcount : client->count;
+	return true;
 }
 
 void getStats(const int sock, const bool istelnet)
 {
 	const int blocked = blocked_queries();
-	const int total = counters->queries;
+	const int total = total_queries();
 	float percentage = 0.0f;
 
 	// Avoid 1/0 condition
@@ -110,15 +319,15 @@ void getStats(const int sock, const bool istelnet)
 		ssend(sock, "dns_queries_today %i\nads_blocked_today %i\nads_percentage_today %f\n",
 		      total, blocked, percentage);
 		ssend(sock, "unique_domains %i\nqueries_forwarded %i\nqueries_cached %i\n",
-		      counters->domains, forwarded_queries(), cached_queries());
-		ssend(sock, "clients_ever_seen %i\n", counters->clients);
+		      known_domains(), forwarded_queries(), cached_queries());
+		ssend(sock, "clients_ever_seen %i\n", known_clients());
 		ssend(sock, "unique_clients %i\n", activeclients);
 
 		// Sum up all query types (A, AAAA, ANY, SRV, SOA, ...)
 		int sumalltypes = 0;
 		for(int queryType=0; queryType < TYPE_MAX-1; queryType++)
 		{
-			sumalltypes += counters->querytype[queryType];
+			sumalltypes += counter_get(querytype[queryType]);
 		}
 		ssend(sock, "dns_queries_all_types %i\n", sumalltypes);
 
@@ -126,8 +335,8 @@ void getStats(const int sock, const bool istelnet)
 		int sumallreplies = 0;
 		for(enum reply_type reply = REPLY_UNKNOWN; reply < QUERY_REPLY_MAX; reply++)
 		{
-			ssend(sock, "reply_%s %i\n", get_query_reply_str(reply), counters->reply[reply]);
-			sumallreplies += counters->reply[reply];
+			ssend(sock, "reply_%s %i\n", get_query_reply_str(reply), counter_get(reply[reply]));
+			sumallreplies += counter_get(reply[reply]);
 		}
 		ssend(sock, "dns_queries_all_replies %i\n", sumallreplies);
 		ssend(sock, "privacy_level %i\n", config.privacylevel);
@@ -137,10 +346,10 @@ void getStats(const int sock, const bool istelnet)
 		pack_int32(sock, total);
 		pack_int32(sock, blocked);
 		pack_float(sock, percentage);
-		pack_int32(sock, counters->domains);
+		pack_int32(sock, known_domains());
 		pack_int32(sock, forwarded_queries());
 		pack_int32(sock, cached_queries());
-		pack_int32(sock, counters->clients);
+		pack_int32(sock, known_clients());
 		pack_int32(sock, activeclients);
 	}
 
@@ -152,8 +361,88 @@ void getStats(const int sock, const bool istelnet)
 		pack_uint8(sock, blockingstatus);
 }
 
-void getOverTime(const int sock, const bool istelnet)
+// Send the window of one tier of the multi-resolution time series in the
+// same formats as the overTime data
+static void sendTimeSeries(const char *client_message, const int sock, const bool istelnet, const int tier)
+{
+	const time_t now = time(NULL);
+	const unsigned int slots = timeseries_tier_slots(tier);
+	time_t timestamps[slots];
+	int32_t totals[slots], blocked[slots];
+	for(unsigned int i = 0; i < slots; i++)
+	{
+		int total = 0, nblocked = 0;
+		timeseries_get(tier, i, now, &timestamps[i], &total, &nblocked);
+		totals[i] = total;
+		blocked[i] = nblocked;
+	}
+
+	if(istelnet)
+	{
+		for(unsigned int i = 0; i < slots; i++)
+			ssend(sock, "%lli %i %i\n", (long long)timestamps[i], totals[i], blocked[i]);
+	}
+	else if(command(client_message, " bulk"))
+	{
+		int32_t values[slots];
+		for(unsigned int i = 0; i < slots; i++)
+			values[i] = (int32_t)timestamps[i];
+		pack_int32_array(sock, values, slots);
+		pack_int32_array(sock, totals, slots);
+		pack_int32_array(sock, blocked, slots);
+	}
+	else
+	{
+		pack_map16_start(sock, (uint16_t) slots);
+		for(unsigned int i = 0; i < slots; i++) {
+			pack_int32(sock, (int32_t)timestamps[i]);
+			pack_int32(sock, totals[i]);
+		}
+		pack_map16_start(sock, (uint16_t) slots);
+		for(unsigned int i = 0; i < slots; i++) {
+			pack_int32(sock, (int32_t)timestamps[i]);
+			pack_int32(sock, blocked[i]);
+		}
+	}
+}
+
+void getOverTime(const char *client_message, const int sock, const bool istelnet)
 {
+	// Multi-resolution time series, the resolution is given in seconds
+	// example: >overTime resolution 60
+	unsigned int resolution = 0;
+	const char *res = strstr(client_message, " resolution ");
+	if(res != NULL && sscanf(res, " resolution %u", &resolution) == 1)
+	{
+		const int tier = timeseries_tier(resolution);
+		if(tier < 0)
+		{
+			if(istelnet)
+				ssend(sock, "unsupported resolution, use 10, 60, 600 or 3600\n");
+			return;
+		}
+		sendTimeSeries(client_message, sock, istelnet, tier);
+		return;
+	}
+
+	// Binary bulk variant: timestamps, total and blocked queries as three
+	// contiguous arrays of little-endian int32 values
+	// example: >overTime bulk
+	if(!istelnet && command(client_message, " bulk"))
+	{
+		int32_t values[OVERTIME_SLOTS];
+		for(int slot = 0; slot < OVERTIME_SLOTS; slot++)
+			values[slot] = (int32_t)overTime[slot].timestamp;
+		pack_int32_array(sock, values, OVERTIME_SLOTS);
+		for(int slot = 0; slot < OVERTIME_SLOTS; slot++)
+			values[slot] = overTime[slot].total;
+		pack_int32_array(sock, values, OVERTIME_SLOTS);
+		for(int slot = 0; slot < OVERTIME_SLOTS; slot++)
+			values[slot] = overTime[slot].blocked;
+		pack_int32_array(sock, values, OVERTIME_SLOTS);
+		return;
+	}
+
 	if(istelnet)
 	{
 		for(int slot = 0; slot < OVERTIME_SLOTS; slot++)
@@ -185,15 +474,95 @@ void getOverTime(const int sock, const bool istelnet)
 	}
 }
 
+void getUniqueOverTime(const int sock, const bool istelnet)
+{
+	unsigned int domains[OVERTIME_SLOTS], clients[OVERTIME_SLOTS];
+	for(unsigned int slot = 0; slot < OVERTIME_SLOTS; slot++)
+		domains[slot] = unique_in_slots(slot, slot, &clients[slot]);
+
+	if(istelnet)
+	{
+		for(int slot = 0; slot < OVERTIME_SLOTS; slot++)
+		{
+			ssend(sock,"%lli %u %u\n",
+			      (long long)overTime[slot].timestamp,
+			      domains[slot], clients[slot]);
+		}
+	}
+	else
+	{
+		// Send distinct domains over time
+		pack_map16_start(sock, (uint16_t) OVERTIME_SLOTS);
+		for(int slot = 0; slot < OVERTIME_SLOTS; slot++) {
+			pack_int32(sock, (int32_t)overTime[slot].timestamp);
+			pack_int32(sock, domains[slot]);
+		}
+
+		// Send distinct clients over time
+		pack_map16_start(sock, (uint16_t) OVERTIME_SLOTS);
+		for(int slot = 0; slot < OVERTIME_SLOTS; slot++) {
+			pack_int32(sock, (int32_t)overTime[slot].timestamp);
+			pack_int32(sock, clients[slot]);
+		}
+	}
+}
+
+void getUnique(const char *client_message, const int sock, const bool istelnet)
+{
+	// Distinct domains queried by one client
+	// example: >unique-client 192.168.2.5
+	char name[256] = { 0 };
+	if(sscanf(client_message, ">unique-client %255s", name) == 1)
+	{
+		int clientID = find_client_lookup(name, false);
+		for(int i = 0; clientID < 0 && i < counters->clients; i++)
+		{
+			const clientsData *client = getClient(i, true);
+			if(client != NULL && client->namepos != 0 &&
+			   strcasecmp(getstr(client->namepos), name) == 0)
+				clientID = i;
+		}
+
+		const clientsData *client = getClient(clientID, true);
+		const unsigned int domains = client != NULL ? client_unique_domains(client) : 0u;
+		if(istelnet)
+			ssend(sock, "unique_domains %u\n", domains);
+		else
+			pack_int32(sock, domains);
+		return;
+	}
+
+	// Distinct domains and clients within a time window, the entire
+	// window is used if none is given
+	// example: >unique 1700000000 1700003600
+	unsigned int from = 0, until = OVERTIME_SLOTS - 1;
+	long long tfrom = 0, tuntil = 0;
+	if(sscanf(client_message, ">unique %lli %lli", &tfrom, &tuntil) == 2)
+	{
+		from = getOverTimeID(tfrom);
+		until = getOverTimeID(tuntil);
+	}
+
+	unsigned int clients = 0;
+	const unsigned int domains = unique_in_slots(from, until, &clients);
+	if(istelnet)
+		ssend(sock, "unique_domains %u\nunique_clients %u\n", domains, clients);
+	else
+	{
+		pack_int32(sock, domains);
+		pack_int32(sock, clients);
+	}
+}
+
 void getTopDomains(const char *client_message, const int sock, const bool istelnet)
 {
-	int temparray[counters->domains][2], count=10, num;
+	int count=10, num;
 	bool audit = false, asc = false;
 
 	const bool blocked = command(client_message, ">top-ads");
 
 	// Exit before processing any data if requested via config setting
-	get_privacy_level(NULL);
+	refresh_privacy_level();
 	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS) {
 		// Always send the total number of domains, but pretend it's 0
 		if(!istelnet)
@@ -219,30 +588,21 @@ void getTopDomains(const char *client_message, const int sock, const bool isteln
 	if(command(client_message, " asc"))
 		asc = true;
 
-	for(int domainID=0; domainID < counters->domains; domainID++)
+	ranking rank;
+	if(!ranking_init(&rank, counters->domains, asc))
 	{
-		// Get domain pointer
-		const domainsData* domain = getDomain(domainID, true);
-		if(domain == NULL)
-			continue;
-
-		temparray[domainID][0] = domainID;
-		if(blocked)
-			temparray[domainID][1] = domain->blockedcount;
-		else
-			// Count only permitted queries
-			temparray[domainID][1] = (domain->count - domain->blockedcount);
+		if(!istelnet)
+			pack_int32(sock, 0);
+		return;
 	}
 
-	// Sort temporary array
-	if(asc)
-		qsort(temparray, counters->domains, sizeof(int[2]), cmpasc);
-	else
-		qsort(temparray, counters->domains, sizeof(int[2]), cmpdesc);
-
+	// Sort lazily
+	ranking_fill(&rank, counters->domains, domain_rank_value, blocked,
+	             blocked ? BOARD_BLOCKED_DOMAINS : BOARD_PERMITTED_DOMAINS);
 
 	// Get filter
-	const char* filter = read_setupVarsconf("API_QUERY_LOG_SHOW");
+	struct setupVars_snapshot *setupVars = setupVars_get();
+	const char* filter = setupVars_value(setupVars, "API_QUERY_LOG_SHOW");
 	bool showpermitted = true, showblocked = true;
 	if(filter != NULL)
 	{
@@ -256,18 +616,9 @@ void getTopDomains(const char *client_message, const int sock, const bool isteln
 			showblocked = false;
 		}
 	}
-	clearSetupVarsArray();
 
 	// Get domains which the user doesn't want to see
-	char * excludedomains = NULL;
-	if(!audit)
-	{
-		excludedomains = read_setupVarsconf("API_EXCLUDE_DOMAINS");
-		if(excludedomains != NULL)
-		{
-			getSetupVarsArray(excludedomains);
-		}
-	}
+	const bool excludedomains = !audit && setupVars_has_list(setupVars, EXCLUDE_DOMAINS);
 
 	if(!istelnet)
 	{
@@ -275,21 +626,22 @@ void getTopDomains(const char *client_message, const int sock, const bool isteln
 		if(blocked)
 			pack_int32(sock, blocked_queries());
 		else
-			pack_int32(sock, counters->queries);
+			pack_int32(sock, total_queries());
 	}
 
 	int n = 0;
-	for(int i=0; i < counters->domains; i++)
+	rankEntry entry;
+	while(ranking_next(&rank, &entry))
 	{
 		// Get sorted index
-		const int domainID = temparray[i][0];
+		const int domainID = entry.id;
 		// Get domain pointer
 		const domainsData* domain = getDomain(domainID, true);
 		if(domain == NULL)
 			continue;
 
 		// Skip this domain if there is a filter on it
-		if(excludedomains != NULL && insetupVarsArray(getstr(domain->domainpos)))
+		if(excludedomains && setupVars_excluded(setupVars, EXCLUDE_DOMAINS, getstr(domain->domainpos)))
 			continue;
 
 		// Skip this domain if already audited
@@ -310,7 +662,7 @@ void getTopDomains(const char *client_message, const int sock, const bool isteln
 				ssend(sock, "%i %i %s\n", n, domain->blockedcount, getstr(domain->domainpos));
 			else {
 				if(!pack_str32(sock, getstr(domain->domainpos)))
-					return;
+					break;
 
 				pack_int32(sock, domain->blockedcount);
 			}
@@ -323,7 +675,7 @@ void getTopDomains(const char *client_message, const int sock, const bool isteln
 			else
 			{
 				if(!pack_str32(sock, getstr(domain->domainpos)))
-					return;
+					break;
 
 				pack_int32(sock, domain->count - domain->blockedcount);
 			}
@@ -335,16 +687,15 @@ void getTopDomains(const char *client_message, const int sock, const bool isteln
 			break;
 	}
 
-	if(excludedomains != NULL)
-		clearSetupVarsArray();
+	setupVars_put(setupVars);
 }
 
 void getTopClients(const char *client_message, const int sock, const bool istelnet)
 {
-	int temparray[counters->clients][2], count=10, num;
+	int count=10, num;
 
 	// Exit before processing any data if requested via config setting
-	get_privacy_level(NULL);
+	refresh_privacy_level();
 	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS_CLIENTS) {
 		// Always send the total number of clients, but pretend it's 0
 		if(!istelnet)
@@ -374,56 +725,41 @@ void getTopClients(const char *client_message, const int sock, const bool isteln
 	if(command(client_message, " blocked"))
 		blockedonly = true;
 
-	for(int clientID = 0; clientID < counters->clients; clientID++)
-	{
-		// Get client pointer
-		const clientsData* client = getClient(clientID, true);
-		// Skip invalid clients and also those managed by alias clients
-		if(client == NULL || (!client->flags.aliasclient && client->aliasclient_id >= 0))
-		{
-			temparray[clientID][0] = -1;
-			continue;
-		}
-		temparray[clientID][0] = clientID;
-		// Use either blocked or total count based on request string
-		temparray[clientID][1] = blockedonly ? client->blockedcount : client->count;
-	}
-
 	// Sort in ascending order?
 	// example: >top-clients asc
 	bool asc = false;
 	if(command(client_message, " asc"))
 		asc = true;
 
-	// Sort temporary array
-	if(asc)
-		qsort(temparray, counters->clients, sizeof(int[2]), cmpasc);
-	else
-		qsort(temparray, counters->clients, sizeof(int[2]), cmpdesc);
-
-	// Get clients which the user doesn't want to see
-	const char* excludeclients = read_setupVarsconf("API_EXCLUDE_CLIENTS");
-	if(excludeclients != NULL)
+	ranking rank;
+	if(!ranking_init(&rank, counters->clients, asc))
 	{
-		getSetupVarsArray(excludeclients);
+		if(!istelnet)
+			pack_int32(sock, 0);
+		return;
 	}
 
+	// Sort lazily
+	ranking_fill(&rank, counters->clients, client_rank_value, blockedonly,
+	             blockedonly ? BOARD_BLOCKED_CLIENTS : BOARD_CLIENTS);
+
+	// Get clients which the user doesn't want to see
+	struct setupVars_snapshot *setupVars = setupVars_get();
+	const bool excludeclients = setupVars_has_list(setupVars, EXCLUDE_CLIENTS);
+
 	if(!istelnet)
 	{
 		// Send the total queries so they can make percentages from this data
-		pack_int32(sock, counters->queries);
+		pack_int32(sock, total_queries());
 	}
 
 	int n = 0;
-	for(int i=0; i < counters->clients; i++)
+	rankEntry entry;
+	while(ranking_next(&rank, &entry))
 	{
 		// Get sorted indices and counter values (may be either total or blocked count)
-		const int clientID = temparray[i][0];
-		const int ccount = temparray[i][1];
-
-		// clientID -1 means this client is to be skipped (managed by a alias-client)
-		if(clientID < 0)
-			continue;
+		const int clientID = entry.id;
+		const int ccount = entry.value;
 
 		// Get client pointer
 		const clientsData* client = getClient(clientID, true);
@@ -433,8 +769,9 @@ void getTopClients(const char *client_message, const int sock, const bool isteln
 			continue;
 
 		// Skip this client if there is a filter on it
-		if(excludeclients != NULL &&
-			(insetupVarsArray(getstr(client->ippos)) || insetupVarsArray(getstr(client->namepos))))
+		if(excludeclients &&
+			(setupVars_excluded(setupVars, EXCLUDE_CLIENTS, getstr(client->ippos)) ||
+			 setupVars_excluded(setupVars, EXCLUDE_CLIENTS, getstr(client->namepos))))
 			continue;
 
 		// Hidden client, probably due to privacy level. Skip this in the top lists
@@ -455,7 +792,7 @@ void getTopClients(const char *client_message, const int sock, const bool isteln
 			else
 			{
 				if(!pack_str32(sock, "") || !pack_str32(sock, client_ip))
-					return;
+					break;
 
 				pack_int32(sock, ccount);
 			}
@@ -466,19 +803,22 @@ void getTopClients(const char *client_message, const int sock, const bool isteln
 			break;
 	}
 
-	if(excludeclients != NULL)
-		clearSetupVarsArray();
+	setupVars_put(setupVars);
 }
 
 
 void getUpstreamDestinations(const char *client_message, const int sock, const bool istelnet)
 {
 	bool sort = true;
-	int temparray[counters->upstreams][2], sumforwarded = 0;
+	int sumforwarded = 0;
 
 	if(command(client_message, "unsorted"))
 		sort = false;
 
+	ranking rank;
+	if(!ranking_init(&rank, counters->upstreams, false))
+		return;
+
 	for(int upstreamID = 0; upstreamID < counters->upstreams; upstreamID++)
 	{
 		// Get upstream pointer
@@ -486,31 +826,27 @@ void getUpstreamDestinations(const char *client_message, const int sock, const b
 		if(upstream == NULL)
 			continue;
 
-		temparray[upstreamID][0] = upstreamID;
-
-		int count = 0;
-		for(unsigned i = 0; i < (sizeof(upstream->overTime)/sizeof(*upstream->overTime)); i++)
-			count += upstream->overTime[i];
-		temparray[upstreamID][1] = count;
+		const int count = overTime_sum(&upstream->overTime);
+		ranking_add(&rank, upstreamID, count);
 		sumforwarded += count;
 	}
 
+	// Sort lazily in descending order. Unsorted output keeps the entries
+	// in the order they have been added
+	const int upstreams = rank.n;
 	if(sort)
-	{
-		// Sort temporary array in descending order
-		qsort(temparray, counters->upstreams, sizeof(int[2]), cmpdesc);
-	}
+		ranking_build(&rank);
 
 	const int cached = cached_queries();
 	const int blocked = blocked_queries();
-	const int others = counters->queries - counters->status[QUERY_FORWARDED] - cached - blocked;
+	const int others = total_queries() - counter_get(status[QUERY_FORWARDED]) - cached - blocked;
 	// The total number of DNS packets can be different than the total
 	// number of queries as FTL is periodically sending queries to multiple
 	// DNS upstream servers to probe which one is the fastest
 	const int totalqueries = sumforwarded + blocked + cached + others;
 
 	// Loop over available forward destinations
-	for(int i = -3; i < min(counters->upstreams, 8); i++)
+	for(int i = -3; i < min(upstreams, 8); i++)
 	{
 		float percentage = 0.0f;
 		const char *ip, *name;
@@ -549,8 +885,13 @@ void getUpstreamDestinations(const char *client_message, const int sock, const b
 		else
 		{
 			// Regular upstream destination
-			const int upstreamID = temparray[i][0];
-			const int count = temparray[i][1];
+			rankEntry entry;
+			if(!sort)
+				entry = rank.heap[i];
+			else if(!ranking_next(&rank, &entry))
+				break;
+			const int upstreamID = entry.id;
+			const int count = entry.value;
 
 			// Get upstream pointer
 			const upstreamsData* upstream = getUpstream(upstreamID, true);
@@ -592,12 +933,91 @@ void getUpstreamDestinations(const char *client_message, const int sock, const b
 	}
 }
 
+// Send the bins of one response time histogram
+static void send_rtime_bins(const int sock, const bool istelnet, const int hist[UPSTREAM_RTIME_BINS])
+{
+	for(unsigned int bin = 0; bin < UPSTREAM_RTIME_BINS; bin++)
+	{
+		if(istelnet)
+			ssend(sock, " %i", hist[bin]);
+		else
+			pack_int32(sock, hist[bin]);
+	}
+
+	if(istelnet)
+		ssend(sock, "\n");
+}
+
+// Response time histograms of the upstream servers. Bin 0 counts responses
+// faster than 0.1 ms, bin i responses in [2^(i-1), 2^i) * 0.1 ms, the last bin
+// everything slower
+// example: >upstream-rtime
+//   <ID> <IP>#<port> <bin 0> ... <bin 15>   (all responses in memory)
+// example: >upstream-rtime overTime
+//   <timestamp> <ID> <bin 0> ... <bin 15>   (only slots with responses)
+void getUpstreamResponseTimes(const char *client_message, const int sock, const bool istelnet)
+{
+	int hist[UPSTREAM_RTIME_BINS];
+	if(!command(client_message, " overTime"))
+	{
+		for(int upstreamID = 0; upstreamID < counters->upstreams; upstreamID++)
+		{
+			const upstreamsData* upstream = getUpstream(upstreamID, true);
+			if(upstream == NULL)
+				continue;
+
+			for(unsigned int bin = 0; bin < UPSTREAM_RTIME_BINS; bin++)
+				hist[bin] = overTime_sum(&upstream->rtime[bin]);
+
+			if(istelnet)
+				ssend(sock, "%i %s#%u", upstreamID, getstr(upstream->ippos), upstream->port);
+			else
+			{
+				pack_int32(sock, upstreamID);
+				if(!pack_str32(sock, getstr(upstream->ippos)))
+					return;
+				pack_int32(sock, upstream->port);
+			}
+			send_rtime_bins(sock, istelnet, hist);
+		}
+		return;
+	}
+
+	for(unsigned int slot = 0; slot < OVERTIME_SLOTS; slot++)
+	{
+		for(int upstreamID = 0; upstreamID < counters->upstreams; upstreamID++)
+		{
+			const upstreamsData* upstream = getUpstream(upstreamID, true);
+			if(upstream == NULL)
+				continue;
+
+			int responses = 0;
+			for(unsigned int bin = 0; bin < UPSTREAM_RTIME_BINS; bin++)
+			{
+				hist[bin] = overTime_get(&upstream->rtime[bin], slot);
+				responses += hist[bin];
+			}
+			if(responses == 0)
+				continue;
+
+			if(istelnet)
+				ssend(sock, "%lli %i", (long long)overTime[slot].timestamp, upstreamID);
+			else
+			{
+				pack_int32(sock, (int32_t)overTime[slot].timestamp);
+				pack_int32(sock, upstreamID);
+			}
+			send_rtime_bins(sock, istelnet, hist);
+		}
+	}
+}
+
 void getQueryTypes(const int sock, const bool istelnet)
 {
 	int total = 0;
 	for(enum query_types type = TYPE_A; type < TYPE_MAX; type++)
 	{
-		total += counters->querytype[type - 1];
+		total += counter_get(querytype[type - 1]);
 	}
 
 	float percentage[TYPE_MAX] = { 0.0 };
@@ -607,7 +1027,7 @@ void getQueryTypes(const int sock, const bool istelnet)
 	{
 		for(enum query_types type = TYPE_A; type < TYPE_MAX; type++)
 		{
-			percentage[type] = 1e2f*counters->querytype[type - 1]/total;
+			percentage[type] = 1e2f*counter_get(querytype[type - 1])/total;
 		}
 	}
 
@@ -657,36 +1077,508 @@ void getQueryTypes(const int sock, const bool istelnet)
 	}
 }
 
-void getAllQueries(const char *client_message, const int sock, const bool istelnet)
+// Send the details of a single query as one line of the query log. Returns
+// -1 on errors, 0 if the query has been skipped and 1 if it has been sent
+// A line of the query log. Queries still in memory are sent by sendQuery(),
+// those only found in the database by send_db_query()
+struct query_line {
+	time_t timestamp;
+	const char *qtype;
+	const char *domain;
+	const char *client;
+	int status;
+	int dnssec;
+	int reply;
+	unsigned long delay;
+	const char *cname_domain;
+	int domainlist_id;
+	const char *upstream;
+	unsigned int upstream_port;
+	const char *ede;
+};
+
+// String table of a dictionary-encoded query log in MessagePack mode, e.g.
+// >getallqueries (1000) dict. Each distinct qtype, domain and client string
+// is sent as str32 the first time it is used and afterwards as the index
+// (counting from zero in the order the strings were sent) in the smallest
+// unsigned integer encoding. The table spans the entire response
+static __thread struct {
+	bool active;
+	uint32_t count;
+	uint32_t size;
+	struct dict_entry {
+		char *string;
+		uint32_t hash;
+		uint32_t index;
+	} *entries;
+} query_dict = { false, 0u, 0u, NULL };
+
+// The option has to be a separate word following the command
+void query_dict_begin(const char *client_message, const bool istelnet)
 {
-	// Exit before processing any data if requested via config setting
-	get_privacy_level(NULL);
-	if(config.privacylevel >= PRIVACY_MAXIMUM)
-		return;
+	const char *option = strchr(client_message, ' ');
+	while(option != NULL && (option = strstr(option, " dict")) != NULL)
+	{
+		const char next = option[5];
+		if(next == '\0' || next == ' ' || next == '\r' || next == '\n')
+			break;
+		option += 5;
+	}
+	query_dict.active = !istelnet && option != NULL;
+}
 
-	// Do we want a more specific version of this command (domain/client/time interval filtered)?
-	int from = 0, until = 0;
+void query_dict_end(void)
+{
+	if(query_dict.count > 0u)
+	{
+		for(uint32_t i = 0; i < query_dict.size; i++)
+		{
+			free(query_dict.entries[i].string);
+			query_dict.entries[i].string = NULL;
+		}
+	}
+	query_dict.count = 0u;
+	query_dict.active = false;
+}
 
-	bool showpermitted = true, showblocked = true;
+// Needs a table with free slots
+static struct dict_entry * __attribute__((pure)) dict_slot(const char *string, const uint32_t hash)
+{
+	const uint32_t mask = query_dict.size - 1u;
+	for(uint32_t i = hash & mask; ; i = (i + 1u) & mask)
+	{
+		struct dict_entry *entry = &query_dict.entries[i];
+		if(entry->string == NULL ||
+		   (entry->hash == hash && strcmp(entry->string, string) == 0))
+			return entry;
+	}
+}
 
-	char *domainname = NULL;
-	bool filterdomainname = false;
-	int domainid = -1;
+// Double the size of the table when it is half full
+static bool dict_grow(void)
+{
+	if(2u*(query_dict.count + 1u) <= query_dict.size)
+		return true;
 
-	char *clientname = NULL;
-	bool filterclientname = false;
-	int clientid = -1;
-	int *clientid_list = NULL;
+	const uint32_t oldsize = query_dict.size;
+	struct dict_entry *old = query_dict.entries;
+	const uint32_t size = oldsize > 0u ? 2u*oldsize : 1024u;
+	struct dict_entry *entries = calloc(size, sizeof(*entries));
+	if(entries == NULL)
+		return false;
 
-	unsigned char querytype = 0;
+	query_dict.entries = entries;
+	query_dict.size = size;
+	for(uint32_t i = 0; i < oldsize; i++)
+		if(old[i].string != NULL)
+			*dict_slot(old[i].string, old[i].hash) = old[i];
+	free(old);
+	return true;
+}
 
-	char *forwarddest = NULL;
+static bool pack_dict_str(const int sock, const char *string)
+{
+	if(!dict_grow())
+		return false;
+
+	const uint32_t hash = hashStr(string);
+	struct dict_entry *entry = dict_slot(string, hash);
+	if(entry->string != NULL)
+	{
+		pack_uint(sock, entry->index);
+		return true;
+	}
+
+	if((entry->string = strdup(string)) == NULL)
+		return false;
+	entry->hash = hash;
+	entry->index = query_dict.count++;
+	return pack_str32(sock, string);
+}
+
+static int send_query_line(const int sock, const bool istelnet, const struct query_line *line, const int queryID)
+{
+	if(istelnet)
+	{
+		ssend(sock,"%lli %s %s %s %i %i %i %lu %s %i %s#%u \"%s\"",
+			(long long)line->timestamp,
+			line->qtype,
+			line->domain,
+			line->client,
+			line->status,
+			line->dnssec,
+			line->reply,
+			line->delay,
+			line->cname_domain,
+			line->domainlist_id,
+			line->upstream,
+			line->upstream_port,
+			line->ede);
+
+		if(config.debug & DEBUG_API && queryID >= 0)
+			ssend(sock, " \"%i\"", queryID);
+		ssend(sock, "\n");
+	}
+	else
+	{
+		pack_int32(sock, (int32_t)line->timestamp);
+
+		if(query_dict.active)
+		{
+			if(!pack_dict_str(sock, line->qtype) ||
+			   !pack_dict_str(sock, line->domain) ||
+			   !pack_dict_str(sock, line->client))
+				return -1;
+			pack_uint8(sock, line->status);
+			pack_uint8(sock, line->dnssec);
+			return 1;
+		}
+
+		// Use a fixstr because the length of qtype is always 4 (max is 31 for fixstr)
+		if(!pack_fixstr(sock, line->qtype))
+			return -1;
+
+		// Use str32 for domain and client because we have no idea how long they will be (max is 4294967295 for str32)
+		if(!pack_str32(sock, line->domain) || !pack_str32(sock, line->client))
+			return -1;
+
+		pack_uint8(sock, line->status);
+		pack_uint8(sock, line->dnssec);
+	}
+
+	return 1;
+}
+
+int sendQuery(const int sock, const bool istelnet, const int queryID)
+{
+	const queriesData* query = getQuery(queryID, true);
+	// Check if this query has been create while in maximum privacy mode
+	if(query == NULL || query->privacylevel >= PRIVACY_MAXIMUM || query->type >= TYPE_MAX)
+		return 0;
+
+	// Get query type
+	const char *qtype = querytypes[query->type];
+	char othertype[12] = { 0 }; // Maximum is "TYPE65535" = 10 bytes
+	if(query->type == TYPE_OTHER)
+	{
+		// Check the dnsmasq RR types table for a matching record
+		qtype = querystr((char*)"", query->qtype);
+
+		// If not known (querystr() returned "type=1234"), we replace this
+		if(!qtype || strstr(qtype, "type=") != NULL)
+		{
+			// Format custom type into buffer
+			sprintf(othertype, "TYPE%u", query->qtype);
+			// Replace qtype pointer
+			qtype = othertype;
+		}
+	}
+
+	// Ask subroutine for domain. It may return "hidden" depending on
+	// the privacy settings at the time the query was made
+	const char *domain = getDomainString(query);
+
+	// Similarly for the client
+	const char *clientIPName = NULL;
+	// Get client pointer
+	const clientsData* client = getClient(query->clientID, true);
+	if(domain == NULL || client == NULL)
+		return 0;
+
+	if(strlen(getstr(client->namepos)) > 0)
+		clientIPName = getClientNameString(query);
+	else
+		clientIPName = getClientIPString(query);
+
+	unsigned long delay = query->flags.response_calculated ? query->response : 0UL;
+
+	// Get domain blocked during deep CNAME inspection, if applicable
+	const char *CNAME_domain = "N/A";
+	if(query->CNAME_domainID > -1)
+	{
+		CNAME_domain = getCNAMEDomainString(query);
+	}
+
+	// Get domainlist table ID, if applicable and permitted by privacy settings
+	int domainlist_id = -1;
+	if (config.privacylevel < PRIVACY_HIDE_DOMAINS)
+	{
+		unsigned int cacheID = findCacheID(query->domainID, query->clientID, query->type, false);
+		DNSCacheData *dns_cache = getDNSCache(cacheID, true);
+		if(dns_cache != NULL)
+			domainlist_id = dns_cache->domainlist_id;
+	}
+
+	// Get IP of upstream destination, if applicable
+	in_port_t upstream_port = 0;
+	const char *upstream_name = "N/A";
+	if(query->upstreamID > -1)
+	{
+		const upstreamsData *upstream = getUpstream(query->upstreamID, true);
+		if(upstream != NULL)
+		{
+			if(upstream->namepos != 0)
+				// Get upstream destination name if possible
+				upstream_name = getstr(upstream->namepos);
+			else
+				// If we have no name, get the IP address
+				upstream_name = getstr(upstream->ippos);
+
+			upstream_port = upstream->port;
+		}
+	}
+
+	// Get reply type
+	// If this is a partially cached CNAME (parts needed to be
+	// forwarded) but we never receive replies, we have to set the
+	// reply back to unknown instead of handing out "CNAME"
+	// See https://discourse.pi-hole.net/t/garbage-response-times-for-many-almost-half-at-times-cname-answers/50291/17
+	enum reply_type reply = query->flags.response_calculated ? query->reply : REPLY_UNKNOWN;
+
+	// Overwrite reply and reply time if they don't make sense for this query
+	// See same Discourse discussion as immediately above
+	if(query->status == QUERY_RETRIED || query->status == QUERY_IN_PROGRESS)
+	{
+		reply = REPLY_UNKNOWN;
+		delay = 0UL;
+	}
+
+	const struct query_line line = {
+		.timestamp = query->timestamp,
+		.qtype = qtype,
+		.domain = domain,
+		.client = clientIPName,
+		.status = query->status,
+		.dnssec = query->dnssec,
+		.reply = reply,
+		.delay = delay,
+		.cname_domain = CNAME_domain,
+		.domainlist_id = domainlist_id,
+		.upstream = upstream_name,
+		.upstream_port = upstream_port,
+		.ede = query->ede == -1 ? "" : get_edestr(query->ede)
+	};
+
+	return send_query_line(sock, istelnet, &line, queryID);
+}
+
+// IDs of the queries matching a domain or client filter. The memory is reused
+// by all requests of an API thread
+static __thread int *query_list = NULL;
+static __thread size_t query_list_size = 0u;
+
+// Walk the query list of a domain or client (see link_query()) from the most
+// recent query backwards and append the IDs within [first, end) to query_list.
+// Returns false on memory errors
+static bool collect_queries(unsigned int seq, const bool domain, const int first, const int end, int *n)
+{
+	int last = counters->queries;
+	for(int queryID = seq_queryID(seq); queryID >= first && queryID < last; queryID = seq_queryID(seq))
+	{
+		const queriesData* query = getQuery(queryID, true);
+		if(query == NULL)
+			break;
+
+		if(queryID < end)
+		{
+			if((size_t)*n >= query_list_size)
+			{
+				const size_t size = query_list_size > 0 ? 2*query_list_size : 1024u;
+				int *list = realloc(query_list, size*sizeof(int));
+				if(list == NULL)
+					return false;
+				query_list = list;
+				query_list_size = size;
+			}
+			query_list[(*n)++] = queryID;
+		}
+
+		// Lists are strictly decreasing, this also stops at removed queries
+		last = queryID;
+		seq = domain ? query->prev_domain_query : query->prev_client_query;
+	}
+
+	return true;
+}
+
+static int cmpqueryid(const void *a, const void *b)
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+// Queries are stored in the order they arrived, find the first query with a
+// timestamp after (or at, unless after is set) the given one
+static int find_query_time(const time_t timestamp, const bool after)
+{
+	int lo = 0, hi = counters->queries;
+	while(lo < hi)
+	{
+		const int mid = lo + (hi - lo)/2;
+		const queriesData* query = getQuery(mid, true);
+		if(query != NULL && (after ? (time_t)query->timestamp <= timestamp : (time_t)query->timestamp < timestamp))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Get the filter of the query log set in setupVars.conf
+static void get_query_log_filter(bool *showpermitted, bool *showblocked)
+{
+	struct setupVars_snapshot *setupVars = setupVars_get();
+	const char *filter = setupVars_value(setupVars, "API_QUERY_LOG_SHOW");
+	if(filter != NULL)
+	{
+		if((strcmp(filter, "permittedonly")) == 0)
+			*showblocked = false;
+		else if((strcmp(filter, "blockedonly")) == 0)
+			*showpermitted = false;
+		else if((strcmp(filter, "nothing")) == 0)
+		{
+			*showpermitted = false;
+			*showblocked = false;
+		}
+	}
+	setupVars_put(setupVars);
+}
+
+struct old_queries_request {
+	int sock;
+	bool istelnet;
+	bool showpermitted;
+	bool showblocked;
+};
+
+// Send a query read from the database in the same format as sendQuery()
+static bool send_db_query(const struct db_query *query, void *arg)
+{
+	const struct old_queries_request *req = arg;
+
+	// Skip queries hidden by the query log filter
+	const bool blocked = query->status >= 0 && query->status < QUERY_STATUS_MAX &&
+	                     is_blocked((enum query_status)query->status);
+	if((blocked && !req->showblocked) || (!blocked && !req->showpermitted))
+		return true;
+
+	// Mapped query types are stored as they are, others with an offset
+	// of 100 (see DB_save_queries())
+	const char *qtype = NULL;
+	char othertype[12] = { 0 }; // Maximum is "TYPE65535" = 10 bytes
+	if(query->type >= TYPE_A && query->type < TYPE_MAX && query->type != TYPE_OTHER)
+		qtype = querytypes[query->type];
+	else if(query->type > 100 && query->type < 100 + UINT16_MAX)
+	{
+		// Check the dnsmasq RR types table for a matching record
+		qtype = querystr((char*)"", query->type - 100);
+		if(!qtype || strstr(qtype, "type=") != NULL)
+		{
+			sprintf(othertype, "TYPE%u", query->type - 100);
+			qtype = othertype;
+		}
+	}
+	else
+		return true;
+
+	// Split upstream destination into address and port
+	char upstream[INET6_ADDRSTRLEN + 1] = "N/A";
+	unsigned int upstream_port = 0;
+	if(query->forward != NULL)
+	{
+		upstream_port = 53;
+		sscanf(query->forward, "%"xstr(INET6_ADDRSTRLEN)"[^#]#%u", upstream, &upstream_port);
+	}
+
+	// Same as in sendQuery(): no reply (time) for queries still waiting
+	// for it or being retried
+	const bool replied = query->reply_time >= 0.0 &&
+	                     query->status != QUERY_RETRIED && query->status != QUERY_IN_PROGRESS;
+
+	const struct query_line line = {
+		.timestamp = query->timestamp,
+		.qtype = qtype,
+		.domain = query->domain,
+		.client = query->client,
+		.status = query->status,
+		.dnssec = query->dnssec,
+		.reply = replied ? query->reply_type : REPLY_UNKNOWN,
+		.delay = replied ? (unsigned long)(query->reply_time * 1e4) : 0UL,
+		.cname_domain = query->cname_domain != NULL ? query->cname_domain : "N/A",
+		.domainlist_id = config.privacylevel < PRIVACY_HIDE_DOMAINS ? query->domainlist_id : -1,
+		.upstream = upstream,
+		.upstream_port = upstream_port,
+		.ede = ""
+	};
+
+	return send_query_line(req->sock, req->istelnet, &line, -1) >= 0;
+}
+
+// Queries evicted from memory because of QUERY_MEMORY_LIMIT are sent from
+// the database for >getallqueries-time. Queries from since on have already
+// been sent. Returns the timestamp from which on queries are still in
+// memory, getAllQueries() continues from there
+time_t getOldQueries(const char *client_message, const int sock, const bool istelnet, const time_t since)
+{
+	if(max_queries_in_memory <= 0)
+		return since;
+
+	// Exit before processing any data if requested via config setting
+	refresh_privacy_level();
+	if(config.privacylevel >= PRIVACY_MAXIMUM)
+		return since;
+
+	// Only the plain time interval is answered from the database, the
+	// most recent or paged queries are in memory anyway
+	int from = 0, until = 0;
+	if(sscanf(client_message, ">getallqueries-time %i %i", &from, &until) < 1 || from == 0 ||
+	   strchr(client_message, '(') != NULL || strstr(client_message, " page ") != NULL)
+		return since;
+
+	const time_t kept_since = queries_kept_since();
+	if(from >= kept_since || since >= kept_since)
+		return kept_since;
+
+	struct old_queries_request req = { .sock = sock, .istelnet = istelnet, .showpermitted = true, .showblocked = true };
+	get_query_log_filter(&req.showpermitted, &req.showblocked);
+	if(req.showpermitted || req.showblocked)
+		DB_read_old_queries(MAX((time_t)from, since), until, kept_since, send_db_query, &req);
+
+	return kept_since;
+}
+
+void getAllQueries(const char *client_message, const int sock, const bool istelnet, const time_t since)
+{
+	// Exit before processing any data if requested via config setting
+	refresh_privacy_level();
+	if(config.privacylevel >= PRIVACY_MAXIMUM)
+		return;
+
+	// Do we want a more specific version of this command (domain/client/time interval filtered)?
+	int from = 0, until = 0;
+
+	bool showpermitted = true, showblocked = true;
+
+	char *domainname = NULL;
+	bool filterdomainname = false;
+	int domainid = -1;
+
+	char *clientname = NULL;
+	bool filterclientname = false;
+	int clientid = -1;
+	int *clientid_list = NULL;
+
+	unsigned char querytype = 0;
+
+	char *forwarddest = NULL;
 	bool filterforwarddest = false;
 	int forwarddestid = 0;
 
-	// Time filtering?
+	// Time filtering? Queries before since have been sent from the
+	// database already (see getOldQueries())
 	if(command(client_message, ">getallqueries-time")) {
 		sscanf(client_message, ">getallqueries-time %i %i",&from, &until);
+		if(from != 0 && since > from)
+			from = since;
 	}
 
 	// Query type filtering?
@@ -863,24 +1755,95 @@ void getAllQueries(const char *client_message, const int sock, const bool isteln
 			ibeg = 0;
 	}
 
+	// Return the queries in pages of the requested size?
+	// example: >getallqueries page 1000 cursor 1f4
+	// The cursor returned at the end of a page is the sequence number of
+	// the first query not looked at (see query_seq()). It stays valid when
+	// older queries are removed, pages continue with the oldest query still
+	// in memory if the cursor's query is gone
+	int pagesize = 0;
+	const char *page = strstr(client_message, " page ");
+	if(page != NULL && sscanf(page, " page %i", &pagesize) == 1 && pagesize > 0)
+	{
+		unsigned int cursor = 0;
+		const char *cursorstr = strstr(client_message, " cursor ");
+		if(cursorstr != NULL && sscanf(cursorstr, " cursor %x", &cursor) == 1)
+		{
+			const int start = (int)(cursor - query_seq(0));
+			if(start > counters->queries)
+				ibeg = counters->queries;
+			else if(start > ibeg)
+				ibeg = start;
+		}
+	}
+	else
+		pagesize = 0;
+
 	// Get potentially existing filtering flags
-	char * filter = read_setupVarsconf("API_QUERY_LOG_SHOW");
-	if(filter != NULL)
+	get_query_log_filter(&showpermitted, &showblocked);
+
+	// Limit the range of queries to the requested time interval
+	int iend = counters->queries;
+	if(from != 0)
+		ibeg = MAX(ibeg, find_query_time(from, false));
+	if(until != 0)
+		iend = find_query_time(until, true);
+
+	// Use the query lists of the requested domain or client(s) instead of
+	// looking at all queries. Queries matching only via a CNAME domain are
+	// not part of these lists, a full scan is needed for such domains
+	int nlist = -1;
+	bool sorted = false;
+	const domainsData* filter_domain = filterdomainname ? getDomain(domainid, true) : NULL;
+	if(filter_domain != NULL && !filter_domain->cname_blocked)
 	{
-		if((strcmp(filter, "permittedonly")) == 0)
-			showblocked = false;
-		else if((strcmp(filter, "blockedonly")) == 0)
-			showpermitted = false;
-		else if((strcmp(filter, "nothing")) == 0)
+		nlist = 0;
+		if(!collect_queries(filter_domain->last_query, true, ibeg, iend, &nlist))
+			nlist = -1;
+	}
+	else if(filterclientname)
+	{
+		bool success = true;
+		nlist = 0;
+		if(clientid_list != NULL)
 		{
-			showpermitted = false;
-			showblocked = false;
+			// Merge the lists of all clients managed by this alias-client
+			for(int i = 0; i < clientid_list[0] && success; i++)
+			{
+				const clientsData* client = getClient(clientid_list[i + 1], true);
+				if(client != NULL)
+					success = collect_queries(client->last_query, false, ibeg, iend, &nlist);
+			}
+			qsort(query_list, nlist, sizeof(int), cmpqueryid);
+			sorted = true;
+		}
+		else
+		{
+			const clientsData* client = getClient(clientid, true);
+			if(client != NULL)
+				success = collect_queries(client->last_query, false, ibeg, iend, &nlist);
+		}
+		if(!success)
+			nlist = -1;
+	}
+
+	// Lists are collected from the most recent query backwards
+	if(nlist > 0 && !sorted)
+	{
+		for(int i = 0, j = nlist - 1; i < j; i++, j--)
+		{
+			const int tmp = query_list[i];
+			query_list[i] = query_list[j];
+			query_list[j] = tmp;
 		}
 	}
-	clearSetupVarsArray();
 
-	for(int queryID = ibeg; queryID < counters->queries; queryID++)
+	const int iquery = nlist > -1 ? 0 : ibeg;
+	const int nquery = nlist > -1 ? nlist : iend;
+	int sent = 0, next = MAX(ibeg, iend);
+	for(int idx = iquery; idx < nquery; idx++)
 	{
+		const int queryID = nlist > -1 ? query_list[idx] : idx;
 		const queriesData* query = getQuery(queryID, true);
 		// Check if this query has been create while in maximum privacy mode
 		if(query == NULL || query->privacylevel >= PRIVACY_MAXIMUM)
@@ -889,24 +1852,6 @@ void getAllQueries(const char *client_message, const int sock, const bool isteln
 		// Verify query type
 		if(query->type >= TYPE_MAX)
 			continue;
-		// Get query type
-		const char *qtype = querytypes[query->type];
-		char othertype[12] = { 0 }; // Maximum is "TYPE65535" = 10 bytes
-		if(query->type == TYPE_OTHER)
-		{
-			// Check the dnsmasq RR types table for a matching record
-			qtype = querystr((char*)"", query->qtype);
-
-			// If not known (querystr() returned "type=1234"), we replace this
-			if(!qtype || strstr(qtype, "type=") != NULL)
-			{
-				// Format custom type into buffer
-				sprintf(othertype, "TYPE%u", query->qtype);
-				// Replace qtype pointer
-				qtype = othertype;
-			}
-		}
-
 		// Hide UNKNOWN queries when not requesting both query status types
 		if(query->status == QUERY_UNKNOWN && !(showpermitted && showblocked))
 			continue;
@@ -920,7 +1865,7 @@ void getAllQueries(const char *client_message, const int sock, const bool isteln
 			continue;
 
 		// Skip those entries which so not meet the requested timeframe
-		if((from > query->timestamp && from != 0) || (query->timestamp > until && until != 0))
+		if((from > (time_t)query->timestamp && from != 0) || ((time_t)query->timestamp > until && until != 0))
 			continue;
 
 		// Skip if domain is not identical with what the user wants to see
@@ -983,111 +1928,27 @@ void getAllQueries(const char *client_message, const int sock, const bool isteln
 				continue;
 		}
 
-		// Ask subroutine for domain. It may return "hidden" depending on
-		// the privacy settings at the time the query was made
-		const char *domain = getDomainString(query);
-
-		// Similarly for the client
-		const char *clientIPName = NULL;
-		// Get client pointer
-		const clientsData* client = getClient(query->clientID, true);
-		if(domain == NULL || client == NULL)
+		const int rc = sendQuery(sock, istelnet, queryID);
+		if(rc < 0)
+			break;
+		else if(rc == 0)
 			continue;
 
-		if(strlen(getstr(client->namepos)) > 0)
-			clientIPName = getClientNameString(query);
-		else
-			clientIPName = getClientIPString(query);
-
-		unsigned long delay = query->flags.response_calculated ? query->response : 0UL;
-
-		// Get domain blocked during deep CNAME inspection, if applicable
-		const char *CNAME_domain = "N/A";
-		if(query->CNAME_domainID > -1)
-		{
-			CNAME_domain = getCNAMEDomainString(query);
-		}
-
-		// Get domainlist table ID, if applicable and permitted by privacy settings
-		int domainlist_id = -1;
-		if (config.privacylevel < PRIVACY_HIDE_DOMAINS)
-		{
-			unsigned int cacheID = findCacheID(query->domainID, query->clientID, query->type, false);
-			DNSCacheData *dns_cache = getDNSCache(cacheID, true);
-			if(dns_cache != NULL)
-				domainlist_id = dns_cache->domainlist_id;
-		}
-
-		// Get IP of upstream destination, if applicable
-		in_port_t upstream_port = 0;
-		const char *upstream_name = "N/A";
-		if(query->upstreamID > -1)
-		{
-			const upstreamsData *upstream = getUpstream(query->upstreamID, true);
-			if(upstream != NULL)
-			{
-				if(upstream->namepos != 0)
-					// Get upstream destination name if possible
-					upstream_name = getstr(upstream->namepos);
-				else
-					// If we have no name, get the IP address
-					upstream_name = getstr(upstream->ippos);
-
-				upstream_port = upstream->port;
-			}
-		}
-
-		// Get reply type
-		// If this is a partially cached CNAME (parts needed to be
-		// forwarded) but we never receive replies, we have to set the
-		// reply back to unknown instead of handing out "CNAME"
-		// See https://discourse.pi-hole.net/t/garbage-response-times-for-many-almost-half-at-times-cname-answers/50291/17
-		enum reply_type reply = query->flags.response_calculated ? query->reply : REPLY_UNKNOWN;
-
-		// Overwrite reply and reply time if they don't make sense for this query
-		// See same Discourse discussion as immediately above
-		if(query->status == QUERY_RETRIED || query->status == QUERY_IN_PROGRESS)
+		// Stop when the page is full
+		if(pagesize > 0 && ++sent >= pagesize)
 		{
-			reply = REPLY_UNKNOWN;
-			delay = 0UL;
+			next = queryID + 1;
+			break;
 		}
+	}
 
+	// Send the cursor for the next page
+	if(pagesize > 0)
+	{
 		if(istelnet)
-		{
-			ssend(sock,"%lli %s %s %s %i %i %i %lu %s %i %s#%u \"%s\"",
-				(long long)query->timestamp,
-				qtype,
-				domain,
-				clientIPName,
-				query->status,
-				query->dnssec,
-				reply,
-				delay,
-				CNAME_domain,
-				domainlist_id,
-				upstream_name,
-				upstream_port,
-				query->ede == -1 ? "" : get_edestr(query->ede));
-
-			if(config.debug & DEBUG_API)
-				ssend(sock, " \"%i\"", queryID);
-			ssend(sock, "\n");
-		}
+			ssend(sock, "cursor %x\n", query_seq(next));
 		else
-		{
-			pack_int32(sock, (int32_t)query->timestamp);
-
-			// Use a fixstr because the length of qtype is always 4 (max is 31 for fixstr)
-			if(!pack_fixstr(sock, qtype))
-				break;
-
-			// Use str32 for domain and client because we have no idea how long they will be (max is 4294967295 for str32)
-			if(!pack_str32(sock, domain) || !pack_str32(sock, clientIPName))
-				break;
-
-			pack_uint8(sock, query->status);
-			pack_uint8(sock, query->dnssec);
-		}
+			pack_uint64(sock, query_seq(next));
 	}
 
 	// Free allocated memory
@@ -1104,6 +1965,25 @@ void getAllQueries(const char *client_message, const int sock, const bool isteln
 		free(clientid_list);
 }
 
+// Send a recently blocked query, returns false if the client is gone
+static bool send_recent_blocked(const queriesData *query, const int sock, const bool istelnet, int *found)
+{
+	// Ask subroutine for domain. It may return "hidden" depending on
+	// the privacy settings at the time the query was made
+	const char *domain = getDomainString(query);
+	if(domain == NULL)
+		return true;
+
+	if(istelnet)
+		ssend(sock,"%s\n", domain);
+	else if(!pack_str32(sock, domain))
+		return false;
+
+	// Only count when sent successfully
+	(*found)++;
+	return true;
+}
+
 void getRecentBlocked(const char *client_message, const int sock, const bool istelnet)
 {
 	int num=1;
@@ -1115,30 +1995,42 @@ void getRecentBlocked(const char *client_message, const int sock, const bool ist
 			num = 0;
 	}
 
-	// Find most recently blocked query
+	// The most recently blocked queries are remembered when they are
+	// blocked, walk this ring backwards instead of all queries
 	int found = 0;
-	for(int queryID = counters->queries - 1; queryID > 0 ; queryID--)
+	if(num > 0 && num <= RECENT_BLOCKED)
 	{
-		const queriesData* query = getQuery(queryID, true);
-		if(query == NULL)
-			continue;
-
-		if(query->flags.blocked)
+		const unsigned int next = query_counters->recent_blocked_next;
+		const unsigned int stored = min(next, (unsigned int)RECENT_BLOCKED);
+		for(unsigned int i = 1; i <= stored && found < num; i++)
 		{
-			// Ask subroutine for domain. It may return "hidden" depending on
-			// the privacy settings at the time the query was made
-			const char *domain = getDomainString(query);
-			if(domain == NULL)
+			const unsigned int seq = query_counters->recent_blocked[(next - i) % RECENT_BLOCKED];
+			const int queryID = seq_queryID(seq);
+			// Stop at the first query which has been removed, all
+			// older ones have been removed as well
+			if(queryID < 0)
+				break;
+
+			const queriesData* query = getQuery(queryID, true);
+			if(query == NULL || !query->flags.blocked)
 				continue;
 
-			if(istelnet)
-				ssend(sock,"%s\n", domain);
-			else if(!pack_str32(sock, domain))
+			if(!send_recent_blocked(query, sock, istelnet, &found))
 				return;
-
-			// Only count when sent successfully
-			found++;
 		}
+		return;
+	}
+
+	// Find most recently blocked query
+	for(int queryID = counters->queries - 1; queryID > 0 ; queryID--)
+	{
+		const queriesData* query = getQuery(queryID, true);
+		if(query == NULL)
+			continue;
+
+		if(query->flags.blocked &&
+		   !send_recent_blocked(query, sock, istelnet, &found))
+			return;
 
 		if(found >= num)
 			break;
@@ -1214,41 +2106,1072 @@ void getDBstats(const int sock, const bool istelnet)
 		if(!pack_str32(sock, (char *) get_sqlite3_version()))
 			return;
 	}
-}
 
-void getClientsOverTime(const int sock, const bool istelnet)
+	// Bloom filters of the exact lists
+	const char *filtername[] = { "gravity", "blacklist", "whitelist" };
+	const enum gravity_tables filterlist[] = { GRAVITY_TABLE, EXACT_BLACKLIST_TABLE, EXACT_WHITELIST_TABLE };
+	for(unsigned int i = 0; i < sizeof(filterlist)/sizeof(filterlist[0]); i++)
+	{
+		const struct bloom_filter *filter = gravityDB_get_filter(filterlist[i]);
+		const size_t memory = bloom_memory(filter);
+		const double fp_rate = 100.0*bloom_fp_rate(filter);
+		const size_t entries = filter != NULL ? filter->entries : 0u;
+		const unsigned long rejected = filter != NULL ? filter->rejected : 0u;
+		const unsigned long false_positives = filter != NULL ? filter->false_positives : 0u;
+
+		if(istelnet)
+		{
+			format_memory_size(prefix, memory, &formatted);
+			ssend(sock, "%s filter: %zu domains, %.2f %sB, false-positive rate %.3f%% (rejected %lu, false positives %lu)\n",
+			      filtername[i], entries, formatted, prefix, fp_rate, rejected, false_positives);
+		}
+		else
+		{
+			pack_uint64(sock, entries);
+			pack_uint64(sock, memory);
+			pack_float(sock, fp_rate);
+			pack_uint64(sock, rejected);
+			pack_uint64(sock, false_positives);
+		}
+	}
+
+	// Memory used by SQLite3 and its page cache
+	struct sqlite3_memory mem;
+	get_sqlite3_memory(&mem);
+	if(istelnet)
+	{
+		char prefix_peak[2] = { 0 };
+		double formatted_peak = 0.0;
+		format_memory_size(prefix, mem.used, &formatted);
+		format_memory_size(prefix_peak, mem.used_peak, &formatted_peak);
+		ssend(sock, "SQLite memory: %.2f %sB (peak %.2f %sB)\n",
+		      formatted, prefix, formatted_peak, prefix_peak);
+		format_memory_size(prefix, mem.overflow, &formatted);
+		format_memory_size(prefix_peak, mem.overflow_peak, &formatted_peak);
+		ssend(sock, "SQLite page cache: %lld of %lld arena slots used (peak %lld), %.2f %sB on the heap (peak %.2f %sB)\n",
+		      (long long)mem.pagecache, (long long)mem.slots, (long long)mem.pagecache_peak,
+		      formatted, prefix, formatted_peak, prefix_peak);
+	}
+	else
+	{
+		pack_int64(sock, mem.used);
+		pack_int64(sock, mem.used_peak);
+		pack_int64(sock, mem.slots);
+		pack_int64(sock, mem.pagecache);
+		pack_int64(sock, mem.pagecache_peak);
+		pack_int64(sock, mem.overflow);
+		pack_int64(sock, mem.overflow_peak);
+	}
+
+	// Time spent in database maintenance
+	struct db_maintenance_stats maint;
+	get_db_maintenance_stats(&maint);
+	if(istelnet)
+	{
+		ssend(sock, "Database maintenance: %lu rounds in %lu slices, %.1f ms total (longest slice %.1f ms), %lld pages vacuumed, %lld frames checkpointed, %lu times analyzed, last round %lld\n",
+		      maint.rounds, maint.slices, maint.total_ms, maint.max_ms,
+		      maint.vacuumed, maint.checkpointed, maint.analyzed, (long long)maint.last_round);
+	}
+	else
+	{
+		pack_int64(sock, maint.rounds);
+		pack_int64(sock, maint.slices);
+		pack_float(sock, maint.total_ms);
+		pack_float(sock, maint.max_ms);
+		pack_int64(sock, maint.vacuumed);
+		pack_int64(sock, maint.checkpointed);
+		pack_int64(sock, maint.analyzed);
+		pack_int64(sock, maint.last_round);
+	}
+}
+
+void getStringsInfo(const int sock, const bool istelnet)
+{
+	size_t used = 0, allocated = 0, last_freed = 0, total_freed = 0;
+	get_strings_usage(&used, &allocated, &last_freed, &total_freed);
+
+	if(istelnet)
+		ssend(sock, "strings: %i\nbytes used: %zu\nbytes allocated: %zu\nlast compaction freed: %zu\ntotal compaction freed: %zu\n",
+		             counters->strings, used, allocated, last_freed, total_freed);
+	else {
+		pack_int32(sock, counters->strings);
+		pack_uint64(sock, used);
+		pack_uint64(sock, allocated);
+		pack_uint64(sock, last_freed);
+		pack_uint64(sock, total_freed);
+	}
+}
+
+void getShmemInfo(const int sock, const bool istelnet)
+{
+	unsigned int resizes = 0, remaps = 0;
+	size_t allocated = 0;
+	get_shm_usage(&resizes, &remaps, &allocated);
+
+	if(istelnet)
+		ssend(sock, "resizes: %u\nremaps: %u\nbytes allocated: %zu\n",
+		             resizes, remaps, allocated);
+	else {
+		pack_uint64(sock, resizes);
+		pack_uint64(sock, remaps);
+		pack_uint64(sock, allocated);
+	}
+}
+
+void getShmemUsage(const int sock, const bool istelnet)
+{
+	struct shm_object_usage usage[SHM_USAGE_OBJECTS];
+	get_shm_breakdown(usage);
+	for(unsigned int i = 0; i < SHM_USAGE_OBJECTS; i++)
+	{
+		const char *name = get_shm_usage_name(i);
+		if(istelnet)
+		{
+			// <object> <entries> <capacity> <bytes used> <bytes allocated>
+			ssend(sock, "%s %u %u %zu %zu\n", name, usage[i].entries,
+			      usage[i].capacity, usage[i].used, usage[i].allocated);
+		}
+		else
+		{
+			if(!pack_str32(sock, name))
+				return;
+			pack_uint64(sock, usage[i].entries);
+			pack_uint64(sock, usage[i].capacity);
+			pack_uint64(sock, usage[i].used);
+			pack_uint64(sock, usage[i].allocated);
+		}
+	}
+
+	unsigned int resizes = 0, remaps = 0;
+	size_t allocated = 0;
+	get_shm_usage(&resizes, &remaps, &allocated);
+	if(istelnet)
+		ssend(sock, "remaps: %u\n", remaps);
+	else
+		pack_uint64(sock, remaps);
+
+	// Segments which have been resized
+	const SharedMemory *shm = NULL;
+	for(unsigned int i = 0; (shm = get_shm_object(i)) != NULL; i++)
+	{
+		get_shm_object_usage(i, &resizes, &remaps);
+		if(shm->name == NULL || resizes == 0)
+			continue;
+		if(istelnet)
+		{
+			// <segment> <resizes> <remaps>
+			ssend(sock, "%s %u %u\n", shm->name, resizes, remaps);
+		}
+		else
+		{
+			if(!pack_str32(sock, shm->name))
+				return;
+			pack_uint64(sock, resizes);
+			pack_uint64(sock, remaps);
+		}
+	}
+}
+
+void getRegexStats(const int sock, const bool istelnet)
+{
+	const enum regex_type types[] = { REGEX_BLACKLIST, REGEX_WHITELIST };
+	for(unsigned int t = 0; t < sizeof(types)/sizeof(types[0]); t++)
+	{
+		const regexData *regex = get_regex_data(types[t]);
+		const unsigned int num = get_num_regex(types[t]);
+		for(unsigned int i = 0; regex != NULL && i < num; i++)
+		{
+			if(!regex[i].available)
+				continue;
+
+			const unsigned int calls = regex[i].stats.calls;
+			const uint64_t nsec = regex[i].stats.nsec;
+			if(istelnet)
+			{
+				// <type> <DB ID> <executions> <matches> <total nsec>
+				// <average nsec> <regex>
+				ssend(sock, "%s %i %u %u %lu %lu %s\n",
+				      regextype[types[t]], regex[i].database_id,
+				      calls, regex[i].stats.matches, (unsigned long)nsec,
+				      (unsigned long)(calls > 0 ? nsec / calls : 0u),
+				      regex[i].string);
+			}
+			else
+			{
+				if(!pack_str32(sock, regextype[types[t]]))
+					return;
+				pack_int32(sock, regex[i].database_id);
+				pack_uint64(sock, calls);
+				pack_uint64(sock, regex[i].stats.matches);
+				pack_uint64(sock, nsec);
+				if(!pack_str32(sock, regex[i].string))
+					return;
+			}
+		}
+	}
+}
+
+void getLockStats(const int sock, const bool istelnet)
+{
+	const unsigned int num = lock_stats_sites();
+	for(unsigned int i = 0; i < num; i++)
+	{
+		const lock_site *site = lock_stats_get(i);
+		if(site == NULL)
+			break;
+
+		// Skip sites that are registered but have not obtained a lock yet
+		const uint64_t count = site->count;
+		if(count == 0)
+			continue;
+
+		if(istelnet)
+		{
+			// <func> <file>:<line> <mode> <count> <wait avg> <wait max>
+			// <hold avg> <hold max> <wait histogram> <hold histogram>
+			ssend(sock, "%s %s:%i %s %lu %lu %lu %lu %lu ",
+			      site->func, site->file, site->line,
+			      site->shared ? "shared" : "exclusive",
+			      (unsigned long)count,
+			      (unsigned long)(site->wait_total / count), (unsigned long)site->wait_max,
+			      (unsigned long)(site->hold_total / count), (unsigned long)site->hold_max);
+			for(unsigned int j = 0; j < LOCK_HIST_BINS; j++)
+				ssend(sock, j > 0 ? ",%lu" : "%lu", (unsigned long)site->wait_hist[j]);
+			ssend(sock, " ");
+			for(unsigned int j = 0; j < LOCK_HIST_BINS; j++)
+				ssend(sock, j > 0 ? ",%lu" : "%lu", (unsigned long)site->hold_hist[j]);
+			ssend(sock, "\n");
+		}
+		else
+		{
+			if(!pack_str32(sock, site->func) || !pack_str32(sock, site->file))
+				return;
+			pack_int32(sock, site->line);
+			pack_bool(sock, site->shared);
+			pack_uint64(sock, count);
+			pack_uint64(sock, site->wait_total);
+			pack_uint64(sock, site->wait_max);
+			pack_uint64(sock, site->hold_total);
+			pack_uint64(sock, site->hold_max);
+			for(unsigned int j = 0; j < LOCK_HIST_BINS; j++)
+				pack_uint64(sock, site->wait_hist[j]);
+			for(unsigned int j = 0; j < LOCK_HIST_BINS; j++)
+				pack_uint64(sock, site->hold_hist[j]);
+		}
+	}
+}
+
+void getDBLatency(const int sock, const bool istelnet)
+{
+	for(unsigned int i = 0; i < DB_LATENCY_FILES; i++)
+	{
+		for(unsigned int j = 0; j < DB_LATENCY_KINDS; j++)
+		{
+			const db_latency *s = db_latency_get(i, j);
+			if(s == NULL)
+				continue;
+
+			const uint64_t count = s->count;
+			const char *file = db_latency_file_name(i);
+			const char *kind = db_latency_kind_name(j);
+			if(istelnet)
+			{
+				// <file> <kind> <count> <avg> <max> <histogram>
+				ssend(sock, "%s %s %lu %lu %lu ", file, kind,
+				      (unsigned long)count,
+				      (unsigned long)(count > 0 ? s->total / count : 0),
+				      (unsigned long)s->max);
+				for(unsigned int k = 0; k < DB_LATENCY_BINS; k++)
+					ssend(sock, k > 0 ? ",%lu" : "%lu", (unsigned long)s->hist[k]);
+				ssend(sock, "\n");
+			}
+			else
+			{
+				if(!pack_str32(sock, file) || !pack_str32(sock, kind))
+					return;
+				pack_uint64(sock, count);
+				pack_uint64(sock, s->total);
+				pack_uint64(sock, s->max);
+				for(unsigned int k = 0; k < DB_LATENCY_BINS; k++)
+					pack_uint64(sock, s->hist[k]);
+			}
+		}
+	}
+}
+
+void getAllocStats(const int sock, const bool istelnet)
+{
+	if(!config.alloc_stats)
+	{
+		if(istelnet)
+			ssend(sock, "Allocation statistics are disabled (ALLOC_STATS)\n");
+		return;
+	}
+
+	const unsigned int num = alloc_stats_sites();
+	for(unsigned int i = 0; i < num; i++)
+	{
+		alloc_site *site = alloc_stats_get(i);
+		if(site == NULL)
+			break;
+
+		const uint64_t allocs = site->allocs;
+		const uint64_t frees = site->frees;
+		const double rate = alloc_stats_rate(site);
+		if(istelnet)
+		{
+			// <func> <file>:<line> <allocations> <frees> <live bytes>
+			// <total bytes> <allocations per second since the last report>
+			ssend(sock, "%s %s:%i %lu %lu %lu %lu %.1f\n",
+			      site->func, short_path(site->file), site->line,
+			      (unsigned long)allocs, (unsigned long)frees,
+			      (unsigned long)site->live_bytes, (unsigned long)site->bytes, rate);
+		}
+		else
+		{
+			if(!pack_str32(sock, site->func) || !pack_str32(sock, short_path(site->file)))
+				return;
+			pack_int32(sock, site->line);
+			pack_uint64(sock, allocs);
+			pack_uint64(sock, frees);
+			pack_uint64(sock, site->live_bytes);
+			pack_uint64(sock, site->bytes);
+			pack_float(sock, rate);
+		}
+	}
+}
+
+static void send_process_memory(const int sock, const bool istelnet, const pid_t pid, const char *role,
+                                const char *mapping, const struct proc_memory_usage *usage)
+{
+	if(istelnet)
+	{
+		// <PID> <role> <mapping> <RSS> <PSS> <USS> [kB]
+		ssend(sock, "%d %s %s %lu %lu %lu\n", (int)pid, role, mapping,
+		      usage->rss, usage->pss, usage->uss);
+	}
+	else
+	{
+		pack_int32(sock, pid);
+		if(!pack_str32(sock, role) || !pack_str32(sock, mapping))
+			return;
+		pack_uint64(sock, usage->rss);
+		pack_uint64(sock, usage->pss);
+		pack_uint64(sock, usage->uss);
+	}
+}
+
+// Memory of the main process and all its forks (DNS workers and TCP workers),
+// broken down by FTL's shared memory objects, the heap and everything else.
+// The sum of the PSS of all processes is the memory FTL really uses, the USS
+// of a fork is what one more of them costs
+void getProcessMemory(const int sock, const bool istelnet)
+{
+	pid_t pids[DNS_WORKERS_MAX + 64];
+	pids[0] = main_pid();
+	const unsigned int num = 1u + get_child_processes(pids[0], &pids[1], sizeof(pids)/sizeof(pids[0]) - 1u);
+
+	struct proc_memory_usage all = { 0 };
+	struct proc_memory *mem = calloc(1, sizeof(*mem));
+	if(mem == NULL)
+		return;
+	for(unsigned int i = 0; i < num; i++)
+	{
+		// The process may have terminated in the meantime
+		if(!get_process_memory(pids[i], mem))
+			continue;
+
+		char role[16];
+		const unsigned int worker = get_dns_worker_index(pids[i]);
+		if(i == 0)
+			strcpy(role, "main");
+		else if(worker > 0)
+			snprintf(role, sizeof(role), "worker-%u", worker);
+		else
+			strcpy(role, "tcp");
+
+		for(unsigned int j = 0; j < mem->segments; j++)
+			send_process_memory(sock, istelnet, pids[i], role, mem->segment[j].name, &mem->segment[j].usage);
+		send_process_memory(sock, istelnet, pids[i], role, "shm", &mem->shm);
+		send_process_memory(sock, istelnet, pids[i], role, "heap", &mem->heap);
+
+		// SQLite's and the tracked allocations are part of the heap of
+		// this process, they are private memory
+		if(i == 0)
+		{
+			// The page cache arena is allocated once and used by
+			// SQLite3 as its own
+			struct sqlite3_memory sqlite_mem;
+			get_sqlite3_memory(&sqlite_mem);
+			const unsigned long sqlite = (unsigned long)(sqlite_mem.used / 1024) + config.sqlite.pagecache;
+			const struct proc_memory_usage sqlite_usage = { sqlite, sqlite, sqlite };
+			send_process_memory(sock, istelnet, pids[i], role, "heap-sqlite", &sqlite_usage);
+
+			if(config.alloc_stats)
+			{
+				uint64_t live = 0u;
+				for(unsigned int j = 0; j < alloc_stats_sites(); j++)
+				{
+					const alloc_site *site = alloc_stats_get(j);
+					if(site != NULL)
+						live += site->live_bytes;
+				}
+				const struct proc_memory_usage tracked = { live / 1024, live / 1024, live / 1024 };
+				send_process_memory(sock, istelnet, pids[i], role, "heap-tracked", &tracked);
+			}
+		}
+
+		send_process_memory(sock, istelnet, pids[i], role, "other", &mem->other);
+		send_process_memory(sock, istelnet, pids[i], role, "total", &mem->total);
+
+		all.rss += mem->total.rss;
+		all.pss += mem->total.pss;
+		all.uss += mem->total.uss;
+	}
+	free(mem);
+
+	// RSS counts shared memory once per process, PSS only once overall
+	send_process_memory(sock, istelnet, 0, "all", "total", &all);
+}
+
+void getTimers(const char *client_message, const int sock, const bool istelnet)
+{
+	// ">timers reset [name]" clears the statistics of one or all timers
+	const char *reset = strstr(client_message, " reset");
+	if(reset != NULL)
+	{
+		char name[64] = { 0 };
+		const bool all = sscanf(reset, " reset %63s", name) < 1;
+		const bool found = timer_stats_reset(all ? NULL : name);
+		if(istelnet)
+			ssend(sock, found ? "Reset\n" : "Unknown timer\n");
+		else
+			pack_bool(sock, found);
+		return;
+	}
+
+	const unsigned int num = timer_stats_num();
+	for(unsigned int i = 0; i < num; i++)
+	{
+		const timer_stats *s = timer_stats_get(i);
+		if(s == NULL)
+			break;
+
+		// Skip timers which have not measured anything yet
+		const uint64_t count = s->count;
+		if(count == 0)
+			continue;
+
+		if(istelnet)
+		{
+			// <name> <count> <total> <min> <avg> <max> <p50> <p90> <p99> [usec]
+			ssend(sock, "%s %lu %lu %lu %lu %lu %lu %lu %lu\n", s->name,
+			      (unsigned long)count, (unsigned long)s->total,
+			      (unsigned long)s->min, (unsigned long)(s->total / count),
+			      (unsigned long)s->max,
+			      (unsigned long)timer_stats_percentile(s, 0.5),
+			      (unsigned long)timer_stats_percentile(s, 0.9),
+			      (unsigned long)timer_stats_percentile(s, 0.99));
+		}
+		else
+		{
+			if(!pack_str32(sock, s->name))
+				return;
+			pack_uint64(sock, count);
+			pack_uint64(sock, s->total);
+			pack_uint64(sock, s->min);
+			pack_uint64(sock, s->max);
+			for(unsigned int k = 0; k < TIMER_HIST_BINS; k++)
+				pack_uint64(sock, s->hist[k]);
+		}
+	}
+}
+
+// Send the most recent slow queries (see SLOW_QUERY_THRESHOLD), oldest first
+static void getSlowQueries(const int sock, const bool istelnet)
+{
+	const unsigned int next = query_counters->slow_next;
+	const unsigned int n = next < SLOW_QUERY_TRACES ? next : SLOW_QUERY_TRACES;
+	for(unsigned int i = next - n; i != next; i++)
+	{
+		const slowQueryTrace *trace = &query_counters->slow[i % SLOW_QUERY_TRACES];
+		const domainsData *domain = getDomain(trace->domainID, true);
+		const clientsData *client = getClient(trace->clientID, true);
+		if(domain == NULL || client == NULL)
+			continue;
+
+		const char *domainstr = getstr(domain->domainpos);
+		const char *clientstr = getstr(client->ippos);
+		const char *status = get_query_status_str(trace->status);
+		if(istelnet)
+		{
+			// <timestamp> <domain> <client> <qtype> <status> <usec per stage>
+			ssend(sock, "%u %s %s %u %s", trace->timestamp, domainstr,
+			      clientstr, trace->qtype, status);
+			for(unsigned int j = 0; j < QUERY_STAGES; j++)
+				ssend(sock, " %u", trace->stage_us[j]);
+			ssend(sock, "\n");
+		}
+		else
+		{
+			pack_int64(sock, trace->timestamp);
+			if(!pack_str32(sock, domainstr) || !pack_str32(sock, clientstr))
+				return;
+			pack_int32(sock, trace->qtype);
+			if(!pack_str32(sock, status))
+				return;
+			for(unsigned int j = 0; j < QUERY_STAGES; j++)
+				pack_uint64(sock, trace->stage_us[j]);
+		}
+	}
+}
+
+void getQueryStages(const char *client_message, const int sock, const bool istelnet)
+{
+	if(strstr(client_message, " slow") != NULL)
+	{
+		getSlowQueries(sock, istelnet);
+		return;
+	}
+
+	for(unsigned int i = 0; i < QUERY_STAGES; i++)
+	{
+		const queryStageStats *s = &query_counters->stages[i];
+		const uint64_t count = s->count;
+		const char *stage = query_stage_name(i);
+		if(istelnet)
+		{
+			// <stage> <count> <avg> <max> <histogram>
+			ssend(sock, "%s %lu %lu %lu ", stage, (unsigned long)count,
+			      (unsigned long)(count > 0 ? s->total / count : 0),
+			      (unsigned long)s->max);
+			for(unsigned int k = 0; k < QUERY_STAGE_BINS; k++)
+				ssend(sock, k > 0 ? ",%lu" : "%lu", (unsigned long)s->hist[k]);
+			ssend(sock, "\n");
+		}
+		else
+		{
+			if(!pack_str32(sock, stage))
+				return;
+			pack_uint64(sock, count);
+			pack_uint64(sock, s->total);
+			pack_uint64(sock, s->max);
+			for(unsigned int k = 0; k < QUERY_STAGE_BINS; k++)
+				pack_uint64(sock, s->hist[k]);
+		}
+	}
+}
+
+// Copy a label value, escaping backslashes, double quotes and newlines as
+// required by the Prometheus text format
+static void metric_label(char *out, const size_t outlen, const char *in)
+{
+	size_t j = 0;
+	for(; *in != '\0' && j + 2 < outlen; in++)
+	{
+		if(*in == '\\' || *in == '"')
+			out[j++] = '\\';
+		else if(*in == '\n')
+		{
+			out[j++] = '\\';
+			out[j++] = 'n';
+			continue;
+		}
+		out[j++] = *in;
+	}
+	out[j] = '\0';
+}
+
+// Send one histogram in Prometheus text format. Bin 0 counts durations below
+// 1 usec, bin i durations in [2^(i-1), 2^i) usec, so the upper edge of bin i
+// is 2^i usec. The last bin is unbounded
+static void metric_histogram(const int sock, const char *name, const char *labels,
+                             const uint64_t *hist, const unsigned int bins,
+                             const uint64_t sum)
+{
+	uint64_t cumulative = 0;
+	for(unsigned int i = 0; i + 1 < bins; i++)
+	{
+		cumulative += hist[i];
+		ssend(sock, "%s_bucket{%s,le=\"%lu\"} %lu\n", name, labels,
+		      1UL << i, (unsigned long)cumulative);
+	}
+	cumulative += hist[bins - 1];
+	ssend(sock, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, labels, (unsigned long)cumulative);
+	ssend(sock, "%s_sum{%s} %lu\n", name, labels, (unsigned long)sum);
+	ssend(sock, "%s_count{%s} %lu\n", name, labels, (unsigned long)cumulative);
+}
+
+// Prometheus / OpenMetrics text exposition. Apart from the upstream section,
+// everything is read lock-free: counters and latency statistics are atomic or
+// local to this process
+void getMetrics(const int sock)
+{
+	ssend(sock, "# HELP pihole_ftl_queries Queries currently kept in memory\n"
+	            "# TYPE pihole_ftl_queries gauge\n"
+	            "pihole_ftl_queries %i\n", counters->queries);
+
+	ssend(sock, "# HELP pihole_ftl_query_status Queries in memory by status\n"
+	            "# TYPE pihole_ftl_query_status gauge\n");
+	for(enum query_status status = 0; status < QUERY_STATUS_MAX; status++)
+		ssend(sock, "pihole_ftl_query_status{status=\"%s\"} %i\n",
+		      get_query_status_str(status), counter_get(status[status]));
+
+	ssend(sock, "# HELP pihole_ftl_query_reply Queries in memory by reply type\n"
+	            "# TYPE pihole_ftl_query_reply gauge\n");
+	for(enum reply_type reply = 0; reply < QUERY_REPLY_MAX; reply++)
+		ssend(sock, "pihole_ftl_query_reply{reply=\"%s\"} %i\n",
+		      get_query_reply_str(reply), counter_get(reply[reply]));
+
+	ssend(sock, "# HELP pihole_ftl_query_type Queries in memory by query type\n"
+	            "# TYPE pihole_ftl_query_type gauge\n");
+	for(unsigned int type = 0; type < TYPE_MAX-1; type++)
+		ssend(sock, "pihole_ftl_query_type{type=\"%s\"} %i\n",
+		      querytypes[type+1], counter_get(querytype[type]));
+
+	// Per-upstream statistics need the lock as they resolve strings
+	ssend(sock, "# HELP pihole_ftl_upstream_queries Queries in memory forwarded to an upstream server\n"
+	            "# TYPE pihole_ftl_upstream_queries gauge\n"
+	            "# HELP pihole_ftl_upstream_failed Queries in memory an upstream server failed to answer\n"
+	            "# TYPE pihole_ftl_upstream_failed gauge\n"
+	            "# HELP pihole_ftl_upstream_response_ms Moving average of the response time of an upstream server\n"
+	            "# TYPE pihole_ftl_upstream_response_ms gauge\n"
+	            "# HELP pihole_ftl_upstream_error_rate Moving average of the error rate of an upstream server\n"
+	            "# TYPE pihole_ftl_upstream_error_rate gauge\n"
+	            "# HELP pihole_ftl_upstream_inflight Queries awaiting a reply from an upstream server\n"
+	            "# TYPE pihole_ftl_upstream_inflight gauge\n"
+	            "# HELP pihole_ftl_upstream_tcp_replies Replies received from an upstream server over new and reused TCP connections\n"
+	            "# TYPE pihole_ftl_upstream_tcp_replies counter\n");
+	if(init_upstream_probe())
+		ssend(sock, "# HELP pihole_ftl_upstream_probe_up Whether an upstream server answers probes\n"
+		            "# TYPE pihole_ftl_upstream_probe_up gauge\n"
+		            "# HELP pihole_ftl_upstream_probe_ms Moving average of the probe latency of an upstream server\n"
+		            "# TYPE pihole_ftl_upstream_probe_ms gauge\n");
+	lock_shm_shared();
+	for(int upstreamID = 0; upstreamID < counters->upstreams; upstreamID++)
+	{
+		const upstreamsData *upstream = getUpstream(upstreamID, true);
+		if(upstream == NULL)
+			continue;
+
+		const int count = overTime_sum(&upstream->overTime);
+
+		char ip[128], name[256], labels[512];
+		metric_label(ip, sizeof(ip), getstr(upstream->ippos));
+		metric_label(name, sizeof(name), getstr(upstream->namepos));
+		snprintf(labels, sizeof(labels), "upstream=\"%s#%u\",name=\"%s\"",
+		         ip, upstream->port, name);
+		ssend(sock, "pihole_ftl_upstream_queries{%s} %i\n", labels, count);
+		ssend(sock, "pihole_ftl_upstream_failed{%s} %i\n", labels, upstream->failed);
+		ssend(sock, "pihole_ftl_upstream_response_ms{%s} %.2f\n", labels, upstream->rtime_ewma);
+		ssend(sock, "pihole_ftl_upstream_error_rate{%s} %.4f\n", labels, upstream->error_ewma);
+		ssend(sock, "pihole_ftl_upstream_inflight{%s} %i\n", labels, upstream->inflight);
+		ssend(sock, "pihole_ftl_upstream_tcp_replies{%s,connection=\"new\"} %u\n", labels, upstream->tcp.opened);
+		ssend(sock, "pihole_ftl_upstream_tcp_replies{%s,connection=\"reused\"} %u\n", labels, upstream->tcp.reused);
+
+		float probe_rtt = 0.0f;
+		const enum probe_state state = upstream_probe_state(getstr(upstream->ippos), upstream->port, &probe_rtt);
+		if(state != PROBE_UNKNOWN)
+		{
+			ssend(sock, "pihole_ftl_upstream_probe_up{%s} %i\n", labels, state == PROBE_UP ? 1 : 0);
+			ssend(sock, "pihole_ftl_upstream_probe_ms{%s} %.2f\n", labels, probe_rtt);
+		}
+	}
+
+	// Clients and upstream servers whose host name lookups are delayed
+	// because earlier lookups did not return a name
+	const time_t now = time(NULL);
+	int client_backoff = 0, upstream_backoff = 0;
+	for(int clientID = 0; clientID < counters->clients; clientID++)
+	{
+		const clientsData *client = getClient(clientID, true);
+		if(client != NULL && client->resolve.next > now)
+			client_backoff++;
+	}
+	for(int upstreamID = 0; upstreamID < counters->upstreams; upstreamID++)
+	{
+		const upstreamsData *upstream = getUpstream(upstreamID, true);
+		if(upstream != NULL && upstream->resolve.next > now)
+			upstream_backoff++;
+	}
+	unlock_shm_shared();
+
+	unsigned int lookups = 0, failed_lookups = 0;
+	get_resolver_stats(&lookups, &failed_lookups);
+	ssend(sock, "# HELP pihole_ftl_hostname_lookups Host name lookups of clients and upstream servers\n"
+	            "# TYPE pihole_ftl_hostname_lookups counter\n"
+	            "pihole_ftl_hostname_lookups %u\n"
+	            "# HELP pihole_ftl_hostname_lookups_failed Host name lookups which did not return a name\n"
+	            "# TYPE pihole_ftl_hostname_lookups_failed counter\n"
+	            "pihole_ftl_hostname_lookups_failed %u\n"
+	            "# HELP pihole_ftl_hostname_backoff Entries whose next host name lookup is delayed\n"
+	            "# TYPE pihole_ftl_hostname_backoff gauge\n"
+	            "pihole_ftl_hostname_backoff{kind=\"client\"} %i\n"
+	            "pihole_ftl_hostname_backoff{kind=\"upstream\"} %i\n",
+	      lookups, failed_lookups, client_backoff, upstream_backoff);
+
+	if(config.defer_statistics)
+	{
+		struct statsqueue_stats queue = { 0 };
+		get_statsqueue_stats(&queue);
+		ssend(sock, "# HELP pihole_ftl_deferred_events Events whose statistics were deferred to the statistics thread\n"
+		            "# TYPE pihole_ftl_deferred_events counter\n"
+		            "pihole_ftl_deferred_events %lu\n"
+		            "# HELP pihole_ftl_deferred_events_flushed Deferred events applied by dnsmasq before a synchronous update\n"
+		            "# TYPE pihole_ftl_deferred_events_flushed counter\n"
+		            "pihole_ftl_deferred_events_flushed %lu\n"
+		            "# HELP pihole_ftl_deferred_events_overflows Events processed synchronously as the queue was full\n"
+		            "# TYPE pihole_ftl_deferred_events_overflows counter\n"
+		            "pihole_ftl_deferred_events_overflows %lu\n"
+		            "# HELP pihole_ftl_deferred_events_pending Events waiting in the queue\n"
+		            "# TYPE pihole_ftl_deferred_events_pending gauge\n"
+		            "pihole_ftl_deferred_events_pending %u\n",
+		      queue.deferred, queue.flushed, queue.overflows, queue.pending);
+	}
+
+	if(config.udp_batch > 1)
+	{
+		struct udp_batch_stats batch = { 0 };
+		get_udp_batch_stats(&batch);
+		ssend(sock, "# HELP pihole_ftl_udp_recv_calls recvmmsg() calls on the DNS listening sockets\n"
+		            "# TYPE pihole_ftl_udp_recv_calls counter\n"
+		            "pihole_ftl_udp_recv_calls %lu\n"
+		            "# HELP pihole_ftl_udp_recv_datagrams Datagrams received by these calls\n"
+		            "# TYPE pihole_ftl_udp_recv_datagrams counter\n"
+		            "pihole_ftl_udp_recv_datagrams %lu\n"
+		            "# HELP pihole_ftl_udp_send_calls sendmmsg() calls for DNS replies\n"
+		            "# TYPE pihole_ftl_udp_send_calls counter\n"
+		            "pihole_ftl_udp_send_calls %lu\n"
+		            "# HELP pihole_ftl_udp_send_datagrams Replies sent by these calls\n"
+		            "# TYPE pihole_ftl_udp_send_datagrams counter\n"
+		            "pihole_ftl_udp_send_datagrams %lu\n",
+		      batch.recv_calls, batch.recv_datagrams, batch.send_calls, batch.send_datagrams);
+	}
+
+	if(config.dns_workers > 0)
+	{
+		struct dns_workers_stats workers = { 0 };
+		get_dns_workers_stats(&workers);
+		ssend(sock, "# HELP pihole_ftl_dns_workers DNS worker processes currently running\n"
+		            "# TYPE pihole_ftl_dns_workers gauge\n"
+		            "pihole_ftl_dns_workers %u\n"
+		            "# HELP pihole_ftl_dns_workers_started DNS worker processes started\n"
+		            "# TYPE pihole_ftl_dns_workers_started counter\n"
+		            "pihole_ftl_dns_workers_started %lu\n",
+		      workers.running, workers.started);
+	}
+
+	struct sigcache_stats sigcache = { 0 };
+	get_sigcache_stats(&sigcache);
+	if(sigcache.hits + sigcache.misses > 0u || sigcache.cpu_ns > 0u)
+	{
+		ssend(sock, "# HELP pihole_ftl_dnssec_sigcache_lookups DNSSEC signature verifications by cache outcome\n"
+		            "# TYPE pihole_ftl_dnssec_sigcache_lookups counter\n"
+		            "pihole_ftl_dnssec_sigcache_lookups{result=\"hit\"} %lu\n"
+		            "pihole_ftl_dnssec_sigcache_lookups{result=\"miss\"} %lu\n"
+		            "# HELP pihole_ftl_dnssec_sigcache_evictions Unexpired verification results displaced from the cache\n"
+		            "# TYPE pihole_ftl_dnssec_sigcache_evictions counter\n"
+		            "pihole_ftl_dnssec_sigcache_evictions %lu\n"
+		            "# HELP pihole_ftl_dnssec_verify_cpu_seconds CPU time spent verifying DNSSEC signatures\n"
+		            "# TYPE pihole_ftl_dnssec_verify_cpu_seconds counter\n"
+		            "pihole_ftl_dnssec_verify_cpu_seconds %.6f\n",
+		      sigcache.hits, sigcache.misses, sigcache.evictions, 1e-9*sigcache.cpu_ns);
+	}
+
+	struct nseccache_stats nseccache = { 0 };
+	get_nseccache_stats(&nseccache);
+	if(nseccache.stored > 0u)
+	{
+		ssend(sock, "# HELP pihole_ftl_dnssec_aggressive_nxdomain Queries answered with NXDOMAIN synthesized from cached NSEC/NSEC3 records\n"
+		            "# TYPE pihole_ftl_dnssec_aggressive_nxdomain counter\n"
+		            "pihole_ftl_dnssec_aggressive_nxdomain %lu\n"
+		            "# HELP pihole_ftl_dnssec_nsec_zones Signed zones with cached NSEC/NSEC3 ranges\n"
+		            "# TYPE pihole_ftl_dnssec_nsec_zones gauge\n"
+		            "pihole_ftl_dnssec_nsec_zones %u\n"
+		            "# HELP pihole_ftl_dnssec_nsec_ranges Cached NSEC/NSEC3 ranges\n"
+		            "# TYPE pihole_ftl_dnssec_nsec_ranges gauge\n"
+		            "pihole_ftl_dnssec_nsec_ranges %u\n",
+		      nseccache.synthesized, nseccache.zones, nseccache.ranges);
+	}
+
+	if(config.prefetch > 0)
+	{
+		ssend(sock, "# HELP pihole_ftl_prefetches Queries forwarded to refresh cached records of popular domains\n"
+		            "# TYPE pihole_ftl_prefetches counter\n"
+		            "pihole_ftl_prefetches %lu\n",
+		      get_prefetch_count());
+	}
+
+	if(config.adaptive_cache > 0)
+	{
+		struct cache_adapt_stats cache = { 0 };
+		get_cache_adapt_stats(&cache);
+		ssend(sock, "# HELP pihole_ftl_dnsmasq_cache_size_min Lower bound of the adaptive DNS cache size\n"
+		            "# TYPE pihole_ftl_dnsmasq_cache_size_min gauge\n"
+		            "pihole_ftl_dnsmasq_cache_size_min %i\n"
+		            "# HELP pihole_ftl_dnsmasq_cache_size_max Upper bound of the adaptive DNS cache size\n"
+		            "# TYPE pihole_ftl_dnsmasq_cache_size_max gauge\n"
+		            "pihole_ftl_dnsmasq_cache_size_max %i\n"
+		            "# HELP pihole_ftl_dnsmasq_cache_resizes Adaptive DNS cache size changes\n"
+		            "# TYPE pihole_ftl_dnsmasq_cache_resizes counter\n"
+		            "pihole_ftl_dnsmasq_cache_resizes{direction=\"grow\"} %lu\n"
+		            "pihole_ftl_dnsmasq_cache_resizes{direction=\"shrink\"} %lu\n",
+		      cache.min, cache.max, cache.grown, cache.shrunk);
+	}
+
+	if(config.pktdump.buffer > 0)
+	{
+		struct pktdump_stats dump = { 0 };
+		get_pktdump_stats(&dump);
+		ssend(sock, "# HELP pihole_ftl_pcap_packets Dumped packets by outcome\n"
+		            "# TYPE pihole_ftl_pcap_packets counter\n"
+		            "pihole_ftl_pcap_packets{outcome=\"queued\"} %lu\n"
+		            "pihole_ftl_pcap_packets{outcome=\"written\"} %lu\n"
+		            "pihole_ftl_pcap_packets{outcome=\"dropped\"} %lu\n"
+		            "# HELP pihole_ftl_pcap_rotations Packet dump file rotations\n"
+		            "# TYPE pihole_ftl_pcap_rotations counter\n"
+		            "pihole_ftl_pcap_rotations %lu\n"
+		            "# HELP pihole_ftl_pcap_triggers Packet dumps triggered by upstream errors\n"
+		            "# TYPE pihole_ftl_pcap_triggers counter\n"
+		            "pihole_ftl_pcap_triggers %lu\n",
+		      dump.queued, dump.written, dump.dropped, dump.rotations, dump.triggers);
+	}
+
+	if(config.binary_querylog)
+	{
+		struct querylog_stats qlog = { 0 };
+		get_querylog_stats(&qlog);
+		ssend(sock, "# HELP pihole_ftl_binary_querylog_records Records of the binary query log by outcome\n"
+		            "# TYPE pihole_ftl_binary_querylog_records counter\n"
+		            "pihole_ftl_binary_querylog_records{outcome=\"written\"} %lu\n"
+		            "pihole_ftl_binary_querylog_records{outcome=\"dropped\"} %lu\n",
+		      qlog.written, qlog.dropped);
+	}
+
+	if(config.dnstap)
+	{
+		struct dnstap_stats tap = { 0 };
+		get_dnstap_stats(&tap);
+		ssend(sock, "# HELP pihole_ftl_dnstap_messages dnstap messages by outcome\n"
+		            "# TYPE pihole_ftl_dnstap_messages counter\n"
+		            "pihole_ftl_dnstap_messages{outcome=\"queued\"} %lu\n"
+		            "pihole_ftl_dnstap_messages{outcome=\"dropped\"} %lu\n"
+		            "# HELP pihole_ftl_dnstap_connects Connections to the dnstap collector\n"
+		            "# TYPE pihole_ftl_dnstap_connects counter\n"
+		            "pihole_ftl_dnstap_connects %lu\n",
+		      tap.queued, tap.dropped, tap.connects);
+	}
+
+	if(config.log_buffer > 0)
+	{
+		struct log_stats logs = { 0 };
+		get_log_stats(&logs);
+		ssend(sock, "# HELP pihole_ftl_log_lines Log lines written by the log writer thread by outcome\n"
+		            "# TYPE pihole_ftl_log_lines counter\n"
+		            "pihole_ftl_log_lines{outcome=\"written\"} %lu\n"
+		            "pihole_ftl_log_lines{outcome=\"dropped\"} %lu\n",
+		      logs.written, logs.dropped);
+	}
+
+	if(debug_limits_active())
+	{
+		ssend(sock, "# HELP pihole_ftl_debug_suppressed_messages Debug messages suppressed by sampling and rate-limiting\n"
+		            "# TYPE pihole_ftl_debug_suppressed_messages counter\n");
+		for(unsigned int i = 0; i < DEBUG_CATEGORIES; i++)
+			ssend(sock, "pihole_ftl_debug_suppressed_messages{category=\"%s\"} %lu\n",
+			      debug_category_name(i),
+			      (unsigned long)atomic_load(&debug_limits->category[i].suppressed));
+	}
+
+	getDNSMetrics(sock);
+
+	ssend(sock, "# HELP pihole_ftl_shm_bytes Size of the shared memory objects\n"
+	            "# TYPE pihole_ftl_shm_bytes gauge\n");
+	const SharedMemory *shm = NULL;
+	for(unsigned int i = 0; (shm = get_shm_object(i)) != NULL; i++)
+		if(shm->name != NULL)
+			ssend(sock, "pihole_ftl_shm_bytes{segment=\"%s\"} %zu\n", shm->name, shm->size);
+	ssend(sock, "# HELP pihole_ftl_shm_segment_remaps Number of remaps of a shared memory object after another process resized it\n"
+	            "# TYPE pihole_ftl_shm_segment_remaps counter\n");
+	for(unsigned int i = 0; (shm = get_shm_object(i)) != NULL; i++)
+	{
+		unsigned int resizes = 0, remaps = 0;
+		get_shm_object_usage(i, &resizes, &remaps);
+		if(shm->name != NULL)
+			ssend(sock, "pihole_ftl_shm_segment_remaps{segment=\"%s\"} %u\n", shm->name, remaps);
+	}
+
+	struct shm_object_usage usage[SHM_USAGE_OBJECTS];
+	lock_shm_shared();
+	get_shm_breakdown(usage);
+	unlock_shm_shared();
+	ssend(sock, "# HELP pihole_ftl_shm_object_entries Live entries of a shared memory object\n"
+	            "# TYPE pihole_ftl_shm_object_entries gauge\n");
+	for(unsigned int i = 0; i < SHM_USAGE_OBJECTS; i++)
+		ssend(sock, "pihole_ftl_shm_object_entries{object=\"%s\"} %u\n",
+		      get_shm_usage_name(i), usage[i].entries);
+	ssend(sock, "# HELP pihole_ftl_shm_object_capacity Entries a shared memory object can hold before it has to grow\n"
+	            "# TYPE pihole_ftl_shm_object_capacity gauge\n");
+	for(unsigned int i = 0; i < SHM_USAGE_OBJECTS; i++)
+		if(i != SHM_USAGE_STRINGS)
+			ssend(sock, "pihole_ftl_shm_object_capacity{object=\"%s\"} %u\n",
+			      get_shm_usage_name(i), usage[i].capacity);
+	ssend(sock, "# HELP pihole_ftl_shm_object_used_bytes Bytes used by the live entries of a shared memory object\n"
+	            "# TYPE pihole_ftl_shm_object_used_bytes gauge\n");
+	for(unsigned int i = 0; i < SHM_USAGE_OBJECTS; i++)
+		ssend(sock, "pihole_ftl_shm_object_used_bytes{object=\"%s\"} %zu\n",
+		      get_shm_usage_name(i), usage[i].used);
+	ssend(sock, "# HELP pihole_ftl_shm_object_allocated_bytes Bytes allocated for a shared memory object and its lookup table\n"
+	            "# TYPE pihole_ftl_shm_object_allocated_bytes gauge\n");
+	for(unsigned int i = 0; i < SHM_USAGE_OBJECTS; i++)
+		ssend(sock, "pihole_ftl_shm_object_allocated_bytes{object=\"%s\"} %zu\n",
+		      get_shm_usage_name(i), usage[i].allocated);
+
+	unsigned int resizes = 0, remaps = 0;
+	size_t allocated = 0;
+	get_shm_usage(&resizes, &remaps, &allocated);
+	ssend(sock, "# HELP pihole_ftl_shm_resizes Number of shared memory resizes\n"
+	            "# TYPE pihole_ftl_shm_resizes counter\n"
+	            "pihole_ftl_shm_resizes %u\n"
+	            "# HELP pihole_ftl_shm_remaps Number of shared memory remaps\n"
+	            "# TYPE pihole_ftl_shm_remaps counter\n"
+	            "pihole_ftl_shm_remaps %u\n"
+	            "# HELP pihole_ftl_shm_allocated_bytes Total shared memory allocated\n"
+	            "# TYPE pihole_ftl_shm_allocated_bytes gauge\n"
+	            "pihole_ftl_shm_allocated_bytes %zu\n",
+	            resizes, remaps, allocated);
+
+	ssend(sock, "# HELP pihole_ftl_lock_wait_microseconds Time spent waiting for the SHM lock\n"
+	            "# TYPE pihole_ftl_lock_wait_microseconds histogram\n");
+	const unsigned int num = lock_stats_sites();
+	for(unsigned int i = 0; i < num; i++)
+	{
+		const lock_site *site = lock_stats_get(i);
+		if(site == NULL)
+			break;
+		if(site->count == 0)
+			continue;
+
+		char labels[256];
+		snprintf(labels, sizeof(labels), "func=\"%s\",file=\"%s\",line=\"%i\",mode=\"%s\"",
+		         site->func, site->file, site->line, site->shared ? "shared" : "exclusive");
+		metric_histogram(sock, "pihole_ftl_lock_wait_microseconds", labels,
+		                 site->wait_hist, LOCK_HIST_BINS, site->wait_total);
+	}
+
+	ssend(sock, "# HELP pihole_ftl_lock_hold_microseconds Time the SHM lock was held\n"
+	            "# TYPE pihole_ftl_lock_hold_microseconds histogram\n");
+	for(unsigned int i = 0; i < num; i++)
+	{
+		const lock_site *site = lock_stats_get(i);
+		if(site == NULL)
+			break;
+		if(site->count == 0)
+			continue;
+
+		char labels[256];
+		snprintf(labels, sizeof(labels), "func=\"%s\",file=\"%s\",line=\"%i\",mode=\"%s\"",
+		         site->func, site->file, site->line, site->shared ? "shared" : "exclusive");
+		metric_histogram(sock, "pihole_ftl_lock_hold_microseconds", labels,
+		                 site->hold_hist, LOCK_HIST_BINS, site->hold_total);
+	}
+
+	ssend(sock, "# HELP pihole_ftl_db_latency_microseconds Latency of database operations\n"
+	            "# TYPE pihole_ftl_db_latency_microseconds histogram\n");
+	for(unsigned int i = 0; i < DB_LATENCY_FILES; i++)
+	{
+		for(unsigned int j = 0; j < DB_LATENCY_KINDS; j++)
+		{
+			const db_latency *s = db_latency_get(i, j);
+			if(s == NULL)
+				continue;
+
+			char labels[128];
+			snprintf(labels, sizeof(labels), "database=\"%s\",kind=\"%s\"",
+			         db_latency_file_name(i), db_latency_kind_name(j));
+			metric_histogram(sock, "pihole_ftl_db_latency_microseconds", labels,
+			                 s->hist, DB_LATENCY_BINS, s->total);
+		}
+	}
+}
+
+void getClientsOverTime(const char *client_message, const int sock, const bool istelnet)
 {
 	// Exit before processing any data if requested via config setting
-	get_privacy_level(NULL);
+	refresh_privacy_level();
 	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS_CLIENTS)
 		return;
 
 	// Get clients which the user doesn't want to see
-	char * excludeclients = read_setupVarsconf("API_EXCLUDE_CLIENTS");
-	// Array of clients to be skipped in the output
-	// if skipclient[i] == true then this client should be hidden from
-	// returned data. We initialize it with false
-	bool skipclient[counters->clients];
-	memset(skipclient, false, counters->clients*sizeof(bool));
+	struct setupVars_snapshot *setupVars = setupVars_get();
+	const bool exclude = setupVars_has_list(setupVars, EXCLUDE_CLIENTS);
 
-	if(excludeclients != NULL)
+	// Collect the clients to be shown once instead of checking them for
+	// every time slot
+	int32_t *clientIDs = calloc(counters->clients > 0 ? counters->clients : 1, sizeof(int32_t));
+	if(clientIDs == NULL)
+	{
+		setupVars_put(setupVars);
+		return;
+	}
+	uint32_t num = 0;
+	for(int clientID = 0; clientID < counters->clients; clientID++)
 	{
-		getSetupVarsArray(excludeclients);
+		// Get client pointer
+		const clientsData* client = getClient(clientID, true);
+		// Skip invalid clients and also those managed by alias clients
+		if(client == NULL || client->aliasclient_id >= 0)
+			continue;
+		// Also skip clients with no active counts at all (may be old IPv6 addresses)
+		if(client->count == 0)
+			continue;
 
-		for(int clientID=0; clientID < counters->clients; clientID++)
-		{
-			// Get client pointer
-			const clientsData* client = getClient(clientID, true);
-			// Skip invalid clients
-			if(client == NULL)
-				continue;
+		// Check if this client should be skipped
+		if(exclude &&
+		   (setupVars_excluded(setupVars, EXCLUDE_CLIENTS, getstr(client->ippos)) ||
+		    setupVars_excluded(setupVars, EXCLUDE_CLIENTS, getstr(client->namepos))))
+			continue;
 
-			// Check if this client should be skipped
-			if(insetupVarsArray(getstr(client->ippos)) ||
-			   insetupVarsArray(getstr(client->namepos)) ||
-			   (!client->flags.aliasclient && client->aliasclient_id > -1))
-				skipclient[clientID] = true;
+		clientIDs[num++] = clientID;
+	}
+	setupVars_put(setupVars);
+
+	// Binary bulk variant (column-oriented)
+	// example: >ClientsoverTime bulk
+	//   int32  number of clients N
+	//   int32  number of time slots M
+	//   bin32  N client IDs (in the order of >client-names)
+	//   bin32  M timestamps
+	//   bin32  N x M values, the time slots of each client back to back
+	// All arrays are little-endian int32 values
+	if(!istelnet && command(client_message, " bulk"))
+	{
+		int32_t timestamps[OVERTIME_SLOTS];
+		for(int slot = 0; slot < OVERTIME_SLOTS; slot++)
+			timestamps[slot] = (int32_t)overTime[slot].timestamp;
+
+		pack_int32(sock, num);
+		pack_int32(sock, OVERTIME_SLOTS);
+		pack_int32_array(sock, clientIDs, num);
+		pack_int32_array(sock, timestamps, OVERTIME_SLOTS);
+		pack_bin32_start(sock, num * OVERTIME_SLOTS * sizeof(int32_t));
+		for(uint32_t i = 0; i < num; i++)
+		{
+			const clientsData* client = getClient(clientIDs[i], true);
+			int values[OVERTIME_SLOTS];
+			overTime_unpack(&client->overTime, values);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			swrite(sock, values, sizeof(values));
+#else
+			for(int slot = 0; slot < OVERTIME_SLOTS; slot++)
+			{
+				const uint32_t value = htole32((uint32_t)values[slot]);
+				swrite(sock, &value, sizeof(value));
+			}
+#endif
 		}
+		free(clientIDs);
+		return;
 	}
 
 	// Main return loop
@@ -1259,21 +3182,11 @@ void getClientsOverTime(const int sock, const bool istelnet)
 		else
 			pack_int32(sock, (int32_t)overTime[slot].timestamp);
 
-		// Loop over forward destinations to generate output to be sent to the client
-		for(int clientID = 0; clientID < counters->clients; clientID++)
+		// Loop over clients to generate output to be sent to the client
+		for(uint32_t i = 0; i < num; i++)
 		{
-			if(skipclient[clientID])
-				continue;
-
-			// Get client pointer
-			const clientsData* client = getClient(clientID, true);
-			// Skip invalid clients and also those managed by alias clients
-			if(client == NULL || client->aliasclient_id >= 0)
-				continue;
-			// Also skip clients with no active counts at all (may be old IPv6 addresses)
-			if(client->count == 0)
-				continue;
-			const int thisclient = client->overTime[slot];
+			const clientsData* client = getClient(clientIDs[i], true);
+			const int thisclient = overTime_get(&client->overTime, slot);
 
 			if(istelnet)
 				ssend(sock, " %i", thisclient);
@@ -1287,29 +3200,26 @@ void getClientsOverTime(const int sock, const bool istelnet)
 			pack_int32(sock, -1);
 	}
 
-	if(excludeclients != NULL)
-		clearSetupVarsArray();
+	free(clientIDs);
 }
 
 void getClientNames(const int sock, const bool istelnet)
 {
 	// Exit before processing any data if requested via config setting
-	get_privacy_level(NULL);
+	refresh_privacy_level();
 	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS_CLIENTS)
 		return;
 
 	// Get clients which the user doesn't want to see
-	char * excludeclients = read_setupVarsconf("API_EXCLUDE_CLIENTS");
+	struct setupVars_snapshot *setupVars = setupVars_get();
 	// Array of clients to be skipped in the output
 	// if skipclient[i] == true then this client should be hidden from
 	// returned data. We initialize it with false
 	bool skipclient[counters->clients];
 	memset(skipclient, false, counters->clients*sizeof(bool));
 
-	if(excludeclients != NULL)
+	if(setupVars_has_list(setupVars, EXCLUDE_CLIENTS))
 	{
-		getSetupVarsArray(excludeclients);
-
 		for(int clientID=0; clientID < counters->clients; clientID++)
 		{
 			// Get client pointer
@@ -1319,12 +3229,13 @@ void getClientNames(const int sock, const bool istelnet)
 				continue;
 
 			// Check if this client should be skipped
-			if(insetupVarsArray(getstr(client->ippos)) ||
-			   insetupVarsArray(getstr(client->namepos)) ||
+			if(setupVars_excluded(setupVars, EXCLUDE_CLIENTS, getstr(client->ippos)) ||
+			   setupVars_excluded(setupVars, EXCLUDE_CLIENTS, getstr(client->namepos)) ||
 			   (!client->flags.aliasclient && client->aliasclient_id > -1))
 				skipclient[clientID] = true;
 		}
 	}
+	setupVars_put(setupVars);
 
 	// Loop over clients to generate output to be sent to the client
 	for(int clientID = 0; clientID < counters->clients; clientID++)
@@ -1351,25 +3262,25 @@ void getClientNames(const int sock, const bool istelnet)
 			pack_str32(sock, client_ip);
 		}
 	}
-
-	if(excludeclients != NULL)
-		clearSetupVarsArray();
 }
 
 void getUnknownQueries(const int sock, const bool istelnet)
 {
 	// Exit before processing any data if requested via config setting
-	get_privacy_level(NULL);
+	refresh_privacy_level();
 	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS)
 		return;
 
-	for(int queryID = 0; queryID < counters->queries; queryID++)
+	// Walk the list of queries in progress (see query_update_inflight())
+	// from the oldest to the most recent one
+	unsigned int seq = counters->inflight_head;
+	for(int n = 0; n < counters->inflight; n++)
 	{
-		const queriesData* query = getQuery(queryID, true);
-
-		if(query == NULL ||
-		  (query->status != QUERY_UNKNOWN && query->flags.complete))
-			continue;
+		const int queryID = seq_queryID(seq);
+		const queriesData* query = queryID < 0 ? NULL : getQuery(queryID, true);
+		if(query == NULL)
+			break;
+		seq = query->next_inflight;
 
 		char type[5];
 		if(query->type == TYPE_A)
@@ -1449,259 +3360,15 @@ void getMAXLOGAGE(const int sock)
 	ssend(sock, "%d\n", config.maxlogage);
 }
 
-static bool getDefaultInterface(char iface[IF_NAMESIZE], in_addr_t *gw)
-{
-	// Get IPv4 default route gateway and associated interface
-	long dest_r = 0, gw_r = 0;
-	int flags = 0, metric = 0, minmetric = __INT_MAX__;
-	char iface_r[IF_NAMESIZE] = { 0 };
-	char buf[1024] = { 0 };
-
-	FILE *file;
-	if((file = fopen("/proc/net/route", "r")))
-	{
-		// Parse /proc/net/route - the kernel's IPv4 routing table
-		while(fgets(buf, sizeof(buf), file))
-		{
-			if(sscanf(buf, "%s %lx %lx %x %*i %*i %i", iface_r, &dest_r, &gw_r, &flags, &metric) != 5)
-				continue;
-
-			// Only analyze routes which are UP and whose
-			// destinations are a gateway
-			if(!(flags & RTF_UP) || !(flags & RTF_GATEWAY))
-				continue;
-
-			// Only analyze "catch all" routes (destination 0.0.0.0)
-			if(dest_r != 0)
-				continue;
-
-			// Store default gateway, overwrite if we find a route with
-			// a lower metric
-			if(metric < minmetric)
-			{
-				minmetric = metric;
-				*gw = gw_r;
-				strcpy(iface, iface_r);
-
-				if(config.debug & DEBUG_API)
-					logg("Reading interfaces: flags: %i, addr: %s, iface: %s, metric: %i, minmetric: %i",
-					     flags, inet_ntoa(*(struct in_addr *) gw), iface, metric, minmetric);
-			}
-		}
-		fclose(file);
-	}
-	else
-		logg("Cannot read /proc/net/route: %s", strerror(errno));
-
-	// Return success based on having found the default gateway's address
-	return gw != 0;
-}
-
 void getGateway(const int sock)
 {
 	in_addr_t gw = 0;
 	char iface[IF_NAMESIZE] = { 0 };
 
-	getDefaultInterface(iface, &gw);
+	get_default_route(iface, &gw);
 	ssend(sock, "%s %s\n", inet_ntoa(*(struct in_addr *) &gw), iface);
 }
 
-struct if_info {
-	bool carrier;
-	bool default_iface;
-	char *name;
-	struct {
-		char *v4;
-		char *v6;
-	} ip;
-	int speed;
-	ssize_t rx_bytes;
-	ssize_t tx_bytes;
-	sa_family_t family;
-	struct if_info *next;
-};
-
-#include <dirent.h>
-
-static bool listInterfaces(struct if_info **head, char default_iface[IF_NAMESIZE])
-{
-	// Loop over interfaces and extract information
-	DIR *dfd;
-	FILE *f;
-	struct dirent *dp;
-	struct if_info *tail = NULL;
-	size_t tx_sum = 0, rx_sum = 0;
-	char fname[64 + IF_NAMESIZE] = { 0 };
-	char readbuffer[1024] = { 0 };
-
-	// Open /sys/class/net directory
-	if ((dfd = opendir("/sys/class/net")) == NULL)
-	{
-		logg("API: Cannot access /sys/class/net");
-		return false;
-	}
-
-	// Get IP addresses of all interfaces on this machine
-	struct ifaddrs *ifap = NULL;
-	if(getifaddrs(&ifap) == -1)
-		logg("API error: Cannot get interface addresses: %s", strerror(errno));
-
-	// Walk /sys/class/net directory
-	while ((dp = readdir(dfd)) != NULL)
-	{
-		// Skip "." and ".."
-		if(strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
-			continue;
-
-		// Create new interface record
-		struct if_info *new = calloc(1, sizeof(struct if_info));
-		new->name = strdup(dp->d_name);
-
-		new->default_iface = strcmp(new->name, default_iface) == 0;
-
-		// Extract carrier status
-		snprintf(fname, sizeof(fname)-1, "/sys/class/net/%s/carrier", new->name);
-		if((f = fopen(fname, "r")) != NULL)
-		{
-			if(fgets(readbuffer, sizeof(readbuffer)-1, f) != NULL)
-				new->carrier = readbuffer[0] == '1';
-			fclose(f);
-		}
-		else
-			logg("Cannot read %s: %s", fname, strerror(errno));
-
-		// Extract link speed (may not be possible, e.g., for WiFi devices with dynamic link speeds)
-		snprintf(fname, sizeof(fname)-1, "/sys/class/net/%s/speed", new->name);
-		if((f = fopen(fname, "r")) != NULL)
-		{
-			if(fscanf(f, "%i", &(new->speed)) != 1)
-				new->speed = -1;
-			fclose(f);
-		}
-		else
-			logg("Cannot read %s: %s", fname, strerror(errno));
-
-		// Get total transmitted bytes
-		snprintf(fname, sizeof(fname)-1, "/sys/class/net/%s/statistics/tx_bytes", new->name);
-		if((f = fopen(fname, "r")) != NULL)
-		{
-			if(fscanf(f, "%zi", &(new->tx_bytes)) != 1)
-				new->tx_bytes = -1;
-			fclose(f);
-		}
-		else
-			logg("Cannot read %s: %s", fname, strerror(errno));
-
-		// Get total transmitted bytes
-		snprintf(fname, sizeof(fname)-1, "/sys/class/net/%s/statistics/rx_bytes", new->name);
-		if((f = fopen(fname, "r")) != NULL)
-		{
-			if(fscanf(f, "%zi", &(new->rx_bytes)) != 1)
-				new->rx_bytes = -1;
-			fclose(f);
-		}
-		else
-			logg("Cannot read %s: %s", fname, strerror(errno));
-
-		// Get IP address(es) of this interface
-		if(ifap)
-		{
-			// Walk through linked list of interface addresses
-
-			for(struct ifaddrs *ifa = ifap; ifa != NULL; ifa = ifa->ifa_next)
-			{
-				// Skip interfaces without an address and those
-				// not matching the current interface
-				if(ifa->ifa_addr == NULL || strcmp(ifa->ifa_name, new->name) != 0)
-					continue;
-
-				// If we reach this point, we found the correct interface
-				new->family = ifa->ifa_addr->sa_family;
-				char host[NI_MAXHOST] = { 0 };
-				if(new->family == AF_INET || new->family == AF_INET6)
-				{
-					// Get IP address
-					const int s = getnameinfo(ifa->ifa_addr,
-					                          (new->family == AF_INET) ?
-					                               sizeof(struct sockaddr_in) :
-					                               sizeof(struct sockaddr_in6),
-					                          host, NI_MAXHOST,
-					                          NULL, 0, NI_NUMERICHOST);
-					if (s != 0)
-					{
-						logg("API warning: getnameinfo() failed: %s\n", gai_strerror(s));
-						continue;
-					}
-
-					if(new->family == AF_INET)
-					{
-						// IPv4 address
-						if(!new->ip.v4)
-						{
-							// First or only IPv4 address of this interface
-							new->ip.v4 = strdup(host);
-						}
-						else
-						{
-							// Create comma-separated list
-							char *new_v4 = calloc(strlen(new->ip.v4) + strlen(host) + 2, sizeof(char));
-							sprintf(new_v4, "%s,%s", new->ip.v4, host);
-							free(new->ip.v4);
-							new->ip.v4 = new_v4;
-						}
-					}
-					else if(new->family == AF_INET6)
-					{
-						// IPv6 address
-						if(!new->ip.v6)
-						{
-							// First or only IPv6 address of this interface
-							new->ip.v6 = strdup(host);
-						}
-						else
-						{
-							// Create comma-separated list
-							char *new_v6 = calloc(strlen(new->ip.v6) + strlen(host) + 2, sizeof(char));
-							sprintf(new_v6, "%s,%s", new->ip.v6, host);
-							free(new->ip.v6);
-							new->ip.v6 = new_v6;
-						}
-					}
-				}
-			}
-		}
-
-		// Add to end of the linked list
-		if(!*head)
-			*head = new;
-		if(tail)
-			tail->next = new;
-		tail = new;
-
-		tx_sum += new->tx_bytes;
-		rx_sum += new->rx_bytes;
-	}
-
-	closedir(dfd);
-	freeifaddrs(ifap);
-
-	// Create sum entry only if there is more than one interface
-	if(head == NULL)
-		return true;
-
-	struct if_info *new = calloc(1, sizeof(struct if_info));
-	new->name = strdup("sum");
-	new->carrier = true;
-	new->speed = 0;
-	new->tx_bytes = tx_sum;
-	new->rx_bytes = rx_sum;
-	if(tail)
-		tail->next = new;
-	tail = new;
-
-	return true;
-}
-
 static bool send_iface(const int sock, struct if_info *iface)
 {
 	double tx = 0.0, rx = 0.0;
@@ -1722,11 +3389,11 @@ void getInterfaces(const int sock)
 	// Get interface with default route
 	in_addr_t gw = 0;
 	char default_iface[IF_NAMESIZE] = { 0 };
-	getDefaultInterface(default_iface, &gw);
+	get_default_route(default_iface, &gw);
 
 	// Enumerate and list interfaces
-	struct if_info *ifinfo = NULL;
-	if(!listInterfaces(&ifinfo, default_iface))
+	struct if_info *ifinfo = get_interfaces(default_iface);
+	if(ifinfo == NULL)
 	{
 		ssend(sock, "ERROR");
 		return;
@@ -1750,16 +3417,141 @@ void getInterfaces(const int sock)
 	{
 		if(!iface->default_iface)
 			send_iface(sock, iface);
+		iface = iface->next;
+	}
+
+	// Free associated memory
+	free_interfaces(ifinfo);
+}
+
+void getHeavyHitters(const char *client_message, const int sock, const bool istelnet)
+{
+	int count = HH_CLIENT_TOPK, num;
+	const bool clientmode = command(client_message, ">top-client-domains");
+
+	// Exit before processing any data if requested via config setting
+	refresh_privacy_level();
+	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS)
+		return;
 
-		// Free associated memory
-		struct if_info *next = iface->next;
-		if(iface->name)
-			free(iface->name);
-		if(iface->ip.v4)
-			free(iface->ip.v4);
-		if(iface->ip.v6)
-			free(iface->ip.v6);
-		free(iface);
-		iface = next;
+	// example: >top-client-domains 192.168.2.5 (3)
+	if(sscanf(client_message, "%*[^(](%i)", &num) > 0)
+		count = num;
+
+	char name[256] = { 0 };
+	if(sscanf(client_message, clientmode ? ">top-client-domains %255s" : ">top-domain-clients %255s", name) < 1 ||
+	   name[0] == '(')
+	{
+		if(istelnet)
+			ssend(sock, "Missing %s\n", clientmode ? "client" : "domain");
+		return;
+	}
+
+	heavyHitter sorted[HH_CLIENT_TOPK];
+	unsigned int n = 0;
+	if(clientmode)
+	{
+		// Try to find the client by its IP address first and fall back to
+		// matching its host name
+		int clientID = find_client_lookup(name, false);
+		for(int i = 0; clientID < 0 && i < counters->clients; i++)
+		{
+			const clientsData *client = getClient(i, true);
+			if(client != NULL && client->namepos != 0 &&
+			   strcasecmp(getstr(client->namepos), name) == 0)
+				clientID = i;
+		}
+
+		const clientsData *client = getClient(clientID, true);
+		if(client != NULL)
+			n = heavy_hitters_sorted(client->topdomains, HH_CLIENT_TOPK, sorted);
+	}
+	else
+	{
+		// Clients are hidden from here on
+		if(config.privacylevel >= PRIVACY_HIDE_DOMAINS_CLIENTS)
+			return;
+
+		const domainsData *domain = getDomain(find_domain_lookup(hashStr(name), name), true);
+		if(domain != NULL)
+			n = heavy_hitters_sorted(domain->topclients, HH_DOMAIN_TOPK, sorted);
+	}
+
+	for(unsigned int i = 0; i < n && (int)i < count; i++)
+	{
+		const char *str = NULL;
+		if(clientmode)
+		{
+			const domainsData *domain = getDomain(sorted[i].id, true);
+			if(domain != NULL)
+				str = getstr(domain->domainpos);
+		}
+		else
+		{
+			const clientsData *client = getClient(sorted[i].id, true);
+			if(client != NULL)
+				str = getstr(client->ippos);
+		}
+
+		// Skip entries recycled in the meantime
+		if(str == NULL)
+			continue;
+
+		if(istelnet)
+			ssend(sock, "%u %i %s\n", i, sorted[i].count, str);
+		else
+		{
+			if(!pack_str32(sock, str))
+				break;
+			pack_int32(sock, sorted[i].count);
+		}
+	}
+}
+
+void searchDomains(const char *client_message, const int sock, const bool istelnet)
+{
+	int count = 100, num;
+
+	// Exit before processing any data if requested via config setting
+	refresh_privacy_level();
+	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS)
+		return;
+
+	// example: >search-domains *tracking* (20)
+	if(sscanf(client_message, "%*[^(](%i)", &num) > 0 && num > 0)
+		count = num;
+
+	char pattern[128] = { 0 };
+	if(sscanf(client_message, ">search-domains %127s", pattern) < 1 || pattern[0] == '(')
+	{
+		if(istelnet)
+			ssend(sock, "Missing search pattern\n");
+		return;
 	}
+
+	// Domains are stored in lower case
+	strtolower(pattern);
+
+	int *ids = calloc(count, sizeof(int));
+	if(ids == NULL)
+		return;
+
+	const int found = search_domains(pattern, ids, count);
+	for(int i = 0; i < found; i++)
+	{
+		const domainsData *domain = getDomain(ids[i], true);
+		if(domain == NULL)
+			continue;
+
+		if(istelnet)
+			ssend(sock, "%i %s\n", domain->count, getstr(domain->domainpos));
+		else
+		{
+			if(!pack_str32(sock, getstr(domain->domainpos)))
+				break;
+			pack_int32(sock, domain->count);
+		}
+	}
+
+	free(ids);
 }
\ No newline at end of file
@@ -12,20 +12,40 @@
 
 // Statistic methods
 void getStats(const int sock, const bool istelnet);
-void getOverTime(const int sock, const bool istelnet);
+void getOverTime(const char *client_message, const int sock, const bool istelnet);
+void getUniqueOverTime(const int sock, const bool istelnet);
+void getUnique(const char *client_message, const int sock, const bool istelnet);
 void getTopDomains(const char *client_message, const int sock, const bool istelnet);
 void getTopClients(const char *client_message, const int sock, const bool istelnet);
+void getHeavyHitters(const char *client_message, const int sock, const bool istelnet);
+void searchDomains(const char *client_message, const int sock, const bool istelnet);
 void getUpstreamDestinations(const char *client_message, const int sock, const bool istelnet);
+void getUpstreamResponseTimes(const char *client_message, const int sock, const bool istelnet);
 void getQueryTypes(const int sock, const bool istelnet);
-void getAllQueries(const char *client_message, const int sock, const bool istelnet);
+void getAllQueries(const char *client_message, const int sock, const bool istelnet, const time_t since);
+time_t getOldQueries(const char *client_message, const int sock, const bool istelnet, const time_t since);
+int sendQuery(const int sock, const bool istelnet, const int queryID);
+void query_dict_begin(const char *client_message, const bool istelnet);
+void query_dict_end(void);
 void getRecentBlocked(const char *client_message, const int sock, const bool istelnet);
-void getClientsOverTime(const int sock, const bool istelnet);
+void getClientsOverTime(const char *client_message, const int sock, const bool istelnet);
 void getClientNames(const int sock, const bool istelnet);
 
 // FTL methods
 void getClientID(const int sock, const bool istelnet);
 void getVersion(const int sock, const bool istelnet);
 void getDBstats(const int sock, const bool istelnet);
+void getStringsInfo(const int sock, const bool istelnet);
+void getShmemInfo(const int sock, const bool istelnet);
+void getShmemUsage(const int sock, const bool istelnet);
+void getLockStats(const int sock, const bool istelnet);
+void getRegexStats(const int sock, const bool istelnet);
+void getDBLatency(const int sock, const bool istelnet);
+void getAllocStats(const int sock, const bool istelnet);
+void getProcessMemory(const int sock, const bool istelnet);
+void getTimers(const char *client_message, const int sock, const bool istelnet);
+void getQueryStages(const char *client_message, const int sock, const bool istelnet);
+void getMetrics(const int sock);
 void getUnknownQueries(const int sock, const bool istelnet);
 void getMAXLOGAGE(const int sock);
 void getGateway(const int sock);
@@ -33,12 +53,14 @@ void getInterfaces(const int sock);
 
 // DNS resolver methods (dnsmasq_interface.c)
 void getCacheInformation(const int sock);
+void getDNSMetrics(const int sock);
 void getDNSport(const int sock);
 
 // MessagePack serialization helpers
 void pack_eom(const int sock);
 void pack_bool(const int sock, const bool value);
 void pack_uint8(const int sock, const uint8_t value);
+void pack_uint(const int sock, const uint32_t value);
 void pack_uint64(const int sock, const uint64_t value);
 void pack_int32(const int sock, const int32_t value);
 void pack_int64(const int sock, const int64_t value);
@@ -46,6 +68,8 @@ void pack_float(const int sock, const float value);
 bool pack_fixstr(const int sock, const char *string);
 bool pack_str32(const int sock, const char *string);
 void pack_map16_start(const int sock, const uint16_t length);
+void pack_bin32_start(const int sock, const uint32_t length);
+void pack_int32_array(const int sock, const int32_t *values, const uint32_t n);
 
 // DHCP lease management
 void delete_lease(const char *client_message, const int sock);
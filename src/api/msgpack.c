@@ -16,12 +16,15 @@
 void pack_eom(const int sock) {
 	// This byte is explicitly never used in the MessagePack spec, so it is perfect to use as an EOM for this API.
 	uint8_t eom = 0xc1;
-	write(sock, &eom, sizeof(eom));
+	swrite(sock, &eom, sizeof(eom));
 }
 
 static void pack_basic(const int sock, const uint8_t format, const void *value, const size_t size) {
-	write(sock, &format, sizeof(format));
-	write(sock, value, size);
+	// Assemble format and value so they are appended to the output buffer at once
+	uint8_t packed[1 + sizeof(uint64_t)];
+	packed[0] = format;
+	memcpy(packed + 1, value, size);
+	swrite(sock, packed, 1 + size);
 }
 
 static uint64_t __attribute__((const)) leToBe64(const uint64_t value) {
@@ -42,13 +45,33 @@ static uint64_t __attribute__((const)) leToBe64(const uint64_t value) {
 
 void pack_bool(const int sock, const bool value) {
 	uint8_t packed = (uint8_t) (value ? 0xc3 : 0xc2);
-	write(sock, &packed, sizeof(packed));
+	swrite(sock, &packed, sizeof(packed));
 }
 
 void pack_uint8(const int sock, const uint8_t value) {
 	pack_basic(sock, 0xcc, &value, sizeof(value));
 }
 
+// Use the smallest encoding (positive fixint, uint8, uint16 or uint32)
+void pack_uint(const int sock, const uint32_t value) {
+	if(value < 0x80) {
+		const uint8_t packed = (uint8_t) value;
+		swrite(sock, &packed, sizeof(packed));
+	}
+	else if(value <= 0xff) {
+		const uint8_t packed = (uint8_t) value;
+		pack_basic(sock, 0xcc, &packed, sizeof(packed));
+	}
+	else if(value <= 0xffff) {
+		const uint16_t bigEValue = htons((uint16_t) value);
+		pack_basic(sock, 0xcd, &bigEValue, sizeof(bigEValue));
+	}
+	else {
+		const uint32_t bigEValue = htonl(value);
+		pack_basic(sock, 0xce, &bigEValue, sizeof(bigEValue));
+	}
+}
+
 void pack_uint64(const int sock, const uint64_t value) {
 	const uint64_t bigEValue = leToBe64(value);
 	pack_basic(sock, 0xcf, &bigEValue, sizeof(bigEValue));
@@ -87,8 +110,8 @@ bool pack_fixstr(const int sock, const char *string) {
 	}
 
 	const uint8_t format = (uint8_t) (0xA0 | length);
-	write(sock, &format, sizeof(format));
-	write(sock, string, length);
+	swrite(sock, &format, sizeof(format));
+	swrite(sock, string, length);
 
 	return true;
 }
@@ -104,17 +127,38 @@ bool pack_str32(const int sock, const char *string) {
 	}
 
 	const uint8_t format = 0xdb;
-	write(sock, &format, sizeof(format));
+	swrite(sock, &format, sizeof(format));
 	const uint32_t bigELength = htonl((uint32_t) length);
-	write(sock, &bigELength, sizeof(bigELength));
-	write(sock, string, length);
+	swrite(sock, &bigELength, sizeof(bigELength));
+	swrite(sock, string, length);
 
 	return true;
 }
 
 void pack_map16_start(const int sock, const uint16_t length) {
 	const uint8_t format = 0xde;
-	write(sock, &format, sizeof(format));
+	swrite(sock, &format, sizeof(format));
 	const uint16_t bigELength = htons(length);
-	write(sock, &bigELength, sizeof(bigELength));
+	swrite(sock, &bigELength, sizeof(bigELength));
+}
+
+void pack_bin32_start(const int sock, const uint32_t length) {
+	const uint8_t format = 0xc6;
+	swrite(sock, &format, sizeof(format));
+	const uint32_t bigELength = htonl(length);
+	swrite(sock, &bigELength, sizeof(bigELength));
+}
+
+// Send an array of int32 values as bin32 object holding the little-endian
+// values back to back. This is a plain copy on little-endian hosts
+void pack_int32_array(const int sock, const int32_t *values, const uint32_t n) {
+	pack_bin32_start(sock, n * sizeof(int32_t));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	swrite(sock, values, n * sizeof(int32_t));
+#else
+	for(uint32_t i = 0; i < n; i++) {
+		const uint32_t littleEValue = htole32((uint32_t) values[i]);
+		swrite(sock, &littleEValue, sizeof(littleEValue));
+	}
+#endif
 }
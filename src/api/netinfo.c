@@ -0,0 +1,572 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Interface and default route cache
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "../FTL.h"
+#include "netinfo.h"
+// logg()
+#include "../log.h"
+// struct config
+#include "../config.h"
+#include <linux/rtnetlink.h>
+#include <linux/route.h>
+
+// The dashboard polls the interfaces and the gateway every few seconds.
+// Instead of walking /sys/class/net, calling getifaddrs() and parsing
+// /proc/net/route for each request, we keep the interfaces, their addresses
+// and the default route in memory. They are only re-read after the kernel
+// announced a change through rtnetlink. The byte counters are refreshed with
+// a single RTM_GETLINK dump at most once every NETINFO_STATS_MSEC
+#define NETINFO_STATS_MSEC 1000u
+
+struct netinfo_iface {
+	int ifindex;
+	bool carrier;
+	int speed;
+	ssize_t rx_bytes;
+	ssize_t tx_bytes;
+	char name[IF_NAMESIZE];
+	char *v4;
+	char *v6;
+	sa_family_t family;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	int fd;
+	bool subscribed;
+	bool links_valid;
+	bool addrs_valid;
+	bool route_valid;
+	uint64_t stats_updated;
+	struct netinfo_iface *ifaces;
+	unsigned int count;
+	char gw_iface[IF_NAMESIZE];
+	in_addr_t gw;
+} netinfo = { .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1 };
+
+static uint64_t now_msec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+// Subscribe to link, address and IPv4 route changes. If this is not
+// possible, everything is read again for each request as before
+static void open_event_socket(void)
+{
+	const int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+	if(fd < 0)
+	{
+		logg("WARN: Cannot open netlink socket: %s", strerror(errno));
+		return;
+	}
+
+	struct sockaddr_nl local = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR | RTMGRP_IPV4_ROUTE
+	};
+	if(bind(fd, (struct sockaddr*)&local, sizeof(local)) < 0)
+	{
+		logg("WARN: Cannot subscribe to interface changes: %s", strerror(errno));
+		close(fd);
+		return;
+	}
+
+	netinfo.fd = fd;
+}
+
+// Invalidate what has been changed according to the events received since
+// the last request
+static void process_events(void)
+{
+	if(netinfo.fd < 0)
+	{
+		netinfo.links_valid = netinfo.addrs_valid = netinfo.route_valid = false;
+		return;
+	}
+
+	char buffer[8192] __attribute__ ((aligned(NLMSG_ALIGNTO)));
+	while(true)
+	{
+		ssize_t len = recv(netinfo.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+		if(len < 0)
+		{
+			// We missed events when the receive buffer overflowed
+			if(errno == ENOBUFS)
+			{
+				netinfo.links_valid = netinfo.addrs_valid = netinfo.route_valid = false;
+				continue;
+			}
+			break;
+		}
+
+		for(struct nlmsghdr *nlh = (struct nlmsghdr*)(void*)buffer; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len))
+		{
+			switch(nlh->nlmsg_type)
+			{
+				case RTM_NEWLINK:
+				case RTM_DELLINK:
+					// Addresses are listed per interface name
+					netinfo.links_valid = false;
+					netinfo.addrs_valid = false;
+					break;
+				case RTM_NEWADDR:
+				case RTM_DELADDR:
+					netinfo.addrs_valid = false;
+					break;
+				case RTM_NEWROUTE:
+				case RTM_DELROUTE:
+					netinfo.route_valid = false;
+					break;
+				default:
+					break;
+			}
+		}
+	}
+}
+
+// Get IPv4 default route gateway and associated interface from
+// /proc/net/route - the kernel's IPv4 routing table
+static void read_default_route(void)
+{
+	long dest_r = 0, gw_r = 0;
+	int flags = 0, metric = 0, minmetric = __INT_MAX__;
+	char iface_r[IF_NAMESIZE] = { 0 };
+	char buf[1024] = { 0 };
+
+	netinfo.gw = 0;
+	netinfo.gw_iface[0] = '\0';
+
+	FILE *file;
+	if((file = fopen("/proc/net/route", "r")))
+	{
+		while(fgets(buf, sizeof(buf), file))
+		{
+			if(sscanf(buf, "%15s %lx %lx %x %*i %*i %i", iface_r, &dest_r, &gw_r, &flags, &metric) != 5)
+				continue;
+
+			// Only analyze routes which are UP and whose
+			// destinations are a gateway
+			if(!(flags & RTF_UP) || !(flags & RTF_GATEWAY))
+				continue;
+
+			// Only analyze "catch all" routes (destination 0.0.0.0)
+			if(dest_r != 0)
+				continue;
+
+			// Store default gateway, overwrite if we find a route with
+			// a lower metric
+			if(metric < minmetric)
+			{
+				minmetric = metric;
+				netinfo.gw = gw_r;
+				strcpy(netinfo.gw_iface, iface_r);
+
+				if(config.debug & DEBUG_API)
+					logg("Reading interfaces: flags: %i, addr: %s, iface: %s, metric: %i, minmetric: %i",
+					     flags, inet_ntoa(*(struct in_addr *) &netinfo.gw), netinfo.gw_iface, metric, minmetric);
+			}
+		}
+		fclose(file);
+	}
+	else
+		logg("Cannot read /proc/net/route: %s", strerror(errno));
+}
+
+// Link speed (may not be available, e.g., for WiFi devices with dynamic link
+// speeds). This is only read when the interface changed
+static int read_speed(const char *name)
+{
+	char fname[64 + IF_NAMESIZE] = { 0 };
+	int speed = -1;
+	snprintf(fname, sizeof(fname)-1, "/sys/class/net/%s/speed", name);
+	FILE *f;
+	if((f = fopen(fname, "r")) != NULL)
+	{
+		if(fscanf(f, "%i", &speed) != 1)
+			speed = -1;
+		fclose(f);
+	}
+	else
+		logg("Cannot read %s: %s", fname, strerror(errno));
+
+	return speed;
+}
+
+static void free_addresses(void)
+{
+	for(unsigned int i = 0; i < netinfo.count; i++)
+	{
+		free(netinfo.ifaces[i].v4);
+		free(netinfo.ifaces[i].v6);
+		netinfo.ifaces[i].v4 = netinfo.ifaces[i].v6 = NULL;
+		netinfo.ifaces[i].family = 0;
+	}
+}
+
+// Store name, carrier and byte counters of one RTM_NEWLINK message. The
+// speed and the addresses are kept from the previous list as long as the
+// interface did not change
+static bool add_link(struct nlmsghdr *nlh, struct netinfo_iface **list, unsigned int *count, unsigned int *size)
+{
+	const struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+	struct netinfo_iface iface = { .ifindex = ifi->ifi_index, .speed = -1, .rx_bytes = -1, .tx_bytes = -1 };
+	bool carrier = false;
+
+	int len = (int)nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi));
+	for(struct rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+	{
+		switch(rta->rta_type)
+		{
+			case IFLA_IFNAME:
+				strncpy(iface.name, RTA_DATA(rta), IF_NAMESIZE - 1);
+				break;
+			case IFLA_CARRIER:
+				carrier = *(unsigned char*)RTA_DATA(rta) != 0;
+				break;
+			case IFLA_STATS64:
+			{
+				struct rtnl_link_stats64 stats;
+				memcpy(&stats, RTA_DATA(rta), sizeof(stats));
+				iface.rx_bytes = stats.rx_bytes;
+				iface.tx_bytes = stats.tx_bytes;
+				break;
+			}
+			case IFLA_STATS:
+				// Only use the 32 bit counters if there are no 64 bit ones
+				if(iface.rx_bytes == -1)
+				{
+					struct rtnl_link_stats stats;
+					memcpy(&stats, RTA_DATA(rta), sizeof(stats));
+					iface.rx_bytes = stats.rx_bytes;
+					iface.tx_bytes = stats.tx_bytes;
+				}
+				break;
+			default:
+				break;
+		}
+	}
+
+	// The carrier is only meaningful for interfaces which are up
+	iface.carrier = (ifi->ifi_flags & IFF_UP) && carrier;
+
+	// Keep what we know about this interface unless it changed
+	for(unsigned int i = 0; i < netinfo.count; i++)
+	{
+		struct netinfo_iface *old = &netinfo.ifaces[i];
+		if(old->ifindex != iface.ifindex || strcmp(old->name, iface.name) != 0)
+			continue;
+
+		if(netinfo.links_valid)
+			iface.speed = old->speed;
+		if(netinfo.addrs_valid)
+		{
+			iface.v4 = old->v4;
+			iface.v6 = old->v6;
+			iface.family = old->family;
+			old->v4 = old->v6 = NULL;
+		}
+		break;
+	}
+
+	if(!netinfo.links_valid)
+		iface.speed = read_speed(iface.name);
+
+	if(*count >= *size)
+	{
+		const unsigned int newsize = *size > 0 ? 2 * *size : 16u;
+		struct netinfo_iface *new = realloc(*list, newsize * sizeof(struct netinfo_iface));
+		if(new == NULL)
+		{
+			free(iface.v4);
+			free(iface.v6);
+			return false;
+		}
+		*list = new;
+		*size = newsize;
+	}
+	(*list)[(*count)++] = iface;
+
+	return true;
+}
+
+// Read all interfaces through rtnetlink (RTM_GETLINK dump). This returns the
+// same interfaces as /sys/class/net including their byte counters
+static bool read_links(void)
+{
+	const int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if(fd < 0)
+	{
+		logg("WARN: Cannot open netlink socket: %s", strerror(errno));
+		return false;
+	}
+
+	struct {
+		struct nlmsghdr nlh;
+		struct ifinfomsg ifi;
+	} req = {
+		.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg)),
+		.nlh.nlmsg_type = RTM_GETLINK,
+		.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+		.nlh.nlmsg_seq = (unsigned int)time(NULL),
+		.ifi.ifi_family = AF_UNSPEC
+	};
+	struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+	if(sendto(fd, &req, req.nlh.nlmsg_len, 0, (struct sockaddr*)&kernel, sizeof(kernel)) < 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	struct netinfo_iface *list = NULL;
+	unsigned int count = 0u, size = 0u;
+	bool done = false, okay = true;
+	char buffer[32768] __attribute__ ((aligned(NLMSG_ALIGNTO)));
+	while(!done && okay)
+	{
+		ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+		if(len <= 0)
+		{
+			okay = false;
+			break;
+		}
+
+		for(struct nlmsghdr *nlh = (struct nlmsghdr*)(void*)buffer; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len))
+		{
+			if(nlh->nlmsg_seq != req.nlh.nlmsg_seq)
+				continue;
+
+			if(nlh->nlmsg_type == NLMSG_DONE)
+			{
+				done = true;
+				break;
+			}
+			else if(nlh->nlmsg_type == NLMSG_ERROR)
+			{
+				const struct nlmsgerr *err = NLMSG_DATA(nlh);
+				logg("WARN: Reading the interfaces failed: %s", strerror(-err->error));
+				okay = false;
+				break;
+			}
+			else if(nlh->nlmsg_type == RTM_NEWLINK &&
+			        !add_link(nlh, &list, &count, &size))
+			{
+				okay = false;
+				break;
+			}
+		}
+	}
+	close(fd);
+
+	if(!okay || !done)
+	{
+		for(unsigned int i = 0; i < count; i++)
+		{
+			free(list[i].v4);
+			free(list[i].v6);
+		}
+		free(list);
+		return false;
+	}
+
+	// Addresses not taken over belonged to interfaces which are gone
+	free_addresses();
+	free(netinfo.ifaces);
+	netinfo.ifaces = list;
+	netinfo.count = count;
+	netinfo.links_valid = true;
+
+	return true;
+}
+
+// Append an address to a comma-separated list
+static void append_address(char **list, const char *host)
+{
+	if(*list == NULL)
+	{
+		// First or only address of this interface
+		*list = strdup(host);
+		return;
+	}
+
+	char *new = calloc(strlen(*list) + strlen(host) + 2, sizeof(char));
+	if(new == NULL)
+		return;
+	sprintf(new, "%s,%s", *list, host);
+	free(*list);
+	*list = new;
+}
+
+// Get IP addresses of all interfaces on this machine
+static void read_addresses(void)
+{
+	struct ifaddrs *ifap = NULL;
+	if(getifaddrs(&ifap) == -1)
+	{
+		logg("API error: Cannot get interface addresses: %s", strerror(errno));
+		return;
+	}
+
+	free_addresses();
+
+	// Walk through linked list of interface addresses
+	for(struct ifaddrs *ifa = ifap; ifa != NULL; ifa = ifa->ifa_next)
+	{
+		// Skip interfaces without an address
+		if(ifa->ifa_addr == NULL)
+			continue;
+
+		struct netinfo_iface *iface = NULL;
+		for(unsigned int i = 0; i < netinfo.count; i++)
+			if(strcmp(ifa->ifa_name, netinfo.ifaces[i].name) == 0)
+			{
+				iface = &netinfo.ifaces[i];
+				break;
+			}
+		if(iface == NULL)
+			continue;
+
+		// If we reach this point, we found the correct interface
+		iface->family = ifa->ifa_addr->sa_family;
+		if(iface->family != AF_INET && iface->family != AF_INET6)
+			continue;
+
+		// Get IP address
+		char host[NI_MAXHOST] = { 0 };
+		const int s = getnameinfo(ifa->ifa_addr,
+		                          (iface->family == AF_INET) ?
+		                               sizeof(struct sockaddr_in) :
+		                               sizeof(struct sockaddr_in6),
+		                          host, NI_MAXHOST,
+		                          NULL, 0, NI_NUMERICHOST);
+		if (s != 0)
+		{
+			logg("API warning: getnameinfo() failed: %s\n", gai_strerror(s));
+			continue;
+		}
+
+		append_address(iface->family == AF_INET ? &iface->v4 : &iface->v6, host);
+	}
+
+	freeifaddrs(ifap);
+	netinfo.addrs_valid = true;
+}
+
+// Subscribe to changes on first use and invalidate what has been changed
+// since the last request. Has to be called with the lock held
+static void update(void)
+{
+	if(!netinfo.subscribed)
+	{
+		open_event_socket();
+		netinfo.subscribed = true;
+	}
+
+	process_events();
+
+	if(!netinfo.route_valid)
+	{
+		read_default_route();
+		netinfo.route_valid = netinfo.fd > -1;
+	}
+}
+
+bool get_default_route(char iface[IF_NAMESIZE], in_addr_t *gw)
+{
+	pthread_mutex_lock(&netinfo.lock);
+	update();
+	*gw = netinfo.gw;
+	strcpy(iface, netinfo.gw_iface);
+	pthread_mutex_unlock(&netinfo.lock);
+
+	// Return success based on having found the default gateway's address
+	return *gw != 0;
+}
+
+// Return a copy of the cached interfaces followed by a "sum" entry. The list
+// has to be freed with free_interfaces()
+struct if_info *get_interfaces(const char default_iface[IF_NAMESIZE])
+{
+	struct if_info *head = NULL, *tail = NULL;
+	size_t tx_sum = 0, rx_sum = 0;
+
+	pthread_mutex_lock(&netinfo.lock);
+	update();
+
+	const uint64_t now = now_msec();
+	if(!netinfo.links_valid || now - netinfo.stats_updated >= NETINFO_STATS_MSEC)
+	{
+		if(read_links())
+			netinfo.stats_updated = now;
+	}
+
+	if(!netinfo.addrs_valid)
+		read_addresses();
+
+	for(unsigned int i = 0; i <= netinfo.count; i++)
+	{
+		struct if_info *new = calloc(1, sizeof(struct if_info));
+		if(new == NULL)
+			break;
+
+		if(i < netinfo.count)
+		{
+			const struct netinfo_iface *iface = &netinfo.ifaces[i];
+			new->name = strdup(iface->name);
+			new->default_iface = strcmp(iface->name, default_iface) == 0;
+			new->carrier = iface->carrier;
+			new->speed = iface->speed;
+			new->rx_bytes = iface->rx_bytes;
+			new->tx_bytes = iface->tx_bytes;
+			new->family = iface->family;
+			new->ip.v4 = iface->v4 ? strdup(iface->v4) : NULL;
+			new->ip.v6 = iface->v6 ? strdup(iface->v6) : NULL;
+
+			tx_sum += new->tx_bytes;
+			rx_sum += new->rx_bytes;
+		}
+		else
+		{
+			// Sum entry
+			new->name = strdup("sum");
+			new->carrier = true;
+			new->speed = 0;
+			new->tx_bytes = tx_sum;
+			new->rx_bytes = rx_sum;
+		}
+
+		// Add to end of the linked list
+		if(!head)
+			head = new;
+		if(tail)
+			tail->next = new;
+		tail = new;
+	}
+	pthread_mutex_unlock(&netinfo.lock);
+
+	return head;
+}
+
+void free_interfaces(struct if_info *head)
+{
+	while(head)
+	{
+		struct if_info *next = head->next;
+		if(head->name)
+			free(head->name);
+		if(head->ip.v4)
+			free(head->ip.v4);
+		if(head->ip.v6)
+			free(head->ip.v6);
+		free(head);
+		head = next;
+	}
+}
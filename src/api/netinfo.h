@@ -0,0 +1,36 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Interface and default route cache prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef NETINFO_H
+#define NETINFO_H
+
+#include <stdbool.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+struct if_info {
+	bool carrier;
+	bool default_iface;
+	char *name;
+	struct {
+		char *v4;
+		char *v6;
+	} ip;
+	int speed;
+	ssize_t rx_bytes;
+	ssize_t tx_bytes;
+	sa_family_t family;
+	struct if_info *next;
+};
+
+bool get_default_route(char iface[IF_NAMESIZE], in_addr_t *gw);
+struct if_info *get_interfaces(const char default_iface[IF_NAMESIZE]);
+void free_interfaces(struct if_info *head);
+
+#endif //NETINFO_H
@@ -21,169 +21,710 @@
 // Eventqueue routines
 #include "../events.h"
 #include "../config.h"
+// stream_subscribe()
+#include "stream.h"
+// respcache_begin()
+#include "respcache.h"
+// monotonic_usec()
+#include "../histogram.h"
+// hashStr()
+#include "../datastructure.h"
+// set_debug_limit()
+#include "../debuglimit.h"
+// lua_report_run()
+#include "../lua/report.h"
+// getClusterStats()
+#include "../federation.h"
+// getGravityArtifact()
+#include "../database/gravity-replica.h"
+#include <stdatomic.h>
 
 bool __attribute__((pure)) command(const char *client_message, const char* cmd) {
 	return strstr(client_message, cmd) != NULL;
 }
 
-bool process_request(const char *client_message, const int sock, const bool istelnet)
+// Parsed API request. The command is the first token of the message, the
+// arguments everything following it
+struct api_request {
+	const char *message;
+	const char *args;
+	int sock;
+	bool istelnet;
+};
+
+enum api_lock {
+	API_LOCK_NONE,
+	API_LOCK_SHARED,
+	API_LOCK_EXCLUSIVE
+};
+
+// Handlers return true if the connection should be closed afterwards
+typedef bool (*api_handler)(const struct api_request *req);
+
+struct api_command {
+	const char *name;
+	api_handler handler;
+	// Lock taken by the dispatcher around the handler
+	enum api_lock lock;
+	// Cached responses, RESPCACHE_NONE for commands without caching
+	enum respcache_type cache;
+};
+
+// Number of calls and time spent in each command
+struct api_command_stats {
+	atomic_uint_fast64_t calls;
+	atomic_uint_fast64_t usec;
+	atomic_uint_fast64_t max_usec;
+};
+
+static bool api_stats(const struct api_request *req)
 {
-	char EOT[2];
-	EOT[0] = 0x04;
-	EOT[1] = 0x00;
-	bool processed = false;
+	getStats(req->sock, req->istelnet);
+	return false;
+}
 
-	if(command(client_message, ">stats"))
-	{
-		processed = true;
-		lock_shm();
-		getStats(sock, istelnet);
-		unlock_shm();
-	}
-	else if(command(client_message, ">overTime"))
-	{
-		processed = true;
-		lock_shm();
-		getOverTime(sock, istelnet);
-		unlock_shm();
-	}
-	else if(command(client_message, ">top-domains") || command(client_message, ">top-ads"))
-	{
-		processed = true;
-		lock_shm();
-		getTopDomains(client_message, sock, istelnet);
-		unlock_shm();
-	}
-	else if(command(client_message, ">top-clients"))
-	{
-		processed = true;
-		lock_shm();
-		getTopClients(client_message, sock, istelnet);
-		unlock_shm();
-	}
-	else if(command(client_message, ">forward-dest"))
-	{
-		processed = true;
-		lock_shm();
-		getUpstreamDestinations(client_message, sock, istelnet);
-		unlock_shm();
-	}
-	else if(command(client_message, ">forward-names"))
-	{
-		processed = true;
-		lock_shm();
-		getUpstreamDestinations(">forward-dest unsorted", sock, istelnet);
-		unlock_shm();
-	}
-	else if(command(client_message, ">querytypes"))
-	{
-		processed = true;
-		lock_shm();
-		getQueryTypes(sock, istelnet);
-		unlock_shm();
-	}
-	else if(command(client_message, ">getallqueries"))
-	{
-		processed = true;
-		lock_shm();
-		getAllQueries(client_message, sock, istelnet);
-		unlock_shm();
-	}
-	else if(command(client_message, ">recentBlocked"))
-	{
-		processed = true;
-		lock_shm();
-		getRecentBlocked(client_message, sock, istelnet);
-		unlock_shm();
-	}
-	else if(command(client_message, ">clientID"))
-	{
-		processed = true;
-		lock_shm();
-		getClientID(sock, istelnet);
-		unlock_shm();
-	}
-	else if(command(client_message, ">version"))
-	{
-		processed = true;
-		// No lock required
-		getVersion(sock, istelnet);
-	}
-	else if(command(client_message, ">dbstats"))
-	{
-		processed = true;
-		// No lock required. Access to the database
-		// is guaranteed to be atomic
-		getDBstats(sock, istelnet);
-	}
-	else if(command(client_message, ">ClientsoverTime"))
-	{
-		processed = true;
-		lock_shm();
-		getClientsOverTime(sock, istelnet);
-		unlock_shm();
-	}
-	else if(command(client_message, ">client-names"))
+static bool api_overtime(const struct api_request *req)
+{
+	getOverTime(req->message, req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_unique_overtime(const struct api_request *req)
+{
+	getUniqueOverTime(req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_unique(const struct api_request *req)
+{
+	getUnique(req->message, req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_top_domains(const struct api_request *req)
+{
+	// >top-ads is distinguished by getTopDomains() itself
+	getTopDomains(req->message, req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_top_clients(const struct api_request *req)
+{
+	getTopClients(req->message, req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_heavy_hitters(const struct api_request *req)
+{
+	getHeavyHitters(req->message, req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_search_domains(const struct api_request *req)
+{
+	searchDomains(req->message, req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_forward_dest(const struct api_request *req)
+{
+	getUpstreamDestinations(req->message, req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_forward_names(const struct api_request *req)
+{
+	getUpstreamDestinations(">forward-dest unsorted", req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_upstream_rtime(const struct api_request *req)
+{
+	getUpstreamResponseTimes(req->message, req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_querytypes(const struct api_request *req)
+{
+	getQueryTypes(req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_getallqueries(const struct api_request *req)
+{
+	query_dict_begin(req->message, req->istelnet);
+	getAllQueries(req->message, req->sock, req->istelnet, 0);
+	query_dict_end();
+	return false;
+}
+
+static bool api_getallqueries_time(const struct api_request *req)
+{
+	// Queries no longer in memory are read from the database before taking
+	// the lock, those evicted meanwhile after taking it
+	query_dict_begin(req->message, req->istelnet);
+	time_t since = getOldQueries(req->message, req->sock, req->istelnet, 0);
+	lock_shm_shared();
+	since = getOldQueries(req->message, req->sock, req->istelnet, since);
+	getAllQueries(req->message, req->sock, req->istelnet, since);
+	unlock_shm_shared();
+	query_dict_end();
+	return false;
+}
+
+static bool api_recentblocked(const struct api_request *req)
+{
+	getRecentBlocked(req->message, req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_clientid(const struct api_request *req)
+{
+	getClientID(req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_version(const struct api_request *req)
+{
+	getVersion(req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_dbstats(const struct api_request *req)
+{
+	// Access to the database is guaranteed to be atomic
+	getDBstats(req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_strings(const struct api_request *req)
+{
+	getStringsInfo(req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_shmem(const struct api_request *req)
+{
+	getShmemInfo(req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_shmem_usage(const struct api_request *req)
+{
+	getShmemUsage(req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_lockstats(const struct api_request *req)
+{
+	// Lock statistics are local to this process
+	getLockStats(req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_dblatency(const struct api_request *req)
+{
+	// Latency statistics are local to this process
+	getDBLatency(req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_allocstats(const struct api_request *req)
+{
+	// Allocation statistics are local to this process
+	getAllocStats(req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_memory(const struct api_request *req)
+{
+	// Reads /proc and needs no lock
+	getProcessMemory(req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_timers(const struct api_request *req)
+{
+	// Timer statistics are local to this process
+	getTimers(req->message, req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_querystages(const struct api_request *req)
+{
+	getQueryStages(req->message, req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_metrics(const struct api_request *req)
+{
+	// Only the upstream statistics need the lock,
+	// getMetrics() takes it itself
+	if(req->istelnet)
+		getMetrics(req->sock);
+	return false;
+}
+
+static bool api_regexstats(const struct api_request *req)
+{
+	// Regex are reloaded while holding the lock
+	getRegexStats(req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_clientsovertime(const struct api_request *req)
+{
+	getClientsOverTime(req->message, req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_client_names(const struct api_request *req)
+{
+	getClientNames(req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_unknown(const struct api_request *req)
+{
+	getUnknownQueries(req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_cacheinfo(const struct api_request *req)
+{
+	getCacheInformation(req->sock);
+	return false;
+}
+
+static bool api_reresolve(const struct api_request *req)
+{
+	logg("Received API request to re-resolve host names");
+	set_event(RELOAD_PRIVACY_LEVEL);
+	return false;
+}
+
+static bool api_recompile_regex(const struct api_request *req)
+{
+	logg("Received API request to recompile regex");
+	// Reread regex.list
+	// Read and compile possible regex filters
+	read_regex_from_database();
+	return false;
+}
+
+static bool api_reload_config(const struct api_request *req)
+{
+	logg("Received API request to reload the config file");
+	const unsigned int restart = reload_FTLconf();
+	// Flush the verdicts of the old blocking mode
+	set_event(RELOAD_GRAVITY);
+	if(req->istelnet)
+		ssend(req->sock, "restart-needed %u\n", restart);
+	else
+		pack_int32(req->sock, (int32_t)restart);
+	return false;
+}
+
+static bool api_delete_lease(const struct api_request *req)
+{
+	delete_lease(req->message, req->sock);
+	return false;
+}
+
+static bool api_dns_port(const struct api_request *req)
+{
+	getDNSport(req->sock);
+	return false;
+}
+
+static bool api_maxlogage(const struct api_request *req)
+{
+	getMAXLOGAGE(req->sock);
+	return false;
+}
+
+static bool api_gateway(const struct api_request *req)
+{
+	getGateway(req->sock);
+	return false;
+}
+
+static bool api_interfaces(const struct api_request *req)
+{
+	getInterfaces(req->sock);
+	return false;
+}
+
+static bool api_stream(const struct api_request *req)
+{
+	// The stream thread takes over the connection and we close our
+	// end of it right away. It does not compress its output
+	if(!scompressed(req->sock) && stream_subscribe(req->sock, req->istelnet))
+		return true;
+
+	if(req->istelnet)
+		ssend(req->sock, "stream not available\n");
+	return false;
+}
+
+// >debug-limits lists the sampling factor, rate limit and number of suppressed
+// messages of all debug categories, >debug-limits <category> <sample> <rate>
+// changes the limits of a category until the config is read again
+static bool api_debug_limits(const struct api_request *req)
+{
+	char name[32];
+	unsigned int sample = 0, rate = 0;
+	const int args = sscanf(req->args, "%31s %u %u", name, &sample, &rate);
+	if(args > 0)
 	{
-		processed = true;
-		lock_shm();
-		getClientNames(sock, istelnet);
-		unlock_shm();
+		const int category = debug_category(name);
+		if(args < 2 || category < 0 || rate > DEBUG_RATE_MAX)
+		{
+			if(req->istelnet)
+				ssend(req->sock, "Invalid arguments\n");
+			return false;
+		}
+
+		logg("Received API request to limit DEBUG_%s to one out of %u messages, at most %u per second",
+		     debug_category_name((unsigned int)category), sample, rate);
+		set_debug_limit((unsigned int)category, sample, rate);
 	}
-	else if(command(client_message, ">unknown"))
+
+	for(unsigned int i = 0; i < DEBUG_CATEGORIES; i++)
 	{
-		processed = true;
-		lock_shm();
-		getUnknownQueries(sock, istelnet);
-		unlock_shm();
+		const debugLimit *limit = &debug_limits->category[i];
+		const bool enabled = config.debug & (1u << i);
+		const unsigned int cur_sample = atomic_load(&limit->sample);
+		const unsigned int cur_rate = atomic_load(&limit->rate);
+		const uint64_t suppressed = atomic_load(&limit->suppressed);
+		if(req->istelnet)
+		{
+			// <category> <enabled> <sample> <rate> <suppressed>
+			ssend(req->sock, "%s %i %u %u %lu\n", debug_category_name(i),
+			      enabled ? 1 : 0, cur_sample, cur_rate, (unsigned long)suppressed);
+		}
+		else
+		{
+			if(!pack_str32(req->sock, debug_category_name(i)))
+				return false;
+			pack_bool(req->sock, enabled);
+			pack_int32(req->sock, (int32_t)cur_sample);
+			pack_int32(req->sock, (int32_t)cur_rate);
+			pack_uint64(req->sock, suppressed);
+		}
 	}
-	else if(command(client_message, ">cacheinfo"))
+	return false;
+}
+
+// >lua <name> runs a Lua report, it takes the shared lock itself
+static bool api_lua(const struct api_request *req)
+{
+	lua_report_run(req->args, req->sock);
+	return false;
+}
+
+static bool api_federation(const struct api_request *req)
+{
+	getFederationSummary(req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_cluster_stats(const struct api_request *req)
+{
+	getClusterStats(req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_cluster_overtime(const struct api_request *req)
+{
+	getClusterOverTime(req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_cluster_top(const struct api_request *req)
+{
+	// The list is distinguished by getClusterTop() itself
+	getClusterTop(req->message, req->sock, req->istelnet);
+	return false;
+}
+
+static bool api_gravity_artifact(const struct api_request *req)
+{
+	getGravityArtifact(req->message, req->sock, req->istelnet);
+	return false;
+}
+
+// >compress deflate [level] compresses the responses following this one,
+// >compress none stops compressing them. The response tells the compression
+// of the following responses, it is not changed for unknown methods
+static bool api_compress(const struct api_request *req)
+{
+	char method[16] = { 0 };
+	int level = config.api_compression;
+	const int args = sscanf(req->args, "%15s %d", method, &level);
+	if(args > 0 && strcmp(method, "none") == 0)
+		scompress(req->sock, 0);
+	else if(args > 0 && strcmp(method, "deflate") == 0 && config.api_compression > 0)
+		scompress(req->sock, level > 0 ? level : (int)config.api_compression);
+
+	level = scompress(req->sock, -1);
+	if(req->istelnet)
 	{
-		processed = true;
-		lock_shm();
-		getCacheInformation(sock);
-		unlock_shm();
+		if(level > 0)
+			ssend(req->sock, "compress deflate %d\n", level);
+		else
+			ssend(req->sock, "compress none\n");
 	}
-	else if(command(client_message, ">reresolve"))
+	else
 	{
-		processed = true;
-		logg("Received API request to re-resolve host names");
-		set_event(RELOAD_PRIVACY_LEVEL);
+		pack_str32(req->sock, level > 0 ? "deflate" : "none");
+		pack_int32(req->sock, level);
 	}
-	else if(command(client_message, ">recompile-regex"))
+	return false;
+}
+
+static bool api_apistats(const struct api_request *req);
+
+// All API commands. A command is matched exactly against the first token of
+// the message, everything after it is left to the handler
+static const struct api_command api_commands[] = {
+	{ ">stats",                        api_stats,             API_LOCK_SHARED,    RESPCACHE_STATS },
+	{ ">overTime",                     api_overtime,          API_LOCK_SHARED,    RESPCACHE_OVERTIME },
+	{ ">uniqueOverTime",               api_unique_overtime,   API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">unique",                       api_unique,            API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">unique-client",                api_unique,            API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">top-domains",                  api_top_domains,       API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">top-ads",                      api_top_domains,       API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">top-clients",                  api_top_clients,       API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">top-client-domains",           api_heavy_hitters,     API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">top-domain-clients",           api_heavy_hitters,     API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">forward-dest",                 api_forward_dest,      API_LOCK_SHARED,    RESPCACHE_FORWARD_DEST },
+	{ ">forward-names",                api_forward_names,     API_LOCK_SHARED,    RESPCACHE_FORWARD_UNSORTED },
+	{ ">upstream-rtime",               api_upstream_rtime,    API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">querytypes",                   api_querytypes,        API_LOCK_SHARED,    RESPCACHE_QUERYTYPES },
+	{ ">getallqueries",                api_getallqueries,     API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">getallqueries-time",           api_getallqueries_time, API_LOCK_NONE,     RESPCACHE_NONE },
+	{ ">getallqueries-domain",         api_getallqueries,     API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">getallqueries-client",         api_getallqueries,     API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">getallqueries-client-blocked", api_getallqueries,     API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">search-domains",               api_search_domains,    API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">getallqueries-forward",        api_getallqueries,     API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">getallqueries-qtype",          api_getallqueries,     API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">recentBlocked",                api_recentblocked,     API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">clientID",                     api_clientid,          API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">version",                      api_version,           API_LOCK_NONE,      RESPCACHE_NONE },
+	{ ">dbstats",                      api_dbstats,           API_LOCK_NONE,      RESPCACHE_NONE },
+	{ ">strings",                      api_strings,           API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">shmem",                        api_shmem,             API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">shmem-usage",                  api_shmem_usage,       API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">lockstats",                    api_lockstats,         API_LOCK_NONE,      RESPCACHE_NONE },
+	{ ">dblatency",                    api_dblatency,         API_LOCK_NONE,      RESPCACHE_NONE },
+	{ ">allocstats",                   api_allocstats,        API_LOCK_NONE,      RESPCACHE_NONE },
+	{ ">memory",                       api_memory,            API_LOCK_NONE,      RESPCACHE_NONE },
+	{ ">timers",                       api_timers,            API_LOCK_NONE,      RESPCACHE_NONE },
+	{ ">querystages",                  api_querystages,       API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">metrics",                      api_metrics,           API_LOCK_NONE,      RESPCACHE_NONE },
+	{ ">regexstats",                   api_regexstats,        API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">ClientsoverTime",              api_clientsovertime,   API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">client-names",                 api_client_names,      API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">unknown",                      api_unknown,           API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">cacheinfo",                    api_cacheinfo,         API_LOCK_EXCLUSIVE, RESPCACHE_NONE },
+	{ ">reresolve",                    api_reresolve,         API_LOCK_NONE,      RESPCACHE_NONE },
+	{ ">recompile-regex",              api_recompile_regex,   API_LOCK_EXCLUSIVE, RESPCACHE_NONE },
+	{ ">reload-config",                api_reload_config,     API_LOCK_EXCLUSIVE, RESPCACHE_NONE },
+	{ ">delete-lease",                 api_delete_lease,      API_LOCK_NONE,      RESPCACHE_NONE },
+	{ ">dns-port",                     api_dns_port,          API_LOCK_NONE,      RESPCACHE_NONE },
+	{ ">maxlogage",                    api_maxlogage,         API_LOCK_NONE,      RESPCACHE_NONE },
+	{ ">gateway",                      api_gateway,           API_LOCK_NONE,      RESPCACHE_NONE },
+	{ ">interfaces",                   api_interfaces,        API_LOCK_NONE,      RESPCACHE_NONE },
+	{ ">stream",                       api_stream,            API_LOCK_NONE,      RESPCACHE_NONE },
+	{ ">apistats",                     api_apistats,          API_LOCK_NONE,      RESPCACHE_NONE },
+	{ ">debug-limits",                 api_debug_limits,      API_LOCK_NONE,      RESPCACHE_NONE },
+	{ ">lua",                          api_lua,               API_LOCK_NONE,      RESPCACHE_NONE },
+	{ ">federation",                   api_federation,        API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">cluster-stats",                api_cluster_stats,     API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">cluster-overTime",             api_cluster_overtime,  API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">cluster-top-domains",          api_cluster_top,       API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">cluster-top-ads",              api_cluster_top,       API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">cluster-top-clients",          api_cluster_top,       API_LOCK_SHARED,    RESPCACHE_NONE },
+	{ ">gravity-artifact",             api_gravity_artifact,  API_LOCK_NONE,      RESPCACHE_NONE },
+	{ ">compress",                     api_compress,          API_LOCK_NONE,      RESPCACHE_NONE },
+};
+#define NUM_API_COMMANDS (sizeof(api_commands)/sizeof(api_commands[0]))
+static struct api_command_stats api_command_stats[NUM_API_COMMANDS];
+
+static bool api_apistats(const struct api_request *req)
+{
+	for(unsigned int i = 0; i < NUM_API_COMMANDS; i++)
 	{
-		processed = true;
-		logg("Received API request to recompile regex");
-		lock_shm();
-		// Reread regex.list
-		// Read and compile possible regex filters
-		read_regex_from_database();
-		unlock_shm();
+		const struct api_command *cmd = &api_commands[i];
+		const struct api_command_stats *stats = &api_command_stats[i];
+		const uint64_t calls = atomic_load(&stats->calls);
+		const uint64_t usec = atomic_load(&stats->usec);
+		const uint64_t max_usec = atomic_load(&stats->max_usec);
+		if(req->istelnet)
+		{
+			// <command> <calls> <avg usec> <max usec>
+			ssend(req->sock, "%s %lu %lu %lu\n", cmd->name, (unsigned long)calls,
+			      (unsigned long)(calls > 0 ? usec / calls : 0),
+			      (unsigned long)max_usec);
+		}
+		else
+		{
+			if(!pack_str32(req->sock, cmd->name))
+				return false;
+			pack_uint64(req->sock, calls);
+			pack_uint64(req->sock, usec);
+			pack_uint64(req->sock, max_usec);
+		}
 	}
-	else if(command(client_message, ">delete-lease"))
+	return false;
+}
+
+// Commands are found through a perfect hash of their names: the multiplier
+// is chosen when building the table such that no two commands share a slot.
+// This costs one hash and one string comparison per request
+#define API_HASH_BITS 8
+#define API_HASH_SLOTS (1u << API_HASH_BITS)
+#define API_HASH_EMPTY 0xFF
+static uint8_t api_hash_table[API_HASH_SLOTS];
+static uint32_t api_hash_seed = 0u;
+
+static unsigned int __attribute__((const)) api_hash_slot(const uint32_t hash, const uint32_t seed)
+{
+	return (hash * seed) >> (32 - API_HASH_BITS);
+}
+
+void init_api_commands(void)
+{
+	// Try odd multipliers until we find one without collisions
+	uint32_t seed = 0x9E3779B1u;
+	for(unsigned int tries = 0; tries < 100000u; tries++, seed += 2u)
 	{
-		processed = true;
-		delete_lease(client_message, sock);
+		memset(api_hash_table, API_HASH_EMPTY, sizeof(api_hash_table));
+		bool collision = false;
+		for(unsigned int i = 0; i < NUM_API_COMMANDS && !collision; i++)
+		{
+			const unsigned int slot = api_hash_slot(hashStr(api_commands[i].name), seed);
+			if(api_hash_table[slot] != API_HASH_EMPTY)
+				collision = true;
+			else
+				api_hash_table[slot] = i;
+		}
+
+		if(!collision)
+		{
+			api_hash_seed = seed;
+			return;
+		}
 	}
-	else if(command(client_message, ">dns-port"))
+
+	// Commands will be searched linearly
+	logg("WARN: Cannot build API command table");
+}
+
+// Find the command for the token at the beginning of a message
+static const struct api_command *find_command(const char *message, const char **args)
+{
+	// Skip leading white space
+	while(*message == ' ' || *message == '\t')
+		message++;
+
+	// The command is everything up to the first white space
+	size_t len = strcspn(message, " \t\r\n");
+	char name[32];
+	if(len == 0 || len >= sizeof(name))
+		return NULL;
+	memcpy(name, message, len);
+	name[len] = '\0';
+	*args = message + len;
+
+	if(api_hash_seed == 0u)
 	{
-		processed = true;
-		getDNSport(sock);
+		for(unsigned int i = 0; i < NUM_API_COMMANDS; i++)
+			if(strcmp(api_commands[i].name, name) == 0)
+				return &api_commands[i];
+		return NULL;
 	}
-	else if(command(client_message, ">maxlogage"))
+
+	const uint8_t idx = api_hash_table[api_hash_slot(hashStr(name), api_hash_seed)];
+	if(idx >= NUM_API_COMMANDS || strcmp(api_commands[idx].name, name) != 0)
+		return NULL;
+
+	return &api_commands[idx];
+}
+
+// Run a command, taking the lock it needs and using cached responses where
+// available
+static bool run_command(const struct api_command *cmd, const struct api_request *req)
+{
+	const uint64_t start = monotonic_usec();
+
+	// >forward-dest unsorted and >overTime bulk have their own cached
+	// responses, other resolutions of >overTime are not cached
+	enum respcache_type cache = cmd->cache;
+	if(cache == RESPCACHE_FORWARD_DEST && command(req->args, "unsorted"))
+		cache = RESPCACHE_FORWARD_UNSORTED;
+	else if(cache == RESPCACHE_OVERTIME && command(req->args, " resolution"))
+		cache = RESPCACHE_NONE;
+	else if(cache == RESPCACHE_OVERTIME && command(req->args, " bulk"))
+		cache = RESPCACHE_OVERTIME_BULK;
+
+	bool close = false;
+	if(cache == RESPCACHE_NONE || !respcache_begin(cache, req->sock, req->istelnet))
 	{
-		processed = true;
-		getMAXLOGAGE(sock);
+		if(cmd->lock == API_LOCK_SHARED)
+			lock_shm_shared();
+		else if(cmd->lock == API_LOCK_EXCLUSIVE)
+			lock_shm();
+
+		close = cmd->handler(req);
+
+		if(cmd->lock == API_LOCK_SHARED)
+			unlock_shm_shared();
+		else if(cmd->lock == API_LOCK_EXCLUSIVE)
+			unlock_shm();
+
+		if(cache != RESPCACHE_NONE)
+			respcache_end(req->sock);
 	}
-	else if(command(client_message, ">gateway"))
+
+	const uint64_t elapsed = monotonic_usec() - start;
+	struct api_command_stats *stats = &api_command_stats[cmd - api_commands];
+	atomic_fetch_add(&stats->calls, 1u);
+	atomic_fetch_add(&stats->usec, elapsed);
+	uint64_t max_usec = atomic_load(&stats->max_usec);
+	while(elapsed > max_usec && !atomic_compare_exchange_weak(&stats->max_usec, &max_usec, elapsed));
+
+	return close;
+}
+
+bool process_request(const char *client_message, const int sock, const bool istelnet)
+{
+	char EOT[2];
+	EOT[0] = 0x04;
+	EOT[1] = 0x00;
+	bool processed = false;
+
+	// Plain HTTP scrape of the metrics endpoint, e.g. by Prometheus. We
+	// answer with HTTP/1.0 semantics and close the connection afterwards
+	if(istelnet && strncmp(client_message, "GET /metrics", 12) == 0)
 	{
-		processed = true;
-		getGateway(sock);
+		ssend(sock, "HTTP/1.0 200 OK\r\n"
+		            "Content-Type: text/plain; version=0.0.4\r\n"
+		            "Connection: close\r\n\r\n");
+		getMetrics(sock);
+		sflush(sock);
+		return true;
 	}
-	else if(command(client_message, ">interfaces"))
+
+	struct api_request req = { .message = client_message, .args = "", .sock = sock, .istelnet = istelnet };
+	const struct api_command *cmd = find_command(client_message, &req.args);
+	if(cmd != NULL)
 	{
 		processed = true;
-		getInterfaces(sock);
+		if(run_command(cmd, &req))
+			return true;
 	}
 
 	// Test only at the end if we want to quit or kill
@@ -192,6 +733,7 @@ bool process_request(const char *client_message, const int sock, const bool iste
 	{
 		if(config.debug & DEBUG_API)
 			logg("Received >quit or EOT on socket %d", sock);
+		sflush(sock);
 		return true;
 	}
 
@@ -10,6 +10,7 @@
 #ifndef REQUEST_H
 #define REQUEST_H
 
+void init_api_commands(void);
 bool process_request(const char *client_message, const int sock, const bool istelnet);
 bool command(const char *client_message, const char* cmd) __attribute__((pure));
 
@@ -0,0 +1,126 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  API response cache
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "../FTL.h"
+#include "respcache.h"
+// swrite(), sbuffered()
+#include "socket.h"
+#include "../config.h"
+#include "../log.h"
+#include <stdatomic.h>
+
+// Dashboards request the same aggregate statistics every few seconds. The
+// serialized responses are kept for API_CACHE_TTL milliseconds so that any
+// number of open dashboards costs the same as a single one. An entry is
+// only valid for the privacy level it was created with and becomes invalid
+// whenever the garbage collection removed queries from memory
+struct respcache_entry {
+	pthread_mutex_t lock;
+	bool valid;
+	enum privacy_level privacylevel;
+	unsigned int generation;
+	uint64_t created;
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+#define RESPCACHE_ENTRY { .lock = PTHREAD_MUTEX_INITIALIZER }
+static struct respcache_entry cache[RESPCACHE_TYPES][2] = {
+	[0 ... RESPCACHE_TYPES-1] = { RESPCACHE_ENTRY, RESPCACHE_ENTRY }
+};
+
+static atomic_uint generation = 0u;
+
+// Entry the response currently computed by this thread will be stored in
+static __thread struct respcache_entry *pending = NULL;
+
+static uint64_t now_msec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+// Send a cached response if we have a recent one. Otherwise, the caller has
+// to compute the response and call respcache_end() afterwards. Concurrent
+// requests for the same response wait for this computation instead of
+// repeating it
+bool respcache_begin(const enum respcache_type type, const int sock, const bool istelnet)
+{
+	if(config.api_cache_ttl == 0u)
+		return false;
+
+	struct respcache_entry *entry = &cache[type][istelnet ? 1 : 0];
+	pthread_mutex_lock(&entry->lock);
+
+	// Pick up changes of the privacy level before looking at the entry
+	refresh_privacy_level();
+
+	if(entry->valid &&
+	   entry->privacylevel == config.privacylevel &&
+	   entry->generation == atomic_load(&generation) &&
+	   now_msec() - entry->created < config.api_cache_ttl)
+	{
+		swrite(sock, entry->data, entry->len);
+		pthread_mutex_unlock(&entry->lock);
+		return true;
+	}
+
+	// Start the response with an empty output buffer so we can capture it
+	sflush(sock);
+	entry->valid = false;
+	entry->generation = atomic_load(&generation);
+	entry->created = now_msec();
+	pending = entry;
+	return false;
+}
+
+// Store the response computed after respcache_begin() returned false
+void respcache_end(const int sock)
+{
+	struct respcache_entry *entry = pending;
+	if(entry == NULL)
+		return;
+	pending = NULL;
+
+	// Nothing is stored when (parts of) the response have already been
+	// written out. This happens only for responses larger than the
+	// output buffer or when the client went away
+	size_t len = 0u;
+	const char *data = sbuffered(sock, &len);
+	if(data != NULL && len > 0u)
+	{
+		if(len > entry->size)
+		{
+			char *newdata = realloc(entry->data, len);
+			if(newdata != NULL)
+			{
+				entry->data = newdata;
+				entry->size = len;
+			}
+		}
+		if(len <= entry->size)
+		{
+			memcpy(entry->data, data, len);
+			entry->len = len;
+			entry->privacylevel = config.privacylevel;
+			entry->valid = true;
+		}
+	}
+
+	pthread_mutex_unlock(&entry->lock);
+}
+
+// Invalidate all cached responses, e.g., after queries have been removed
+void respcache_invalidate(void)
+{
+	atomic_fetch_add(&generation, 1u);
+}
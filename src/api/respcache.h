@@ -0,0 +1,32 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  API response cache prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef RESPCACHE_H
+#define RESPCACHE_H
+
+#include <stdbool.h>
+
+// Aggregate API commands whose responses are cached
+enum respcache_type {
+	RESPCACHE_STATS,
+	RESPCACHE_OVERTIME,
+	RESPCACHE_OVERTIME_BULK,
+	RESPCACHE_QUERYTYPES,
+	RESPCACHE_FORWARD_DEST,
+	RESPCACHE_FORWARD_UNSORTED,
+	RESPCACHE_TYPES,
+	// Commands whose responses are not cached
+	RESPCACHE_NONE = RESPCACHE_TYPES
+};
+
+bool respcache_begin(const enum respcache_type type, const int sock, const bool istelnet);
+void respcache_end(const int sock);
+void respcache_invalidate(void);
+
+#endif //RESPCACHE_H
@@ -21,6 +21,21 @@
 // API thread storage
 #include "../daemon.h"
 #include "../shmem.h"
+// epoll_create1()
+#include <sys/epoll.h>
+// fcntl()
+#include <fcntl.h>
+// writev()
+#include <sys/uio.h>
+// ioctl(FIONREAD)
+#include <sys/ioctl.h>
+// deflate()
+#define ZLIB_CONST
+#include <zlib.h>
+#include <netdb.h>
+#include <poll.h>
+// thread_sched_apply()
+#include "../threadsched.h"
 
 // The backlog argument defines the maximum length
 // to which the queue of pending connections for
@@ -128,13 +143,237 @@ static int bind_to_telnet_socket(const enum telnet_type type, const char *stype)
 	return socketdescriptor;
 }
 
+// Listening sockets and client connections are registered with a single
+// epoll instance shared by all API worker threads. Every descriptor is armed
+// with EPOLLONESHOT so exactly one worker handles an event and the descriptor
+// is silent until this worker re-arms it. Hence, idle connections do not
+// block a thread and the number of connections is not limited by the number
+// of threads
+static int api_epoll_fd = -1;
+
+// Responses are compressed on connections which asked for it (see
+// scompress()). All compressed responses of a connection form one zlib
+// stream, each of them ends with a sync flush so the client can decompress it
+// completely as soon as it arrived
+struct api_compress {
+	z_stream zs;
+	int level;
+	// Data has been compressed since the last flush
+	bool pending;
+};
+
+struct api_conn {
+	int fd;
+	bool listener;
+	bool istelnet;
+	const char *stype;
+	// Client messages are received into this buffer and processed in-place.
+	// It holds everything received so far that is not yet a complete line
+	char *buffer;
+	size_t len;
+	size_t size;
+	// Compression of the current response (NULL if uncompressed) and the
+	// level requested for the following ones
+	struct api_compress *compress;
+	int compress_level;
+};
+
+// Connection served by this worker thread
+static __thread struct api_conn *current_conn = NULL;
+
+// Maximum length of a single request line. Clients sending longer lines
+// without a line break are disconnected
+#define API_MAX_REQUEST (64u*1024u)
+
+// (Re-)arm a descriptor for exactly one more event
+static bool api_arm(struct api_conn *conn, const int op)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = conn };
+	if(epoll_ctl(api_epoll_fd, op, conn->fd, &ev) != 0)
+	{
+		logg("Telnet error: Cannot register %s fd %d: %s", conn->stype, conn->fd, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+// Close a client connection. The descriptor is removed from the epoll set
+// explicitly as the stream thread may hold a duplicate of it
+static void api_close(struct api_conn *conn)
+{
+	epoll_ctl(api_epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	if(conn->buffer != NULL)
+		free(conn->buffer);
+	if(conn->compress != NULL)
+	{
+		deflateEnd(&conn->compress->zs);
+		free(conn->compress);
+	}
+	free(conn);
+}
+
+// Accept a new client on a listening socket
+static void api_accept(struct api_conn *listener)
+{
+	const int csck = accept(listener->fd, NULL, NULL);
+
+	// Re-arm the listener right away so other workers can accept further
+	// clients while this worker is setting up the connection
+	api_arm(listener, EPOLL_CTL_MOD);
+
+	if(csck == -1)
+		return;
+
+	struct api_conn *conn = calloc(1, sizeof(struct api_conn));
+	if(conn == NULL)
+	{
+		close(csck);
+		return;
+	}
+	conn->fd = csck;
+	conn->istelnet = listener->istelnet;
+	conn->stype = listener->stype;
+
+	if(!api_arm(conn, EPOLL_CTL_ADD))
+		api_close(conn);
+}
+
+// Requests are terminated by a line break. Telnet clients may also end a
+// session with EOT (Ctrl+D), which is sent without a line break
+static char *find_request_end(char *buffer, const size_t len)
+{
+	for(size_t i = 0; i < len; i++)
+		if(buffer[i] == '\n' || buffer[i] == '\0' || buffer[i] == 0x04)
+			return buffer + i;
+	return NULL;
+}
+
+// Check if more data has arrived on the connection which has not been
+// received yet
+static bool api_data_pending(const int fd)
+{
+	int pending = 0;
+	return ioctl(fd, FIONREAD, &pending) == 0 && pending > 0;
+}
+
+// Process all complete requests in the buffer of a connection in the order
+// they have been received. Clients can send many requests at once (and need
+// not wait for the responses in between), an incomplete request is kept
+// while the rest of it is still arriving. Clients need not terminate their
+// request at all: unterminated data is processed as one request as soon as
+// there is no further data pending. Returns true if the connection should be
+// closed
+static bool api_process(struct api_conn *conn)
+{
+	char *line = conn->buffer;
+	size_t remaining = conn->len;
+	char *end = NULL;
+	current_conn = conn;
+	while((end = find_request_end(line, remaining)) != NULL)
+	{
+		// Keep EOT as it requests closing the connection
+		const bool eot = *end == 0x04;
+		const size_t linelen = end - line + (eot ? 1 : 0);
+		const char saved = line[linelen];
+		line[linelen] = '\0';
+
+		// Skip empty lines
+		if(linelen > 0 && !(linelen == 1 && line[0] == '\r'))
+		{
+			if(process_request(line, conn->fd, conn->istelnet))
+			{
+				current_conn = NULL;
+				return true;
+			}
+		}
+
+		line[linelen] = saved;
+		remaining -= end - line + 1;
+		line = end + 1;
+	}
+
+	// The buffer has room for the terminating null byte (see api_receive())
+	if(remaining > 0 && !api_data_pending(conn->fd))
+	{
+		line[remaining] = '\0';
+		const bool close_conn = process_request(line, conn->fd, conn->istelnet);
+		remaining = 0;
+		if(close_conn)
+		{
+			current_conn = NULL;
+			return true;
+		}
+	}
+	current_conn = NULL;
+
+	// Move an incomplete request to the beginning of the buffer
+	if(remaining > 0 && line != conn->buffer)
+		memmove(conn->buffer, line, remaining);
+	conn->len = remaining;
+
+	if(conn->len >= API_MAX_REQUEST)
+	{
+		logg("WARN: Closing telnet %s connection on fd %d: Request too long",
+		     conn->stype, conn->fd);
+		return true;
+	}
+
+	return false;
+}
+
+// Receive and process messages on a client connection
+static void api_receive(struct api_conn *conn)
+{
+	// Make room for at least another chunk of data (plus a terminating null
+	// byte) in the buffer of this connection
+	if(conn->size - conn->len < SOCKETBUFFERLEN)
+	{
+		const size_t newsize = conn->size > 0 ? 2*conn->size : SOCKETBUFFERLEN;
+		char *newbuffer = realloc(conn->buffer, newsize);
+		if(newbuffer == NULL)
+		{
+			api_close(conn);
+			return;
+		}
+		conn->buffer = newbuffer;
+		conn->size = newsize;
+	}
+
+	// The connection is ready, this does not block
+	const ssize_t n = recv(conn->fd, conn->buffer + conn->len, conn->size - conn->len - 1, MSG_DONTWAIT);
+	if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+	{
+		// Client closed the connection or error
+		if(config.debug & DEBUG_API && n < 0)
+			logg("Closing telnet %s connection on fd %d: No data received", conn->stype, conn->fd);
+		api_close(conn);
+		return;
+	}
+
+	if(n > 0)
+	{
+		conn->len += n;
+		if(api_process(conn))
+		{
+			api_close(conn);
+			return;
+		}
+	}
+
+	// Wait for the next message on this connection
+	if(!api_arm(conn, EPOLL_CTL_MOD))
+		api_close(conn);
+}
+
 static void *telnet_connection_handler_thread(void *args)
 {
-	struct thread_info *tinfo = args;
+	const int tid = (int)(intptr_t)args;
 	// Set thread name
 	char threadname[16] = { 0 };
-	snprintf(threadname, sizeof(threadname), "telnet-%s-%i", tinfo->stype, tinfo->tid);
+	snprintf(threadname, sizeof(threadname), "telnet-%i", tid);
 	prctl(PR_SET_NAME, threadname, 0, 0, 0);
+	thread_sched_apply(SCHED_API);
 
 	// Ensure this thread can be canceled at any time (not only at
 	// cancellation points)
@@ -147,66 +386,46 @@ static void *telnet_connection_handler_thread(void *args)
 	int errors = 0;
 	while(!killed)
 	{
-		// Look for new clients that want to connect
-		const int csck = accept(tinfo->fd, NULL, NULL);
-		if(csck == -1)
+		struct epoll_event ev;
+		const int rc = epoll_wait(api_epoll_fd, &ev, 1, -1);
+		if(rc < 0)
 		{
-			logg("Telnet error in %s: %s (%i, fd: %d)", threadname, strerror(errno), errno, tinfo->fd);
+			if(errno == EINTR)
+				continue;
+			logg("Telnet error in %s: %s (%i)", threadname, strerror(errno), errno);
 			if(errors++ > 20)
 				break;
 			sleepms(100);
 			continue;
 		}
+		if(rc == 0)
+			continue;
 
-		// Define buffer for client's message
-		char client_message[SOCKETBUFFERLEN] ={ 0 };
-
-		// Receive from client
-		ssize_t n;
-		while((n = recv(csck, client_message, SOCKETBUFFERLEN-1, 0)))
-		{
-			if (n > 0 && n < SOCKETBUFFERLEN)
-			{
-				// Null-terminate client string
-				client_message[n] = '\0';
-				char *message = strdup(client_message);
-				if(message == NULL)
-				{
-					if(config.debug & DEBUG_API)
-						logg("Break in telnet thread for socket %d/%d: Memory error", tinfo->fd, csck);
-					break;
-				}
-
-				// Clear client message receive buffer
-				memset(client_message, 0, sizeof client_message);
-
-				// Process received message
-				const bool eom = process_request(message, csck, tinfo->istelnet);
-				free(message);
-				if(eom) break;
-			}
-			else if(n == -1)
-			{
-				if(config.debug & DEBUG_API)
-					logg("Break in telnet thread for socket %d/%d: No data received", tinfo->fd, csck);
-				break;
-			}
-		}
-
-		// Close client socket
-		close(csck);
+		struct api_conn *conn = ev.data.ptr;
+		if(conn->listener)
+			api_accept(conn);
+		else
+			api_receive(conn);
 	}
 
 	if(config.debug & DEBUG_API)
 		logg("Terminating telnet thread %s (%d errors)", threadname, errors);
 
-	// Free thread-private memory
-	free(tinfo);
 	return NULL;
 }
 
-void listen_telnet(const enum telnet_type type)
+// Start the API worker threads. They serve all telnet sockets
+static bool start_api_threads(void)
 {
+	init_api_commands();
+
+	api_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(api_epoll_fd < 0)
+	{
+		logg("WARNING: Unable to create telnet event queue: %s", strerror(errno));
+		return false;
+	}
+
 	// We will use the attributes object later to start all threads in detached mode
 	pthread_attr_t attr;
 	// Initialize thread attributes object with default attribute values
@@ -215,6 +434,25 @@ void listen_telnet(const enum telnet_type type)
 	// the system without the need for another thread to join with the terminated thread
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
+	for(unsigned int i = 0; i < MAX_API_THREADS; i++)
+	{
+		// Spawn telnet thread
+		if(pthread_create(&api_threads[i], &attr, telnet_connection_handler_thread, (void*)(intptr_t)i) != 0)
+		{
+			// Log the error code description
+			logg("WARNING: Unable to open telnet processing thread: %s", strerror(errno));
+		}
+	}
+
+	return true;
+}
+
+void listen_telnet(const enum telnet_type type)
+{
+	// Start worker threads when the first socket is set up
+	if(api_epoll_fd < 0 && !start_api_threads())
+		return;
+
 	// Initialize telnet socket
 	const char *stype = type == TELNET_SOCK ? "socket" : (type == TELNETv4 ? "IPv4" : "IPv6");
 	const int fd = bind_to_telnet_socket(type, stype);
@@ -224,27 +462,283 @@ void listen_telnet(const enum telnet_type type)
 		return;
 	}
 
+	// The listening socket is non-blocking as a client may have gone away
+	// before we get to accept() it
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	struct api_conn *listener = calloc(1, sizeof(struct api_conn));
+	if(listener == NULL)
+	{
+		close(fd);
+		return;
+	}
+	listener->fd = fd;
+	listener->listener = true;
+	listener->istelnet = (type == TELNETv4 || type == TELNETv6);
+	listener->stype = stype;
+
 	if(config.debug & DEBUG_API)
 		logg("Telnet-%s listener accepting on fd %d", stype, fd);
 
-	for(unsigned int i = 0; i < MAX_API_THREADS; i++)
+	if(!api_arm(listener, EPOLL_CTL_ADD))
 	{
-		// Spawn telnet thread
-		// Create a private copy of the socket fd for the child thread
-		struct thread_info *tinfo = calloc(1, sizeof(struct thread_info));
-		if(!tinfo)
-			continue;
+		close(fd);
+		free(listener);
+	}
+}
+
+// Responses are collected in a per-thread output buffer and written in large
+// chunks. A worker thread handles only one request at a time, so the buffer
+// belongs to the connection currently being served. The allocation is kept
+// and reused for all following requests of this thread
+#define API_OUTBUF_SIZE (64u*1024u)
+static __thread struct {
+	char *data;
+	size_t len;
+	int sock;
+	bool failed;
+	bool flushed;
+} outbuf = { NULL, 0u, -1, false, false };
+
+// Write all iovecs, resuming after partial writes and interrupts
+static bool write_all(const int sock, struct iovec *iov, int iovcnt)
+{
+	while(iovcnt > 0)
+	{
+		const ssize_t ret = writev(sock, iov, iovcnt);
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
 
-		tinfo->fd = fd;
-		tinfo->tid = i;
-		tinfo->istelnet = (type == TELNETv4 || type == TELNETv6);
-		tinfo->stype = stype;
-		if(pthread_create(&api_threads[i], &attr, telnet_connection_handler_thread, (void*) tinfo) != 0)
+		// Skip everything that has been written
+		size_t written = (size_t)ret;
+		while(iovcnt > 0 && written >= iov->iov_len)
 		{
-			// Log the error code description
-			logg("WARNING: Unable to open telnet processing thread: %s", strerror(errno));
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt > 0)
+		{
+			iov->iov_base = (char*)iov->iov_base + written;
+			iov->iov_len -= written;
 		}
 	}
+
+	return true;
+}
+
+// Compression state of a socket if it is the connection served by this thread
+static struct api_compress * __attribute__((pure)) get_compress(const int sock)
+{
+	if(current_conn == NULL || current_conn->fd != sock)
+		return NULL;
+	return current_conn->compress;
+}
+
+// Compress data and write the output to the socket. Without flush, zlib keeps
+// the data until it has enough for a block
+#define API_DEFLATE_CHUNK (16u*1024u)
+static bool deflate_write(const int sock, struct api_compress *cmp, const void *data, const size_t len, const int flush)
+{
+	unsigned char out[API_DEFLATE_CHUNK];
+	cmp->zs.next_in = data;
+	cmp->zs.avail_in = len;
+	do
+	{
+		cmp->zs.next_out = out;
+		cmp->zs.avail_out = sizeof(out);
+		if(deflate(&cmp->zs, flush) == Z_STREAM_ERROR)
+			return false;
+
+		struct iovec iov = { out, sizeof(out) - cmp->zs.avail_out };
+		if(iov.iov_len > 0 && !write_all(sock, &iov, 1))
+			return false;
+	} while(cmp->zs.avail_out == 0);
+
+	return true;
+}
+
+// Write buffered data together with an optional payload to the socket. The
+// end of a response flushes the compressor, a changed compression level ends
+// the zlib stream
+static bool flush_outbuf(const void *extra, const size_t extralen, const bool end)
+{
+	struct iovec iov[2];
+	int iovcnt = 0;
+	if(outbuf.len > 0)
+	{
+		iov[iovcnt].iov_base = outbuf.data;
+		iov[iovcnt++].iov_len = outbuf.len;
+	}
+	if(extralen > 0)
+	{
+		iov[iovcnt].iov_base = (void*)extra;
+		iov[iovcnt++].iov_len = extralen;
+	}
+	outbuf.len = 0;
+	outbuf.flushed = true;
+
+	struct api_compress *cmp = get_compress(outbuf.sock);
+	int flush = Z_NO_FLUSH;
+	if(cmp != NULL && end && current_conn->compress_level != cmp->level)
+		flush = Z_FINISH;
+	else if(cmp != NULL && end && (cmp->pending || iovcnt > 0))
+		flush = Z_SYNC_FLUSH;
+
+	if(outbuf.failed || (iovcnt == 0 && flush == Z_NO_FLUSH))
+		return !outbuf.failed;
+
+	bool ok = true;
+	if(cmp != NULL)
+	{
+		if(iovcnt == 0)
+			ok = deflate_write(outbuf.sock, cmp, NULL, 0u, flush);
+		for(int i = 0; ok && i < iovcnt; i++)
+			ok = deflate_write(outbuf.sock, cmp, iov[i].iov_base, iov[i].iov_len,
+			                   i == iovcnt - 1 ? flush : Z_NO_FLUSH);
+		cmp->pending = flush == Z_NO_FLUSH;
+	}
+	else
+		ok = write_all(outbuf.sock, iov, iovcnt);
+
+	if(!ok)
+	{
+		// Drop everything until the end of this response
+		logg("WARN: Could not write API response to socket %d: %s",
+		     outbuf.sock, strerror(errno));
+		outbuf.failed = true;
+	}
+
+	return !outbuf.failed;
+}
+
+// Use the output buffer for a socket, flush buffered data of the previous one
+static void use_outbuf(const int sock)
+{
+	if(outbuf.sock == sock)
+		return;
+
+	if(outbuf.len > 0)
+		flush_outbuf(NULL, 0, false);
+	outbuf.sock = sock;
+	outbuf.failed = false;
+	outbuf.flushed = false;
+}
+
+// Apply a changed compression level of the connection served by this thread
+// after the end of a response
+static void switch_compress(const int sock)
+{
+	struct api_conn *conn = current_conn;
+	if(conn == NULL || conn->fd != sock)
+		return;
+
+	const int level = conn->compress != NULL ? conn->compress->level : 0;
+	if(conn->compress_level == level)
+		return;
+
+	if(conn->compress != NULL)
+	{
+		deflateEnd(&conn->compress->zs);
+		free(conn->compress);
+		conn->compress = NULL;
+	}
+
+	if(conn->compress_level < 1)
+		return;
+
+	conn->compress = calloc(1, sizeof(struct api_compress));
+	if(conn->compress == NULL || deflateInit(&conn->compress->zs, conn->compress_level) != Z_OK)
+	{
+		logg("WARN: Cannot compress API responses on fd %d", conn->fd);
+		free(conn->compress);
+		conn->compress = NULL;
+		conn->compress_level = 0;
+		return;
+	}
+	conn->compress->level = conn->compress_level;
+
+	if(config.debug & DEBUG_API)
+		logg("Compressing API responses on fd %d with level %d", conn->fd, conn->compress_level);
+}
+
+// Change the compression of the responses following the current one on the
+// connection served by this thread. Level 0 disables compression, -1 keeps
+// the current setting. Returns the level of the following responses
+int scompress(const int sock, const int level)
+{
+	struct api_conn *conn = current_conn;
+	if(conn == NULL || conn->fd != sock)
+		return 0;
+
+	if(level > -1)
+		conn->compress_level = level < Z_BEST_COMPRESSION ? level : Z_BEST_COMPRESSION;
+	return conn->compress_level;
+}
+
+// Whether responses on this socket are compressed. Data must not be written
+// to it bypassing swrite() then
+bool __attribute__((pure)) scompressed(const int sock)
+{
+	return get_compress(sock) != NULL;
+}
+
+// Append data to the output buffer of a socket. Payloads that do not fit
+// into the buffer are written directly (together with the buffered data)
+bool swrite(const int sock, const void *data, const size_t len)
+{
+	// Switch to a new socket, flush buffered data of the previous one
+	use_outbuf(sock);
+
+	if(outbuf.data == NULL && (outbuf.data = calloc(API_OUTBUF_SIZE, 1)) == NULL)
+	{
+		// Cannot buffer, write directly
+		return flush_outbuf(data, len, false);
+	}
+
+	if(len == 0)
+		return !outbuf.failed;
+
+	if(outbuf.len + len > API_OUTBUF_SIZE)
+	{
+		if(len > API_OUTBUF_SIZE)
+			return flush_outbuf(data, len, false);
+		if(!flush_outbuf(NULL, 0, false))
+			return false;
+	}
+
+	memcpy(outbuf.data + outbuf.len, data, len);
+	outbuf.len += len;
+
+	return !outbuf.failed;
+}
+
+// Write everything buffered for this socket. This ends the current response,
+// a following response on the same socket starts without error state and
+// with the compression requested meanwhile
+bool sflush(const int sock)
+{
+	use_outbuf(sock);
+	const bool ok = flush_outbuf(NULL, 0, true);
+	outbuf.failed = false;
+	outbuf.flushed = false;
+	switch_compress(sock);
+	return ok;
+}
+
+// Get everything sent to this socket since the last sflush(). Returns NULL if
+// parts of it have already been written out
+const char *sbuffered(const int sock, size_t *len)
+{
+	if(outbuf.sock != sock || outbuf.flushed || outbuf.failed || outbuf.data == NULL)
+		return NULL;
+
+	*len = outbuf.len;
+	return outbuf.data;
 }
 
 void seom(const int sock, const bool istelnet)
@@ -253,19 +747,100 @@ void seom(const int sock, const bool istelnet)
 		ssend(sock, "---EOM---\n\n");
 	else
 		pack_eom(sock);
+
+	sflush(sock);
 }
 
 bool __attribute__ ((format (gnu_printf, 5, 6))) _ssend(const int sock, const char *file, const char *func, const int line, const char *format, ...)
 {
-	char *buffer;
+	// Make sure the buffer of this socket is in use
+	if(!swrite(sock, NULL, 0))
+		return false;
+
+	// Try to print into the remaining buffer space first. If the output
+	// does not fit, flush and try again with the entire buffer
+	for(unsigned int attempt = 0; attempt < 2 && outbuf.data != NULL; attempt++)
+	{
+		const size_t avail = API_OUTBUF_SIZE - outbuf.len;
+		va_list args;
+		va_start(args, format);
+		const int bytes = vsnprintf(outbuf.data + outbuf.len, avail, format, args);
+		va_end(args);
+
+		if(bytes < 0)
+			return false;
+		if((size_t)bytes < avail)
+		{
+			outbuf.len += bytes;
+			return !outbuf.failed;
+		}
+		if(attempt > 0 || !flush_outbuf(NULL, 0, false))
+			break;
+	}
+
+	// Output is larger than the buffer (or the buffer could not be allocated)
+	char *buffer = NULL;
 	va_list args;
 	va_start(args, format);
-	int bytes = vasprintf(&buffer, format, args);
+	const int bytes = vasprintf(&buffer, format, args);
 	va_end(args);
-	if(bytes > 0 && buffer != NULL)
+	if(bytes <= 0 || buffer == NULL)
+		return false;
+
+	if(config.debug & DEBUG_API)
+		logg("Sending %d bytes unbuffered in %s() [%s:%i]", bytes, func, short_path(file), line);
+	const bool ok = swrite(sock, buffer, bytes);
+	free(buffer);
+	return ok;
+}
+
+// Connect to host:port (or [IPv6]:port) within timeout seconds, which is
+// also used for sending and receiving afterwards. Returns -1 on failure
+int socket_connect(const char *target, const unsigned int timeout)
+{
+	char host[256];
+	const char *colon = strrchr(target, ':');
+	if(colon == NULL || (size_t)(colon - target) >= sizeof(host))
+		return -1;
+	memcpy(host, target, colon - target);
+	host[colon - target] = '\0';
+	if(host[0] == '[' && host[strlen(host) - 1] == ']')
+	{
+		memmove(host, host + 1, strlen(host) - 2);
+		host[strlen(host) - 2] = '\0';
+	}
+
+	struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *res = NULL;
+	if(getaddrinfo(host, colon + 1, &hints, &res) != 0)
+		return -1;
+
+	int sock = -1;
+	for(const struct addrinfo *ai = res; ai != NULL && sock < 0; ai = ai->ai_next)
+	{
+		sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, ai->ai_protocol);
+		if(sock < 0)
+			continue;
+
+		// Do not wait for unreachable hosts longer than the timeout
+		struct pollfd pfd = { .fd = sock, .events = POLLOUT };
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if(connect(sock, ai->ai_addr, ai->ai_addrlen) != 0 &&
+		   (errno != EINPROGRESS || poll(&pfd, 1, (int)timeout*1000) != 1 ||
+		    getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0))
+		{
+			close(sock);
+			sock = -1;
+		}
+	}
+	freeaddrinfo(res);
+
+	if(sock > -1)
 	{
-		FTLwrite(sock, buffer, bytes, short_path(file), func, line);
-		free(buffer);
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+		const struct timeval tv = { timeout, 0 };
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 	}
-	return errno == 0;
+	return sock;
 }
@@ -13,17 +13,16 @@
 // enum telnet_type
 #include "../enums.h"
 
-struct thread_info {
-	int fd;
-	int tid;
-	bool istelnet;
-	const char *stype;
-};
-
 void close_unix_socket(bool unlink_file);
 void seom(const int sock, const bool istelnet);
+bool swrite(const int sock, const void *data, const size_t len);
+bool sflush(const int sock);
+const char *sbuffered(const int sock, size_t *len);
+int scompress(const int sock, const int level);
+bool scompressed(const int sock);
 #define ssend(sock, format, ...) _ssend(sock, __FILE__, __FUNCTION__,  __LINE__, format, ##__VA_ARGS__)
 bool _ssend(const int sock, const char *file, const char *func, const int line, const char *format, ...) __attribute__ ((format (gnu_printf, 5, 6)));
 void listen_telnet(const enum telnet_type type);
+int socket_connect(const char *target, const unsigned int timeout);
 
 #endif //SOCKET_H
@@ -0,0 +1,156 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Live query stream (>stream)
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "../FTL.h"
+#include "stream.h"
+// sendQuery()
+#include "api.h"
+// sflush()
+#include "socket.h"
+// query_seq()
+#include "../shmem.h"
+#include "../log.h"
+#include "../config.h"
+// killed, thread_sleepms()
+#include "../signals.h"
+// threads[]
+#include "../daemon.h"
+// fcntl()
+#include <fcntl.h>
+// thread_sched_apply()
+#include "../threadsched.h"
+
+// Interval in which new queries are sent to the subscribers
+#define STREAM_INTERVAL 100
+
+// Subscribers are only known to the main process, the stream thread sends
+// all queries completed since its last run to each of them. Subscriber
+// sockets are non-blocking: we rather drop a subscriber which cannot keep up
+// than letting it delay the stream for everyone else or hold the SHM lock
+static struct {
+	int fd;
+	bool istelnet;
+} subscribers[MAX_STREAM_SUBSCRIBERS];
+static int num_subscribers = 0;
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Remember a completed query for the subscribers. Has to be called while
+// holding the SHM lock. This costs no more than an atomic read as long as
+// nobody is listening
+void stream_push(const int queryID)
+{
+	if(stream_ring == NULL ||
+	   atomic_load_explicit(&stream_ring->subscribers, memory_order_relaxed) < 1)
+		return;
+
+	const unsigned int head = atomic_load_explicit(&stream_ring->head, memory_order_relaxed);
+	stream_ring->seqs[head % STREAM_RING_SIZE] = query_seq(queryID);
+	atomic_store_explicit(&stream_ring->head, head + 1u, memory_order_release);
+}
+
+// Hand over a client connection to the stream thread. The socket is
+// duplicated as the API closes its own descriptor after this request
+bool stream_subscribe(const int sock, const bool istelnet)
+{
+	pthread_mutex_lock(&stream_lock);
+
+	// Start the stream thread with the first subscriber
+	if(threads[STREAM] == 0)
+	{
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if(pthread_create(&threads[STREAM], &attr, stream_thread, NULL) != 0)
+		{
+			logg("WARNING: Unable to open stream thread: %s", strerror(errno));
+			threads[STREAM] = 0;
+			pthread_mutex_unlock(&stream_lock);
+			return false;
+		}
+	}
+
+	const int fd = num_subscribers < MAX_STREAM_SUBSCRIBERS ? dup(sock) : -1;
+	if(fd < 0)
+	{
+		pthread_mutex_unlock(&stream_lock);
+		return false;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	subscribers[num_subscribers].fd = fd;
+	subscribers[num_subscribers].istelnet = istelnet;
+	num_subscribers++;
+	atomic_fetch_add(&stream_ring->subscribers, 1);
+
+	if(config.debug & DEBUG_API)
+		logg("Stream: New subscriber on fd %d (%d subscribers)", fd, num_subscribers);
+
+	pthread_mutex_unlock(&stream_lock);
+	return true;
+}
+
+// Remove a subscriber, the last one takes its place
+static void stream_drop(const int i)
+{
+	if(config.debug & DEBUG_API)
+		logg("Stream: Dropping subscriber on fd %d", subscribers[i].fd);
+
+	close(subscribers[i].fd);
+	subscribers[i] = subscribers[--num_subscribers];
+	atomic_fetch_sub(&stream_ring->subscribers, 1);
+}
+
+void *stream_thread(void *val)
+{
+	(void)val;
+
+	// Set thread name
+	thread_names[STREAM] = "stream";
+	prctl(PR_SET_NAME, thread_names[STREAM], 0, 0, 0);
+	thread_sched_apply(STREAM);
+
+	unsigned int pos = atomic_load_explicit(&stream_ring->head, memory_order_acquire);
+	while(!killed)
+	{
+		thread_sleepms(STREAM, STREAM_INTERVAL);
+
+		const unsigned int head = atomic_load_explicit(&stream_ring->head, memory_order_acquire);
+		if(head == pos)
+			continue;
+
+		// Skip what has already been overwritten
+		if(head - pos > STREAM_RING_SIZE)
+		{
+			if(config.debug & DEBUG_API)
+				logg("Stream: Skipping %u queries", head - pos - STREAM_RING_SIZE);
+			pos = head - STREAM_RING_SIZE;
+		}
+
+		pthread_mutex_lock(&stream_lock);
+		lock_shm_shared();
+		for(int i = num_subscribers - 1; i >= 0; i--)
+		{
+			bool ok = true;
+			for(unsigned int p = pos; p != head && ok; p++)
+			{
+				const int queryID = seq_queryID(stream_ring->seqs[p % STREAM_RING_SIZE]);
+				if(queryID > -1)
+					ok = sendQuery(subscribers[i].fd, subscribers[i].istelnet, queryID) > -1;
+			}
+			if(!ok || !sflush(subscribers[i].fd))
+				stream_drop(i);
+		}
+		unlock_shm_shared();
+		pthread_mutex_unlock(&stream_lock);
+
+		pos = head;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,35 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Live query stream prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// Number of completed queries remembered for the subscribers (power of two)
+#define STREAM_RING_SIZE 4096u
+#define MAX_STREAM_SUBSCRIBERS 16
+
+// Sequence numbers of completed queries. This lives in shared memory as
+// queries are also completed in the TCP workers. Entries are written while
+// holding the SHM lock exclusively and read while holding it shared
+typedef struct {
+	atomic_uint head;
+	atomic_int subscribers;
+	unsigned int seqs[STREAM_RING_SIZE];
+} streamRingStruct;
+
+extern streamRingStruct *stream_ring;
+
+void stream_push(const int queryID);
+bool stream_subscribe(const int sock, const bool istelnet);
+void *stream_thread(void *val);
+
+#endif //STREAM_H
@@ -38,6 +38,12 @@
 #include "tools/dhcp-discover.h"
 // run_arp_scan()
 #include "tools/arp-scan.h"
+// decode_querylog()
+#include "querylog.h"
+// run_benchmark()
+#include "tools/benchmark.h"
+// run_shmem_stats()
+#include "tools/shmem-stats.h"
 // defined in dnsmasq.c
 extern void print_dnsmasq_version(const char *yellow, const char *green, const char *bold, const char *normal);
 
@@ -186,6 +192,13 @@ void parse_args(int argc, char* argv[])
 			exit(gravity_parseList(argv[3], argv[4], argv[5]));
 		}
 
+		// pihole-FTL gravity compile <gravity.db>
+		if(argc == 4 && strcmp(argv[2], "compile") == 0)
+		{
+			// Compile memory-mappable index next to the database
+			exit(gravity_compile(argv[3]));
+		}
+
 		printf("Incorrect usage of pihole-FTL gravity subcommand\n");
 		exit(EXIT_FAILURE);
 	}
@@ -195,7 +208,26 @@ void parse_args(int argc, char* argv[])
 	{
 		// Enable stdout printing
 		cli_mode = true;
-		exit(run_dhcp_discover());
+		bool json = false;
+		unsigned int expected = 0, timeout = DHCPOFFER_TIMEOUT;
+		for(int i = 2; i < argc; i++)
+		{
+			if(strcmp(argv[i], "-j") == 0)
+				json = true;
+			else if(strcmp(argv[i], "-e") == 0 && i + 1 < argc &&
+			        sscanf(argv[i + 1], "%u", &expected) == 1)
+				i++;
+			else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc &&
+			        sscanf(argv[i + 1], "%u", &timeout) == 1 &&
+			        timeout > 0 && timeout <= 3600)
+				i++;
+			else
+			{
+				printf("Incorrect usage of pihole-FTL dhcp-discover: %s\n", argv[i]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		exit(run_dhcp_discover(json, expected, timeout));
 	}
 
 	// ARP scanning mode
@@ -203,9 +235,188 @@ void parse_args(int argc, char* argv[])
 	{
 		// Enable stdout printing
 		cli_mode = true;
-		const bool scan_all = argc > 2 && strcmp(argv[2], "-a") == 0;
-		const bool extreme_mode = argc > 2 && strcmp(argv[2], "-x") == 0;
-		exit(run_arp_scan(scan_all, extreme_mode));
+		bool scan_all = false, extreme_mode = false, update_neighbors = false;
+		for(int i = 2; i < argc; i++)
+		{
+			scan_all |= strcmp(argv[i], "-a") == 0;
+			extreme_mode |= strcmp(argv[i], "-x") == 0;
+			update_neighbors |= strcmp(argv[i], "-n") == 0;
+		}
+		exit(run_arp_scan(scan_all, extreme_mode, update_neighbors));
+	}
+
+	// Binary query log decoding mode
+	if(argc > 1 && strcmp(argv[1], "querylog") == 0)
+	{
+		// Enable stdout printing
+		cli_mode = true;
+		exit(decode_querylog(argc > 2 ? argv[2] : "/var/log/pihole/queries.bin"));
+	}
+
+	// Query pipeline and domain list benchmarks
+	if(argc > 1 && (strcmp(argv[1], "benchmark") == 0 || strcmp(argv[1], "benchmark-lists") == 0))
+	{
+		const bool lists = strcmp(argv[1], "benchmark-lists") == 0;
+		const char *trace = NULL, *gravity_db = NULL, *conf = NULL;
+		unsigned int passes = 1;
+		bool verbose = false;
+		for(int i = 2; i < argc; i++)
+		{
+			if(strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+				gravity_db = argv[++i];
+			else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+				conf = argv[++i];
+			else if(strcmp(argv[i], "-p") == 0 && i + 1 < argc &&
+			        sscanf(argv[i + 1], "%u", &passes) == 1 &&
+			        passes > 0 && passes <= 1000)
+				i++;
+			else if(strcmp(argv[i], "-v") == 0)
+				verbose = true;
+			else if(trace == NULL)
+				trace = argv[i];
+			else
+			{
+				printf("Incorrect usage of pihole-FTL %s: %s\n", argv[1], argv[i]);
+				exit(EXIT_FAILURE);
+			}
+		}
+		if(trace == NULL)
+		{
+			printf("Usage: pihole-FTL %s [-d gravity.db] [-c pihole-FTL.conf] [-p passes] [-v] <%s>\n",
+			       argv[1], lists ? "corpus" : "trace");
+			exit(EXIT_FAILURE);
+		}
+		if(lists)
+			exit(run_lists_benchmark(trace, gravity_db, conf, passes, verbose));
+		exit(run_benchmark(trace, gravity_db, conf, passes, verbose));
+	}
+
+	// Shared memory lookup benchmark
+	if(argc > 1 && strcmp(argv[1], "benchmark-shm") == 0)
+	{
+		unsigned int max = 1000000;
+		bool json = false, verbose = false;
+		for(int i = 2; i < argc; i++)
+		{
+			if(strcmp(argv[i], "-j") == 0)
+				json = true;
+			else if(strcmp(argv[i], "-v") == 0)
+				verbose = true;
+			else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc &&
+			        sscanf(argv[i + 1], "%u", &max) == 1 &&
+			        max >= 1000 && max <= 10000000)
+				i++;
+			else
+			{
+				printf("Usage: pihole-FTL benchmark-shm [-n entries (1000..10000000)] [-j] [-v]\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		exit(run_shm_benchmark(max, json, verbose));
+	}
+
+	// Load the API (optionally while sending DNS queries)
+	if(argc > 1 && strcmp(argv[1], "benchmark-api") == 0)
+	{
+		struct api_benchmark opts = {
+			.target = "127.0.0.1:4711",
+			.connections = 4,
+			.seconds = 10,
+			.qps = 100,
+		};
+		for(int i = 2; i < argc; i++)
+		{
+			if(strcmp(argv[i], "-j") == 0)
+				opts.json = true;
+			else if(strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+				opts.target = argv[++i];
+			else if(strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+				opts.mix = argv[++i];
+			else if(strcmp(argv[i], "-q") == 0 && i + 1 < argc)
+				opts.dns = argv[++i];
+			else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc &&
+			        sscanf(argv[i + 1], "%u", &opts.connections) == 1 &&
+			        opts.connections >= 1 && opts.connections <= 1024)
+				i++;
+			else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc &&
+			        sscanf(argv[i + 1], "%u", &opts.seconds) == 1 &&
+			        opts.seconds >= 1 && opts.seconds <= 3600)
+				i++;
+			else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc &&
+			        sscanf(argv[i + 1], "%u", &opts.qps) == 1 &&
+			        opts.qps >= 1 && opts.qps <= 100000)
+				i++;
+			else
+			{
+				printf("Usage: pihole-FTL benchmark-api [-s host:port|/path/to/socket] [-n connections (1..1024)]\n"
+				       "                                [-t seconds] [-m \">cmd[:weight],...\"] [-q dns-host:port]\n"
+				       "                                [-r queries/s] [-j]\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		exit(run_api_benchmark(&opts));
+	}
+
+	// Replay days of traffic in accelerated time and watch the memory
+	if(argc > 1 && strcmp(argv[1], "benchmark-soak") == 0)
+	{
+		struct soak_benchmark opts = {
+			.days = 3,
+			.queries = 1000,
+			.clients = 250,
+			.churn = 5,
+			.growth = 10,
+		};
+		for(int i = 2; i < argc; i++)
+		{
+			if(strcmp(argv[i], "-j") == 0)
+				opts.json = true;
+			else if(strcmp(argv[i], "-v") == 0)
+				opts.verbose = true;
+			else if(strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+				opts.gravity_db = argv[++i];
+			else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+				opts.conf = argv[++i];
+			else if(strcmp(argv[i], "-D") == 0 && i + 1 < argc &&
+			        sscanf(argv[i + 1], "%u", &opts.days) == 1 &&
+			        opts.days >= 1 && opts.days <= 365)
+				i++;
+			else if(strcmp(argv[i], "-q") == 0 && i + 1 < argc &&
+			        sscanf(argv[i + 1], "%u", &opts.queries) == 1 &&
+			        opts.queries >= 1 && opts.queries <= 1000000)
+				i++;
+			else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc &&
+			        sscanf(argv[i + 1], "%u", &opts.clients) == 1 &&
+			        opts.clients >= 1 && opts.clients <= 100000)
+				i++;
+			else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc &&
+			        sscanf(argv[i + 1], "%u", &opts.churn) == 1 &&
+			        opts.churn <= 100)
+				i++;
+			else if(strcmp(argv[i], "-g") == 0 && i + 1 < argc &&
+			        sscanf(argv[i + 1], "%u", &opts.growth) == 1)
+				i++;
+			else
+			{
+				printf("Usage: pihole-FTL benchmark-soak [-d gravity.db] [-c pihole-FTL.conf] [-D days (1..365)]\n"
+				       "                                 [-q queries per GC interval] [-n clients]\n"
+				       "                                 [-r clients replaced per hour (%%)] [-g max. growth (%%)]\n"
+				       "                                 [-j] [-v]\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		exit(run_soak_benchmark(&opts));
+	}
+
+	// Read the statistics published with SHMEM_STATS=true
+	if(argc > 1 && strcmp(argv[1], "shmem-stats") == 0)
+	{
+		if(argc > 3)
+		{
+			printf("Usage: pihole-FTL shmem-stats [name]\n");
+			exit(EXIT_FAILURE);
+		}
+		exit(run_shmem_stats(argc > 2 ? argv[2] : NULL));
 	}
 
 	// start from 1, as argv[0] is the executable name
@@ -565,12 +776,52 @@ void parse_args(int argc, char* argv[])
 			printf("%sOther:%s\n", yellow, normal);
 			printf("\t%sdhcp-discover%s       Discover DHCP servers in the local\n", green, normal);
 			printf("\t                    network\n");
+			printf("\t                    Append %s-t <sec>%s to wait at most this\n", cyan, normal);
+			printf("\t                    long for replies (default: %i)\n", DHCPOFFER_TIMEOUT);
+			printf("\t                    Append %s-e <num>%s to stop once this\n", cyan, normal);
+			printf("\t                    many servers answered and fail\n");
+			printf("\t                    if fewer did\n");
+			printf("\t                    Append %s-j%s to print the results\n", cyan, normal);
+			printf("\t                    as JSON\n");
 			printf("\t%sarp-scan %s[-a/-x]%s    Use ARP to scan local network for\n", green, cyan, normal);
 			printf("\t                    possible IP conflicts\n");
 			printf("\t                    Append %s-a%s to force scan on all\n", cyan, normal);
 			printf("\t                    interfaces\n");
 			printf("\t                    Append %s-x%s to force scan on all\n", cyan, normal);
 			printf("\t                    interfaces and scan 10x more often\n");
+			printf("\t                    Append %s-n%s to add the devices found\n", cyan, normal);
+			printf("\t                    to the kernel's neighbor cache\n");
+			printf("\t%squerylog %s[file]%s     Print the binary query log as\n", green, cyan, normal);
+			printf("\t                    text (BINARY_QUERY_LOG)\n");
+			printf("\t%sbenchmark %s<trace>%s   Replay a query trace through the\n", green, cyan, normal);
+			printf("\t                    query pipeline and report the\n");
+			printf("\t                    throughput and latencies\n");
+			printf("\t                    Append %s-d <db>%s to use this gravity\n", cyan, normal);
+			printf("\t                    database, %s-c <conf>%s to use this\n", cyan, normal);
+			printf("\t                    config file, %s-p <num>%s to replay\n", cyan, normal);
+			printf("\t                    the trace this often\n");
+			printf("\t%sbenchmark-lists %s<corpus>%s\n", green, cyan, normal);
+			printf("\t                    Time the gravity, exact and regex\n");
+			printf("\t                    list lookups of each domain of the\n");
+			printf("\t                    corpus, same options as benchmark\n");
+			printf("\t%sbenchmark-shm%s       Time the shared memory lookups\n", green, normal);
+			printf("\t                    for 1k to 1M entries (CSV), append\n");
+			printf("\t                    %s-j%s for JSON, %s-n <num>%s to change\n", cyan, normal, cyan, normal);
+			printf("\t                    the maximum number of entries\n");
+			printf("\t%sbenchmark-api%s       Load the API with %s-n <num>%s\n", green, normal, cyan, normal);
+			printf("\t                    connections to %s-s <host:port>%s or\n", cyan, normal);
+			printf("\t                    the unix socket for %s-t <sec>%s, send\n", cyan, normal);
+			printf("\t                    %s-r <qps>%s DNS queries to %s-q <host:port>%s\n", cyan, normal, cyan, normal);
+			printf("\t                    to compare their latency with and\n");
+			printf("\t                    without API load\n");
+			printf("\t%sbenchmark-soak%s      Replay %s-D <days>%s of traffic with\n", green, normal, cyan, normal);
+			printf("\t                    client churn in accelerated time,\n");
+			printf("\t                    record memory and GC durations after\n");
+			printf("\t                    each GC run (CSV, %s-j%s for JSON) and\n", cyan, normal);
+			printf("\t                    fail if memory grows by more than\n");
+			printf("\t                    %s-g <percent>%s after the warm-up\n", cyan, normal);
+			printf("\t%sshmem-stats%s         Print the statistics published in\n", green, normal);
+			printf("\t                    shared memory with SHMEM_STATS=true\n");
 			printf("\t%s-h%s, %shelp%s            Display this help and exit\n\n", green, normal, green, normal);
 			exit(EXIT_SUCCESS);
 		}
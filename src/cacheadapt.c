@@ -0,0 +1,110 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Adaptive DNS cache sizing
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#define FTLDNS
+#include "dnsmasq/dnsmasq.h"
+#undef __USE_XOPEN
+#include "FTL.h"
+#include "cacheadapt.h"
+#include "dnsmasq_interface.h"
+#include "config.h"
+#include "log.h"
+
+// dnsmasq's cache has a fixed number of entries (cache-size). When it is too
+// small, entries which have not yet expired are evicted to make room for new
+// ones and the next query for them has to be forwarded. When ADAPTIVE_CACHE is
+// set, the cache is grown whenever this happens (up to the configured amount
+// of memory) and shrunk back towards cache-size after a while without any
+// evictions. dnsmasq's configured cache size is the lower bound. DNS workers
+// keep the size their cache had when they were forked
+
+static int min_size = -1, max_size = 0;
+static time_t last_check = 0;
+static unsigned int last_hits = 0u, last_misses = 0u, last_evictions = 0u, last_inserted = 0u;
+static unsigned int quiet = 0u;
+static unsigned long grown = 0u, shrunk = 0u;
+
+// Counters are reset when the cache is cleared
+static unsigned int __attribute__((pure)) delta(const unsigned int now, const unsigned int before)
+{
+	return now >= before ? now - before : now;
+}
+
+// Called in every iteration of dnsmasq's main loop
+void FTL_cache_adapt(const time_t now)
+{
+	if(config.adaptive_cache == 0 || daemon->cachesize == 0 ||
+	   now - last_check < CACHE_ADAPT_INTERVAL)
+		return;
+
+	// Bounds are determined when we are called the first time
+	if(min_size < 0)
+	{
+		min_size = daemon->cachesize;
+		max_size = (int)(((unsigned long)config.adaptive_cache * 1024u) / sizeof(struct crec));
+		if(max_size < min_size)
+			max_size = min_size;
+	}
+
+	const unsigned int hits = delta(daemon->metrics[METRIC_DNS_LOCAL_ANSWERED], last_hits);
+	const unsigned int misses = delta(daemon->metrics[METRIC_DNS_QUERIES_FORWARDED], last_misses);
+	const unsigned int evictions = delta(daemon->metrics[METRIC_DNS_CACHE_LIVE_FREED], last_evictions);
+	const unsigned int inserted = delta(daemon->metrics[METRIC_DNS_CACHE_INSERTED], last_inserted);
+	const int interval = last_check > 0 ? (int)(now - last_check) : 0;
+	last_hits = daemon->metrics[METRIC_DNS_LOCAL_ANSWERED];
+	last_misses = daemon->metrics[METRIC_DNS_QUERIES_FORWARDED];
+	last_evictions = daemon->metrics[METRIC_DNS_CACHE_LIVE_FREED];
+	last_inserted = daemon->metrics[METRIC_DNS_CACHE_INSERTED];
+	last_check = now;
+
+	// The first call only initializes the counters
+	if(interval == 0)
+		return;
+
+	const int size = daemon->cachesize;
+	int target = size;
+	if(evictions > 0)
+	{
+		quiet = 0u;
+
+		// Grow by half if more than 1% of the inserted records evicted
+		// a live entry and the cache is actually useful (at least one
+		// in ten queries is answered from it)
+		if(evictions*100u > inserted && hits*10u > misses && size < max_size)
+			target = MIN(size + size/2 + 1, max_size);
+	}
+	else if(++quiet >= CACHE_ADAPT_QUIET && size > min_size)
+	{
+		quiet = 0u;
+		target = MAX(size - size/4, min_size);
+	}
+
+	if(target == size)
+		return;
+
+	const int new_size = cache_resize(target, now);
+	if(new_size > size)
+		grown++;
+	else if(new_size < size)
+		shrunk++;
+	else
+		return;
+
+	logg("%s DNS cache from %i to %i entries (%u hits, %u misses, %u live entries evicted in the last %i seconds)",
+	     new_size > size ? "Growing" : "Shrinking", size, new_size, hits, misses, evictions, interval);
+}
+
+void get_cache_adapt_stats(struct cache_adapt_stats *stats)
+{
+	stats->min = min_size;
+	stats->max = max_size;
+	stats->grown = grown;
+	stats->shrunk = shrunk;
+}
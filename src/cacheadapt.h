@@ -0,0 +1,29 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Adaptive DNS cache sizing prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef CACHEADAPT_H
+#define CACHEADAPT_H
+
+// Interval in which the cache size is reconsidered [seconds]
+#define CACHE_ADAPT_INTERVAL 60
+
+// Number of intervals without evictions before the cache is shrunk
+#define CACHE_ADAPT_QUIET 10
+
+struct cache_adapt_stats {
+	int min;
+	int max;
+	unsigned long grown;
+	unsigned long shrunk;
+};
+
+// FTL_cache_adapt() is called by dnsmasq and declared in dnsmasq_interface.h
+void get_cache_adapt_stats(struct cache_adapt_stats *stats);
+
+#endif //CACHEADAPT_H
@@ -0,0 +1,200 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Distinct domain and client count estimation
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "cardinality.h"
+// getClient(), getQuery()
+#include "shmem.h"
+// getOverTimeID()
+#include "overTime.h"
+// log()
+#include <math.h>
+
+// All routines in here have to be called while holding the SHM lock
+// (exclusively, except for the estimators)
+
+// The number of distinct domains and clients is estimated by HyperLogLog
+// sketches. Every overTime slot has one for the domains and one for the
+// clients queried within it. Sketches are merged by taking the maximum of each
+// register so the number of distinct domains in any range of slots can be
+// estimated without looking at the queries. Each client has another sketch of
+// the domains it queried. As sketches can not forget single elements, the ones
+// of the clients are recomputed whenever the garbage collection removed
+// queries while the ones of the slots simply move out of the window. The
+// sketches of the slots hash names rather than IDs so sketches of different
+// FTL nodes can be merged, too (see federation.c)
+
+// Hash an ID, different seeds give independent hashes of the same ID
+static inline uint64_t __attribute__((const)) hll_hash(const int id, const uint64_t seed)
+{
+	uint64_t h = (uint64_t)(uint32_t)id + seed;
+	h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+	h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+	return h ^ (h >> 31);
+}
+
+#define DOMAIN_SEED 0x9E3779B97F4A7C15ull
+#define CLIENT_SEED 0xD6E8FEB86659FD93ull
+
+// Add a hash to a sketch of 2^precision registers. The first bits select the
+// register, it keeps the largest position of the first set bit of the
+// remaining bits
+static inline void hll_add(unsigned char *registers, const unsigned int precision, const uint64_t hash)
+{
+	const unsigned int index = hash >> (64 - precision);
+	const uint64_t rest = (hash << precision) | (1ull << (precision - 1));
+	const unsigned char rank = __builtin_clzll(rest) + 1;
+	if(rank > registers[index])
+		registers[index] = rank;
+}
+
+// Estimate the cardinality from the registers
+static unsigned int __attribute__((pure)) hll_estimate(const unsigned char *registers, const unsigned int m)
+{
+	double sum = 0.0;
+	unsigned int zeros = 0;
+	for(unsigned int i = 0; i < m; i++)
+	{
+		sum += ldexp(1.0, -registers[i]);
+		if(registers[i] == 0)
+			zeros++;
+	}
+
+	const double alpha = 0.7213 / (1.0 + 1.079 / m);
+	double estimate = alpha * m * m / sum;
+
+	// Use linear counting for small cardinalities
+	if(estimate <= 2.5 * m && zeros > 0)
+		estimate = m * log((double)m / zeros);
+
+	return (unsigned int)(estimate + 0.5);
+}
+
+static void slot_add(const queriesData *query)
+{
+	cardinalitySlot *slot = &cardinality->slots[getOverTimeID(query->timestamp)];
+
+	const domainsData *domain = getDomain(query->domainID, true);
+	if(domain != NULL)
+		hll_add(slot->domains, HLL_SLOT_PRECISION, hll_hash((int)domain->domainhash, DOMAIN_SEED));
+
+	const clientsData *client = getClient(query->clientID, true);
+	if(client != NULL)
+		hll_add(slot->clients, HLL_SLOT_PRECISION, hll_hash((int)hashStr(getstr(client->ippos)), CLIENT_SEED));
+}
+
+static void client_add(const queriesData *query)
+{
+	clientsData *client = getClient(query->clientID, true);
+	if(client != NULL)
+		hll_add(client->unique_domains, HLL_CLIENT_PRECISION, hll_hash(query->domainID, DOMAIN_SEED));
+}
+
+void cardinality_add(const queriesData *query)
+{
+	if(cardinality == NULL)
+		return;
+
+	slot_add(query);
+	client_add(query);
+}
+
+// Move the sketches along with the overTime slots (see moveOverTimeMemory())
+void cardinality_move(const unsigned int moved)
+{
+	if(cardinality == NULL || moved == 0 || moved >= OVERTIME_SLOTS)
+		return;
+
+	memmove(&cardinality->slots[0], &cardinality->slots[moved],
+	        (OVERTIME_SLOTS - moved)*sizeof(cardinalitySlot));
+	memset(&cardinality->slots[OVERTIME_SLOTS - moved], 0, moved*sizeof(cardinalitySlot));
+}
+
+// Re-compute the sketches of the clients from the queries in memory
+void rebuild_client_cardinality(void)
+{
+	for(int clientID = 0; clientID < counters->clients; clientID++)
+	{
+		clientsData *client = getClient(clientID, true);
+		if(client != NULL)
+			memset(client->unique_domains, 0, sizeof(client->unique_domains));
+	}
+
+	for(int queryID = 0; queryID < counters->queries; queryID++)
+	{
+		const queriesData *query = getQuery(queryID, true);
+		if(query != NULL)
+			client_add(query);
+	}
+}
+
+// Re-compute all sketches, e.g., after restoring a snapshot which does not
+// contain them
+void rebuild_cardinality(void)
+{
+	if(cardinality == NULL)
+		return;
+
+	memset(cardinality, 0, sizeof(*cardinality));
+	for(int queryID = 0; queryID < counters->queries; queryID++)
+	{
+		const queriesData *query = getQuery(queryID, true);
+		if(query != NULL)
+			slot_add(query);
+	}
+
+	rebuild_client_cardinality();
+}
+
+// Merge the sketches of the overTime slots from .. until (inclusive) into the
+// given registers
+void merge_slots(const unsigned int from, const unsigned int until, cardinalitySlot *merged)
+{
+	if(cardinality == NULL)
+		return;
+
+	for(unsigned int slot = from; slot <= until && slot < OVERTIME_SLOTS; slot++)
+		merge_sketch(merged, &cardinality->slots[slot]);
+}
+
+// Merge one sketch into another by taking the maximum of each register
+void merge_sketch(cardinalitySlot *merged, const cardinalitySlot *other)
+{
+	for(unsigned int i = 0; i < HLL_SLOT_REGISTERS; i++)
+	{
+		if(other->domains[i] > merged->domains[i])
+			merged->domains[i] = other->domains[i];
+		if(other->clients[i] > merged->clients[i])
+			merged->clients[i] = other->clients[i];
+	}
+}
+
+// Estimate the number of distinct domains (returned) and clients of a sketch
+unsigned int sketch_unique(const cardinalitySlot *sketch, unsigned int *clients)
+{
+	if(clients != NULL)
+		*clients = hll_estimate(sketch->clients, HLL_SLOT_REGISTERS);
+	return hll_estimate(sketch->domains, HLL_SLOT_REGISTERS);
+}
+
+// Estimate the number of distinct domains (returned) and clients queried in
+// the overTime slots from .. until (inclusive)
+unsigned int unique_in_slots(const unsigned int from, const unsigned int until, unsigned int *clients)
+{
+	cardinalitySlot merged = { { 0 }, { 0 } };
+	merge_slots(from, until, &merged);
+	return sketch_unique(&merged, clients);
+}
+
+// Estimate the number of distinct domains queried by a client
+unsigned int client_unique_domains(const clientsData *client)
+{
+	return hll_estimate(client->unique_domains, HLL_CLIENT_REGISTERS);
+}
@@ -0,0 +1,44 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Distinct domain and client count estimation prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef CARDINALITY_H
+#define CARDINALITY_H
+
+// queriesData, HLL_CLIENT_REGISTERS
+#include "datastructure.h"
+
+// HyperLogLog registers of each overTime slot, the relative standard error of
+// the estimates is about 1.04 / sqrt(HLL_SLOT_REGISTERS) = 3.3%
+#define HLL_SLOT_PRECISION 10
+#define HLL_SLOT_REGISTERS (1 << HLL_SLOT_PRECISION)
+
+typedef struct {
+	unsigned char domains[HLL_SLOT_REGISTERS];
+	unsigned char clients[HLL_SLOT_REGISTERS];
+} cardinalitySlot;
+
+// The sketches are stored in shared memory as they are updated by forks, too.
+// Slot i belongs to overTime[i]
+typedef struct {
+	cardinalitySlot slots[OVERTIME_SLOTS];
+} cardinalityStruct;
+
+extern cardinalityStruct *cardinality;
+
+void cardinality_add(const queriesData *query);
+void cardinality_move(const unsigned int moved);
+void rebuild_cardinality(void);
+void rebuild_client_cardinality(void);
+void merge_slots(const unsigned int from, const unsigned int until, cardinalitySlot *merged);
+void merge_sketch(cardinalitySlot *merged, const cardinalitySlot *other);
+unsigned int sketch_unique(const cardinalitySlot *sketch, unsigned int *clients) __attribute__((pure));
+unsigned int unique_in_slots(const unsigned int from, const unsigned int until, unsigned int *clients) __attribute__((pure));
+unsigned int client_unique_domains(const clientsData *client) __attribute__((pure));
+
+#endif //CARDINALITY_H
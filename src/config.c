@@ -12,10 +12,34 @@
 #include "config.h"
 #include "setupVars.h"
 #include "log.h"
+// UDP_BATCH_MAX
+#include "udpbatch.h"
+// DNS_WORKERS_MAX
+#include "workers.h"
+// LEADERBOARD_SIZE
+#include "leaderboard.h"
+// file_changed()
+#include "files.h"
+// set_debug_limit()
+#include "debuglimit.h"
 // nice()
 #include <unistd.h>
 // argv_dnsmasq
 #include "args.h"
+// thread_sched_set_cpus()
+#include "threadsched.h"
+// max_queries_in_memory
+#include "gc.h"
+// sizeof(queriesData)
+#include "datastructure.h"
+// federation_set_peers()
+#include "federation.h"
+// gravity_replica_set_primary()
+#include "database/gravity-replica.h"
+// SIGCACHE_MAX
+#include "sigcache.h"
+// respcache_invalidate()
+#include "api/respcache.h"
 
 // INT_MAX
 #include <limits.h>
@@ -34,6 +58,13 @@ FTLFileNamesStruct FTLfiles = {
 	NULL,
 	NULL,
 	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
 	NULL
 };
 
@@ -43,11 +74,23 @@ pthread_mutex_t lock;
 static char *conflinebuffer = NULL;
 static size_t size = 0;
 
+// Raw values of the settings which are only applied on startup (paths,
+// peers, niceness and thread scheduling), changes are reported on reload
+static struct {
+	char *key;
+	char *value;
+} *startup_values = NULL;
+static unsigned int num_startup_values = 0u;
+static bool reloading = false;
+static unsigned int restart_needed = 0u;
+
 // Private prototypes
 static char *parse_FTLconf(FILE *fp, const char * key);
 static void getpath(FILE* fp, const char *option, const char *defaultloc, char **pointer);
 static void set_nice(const char *buffer, int fallback);
 static bool read_bool(const char *option, const bool fallback);
+static unsigned int read_prealloc(FILE *fp, const char *key, const char *unit);
+static bool apply_on_startup(const char *key, const char *value);
 
 void init_config_mutex(void)
 {
@@ -168,6 +211,46 @@ void read_FTLconf(void)
 	else
 		logg("   MAXDBDAYS: max age for stored queries is %i days", config.maxDBdays);
 
+	// ARCHIVEDAYS
+	// Queries older than this are moved into the compressed query archive
+	// defaults to: 0 (disabled)
+	config.archiveDBdays = 0;
+	buffer = parse_FTLconf(fp, "ARCHIVEDAYS");
+
+	value = 0;
+	if(buffer != NULL && sscanf(buffer, "%i", &value) == 1 && value > 0)
+		config.archiveDBdays = value > maxdbdays_max ? maxdbdays_max : value;
+
+	if(config.archiveDBdays == 0)
+		logg("   ARCHIVEDAYS: --- (archive disabled)");
+	else
+		logg("   ARCHIVEDAYS: archiving queries older than %i days", config.archiveDBdays);
+
+	// SAMPLE_QUERIES
+	// Store only every n-th permitted query in the long-term database. The
+	// totals and the hourly rollups still count all queries, the stored
+	// queries have the sampling rate in their column sample so they can be
+	// scaled up
+	// defaults to: 1 (store all queries)
+	config.sample_queries = 1u;
+	buffer = parse_FTLconf(fp, "SAMPLE_QUERIES");
+
+	unsigned int sample = 0u;
+	if(buffer != NULL && sscanf(buffer, "%u", &sample) == 1 && sample > 0u)
+		config.sample_queries = sample;
+
+	// SAMPLE_BLOCKED
+	// Sample blocked queries, too. All of them are stored otherwise
+	// defaults to: false
+	buffer = parse_FTLconf(fp, "SAMPLE_BLOCKED");
+	config.sample_blocked = read_bool(buffer, false);
+
+	if(config.sample_queries == 1u)
+		logg("   SAMPLE_QUERIES: --- (storing all queries)");
+	else
+		logg("   SAMPLE_QUERIES: storing 1 in %u %squeries", config.sample_queries,
+		     config.sample_blocked ? "" : "permitted ");
+
 	// RESOLVE_IPV6
 	// defaults to: Yes
 	buffer = parse_FTLconf(fp, "RESOLVE_IPV6");
@@ -213,7 +296,9 @@ void read_FTLconf(void)
 	buffer = parse_FTLconf(fp, "DBFILE");
 
 	// Use sscanf() to obtain filename from config file parameter only if buffer != NULL
-	if(!(buffer != NULL && sscanf(buffer, "%127ms", &FTLfiles.FTL_db)))
+	// (the database file is kept when reloading the config)
+	if(apply_on_startup("DBFILE", buffer) &&
+	   !(buffer != NULL && sscanf(buffer, "%127ms", &FTLfiles.FTL_db)))
 	{
 		// Use standard path if no custom path was obtained from the config file
 		FTLfiles.FTL_db = strdup("/etc/pihole/pihole-FTL.db");
@@ -259,6 +344,44 @@ void read_FTLconf(void)
 	logg("   MAXLOGAGE: Importing up to %.1f hours of log data%s",
 	     (float)config.maxlogage/3600.0f, hint);
 
+	// QUERY_MEMORY_LIMIT
+	// Memory budget [MiB] for the queries kept in shared memory. When more
+	// queries than fit into it are recorded, the oldest ones already stored
+	// in the database are removed from memory before MAXLOGAGE (taking
+	// their counts with them). >getallqueries-time reads older queries from
+	// the database instead
+	// defaults to: 0 (unlimited)
+	max_queries_in_memory = 0;
+	buffer = parse_FTLconf(fp, "QUERY_MEMORY_LIMIT");
+
+	unsigned int budget = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &budget) == 1 && budget > 0 && budget <= 65536u)
+		max_queries_in_memory = (int)((size_t)budget*1024u*1024u/sizeof(queriesData));
+
+	if(max_queries_in_memory > 0 && config.maxDBdays == 0)
+		logg("   QUERY_MEMORY_LIMIT: Ineffective as queries are not stored in the database");
+	else if(max_queries_in_memory > 0)
+		logg("   QUERY_MEMORY_LIMIT: Keeping up to %u MiB (%i queries) in memory", budget, max_queries_in_memory);
+	else
+		logg("   QUERY_MEMORY_LIMIT: Unlimited");
+
+	// RECLAIM_GRACE
+	// Domains and clients without any queries left in memory are removed
+	// once they have not been seen for this many seconds, their slots are
+	// reused for new domains and clients. Zero keeps them forever
+	// defaults to: 3600 (one hour)
+	config.reclaim_grace = 3600u;
+	buffer = parse_FTLconf(fp, "RECLAIM_GRACE");
+
+	unsigned int grace = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &grace) == 1 && grace <= 604800u)
+		config.reclaim_grace = grace;
+
+	if(config.reclaim_grace > 0)
+		logg("   RECLAIM_GRACE: Reclaiming unused domains and clients after %u seconds", config.reclaim_grace);
+	else
+		logg("   RECLAIM_GRACE: Disabled");
+
 	// PRIVACYLEVEL
 	// Specify if we want to anonymize the DNS queries somehow, available options are:
 	// PRIVACY_SHOW_ALL (0) = don't hide anything
@@ -335,6 +458,53 @@ void read_FTLconf(void)
 	else
 		logg("   DBIMPORT: Not importing history from database");
 
+	// SHMEM_SNAPSHOT
+	// Should the history be written to a snapshot file of the shared memory
+	// on shutdown and restored from it on the next start instead of being
+	// imported from the database?
+	// defaults to: false
+	buffer = parse_FTLconf(fp, "SHMEM_SNAPSHOT");
+	config.shmem_snapshot = read_bool(buffer, false);
+
+	if(config.shmem_snapshot)
+		logg("   SHMEM_SNAPSHOT: Restoring history from a snapshot if available");
+	else
+		logg("   SHMEM_SNAPSHOT: Disabled");
+
+	// SNAPSHOTFILE
+	getpath(fp, "SNAPSHOTFILE", "/etc/pihole/pihole-FTL.snapshot", &FTLfiles.shmem_snapshot);
+
+	// DNS_CACHE_DUMP
+	// Should the unexpired entries of the DNS cache be written to a file on
+	// shutdown and restored with their remaining TTL on the next start?
+	// defaults to: false
+	buffer = parse_FTLconf(fp, "DNS_CACHE_DUMP");
+	config.dns_cache_dump = read_bool(buffer, false);
+
+	if(config.dns_cache_dump)
+		logg("   DNS_CACHE_DUMP: Restoring the DNS cache if available");
+	else
+		logg("   DNS_CACHE_DUMP: Disabled");
+
+	// DNSCACHEFILE
+	getpath(fp, "DNSCACHEFILE", "/etc/pihole/pihole-FTL.dnscache", &FTLfiles.dns_cache);
+
+	// HANDOVER
+	// Should a new FTL process take over the listening sockets and the
+	// history from the running one instead of waiting for it to terminate
+	// first? (see src/handover.c)
+	// defaults to: false
+	buffer = parse_FTLconf(fp, "HANDOVER");
+	config.handover = read_bool(buffer, false);
+
+	if(config.handover)
+		logg("   HANDOVER: Taking over from a running instance if available");
+	else
+		logg("   HANDOVER: Disabled");
+
+	// HANDOVERFILE
+	getpath(fp, "HANDOVERFILE", "/run/pihole/FTL-handover.sock", &FTLfiles.handover);
+
 	// PIDFILE
 	getpath(fp, "PIDFILE", "/run/pihole-FTL.pid", &FTLfiles.pid);
 
@@ -350,6 +520,62 @@ void read_FTLconf(void)
 	// GRAVITYDB
 	getpath(fp, "GRAVITYDB", "/etc/pihole/gravity.db", &FTLfiles.gravity_db);
 
+	// BINARY_QUERY_LOG
+	// Write one binary record per completed query to QUERYLOGFILE, decode
+	// it using "pihole-FTL querylog"
+	// defaults to: false
+	buffer = parse_FTLconf(fp, "BINARY_QUERY_LOG");
+	config.binary_querylog = read_bool(buffer, false);
+
+	if(config.binary_querylog)
+		logg("   BINARY_QUERY_LOG: Enabled");
+	else
+		logg("   BINARY_QUERY_LOG: Disabled");
+
+	// QUERYLOGFILE
+	getpath(fp, "QUERYLOGFILE", "/var/log/pihole/queries.bin", &FTLfiles.querylog);
+
+	// DNSTAP
+	// Send dnstap messages of all completed queries to the collector at
+	// DNSTAPSOCKET (see src/dnstap.c)
+	// defaults to: false
+	buffer = parse_FTLconf(fp, "DNSTAP");
+	config.dnstap = read_bool(buffer, false);
+
+	if(config.dnstap)
+		logg("   DNSTAP: Enabled");
+	else
+		logg("   DNSTAP: Disabled");
+
+	// DNSTAPSOCKET
+	// Unix socket (absolute path) or host:port (TCP) of the dnstap collector
+	getpath(fp, "DNSTAPSOCKET", "/run/pihole/dnstap.sock", &FTLfiles.dnstap);
+
+	// FEDERATION_PEERS
+	// Comma-separated list of the API ports (host:port) of other FTL nodes.
+	// Their summaries are merged with our own statistics by the >cluster-*
+	// API commands (see src/federation.c). The peers have to accept API
+	// connections from this node (SOCKET_LISTENING=all)
+	// defaults to: unset (no federation)
+	buffer = parse_FTLconf(fp, "FEDERATION_PEERS");
+	const unsigned int peers = apply_on_startup("FEDERATION_PEERS", buffer) ? federation_set_peers(buffer) : 0u;
+
+	// FEDERATION_INTERVAL
+	// Interval [seconds] in which the summaries of the peers are fetched
+	// defaults to: 10 seconds
+	config.federation_interval = 10u;
+	buffer = parse_FTLconf(fp, "FEDERATION_INTERVAL");
+
+	unsigned int fedinterval = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &fedinterval) == 1 && fedinterval >= 1u && fedinterval <= 3600u)
+		config.federation_interval = fedinterval;
+
+	if(peers > 0u)
+		logg("   FEDERATION_PEERS: Merging statistics of %u peer%s every %u seconds",
+		     peers, peers == 1u ? "" : "s", config.federation_interval);
+	else if(!reloading)
+		logg("   FEDERATION_PEERS: --- (no federation)");
+
 	// PARSE_ARP_CACHE
 	// defaults to: true
 	buffer = parse_FTLconf(fp, "PARSE_ARP_CACHE");
@@ -403,7 +629,8 @@ void read_FTLconf(void)
 	// systems, the range is -20..20. Very early Linux kernels (Before Linux
 	// 2.0) had the range -infinity..15.
 	buffer = parse_FTLconf(fp, "NICE");
-	set_nice(buffer, -10);
+	if(apply_on_startup("NICE", buffer))
+		set_nice(buffer, -10);
 
 	// MAXNETAGE
 	// IP addresses (and associated host names) older than the specified number
@@ -496,6 +723,41 @@ void read_FTLconf(void)
 	else
 		logg("   RATE_LIMIT: Disabled");
 
+	// RATE_LIMIT_PREFIX
+	// Prefix lengths of the IPv4 and IPv6 subnets whose clients share a
+	// rate-limit of RATE_LIMIT_PREFIX_COUNT queries per RATE_LIMIT interval,
+	// e.g. "24,56". Zero disables this for the family
+	// defaults to: 0,0 (disabled)
+	config.rate_limit.prefix_v4 = 0;
+	config.rate_limit.prefix_v6 = 0;
+	buffer = parse_FTLconf(fp, "RATE_LIMIT_PREFIX");
+
+	unsigned int prefix_v4 = 0, prefix_v6 = 0;
+	if(buffer != NULL && sscanf(buffer, "%u,%u", &prefix_v4, &prefix_v6) == 2 &&
+	   prefix_v4 <= 32 && prefix_v6 <= 128)
+	{
+		config.rate_limit.prefix_v4 = prefix_v4;
+		config.rate_limit.prefix_v6 = prefix_v6;
+	}
+
+	// RATE_LIMIT_PREFIX_COUNT
+	// defaults to: ten times the RATE_LIMIT count
+	config.rate_limit.prefix_count = 10 * config.rate_limit.count;
+	buffer = parse_FTLconf(fp, "RATE_LIMIT_PREFIX_COUNT");
+
+	if(buffer != NULL && sscanf(buffer, "%u", &count) == 1)
+		config.rate_limit.prefix_count = count;
+
+	if(config.rate_limit.prefix_v4 == 0 && config.rate_limit.prefix_v6 == 0)
+		config.rate_limit.prefix_count = 0;
+
+	if(config.rate_limit.prefix_count > 0)
+		logg("   RATE_LIMIT_PREFIX: Rate-limiting IPv4 /%u and IPv6 /%u subnets making more than %u queries in %u second%s",
+		     config.rate_limit.prefix_v4, config.rate_limit.prefix_v6, config.rate_limit.prefix_count,
+		     config.rate_limit.interval, config.rate_limit.interval == 1 ? "" : "s");
+	else
+		logg("   RATE_LIMIT_PREFIX: Disabled");
+
 	// LOCAL_IPV4
 	// Use a specific IP address instead of automatically detecting the
 	// IPv4 interface address a query arrived on for A hostname queries
@@ -631,6 +893,324 @@ void read_FTLconf(void)
 	else
 		logg("   SHOW_DNSSEC: Disabled");
 
+	// UPSTREAM_SCORING
+	// Should FTL pick the upstream server with the lowest average response
+	// time and error rate instead of the one dnsmasq considers the fastest?
+	// defaults to: false
+	buffer = parse_FTLconf(fp, "UPSTREAM_SCORING");
+	config.upstream_scoring = read_bool(buffer, false);
+
+	if(config.upstream_scoring)
+		logg("   UPSTREAM_SCORING: Enabled, preferring the fastest healthy upstream server");
+	else
+		logg("   UPSTREAM_SCORING: Disabled");
+
+	// UPSTREAM_PROBE_INTERVAL
+	// Interval [seconds] in which upstream servers that did not answer
+	// client queries are sent a probe query. Servers not answering the
+	// probes are skipped until they answer again. Zero disables probing
+	// defaults to: 0 (disabled)
+	config.upstream_probe_interval = 0u;
+	buffer = parse_FTLconf(fp, "UPSTREAM_PROBE_INTERVAL");
+
+	unsigned int probeinterval = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &probeinterval) == 1 && probeinterval <= 3600u)
+		config.upstream_probe_interval = probeinterval;
+
+	if(config.upstream_probe_interval > 0)
+		logg("   UPSTREAM_PROBE_INTERVAL: Probing idle upstream servers every %u seconds",
+		     config.upstream_probe_interval);
+	else
+		logg("   UPSTREAM_PROBE_INTERVAL: Disabled");
+
+	// UPSTREAM_MAX_INFLIGHT
+	// Maximum number of queries awaiting a reply from an upstream server.
+	// Further queries spill over to the other servers for the domain until
+	// it catches up. Zero disables the limit
+	// defaults to: 0 (unlimited)
+	config.upstream_max_inflight = 0u;
+	buffer = parse_FTLconf(fp, "UPSTREAM_MAX_INFLIGHT");
+
+	unsigned int maxinflight = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &maxinflight) == 1 && maxinflight <= 65536u)
+		config.upstream_max_inflight = maxinflight;
+
+	if(config.upstream_max_inflight > 0)
+		logg("   UPSTREAM_MAX_INFLIGHT: At most %u queries in flight per upstream server",
+		     config.upstream_max_inflight);
+	else
+		logg("   UPSTREAM_MAX_INFLIGHT: Unlimited");
+
+	// SHMEM_STATS
+	// Should a summary of the statistics be published once per second in the
+	// shared memory object FTL-stats for local consumers (see libftlstats)?
+	// defaults to: false
+	buffer = parse_FTLconf(fp, "SHMEM_STATS");
+	config.shmem_stats = read_bool(buffer, false);
+
+	if(config.shmem_stats)
+		logg("   SHMEM_STATS: Publishing statistics in shared memory");
+	else
+		logg("   SHMEM_STATS: Disabled");
+
+	// DEFER_STATISTICS
+	// Should the statistics be updated by a separate thread instead of
+	// while dnsmasq is answering queries? Only the blocking decision is
+	// made synchronously then
+	// defaults to: false
+	buffer = parse_FTLconf(fp, "DEFER_STATISTICS");
+	config.defer_statistics = read_bool(buffer, false);
+
+	if(config.defer_statistics)
+		logg("   DEFER_STATISTICS: Enabled, updating statistics in the background");
+	else
+		logg("   DEFER_STATISTICS: Disabled");
+
+	// UDP_BATCH
+	// Maximum number of UDP datagrams received with a single recvmmsg()
+	// call and of replies sent with a single sendmmsg() call. One disables
+	// batching
+	// defaults to: 1
+	config.udp_batch = 1u;
+	buffer = parse_FTLconf(fp, "UDP_BATCH");
+
+	unsigned int batch = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &batch) && batch >= 1u && batch <= UDP_BATCH_MAX)
+		config.udp_batch = batch;
+
+	if(config.udp_batch > 1)
+		logg("   UDP_BATCH: Receiving and sending up to %u datagrams at once", config.udp_batch);
+	else
+		logg("   UDP_BATCH: Disabled");
+
+	// DNS_WORKERS
+	// Number of additional processes answering UDP queries. They share the
+	// listening sockets and FTL's statistics with the main process
+	// defaults to: 0
+	config.dns_workers = 0u;
+	buffer = parse_FTLconf(fp, "DNS_WORKERS");
+
+	unsigned int workers = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &workers) && workers <= DNS_WORKERS_MAX)
+		config.dns_workers = workers;
+
+	if(config.dns_workers > 0)
+		logg("   DNS_WORKERS: Answering UDP queries with %u additional processes", config.dns_workers);
+	else
+		logg("   DNS_WORKERS: Disabled");
+
+	// PREFETCH
+	// Number of most frequently permitted domains whose cached records are
+	// refreshed shortly before they expire. Zero disables prefetching
+	// defaults to: 0
+	config.prefetch = 0u;
+	buffer = parse_FTLconf(fp, "PREFETCH");
+
+	unsigned int prefetch = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &prefetch) && prefetch <= LEADERBOARD_SIZE)
+		config.prefetch = prefetch;
+
+	if(config.prefetch > 0)
+		logg("   PREFETCH: Refreshing cached records of the top %u domains", config.prefetch);
+	else
+		logg("   PREFETCH: Disabled");
+
+	// ADAPTIVE_CACHE
+	// Maximum amount of memory [KiB] the DNS cache may grow to when live
+	// entries are evicted because it is full. Zero keeps the cache at the
+	// size configured for dnsmasq
+	// defaults to: 0
+	config.adaptive_cache = 0u;
+	buffer = parse_FTLconf(fp, "ADAPTIVE_CACHE");
+
+	unsigned int cachemem = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &cachemem) && cachemem <= 1048576u)
+		config.adaptive_cache = cachemem;
+
+	if(config.adaptive_cache > 0)
+		logg("   ADAPTIVE_CACHE: Growing the DNS cache up to %u KiB", config.adaptive_cache);
+	else
+		logg("   ADAPTIVE_CACHE: Disabled");
+
+	// TCP_POOL_IDLE
+	// Number of seconds connections to upstream servers opened for queries
+	// received over TCP are kept open for further queries after the TCP
+	// worker which opened them has terminated. Zero closes them together
+	// with the worker
+	// defaults to: 0
+	config.tcp_pool_idle = 0u;
+	buffer = parse_FTLconf(fp, "TCP_POOL_IDLE");
+
+	unsigned int poolidle = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &poolidle) && poolidle <= 3600u)
+		config.tcp_pool_idle = poolidle;
+
+	if(config.tcp_pool_idle > 0)
+		logg("   TCP_POOL_IDLE: Keeping idle upstream TCP connections open for %u seconds", config.tcp_pool_idle);
+	else
+		logg("   TCP_POOL_IDLE: Disabled");
+
+	// LEASE_WRITE_DELAY
+	// Minimum time [ms] between two writes of the DHCP lease file. Lease
+	// changes within this time are written together. Zero writes the file
+	// on every change
+	// defaults to: 0
+	config.lease_write_delay = 0u;
+	buffer = parse_FTLconf(fp, "LEASE_WRITE_DELAY");
+
+	unsigned int leasedelay = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &leasedelay) && leasedelay <= 60000u)
+		config.lease_write_delay = leasedelay;
+
+	if(config.lease_write_delay > 0)
+		logg("   LEASE_WRITE_DELAY: Writing the lease file at most every %u ms", config.lease_write_delay);
+	else
+		logg("   LEASE_WRITE_DELAY: Disabled");
+
+	// IPSET_DEDUP
+	// Maximum time [s] an address added to an ipset or nftset is not added
+	// again when it is received in further replies. The TTL of the record
+	// is used if it is shorter. Zero adds the address on every reply
+	// defaults to: 0
+	config.ipset_dedup = 0u;
+	buffer = parse_FTLconf(fp, "IPSET_DEDUP");
+
+	unsigned int dedup = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &dedup) && dedup <= 86400u)
+		config.ipset_dedup = dedup;
+
+	if(config.ipset_dedup > 0)
+		logg("   IPSET_DEDUP: Not adding addresses to sets again for up to %u seconds", config.ipset_dedup);
+	else
+		logg("   IPSET_DEDUP: Disabled");
+
+	// DNSSEC_SIGCACHE
+	// Number of DNSSEC signature verification results remembered so the
+	// same signatures are not verified again for further queries. Rounded
+	// up to a power of two, zero verifies every signature
+	// defaults to: 1024
+	config.dnssec_sigcache = 1024u;
+	buffer = parse_FTLconf(fp, "DNSSEC_SIGCACHE");
+
+	unsigned int sigcache = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &sigcache) == 1 && sigcache <= SIGCACHE_MAX)
+	{
+		config.dnssec_sigcache = 0u;
+		if(sigcache > 0u)
+		{
+			config.dnssec_sigcache = 1u;
+			while(config.dnssec_sigcache < sigcache)
+				config.dnssec_sigcache *= 2u;
+		}
+	}
+
+	if(config.dnssec_sigcache > 0)
+		logg("   DNSSEC_SIGCACHE: Remembering up to %u signature verifications", config.dnssec_sigcache);
+	else
+		logg("   DNSSEC_SIGCACHE: Disabled");
+
+	// AGGRESSIVE_NSEC
+	// Answer queries for names proven not to exist by NSEC/NSEC3 records of
+	// earlier validated NXDOMAIN replies from the cache (RFC 8198). Only
+	// used when DNSSEC validation is enabled
+	// defaults to: true
+	buffer = parse_FTLconf(fp, "AGGRESSIVE_NSEC");
+	config.aggressive_nsec = read_bool(buffer, true);
+
+	if(config.aggressive_nsec)
+		logg("   AGGRESSIVE_NSEC: Synthesizing NXDOMAIN from validated NSEC/NSEC3 records");
+	else
+		logg("   AGGRESSIVE_NSEC: Disabled");
+
+	// PCAP_BUFFER
+	// Size of the buffer [KiB] packets dumped by dnsmasq (dumpfile) are
+	// collected in before they are written to the file by a background
+	// thread. Zero writes them synchronously
+	// defaults to: 0
+	config.pktdump.buffer = 0u;
+	buffer = parse_FTLconf(fp, "PCAP_BUFFER");
+
+	unsigned int pcapbuf = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &pcapbuf) && pcapbuf <= 1048576u)
+		config.pktdump.buffer = pcapbuf;
+
+	if(config.pktdump.buffer > 0)
+		logg("   PCAP_BUFFER: Writing dumped packets asynchronously (%u KiB buffer)", config.pktdump.buffer);
+	else
+		logg("   PCAP_BUFFER: Disabled");
+
+	// PCAP_MAX_SIZE
+	// Maximum size [MiB] of the packet dump file before it is rotated. Only
+	// used with PCAP_BUFFER. Zero never rotates the file
+	// defaults to: 0
+	config.pktdump.max_size = 0u;
+	buffer = parse_FTLconf(fp, "PCAP_MAX_SIZE");
+
+	unsigned int pcapsize = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &pcapsize) && pcapsize <= 4096u)
+		config.pktdump.max_size = pcapsize;
+
+	// PCAP_MAX_FILES
+	// Number of rotated packet dump files which are kept
+	// defaults to: 5
+	config.pktdump.files = 5u;
+	buffer = parse_FTLconf(fp, "PCAP_MAX_FILES");
+
+	unsigned int pcapfiles = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &pcapfiles) && pcapfiles >= 1u && pcapfiles <= 100u)
+		config.pktdump.files = pcapfiles;
+
+	if(config.pktdump.buffer > 0 && config.pktdump.max_size > 0)
+		logg("   PCAP_MAX_SIZE: Rotating the packet dump at %u MiB, keeping %u old files",
+		     config.pktdump.max_size, config.pktdump.files);
+	else
+		logg("   PCAP_MAX_SIZE: Disabled");
+
+	// PCAP_TRIGGER
+	// Only write the packets dumped within this many seconds before an
+	// upstream server returned an error. Only used with PCAP_BUFFER. Zero
+	// writes all packets
+	// defaults to: 0
+	config.pktdump.trigger = 0u;
+	buffer = parse_FTLconf(fp, "PCAP_TRIGGER");
+
+	unsigned int pcaptrigger = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &pcaptrigger) && pcaptrigger <= 3600u)
+		config.pktdump.trigger = pcaptrigger;
+
+	if(config.pktdump.buffer > 0 && config.pktdump.trigger > 0)
+		logg("   PCAP_TRIGGER: Dumping the last %u seconds on upstream errors", config.pktdump.trigger);
+	else
+		logg("   PCAP_TRIGGER: Disabled");
+
+	// FAST_QUESTION_HASH
+	// Match replies to forwarded queries using SipHash keyed with a random
+	// secret instead of SHA-256 over the question section
+	// defaults to: false
+	buffer = parse_FTLconf(fp, "FAST_QUESTION_HASH");
+	config.fast_question_hash = read_bool(buffer, false);
+
+	if(config.fast_question_hash)
+		logg("   FAST_QUESTION_HASH: Enabled, using SipHash to match replies");
+	else
+		logg("   FAST_QUESTION_HASH: Disabled");
+
+	// LOG_BUFFER
+	// Size of the queue of log lines written by the log writer thread [KiB].
+	// Zero writes every line synchronously
+	// defaults to: 0
+	config.log_buffer = 0u;
+	buffer = parse_FTLconf(fp, "LOG_BUFFER");
+
+	unsigned int logbuffer = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &logbuffer) && logbuffer <= 65536u)
+		config.log_buffer = logbuffer;
+
+	if(config.log_buffer > 0)
+		logg("   LOG_BUFFER: Writing the log asynchronously (%u KiB buffer)", config.log_buffer);
+	else
+		logg("   LOG_BUFFER: Disabled");
+
 	// MOZILLA_CANARY
 	// Should FTL handle use-application-dns.net specifically and always return NXDOMAIN?
 	// defaults to: true
@@ -770,6 +1350,411 @@ void read_FTLconf(void)
 
 	logg("   CHECK_DISK: Warning if certain disk usage exceeds %d%%", config.check.disk);
 
+	// PREALLOC_QUERIES, PREALLOC_CLIENTS, PREALLOC_DOMAINS, PREALLOC_DNS_CACHE
+	// Initial capacity of the shared memory objects. Objects are allocated at
+	// this size when FTL starts and are only grown beyond it if needed. Every
+	// growth forces all processes to remap their shared memory objects
+	// defaults to: 0 (start small and grow when needed)
+	config.prealloc.queries = read_prealloc(fp, "PREALLOC_QUERIES", "queries");
+	config.prealloc.clients = read_prealloc(fp, "PREALLOC_CLIENTS", "clients");
+	config.prealloc.domains = read_prealloc(fp, "PREALLOC_DOMAINS", "domains");
+	config.prealloc.dns_cache = read_prealloc(fp, "PREALLOC_DNS_CACHE", "DNS cache records");
+
+	// PREALLOC_STRINGS
+	// Initial size of the shared string buffer in bytes
+	// defaults to: 0 (start small and grow when needed)
+	config.prealloc.strings = read_prealloc(fp, "PREALLOC_STRINGS", "bytes of strings");
+
+	// GRAVITY_IN_MEMORY
+	// Should gravity domains be held in an in-memory hash set? This avoids
+	// database lookups for every new domain at the cost of 32 bytes of
+	// memory per unique gravity domain
+	// defaults to: true
+	buffer = parse_FTLconf(fp, "GRAVITY_IN_MEMORY");
+	config.gravity_in_memory = read_bool(buffer, true);
+
+	if(config.gravity_in_memory)
+		logg("   GRAVITY_IN_MEMORY: Holding gravity domains in memory");
+	else
+		logg("   GRAVITY_IN_MEMORY: Looking up gravity domains in the database");
+
+	// GRAVITY_PUBLISH
+	// Offer the gravity database and its compiled index to replicas through
+	// the API (see src/database/gravity-replica.c). Replicas need to be
+	// able to connect to the API port (SOCKET_LISTENING=all)
+	// defaults to: false
+	buffer = parse_FTLconf(fp, "GRAVITY_PUBLISH");
+	config.gravity_publish = read_bool(buffer, false);
+
+	if(config.gravity_publish)
+		logg("   GRAVITY_PUBLISH: Offering the gravity database to replicas");
+	else
+		logg("   GRAVITY_PUBLISH: Disabled");
+
+	// GRAVITY_PRIMARY
+	// API port (host:port) of the primary to replicate the gravity database
+	// from. Replicas should not run gravity themselves
+	// defaults to: unset (no replication)
+	buffer = parse_FTLconf(fp, "GRAVITY_PRIMARY");
+	const char *primary = apply_on_startup("GRAVITY_PRIMARY", buffer) ? gravity_replica_set_primary(buffer) : NULL;
+
+	// GRAVITY_SYNC_INTERVAL
+	// Interval [seconds] in which replicas check the primary for changes
+	// defaults to: 60 seconds
+	config.gravity_sync_interval = 60u;
+	buffer = parse_FTLconf(fp, "GRAVITY_SYNC_INTERVAL");
+
+	unsigned int syncinterval = 0;
+	if(buffer != NULL && sscanf(buffer, "%u", &syncinterval) == 1 && syncinterval >= 1u && syncinterval <= 86400u)
+		config.gravity_sync_interval = syncinterval;
+
+	if(primary != NULL)
+		logg("   GRAVITY_PRIMARY: Replicating gravity from %s every %u seconds",
+		     primary, config.gravity_sync_interval);
+	else if(!reloading)
+		logg("   GRAVITY_PRIMARY: --- (no replication)");
+
+	// REGEX_PREFILTER
+	// Should the literals of all regex filters be combined into one automaton
+	// which determines in a single pass which regex can possibly match? Only
+	// these are executed afterwards
+	// defaults to: true
+	buffer = parse_FTLconf(fp, "REGEX_PREFILTER");
+	config.regex_prefilter = read_bool(buffer, true);
+
+	if(config.regex_prefilter)
+		logg("   REGEX_PREFILTER: Executing only regex whose literals match");
+	else
+		logg("   REGEX_PREFILTER: Executing all regex");
+
+	// REGEX_ARENA
+	// Should all regex read from the database be compiled into a few large
+	// blocks of memory which are freed in one go on the next reload? This
+	// avoids fragmenting the heap with the many small allocations of the
+	// compiled regex and speeds up reloading
+	// defaults to: true
+	buffer = parse_FTLconf(fp, "REGEX_ARENA");
+	config.regex_arena = read_bool(buffer, true);
+
+	if(config.regex_arena)
+		logg("   REGEX_ARENA: Compiling regex into arenas");
+	else
+		logg("   REGEX_ARENA: Compiling regex onto the heap");
+
+	// VERDICT_CACHE_SIZE
+	// Number of (domain, group set) blocking verdicts shared between all
+	// clients with identical groups. Rounded up to a power of two, zero
+	// disables the verdict cache
+	// defaults to: 16384
+	config.verdict_cache_size = 16384u;
+	buffer = parse_FTLconf(fp, "VERDICT_CACHE_SIZE");
+
+	if(buffer != NULL && sscanf(buffer, "%u", &uval) && uval <= 16777216u)
+		config.verdict_cache_size = uval;
+
+	if(config.verdict_cache_size > 0)
+		logg("   VERDICT_CACHE_SIZE: %u verdicts", config.verdict_cache_size);
+	else
+		logg("   VERDICT_CACHE_SIZE: Disabled");
+
+	// VERDICT_WARMUP
+	// Number of most frequently queried domains whose verdicts are computed
+	// for all active group sets after the lists have been (re)loaded, before
+	// they are queried again. Zero disables the warm-up
+	// defaults to: 500
+	config.verdict_warmup = 500u;
+	buffer = parse_FTLconf(fp, "VERDICT_WARMUP");
+
+	if(buffer != NULL && sscanf(buffer, "%u", &uval) && uval <= 1000000u)
+		config.verdict_warmup = uval;
+
+	if(config.verdict_warmup > 0 && config.verdict_cache_size > 0)
+		logg("   VERDICT_WARMUP: Warming up the verdict cache with %u domains", config.verdict_warmup);
+	else
+		logg("   VERDICT_WARMUP: Disabled");
+
+	// REGEX_SLOW_THRESHOLD
+	// Average execution time (in microseconds) above which a regex filter
+	// is reported as slow. Zero disables the warning
+	// defaults to: 100
+	config.regex_slow_threshold = 100u;
+	buffer = parse_FTLconf(fp, "REGEX_SLOW_THRESHOLD");
+
+	if(buffer != NULL && sscanf(buffer, "%u", &uval))
+		config.regex_slow_threshold = uval;
+
+	if(config.regex_slow_threshold > 0)
+		logg("   REGEX_SLOW_THRESHOLD: Warning about regex taking more than %u usec on average",
+		     config.regex_slow_threshold);
+	else
+		logg("   REGEX_SLOW_THRESHOLD: Disabled");
+
+	// SLOW_QUERY_THRESHOLD
+	// Time (in milliseconds) from receiving a query until recording its
+	// reply above which the query is kept with the durations of its pipeline
+	// stages (API command >querystages slow). Zero disables this
+	// defaults to: 0
+	config.slow_query_threshold = 0u;
+	buffer = parse_FTLconf(fp, "SLOW_QUERY_THRESHOLD");
+
+	if(buffer != NULL && sscanf(buffer, "%u", &uval) && uval <= 3600000u)
+		config.slow_query_threshold = uval;
+
+	if(config.slow_query_threshold > 0)
+		logg("   SLOW_QUERY_THRESHOLD: Keeping queries taking more than %u msec",
+		     config.slow_query_threshold);
+	else
+		logg("   SLOW_QUERY_THRESHOLD: Disabled");
+
+	// SHMEM_HUGEPAGES
+	// Should the (potentially large) queries and strings shared memory
+	// objects be backed by (transparent) huge pages if available?
+	// defaults to: false
+	buffer = parse_FTLconf(fp, "SHMEM_HUGEPAGES");
+	config.shmem_hugepages = read_bool(buffer, false);
+
+	if(config.shmem_hugepages)
+		logg("   SHMEM_HUGEPAGES: Using huge pages for queries and strings if available");
+	else
+		logg("   SHMEM_HUGEPAGES: Disabled");
+
+	// DBFLUSH_INTERVAL
+	// Store completed queries in the database continuously: new queries
+	// are written at most this many milliseconds after they completed.
+	// Zero stores queries only every DBINTERVAL
+	// defaults to: 1000
+	config.db_flush.interval = 1000u;
+	buffer = parse_FTLconf(fp, "DBFLUSH_INTERVAL");
+
+	if(buffer != NULL && sscanf(buffer, "%u", &uval))
+		config.db_flush.interval = uval;
+
+	// DBFLUSH_ROWS
+	// Store queries earlier if at least this many are waiting
+	// defaults to: 500
+	config.db_flush.rows = 500u;
+	buffer = parse_FTLconf(fp, "DBFLUSH_ROWS");
+
+	if(buffer != NULL && sscanf(buffer, "%u", &uval) && uval > 0)
+		config.db_flush.rows = uval;
+
+	if(config.db_flush.interval > 0)
+		logg("   DBFLUSH_INTERVAL: Storing queries every %u ms or every %u queries",
+		     config.db_flush.interval, config.db_flush.rows);
+	else
+		logg("   DBFLUSH_INTERVAL: Disabled, storing queries every DBINTERVAL");
+
+	// SQLITE_PAGECACHE
+	// Size of a static arena SQLite3 takes its page cache from [KiB]. This
+	// avoids fragmenting the heap with database pages. Pages which do not
+	// fit into the arena are allocated on the heap
+	// defaults to: 0 (no arena)
+	config.sqlite.pagecache = 0u;
+	buffer = parse_FTLconf(fp, "SQLITE_PAGECACHE");
+
+	if(buffer != NULL && sscanf(buffer, "%u", &uval) == 1 && uval <= 1048576u)
+		config.sqlite.pagecache = uval;
+
+	if(config.sqlite.pagecache > 0)
+		logg("   SQLITE_PAGECACHE: Using a page cache arena of %u KiB", config.sqlite.pagecache);
+	else
+		logg("   SQLITE_PAGECACHE: --- (allocating the page cache on the heap)");
+
+	// SQLITE_LOOKASIDE
+	// Number of lookaside slots of every database connection. SQLite3 takes
+	// small, short-lived allocations from them instead of the heap. 0
+	// disables the lookaside memory
+	// defaults to: -1 (use SQLite3's default)
+	config.sqlite.lookaside = -1;
+	buffer = parse_FTLconf(fp, "SQLITE_LOOKASIDE");
+
+	if(buffer != NULL && sscanf(buffer, "%u", &uval) == 1 && uval <= 65536u)
+		config.sqlite.lookaside = uval;
+
+	if(config.sqlite.lookaside > -1)
+		logg("   SQLITE_LOOKASIDE: Using %i lookaside slots per connection", config.sqlite.lookaside);
+	else
+		logg("   SQLITE_LOOKASIDE: --- (using SQLite3's default)");
+
+	// GRAVITY_MMAP
+	// Size of the memory map of the (read-only) gravity database [MiB]. Pages
+	// of the gravity database are read from the mapping instead of copying
+	// them into the page cache
+	// defaults to: 0 (no memory map)
+	config.sqlite.gravity_mmap = 0u;
+	buffer = parse_FTLconf(fp, "GRAVITY_MMAP");
+
+	if(buffer != NULL && sscanf(buffer, "%u", &uval) == 1 && uval <= 2047u)
+		config.sqlite.gravity_mmap = uval;
+
+	if(config.sqlite.gravity_mmap > 0)
+		logg("   GRAVITY_MMAP: Mapping up to %u MiB of the gravity database", config.sqlite.gravity_mmap);
+	else
+		logg("   GRAVITY_MMAP: --- (no memory map)");
+
+	// DBMAINTENANCE_INTERVAL
+	// Interval [seconds] of the database maintenance (incremental vacuum,
+	// PRAGMA optimize and WAL checkpoint). It is run in small slices while
+	// the DNS load is below DBMAINTENANCE_IDLE queries per second and no
+	// queries are waiting to be stored
+	// defaults to: 3600 seconds (once per hour), 0 disables the maintenance
+	config.db_maintenance.interval = 3600u;
+	buffer = parse_FTLconf(fp, "DBMAINTENANCE_INTERVAL");
+
+	if(buffer != NULL && sscanf(buffer, "%u", &uval) == 1 && uval <= 604800u)
+		config.db_maintenance.interval = uval;
+
+	// DBMAINTENANCE_IDLE
+	// defaults to: 10 queries per second
+	config.db_maintenance.idle = 10u;
+	buffer = parse_FTLconf(fp, "DBMAINTENANCE_IDLE");
+
+	if(buffer != NULL && sscanf(buffer, "%u", &uval) == 1)
+		config.db_maintenance.idle = uval;
+
+	if(config.db_maintenance.interval > 0u)
+		logg("   DBMAINTENANCE_INTERVAL: Database maintenance every %u seconds (below %u queries per second)",
+		     config.db_maintenance.interval, config.db_maintenance.idle);
+	else
+		logg("   DBMAINTENANCE_INTERVAL: --- (no database maintenance)");
+
+	// NETWORK_CACHE_TTL
+	// Number of seconds results of network table lookups by IP address
+	// (hardware address, host name, interface and alias-client) are cached
+	// in memory. The cache is flushed whenever the network table is updated
+	// defaults to: 60 seconds, 0 disables the cache
+	config.network_cache_ttl = 60u;
+	buffer = parse_FTLconf(fp, "NETWORK_CACHE_TTL");
+
+	if(buffer != NULL && sscanf(buffer, "%u", &uval) == 1 && uval <= 86400u)
+		config.network_cache_ttl = uval;
+
+	if(config.network_cache_ttl > 0u)
+		logg("   NETWORK_CACHE_TTL: Caching network table lookups for %u seconds", config.network_cache_ttl);
+	else
+		logg("   NETWORK_CACHE_TTL: --- (not caching network table lookups)");
+
+	// API_CACHE_TTL
+	// Number of milliseconds responses of aggregate API commands (>stats,
+	// >overTime, >querytypes and >forward-dest) are cached. The cache is
+	// flushed whenever the garbage collection removed queries
+	// defaults to: 1000 milliseconds, 0 disables the cache
+	config.api_cache_ttl = 1000u;
+	buffer = parse_FTLconf(fp, "API_CACHE_TTL");
+
+	if(buffer != NULL && sscanf(buffer, "%u", &uval) == 1 && uval <= 10000u)
+		config.api_cache_ttl = uval;
+
+	if(config.api_cache_ttl > 0u)
+		logg("   API_CACHE_TTL: Caching aggregate API responses for %u ms", config.api_cache_ttl);
+	else
+		logg("   API_CACHE_TTL: --- (not caching API responses)");
+
+	// API_COMPRESSION
+	// Default deflate level of API responses on connections asking for
+	// compression with >compress deflate. Compressing large responses gets
+	// them out of FTL sooner on slow links, level 1 is fastest
+	// defaults to: 1, 0 does not allow compressing responses
+	config.api_compression = 1;
+	buffer = parse_FTLconf(fp, "API_COMPRESSION");
+
+	if(buffer != NULL && sscanf(buffer, "%u", &uval) == 1 && uval <= 9u)
+		config.api_compression = uval;
+
+	if(config.api_compression > 0)
+		logg("   API_COMPRESSION: Level %u on request", config.api_compression);
+	else
+		logg("   API_COMPRESSION: Disabled");
+
+	// LUA_POLICY
+	// Call the function policy() of the Lua script LUA_POLICY_FILE for every
+	// domain/client combination not yet in FTL's DNS cache (see
+	// src/lua/policy.c)
+	// defaults to: false
+	buffer = parse_FTLconf(fp, "LUA_POLICY");
+	config.lua_policy = read_bool(buffer, false);
+
+	if(config.lua_policy)
+		logg("   LUA_POLICY: Enabled");
+	else
+		logg("   LUA_POLICY: Disabled");
+
+	// LUA_POLICY_FILE
+	getpath(fp, "LUA_POLICY_FILE", "/etc/pihole/policy.lua", &FTLfiles.lua_policy);
+
+	// LUA_POLICY_INSTRUCTIONS
+	// Maximum number of Lua instructions a single call of the policy may
+	// execute before it is aborted
+	// defaults to: 100000
+	config.lua_instructions = 100000u;
+	buffer = parse_FTLconf(fp, "LUA_POLICY_INSTRUCTIONS");
+
+	if(buffer != NULL && sscanf(buffer, "%u", &uval) == 1 && uval >= 1000u && uval <= 100000000u)
+		config.lua_instructions = uval;
+
+	if(config.lua_policy)
+		logg("   LUA_POLICY_INSTRUCTIONS: Aborting the policy after %u instructions", config.lua_instructions);
+
+	// LUA_REPORT_DIR
+	// Directory of the Lua scripts which can be run using the API command
+	// >lua <name> (see src/lua/report.c)
+	getpath(fp, "LUA_REPORT_DIR", "/etc/pihole/reports", &FTLfiles.lua_reports);
+
+	// COMPRESS_DOMAINS
+	// Store domains in shared memory as their first label and a reference to
+	// the remainder, which is stored the same way. Domains sharing suffixes
+	// (e.g. ".googleapis.com") share their storage (see adddomain())
+	// defaults to: false
+	buffer = parse_FTLconf(fp, "COMPRESS_DOMAINS");
+	config.compress_domains = read_bool(buffer, false);
+
+	if(config.compress_domains)
+		logg("   COMPRESS_DOMAINS: Enabled");
+	else
+		logg("   COMPRESS_DOMAINS: Disabled");
+
+	// ALLOC_STATS
+	// Account heap allocations made through FTL's wrappers by their call
+	// site (see src/allocstats.c and the API command >allocstats)
+	// defaults to: false
+	buffer = parse_FTLconf(fp, "ALLOC_STATS");
+	config.alloc_stats = read_bool(buffer, false);
+
+	if(config.alloc_stats)
+		logg("   ALLOC_STATS: Enabled");
+	else
+		logg("   ALLOC_STATS: Disabled");
+
+	// CPU_AFFINITY_<THREAD>, SCHED_POLICY_<THREAD>, NICE_<THREAD>
+	// Pin FTL's threads to CPUs (e.g. "1" or "0,2-3"), change their
+	// scheduling policy (normal, batch or idle) and their nice value.
+	// <THREAD> is one of DNS (the DNS event loop and its workers), API,
+	// DATABASE, HOUSEKEEPER, DNSCLIENT, STREAM, STATISTICS, PCAP, QUERYLOG,
+	// DNSTAP, FEDERATION, REPLICA, PROBE and LOGWRITER (see src/threadsched.c)
+	// defaults to: unset (threads inherit the settings of the process)
+	for(unsigned int target = 0; target < SCHED_TARGETS; target++)
+	{
+		const char *name = thread_sched_name(target);
+		char key[64];
+
+		snprintf(key, sizeof(key), "CPU_AFFINITY_%s", name);
+		buffer = parse_FTLconf(fp, key);
+		if(apply_on_startup(key, buffer) && buffer != NULL && thread_sched_set_cpus(target, buffer))
+			logg("   %s: CPUs %s", key, buffer);
+
+		snprintf(key, sizeof(key), "SCHED_POLICY_%s", name);
+		buffer = parse_FTLconf(fp, key);
+		if(apply_on_startup(key, buffer) && buffer != NULL && thread_sched_set_policy(target, buffer))
+			logg("   %s: %s", key, buffer);
+
+		int ival = 0;
+		snprintf(key, sizeof(key), "NICE_%s", name);
+		buffer = parse_FTLconf(fp, key);
+		if(apply_on_startup(key, buffer) && buffer != NULL &&
+		   sscanf(buffer, "%i", &ival) == 1 && thread_sched_set_nice(target, ival))
+			logg("   %s: %i", key, ival);
+	}
+
 	// Read DEBUG_... setting from pihole-FTL.conf
 	read_debuging_settings(fp);
 
@@ -787,6 +1772,8 @@ static void getpath(FILE* fp, const char *option, const char *defaultloc, char *
 	// defaultloc: Value used if key is not found in file
 	// pointer:    Location where read (or default) parameter is stored
 	char *buffer = parse_FTLconf(fp, option);
+	if(!apply_on_startup(option, buffer))
+		return;
 
 	errno = 0;
 	// Use sscanf() to obtain filename from config file parameter only if buffer != NULL
@@ -925,6 +1912,15 @@ void get_privacy_level(FILE *fp)
 		fclose(fp);
 }
 
+// Re-read the privacy level only if pihole-FTL.conf has been modified since
+// it has been read the last time
+void refresh_privacy_level(void)
+{
+	static unsigned int seen = 0u;
+	if(file_changed(WATCH_FTLCONF, &seen))
+		get_privacy_level(NULL);
+}
+
 void get_blocking_mode(FILE *fp)
 {
 	// Set default value
@@ -980,6 +1976,35 @@ static void setDebugOption(FILE* fp, const char* option, enum debug_flags bitmas
 		config.debug &= ~bitmask;
 }
 
+// Routine for setting the sampling factor and rate limit of a debug category
+static void setDebugLimit(FILE* fp, const unsigned int category)
+{
+	char key[32];
+	unsigned int sample = 0, rate = 0, value;
+
+	snprintf(key, sizeof(key), "DEBUG_%s_SAMPLE", debug_category_name(category));
+	const char *buffer = parse_FTLconf(fp, key);
+	if(buffer != NULL && sscanf(buffer, "%u", &value) == 1)
+		sample = value;
+
+	snprintf(key, sizeof(key), "DEBUG_%s_RATE", debug_category_name(category));
+	buffer = parse_FTLconf(fp, key);
+	if(buffer != NULL && sscanf(buffer, "%u", &value) == 1 && value <= DEBUG_RATE_MAX)
+		rate = value;
+
+	set_debug_limit(category, sample, rate);
+
+	if(sample > 1 && rate > 0)
+		logg("   DEBUG_%s: Logging one out of %u messages, at most %u per second",
+		     debug_category_name(category), sample, rate);
+	else if(sample > 1)
+		logg("   DEBUG_%s: Logging one out of %u messages",
+		     debug_category_name(category), sample);
+	else if(rate > 0)
+		logg("   DEBUG_%s: Logging at most %u messages per second",
+		     debug_category_name(category), rate);
+}
+
 void read_debuging_settings(FILE *fp)
 {
 	// Set default (no debug instructions set)
@@ -1092,6 +2117,11 @@ void read_debuging_settings(FILE *fp)
 	// defaults to: false
 	setDebugOption(fp, "DEBUG_EXTRA", DEBUG_EXTRA);
 
+	// DEBUG_<CATEGORY>_SAMPLE and DEBUG_<CATEGORY>_RATE
+	// defaults to: 0 (log all messages of the category)
+	for(unsigned int i = 0; i < DEBUG_CATEGORIES; i++)
+		setDebugLimit(fp, i);
+
 	if(config.debug)
 	{
 		logg("*****************************");
@@ -1186,3 +2216,149 @@ static bool read_bool(const char *option, const bool fallback)
 
 	return fallback;
 }
+
+static unsigned int read_prealloc(FILE *fp, const char *key, const char *unit)
+{
+	unsigned int value = 0;
+	const char *buffer = parse_FTLconf(fp, key);
+
+	// Limit to 1G objects to avoid overflows when computing sizes
+	if(buffer != NULL &&
+	   (sscanf(buffer, "%u", &value) != 1 || value > 1000000000u))
+	{
+		logg("   %s: Invalid value, ignoring", key);
+		value = 0;
+	}
+
+	if(value > 0)
+		logg("   %s: Pre-allocating shared memory for %u %s", key, value, unit);
+
+	return value;
+}
+
+// Returns true if a setting which is only applied on startup should be
+// applied now. When reloading, a changed value is reported instead
+static bool apply_on_startup(const char *key, const char *value)
+{
+	if(!reloading)
+	{
+		// Remember the raw value to detect changes on reload
+		void *values = realloc(startup_values, (num_startup_values + 1)*sizeof(*startup_values));
+		if(values == NULL)
+			return true;
+		startup_values = values;
+		startup_values[num_startup_values].key = strdup(key);
+		startup_values[num_startup_values].value = value != NULL ? strdup(value) : NULL;
+		num_startup_values++;
+		return true;
+	}
+
+	for(unsigned int i = 0; i < num_startup_values; i++)
+	{
+		if(startup_values[i].key == NULL || strcmp(startup_values[i].key, key) != 0)
+			continue;
+
+		const char *old = startup_values[i].value;
+		if((old == NULL) != (value == NULL) || (old != NULL && strcmp(old, value) != 0))
+		{
+			logg("   %s: Changing this setting requires a restart of FTL", key);
+			restart_needed++;
+		}
+		break;
+	}
+	return false;
+}
+
+// Restore a setting which is only applied on startup (it sizes memory,
+// starts a thread or opens a socket) and report if it was changed
+#define KEEP_ON_RELOAD(field, key) do { \
+	if(config.field != old.field) \
+	{ \
+		logg("   %s: Changing this setting requires a restart of FTL", key); \
+		config.field = old.field; \
+		restart_needed++; \
+	} \
+} while(0)
+
+// Re-read pihole-FTL.conf at runtime (on SIGHUP and >reload-config), needs
+// to be called while holding the SHM lock so no other thread sees the
+// defaults assigned while parsing. Returns the number of changed settings
+// which are only applied after a restart of FTL
+unsigned int reload_FTLconf(void)
+{
+	const ConfigStruct old = config;
+
+	reloading = true;
+	restart_needed = 0u;
+	read_FTLconf();
+	reloading = false;
+
+	KEEP_ON_RELOAD(socket_listenlocal, "SOCKET_LISTENING");
+	KEEP_ON_RELOAD(port, "FTLPORT");
+	KEEP_ON_RELOAD(shmem_hugepages, "SHMEM_HUGEPAGES");
+	KEEP_ON_RELOAD(gravity_in_memory, "GRAVITY_IN_MEMORY");
+	KEEP_ON_RELOAD(fast_question_hash, "FAST_QUESTION_HASH");
+	KEEP_ON_RELOAD(binary_querylog, "BINARY_QUERY_LOG");
+	KEEP_ON_RELOAD(lua_policy, "LUA_POLICY");
+	KEEP_ON_RELOAD(alloc_stats, "ALLOC_STATS");
+	KEEP_ON_RELOAD(compress_domains, "COMPRESS_DOMAINS");
+	KEEP_ON_RELOAD(handover, "HANDOVER");
+	KEEP_ON_RELOAD(dnstap, "DNSTAP");
+	KEEP_ON_RELOAD(defer_statistics, "DEFER_STATISTICS");
+	KEEP_ON_RELOAD(verdict_cache_size, "VERDICT_CACHE_SIZE");
+	KEEP_ON_RELOAD(udp_batch, "UDP_BATCH");
+	KEEP_ON_RELOAD(dns_workers, "DNS_WORKERS");
+	KEEP_ON_RELOAD(adaptive_cache, "ADAPTIVE_CACHE");
+	KEEP_ON_RELOAD(tcp_pool_idle, "TCP_POOL_IDLE");
+	KEEP_ON_RELOAD(ipset_dedup, "IPSET_DEDUP");
+	KEEP_ON_RELOAD(log_buffer, "LOG_BUFFER");
+	KEEP_ON_RELOAD(federation_interval, "FEDERATION_INTERVAL");
+	KEEP_ON_RELOAD(gravity_sync_interval, "GRAVITY_SYNC_INTERVAL");
+	KEEP_ON_RELOAD(dnssec_sigcache, "DNSSEC_SIGCACHE");
+	KEEP_ON_RELOAD(upstream_probe_interval, "UPSTREAM_PROBE_INTERVAL");
+	KEEP_ON_RELOAD(pktdump.buffer, "PCAP_BUFFER");
+	KEEP_ON_RELOAD(pktdump.max_size, "PCAP_MAX_SIZE");
+	KEEP_ON_RELOAD(pktdump.files, "PCAP_MAX_FILES");
+	KEEP_ON_RELOAD(sqlite.pagecache, "SQLITE_PAGECACHE");
+	KEEP_ON_RELOAD(sqlite.lookaside, "SQLITE_LOOKASIDE");
+	KEEP_ON_RELOAD(sqlite.gravity_mmap, "GRAVITY_MMAP");
+	KEEP_ON_RELOAD(prealloc.queries, "PREALLOC_QUERIES");
+	KEEP_ON_RELOAD(prealloc.clients, "PREALLOC_CLIENTS");
+	KEEP_ON_RELOAD(prealloc.domains, "PREALLOC_DOMAINS");
+	KEEP_ON_RELOAD(prealloc.dns_cache, "PREALLOC_DNS_CACHE");
+	KEEP_ON_RELOAD(prealloc.strings, "PREALLOC_STRINGS");
+
+	// The database thread is only started with the database enabled
+	if((config.maxDBdays == 0) != (old.maxDBdays == 0))
+	{
+		logg("   MAXDBDAYS: Enabling or disabling the database requires a restart of FTL");
+		config.maxDBdays = old.maxDBdays;
+		restart_needed++;
+	}
+
+	// Queries recorded under a higher privacy level have already been
+	// anonymized, lowering it is only possible on a fresh start
+	if(config.privacylevel < old.privacylevel)
+	{
+		logg("   PRIVACYLEVEL: Lowering the privacy level requires a restart of FTL");
+		config.privacylevel = old.privacylevel;
+		restart_needed++;
+	}
+
+	// A shorter MAXLOGAGE is applied by the next garbage collection, a longer
+	// one only keeps new queries for longer (the overTime slots cover
+	// MAXLOGAGE hours anyway)
+	if(config.maxlogage > old.maxlogage)
+		logg("   MAXLOGAGE: Older queries are not re-imported from the database");
+
+	// Responses of the API may depend on the old settings
+	respcache_invalidate();
+
+	if(restart_needed > 0u)
+		logg("Reloaded config file, restart FTL to apply %u more setting%s",
+		     restart_needed, restart_needed == 1u ? "" : "s");
+	else
+		logg("Reloaded config file");
+
+	return restart_needed;
+}
@@ -27,7 +27,9 @@
 void init_config_mutex(void);
 void getLogFilePath(void);
 void read_FTLconf(void);
+unsigned int reload_FTLconf(void);
 void get_privacy_level(FILE *fp);
+void refresh_privacy_level(void);
 void get_blocking_mode(FILE *fp);
 void read_debuging_settings(FILE *fp);
 
@@ -51,6 +53,25 @@ typedef struct {
 	bool edns0_ecs :1;
 	bool show_dnssec :1;
 	bool addr2line :1;
+	bool shmem_hugepages :1;
+	bool gravity_in_memory :1;
+	bool regex_prefilter :1;
+	bool regex_arena :1;
+	bool shmem_snapshot :1;
+	bool upstream_scoring :1;
+	bool defer_statistics :1;
+	bool fast_question_hash :1;
+	bool binary_querylog :1;
+	bool lua_policy :1;
+	bool alloc_stats :1;
+	bool dns_cache_dump :1;
+	bool compress_domains :1;
+	bool handover :1;
+	bool dnstap :1;
+	bool gravity_publish :1;
+	bool aggressive_nsec :1;
+	bool shmem_stats :1;
+	bool sample_blocked :1;
 	struct {
 		bool mozilla_canary :1;
 		bool icloud_private_relay :1;
@@ -60,22 +81,75 @@ typedef struct {
 		unsigned char shmem;
 		unsigned char disk;
 	} check;
+	unsigned char api_compression;
 	enum privacy_level privacylevel;
 	enum blocking_mode blockingmode;
 	enum refresh_hostnames refresh_hostnames;
 	enum busy_reply reply_when_busy;
 	enum ptr_type pihole_ptr;
 	int maxDBdays;
+	int archiveDBdays;
 	int port;
 	int maxlogage;
+	unsigned int reclaim_grace;
 	int dns_port;
 	unsigned int delay_startup;
 	unsigned int network_expire;
+	unsigned int network_cache_ttl;
+	unsigned int api_cache_ttl;
 	unsigned int block_ttl;
+	unsigned int verdict_cache_size;
+	unsigned int verdict_warmup;
+	unsigned int sample_queries;
+	unsigned int regex_slow_threshold;
+	unsigned int slow_query_threshold;
+	unsigned int udp_batch;
+	unsigned int dns_workers;
+	unsigned int prefetch;
+	unsigned int adaptive_cache;
+	unsigned int tcp_pool_idle;
+	unsigned int lease_write_delay;
+	unsigned int ipset_dedup;
+	unsigned int log_buffer;
+	unsigned int lua_instructions;
+	unsigned int federation_interval;
+	unsigned int gravity_sync_interval;
+	unsigned int dnssec_sigcache;
+	unsigned int upstream_probe_interval;
+	unsigned int upstream_max_inflight;
+	struct {
+		unsigned int buffer;
+		unsigned int max_size;
+		unsigned int files;
+		unsigned int trigger;
+	} pktdump;
 	struct {
 		unsigned int count;
 		unsigned int interval;
+		unsigned int prefix_count;
+		unsigned char prefix_v4;
+		unsigned char prefix_v6;
 	} rate_limit;
+	struct {
+		unsigned int interval;
+		unsigned int rows;
+	} db_flush;
+	struct {
+		unsigned int interval;
+		unsigned int idle;
+	} db_maintenance;
+	struct {
+		unsigned int pagecache;
+		int lookaside;
+		unsigned int gravity_mmap;
+	} sqlite;
+	struct {
+		unsigned int queries;
+		unsigned int clients;
+		unsigned int domains;
+		unsigned int dns_cache;
+		unsigned int strings;
+	} prealloc;
 	enum debug_flags debug;
 	time_t DBinterval;
 	struct {
@@ -106,6 +180,13 @@ typedef struct {
 	char* macvendor_db;
 	char* setupVars;
 	char* auditlist;
+	char* shmem_snapshot;
+	char* querylog;
+	char* lua_policy;
+	char* lua_reports;
+	char* dns_cache;
+	char* handover;
+	char* dnstap;
 } FTLFileNamesStruct;
 
 extern ConfigStruct config;
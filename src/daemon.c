@@ -24,6 +24,10 @@
 #include "signals.h"
 // sysinfo()
 #include <sys/sysinfo.h>
+// handover_cleanup()
+#include "handover.h"
+// destroy_shm_stats()
+#include "shmstats.h"
 #include <errno.h>
 
 pthread_t threads[THREADS_MAX] = { 0 };
@@ -224,6 +228,11 @@ static void terminate_threads(void)
 	logg("Waiting for threads to join");
 	for(int i = 0; i < THREADS_MAX; i++)
 	{
+		// Skip threads which have never been started (e.g., the DNS
+		// client thread when resolving names is disabled)
+		if(threads[i] == 0)
+			continue;
+
 		if(thread_cancellable[i])
 		{
 			logg("Thread %s (%d) is idle, terminating it.",
@@ -281,6 +290,12 @@ void cleanup(const int ret)
 	// Remove PID file
 	removepid();
 
+	// Stop listening for a new process taking over
+	handover_cleanup();
+
+	// Remove the published statistics
+	destroy_shm_stats();
+
 	// Remove shared memory objects
 	// Important: This invalidated all objects such as
 	//            counters-> ... etc.
@@ -19,6 +19,12 @@
 #include "../log.h"
 // getAliasclientIDfromIP()
 #include "network-table.h"
+// update_client_leaderboards()
+#include "../leaderboard.h"
+// overTime_add_series()
+#include "../overTime.h"
+// TIME_SCOPE()
+#include "../timers.h"
 
 bool create_aliasclients_table(sqlite3 *db)
 {
@@ -40,56 +46,87 @@ bool create_aliasclients_table(sqlite3 *db)
 	return true;
 }
 
-// Recompute the alias-client's values
-// We shouldn't do this too often as it iterates over all existing clients
-static void recompute_aliasclient(const int aliasclientID)
-{
-	clientsData *aliasclient = getClient(aliasclientID, true);
+// Every alias-client keeps a list of the clients it manages: alias_list of
+// the alias-client holds the first (lowest) client ID, alias_list of every
+// managed client holds the next one (-1 terminates the list). The counters of
+// alias-clients are maintained incrementally by change_clientcount(), so they
+// only need to be adjusted here when a client joins or leaves an alias-client
 
-	if(config.debug & DEBUG_ALIASCLIENTS)
-	{
-		logg("Recomputing alias-client \"%s\" (%s)...",
-		     getstr(aliasclient->namepos), getstr(aliasclient->ippos));
-	}
-
-	// Reset this alias-client
-	aliasclient->count = 0;
-	aliasclient->blockedcount = 0;
-	memset(aliasclient->overTime, 0, sizeof(aliasclient->overTime));
+// Add a client's counts to (sign = 1) or subtract them from (sign = -1) an alias-client
+static void aliasclient_add_counts(clientsData *aliasclient, const clientsData *client, const int sign)
+{
+	aliasclient->count += sign * client->count;
+	aliasclient->blockedcount += sign * client->blockedcount;
+	overTime_add_series(&aliasclient->overTime, &client->overTime, sign);
+	update_client_leaderboards(aliasclient->id);
+}
 
-	// Loop over all existing clients to find which clients are associated to this one
-	for(int clientID = 0; clientID < counters->clients; clientID++)
+// Remove client from the alias-client managing it (if any)
+static void unlink_aliasclient(clientsData *client)
+{
+	if(client->aliasclient_id > -1)
 	{
-		// Get pointer to client candidate
-		const clientsData *client = getClient(clientID, true);
-		// Skip invalid clients and alias-clients
-		if(client == NULL || client->flags.aliasclient)
-			continue;
-
-		// Skip clients that are not managed by this aliasclient
-		if(client->aliasclient_id != aliasclientID)
+		clientsData *aliasclient = getClient(client->aliasclient_id, true);
+		if(aliasclient != NULL)
 		{
 			if(config.debug & DEBUG_ALIASCLIENTS)
 			{
-				logg("Client \"%s\" (%s) NOT managed by this alias-client, skipping",
-				     getstr(client->namepos), getstr(client->ippos));
+				logg("Client \"%s\" (%s) leaves alias-client \"%s\" (%s)",
+				     getstr(client->namepos), getstr(client->ippos),
+				     getstr(aliasclient->namepos), getstr(aliasclient->ippos));
 			}
-			continue;
-		}
 
-		// Debug logging
-		if(config.debug & DEBUG_ALIASCLIENTS)
-		{
-			logg("Client \"%s\" (%s) IS  managed by this alias-client, adding counts",
-					getstr(client->namepos), getstr(client->ippos));
+			aliasclient_add_counts(aliasclient, client, -1);
+
+			// Remove client from the list of managed clients
+			int *next = &aliasclient->alias_list;
+			while(*next > -1)
+			{
+				if(*next == (int)client->id)
+				{
+					*next = client->alias_list;
+					break;
+				}
+				clientsData *member = getClient(*next, true);
+				if(member == NULL)
+					break;
+				next = &member->alias_list;
+			}
 		}
+	}
+
+	client->aliasclient_id = -1;
+	client->alias_list = -1;
+}
+
+// Let the alias-client aliasclientID manage client
+static void link_aliasclient(clientsData *client, const int aliasclientID)
+{
+	clientsData *aliasclient = getClient(aliasclientID, true);
+	if(aliasclient == NULL)
+		return;
+
+	if(config.debug & DEBUG_ALIASCLIENTS)
+	{
+		logg("Client \"%s\" (%s) joins alias-client \"%s\" (%s)",
+		     getstr(client->namepos), getstr(client->ippos),
+		     getstr(aliasclient->namepos), getstr(aliasclient->ippos));
+	}
 
-		// Add counts of this client to the alias-client
-		aliasclient->count += client->count;
-		aliasclient->blockedcount += client->blockedcount;
-		for(int idx = 0; idx < OVERTIME_SLOTS; idx++)
-			aliasclient->overTime[idx] += client->overTime[idx];
+	aliasclient_add_counts(aliasclient, client, 1);
+	client->aliasclient_id = aliasclientID;
+
+	// Insert client into the list of managed clients (sorted by ID)
+	int *next = &aliasclient->alias_list;
+	while(*next > -1 && *next < (int)client->id)
+	{
+		clientsData *member = getClient(*next, true);
+		if(member == NULL)
+			break;
+		next = &member->alias_list;
 	}
+	client->alias_list = *next;
+	*next = client->id;
 }
 
 // Store hostname of device identified by dbID
@@ -147,9 +184,6 @@ bool import_aliasclients(sqlite3 *db)
 		// Set client flags
 		client->flags.new = false;
 
-		// Reset counter
-		client->count = 0;
-
 		// Store intended name
 		const char *name = (char*)sqlite3_column_text(stmt, 1);
 		client->namepos = addstr(name);
@@ -238,6 +272,10 @@ void reset_aliasclient(sqlite3 *db, clientsData *client)
 	if(FTLDBerror())
 		return;
 
+	// Skip alias-clients themselves
+	if(client->flags.aliasclient)
+		return;
+
 	// Open pihole-FTL.db database file if needed
 	bool db_opened = false;
 	if(db == NULL)
@@ -252,55 +290,51 @@ void reset_aliasclient(sqlite3 *db, clientsData *client)
 		db_opened = true;
 	}
 
-	// Skip alias-clients themselves
-	if(client->flags.aliasclient)
-		return;
-
 	// Find corresponding alias-client (if any)
-	client->aliasclient_id = get_aliasclient_ID(db, client);
+	const int aliasclientID = get_aliasclient_ID(db, client);
 
 	// Close the database if we opened it here
 	if(db_opened) dbclose(&db);
 
-	// Skip if there is no responsible alias-client
-	if(client->aliasclient_id == -1)
+	// Nothing to do if the responsible alias-client did not change
+	if(aliasclientID == client->aliasclient_id)
 		return;
 
-	// Recompute all values for this alias-client
-	recompute_aliasclient(client->aliasclient_id);
+	// Move the client's counts over to the new alias-client (if any)
+	unlink_aliasclient(client);
+	if(aliasclientID > -1)
+		link_aliasclient(client, aliasclientID);
 }
 
 // Return a list of clients linked to the current alias-client
 // The first element contains the number of following IDs
 int *get_aliasclient_list(const int aliasclientID)
 {
+	const clientsData *aliasclient = getClient(aliasclientID, true);
+
+	// Count associated clients
 	int count = 0;
-	// Loop over all existing clients to count associated clients
-	for(int clientID = 0; clientID < counters->clients; clientID++)
+	for(int clientID = aliasclient != NULL ? aliasclient->alias_list : -1; clientID > -1;)
 	{
-		// Get pointer to client candidate
 		const clientsData *client = getClient(clientID, true);
-		// Skip invalid clients and those that are not managed by this aliasclient
-		if(client == NULL || client->aliasclient_id != aliasclientID)
-			continue;
-
+		if(client == NULL)
+			break;
 		count++;
+		clientID = client->alias_list;
 	}
 
 	int *list = calloc(count + 1, sizeof(int));
 	list[0] = count;
 
-	// Loop over all existing clients to fill list of clients
+	// Fill list of clients
 	count = 0;
-	for(int clientID = 0; clientID < counters->clients; clientID++)
+	for(int clientID = aliasclient != NULL ? aliasclient->alias_list : -1; clientID > -1 && count < list[0];)
 	{
-		// Get pointer to client candidate
 		const clientsData *client = getClient(clientID, true);
-		// Skip invalid clients and those that are not managed by this aliasclient
-		if(client == NULL || client->aliasclient_id != aliasclientID)
-			continue;
-
+		if(client == NULL)
+			break;
 		list[++count] = clientID;
+		clientID = client->alias_list;
 	}
 
 	return list;
@@ -311,6 +345,8 @@ int *get_aliasclient_list(const int aliasclientID)
 // removed by nulling them before importing new clients
 void reimport_aliasclients(sqlite3 *db)
 {
+	TIME_SCOPE("aliasclients_import");
+
 	// Return early if database is known to be broken
 	if(FTLDBerror())
 		return;
@@ -329,25 +365,13 @@ void reimport_aliasclients(sqlite3 *db)
 		db_opened = true;
 	}
 
-	// Loop over all existing alias-clients and set their counters to zero
-	for(int clientID = 0; clientID < counters->clients; clientID++)
-	{
-		// Get pointer to client candidate
-		clientsData *client = getClient(clientID, true);
-		// Skip invalid and non-alias-clients
-		if(client == NULL || !client->flags.aliasclient)
-			continue;
-
-		// Reset this alias-client
-		client->count = 0;
-		client->blockedcount = 0;
-		memset(client->overTime, 0, sizeof(client->overTime));
-	}
+	// Alias-client assignments may have changed in the network table
+	flush_network_cache();
 
 	// Import aliasclients from database table
 	import_aliasclients(db);
 
-	// Recompute all alias-clients
+	// Re-link all clients whose alias-client changed
 	for(int clientID = 0; clientID < counters->clients; clientID++)
 	{
 		// Get pointer to client candidate
@@ -0,0 +1,1053 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  pihole-FTL.db -> compressed query archive
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "../FTL.h"
+#include "archive-table.h"
+#include "common.h"
+#include "../log.h"
+#include "../config.h"
+// TIME_SCOPE()
+#include "../timers.h"
+
+// Queries older than ARCHIVEDAYS are moved from query_storage into blocks of
+// ARCHIVE_BLOCK_ROWS queries in the query_archive table. A block stores its
+// queries column by column: IDs and timestamps are delta-encoded, the reply
+// times are stored in units of 0.1 milliseconds, and all other columns are
+// dictionary-encoded with the most frequent value getting the smallest index.
+// All numbers are variable-length integers. The archive can be read through
+// the virtual table archived_queries which has the same columns as the
+// queries view
+#define ARCHIVE_BLOCK_ROWS 4096
+// Blocks of format 1 were written before the column sample was added
+#define ARCHIVE_FORMAT 2
+
+// Columns of query_storage in the order they are selected (and of the
+// virtual table archived_queries)
+enum archive_column { ARCH_ID, ARCH_TIMESTAMP, ARCH_TYPE, ARCH_STATUS, ARCH_DOMAIN, ARCH_CLIENT,
+                      ARCH_FORWARD, ARCH_ADDINFO, ARCH_REPLY_TYPE, ARCH_REPLY_TIME, ARCH_DNSSEC,
+                      ARCH_SAMPLE };
+
+// Dictionary-encoded columns. The IDs of the linking tables are replaced by
+// the strings they stand for when reading them
+#define DICT_COLUMNS 9
+static const enum archive_column dict_columns[DICT_COLUMNS] = {
+	ARCH_TYPE, ARCH_STATUS, ARCH_DOMAIN, ARCH_CLIENT, ARCH_FORWARD, ARCH_ADDINFO, ARCH_REPLY_TYPE, ARCH_DNSSEC,
+	ARCH_SAMPLE
+};
+static const char *dict_lookup[DICT_COLUMNS] = {
+	[2] = "SELECT domain FROM domain_by_id WHERE id = ?",
+	[3] = "SELECT ip FROM client_by_id WHERE id = ?",
+	[4] = "SELECT forward FROM forward_by_id WHERE id = ?",
+	[5] = "SELECT content FROM addinfo_by_id WHERE id = ?"
+};
+
+// Type tags of the values stored in the dictionaries
+enum archive_value { VAL_NULL, VAL_INTEGER, VAL_FLOAT, VAL_TEXT, VAL_BLOB };
+
+// Reply times are stored like this (see DB_save_queries())
+#define REPLY_TIME_UNIT 1e-4
+
+typedef struct {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+	bool failed;
+} archiveBuffer;
+
+typedef struct {
+	const unsigned char *data;
+	size_t len;
+	size_t pos;
+	bool failed;
+} archiveReader;
+
+static void put_bytes(archiveBuffer *buf, const void *bytes, const size_t len)
+{
+	if(buf->failed)
+		return;
+
+	if(buf->len + len > buf->size)
+	{
+		size_t size = buf->size > 0 ? buf->size : 4096;
+		while(size < buf->len + len)
+			size *= 2;
+		unsigned char *data = realloc(buf->data, size);
+		if(data == NULL)
+		{
+			buf->failed = true;
+			return;
+		}
+		buf->data = data;
+		buf->size = size;
+	}
+
+	memcpy(buf->data + buf->len, bytes, len);
+	buf->len += len;
+}
+
+static void put_varint(archiveBuffer *buf, uint64_t value)
+{
+	unsigned char bytes[10];
+	size_t len = 0u;
+	do
+	{
+		bytes[len] = value & 0x7f;
+		value >>= 7;
+		if(value > 0)
+			bytes[len] |= 0x80;
+		len++;
+	} while(value > 0);
+
+	put_bytes(buf, bytes, len);
+}
+
+// Map signed onto unsigned numbers so that small negative numbers are short
+static uint64_t __attribute__ ((const)) zigzag(const sqlite3_int64 value)
+{
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static sqlite3_int64 __attribute__ ((const)) unzigzag(const uint64_t value)
+{
+	return (sqlite3_int64)((value >> 1) ^ (~(value & 1) + 1));
+}
+
+static void put_value(archiveBuffer *buf, sqlite3_stmt *stmt, const int col)
+{
+	switch(sqlite3_column_type(stmt, col))
+	{
+		case SQLITE_INTEGER:
+			put_varint(buf, VAL_INTEGER);
+			put_varint(buf, zigzag(sqlite3_column_int64(stmt, col)));
+			break;
+		case SQLITE_FLOAT:
+		{
+			const double value = sqlite3_column_double(stmt, col);
+			put_varint(buf, VAL_FLOAT);
+			put_bytes(buf, &value, sizeof(value));
+			break;
+		}
+		case SQLITE_TEXT:
+		case SQLITE_BLOB:
+		{
+			const bool text = sqlite3_column_type(stmt, col) == SQLITE_TEXT;
+			const void *value = text ? (const void*)sqlite3_column_text(stmt, col) : sqlite3_column_blob(stmt, col);
+			const int len = sqlite3_column_bytes(stmt, col);
+			put_varint(buf, text ? VAL_TEXT : VAL_BLOB);
+			put_varint(buf, len);
+			put_bytes(buf, value, len);
+			break;
+		}
+		default:
+			put_varint(buf, VAL_NULL);
+			break;
+	}
+}
+
+static uint64_t get_varint(archiveReader *r)
+{
+	uint64_t value = 0u;
+	for(unsigned int shift = 0; shift < 64 && r->pos < r->len; shift += 7)
+	{
+		const unsigned char byte = r->data[r->pos++];
+		value |= (uint64_t)(byte & 0x7f) << shift;
+		if(!(byte & 0x80))
+			return value;
+	}
+
+	r->failed = true;
+	return 0u;
+}
+
+static const unsigned char *get_bytes(archiveReader *r, const uint64_t len)
+{
+	if(r->failed || len > r->len - r->pos)
+	{
+		r->failed = true;
+		return NULL;
+	}
+
+	const unsigned char *bytes = r->data + r->pos;
+	r->pos += len;
+	return bytes;
+}
+
+// Per-block dictionary of the values of one column. The values are kept in
+// their encoded form, rows[] holds the dictionary entry of every row
+struct dictEntry {
+	uint32_t hash;
+	unsigned int offset;
+	unsigned int len;
+	unsigned int count;
+	unsigned int index;
+};
+
+#define DICT_SLOTS (2*ARCHIVE_BLOCK_ROWS)
+typedef struct {
+	archiveBuffer values;
+	struct dictEntry entries[ARCHIVE_BLOCK_ROWS];
+	unsigned int used;
+	unsigned int slots[DICT_SLOTS];
+	unsigned int rows[ARCHIVE_BLOCK_ROWS];
+} archiveDict;
+
+static uint32_t __attribute__ ((pure)) dict_hash(const unsigned char *data, const size_t len)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < len; i++)
+		hash = (hash ^ data[i]) * 16777619u;
+	return hash;
+}
+
+static void dict_add(archiveDict *dict, sqlite3_stmt *stmt, const int col, const unsigned int row)
+{
+	// Encode the value at the end of the dictionary and remove it again if
+	// it is already known
+	const size_t offset = dict->values.len;
+	put_value(&dict->values, stmt, col);
+	if(dict->values.failed)
+		return;
+
+	const unsigned char *value = dict->values.data + offset;
+	const unsigned int len = dict->values.len - offset;
+	const uint32_t hash = dict_hash(value, len);
+	unsigned int i = hash & (DICT_SLOTS - 1);
+	while(dict->slots[i] > 0)
+	{
+		struct dictEntry *entry = &dict->entries[dict->slots[i] - 1];
+		if(entry->hash == hash && entry->len == len &&
+		   memcmp(dict->values.data + entry->offset, value, len) == 0)
+		{
+			dict->values.len = offset;
+			entry->count++;
+			dict->rows[row] = dict->slots[i] - 1;
+			return;
+		}
+		i = (i + 1) & (DICT_SLOTS - 1);
+	}
+
+	struct dictEntry *entry = &dict->entries[dict->used];
+	entry->hash = hash;
+	entry->offset = offset;
+	entry->len = len;
+	entry->count = 1u;
+	dict->rows[row] = dict->used;
+	dict->slots[i] = ++dict->used;
+}
+
+struct dictOrder {
+	unsigned int count;
+	unsigned int entry;
+};
+
+static int dict_order_cmp(const void *a, const void *b)
+{
+	const struct dictOrder *x = a, *y = b;
+	if(x->count != y->count)
+		return x->count > y->count ? -1 : 1;
+	return x->entry < y->entry ? -1 : 1;
+}
+
+// Append the dictionary sorted by frequency followed by the index of every row
+static bool dict_store(archiveDict *dict, archiveBuffer *out, const unsigned int rows)
+{
+	struct dictOrder *order = calloc(dict->used, sizeof(struct dictOrder));
+	if(order == NULL)
+		return false;
+
+	for(unsigned int i = 0; i < dict->used; i++)
+	{
+		order[i].count = dict->entries[i].count;
+		order[i].entry = i;
+	}
+	qsort(order, dict->used, sizeof(struct dictOrder), dict_order_cmp);
+
+	put_varint(out, dict->used);
+	for(unsigned int i = 0; i < dict->used; i++)
+	{
+		struct dictEntry *entry = &dict->entries[order[i].entry];
+		entry->index = i;
+		put_bytes(out, dict->values.data + entry->offset, entry->len);
+	}
+	for(unsigned int i = 0; i < rows; i++)
+		put_varint(out, dict->entries[dict->rows[i]].index);
+
+	free(order);
+	return true;
+}
+
+bool create_archive_table(sqlite3 *db)
+{
+	// Start transaction of database update
+	SQL_bool(db, "BEGIN TRANSACTION");
+
+	SQL_bool(db, "CREATE TABLE query_archive (id INTEGER PRIMARY KEY AUTOINCREMENT, "
+	             "first_id INTEGER NOT NULL, last_id INTEGER NOT NULL, "
+	             "first_timestamp INTEGER NOT NULL, last_timestamp INTEGER NOT NULL, "
+	             "count INTEGER NOT NULL, data BLOB NOT NULL)");
+	SQL_bool(db, "CREATE INDEX query_archive_timestamp_idx ON query_archive (last_timestamp)");
+
+	// Update database version to 14
+	if(!db_set_FTL_property(db, DB_VERSION, 14))
+	{
+		logg("create_archive_table(): Failed to update database version!");
+		return false;
+	}
+
+	// Finish transaction
+	SQL_bool(db, "COMMIT");
+
+	return true;
+}
+
+// Encode the queries returned by stmt into a block. Returns the number of
+// queries in the block or -1 on error
+static int encode_block(sqlite3_stmt *stmt, archiveBuffer *out, sqlite3_int64 first[2], sqlite3_int64 last[2])
+{
+	archiveDict *dicts = calloc(DICT_COLUMNS, sizeof(archiveDict));
+	sqlite3_int64 *values = calloc(2*ARCHIVE_BLOCK_ROWS, sizeof(sqlite3_int64));
+	archiveBuffer reply_times = { NULL, 0u, 0u, false };
+	if(dicts == NULL || values == NULL)
+	{
+		if(dicts != NULL)
+			free(dicts);
+		if(values != NULL)
+			free(values);
+		return -1;
+	}
+	sqlite3_int64 *ids = values, *timestamps = values + ARCHIVE_BLOCK_ROWS;
+
+	int rc = SQLITE_DONE;
+	unsigned int rows = 0u;
+	while(rows < ARCHIVE_BLOCK_ROWS && (rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		ids[rows] = sqlite3_column_int64(stmt, ARCH_ID);
+		timestamps[rows] = sqlite3_column_int64(stmt, ARCH_TIMESTAMP);
+		for(unsigned int i = 0; i < DICT_COLUMNS; i++)
+			dict_add(&dicts[i], stmt, dict_columns[i], rows);
+
+		// Reply times are (almost) unique and not dictionary-encoded
+		if(sqlite3_column_type(stmt, ARCH_REPLY_TIME) == SQLITE_NULL)
+			put_varint(&reply_times, 0u);
+		else
+		{
+			// Values which cannot be restored exactly from the number
+			// of units are stored as they are
+			const double value = sqlite3_column_double(stmt, ARCH_REPLY_TIME);
+			const double units = value / REPLY_TIME_UNIT;
+			bool exact = false;
+			sqlite3_int64 rounded = 0;
+			if(sqlite3_column_type(stmt, ARCH_REPLY_TIME) == SQLITE_FLOAT && units > -1e15 && units < 1e15)
+			{
+				rounded = (sqlite3_int64)(units + (units < 0.0 ? -0.5 : 0.5));
+				const double restored = REPLY_TIME_UNIT*rounded;
+				exact = memcmp(&restored, &value, sizeof(value)) == 0;
+			}
+			if(exact)
+				put_varint(&reply_times, 2u + zigzag(rounded));
+			else
+			{
+				put_varint(&reply_times, 1u);
+				put_value(&reply_times, stmt, ARCH_REPLY_TIME);
+			}
+		}
+
+		if(rows == 0 || timestamps[rows] < first[1])
+			first[1] = timestamps[rows];
+		if(rows == 0 || timestamps[rows] > last[1])
+			last[1] = timestamps[rows];
+		rows++;
+	}
+	first[0] = ids[0];
+	last[0] = rows > 0 ? ids[rows - 1] : 0;
+
+	int result = rows;
+	if(rows < ARCHIVE_BLOCK_ROWS && rc != SQLITE_DONE)
+	{
+		logg("encode_block() - SQL error step: %s", sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		result = -1;
+	}
+	else if(rows > 0)
+	{
+		put_varint(out, ARCHIVE_FORMAT);
+		put_varint(out, rows);
+		for(unsigned int i = 0; i < rows; i++)
+			put_varint(out, zigzag(i > 0 ? (sqlite3_int64)((uint64_t)ids[i] - (uint64_t)ids[i-1]) : ids[0]));
+		for(unsigned int i = 0; i < rows; i++)
+			put_varint(out, zigzag(i > 0 ? (sqlite3_int64)((uint64_t)timestamps[i] - (uint64_t)timestamps[i-1]) : timestamps[0]));
+		for(unsigned int i = 0; i < DICT_COLUMNS && result > 0; i++)
+			if(dicts[i].values.failed || !dict_store(&dicts[i], out, rows))
+				result = -1;
+		if(reply_times.failed)
+			result = -1;
+		else
+			put_bytes(out, reply_times.data, reply_times.len);
+		if(out->failed)
+			result = -1;
+		if(result < 0)
+			logg("WARNING: Failed to allocate memory for the query archive");
+	}
+
+	for(unsigned int i = 0; i < DICT_COLUMNS; i++)
+		if(dicts[i].values.data != NULL)
+			free(dicts[i].values.data);
+	if(reply_times.data != NULL)
+		free(reply_times.data);
+	free(dicts);
+	free(values);
+
+	return result;
+}
+
+// Move one block of queries older than ARCHIVEDAYS (but never queries which
+// are imported on startup) into the query archive. Only full blocks are
+// archived. Returns true if there are more queries to be archived in a
+// subsequent call
+bool archive_old_queries(sqlite3 *db)
+{
+	TIME_SCOPE("database_archive");
+
+	// Return early if database is known to be broken
+	if(FTLDBerror())
+		return false;
+
+	// The limit is kept until all old queries have been archived so this
+	// terminates even while new queries are added
+	static sqlite3_int64 timestamp = 0;
+	static int archived = 0, blocks = 0;
+	static size_t bytes = 0u;
+	if(timestamp == 0)
+	{
+		const time_t now = time(NULL);
+		timestamp = now - (sqlite3_int64)config.archiveDBdays * 86400;
+		if(timestamp > now - config.maxlogage)
+			timestamp = now - config.maxlogage;
+	}
+
+	// The unary + prevents using the timestamp index so the table is walked
+	// in the order of the IDs and the walk stops after a full block
+	sqlite3_stmt *stmt = NULL;
+	archiveBuffer block = { NULL, 0u, 0u, false };
+	sqlite3_int64 first[2] = { 0 }, last[2] = { 0 };
+	if(dbquery(db, "BEGIN TRANSACTION") != SQLITE_OK)
+		goto end;
+	int rc = sqlite3_prepare_v2(db, "SELECT id,timestamp,type,status,domain,client,forward,"
+	                                "additional_info,reply_type,reply_time,dnssec,sample FROM query_storage "
+	                                "WHERE typeof(timestamp) = 'integer' AND +timestamp <= ? "
+	                                "ORDER BY id LIMIT ?", -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("archive_old_queries() - SQL error prepare: %s", sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		goto rollback;
+	}
+	sqlite3_bind_int64(stmt, 1, timestamp);
+	sqlite3_bind_int(stmt, 2, ARCHIVE_BLOCK_ROWS);
+
+	const int rows = encode_block(stmt, &block, first, last);
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+	if(rows < ARCHIVE_BLOCK_ROWS)
+	{
+		if(block.data != NULL)
+			free(block.data);
+		goto rollback;
+	}
+
+	rc = sqlite3_prepare_v2(db, "INSERT INTO query_archive "
+	                            "(first_id,last_id,first_timestamp,last_timestamp,count,data) "
+	                            "VALUES (?1,?2,?3,?4,?5,?6)", -1, &stmt, NULL);
+	if(rc == SQLITE_OK)
+	{
+		sqlite3_bind_int64(stmt, 1, first[0]);
+		sqlite3_bind_int64(stmt, 2, last[0]);
+		sqlite3_bind_int64(stmt, 3, first[1]);
+		sqlite3_bind_int64(stmt, 4, last[1]);
+		sqlite3_bind_int(stmt, 5, rows);
+		sqlite3_bind_blob(stmt, 6, block.data, block.len, SQLITE_STATIC);
+		if((rc = sqlite3_step(stmt)) == SQLITE_DONE)
+			rc = SQLITE_OK;
+	}
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+	const size_t len = block.len;
+	free(block.data);
+	if(rc != SQLITE_OK)
+	{
+		logg("archive_old_queries() - SQL error storing block: %s", sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		goto rollback;
+	}
+
+	// Remove exactly the archived queries
+	if(dbquery(db, "DELETE FROM query_storage WHERE id BETWEEN %lld AND %lld AND "
+	               "typeof(timestamp) = 'integer' AND timestamp <= %lld",
+	           (long long)first[0], (long long)last[0], (long long)timestamp) != SQLITE_OK ||
+	   sqlite3_changes(db) != rows)
+	{
+		logg("archive_old_queries(): Removing archived queries failed!");
+		goto rollback;
+	}
+
+	if(dbquery(db, "COMMIT") != SQLITE_OK)
+		goto rollback;
+
+	archived += rows;
+	blocks++;
+	bytes += len;
+	return true;
+
+rollback:
+	dbquery(db, "ROLLBACK");
+end:
+	// Print final message only if there is a difference
+	if((config.debug & DEBUG_DATABASE) || archived)
+		logg("Notice: Archived %i queries in %i blocks (%.1f bytes per query)",
+		     archived, blocks, archived > 0 ? 1.0*bytes/archived : 0.0);
+
+	timestamp = 0;
+	archived = 0;
+	blocks = 0;
+	bytes = 0u;
+	return false;
+}
+
+// Remove all blocks which only contain queries older than the given timestamp
+bool delete_old_archive_blocks(sqlite3 *db, const time_t timestamp)
+{
+	if(dbquery(db, "DELETE FROM query_archive WHERE last_timestamp <= %lld",
+	           (long long)timestamp) != SQLITE_OK)
+	{
+		logg("delete_old_archive_blocks(): Deleting archived queries due to age failed!");
+		return false;
+	}
+
+	return true;
+}
+
+int get_number_of_archived_queries(sqlite3 *db)
+{
+	return db_query_int(db, "SELECT IFNULL(SUM(count),0) FROM query_archive");
+}
+
+/*
+ * Virtual table archived_queries
+ *
+ * The table is eponymous (it exists in every database without a CREATE
+ * VIRTUAL TABLE statement) and read-only. Constraints on the id and timestamp
+ * columns are used to skip blocks which cannot contain matching queries,
+ * SQLite checks them again for the individual queries
+ */
+typedef struct {
+	int type;
+	sqlite3_int64 i;
+	double r;
+	char *text;
+	int len;
+} archiveValue;
+
+typedef struct {
+	sqlite3_vtab base;
+	sqlite3 *db;
+} archiveVtab;
+
+typedef struct {
+	sqlite3_vtab_cursor base;
+	sqlite3_stmt *blocks;
+	sqlite3_stmt *lookup[DICT_COLUMNS];
+	unsigned int rows;
+	unsigned int row;
+	bool eof;
+	sqlite3_int64 *ids;
+	sqlite3_int64 *timestamps;
+	unsigned int *index[DICT_COLUMNS];
+	archiveValue *dict[DICT_COLUMNS];
+	unsigned int dictlen[DICT_COLUMNS];
+	archiveValue *reply_times;
+} archiveCursor;
+
+static void free_values(archiveValue *values, const unsigned int len)
+{
+	if(values == NULL)
+		return;
+	for(unsigned int i = 0; i < len; i++)
+		sqlite3_free(values[i].text);
+	sqlite3_free(values);
+}
+
+static void free_block(archiveCursor *cur)
+{
+	for(unsigned int i = 0; i < DICT_COLUMNS; i++)
+	{
+		free_values(cur->dict[i], cur->dictlen[i]);
+		sqlite3_free(cur->index[i]);
+		cur->dict[i] = NULL;
+		cur->dictlen[i] = 0u;
+		cur->index[i] = NULL;
+	}
+	free_values(cur->reply_times, cur->rows);
+	sqlite3_free(cur->ids);
+	cur->reply_times = NULL;
+	cur->ids = NULL;
+	cur->timestamps = NULL;
+	cur->rows = 0u;
+	cur->row = 0u;
+}
+
+static bool set_text(archiveValue *value, const int type, const void *data, const int len)
+{
+	value->type = type;
+	value->len = len;
+	value->text = sqlite3_malloc(len + 1);
+	if(value->text == NULL)
+		return false;
+	if(len > 0)
+		memcpy(value->text, data, len);
+	value->text[len] = '\0';
+	return true;
+}
+
+static bool get_value(archiveReader *r, archiveValue *value)
+{
+	const uint64_t tag = get_varint(r);
+	switch(tag)
+	{
+		case VAL_NULL:
+			value->type = SQLITE_NULL;
+			break;
+		case VAL_INTEGER:
+			value->type = SQLITE_INTEGER;
+			value->i = unzigzag(get_varint(r));
+			break;
+		case VAL_FLOAT:
+		{
+			const unsigned char *bytes = get_bytes(r, sizeof(value->r));
+			value->type = SQLITE_FLOAT;
+			if(bytes != NULL)
+				memcpy(&value->r, bytes, sizeof(value->r));
+			break;
+		}
+		case VAL_TEXT:
+		case VAL_BLOB:
+		{
+			const uint64_t len = get_varint(r);
+			const unsigned char *bytes = get_bytes(r, len);
+			if(bytes != NULL && !set_text(value, tag == VAL_TEXT ? SQLITE_TEXT : SQLITE_BLOB, bytes, len))
+				return false;
+			break;
+		}
+		default:
+			r->failed = true;
+			break;
+	}
+
+	return !r->failed;
+}
+
+// Replace the ID of a linking table by the string it stands for (NULL if it
+// does not exist) like the queries view does
+static int resolve_value(sqlite3_stmt *stmt, archiveValue *value)
+{
+	if(value->type != SQLITE_INTEGER)
+		return SQLITE_OK;
+
+	sqlite3_bind_int64(stmt, 1, value->i);
+	int rc = sqlite3_step(stmt);
+	value->type = SQLITE_NULL;
+	if(rc == SQLITE_ROW)
+	{
+		switch(sqlite3_column_type(stmt, 0))
+		{
+			case SQLITE_INTEGER:
+				value->type = SQLITE_INTEGER;
+				value->i = sqlite3_column_int64(stmt, 0);
+				break;
+			case SQLITE_FLOAT:
+				value->type = SQLITE_FLOAT;
+				value->r = sqlite3_column_double(stmt, 0);
+				break;
+			case SQLITE_TEXT:
+				if(!set_text(value, SQLITE_TEXT, sqlite3_column_text(stmt, 0), sqlite3_column_bytes(stmt, 0)))
+					rc = SQLITE_NOMEM;
+				break;
+			case SQLITE_BLOB:
+				if(!set_text(value, SQLITE_BLOB, sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0)))
+					rc = SQLITE_NOMEM;
+				break;
+			default:
+				break;
+		}
+	}
+	sqlite3_reset(stmt);
+
+	return rc == SQLITE_ROW || rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static int decode_block(archiveCursor *cur, const unsigned char *data, const int len)
+{
+	archiveReader r = { data, len > 0 ? len : 0, 0u, false };
+	const uint64_t format = get_varint(&r);
+	if(format < 1u || format > ARCHIVE_FORMAT)
+		return SQLITE_CORRUPT;
+	const uint64_t rows = get_varint(&r);
+	if(r.failed || rows == 0 || rows > r.len)
+		return SQLITE_CORRUPT;
+
+	cur->rows = rows;
+	cur->ids = sqlite3_malloc64(2*rows*sizeof(sqlite3_int64));
+	cur->reply_times = sqlite3_malloc64(rows*sizeof(archiveValue));
+	if(cur->ids == NULL || cur->reply_times == NULL)
+		return SQLITE_NOMEM;
+	memset(cur->reply_times, 0, rows*sizeof(archiveValue));
+	cur->timestamps = cur->ids + rows;
+
+	for(sqlite3_int64 *col = cur->ids; col <= cur->timestamps; col += rows)
+	{
+		col[0] = unzigzag(get_varint(&r));
+		for(unsigned int i = 1; i < rows; i++)
+			col[i] = (sqlite3_int64)((uint64_t)col[i-1] + (uint64_t)unzigzag(get_varint(&r)));
+	}
+
+	for(unsigned int i = 0; i < DICT_COLUMNS; i++)
+	{
+		// The column sample is NULL for all queries in blocks of format 1
+		const bool missing = format < 2u && dict_columns[i] == ARCH_SAMPLE;
+		const uint64_t dictlen = missing ? 1u : get_varint(&r);
+		if(r.failed || dictlen == 0 || dictlen > rows)
+			return SQLITE_CORRUPT;
+		cur->dict[i] = sqlite3_malloc64(dictlen*sizeof(archiveValue));
+		cur->index[i] = sqlite3_malloc64(rows*sizeof(unsigned int));
+		if(cur->dict[i] == NULL || cur->index[i] == NULL)
+			return SQLITE_NOMEM;
+		memset(cur->dict[i], 0, dictlen*sizeof(archiveValue));
+		cur->dictlen[i] = dictlen;
+		if(missing)
+		{
+			cur->dict[i][0].type = SQLITE_NULL;
+			memset(cur->index[i], 0, rows*sizeof(unsigned int));
+			continue;
+		}
+
+		for(unsigned int j = 0; j < dictlen; j++)
+		{
+			if(!get_value(&r, &cur->dict[i][j]))
+				return r.failed ? SQLITE_CORRUPT : SQLITE_NOMEM;
+			if(dict_lookup[i] != NULL)
+			{
+				const int rc = resolve_value(cur->lookup[i], &cur->dict[i][j]);
+				if(rc != SQLITE_OK)
+					return rc;
+			}
+		}
+		for(unsigned int j = 0; j < rows; j++)
+		{
+			const uint64_t index = get_varint(&r);
+			if(index >= dictlen)
+				return SQLITE_CORRUPT;
+			cur->index[i][j] = index;
+		}
+	}
+
+	for(unsigned int i = 0; i < rows; i++)
+	{
+		archiveValue *value = &cur->reply_times[i];
+		const uint64_t code = get_varint(&r);
+		if(code == 0u)
+			value->type = SQLITE_NULL;
+		else if(code == 1u)
+		{
+			if(!get_value(&r, value))
+				return r.failed ? SQLITE_CORRUPT : SQLITE_NOMEM;
+		}
+		else
+		{
+			value->type = SQLITE_FLOAT;
+			value->r = REPLY_TIME_UNIT*unzigzag(code - 2u);
+		}
+	}
+
+	return r.failed ? SQLITE_CORRUPT : SQLITE_OK;
+}
+
+// Advance to the first query of the next block
+static int next_block(archiveCursor *cur)
+{
+	free_block(cur);
+	const int rc = sqlite3_step(cur->blocks);
+	if(rc == SQLITE_DONE)
+	{
+		cur->eof = true;
+		return SQLITE_OK;
+	}
+	else if(rc != SQLITE_ROW)
+		return rc;
+
+	return decode_block(cur, sqlite3_column_blob(cur->blocks, 0), sqlite3_column_bytes(cur->blocks, 0));
+}
+
+static int archive_connect(sqlite3 *db, void *aux, int argc, const char *const *argv,
+                           sqlite3_vtab **vtab, char **err)
+{
+	(void)aux;
+	(void)argc;
+	(void)argv;
+	(void)err;
+
+	const int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(id INTEGER, timestamp INTEGER, type INTEGER, "
+	                                        "status INTEGER, domain TEXT, client TEXT, forward TEXT, "
+	                                        "additional_info TEXT, reply_type INTEGER, reply_time REAL, "
+	                                        "dnssec INTEGER, sample INTEGER)");
+	if(rc != SQLITE_OK)
+		return rc;
+
+	archiveVtab *table = sqlite3_malloc(sizeof(archiveVtab));
+	if(table == NULL)
+		return SQLITE_NOMEM;
+	memset(table, 0, sizeof(archiveVtab));
+	table->db = db;
+	*vtab = &table->base;
+
+	return SQLITE_OK;
+}
+
+static int archive_disconnect(sqlite3_vtab *vtab)
+{
+	sqlite3_free(vtab);
+	return SQLITE_OK;
+}
+
+// Every bound used to skip blocks gets the position of its argument in four
+// bits of idxNum: lower and upper bound of the IDs, then of the timestamps
+static int archive_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info)
+{
+	(void)vtab;
+
+	int argc = 0, idxNum = 0;
+	for(int i = 0; i < info->nConstraint; i++)
+	{
+		const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+		if(!c->usable || (c->iColumn != ARCH_ID && c->iColumn != ARCH_TIMESTAMP))
+			continue;
+
+		bool lower = false, upper = false;
+		switch(c->op)
+		{
+			case SQLITE_INDEX_CONSTRAINT_EQ:
+				lower = upper = true;
+				break;
+			case SQLITE_INDEX_CONSTRAINT_GT:
+			case SQLITE_INDEX_CONSTRAINT_GE:
+				lower = true;
+				break;
+			case SQLITE_INDEX_CONSTRAINT_LT:
+			case SQLITE_INDEX_CONSTRAINT_LE:
+				upper = true;
+				break;
+			default:
+				continue;
+		}
+
+		const int slot = 2*c->iColumn;
+		lower = lower && ((idxNum >> (4*slot)) & 0xf) == 0;
+		upper = upper && ((idxNum >> (4*(slot + 1))) & 0xf) == 0;
+		if(!lower && !upper)
+			continue;
+
+		info->aConstraintUsage[i].argvIndex = ++argc;
+		if(lower)
+			idxNum |= argc << (4*slot);
+		if(upper)
+			idxNum |= argc << (4*(slot + 1));
+	}
+
+	info->idxNum = idxNum;
+	info->estimatedCost = idxNum != 0 ? 1e4 : 1e6;
+	info->estimatedRows = idxNum != 0 ? 1e4 : 1e6;
+
+	return SQLITE_OK;
+}
+
+static int archive_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor)
+{
+	(void)vtab;
+
+	archiveCursor *cur = sqlite3_malloc(sizeof(archiveCursor));
+	if(cur == NULL)
+		return SQLITE_NOMEM;
+	memset(cur, 0, sizeof(archiveCursor));
+	cur->eof = true;
+	*cursor = &cur->base;
+
+	return SQLITE_OK;
+}
+
+static int archive_close(sqlite3_vtab_cursor *cursor)
+{
+	archiveCursor *cur = (archiveCursor*)cursor;
+	free_block(cur);
+	sqlite3_finalize(cur->blocks);
+	for(unsigned int i = 0; i < DICT_COLUMNS; i++)
+		sqlite3_finalize(cur->lookup[i]);
+	sqlite3_free(cur);
+
+	return SQLITE_OK;
+}
+
+static int archive_error(archiveCursor *cur, const int rc)
+{
+	archiveVtab *table = (archiveVtab*)cur->base.pVtab;
+	sqlite3_free(table->base.zErrMsg);
+	if(rc == SQLITE_CORRUPT)
+		table->base.zErrMsg = sqlite3_mprintf("malformed block in query_archive");
+	else
+		table->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(table->db));
+	return rc;
+}
+
+static int archive_filter(sqlite3_vtab_cursor *cursor, int idxNum, const char *idxStr,
+                          int argc, sqlite3_value **argv)
+{
+	(void)idxStr;
+
+	archiveCursor *cur = (archiveCursor*)cursor;
+	archiveVtab *table = (archiveVtab*)cursor->pVtab;
+	free_block(cur);
+	cur->eof = false;
+
+	int rc = SQLITE_OK;
+	if(cur->blocks == NULL)
+		rc = sqlite3_prepare_v2(table->db, "SELECT data FROM query_archive "
+		                                   "WHERE last_id >= ?1 AND first_id <= ?2 AND "
+		                                   "last_timestamp >= ?3 AND first_timestamp <= ?4 "
+		                                   "ORDER BY id", -1, &cur->blocks, NULL);
+	for(unsigned int i = 0; i < DICT_COLUMNS && rc == SQLITE_OK; i++)
+		if(dict_lookup[i] != NULL && cur->lookup[i] == NULL)
+			rc = sqlite3_prepare_v2(table->db, dict_lookup[i], -1, &cur->lookup[i], NULL);
+	if(rc != SQLITE_OK)
+		return archive_error(cur, rc);
+	sqlite3_reset(cur->blocks);
+
+	// Bounds which are not integers are rounded outwards or ignored
+	for(int slot = 0; slot < 4; slot++)
+	{
+		const bool lower = slot % 2 == 0;
+		sqlite3_int64 bound = lower ? INT64_MIN : INT64_MAX;
+		const int arg = (idxNum >> (4*slot)) & 0xf;
+		if(arg > 0 && arg <= argc)
+		{
+			sqlite3_value *value = argv[arg - 1];
+			if(sqlite3_value_type(value) == SQLITE_INTEGER)
+				bound = sqlite3_value_int64(value);
+			else if(sqlite3_value_type(value) == SQLITE_FLOAT)
+			{
+				const double d = sqlite3_value_double(value);
+				if(d > -9e18 && d < 9e18)
+					bound = (sqlite3_int64)d + (lower ? -1 : 1);
+			}
+		}
+		sqlite3_bind_int64(cur->blocks, slot + 1, bound);
+	}
+
+	rc = next_block(cur);
+	return rc == SQLITE_OK ? SQLITE_OK : archive_error(cur, rc);
+}
+
+static int archive_next(sqlite3_vtab_cursor *cursor)
+{
+	archiveCursor *cur = (archiveCursor*)cursor;
+	if(++cur->row < cur->rows)
+		return SQLITE_OK;
+
+	const int rc = next_block(cur);
+	return rc == SQLITE_OK ? SQLITE_OK : archive_error(cur, rc);
+}
+
+static int archive_eof(sqlite3_vtab_cursor *cursor)
+{
+	return ((archiveCursor*)cursor)->eof;
+}
+
+static void result_value(sqlite3_context *ctx, const archiveValue *value)
+{
+	switch(value->type)
+	{
+		case SQLITE_INTEGER:
+			sqlite3_result_int64(ctx, value->i);
+			break;
+		case SQLITE_FLOAT:
+			sqlite3_result_double(ctx, value->r);
+			break;
+		case SQLITE_TEXT:
+			sqlite3_result_text(ctx, value->text, value->len, SQLITE_TRANSIENT);
+			break;
+		case SQLITE_BLOB:
+			sqlite3_result_blob(ctx, value->text, value->len, SQLITE_TRANSIENT);
+			break;
+		default:
+			sqlite3_result_null(ctx);
+			break;
+	}
+}
+
+static int archive_column(sqlite3_vtab_cursor *cursor, sqlite3_context *ctx, int col)
+{
+	const archiveCursor *cur = (archiveCursor*)cursor;
+	const unsigned int row = cur->row;
+	switch(col)
+	{
+		case ARCH_ID:
+			sqlite3_result_int64(ctx, cur->ids[row]);
+			return SQLITE_OK;
+		case ARCH_TIMESTAMP:
+			sqlite3_result_int64(ctx, cur->timestamps[row]);
+			return SQLITE_OK;
+		case ARCH_REPLY_TIME:
+			result_value(ctx, &cur->reply_times[row]);
+			return SQLITE_OK;
+		default:
+			break;
+	}
+
+	for(unsigned int i = 0; i < DICT_COLUMNS; i++)
+		if(dict_columns[i] == (enum archive_column)col)
+			result_value(ctx, &cur->dict[i][cur->index[i][row]]);
+
+	return SQLITE_OK;
+}
+
+static int archive_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid)
+{
+	const archiveCursor *cur = (archiveCursor*)cursor;
+	*rowid = cur->ids[cur->row];
+	return SQLITE_OK;
+}
+
+static sqlite3_module archive_module = {
+	.iVersion = 0,
+	.xCreate = NULL,
+	.xConnect = archive_connect,
+	.xBestIndex = archive_best_index,
+	.xDisconnect = archive_disconnect,
+	.xDestroy = archive_disconnect,
+	.xOpen = archive_open,
+	.xClose = archive_close,
+	.xFilter = archive_filter,
+	.xNext = archive_next,
+	.xEof = archive_eof,
+	.xColumn = archive_column,
+	.xRowid = archive_rowid
+};
+
+int register_archive_vtab(sqlite3 *db)
+{
+	return sqlite3_create_module(db, "archived_queries", &archive_module, NULL);
+}
@@ -0,0 +1,21 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  pihole-FTL.db -> compressed query archive prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef ARCHIVETABLE_H
+#define ARCHIVETABLE_H
+
+#include "sqlite3.h"
+
+bool create_archive_table(sqlite3 *db);
+bool archive_old_queries(sqlite3 *db);
+bool delete_old_archive_blocks(sqlite3 *db, const time_t timestamp);
+int get_number_of_archived_queries(sqlite3 *db);
+int register_archive_vtab(sqlite3 *db);
+
+#endif //ARCHIVETABLE_H
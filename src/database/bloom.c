@@ -0,0 +1,178 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Bloom filter for domain lists
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "../FTL.h"
+// public prototypes
+#include "bloom.h"
+// logg()
+#include "../log.h"
+// struct config
+#include "../config.h"
+// exp(), log()
+#include <math.h>
+
+// The filters are sized for (at least) this many bits per domain. This results
+// in a false-positive rate below 1% with the optimal number of hash functions
+#define BLOOM_BITS_PER_ENTRY 10u
+#define BLOOM_MAX_HASHES 16u
+
+// 64-bit FNV-1a hash followed by the MurmurHash3 finalizer to spread the bits
+// evenly. The two halves are used for double hashing
+static uint64_t __attribute__((pure)) bloom_hash(const char *domain)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for(const unsigned char *p = (const unsigned char*)domain; *p; p++)
+		hash = (hash ^ *p) * 1099511628211ULL;
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+static void bloom_add(bloom_filter *filter, const char *domain)
+{
+	const uint64_t hash = bloom_hash(domain);
+	const uint32_t h1 = hash & 0xFFFFFFFFu;
+	const uint32_t h2 = (hash >> 32) | 1u;
+	const size_t mask = filter->nbits - 1;
+	for(unsigned int i = 0; i < filter->k; i++)
+	{
+		const size_t bit = (h1 + (size_t)i * h2) & mask;
+		filter->bits[bit / 64] |= 1ULL << (bit % 64);
+	}
+	filter->entries++;
+}
+
+// Check if a domain may be in the list. A return value of false means the
+// domain is definitely not in the list
+bool bloom_check(bloom_filter *filter, const char *domain)
+{
+	if(filter == NULL)
+		return true;
+
+	const uint64_t hash = bloom_hash(domain);
+	const uint32_t h1 = hash & 0xFFFFFFFFu;
+	const uint32_t h2 = (hash >> 32) | 1u;
+	const size_t mask = filter->nbits - 1;
+	for(unsigned int i = 0; i < filter->k; i++)
+	{
+		const size_t bit = (h1 + (size_t)i * h2) & mask;
+		if(!(filter->bits[bit / 64] & (1ULL << (bit % 64))))
+		{
+			filter->rejected++;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Build a filter containing all domains returned by the query. The first
+// statement returns the number of domains, the second the domains themselves
+bloom_filter *bloom_build(sqlite3 *db, const char *querystr)
+{
+	sqlite3_stmt *stmt = NULL;
+	const char *tail = NULL;
+	int rc = sqlite3_prepare_v2(db, querystr, -1, &stmt, &tail);
+	if(rc != SQLITE_OK)
+	{
+		logg("bloom_build(\"%s\") - SQL error prepare: %s", querystr, sqlite3_errstr(rc));
+		return NULL;
+	}
+
+	// Get number of domains to size the filter
+	size_t count = 0;
+	if(sqlite3_step(stmt) == SQLITE_ROW)
+		count = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	size_t nbits = 64;
+	while(nbits < BLOOM_BITS_PER_ENTRY * count)
+		nbits *= 2;
+
+	bloom_filter *filter = calloc(1, sizeof(bloom_filter));
+	if(filter == NULL)
+		return NULL;
+	filter->bits = calloc(nbits / 64, sizeof(uint64_t));
+	if(filter->bits == NULL)
+	{
+		free(filter);
+		return NULL;
+	}
+	filter->nbits = nbits;
+
+	// Optimal number of hash functions for this size: k = ln(2) * m/n
+	const double k = count > 0 ? log(2.0) * nbits / count + 0.5 : 1.0;
+	if(k < 1.0)
+		filter->k = 1u;
+	else if(k > BLOOM_MAX_HASHES)
+		filter->k = BLOOM_MAX_HASHES;
+	else
+		filter->k = (unsigned int)k;
+
+	rc = sqlite3_prepare_v2(db, tail, -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("bloom_build(\"%s\") - SQL error prepare: %s", tail, sqlite3_errstr(rc));
+		bloom_free(&filter);
+		return NULL;
+	}
+
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		const char *domain = (const char*)sqlite3_column_text(stmt, 0);
+		if(domain != NULL)
+			bloom_add(filter, domain);
+	}
+	sqlite3_finalize(stmt);
+
+	if(rc != SQLITE_DONE)
+	{
+		logg("bloom_build(\"%s\") - SQL error step: %s", tail, sqlite3_errstr(rc));
+		bloom_free(&filter);
+		return NULL;
+	}
+
+	if(config.debug & DEBUG_DATABASE)
+		logg("bloom_build(): Added %zu domains, %zu bits, %u hashes",
+		     filter->entries, filter->nbits, filter->k);
+
+	return filter;
+}
+
+void bloom_free(bloom_filter **filter)
+{
+	if(*filter == NULL)
+		return;
+
+	free((*filter)->bits);
+	free(*filter);
+	*filter = NULL;
+}
+
+// Memory used by the filter in bytes
+size_t bloom_memory(const bloom_filter *filter)
+{
+	if(filter == NULL)
+		return 0u;
+
+	return sizeof(bloom_filter) + filter->nbits / 8;
+}
+
+// Expected false-positive rate of the filter: (1 - e^(-kn/m))^k
+double bloom_fp_rate(const bloom_filter *filter)
+{
+	if(filter == NULL || filter->entries == 0)
+		return 0.0;
+
+	return pow(1.0 - exp(-(double)filter->k * filter->entries / filter->nbits), filter->k);
+}
@@ -0,0 +1,38 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Bloom filter prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "sqlite3.h"
+
+typedef struct bloom_filter {
+	// Bit array, size is a power of two
+	uint64_t *bits;
+	size_t nbits;
+	// Number of hash functions
+	unsigned int k;
+	// Number of domains added to the filter
+	size_t entries;
+	// Lookup statistics: checks rejected by the filter and checks passed
+	// by the filter which turned out to be no match (false positives)
+	unsigned long rejected;
+	unsigned long false_positives;
+} bloom_filter;
+
+bloom_filter *bloom_build(sqlite3 *db, const char *querystr);
+void bloom_free(bloom_filter **filter);
+bool bloom_check(bloom_filter *filter, const char *domain);
+size_t bloom_memory(const bloom_filter *filter) __attribute__((pure));
+double bloom_fp_rate(const bloom_filter *filter) __attribute__((pure));
+
+#endif //BLOOM_H
@@ -25,8 +25,15 @@
 #include "aliasclients.h"
 // add_additional_info_column()
 #include "query-table.h"
+// create_rollup_tables()
+#include "rollup-table.h"
+// create_archive_table()
+#include "archive-table.h"
+// db_latency_register()
+#include "dblatency.h"
 
 bool DBdeleteoldqueries = false;
+bool DBarchiveoldqueries = false;
 static bool DBerror = false;
 long int lastdbindex = 0;
 
@@ -110,6 +117,9 @@ sqlite3* _dbopen(bool create, const char *func, const int line, const char *file
 		return NULL;
 	}
 
+	// Collect statement latency statistics on this connection
+	db_latency_register(db, DB_LATENCY_FTL);
+
 	return db;
 }
 
@@ -207,6 +217,10 @@ static bool db_create(void)
 	if(db == NULL)
 		return false;
 
+	// Allow the database maintenance to return free pages to the file
+	// system in small steps. This has to be set before creating tables
+	SQL_bool(db, "PRAGMA auto_vacuum = INCREMENTAL;");
+
 	// Create Queries table in the database
 	SQL_bool(db, "CREATE TABLE queries ( id INTEGER PRIMARY KEY AUTOINCREMENT, timestamp INTEGER NOT NULL, type INTEGER NOT NULL, status INTEGER NOT NULL, domain TEXT NOT NULL, client TEXT NOT NULL, forward TEXT );");
 
@@ -238,6 +252,44 @@ void SQLite3LogCallback(void *pArg, int iErrCode, const char *zMsg)
 	logg("SQLite3 message: %s (%d)", zMsg, iErrCode);
 }
 
+// Page size of FTL's databases. Pages of databases with a larger page size do
+// not fit into the page cache arena and are allocated on the heap
+#define ARENA_PAGE_SIZE 4096
+// Size of a lookaside slot (SQLite3's default)
+#define LOOKASIDE_SLOT_SIZE 1200
+
+// Set up the memory SQLite3 uses for all connections (see SQLITE_PAGECACHE
+// and SQLITE_LOOKASIDE). This has to be done before SQLite3 is initialized
+static void db_memory_init(void)
+{
+	// Track the memory used by SQLite3 (reported by >dbstats). This is
+	// disabled by default at compile time (SQLITE_DEFAULT_MEMSTATUS=0)
+	sqlite3_config(SQLITE_CONFIG_MEMSTATUS, 1);
+
+	if(config.sqlite.pagecache > 0)
+	{
+		int hdrsz = 0;
+		sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &hdrsz);
+		const size_t slot = ARENA_PAGE_SIZE + hdrsz;
+		const size_t slots = (size_t)config.sqlite.pagecache * 1024u / slot;
+
+		// The arena is never freed as SQLite3 uses it until FTL exits
+		void *arena = slots > 0 ? calloc(slots, slot) : NULL;
+		if(arena == NULL)
+			logg("WARNING: Cannot allocate page cache arena of %u KiB", config.sqlite.pagecache);
+		else if(sqlite3_config(SQLITE_CONFIG_PAGECACHE, arena, (int)slot, (int)slots) != SQLITE_OK)
+		{
+			logg("WARNING: Cannot configure page cache arena of %u KiB", config.sqlite.pagecache);
+			free(arena);
+		}
+	}
+
+	if(config.sqlite.lookaside > -1 &&
+	   sqlite3_config(SQLITE_CONFIG_LOOKASIDE, config.sqlite.lookaside > 0 ? LOOKASIDE_SLOT_SIZE : 0,
+	                  config.sqlite.lookaside) != SQLITE_OK)
+		logg("WARNING: Cannot configure %i lookaside slots", config.sqlite.lookaside);
+}
+
 void db_init(void)
 {
 	// Initialize SQLite3 logging callback
@@ -246,6 +298,9 @@ void db_init(void)
 	// explicitly check for failures to have happened
 	sqlite3_config(SQLITE_CONFIG_LOG, SQLite3LogCallback, NULL);
 
+	// Configure the memory used by SQLite3
+	db_memory_init();
+
 	// Register Pi-hole provided SQLite3 extensions (see sqlite3-ext.c)
 	sqlite3_auto_extension((void (*)(void))sqlite3_pihole_extensions_init);
 
@@ -465,6 +520,81 @@ void db_init(void)
 		dbversion = db_get_int(db, DB_VERSION);
 	}
 
+	// Update to version 13 if lower
+	if(dbversion < 13)
+	{
+		// Update to version 13: Add hourly rollup tables
+		logg("Updating long-term database to version 13");
+		if(!create_rollup_tables(db))
+		{
+			logg("Rollup tables not generated, database not available");
+			dbclose(&db);
+			return;
+		}
+		// Get updated version
+		dbversion = db_get_int(db, DB_VERSION);
+	}
+
+	// Update to version 14 if lower
+	if(dbversion < 14)
+	{
+		// Update to version 14: Add compressed query archive
+		logg("Updating long-term database to version 14");
+		if(!create_archive_table(db))
+		{
+			logg("Query archive not generated, database not available");
+			dbclose(&db);
+			return;
+		}
+		// Get updated version
+		dbversion = db_get_int(db, DB_VERSION);
+	}
+
+	// Update to version 15 if lower
+	if(dbversion < 15)
+	{
+		// Update to version 15: Add occurrence counter to message table
+		logg("Updating long-term database to version 15");
+		if(!add_message_count_column(db))
+		{
+			logg("Column count not added to message table, database not available");
+			dbclose(&db);
+			return;
+		}
+		// Get updated version
+		dbversion = db_get_int(db, DB_VERSION);
+	}
+
+	// Update to version 16 if lower
+	if(dbversion < 16)
+	{
+		// Update to version 16: Add covering indexes to the query_storage table
+		logg("Updating long-term database to version 16");
+		if(!create_query_storage_indexes(db))
+		{
+			logg("Indexes of the query_storage table not created, database not available");
+			dbclose(&db);
+			return;
+		}
+		// Get updated version
+		dbversion = db_get_int(db, DB_VERSION);
+	}
+
+	// Update to version 17 if lower
+	if(dbversion < 17)
+	{
+		// Update to version 17: Add sampling rate column to the query_storage table
+		logg("Updating long-term database to version 17");
+		if(!add_query_sample_column(db))
+		{
+			logg("Column sample not added to query_storage table, database not available");
+			dbclose(&db);
+			return;
+		}
+		// Get updated version
+		dbversion = db_get_int(db, DB_VERSION);
+	}
+
 	lock_shm();
 	import_aliasclients(db);
 	unlock_shm();
@@ -634,3 +764,17 @@ const char *get_sqlite3_version(void)
 {
 	return sqlite3_libversion();
 }
+
+// Return the memory currently used by SQLite3 and the high-water marks
+void get_sqlite3_memory(struct sqlite3_memory *mem)
+{
+	memset(mem, 0, sizeof(*mem));
+	sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &mem->used, &mem->used_peak, 0);
+	sqlite3_status64(SQLITE_STATUS_PAGECACHE_USED, &mem->pagecache, &mem->pagecache_peak, 0);
+	sqlite3_status64(SQLITE_STATUS_PAGECACHE_OVERFLOW, &mem->overflow, &mem->overflow_peak, 0);
+
+	// Number of slots of the page cache arena
+	int hdrsz = 0;
+	sqlite3_config(SQLITE_CONFIG_PCACHE_HDRSZ, &hdrsz);
+	mem->slots = (sqlite3_int64)config.sqlite.pagecache * 1024 / (ARENA_PAGE_SIZE + hdrsz);
+}
@@ -30,6 +30,13 @@ int db_get_int(sqlite3* db, const enum ftl_table_props ID);
 bool db_set_FTL_property(sqlite3 *db, const enum ftl_table_props ID, const long value);
 bool db_set_counter(sqlite3 *db, const enum counters_table_props ID, const long value);
 
+// Number of rows of every index ANALYZE looks at. The statistics are
+// approximate but ANALYZE takes milliseconds even on large databases
+#define DB_ANALYSIS_LIMIT 1000
+// Interval [seconds] the database maintenance refreshes the statistics of the
+// query planner in
+#define DB_ANALYZE_INTERVAL 86400
+
 /// Execute a formatted SQL query and get the return code
 int dbquery(sqlite3* db, const char *format, ...) __attribute__ ((format (gnu_printf, 2, 3)));;
 
@@ -44,8 +51,19 @@ long int get_max_query_ID(sqlite3 *db);
 bool db_update_counters(sqlite3 *db, const int total, const int blocked);
 const char *get_sqlite3_version(void);
 
+// Memory used by SQLite3 (current value and high-water mark), the page cache
+// is counted in slots of the arena and in bytes allocated beyond it
+struct sqlite3_memory {
+	sqlite3_int64 used, used_peak;
+	sqlite3_int64 slots;
+	sqlite3_int64 pagecache, pagecache_peak;
+	sqlite3_int64 overflow, overflow_peak;
+};
+void get_sqlite3_memory(struct sqlite3_memory *mem);
+
 extern long int lastdbindex;
 extern bool DBdeleteoldqueries;
+extern bool DBarchiveoldqueries;
 
 // Return if FTL's database is known to be broken
 // We abort execution of all database-related activities in this case
@@ -17,6 +17,8 @@
 #include "network-table.h"
 // DB_save_queries()
 #include "query-table.h"
+// archive_old_queries()
+#include "archive-table.h"
 #include "../config.h"
 #include "../log.h"
 #include "../timers.h"
@@ -28,27 +30,275 @@
 #include "../events.h"
 // check_blocking_status()
 #include "../setupVars.h"
+// store_queued_messages()
+#include "message-table.h"
+// restart_dns_workers()
+#include "../workers.h"
+// thread_sched_apply()
+#include "../threadsched.h"
 
-#define DBOPEN_OR_AGAIN() { db = dbopen(false); if(db == NULL) { thread_sleepms(DB, 5000); continue; } }
+// The connection to pihole-FTL.db is kept open between cycles (together with
+// the statements cached by DB_save_queries()). It is only closed on shutdown,
+// after a database error, or when the file has been replaced
+#define DBOPEN_OR_AGAIN() { if(!reuse_db(&db, &db_stat)) { db = dbopen(false); if(db == NULL) { thread_sleepms(DB, 5000); continue; } stat(FTLfiles.FTL_db, &db_stat); } }
 #define BREAK_IF_KILLED() { if(killed) break; }
-#define DBCLOSE_OR_BREAK() { dbclose(&db); BREAK_IF_KILLED(); }
+#define DBCLOSE_OR_BREAK() { if(FTLDBerror()) close_db(&db); BREAK_IF_KILLED(); }
+
+static void close_db(sqlite3 **db)
+{
+	if(*db == NULL)
+		return;
+
+	// Statements have to be finalized before the connection can be closed
+	DB_finalize_save_statements();
+	dbclose(db);
+	*db = NULL;
+}
+
+// Check if the open connection can be used again. It is closed if the database
+// file has been removed or replaced (e.g., by restoring a backup) since it was
+// opened
+static bool reuse_db(sqlite3 **db, const struct stat *opened)
+{
+	if(*db == NULL)
+		return false;
+
+	struct stat st;
+	if(stat(FTLfiles.FTL_db, &st) != 0 ||
+	   st.st_dev != opened->st_dev || st.st_ino != opened->st_ino)
+	{
+		if(config.debug & DEBUG_DATABASE)
+			logg("Database file has changed, reopening");
+		close_db(db);
+		return false;
+	}
+
+	return true;
+}
+
+// Database maintenance (incremental vacuum, ANALYZE, PRAGMA optimize and WAL
+// checkpoints) is run every DBMAINTENANCE_INTERVAL seconds. It is split into
+// small slices that are only executed while the DNS load is low and no
+// queries are waiting to be stored so it never competes with storing queries
+#define MAINTENANCE_VACUUM_PAGES 128
+enum maintenance_task { MAINTENANCE_VACUUM, MAINTENANCE_ANALYZE, MAINTENANCE_OPTIMIZE, MAINTENANCE_CHECKPOINT, MAINTENANCE_DONE };
+static struct {
+	enum maintenance_task task;
+	time_t next_run;
+	time_t last_analyze;
+	time_t last_sample;
+	int last_queries;
+	unsigned int qps;
+	struct db_maintenance_stats stats;
+} maintenance = { MAINTENANCE_DONE, 0, 0, 0, 0, 0u, { 0 } };
+
+void get_db_maintenance_stats(struct db_maintenance_stats *stats)
+{
+	memcpy(stats, &maintenance.stats, sizeof(*stats));
+}
+
+// Measure the DNS load (queries per second) once per second
+static void sample_dns_load(const time_t now)
+{
+	if(now == maintenance.last_sample)
+		return;
+
+	lock_shm_shared();
+	const int queries = counters->queries;
+	unlock_shm_shared();
+
+	if(maintenance.last_sample > 0 && queries >= maintenance.last_queries)
+		maintenance.qps = (queries - maintenance.last_queries) / (now - maintenance.last_sample);
+	maintenance.last_sample = now;
+	maintenance.last_queries = queries;
+}
+
+// Run one slice of the database maintenance. Returns true if the slice was
+// executed successfully
+static bool run_maintenance_slice(sqlite3 *db, const time_t now)
+{
+	switch(maintenance.task)
+	{
+		case MAINTENANCE_VACUUM:
+		{
+			// Incremental vacuum is only possible when it has been
+			// enabled when the database was created
+			const int auto_vacuum = db_query_int(db, "PRAGMA auto_vacuum;");
+			const int freelist = db_query_int(db, "PRAGMA freelist_count;");
+			if(auto_vacuum != 2 || freelist < 1)
+			{
+				maintenance.task = MAINTENANCE_ANALYZE;
+				return auto_vacuum != DB_FAILED && freelist != DB_FAILED;
+			}
+
+			const int pages = freelist < MAINTENANCE_VACUUM_PAGES ? freelist : MAINTENANCE_VACUUM_PAGES;
+			if(dbquery(db, "PRAGMA incremental_vacuum(%d);", pages) != SQLITE_OK)
+				return false;
+			maintenance.stats.vacuumed += pages;
+			if(pages == freelist)
+				maintenance.task = MAINTENANCE_ANALYZE;
+			return true;
+		}
+
+		case MAINTENANCE_ANALYZE:
+		{
+			// PRAGMA optimize only analyzes tables this connection
+			// has queried, the long-term statistics are queried by
+			// other processes. Refresh the statistics of the
+			// query_storage indexes once a day, they only change
+			// slowly as the table grows
+			maintenance.task = MAINTENANCE_OPTIMIZE;
+			if(now - maintenance.last_analyze < DB_ANALYZE_INTERVAL)
+				return true;
+			maintenance.last_analyze = now;
+			if(dbquery(db, "PRAGMA analysis_limit = %d;", DB_ANALYSIS_LIMIT) != SQLITE_OK)
+				return false;
+			if(dbquery(db, "ANALYZE query_storage;") != SQLITE_OK)
+				return false;
+			maintenance.stats.analyzed++;
+			return true;
+		}
+
+		case MAINTENANCE_OPTIMIZE:
+			maintenance.task = MAINTENANCE_CHECKPOINT;
+			return dbquery(db, "PRAGMA optimize;") == SQLITE_OK;
+
+		case MAINTENANCE_CHECKPOINT:
+		{
+			maintenance.task = MAINTENANCE_DONE;
+
+			// Checkpoints are only needed in WAL mode. Truncate the
+			// WAL file only when there is no DNS load at all
+			int log = 0, checkpointed = 0;
+			const int mode = maintenance.qps == 0u ? SQLITE_CHECKPOINT_TRUNCATE : SQLITE_CHECKPOINT_PASSIVE;
+			const int rc = sqlite3_wal_checkpoint_v2(db, NULL, mode, &log, &checkpointed);
+			if(rc != SQLITE_OK && rc != SQLITE_BUSY)
+			{
+				logg("Database maintenance: WAL checkpoint failed: %s", sqlite3_errstr(rc));
+				checkFTLDBrc(rc);
+				return false;
+			}
+			if(checkpointed > 0)
+				maintenance.stats.checkpointed += checkpointed;
+			return true;
+		}
+
+		case MAINTENANCE_DONE:
+		default:
+			// Start next maintenance round
+			maintenance.task = MAINTENANCE_VACUUM;
+			maintenance.next_run = now + config.db_maintenance.interval;
+			maintenance.stats.rounds++;
+			maintenance.stats.last_round = now;
+			return true;
+	}
+}
+
+// Run a maintenance slice if one is due and the DNS load is low
+static bool maintenance_due(const time_t now)
+{
+	if(config.db_maintenance.interval == 0u)
+		return false;
+
+	sample_dns_load(now);
+
+	// The first round starts one interval after starting FTL
+	if(maintenance.next_run == 0)
+		maintenance.next_run = now + config.db_maintenance.interval;
+
+	if(maintenance.task == MAINTENANCE_DONE && now < maintenance.next_run)
+		return false;
+
+	return maintenance.qps <= config.db_maintenance.idle && DB_pending_queries() == 0;
+}
+
+static void run_maintenance(sqlite3 *db, const time_t now)
+{
+	timer_start(DATABASE_MAINTENANCE_TIMER);
+	const enum maintenance_task task = maintenance.task;
+	const bool okay = run_maintenance_slice(db, now);
+	const double took = timer_stop(DATABASE_MAINTENANCE_TIMER);
+
+	maintenance.stats.slices++;
+	maintenance.stats.total_ms += took;
+	if(took > maintenance.stats.max_ms)
+		maintenance.stats.max_ms = took;
+
+	if(config.debug & DEBUG_DATABASE || !okay)
+	{
+		const char *tasks[] = { "incremental vacuum", "analyze", "optimize", "checkpoint", "scheduling" };
+		logg("Database maintenance: %s %s after %.1f ms (%u queries/s)",
+		     tasks[task], okay ? "done" : "failed", took, maintenance.qps);
+	}
+
+	// Postpone the remainder on errors
+	if(!okay)
+	{
+		maintenance.task = MAINTENANCE_DONE;
+		maintenance.next_run = now + config.db_maintenance.interval;
+	}
+}
+
+// Milliseconds until the database thread has to run again
+static int next_db_wakeup(const time_t lastDBsave, const bool flush_backlog)
+{
+	if(have_queued_messages() || maintenance.task != MAINTENANCE_DONE ||
+	   (config.DBexport && (DBdeleteoldqueries || DBarchiveoldqueries)))
+		return 100;
+
+	const time_t now = time(NULL);
+	long wait = (lastDBsave + config.DBinterval - now)*1000L;
+
+	// Completed queries do not wake up this thread, check for them once
+	// per flush interval
+	if(config.DBexport && config.db_flush.interval > 0 && !flush_backlog)
+	{
+		double flush = config.db_flush.interval;
+		if(DB_pending_queries() > 0)
+			flush -= timer_elapsed_msec(DATABASE_FLUSH_TIMER);
+		if(flush < wait)
+			wait = (long)flush;
+	}
+
+	// Wait for the next maintenance round. When it is due but the DNS load
+	// is too high, check the load again in a second
+	if(config.DBexport && config.db_maintenance.interval > 0u && maintenance.next_run > 0)
+	{
+		const long maint = maintenance.next_run > now ? (maintenance.next_run - now)*1000L : 1000L;
+		if(maint < wait)
+			wait = maint;
+	}
+
+	// Never wake up more often than every 100 msec
+	return wait > 100 ? (int)wait : 100;
+}
 
 void *DB_thread(void *val)
 {
 	// Set thread name
 	thread_names[DB] = "database";
 	prctl(PR_SET_NAME, thread_names[DB], 0, 0, 0);
+	thread_sched_apply(DB);
 
 	// Save timestamp as we do not want to store immediately
 	// to the database
 	time_t lastDBsave = time(NULL) - time(NULL)%config.DBinterval;
+	time_t nextMACVendorUpdate = time(NULL) - time(NULL)%2592000L + 2592000L;
+
+	// Completed queries are stored continuously in small transactions (see
+	// DBFLUSH_INTERVAL). If the database cannot keep up, we fall back to
+	// storing them only every DBinterval until a batch succeeded
+	bool flush_backlog = false;
+	timer_start(DATABASE_FLUSH_TIMER);
+
+	sqlite3 *db = NULL;
+	struct stat db_stat = { 0 };
 
 	// This thread runs until shutdown of the process. We keep this thread
 	// running when pihole-FTL.db is corrupted because reloading of privacy
 	// level, and the gravity database (initially and after gravity)
 	while(!killed)
 	{
-		sqlite3 *db = NULL;
 		time_t now = time(NULL);
 		if(now - lastDBsave >= config.DBinterval)
 		{
@@ -59,18 +309,12 @@ void *DB_thread(void *val)
 			if(config.DBexport)
 			{
 				DBOPEN_OR_AGAIN();
-				lock_shm();
-				DB_save_queries(db);
-				unlock_shm();
-
-				// Check if GC should be done on the database
-				if(DBdeleteoldqueries && config.maxDBdays != -1)
+				if(DB_save_queries(db) != DB_FAILED && flush_backlog)
 				{
-					// No thread locks needed
-					delete_old_queries_in_DB(db);
-					DBdeleteoldqueries = false;
+					logg("Resuming continuous storing of queries in the database");
+					flush_backlog = false;
 				}
-
+				timer_start(DATABASE_FLUSH_TIMER);
 				DBCLOSE_OR_BREAK();
 			}
 
@@ -79,10 +323,58 @@ void *DB_thread(void *val)
 				set_event(PARSE_NEIGHBOR_CACHE);
 		}
 
+		// Store completed queries if the flush interval has passed or
+		// enough queries are waiting
+		if(config.DBexport && config.db_flush.interval > 0 && !flush_backlog)
+		{
+			const int pending = DB_pending_queries();
+			if(pending > 0 &&
+			   (timer_elapsed_msec(DATABASE_FLUSH_TIMER) >= config.db_flush.interval ||
+			    (unsigned int)pending >= config.db_flush.rows))
+			{
+				DBOPEN_OR_AGAIN();
+				const int saved = DB_save_queries(db);
+				// Backpressure: The transaction took longer than the
+				// interval it should be repeated in (or failed)
+				const double took = timer_elapsed_msec(DATABASE_WRITE_TIMER);
+				if(saved == DB_FAILED || took > config.db_flush.interval)
+				{
+					logg("WARNING: Storing queries in the database %s, storing them every %lli seconds",
+					     saved == DB_FAILED ? "failed" : "is too slow", (long long)config.DBinterval);
+					if(saved != DB_FAILED)
+						logg("         Last transaction took %.1f ms", took);
+					flush_backlog = true;
+				}
+				timer_start(DATABASE_FLUSH_TIMER);
+				DBCLOSE_OR_BREAK();
+			}
+		}
+
+		// Delete old queries from the database if requested by the GC.
+		// This is done in batches, one per iteration, so storing queries
+		// continues in the meantime
+		if(config.DBexport && DBdeleteoldqueries && config.maxDBdays != -1)
+		{
+			DBOPEN_OR_AGAIN();
+			// No thread locks needed
+			DBdeleteoldqueries = delete_old_queries_in_DB(db);
+			DBCLOSE_OR_BREAK();
+		}
+
+		// Move old queries into the compressed query archive if
+		// requested by the GC. This is done in batches as well
+		if(config.DBexport && DBarchiveoldqueries && config.archiveDBdays > 0)
+		{
+			DBOPEN_OR_AGAIN();
+			DBarchiveoldqueries = archive_old_queries(db);
+			DBCLOSE_OR_BREAK();
+		}
+
 		// Update MAC vendor strings once a month (the MAC vendor
 		// database is not updated very often)
-		if(now % 2592000L == 0)
+		if(now >= nextMACVendorUpdate)
 		{
+			nextMACVendorUpdate = now - now%2592000L + 2592000L;
 			DBOPEN_OR_AGAIN();
 			updateMACVendorRecords(db);
 			DBCLOSE_OR_BREAK();
@@ -96,6 +388,22 @@ void *DB_thread(void *val)
 			DBCLOSE_OR_BREAK();
 		}
 
+		// Run database maintenance in small slices while idle
+		if(config.DBexport && maintenance_due(now))
+		{
+			DBOPEN_OR_AGAIN();
+			run_maintenance(db, now);
+			DBCLOSE_OR_BREAK();
+		}
+
+		// Store queued messages
+		if(have_queued_messages())
+		{
+			DBOPEN_OR_AGAIN();
+			store_queued_messages(db);
+			DBCLOSE_OR_BREAK();
+		}
+
 		// Import alias-clients
 		if(get_and_clear_event(REIMPORT_ALIASCLIENTS))
 		{
@@ -114,20 +422,29 @@ void *DB_thread(void *val)
 
 		// Reload privacy level from pihole-FTL.conf
 		if(get_and_clear_event(RELOAD_PRIVACY_LEVEL))
+		{
 			get_privacy_level(NULL);
+			restart_dns_workers();
+		}
 
 		BREAK_IF_KILLED();
 
 		// Inspect setupVars.conf to see if Pi-hole blocking is enabled
 		if(get_and_clear_event(RELOAD_BLOCKINGSTATUS))
+		{
 			check_blocking_status();
+			restart_dns_workers();
+		}
 
 		BREAK_IF_KILLED();
 
-		// Sleep 0.1 sec
-		thread_sleepms(DB, 100);
+		// Sleep only shortly while there is backlog to work on.
+		// Otherwise, sleep until the next periodic task is due or an
+		// event arrives for this thread
+		wait_for_event(DB, next_db_wakeup(lastDBsave, flush_backlog));
 	}
 
+	close_db(&db);
 	logg("Terminating database thread");
 	return NULL;
 }
@@ -10,6 +10,18 @@
 #ifndef DATABASE_THREAD_H
 #define DATABASE_THREAD_H
 
+struct db_maintenance_stats {
+	unsigned long rounds;
+	unsigned long slices;
+	long long vacuumed;
+	long long checkpointed;
+	unsigned long analyzed;
+	double total_ms;
+	double max_ms;
+	time_t last_round;
+};
+
 void *DB_thread(void *val);
+void get_db_maintenance_stats(struct db_maintenance_stats *stats);
 
 #endif //DATABASE_THREAD_H
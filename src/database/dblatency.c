@@ -0,0 +1,186 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Database latency profiling routines
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "../FTL.h"
+// public prototypes
+#include "dblatency.h"
+// logg()
+#include "../log.h"
+// hist_bin()
+#include "../histogram.h"
+
+// Statistics are collected per process for all connections to a database
+// file. Several threads may use (different) connections to the same file
+// concurrently, hence all updates are atomic
+static db_latency stats[DB_LATENCY_FILES][DB_LATENCY_KINDS] = {{{ 0 }}};
+
+// Does the SQL statement start with the given keyword (case-insensitive)?
+static bool __attribute__((pure)) starts_with(const char *sql, const char *keyword)
+{
+	while(*sql == ' ' || *sql == '\t' || *sql == '\n')
+		sql++;
+	return strncasecmp(sql, keyword, strlen(keyword)) == 0;
+}
+
+// Classify a statement which has just finished
+static enum db_latency_kind classify(sqlite3_stmt *stmt)
+{
+	const char *sql = sqlite3_sql(stmt);
+	if(sql != NULL)
+	{
+		if(starts_with(sql, "BEGIN"))
+			return DB_LATENCY_BEGIN;
+		if(starts_with(sql, "COMMIT") || starts_with(sql, "END"))
+			return DB_LATENCY_COMMIT;
+	}
+	return sqlite3_stmt_readonly(stmt) ? DB_LATENCY_READ : DB_LATENCY_WRITE;
+}
+
+// The time SQLite3 reports for finished statements has only millisecond
+// resolution. We take our own timestamps when statements start running. A
+// connection runs more than one statement at a time only when statements are
+// nested (e.g. sqlite3_exec() while stepping through another statement)
+#define DB_LATENCY_NESTED 4
+struct db_latency_conn {
+	db_latency *file;
+	struct {
+		sqlite3_stmt *stmt;
+		uint64_t start;
+	} running[DB_LATENCY_NESTED];
+};
+
+// Record a finished statement
+static void record(db_latency *file, sqlite3_stmt *stmt, const uint64_t usec)
+{
+	db_latency *s = &file[classify(stmt)];
+	__atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->total, usec, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->hist[hist_bin(usec, DB_LATENCY_BINS)], 1, __ATOMIC_RELAXED);
+	update_max(&s->max, usec);
+}
+
+// SQLite3 calls this when a statement starts running (SQLITE_TRACE_STMT), when
+// it has finished (SQLITE_TRACE_PROFILE) and when the connection is closed
+// (SQLITE_TRACE_CLOSE). The measured time is the wall-clock time spent inside
+// sqlite3_step(), this includes time spent in the busy handler and waiting
+// for fsync()
+static int trace_callback(unsigned int type, void *ctx, void *P, void *X)
+{
+	struct db_latency_conn *conn = ctx;
+	if(type == SQLITE_TRACE_CLOSE)
+	{
+		free(conn);
+		return 0;
+	}
+
+	sqlite3_stmt *stmt = P;
+	unsigned int i = 0;
+	for(; i < DB_LATENCY_NESTED; i++)
+		if(conn->running[i].stmt == stmt)
+			break;
+
+	if(type == SQLITE_TRACE_STMT)
+	{
+		// This is also invoked for each trigger program and possibly
+		// later during the execution of a statement. Keep the first
+		// timestamp in this case
+		if(i < DB_LATENCY_NESTED)
+			return 0;
+		for(i = 0; i < DB_LATENCY_NESTED; i++)
+		{
+			if(conn->running[i].stmt == NULL)
+			{
+				conn->running[i].stmt = stmt;
+				conn->running[i].start = monotonic_usec();
+				break;
+			}
+		}
+	}
+	else if(type == SQLITE_TRACE_PROFILE)
+	{
+		uint64_t usec;
+		if(i < DB_LATENCY_NESTED)
+		{
+			usec = monotonic_usec() - conn->running[i].start;
+			conn->running[i].stmt = NULL;
+		}
+		else
+		{
+			// Too deeply nested, use SQLite3's own measurement
+			usec = (uint64_t)(*(sqlite3_int64*)X) / 1000u;
+		}
+		record(conn->file, stmt, usec);
+	}
+
+	return 0;
+}
+
+// Start collecting latency statistics for a database connection
+void db_latency_register(sqlite3 *db, const enum db_latency_file file)
+{
+	if(db == NULL || file >= DB_LATENCY_FILES)
+		return;
+
+	// Freed by trace_callback() when the connection is closed
+	struct db_latency_conn *conn = calloc(1, sizeof(*conn));
+	if(conn == NULL)
+		return;
+	conn->file = stats[file];
+
+	const int rc = sqlite3_trace_v2(db, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE | SQLITE_TRACE_CLOSE,
+	                                trace_callback, conn);
+	if(rc != SQLITE_OK)
+	{
+		logg("Cannot register database latency profiling for %s: %s",
+		     db_latency_file_name(file), sqlite3_errstr(rc));
+		free(conn);
+	}
+}
+
+const db_latency *db_latency_get(const enum db_latency_file file, const enum db_latency_kind kind)
+{
+	if(file >= DB_LATENCY_FILES || kind >= DB_LATENCY_KINDS)
+		return NULL;
+	return &stats[file][kind];
+}
+
+const char *db_latency_file_name(const enum db_latency_file file)
+{
+	switch(file)
+	{
+		case DB_LATENCY_FTL:
+			return "pihole-FTL.db";
+		case DB_LATENCY_GRAVITY:
+			return "gravity.db";
+		case DB_LATENCY_MACVENDOR:
+			return "macvendor.db";
+		case DB_LATENCY_FILES: // Fall through
+		default:
+			return "unknown";
+	}
+}
+
+const char *db_latency_kind_name(const enum db_latency_kind kind)
+{
+	switch(kind)
+	{
+		case DB_LATENCY_BEGIN:
+			return "begin";
+		case DB_LATENCY_WRITE:
+			return "write";
+		case DB_LATENCY_READ:
+			return "read";
+		case DB_LATENCY_COMMIT:
+			return "commit";
+		case DB_LATENCY_KINDS: // Fall through
+		default:
+			return "unknown";
+	}
+}
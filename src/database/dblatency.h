@@ -0,0 +1,50 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Database latency profiling prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef DBLATENCY_H
+#define DBLATENCY_H
+
+#include <stdint.h>
+#include "sqlite3.h"
+
+// Number of histogram bins (see hist_bin())
+#define DB_LATENCY_BINS 24
+
+enum db_latency_file {
+	DB_LATENCY_FTL,
+	DB_LATENCY_GRAVITY,
+	DB_LATENCY_MACVENDOR,
+	DB_LATENCY_FILES
+} __attribute__ ((packed));
+
+enum db_latency_kind {
+	// BEGIN [IMMEDIATE] TRANSACTION, includes waiting for a busy database
+	DB_LATENCY_BEGIN,
+	// Statements modifying the database
+	DB_LATENCY_WRITE,
+	// Read-only statements
+	DB_LATENCY_READ,
+	// COMMIT / END TRANSACTION, includes syncing to disk
+	DB_LATENCY_COMMIT,
+	DB_LATENCY_KINDS
+} __attribute__ ((packed));
+
+typedef struct {
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+	uint64_t hist[DB_LATENCY_BINS];
+} db_latency;
+
+void db_latency_register(sqlite3 *db, const enum db_latency_file file);
+const db_latency *db_latency_get(const enum db_latency_file file, const enum db_latency_kind kind) __attribute__((const));
+const char *db_latency_file_name(const enum db_latency_file file) __attribute__((const));
+const char *db_latency_kind_name(const enum db_latency_kind kind) __attribute__((const));
+
+#endif //DBLATENCY_H
@@ -31,17 +31,45 @@
 
 // Definition of struct regexData
 #include "../regex_r.h"
+// gravity_set_lookup()
+#include "gravity-set.h"
+// bloom_check()
+#include "bloom.h"
+// list_map_lookup()
+#include "list-map.h"
+// db_latency_register()
+#include "dblatency.h"
+// debug_enabled()
+#include "../debuglimit.h"
 
 // Prefix of interface names in the client table
 #define INTERFACE_SEP ":"
 
 // Process-private prepared statements are used to support multiple forks (might
 // be TCP workers) to use the database simultaneously without corrupting the
-// gravity database
+// gravity database. Clients with identical groups share their statements, the
+// vectors are indexed by the ID of the group set
 sqlite3_stmt_vec *whitelist_stmt = NULL;
 sqlite3_stmt_vec *gravity_stmt = NULL;
 sqlite3_stmt_vec *blacklist_stmt = NULL;
 
+// Process-private table of distinct group sets and the group set of each
+// client (stored as ID + 1, zero means not yet known). The groups of a client
+// may be re-read by another process or thread, the group set is only valid for
+// the number of group rechecks of the client it has been determined for
+typedef struct {
+	uint32_t hash;
+	char *groups;
+} groupsetData;
+static groupsetData *groupsets = NULL;
+static unsigned int num_groupsets = 0u;
+typedef struct {
+	unsigned int groupset;
+	unsigned char rechecks;
+} clientGroupsetData;
+static clientGroupsetData *client_groupsets = NULL;
+static unsigned int num_client_groupsets = 0u;
+
 // Private variables
 static sqlite3 *gravity_db = NULL;
 static sqlite3_stmt* table_stmt = NULL;
@@ -49,6 +77,28 @@ static sqlite3_stmt* auditlist_stmt = NULL;
 bool gravityDB_opened = false;
 static bool gravity_abp_format = false;
 
+// Bloom filters of the exact lists. Definite misses are answered without
+// querying the database. The filters are inherited by forks
+static bloom_filter *gravity_filter = NULL;
+static bloom_filter *blacklist_filter = NULL;
+static bloom_filter *whitelist_filter = NULL;
+
+// In-memory maps of the exact lists. If available, they answer all lookups
+// and the Bloom filters of these lists are not needed
+static list_map *blacklist_map = NULL;
+static list_map *whitelist_map = NULL;
+
+// Connection prepared by gravityDB_prepare() to be installed by
+// gravityDB_reopen()
+struct gravityDB_handle {
+	sqlite3 *db;
+	bloom_filter *gravity_filter;
+	bloom_filter *blacklist_filter;
+	bloom_filter *whitelist_filter;
+	list_map *blacklist_map;
+	list_map *whitelist_map;
+};
+
 // Table names corresponding to the enum defined in gravity-db.h
 static const char* tablename[] = { "vw_gravity", "vw_blacklist", "vw_whitelist", "vw_regex_blacklist", "vw_regex_whitelist" , "" };
 
@@ -92,25 +142,33 @@ void gravityDB_forked(void)
 	blacklist_stmt = NULL;
 	gravity_stmt = NULL;
 
-	// Open the database
-	gravityDB_open();
+	// The group sets refer to the statements prepared by the parent process
+	groupsets = NULL;
+	num_groupsets = 0u;
+	client_groupsets = NULL;
+	num_client_groupsets = 0u;
+
+	// The database is not opened here but on the first lookup which needs
+	// it. Most TCP connections are answered from the cache, the DNS cache
+	// verdicts or the inherited in-memory lists and Bloom filters, so they
+	// neither pay for opening the database nor for closing it again
 }
 
-static void gravity_check_ABP_format(void)
+static bool gravity_check_ABP_format(sqlite3 *db)
 {
 	// Check if we have a valid ABP format
 	// We do this by checking the "abp_domains" property in the "info" table
 
 	// Prepare statement
 	sqlite3_stmt *stmt = NULL;
-	int rc = sqlite3_prepare_v2(gravity_db,
+	int rc = sqlite3_prepare_v2(db,
 	                            "SELECT value FROM info WHERE property = 'abp_domains';",
 	                            -1, &stmt, NULL);
 
 	if( rc != SQLITE_OK )
 	{
 		logg("gravity_check_ABP_format() - SQL error prepare: %s", sqlite3_errstr(rc));
-		return;
+		return false;
 	}
 
 	// Execute statement
@@ -118,63 +176,166 @@ static void gravity_check_ABP_format(void)
 	if( rc != SQLITE_ROW )
 	{
 		// No result
-		gravity_abp_format = false;
 		sqlite3_finalize(stmt);
-		return;
+		return false;
 	}
 
 	// Get result (SQLite3 stores 1 for TRUE, 0 for FALSE)
-	gravity_abp_format = sqlite3_column_int(stmt, 0) != 0;
+	const bool abp_format = sqlite3_column_int(stmt, 0) != 0;
 
 	// Finalize statement
 	sqlite3_finalize(stmt);
+
+	return abp_format;
 }
 
-// Open gravity database
-bool gravityDB_open(void)
+// Build the Bloom filter of an exact list. It contains all enabled domains
+// regardless of their groups
+static bloom_filter *gravityDB_build_filter(sqlite3 *db, const enum gravity_tables list)
 {
-	struct stat st;
-	if(stat(FTLfiles.gravity_db, &st) != 0)
+	switch(list)
 	{
-		// File does not exist
-		logg("gravityDB_open(): %s does not exist", FTLfiles.gravity_db);
-		return false;
+		case GRAVITY_TABLE:
+			return bloom_build(db,
+			        "SELECT COUNT(*) FROM gravity;"
+			        "SELECT domain FROM gravity;");
+		case EXACT_BLACKLIST_TABLE:
+			return bloom_build(db,
+			        "SELECT COUNT(*) FROM domainlist WHERE type = 1 AND enabled = 1;"
+			        "SELECT domain FROM domainlist WHERE type = 1 AND enabled = 1;");
+		case EXACT_WHITELIST_TABLE:
+			return bloom_build(db,
+			        "SELECT COUNT(*) FROM domainlist WHERE type = 0 AND enabled = 1;"
+			        "SELECT domain FROM domainlist WHERE type = 0 AND enabled = 1;");
+		case REGEX_BLACKLIST_TABLE:
+		case REGEX_WHITELIST_TABLE:
+		case UNKNOWN_TABLE:
+		default:
+			return NULL;
 	}
+}
 
-	if(gravityDB_opened && gravity_db != NULL)
+// Build the in-memory maps and Bloom filters of the exact lists (if not
+// inherited or installed). The filters are only needed if the maps could not
+// be built
+static void gravityDB_build_filters(void)
+{
+	if(whitelist_map == NULL)
+		whitelist_map = list_map_build(gravity_db, tablename[EXACT_WHITELIST_TABLE]);
+	if(blacklist_map == NULL)
+		blacklist_map = list_map_build(gravity_db, tablename[EXACT_BLACKLIST_TABLE]);
+	if(whitelist_filter == NULL && whitelist_map == NULL)
+		whitelist_filter = gravityDB_build_filter(gravity_db, EXACT_WHITELIST_TABLE);
+	if(blacklist_filter == NULL && blacklist_map == NULL)
+		blacklist_filter = gravityDB_build_filter(gravity_db, EXACT_BLACKLIST_TABLE);
+
+	// Gravity is looked up in the in-memory gravity set if enabled, the
+	// filter is only needed when gravity is queried from the database
+	if(gravity_filter == NULL && !config.gravity_in_memory)
+		gravity_filter = gravityDB_build_filter(gravity_db, GRAVITY_TABLE);
+}
+
+// Get the Bloom filter of an exact list (may be NULL)
+const bloom_filter *gravityDB_get_filter(const enum gravity_tables list)
+{
+	switch(list)
 	{
-		if(config.debug & DEBUG_DATABASE)
-			logg("gravityDB_open(): Database already connected");
-		return true;
+		case GRAVITY_TABLE:
+			return gravity_filter;
+		case EXACT_BLACKLIST_TABLE:
+			return blacklist_filter;
+		case EXACT_WHITELIST_TABLE:
+			return whitelist_filter;
+		case REGEX_BLACKLIST_TABLE:
+		case REGEX_WHITELIST_TABLE:
+		case UNKNOWN_TABLE:
+		default:
+			return NULL;
 	}
+}
 
+// Open a read-only connection to the gravity database
+static sqlite3 *gravityDB_open_connection(void)
+{
 	if(config.debug & DEBUG_DATABASE)
 		logg("gravityDB_open(): Trying to open %s in read-only mode", FTLfiles.gravity_db);
-	int rc = sqlite3_open_v2(FTLfiles.gravity_db, &gravity_db, SQLITE_OPEN_READONLY, NULL);
+	sqlite3 *db = NULL;
+	int rc = sqlite3_open_v2(FTLfiles.gravity_db, &db, SQLITE_OPEN_READONLY, NULL);
 	if( rc != SQLITE_OK )
 	{
 		logg("gravityDB_open() - SQL error: %s", sqlite3_errstr(rc));
-		gravityDB_close();
-		return false;
+		sqlite3_close(db);
+		return NULL;
 	}
 
-	// Database connection is now open
-	gravityDB_opened = true;
-
 	// Tell SQLite3 to store temporary tables in memory. This speeds up read operations on
 	// temporary tables, indices, and views.
 	if(config.debug & DEBUG_DATABASE)
 		logg("gravityDB_open(): Setting location for temporary object to MEMORY");
 	char *zErrMsg = NULL;
-	rc = sqlite3_exec(gravity_db, "PRAGMA temp_store = MEMORY", NULL, NULL, &zErrMsg);
+	rc = sqlite3_exec(db, "PRAGMA temp_store = MEMORY", NULL, NULL, &zErrMsg);
 	if( rc != SQLITE_OK )
 	{
 		logg("gravityDB_open(PRAGMA temp_store) - SQL error (%i): %s", rc, zErrMsg);
 		sqlite3_free(zErrMsg);
-		gravityDB_close();
-		return false;
+		sqlite3_close(db);
+		return NULL;
 	}
 
+	// Read the gravity database through a memory map (if enabled). The
+	// mapping is shared with the kernel's page cache and safe as the
+	// connection is read-only
+	if(config.sqlite.gravity_mmap > 0)
+	{
+		if(config.debug & DEBUG_DATABASE)
+			logg("gravityDB_open(): Setting mmap_size to %u MiB", config.sqlite.gravity_mmap);
+		char querystr[64];
+		snprintf(querystr, sizeof(querystr), "PRAGMA mmap_size = %llu",
+		         (unsigned long long)config.sqlite.gravity_mmap * 1024u * 1024u);
+		rc = sqlite3_exec(db, querystr, NULL, NULL, &zErrMsg);
+		if( rc != SQLITE_OK )
+		{
+			// Not fatal, the database is read without the mapping
+			logg("gravityDB_open(PRAGMA mmap_size) - SQL error (%i): %s", rc, zErrMsg);
+			sqlite3_free(zErrMsg);
+		}
+	}
+
+	// Collect statement latency statistics on this connection
+	db_latency_register(db, DB_LATENCY_GRAVITY);
+
+	return db;
+}
+
+// Open gravity database
+bool gravityDB_open(void)
+{
+	if(gravityDB_opened && gravity_db != NULL)
+	{
+		if(config.debug & DEBUG_DATABASE)
+			logg("gravityDB_open(): Database already connected");
+		return true;
+	}
+
+	// Open a new connection unless gravityDB_reopen() has installed one
+	// prepared in the background
+	if(gravity_db == NULL)
+	{
+		struct stat st;
+		if(stat(FTLfiles.gravity_db, &st) != 0)
+		{
+			// File does not exist
+			logg("gravityDB_open(): %s does not exist", FTLfiles.gravity_db);
+			return false;
+		}
+
+		if((gravity_db = gravityDB_open_connection()) == NULL)
+			return false;
+	}
+
+	// Database connection is now open
+	gravityDB_opened = true;
+
 	// Prepare audit statement
 	if(config.debug & DEBUG_DATABASE)
 		logg("gravityDB_open(): Preparing audit query");
@@ -189,7 +350,7 @@ bool gravityDB_open(void)
 	//            matches 'google.de' and all of its subdomains but
 	//            also other domains ending in google.de, like
 	//            abcgoogle.de
-	rc = sqlite3_prepare_v3(gravity_db,
+	int rc = sqlite3_prepare_v3(gravity_db,
 	        "SELECT domain, "
 	          "CASE WHEN substr(domain, 1, 1) = '*' " // Does the database string start in '*' ?
 	            "THEN '*' || substr(:input, - length(domain) + 1) " // If so: Crop the input domain and prepend '*'
@@ -214,11 +375,11 @@ bool gravityDB_open(void)
 
 	// Prepare private vector of statements for this process (might be a TCP fork!)
 	if(whitelist_stmt == NULL)
-		whitelist_stmt = new_sqlite3_stmt_vec(counters->clients);
+		whitelist_stmt = new_sqlite3_stmt_vec(VEC_ALLOC_STEP);
 	if(blacklist_stmt == NULL)
-		blacklist_stmt = new_sqlite3_stmt_vec(counters->clients);
+		blacklist_stmt = new_sqlite3_stmt_vec(VEC_ALLOC_STEP);
 	if(gravity_stmt == NULL)
-		gravity_stmt = new_sqlite3_stmt_vec(counters->clients);
+		gravity_stmt = new_sqlite3_stmt_vec(VEC_ALLOC_STEP);
 
 	// Explicitly set busy handler to zero milliseconds
 	if(config.debug & DEBUG_DATABASE)
@@ -231,18 +392,72 @@ bool gravityDB_open(void)
 
 	// Check (and remember in global variable) if there are any ABP-style
 	// entries in the database
-	gravity_check_ABP_format();
+	gravity_abp_format = gravity_check_ABP_format(gravity_db);
+
+	// Build Bloom filters of the exact lists (if not inherited)
+	gravityDB_build_filters();
 
 	if(config.debug & DEBUG_DATABASE)
 		logg("gravityDB_open(): Successfully opened gravity.db");
 	return true;
 }
 
-bool gravityDB_reopen(void)
+// Open and warm a new connection to the gravity database including the Bloom
+// filters of the exact lists. This is done without holding the shared memory
+// lock so that lookups continue on the current connection in the meantime
+gravityDB_handle *gravityDB_prepare(void)
+{
+	struct stat st;
+	if(stat(FTLfiles.gravity_db, &st) != 0)
+	{
+		logg("gravityDB_prepare(): %s does not exist", FTLfiles.gravity_db);
+		return NULL;
+	}
+
+	gravityDB_handle *handle = calloc(1, sizeof(gravityDB_handle));
+	if(handle == NULL)
+		return NULL;
+
+	if((handle->db = gravityDB_open_connection()) == NULL)
+	{
+		free(handle);
+		return NULL;
+	}
+
+	// Building the maps and filters reads the lists and brings their pages
+	// into the cache before lookups are switched to the new connection
+	handle->whitelist_map = list_map_build(handle->db, tablename[EXACT_WHITELIST_TABLE]);
+	handle->blacklist_map = list_map_build(handle->db, tablename[EXACT_BLACKLIST_TABLE]);
+	if(handle->whitelist_map == NULL)
+		handle->whitelist_filter = gravityDB_build_filter(handle->db, EXACT_WHITELIST_TABLE);
+	if(handle->blacklist_map == NULL)
+		handle->blacklist_filter = gravityDB_build_filter(handle->db, EXACT_BLACKLIST_TABLE);
+	if(!config.gravity_in_memory)
+		handle->gravity_filter = gravityDB_build_filter(handle->db, GRAVITY_TABLE);
+
+	return handle;
+}
+
+// We call this routine when reloading the lists. The current connection is
+// closed and replaced by the prepared connection (if any). As all lookups
+// happen while holding the shared memory lock, no lookup is still using the
+// old connection when this is called
+bool gravityDB_reopen(gravityDB_handle *next)
 {
-	// We call this routine when reloading the cache.
 	gravityDB_close();
 
+	// Install prepared connection
+	if(next != NULL)
+	{
+		gravity_db = next->db;
+		whitelist_filter = next->whitelist_filter;
+		blacklist_filter = next->blacklist_filter;
+		gravity_filter = next->gravity_filter;
+		whitelist_map = next->whitelist_map;
+		blacklist_map = next->blacklist_map;
+		free(next);
+	}
+
 	// Re-open gravity database
 	return gravityDB_open();
 }
@@ -283,23 +498,149 @@ static inline const char *show_client_string(const char *hwaddr, const char *hos
 }
 
 
-// Get associated groups for this client (if defined)
-static bool get_client_groupids(clientsData* client)
+// Cache of resolved client identifiers. The key is the kind of the identifier
+// (see below) followed by the identifier itself (IP address, MAC address, host
+// name or interface), the value the groups of the matching client table record.
+// Identifiers without a record are cached as well. The cache is flushed when
+// the group assignments in the gravity database change
+#define GROUP_CACHE_BUCKETS 256u
+#define GROUP_CACHE_MAX 4096u
+#define GROUPS_BY_IP 'i'
+#define GROUPS_BY_MAC 'm'
+#define GROUPS_BY_HOSTNAME 'h'
+#define GROUPS_BY_INTERFACE 'f'
+typedef struct group_cache_entry {
+	struct group_cache_entry *next;
+	uint32_t hash;
+	// NULL if there is no record for this identifier in the client table
+	char *groups;
+	char key[];
+} group_cache_entry;
+static group_cache_entry *group_cache[GROUP_CACHE_BUCKETS] = { NULL };
+static unsigned int group_cache_entries = 0u;
+
+static void group_cache_flush(void)
 {
-	const char *ip = getstr(client->ippos);
-	client->flags.found_group = false;
-	client->groupspos = 0u;
+	for(unsigned int i = 0; i < GROUP_CACHE_BUCKETS; i++)
+	{
+		group_cache_entry *entry = group_cache[i];
+		while(entry != NULL)
+		{
+			group_cache_entry *next = entry->next;
+			if(entry->groups != NULL)
+				free(entry->groups);
+			free(entry);
+			entry = next;
+		}
+		group_cache[i] = NULL;
+	}
+	group_cache_entries = 0u;
+}
 
-	// Do not proceed when database is not available
-	if(!gravityDB_opened && !gravityDB_open())
+static group_cache_entry * __attribute__((pure)) group_cache_get(const char kind, const char *ident)
+{
+	const uint32_t hash = hashStr(ident) ^ (uint32_t)kind;
+	for(group_cache_entry *entry = group_cache[hash % GROUP_CACHE_BUCKETS]; entry != NULL; entry = entry->next)
+		if(entry->hash == hash && entry->key[0] == kind && strcmp(entry->key + 1, ident) == 0)
+			return entry;
+
+	return NULL;
+}
+
+// Store the groups of an identifier (NULL: no record in the client table)
+static void group_cache_add(const char kind, const char *ident, const char *groups)
+{
+	// Start over when the cache is full, a flood of new clients would
+	// otherwise grow it without limit
+	if(group_cache_entries >= GROUP_CACHE_MAX)
+		group_cache_flush();
+
+	const size_t len = strlen(ident);
+	group_cache_entry *entry = calloc(1, sizeof(group_cache_entry) + len + 2u);
+	if(entry == NULL)
+		return;
+	if(groups != NULL && (entry->groups = strdup(groups)) == NULL)
 	{
-		logg("get_client_groupids(): Gravity database not available");
-		return false;
+		free(entry);
+		return;
 	}
 
+	entry->hash = hashStr(ident) ^ (uint32_t)kind;
+	entry->key[0] = kind;
+	memcpy(entry->key + 1, ident, len + 1u);
+
+	const unsigned int bucket = entry->hash % GROUP_CACHE_BUCKETS;
+	entry->next = group_cache[bucket];
+	group_cache[bucket] = entry;
+	group_cache_entries++;
+}
+
+// Get the groups of a record of the client table. Clients without groups get
+// an empty group list
+static char *get_groups_of_record(const int id, const char *ip)
+{
+	// Build query string to get possible group associations for this particular client
+	// The SQL GROUP_CONCAT() function returns a string which is the concatenation of all
+	// non-NULL values of group_id separated by ','. The order of the concatenated elements
+	// is arbitrary, however, is of no relevance for your use case.
+	const char *querystr = "SELECT GROUP_CONCAT(group_id) FROM client_by_group "
+	                       "WHERE client_id = ?;";
+
 	if(config.debug & DEBUG_CLIENTS)
-		logg("Querying gravity database for client with IP %s...", ip);
+		logg("Querying gravity database for client %s (getting groups)", ip);
 
+	// Prepare query
+	int rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("get_client_groupids(\"%s\", %d) - SQL error prepare: %s",
+		     ip, id, sqlite3_errstr(rc));
+		sqlite3_finalize(table_stmt);
+		return NULL;
+	}
+
+	// Bind record ID to prepared statement
+	if((rc = sqlite3_bind_int(table_stmt, 1, id)) != SQLITE_OK)
+	{
+		logg("get_client_groupids(\"%s\", %d): Failed to bind chosen_match_id: %s",
+			ip, id, sqlite3_errstr(rc));
+		sqlite3_reset(table_stmt);
+		sqlite3_finalize(table_stmt);
+		return NULL;
+	}
+
+	// Perform query
+	char *groups = NULL;
+	rc = sqlite3_step(table_stmt);
+	if(rc == SQLITE_ROW)
+	{
+		// There is a record for this client in the database, the result
+		// is NULL if the client is not assigned to any group
+		const char* result = (const char*)sqlite3_column_text(table_stmt, 0);
+		groups = strdup(result != NULL ? result : "");
+	}
+	else if(rc == SQLITE_DONE)
+	{
+		// Found no record for this client in the database
+		// -> No associated groups
+		groups = strdup("");
+	}
+	else
+	{
+		logg("get_client_groupids(\"%s\", %d) - SQL error step: %s",
+		     ip, id, sqlite3_errstr(rc));
+	}
+
+	// Finalize statement
+	gravityDB_finalizeTable();
+
+	return groups;
+}
+
+// Look up the record of a client identified by its IP address (possibly
+// through a subnet) in the client table. Returns false on database errors
+static bool get_record_by_ip(const char *ip, int *id)
+{
 	// Check if client is configured through the client table
 	// This will return nothing if the client is unknown/unconfigured
 	const char *querystr = "SELECT count(id) matching_count, "
@@ -327,26 +668,27 @@ static bool get_client_groupids(clientsData* client)
 		     ip, sqlite3_errstr(rc));
 		sqlite3_reset(table_stmt);
 		sqlite3_finalize(table_stmt);
-		return NULL;
+		return false;
 	}
 
 	// Perform query
 	rc = sqlite3_step(table_stmt);
-	int matching_count = 0, chosen_match_id = -1, matching_bits = 0;
+	int matching_count = 0, matching_bits = 0;
 	char *matching_ids = NULL, *chosen_match_text = NULL;
+	*id = -1;
 	if(rc == SQLITE_ROW)
 	{
 		// There is a record for this client in the database,
 		// extract the result (there can be at most one line)
 		matching_count = sqlite3_column_int(table_stmt, 0);
-		chosen_match_id = sqlite3_column_int(table_stmt, 1);
+		*id = sqlite3_column_int(table_stmt, 1);
 		chosen_match_text = strdup((const char*)sqlite3_column_text(table_stmt, 2));
 		matching_ids = strdup((const char*)sqlite3_column_text(table_stmt, 3));
 		matching_bits = sqlite3_column_int(table_stmt, 4);
 
 		if(config.debug & DEBUG_CLIENTS && matching_count == 1)
 			// Case matching_count > 1 handled below using logg_subnet_warning()
-			logg("--> Found record for %s in the client table (group ID %d)", ip, chosen_match_id);
+			logg("--> Found record for %s in the client table (group ID %d)", ip, *id);
 	}
 	else if(rc == SQLITE_DONE)
 	{
@@ -374,28 +716,145 @@ static bool get_client_groupids(clientsData* client)
 		//   Device 10.8.0.22
 		//   Client 1: 10.8.0.0/24
 		//   Client 2: 10.8.1.0/24
-		logg_subnet_warning(ip, matching_count, matching_ids, matching_bits, chosen_match_text, chosen_match_id);
+		logg_subnet_warning(ip, matching_count, matching_ids, matching_bits, chosen_match_text, *id);
 	}
 
 	// Free memory if applicable
 	if(matching_ids != NULL)
-	{
 		free(matching_ids);
-		matching_ids = NULL;
-	}
 	if(chosen_match_text != NULL)
-	{
 		free(chosen_match_text);
-		chosen_match_text = NULL;
+
+	return true;
+}
+
+// Look up the record of a client identified by its MAC address, host name or
+// interface in the client table. Returns false on database errors
+static bool get_record_by_name(const char *ip, const char *ident, int *id)
+{
+	if(config.debug & DEBUG_CLIENTS)
+		logg("--> Querying client table for %s", ident);
+
+	// Check if client is configured through the client table
+	// This will return nothing if the client is unknown/unconfigured
+	// We use COLLATE NOCASE to ensure the comparison is done case-insensitive
+	const char *querystr = "SELECT id FROM client WHERE ip = ? COLLATE NOCASE;";
+
+	// Prepare query
+	int rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("get_client_groupids(%s) - SQL error prepare: %s",
+			querystr, sqlite3_errstr(rc));
+		return false;
+	}
+
+	// Bind identifier to prepared statement
+	if((rc = sqlite3_bind_text(table_stmt, 1, ident, -1, SQLITE_STATIC)) != SQLITE_OK)
+	{
+		logg("get_client_groupids(\"%s\", \"%s\"): Failed to bind identifier: %s",
+			ip, ident, sqlite3_errstr(rc));
+		sqlite3_reset(table_stmt);
+		sqlite3_finalize(table_stmt);
+		return false;
+	}
+
+	// Perform query
+	*id = -1;
+	rc = sqlite3_step(table_stmt);
+	if(rc == SQLITE_ROW)
+	{
+		// There is a record for this client in the database,
+		// extract the result (there can be at most one line)
+		*id = sqlite3_column_int(table_stmt, 0);
+
+		if(config.debug & DEBUG_CLIENTS)
+			logg("--> Found record for %s in the client table (group ID %d)", ident, *id);
+	}
+	else if(rc == SQLITE_DONE)
+	{
+		if(config.debug & DEBUG_CLIENTS)
+			logg("--> There is no record for %s in the client table", ident);
+	}
+	else
+	{
+		// Error
+		logg("get_client_groupids(\"%s\", \"%s\") - SQL error step: %s",
+			ip, ident, sqlite3_errstr(rc));
+		gravityDB_finalizeTable();
+		return false;
+	}
+
+	// Finalize statement
+	gravityDB_finalizeTable();
+
+	return true;
+}
+
+// Resolve an identifier of a client to the groups of the matching record in
+// the client table using the cache. *groups is set to NULL if there is no
+// such record. Returns false on database errors
+static bool resolve_client_groups(const char kind, const char *ip, const char *ident, const char **groups)
+{
+	const group_cache_entry *entry = group_cache_get(kind, ident);
+	if(entry != NULL)
+	{
+		if(config.debug & DEBUG_CLIENTS)
+			logg("--> %s: %s (cached)", ident, entry->groups != NULL ?
+			     "found record in the client table" : "no record in the client table");
+		*groups = entry->groups;
+		return true;
 	}
 
+	int id = -1;
+	if(!(kind == GROUPS_BY_IP ? get_record_by_ip(ip, &id) : get_record_by_name(ip, ident, &id)))
+		return false;
+
+	char *result = NULL;
+	if(id > -1 && (result = get_groups_of_record(id, ip)) == NULL)
+		return false;
+
+	group_cache_add(kind, ident, result);
+	entry = group_cache_get(kind, ident);
+	if(result != NULL)
+		free(result);
+
+	// The cache may not be able to store the identifier. We return the
+	// default group in this case and the client is checked again later
+	*groups = entry != NULL ? entry->groups : NULL;
+	return true;
+}
+
+// Get associated groups for this client (if defined)
+static bool get_client_groupids(clientsData* client)
+{
+	const char *ip = getstr(client->ippos);
+	client->flags.found_group = false;
+	client->groupspos = 0u;
+
+	// Do not proceed when database is not available
+	if(!gravityDB_opened && !gravityDB_open())
+	{
+		logg("get_client_groupids(): Gravity database not available");
+		return false;
+	}
+
+	if(config.debug & DEBUG_CLIENTS)
+		logg("Querying gravity database for client with IP %s...", ip);
+
+	// Check if client is configured through the client table using its IP
+	// address or a subnet containing it
+	const char *groups = NULL;
+	if(!resolve_client_groups(GROUPS_BY_IP, ip, ip, &groups))
+		return false;
+
 	// If we didn't find an IP address match above, try with MAC address matches
 	// 1. Look up MAC address of this client
 	//   1.1. Look up IP address in network_addresses table
 	//   1.2. Get MAC address from this network_id
 	// 2. If found -> Get groups by looking up MAC address in client table
 	char *hwaddr = NULL;
-	if(chosen_match_id < 0)
+	if(groups == NULL)
 	{
 		if(config.debug & DEBUG_CLIENTS)
 			logg("Querying gravity database for MAC address of %s...", ip);
@@ -435,86 +894,29 @@ static bool get_client_groupids(clientsData* client)
 		// MAC address fallback: Try to synthesize MAC address from internal buffer
 		if(hwaddr == NULL && client->hwlen == 6)
 		{
-			const size_t strlen = sizeof("AA:BB:CC:DD:EE:FF");
-			hwaddr = calloc(18, strlen);
-			snprintf(hwaddr, strlen, "%02X:%02X:%02X:%02X:%02X:%02X",
-			         client->hwaddr[0], client->hwaddr[1], client->hwaddr[2],
-			         client->hwaddr[3], client->hwaddr[4], client->hwaddr[5]);
-
-			if(config.debug & DEBUG_CLIENTS)
-				logg("--> Obtained %s from internal ARP cache", hwaddr);
-		}
-	}
-
-	// Check if we received a valid MAC address
-	// This ensures we skip mock hardware addresses such as "ip-127.0.0.1"
-	if(hwaddr != NULL)
-	{
-		if(config.debug & DEBUG_CLIENTS)
-			logg("--> Querying client table for %s", hwaddr);
-
-		// Check if client is configured through the client table
-		// This will return nothing if the client is unknown/unconfigured
-		// We use COLLATE NOCASE to ensure the comparison is done case-insensitive
-		querystr = "SELECT id FROM client WHERE ip = ? COLLATE NOCASE;";
-
-		// Prepare query
-		rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
-		if(rc != SQLITE_OK)
-		{
-			logg("get_client_groupids(%s) - SQL error prepare: %s",
-				querystr, sqlite3_errstr(rc));
-			free(hwaddr); // hwaddr != NULL -> memory has been allocated
-			return false;
-		}
-
-		// Bind hwaddr to prepared statement
-		if((rc = sqlite3_bind_text(table_stmt, 1, hwaddr, -1, SQLITE_STATIC)) != SQLITE_OK)
-		{
-			logg("get_client_groupids(\"%s\", \"%s\"): Failed to bind hwaddr: %s",
-				ip, hwaddr, sqlite3_errstr(rc));
-			sqlite3_reset(table_stmt);
-			sqlite3_finalize(table_stmt);
-			free(hwaddr); // hwaddr != NULL -> memory has been allocated
-			return false;
-		}
-
-		// Perform query
-		rc = sqlite3_step(table_stmt);
-		if(rc == SQLITE_ROW)
-		{
-			// There is a record for this client in the database,
-			// extract the result (there can be at most one line)
-			chosen_match_id = sqlite3_column_int(table_stmt, 0);
+			const size_t strlen = sizeof("AA:BB:CC:DD:EE:FF");
+			hwaddr = calloc(18, strlen);
+			snprintf(hwaddr, strlen, "%02X:%02X:%02X:%02X:%02X:%02X",
+			         client->hwaddr[0], client->hwaddr[1], client->hwaddr[2],
+			         client->hwaddr[3], client->hwaddr[4], client->hwaddr[5]);
 
 			if(config.debug & DEBUG_CLIENTS)
-				logg("--> Found record for %s in the client table (group ID %d)", hwaddr, chosen_match_id);
-		}
-		else if(rc == SQLITE_DONE)
-		{
-			if(config.debug & DEBUG_CLIENTS)
-				logg("--> There is no record for %s in the client table", hwaddr);
-		}
-		else
-		{
-			// Error
-			logg("get_client_groupids(\"%s\", \"%s\") - SQL error step: %s",
-				ip, hwaddr, sqlite3_errstr(rc));
-			gravityDB_finalizeTable();
-			free(hwaddr); // hwaddr != NULL -> memory has been allocated
-			return false;
+				logg("--> Obtained %s from internal ARP cache", hwaddr);
 		}
-
-		// Finalize statement and free allocated memory
-		gravityDB_finalizeTable();
 	}
 
+	// Check if we received a valid MAC address
+	// This ensures we skip mock hardware addresses such as "ip-127.0.0.1"
+	bool success = true;
+	if(hwaddr != NULL)
+		success = resolve_client_groups(GROUPS_BY_MAC, ip, hwaddr, &groups);
+
 	// If we did neither find an IP nor a MAC address match above, we try to look
 	// up the client using its host name
 	// 1. Look up host name address of this client
 	// 2. If found -> Get groups by looking up host name in client table
 	char *hostname = NULL;
-	if(chosen_match_id < 0)
+	if(success && groups == NULL)
 	{
 		if(config.debug & DEBUG_CLIENTS)
 			logg("Querying gravity database for host name of %s...", ip);
@@ -534,71 +936,9 @@ static bool get_client_groupids(clientsData* client)
 		}
 	}
 
-	// Check if we received a valid MAC address
-	// This ensures we skip mock hardware addresses such as "ip-127.0.0.1"
+	// Check if we received a valid host name
 	if(hostname != NULL)
-	{
-		if(config.debug & DEBUG_CLIENTS)
-			logg("--> Querying client table for %s", hostname);
-
-		// Check if client is configured through the client table
-		// This will return nothing if the client is unknown/unconfigured
-		// We use COLLATE NOCASE to ensure the comparison is done case-insensitive
-		querystr = "SELECT id FROM client WHERE ip = ? COLLATE NOCASE;";
-
-		// Prepare query
-		rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
-		if(rc != SQLITE_OK)
-		{
-			logg("get_client_groupids(%s) - SQL error prepare: %s",
-				querystr, sqlite3_errstr(rc));
-			if(hwaddr) free(hwaddr);
-			free(hostname); // hostname != NULL -> memory has been allocated
-			return false;
-		}
-
-		// Bind hostname to prepared statement
-		if((rc = sqlite3_bind_text(table_stmt, 1, hostname, -1, SQLITE_STATIC)) != SQLITE_OK)
-		{
-			logg("get_client_groupids(\"%s\", \"%s\"): Failed to bind hostname: %s",
-				ip, hostname, sqlite3_errstr(rc));
-			sqlite3_reset(table_stmt);
-			sqlite3_finalize(table_stmt);
-			if(hwaddr) free(hwaddr);
-			free(hostname); // hostname != NULL -> memory has been allocated
-			return false;
-		}
-
-		// Perform query
-		rc = sqlite3_step(table_stmt);
-		if(rc == SQLITE_ROW)
-		{
-			// There is a record for this client in the database,
-			// extract the result (there can be at most one line)
-			chosen_match_id = sqlite3_column_int(table_stmt, 0);
-
-			if(config.debug & DEBUG_CLIENTS)
-				logg("--> Found record for %s in the client table (group ID %d)", hostname, chosen_match_id);
-		}
-		else if(rc == SQLITE_DONE)
-		{
-			if(config.debug & DEBUG_CLIENTS)
-				logg("--> There is no record for %s in the client table", hostname);
-		}
-		else
-		{
-			// Error
-			logg("get_client_groupids(\"%s\", \"%s\") - SQL error step: %s",
-				ip, hostname, sqlite3_errstr(rc));
-			gravityDB_finalizeTable();
-			if(hwaddr) free(hwaddr);
-			free(hostname); // hostname != NULL -> memory has been allocated
-			return false;
-		}
-
-		// Finalize statement and free allocated memory
-		gravityDB_finalizeTable();
-	}
+		success = resolve_client_groups(GROUPS_BY_HOSTNAME, ip, hostname, &groups);
 
 	// If we did neither find an IP nor a MAC address and also no host name
 	// match above, we try to look up the client using its interface
@@ -606,7 +946,7 @@ static bool get_client_groupids(clientsData* client)
 	//    when creating the client from history data!)
 	// 2. If found -> Get groups by looking up interface in client table
 	char *interface = NULL;
-	if(chosen_match_id < 0)
+	if(success && groups == NULL)
 	{
 		if(config.debug & DEBUG_CLIENTS)
 			logg("Querying gravity database for interface of %s...", ip);
@@ -626,201 +966,58 @@ static bool get_client_groupids(clientsData* client)
 		}
 	}
 
-	// Check if we received a valid interface
+	// Check if we received a valid interface. Interfaces are stored with a
+	// prefix in the client table
 	if(interface != NULL)
 	{
-		if(config.debug & DEBUG_CLIENTS)
-			logg("Querying client table for interface "INTERFACE_SEP"%s", interface);
-
-		// Check if client is configured through the client table using its interface
-		// This will return nothing if the client is unknown/unconfigured
-		// We use the SQLite concatenate operator || to prepace the queried interface by ":"
-		// We use COLLATE NOCASE to ensure the comparison is done case-insensitive
-		querystr = "SELECT id FROM client WHERE ip = '"INTERFACE_SEP"' || ? COLLATE NOCASE;";
-
-		// Prepare query
-		rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
-		if(rc != SQLITE_OK)
-		{
-			logg("get_client_groupids(%s) - SQL error prepare: %s",
-				querystr, sqlite3_errstr(rc));
-			if(hwaddr) free(hwaddr);
-			if(hostname) free(hostname);
-			free(interface); // interface != NULL -> memory has been allocated
-			return false;
-		}
-
-		// Bind interface to prepared statement
-		if((rc = sqlite3_bind_text(table_stmt, 1, interface, -1, SQLITE_STATIC)) != SQLITE_OK)
-		{
-			logg("get_client_groupids(\"%s\", \"%s\"): Failed to bind interface: %s",
-				ip, interface, sqlite3_errstr(rc));
-			sqlite3_reset(table_stmt);
-			sqlite3_finalize(table_stmt);
-			if(hwaddr) free(hwaddr);
-			if(hostname) free(hostname);
-			free(interface); // interface != NULL -> memory has been allocated
-			return false;
-		}
-
-		// Perform query
-		rc = sqlite3_step(table_stmt);
-		if(rc == SQLITE_ROW)
-		{
-			// There is a record for this client in the database,
-			// extract the result (there can be at most one line)
-			chosen_match_id = sqlite3_column_int(table_stmt, 0);
-
-			if(config.debug & DEBUG_CLIENTS)
-				logg("--> Found record for interface "INTERFACE_SEP"%s in the client table (group ID %d)", interface, chosen_match_id);
-		}
-		else if(rc == SQLITE_DONE)
+		char *ident = NULL;
+		if(asprintf(&ident, INTERFACE_SEP"%s", interface) > 0)
 		{
-			if(config.debug & DEBUG_CLIENTS)
-				logg("--> There is no record for interface "INTERFACE_SEP"%s in the client table", interface);
+			success = resolve_client_groups(GROUPS_BY_INTERFACE, ip, ident, &groups);
+			free(ident);
 		}
 		else
-		{
-			// Error
-			logg("get_client_groupids(\"%s\", \"%s\") - SQL error step: %s",
-				ip, interface, sqlite3_errstr(rc));
-			gravityDB_finalizeTable();
-			if(hwaddr) free(hwaddr);
-			if(hostname) free(hostname);
-			free(interface); // interface != NULL -> memory has been allocated
-			return false;
-		}
-
-		// Finalize statement and free allocated memory
-		gravityDB_finalizeTable();
+			success = false;
 	}
 
-	// We use the default group and return early here
-	// if above lookups didn't return any results
-	// (the client is not configured through the client table)
-	if(chosen_match_id < 0)
+	if(success)
 	{
-		if(config.debug & DEBUG_CLIENTS)
-			logg("Gravity database: Client %s not found. Using default group.\n",
-			     show_client_string(hwaddr, hostname, ip));
-
-		client->groupspos = addstr("0");
-		client->flags.found_group = true;
-
-		if(hwaddr != NULL)
+		// We use the default group if above lookups didn't return any
+		// results (the client is not configured through the client table)
+		if(groups == NULL)
 		{
-			free(hwaddr);
-			hwaddr = NULL;
-		}
-
-		if(hostname != NULL)
-		{
-			free(hostname);
-			hostname = NULL;
+			if(config.debug & DEBUG_CLIENTS)
+				logg("Gravity database: Client %s not found. Using default group.\n",
+				     show_client_string(hwaddr, hostname, ip));
+			groups = "0";
 		}
-
-		if(interface != NULL)
+		else if(config.debug & DEBUG_CLIENTS)
 		{
-			free(interface);
-			interface = NULL;
+			if(interface != NULL)
+			{
+				logg("Gravity database: Client %s found (identified by interface %s). Using groups (%s)\n",
+				     show_client_string(hwaddr, hostname, ip), interface, groups);
+			}
+			else
+			{
+				logg("Gravity database: Client %s found. Using groups (%s)\n",
+				     show_client_string(hwaddr, hostname, ip), groups);
+			}
 		}
 
-		return true;
-	}
-
-	// Build query string to get possible group associations for this particular client
-	// The SQL GROUP_CONCAT() function returns a string which is the concatenation of all
-	// non-NULL values of group_id separated by ','. The order of the concatenated elements
-	// is arbitrary, however, is of no relevance for your use case.
-	// We check using a possibly defined subnet and use the first result
-	querystr = "SELECT GROUP_CONCAT(group_id) FROM client_by_group "
-	           "WHERE client_id = ?;";
-
-	if(config.debug & DEBUG_CLIENTS)
-		logg("Querying gravity database for client %s (getting groups)", ip);
-
-	// Prepare query
-	rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &table_stmt, NULL);
-	if(rc != SQLITE_OK)
-	{
-		logg("get_client_groupids(\"%s\", \"%s\", %d) - SQL error prepare: %s",
-		     ip, hwaddr, chosen_match_id, sqlite3_errstr(rc));
-		sqlite3_finalize(table_stmt);
-		return false;
-	}
-
-	// Bind hwaddr to prepared statement
-	if((rc = sqlite3_bind_int(table_stmt, 1, chosen_match_id)) != SQLITE_OK)
-	{
-		logg("get_client_groupids(\"%s\", \"%s\", %d): Failed to bind chosen_match_id: %s",
-			ip, hwaddr, chosen_match_id, sqlite3_errstr(rc));
-		sqlite3_reset(table_stmt);
-		sqlite3_finalize(table_stmt);
-		return false;
-	}
-
-	// Perform query
-	rc = sqlite3_step(table_stmt);
-	if(rc == SQLITE_ROW)
-	{
-		// There is a record for this client in the database
-		const char* result = (const char*)sqlite3_column_text(table_stmt, 0);
-		if(result != NULL)
-		{
-			client->groupspos = addstr(result);
-			client->flags.found_group = true;
-		}
-	}
-	else if(rc == SQLITE_DONE)
-	{
-		// Found no record for this client in the database
-		// -> No associated groups
-		client->groupspos = addstr("");
+		client->groupspos = addstr(groups);
 		client->flags.found_group = true;
 	}
-	else
-	{
-		logg("get_client_groupids(\"%s\", \"%s\", %d) - SQL error step: %s",
-		     ip, hwaddr, chosen_match_id, sqlite3_errstr(rc));
-		gravityDB_finalizeTable();
-		return false;
-	}
-	// Finalize statement
-	gravityDB_finalizeTable();
-
-	if(config.debug & DEBUG_CLIENTS)
-	{
-		if(interface != NULL)
-		{
-			logg("Gravity database: Client %s found (identified by interface %s). Using groups (%s)\n",
-			     show_client_string(hwaddr, hostname, ip), interface, getstr(client->groupspos));
-		}
-		else
-		{
-			logg("Gravity database: Client %s found. Using groups (%s)\n",
-			     show_client_string(hwaddr, hostname, ip), getstr(client->groupspos));
-		}
-	}
 
 	// Free possibly allocated memory
 	if(hwaddr != NULL)
-	{
 		free(hwaddr);
-		hwaddr = NULL;
-	}
 	if(hostname != NULL)
-	{
 		free(hostname);
-		hostname = NULL;
-	}
 	if(interface != NULL)
-	{
 		free(interface);
-		interface = NULL;
-	}
 
-	// Return success
-	return true;
+	return success;
 }
 
 char* __attribute__ ((malloc)) get_client_names_from_ids(const char *group_ids)
@@ -878,6 +1075,60 @@ char* __attribute__ ((malloc)) get_client_names_from_ids(const char *group_ids)
 }
 
 // Prepare statements for scanning white- and blacklist as well as gravit for one client
+// Get the ID of a group set, a new ID is assigned to group sets not seen before
+static int get_groupset_id(const char *groups)
+{
+	const uint32_t hash = hashStr(groups);
+	for(unsigned int i = 0; i < num_groupsets; i++)
+		if(groupsets[i].hash == hash && strcmp(groupsets[i].groups, groups) == 0)
+			return i;
+
+	groupsetData *new = realloc(groupsets, (num_groupsets + 1u) * sizeof(groupsetData));
+	if(new == NULL)
+		return -1;
+	groupsets = new;
+	groupsets[num_groupsets].hash = hash;
+	groupsets[num_groupsets].groups = strdup(groups);
+	if(groupsets[num_groupsets].groups == NULL)
+		return -1;
+
+	if(config.debug & DEBUG_DATABASE)
+		logg("New group set %u: (%s)", num_groupsets, groups);
+
+	return num_groupsets++;
+}
+
+// Get the ID of the group set of this client, -1 if not yet known
+static int __attribute__((pure)) get_client_groupset(const clientsData *client)
+{
+	if(client->id >= num_client_groupsets)
+		return -1;
+
+	const clientGroupsetData *data = &client_groupsets[client->id];
+	if(data->rechecks != client->reread_groups)
+		return -1;
+
+	return (int)data->groupset - 1;
+}
+
+static bool set_client_groupset(const clientsData *client, const int groupset)
+{
+	if(client->id >= num_client_groupsets)
+	{
+		const unsigned int size = client->id + VEC_ALLOC_STEP;
+		clientGroupsetData *new = realloc(client_groupsets, size * sizeof(clientGroupsetData));
+		if(new == NULL)
+			return false;
+		memset(new + num_client_groupsets, 0, (size - num_client_groupsets) * sizeof(clientGroupsetData));
+		client_groupsets = new;
+		num_client_groupsets = size;
+	}
+
+	client_groupsets[client->id].groupset = groupset + 1;
+	client_groupsets[client->id].rechecks = client->reread_groups;
+	return true;
+}
+
 bool gravityDB_prepare_client_statements(clientsData *client)
 {
 	// Return early if gravity database is not available
@@ -894,6 +1145,22 @@ bool gravityDB_prepare_client_statements(clientsData *client)
 	if(!client->flags.found_group && !get_client_groupids(client))
 		return false;
 
+	// Clients with identical groups share their statements
+	const int groupset = get_groupset_id(getstr(client->groupspos));
+	if(groupset < 0 || !set_client_groupset(client, groupset))
+	{
+		logg("gravityDB_prepare_client_statements(): Failed to allocate memory");
+		return false;
+	}
+	if(whitelist_stmt->get(whitelist_stmt, groupset) != NULL &&
+	   gravity_stmt->get(gravity_stmt, groupset) != NULL &&
+	   blacklist_stmt->get(blacklist_stmt, groupset) != NULL)
+	{
+		if(config.debug & DEBUG_DATABASE)
+			logg("Using statements of group set %d for %s", groupset, clientip);
+		return true;
+	}
+
 	// Prepare whitelist statement
 	if(config.debug & DEBUG_DATABASE)
 		logg("gravityDB_open(): Preparing vw_whitelist statement for client %s", clientip);
@@ -906,7 +1173,7 @@ bool gravityDB_prepare_client_statements(clientsData *client)
 		gravityDB_close();
 		return false;
 	}
-	whitelist_stmt->set(whitelist_stmt, client->id, stmt);
+	whitelist_stmt->set(whitelist_stmt, groupset, stmt);
 	free(querystr);
 
 	// Prepare gravity statement
@@ -920,7 +1187,7 @@ bool gravityDB_prepare_client_statements(clientsData *client)
 		gravityDB_close();
 		return false;
 	}
-	gravity_stmt->set(gravity_stmt, client->id, stmt);
+	gravity_stmt->set(gravity_stmt, groupset, stmt);
 	free(querystr);
 
 	// Prepare blacklist statement
@@ -934,36 +1201,22 @@ bool gravityDB_prepare_client_statements(clientsData *client)
 		gravityDB_close();
 		return false;
 	}
-	blacklist_stmt->set(blacklist_stmt, client->id, stmt);
+	blacklist_stmt->set(blacklist_stmt, groupset, stmt);
 	free(querystr);
 
 	return true;
 }
 
 // Finalize non-NULL prepared statements and set them to NULL for a given client
+// Detach a client from its group set. The statements of the group set are
+// kept for other clients with the same groups
 static inline void gravityDB_finalize_client_statements(clientsData *client)
 {
 	if(config.debug & DEBUG_DATABASE)
 		logg("Finalizing gravity statements for %s", getstr(client->ippos));
 
-	if(whitelist_stmt != NULL &&
-	   whitelist_stmt->get(whitelist_stmt, client->id) != NULL)
-	{
-		sqlite3_finalize(whitelist_stmt->get(whitelist_stmt, client->id));
-		whitelist_stmt->set(whitelist_stmt, client->id, NULL);
-	}
-	if(blacklist_stmt != NULL &&
-	   blacklist_stmt->get(blacklist_stmt, client->id) != NULL)
-	{
-		sqlite3_finalize(blacklist_stmt->get(blacklist_stmt, client->id));
-		blacklist_stmt->set(blacklist_stmt, client->id, NULL);
-	}
-	if(gravity_stmt != NULL &&
-	   gravity_stmt->get(gravity_stmt, client->id) != NULL)
-	{
-		sqlite3_finalize(gravity_stmt->get(gravity_stmt, client->id));
-		gravity_stmt->set(gravity_stmt, client->id, NULL);
-	}
+	if(client->id < num_client_groupsets)
+		client_groupsets[client->id].groupset = 0u;
 
 	// Unset group found property to trigger a check next time the
 	// client sends a query
@@ -973,6 +1226,13 @@ static inline void gravityDB_finalize_client_statements(clientsData *client)
 	}
 }
 
+// The slot of this client is reclaimed and its ID will be reused by another
+// client (see reclaim.c)
+void gravityDB_forget_client(clientsData *client)
+{
+	gravityDB_finalize_client_statements(client);
+}
+
 // Close gravity database connection
 void gravityDB_close(void)
 {
@@ -988,11 +1248,35 @@ void gravityDB_close(void)
 			gravityDB_finalize_client_statements(client);
 	}
 
+	// Finalize prepared list statements of all group sets
+	for(unsigned int i = 0; i < num_groupsets; i++)
+	{
+		if(whitelist_stmt != NULL)
+			sqlite3_finalize(whitelist_stmt->get(whitelist_stmt, i));
+		if(blacklist_stmt != NULL)
+			sqlite3_finalize(blacklist_stmt->get(blacklist_stmt, i));
+		if(gravity_stmt != NULL)
+			sqlite3_finalize(gravity_stmt->get(gravity_stmt, i));
+		if(groupsets[i].groups != NULL)
+			free(groupsets[i].groups);
+	}
+	if(groupsets != NULL)
+		free(groupsets);
+	groupsets = NULL;
+	num_groupsets = 0u;
+
 	// Free allocated memory for vectors of prepared client statements
 	free_sqlite3_stmt_vec(&whitelist_stmt);
 	free_sqlite3_stmt_vec(&blacklist_stmt);
 	free_sqlite3_stmt_vec(&gravity_stmt);
 
+	// Free Bloom filters, they are rebuilt when the database is opened again
+	bloom_free(&whitelist_filter);
+	bloom_free(&blacklist_filter);
+	bloom_free(&gravity_filter);
+	list_map_free(&whitelist_map);
+	list_map_free(&blacklist_map);
+
 	// Finalize audit list statement
 	sqlite3_finalize(auditlist_stmt);
 	auditlist_stmt = NULL;
@@ -1178,7 +1462,111 @@ int gravityDB_count(const enum gravity_tables list)
 	return result;
 }
 
-static enum db_result domain_in_list(const char *domain, sqlite3_stmt *stmt, const char *listname, int *domain_id)
+// Row sets whose fingerprints are compared on reload. The gravity table itself
+// may hold millions of rows, it is represented by the timestamp and count
+// stored by gravity and the enabled adlists with their groups
+static const char *fingerprint_query[] = {
+	[GRAVITY_TABLE] = "SELECT property, value FROM info WHERE property IN ('updated','gravity_count') "
+	                  "UNION ALL SELECT adlist.id, adlist_by_group.group_id FROM adlist "
+	                  "LEFT JOIN adlist_by_group ON adlist_by_group.adlist_id = adlist.id "
+	                  "LEFT JOIN \"group\" ON \"group\".id = adlist_by_group.group_id "
+	                  "WHERE adlist.enabled = 1 AND (adlist_by_group.group_id IS NULL OR \"group\".enabled = 1) "
+	                  "ORDER BY 1, 2;",
+	[EXACT_BLACKLIST_TABLE] = "SELECT domain, id, group_id FROM vw_blacklist ORDER BY id, group_id;",
+	[EXACT_WHITELIST_TABLE] = "SELECT domain, id, group_id FROM vw_whitelist ORDER BY id, group_id;",
+	[REGEX_BLACKLIST_TABLE] = "SELECT domain, id, group_id FROM vw_regex_blacklist ORDER BY id, group_id;",
+	[REGEX_WHITELIST_TABLE] = "SELECT domain, id, group_id FROM vw_regex_whitelist ORDER BY id, group_id;",
+	// Group assignments of the clients
+	[UNKNOWN_TABLE] = "SELECT client.ip, client_by_group.group_id FROM client "
+	                  "LEFT JOIN client_by_group ON client_by_group.client_id = client.id "
+	                  "ORDER BY 1, 2;"
+};
+static uint64_t list_fingerprint[UNKNOWN_TABLE + 1] = { 0 };
+static bool list_fingerprint_valid = false;
+
+// Hash all rows returned by the given query
+static bool list_fingerprint_query(const char *querystr, uint64_t *fingerprint)
+{
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("list_fingerprint_query(%s) - SQL error prepare: %s", querystr, sqlite3_errstr(rc));
+		return false;
+	}
+
+	uint64_t hash = 14695981039346656037ULL;
+	const int columns = sqlite3_column_count(stmt);
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		for(int col = 0; col < columns; col++)
+		{
+			const unsigned char *text = sqlite3_column_text(stmt, col);
+			for(const unsigned char *p = text; p != NULL && *p != '\0'; p++)
+			{
+				hash ^= *p;
+				hash *= 1099511628211ULL;
+			}
+			// Separator
+			hash ^= 0xff;
+			hash *= 1099511628211ULL;
+		}
+	}
+	sqlite3_finalize(stmt);
+
+	if(rc != SQLITE_DONE)
+	{
+		logg("list_fingerprint_query(%s) - SQL error step: %s", querystr, sqlite3_errstr(rc));
+		return false;
+	}
+
+	*fingerprint = hash;
+	return true;
+}
+
+// Compare the row sets of all lists with the ones seen at the last call. The
+// returned bitmask has LIST_CHANGED(list) set for every list that has changed
+// (or could not be checked) and LIST_CHANGED_CLIENTS if the group assignments
+// of the clients have changed. Everything is reported as changed on first use
+unsigned int gravityDB_changed_lists(void)
+{
+	if(!gravityDB_opened && !gravityDB_open())
+	{
+		logg("gravityDB_changed_lists(): Gravity database not available");
+		list_fingerprint_valid = false;
+		return ~0u;
+	}
+
+	unsigned int changed = 0u;
+	bool valid = true;
+	for(unsigned int list = 0; list <= UNKNOWN_TABLE; list++)
+	{
+		uint64_t fingerprint = 0u;
+		if(!list_fingerprint_query(fingerprint_query[list], &fingerprint))
+		{
+			changed |= LIST_CHANGED(list);
+			valid = false;
+			continue;
+		}
+
+		if(!list_fingerprint_valid || fingerprint != list_fingerprint[list])
+			changed |= LIST_CHANGED(list);
+		list_fingerprint[list] = fingerprint;
+	}
+	list_fingerprint_valid = valid;
+
+	// Resolved client identifiers may now belong to other groups
+	if(changed & LIST_CHANGED_CLIENTS)
+		group_cache_flush();
+
+	if(config.debug & DEBUG_DATABASE)
+		logg("gravityDB_changed_lists(): Change mask is 0x%02x", changed);
+
+	return changed;
+}
+
+static enum db_result domain_in_list(const char *domain, sqlite3_stmt *stmt, const char *listname,
+                                     int *domain_id, bloom_filter *filter)
 {
 	// Do not try to bind text to statement when database is not available
 	if(!gravityDB_opened && !gravityDB_open())
@@ -1187,6 +1575,16 @@ static enum db_result domain_in_list(const char *domain, sqlite3_stmt *stmt, con
 		return LIST_NOT_AVAILABLE;
 	}
 
+	// Domains rejected by the Bloom filter are definitely not in the list
+	if(!bloom_check(filter, domain))
+	{
+		if(domain_id != NULL)
+			*domain_id = -1;
+		if(config.debug & DEBUG_DATABASE)
+			logg("domain_in_list(\"%s\", %p, %s): -1 (filter)", domain, stmt, listname);
+		return NOT_FOUND;
+	}
+
 	int rc;
 	// Bind domain to prepared statement
 	// SQLITE_STATIC: Use the string without first duplicating it internally.
@@ -1242,10 +1640,26 @@ static enum db_result domain_in_list(const char *domain, sqlite3_stmt *stmt, con
 	// parameters to NULL.
 	sqlite3_clear_bindings(stmt);
 
+	// Count domains the Bloom filter could not reject
+	if(filter != NULL && rc != SQLITE_ROW)
+		filter->false_positives++;
+
 	// Return if domain was found in current table
 	return (rc == SQLITE_ROW) ? FOUND : NOT_FOUND;
 }
 
+// Look up a domain in the in-memory map of an exact list
+static enum db_result domain_in_map(const char *domain, const list_map *map, const char *listname,
+                                    const clientsData *client, int *domain_id)
+{
+	const enum db_result result = list_map_lookup(map, domain, getstr(client->groupspos), domain_id);
+
+	if(config.debug & DEBUG_DATABASE)
+		logg("domain_in_map(\"%s\", %s): %d", domain, listname, *domain_id);
+
+	return result;
+}
+
 void gravityDB_reload_groups(clientsData* client)
 {
 	// Rebuild client table statements (possibly from a different group set)
@@ -1256,21 +1670,51 @@ void gravityDB_reload_groups(clientsData* client)
 	reload_per_client_regex(client);
 }
 
-// Check if this client needs a rechecking of group membership
-// This client may be identified by something that wasn't there on its first query (hostname, MAC address, interface)
-static void gravityDB_client_check_again(clientsData* client)
+// Recheck the group membership of clients in the background. Clients may be
+// identified by something that wasn't there on their first query (hostname, MAC
+// address, interface). Queries use the last known groups of a client meanwhile.
+// At most max clients are rechecked, the return value is the number of
+// rechecked clients. *next is set to the time the next recheck is due
+unsigned int gravityDB_recheck_clients(const time_t now, const unsigned int max, time_t *next)
 {
-	const time_t diff = time(NULL) - client->firstSeen;
-	const unsigned char check_count = client->reread_groups + 1u;
-	if(check_count <= NUM_RECHECKS && diff > check_count * RECHECK_DELAY)
+	unsigned int rechecked = 0u;
+	*next = now + RECHECK_DELAY;
+	for(int clientID = 0; clientID < counters->clients; clientID++)
 	{
-		const char *ord = get_ordinal_suffix(check_count);
+		clientsData *client = getClient(clientID, true);
+		if(client == NULL || client->flags.aliasclient ||
+		   client->reread_groups >= NUM_RECHECKS)
+			continue;
+
+		// Recheck after RECHECK_DELAY, 2*RECHECK_DELAY, ... seconds
+		const time_t due = client->firstSeen + (client->reread_groups + 1)*RECHECK_DELAY + 1;
+		if(due > now || rechecked >= max)
+		{
+			if(due < *next)
+				*next = due;
+			continue;
+		}
+
+		// Skip rechecks which are overdue already, e.g., for clients
+		// imported from the database
+		const time_t diff = now - client->firstSeen;
+		unsigned char check_count = (diff - 1)/RECHECK_DELAY;
+		if(check_count > NUM_RECHECKS)
+			check_count = NUM_RECHECKS;
+
 		if(config.debug & DEBUG_CLIENTS)
-			logg("Reloading client groups after %u seconds (%u%s check)",
-			     (unsigned int)diff, check_count, ord);
-		client->reread_groups++;
+			logg("Reloading groups of client %s after %u seconds (%u%s check)",
+			     getstr(client->ippos), (unsigned int)diff, check_count,
+			     get_ordinal_suffix(check_count));
+
+		// Other processes pick up the new groups as the number of
+		// rechecks changes
+		client->reread_groups = check_count;
 		gravityDB_reload_groups(client);
+		rechecked++;
 	}
+
+	return rechecked;
 }
 
 enum db_result in_whitelist(const char *domain, DNSCacheData *dns_cache, clientsData* client)
@@ -1280,11 +1724,9 @@ enum db_result in_whitelist(const char *domain, DNSCacheData *dns_cache, clients
 	if(whitelist_stmt == NULL)
 		return LIST_NOT_AVAILABLE;
 
-	// Check if this client needs a rechecking of group membership
-	gravityDB_client_check_again(client);
-
 	// Get whitelist statement from vector of prepared statements if available
-	sqlite3_stmt *stmt = whitelist_stmt->get(whitelist_stmt, client->id);
+	const int groupset = get_client_groupset(client);
+	sqlite3_stmt *stmt = groupset > -1 ? whitelist_stmt->get(whitelist_stmt, groupset) : NULL;
 
 	// If client statement is not ready and cannot be initialized (e.g. no access to
 	// the database), we return false (not in whitelist) to prevent an FTL crash
@@ -1296,12 +1738,14 @@ enum db_result in_whitelist(const char *domain, DNSCacheData *dns_cache, clients
 
 	// Update statement if has just been initialized
 	if(stmt == NULL)
-		stmt = whitelist_stmt->get(whitelist_stmt, client->id);
-
-	// We have to check both the exact whitelist (using a prepared database statement)
-	// as well the compiled regex whitelist filters to check if the current domain is
-	// whitelisted.
-	return domain_in_list(domain, stmt, "whitelist", &dns_cache->domainlist_id);
+		stmt = whitelist_stmt->get(whitelist_stmt, get_client_groupset(client));
+
+	// We have to check both the exact whitelist (using the in-memory map or a
+	// prepared database statement) as well the compiled regex whitelist
+	// filters to check if the current domain is whitelisted.
+	if(whitelist_map != NULL)
+		return domain_in_map(domain, whitelist_map, "whitelist", client, &dns_cache->domainlist_id);
+	return domain_in_list(domain, stmt, "whitelist", &dns_cache->domainlist_id, whitelist_filter);
 }
 
 enum db_result in_gravity(const char *domain, clientsData *client)
@@ -1311,11 +1755,9 @@ enum db_result in_gravity(const char *domain, clientsData *client)
 	if(gravity_stmt == NULL)
 		return LIST_NOT_AVAILABLE;
 
-	// Check if this client needs a rechecking of group membership
-	gravityDB_client_check_again(client);
-
 	// Get whitelist statement from vector of prepared statements
-	sqlite3_stmt *stmt = gravity_stmt->get(gravity_stmt, client->id);
+	const int groupset = get_client_groupset(client);
+	sqlite3_stmt *stmt = groupset > -1 ? gravity_stmt->get(gravity_stmt, groupset) : NULL;
 
 	// If client statement is not ready and cannot be initialized (e.g. no access to
 	// the database), we return false (not in gravity list) to prevent an FTL crash
@@ -1327,11 +1769,18 @@ enum db_result in_gravity(const char *domain, clientsData *client)
 
 	// Update statement if has just been initialized
 	if(stmt == NULL)
-		stmt = gravity_stmt->get(gravity_stmt, client->id);
+		stmt = gravity_stmt->get(gravity_stmt, get_client_groupset(client));
+
+	// Get the groups of this client as bit mask if the in-memory gravity
+	// set is available
+	uint64_t mask = 0;
+	const bool use_set = gravity_set_client_mask(getstr(client->groupspos), &mask);
 
 	// Check if domain is exactly in gravity list
-	const enum db_result exact_match = domain_in_list(domain, stmt, "gravity", NULL);
-	if(config.debug & DEBUG_QUERIES)
+	const enum db_result exact_match = use_set ?
+		gravity_set_lookup(domain, mask) :
+		domain_in_list(domain, stmt, "gravity", NULL, gravity_filter);
+	if(debug_enabled(DEBUG_QUERIES))
 		logg("Checking if \"%s\" is in gravity: %s",
 		     domain, exact_match == FOUND ? "yes" : "no");
 	// Return for anything else than "not found" (e.g. "found" or "list not available")
@@ -1344,6 +1793,16 @@ enum db_result in_gravity(const char *domain, clientsData *client)
 	if(!gravity_abp_format)
 		return NOT_FOUND;
 
+	// The in-memory gravity set checks all parent domains in one go
+	if(use_set)
+	{
+		const enum db_result abp_match = gravity_set_lookup_abp(domain, mask);
+		if(debug_enabled(DEBUG_QUERIES))
+			logg("Checking if \"%s\" is in gravity (ABP): %s",
+			     domain, abp_match == FOUND ? "yes" : "no");
+		return abp_match;
+	}
+
 	// Make a copy of the domain we will slowly truncate
 	// while extracting the individual components below
 	char *domainBuf = strdup(domain);
@@ -1393,8 +1852,8 @@ enum db_result in_gravity(const char *domain, clientsData *client)
 			memcpy(abpDomain+2, ptr, component_size);
 		}
 		// Check if the constructed ABP-style domain is in the gravity list
-		const enum db_result abp_match = domain_in_list(abpDomain, stmt, "gravity", NULL);
-		if(config.debug & DEBUG_QUERIES)
+		const enum db_result abp_match = domain_in_list(abpDomain, stmt, "gravity", NULL, gravity_filter);
+		if(debug_enabled(DEBUG_QUERIES))
 			logg("Checking if \"%s\" is in gravity: %s",
 			     abpDomain, abp_match == FOUND ? "yes" : "no");
 		// Return for anything else than "not found" (e.g. "found" or "list not available")
@@ -1434,11 +1893,9 @@ enum db_result in_blacklist(const char *domain, DNSCacheData *dns_cache, clients
 	if(blacklist_stmt == NULL)
 		return LIST_NOT_AVAILABLE;
 
-	// Check if this client needs a rechecking of group membership
-	gravityDB_client_check_again(client);
-
 	// Get whitelist statement from vector of prepared statements
-	sqlite3_stmt *stmt = blacklist_stmt->get(blacklist_stmt, client->id);
+	const int groupset = get_client_groupset(client);
+	sqlite3_stmt *stmt = groupset > -1 ? blacklist_stmt->get(blacklist_stmt, groupset) : NULL;
 
 	// If client statement is not ready and cannot be initialized (e.g. no access to
 	// the database), we return false (not in blacklist) to prevent an FTL crash
@@ -1450,9 +1907,11 @@ enum db_result in_blacklist(const char *domain, DNSCacheData *dns_cache, clients
 
 	// Update statement if has just been initialized
 	if(stmt == NULL)
-		stmt = blacklist_stmt->get(blacklist_stmt, client->id);
+		stmt = blacklist_stmt->get(blacklist_stmt, get_client_groupset(client));
 
-	return domain_in_list(domain, stmt, "blacklist", &dns_cache->domainlist_id);
+	if(blacklist_map != NULL)
+		return domain_in_map(domain, blacklist_map, "blacklist", client, &dns_cache->domainlist_id);
+	return domain_in_list(domain, stmt, "blacklist", &dns_cache->domainlist_id, blacklist_filter);
 }
 
 bool in_auditlist(const char *domain)
@@ -1463,7 +1922,7 @@ bool in_auditlist(const char *domain)
 		return false;
 
 	// We check the domain_audit table for the given domain
-	return domain_in_list(domain, auditlist_stmt, "auditlist", NULL) == FOUND;
+	return domain_in_list(domain, auditlist_stmt, "auditlist", NULL, NULL) == FOUND;
 }
 
 bool gravityDB_get_regex_client_groups(clientsData* client, const unsigned int numregex, const regexData *regex,
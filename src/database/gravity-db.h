@@ -15,13 +15,26 @@
 // regexData
 #include "../regex_r.h"
 
+struct bloom_filter;
+
 // Table indices
 enum gravity_tables { GRAVITY_TABLE, EXACT_BLACKLIST_TABLE, EXACT_WHITELIST_TABLE, REGEX_BLACKLIST_TABLE, REGEX_WHITELIST_TABLE, UNKNOWN_TABLE } __attribute__ ((packed));
 
+// Bits returned by gravityDB_changed_lists()
+#define LIST_CHANGED(list) (1u << (list))
+#define LIST_CHANGED_CLIENTS LIST_CHANGED(UNKNOWN_TABLE)
+
+typedef struct gravityDB_handle gravityDB_handle;
+
+extern bool gravityDB_opened;
+
 bool gravityDB_open(void);
-bool gravityDB_reopen(void);
+gravityDB_handle *gravityDB_prepare(void);
+bool gravityDB_reopen(gravityDB_handle *next);
 void gravityDB_forked(void);
 void gravityDB_reload_groups(clientsData* client);
+unsigned int gravityDB_recheck_clients(const time_t now, const unsigned int max, time_t *next);
+void gravityDB_forget_client(clientsData *client);
 bool gravityDB_prepare_client_statements(clientsData* client);
 void gravityDB_close(void);
 bool gravityDB_getTable(unsigned char list);
@@ -29,6 +42,8 @@ const char* gravityDB_getDomain(int *rowid);
 char* get_client_names_from_ids(const char *group_ids) __attribute__ ((malloc));
 void gravityDB_finalizeTable(void);
 int gravityDB_count(const enum gravity_tables list);
+unsigned int gravityDB_changed_lists(void);
+const struct bloom_filter *gravityDB_get_filter(const enum gravity_tables list) __attribute__((pure));
 void check_inaccessible_adlists(void);
 
 enum db_result in_gravity(const char *domain, clientsData *client);
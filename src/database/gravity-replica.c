@@ -0,0 +1,507 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Gravity database replication
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "../FTL.h"
+#include "sqlite3.h"
+#include "gravity-replica.h"
+// struct config
+#include "../config.h"
+// logg()
+#include "../log.h"
+// ssend(), swrite(), sflush(), scompressed(), socket_connect()
+#include "../api/socket.h"
+// killed, thread_names[]
+#include "../signals.h"
+// set_event(), wait_for_event()
+#include "../events.h"
+// thread_sched_apply()
+#include "../threadsched.h"
+// struct stat
+#include <sys/stat.h>
+// sendfile()
+#include <sys/sendfile.h>
+// open()
+#include <fcntl.h>
+
+// A primary node (GRAVITY_PUBLISH) offers its gravity database together with
+// the compiled gravity set (gravity.db.idx) through the API command
+// >gravity-artifact. Replicas (GRAVITY_PRIMARY) ask for it every
+// GRAVITY_SYNC_INTERVAL seconds, passing the checksum of what they have. The
+// artifact is only transferred if it changed, the response is one of
+//
+//   unchanged <checksum>
+//   unavailable
+//   artifact <checksum> <database size> <index size>
+//
+// where the last one is followed by the raw bytes of both files. Replicas
+// verify the checksum, rename the files into place and reload gravity the
+// same way as after "pihole restartdns reload-lists": the new database and set
+// are prepared before the old ones are replaced while holding the lock. The
+// index is only used if its fingerprint matches the database (see
+// gravity-set.c), so a replica never needs to build anything itself.
+// The checksum is a 64bit FNV-1a hash which protects against truncated or
+// corrupted transfers, not against forgery. The API port of the primary must
+// hence only be reachable by trusted replicas
+
+// Published copies are named <gravity.db>.publish and <gravity.db>.publish.idx,
+// received ones <gravity.db>.replica and <gravity.db>.idx.replica
+#define PUBLISH_SUFFIX ".publish"
+#define REPLICA_SUFFIX ".replica"
+#define INDEX_SUFFIX ".idx"
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// Identity of a file, it has changed if any of these differs
+struct file_key {
+	bool exists;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+};
+
+// Primary: consistent copy of the database and index last published
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct file_key published_db = { 0 }, published_idx = { 0 };
+static uint64_t published_checksum = 0u;
+static bool published = false;
+
+// Replica
+static char *primary = NULL;
+
+static struct file_key file_key(const char *filename)
+{
+	struct file_key key = { 0 };
+	struct stat st;
+	if(stat(filename, &st) == 0)
+	{
+		key.exists = true;
+		key.dev = st.st_dev;
+		key.ino = st.st_ino;
+		key.size = st.st_size;
+		key.mtime = st.st_mtim;
+	}
+	return key;
+}
+
+static bool __attribute__((pure)) same_file(const struct file_key *a, const struct file_key *b)
+{
+	return a->exists == b->exists && a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+	       a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+static uint64_t __attribute__((pure)) fnv_update(uint64_t hash, const unsigned char *data, const size_t len)
+{
+	for(size_t i = 0; i < len; i++)
+	{
+		hash ^= data[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+// Add the content of a file to the checksum, missing files add nothing
+static bool checksum_file(const char *filename, uint64_t *hash)
+{
+	const int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return errno == ENOENT;
+
+	unsigned char buffer[65536];
+	ssize_t len = 0;
+	while((len = read(fd, buffer, sizeof(buffer))) > 0)
+		*hash = fnv_update(*hash, buffer, len);
+	close(fd);
+
+	return len == 0;
+}
+
+static char *filename_with(const char *suffix)
+{
+	char *filename = NULL;
+	if(asprintf(&filename, "%s%s", FTLfiles.gravity_db, suffix) < 0)
+		return NULL;
+	return filename;
+}
+
+// Write a consistent copy of the gravity database. This uses its own
+// read-only connection so changes made meanwhile are not included halfway
+static bool copy_database(const char *target)
+{
+	sqlite3 *db = NULL;
+	int rc = sqlite3_open_v2(FTLfiles.gravity_db, &db, SQLITE_OPEN_READONLY, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("copy_database(): Cannot open database: %s", sqlite3_errstr(rc));
+		sqlite3_close(db);
+		return false;
+	}
+	sqlite3_busy_timeout(db, 1000);
+
+	sqlite3_stmt *stmt = NULL;
+	unlink(target);
+	rc = sqlite3_prepare_v2(db, "VACUUM INTO ?;", -1, &stmt, NULL);
+	if(rc == SQLITE_OK)
+		rc = sqlite3_bind_text(stmt, 1, target, -1, SQLITE_STATIC);
+	if(rc == SQLITE_OK && (rc = sqlite3_step(stmt)) == SQLITE_DONE)
+		rc = SQLITE_OK;
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+
+	if(rc != SQLITE_OK)
+	{
+		logg("copy_database(): Cannot copy database: %s", sqlite3_errstr(rc));
+		unlink(target);
+		return false;
+	}
+	return true;
+}
+
+// Publish the current gravity database and index if they changed since they
+// were published the last time. Needs publish_lock
+static bool publish(const char *dbcopy, const char *idxcopy)
+{
+	char *idxfile = filename_with(INDEX_SUFFIX);
+	if(idxfile == NULL)
+		return false;
+
+	const struct file_key db = file_key(FTLfiles.gravity_db);
+	const struct file_key idx = file_key(idxfile);
+	if(published && same_file(&db, &published_db) && same_file(&idx, &published_idx))
+	{
+		free(idxfile);
+		return true;
+	}
+
+	published = false;
+	if(!db.exists || !copy_database(dbcopy))
+	{
+		free(idxfile);
+		return false;
+	}
+
+	// Compiled sets are replaced atomically (see gravity_set_compile()) so
+	// a hard link is a stable copy
+	unlink(idxcopy);
+	if(idx.exists && link(idxfile, idxcopy) != 0)
+		logg("WARN: Cannot publish %s: %s", idxfile, strerror(errno));
+	free(idxfile);
+
+	uint64_t checksum = FNV_OFFSET;
+	if(!checksum_file(dbcopy, &checksum) || !checksum_file(idxcopy, &checksum))
+		return false;
+
+	published_db = db;
+	published_idx = idx;
+	published_checksum = checksum;
+	published = true;
+	logg("Published gravity database (checksum %016llx)", (unsigned long long)checksum);
+	return true;
+}
+
+static bool send_file(const int sock, const int fd, const off_t size)
+{
+	// Compressed connections get the file through the output buffer
+	if(scompressed(sock))
+	{
+		char buffer[16*1024];
+		for(off_t left = size; left > 0;)
+		{
+			const ssize_t ret = read(fd, buffer, left < (off_t)sizeof(buffer) ? (size_t)left : sizeof(buffer));
+			if(ret < 0 && errno == EINTR)
+				continue;
+			if(ret <= 0 || !swrite(sock, buffer, ret))
+				return false;
+			left -= ret;
+		}
+		return true;
+	}
+
+	off_t offset = 0;
+	while(offset < size)
+	{
+		const ssize_t ret = sendfile(sock, fd, &offset, size - offset);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			return false;
+	}
+	return true;
+}
+
+// >gravity-artifact <checksum of the replica>
+void getGravityArtifact(const char *client_message, const int sock, const bool istelnet)
+{
+	if(!config.gravity_publish || !istelnet)
+	{
+		if(istelnet)
+			ssend(sock, "unavailable\n");
+		return;
+	}
+
+	unsigned long long have = 0;
+	sscanf(client_message, "%*s %llx", &have);
+
+	char *dbcopy = filename_with(PUBLISH_SUFFIX);
+	char *idxcopy = filename_with(PUBLISH_SUFFIX INDEX_SUFFIX);
+	if(dbcopy == NULL || idxcopy == NULL)
+	{
+		free(dbcopy);
+		free(idxcopy);
+		ssend(sock, "unavailable\n");
+		return;
+	}
+
+	// Open the files while holding the lock, they are never modified in
+	// place (only replaced by new ones) so we can send them after
+	// releasing it
+	int dbfd = -1, idxfd = -1;
+	uint64_t checksum = 0u;
+	pthread_mutex_lock(&publish_lock);
+	if(publish(dbcopy, idxcopy))
+	{
+		checksum = published_checksum;
+		if(checksum != have)
+		{
+			dbfd = open(dbcopy, O_RDONLY | O_CLOEXEC);
+			idxfd = open(idxcopy, O_RDONLY | O_CLOEXEC);
+		}
+	}
+	pthread_mutex_unlock(&publish_lock);
+	free(dbcopy);
+	free(idxcopy);
+
+	struct stat dbst = { 0 }, idxst = { 0 };
+	if(checksum != 0u && checksum == have)
+		ssend(sock, "unchanged %016llx\n", (unsigned long long)checksum);
+	else if(dbfd < 0 || fstat(dbfd, &dbst) != 0 || (idxfd > -1 && fstat(idxfd, &idxst) != 0))
+		ssend(sock, "unavailable\n");
+	else
+	{
+		ssend(sock, "artifact %016llx %lld %lld\n", (unsigned long long)checksum,
+		      (long long)dbst.st_size, (long long)idxst.st_size);
+		if(sflush(sock) && send_file(sock, dbfd, dbst.st_size) && idxfd > -1)
+			send_file(sock, idxfd, idxst.st_size);
+	}
+
+	if(dbfd > -1)
+		close(dbfd);
+	if(idxfd > -1)
+		close(idxfd);
+}
+
+// Set the primary to replicate from, returns NULL if there is none
+const char *gravity_replica_set_primary(const char *target)
+{
+	if(primary != NULL)
+		free(primary);
+	primary = NULL;
+
+	if(target == NULL || strlen(target) == 0)
+		return NULL;
+
+	if(strrchr(target, ':') == NULL)
+	{
+		logg("WARNING: Ignoring GRAVITY_PRIMARY %s, expected host:port", target);
+		return NULL;
+	}
+
+	primary = strdup(target);
+	return primary;
+}
+
+// Called before the threads are started
+bool init_gravity_replica(void)
+{
+	return primary != NULL;
+}
+
+// Read one line of the response
+static bool receive_line(const int sock, char *line, const size_t size)
+{
+	size_t len = 0u;
+	while(len < size - 1)
+	{
+		if(recv(sock, &line[len], 1, 0) != 1)
+			return false;
+		if(line[len] == '\n')
+			break;
+		len++;
+	}
+	line[len] = '\0';
+	return len < size - 1;
+}
+
+// Receive size bytes into a new file
+static bool receive_file(const int sock, const char *filename, const unsigned long long size, uint64_t *hash)
+{
+	const int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd < 0)
+	{
+		logg("WARN: Cannot create %s: %s", filename, strerror(errno));
+		return false;
+	}
+
+	unsigned char buffer[65536];
+	unsigned long long received = 0u;
+	bool success = true;
+	while(success && received < size)
+	{
+		const size_t want = size - received < sizeof(buffer) ? size - received : sizeof(buffer);
+		const ssize_t len = recv(sock, buffer, want, 0);
+		if(len < 0 && errno == EINTR)
+			continue;
+		if(len <= 0 || write(fd, buffer, len) != len)
+			success = false;
+		else
+		{
+			*hash = fnv_update(*hash, buffer, len);
+			received += len;
+		}
+	}
+
+	// Make sure the file is complete on disk before it replaces the old one
+	if(fsync(fd) != 0)
+		success = false;
+	close(fd);
+
+	if(!success)
+		unlink(filename);
+	return success;
+}
+
+// Fetch the artifact from the primary and install it if it changed. Returns
+// false if the primary cannot be reached or the transfer failed
+static bool replicate(uint64_t *checksum)
+{
+	const int sock = socket_connect(primary, GRAVITY_REPLICA_TIMEOUT);
+	if(sock < 0)
+		return false;
+
+	char line[128];
+	snprintf(line, sizeof(line), ">gravity-artifact %016llx\n", (unsigned long long)*checksum);
+	unsigned long long expected = 0u, dbsize = 0u, idxsize = 0u;
+	if(send(sock, line, strlen(line), MSG_NOSIGNAL) != (ssize_t)strlen(line) ||
+	   !receive_line(sock, line, sizeof(line)))
+	{
+		close(sock);
+		return false;
+	}
+
+	if(strncmp(line, "unchanged ", 10) == 0)
+	{
+		close(sock);
+		return true;
+	}
+
+	if(sscanf(line, "artifact %llx %llu %llu", &expected, &dbsize, &idxsize) != 3)
+	{
+		if(config.debug & DEBUG_DATABASE)
+			logg("Gravity primary %s answered: %s", primary, line);
+		close(sock);
+		return false;
+	}
+
+	char *dbfile = filename_with(REPLICA_SUFFIX);
+	char *idxfile = filename_with(INDEX_SUFFIX);
+	char *idxtmp = filename_with(INDEX_SUFFIX REPLICA_SUFFIX);
+	uint64_t hash = FNV_OFFSET;
+	bool success = dbfile != NULL && idxfile != NULL && idxtmp != NULL &&
+	               receive_file(sock, dbfile, dbsize, &hash) &&
+	               (idxsize == 0u || receive_file(sock, idxtmp, idxsize, &hash));
+	close(sock);
+
+	if(success && hash != expected)
+	{
+		logg("WARN: Checksum of the gravity database received from %s does not match", primary);
+		success = false;
+	}
+
+	// Replace the index first. A new index is ignored while the old
+	// database is still in place as its fingerprint does not match
+	if(success && idxsize > 0u && rename(idxtmp, idxfile) != 0)
+		success = false;
+	if(success && idxsize == 0u)
+		unlink(idxfile);
+	if(success && rename(dbfile, FTLfiles.gravity_db) != 0)
+		success = false;
+
+	if(success)
+	{
+		*checksum = hash;
+		logg("Replicated gravity database from %s (%llu + %llu bytes, checksum %016llx)",
+		     primary, dbsize, idxsize, expected);
+
+		// Swap to the new database and set through the usual reload path
+		set_event(RELOAD_GRAVITY);
+	}
+	else
+	{
+		logg("WARN: Cannot install gravity database received from %s: %s", primary, strerror(errno));
+		if(dbfile != NULL)
+			unlink(dbfile);
+		if(idxtmp != NULL)
+			unlink(idxtmp);
+	}
+
+	free(dbfile);
+	free(idxfile);
+	free(idxtmp);
+	return success;
+}
+
+void *gravity_replica_thread(void *val)
+{
+	(void)val;
+
+	// Set thread name
+	thread_names[REPLICA] = "gravity-replica";
+	prctl(PR_SET_NAME, thread_names[REPLICA], 0, 0, 0);
+	thread_sched_apply(REPLICA);
+
+	char *idxfile = filename_with(INDEX_SUFFIX);
+	struct file_key installed_db = { 0 }, installed_idx = { 0 };
+	uint64_t checksum = 0u;
+	bool failed = false;
+	while(!killed && idxfile != NULL)
+	{
+		// Files from an earlier replication are not transferred again
+		// unless they have been changed locally
+		const struct file_key db = file_key(FTLfiles.gravity_db);
+		const struct file_key idx = file_key(idxfile);
+		if(!same_file(&db, &installed_db) || !same_file(&idx, &installed_idx))
+		{
+			checksum = FNV_OFFSET;
+			if(!db.exists || !checksum_file(FTLfiles.gravity_db, &checksum) || !checksum_file(idxfile, &checksum))
+				checksum = 0u;
+		}
+
+		const bool success = replicate(&checksum);
+		if(success)
+		{
+			installed_db = file_key(FTLfiles.gravity_db);
+			installed_idx = file_key(idxfile);
+		}
+
+		// Log only changes
+		if(!success && !failed)
+			logg("WARNING: Cannot replicate gravity database from %s", primary);
+		else if(success && failed)
+			logg("Replicating gravity database from %s again", primary);
+		failed = !success;
+
+		wait_for_event(REPLICA, config.gravity_sync_interval*1000);
+	}
+
+	free(idxfile);
+	logg("Terminating gravity replica thread");
+	return NULL;
+}
@@ -0,0 +1,27 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Gravity database replication prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef GRAVITY_REPLICA_H
+#define GRAVITY_REPLICA_H
+
+#include <stdbool.h>
+
+// Time to wait for the primary when connecting and for each chunk of the
+// transfer [seconds]
+#define GRAVITY_REPLICA_TIMEOUT 10
+
+// Primary
+void getGravityArtifact(const char *client_message, const int sock, const bool istelnet);
+
+// Replicas
+const char *gravity_replica_set_primary(const char *target);
+bool init_gravity_replica(void) __attribute__((pure));
+void *gravity_replica_thread(void *val);
+
+#endif //GRAVITY_REPLICA_H
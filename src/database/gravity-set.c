@@ -0,0 +1,588 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  In-memory gravity domain set
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "../FTL.h"
+#include "sqlite3.h"
+// public prototypes
+#include "gravity-set.h"
+// struct config
+#include "../config.h"
+// logg()
+#include "../log.h"
+// struct stat
+#include <sys/stat.h>
+// mmap()
+#include <sys/mman.h>
+// open()
+#include <fcntl.h>
+
+// Identification of compiled gravity sets
+#define GRAVITY_SET_MAGIC "FTLGRAV2"
+#define GRAVITY_SET_BYTEORDER 0x01020304u
+
+// The gravity set maps the hash of every gravity domain to a bit mask of the
+// groups it is enabled for. The database stays the source of truth, the set is
+// rebuilt from it whenever gravity is reloaded. The set is process-private,
+// forks share its pages with the main process (copy-on-write)
+struct gravity_set {
+	// Open addressing hash table, size is a power of two
+	gravitySetEntry *table;
+	size_t size;
+	size_t count;
+	// Number of ABP-style entries (||domain^)
+	size_t abp_count;
+	// Group IDs represented by the bits of the masks (sorted)
+	unsigned int num_groups;
+	int group_ids[GRAVITY_SET_MAX_GROUPS];
+	// Memory mapping if the set was loaded from a compiled file
+	void *map;
+	size_t mapsize;
+};
+
+// Header of compiled gravity sets. The hash table follows directly (in the
+// same format as in memory) so the file can be mapped and used as-is
+typedef struct {
+	char magic[8];
+	uint32_t byteorder;
+	uint32_t num_groups;
+	uint64_t fingerprint;
+	uint64_t size;
+	uint64_t count;
+	uint64_t abp_count;
+	int32_t group_ids[GRAVITY_SET_MAX_GROUPS];
+} gravitySetHeader;
+
+// Currently active set, NULL if domains have to be looked up in the database
+static gravity_set *active_set = NULL;
+
+// 64bit FNV-1a hash of a domain. Zero is used to mark empty slots
+uint64_t gravity_set_hash(const char *domain)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for(const unsigned char *p = (const unsigned char*)domain; *p != '\0'; p++)
+	{
+		hash ^= *p;
+		hash *= 1099511628211ULL;
+	}
+	return hash != 0 ? hash : 1;
+}
+
+// ABP-style entries (||domain^ matches domain and all its subdomains) are
+// stored by the hash of their domain read backwards, using a different offset
+// basis than exact domains. This allows to compute the hashes of all parent
+// domains of a queried domain in a single right-to-left walk
+#define ABP_HASH_BASIS 0x84222325cbf29ce4ULL
+static inline uint64_t __attribute__((const)) abp_hash_step(const uint64_t hash, const unsigned char c)
+{
+	return (hash ^ c) * 1099511628211ULL;
+}
+
+static inline uint64_t __attribute__((const)) abp_hash_final(const uint64_t hash)
+{
+	return hash != 0 ? hash : 1;
+}
+
+// Hash of the domain of an ABP-style entry of length len
+static uint64_t __attribute__((pure)) abp_hash(const char *domain, const size_t len)
+{
+	uint64_t hash = ABP_HASH_BASIS;
+	for(size_t i = len; i > 0; i--)
+		hash = abp_hash_step(hash, domain[i-1]);
+	return abp_hash_final(hash);
+}
+
+// Get the bit representing a group ID, -1 if this group is unknown
+static int __attribute__((pure)) group_bit(const gravity_set *set, const int group_id)
+{
+	// Binary search in sorted list of group IDs
+	int low = 0, high = (int)set->num_groups - 1;
+	while(low <= high)
+	{
+		const int mid = (low + high) / 2;
+		if(set->group_ids[mid] == group_id)
+			return mid;
+		else if(set->group_ids[mid] < group_id)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+	return -1;
+}
+
+// Add a domain/group pair to the set. The table is large enough
+static void set_insert(gravity_set *set, const uint64_t hash, const uint64_t groups)
+{
+	const size_t mask = set->size - 1;
+	for(size_t i = hash & mask; ; i = (i + 1) & mask)
+	{
+		gravitySetEntry *entry = &set->table[i];
+		if(entry->hash == hash)
+		{
+			// Domain is on more than one list/group
+			entry->groups |= groups;
+			return;
+		}
+		else if(entry->hash == 0)
+		{
+			entry->hash = hash;
+			entry->groups = groups;
+			set->count++;
+			return;
+		}
+	}
+}
+
+// Double the size of the hash table
+static bool set_grow(gravity_set *set)
+{
+	gravitySetEntry *old = set->table;
+	const size_t oldsize = set->size;
+
+	set->size *= 2;
+	set->count = 0;
+	set->table = calloc(set->size, sizeof(gravitySetEntry));
+	if(set->table == NULL)
+	{
+		set->table = old;
+		set->size = oldsize;
+		return false;
+	}
+
+	for(size_t i = 0; i < oldsize; i++)
+		if(old[i].hash != 0)
+			set_insert(set, old[i].hash, old[i].groups);
+
+	free(old);
+	return true;
+}
+
+static void set_free(gravity_set *set)
+{
+	if(set == NULL)
+		return;
+	if(set->map != NULL)
+		munmap(set->map, set->mapsize);
+	else
+		free(set->table);
+	free(set);
+}
+
+// Compute a fingerprint of everything that determines the content of the
+// gravity set: the gravity table itself (identified by its update timestamp
+// and size), and the assignment of adlists to groups. A compiled set can only
+// be used when its fingerprint matches the database
+static bool db_fingerprint(sqlite3 *db, uint64_t *fingerprint)
+{
+	const char *querystr =
+		"SELECT property, value FROM info WHERE property IN ('updated','gravity_count') "
+		"UNION ALL SELECT 'group', id || ':' || enabled FROM \"group\" "
+		"UNION ALL SELECT 'adlist', id || ':' || enabled FROM adlist "
+		"UNION ALL SELECT 'by_group', adlist_id || ':' || group_id FROM adlist_by_group "
+		"ORDER BY 1, 2;";
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("db_fingerprint(): SQL error prepare: %s", sqlite3_errstr(rc));
+		return false;
+	}
+
+	uint64_t hash = 14695981039346656037ULL;
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		for(int col = 0; col < 2; col++)
+		{
+			const unsigned char *text = sqlite3_column_text(stmt, col);
+			for(const unsigned char *p = text; p != NULL && *p != '\0'; p++)
+			{
+				hash ^= *p;
+				hash *= 1099511628211ULL;
+			}
+			// Separator
+			hash ^= 0xff;
+			hash *= 1099511628211ULL;
+		}
+	}
+	sqlite3_finalize(stmt);
+
+	if(rc != SQLITE_DONE)
+	{
+		logg("db_fingerprint(): SQL error step: %s", sqlite3_errstr(rc));
+		return false;
+	}
+
+	*fingerprint = hash;
+	return true;
+}
+
+// Map a compiled gravity set. Returns NULL if the file does not exist or
+// does not match the database
+static gravity_set *set_map(const char *filename, const uint64_t fingerprint)
+{
+	const int fd = open(filename, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(gravitySetHeader))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	// The mapping is shared and read-only: all processes on this machine,
+	// including our forks, use the same pages of the page cache
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		logg("set_map(): Cannot map %s: %s", filename, strerror(errno));
+		return NULL;
+	}
+
+	const gravitySetHeader *header = map;
+	const size_t size = header->size;
+	if(memcmp(header->magic, GRAVITY_SET_MAGIC, sizeof(header->magic)) != 0 ||
+	   header->byteorder != GRAVITY_SET_BYTEORDER ||
+	   header->num_groups > GRAVITY_SET_MAX_GROUPS ||
+	   size == 0 || (size & (size - 1)) != 0 || header->count >= size ||
+	   (size_t)st.st_size != sizeof(gravitySetHeader) + size*sizeof(gravitySetEntry))
+	{
+		logg("Ignoring invalid compiled gravity set %s", filename);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	if(header->fingerprint != fingerprint)
+	{
+		logg("Ignoring outdated compiled gravity set %s", filename);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	gravity_set *set = calloc(1, sizeof(gravity_set));
+	if(set == NULL)
+	{
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	set->map = map;
+	set->mapsize = st.st_size;
+	set->table = (gravitySetEntry*)(header + 1);
+	set->size = size;
+	set->count = header->count;
+	set->abp_count = header->abp_count;
+	set->num_groups = header->num_groups;
+	for(unsigned int i = 0; i < set->num_groups; i++)
+		set->group_ids[i] = header->group_ids[i];
+
+	return set;
+}
+
+// Build a new gravity set from the database
+static gravity_set *set_build(sqlite3 *db)
+{
+	sqlite3_stmt *stmt = NULL;
+	gravity_set *set = calloc(1, sizeof(gravity_set));
+	if(set == NULL)
+		return NULL;
+
+	// Get group IDs
+	int rc = sqlite3_prepare_v2(db, "SELECT id FROM \"group\" ORDER BY id;", -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("set_build(): SQL error prepare (groups): %s", sqlite3_errstr(rc));
+		goto failure;
+	}
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		if(set->num_groups >= GRAVITY_SET_MAX_GROUPS)
+		{
+			logg("More than %d groups defined, using database lookups for gravity",
+			     GRAVITY_SET_MAX_GROUPS);
+			goto failure;
+		}
+		set->group_ids[set->num_groups++] = sqlite3_column_int(stmt, 0);
+	}
+	if(rc != SQLITE_DONE)
+	{
+		logg("set_build(): SQL error step (groups): %s", sqlite3_errstr(rc));
+		goto failure;
+	}
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+
+	// Prepare table for the number of unique gravity domains as counted by
+	// gravity (this is only a hint, the table grows if needed). The table
+	// is kept at most half-full to keep the probe sequences short
+	size_t expected = 0;
+	rc = sqlite3_prepare_v2(db, "SELECT value FROM info WHERE property = 'gravity_count';", -1, &stmt, NULL);
+	if(rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) > 0)
+		expected = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+
+	set->size = 1024;
+	while(set->size < 2*expected)
+		set->size *= 2;
+	set->table = calloc(set->size, sizeof(gravitySetEntry));
+	if(set->table == NULL)
+	{
+		logg("set_build(): Failed to allocate memory");
+		goto failure;
+	}
+
+	// Domains of adlists that are not assigned to any group are never
+	// matched by the per-client statements, so we skip them here as well
+	rc = sqlite3_prepare_v2(db, "SELECT domain, group_id FROM vw_gravity WHERE group_id IS NOT NULL;", -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("set_build(): SQL error prepare (gravity): %s", sqlite3_errstr(rc));
+		goto failure;
+	}
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		const char *domain = (const char*)sqlite3_column_text(stmt, 0);
+		const int bit = group_bit(set, sqlite3_column_int(stmt, 1));
+		if(domain == NULL || bit < 0)
+			continue;
+
+		if(2*(set->count + 1) > set->size && !set_grow(set))
+		{
+			logg("set_build(): Failed to allocate memory");
+			goto failure;
+		}
+
+		// ABP-style entries are stored by their (backwards) domain
+		const size_t len = strlen(domain);
+		if(len > 3 && domain[0] == '|' && domain[1] == '|' && domain[len-1] == '^')
+		{
+			const size_t count = set->count;
+			set_insert(set, abp_hash(domain + 2, len - 3), 1ULL << bit);
+			set->abp_count += set->count - count;
+		}
+		else
+			set_insert(set, gravity_set_hash(domain), 1ULL << bit);
+	}
+	if(rc != SQLITE_DONE)
+	{
+		logg("set_build(): SQL error step (gravity): %s", sqlite3_errstr(rc));
+		goto failure;
+	}
+	sqlite3_finalize(stmt);
+
+	return set;
+
+failure:
+	sqlite3_finalize(stmt);
+	set_free(set);
+	return NULL;
+}
+
+// Get the name of the compiled gravity set belonging to a database file
+static char *set_filename(const char *dbfile)
+{
+	char *filename = NULL;
+	if(asprintf(&filename, "%s.idx", dbfile) < 0)
+		return NULL;
+	return filename;
+}
+
+// Load the gravity set. A compiled set next to the database is mapped if it
+// matches the database, otherwise, the set is built in memory. This uses its
+// own read-only database connection so it can run without holding the SHM
+// lock while the DNS resolver continues to use the existing connection.
+// Returns NULL if the set is disabled or could not be loaded, we fall back to
+// database lookups in this case
+gravity_set *gravity_set_load(void)
+{
+	if(!config.gravity_in_memory)
+		return NULL;
+
+	sqlite3 *db = NULL;
+	int rc = sqlite3_open_v2(FTLfiles.gravity_db, &db, SQLITE_OPEN_READONLY, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("gravity_set_load(): Cannot open database: %s", sqlite3_errstr(rc));
+		sqlite3_close(db);
+		return NULL;
+	}
+	sqlite3_busy_timeout(db, 1000);
+
+	// Try to use the compiled gravity set
+	uint64_t fingerprint = 0;
+	char *filename = set_filename(FTLfiles.gravity_db);
+	if(filename != NULL && db_fingerprint(db, &fingerprint))
+	{
+		gravity_set *set = set_map(filename, fingerprint);
+		if(set != NULL)
+		{
+			logg("Mapped %zu gravity domains from %s", set->count, filename);
+			free(filename);
+			sqlite3_close(db);
+			return set;
+		}
+	}
+	free(filename);
+
+	// Build set in memory
+	gravity_set *set = set_build(db);
+	sqlite3_close(db);
+	if(set == NULL)
+		return NULL;
+
+	char prefix[2] = { 0 };
+	double formatted = 0.0;
+	format_memory_size(prefix, set->size * sizeof(gravitySetEntry), &formatted);
+	logg("Loaded %zu gravity domains into memory (%.1f %sB)", set->count, formatted, prefix);
+
+	return set;
+}
+
+// Compile the gravity set of a database into a file that can be mapped by
+// gravity_set_load(). The file is written atomically (write + rename)
+bool gravity_set_compile(const char *dbfile, size_t *count)
+{
+	sqlite3 *db = NULL;
+	if(sqlite3_open_v2(dbfile, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+	{
+		sqlite3_close(db);
+		return false;
+	}
+
+	uint64_t fingerprint = 0;
+	gravity_set *set = NULL;
+	if(!db_fingerprint(db, &fingerprint) || (set = set_build(db)) == NULL)
+	{
+		sqlite3_close(db);
+		return false;
+	}
+	sqlite3_close(db);
+
+	gravitySetHeader header = { .byteorder = GRAVITY_SET_BYTEORDER };
+	memcpy(header.magic, GRAVITY_SET_MAGIC, sizeof(header.magic));
+	header.num_groups = set->num_groups;
+	header.fingerprint = fingerprint;
+	header.size = set->size;
+	header.count = set->count;
+	header.abp_count = set->abp_count;
+	for(unsigned int i = 0; i < set->num_groups; i++)
+		header.group_ids[i] = set->group_ids[i];
+
+	char *filename = set_filename(dbfile);
+	char *tmpname = NULL;
+	if(filename == NULL || asprintf(&tmpname, "%s.tmp", filename) < 0)
+	{
+		free(filename);
+		set_free(set);
+		return false;
+	}
+
+	FILE *fp = fopen(tmpname, "w");
+	bool success = fp != NULL &&
+	               fwrite(&header, sizeof(header), 1, fp) == 1 &&
+	               fwrite(set->table, sizeof(gravitySetEntry), set->size, fp) == set->size;
+	if(fp != NULL && fclose(fp) != 0)
+		success = false;
+	if(success && rename(tmpname, filename) != 0)
+		success = false;
+	if(!success)
+		unlink(tmpname);
+
+	*count = set->count;
+	free(tmpname);
+	free(filename);
+	set_free(set);
+	return success;
+}
+
+// Replace the active set by a new one (may be NULL). Has to be called while
+// holding the SHM lock so no lookup is using the old set
+void gravity_set_install(gravity_set *set)
+{
+	set_free(active_set);
+	active_set = set;
+}
+
+// Translate the comma-separated list of group IDs of a client into a bit
+// mask. Returns false if there is no gravity set
+bool gravity_set_client_mask(const char *groups, uint64_t *mask)
+{
+	if(active_set == NULL)
+		return false;
+
+	*mask = 0;
+	const char *p = groups;
+	while(p != NULL && *p != '\0')
+	{
+		char *end = NULL;
+		const long group_id = strtol(p, &end, 10);
+		if(end == p)
+			break;
+
+		const int bit = group_bit(active_set, (int)group_id);
+		if(bit >= 0)
+			*mask |= 1ULL << bit;
+
+		// Skip separator
+		p = *end == ',' ? end + 1 : end;
+	}
+
+	return true;
+}
+
+// Get the group mask of a hash, zero if the hash is not in the set
+static uint64_t __attribute__((pure)) set_groups(const gravity_set *set, const uint64_t hash)
+{
+	const size_t tablemask = set->size - 1;
+	for(size_t i = hash & tablemask; ; i = (i + 1) & tablemask)
+	{
+		const gravitySetEntry *entry = &set->table[i];
+		if(entry->hash == hash)
+			return entry->groups;
+		else if(entry->hash == 0)
+			return 0;
+	}
+}
+
+// Check if a domain is on gravity for any of the groups in the mask
+enum db_result gravity_set_lookup(const char *domain, const uint64_t mask)
+{
+	if(active_set == NULL)
+		return LIST_NOT_AVAILABLE;
+
+	return (set_groups(active_set, gravity_set_hash(domain)) & mask) ? FOUND : NOT_FOUND;
+}
+
+// Check if the domain or any of its parent domains is on gravity as ABP-style
+// entry for any of the groups in the mask. The domain is walked from right to
+// left, its parent domains are checked starting at the TLD
+enum db_result gravity_set_lookup_abp(const char *domain, const uint64_t mask)
+{
+	if(active_set == NULL)
+		return LIST_NOT_AVAILABLE;
+	if(active_set->abp_count == 0)
+		return NOT_FOUND;
+
+	uint64_t hash = ABP_HASH_BASIS;
+	for(size_t i = strlen(domain); i > 0; i--)
+	{
+		// Check parent domain right of this dot
+		if(domain[i-1] == '.' &&
+		   set_groups(active_set, abp_hash_final(hash)) & mask)
+			return FOUND;
+
+		hash = abp_hash_step(hash, domain[i-1]);
+	}
+
+	// Check the full domain
+	return (set_groups(active_set, abp_hash_final(hash)) & mask) ? FOUND : NOT_FOUND;
+}
@@ -0,0 +1,36 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  In-memory gravity domain set prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef GRAVITY_SET_H
+#define GRAVITY_SET_H
+
+#include <stdint.h>
+#include <stdbool.h>
+// enum db_result
+#include "../enums.h"
+
+// Maximum number of groups that can be represented in the group masks
+#define GRAVITY_SET_MAX_GROUPS 64
+
+typedef struct {
+	uint64_t hash;
+	uint64_t groups;
+} gravitySetEntry;
+
+typedef struct gravity_set gravity_set;
+
+gravity_set *gravity_set_load(void);
+bool gravity_set_compile(const char *dbfile, size_t *count);
+void gravity_set_install(gravity_set *set);
+bool gravity_set_client_mask(const char *groups, uint64_t *mask);
+enum db_result gravity_set_lookup(const char *domain, const uint64_t mask) __attribute__((pure));
+enum db_result gravity_set_lookup_abp(const char *domain, const uint64_t mask) __attribute__((pure));
+uint64_t gravity_set_hash(const char *domain) __attribute__((pure));
+
+#endif //GRAVITY_SET_H
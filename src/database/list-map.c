@@ -0,0 +1,235 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  In-memory exact domain lists
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "../FTL.h"
+// public prototypes
+#include "list-map.h"
+// gravity_set_hash(), GRAVITY_SET_MAX_GROUPS
+#include "gravity-set.h"
+// struct config
+#include "../config.h"
+// logg()
+#include "../log.h"
+
+// The exact white- and blacklist are small but consulted for every domain
+// not yet known to the DNS cache. Their maps store the hash of every enabled
+// domain together with its database ID and a bit mask of the groups it is
+// enabled for. Like the gravity set, the maps are process-private and
+// inherited by forks (copy-on-write)
+typedef struct {
+	uint64_t hash;
+	uint64_t groups;
+	int id;
+} listMapEntry;
+
+struct list_map {
+	// Open addressing hash table, size is a power of two
+	listMapEntry *table;
+	size_t size;
+	size_t count;
+	// Group IDs represented by the bits of the masks (sorted)
+	unsigned int num_groups;
+	int group_ids[GRAVITY_SET_MAX_GROUPS];
+};
+
+// Get the bit representing a group ID, -1 if this group is unknown
+static int __attribute__((pure)) group_bit(const list_map *map, const int group_id)
+{
+	// Binary search in sorted list of group IDs
+	int low = 0, high = (int)map->num_groups - 1;
+	while(low <= high)
+	{
+		const int mid = (low + high) / 2;
+		if(map->group_ids[mid] == group_id)
+			return mid;
+		else if(map->group_ids[mid] < group_id)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+	return -1;
+}
+
+// Add a domain/group pair to the map. The table is large enough
+static void map_insert(list_map *map, const uint64_t hash, const uint64_t groups, const int id)
+{
+	const size_t mask = map->size - 1;
+	for(size_t i = hash & mask; ; i = (i + 1) & mask)
+	{
+		listMapEntry *entry = &map->table[i];
+		if(entry->hash == hash)
+		{
+			// Domain is enabled for more than one group
+			entry->groups |= groups;
+			return;
+		}
+		else if(entry->hash == 0)
+		{
+			entry->hash = hash;
+			entry->groups = groups;
+			entry->id = id;
+			map->count++;
+			return;
+		}
+	}
+}
+
+// Build the map of an exact list from its view (vw_whitelist or vw_blacklist).
+// Returns NULL if the map cannot be built, e.g., if there are more groups than
+// can be represented in the masks. Lookups use the database in this case
+list_map *list_map_build(sqlite3 *db, const char *table)
+{
+	sqlite3_stmt *stmt = NULL;
+	char *querystr = NULL;
+	list_map *map = calloc(1, sizeof(list_map));
+	if(map == NULL)
+		return NULL;
+
+	// Get group IDs
+	int rc = sqlite3_prepare_v2(db, "SELECT id FROM \"group\" ORDER BY id;", -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("list_map_build(%s): SQL error prepare (groups): %s", table, sqlite3_errstr(rc));
+		goto failure;
+	}
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		if(map->num_groups >= GRAVITY_SET_MAX_GROUPS)
+		{
+			logg("More than %d groups defined, using database lookups for %s",
+			     GRAVITY_SET_MAX_GROUPS, table);
+			goto failure;
+		}
+		map->group_ids[map->num_groups++] = sqlite3_column_int(stmt, 0);
+	}
+	if(rc != SQLITE_DONE)
+	{
+		logg("list_map_build(%s): SQL error step (groups): %s", table, sqlite3_errstr(rc));
+		goto failure;
+	}
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+
+	// Domains that are not assigned to any group are never matched by the
+	// per-client statements, so we skip them here as well
+	if(asprintf(&querystr, "SELECT domain, id, group_id FROM %s WHERE group_id IS NOT NULL;", table) < 0)
+		goto failure;
+	rc = sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL);
+	free(querystr);
+	if(rc != SQLITE_OK)
+	{
+		logg("list_map_build(%s): SQL error prepare: %s", table, sqlite3_errstr(rc));
+		goto failure;
+	}
+
+	// The table is kept at most half-full to keep the probe sequences short
+	map->size = 64;
+	map->table = calloc(map->size, sizeof(listMapEntry));
+	if(map->table == NULL)
+		goto failure;
+
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		const char *domain = (const char*)sqlite3_column_text(stmt, 0);
+		const int bit = group_bit(map, sqlite3_column_int(stmt, 2));
+		if(domain == NULL || bit < 0)
+			continue;
+
+		if(2*(map->count + 1) > map->size)
+		{
+			// Double the size of the hash table
+			listMapEntry *old = map->table;
+			const size_t oldsize = map->size;
+			map->table = calloc(2*oldsize, sizeof(listMapEntry));
+			if(map->table == NULL)
+			{
+				map->table = old;
+				logg("list_map_build(%s): Failed to allocate memory", table);
+				goto failure;
+			}
+			map->size = 2*oldsize;
+			map->count = 0;
+			for(size_t i = 0; i < oldsize; i++)
+				if(old[i].hash != 0)
+					map_insert(map, old[i].hash, old[i].groups, old[i].id);
+			free(old);
+		}
+
+		map_insert(map, gravity_set_hash(domain), 1ULL << bit, sqlite3_column_int(stmt, 1));
+	}
+	if(rc != SQLITE_DONE)
+	{
+		logg("list_map_build(%s): SQL error step: %s", table, sqlite3_errstr(rc));
+		goto failure;
+	}
+	sqlite3_finalize(stmt);
+
+	if(config.debug & DEBUG_DATABASE)
+		logg("list_map_build(%s): %zu domains in %zu slots", table, map->count, map->size);
+
+	return map;
+
+failure:
+	sqlite3_finalize(stmt);
+	list_map_free(&map);
+	return NULL;
+}
+
+void list_map_free(list_map **map)
+{
+	if(*map == NULL)
+		return;
+	free((*map)->table);
+	free(*map);
+	*map = NULL;
+}
+
+// Check if a domain is on the list for any of the groups given as
+// comma-separated list of group IDs. The database ID of the matching entry is
+// stored in domain_id (-1 if not found)
+enum db_result list_map_lookup(const list_map *map, const char *domain, const char *groups, int *domain_id)
+{
+	*domain_id = -1;
+
+	// Translate the groups of the client into a bit mask
+	uint64_t mask = 0;
+	const char *p = groups;
+	while(p != NULL && *p != '\0')
+	{
+		char *end = NULL;
+		const long group_id = strtol(p, &end, 10);
+		if(end == p)
+			break;
+
+		const int bit = group_bit(map, (int)group_id);
+		if(bit >= 0)
+			mask |= 1ULL << bit;
+
+		// Skip separator
+		p = *end == ',' ? end + 1 : end;
+	}
+
+	const uint64_t hash = gravity_set_hash(domain);
+	const size_t tablemask = map->size - 1;
+	for(size_t i = hash & tablemask; ; i = (i + 1) & tablemask)
+	{
+		const listMapEntry *entry = &map->table[i];
+		if(entry->hash == 0)
+			return NOT_FOUND;
+		else if(entry->hash != hash)
+			continue;
+
+		if(!(entry->groups & mask))
+			return NOT_FOUND;
+
+		*domain_id = entry->id;
+		return FOUND;
+	}
+}
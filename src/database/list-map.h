@@ -0,0 +1,25 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  In-memory exact domain list prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef LIST_MAP_H
+#define LIST_MAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sqlite3.h"
+// enum db_result
+#include "../enums.h"
+
+typedef struct list_map list_map;
+
+list_map *list_map_build(sqlite3 *db, const char *table);
+void list_map_free(list_map **map);
+enum db_result list_map_lookup(const list_map *map, const char *domain, const char *groups, int *domain_id);
+
+#endif //LIST_MAP_H
@@ -23,8 +23,10 @@
 #include "../signals.h"
 // struct config
 #include "../config.h"
-// get_rate_limit_turnaround()
-#include "../gc.h"
+// hashStr()
+#include "../datastructure.h"
+// TIME_SCOPE()
+#include "../timers.h"
 
 static const char *message_types[MAX_MESSAGE] =
 	{ "REGEX", "SUBNET", "HOSTNAME", "DNSMASQ_CONFIG", "RATE_LIMIT", "DNSMASQ_WARN", "LOAD", "SHMEM", "DISK", "ADLIST" };
@@ -150,117 +152,154 @@ bool flush_message_table(void)
 	return true;
 }
 
-static bool add_message(const enum message_type type,
-                        const char *message, const int count,...)
+// Add occurrence counter to the message table
+bool add_message_count_column(sqlite3 *db)
 {
-	bool okay = false;
-	// Return early if database is known to be broken
-	if(FTLDBerror())
-		return false;
+	// Start transaction of database update
+	SQL_bool(db, "BEGIN TRANSACTION");
 
-	sqlite3 *db;
-	// Open database connection
-	if((db = dbopen(false)) == NULL)
+	// Number of times the message occurred since it was first stored
+	SQL_bool(db, "ALTER TABLE message ADD COLUMN count INTEGER NOT NULL DEFAULT 1;");
+
+	// Update database version to 15
+	if(!db_set_FTL_property(db, DB_VERSION, 15))
 	{
-		logg("add_message() - Failed to open DB");
+		logg("add_message_count_column(): Failed to update database version!");
 		return false;
 	}
 
+	// Finish transaction
+	SQL_bool(db, "COMMIT");
+
+	return true;
+}
+
+// Messages are not written to the database immediately. They are queued in
+// memory instead and stored by the database thread in a single transaction.
+// Repeated messages (same type and message) are only queued once, the
+// arguments of the most recent occurrence are kept and the number of
+// occurrences is added to the count column. This keeps the database off the
+// DNS path even when many messages are generated at once (e.g., rate-limiting
+// of many clients)
+#define MAX_QUEUED_MESSAGES 1024u
+#define MAX_MESSAGE_ARGS 5
+typedef struct {
+	enum message_type type;
+	uint32_t hash;
+	unsigned int count;
+	time_t timestamp;
+	char *message;
+	struct {
+		unsigned char type;
+		int i;
+		double d;
+		char *s;
+	} arg[MAX_MESSAGE_ARGS];
+} queuedMessage;
+
+static struct {
+	queuedMessage *msg;
+	unsigned int num, size;
+	unsigned int dropped;
+} message_queue = { NULL, 0u, 0u, 0u };
+static pthread_mutex_t message_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_queued_message(queuedMessage *msg)
+{
+	if(msg->message != NULL)
+		free(msg->message);
+	for(unsigned int j = 0u; j < MAX_MESSAGE_ARGS; j++)
+		if(msg->arg[j].s != NULL)
+			free(msg->arg[j].s);
+	memset(msg, 0, sizeof(*msg));
+}
+
+// Store one message in the database. Possibly existing messages of the same
+// type and content are replaced, their count is carried over
+static bool store_message(sqlite3 *db, const queuedMessage *msg)
+{
 	// Ensure there are no duplicates when adding messages
 	sqlite3_stmt* stmt = NULL;
-	const char *querystr = "DELETE FROM message WHERE type = ?1 AND message = ?2";
+	const char *querystr = "SELECT SUM(count) FROM message WHERE type = ?1 AND message = ?2";
 	int rc = sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL);
 	if( rc != SQLITE_OK ){
-		logg("add_message(type=%u, message=%s) - SQL error prepare DELETE: %s",
-			type, message, sqlite3_errstr(rc));
-		goto end_of_add_message;
+		logg("add_message(type=%u, message=%s) - SQL error prepare SELECT: %s",
+			msg->type, msg->message, sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		return false;
 	}
-
-	// Bind type to prepared statement
-	if((rc = sqlite3_bind_text(stmt, 1, message_types[type], -1, SQLITE_STATIC)) != SQLITE_OK)
+	sqlite3_bind_text(stmt, 1, message_types[msg->type], -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, msg->message, -1, SQLITE_STATIC);
+	sqlite3_int64 count = msg->count;
+	if((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+		count += sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+	if(rc != SQLITE_ROW && rc != SQLITE_DONE)
 	{
-		logg("add_message(type=%u, message=%s) - Failed to bind type DELETE: %s",
-			type, message, sqlite3_errstr(rc));
-		sqlite3_reset(stmt);
-		sqlite3_finalize(stmt);
-		goto end_of_add_message;
+		logg("add_message(type=%u, message=%s) - SQL error step SELECT: %s",
+			msg->type, msg->message, sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		return false;
 	}
 
-	// Bind message to prepared statement
-	if((rc = sqlite3_bind_text(stmt, 2, message, -1, SQLITE_STATIC)) != SQLITE_OK)
-	{
-		logg("add_message(type=%u, message=%s) - Failed to bind message DELETE: %s",
-			type, message, sqlite3_errstr(rc));
-		sqlite3_reset(stmt);
-		sqlite3_finalize(stmt);
-		goto end_of_add_message;
+	querystr = "DELETE FROM message WHERE type = ?1 AND message = ?2";
+	rc = sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL);
+	if( rc != SQLITE_OK ){
+		logg("add_message(type=%u, message=%s) - SQL error prepare DELETE: %s",
+			msg->type, msg->message, sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		return false;
 	}
-
-	// Execute and finalize
-	if((rc = sqlite3_step(stmt)) != SQLITE_OK && rc != SQLITE_DONE)
+	sqlite3_bind_text(stmt, 1, message_types[msg->type], -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, msg->message, -1, SQLITE_STATIC);
+	rc = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+	if(rc != SQLITE_DONE)
 	{
 		logg("add_message(type=%u, message=%s) - SQL error step DELETE: %s",
-			type, message, sqlite3_errstr(rc));
-		goto end_of_add_message;
+			msg->type, msg->message, sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		return false;
 	}
-	sqlite3_clear_bindings(stmt);
-	sqlite3_reset(stmt);
-	sqlite3_finalize(stmt);
-	stmt = NULL;
 
 	// Prepare SQLite statement
-	querystr = "INSERT INTO message (timestamp,type,message,blob1,blob2,blob3,blob4,blob5) "
-	           "VALUES ((cast(strftime('%s', 'now') as int)),?,?,?,?,?,?,?);";
+	querystr = "INSERT INTO message (timestamp,type,message,blob1,blob2,blob3,blob4,blob5,count) "
+	           "VALUES (?,?,?,?,?,?,?,?,?);";
 	rc = sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL);
 	if( rc != SQLITE_OK )
 	{
 		logg("add_message(type=%u, message=%s) - SQL error prepare: %s",
-		     type, message, sqlite3_errstr(rc));
-		goto end_of_add_message;
-	}
-
-	// Bind type to prepared statement
-	if((rc = sqlite3_bind_text(stmt, 1, message_types[type], -1, SQLITE_STATIC)) != SQLITE_OK)
-	{
-		logg("add_message(type=%u, message=%s) - Failed to bind type: %s",
-		     type, message, sqlite3_errstr(rc));
-		sqlite3_reset(stmt);
-		sqlite3_finalize(stmt);
-		goto end_of_add_message;
+		     msg->type, msg->message, sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		return false;
 	}
 
-	// Bind message to prepared statement
-	if((rc = sqlite3_bind_text(stmt, 2, message, -1, SQLITE_STATIC)) != SQLITE_OK)
-	{
-		logg("add_message(type=%u, message=%s) - Failed to bind message: %s",
-		     type, message, sqlite3_errstr(rc));
-		sqlite3_reset(stmt);
-		sqlite3_finalize(stmt);
-		goto end_of_add_message;
-	}
+	// Bind timestamp, type and message to prepared statement
+	sqlite3_bind_int64(stmt, 1, msg->timestamp);
+	sqlite3_bind_text(stmt, 2, message_types[msg->type], -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, msg->message, -1, SQLITE_STATIC);
 
-	va_list ap;
-	va_start(ap, count);
-	for (int j = 0; j < count; j++)
+	for (unsigned int j = 0u; j < MAX_MESSAGE_ARGS; j++)
 	{
-		const unsigned char datatype = message_blob_types[type][j];
-		switch (datatype)
+		switch (msg->arg[j].type)
 		{
 			case SQLITE_INTEGER:
-				rc = sqlite3_bind_int(stmt, 3 + j, va_arg(ap, int));
+				rc = sqlite3_bind_int(stmt, 4 + j, msg->arg[j].i);
 				break;
 
 			case SQLITE_FLOAT:
-				rc = sqlite3_bind_double(stmt, 3 + j, va_arg(ap, double));
+				rc = sqlite3_bind_double(stmt, 4 + j, msg->arg[j].d);
 				break;
 
 			case SQLITE_TEXT:
-				rc = sqlite3_bind_text(stmt, 3 + j, va_arg(ap, char*), -1, SQLITE_STATIC);
+				rc = sqlite3_bind_text(stmt, 4 + j, msg->arg[j].s, -1, SQLITE_STATIC);
 				break;
 
 			case SQLITE_NULL: /* Fall through */
 			default:
-				rc = sqlite3_bind_null(stmt, 3 + j);
+				rc = sqlite3_bind_null(stmt, 4 + j);
 				break;
 		}
 
@@ -268,34 +307,217 @@ static bool add_message(const enum message_type type,
 		if(rc != SQLITE_OK)
 		{
 			logg("add_message(type=%u, message=%s) - Failed to bind argument %u (type %u): %s",
-			     type, message, 3 + j, datatype, sqlite3_errstr(rc));
-			sqlite3_reset(stmt);
+			     msg->type, msg->message, 4 + j, msg->arg[j].type, sqlite3_errstr(rc));
 			sqlite3_finalize(stmt);
 			checkFTLDBrc(rc);
-			va_end(ap);
-			goto end_of_add_message;
+			return false;
 		}
 	}
-	va_end(ap);
+	sqlite3_bind_int64(stmt, 9, count);
 
 	// Step and check if successful
 	rc = sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
 
 	if(rc != SQLITE_DONE)
 	{
 		logg("Encountered error while trying to store message in long-term database: %s", sqlite3_errstr(rc));
 		checkFTLDBrc(rc);
-		goto end_of_add_message;
+		return false;
 	}
 
-	// Final database handling
-	sqlite3_clear_bindings(stmt);
-	sqlite3_reset(stmt);
-	sqlite3_finalize(stmt);
-	okay = true;
+	return true;
+}
 
-end_of_add_message: // Close database connection
-	dbclose(&db);
+bool have_queued_messages(void)
+{
+	pthread_mutex_lock(&message_queue_lock);
+	const bool pending = message_queue.num > 0u;
+	pthread_mutex_unlock(&message_queue_lock);
+	return pending;
+}
+
+// Store all queued messages in the database in one transaction. The database
+// is opened (and closed afterwards) if db is NULL. Returns the number of
+// stored messages or -1 on error
+int store_queued_messages(sqlite3 *db)
+{
+	TIME_SCOPE("messages_store");
+
+	// Take over the current queue so new messages can be queued while we
+	// are writing to the database
+	pthread_mutex_lock(&message_queue_lock);
+	queuedMessage *msg = message_queue.msg;
+	const unsigned int num = message_queue.num;
+	const unsigned int dropped = message_queue.dropped;
+	message_queue.msg = NULL;
+	message_queue.num = message_queue.size = message_queue.dropped = 0u;
+	pthread_mutex_unlock(&message_queue_lock);
+
+	if(num == 0u)
+	{
+		if(msg != NULL)
+			free(msg);
+		return 0;
+	}
+
+	if(dropped > 0u)
+		logg("WARNING: Message queue was full, dropped %u message%s",
+		     dropped, dropped == 1u ? "" : "s");
+
+	int stored = -1;
+	bool db_opened = false;
+	// Return early if database is known to be broken
+	if(FTLDBerror())
+		goto end_of_store_queued_messages;
+
+	// Open database connection if needed
+	if(db == NULL)
+	{
+		if((db = dbopen(false)) == NULL)
+		{
+			logg("store_queued_messages() - Failed to open DB");
+			goto end_of_store_queued_messages;
+		}
+		db_opened = true;
+	}
+
+	if(dbquery(db, "BEGIN TRANSACTION IMMEDIATE") != SQLITE_OK)
+		goto end_of_store_queued_messages;
+
+	stored = 0;
+	for(unsigned int i = 0u; i < num; i++)
+	{
+		if(!store_message(db, &msg[i]))
+		{
+			stored = -1;
+			break;
+		}
+		stored++;
+	}
+
+	if(dbquery(db, stored < 0 ? "ROLLBACK" : "END TRANSACTION") != SQLITE_OK)
+		stored = -1;
+
+	if(config.debug & DEBUG_DATABASE)
+		logg("Stored %d of %u queued message%s in the database",
+		     stored, num, num == 1u ? "" : "s");
+
+end_of_store_queued_messages:
+	if(db_opened)
+		dbclose(&db);
+
+	for(unsigned int i = 0u; i < num; i++)
+		free_queued_message(&msg[i]);
+	free(msg);
+
+	return stored;
+}
+
+static bool add_message(const enum message_type type,
+                        const char *message, const int count,...)
+{
+	// Return early if database is known to be broken
+	if(FTLDBerror())
+		return false;
+
+	queuedMessage new = { 0 };
+	new.type = type;
+	new.hash = hashStr(message);
+	new.count = 1u;
+	new.timestamp = time(NULL);
+	new.message = strdup(message);
+
+	va_list ap;
+	va_start(ap, count);
+	for (int j = 0; j < count && j < (int)MAX_MESSAGE_ARGS; j++)
+	{
+		const unsigned char datatype = message_blob_types[type][j];
+		new.arg[j].type = datatype;
+		switch (datatype)
+		{
+			case SQLITE_INTEGER:
+				new.arg[j].i = va_arg(ap, int);
+				break;
+
+			case SQLITE_FLOAT:
+				new.arg[j].d = va_arg(ap, double);
+				break;
+
+			case SQLITE_TEXT:
+			{
+				const char *s = va_arg(ap, char*);
+				new.arg[j].s = s != NULL ? strdup(s) : NULL;
+				break;
+			}
+
+			case SQLITE_NULL: /* Fall through */
+			default:
+				break;
+		}
+	}
+	va_end(ap);
+
+	// TCP workers are forked processes and cannot hand messages over to the
+	// database thread of the main process, they store them immediately
+	if(getpid() != main_pid())
+	{
+		bool okay = false;
+		sqlite3 *db = dbopen(false);
+		if(db != NULL)
+		{
+			okay = store_message(db, &new);
+			dbclose(&db);
+		}
+		else
+			logg("add_message() - Failed to open DB");
+		free_queued_message(&new);
+		return okay;
+	}
+
+	pthread_mutex_lock(&message_queue_lock);
+
+	// Merge with already queued message of the same type and content
+	for(unsigned int i = 0u; i < message_queue.num; i++)
+	{
+		queuedMessage *msg = &message_queue.msg[i];
+		if(msg->type != type || msg->hash != new.hash || strcmp(msg->message, message) != 0)
+			continue;
+
+		new.count += msg->count;
+		free_queued_message(msg);
+		*msg = new;
+		pthread_mutex_unlock(&message_queue_lock);
+		return true;
+	}
+
+	// Append new message, grow queue if needed
+	bool okay = false;
+	if(message_queue.num >= MAX_QUEUED_MESSAGES)
+		message_queue.dropped++;
+	else
+	{
+		if(message_queue.num >= message_queue.size)
+		{
+			const unsigned int size = message_queue.size > 0u ? 2u*message_queue.size : 16u;
+			queuedMessage *msg = realloc(message_queue.msg, size*sizeof(*msg));
+			if(msg != NULL)
+			{
+				message_queue.msg = msg;
+				message_queue.size = size;
+			}
+		}
+		if(message_queue.num < message_queue.size)
+		{
+			message_queue.msg[message_queue.num++] = new;
+			okay = true;
+		}
+	}
+
+	pthread_mutex_unlock(&message_queue_lock);
+
+	if(!okay)
+		free_queued_message(&new);
 
 	return okay;
 }
@@ -351,21 +573,22 @@ void logg_fatal_dnsmasq_message(const char *message)
 	// Log to database
 	add_message(DNSMASQ_CONFIG_MESSAGE, message, 0);
 
+	// The database thread will not get a chance to store the message
+	store_queued_messages(NULL);
+
 	// FTL will dies after this point, so we should make sure to clean up
 	// behind ourselves
 	cleanup(EXIT_FAILURE);
 }
 
-void logg_rate_limit_message(const char *clientIP, const unsigned int rate_limit_count)
+void logg_rate_limit_message(const char *clientIP, const unsigned int count, const time_t turnaround)
 {
-	const time_t turnaround = get_rate_limit_turnaround(rate_limit_count);
-
 	// Log to FTL.log
 	logg("Rate-limiting %s for at least %ld second%s",
 	     clientIP, turnaround, turnaround == 1 ? "" : "s");
 
 	// Log to database
-	add_message(RATE_LIMIT_MESSAGE, clientIP, 2, config.rate_limit.count, config.rate_limit.interval);
+	add_message(RATE_LIMIT_MESSAGE, clientIP, 2, count, config.rate_limit.interval);
 }
 
 void logg_warn_dnsmasq_message(char *message)
@@ -14,13 +14,16 @@
 
 bool create_message_table(sqlite3 *db);
 bool flush_message_table(void);
+bool add_message_count_column(sqlite3 *db);
+bool have_queued_messages(void);
+int store_queued_messages(sqlite3 *db);
 void logg_regex_warning(const char *type, const char *warning, const int dbindex, const char *regex);
 void logg_subnet_warning(const char *ip, const int matching_count, const char *matching_ids,
                          const int matching_bits, const char *chosen_match_text,
                          const int chosen_match_id);
 void logg_hostname_warning(const char *ip, const char *name, const unsigned int pos);
 void logg_fatal_dnsmasq_message(const char *message);
-void logg_rate_limit_message(const char *clientIP, const unsigned int rate_limit_count);
+void logg_rate_limit_message(const char *clientIP, const unsigned int count, const time_t turnaround);
 void logg_warn_dnsmasq_message(char *message);
 void log_resource_shortage(const double load, const int nprocs, const int shmem, const int disk, const char *path, const char *msg);
 void logg_inaccessible_adlist(const int dbindex, const char *address);
@@ -21,6 +21,12 @@
 #include "../resolve.h"
 // killed
 #include "../signals.h"
+// RTM_GETNEIGH
+#include <linux/rtnetlink.h>
+// if_indextoname()
+#include <net/if.h>
+// db_latency_register()
+#include "dblatency.h"
 
 // Private prototypes
 static char *getMACVendor(const char *hwaddr) __attribute__ ((malloc));
@@ -195,49 +201,6 @@ bool create_network_addresses_with_names_table(sqlite3 *db)
 	return true;
 }
 
-// Try to find device by recent usage of this IP address
-static int find_device_by_recent_ip(sqlite3 *db, const char *ipaddr)
-{
-	// Return early if database is known to be broken
-	if(FTLDBerror())
-		return -1;
-
-	char *querystr = NULL;
-	int ret = asprintf(&querystr,
-	                   "SELECT network_id FROM network_addresses "
-	                   "WHERE ip = \'%s\' AND "
-	                   "lastSeen > (cast(strftime('%%s', 'now') as int)-86400) "
-	                   "ORDER BY lastSeen DESC LIMIT 1;", ipaddr);
-	if(querystr == NULL || ret < 0)
-	{
-		logg("Memory allocation failed in find_device_by_recent_ip(\"%s\"): %i",
-		     ipaddr, ret);
-		return -1;
-	}
-
-	// Perform SQL query
-	int network_id = db_query_int(db, querystr);
-	free(querystr);
-	querystr = NULL;
-
-	if(network_id == DB_FAILED)
-	{
-		// SQLite error
-		return -1;
-	}
-	else if(network_id == DB_NODATA)
-	{
-		// No result found
-		return -1;
-	}
-
-	if(config.debug & DEBUG_ARP)
-		logg("APR: Identified device %s using most recently used IP address", ipaddr);
-
-	// Found network_id
-	return network_id;
-}
-
 // Try to find device by mock hardware address (generated from IP address)
 static int find_device_by_mock_hwaddr(sqlite3 *db, const char *ipaddr)
 {
@@ -758,6 +721,399 @@ static int update_netDB_interface(sqlite3 *db, const int network_id, const char
 	return SQLITE_OK;
 }
 
+// In-memory copy of the network and network_addresses tables. It is loaded
+// once at the beginning of add_FTL_clients_to_network_table() so identifying
+// FTL's clients needs no SQL queries at all and only rows that actually
+// changed are written back using prepared statements that are reused for
+// all clients
+struct netdb_device {
+	int id;
+	time_t lastQuery;
+	char *hwaddr;
+	char *iface;
+};
+
+struct netdb_address {
+	int network_id;
+	time_t lastSeen;
+	char *ip;
+};
+
+struct netdb_map {
+	// Devices are sorted by ID, byhwaddr holds their indices sorted by
+	// hardware address (case-insensitive)
+	struct netdb_device *devices;
+	unsigned int *byhwaddr;
+	unsigned int num_devices, size_devices;
+	// Addresses are sorted by IP address
+	struct netdb_address *addresses;
+	unsigned int num_addresses, size_addresses;
+	// Prepared statements reused for all clients
+	sqlite3_stmt *counters_stmt;
+	sqlite3_stmt *address_stmt;
+	sqlite3_stmt *interface_stmt;
+};
+
+// Find position of the first device with an ID not less than id
+static unsigned int __attribute__ ((pure)) netdb_map_id_pos(const struct netdb_map *map, const int id)
+{
+	unsigned int lo = 0u, hi = map->num_devices;
+	while(lo < hi)
+	{
+		const unsigned int mid = lo + (hi - lo) / 2u;
+		if(map->devices[mid].id < id)
+			lo = mid + 1u;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Find position of the first index referencing a hardware address not less than hwaddr
+static unsigned int __attribute__ ((pure)) netdb_map_hwaddr_pos(const struct netdb_map *map, const char *hwaddr)
+{
+	unsigned int lo = 0u, hi = map->num_devices;
+	while(lo < hi)
+	{
+		const unsigned int mid = lo + (hi - lo) / 2u;
+		if(strcasecmp(map->devices[map->byhwaddr[mid]].hwaddr, hwaddr) < 0)
+			lo = mid + 1u;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Find position of the first address not less than ip
+static unsigned int __attribute__ ((pure)) netdb_map_ip_pos(const struct netdb_map *map, const char *ip)
+{
+	unsigned int lo = 0u, hi = map->num_addresses;
+	while(lo < hi)
+	{
+		const unsigned int mid = lo + (hi - lo) / 2u;
+		if(strcmp(map->addresses[mid].ip, ip) < 0)
+			lo = mid + 1u;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static struct netdb_device __attribute__ ((pure)) *netdb_map_get_device(struct netdb_map *map, const int id)
+{
+	const unsigned int pos = netdb_map_id_pos(map, id);
+	if(pos < map->num_devices && map->devices[pos].id == id)
+		return &map->devices[pos];
+	return NULL;
+}
+
+// Equivalent of "SELECT id FROM network WHERE hwaddr = ? COLLATE NOCASE;"
+static int __attribute__ ((pure)) netdb_map_find_hwaddr(const struct netdb_map *map, const char *hwaddr)
+{
+	const unsigned int pos = netdb_map_hwaddr_pos(map, hwaddr);
+	if(pos < map->num_devices &&
+	   strcasecmp(map->devices[map->byhwaddr[pos]].hwaddr, hwaddr) == 0)
+		return map->devices[map->byhwaddr[pos]].id;
+	return DB_NODATA;
+}
+
+// Try to find device by recent usage of this IP address (within the last 24 hours)
+static int __attribute__ ((pure)) netdb_map_find_recent_ip(const struct netdb_map *map, const char *ip, const time_t now)
+{
+	const unsigned int pos = netdb_map_ip_pos(map, ip);
+	if(pos < map->num_addresses &&
+	   strcmp(map->addresses[pos].ip, ip) == 0 &&
+	   map->addresses[pos].lastSeen > now - 86400)
+		return map->addresses[pos].network_id;
+	return DB_NODATA;
+}
+
+static bool netdb_map_add_device(struct netdb_map *map, const int id, const char *hwaddr,
+                                 const time_t lastQuery, const char *iface)
+{
+	// Skip devices we already know
+	const unsigned int pos = netdb_map_id_pos(map, id);
+	if(pos < map->num_devices && map->devices[pos].id == id)
+		return true;
+
+	// Grow arrays if needed
+	if(map->num_devices >= map->size_devices)
+	{
+		const unsigned int size = map->size_devices > 0u ? 2u*map->size_devices : 64u;
+		struct netdb_device *devices = realloc(map->devices, size*sizeof(*devices));
+		if(devices == NULL)
+			return false;
+		map->devices = devices;
+		unsigned int *byhwaddr = realloc(map->byhwaddr, size*sizeof(*byhwaddr));
+		if(byhwaddr == NULL)
+			return false;
+		map->byhwaddr = byhwaddr;
+		map->size_devices = size;
+	}
+
+	// Insert device (new IDs are typically appended at the end)
+	memmove(&map->devices[pos+1], &map->devices[pos],
+	        (map->num_devices - pos)*sizeof(*map->devices));
+	map->devices[pos].id = id;
+	map->devices[pos].lastQuery = lastQuery;
+	map->devices[pos].hwaddr = strdup(hwaddr);
+	map->devices[pos].iface = strdup(iface != NULL ? iface : "");
+	for(unsigned int i = 0u; i < map->num_devices; i++)
+		if(map->byhwaddr[i] >= pos)
+			map->byhwaddr[i]++;
+
+	// Insert index sorted by hardware address
+	const unsigned int hpos = netdb_map_hwaddr_pos(map, hwaddr);
+	memmove(&map->byhwaddr[hpos+1], &map->byhwaddr[hpos],
+	        (map->num_devices - hpos)*sizeof(*map->byhwaddr));
+	map->byhwaddr[hpos] = pos;
+	map->num_devices++;
+
+	return true;
+}
+
+static bool netdb_map_set_address(struct netdb_map *map, const char *ip,
+                                  const int network_id, const time_t lastSeen)
+{
+	const unsigned int pos = netdb_map_ip_pos(map, ip);
+	if(pos < map->num_addresses && strcmp(map->addresses[pos].ip, ip) == 0)
+	{
+		map->addresses[pos].network_id = network_id;
+		map->addresses[pos].lastSeen = lastSeen;
+		return true;
+	}
+
+	// Grow array if needed
+	if(map->num_addresses >= map->size_addresses)
+	{
+		const unsigned int size = map->size_addresses > 0u ? 2u*map->size_addresses : 64u;
+		struct netdb_address *addresses = realloc(map->addresses, size*sizeof(*addresses));
+		if(addresses == NULL)
+			return false;
+		map->addresses = addresses;
+		map->size_addresses = size;
+	}
+
+	memmove(&map->addresses[pos+1], &map->addresses[pos],
+	        (map->num_addresses - pos)*sizeof(*map->addresses));
+	map->addresses[pos].network_id = network_id;
+	map->addresses[pos].lastSeen = lastSeen;
+	map->addresses[pos].ip = strdup(ip);
+	map->num_addresses++;
+
+	return true;
+}
+
+static void netdb_map_free(struct netdb_map *map)
+{
+	for(unsigned int i = 0u; i < map->num_devices; i++)
+	{
+		if(map->devices[i].hwaddr != NULL)
+			free(map->devices[i].hwaddr);
+		if(map->devices[i].iface != NULL)
+			free(map->devices[i].iface);
+	}
+	for(unsigned int i = 0u; i < map->num_addresses; i++)
+		if(map->addresses[i].ip != NULL)
+			free(map->addresses[i].ip);
+
+	if(map->devices != NULL)
+		free(map->devices);
+	if(map->byhwaddr != NULL)
+		free(map->byhwaddr);
+	if(map->addresses != NULL)
+		free(map->addresses);
+
+	// sqlite3_finalize() is a harmless no-op for NULL statements
+	sqlite3_finalize(map->counters_stmt);
+	sqlite3_finalize(map->address_stmt);
+	sqlite3_finalize(map->interface_stmt);
+	memset(map, 0, sizeof(*map));
+}
+
+static bool netdb_map_load(sqlite3 *db, struct netdb_map *map)
+{
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(db, "SELECT id,hwaddr,lastQuery,interface FROM network ORDER BY id;",
+	                            -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("netdb_map_load() - SQL error prepare (%i): %s", rc, sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		return false;
+	}
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		const char *hwaddr = (const char*)sqlite3_column_text(stmt, 1);
+		if(hwaddr == NULL)
+			continue;
+		if(!netdb_map_add_device(map, sqlite3_column_int(stmt, 0), hwaddr,
+		                         sqlite3_column_int64(stmt, 2),
+		                         (const char*)sqlite3_column_text(stmt, 3)))
+		{
+			sqlite3_finalize(stmt);
+			return false;
+		}
+	}
+	sqlite3_finalize(stmt);
+	if(rc != SQLITE_DONE)
+	{
+		logg("netdb_map_load() - SQL error step (%i): %s", rc, sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		return false;
+	}
+
+	rc = sqlite3_prepare_v2(db, "SELECT ip,network_id,lastSeen FROM network_addresses ORDER BY ip;",
+	                        -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("netdb_map_load() - SQL error prepare (%i): %s", rc, sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		return false;
+	}
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		const char *ip = (const char*)sqlite3_column_text(stmt, 0);
+		if(ip == NULL)
+			continue;
+		if(!netdb_map_set_address(map, ip, sqlite3_column_int(stmt, 1),
+		                          sqlite3_column_int64(stmt, 2)))
+		{
+			sqlite3_finalize(stmt);
+			return false;
+		}
+	}
+	sqlite3_finalize(stmt);
+	if(rc != SQLITE_DONE)
+	{
+		logg("netdb_map_load() - SQL error step (%i): %s", rc, sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		return false;
+	}
+
+	// Prepare statements used for writing back changes
+	const char counters_sql[] = "UPDATE network SET lastQuery = MAX(lastQuery, ?2), "
+	                                               "numQueries = numQueries + ?3 "
+	                            "WHERE id = ?1;";
+	// Add IP address record if it does not exist (INSERT). If it already
+	// exists, the UNIQUE(ip) trigger becomes active and the line is instead
+	// REPLACEd. We preserve a possibly existing IP -> host name association
+	// unless a new host name is available (?3 is not NULL)
+	const char address_sql[] = "INSERT OR REPLACE INTO network_addresses "
+	                           "(network_id,ip,lastSeen,name,nameUpdated) VALUES "
+	                           "(?1,?2,(cast(strftime('%s', 'now') as int)),"
+	                           "COALESCE(?3,(SELECT name FROM network_addresses "
+	                                        "WHERE ip = ?2)),"
+	                           "CASE WHEN ?3 IS NULL THEN "
+	                                "(SELECT nameUpdated FROM network_addresses "
+	                                        "WHERE ip = ?2) "
+	                           "ELSE (cast(strftime('%s', 'now') as int)) END);";
+	const char interface_sql[] = "UPDATE network SET interface = ?2 WHERE id = ?1;";
+	if((rc = sqlite3_prepare_v2(db, counters_sql, -1, &map->counters_stmt, NULL)) != SQLITE_OK ||
+	   (rc = sqlite3_prepare_v2(db, address_sql, -1, &map->address_stmt, NULL)) != SQLITE_OK ||
+	   (rc = sqlite3_prepare_v2(db, interface_sql, -1, &map->interface_stmt, NULL)) != SQLITE_OK)
+	{
+		logg("netdb_map_load() - SQL error prepare (%i): %s", rc, sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		return false;
+	}
+
+	if(config.debug & DEBUG_ARP)
+		logg("Network table: Loaded %u devices and %u addresses into memory",
+		     map->num_devices, map->num_addresses);
+
+	return true;
+}
+
+// Step a reusable prepared statement and reset it afterwards
+static int netdb_map_step(sqlite3_stmt *stmt, const char *func)
+{
+	if(config.debug & DEBUG_DATABASE)
+	{
+		char *sql = sqlite3_expanded_sql(stmt);
+		logg("dbquery: \"%s\"", sql != NULL ? sql : sqlite3_sql(stmt));
+		sqlite3_free(sql);
+	}
+
+	int rc = sqlite3_step(stmt);
+	if(rc == SQLITE_DONE)
+		rc = SQLITE_OK;
+	else
+	{
+		logg("%s: Failed to step (error %d): %s", func, rc, sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+	}
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	return rc;
+}
+
+// Update lastQuery and numQueries of a known device if either changed.
+// lastQuery may be zero if this client is only known from a database entry
+// but has not been seen since then (skip in this case)
+static int netdb_map_update_counters(struct netdb_map *map, const int id,
+                                     const time_t lastQuery, const unsigned int numQueries)
+{
+	struct netdb_device *device = netdb_map_get_device(map, id);
+	const bool newer = lastQuery > 0 && (device == NULL || lastQuery > device->lastQuery);
+	if(!newer && numQueries < 1)
+		return SQLITE_OK;
+
+	sqlite3_bind_int(map->counters_stmt, 1, id);
+	sqlite3_bind_int64(map->counters_stmt, 2, lastQuery);
+	sqlite3_bind_int(map->counters_stmt, 3, numQueries);
+	const int rc = netdb_map_step(map->counters_stmt, "netdb_map_update_counters()");
+	if(rc == SQLITE_OK && newer && device != NULL)
+		device->lastQuery = lastQuery;
+
+	return rc;
+}
+
+// Store IP address (and possibly the host name) of a device
+static int netdb_map_update_address(struct netdb_map *map, const int id, const char *ip,
+                                    const char *hostname, const time_t now)
+{
+	// Return early if there is nothing to be done in here
+	if(ip == NULL || strlen(ip) == 0)
+		return SQLITE_OK;
+
+	sqlite3_bind_int(map->address_stmt, 1, id);
+	sqlite3_bind_text(map->address_stmt, 2, ip, -1, SQLITE_STATIC);
+	// Skip host name if it is NULL or an empty string (= no result)
+	if(hostname != NULL && strlen(hostname) > 0)
+		sqlite3_bind_text(map->address_stmt, 3, hostname, -1, SQLITE_STATIC);
+	const int rc = netdb_map_step(map->address_stmt, "netdb_map_update_address()");
+	if(rc == SQLITE_OK && !netdb_map_set_address(map, ip, id, now))
+		return SQLITE_NOMEM;
+
+	return rc;
+}
+
+// Update interface of device if it changed
+static int netdb_map_update_interface(struct netdb_map *map, const int id, const char *iface)
+{
+	// Return early if there is nothing to be done in here
+	if(iface == NULL || strlen(iface) == 0)
+		return SQLITE_OK;
+
+	struct netdb_device *device = netdb_map_get_device(map, id);
+	if(device != NULL && device->iface != NULL && strcmp(device->iface, iface) == 0)
+		return SQLITE_OK;
+
+	sqlite3_bind_int(map->interface_stmt, 1, id);
+	sqlite3_bind_text(map->interface_stmt, 2, iface, -1, SQLITE_STATIC);
+	const int rc = netdb_map_step(map->interface_stmt, "netdb_map_update_interface()");
+	if(rc == SQLITE_OK && device != NULL)
+	{
+		if(device->iface != NULL)
+			free(device->iface);
+		device->iface = strdup(iface);
+	}
+
+	return rc;
+}
+
 // Loop over all clients known to FTL and ensure we add them all to the database
 static bool add_FTL_clients_to_network_table(sqlite3 *db, enum arp_status *client_status, time_t now,
                                              unsigned int *additional_entries, int num_clients)
@@ -766,6 +1122,14 @@ static bool add_FTL_clients_to_network_table(sqlite3 *db, enum arp_status *clien
 	if(FTLDBerror())
 		return false;
 
+	// Load network and network_addresses tables into memory
+	struct netdb_map map = { 0 };
+	if(!netdb_map_load(db, &map))
+	{
+		netdb_map_free(&map);
+		return false;
+	}
+
 	int rc = SQLITE_OK;
 	char hwaddr[128];
 	for(int clientID = 0; clientID < num_clients; clientID++)
@@ -828,12 +1192,7 @@ static bool add_FTL_clients_to_network_table(sqlite3 *db, enum arp_status *clien
 			         client->hwaddr[4], client->hwaddr[5]);
 			hwaddr[6*2+5] = '\0';
 
-			unlock_shm();
-			dbID = find_device_by_hwaddr(db, hwaddr);
-			lock_shm();
-
-			// Reacquire client pointer (if may have changed when unlocking above)
-			client = getClient(clientID, true);
+			dbID = netdb_map_find_hwaddr(&map, hwaddr);
 
 			if(config.debug & DEBUG_ARP && dbID >= 0)
 				logg("Network table: Client with MAC %s is network ID %i", hwaddr, dbID);
@@ -844,51 +1203,33 @@ static bool add_FTL_clients_to_network_table(sqlite3 *db, enum arp_status *clien
 			// Variant 2: Try to find a device using the same IP address within the last 24 hours
 			// Only try this when there is no EDNS(0) MAC address available
 			//
-			unlock_shm();
-			dbID = find_device_by_recent_ip(db, ipaddr);
-			lock_shm();
-
-			// Reacquire client pointer (if may have changed when unlocking above)
-			client = getClient(clientID, true);
+			dbID = netdb_map_find_recent_ip(&map, ipaddr, now);
 
 			if(config.debug & DEBUG_ARP && dbID >= 0)
 				logg("Network table: Client with IP %s has no MAC info but was recently be seen for network ID %i",
 				     ipaddr, dbID);
 
+			// Create mock hardware address in the style of "ip-<IP address>", like "ip-127.0.0.1"
+			strcpy(hwaddr, "ip-");
+			strncpy(hwaddr+3, ipaddr, sizeof(hwaddr)-4);
+			hwaddr[sizeof(hwaddr)-1] = '\0';
+
 			//
 			// Variant 3: Try to find a device with mock IP address
 			// Only try this when there is no EDNS(0) MAC address available
 			//
 			if(dbID < 0)
 			{
-				unlock_shm();
-				dbID = find_device_by_mock_hwaddr(db, ipaddr);
-				lock_shm();
-
-				// Reacquire client pointer (if may have changed when unlocking above)
-				client = getClient(clientID, true);
+				dbID = netdb_map_find_hwaddr(&map, hwaddr);
 
 				if(config.debug & DEBUG_ARP && dbID >= 0)
 					logg("Network table: Client with IP %s has no MAC info but is known as mock-hwaddr client with network ID %i",
 					     ipaddr, dbID);
 			}
-
-			// Create mock hardware address in the style of "ip-<IP address>", like "ip-127.0.0.1"
-			strcpy(hwaddr, "ip-");
-			strncpy(hwaddr+3, ipaddr, sizeof(hwaddr)-4);
-			hwaddr[sizeof(hwaddr)-1] = '\0';
 		}
 
-		if(dbID == DB_FAILED)
-		{
-			// SQLite error
-			if(ipaddr) free(ipaddr);
-			if(hostname) free(hostname);
-			if(interface) free(interface);
-			break;
-		}
 		// Device not in database, add new entry
-		else if(dbID == DB_NODATA)
+		if(dbID == DB_NODATA)
 		{
 			char *macVendor = NULL;
 			if(client->hwlen == 6)
@@ -910,14 +1251,7 @@ static bool add_FTL_clients_to_network_table(sqlite3 *db, enum arp_status *clien
 			const time_t lastQuery = client->lastQuery;
 			const unsigned int numQueriesARP = client->numQueriesARP;
 			unlock_shm();
-			insert_netDB_device(db, hwaddr, now, lastQuery, numQueriesARP, macVendor);
-			lock_shm();
-
-			// Reacquire client pointer (if may have changed when unlocking above)
-			client = getClient(clientID, true);
-
-			// Reset client counter
-			client->numQueriesARP = 0;
+			rc = insert_netDB_device(db, hwaddr, now, lastQuery, numQueriesARP, macVendor);
 
 			// Free allocated memory (if allocated)
 			if(macVendor != NULL)
@@ -926,8 +1260,18 @@ static bool add_FTL_clients_to_network_table(sqlite3 *db, enum arp_status *clien
 				macVendor = NULL;
 			}
 
-			// Obtain ID which was given to this new entry
+			if(rc != SQLITE_OK)
+			{
+				if(ipaddr) free(ipaddr);
+				if(hostname) free(hostname);
+				if(interface) free(interface);
+				break;
+			}
+
+			// Obtain ID which was given to this new entry and
+			// remember the device for the remaining clients
 			dbID = sqlite3_last_insert_rowid(db);
+			netdb_map_add_device(&map, dbID, hwaddr, lastQuery, "N/A");
 		}
 		else	// Device already in database
 		{
@@ -937,21 +1281,11 @@ static bool add_FTL_clients_to_network_table(sqlite3 *db, enum arp_status *clien
 				     hwaddr, ipaddr, hostname, interface);
 			}
 
-			// Update timestamp of last query if applicable
+			// Update timestamp of last query and number of queries if applicable
 			const time_t lastQuery = client->lastQuery;
 			const unsigned int numQueriesARP = client->numQueriesARP;
 			unlock_shm();
-			rc = update_netDB_lastQuery(db, dbID, lastQuery);
-			if(rc != SQLITE_OK)
-			{
-				if(ipaddr) free(ipaddr);
-				if(hostname) free(hostname);
-				if(interface) free(interface);
-				break;
-			}
-
-			// Update number of queries if applicable
-			rc = update_netDB_numQueries(db, dbID, numQueriesARP);
+			rc = netdb_map_update_counters(&map, dbID, lastQuery, numQueriesARP);
 			if(rc != SQLITE_OK)
 			{
 				if(ipaddr) free(ipaddr);
@@ -959,29 +1293,19 @@ static bool add_FTL_clients_to_network_table(sqlite3 *db, enum arp_status *clien
 				if(interface) free(interface);
 				break;
 			}
-
-			lock_shm();
-			// Reacquire client pointer (if may have changed when unlocking above)
-			client = getClient(clientID, true);
-			client->numQueriesARP = 0;
 		}
 
+		// Reset client counter
+		lock_shm();
+		// Reacquire client pointer (if may have changed when unlocking above)
+		client = getClient(clientID, true);
+		client->numQueriesARP = 0;
 		unlock_shm();
 
 		// Add unique IP address / mock-MAC pair to network_addresses table
-		// ipaddr is a local copy
-		rc = add_netDB_network_address(db, dbID, ipaddr);
-		if(rc != SQLITE_OK)
-		{
-			if(ipaddr) free(ipaddr);
-			if(hostname) free(hostname);
-			if(interface) free(interface);
-			break;
-		}
-
-		// Update hostname if available
-		// hostname is a local copy
-		rc = update_netDB_name(db, ipaddr, hostname);
+		// and update the hostname if available
+		// ipaddr and hostname are local copies
+		rc = netdb_map_update_address(&map, dbID, ipaddr, hostname, now);
 		if(rc != SQLITE_OK)
 		{
 			if(ipaddr) free(ipaddr);
@@ -992,7 +1316,7 @@ static bool add_FTL_clients_to_network_table(sqlite3 *db, enum arp_status *clien
 
 		// Update interface if available
 		// interface is a local copy
-		rc = update_netDB_interface(db, dbID, interface);
+		rc = netdb_map_update_interface(&map, dbID, interface);
 		if(rc != SQLITE_OK)
 		{
 			if(ipaddr) free(ipaddr);
@@ -1010,8 +1334,12 @@ static bool add_FTL_clients_to_network_table(sqlite3 *db, enum arp_status *clien
 		free(interface);
 	}
 
+	// Release in-memory tables and prepared statements
+	netdb_map_free(&map);
+
 	// Check for possible error in loop
 	if(rc != SQLITE_OK)
+
 	{
 		const char *text;
 		if( rc == SQLITE_BUSY )
@@ -1222,27 +1550,162 @@ static bool add_local_interfaces_to_network_table(sqlite3 *db, time_t now, unsig
 	return true;
 }
 
-// Parse kernel's neighbor cache
-void parse_neighbor_cache(sqlite3* db)
+// An entry of the kernel's neighbor cache. Incomplete entries have no
+// hardware address
+struct neigh_entry {
+	char ip[INET6_ADDRSTRLEN];
+	char iface[IF_NAMESIZE];
+	char hwaddr[128];
+	bool complete;
+};
+
+// Add a neighbor cache entry received from the kernel to the list
+static bool add_neigh_entry(struct nlmsghdr *nlh, struct neigh_entry **list, unsigned int *count, unsigned int *size)
 {
-	// Try to access the kernel's neighbor cache
-	FILE *arpfp = NULL;
-	const char cmd[] = "ip neigh show";
-	errno = ENOMEM;
-	if((arpfp = popen(cmd, "r")) == NULL)
+	const struct ndmsg *ndm = NLMSG_DATA(nlh);
+
+	// Skip entries "ip neigh show" does not show either
+	if((ndm->ndm_family != AF_INET && ndm->ndm_family != AF_INET6) ||
+	   ndm->ndm_state == NUD_NONE || (ndm->ndm_state & NUD_NOARP))
+		return true;
+
+	struct neigh_entry entry = { .complete = false };
+	bool have_ip = false;
+	int len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*ndm));
+	for(struct rtattr *rta = (struct rtattr*)(void*)((char*)ndm + NLMSG_ALIGN(sizeof(*ndm)));
+	    RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+	{
+		const size_t payload = RTA_PAYLOAD(rta);
+		if(rta->rta_type == NDA_DST &&
+		   payload == (ndm->ndm_family == AF_INET ? sizeof(struct in_addr) : sizeof(struct in6_addr)))
+			have_ip = inet_ntop(ndm->ndm_family, RTA_DATA(rta), entry.ip, sizeof(entry.ip)) != NULL;
+		else if(rta->rta_type == NDA_LLADDR && payload > 0 && 3*payload <= sizeof(entry.hwaddr))
+		{
+			// Format like "ip neigh show" does (aa:bb:cc:dd:ee:ff)
+			const unsigned char *mac = RTA_DATA(rta);
+			for(size_t i = 0; i < payload; i++)
+				sprintf(entry.hwaddr + 3*i, "%02x:", mac[i]);
+			entry.hwaddr[3*payload - 1] = '\0';
+			entry.complete = true;
+		}
+	}
+
+	if(!have_ip)
+		return true;
+	if(if_indextoname(ndm->ndm_ifindex, entry.iface) == NULL)
+		entry.iface[0] = '\0';
+
+	if(*count == *size)
 	{
-		logg("WARN: Command \"%s\" failed: %s", cmd, strerror(errno));
-		return;
+		const unsigned int newsize = *size > 0 ? 2 * *size : 64;
+		struct neigh_entry *newlist = realloc(*list, newsize * sizeof(struct neigh_entry));
+		if(newlist == NULL)
+			return false;
+		*list = newlist;
+		*size = newsize;
 	}
+	(*list)[(*count)++] = entry;
 
+	return true;
+}
+
+// Read the kernel's neighbor cache through rtnetlink (RTM_GETNEIGH dump). This
+// returns the same entries as "ip neigh show" without starting a process for
+// it. Returns NULL on error
+static struct neigh_entry *read_neighbor_cache(unsigned int *count)
+{
+	*count = 0u;
+	const int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if(fd < 0)
+	{
+		logg("WARN: Cannot open netlink socket: %s", strerror(errno));
+		return NULL;
+	}
+
+	struct {
+		struct nlmsghdr nlh;
+		struct ndmsg ndm;
+	} req = {
+		.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ndmsg)),
+		.nlh.nlmsg_type = RTM_GETNEIGH,
+		.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+		.nlh.nlmsg_seq = (unsigned int)time(NULL),
+		.ndm.ndm_family = AF_UNSPEC
+	};
+	struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+	if(sendto(fd, &req, req.nlh.nlmsg_len, 0, (struct sockaddr*)&kernel, sizeof(kernel)) < 0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	struct neigh_entry *list = NULL;
+	unsigned int size = 0u;
+	bool done = false, okay = true;
+	char buffer[32768] __attribute__ ((aligned(NLMSG_ALIGNTO)));
+	while(!done && okay && !killed)
+	{
+		ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+		if(len <= 0)
+		{
+			okay = false;
+			break;
+		}
+
+		for(struct nlmsghdr *nlh = (struct nlmsghdr*)(void*)buffer; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len))
+		{
+			if(nlh->nlmsg_seq != req.nlh.nlmsg_seq)
+				continue;
+
+			if(nlh->nlmsg_type == NLMSG_DONE)
+			{
+				done = true;
+				break;
+			}
+			else if(nlh->nlmsg_type == NLMSG_ERROR)
+			{
+				const struct nlmsgerr *err = NLMSG_DATA(nlh);
+				logg("WARN: Reading the neighbor cache failed: %s", strerror(-err->error));
+				okay = false;
+				break;
+			}
+			else if(nlh->nlmsg_type == RTM_NEWNEIGH &&
+			        !add_neigh_entry(nlh, &list, count, &size))
+			{
+				okay = false;
+				break;
+			}
+		}
+	}
+	close(fd);
+
+	if(!okay || !done)
+	{
+		if(list != NULL)
+			free(list);
+		*count = 0u;
+		return NULL;
+	}
+
+	// Return a valid pointer for an empty neighbor cache
+	if(list == NULL)
+		list = calloc(1, sizeof(struct neigh_entry));
+
+	return list;
+}
+
+// Parse kernel's neighbor cache
+void parse_neighbor_cache(sqlite3* db)
+{
 	// Start ARP timer
-	if(config.debug & DEBUG_ARP)
-		timer_start(ARP_TIMER);
+	timer_start(ARP_TIMER);
+
+	// Try to access the kernel's neighbor cache
+	unsigned int neighbors = 0u;
+	struct neigh_entry *neigh = read_neighbor_cache(&neighbors);
+	if(neigh == NULL)
+		return;
 
-	// Prepare buffers
-	char *linebuffer = NULL;
-	size_t linebuffersize = 0u;
-	char ip[128], hwaddr[128], iface[128];
 	unsigned int entries = 0u, additional_entries = 0u;
 	time_t now = time(NULL);
 
@@ -1258,7 +1721,7 @@ void parse_neighbor_cache(sqlite3* db)
 
 		// dbquery() above already logs the reason for why the query failed
 		logg("%s: Storing devices in network table (\"%s\") failed", text, sql);
-		pclose(arpfp);
+		free(neigh);
 		return;
 	}
 
@@ -1270,7 +1733,7 @@ void parse_neighbor_cache(sqlite3* db)
 		                        "WHERE lastSeen < %lu;", (unsigned long)limit);
 		if(rc != SQLITE_OK)
 		{
-			pclose(arpfp);
+			free(neigh);
 			return;
 		}
 
@@ -1278,7 +1741,7 @@ void parse_neighbor_cache(sqlite3* db)
 		                        "WHERE nameUpdated < %lu;", (unsigned long)limit);
 		if(rc != SQLITE_OK)
 		{
-			pclose(arpfp);
+			free(neigh);
 			return;
 		}
 	}
@@ -1294,41 +1757,29 @@ void parse_neighbor_cache(sqlite3* db)
 		client_status[i] = CLIENT_NOT_HANDLED;
 	}
 
-	// Read ARP cache line by line
-	while(getline(&linebuffer, &linebuffersize, arpfp) != -1)
+	// Process the neighbor cache entry by entry
+	for(unsigned int n = 0; n < neighbors; n++)
 	{
-		// Skip if line buffer is invalid
-		if(linebuffer == NULL)
-			continue;
-
 		// Check thread cancellation
 		if(killed)
 			break;
 
-		int num = sscanf(linebuffer, "%99s dev %99s lladdr %99s",
-		                 ip, iface, hwaddr);
+		const char *ip = neigh[n].ip;
+		const char *iface = neigh[n].iface;
+		const char *hwaddr = neigh[n].hwaddr;
 
-		// Ensure strings are null-terminated in case we hit the max.
-		// length limitation
-		ip[sizeof(ip)-1] = '\0';
-		iface[sizeof(iface)-1] = '\0';
-		hwaddr[sizeof(hwaddr)-1] = '\0';
-
-		// Check if we want to process the line we just read
-		if(num != 3)
+		// Check if we want to process the entry
+		if(!neigh[n].complete)
 		{
-			if(num == 2)
-			{
-				// This line is incomplete, remember this to skip
-				// mock-device creation after ARP processing
-				lock_shm();
-				int clientID = findClientID(ip, false, false);
-				unlock_shm();
-				if(clientID >= 0)
-					client_status[clientID] = CLIENT_ARP_INCOMPLETE;
-			}
+			// This entry is incomplete, remember this to skip
+			// mock-device creation after ARP processing
+			lock_shm();
+			int clientID = findClientID(ip, false, false);
+			unlock_shm();
+			if(clientID >= 0)
+				client_status[clientID] = CLIENT_ARP_INCOMPLETE;
 
-			// Skip to the next row in the neigh cache rather when
+			// Skip to the next entry in the neigh cache rather when
 			// marking as incomplete client
 			continue;
 		}
@@ -1519,10 +1970,8 @@ void parse_neighbor_cache(sqlite3* db)
 		entries++;
 	}
 
-	// Close pipe handle and free allocated memory
-	pclose(arpfp);
-	if(linebuffer != NULL)
-		free(linebuffer);
+	// Free allocated memory
+	free(neigh);
 
 	if(rc != SQLITE_OK)
 	{
@@ -1578,11 +2027,15 @@ void parse_neighbor_cache(sqlite3* db)
 		return;
 	}
 
+	// Cached lookups may be outdated now
+	flush_network_cache();
+
 	// Debug logging
+	const double took = timer_stop(ARP_TIMER);
 	if(config.debug & DEBUG_ARP)
 	{
 		logg("ARP table processing (%i entries from ARP, %i from FTL's cache) took %.1f ms",
-		     entries, additional_entries, timer_elapsed_msec(ARP_TIMER));
+		     entries, additional_entries, took);
 	}
 }
 
@@ -1664,6 +2117,115 @@ bool unify_hwaddr(sqlite3 *db)
 	return true;
 }
 
+// The MAC vendor database is kept open (read-only) together with its prepared
+// statement between lookups and vendor strings are cached by their OUI (the
+// first three bytes of the hardware address). Everything is reset whenever
+// the database file is replaced or modified
+static struct {
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	off_t size;
+	struct macvendor_cache {
+		uint32_t oui;
+		char *vendor;
+	} *cache;
+	unsigned int num_cache, size_cache;
+} macvendor = { NULL, NULL, 0, 0, 0, 0, NULL, 0u, 0u };
+
+static void close_macvendor_db(void)
+{
+	// sqlite3_finalize() and sqlite3_close() are harmless no-ops for NULL
+	sqlite3_finalize(macvendor.stmt);
+	macvendor.stmt = NULL;
+	sqlite3_close(macvendor.db);
+	macvendor.db = NULL;
+
+	for(unsigned int i = 0u; i < macvendor.num_cache; i++)
+		if(macvendor.cache[i].vendor != NULL)
+			free(macvendor.cache[i].vendor);
+	macvendor.num_cache = 0u;
+}
+
+static bool open_macvendor_db(const struct stat *st)
+{
+	// Reuse open database unless the file changed since we opened it
+	if(macvendor.db != NULL)
+	{
+		if(st->st_dev == macvendor.dev && st->st_ino == macvendor.ino &&
+		   st->st_mtime == macvendor.mtime && st->st_size == macvendor.size)
+			return true;
+
+		if(config.debug & DEBUG_ARP)
+			logg("MAC vendor database changed, reopening");
+		close_macvendor_db();
+	}
+
+	int rc = sqlite3_open_v2(FTLfiles.macvendor_db, &macvendor.db, SQLITE_OPEN_READONLY, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("open_macvendor_db() - SQL error: %s", sqlite3_errstr(rc));
+		close_macvendor_db();
+		return false;
+	}
+
+	// Collect statement latency statistics on this connection
+	db_latency_register(macvendor.db, DB_LATENCY_MACVENDOR);
+
+	const char querystr[] = "SELECT vendor FROM macvendor WHERE mac LIKE ?;";
+	rc = sqlite3_prepare_v2(macvendor.db, querystr, -1, &macvendor.stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("open_macvendor_db() - SQL error prepare \"%s\": %s", querystr, sqlite3_errstr(rc));
+		close_macvendor_db();
+		return false;
+	}
+
+	macvendor.dev = st->st_dev;
+	macvendor.ino = st->st_ino;
+	macvendor.mtime = st->st_mtime;
+	macvendor.size = st->st_size;
+
+	return true;
+}
+
+// Find position of the first cache entry with an OUI not less than oui
+static unsigned int __attribute__ ((pure)) macvendor_cache_pos(const uint32_t oui)
+{
+	unsigned int lo = 0u, hi = macvendor.num_cache;
+	while(lo < hi)
+	{
+		const unsigned int mid = lo + (hi - lo) / 2u;
+		if(macvendor.cache[mid].oui < oui)
+			lo = mid + 1u;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void macvendor_cache_add(const unsigned int pos, const uint32_t oui, const char *vendor)
+{
+	// Grow cache if needed
+	if(macvendor.num_cache >= macvendor.size_cache)
+	{
+		const unsigned int size = macvendor.size_cache > 0u ? 2u*macvendor.size_cache : 64u;
+		struct macvendor_cache *cache = realloc(macvendor.cache, size*sizeof(*cache));
+		if(cache == NULL)
+			return;
+		macvendor.cache = cache;
+		macvendor.size_cache = size;
+	}
+
+	memmove(&macvendor.cache[pos+1], &macvendor.cache[pos],
+	        (macvendor.num_cache - pos)*sizeof(*macvendor.cache));
+	macvendor.cache[pos].oui = oui;
+	macvendor.cache[pos].vendor = strdup(vendor);
+	macvendor.num_cache++;
+}
+
 static char * __attribute__ ((malloc)) getMACVendor(const char *hwaddr)
 {
 	// Special handling for the loopback interface
@@ -1676,6 +2238,7 @@ static char * __attribute__ ((malloc)) getMACVendor(const char *hwaddr)
 		// File does not exist
 		if(config.debug & DEBUG_ARP)
 			logg("getMACVenor(\"%s\"): %s does not exist", hwaddr, FTLfiles.macvendor_db);
+		close_macvendor_db();
 		return strdup("");
 	}
 	else if(strlen(hwaddr) != 17 || strstr(hwaddr, "ip-") != NULL)
@@ -1686,46 +2249,49 @@ static char * __attribute__ ((malloc)) getMACVendor(const char *hwaddr)
 		return strdup("");
 	}
 
-	sqlite3 *macvendor_db = NULL;
-	int rc = sqlite3_open_v2(FTLfiles.macvendor_db, &macvendor_db, SQLITE_OPEN_READONLY, NULL);
-	if(rc != SQLITE_OK)
+	unsigned int oui[3];
+	if(sscanf(hwaddr, "%2x:%2x:%2x", &oui[0], &oui[1], &oui[2]) != 3)
 	{
-		logg("getMACVendor(\"%s\") - SQL error: %s", hwaddr, sqlite3_errstr(rc));
-		sqlite3_close(macvendor_db);
+		if(config.debug & DEBUG_ARP)
+			logg("getMACVenor(\"%s\"): MAC invalid", hwaddr);
 		return strdup("");
 	}
 
+	if(!open_macvendor_db(&st))
+		return strdup("");
+
+	// Check cache first
+	const uint32_t key = (oui[0] << 16) | (oui[1] << 8) | oui[2];
+	const unsigned int pos = macvendor_cache_pos(key);
+	if(pos < macvendor.num_cache && macvendor.cache[pos].oui == key)
+	{
+		if(config.debug & DEBUG_DATABASE)
+			logg("DEBUG: MAC Vendor lookup for %s returned \"%s\" (cached)",
+			     hwaddr, macvendor.cache[pos].vendor);
+		return strdup(macvendor.cache[pos].vendor);
+	}
+
 	// Only keep "XX:YY:ZZ" (8 characters)
 	char hwaddrshort[9];
 	strncpy(hwaddrshort, hwaddr, 8);
 	hwaddrshort[8] = '\0';
-	const char querystr[] = "SELECT vendor FROM macvendor WHERE mac LIKE ?;";
-
-	sqlite3_stmt *stmt = NULL;
-	rc = sqlite3_prepare_v2(macvendor_db, querystr, -1, &stmt, NULL);
-	if(rc != SQLITE_OK)
-	{
-		logg("getMACVendor(\"%s\") - SQL error prepare \"%s\": %s", hwaddr, querystr, sqlite3_errstr(rc));
-		sqlite3_close(macvendor_db);
-		return strdup("");
-	}
 
 	// Bind hwaddrshort to prepared statement
-	if((rc = sqlite3_bind_text(stmt, 1, hwaddrshort, -1, SQLITE_STATIC)) != SQLITE_OK)
+	int rc;
+	if((rc = sqlite3_bind_text(macvendor.stmt, 1, hwaddrshort, -1, SQLITE_STATIC)) != SQLITE_OK)
 	{
 		logg("getMACVendor(\"%s\" -> \"%s\"): Failed to bind hwaddrshort: %s",
 		     hwaddr, hwaddrshort, sqlite3_errstr(rc));
-		sqlite3_reset(stmt);
-		sqlite3_finalize(stmt);
-		sqlite3_close(macvendor_db);
+		sqlite3_reset(macvendor.stmt);
 		return strdup("");
 	}
 
 	char *vendor = NULL;
-	rc = sqlite3_step(stmt);
+	rc = sqlite3_step(macvendor.stmt);
 	if(rc == SQLITE_ROW)
 	{
-		vendor = strdup((char*)sqlite3_column_text(stmt, 0));
+		const char *text = (const char*)sqlite3_column_text(macvendor.stmt, 0);
+		vendor = strdup(text != NULL ? text : "");
 	}
 	else
 	{
@@ -1735,12 +2301,17 @@ static char * __attribute__ ((malloc)) getMACVendor(const char *hwaddr)
 
 	if(rc != SQLITE_DONE && rc != SQLITE_ROW)
 	{
-		// Error
+		// Error, do not cache this result
 		logg("getMACVendor(\"%s\") - SQL error step: %s", hwaddr, sqlite3_errstr(rc));
 	}
+	else if(vendor != NULL)
+	{
+		// Cache result (also if nothing was found)
+		macvendor_cache_add(pos, key, vendor);
+	}
 
-	sqlite3_finalize(stmt);
-	sqlite3_close(macvendor_db);
+	sqlite3_reset(macvendor.stmt);
+	sqlite3_clear_bindings(macvendor.stmt);
 
 	if(config.debug & DEBUG_DATABASE)
 		logg("DEBUG: MAC Vendor lookup for %s returned \"%s\"", hwaddr, vendor);
@@ -1750,6 +2321,8 @@ static char * __attribute__ ((malloc)) getMACVendor(const char *hwaddr)
 
 void updateMACVendorRecords(sqlite3 *db)
 {
+	TIME_SCOPE("macvendor_update");
+
 	// Return early if database is known to be broken
 	if(FTLDBerror())
 		return;
@@ -1764,7 +2337,7 @@ void updateMACVendorRecords(sqlite3 *db)
 	}
 
 	sqlite3_stmt *stmt = NULL;
-	const char *selectstr = "SELECT id,hwaddr FROM network;";
+	const char *selectstr = "SELECT id,hwaddr,macVendor FROM network;";
 	int rc = sqlite3_prepare_v2(db, selectstr, -1, &stmt, NULL);
 	if(rc != SQLITE_OK)
 	{
@@ -1773,42 +2346,53 @@ void updateMACVendorRecords(sqlite3 *db)
 		return;
 	}
 
+	sqlite3_stmt *update_stmt = NULL;
+	const char *updatestr = "UPDATE network SET macVendor = ?1 WHERE id = ?2;";
+	rc = sqlite3_prepare_v2(db, updatestr, -1, &update_stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("updateMACVendorRecords() - SQL error prepare \"%s\": %s", updatestr, sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		sqlite3_finalize(stmt);
+		return;
+	}
+
 	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
 	{
 		const int id = sqlite3_column_int(stmt, 0);
-		char *hwaddr = strdup((char*)sqlite3_column_text(stmt, 1));
+		const char *hwaddr = (const char*)sqlite3_column_text(stmt, 1);
+		const char *oldvendor = (const char*)sqlite3_column_text(stmt, 2);
+		if(hwaddr == NULL)
+			continue;
 
 		// Get vendor for MAC
 		char *vendor = getMACVendor(hwaddr);
-		free(hwaddr);
-		hwaddr = NULL;
+		if(vendor == NULL)
+			continue;
 
-		// Prepare UPDATE statement
-		char *updatestr = NULL;
-		if(asprintf(&updatestr, "UPDATE network SET macVendor = \'%s\' WHERE id = %i", vendor, id) < 1)
+		// Skip devices whose vendor string did not change
+		if(oldvendor != NULL && strcmp(vendor, oldvendor) == 0)
 		{
-			logg("updateMACVendorRecords() - Allocation error");
 			free(vendor);
-			break;
+			continue;
 		}
 
 		// Execute prepared statement
-		char *zErrMsg = NULL;
-		rc = sqlite3_exec(db, updatestr, NULL, NULL, &zErrMsg);
-		if(rc != SQLITE_OK)
+		sqlite3_bind_text(update_stmt, 1, vendor, -1, SQLITE_STATIC);
+		sqlite3_bind_int(update_stmt, 2, id);
+		rc = sqlite3_step(update_stmt);
+		sqlite3_reset(update_stmt);
+		sqlite3_clear_bindings(update_stmt);
+		free(vendor);
+		if(rc != SQLITE_DONE)
 		{
-			logg("updateMACVendorRecords() - SQL exec error: \"%s\": %s", updatestr, zErrMsg);
+			logg("updateMACVendorRecords() - SQL error step \"%s\": %s", updatestr, sqlite3_errstr(rc));
 			checkFTLDBrc(rc);
-			sqlite3_free(zErrMsg);
-			free(updatestr);
-			free(vendor);
 			break;
 		}
-
-		// Free allocated memory
-		free(updatestr);
-		free(vendor);
 	}
+	sqlite3_finalize(update_stmt);
+	sqlite3_finalize(stmt);
 	if(rc != SQLITE_DONE)
 	{
 		// Error
@@ -1816,8 +2400,137 @@ void updateMACVendorRecords(sqlite3 *db)
 		checkFTLDBrc(rc);
 		return;
 	}
+}
 
-	sqlite3_finalize(stmt);
+// Small in-process cache for the network table lookups by IP address below.
+// They are called from several threads whenever a client is seen or
+// re-resolved, often for the same addresses over and over again. Results
+// (including negative ones) are kept for config.network_cache_ttl seconds and
+// the entire cache is flushed after parse_neighbor_cache() wrote to the network
+// tables. The cache is flushed as well when it reaches NETDB_CACHE_MAX entries
+#define NETDB_CACHE_MAX 1024u
+enum netdb_cache_type { NETDB_CACHE_MAC, NETDB_CACHE_ALIASCLIENT, NETDB_CACHE_NAME, NETDB_CACHE_IFACE, NETDB_CACHE_TYPES };
+struct netdb_cache_entry {
+	char *ip;
+	char *value[NETDB_CACHE_TYPES];
+	time_t expires[NETDB_CACHE_TYPES];
+	int aliasclient_id;
+};
+static struct {
+	struct netdb_cache_entry *entries;
+	unsigned int num, size;
+} netdb_cache = { NULL, 0u, 0u };
+static pthread_mutex_t netdb_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Find position of the first cache entry with an IP address not less than ip
+static unsigned int __attribute__ ((pure)) netdb_cache_pos(const char *ip)
+{
+	unsigned int lo = 0u, hi = netdb_cache.num;
+	while(lo < hi)
+	{
+		const unsigned int mid = lo + (hi - lo) / 2u;
+		if(strcmp(netdb_cache.entries[mid].ip, ip) < 0)
+			lo = mid + 1u;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Remove all entries from the cache. The caller has to hold netdb_cache_lock
+static void netdb_cache_clear(void)
+{
+	for(unsigned int i = 0u; i < netdb_cache.num; i++)
+	{
+		struct netdb_cache_entry *entry = &netdb_cache.entries[i];
+		if(entry->ip != NULL)
+			free(entry->ip);
+		for(unsigned int j = 0u; j < NETDB_CACHE_TYPES; j++)
+			if(entry->value[j] != NULL)
+				free(entry->value[j]);
+	}
+	netdb_cache.num = 0u;
+}
+
+void flush_network_cache(void)
+{
+	pthread_mutex_lock(&netdb_cache_lock);
+	netdb_cache_clear();
+	pthread_mutex_unlock(&netdb_cache_lock);
+}
+
+// Look up a cached result. Returns true on a cache hit, *value is then set to a
+// copy of the cached string (which may be NULL = nothing found in the database)
+static bool netdb_cache_get(const enum netdb_cache_type type, const char *ip,
+                            char **value, int *aliasclient_id)
+{
+	if(config.network_cache_ttl == 0u || ip == NULL)
+		return false;
+
+	bool found = false;
+	pthread_mutex_lock(&netdb_cache_lock);
+	const unsigned int pos = netdb_cache_pos(ip);
+	if(pos < netdb_cache.num && strcmp(netdb_cache.entries[pos].ip, ip) == 0)
+	{
+		const struct netdb_cache_entry *entry = &netdb_cache.entries[pos];
+		if(entry->expires[type] > time(NULL))
+		{
+			found = true;
+			if(value != NULL)
+				*value = entry->value[type] != NULL ? strdup(entry->value[type]) : NULL;
+			if(aliasclient_id != NULL)
+				*aliasclient_id = entry->aliasclient_id;
+		}
+	}
+	pthread_mutex_unlock(&netdb_cache_lock);
+
+	return found;
+}
+
+// Store a result in the cache
+static void netdb_cache_put(const enum netdb_cache_type type, const char *ip,
+                            const char *value, const int aliasclient_id)
+{
+	if(config.network_cache_ttl == 0u || ip == NULL)
+		return;
+
+	pthread_mutex_lock(&netdb_cache_lock);
+	unsigned int pos = netdb_cache_pos(ip);
+	if(pos >= netdb_cache.num || strcmp(netdb_cache.entries[pos].ip, ip) != 0)
+	{
+		// Add new entry, start over when the cache is full
+		if(netdb_cache.num >= NETDB_CACHE_MAX)
+		{
+			netdb_cache_clear();
+			pos = 0u;
+		}
+		if(netdb_cache.num >= netdb_cache.size)
+		{
+			const unsigned int size = netdb_cache.size > 0u ? 2u*netdb_cache.size : 64u;
+			struct netdb_cache_entry *entries = realloc(netdb_cache.entries, size*sizeof(*entries));
+			if(entries == NULL)
+			{
+				pthread_mutex_unlock(&netdb_cache_lock);
+				return;
+			}
+			netdb_cache.entries = entries;
+			netdb_cache.size = size;
+		}
+		memmove(&netdb_cache.entries[pos+1], &netdb_cache.entries[pos],
+		        (netdb_cache.num - pos)*sizeof(*netdb_cache.entries));
+		memset(&netdb_cache.entries[pos], 0, sizeof(*netdb_cache.entries));
+		netdb_cache.entries[pos].ip = strdup(ip);
+		netdb_cache.num++;
+	}
+
+	struct netdb_cache_entry *entry = &netdb_cache.entries[pos];
+	if(entry->value[type] != NULL)
+		free(entry->value[type]);
+	entry->value[type] = value != NULL ? strdup(value) : NULL;
+	entry->expires[type] = time(NULL) + config.network_cache_ttl;
+	if(type == NETDB_CACHE_ALIASCLIENT)
+		entry->aliasclient_id = aliasclient_id;
+	pthread_mutex_unlock(&netdb_cache_lock);
 }
 
 // Get hardware address of device identified by IP address
@@ -1827,6 +2540,11 @@ char *__attribute__((malloc)) getMACfromIP(sqlite3* db, const char *ipaddr)
 	if(FTLDBerror())
 		return NULL;
 
+	// Check cache first
+	char *hwaddr = NULL;
+	if(netdb_cache_get(NETDB_CACHE_MAC, ipaddr, &hwaddr, NULL))
+		return hwaddr;
+
 	// Open pihole-FTL.db database file if needed
 	bool db_opened = false;
 	if(db == NULL)
@@ -1874,7 +2592,6 @@ char *__attribute__((malloc)) getMACfromIP(sqlite3* db, const char *ipaddr)
 		return NULL;
 	}
 
-	char *hwaddr = NULL;
 	rc = sqlite3_step(stmt);
 	if(rc == SQLITE_ROW)
 	{
@@ -1903,6 +2620,8 @@ char *__attribute__((malloc)) getMACfromIP(sqlite3* db, const char *ipaddr)
 
 	if(db_opened) dbclose(&db);
 
+	netdb_cache_put(NETDB_CACHE_MAC, ipaddr, hwaddr, 0);
+
 	return hwaddr;
 }
 
@@ -1913,6 +2632,11 @@ int getAliasclientIDfromIP(sqlite3 *db, const char *ipaddr)
 	if(FTLDBerror())
 		return DB_FAILED;
 
+	// Check cache first
+	int aliasclient_id = DB_NODATA;
+	if(netdb_cache_get(NETDB_CACHE_ALIASCLIENT, ipaddr, NULL, &aliasclient_id))
+		return aliasclient_id;
+
 	// Open pihole-FTL.db database file if needed
 	bool db_opened = false;
 	if(db == NULL)
@@ -1962,7 +2686,6 @@ int getAliasclientIDfromIP(sqlite3 *db, const char *ipaddr)
 		return DB_FAILED;
 	}
 
-	int aliasclient_id = DB_NODATA;
 	rc = sqlite3_step(stmt);
 	if(rc == SQLITE_ROW)
 	{
@@ -1986,6 +2709,8 @@ int getAliasclientIDfromIP(sqlite3 *db, const char *ipaddr)
 
 	if(db_opened) dbclose(&db);
 
+	netdb_cache_put(NETDB_CACHE_ALIASCLIENT, ipaddr, NULL, aliasclient_id);
+
 	return aliasclient_id;
 }
 
@@ -2004,6 +2729,11 @@ char *__attribute__((malloc)) getNameFromIP(sqlite3 *db, const char *ipaddr)
 		return NULL;
 	}
 
+	// Check cache first
+	char *name = NULL;
+	if(netdb_cache_get(NETDB_CACHE_NAME, ipaddr, &name, NULL))
+		return name;
+
 	// Open pihole-FTL.db database file if needed
 	bool db_opened = false;
 	if(db == NULL)
@@ -2047,7 +2777,6 @@ char *__attribute__((malloc)) getNameFromIP(sqlite3 *db, const char *ipaddr)
 		return NULL;
 	}
 
-	char *name = NULL;
 	rc = sqlite3_step(stmt);
 	if(rc == SQLITE_ROW)
 	{
@@ -2073,6 +2802,8 @@ char *__attribute__((malloc)) getNameFromIP(sqlite3 *db, const char *ipaddr)
 	{
 		if(db_opened) dbclose(&db);
 
+		netdb_cache_put(NETDB_CACHE_NAME, ipaddr, name, 0);
+
 		return name;
 	}
 
@@ -2136,6 +2867,8 @@ char *__attribute__((malloc)) getNameFromIP(sqlite3 *db, const char *ipaddr)
 
 	if(db_opened) dbclose(&db);
 
+	netdb_cache_put(NETDB_CACHE_NAME, ipaddr, name, 0);
+
 	return name;
 }
 
@@ -2146,6 +2879,11 @@ char *__attribute__((malloc)) getIfaceFromIP(sqlite3 *db, const char *ipaddr)
 	if(FTLDBerror())
 		return NULL;
 
+	// Check cache first
+	char *iface = NULL;
+	if(netdb_cache_get(NETDB_CACHE_IFACE, ipaddr, &iface, NULL))
+		return iface;
+
 	// Open pihole-FTL.db database file if needed
 	bool db_opened = false;
 	if(db == NULL)
@@ -2199,7 +2937,6 @@ char *__attribute__((malloc)) getIfaceFromIP(sqlite3 *db, const char *ipaddr)
 		return NULL;
 	}
 
-	char *iface = NULL;
 	rc = sqlite3_step(stmt);
 	if(rc == SQLITE_ROW)
 	{
@@ -2222,5 +2959,7 @@ char *__attribute__((malloc)) getIfaceFromIP(sqlite3 *db, const char *ipaddr)
 
 	if(db_opened) dbclose(&db);
 
+	netdb_cache_put(NETDB_CACHE_IFACE, ipaddr, iface, 0);
+
 	return iface;
 }
@@ -23,6 +23,7 @@ char* __attribute__((malloc)) getMACfromIP(sqlite3 *db, const char* ipaddr);
 int getAliasclientIDfromIP(sqlite3 *db, const char *ipaddr);
 char* __attribute__((malloc)) getNameFromIP(sqlite3 *db, const char* ipaddr);
 char* __attribute__((malloc)) getIfaceFromIP(sqlite3 *db, const char* ipaddr);
+void flush_network_cache(void);
 void resolveNetworkTableNames(void);
 
 #endif //NETWORKTABLE_H
@@ -25,8 +25,240 @@
 #include "../config.h"
 // getstr()
 #include "../shmem.h"
+// rollup_add()
+#include "rollup-table.h"
+// delete_old_archive_blocks()
+#include "archive-table.h"
+// update_domain_leaderboards()
+#include "../leaderboard.h"
+// timeseries_update()
+#include "../timeseries.h"
+// heavy_hitters_add()
+#include "../heavyhitters.h"
+// cardinality_add()
+#include "../cardinality.h"
+// FTL_PROBE()
+#include "../probes.h"
 
 static bool saving_failed_before = false;
+// Number of queries considered for sampling so far (see SAMPLE_QUERIES)
+static unsigned int sampled_queries = 0u;
+
+// Queries copied from shared memory by snapshot_queries(). Their strings are
+// stored in a private arena and referenced by their offset so the arena can
+// grow while the snapshot is taken
+#define ARENA_NULL SIZE_MAX
+typedef struct {
+	long int queryID;
+	int id;
+	int type;
+	int status;
+	int reply;
+	int dnssec;
+	enum addinfo_type addinfo;
+	int domainlist_id;
+	time_t timestamp;
+	double response;
+	bool blocked;
+	bool response_calculated;
+	// Sampling rate the query is stored with, 0 if it is only counted
+	unsigned int sample;
+	size_t domain;
+	size_t client_ip;
+	size_t client_name;
+	size_t forward;
+	size_t cname;
+} savedQuery;
+
+typedef struct {
+	savedQuery *queries;
+	unsigned int count;
+	unsigned int size;
+	char *arena;
+	size_t arena_len;
+	size_t arena_size;
+	// lastdbindex at the time of the snapshot and first query not
+	// included in the snapshot
+	long int start;
+	long int stop;
+	bool failed;
+} querySnapshot;
+
+// Copy a string into the arena of the snapshot, returns its offset
+static size_t arena_add(querySnapshot *snap, const char *str)
+{
+	if(str == NULL)
+		return ARENA_NULL;
+
+	const size_t len = strlen(str) + 1;
+	if(snap->arena_len + len > snap->arena_size)
+	{
+		size_t size = snap->arena_size > 0 ? snap->arena_size : 4096;
+		while(snap->arena_len + len > size)
+			size *= 2;
+		char *arena = realloc(snap->arena, size);
+		if(arena == NULL)
+		{
+			snap->failed = true;
+			return ARENA_NULL;
+		}
+		snap->arena = arena;
+		snap->arena_size = size;
+	}
+
+	const size_t offset = snap->arena_len;
+	memcpy(snap->arena + offset, str, len);
+	snap->arena_len += len;
+	return offset;
+}
+
+static inline const char *arena_get(const querySnapshot *snap, const size_t offset)
+{
+	return offset != ARENA_NULL ? snap->arena + offset : NULL;
+}
+
+static void free_snapshot(querySnapshot *snap)
+{
+	if(snap->queries != NULL)
+		free(snap->queries);
+	if(snap->arena != NULL)
+		free(snap->arena);
+	memset(snap, 0, sizeof(*snap));
+}
+
+// Copy all queries that are to be stored in the database together with their
+// strings. Has to be called while holding the SHM lock
+static void snapshot_queries(querySnapshot *snap)
+{
+	const time_t currenttimestamp = time(NULL);
+	snap->start = lastdbindex;
+	long int queryID;
+	for(queryID = MAX(0, lastdbindex); queryID < counters->queries; queryID++)
+	{
+		queriesData* query = getQuery(queryID, true);
+		if(!query)
+		{
+			// Memory error
+			continue;
+		}
+
+		if(query->flags.database)
+		{
+			// Skip, already saved in database
+			continue;
+		}
+
+		if(!query->flags.complete && query->timestamp > currenttimestamp-2)
+		{
+			// Break if a brand new query (age < 2 seconds) is not yet completed
+			// giving it a chance to be stored next time
+			break;
+		}
+
+		if(query->privacylevel >= PRIVACY_MAXIMUM)
+		{
+			// Skip, we never store nor count queries recorded
+			// while have been in maximum privacy mode in the database
+			continue;
+		}
+
+		if(snap->count >= snap->size)
+		{
+			const unsigned int size = snap->size > 0 ? 2*snap->size : 256;
+			savedQuery *queries = realloc(snap->queries, size*sizeof(savedQuery));
+			if(queries == NULL)
+			{
+				snap->failed = true;
+				break;
+			}
+			snap->queries = queries;
+			snap->size = size;
+		}
+
+		savedQuery *saved = &snap->queries[snap->count];
+		saved->queryID = queryID;
+		saved->id = query->id;
+		saved->timestamp = query->timestamp;
+		// Store query type + offset if query->type is OTHER
+		saved->type = query->type != TYPE_OTHER ? (int)query->type : query->qtype + 100;
+		saved->status = query->status;
+		saved->reply = query->reply;
+		saved->dnssec = query->dnssec;
+		saved->blocked = query->flags.blocked;
+		saved->response_calculated = query->flags.response_calculated;
+		saved->response = 1e-4*query->response;
+
+		// Only every n-th permitted (and, optionally, blocked) query is
+		// stored when sampling, the others are only counted
+		saved->sample = 1u;
+		if(config.sample_queries > 1u && (config.sample_blocked || !query->flags.blocked))
+			saved->sample = sampled_queries++ % config.sample_queries == 0u ? config.sample_queries : 0u;
+		saved->domain = arena_add(snap, getDomainString(query));
+		saved->client_ip = arena_add(snap, getClientIPString(query));
+		saved->client_name = arena_add(snap, getClientNameString(query));
+
+		// FORWARD
+		saved->forward = ARENA_NULL;
+		const upstreamsData* upstream = query->upstreamID > -1 ? getUpstream(query->upstreamID, true) : NULL;
+		if(upstream != NULL)
+		{
+			const char *forwardIP = getstr(upstream->ippos);
+			char *buffer = NULL;
+			if(forwardIP != NULL && asprintf(&buffer, "%s#%u", forwardIP, upstream->port) > 0)
+			{
+				saved->forward = arena_add(snap, buffer);
+				free(buffer);
+			}
+		}
+
+		// ADDITIONAL_INFO
+		saved->addinfo = 0;
+		saved->cname = ARENA_NULL;
+		const int cacheID = findCacheID(query->domainID, query->clientID, query->type, false);
+		DNSCacheData *cache = getDNSCache(cacheID, true);
+		if(query->status == QUERY_GRAVITY_CNAME ||
+		   query->status == QUERY_REGEX_CNAME ||
+		   query->status == QUERY_BLACKLIST_CNAME)
+		{
+			// Save domain blocked during deep CNAME inspection
+			saved->addinfo = ADDINFO_CNAME_DOMAIN;
+			saved->cname = arena_add(snap, getCNAMEDomainString(query));
+		}
+		else if(cache != NULL && cache->domainlist_id > -1)
+		{
+			saved->addinfo = ADDINFO_REGEX_ID;
+			saved->domainlist_id = cache->domainlist_id;
+		}
+
+		if(snap->failed)
+			break;
+
+		snap->count++;
+	}
+	snap->stop = queryID;
+}
+
+// Mark the first num queries of the snapshot as stored in the database. The
+// garbage collection may have removed queries in the meantime, it decreases
+// lastdbindex by the number of removed queries. Has to be called while holding
+// the SHM lock
+static void mark_queries_saved(const querySnapshot *snap, const unsigned int num)
+{
+	const long int removed = snap->start - lastdbindex;
+	for(unsigned int i = 0; i < num; i++)
+	{
+		const long int queryID = snap->queries[i].queryID - removed;
+		if(queryID < 0)
+			continue;
+		queriesData* query = getQuery(queryID, true);
+		if(query != NULL && query->id == snap->queries[i].id)
+			query->flags.database = true;
+	}
+
+	// Store index for next loop iteration round
+	if(num == snap->count)
+		lastdbindex = snap->stop - removed;
+}
 
 int get_number_of_queries_in_DB(sqlite3 *db)
 {
@@ -51,174 +283,326 @@ int get_number_of_queries_in_DB(sqlite3 *db)
 	// Count number of rows using the index timestamp is faster than select(*)
 	int result = db_query_int(db, "SELECT COUNT(timestamp) FROM query_storage");
 
+	// Add the queries moved into the query archive
+	const int archived = get_number_of_archived_queries(db);
+	if(result >= 0 && archived > 0)
+		result += archived;
+
 	if(db_opened) dbclose(&db);
 
 	return result;
 }
 
-int DB_save_queries(sqlite3 *db)
+// Statements used by DB_save_queries(). When called on the long-lived
+// connection of the database thread, they are kept between runs and only
+// reset. They are prepared again only when the connection changed or a run
+// failed (e.g., SQLITE_SCHEMA after the schema was modified externally)
+enum save_stmt { QUERY_STMT, DOMAIN_STMT, CLIENT_STMT, FORWARD_STMT, ADDINFO_STMT,
+                 DOMAIN_ID_STMT, CLIENT_ID_STMT, FORWARD_ID_STMT, ADDINFO_ID_STMT, SAVE_STMT_MAX };
+static const char *save_querystr[SAVE_STMT_MAX] = {
+	[QUERY_STMT] = "INSERT INTO query_storage "
+	               "(timestamp,type,status,domain,client,forward,additional_info,reply_type,reply_time,dnssec,sample) "
+	               "VALUES (?1,?2,?3,?4,?5,?6,?7,?8,?9,?10,?11)",
+	[DOMAIN_STMT] = "INSERT OR IGNORE INTO domain_by_id (domain) VALUES (?)",
+	[CLIENT_STMT] = "INSERT OR IGNORE INTO client_by_id (ip,name) VALUES (?,?)",
+	[FORWARD_STMT] = "INSERT OR IGNORE INTO forward_by_id (forward) VALUES (?)",
+	[ADDINFO_STMT] = "INSERT OR IGNORE INTO addinfo_by_id (type,content) VALUES (?,?)",
+	[DOMAIN_ID_STMT] = "SELECT id FROM domain_by_id WHERE domain = ?",
+	[CLIENT_ID_STMT] = "SELECT id FROM client_by_id WHERE ip = ? AND name = ?",
+	[FORWARD_ID_STMT] = "SELECT id FROM forward_by_id WHERE forward = ?",
+	[ADDINFO_ID_STMT] = "SELECT id FROM addinfo_by_id WHERE type = ? AND content = ?"
+};
+static sqlite3 *save_db = NULL;
+static sqlite3_stmt *save_stmt[SAVE_STMT_MAX] = { NULL };
+
+// Row IDs of the values stored in the linking tables (domain_by_id, ...).
+// They are filled when a value is stored for the first time so queries can be
+// written with the IDs directly instead of looking them up for every query.
+// The keys are the values written to the tables, a cache is cleared when it
+// reaches ID_CACHE_MAX entries
+#define ID_CACHE_MAX (1u << 16)
+#define ID_KEY_LEN 512
+typedef struct {
+	uint32_t hash;
+	unsigned int len;
+	char *key;
+	sqlite3_int64 id;
+} idCacheEntry;
+
+typedef struct {
+	idCacheEntry *entries;
+	unsigned int size;
+	unsigned int used;
+} idCache;
+
+enum id_cache { DOMAIN_IDS, CLIENT_IDS, FORWARD_IDS, ADDINFO_IDS, ID_CACHE_COUNT };
+static idCache save_ids[ID_CACHE_COUNT] = {{ 0 }};
+
+// FNV-1a hash of the key
+static uint32_t __attribute__ ((pure)) id_key_hash(const char *key, const unsigned int len)
 {
-	// Return early if database is known to be broken
-	if(FTLDBerror())
-		return DB_FAILED;
+	uint32_t hash = 2166136261u;
+	for(unsigned int i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char)key[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
 
-	// Start database timer
-	timer_start(DATABASE_WRITE_TIMER);
+static void id_cache_clear(idCache *cache)
+{
+	for(unsigned int i = 0; i < cache->size; i++)
+		if(cache->entries[i].key != NULL)
+			free(cache->entries[i].key);
+	if(cache->entries != NULL)
+		free(cache->entries);
+	memset(cache, 0, sizeof(*cache));
+}
 
-	// Open pihole-FTL.db database file if needed
-	bool db_opened = false;
-	if(db == NULL)
+static void id_caches_clear(idCache ids[ID_CACHE_COUNT])
+{
+	for(unsigned int i = 0; i < ID_CACHE_COUNT; i++)
+		id_cache_clear(&ids[i]);
+}
+
+// Get the slot of the key (or the empty slot it would be stored in)
+static idCacheEntry * __attribute__ ((pure)) id_cache_slot(const idCache *cache, const char *key,
+                                                           const unsigned int len, const uint32_t hash)
+{
+	unsigned int i = hash & (cache->size - 1);
+	while(cache->entries[i].key != NULL &&
+	      (cache->entries[i].hash != hash || cache->entries[i].len != len ||
+	       memcmp(cache->entries[i].key, key, len) != 0))
+		i = (i + 1) & (cache->size - 1);
+	return &cache->entries[i];
+}
+
+// Keys longer than ID_KEY_LEN (len == 0) are never cached
+static bool id_cache_get(const idCache *cache, const char *key, const unsigned int len, sqlite3_int64 *id)
+{
+	if(cache->size == 0 || len == 0)
+		return false;
+
+	const idCacheEntry *entry = id_cache_slot(cache, key, len, id_key_hash(key, len));
+	if(entry->key == NULL)
+		return false;
+
+	*id = entry->id;
+	return true;
+}
+
+static void id_cache_add(idCache *cache, const char *key, const unsigned int len, const sqlite3_int64 id)
+{
+	if(len == 0 || id < 0)
+		return;
+
+	if(cache->used >= ID_CACHE_MAX)
+		id_cache_clear(cache);
+
+	// Keep the load factor below 1/2
+	if(2*(cache->used + 1) > cache->size)
 	{
-		if((db = dbopen(false)) == NULL)
+		const unsigned int size = cache->size > 0 ? 2*cache->size : 1024;
+		idCacheEntry *entries = calloc(size, sizeof(idCacheEntry));
+		if(entries == NULL)
+			return;
+
+		idCache grown = { entries, size, cache->used };
+		for(unsigned int i = 0; i < cache->size; i++)
 		{
-			logg("DB_save_queries() - Failed to open DB");
-			return DB_FAILED;
+			const idCacheEntry *old = &cache->entries[i];
+			if(old->key != NULL)
+				*id_cache_slot(&grown, old->key, old->len, old->hash) = *old;
 		}
-
-		// Successful
-		db_opened = true;
+		if(cache->entries != NULL)
+			free(cache->entries);
+		*cache = grown;
 	}
 
-	int saved = 0;
-	bool error = false;
-	sqlite3_stmt *query_stmt = NULL;
-	sqlite3_stmt *domain_stmt = NULL;
-	sqlite3_stmt *client_stmt = NULL;
-	sqlite3_stmt *forward_stmt = NULL;
-	sqlite3_stmt *addinfo_stmt = NULL;
+	const uint32_t hash = id_key_hash(key, len);
+	idCacheEntry *entry = id_cache_slot(cache, key, len, hash);
+	if(entry->key != NULL || (entry->key = malloc(len)) == NULL)
+		return;
 
-	int rc = dbquery(db, "BEGIN TRANSACTION IMMEDIATE");
-	if( rc != SQLITE_OK )
+	memcpy(entry->key, key, len);
+	entry->hash = hash;
+	entry->len = len;
+	entry->id = id;
+	cache->used++;
+}
+
+// Step the bound INSERT OR IGNORE statement of a linking table and get the ID
+// of the (new or existing) row. id is -1 if there is no such row
+static bool store_linked_value(sqlite3 *db, sqlite3_stmt *insert, sqlite3_stmt *select, sqlite3_int64 *id)
+{
+	*id = -1;
+	if(sqlite3_step(insert) != SQLITE_DONE)
+		return false;
+	sqlite3_clear_bindings(insert);
+	sqlite3_reset(insert);
+
+	// The row has just been added
+	if(sqlite3_changes(db) > 0)
 	{
-		const char *text;
-		if( rc == SQLITE_BUSY )
-			text = "WARNING";
-		else
-			text = "ERROR";
+		*id = sqlite3_last_insert_rowid(db);
+		sqlite3_clear_bindings(select);
+		return true;
+	}
 
-		logg("%s: Storing queries in long-term database failed: %s", text, sqlite3_errstr(rc));
-		checkFTLDBrc(rc);
+	const int rc = sqlite3_step(select);
+	if(rc == SQLITE_ROW)
+		*id = sqlite3_column_int64(select, 0);
+	else if(rc != SQLITE_DONE)
+		return false;
+	sqlite3_clear_bindings(select);
+	sqlite3_reset(select);
 
-		if(db_opened) dbclose(&db);
+	return true;
+}
 
-		return DB_FAILED;
-	}
+static void bind_linked_id(sqlite3_stmt *stmt, const int pos, const sqlite3_int64 id)
+{
+	if(id > -1)
+		sqlite3_bind_int64(stmt, pos, id);
+	else
+		sqlite3_bind_null(stmt, pos);
+}
 
-	// Prepare statements
-	rc  = sqlite3_prepare_v3(db, "INSERT INTO query_storage "
-	                                 "(timestamp,type,status,domain,client,forward,additional_info,reply_type,reply_time,dnssec) "
-	                                 "VALUES "
-	                                 "(?1,?2,?3,"
-	                                 "(SELECT id FROM domain_by_id WHERE domain = ?4),"
-	                                 "(SELECT id FROM client_by_id WHERE ip = ?5 AND name = ?6),"
-	                                 "(SELECT id FROM forward_by_id WHERE forward = ?7),"
-	                                 "(SELECT id FROM addinfo_by_id WHERE type = ?8 AND content = ?9),"
-	                                 "?10,?11,?12)",
-	                         -1, SQLITE_PREPARE_PERSISTENT, &query_stmt, NULL);
-	if( rc != SQLITE_OK )
+// Finalize the cached statements. This has to be done before the connection
+// they were prepared on is closed
+void DB_finalize_save_statements(void)
+{
+	for(unsigned int i = 0; i < SAVE_STMT_MAX; i++)
 	{
-		const char *text, *spaces;
-		if( rc == SQLITE_BUSY )
-		{
-			text   = "WARNING";
-			spaces = "       ";
-		}
-		else
-		{
-			text   = "ERROR";
-			spaces = "     ";
-		}
+		if(save_stmt[i] != NULL)
+			sqlite3_finalize(save_stmt[i]);
+		save_stmt[i] = NULL;
+	}
+	save_db = NULL;
 
-		logg("%s: Storing queries in long-term database failed: %s\n", text, sqlite3_errstr(rc));
-		if(!checkFTLDBrc(rc))
-			logg("%s  Keeping queries in memory for later new attempt", spaces);
-		saving_failed_before = true;
+	// The IDs may not be valid for another connection
+	id_caches_clear(save_ids);
+}
 
-		if(db_opened) dbclose(&db);
+// Roll back a transaction left open by a failed run. Closing the connection
+// did this before, but the connection of the database thread stays open. IDs
+// added during the transaction are gone afterwards
+static void rollback_save_transaction(sqlite3 *db, idCache ids[ID_CACHE_COUNT])
+{
+	if(!sqlite3_get_autocommit(db))
+		dbquery(db, "ROLLBACK TRANSACTION");
+	id_caches_clear(ids);
+}
 
-		return DB_FAILED;
+// Get the statements for storing queries, either from the cache or by
+// preparing them. Returns SQLITE_OK on success
+static int prepare_save_statements(sqlite3 *db, sqlite3_stmt *stmt[SAVE_STMT_MAX], const bool cached)
+{
+	// Re-use the cached statements if they belong to this connection
+	if(cached && save_db == db)
+	{
+		memcpy(stmt, save_stmt, sizeof(save_stmt));
+		return SQLITE_OK;
 	}
 
-	rc = sqlite3_prepare_v3(db, "INSERT OR IGNORE INTO domain_by_id (domain) VALUES (?)",
-	                        -1, SQLITE_PREPARE_PERSISTENT, &domain_stmt, NULL);
-	if( rc != SQLITE_OK )
+	if(cached)
+		DB_finalize_save_statements();
+
+	for(unsigned int i = 0; i < SAVE_STMT_MAX; i++)
 	{
-		const char *text, *spaces;
-		if( rc == SQLITE_BUSY )
+		const int rc = sqlite3_prepare_v3(db, save_querystr[i], -1,
+		                                  SQLITE_PREPARE_PERSISTENT, &stmt[i], NULL);
+		if(rc != SQLITE_OK)
 		{
-			text   = "WARNING";
-			spaces = "       ";
-		}
-		else
-		{
-			text   = "ERROR";
-			spaces = "     ";
+			for(unsigned int j = 0; j < i; j++)
+				sqlite3_finalize(stmt[j]);
+			return rc;
 		}
+	}
 
-		logg("%s: Storing queries in long-term database failed: %s\n", text, sqlite3_errstr(rc));
-		if(!checkFTLDBrc(rc))
-			logg("%s  Keeping queries in memory for later new attempt", spaces);
-		saving_failed_before = true;
+	if(cached)
+	{
+		memcpy(save_stmt, stmt, sizeof(save_stmt));
+		save_db = db;
+	}
 
-		if(db_opened) dbclose(&db);
+	return SQLITE_OK;
+}
 
+// Store new queries in the database. This must be called without holding the
+// SHM lock, it is obtained only while copying the queries and while marking
+// them as stored afterwards
+static int save_queries(sqlite3 *db)
+{
+	// Return early if database is known to be broken
+	if(FTLDBerror())
 		return DB_FAILED;
+
+	// Copy the queries to be stored while holding the lock. The database
+	// transaction below runs without it so DNS replies can be recorded in
+	// the meantime
+	querySnapshot snap = { 0 };
+	lock_shm();
+	snapshot_queries(&snap);
+	unlock_shm();
+
+	// Start database timer
+	timer_start(DATABASE_WRITE_TIMER);
+	if(snap.failed)
+		logg("DB_save_queries() - Failed to allocate memory, storing %u queries", snap.count);
+
+	// Nothing to be done
+	if(snap.count == 0)
+	{
+		free_snapshot(&snap);
+		return 0;
 	}
 
-	rc = sqlite3_prepare_v3(db, "INSERT OR IGNORE INTO client_by_id (ip,name) VALUES (?,?)",
-	                        -1, SQLITE_PREPARE_PERSISTENT, &client_stmt, NULL);
-	if( rc != SQLITE_OK )
+	// Open pihole-FTL.db database file if needed
+	bool db_opened = false;
+	if(db == NULL)
 	{
-		const char *text, *spaces;
-		if( rc == SQLITE_BUSY )
-		{
-			text   = "WARNING";
-			spaces = "       ";
-		}
-		else
+		if((db = dbopen(false)) == NULL)
 		{
-			text   = "ERROR";
-			spaces = "     ";
+			logg("DB_save_queries() - Failed to open DB");
+			free_snapshot(&snap);
+			return DB_FAILED;
 		}
 
-		logg("%s: Storing queries in long-term database failed: %s\n", text, sqlite3_errstr(rc));
-		if(!checkFTLDBrc(rc))
-			logg("%s  Keeping queries in memory for later new attempt", spaces);
-		saving_failed_before = true;
-
-		if(db_opened) dbclose(&db);
-
-		return DB_FAILED;
+		// Successful
+		db_opened = true;
 	}
 
-	rc = sqlite3_prepare_v3(db, "INSERT OR IGNORE INTO forward_by_id (forward) VALUES (?)",
-	                        -1, SQLITE_PREPARE_PERSISTENT, &forward_stmt, NULL);
+	int saved = 0;
+	bool error = false;
+	// Statements are kept between runs only on the connection of the
+	// database thread, not on one opened here
+	const bool cached = !db_opened;
+	sqlite3_stmt *stmt[SAVE_STMT_MAX] = { NULL };
+	idCache local_ids[ID_CACHE_COUNT] = {{ 0 }};
+	idCache *ids = cached ? save_ids : local_ids;
+	rollupBatch rollups = { 0 };
+	int rc = dbquery(db, "BEGIN TRANSACTION IMMEDIATE");
 	if( rc != SQLITE_OK )
 	{
-		const char *text, *spaces;
+		const char *text;
 		if( rc == SQLITE_BUSY )
-		{
-			text   = "WARNING";
-			spaces = "       ";
-		}
+			text = "WARNING";
 		else
-		{
-			text   = "ERROR";
-			spaces = "     ";
-		}
+			text = "ERROR";
 
-		logg("%s: Storing queries in long-term database failed: %s\n", text, sqlite3_errstr(rc));
-		if(!checkFTLDBrc(rc))
-			logg("%s  Keeping queries in memory for later new attempt", spaces);
-		saving_failed_before = true;
+		logg("%s: Storing queries in long-term database failed: %s", text, sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
 
 		if(db_opened) dbclose(&db);
+		free_snapshot(&snap);
 
 		return DB_FAILED;
 	}
 
-	rc = sqlite3_prepare_v3(db, "INSERT OR IGNORE INTO addinfo_by_id (type,content) VALUES (?,?)",
-	                        -1, SQLITE_PREPARE_PERSISTENT, &addinfo_stmt, NULL);
+	// Prepare statements (or get them from the cache)
+	rc = prepare_save_statements(db, stmt, cached);
 	if( rc != SQLITE_OK )
 	{
 		const char *text, *spaces;
@@ -229,210 +613,176 @@ int DB_save_queries(sqlite3 *db)
 		}
 		else
 		{
-			text   = "ERROR";
-			spaces = "     ";
-		}
-
-		logg("%s: Storing queries in long-term database failed: %s\n", text, sqlite3_errstr(rc));
-		if(!checkFTLDBrc(rc))
-			logg("%s  Keeping queries in memory for later new attempt", spaces);
-		saving_failed_before = true;
-
-		if(db_opened) dbclose(&db);
-
-		return DB_FAILED;
-	}
-
-	// Get last ID stored in the database
-	long int lastID = get_max_query_ID(db);
-
-	int total = 0, blocked = 0;
-	time_t currenttimestamp = time(NULL);
-	time_t newlasttimestamp = 0;
-	long int queryID;
-	for(queryID = MAX(0, lastdbindex); queryID < counters->queries; queryID++)
-	{
-		queriesData* query = getQuery(queryID, true);
-		if(!query)
-		{
-			// Memory error
-			continue;
-		}
-
-		if(query->flags.database)
-		{
-			// Skip, already saved in database
-			continue;
-		}
-
-		if(!query->flags.complete && query->timestamp > currenttimestamp-2)
-		{
-			// Break if a brand new query (age < 2 seconds) is not yet completed
-			// giving it a chance to be stored next time
-			break;
-		}
-
-		if(query->privacylevel >= PRIVACY_MAXIMUM)
-		{
-			// Skip, we never store nor count queries recorded
-			// while have been in maximum privacy mode in the database
-			continue;
+			text   = "ERROR";
+			spaces = "     ";
 		}
 
+		logg("%s: Storing queries in long-term database failed: %s\n", text, sqlite3_errstr(rc));
+		if(!checkFTLDBrc(rc))
+			logg("%s  Keeping queries in memory for later new attempt", spaces);
+		saving_failed_before = true;
+
+		rollback_save_transaction(db, ids);
+		if(db_opened) dbclose(&db);
+		free_snapshot(&snap);
+
+		return DB_FAILED;
+	}
+	sqlite3_stmt *query_stmt = stmt[QUERY_STMT];
+
+	// Get last ID stored in the database
+	long int lastID = get_max_query_ID(db);
+
+	int total = 0, blocked = 0;
+	time_t newlasttimestamp = 0;
+	char key[ID_KEY_LEN];
+	for(unsigned int i = 0; i < snap.count; i++)
+	{
+		const savedQuery *query = &snap.queries[i];
+		sqlite3_int64 id, domainID, clientID, forwardID = -1;
+		int len;
+
 		// TIMESTAMP
 		sqlite3_bind_int(query_stmt, 1, query->timestamp);
 
 		// TYPE
-		if(query->type != TYPE_OTHER)
-		{
-			// Store mapped type if query->type is not OTHER
-			sqlite3_bind_int(query_stmt, 2, query->type);
-		}
-		else
-		{
-			// Store query type + offset if query-> type is OTHER
-			sqlite3_bind_int(query_stmt, 2, query->qtype + 100);
-		}
+		sqlite3_bind_int(query_stmt, 2, query->type);
 
 		// STATUS
 		sqlite3_bind_int(query_stmt, 3, query->status);
 
 		// DOMAIN
-		const char *domain = getDomainString(query);
-		sqlite3_bind_text(domain_stmt, 1, domain, -1, SQLITE_STATIC);
-		sqlite3_bind_text(query_stmt, 4, domain, -1, SQLITE_STATIC);
-
-		// Execute prepare client statement and check if successful
-		if(sqlite3_step(domain_stmt) != SQLITE_DONE)
+		const char *domain = arena_get(&snap, query->domain);
+		len = snprintf(key, sizeof(key), "%s", domain);
+		len = len < (int)sizeof(key) ? len : 0;
+		if(!id_cache_get(&ids[DOMAIN_IDS], key, len, &id))
 		{
-			logg("Encountered error while trying to store client in long-term database");
-			error = true;
-			break;
+			sqlite3_bind_text(stmt[DOMAIN_STMT], 1, domain, -1, SQLITE_STATIC);
+			sqlite3_bind_text(stmt[DOMAIN_ID_STMT], 1, domain, -1, SQLITE_STATIC);
+			if(!store_linked_value(db, stmt[DOMAIN_STMT], stmt[DOMAIN_ID_STMT], &id))
+			{
+				logg("Encountered error while trying to store domain in long-term database");
+				error = true;
+				break;
+			}
+			id_cache_add(&ids[DOMAIN_IDS], key, len, id);
 		}
-		sqlite3_clear_bindings(domain_stmt);
-		sqlite3_reset(domain_stmt);
+		bind_linked_id(query_stmt, 4, id);
+		domainID = id;
 
 		// CLIENT
-		const char *clientIP = getClientIPString(query);
-		sqlite3_bind_text(query_stmt, 5, clientIP, -1, SQLITE_STATIC);
-		sqlite3_bind_text(client_stmt, 1, clientIP, -1, SQLITE_STATIC);
-		const char *clientName = getClientNameString(query);
-		sqlite3_bind_text(query_stmt, 6, clientName, -1, SQLITE_STATIC);
-		sqlite3_bind_text(client_stmt, 2, clientName, -1, SQLITE_STATIC);
-
-		// Execute prepare client statement and check if successful
-		if(sqlite3_step(client_stmt) != SQLITE_DONE)
+		const char *clientIP = arena_get(&snap, query->client_ip);
+		const char *clientName = arena_get(&snap, query->client_name);
+		len = snprintf(key, sizeof(key), "%s%c%s", clientIP, '\0', clientName);
+		len = len < (int)sizeof(key) ? len : 0;
+		if(!id_cache_get(&ids[CLIENT_IDS], key, len, &id))
 		{
-			logg("Encountered error while trying to store client in long-term database");
-			error = true;
-			break;
+			sqlite3_bind_text(stmt[CLIENT_STMT], 1, clientIP, -1, SQLITE_STATIC);
+			sqlite3_bind_text(stmt[CLIENT_STMT], 2, clientName, -1, SQLITE_STATIC);
+			sqlite3_bind_text(stmt[CLIENT_ID_STMT], 1, clientIP, -1, SQLITE_STATIC);
+			sqlite3_bind_text(stmt[CLIENT_ID_STMT], 2, clientName, -1, SQLITE_STATIC);
+			if(!store_linked_value(db, stmt[CLIENT_STMT], stmt[CLIENT_ID_STMT], &id))
+			{
+				logg("Encountered error while trying to store client in long-term database");
+				error = true;
+				break;
+			}
+			id_cache_add(&ids[CLIENT_IDS], key, len, id);
 		}
-		sqlite3_clear_bindings(client_stmt);
-		sqlite3_reset(client_stmt);
+		bind_linked_id(query_stmt, 5, id);
+		clientID = id;
 
 		// FORWARD
-		if(query->upstreamID > -1)
+		const char *forward = arena_get(&snap, query->forward);
+		if(forward != NULL)
 		{
-			// Get forward pointer
-			const upstreamsData* upstream = getUpstream(query->upstreamID, true);
-			const char *forwardIP = getstr(upstream->ippos);
-			if(upstream && forwardIP)
+			len = snprintf(key, sizeof(key), "%s", forward);
+			len = len < (int)sizeof(key) ? len : 0;
+			if(!id_cache_get(&ids[FORWARD_IDS], key, len, &id))
 			{
-				char *buffer = NULL;
-				int len = 0; // The length of the string WITHOUT the NUL byte. This is what sqlite3_bind_text() expects.
-				if((len = asprintf(&buffer, "%s#%u", forwardIP, upstream->port)) > 0)
-				{
-					// Use transient here as we step only after the buffer is freed below
-					sqlite3_bind_text(query_stmt, 7, buffer, len, SQLITE_TRANSIENT);
-					// Use static here as we insert right away
-					sqlite3_bind_text(forward_stmt, 1, buffer, len, SQLITE_STATIC);
-
-					// Execute prepared forward statement and check if successful
-					if(sqlite3_step(forward_stmt) != SQLITE_DONE)
-					{
-						logg("Encountered error while trying to store forward destination in long-term database");
-						error = true;
-						break;
-					}
-					sqlite3_clear_bindings(forward_stmt);
-					sqlite3_reset(forward_stmt);
-				}
-				else
+				sqlite3_bind_text(stmt[FORWARD_STMT], 1, forward, -1, SQLITE_STATIC);
+				sqlite3_bind_text(stmt[FORWARD_ID_STMT], 1, forward, -1, SQLITE_STATIC);
+				if(!store_linked_value(db, stmt[FORWARD_STMT], stmt[FORWARD_ID_STMT], &id))
 				{
-					// Memory error: Do not store the forward destination
-					sqlite3_bind_null(query_stmt, 7);
+					logg("Encountered error while trying to store forward destination in long-term database");
+					error = true;
+					break;
 				}
-
-				if(buffer) free(buffer);
+				id_cache_add(&ids[FORWARD_IDS], key, len, id);
 			}
+			bind_linked_id(query_stmt, 6, id);
+			forwardID = id;
 		}
 		else
 		{
 			// No forward destination
-			sqlite3_bind_null(query_stmt, 7);
+			sqlite3_bind_null(query_stmt, 6);
 		}
 
-		const int cacheID = findCacheID(query->domainID, query->clientID, query->type, false);
-		DNSCacheData *cache = getDNSCache(cacheID, true);
-
-		// ADDITIONAL_INFO
-		if(query->status == QUERY_GRAVITY_CNAME ||
-		   query->status == QUERY_REGEX_CNAME ||
-		   query->status == QUERY_BLACKLIST_CNAME)
+		// Queries left out by sampling are counted in the totals and the
+		// hourly rollups but not stored themselves
+		if(query->sample == 0u)
 		{
-			// Save domain blocked during deep CNAME inspection
-			const char *cname = getCNAMEDomainString(query);
-			const int len = strlen(cname);
-			sqlite3_bind_int(query_stmt, 8, ADDINFO_CNAME_DOMAIN);
-			sqlite3_bind_text(query_stmt, 9, cname, len, SQLITE_STATIC);
-
-			// Execute prepared addinfo statement and check if successful
-			sqlite3_bind_int(addinfo_stmt, 1, ADDINFO_CNAME_DOMAIN);
-			sqlite3_bind_text(addinfo_stmt, 2, cname, len, SQLITE_STATIC);
-			if(sqlite3_step(addinfo_stmt) != SQLITE_DONE)
-			{
-				logg("Encountered error while trying to store addinfo in long-term database (CNAME)");
-				error = true;
-				break;
-			}
-			sqlite3_clear_bindings(addinfo_stmt);
-			sqlite3_reset(addinfo_stmt);
+			sqlite3_clear_bindings(query_stmt);
+			goto count_query;
 		}
-		else if(cache != NULL && cache->domainlist_id > -1)
-		{
-			sqlite3_bind_int(query_stmt, 8, ADDINFO_REGEX_ID);
-			sqlite3_bind_int(query_stmt, 9, cache->domainlist_id);
 
-			// Execute prepared addinfo statement and check if successful
-			sqlite3_bind_int(addinfo_stmt, 1, ADDINFO_REGEX_ID);
-			sqlite3_bind_int(addinfo_stmt, 2, cache->domainlist_id);
-			if(sqlite3_step(addinfo_stmt) != SQLITE_DONE)
+		// ADDITIONAL_INFO
+		if(query->addinfo == ADDINFO_CNAME_DOMAIN || query->addinfo == ADDINFO_REGEX_ID)
+		{
+			// Domain blocked during deep CNAME inspection or ID of the
+			// regex that matched
+			const char *cname = arena_get(&snap, query->cname);
+			if(query->addinfo == ADDINFO_CNAME_DOMAIN)
+				len = snprintf(key, sizeof(key), "%d%c%s", ADDINFO_CNAME_DOMAIN, '\0', cname);
+			else
+				len = snprintf(key, sizeof(key), "%d%c%d", ADDINFO_REGEX_ID, '\0', query->domainlist_id);
+			len = len < (int)sizeof(key) ? len : 0;
+			if(!id_cache_get(&ids[ADDINFO_IDS], key, len, &id))
 			{
-				logg("Encountered error while trying to store addinfo in long-term database (domainlist_id)");
-				error = true;
-				break;
+				sqlite3_stmt *addinfo_stmt[2] = { stmt[ADDINFO_STMT], stmt[ADDINFO_ID_STMT] };
+				for(unsigned int j = 0; j < 2; j++)
+				{
+					sqlite3_bind_int(addinfo_stmt[j], 1, query->addinfo);
+					if(query->addinfo == ADDINFO_CNAME_DOMAIN)
+						sqlite3_bind_text(addinfo_stmt[j], 2, cname, -1, SQLITE_STATIC);
+					else
+						sqlite3_bind_int(addinfo_stmt[j], 2, query->domainlist_id);
+				}
+				if(!store_linked_value(db, stmt[ADDINFO_STMT], stmt[ADDINFO_ID_STMT], &id))
+				{
+					logg("Encountered error while trying to store addinfo in long-term database (%s)",
+					     query->addinfo == ADDINFO_CNAME_DOMAIN ? "CNAME" : "domainlist_id");
+					error = true;
+					break;
+				}
+				id_cache_add(&ids[ADDINFO_IDS], key, len, id);
 			}
-			sqlite3_clear_bindings(addinfo_stmt);
-			sqlite3_reset(addinfo_stmt);
+			bind_linked_id(query_stmt, 7, id);
 		}
 		else
 		{
 			// Nothing to add here
-			sqlite3_bind_null(query_stmt, 8);
-			sqlite3_bind_null(query_stmt, 9);
+			sqlite3_bind_null(query_stmt, 7);
 		}
 
 		// REPLY_TYPE
-		sqlite3_bind_int(query_stmt, 10, query->reply);
+		sqlite3_bind_int(query_stmt, 8, query->reply);
 
 		// REPLY_TIME (stored in units of seconds) if available, NULL otherwise
-		if(query->flags.response_calculated)
-			sqlite3_bind_double(query_stmt, 11, 1e-4*query->response);
+		if(query->response_calculated)
+			sqlite3_bind_double(query_stmt, 9, query->response);
 		else
-			sqlite3_bind_null(query_stmt, 11);
+			sqlite3_bind_null(query_stmt, 9);
 
 		// DNSSEC
-		sqlite3_bind_int(query_stmt, 12, query->dnssec);
+		sqlite3_bind_int(query_stmt, 10, query->dnssec);
+
+		// SAMPLE (NULL when the query is not sampled)
+		if(query->sample > 1u)
+			sqlite3_bind_int(query_stmt, 11, query->sample);
+		else
+			sqlite3_bind_null(query_stmt, 11);
 
 		// Step and check if successful
 		if(sqlite3_step(query_stmt) != SQLITE_DONE)
@@ -443,17 +793,24 @@ int DB_save_queries(sqlite3 *db)
 		}
 		sqlite3_clear_bindings(query_stmt);
 		sqlite3_reset(query_stmt);
+		lastID++;
+
+count_query:
+		// Count the query in the hourly rollups
+		if(domainID > -1)
+			rollup_add(&rollups, ROLLUP_DOMAIN, query->timestamp, domainID, query->blocked);
+		if(clientID > -1)
+			rollup_add(&rollups, ROLLUP_CLIENT, query->timestamp, clientID, query->blocked);
+		rollup_add(&rollups, ROLLUP_STATUS, query->timestamp, query->status, query->blocked);
+		if(forwardID > -1)
+			rollup_add(&rollups, ROLLUP_FORWARD, query->timestamp, forwardID, query->blocked);
 
 		// Increment counters
 		saved++;
-		lastID++;
-
-		// Mark this query as saved in the database
-		query->flags.database = true;
 
 		// Total counter information (delta computation)
 		total++;
-		if(query->flags.blocked)
+		if(query->blocked)
 			blocked++;
 
 		// Update lasttimestamp variable with timestamp of the latest stored query
@@ -461,13 +818,37 @@ int DB_save_queries(sqlite3 *db)
 			newlasttimestamp = query->timestamp;
 	}
 
-	if(sqlite3_finalize(query_stmt) != SQLITE_OK ||
-	   sqlite3_finalize(domain_stmt) != SQLITE_OK ||
-	   sqlite3_finalize(client_stmt) != SQLITE_OK ||
-	   sqlite3_finalize(forward_stmt) != SQLITE_OK ||
-	   sqlite3_finalize(addinfo_stmt) != SQLITE_OK)
+	// Reset cached statements for the next run, finalize them otherwise.
+	// Both return the error of the most recent step (if any)
+	bool stmt_failed = false;
+	for(unsigned int i = 0; i < SAVE_STMT_MAX; i++)
+	{
+		if(cached)
+		{
+			sqlite3_clear_bindings(stmt[i]);
+			if(sqlite3_reset(stmt[i]) != SQLITE_OK)
+				stmt_failed = true;
+		}
+		else if(sqlite3_finalize(stmt[i]) != SQLITE_OK)
+			stmt_failed = true;
+	}
+
+	// Prepare the statements again on the next run after an error (e.g.,
+	// SQLITE_SCHEMA when the schema changed and could not be re-prepared)
+	if(cached && (error || stmt_failed))
+		DB_finalize_save_statements();
+
+	// The hourly rollups are updated in the same transaction so they always
+	// match the stored queries
+	const bool rollup_failed = !stmt_failed && saved > 0 && !rollup_store(db, &rollups);
+	rollup_free(&rollups);
+
+	if(stmt_failed || rollup_failed)
 	{
-		logg("Statement finalization failed when trying to store queries to long-term database");
+		if(rollup_failed)
+			logg("Updating hourly rollups failed when trying to store queries to long-term database");
+		else
+			logg("Statement finalization failed when trying to store queries to long-term database");
 
 		if(!checkFTLDBrc(rc) && rc == SQLITE_BUSY)
 		{
@@ -475,16 +856,17 @@ int DB_save_queries(sqlite3 *db)
 			saving_failed_before = true;
 		}
 
+		rollback_save_transaction(db, ids);
 		if(db_opened) dbclose(&db);
+		free_snapshot(&snap);
 
 		return DB_FAILED;
 	}
 
-	// Store index for next loop iteration round and update last time stamp
-	// in the database only if all queries have been saved successfully
+	// Update last time stamp in the database only if all queries have been
+	// saved successfully
 	if(saved > 0 && !error)
 	{
-		lastdbindex = queryID;
 		db_set_FTL_property(db, DB_LASTTIMESTAMP, newlasttimestamp);
 		db_update_counters(db, total, blocked);
 	}
@@ -501,15 +883,29 @@ int DB_save_queries(sqlite3 *db)
 			saving_failed_before = true;
 		}
 
+		rollback_save_transaction(db, ids);
 		if(db_opened) dbclose(&db);
+		free_snapshot(&snap);
 
 		return DB_FAILED;
 	}
 
+	// IDs found in a private connection are not kept
+	if(!cached)
+		id_caches_clear(local_ids);
+
+	// Mark the stored queries in memory only now that the transaction has
+	// succeeded so they are stored again after a failure
+	lock_shm();
+	mark_queries_saved(&snap, (unsigned int)saved);
+	unlock_shm();
+	free_snapshot(&snap);
+
+	const double took = timer_stop(DATABASE_WRITE_TIMER);
 	if(config.debug & DEBUG_DATABASE || saving_failed_before)
 	{
 		logg("Notice: Queries stored in long-term database: %u (took %.1f ms, last SQLite ID %li)",
-		     saved, timer_elapsed_msec(DATABASE_WRITE_TIMER), lastID);
+		     saved, took, lastID);
 		if(saving_failed_before)
 		{
 			logg("        Queries from earlier attempt(s) stored successfully");
@@ -522,26 +918,73 @@ int DB_save_queries(sqlite3 *db)
 	return saved;
 }
 
-void delete_old_queries_in_DB(sqlite3 *db)
+int DB_save_queries(sqlite3 *db)
+{
+	FTL_PROBE(db__save__start);
+	const int saved = save_queries(db);
+	FTL_PROBE2(db__save__done, saved, (uint64_t)(1e3*timer_elapsed_msec(DATABASE_WRITE_TIMER)));
+	return saved;
+}
+
+// Get the number of queries added to memory since the last export to the
+// database. This includes queries that are not yet complete
+int DB_pending_queries(void)
+{
+	lock_shm_shared();
+	const int pending = counters->queries - MAX(0, lastdbindex);
+	unlock_shm_shared();
+	return pending;
+}
+
+// Delete queries older than MAXDBDAYS. A single DELETE can take minutes on a
+// large database and blocks the database thread for this time, we delete at
+// most DELETE_BATCH_ROWS rows per call instead. Returns true if there are more
+// rows to be deleted in a subsequent call
+#define DELETE_BATCH_ROWS 10000
+bool delete_old_queries_in_DB(sqlite3 *db)
 {
+	TIME_SCOPE("database_delete");
+
 	// Return early if database is known to be broken
 	if(FTLDBerror())
-		return;
+		return false;
 
-	int timestamp = time(NULL) - config.maxDBdays * 86400;
+	// The limit is kept until all old queries have been deleted so this
+	// terminates even while new queries are added
+	static int timestamp = 0;
+	static int deleted = 0;
+	if(timestamp == 0)
+		timestamp = time(NULL) - config.maxDBdays * 86400;
 
-	if(dbquery(db, "DELETE FROM query_storage WHERE timestamp <= %i", timestamp) != SQLITE_OK)
+	if(dbquery(db, "DELETE FROM query_storage WHERE id IN "
+	               "(SELECT id FROM query_storage WHERE timestamp <= %i LIMIT %i)",
+	           timestamp, DELETE_BATCH_ROWS) != SQLITE_OK)
 	{
 		logg("delete_old_queries_in_DB(): Deleting queries due to age of entries failed!");
-		return;
+		timestamp = 0;
+		deleted = 0;
+		return false;
 	}
 
 	// Get how many rows have been affected (deleted)
 	const int affected = sqlite3_changes(db);
+	deleted += affected;
+	if(affected == DELETE_BATCH_ROWS)
+		return true;
+
+	// Hours entirely older than the limit are removed from the rollups
+	delete_old_rollups(db, timestamp);
+
+	// Archived blocks are removed when their newest query is too old
+	delete_old_archive_blocks(db, timestamp);
 
 	// Print final message only if there is a difference
-	if((config.debug & DEBUG_DATABASE) || affected)
-		logg("Notice: Database size is %.2f MB, deleted %i rows", 1e-6*get_FTL_db_filesize(), affected);
+	if((config.debug & DEBUG_DATABASE) || deleted)
+		logg("Notice: Database size is %.2f MB, deleted %i rows", 1e-6*get_FTL_db_filesize(), deleted);
+
+	timestamp = 0;
+	deleted = 0;
+	return false;
 }
 
 bool add_additional_info_column(sqlite3 *db)
@@ -589,6 +1032,72 @@ bool add_query_storage_columns(sqlite3 *db)
 	return true;
 }
 
+// Long-term statistics filter the queries by a time range and a client or a
+// status. The composite indexes turn these into index range scans, the first
+// one contains all columns needed to count the queries of a time range by
+// client and status without looking at the table itself. It also replaces the
+// index on the timestamp alone
+bool create_query_storage_indexes(sqlite3 *db)
+{
+	// Start transaction of database update
+	SQL_bool(db, "BEGIN TRANSACTION");
+
+	SQL_bool(db, "CREATE INDEX query_storage_timestamp_client_status_idx ON query_storage (timestamp, client, status);");
+	SQL_bool(db, "CREATE INDEX query_storage_client_timestamp_idx ON query_storage (client, timestamp);");
+	SQL_bool(db, "CREATE INDEX query_storage_status_timestamp_idx ON query_storage (status, timestamp);");
+	SQL_bool(db, "DROP INDEX IF EXISTS idx_queries_timestamps;");
+
+	// Give the query planner statistics about the new indexes right away,
+	// they are refreshed by the database maintenance afterwards
+	SQL_bool(db, "PRAGMA analysis_limit = %d;", DB_ANALYSIS_LIMIT);
+	SQL_bool(db, "ANALYZE query_storage;");
+
+	// Update database version to 16
+	if(!db_set_FTL_property(db, DB_VERSION, 16))
+	{
+		logg("create_query_storage_indexes(): Failed to update database version!");
+		return false;
+	}
+
+	// Finish transaction
+	SQL_bool(db, "COMMIT");
+
+	return true;
+}
+
+// Queries stored while sampling (see SAMPLE_QUERIES) have the sampling rate in
+// the column sample, it is NULL for all other queries
+bool add_query_sample_column(sqlite3 *db)
+{
+	// Start transaction of database update
+	SQL_bool(db, "BEGIN TRANSACTION");
+
+	SQL_bool(db, "ALTER TABLE query_storage ADD COLUMN sample INTEGER");
+
+	// Update VIEW queries
+	SQL_bool(db, "DROP VIEW queries");
+	SQL_bool(db, "CREATE VIEW queries AS "
+	                     "SELECT id, timestamp, type, status, "
+	                       "CASE typeof(domain) WHEN 'integer' THEN (SELECT domain FROM domain_by_id d WHERE d.id = q.domain) ELSE domain END domain,"
+	                       "CASE typeof(client) WHEN 'integer' THEN (SELECT ip FROM client_by_id c WHERE c.id = q.client) ELSE client END client,"
+	                       "CASE typeof(forward) WHEN 'integer' THEN (SELECT forward FROM forward_by_id f WHERE f.id = q.forward) ELSE forward END forward,"
+	                       "CASE typeof(additional_info) WHEN 'integer' THEN (SELECT content FROM addinfo_by_id a WHERE a.id = q.additional_info) ELSE additional_info END additional_info, "
+	                       "reply_type, reply_time, dnssec, sample "
+	                       "FROM query_storage q");
+
+	// Update database version to 17
+	if(!db_set_FTL_property(db, DB_VERSION, 17))
+	{
+		logg("add_query_sample_column(): Failed to update database version!");
+		return false;
+	}
+
+	// Finish transaction
+	SQL_bool(db, "COMMIT");
+
+	return true;
+}
+
 bool optimize_queries_table(sqlite3 *db)
 {
 	// Start transaction of database update
@@ -684,6 +1193,169 @@ bool create_addinfo_table(sqlite3 *db)
 	return true;
 }
 
+// Resolves the IDs of the linking tables (domain_by_id, ...) stored in
+// query_storage while importing queries. The string behind each ID is looked
+// up only once, the FTL ID it resolved to is remembered in a map indexed by
+// the database ID. This replaces the sub-queries of the queries view for
+// every imported row
+#define IMPORT_MAP_MAX (1 << 24)
+typedef struct {
+	sqlite3_stmt *stmt;
+	int *map;
+	sqlite3_int64 size;
+} importMap;
+
+static bool import_map_init(sqlite3 *db, importMap *map, const char *table, const char *column)
+{
+	char querystr[128];
+	snprintf(querystr, sizeof(querystr), "SELECT MAX(id) FROM %s", table);
+	const int max = db_query_int(db, querystr);
+
+	// The map is optional, we look up the strings for every row without it
+	map->map = NULL;
+	map->size = 0;
+	if(max >= 0 && max < IMPORT_MAP_MAX && (map->map = calloc(max + 1, sizeof(int))) != NULL)
+		map->size = max + 1;
+
+	snprintf(querystr, sizeof(querystr), "SELECT %s FROM %s WHERE id = ?", column, table);
+	const int rc = sqlite3_prepare_v3(db, querystr, -1, SQLITE_PREPARE_PERSISTENT, &map->stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("DB_read_queries() - SQL error prepare: %s", sqlite3_errstr(rc));
+		checkFTLDBrc(rc);
+		if(map->map != NULL)
+			free(map->map);
+		map->map = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+static void import_map_free(importMap *map)
+{
+	if(map->stmt != NULL)
+		sqlite3_finalize(map->stmt);
+	if(map->map != NULL)
+		free(map->map);
+	memset(map, 0, sizeof(*map));
+}
+
+// Get the FTL ID the database ID in column col of the row has been resolved to
+// before, -1 if not known
+static int import_map_get(const importMap *map, sqlite3_stmt *row, const int col)
+{
+	if(map->map == NULL || sqlite3_column_type(row, col) != SQLITE_INTEGER)
+		return -1;
+
+	const sqlite3_int64 id = sqlite3_column_int64(row, col);
+	if(id < 0 || id >= map->size)
+		return -1;
+
+	return map->map[id] - 1;
+}
+
+static void import_map_set(importMap *map, sqlite3_stmt *row, const int col, const int ftlID)
+{
+	if(map->map == NULL || ftlID < 0 || sqlite3_column_type(row, col) != SQLITE_INTEGER)
+		return;
+
+	const sqlite3_int64 id = sqlite3_column_int64(row, col);
+	if(id >= 0 && id < map->size)
+		map->map[id] = ftlID + 1;
+}
+
+// Get the value of column col of the row the same way the queries view does:
+// Integers are IDs in the linking table, anything else is stored in the row
+// itself (older rows). Returns the statement and column to read the value from
+// or NULL if the ID is not known
+static sqlite3_stmt *import_get_value(importMap *map, sqlite3_stmt *row, const int col, int *valcol)
+{
+	*valcol = col;
+	if(sqlite3_column_type(row, col) != SQLITE_INTEGER)
+		return row;
+
+	sqlite3_reset(map->stmt);
+	sqlite3_bind_int64(map->stmt, 1, sqlite3_column_int64(row, col));
+	if(sqlite3_step(map->stmt) != SQLITE_ROW)
+		return NULL;
+
+	*valcol = 0;
+	return map->stmt;
+}
+
+static const char *import_get_string(importMap *map, sqlite3_stmt *row, const int col)
+{
+	int valcol;
+	sqlite3_stmt *src = import_get_value(map, row, col, &valcol);
+	return src != NULL ? (const char *)sqlite3_column_text(src, valcol) : NULL;
+}
+
+// Resolve all IDs of a linking table referenced by the queries to be imported
+// at once. A single join replaces a lookup of each ID while reading the rows.
+// Has to be called while holding the SHM lock
+static void import_map_preload(sqlite3 *db, importMap *map, const char *table, const char *column,
+                               const char *ref, const time_t mintime, int (*resolve)(const char *value))
+{
+	if(map->map == NULL)
+		return;
+
+	char querystr[256];
+	snprintf(querystr, sizeof(querystr), "SELECT t.id,t.%s FROM %s t WHERE t.id IN "
+	                                     "(SELECT DISTINCT %s FROM query_storage WHERE timestamp >= ?)",
+	         column, table, ref);
+
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		// Not fatal, the IDs are resolved one by one while reading the rows
+		logg("DB_read_queries() - SQL error prepare: %s", sqlite3_errstr(rc));
+		return;
+	}
+	sqlite3_bind_int64(stmt, 1, mintime);
+
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		const char *value = (const char *)sqlite3_column_text(stmt, 1);
+		if(value == NULL)
+			continue;
+
+		// Ensure we have enough shared memory available for new data
+		shm_ensure_size();
+
+		const sqlite3_int64 id = sqlite3_column_int64(stmt, 0);
+		const int ftlID = resolve(value);
+		if(id >= 0 && id < map->size && ftlID > -1)
+			map->map[id] = ftlID + 1;
+	}
+
+	sqlite3_finalize(stmt);
+}
+
+// Domains are only counted for the queries actually imported
+static int import_domain(const char *domain)
+{
+	return findDomainID(domain, hashStr(domain), false);
+}
+
+// The forward column has the format IP#port, the port is optional
+static int import_upstream(const char *forward)
+{
+	if(forward[0] == '\0')
+		return -1;
+
+	// Get IP address and port of upstream destination
+	char serv_addr[INET6_ADDRSTRLEN] = { 0 };
+	unsigned int serv_port = 53;
+	// We limit the number of bytes written into the serv_addr buffer
+	// to prevent buffer overflows. If there is no port available in
+	// the database, we skip extracting them and use the default port
+	sscanf(forward, "%"xstr(INET6_ADDRSTRLEN)"[^#]#%u", serv_addr, &serv_port);
+	serv_addr[INET6_ADDRSTRLEN-1] = '\0';
+	return findUpstreamID(serv_addr, (in_port_t)serv_port);
+}
+
 // Get most recent 24 hours data from long-term database
 void DB_read_queries(void)
 {
@@ -703,13 +1375,24 @@ void DB_read_queries(void)
 	// Get time stamp 24 hours in the past
 	const time_t now = time(NULL);
 	const time_t mintime = now - config.maxlogage;
-	const char *querystr = "SELECT id,timestamp,type,status,domain,client,forward,additional_info,reply_type,reply_time,dnssec FROM queries WHERE timestamp >= ?";
+	const char *querystr = "SELECT id,timestamp,type,status,domain,client,forward,additional_info,reply_type,reply_time,dnssec,sample FROM query_storage WHERE timestamp >= ?";
 	// Log FTL_db query string in debug mode
 	if(config.debug & DEBUG_DATABASE)
 		logg("DB_read_queries(): \"%s\" with ? = %lli", querystr, (long long)mintime);
 
-	// Prepare SQLite3 statement
+	// Prepare lookups of the linking tables
+	importMap domains = { 0 }, clients = { 0 }, forwards = { 0 }, addinfos = { 0 };
 	sqlite3_stmt* stmt = NULL;
+	if(!import_map_init(db, &domains, "domain_by_id", "domain") ||
+	   !import_map_init(db, &clients, "client_by_id", "ip") ||
+	   !import_map_init(db, &forwards, "forward_by_id", "forward") ||
+	   !import_map_init(db, &addinfos, "addinfo_by_id", "content"))
+		goto end_of_DB_read_queries;
+	// Additional info is not mapped, it is needed only for few queries
+	free(addinfos.map);
+	addinfos.map = NULL;
+
+	// Prepare SQLite3 statement
 	int rc = sqlite3_prepare_v3(db, querystr, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
 	if( rc != SQLITE_OK ){
 		logg("DB_read_queries() - SQL error prepare: %s", sqlite3_errstr(rc));
@@ -725,9 +1408,24 @@ void DB_read_queries(void)
 		goto end_of_DB_read_queries;
 	}
 
+	// Count the queries to be imported so the shared memory can be enlarged
+	// once instead of in many small steps
+	char countstr[128];
+	snprintf(countstr, sizeof(countstr), "SELECT COUNT(*) FROM query_storage WHERE timestamp >= %lli", (long long)mintime);
+	const int count = db_query_int(db, countstr);
+
 	// Lock shared memory
 	lock_shm();
 
+	if(count > 0)
+		shm_reserve_queries(count);
+
+	// Create all domains and upstreams referenced by the linking tables in
+	// one pass. Clients are still added while reading the rows, as a client
+	// can not exist without queries
+	import_map_preload(db, &domains, "domain_by_id", "domain", "domain", mintime, import_domain);
+	import_map_preload(db, &forwards, "forward_by_id", "forward", "forward", mintime, import_upstream);
+
 	// Loop through returned database rows
 	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
 	{
@@ -767,14 +1465,21 @@ void DB_read_queries(void)
 		}
 		const enum query_status status = status_int;
 
-		const char * domainname = (const char *)sqlite3_column_text(stmt, 4);
-		if(domainname == NULL)
+		// The strings are only needed for domains and clients not seen
+		// before during this import
+		int domainID = import_map_get(&domains, stmt, 4);
+		const char * domainname = NULL;
+		if(domainID < 0 && (domainname = import_get_string(&domains, stmt, 4)) == NULL)
 		{
 			logg("DB warn: DOMAIN should never be NULL, %lli", (long long)queryTimeStamp);
 			continue;
 		}
 
-		const char * clientIP = (const char *)sqlite3_column_text(stmt, 5);
+		int clientID = import_map_get(&clients, stmt, 5);
+		const clientsData *known_client = clientID > -1 ? getClient(clientID, true) : NULL;
+		const char * clientIP = known_client != NULL ? getstr(known_client->ippos) : import_get_string(&clients, stmt, 5);
+		if(known_client == NULL)
+			clientID = -1;
 		if(clientIP == NULL)
 		{
 			logg("DB warn: CLIENT should never be NULL, %lli", (long long)queryTimeStamp);
@@ -792,20 +1497,13 @@ void DB_read_queries(void)
 		shm_ensure_size();
 
 		const char *buffer = NULL;
-		int upstreamID = -1; // Default if not forwarded
+		int upstreamID = import_map_get(&forwards, stmt, 6); // -1 if not forwarded
 		// Try to extract the upstream from the "forward" column if non-empty
-		if(sqlite3_column_bytes(stmt, 6) > 0 &&
-		   (buffer = (const char *)sqlite3_column_text(stmt, 6)) != NULL)
+		if(upstreamID < 0 && sqlite3_column_type(stmt, 6) != SQLITE_NULL &&
+		   (buffer = import_get_string(&forwards, stmt, 6)) != NULL && buffer[0] != '\0')
 		{
-			// Get IP address and port of upstream destination
-			char serv_addr[INET6_ADDRSTRLEN] = { 0 };
-			unsigned int serv_port = 53;
-			// We limit the number of bytes written into the serv_addr buffer
-			// to prevent buffer overflows. If there is no port available in
-			// the database, we skip extracting them and use the default port
-			sscanf(buffer, "%"xstr(INET6_ADDRSTRLEN)"[^#]#%u", serv_addr, &serv_port);
-			serv_addr[INET6_ADDRSTRLEN-1] = '\0';
-			upstreamID = findUpstreamID(serv_addr, (in_port_t)serv_port);
+			upstreamID = import_upstream(buffer);
+			import_map_set(&forwards, stmt, 6, upstreamID);
 		}
 
 		int reply_type = REPLY_UNKNOWN;
@@ -846,10 +1544,46 @@ void DB_read_queries(void)
 			}
 		}
 
+		// A sampled query stands for the queries left out by sampling
+		// before it was stored (see SAMPLE_QUERIES). It is imported once
+		// and counted with the weight of all of them
+		int weight = 1;
+		if(sqlite3_column_type(stmt, 11) == SQLITE_INTEGER && sqlite3_column_int(stmt, 11) > 1)
+		{
+			weight = sqlite3_column_int(stmt, 11);
+			if(weight > UINT16_MAX + 1)
+				weight = UINT16_MAX + 1;
+		}
+
 		// Obtain IDs only after filtering which queries we want to keep
 		const int timeidx = getOverTimeID(queryTimeStamp);
-		const int domainID = findDomainID(domainname, true);
-		const int clientID = findClientID(clientIP, true, false);
+		int domain_counted = 0;
+		if(domainID < 0)
+		{
+			// findDomainID() counts the query once
+			domainID = findDomainID(domainname, hashStr(domainname), true);
+			import_map_set(&domains, stmt, 4, domainID);
+			domain_counted = 1;
+		}
+		// Count the query the same way findDomainID() does
+		domainsData* known_domain = getDomain(domainID, true);
+		if(known_domain != NULL && weight > domain_counted)
+		{
+			known_domain->count += weight - domain_counted;
+			update_domain_leaderboards(domainID);
+		}
+		int client_counted = 0;
+		if(clientID < 0)
+		{
+			// findClientID() counts the query once
+			clientID = findClientID(clientIP, true, false);
+			import_map_set(&clients, stmt, 5, clientID);
+			client_counted = 1;
+		}
+		// Count the query the same way findClientID() does
+		clientsData* counted_client = getClient(clientID, true);
+		if(counted_client != NULL && weight > client_counted)
+			change_clientcount(counted_client, weight - client_counted, 0, -1, 0);
 
 		// Set index for this query
 		const int queryIndex = counters->queries;
@@ -886,7 +1620,7 @@ void DB_read_queries(void)
 		query->flags.response_calculated = reply_time_avail;
 		query->dnssec = dnssec;
 		query->reply = reply_type;
-		counters->reply[query->reply]++;
+		counter_add(reply[query->reply], weight);
 		query->response = reply_time * 1e4; // convert to tenth-millisecond unit
 		query->CNAME_domainID = -1;
 		// Initialize flags
@@ -895,39 +1629,54 @@ void DB_read_queries(void)
 		query->flags.whitelisted = false;
 		query->flags.database = true;
 		query->ede = -1; // EDE_UNSET == -1
+		query->unsampled = weight - 1;
+		counters->queries_unsampled += query->unsampled;
 
 		// Set lastQuery timer for network table
 		clientsData* client = getClient(clientID, true);
 		client->lastQuery = queryTimeStamp;
 
 		// Handle type counters
-		counters->querytype[query->type-1]++;
+		counter_add(querytype[query->type-1], weight);
 
 		// Update overTime data
-		overTime[timeidx].total++;
+		overTime[timeidx].total += weight;
+		timeseries_update(query->timestamp, weight, 0);
 		// Update overTime data structure with the new client
-		change_clientcount(client, 0, 0, timeidx, 1);
+		change_clientcount(client, 0, 0, timeidx, weight);
+
+		// Add query to the query lists of its domain and client
+		link_query(queryIndex, query);
+		heavy_hitters_add(query, weight);
+		cardinality_add(query);
 
 		// Increase DNS queries counter
 		counters->queries++;
 
 		// Get additional information from the additional_info column if applicable
+		sqlite3_stmt *addinfo = NULL;
+		int valcol = 0;
 		if(status == QUERY_GRAVITY_CNAME ||
 		   status == QUERY_REGEX_CNAME ||
 		   status == QUERY_BLACKLIST_CNAME)
 		{
 			// QUERY_*_CNAME: Get domain causing the blocking
-			const char *CNAMEdomain = (const char *)sqlite3_column_text(stmt, 7);
+			const char *CNAMEdomain = import_get_string(&addinfos, stmt, 7);
 			if(CNAMEdomain != NULL && strlen(CNAMEdomain) > 0)
 			{
 				// Add domain to FTL's memory but do not count it. Seeing a
 				// domain in the middle of a CNAME trajectory does not mean
 				// it was queried intentionally.
-				const int CNAMEdomainID = findDomainID(CNAMEdomain, false);
+				const int CNAMEdomainID = findDomainID(CNAMEdomain, hashStr(CNAMEdomain), false);
 				query->CNAME_domainID = CNAMEdomainID;
+				domainsData *CNAMEdomain_ptr = getDomain(CNAMEdomainID, true);
+				if(CNAMEdomain_ptr != NULL)
+					CNAMEdomain_ptr->cname_blocked = true;
 			}
 		}
-		else if(sqlite3_column_bytes(stmt, 7) != 0)
+		else if(sqlite3_column_type(stmt, 7) != SQLITE_NULL &&
+		        (addinfo = import_get_value(&addinfos, stmt, 7, &valcol)) != NULL &&
+		        sqlite3_column_bytes(addinfo, valcol) != 0)
 		{
 			// Set ID of the domainlist entry that was the reason for permitting/blocking this query
 			// We assume the value in this field is said ID when it is not a CNAME-related domain
@@ -937,13 +1686,13 @@ void DB_read_queries(void)
 			// Only load if
 			//  a) we have a cache entry
 			if(cache != NULL)
-				cache->domainlist_id = sqlite3_column_int(stmt, 7);
+				cache->domainlist_id = sqlite3_column_int(addinfo, valcol);
 		}
 
-		// Increment status counters, we first have to add one to the count of
-		// unknown queries because query_set_status() will subtract from there
-		// when setting a different status
-		counters->status[QUERY_UNKNOWN]++;
+		// Increment status counters, we first have to add the query to the
+		// count of unknown queries because query_set_status() will subtract
+		// from there when setting a different status
+		counter_add(status[QUERY_UNKNOWN], weight);
 		query_set_status(query, status);
 
 		// Do further processing based on the query status we read from the database
@@ -964,10 +1713,12 @@ void DB_read_queries(void)
 			case QUERY_DBBUSY: // Blocked because gravity database was busy
 			case QUERY_SPECIAL_DOMAIN: // Blocked by special domain handling
 				query->flags.blocked = true;
+				query_remember_blocked(query);
 				// Get domain pointer
 				domainsData* domain = getDomain(domainID, true);
-				domain->blockedcount++;
-				change_clientcount(client, 0, 1, -1, 0);
+				domain->blockedcount += weight;
+				update_domain_leaderboards(domainID);
+				change_clientcount(client, 0, weight, -1, 0);
 				break;
 
 			case QUERY_FORWARDED: // Forwarded
@@ -980,8 +1731,10 @@ void DB_read_queries(void)
 					upstreamsData *upstream = getUpstream(upstreamID, true);
 					if(upstream != NULL)
 					{
-						upstream->overTime[timeidx]++;
+						overTime_add(&upstream->overTime, timeidx, weight);
 						upstream->lastQuery = queryTimeStamp;
+						if(query->flags.response_calculated)
+							add_upstream_rtime(upstream, queryTimeStamp, query->response);
 					}
 				}
 				break;
@@ -1003,7 +1756,11 @@ void DB_read_queries(void)
 	}
 
 	unlock_shm();
-	logg("Imported %i queries from the long-term database", counters->queries);
+	if(counters->queries_unsampled > 0)
+		logg("Imported %i queries (standing for %i) from the long-term database",
+		     counters->queries, total_queries());
+	else
+		logg("Imported %i queries from the long-term database", counters->queries);
 
 	// Update lastdbindex so that the next call to DB_save_queries()
 	// skips the queries that we just imported from the database
@@ -1015,9 +1772,97 @@ void DB_read_queries(void)
 		goto end_of_DB_read_queries;
 	}
 
-	// Finalize SQLite3 statement
-	sqlite3_finalize(stmt);
+end_of_DB_read_queries:
+	// Finalize SQLite3 statements
+	if(stmt != NULL)
+		sqlite3_finalize(stmt);
+	import_map_free(&domains);
+	import_map_free(&clients);
+	import_map_free(&forwards);
+	import_map_free(&addinfos);
+
+	// Close database here, we have to reopen it later (after forking)
+	dbclose(&db);
+}
+
+// Read the queries stored in the database with from <= timestamp < before
+// (and timestamp <= until unless until is zero) in the order they were
+// stored and hand them to callback until it returns false. This is used by
+// the API for queries no longer in memory (see QUERY_MEMORY_LIMIT)
+bool DB_read_old_queries(const time_t from, const time_t until, const time_t before,
+                         bool (*callback)(const struct db_query *query, void *arg), void *arg)
+{
+	// Return early if database is known to be broken
+	if(FTLDBerror())
+		return false;
+
+	sqlite3 *db = dbopen(false);
+	if(db == NULL)
+	{
+		logg("DB_read_old_queries() - Failed to open DB");
+		return false;
+	}
+
+	const char *querystr = "SELECT timestamp,type,status,domain,client,forward,additional_info,reply_type,reply_time,dnssec "
+	                       "FROM queries WHERE timestamp >= ?1 AND timestamp < ?2 ORDER BY id";
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("DB_read_old_queries() - SQL error prepare: %s", sqlite3_errstr(rc));
+		dbclose(&db);
+		return false;
+	}
+
+	const time_t end = until != 0 && until < before ? until + 1 : before;
+	sqlite3_bind_int64(stmt, 1, from);
+	sqlite3_bind_int64(stmt, 2, end);
+
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		struct db_query query = {
+			.timestamp = sqlite3_column_int64(stmt, 0),
+			.type = sqlite3_column_int(stmt, 1),
+			.status = sqlite3_column_int(stmt, 2),
+			.reply_type = REPLY_UNKNOWN,
+			.dnssec = DNSSEC_UNSPECIFIED,
+			.reply_time = -1.0,
+			.domain = (const char*)sqlite3_column_text(stmt, 3),
+			.client = (const char*)sqlite3_column_text(stmt, 4),
+			.forward = (const char*)sqlite3_column_text(stmt, 5),
+			.cname_domain = NULL,
+			.domainlist_id = -1
+		};
+
+		if(query.domain == NULL || query.client == NULL)
+			continue;
+
+		// The additional info is the domain causing the blocking of
+		// queries blocked in a CNAME chain and the ID of the domainlist
+		// entry responsible for permitting/blocking otherwise
+		if(query.status == QUERY_GRAVITY_CNAME ||
+		   query.status == QUERY_REGEX_CNAME ||
+		   query.status == QUERY_BLACKLIST_CNAME)
+			query.cname_domain = (const char*)sqlite3_column_text(stmt, 6);
+		else if(sqlite3_column_type(stmt, 6) == SQLITE_INTEGER)
+			query.domainlist_id = sqlite3_column_int(stmt, 6);
+
+		if(sqlite3_column_type(stmt, 7) == SQLITE_INTEGER)
+			query.reply_type = sqlite3_column_int(stmt, 7);
+		if(sqlite3_column_type(stmt, 8) == SQLITE_FLOAT)
+			query.reply_time = sqlite3_column_double(stmt, 8);
+		if(sqlite3_column_type(stmt, 9) == SQLITE_INTEGER)
+			query.dnssec = sqlite3_column_int(stmt, 9);
+
+		if(!callback(&query, arg))
+			break;
+	}
 
-end_of_DB_read_queries:	// Close database here, we have to reopen it later (after forking)
+	const bool success = rc == SQLITE_ROW || rc == SQLITE_DONE;
+	if(!success)
+		logg("DB_read_old_queries() - SQL error step: %s", sqlite3_errstr(rc));
+
+	sqlite3_finalize(stmt);
 	dbclose(&db);
+	return success;
 }
@@ -11,14 +11,37 @@
 #define DATABASE_QUERY_TABLE_H
 
 #include "sqlite3.h"
+// time_t
+#include <time.h>
+
+// A query read from the database by DB_read_old_queries()
+struct db_query {
+	time_t timestamp;
+	int type;
+	int status;
+	int reply_type;
+	int dnssec;
+	double reply_time; // negative when not available
+	const char *domain;
+	const char *client;
+	const char *forward; // NULL when not forwarded
+	const char *cname_domain; // NULL unless blocked in a CNAME chain
+	int domainlist_id;
+};
 
 int get_number_of_queries_in_DB(sqlite3 *db);
-void delete_old_queries_in_DB(sqlite3 *db);
+bool delete_old_queries_in_DB(sqlite3 *db);
 bool add_additional_info_column(sqlite3 *db);
 bool optimize_queries_table(sqlite3 *db);
 bool create_addinfo_table(sqlite3 *db);
 int DB_save_queries(sqlite3 *db);
+void DB_finalize_save_statements(void);
+int DB_pending_queries(void);
 void DB_read_queries(void);
 bool add_query_storage_columns(sqlite3 *db);
+bool create_query_storage_indexes(sqlite3 *db);
+bool add_query_sample_column(sqlite3 *db);
+bool DB_read_old_queries(const time_t from, const time_t until, const time_t before,
+                         bool (*callback)(const struct db_query *query, void *arg), void *arg);
 
 #endif //DATABASE_QUERY_TABLE_H
@@ -0,0 +1,244 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  pihole-FTL.db -> hourly rollup tables
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "../FTL.h"
+#include "rollup-table.h"
+#include "common.h"
+#include "../log.h"
+// is_blocked()
+#include "../datastructure.h"
+
+// The rollup tables hold the number of total and blocked queries per hour and
+// per domain, client, status and forward destination. Domains, clients and
+// forward destinations are the IDs of the linking tables (domain_by_id, ...)
+// also used by query_storage. Long-term statistics can be computed from them
+// without scanning the individual queries. They are updated in the same
+// transaction that stores the queries
+#define ROLLUP_INTERVAL 3600
+
+static const char *rollup_names[ROLLUP_TABLE_MAX] = {
+	[ROLLUP_DOMAIN] = "domain",
+	[ROLLUP_CLIENT] = "client",
+	[ROLLUP_STATUS] = "status",
+	[ROLLUP_FORWARD] = "forward"
+};
+
+// Maps the column of query_storage onto the ID used in the rollup table. Rows
+// stored before database version 10 contain the strings themselves
+static const char *rollup_values[ROLLUP_TABLE_MAX] = {
+	[ROLLUP_DOMAIN] = "CASE typeof(domain) WHEN 'integer' THEN domain "
+	                  "ELSE (SELECT id FROM domain_by_id d WHERE d.domain = q.domain) END",
+	[ROLLUP_CLIENT] = "CASE typeof(client) WHEN 'integer' THEN client "
+	                  "ELSE (SELECT id FROM client_by_id c WHERE c.ip = q.client AND c.name = '') END",
+	[ROLLUP_STATUS] = "status",
+	[ROLLUP_FORWARD] = "CASE typeof(forward) WHEN 'integer' THEN forward "
+	                   "WHEN 'text' THEN (SELECT id FROM forward_by_id f WHERE f.forward = q.forward) END"
+};
+
+struct rollupEntry {
+	sqlite3_int64 hour;
+	sqlite3_int64 value;
+	unsigned int total;
+	unsigned int blocked;
+	unsigned char table;
+	bool used;
+};
+
+bool create_rollup_tables(sqlite3 *db)
+{
+	// List of blocking status values for aggregating the existing queries
+	char blocked[128] = "";
+	size_t len = 0u;
+	for(enum query_status status = QUERY_UNKNOWN; status < QUERY_STATUS_MAX; status++)
+		if(is_blocked(status) && len < sizeof(blocked))
+			len += snprintf(blocked + len, sizeof(blocked) - len, "%s%d", len > 0 ? "," : "", status);
+
+	// Start transaction of database update
+	SQL_bool(db, "BEGIN TRANSACTION");
+
+	// Legacy strings get an ID in the linking tables so they can be
+	// aggregated like all other queries
+	SQL_bool(db, "INSERT OR IGNORE INTO domain_by_id (domain) "
+	             "SELECT DISTINCT domain FROM query_storage WHERE typeof(domain) = 'text'");
+	SQL_bool(db, "INSERT OR IGNORE INTO client_by_id (ip,name) "
+	             "SELECT DISTINCT client, '' FROM query_storage WHERE typeof(client) = 'text'");
+	SQL_bool(db, "INSERT OR IGNORE INTO forward_by_id (forward) "
+	             "SELECT DISTINCT forward FROM query_storage WHERE typeof(forward) = 'text' AND forward != ''");
+
+	for(unsigned int i = 0; i < ROLLUP_TABLE_MAX; i++)
+	{
+		SQL_bool(db, "CREATE TABLE rollup_%s (hour INTEGER NOT NULL, %s INTEGER NOT NULL, "
+		             "total INTEGER NOT NULL, blocked INTEGER NOT NULL, "
+		             "PRIMARY KEY (hour, %s)) WITHOUT ROWID",
+		         rollup_names[i], rollup_names[i], rollup_names[i]);
+
+		// Aggregate the queries already in the database
+		SQL_bool(db, "INSERT INTO rollup_%s (hour,%s,total,blocked) "
+		             "SELECT hour, value, COUNT(*), SUM(blocked) FROM "
+		               "(SELECT timestamp - timestamp %% %d AS hour, %s AS value, status IN (%s) AS blocked "
+		               "FROM query_storage q) "
+		             "WHERE value IS NOT NULL GROUP BY hour, value",
+		         rollup_names[i], rollup_names[i], ROLLUP_INTERVAL, rollup_values[i], blocked);
+	}
+
+	// Update database version to 13
+	if(!db_set_FTL_property(db, DB_VERSION, 13))
+	{
+		logg("create_rollup_tables(): Failed to update database version!");
+		return false;
+	}
+
+	// Finish transaction
+	SQL_bool(db, "COMMIT");
+
+	return true;
+}
+
+static uint32_t __attribute__ ((pure)) rollup_hash(const unsigned char table, const sqlite3_int64 hour,
+                                                   const sqlite3_int64 value)
+{
+	uint64_t key = ((uint64_t)(hour / ROLLUP_INTERVAL) << 34) ^ ((uint64_t)value << 2) ^ table;
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return (uint32_t)key;
+}
+
+static struct rollupEntry * __attribute__ ((pure)) rollup_slot(const rollupBatch *batch, const unsigned char table,
+                                                               const sqlite3_int64 hour, const sqlite3_int64 value)
+{
+	unsigned int i = rollup_hash(table, hour, value) & (batch->size - 1);
+	while(batch->entries[i].used &&
+	      (batch->entries[i].table != table || batch->entries[i].hour != hour ||
+	       batch->entries[i].value != value))
+		i = (i + 1) & (batch->size - 1);
+	return &batch->entries[i];
+}
+
+// Count a stored query in the rollup row of its hour. Rows are accumulated in
+// memory and written by rollup_store() once per transaction
+void rollup_add(rollupBatch *batch, const enum rollup_table table, const time_t timestamp,
+                const sqlite3_int64 value, const bool blocked)
+{
+	// Keep the load factor below 1/2
+	if(2*(batch->used + 1) > batch->size)
+	{
+		const unsigned int size = batch->size > 0 ? 2*batch->size : 256;
+		struct rollupEntry *entries = calloc(size, sizeof(struct rollupEntry));
+		if(entries == NULL)
+		{
+			batch->failed = true;
+			return;
+		}
+
+		rollupBatch grown = { entries, size, batch->used, batch->failed };
+		for(unsigned int i = 0; i < batch->size; i++)
+		{
+			const struct rollupEntry *old = &batch->entries[i];
+			if(old->used)
+				*rollup_slot(&grown, old->table, old->hour, old->value) = *old;
+		}
+		if(batch->entries != NULL)
+			free(batch->entries);
+		*batch = grown;
+	}
+
+	const sqlite3_int64 hour = timestamp - timestamp % ROLLUP_INTERVAL;
+	struct rollupEntry *entry = rollup_slot(batch, table, hour, value);
+	if(!entry->used)
+	{
+		entry->table = table;
+		entry->hour = hour;
+		entry->value = value;
+		entry->used = true;
+		batch->used++;
+	}
+	entry->total++;
+	if(blocked)
+		entry->blocked++;
+}
+
+// Add the accumulated rows to the rollup tables. Has to be called within the
+// transaction the queries are stored in
+bool rollup_store(sqlite3 *db, rollupBatch *batch)
+{
+	if(batch->failed)
+		logg("WARNING: Failed to allocate memory, hourly rollups are incomplete");
+
+	sqlite3_stmt *stmt[ROLLUP_TABLE_MAX] = { NULL };
+	bool okay = true;
+	for(unsigned int i = 0; i < batch->size && okay; i++)
+	{
+		const struct rollupEntry *entry = &batch->entries[i];
+		if(!entry->used)
+			continue;
+
+		const unsigned char table = entry->table;
+		if(stmt[table] == NULL)
+		{
+			char querystr[256];
+			snprintf(querystr, sizeof(querystr),
+			         "INSERT INTO rollup_%s (hour,%s,total,blocked) VALUES (?1,?2,?3,?4) "
+			         "ON CONFLICT (hour,%s) DO UPDATE SET total = total + excluded.total, "
+			         "blocked = blocked + excluded.blocked",
+			         rollup_names[table], rollup_names[table], rollup_names[table]);
+			const int rc = sqlite3_prepare_v2(db, querystr, -1, &stmt[table], NULL);
+			if(rc != SQLITE_OK)
+			{
+				logg("rollup_store() - SQL error prepare: %s", sqlite3_errstr(rc));
+				checkFTLDBrc(rc);
+				okay = false;
+				break;
+			}
+		}
+
+		sqlite3_bind_int64(stmt[table], 1, entry->hour);
+		sqlite3_bind_int64(stmt[table], 2, entry->value);
+		sqlite3_bind_int(stmt[table], 3, entry->total);
+		sqlite3_bind_int(stmt[table], 4, entry->blocked);
+		const int rc = sqlite3_step(stmt[table]);
+		if(rc != SQLITE_DONE)
+		{
+			logg("rollup_store() - SQL error step: %s", sqlite3_errstr(rc));
+			checkFTLDBrc(rc);
+			okay = false;
+		}
+		sqlite3_reset(stmt[table]);
+	}
+
+	for(unsigned int i = 0; i < ROLLUP_TABLE_MAX; i++)
+		if(stmt[i] != NULL)
+			sqlite3_finalize(stmt[i]);
+
+	return okay;
+}
+
+void rollup_free(rollupBatch *batch)
+{
+	if(batch->entries != NULL)
+		free(batch->entries);
+	memset(batch, 0, sizeof(*batch));
+}
+
+// Remove all hours which ended before the given timestamp
+bool delete_old_rollups(sqlite3 *db, const time_t timestamp)
+{
+	for(unsigned int i = 0; i < ROLLUP_TABLE_MAX; i++)
+	{
+		if(dbquery(db, "DELETE FROM rollup_%s WHERE hour <= %lld",
+		           rollup_names[i], (long long)(timestamp - ROLLUP_INTERVAL)) != SQLITE_OK)
+		{
+			logg("delete_old_rollups(): Deleting hourly rollups due to age failed!");
+			return false;
+		}
+	}
+
+	return true;
+}
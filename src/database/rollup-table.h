@@ -0,0 +1,32 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  pihole-FTL.db -> hourly rollup tables prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef ROLLUPTABLE_H
+#define ROLLUPTABLE_H
+
+#include "sqlite3.h"
+
+enum rollup_table { ROLLUP_DOMAIN, ROLLUP_CLIENT, ROLLUP_STATUS, ROLLUP_FORWARD, ROLLUP_TABLE_MAX };
+
+// Rollup rows of a single transaction storing queries, see rollup_add()
+typedef struct {
+	struct rollupEntry *entries;
+	unsigned int size;
+	unsigned int used;
+	bool failed;
+} rollupBatch;
+
+bool create_rollup_tables(sqlite3 *db);
+void rollup_add(rollupBatch *batch, const enum rollup_table table, const time_t timestamp,
+                const sqlite3_int64 value, const bool blocked);
+bool rollup_store(sqlite3 *db, rollupBatch *batch);
+void rollup_free(rollupBatch *batch);
+bool delete_old_rollups(sqlite3 *db, const time_t timestamp);
+
+#endif //ROLLUPTABLE_H
@@ -28,6 +28,10 @@
 
 // isMAC()
 #include "network-table.h"
+// register_archive_vtab()
+#include "archive-table.h"
+// hashStr()
+#include "../datastructure.h"
 
 // Counting number of occurrences of a specific char in a string
 static size_t __attribute__ ((pure)) count_char(const char *haystack, const char needle)
@@ -55,6 +59,103 @@ static bool __attribute__ ((pure)) isMAC(const char *input)
 	return false;
 }
 
+// Parsed form of an IP address (optionally with CIDR suffix) as
+// used by subnet_match(). Addresses with a prefix are stored with
+// their host bits already masked off
+typedef struct {
+	bool valid;
+	bool ipv6;
+	int cidr;
+	struct in6_addr addr;
+} parsedAddr;
+
+// Parse an IP address into parsedAddr. If with_cidr is true, the
+// address may be followed by a prefix length (e.g., 10.0.0.0/8)
+static void parse_addr(const char *input, const bool with_cidr, parsedAddr *out)
+{
+	memset(out, 0, sizeof(*out));
+
+	// MAC addresses are never valid (they never match)
+	if(isMAC(input))
+		return;
+
+	out->ipv6 = strchr(input, ':') != NULL;
+	const int maxbits = out->ipv6 ? 128 : 32;
+
+	// Extract possible CIDR from IP string
+	// sscanf() will not overwrite the pre-defined CIDR in cidr if
+	// no CIDR is specified
+	int cidr = maxbits;
+	char *addr = NULL;
+	if(with_cidr)
+	{
+		const int rt = sscanf(input, "%m[^/]/%i", &addr, &cidr);
+
+		// Skip if string seems to be a CIDR but does not contain an address ('/32' is invalid)
+		// Passing an invalid IP address to inet_pton() causes a SEGFAULT
+		if(rt < 1 || addr == NULL)
+			return;
+	}
+
+	// Convert the Internet host address into binary form in network byte order
+	// We use in6_addr as variable type here as it is guaranteed to be large enough
+	// for both, IPv4 and IPv6 addresses (128 bits variable size).
+	const int rc = inet_pton(out->ipv6 ? AF_INET6 : AF_INET, addr != NULL ? addr : input, &out->addr);
+
+	// Free allocated memory
+	if(addr != NULL)
+		free(addr);
+
+	// This may happen when trying to analyze a hostname
+	if(rc != 1)
+		return;
+
+	// Clamp prefix length to the valid range of the address family
+	if(cidr < 0)
+		cidr = 0;
+	else if(cidr > maxbits)
+		cidr = maxbits;
+	out->cidr = cidr;
+
+	// Mask off host bits
+	// Note: the upper 12 byte of IPv4 addresses are zero
+	for(int i = cidr; i < 128; i++)
+		out->addr.s6_addr[i/8] &= (uint8_t)~(1u << (7-(i%8)));
+
+	out->valid = true;
+}
+
+// The address on the database side differs from row to row. Parsed
+// subnets are kept in a small per-thread direct-mapped cache so each
+// of them is parsed only once instead of once per client lookup
+#define ADDR_CACHE_SIZE 64u
+#define ADDR_CACHE_KEYLEN 48u
+static __thread struct {
+	char key[ADDR_CACHE_KEYLEN];
+	parsedAddr addr;
+} addr_cache[ADDR_CACHE_SIZE];
+
+static const parsedAddr *get_cached_subnet(const char *input, parsedAddr *buffer)
+{
+	// Strings too long to be cached are parsed every time
+	const size_t len = strlen(input);
+	if(len >= ADDR_CACHE_KEYLEN)
+	{
+		parse_addr(input, true, buffer);
+		return buffer;
+	}
+
+	const unsigned int slot = hashStr(input) % ADDR_CACHE_SIZE;
+	if(strcmp(addr_cache[slot].key, input) != 0)
+	{
+		// Cache miss: parse and replace the current slot content
+		parse_addr(input, true, &addr_cache[slot].addr);
+		memcpy(addr_cache[slot].key, input, len + 1);
+	}
+
+	return &addr_cache[slot].addr;
+}
+
 static void subnet_match_impl(sqlite3_context *context, int argc, sqlite3_value **argv)
 {
 	// Exactly two arguments should be submitted to this routine
@@ -80,9 +181,11 @@ static void subnet_match_impl(sqlite3_context *context, int argc, sqlite3_value
 	// ... and from FTL's side (second argument)
 	const char *addrFTL = (const char*)sqlite3_value_text(argv[1]);
 
-	// Return early (no match) if database entry is a MAC address
-	// We can skip all computations in this case
-	if(isMAC(addrDBcidr))
+	// Get parsed database subnet. Return early (no match) if the
+	// database entry is a MAC address, a hostname or otherwise invalid
+	parsedAddr bufferDB;
+	const parsedAddr *saddrDB = get_cached_subnet(addrDBcidr, &bufferDB);
+	if(!saddrDB->valid)
 	{
 		sqlite3_result_int(context, 0);
 		return;
@@ -90,47 +193,34 @@ static void subnet_match_impl(sqlite3_context *context, int argc, sqlite3_value
 
 	// Return early (no match) if IP types are different
 	// We can skip all computations in this case
-	bool isIPv6_DB = strchr(addrDBcidr, ':') != NULL;
-	bool isIPv6_FTL = strchr(addrFTL, ':') != NULL;
-	if(isIPv6_DB != isIPv6_FTL)
+	const bool isIPv6_FTL = strchr(addrFTL, ':') != NULL;
+	if(saddrDB->ipv6 != isIPv6_FTL)
 	{
 		sqlite3_result_int(context, 0);
 		return;
 	}
 
-	// Extract possible CIDR from database IP string
-	// sscanf() will not overwrite the pre-defined CIDR in cidr if
-	// no CIDR is specified in the database
-	int cidr = isIPv6_DB ? 128 : 32;
-	char *addrDB = NULL;
-	const int rt = sscanf(addrDBcidr, "%m[^/]/%i", &addrDB, &cidr);
-
-	// Skip if database row seems to be a CIDR but does not contain an address ('/32' is invalid)
-	// Passing an invalid IP address to inet_pton() causes a SEGFAULT
-	if(rt < 1 || addrDB == NULL)
+	// The address on FTL's side is a bound parameter which is constant
+	// for all rows of a statement. It is parsed only once and attached to
+	// the statement as auxiliary data. SQLite may discard auxiliary data
+	// at any time so we always work on a local copy
+	parsedAddr saddrFTL;
+	const parsedAddr *aux = sqlite3_get_auxdata(context, 1);
+	if(aux != NULL)
+		memcpy(&saddrFTL, aux, sizeof(saddrFTL));
+	else
 	{
-		sqlite3_result_int(context, 0);
-		return;
-	}
-
-	// Convert the Internet host address into binary form in network byte order
-	// We use in6_addr as variable type here as it is guaranteed to be large enough
-	// for both, IPv4 and IPv6 addresses (128 bits variable size).
-	struct in6_addr saddrDB = {{{ 0 }}}, saddrFTL = {{{ 0 }}};
-	if (inet_pton(isIPv6_DB ? AF_INET6 : AF_INET, addrDB, &saddrDB) == 0)
-	{
-		// This may happen when trying to analyze a hostname, skip this entry and return NO MATCH (= 0)
-		free(addrDB);
-		sqlite3_result_int(context, 0);
-		return;
+		parse_addr(addrFTL, false, &saddrFTL);
+		parsedAddr *copy = sqlite3_malloc(sizeof(parsedAddr));
+		if(copy != NULL)
+		{
+			memcpy(copy, &saddrFTL, sizeof(*copy));
+			sqlite3_set_auxdata(context, 1, copy, sqlite3_free);
+		}
 	}
 
-	// Free allocated memory
-	free(addrDB);
-	addrDB = NULL;
-
-	// Check and convert client IP address as seen by FTL
-	if (inet_pton(isIPv6_FTL ? AF_INET6 : AF_INET, addrFTL, &saddrFTL) == 0)
+	// Check client IP address as seen by FTL
+	if(!saddrFTL.valid)
 	{
 		//sqlite3_result_error(context, "Passed a malformed IP address (FTL)", -1);
 		// Return non-fatal "NO MATCH" if address is invalid
@@ -139,37 +229,31 @@ static void subnet_match_impl(sqlite3_context *context, int argc, sqlite3_value
 		return;
 	}
 
-	// Construct binary mask from CIDR field
-	uint8_t bitmask[16] = { 0 };
-	for(int i = 0; i < cidr; i++)
+	// Compare all full bytes covered by the prefix at once and the
+	// remaining partial byte (if any) with the appropriate mask
+	const int cidr = saddrDB->cidr;
+	const unsigned int full = (unsigned int)cidr / 8u;
+	const unsigned int rest = (unsigned int)cidr % 8u;
+	bool match = memcmp(saddrDB->addr.s6_addr, saddrFTL.addr.s6_addr, full) == 0;
+	if(match && rest > 0u)
 	{
-		bitmask[i/8] |= (1 << (7-(i%8)));
-	}
-
-	// Apply bitmask to both IP addresses
-	// Note: the upper 12 byte of IPv4 addresses are zero
-	int match = 1;
-	for(unsigned int i = 0u; i < 16u; i++)
-	{
-		saddrDB.s6_addr[i] &= bitmask[i];
-		saddrFTL.s6_addr[i] &= bitmask[i];
-
-		// Are the addresses different given the applied mask?
-		if(saddrDB.s6_addr[i] != saddrFTL.s6_addr[i])
-		{
-			match = 0;
-			break;
-		}
+		const uint8_t mask = (uint8_t)(0xFFu << (8u - rest));
+		match = (saddrFTL.addr.s6_addr[full] & mask) == saddrDB->addr.s6_addr[full];
 	}
 
 	// Possible debug logging
 	if(config.debug & DEBUG_DATABASE)
 	{
+		// Construct binary mask from CIDR field
+		uint8_t bitmask[16] = { 0 };
+		for(int i = 0; i < cidr; i++)
+			bitmask[i/8] |= (1 << (7-(i%8)));
+
 		char subnet[INET6_ADDRSTRLEN];
 		inet_ntop(isIPv6_FTL ? AF_INET6 : AF_INET, &bitmask, subnet, sizeof(subnet));
 		logg("SQL: Comparing %s vs. %s (subnet %s) - %s",
 		     addrFTL, addrDBcidr, subnet,
-			 match == 1 ? "!! MATCH !!" : "NO MATCH");
+			 match ? "!! MATCH !!" : "NO MATCH");
 	}
 
 	// Return if we found a match between the two addresses
@@ -194,7 +278,24 @@ int sqlite3_pihole_extensions_init(sqlite3 *db, const char **pzErrMsg, const str
 	{
 		logg("Error while initializing the SQLite3 extension subnet_match: %s",
 		     sqlite3_errstr(rc));
+		return rc;
+	}
+
+	// Register the virtual table archived_queries (see archive-table.c)
+	rc = register_archive_vtab(db);
+	if(rc != SQLITE_OK)
+	{
+		logg("Error while initializing the SQLite3 extension archived_queries: %s",
+		     sqlite3_errstr(rc));
 	}
 
 	return rc;
-}
\ No newline at end of file
+}
+
+// Called by the embedded SQLite3 shell (see SQLITE_SHELL_INIT_PROC) after it
+// configured SQLite3 so the extensions are available in the shell as well
+void pihole_sqlite3_initialize(void)
+{
+	sqlite3_initialize();
+	sqlite3_auto_extension((void (*)(void))sqlite3_pihole_extensions_init);
+}
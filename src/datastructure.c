@@ -16,6 +16,8 @@
 #include "regex_r.h"
 // reload_per_client_regex()
 #include "database/gravity-db.h"
+// gravity_set_load()
+#include "database/gravity-set.h"
 // bool startup
 #include "main.h"
 // reset_aliasclient()
@@ -28,63 +30,155 @@
 #include "overTime.h"
 // short_path()
 #include "files.h"
+// update_*_leaderboards()
+#include "leaderboard.h"
+// timeseries_update()
+#include "timeseries.h"
+// dns_worker_query_id(), restart_dns_workers()
+#include "workers.h"
+// debug_enabled()
+#include "debuglimit.h"
+// lua_policy_load()
+#include "lua/policy.h"
+// timer_start()
+#include "timers.h"
+// trigram_add_domain()
+#include "trigram.h"
+// new_domain_slot(), new_client_slot()
+#include "reclaim.h"
 
 const char *querytypes[TYPE_MAX] = {"UNKNOWN", "A", "AAAA", "ANY", "SRV", "SOA", "PTR", "TXT",
                                     "NAPTR", "MX", "DS", "RRSIG", "DNSKEY", "NS", "OTHER", "SVCB",
                                     "HTTPS"};
 
-// converts upper to lower case, and leaves other characters unchanged
-void strtolower(char *str)
+// Strings are hashed eight bytes at a time: every word is mixed into the state
+// by a rotation and a multiplication, the result is finalized by the avalanche
+// step of MurmurHash3 so that also the low bits used to index the lookup
+// tables depend on all input bytes
+static inline uint64_t hash_word(const uint64_t hash, const uint64_t word)
 {
-	int i = 0;
-	while(str[i]){ str[i] = tolower(str[i]); i++; }
+	return ((hash << 5 | hash >> 59) ^ word) * 0x9E3779B97F4A7C15ULL;
 }
 
-// creates a simple hash of a string that fits into a uint32_t
-uint32_t __attribute__ ((pure)) hashStr(const char *s)
+static inline uint32_t hash_final(uint64_t hash, const size_t len)
 {
-        uint32_t hash = 0;
-        // Jenkins' One-at-a-Time hash (http://www.burtleburtle.net/bob/hash/doobs.html)
-        for(; *s; ++s)
-        {
-                hash += *s;
-                hash += hash << 10;
-                hash ^= hash >> 6;
-        }
+	hash ^= len;
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return (uint32_t)hash;
+}
 
-        hash += hash << 3;
-        hash ^= hash >> 11;
-        hash += hash << 15;
-        return hash;
+// Convert the upper case ASCII letters in eight bytes to lower case at once.
+// Bytes with the highest bit set (non-ASCII) are left unchanged
+static inline uint64_t lower_word(const uint64_t word)
+{
+	const uint64_t ones = 0x0101010101010101ULL;
+	const uint64_t high = 0x8080808080808080ULL;
+	const uint64_t seven = word & ~high;
+	const uint64_t above_Z = seven + (0x7f - 'Z') * ones;
+	const uint64_t from_A = seven + (0x80 - 'A') * ones;
+	return word | ((from_A & ~above_Z & ~word & high) >> 2);
 }
 
-int findQueryID(const int id)
+// Convert sixteen bytes to lower case using the vector unit. SSE2 and NEON are
+// part of the baseline of x86_64 and aarch64, other targets use lower_word()
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_LOWER_VECTOR
+static inline void lower_vector(char *str)
+{
+	const __m128i v = _mm_loadu_si128((const void*)str);
+	// Bytes above 0x7f are negative and never upper case letters
+	const __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+	                                    _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+	_mm_storeu_si128((void*)str, _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20))));
+}
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_LOWER_VECTOR
+static inline void lower_vector(char *str)
+{
+	const uint8x16_t v = vld1q_u8((const uint8_t*)str);
+	const uint8x16_t upper = vcleq_u8(vsubq_u8(v, vdupq_n_u8('A')), vdupq_n_u8('Z' - 'A'));
+	vst1q_u8((uint8_t*)str, vorrq_u8(v, vandq_u8(upper, vdupq_n_u8(0x20))));
+}
+#endif
+
+// Converts upper to lower case, and leaves other characters unchanged. Returns
+// the hash of the converted string (identical to hashStr() of the result)
+uint32_t strtolower_hash(char *str)
 {
-	// Loop over all queries - we loop in reverse order (start from the most recent query and
-	// continuously walk older queries while trying to find a match. Ideally, we should always
-	// find the correct query with zero iterations, but it may happen that queries are processed
-	// asynchronously, e.g. for slow upstream relies to a huge amount of requests.
-	// We iterate from the most recent query down to at most MAXITER queries in the past to avoid
-	// iterating through the entire array of queries
-	// MAX(0, a) is used to return 0 in case a is negative (negative array indices are harmful)
-	const int until = MAX(0, counters->queries-MAXITER);
-	const int start = MAX(0, counters->queries-1);
-
-	// Check UUIDs of queries
-	for(int i = start; i >= until; i--)
+	const size_t len = strlen(str);
+	uint64_t hash = 0;
+	size_t i = 0;
+#ifdef HAVE_LOWER_VECTOR
+	for(; i + 16 <= len; i += 16)
 	{
-		const queriesData* query = getQuery(i, true);
+		lower_vector(str + i);
+		uint64_t word[2];
+		memcpy(word, str + i, sizeof(word));
+		hash = hash_word(hash_word(hash, word[0]), word[1]);
+	}
+#endif
+	for(; i + 8 <= len; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, str + i, sizeof(word));
+		word = lower_word(word);
+		memcpy(str + i, &word, sizeof(word));
+		hash = hash_word(hash, word);
+	}
+	if(i < len)
+	{
+		// Remaining bytes, padded with zeros
+		uint64_t word = 0;
+		memcpy(&word, str + i, len - i);
+		word = lower_word(word);
+		memcpy(str + i, &word, len - i);
+		hash = hash_word(hash, word);
+	}
 
-		// Check if the returned pointer is valid before trying to access it
-		if(query == NULL)
-			continue;
+	return hash_final(hash, len);
+}
+
+// converts upper to lower case, and leaves other characters unchanged
+void strtolower(char *str)
+{
+	strtolower_hash(str);
+}
 
-		if(query->id == id)
-			return i;
+// creates a hash of a string that fits into a uint32_t
+uint32_t __attribute__ ((pure)) hashStr(const char *s)
+{
+	const size_t len = strlen(s);
+	uint64_t hash = 0;
+	size_t i = 0;
+	for(; i + 8 <= len; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, s + i, sizeof(word));
+		hash = hash_word(hash, word);
+	}
+	if(i < len)
+	{
+		// Remaining bytes, padded with zeros
+		uint64_t word = 0;
+		memcpy(&word, s + i, len - i);
+		hash = hash_word(hash, word);
 	}
 
-	// If not found
-	return -1;
+	return hash_final(hash, len);
+}
+
+int findQueryID(const int id)
+{
+	// Look up the dnsmasq ID in the queries index. This is independent of
+	// how many queries have been received since the query we are looking
+	// for arrived
+	return find_query_lookup(dns_worker_query_id(id));
 }
 
 int findUpstreamID(const char * upstreamString, const in_port_t port)
@@ -128,7 +222,7 @@ int findUpstreamID(const char * upstreamString, const in_port_t port)
 	upstream->namepos = 0; // 0 -> string with length zero
 	set_event(RESOLVE_NEW_HOSTNAMES);
 	// This is a new upstream server
-	upstream->lastQuery = time(NULL);
+	upstream->lastQuery = ftl_time();
 	// Store port
 	upstream->port = port;
 	// Increase counter by one
@@ -137,34 +231,32 @@ int findUpstreamID(const char * upstreamString, const in_port_t port)
 	return upstreamID;
 }
 
-int findDomainID(const char *domainString, const bool count)
+// The hash of the domain is computed by the caller, usually together with
+// converting it to lower case (strtolower_hash())
+int findDomainID(const char *domainString, const uint32_t domainHash, const bool count)
 {
-	uint32_t domainHash = hashStr(domainString);
-	for(int domainID = 0; domainID < counters->domains; domainID++)
+	const int knownID = find_domain_lookup(domainHash, domainString);
+	if(knownID > -1)
 	{
 		// Get domain pointer
-		domainsData* domain = getDomain(domainID, true);
-
-		// Check if the returned pointer is valid before trying to access it
-		if(domain == NULL)
-			continue;
-
-		// Quicker test: Does the domain match the pre-computed hash?
-		if(domain->domainhash != domainHash)
-			continue;
-
-		// If so, compare the full domain using strcmp
-		if(strcmp(getstr(domain->domainpos), domainString) == 0)
+		domainsData* domain = getDomain(knownID, true);
+		if(domain != NULL)
+			domain->last_seen = (uint32_t)ftl_time();
+		if(domain != NULL && count)
 		{
-			if(count)
-				domain->count++;
-			return domainID;
+			domain->count++;
+			update_domain_leaderboards(knownID);
+
+			// Domains are pruned from the index once all of their
+			// queries are gone, add them again
+			trigram_add_domain(knownID, domain);
 		}
+		return knownID;
 	}
 
 	// If we did not return until here, then this domain is not known
-	// Store ID
-	const int domainID = counters->domains;
+	// Store ID, the slot of a reclaimed domain is reused if possible
+	const int domainID = new_domain_slot();
 
 	// Get domain pointer
 	domainsData* domain = getDomain(domainID, false);
@@ -181,39 +273,39 @@ int findDomainID(const char *domainString, const bool count)
 	domain->count = count ? 1 : 0;
 	// Set blocked counter to zero
 	domain->blockedcount = 0;
+	// No query seen so far
+	domain->last_query = query_seq(-1);
+	domain->last_seen = (uint32_t)ftl_time();
+	domain->cname_blocked = false;
+	domain->indexed = false;
 	// Store domain name - no need to check for NULL here as it doesn't harm
-	domain->domainpos = addstr(domainString);
+	domain->domainpos = adddomain(domainString);
 	// Store pre-computed hash of domain for faster lookups later on
-	domain->domainhash = hashStr(domainString);
-	// Increase counter by one
-	counters->domains++;
+	domain->domainhash = domainHash;
+	// Make the domain known to the lookup table
+	add_domain_lookup(domainHash, domainID);
+	// Increase counter by one unless a reclaimed slot has been reused
+	if(domainID == counters->domains)
+		counters->domains++;
+	// Offer the new domain to the leaderboards (even when not counted)
+	update_domain_leaderboards(domainID);
+	// Make the domain searchable
+	trigram_add_domain(domainID, domain);
 
 	return domainID;
 }
 
 int findClientID(const char *clientIP, const bool count, const bool aliasclient)
 {
-	// Compare content of client against known client IP addresses
-	for(int clientID=0; clientID < counters->clients; clientID++)
+	// Look up client in the (alias-)client index
+	const int knownID = find_client_lookup(clientIP, aliasclient);
+	if(knownID > -1)
 	{
-		// Get client pointer
-		clientsData* client = getClient(clientID, true);
-
-		// Check if the returned pointer is valid before trying to access it
-		if(client == NULL)
-			continue;
-
-		// Quick test: Does the clients IP start with the same character?
-		if(getstr(client->ippos)[0] != clientIP[0])
-			continue;
-
-		// If so, compare the full IP using strcmp
-		if(strcmp(getstr(client->ippos), clientIP) == 0)
-		{
-			// Add one if count == true (do not add one, e.g., during ARP table processing)
-			if(count && !aliasclient) change_clientcount(client, 1, 0, -1, 0);
-			return clientID;
-		}
+		// Add one if count == true (do not add one, e.g., during ARP table processing)
+		clientsData* client = getClient(knownID, true);
+		if(client != NULL && count && !aliasclient)
+			change_clientcount(client, 1, 0, -1, 0);
+		return knownID;
 	}
 
 	// Return -1 (= not found) if count is false because we do not want to create a new client here
@@ -222,8 +314,8 @@ int findClientID(const char *clientIP, const bool count, const bool aliasclient)
 		return -1;
 
 	// If we did not return until here, then this client is definitely new
-	// Store ID
-	const int clientID = counters->clients;
+	// Store ID, the slot of a reclaimed client is reused if possible
+	const int clientID = new_client_slot();
 
 	// Get client pointer
 	clientsData* client = getClient(clientID, false);
@@ -241,6 +333,8 @@ int findClientID(const char *clientIP, const bool count, const bool aliasclient)
 	client->blockedcount = 0;
 	// Store client IP - no need to check for NULL here as it doesn't harm
 	client->ippos = addstr(clientIP);
+	// Make the client known to the lookup table
+	add_client_lookup(clientIP, aliasclient, clientID);
 	// Initialize client hostname
 	// Due to the nature of us being the resolver,
 	// the actual resolving of the host name has
@@ -250,6 +344,7 @@ int findClientID(const char *clientIP, const bool count, const bool aliasclient)
 	set_event(RESOLVE_NEW_HOSTNAMES);
 	// No query seen so far
 	client->lastQuery = 0;
+	client->last_query = query_seq(-1);
 	client->numQueriesARP = client->count;
 	// Configured groups are yet unknown
 	client->flags.found_group = false;
@@ -258,7 +353,7 @@ int findClientID(const char *clientIP, const bool count, const bool aliasclient)
 	// some time after adding a client to ensure we pick up possible
 	// group configuration though hostname, MAC address or interface
 	client->reread_groups = 0u;
-	client->firstSeen = time(NULL);
+	client->firstSeen = ftl_time();
 	// Interface is not yet known
 	client->ifacepos = 0;
 	// Set all MAC address bytes to zero
@@ -267,15 +362,19 @@ int findClientID(const char *clientIP, const bool count, const bool aliasclient)
 	// This may be a alias-client, the ID is set elsewhere
 	client->flags.aliasclient = aliasclient;
 	client->aliasclient_id = -1;
+	client->alias_list = -1;
 
 	// Initialize client-specific overTime data
-	memset(client->overTime, 0, sizeof(client->overTime));
+	memset(&client->overTime, 0, sizeof(client->overTime));
 
 	// Store client ID
 	client->id = clientID;
 
-	// Increase counter by one
-	counters->clients++;
+	// Increase counter by one unless a reclaimed slot has been reused
+	if(clientID == counters->clients)
+		counters->clients++;
+	// Offer the new client to the leaderboards
+	update_client_leaderboards(clientID);
 
 	// Get groups for this client and set enabled regex filters
 	// Note 1: We do this only after increasing the clients counter to
@@ -295,12 +394,118 @@ int findClientID(const char *clientIP, const bool count, const bool aliasclient)
 	return clientID;
 }
 
+// Prepend a new query to the query lists of its domain and client. This has
+// to be done before the query is counted in counters->queries
+void link_query(const int queryID, queriesData *query)
+{
+	const unsigned int seq = query_seq(queryID);
+
+	domainsData *domain = getDomain(query->domainID, true);
+	if(domain != NULL)
+	{
+		query->prev_domain_query = domain->last_query;
+		domain->last_query = seq;
+	}
+	else
+		query->prev_domain_query = query_seq(-1);
+
+	clientsData *client = getClient(query->clientID, true);
+	if(client != NULL)
+	{
+		query->prev_client_query = client->last_query;
+		client->last_query = seq;
+	}
+	else
+		query->prev_client_query = query_seq(-1);
+}
+
+// Queries in progress (not yet complete or still of unknown status) are kept
+// in a doubly-linked list in the order they arrived so the API can list them
+// without scanning all queries in memory. The list is linked through query
+// sequence numbers which do not change when older queries are removed
+static void link_inflight(queriesData *query)
+{
+	const unsigned int seq = query_seq(get_queryID(query));
+
+	query->next_inflight = seq;
+	if(counters->inflight > 0)
+	{
+		queriesData *tail = getQuery(seq_queryID(counters->inflight_tail), true);
+		if(tail != NULL)
+			tail->next_inflight = seq;
+		query->prev_inflight = counters->inflight_tail;
+	}
+	else
+	{
+		query->prev_inflight = seq;
+		counters->inflight_head = seq;
+	}
+
+	counters->inflight_tail = seq;
+	counters->inflight++;
+	query->flags.inflight = true;
+}
+
+// Remove a query from the list of queries in progress
+void query_remove_inflight(queriesData *query)
+{
+	if(!query->flags.inflight)
+		return;
+
+	const unsigned int seq = query_seq(get_queryID(query));
+	const bool first = query->prev_inflight == seq;
+	const bool last = query->next_inflight == seq;
+
+	if(first)
+		counters->inflight_head = query->next_inflight;
+	else
+	{
+		queriesData *prev = getQuery(seq_queryID(query->prev_inflight), true);
+		if(prev != NULL)
+			prev->next_inflight = last ? query->prev_inflight : query->next_inflight;
+	}
+
+	if(last)
+		counters->inflight_tail = query->prev_inflight;
+	else
+	{
+		queriesData *next = getQuery(seq_queryID(query->next_inflight), true);
+		if(next != NULL)
+			next->prev_inflight = first ? query->next_inflight : query->prev_inflight;
+	}
+
+	counters->inflight--;
+	query->flags.inflight = false;
+}
+
+// Add the query to or remove it from the list of queries in progress after
+// its status or completeness changed
+void query_update_inflight(queriesData *query)
+{
+	const bool inflight = query->status == QUERY_UNKNOWN || !query->flags.complete;
+	if(inflight == query->flags.inflight)
+		return;
+
+	if(inflight)
+		link_inflight(query);
+	else
+		query_remove_inflight(query);
+}
+
+// Remember a newly blocked query for >recentBlocked
+void query_remember_blocked(const queriesData *query)
+{
+	const unsigned int next = query_counters->recent_blocked_next++;
+	query_counters->recent_blocked[next % RECENT_BLOCKED] = query_seq(get_queryID(query));
+}
+
 void change_clientcount(clientsData *client, int total, int blocked, int overTimeIdx, int overTimeMod)
 {
 		client->count += total;
 		client->blockedcount += blocked;
-		if(overTimeIdx > -1 && overTimeIdx < OVERTIME_SLOTS)
-			client->overTime[overTimeIdx] += overTimeMod;
+		if(overTimeIdx > -1)
+			overTime_add(&client->overTime, (unsigned int)overTimeIdx, overTimeMod);
+		update_client_leaderboards(client->id);
 
 		// Also add counts to the connected alias-client (if any)
 		if(client->flags.aliasclient)
@@ -314,29 +519,86 @@ void change_clientcount(clientsData *client, int total, int blocked, int overTim
 			clientsData *aliasclient = getClient(client->aliasclient_id, true);
 			aliasclient->count += total;
 			aliasclient->blockedcount += blocked;
-			if(overTimeIdx > -1 && overTimeIdx < OVERTIME_SLOTS)
-				aliasclient->overTime[overTimeIdx] += overTimeMod;
+			if(overTimeIdx > -1)
+				overTime_add(&aliasclient->overTime, (unsigned int)overTimeIdx, overTimeMod);
+			update_client_leaderboards(client->aliasclient_id);
 		}
 }
 
+// Get the response time histogram bin of a response time (in units of 0.1 ms)
+unsigned int __attribute__ ((const)) upstream_rtime_bin(const unsigned long response)
+{
+	if(response == 0)
+		return 0;
+	const unsigned int bin = 64 - __builtin_clzll(response);
+	return bin < UPSTREAM_RTIME_BINS ? bin : UPSTREAM_RTIME_BINS - 1;
+}
+
+// Count a response of an upstream server in the histogram of the overTime slot
+// the query belongs to. Like the upstream's overTime data, the histograms are
+// not adjusted by GC but expire together with their overTime slots
+void add_upstream_rtime(upstreamsData *upstream, const time_t timestamp, const unsigned long response)
+{
+	const unsigned int timeidx = getOverTimeID(timestamp);
+	overTime_add(&upstream->rtime[upstream_rtime_bin(response)], timeidx, 1);
+}
+
+// A cached blocking status is valid if it has been determined after this status
+// has been invalidated the last time
+static bool __attribute__((pure)) dns_cache_status_valid(const unsigned int epoch, const unsigned char status)
+{
+	return status > NOT_BLOCKED || epoch >= counters->dns_cache_status_epoch[status];
+}
+
+// Hour of a lookup of a DNS cache entry
+static uint16_t dns_cache_hour(void)
+{
+	return (uint16_t)(ftl_time() / 3600);
+}
+
 int _findCacheID(const int domainID, const int clientID, const enum query_types query_type, const bool create_new, const char *func, int line, const char *file)
 {
-	// Compare content of client against known client IP addresses
-	for(int cacheID = 0; cacheID < counters->dns_cache_size; cacheID++)
+	// Look up the (domainID, clientID, query_type) tuple in the cache index
+	const int knownID = find_dns_cache_lookup(domainID, clientID, query_type);
+	if(knownID > -1)
 	{
 		// Get cache pointer
-		DNSCacheData* dns_cache = _getDNSCache(cacheID, true, line, func, file);
-
-		// Check if the returned pointer is valid before trying to access it
-		if(dns_cache == NULL)
-			continue;
+		DNSCacheData* dns_cache = _getDNSCache(knownID, true, line, func, file);
+
+		// The domain or the client of this entry has been reclaimed
+		// and its ID reused, the entry starts over. It is not found
+		// when we only hold a shared (read-only) lock
+		const domainsData *domain = getDomain(domainID, true);
+		const clientsData *client = getClient(clientID, true);
+		if(dns_cache != NULL && domain != NULL && client != NULL &&
+		   (dns_cache->domain_generation != domain->generation ||
+		    dns_cache->client_generation != client->generation))
+		{
+			if(!is_our_lock())
+				return -1;
+			dns_cache->blocking_status = UNKNOWN_BLOCKED;
+			dns_cache->force_reply = 0u;
+			dns_cache->domainlist_id = -1;
+			dns_cache->epoch = counters->dns_cache_epoch;
+			dns_cache->domain_generation = domain->generation;
+			dns_cache->client_generation = client->generation;
+		}
 
-		if(dns_cache->domainID == domainID &&
-		   dns_cache->clientID == clientID &&
-		   dns_cache->query_type == query_type)
+		// Lazily invalidate the blocking status of entries that have been
+		// created before their status was last invalidated by
+		// FTL_reset_per_client_domain_status(). This is skipped when we
+		// only hold a shared (read-only) lock
+		if(dns_cache != NULL && !dns_cache_status_valid(dns_cache->epoch, dns_cache->blocking_status) &&
+		   is_our_lock())
 		{
-			return cacheID;
+			dns_cache->blocking_status = UNKNOWN_BLOCKED;
+			dns_cache->epoch = counters->dns_cache_epoch;
 		}
+
+		if(dns_cache != NULL && is_our_lock())
+			dns_cache->last_hour = dns_cache_hour();
+
+		return knownID;
 	}
 
 	if(!create_new)
@@ -362,6 +624,15 @@ int _findCacheID(const int domainID, const int clientID, const enum query_types
 	dns_cache->query_type = query_type;
 	dns_cache->force_reply = 0u;
 	dns_cache->domainlist_id = -1; // -1 = not set
+	dns_cache->epoch = counters->dns_cache_epoch;
+	const domainsData *domain = getDomain(domainID, true);
+	const clientsData *client = getClient(clientID, true);
+	dns_cache->domain_generation = domain != NULL ? domain->generation : 0u;
+	dns_cache->client_generation = client != NULL ? client->generation : 0u;
+	dns_cache->last_hour = dns_cache_hour();
+
+	// Make the entry known to the lookup table
+	add_dns_cache_lookup(domainID, clientID, query_type, cacheID);
 
 	// Increase counter by one
 	counters->dns_cache_size++;
@@ -477,47 +748,202 @@ const char *getClientNameString(const queriesData* query)
 		return HIDDEN_CLIENT;
 }
 
+// Check if another client with the same groups has already asked for this
+// domain. If so, the verdict is copied into the DNS cache entry of this client
+bool get_cached_verdict(const int domainID, clientsData *client, const enum query_types query_type, DNSCacheData *dns_cache)
+{
+	// We need to know the groups of this client
+	if(!client->flags.found_group && !gravityDB_prepare_client_statements(client))
+		return false;
+
+	const verdictCacheData *verdict = get_verdict_slot(domainID, client->groupspos, query_type);
+	if(verdict == NULL || verdict->domainID != domainID ||
+	   verdict->groupspos != client->groupspos || verdict->query_type != query_type ||
+	   !dns_cache_status_valid(verdict->epoch, verdict->blocking_status))
+		return false;
+
+	dns_cache->blocking_status = verdict->blocking_status;
+	dns_cache->force_reply = verdict->force_reply;
+	dns_cache->domainlist_id = verdict->domainlist_id;
+
+	if(debug_enabled(DEBUG_QUERIES))
+		logg("Using verdict of group set (%s) for %s", getstr(client->groupspos), getstr(client->ippos));
+
+	return true;
+}
+
+// Check if the verdict for this domain is known for the group set of a client
+bool has_cached_verdict(const int domainID, const clientsData *client, const enum query_types query_type)
+{
+	if(!client->flags.found_group)
+		return false;
+
+	const verdictCacheData *verdict = get_verdict_slot(domainID, client->groupspos, query_type);
+	return verdict != NULL && verdict->domainID == domainID &&
+	       verdict->groupspos == client->groupspos && verdict->query_type == query_type &&
+	       dns_cache_status_valid(verdict->epoch, verdict->blocking_status);
+}
+
+// Store the verdict found for this client for all clients with the same groups
+void set_cached_verdict(const int domainID, const clientsData *client, const enum query_types query_type, const DNSCacheData *dns_cache)
+{
+	if(!client->flags.found_group || dns_cache->blocking_status == UNKNOWN_BLOCKED)
+		return;
+
+	verdictCacheData *verdict = get_verdict_slot(domainID, client->groupspos, query_type);
+	if(verdict == NULL)
+		return;
+
+	verdict->domainID = domainID;
+	verdict->groupspos = client->groupspos;
+	verdict->query_type = query_type;
+	verdict->blocking_status = dns_cache->blocking_status;
+	verdict->force_reply = dns_cache->force_reply;
+	verdict->domainlist_id = dns_cache->domainlist_id;
+	verdict->epoch = counters->dns_cache_epoch;
+}
+
 void FTL_reset_per_client_domain_data(void)
+{
+	FTL_reset_per_client_domain_status(~0u);
+}
+
+// Invalidate the blocking status of all DNS cache entries with one of the
+// statuses in the given bitmask (bits 1 << enum domain_client_status)
+void FTL_reset_per_client_domain_status(const unsigned int statuses)
 {
 	if(config.debug & DEBUG_DATABASE)
-		logg("Resetting per-client DNS cache, size is %i", counters->dns_cache_size);
+		logg("Resetting per-client DNS cache (status mask 0x%02x), size is %i",
+		     statuses, counters->dns_cache_size);
+
+	// Reset the affected blocking yes/no fields for all domains and
+	// clients. This forces a reprocessing of all available filters for
+	// any given domain and client the next time they are seen
+	// Instead of rewriting all entries here, we start a new epoch and
+	// remember it for every affected status. Entries from older epochs
+	// are reset when they are accessed the next time
+	counters->dns_cache_epoch++;
+	for(unsigned int status = 0; status <= NOT_BLOCKED; status++)
+		if(statuses & (1u << status))
+			counters->dns_cache_status_epoch[status] = counters->dns_cache_epoch;
+}
 
-	for(int cacheID = 0; cacheID < counters->dns_cache_size; cacheID++)
-	{
-		// Reset all blocking yes/no fields for all domains and clients
-		// This forces a reprocessing of all available filters for any
-		// given domain and client the next time they are seen
-		DNSCacheData *dns_cache = getDNSCache(cacheID, true);
-		if(dns_cache != NULL)
-			dns_cache->blocking_status = UNKNOWN_BLOCKED;
-	}
+// Gravity set and regex loaded by FTL_preload_domainlists() during startup.
+// They are taken over by the initial call to FTL_reload_all_domainlists()
+static gravity_set *preloaded_set = NULL;
+static bool lists_preloaded = false;
+
+// Load the gravity set and compile the regex while the history is imported
+// from the database. This runs in a helper thread of the main process and
+// must not access the shared memory objects. The gravity database connection
+// opened here is closed by FTL_preload_domainlists_done() before forking
+void FTL_preload_domainlists(void)
+{
+	startup_phase_begin("gravity set");
+	preloaded_set = gravity_set_load();
+	startup_phase_end("gravity set");
+
+	// Remember the fingerprints of the lists so the initial reload only
+	// recompiles regex which have changed in the meantime
+	startup_phase_begin("regex compilation");
+	gravityDB_changed_lists();
+	preload_regex_from_database();
+	startup_phase_end("regex compilation");
+
+	lists_preloaded = true;
+}
+
+// Called after joining the thread running FTL_preload_domainlists()
+void FTL_preload_domainlists_done(void)
+{
+	// Do not carry the connection across a fork
+	gravityDB_close();
 }
 
-// Reloads all domainlists and performs a few extra tasks such as cleaning the
-// message table
-// May only be called from the database thread
 void FTL_reload_all_domainlists(void)
 {
+	timer_start(LISTS_TIMER);
+
+	// The initial reload takes over the preloaded gravity set and regex
+	const bool preloaded = lists_preloaded;
+	lists_preloaded = false;
+
+	// Build the in-memory gravity set and open the new database connection
+	// before obtaining the lock as this may take a while for large lists
+	gravity_set *set = preloaded_set != NULL ? preloaded_set : gravity_set_load();
+	preloaded_set = NULL;
+	gravityDB_handle *db = gravityDB_prepare();
+
 	lock_shm();
 
-	// (Re-)open gravity database connection
-	gravityDB_reopen();
+	// Switch to the new gravity database connection
+	gravityDB_reopen(db);
+
+	// Replace the in-memory gravity set
+	gravity_set_install(set);
 
 	// Reset number of blocked domains
 	counters->gravity = gravityDB_count(GRAVITY_TABLE);
 
-	// Read and compile possible regex filters
+	// Determine which lists have changed since the last reload
+	const unsigned int changed = gravityDB_changed_lists();
+
+	// Read and compile possible regex filters of the changed types
 	// only after having called gravityDB_open()
-	read_regex_from_database();
+	if(changed & (LIST_CHANGED(REGEX_BLACKLIST_TABLE) |
+	              LIST_CHANGED(REGEX_WHITELIST_TABLE) |
+	              LIST_CHANGED_CLIENTS))
+		update_regex_from_database(changed & LIST_CHANGED(REGEX_BLACKLIST_TABLE),
+		                           changed & LIST_CHANGED(REGEX_WHITELIST_TABLE));
+	// The clients imported from the history still need their per-client
+	// regex data
+	else if(preloaded)
+		update_regex_from_database(false, false);
+
+	// Load the gravity set again if gravity has been updated since it was
+	// preloaded
+	if(preloaded && (changed & LIST_CHANGED(GRAVITY_TABLE)))
+		set_event(RELOAD_GRAVITY);
 
 	// Check for inaccessible adlist URLs
 	check_inaccessible_adlists();
 
+	// Recompile the Lua policy. A changed policy can change any status
+	const bool policy_changed = lua_policy_load();
+
 	// Reset FTL's internal DNS cache storing whether a specific domain
-	// has already been validated for a specific user
-	FTL_reset_per_client_domain_data();
+	// has already been validated for a specific user. Only statuses which
+	// may depend on a changed list are reset. Whitelists and the group
+	// assignments of clients can change any status. The other lists are
+	// checked in the order blacklist, gravity, regex blacklist: a change
+	// can block domains which were not blocked before and alter the
+	// status of its own list and of all lists checked after it
+	unsigned int statuses = 0u;
+	if(preloaded || policy_changed ||
+	   (changed & (LIST_CHANGED(EXACT_WHITELIST_TABLE) |
+	               LIST_CHANGED(REGEX_WHITELIST_TABLE) |
+	               LIST_CHANGED_CLIENTS)))
+		statuses = ~0u;
+	if(changed & LIST_CHANGED(EXACT_BLACKLIST_TABLE))
+		statuses |= 1u << BLACKLIST_BLOCKED;
+	if(changed & (LIST_CHANGED(EXACT_BLACKLIST_TABLE) |
+	              LIST_CHANGED(GRAVITY_TABLE)))
+		statuses |= 1u << GRAVITY_BLOCKED;
+	if(changed & (LIST_CHANGED(EXACT_BLACKLIST_TABLE) |
+	              LIST_CHANGED(GRAVITY_TABLE) |
+	              LIST_CHANGED(REGEX_BLACKLIST_TABLE)))
+		statuses |= (1u << REGEX_BLOCKED) | (1u << NOT_BLOCKED);
+	if(statuses != 0u)
+		FTL_reset_per_client_domain_status(statuses);
+	else
+		logg("Domain lists are unchanged, keeping blocking status of all domains");
+
+	// DNS workers have to pick up the new lists and database connection
+	restart_dns_workers();
 
 	unlock_shm();
+
+	timer_stop(LISTS_TIMER);
 }
 
 bool __attribute__ ((const)) is_blocked(const enum query_status status)
@@ -550,7 +976,7 @@ bool __attribute__ ((const)) is_blocked(const enum query_status status)
 	}
 }
 
-static const char* __attribute__ ((const)) query_status_str(const enum query_status status)
+const char * __attribute__ ((const)) get_query_status_str(const enum query_status status)
 {
 	switch (status)
 	{
@@ -601,7 +1027,7 @@ void _query_set_status(queriesData *query, const enum query_status new_status, c
 	// Debug logging
 	if(config.debug & DEBUG_STATUS)
 	{
-		const char *oldstr = query->status < QUERY_STATUS_MAX ? query_status_str(query->status) : "INVALID";
+		const char *oldstr = query->status < QUERY_STATUS_MAX ? get_query_status_str(query->status) : "INVALID";
 		if(query->status == new_status)
 		{
 			logg("Query %i: status unchanged: %s (%d) in %s() (%s:%i)",
@@ -609,7 +1035,7 @@ void _query_set_status(queriesData *query, const enum query_status new_status, c
 		}
 		else
 		{
-			const char *newstr = new_status < QUERY_STATUS_MAX ? query_status_str(new_status) : "INVALID";
+			const char *newstr = new_status < QUERY_STATUS_MAX ? get_query_status_str(new_status) : "INVALID";
 			logg("Query %i: status changed: %s (%d) -> %s (%d) in %s() (%s:%i)",
 			     query->id, oldstr, query->status, newstr, new_status, func, short_path(file), line);
 		}
@@ -619,31 +1045,41 @@ void _query_set_status(queriesData *query, const enum query_status new_status, c
 	if(new_status >= QUERY_STATUS_MAX)
 		return;
 
-	// Update counters
+	// Update counters, the query is counted with the queries it stands for
 	if(query->status != new_status)
 	{
-		counters->status[query->status]--;
-		counters->status[new_status]++;
+		const int weight = 1 + query->unsampled;
+		counter_sub(status[query->status], weight);
+		counter_add(status[new_status], weight);
 
 		const int timeidx = getOverTimeID(query->timestamp);
 		if(is_blocked(query->status))
-			overTime[timeidx].blocked--;
+		{
+			overTime[timeidx].blocked -= weight;
+			timeseries_update(query->timestamp, 0, -weight);
+		}
 		if(is_blocked(new_status))
-			overTime[timeidx].blocked++;
+		{
+			overTime[timeidx].blocked += weight;
+			timeseries_update(query->timestamp, 0, weight);
+		}
 
 		if(query->status == QUERY_CACHE)
-			overTime[timeidx].cached--;
+			overTime[timeidx].cached -= weight;
 		if(new_status == QUERY_CACHE)
-			overTime[timeidx].cached++;
+			overTime[timeidx].cached += weight;
 
 		if(query->status == QUERY_FORWARDED)
-			overTime[timeidx].forwarded--;
+			overTime[timeidx].forwarded -= weight;
 		if(new_status == QUERY_FORWARDED)
-			overTime[timeidx].forwarded++;
+			overTime[timeidx].forwarded += weight;
 	}
 
 	// Update status
 	query->status = new_status;
+
+	// A query with a known status may be done now
+	query_update_inflight(query);
 }
 
 const char * __attribute__ ((const)) get_query_reply_str(const enum reply_type reply)
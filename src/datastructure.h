@@ -21,6 +21,9 @@
 
 extern const char *querytypes[TYPE_MAX];
 
+// The members are ordered to avoid any padding as there may be millions of
+// these objects in memory. All enums are packed (one byte each). The fields
+// most often scanned (status, type and timestamp) are placed first
 typedef struct {
 	unsigned char magic;
 	enum query_status status;
@@ -29,14 +32,27 @@ typedef struct {
 	enum reply_type reply;
 	enum dnssec_status dnssec;
 	uint16_t qtype;
+	uint32_t timestamp; // seconds since the epoch, valid until 2106
 	int domainID;
 	int clientID;
 	int upstreamID;
 	int id; // the ID is a (signed) int in dnsmasq, so no need for a long int here
 	int CNAME_domainID; // only valid if query has a CNAME blocking status
 	int ede;
-	unsigned long response; // saved in units of 1/10 milliseconds (1 = 0.1ms, 2 = 0.2ms, 2500 = 250.0ms, etc.)
-	time_t timestamp;
+	// Sequence numbers of the previous query of the same domain and client
+	// (see query_seq()), these form per-domain and per-client query lists
+	unsigned int prev_domain_query;
+	unsigned int prev_client_query;
+	// Sequence numbers of the neighbours of this query in the list of
+	// queries which are still in progress (see query_update_inflight()),
+	// a query refers to itself at either end of the list
+	unsigned int prev_inflight;
+	unsigned int next_inflight;
+	// Saved in units of 1/10 milliseconds (1 = 0.1ms, 2 = 0.2ms, 2500 = 250.0ms,
+	// etc.). While waiting for the reply, this holds the (truncated) time the
+	// query arrived. Unsigned wrap-around ensures the difference is still
+	// correct for response times of up to five days
+	uint32_t response;
 	// Adjacent bit field members in the struct flags may be packed to share
 	// and straddle the individual bytes. It is useful to pack the memory as
 	// tightly as possible as there may be dozens of thousands of these
@@ -49,18 +65,77 @@ typedef struct {
 		bool blocked :1;
 		bool database :1;
 		bool response_calculated :1;
+		bool inflight :1;
 	} flags;
+	// Number of queries left out by sampling which this query stands for.
+	// Only queries imported from the database stand for others (see
+	// DB_read_queries()), they are counted and expire together with it
+	uint16_t unsampled;
 } queriesData;
 
+// The overTime data of clients and upstreams is sparse, most of them are only
+// active in a few slots. It is stored in chunks of consecutive slots which are
+// allocated from a shared pool once a slot becomes non-zero. Slots are mapped
+// onto a ring of chunks so moving the overTime data only advances the ring
+#define OVERTIME_CHUNK_SLOTS 16
+#define OVERTIME_CHUNKS ((OVERTIME_SLOTS + OVERTIME_CHUNK_SLOTS - 1) / OVERTIME_CHUNK_SLOTS)
+#define OVERTIME_RING (OVERTIME_CHUNKS * OVERTIME_CHUNK_SLOTS)
+
+typedef struct {
+	int values[OVERTIME_CHUNK_SLOTS];
+} overTimeChunk;
+
+typedef struct {
+	// Pool index of the chunks, zero if a chunk is not allocated
+	unsigned int chunk[OVERTIME_CHUNKS];
+} overTimeSeries;
+
+// Host name resolution state of clients and upstream servers. Lookups which
+// did not return a host name are retried no earlier than at next
+typedef struct {
+	time_t last;
+	time_t next;
+	unsigned int failures;
+} resolveState;
+
+// Estimated number of queries of a client for a domain (see heavyhitters.c).
+// Clients keep their HH_CLIENT_TOPK most queried domains, domains their
+// HH_DOMAIN_TOPK most active clients. Slots with a zero count are unused
+#define HH_CLIENT_TOPK 8
+#define HH_DOMAIN_TOPK 4
+typedef struct {
+	int id;
+	int count;
+} heavyHitter;
+
+// HyperLogLog registers estimating the number of distinct domains queried by
+// a client (see cardinality.c)
+#define HLL_CLIENT_PRECISION 8
+#define HLL_CLIENT_REGISTERS (1 << HLL_CLIENT_PRECISION)
+
+// Response time histogram of upstream servers, one sparse series per bin. Bin 0
+// counts responses faster than 0.1 ms, bin i responses in [2^(i-1), 2^i) * 0.1 ms,
+// the last bin everything slower than about 1.6 s
+#define UPSTREAM_RTIME_BINS 16
+
 typedef struct {
 	unsigned char magic;
 	bool new;
 	in_addr_t port;
 	int failed;
-	int overTime[OVERTIME_SLOTS];
+	int inflight; // queries awaiting a reply (see FTL_upstream_inflight())
+	float rtime_ewma; // moving average of the response time [ms]
+	float error_ewma; // moving average of the error rate [0..1]
+	overTimeSeries overTime;
+	overTimeSeries rtime[UPSTREAM_RTIME_BINS];
 	size_t ippos;
 	size_t namepos;
 	time_t lastQuery;
+	resolveState resolve;
+	struct {
+		unsigned int opened; // replies received over new TCP connections
+		unsigned int reused; // replies received over reused TCP connections
+	} tcp;
 } upstreamsData;
 
 typedef struct {
@@ -74,27 +149,46 @@ typedef struct {
 		bool aliasclient:1;
 		bool rate_limited:1;
 	} flags;
+	// Incremented whenever the slot is reclaimed (see reclaim.c)
+	unsigned char generation;
 	int count;
 	int blockedcount;
 	int aliasclient_id;
 	unsigned int id;
-	unsigned int rate_limit;
 	unsigned int numQueriesARP;
-	int overTime[OVERTIME_SLOTS];
+	struct {
+		float tokens; // token bucket, see ratelimit.c
+		unsigned int refused;
+		int next; // next client released in the same second
+		time_t refilled;
+		time_t release;
+	} rate;
+	overTimeSeries overTime;
+	int alias_list;
+	unsigned int last_query; // sequence number of the most recent query
 	size_t groupspos;
 	size_t ippos;
 	size_t namepos;
 	size_t ifacepos;
 	time_t lastQuery;
 	time_t firstSeen;
+	resolveState resolve;
+	heavyHitter topdomains[HH_CLIENT_TOPK];
+	unsigned char unique_domains[HLL_CLIENT_REGISTERS];
 } clientsData;
 
 typedef struct {
 	unsigned char magic;
+	bool cname_blocked; // domain has been seen blocking a CNAME chain
+	bool indexed; // domain is part of the trigram index
+	unsigned char generation; // incremented whenever the slot is reclaimed
 	int count;
 	int blockedcount;
 	uint32_t domainhash;
+	unsigned int last_query; // sequence number of the most recent query
+	uint32_t last_seen; // last lookup, also as a CNAME [s since the epoch]
 	size_t domainpos;
+	heavyHitter topclients[HH_DOMAIN_TOPK];
 } domainsData;
 
 typedef struct {
@@ -102,16 +196,36 @@ typedef struct {
 	enum domain_client_status blocking_status;
 	enum reply_type force_reply;
 	enum query_types query_type;
+	// Generations of the domain and the client, the entry is stale when
+	// either of them has been reclaimed since (see reclaim.c)
+	unsigned char domain_generation;
+	unsigned char client_generation;
+	// Hour of the last lookup (hours since the epoch, truncated), entries
+	// not looked up within the retention window are removed (see reclaim.c)
+	uint16_t last_hour;
 	int domainID;
 	int clientID;
 	int domainlist_id;
+	unsigned int epoch;
 } DNSCacheData;
 
+// Blocking verdict of a domain shared by all clients with the same groups
+typedef struct {
+	int domainID;
+	unsigned int groupspos;
+	int domainlist_id;
+	unsigned int epoch;
+	unsigned char query_type;
+	unsigned char blocking_status;
+	unsigned char force_reply;
+} verdictCacheData;
+
 void strtolower(char *str);
+uint32_t strtolower_hash(char *str);
 uint32_t hashStr(const char *s) __attribute__((pure));
-int findQueryID(const int id);
+int findQueryID(const int id) __attribute__((pure));
 int findUpstreamID(const char * upstream, const in_port_t port);
-int findDomainID(const char *domain, const bool count);
+int findDomainID(const char *domain, const uint32_t hash, const bool count);
 int findClientID(const char *client, const bool count, const bool aliasclient);
 #define findCacheID(domainID, clientID, query_type, create_new) _findCacheID(domainID, clientID, query_type, create_new, __FUNCTION__, __LINE__, __FILE__)
 int _findCacheID(const int domainID, const int clientID, const enum query_types query_type, const bool create_new, const char *func, const int line, const char *file);
@@ -122,16 +236,30 @@ bool is_blocked(const enum query_status status) __attribute__ ((const));
 #define query_set_status(query, new_status) _query_set_status(query, new_status, __FUNCTION__, __LINE__, __FILE__)
 void _query_set_status(queriesData *query, const enum query_status new_status, const char *func, const int line, const char *file);
 
+bool get_cached_verdict(const int domainID, clientsData *client, const enum query_types query_type, DNSCacheData *dns_cache);
+bool has_cached_verdict(const int domainID, const clientsData *client, const enum query_types query_type) __attribute__((pure));
+void set_cached_verdict(const int domainID, const clientsData *client, const enum query_types query_type, const DNSCacheData *dns_cache);
+
+void FTL_preload_domainlists(void);
+void FTL_preload_domainlists_done(void);
 void FTL_reload_all_domainlists(void);
 void FTL_reset_per_client_domain_data(void);
+void FTL_reset_per_client_domain_status(const unsigned int statuses);
 
 const char *getDomainString(const queriesData* query);
 const char *getCNAMEDomainString(const queriesData* query);
 const char *getClientIPString(const queriesData* query);
 const char *getClientNameString(const queriesData* query);
 
+void link_query(const int queryID, queriesData *query);
+void query_update_inflight(queriesData *query);
+void query_remove_inflight(queriesData *query);
+void query_remember_blocked(const queriesData *query);
 void change_clientcount(clientsData *client, int total, int blocked, int overTimeIdx, int overTimeMod);
+unsigned int upstream_rtime_bin(const unsigned long response) __attribute__ ((const));
+void add_upstream_rtime(upstreamsData *upstream, const time_t timestamp, const unsigned long response);
 
+const char *get_query_status_str(const enum query_status status) __attribute__ ((const));
 const char *get_query_reply_str(const enum reply_type query) __attribute__ ((const));
 
 // Pointer getter functions
@@ -0,0 +1,166 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Debug log sampling and rate-limiting
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "debuglimit.h"
+#include "config.h"
+#include "log.h"
+// TIME_SCOPE()
+#include "timers.h"
+
+// Debug categories like DEBUG_QUERIES log several lines for every query, this
+// is unusable on busy servers. Each category can be limited by sampling (only
+// one out of DEBUG_<CATEGORY>_SAMPLE messages is logged) and by a token bucket
+// (at most DEBUG_<CATEGORY>_RATE messages per second, bursts of up to one
+// second's worth of messages). The bucket is implemented as generic cell rate
+// algorithm: a single timestamp updated by compare-and-swap, so processes can
+// share it without a lock. The number of suppressed messages is logged by the
+// housekeeper every DEBUG_REPORT_INTERVAL seconds
+
+static const char *const category_names[DEBUG_CATEGORIES] = {
+	"DATABASE", "NETWORKING", "LOCKS", "QUERIES", "FLAGS", "SHMEM", "GC",
+	"ARP", "REGEX", "API", "OVERTIME", "STATUS", "CAPS", "DNSSEC", "VECTORS",
+	"RESOLVER", "EDNS0", "CLIENTS", "ALIASCLIENTS", "EVENTS", "HELPER", "EXTRA"
+};
+
+// Limits read from the config file before the shared memory is created
+static struct {
+	unsigned int sample;
+	unsigned int rate;
+} configured[DEBUG_CATEGORIES] = {{ 0 }};
+
+static uint64_t monotonic_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+// Take a token from the bucket of this category
+static bool take_token(debugLimit *limit, const unsigned int rate)
+{
+	const uint64_t now = monotonic_usec();
+	const uint64_t interval = 1000000u / rate;
+	// Allow bursts of one second's worth of messages
+	const uint64_t tolerance = 1000000u - interval;
+
+	uint64_t tat = atomic_load_explicit(&limit->tat, memory_order_relaxed);
+	do
+	{
+		if(tat > now + tolerance)
+			return false;
+	}
+	while(!atomic_compare_exchange_weak_explicit(&limit->tat, &tat,
+	                                             (tat > now ? tat : now) + interval,
+	                                             memory_order_relaxed,
+	                                             memory_order_relaxed));
+
+	return true;
+}
+
+// Returns true if a debug message of this category may be logged now
+bool debug_limit_pass(const enum debug_flags flag)
+{
+	if(debug_limits == NULL ||
+	   !(atomic_load_explicit(&debug_limits->active, memory_order_relaxed) & flag))
+		return true;
+
+	debugLimit *limit = &debug_limits->category[__builtin_ctz(flag)];
+	const unsigned int sample = atomic_load_explicit(&limit->sample, memory_order_relaxed);
+	if(sample > 1 && atomic_fetch_add_explicit(&limit->seen, 1, memory_order_relaxed) % sample != 0)
+	{
+		atomic_fetch_add_explicit(&limit->suppressed, 1, memory_order_relaxed);
+		return false;
+	}
+
+	const unsigned int rate = atomic_load_explicit(&limit->rate, memory_order_relaxed);
+	if(rate > 0 && !take_token(limit, rate))
+	{
+		atomic_fetch_add_explicit(&limit->suppressed, 1, memory_order_relaxed);
+		return false;
+	}
+
+	return true;
+}
+
+static void apply_limit(const unsigned int category)
+{
+	debugLimit *limit = &debug_limits->category[category];
+	atomic_store(&limit->sample, configured[category].sample);
+	atomic_store(&limit->rate, configured[category].rate);
+	atomic_store(&limit->tat, 0u);
+
+	if(configured[category].sample > 1 || configured[category].rate > 0)
+		atomic_fetch_or(&debug_limits->active, 1u << category);
+	else
+		atomic_fetch_and(&debug_limits->active, ~(1u << category));
+}
+
+// Called after the shared memory object has been created
+void init_debug_limits(void)
+{
+	atomic_store(&debug_limits->active, 0u);
+	for(unsigned int i = 0; i < DEBUG_CATEGORIES; i++)
+		apply_limit(i);
+}
+
+void set_debug_limit(const unsigned int category, const unsigned int sample, const unsigned int rate)
+{
+	if(category >= DEBUG_CATEGORIES)
+		return;
+
+	configured[category].sample = sample;
+	configured[category].rate = rate < DEBUG_RATE_MAX ? rate : DEBUG_RATE_MAX;
+
+	if(debug_limits != NULL)
+		apply_limit(category);
+}
+
+// Get the category of a name like "QUERIES" or "DEBUG_QUERIES", -1 if unknown
+int debug_category(const char *name)
+{
+	if(strncasecmp(name, "DEBUG_", 6) == 0)
+		name += 6;
+
+	for(unsigned int i = 0; i < DEBUG_CATEGORIES; i++)
+		if(strcasecmp(name, category_names[i]) == 0)
+			return (int)i;
+
+	return -1;
+}
+
+const char *debug_category_name(const unsigned int category)
+{
+	return category < DEBUG_CATEGORIES ? category_names[category] : "UNKNOWN";
+}
+
+// Log the number of messages suppressed since the last report
+void report_debug_limits(void)
+{
+	TIME_SCOPE("debug_limits_report");
+
+	if(debug_limits == NULL)
+		return;
+
+	for(unsigned int i = 0; i < DEBUG_CATEGORIES; i++)
+	{
+		debugLimit *limit = &debug_limits->category[i];
+		const uint64_t suppressed = atomic_load(&limit->suppressed);
+		const uint64_t reported = atomic_exchange(&limit->reported, suppressed);
+		if(suppressed > reported)
+			logg("Suppressed %llu DEBUG_%s messages since the last report",
+			     (unsigned long long)(suppressed - reported), category_names[i]);
+	}
+}
+
+bool debug_limits_active(void)
+{
+	return debug_limits != NULL && atomic_load(&debug_limits->active) != 0u;
+}
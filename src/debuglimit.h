@@ -0,0 +1,64 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Debug log sampling and rate-limiting prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef DEBUGLIMIT_H
+#define DEBUGLIMIT_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+// enum debug_flags
+#include "enums.h"
+
+// Number of debug categories (bits of enum debug_flags)
+#define DEBUG_CATEGORIES 22
+
+// Interval in which suppressed debug messages are reported [seconds]
+#define DEBUG_REPORT_INTERVAL 60
+
+// Upper bound of DEBUG_<CATEGORY>_RATE [messages per second]
+#define DEBUG_RATE_MAX 100000u
+
+typedef struct {
+	// Log one out of this many messages, zero or one logs all of them
+	atomic_uint sample;
+	// Log at most this many messages per second, zero means unlimited
+	atomic_uint rate;
+	// Number of messages seen so far (for sampling)
+	atomic_uint_fast64_t seen;
+	// Theoretical arrival time of the next message [microseconds]
+	atomic_uint_fast64_t tat;
+	// Number of suppressed messages and their number at the last report
+	atomic_uint_fast64_t suppressed;
+	atomic_uint_fast64_t reported;
+} debugLimit;
+
+// Debug messages are logged by forks, too, so the limits are stored in
+// shared memory. Changes through the API apply to all processes immediately
+typedef struct {
+	// Categories with a sampling factor or a rate limit
+	atomic_uint active;
+	debugLimit category[DEBUG_CATEGORIES];
+} debugLimitsStruct;
+
+extern debugLimitsStruct *debug_limits;
+
+// Use this instead of (config.debug & flag) in front of messages which may be
+// logged for every query. Debug logging is the exception, the compiler moves
+// the guarded code out of the hot paths
+#define debug_enabled(flag) (__builtin_expect((config.debug & (flag)) != 0, 0) && debug_limit_pass(flag))
+
+bool debug_limit_pass(const enum debug_flags flag) __attribute__((cold));
+void init_debug_limits(void);
+void set_debug_limit(const unsigned int category, const unsigned int sample, const unsigned int rate);
+int debug_category(const char *name) __attribute__((pure));
+const char *debug_category_name(const unsigned int category) __attribute__((const));
+void report_debug_limits(void);
+bool debug_limits_active(void) __attribute__((pure));
+
+#endif //DEBUGLIMIT_H
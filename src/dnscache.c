@@ -0,0 +1,124 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  DNS cache persistence
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#define FTLDNS
+#include "dnsmasq/dnsmasq.h"
+#undef __USE_XOPEN
+#include "FTL.h"
+#include "dnscache.h"
+#include "dnsmasq_interface.h"
+#include "config.h"
+#include "log.h"
+// GIT_HASH
+#include "version.h"
+
+// dnsmasq's cache starts empty after every restart. With DNS_CACHE_DUMP, the
+// unexpired entries received from upstream servers (including DNSSEC data) are
+// written to a file on shutdown and inserted with their remaining TTL when
+// dnsmasq has loaded its configuration on the next start. The file is only
+// used once and rejected if written by a different build or with a different
+// DNSSEC setting
+
+#define DNSCACHE_MAGIC "FTLDNSC1"
+
+typedef struct {
+	char magic[8];
+	char commit[41];
+	bool dnssec;
+	size_t addrsize;
+	time_t timestamp;
+} dnscacheHeader;
+
+static void get_dnscache_header(dnscacheHeader *header)
+{
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, DNSCACHE_MAGIC, sizeof(header->magic));
+	strncpy(header->commit, GIT_HASH, sizeof(header->commit) - 1);
+	header->dnssec = option_bool(OPT_DNSSEC_VALID);
+	header->addrsize = sizeof(union all_addr);
+	header->timestamp = time(NULL);
+}
+
+// Write the DNS cache to the dump file, this has to be done by the process
+// owning the cache after dnsmasq has stopped answering queries
+void write_dns_cache(void)
+{
+	if(!config.dns_cache_dump || daemon->port == 0 || daemon->cachesize == 0)
+		return;
+
+	// The cache reveals which domains have been queried, only we may read it
+	const int fd = open(FTLfiles.dns_cache, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if(fd == -1)
+	{
+		logg("WARNING: Cannot write DNS cache %s: %s", FTLfiles.dns_cache, strerror(errno));
+		return;
+	}
+
+	dnscacheHeader header;
+	get_dnscache_header(&header);
+	int entries = -1;
+	if(read_write(fd, (unsigned char*)&header, sizeof(header), 0))
+		entries = cache_dump_entries(fd, header.timestamp);
+
+	if(close(fd) != 0)
+		entries = -1;
+
+	if(entries > -1)
+		logg("Stored %i DNS cache entries in %s", entries, FTLfiles.dns_cache);
+	else
+	{
+		logg("WARNING: Failed to write DNS cache %s: %s", FTLfiles.dns_cache, strerror(errno));
+		unlink(FTLfiles.dns_cache);
+	}
+}
+
+// Restore the DNS cache from the dump file (if available). This is called
+// after dnsmasq has (re)loaded the cache on startup
+void FTL_restore_dns_cache(const time_t now)
+{
+	if(!config.dns_cache_dump || daemon->port == 0 || daemon->cachesize == 0)
+		return;
+
+	const int fd = open(FTLfiles.dns_cache, O_RDONLY);
+	if(fd == -1)
+	{
+		if(errno != ENOENT)
+			logg("WARNING: Cannot read DNS cache %s: %s", FTLfiles.dns_cache, strerror(errno));
+		return;
+	}
+
+	// The dump is used at most once. Its content is outdated as soon as
+	// we start answering queries
+	unlink(FTLfiles.dns_cache);
+
+	dnscacheHeader stored, current;
+	get_dnscache_header(&current);
+	if(!read_write(fd, (unsigned char*)&stored, sizeof(stored), 1) ||
+	   memcmp(stored.magic, current.magic, sizeof(current.magic)) != 0 ||
+	   strncmp(stored.commit, current.commit, sizeof(current.commit)) != 0 ||
+	   stored.addrsize != current.addrsize)
+		logg("Not restoring DNS cache written by a different version of FTL");
+	else if(stored.dnssec != current.dnssec)
+		logg("Not restoring DNS cache as the DNSSEC setting has changed");
+	else if(stored.timestamp > current.timestamp)
+		logg("Not restoring DNS cache written in the future");
+	else
+	{
+		const int entries = cache_restore_entries(fd, now);
+		if(entries > -1)
+			logg("Restored %i DNS cache entries from %s (written %lis ago)",
+			     entries, FTLfiles.dns_cache, (long)(current.timestamp - stored.timestamp));
+		else
+			logg("WARNING: DNS cache %s is incomplete, restored what could be read",
+			     FTLfiles.dns_cache);
+	}
+
+	close(fd);
+}
@@ -0,0 +1,16 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  DNS cache persistence prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+// FTL_restore_dns_cache() is called by dnsmasq and declared in dnsmasq_interface.h
+void write_dns_cache(void);
+
+#endif //DNSCACHE_H
@@ -16,8 +16,142 @@
 
 #include "dnsmasq.h"
 
+/************ Pi-hole modification ************/
+/* Payloads used to be stored in chains of KEYBLOCK_LEN sized blocks, large
+   records (DNSSEC keys, TXT, ...) walked long chains and were copied into a
+   static buffer on every retrieval. Now, every payload has exactly one
+   block. Payloads larger than KEYBLOCK_LEN are stored contiguously in a run
+   of the smallest fitting size class (64 bytes to 64 KiB, doubling). Runs are
+   carved from slabs of BLOCKDATA_SLAB bytes (or one run for larger classes)
+   and kept in a free list per class. When the cache is flushed and no run is
+   in use anymore, all slabs are released at once. */
+struct blockslab {
+  struct blockslab *next;
+  /* runs follow, aligned like malloc() */
+  max_align_t runs[];
+};
+
 static struct blockdata *keyblock_free;
 static unsigned int blockdata_count, blockdata_hwm, blockdata_alloced;
+static struct blockslab *slabs;
+static unsigned char *run_free[BLOCKDATA_CLASSES];
+static size_t runs_used, run_count[BLOCKDATA_CLASSES], run_hwm[BLOCKDATA_CLASSES];
+static size_t slab_count, slab_bytes;
+static unsigned long slabs_released;
+
+static size_t run_size(int class)
+{
+  return (size_t)64 << (class - 1);
+}
+
+/* Smallest class holding len bytes, 0 if it fits into the block itself and
+   BLOCKDATA_CLASSES if it is too large for any class */
+static int run_class(size_t len)
+{
+  int class;
+
+  if (len <= KEYBLOCK_LEN)
+    return 0;
+
+  for (class = 1; class < BLOCKDATA_CLASSES && run_size(class) < len; class++);
+
+  return class;
+}
+
+static int add_runs(int class)
+{
+  size_t size = run_size(class), bytes = size > BLOCKDATA_SLAB ? size : BLOCKDATA_SLAB;
+  struct blockslab *slab = whine_malloc(sizeof(struct blockslab) + bytes);
+  unsigned char *run;
+
+  if (!slab)
+    return 0;
+
+  slab->next = slabs;
+  slabs = slab;
+  slab_count++;
+  slab_bytes += bytes;
+
+  for (run = (unsigned char *)slab->runs; run + size <= (unsigned char *)slab->runs + bytes; run += size)
+    {
+      memcpy(run, &run_free[class], sizeof(unsigned char *));
+      run_free[class] = run;
+    }
+
+  return 1;
+}
+
+static unsigned char *new_run(int class)
+{
+  unsigned char *run;
+
+  if (!run_free[class] && !add_runs(class))
+    return NULL;
+
+  run = run_free[class];
+  memcpy(&run_free[class], run, sizeof(unsigned char *));
+  runs_used++;
+  if (++run_count[class] > run_hwm[class])
+    run_hwm[class] = run_count[class];
+
+  return run;
+}
+
+static void free_run(unsigned char *run, int class)
+{
+  memcpy(run, &run_free[class], sizeof(unsigned char *));
+  run_free[class] = run;
+  runs_used--;
+  run_count[class]--;
+}
+
+/* Payload of a block */
+static unsigned char *block_data(struct blockdata *block)
+{
+  return block->run ? block->run : block->key;
+}
+
+/* Called after the cache has been flushed. Release all slabs unless some
+   runs are still in use (e.g. by a reply stashed for validation) */
+void blockdata_flush(void)
+{
+  int class;
+
+  if (runs_used != 0 || !slabs)
+    return;
+
+  while (slabs)
+    {
+      struct blockslab *next = slabs->next;
+      free(slabs);
+      slabs = next;
+    }
+
+  for (class = 0; class < BLOCKDATA_CLASSES; class++)
+    run_free[class] = NULL;
+
+  slabs_released += slab_count;
+  slab_count = 0;
+  slab_bytes = 0;
+}
+
+void blockdata_get_stats(struct blockdata_stats *stats)
+{
+  int class;
+
+  stats->blocks = blockdata_count;
+  stats->blocks_hwm = blockdata_hwm;
+  stats->blocks_alloced = blockdata_alloced;
+  for (class = 0; class < BLOCKDATA_CLASSES; class++)
+    {
+      stats->runs[class] = run_count[class];
+      stats->runs_hwm[class] = run_hwm[class];
+    }
+  stats->slabs = slab_count;
+  stats->slab_bytes = slab_bytes;
+  stats->released = slabs_released;
+}
+/**********************************************/
 
 static void add_blocks(int n)
 {
@@ -52,10 +186,23 @@ void blockdata_init(void)
 
 void blockdata_report(void)
 {
+  /************ Pi-hole modification ************/
+  size_t used = 0;
+  int class;
+
+  for (class = 1; class < BLOCKDATA_CLASSES; class++)
+    used += run_count[class] * run_size(class);
+
   my_syslog(LOG_INFO, _("pool memory in use %zu, max %zu, allocated %zu"), 
-	    blockdata_count * sizeof(struct blockdata),  
+	    blockdata_count * sizeof(struct blockdata) + used,
 	    blockdata_hwm * sizeof(struct blockdata),  
-	    blockdata_alloced * sizeof(struct blockdata));
+	    blockdata_alloced * sizeof(struct blockdata) + slab_bytes);
+
+  for (class = 1; class < BLOCKDATA_CLASSES; class++)
+    if (run_hwm[class] != 0)
+      my_syslog(LOG_INFO, _("pool runs of %zu bytes in use %zu, max %zu"),
+		run_size(class), run_count[class], run_hwm[class]);
+  /**********************************************/
 } 
 
 static struct blockdata *new_block(void)
@@ -72,152 +219,111 @@ static struct blockdata *new_block(void)
       blockdata_count++;
       if (blockdata_hwm < blockdata_count)
 	blockdata_hwm = blockdata_count;
-      block->next = NULL;
+      block->run = NULL;
       return block;
     }
   
   return NULL;
 }
 
+/************ Pi-hole modification ************/
 static struct blockdata *blockdata_alloc_real(int fd, char *data, size_t len)
 {
-  struct blockdata *block, *ret = NULL;
-  struct blockdata **prev = &ret;
-  size_t blen;
+  struct blockdata *block;
+  int class = run_class(len);
+
+  if (!(block = new_block()))
+    return NULL;
 
-  do
+  if (class != 0)
     {
-      if (!(block = new_block()))
+      if (class == BLOCKDATA_CLASSES || !(block->run = new_run(class)))
 	{
-	  /* failed to alloc, free partial chain */
-	  blockdata_free(ret);
+	  blockdata_free(block);
 	  return NULL;
 	}
+      block->key[0] = class;
+    }
 
-      if ((blen = len > KEYBLOCK_LEN ? KEYBLOCK_LEN : len) > 0)
+  if (len > 0)
+    {
+      if (data)
+	memcpy(block_data(block), data, len);
+      else if (!read_write(fd, block_data(block), len, 1))
 	{
-	  if (data)
-	    {
-	      memcpy(block->key, data, blen);
-	      data += blen;
-	    }
-	  else if (!read_write(fd, block->key, blen, 1))
-	    {
-	      /* failed read free partial chain */
-	      blockdata_free(ret);
-	      return NULL;
-	    }
+	  /* failed read */
+	  blockdata_free(block);
+	  return NULL;
 	}
-      
-      len -= blen;
-      *prev = block;
-      prev = &block->next;
-    } while (len != 0);
-  
-  return ret;
+    }
+
+  return block;
 }
+/**********************************************/
 
 struct blockdata *blockdata_alloc(char *data, size_t len)
 {
   return blockdata_alloc_real(0, data, len);
 }
 
+/************ Pi-hole modification ************/
 /* Add data to the end of the block. 
    newlen is length of new data, NOT total new length. 
-   Use blockdata_alloc(NULL, 0) to make empty block to add to. */
+   Use blockdata_alloc(NULL, 0) to make empty block to add to.
+   Payloads are moved to a run of the next fitting size class when they grow
+   beyond the current one, the block itself stays where it is */
 int blockdata_expand(struct blockdata *block, size_t oldlen, char *data, size_t newlen)
 {
-  struct blockdata *b;
-  
-  /* find size of current final block */
-  for (b = block; oldlen > KEYBLOCK_LEN && b;  b = b->next, oldlen -= KEYBLOCK_LEN);
+  int class = block->run ? block->key[0] : 0;
+  int new_class = run_class(oldlen + newlen);
 
-  /* chain to short for length, something is broken */
-  if (oldlen > KEYBLOCK_LEN)
+  if (new_class > class)
     {
-      blockdata_free(block);
-      return 0;
-    }
+      unsigned char *run = new_class < BLOCKDATA_CLASSES ? new_run(new_class) : NULL;
 
-  while (1)
-    {
-      struct blockdata *new;
-      size_t blocksize = KEYBLOCK_LEN - oldlen;
-      size_t size = (newlen <= blocksize) ? newlen : blocksize;
-      
-      if (size != 0)
+      if (!run)
 	{
-	  memcpy(&b->key[oldlen], data, size);
-	  data += size;
-	  newlen -= size;
-	}
-      
-      /* full blocks from now on. */
-      oldlen = 0;
-
-      if (newlen == 0)
-	break;
-
-      if ((new = new_block()))
-	{
-	  b->next = new;
-	  b = new;
-	}
-      else
-	{
-	  /* failed to alloc, free partial chain */
+	  /* failed to alloc */
 	  blockdata_free(block);
 	  return 0;
 	}
+
+      memcpy(run, block_data(block), oldlen);
+      if (class != 0)
+	free_run(block->run, class);
+      block->run = run;
+      block->key[0] = new_class;
     }
 
+  if (newlen != 0)
+    memcpy(block_data(block) + oldlen, data, newlen);
+
   return 1;
 }
 
 void blockdata_free(struct blockdata *blocks)
 {
-  struct blockdata *tmp;
-  
   if (blocks)
     {
-      for (tmp = blocks; tmp->next; tmp = tmp->next)
-	blockdata_count--;
-      tmp->next = keyblock_free;
+      if (blocks->run)
+	free_run(blocks->run, blocks->key[0]);
+      blocks->next = keyblock_free;
       keyblock_free = blocks; 
       blockdata_count--;
     }
 }
 
-/* if data == NULL, return pointer to static block of sufficient size */
+/* if data == NULL, return pointer to the payload itself, it must not be
+   modified and is only valid until the block is freed */
 void *blockdata_retrieve(struct blockdata *block, size_t len, void *data)
 {
-  size_t blen;
-  struct  blockdata *b;
-  void *new, *d;
-  
-  static unsigned int buff_len = 0;
-  static unsigned char *buff = NULL;
-   
+  if (!block)
+    return NULL;
+
   if (!data)
-    {
-      if (len > buff_len)
-	{
-	  if (!(new = whine_malloc(len)))
-	    return NULL;
-	  if (buff)
-	    free(buff);
-	  buff = new;
-	}
-      data = buff;
-    }
-  
-  for (d = data, b = block; len > 0 && b;  b = b->next)
-    {
-      blen = len > KEYBLOCK_LEN ? KEYBLOCK_LEN : len;
-      memcpy(d, b->key, blen);
-      d += blen;
-      len -= blen;
-    }
+    return block_data(block);
+
+  memcpy(data, block_data(block), len);
 
   return data;
 }
@@ -225,13 +331,10 @@ void *blockdata_retrieve(struct blockdata *block, size_t len, void *data)
 
 void blockdata_write(struct blockdata *block, size_t len, int fd)
 {
-  for (; len > 0 && block; block = block->next)
-    {
-      size_t blen = len > KEYBLOCK_LEN ? KEYBLOCK_LEN : len;
-      read_write(fd, block->key, blen, 0);
-      len -= blen;
-    }
+  if (block && len > 0)
+    read_write(fd, block_data(block), len, 0);
 }
+/**********************************************/
 
 struct blockdata *blockdata_read(int fd, size_t len)
 {
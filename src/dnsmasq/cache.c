@@ -16,6 +16,9 @@
 
 #include "dnsmasq.h"
 #include "dnsmasq_interface.h"
+/************ Pi-hole modification ************/
+#include <sys/mman.h>
+/**********************************************/
 
 static struct crec *cache_head = NULL, *cache_tail = NULL, **hash_table = NULL;
 #ifdef HAVE_DHCP
@@ -25,6 +28,10 @@ static struct crec *new_chain = NULL;
 static int insert_error;
 static union bigname *big_free = NULL;
 static int bignames_left, hash_size;
+/************ Pi-hole modification ************/
+/* Entries removed from the cache by cache_resize() */
+static struct crec *cache_spare = NULL;
+/**********************************************/
 
 static void make_non_terminals(struct crec *source);
 static struct crec *really_insert(char *name, union all_addr *addr, unsigned short class,
@@ -210,8 +217,12 @@ void rehash(int size)
   struct crec **new, **old, *p, *tmp;
   int i, new_size, old_size;
 
-  /* hash_size is a power of two. */
-  for (new_size = 64; new_size < size/10; new_size = new_size << 1);
+  /************ Pi-hole modification ************/
+  /* hash_size is a power of two. There is a bucket for every entry so
+     the chains are short and finding a name rarely has to follow
+     them */
+  for (new_size = 64; new_size < size; new_size = new_size << 1);
+  /**********************************************/
   
   /* must succeed in getting first instance, failure later is non-fatal */
   if (!hash_table)
@@ -239,7 +250,11 @@ void rehash(int size)
     }
 }
   
-static struct crec **hash_bucket(char *name)
+/************ Pi-hole modification ************/
+/* The hash of a name is kept in its entries (name_hash). Entries of other
+   names in the same chain are skipped by comparing it instead of the names
+   themselves */
+static unsigned int hash_name(const char *name)
 {
   unsigned int c, val = 017465; /* Barker code - minimum self-correlation in cyclic shift */
   const unsigned char *mix_tab = (const unsigned char*)typestr; 
@@ -252,10 +267,21 @@ static struct crec **hash_bucket(char *name)
       val = ((val << 7) | (val >> (32 - 7))) + (mix_tab[(val + c) & 0x3F] ^ c);
     } 
   
+  return val;
+}
+
+static struct crec **hash_bucket_of(unsigned int val)
+{
   /* hash_size is a power of two */
   return hash_table + ((val ^ (val >> 16)) & (hash_size - 1));
 }
 
+static struct crec **hash_bucket(char *name)
+{
+  return hash_bucket_of(hash_name(name));
+}
+/**********************************************/
+
 static void cache_hash(struct crec *crecp)
 {
   /* maintain an invariant that all entries with F_REVERSE set
@@ -264,7 +290,9 @@ static void cache_hash(struct crec *crecp)
      This allows reverse searches and garbage collection to be optimised */
 
   char *name = cache_get_name(crecp);
-  struct crec **up = hash_bucket(name);
+  /************ Pi-hole modification ************/
+  struct crec **up = hash_bucket_of(crecp->name_hash = hash_name(name));
+  /**********************************************/
   unsigned int flags = crecp->flags & (F_IMMORTAL | F_REVERSE);
   
   if (!(flags & F_REVERSE))
@@ -280,6 +308,7 @@ static void cache_hash(struct crec *crecp)
   /* Preserve order when inserting the same name multiple times.
      Do not mess up the flag invariants. */
   while (*up &&
+	 (*up)->name_hash == crecp->name_hash && /* Pi-hole modification */
 	 hostname_isequal(cache_get_name(*up), name) &&
 	 flags == ((*up)->flags & (F_IMMORTAL | F_REVERSE)))
     up = &((*up)->hash_next);
@@ -485,9 +514,13 @@ static struct crec *cache_scan_free(char *name, union all_addr *addr, unsigned s
   
   if (flags & F_FORWARD)
     {
-      for (up = hash_bucket(name), crecp = *up; crecp; crecp = crecp->hash_next)
+      /************ Pi-hole modification ************/
+      const unsigned int hash = hash_name(name);
+      /**********************************************/
+      for (up = hash_bucket_of(hash), crecp = *up; crecp; crecp = crecp->hash_next)
 	{
-	  if ((crecp->flags & F_FORWARD) && hostname_isequal(cache_get_name(crecp), name))
+	  if ((crecp->flags & F_FORWARD) && crecp->name_hash == hash && /* Pi-hole modification */
+	      hostname_isequal(cache_get_name(crecp), name))
 	    {
 	      int rrmatch = 0;
 	      if (crecp->flags & flags & F_RR)
@@ -785,6 +818,75 @@ static struct crec *really_insert(char *name, union all_addr *addr, unsigned sho
   return new;
 }
 
+/************ Pi-hole modification ************/
+/* Change the number of cache entries. New entries are free and appended to
+   the end of the LRU list. When shrinking, only free entries at the end of
+   the LRU list are removed (after freeing all expired entries), the cache may
+   hence remain larger than requested. Removed entries are reused when the
+   cache grows again. Returns the new size. */
+int cache_resize(int size, time_t now)
+{
+  struct crec *crecp;
+
+  /* Don't resize a disabled cache or during an insertion */
+  if (daemon->cachesize == 0 || new_chain)
+    return daemon->cachesize;
+
+  /* Entries which are not spare are allocated in one block so they are
+     as close to each other as the initial ones */
+  int missing = size - daemon->cachesize;
+  for (crecp = cache_spare; crecp && missing > 0; crecp = crecp->next)
+    missing--;
+  if (missing > 0 && (crecp = whine_malloc(missing*sizeof(struct crec))))
+    while (missing-- > 0)
+      {
+	crecp[missing].next = cache_spare;
+	cache_spare = &crecp[missing];
+      }
+
+  while (daemon->cachesize < size)
+    {
+      if ((crecp = cache_spare))
+	cache_spare = crecp->next;
+      else if (!(crecp = whine_malloc(sizeof(struct crec))))
+	break;
+
+      crecp->flags = 0;
+      crecp->uid = UID_NONE;
+      if (cache_tail)
+	cache_tail->next = crecp;
+      else
+	cache_head = crecp;
+      crecp->prev = cache_tail;
+      crecp->next = NULL;
+      cache_tail = crecp;
+
+      if (++daemon->cachesize % 10 == 0)
+	bignames_left++;
+    }
+
+  if (daemon->cachesize > size)
+    cache_scan_free(NULL, NULL, C_IN, now, 0, NULL, NULL);
+
+  while (daemon->cachesize > size && (crecp = cache_tail) &&
+	 !(crecp->flags & (F_FORWARD | F_REVERSE)))
+    {
+      /* CNAME records may still point to this entry (see
+	 is_outdated_cname_pointer()), it is kept for later reuse
+	 instead of being freed. */
+      cache_unlink(crecp);
+      crecp->next = cache_spare;
+      cache_spare = crecp;
+
+      if (daemon->cachesize-- % 10 == 0 && bignames_left > 0)
+	bignames_left--;
+    }
+
+  rehash(daemon->cachesize);
+  return daemon->cachesize;
+}
+/**********************************************/
+
 /* after end of insertion, commit the new entries */
 void cache_end_insert(void)
 {
@@ -966,9 +1068,13 @@ int cache_recv_insert(time_t now, int fd)
 int cache_find_non_terminal(char *name, time_t now)
 {
   struct crec *crecp;
+  /************ Pi-hole modification ************/
+  const unsigned int hash = hash_name(name);
+  /**********************************************/
 
-  for (crecp = *hash_bucket(name); crecp; crecp = crecp->hash_next)
-    if (!is_outdated_cname_pointer(crecp) &&
+  for (crecp = *hash_bucket_of(hash); crecp; crecp = crecp->hash_next)
+    if (crecp->name_hash == hash && /* Pi-hole modification */
+	!is_outdated_cname_pointer(crecp) &&
 	!is_expired(now, crecp) &&
 	(crecp->flags & F_FORWARD) &&
 	!(crecp->flags & F_NXDOMAIN) && 
@@ -993,8 +1099,11 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
 	 also free anything which has expired */
       struct crec *next, **up, **insert = NULL, **chainp = &ans;
       unsigned int ins_flags = 0;
+      /************ Pi-hole modification ************/
+      const unsigned int hash = hash_name(name);
+      /**********************************************/
       
-      for (up = hash_bucket(name), crecp = *up; crecp; crecp = next)
+      for (up = hash_bucket_of(hash), crecp = *up; crecp; crecp = next)
 	{
 	  next = crecp->hash_next;
 	  
@@ -1002,6 +1111,7 @@ struct crec *cache_find_by_name(struct crec *crecp, char *name, time_t now, unsi
 	    {
 	      if ((crecp->flags & F_FORWARD) && 
 		  (crecp->flags & prot) &&
+		  crecp->name_hash == hash && /* Pi-hole modification */
 		  hostname_isequal(cache_get_name(crecp), name))
 		{
 		  if (crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG))
@@ -1159,9 +1269,13 @@ void add_hosts_entry(struct crec *cache, union all_addr *addr, int addrlen,
   
   if (rhash)
     {
-      /* hash address */
-      for (j = 0, i = 0; i < addrlen; i++)
-	j = (j*2 +((unsigned char *)addr)[i]) % hashsz;
+      /************ Pi-hole modification ************/
+      /* hash address (FNV-1a), the former shift-and-add hash put most
+	 addresses of a large hosts file into very few buckets */
+      for (j = 2166136261u, i = 0; i < addrlen; i++)
+	j = (j ^ ((unsigned char *)addr)[i]) * 16777619u;
+      j %= hashsz;
+      /**********************************************/
       
       for (lookup = rhash[j]; lookup; lookup = lookup->next)
 	if ((lookup->flags & cache->flags & (F_IPV4 | F_IPV6)) &&
@@ -1192,71 +1306,204 @@ void add_hosts_entry(struct crec *cache, union all_addr *addr, int addrlen,
   make_non_terminals(cache);
 }
 
-static int eatspace(FILE *f)
+/************ Pi-hole modification ************/
+/* Hosts files are tokenised straight out of a read-only mapping of the file
+   rather than through getc(), this is several times faster for files with
+   millions of lines. Files which cannot be mapped (pipes, /proc) are read
+   into a buffer instead. */
+struct hostsbuf {
+  char *data;
+  const char *p, *end;
+  size_t len;
+  int mapped;
+};
+
+static int hostsbuf_open(const char *filename, struct hostsbuf *hb)
 {
-  int c, nl = 0;
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
 
-  while (1)
+  memset(hb, 0, sizeof(*hb));
+
+  if (fd == -1)
+    return 0;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
     {
-      if ((c = getc(f)) == '#')
-	while (c != '\n' && c != EOF)
-	  c = getc(f);
-      
-      if (c == EOF)
-	return 1;
+      void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED)
+	{
+	  madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+	  hb->data = map;
+	  hb->len = (size_t)st.st_size;
+	  hb->mapped = 1;
+	}
+    }
 
-      if (!isspace(c))
+  if (!hb->mapped)
+    {
+      size_t size = 0;
+      ssize_t n;
+
+      while (1)
+	{
+	  if (hb->len == size)
+	    {
+	      char *new = realloc(hb->data, size = size ? 2*size : 65536);
+	      if (!new)
+		{
+		  free(hb->data);
+		  close(fd);
+		  errno = ENOMEM;
+		  return 0;
+		}
+	      hb->data = new;
+	    }
+
+	  if ((n = read(fd, hb->data + hb->len, size - hb->len)) > 0)
+	    hb->len += n;
+	  else if (n == 0 || errno != EINTR)
+	    break;
+	}
+    }
+
+  close(fd);
+  hb->p = hb->data;
+  hb->end = hb->data + hb->len;
+
+  return 1;
+}
+
+static void hostsbuf_close(struct hostsbuf *hb)
+{
+  if (hb->mapped)
+    munmap(hb->data, hb->len);
+  else
+    free(hb->data);
+}
+
+static int eatspace(struct hostsbuf *hb)
+{
+  int nl = 0;
+
+  while (hb->p < hb->end)
+    {
+      unsigned char c = *hb->p;
+
+      if (c == '#')
 	{
-	  ungetc(c, f);
-	  return nl;
+	  const char *eol = memchr(hb->p, '\n', hb->end - hb->p);
+	  hb->p = eol ? eol : hb->end;
+	  continue;
 	}
 
+      if (!isspace(c))
+	return nl;
+
       if (c == '\n')
 	nl++;
+      hb->p++;
     }
+
+  return 1;
 }
-	 
-static int gettok(FILE *f, char *token)
+
+static int gettok(struct hostsbuf *hb, char *token)
 {
-  int c, count = 0;
- 
-  while (1)
+  int count = 0;
+
+  if (hb->p >= hb->end)
+    return -1;
+
+  while (hb->p < hb->end)
     {
-      if ((c = getc(f)) == EOF)
-	return (count == 0) ? -1 : 1;
+      unsigned char c = *hb->p;
 
       if (isspace(c) || c == '#')
 	{
-	  ungetc(c, f);
-	  return eatspace(f);
+	  token[count] = 0;
+	  return eatspace(hb);
 	}
-      
+
       if (count < (MAXDNAME - 1))
+	token[count++] = c;
+      hb->p++;
+    }
+
+  token[count] = 0;
+  return 1;
+}
+
+/* Upper bound of the number of names and addresses in a hosts file: every
+   line with at least two tokens counts one address, every further token
+   one name. Used to size the cache hash and the by-address hash once
+   before reading instead of growing them while reading. */
+static void count_hostsfile(const char *filename, int *names, int *addrs)
+{
+  struct hostsbuf hb;
+  int tokens = 0;
+
+  if (!hostsbuf_open(filename, &hb))
+    return;
+
+  while (hb.p < hb.end)
+    {
+      unsigned char c = *hb.p;
+
+      if (c == '\n' || c == '#')
 	{
-	  token[count++] = c;
-	  token[count] = 0;
+	  if (tokens > 1)
+	    {
+	      (*addrs)++;
+	      *names += tokens - 1;
+	    }
+	  tokens = 0;
+	  if (c == '#' && !(hb.p = memchr(hb.p, '\n', hb.end - hb.p)))
+	    break;
+	  hb.p++;
+	}
+      else if (isspace(c))
+	hb.p++;
+      else
+	{
+	  tokens++;
+	  while (hb.p < hb.end && !isspace((unsigned char)*hb.p) && *hb.p != '#')
+	    hb.p++;
 	}
     }
+
+  if (tokens > 1)
+    {
+      (*addrs)++;
+      *names += tokens - 1;
+    }
+
+  hostsbuf_close(&hb);
 }
+/**********************************************/
 
 int read_hostsfile(char *filename, unsigned int index, int cache_size, struct crec **rhash, int hashsz)
 {  
-  FILE *f = fopen(filename, "r");
+  /************ Pi-hole modification ************/
+  struct hostsbuf hb;
+  /**********************************************/
   char *token = daemon->namebuff, *domain_suffix = NULL;
   int names_done = 0, name_count = cache_size, lineno = 1;
   unsigned int flags = 0;
   union all_addr addr;
   int atnl, addrlen = 0;
 
-  if (!f)
+  /************ Pi-hole modification ************/
+  if (!hostsbuf_open(filename, &hb))
+  /**********************************************/
     {
       my_syslog(LOG_ERR, _("failed to load names from %s: %s"), filename, strerror(errno));
       return cache_size;
     }
   
-  lineno += eatspace(f);
+  lineno += eatspace(&hb);
   
-  while ((atnl = gettok(f, token)) != -1)
+  while ((atnl = gettok(&hb, token)) != -1)
     {
       if (inet_pton(AF_INET, token, &addr) > 0)
 	{
@@ -1274,7 +1521,7 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size, struct cr
 	{
 	  my_syslog(LOG_ERR, _("bad address at %s line %d"), filename, lineno); 
 	  while (atnl == 0)
-	    atnl = gettok(f, token);
+	    atnl = gettok(&hb, token);
 	  lineno += atnl;
 	  continue;
 	}
@@ -1292,7 +1539,7 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size, struct cr
 	  int fqdn, nomem;
 	  char *canon;
 	  
-	  if ((atnl = gettok(f, token)) == -1)
+	  if ((atnl = gettok(&hb, token)) == -1)
 	    break;
 
 	  fqdn = !!strchr(token, '.');
@@ -1331,7 +1578,7 @@ int read_hostsfile(char *filename, unsigned int index, int cache_size, struct cr
       lineno += atnl;
     } 
 
-  fclose(f);
+  hostsbuf_close(&hb);
   
   if (rhash)
     rehash(name_count); 
@@ -1345,6 +1592,10 @@ void cache_reload(void)
 {
   struct crec *cache, **up, *tmp;
   int revhashsz, i, total_size = daemon->cachesize;
+  /************ Pi-hole modification ************/
+  struct crec **revhash = (struct crec **)daemon->packet;
+  int names = 0, addrs = 0;
+  /**********************************************/
   struct hostsfile *ah;
   struct host_record *hr;
   struct name_list *nl;
@@ -1386,6 +1637,11 @@ void cache_reload(void)
 	else
 	  up = &cache->hash_next;
       }
+
+  /************ Pi-hole modification ************/
+  /* Release the memory of the records freed above at once */
+  blockdata_flush();
+  /**********************************************/
   
   /* Add locally-configured CNAMEs to the cache */
   for (a = daemon->cnames; a; a = a->next)
@@ -1420,11 +1676,35 @@ void cache_reload(void)
       }
 #endif
   
-  /* borrow the packet buffer for a temporary by-address hash */
-  memset(daemon->packet, 0, daemon->packet_buff_sz);
+  /************ Pi-hole modification ************/
+  /* Count names and addresses of all hosts files up-front so the cache hash
+     is grown once and the by-address hash is large enough for all of them */
+  if (!(option_bool(OPT_NO_HOSTS) && !daemon->addn_hosts))
+    {
+      if (!option_bool(OPT_NO_HOSTS))
+	count_hostsfile(HOSTSFILE, &names, &addrs);
+
+      daemon->addn_hosts = expand_filelist(daemon->addn_hosts);
+      for (ah = daemon->addn_hosts; ah; ah = ah->next)
+	if (!(ah->flags & AH_INACTIVE))
+	  count_hostsfile(ah->fname, &names, &addrs);
+
+      if (names > 0)
+	rehash(total_size + names);
+    }
+
   revhashsz = daemon->packet_buff_sz / sizeof(struct crec *);
-  /* we overwrote the buffer... */
-  daemon->srv_save = NULL;
+  if (addrs > revhashsz && (revhash = whine_malloc(addrs * sizeof(struct crec *))))
+    revhashsz = addrs;
+  else
+    {
+      /* borrow the packet buffer for a temporary by-address hash */
+      revhash = (struct crec **)daemon->packet;
+      memset(daemon->packet, 0, daemon->packet_buff_sz);
+      /* we overwrote the buffer... */
+      daemon->srv_save = NULL;
+    }
+  /**********************************************/
 
   /* Do host_records in config. */
   for (hr = daemon->host_records; hr; hr = hr->next)
@@ -1436,7 +1716,7 @@ void cache_reload(void)
 	    cache->name.namep = nl->name;
 	    cache->ttd = hr->ttl;
 	    cache->flags = F_HOSTS | F_IMMORTAL | F_FORWARD | F_REVERSE | F_IPV4 | F_NAMEP | F_CONFIG;
-	    add_hosts_entry(cache, (union all_addr *)&hr->addr, INADDRSZ, SRC_CONFIG, (struct crec **)daemon->packet, revhashsz);
+	    add_hosts_entry(cache, (union all_addr *)&hr->addr, INADDRSZ, SRC_CONFIG, revhash, revhashsz);
 	  }
 
 	if ((hr->flags & HR_6) &&
@@ -1445,7 +1725,7 @@ void cache_reload(void)
 	    cache->name.namep = nl->name;
 	    cache->ttd = hr->ttl;
 	    cache->flags = F_HOSTS | F_IMMORTAL | F_FORWARD | F_REVERSE | F_IPV6 | F_NAMEP | F_CONFIG;
-	    add_hosts_entry(cache, (union all_addr *)&hr->addr6, IN6ADDRSZ, SRC_CONFIG, (struct crec **)daemon->packet, revhashsz);
+	    add_hosts_entry(cache, (union all_addr *)&hr->addr6, IN6ADDRSZ, SRC_CONFIG, revhash, revhashsz);
 	  }
       }
 	
@@ -1457,12 +1737,14 @@ void cache_reload(void)
   else
     {
       if (!option_bool(OPT_NO_HOSTS))
-	total_size = read_hostsfile(HOSTSFILE, SRC_HOSTS, total_size, (struct crec **)daemon->packet, revhashsz);
+	total_size = read_hostsfile(HOSTSFILE, SRC_HOSTS, total_size, revhash, revhashsz);
       
-      daemon->addn_hosts = expand_filelist(daemon->addn_hosts);
+      /************ Pi-hole modification ************/
+      /* daemon->addn_hosts has been expanded above already */
+      /**********************************************/
       for (ah = daemon->addn_hosts; ah; ah = ah->next)
 	if (!(ah->flags & AH_INACTIVE))
-	  total_size = read_hostsfile(ah->fname, ah->index, total_size, (struct crec **)daemon->packet, revhashsz);
+	  total_size = read_hostsfile(ah->fname, ah->index, total_size, revhash, revhashsz);
     }
   
   /* Make non-terminal records for all locally-define RRs */
@@ -1499,8 +1781,13 @@ void cache_reload(void)
     }
   
 #ifdef HAVE_INOTIFY
-  set_dynamic_inotify(AH_HOSTS, total_size, (struct crec **)daemon->packet, revhashsz);
+  set_dynamic_inotify(AH_HOSTS, total_size, revhash, revhashsz);
 #endif
+
+  /************ Pi-hole modification ************/
+  if (revhash != (struct crec **)daemon->packet)
+    free(revhash);
+  /**********************************************/
   
 } 
 
@@ -1951,6 +2238,298 @@ void get_dnsmasq_cache_info(struct cache_info *ci)
       else
 	ci->expired++;
 }
+
+/* Entries received from upstream which are written to the cache dump. CNAMEs
+   have to point to another cache entry. */
+static int is_dumpable(struct crec *crecp, time_t now)
+{
+  if (!(crecp->flags & (F_FORWARD | F_REVERSE)) ||
+      (crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG | F_IMMORTAL | F_NAMEP)) ||
+      difftime(crecp->ttd, now) <= 0)
+    return 0;
+
+  if (crecp->flags & F_CNAME)
+    return !crecp->addr.cname.is_name_ptr && !is_outdated_cname_pointer(crecp);
+
+  return 1;
+}
+
+/* Entries of the same RRset have to be inserted in one go, inserting one
+   of them frees the others otherwise. */
+#define RRSET_FLAGS (F_FORWARD | F_REVERSE | F_IPV4 | F_IPV6 | F_CNAME | F_DNSKEY | F_DS | F_RR)
+static int same_rrset(char *a, unsigned int aflags, unsigned short atype,
+		      char *b, unsigned int bflags, unsigned short btype)
+{
+  return (aflags & RRSET_FLAGS) == (bflags & RRSET_FLAGS) &&
+    (!(aflags & F_RR) || atype == btype) &&
+    hostname_isequal(a, b);
+}
+
+static int dump_entry(int fd, struct crec *crecp)
+{
+  char *name = cache_get_name(crecp);
+  unsigned short len = strlen(name);
+  unsigned short class = (crecp->flags & (F_DNSKEY | F_DS)) ? crecp->uid : C_IN;
+  union all_addr addr = crecp->addr;
+
+  if (crecp->flags & F_CNAME)
+    memset(&addr, 0, sizeof(addr));
+
+  if (!read_write(fd, (unsigned char *)&len, sizeof(len), 0) ||
+      !read_write(fd, (unsigned char *)name, len, 0) ||
+      !read_write(fd, (unsigned char *)&crecp->ttd, sizeof(crecp->ttd), 0) ||
+      !read_write(fd, (unsigned char *)&crecp->flags, sizeof(crecp->flags), 0) ||
+      !read_write(fd, (unsigned char *)&class, sizeof(class), 0) ||
+      !read_write(fd, (unsigned char *)&addr, sizeof(addr), 0))
+    return 0;
+
+  if (crecp->flags & F_CNAME)
+    {
+      /* The target is stored by name, it gets a new entry when restored */
+      char *target = cache_get_name(crecp->addr.cname.target.cache);
+      len = strlen(target);
+      return read_write(fd, (unsigned char *)&len, sizeof(len), 0) &&
+	read_write(fd, (unsigned char *)target, len, 0);
+    }
+
+  if (!(crecp->flags & F_NEG))
+    {
+      if ((crecp->flags & F_RR) && (crecp->flags & F_KEYTAG))
+	blockdata_write(crecp->addr.rrblock.rrdata, crecp->addr.rrblock.datalen, fd);
+#ifdef HAVE_DNSSEC
+      else if (crecp->flags & F_DNSKEY)
+	blockdata_write(crecp->addr.key.keydata, crecp->addr.key.keylen, fd);
+      else if (crecp->flags & F_DS)
+	blockdata_write(crecp->addr.ds.keydata, crecp->addr.ds.keylen, fd);
+#endif
+    }
+
+  return 1;
+}
+
+/* Write all unexpired entries received from upstream servers to fd. Returns
+   the number of entries written or -1 on errors. */
+int cache_dump_entries(int fd, time_t now)
+{
+  int count = 0;
+  unsigned short end = 0;
+
+  for (int i = 0; i < hash_size; i++)
+    for (struct crec *crecp = hash_table[i]; crecp; crecp = crecp->hash_next)
+      {
+	struct crec *prev, *same;
+	char *name = cache_get_name(crecp);
+
+	if (!is_dumpable(crecp, now))
+	  continue;
+
+	/* Skip entries already written as part of an earlier RRset */
+	for (prev = hash_table[i]; prev != crecp; prev = prev->hash_next)
+	  if (is_dumpable(prev, now) &&
+	      same_rrset(name, crecp->flags, crecp->addr.rrdata.rrtype,
+			 cache_get_name(prev), prev->flags, prev->addr.rrdata.rrtype))
+	    break;
+	if (prev != crecp)
+	  continue;
+
+	for (same = crecp; same; same = same->hash_next)
+	  if (same == crecp ||
+	      (is_dumpable(same, now) &&
+	       same_rrset(name, crecp->flags, crecp->addr.rrdata.rrtype,
+			  cache_get_name(same), same->flags, same->addr.rrdata.rrtype)))
+	    {
+	      if (!dump_entry(fd, same))
+		return -1;
+	      count++;
+	    }
+      }
+
+  if (!read_write(fd, (unsigned char *)&end, sizeof(end), 0))
+    return -1;
+
+  return count;
+}
+
+/* Find an entry a restored CNAME can point to */
+static struct crec *find_cname_target(char *name, time_t now)
+{
+  for (struct crec *crecp = *hash_bucket(name); crecp; crecp = crecp->hash_next)
+    if ((crecp->flags & F_FORWARD) && !(crecp->flags & (F_DNSKEY | F_DS)) &&
+	!is_expired(now, crecp) && !is_outdated_cname_pointer(crecp) &&
+	hostname_isequal(name, cache_get_name(crecp)))
+      return crecp;
+
+  return NULL;
+}
+
+struct restored_cname {
+  struct restored_cname *next;
+  time_t ttd;
+  unsigned int flags;
+  char *target;
+  char name[];
+};
+
+/* Insert the entries written by cache_dump_entries() with their remaining
+   TTL. Returns the number of restored entries or -1 if fd could not be read
+   completely. */
+int cache_restore_entries(int fd, time_t now)
+{
+  struct restored_cname *cnames = NULL, *c, **up;
+  char rrset[MAXDNAME];
+  unsigned int rrset_flags = 0;
+  unsigned short rrset_type = 0;
+  int count = 0, ok = 1, progress = 1;
+
+  *rrset = 0;
+  cache_start_insert();
+
+  while (1)
+    {
+      unsigned short len, class;
+      time_t ttd;
+      unsigned int flags;
+      union all_addr addr;
+      struct blockdata *block = NULL;
+
+      if (!read_write(fd, (unsigned char *)&len, sizeof(len), 1) || len >= MAXDNAME)
+	{
+	  ok = 0;
+	  break;
+	}
+
+      if (len == 0)
+	break;
+
+      if (!read_write(fd, (unsigned char *)daemon->namebuff, len, 1) ||
+	  !read_write(fd, (unsigned char *)&ttd, sizeof(ttd), 1) ||
+	  !read_write(fd, (unsigned char *)&flags, sizeof(flags), 1) ||
+	  !read_write(fd, (unsigned char *)&class, sizeof(class), 1) ||
+	  !read_write(fd, (unsigned char *)&addr, sizeof(addr), 1))
+	{
+	  ok = 0;
+	  break;
+	}
+      daemon->namebuff[len] = 0;
+
+      if (flags & F_CNAME)
+	{
+	  /* CNAMEs are inserted after all other entries, their targets
+	     have to be in the cache */
+	  size_t namelen = strlen(daemon->namebuff) + 1;
+
+	  if (!read_write(fd, (unsigned char *)&len, sizeof(len), 1) || len >= MAXDNAME ||
+	      !(c = whine_malloc(sizeof(struct restored_cname) + namelen + len + 1)))
+	    {
+	      ok = 0;
+	      break;
+	    }
+
+	  memcpy(c->name, daemon->namebuff, namelen);
+	  c->target = c->name + namelen;
+	  if (!read_write(fd, (unsigned char *)c->target, len, 1))
+	    {
+	      free(c);
+	      ok = 0;
+	      break;
+	    }
+	  c->target[len] = 0;
+	  c->ttd = ttd;
+	  c->flags = flags;
+	  c->next = cnames;
+	  cnames = c;
+	  continue;
+	}
+
+      if (!(flags & F_NEG))
+	{
+	  if ((flags & F_RR) && (flags & F_KEYTAG))
+	    {
+	      if (!(block = addr.rrblock.rrdata = blockdata_read(fd, addr.rrblock.datalen)))
+		{
+		  ok = 0;
+		  break;
+		}
+	    }
+#ifdef HAVE_DNSSEC
+	  else if (flags & F_DNSKEY)
+	    {
+	      if (!(block = addr.key.keydata = blockdata_read(fd, addr.key.keylen)))
+		{
+		  ok = 0;
+		  break;
+		}
+	    }
+	  else if (flags & F_DS)
+	    {
+	      if (!(block = addr.ds.keydata = blockdata_read(fd, addr.ds.keylen)))
+		{
+		  ok = 0;
+		  break;
+		}
+	    }
+#endif
+	}
+
+      /* Start a new insertion for every RRset. A failing insertion
+	 only loses the current RRset */
+      if (!*rrset || !same_rrset(rrset, rrset_flags, rrset_type,
+				 daemon->namebuff, flags, addr.rrdata.rrtype))
+	{
+	  cache_end_insert();
+	  cache_start_insert();
+	  strcpy(rrset, daemon->namebuff);
+	  rrset_flags = flags;
+	  rrset_type = addr.rrdata.rrtype;
+	}
+
+      if (difftime(ttd, now) > 0 &&
+	  really_insert(daemon->namebuff, &addr, class, now, (unsigned long)difftime(ttd, now), flags))
+	count++;
+      else if (block)
+	blockdata_free(block);
+    }
+
+  cache_end_insert();
+
+  /* CNAMEs may point to other CNAMEs, insert them until no more targets
+     are found */
+  while (cnames && progress)
+    for (progress = 0, up = &cnames; (c = *up); )
+      {
+	struct crec *target, *newc;
+
+	if (!(target = find_cname_target(c->target, now)))
+	  {
+	    up = &c->next;
+	    continue;
+	  }
+
+	cache_start_insert();
+	if (difftime(c->ttd, now) > 0 &&
+	    (newc = really_insert(c->name, NULL, C_IN, now, (unsigned long)difftime(c->ttd, now), c->flags)))
+	  {
+	    newc->addr.cname.is_name_ptr = 0;
+	    next_uid(target);
+	    newc->addr.cname.target.cache = target;
+	    newc->addr.cname.uid = target->uid;
+	    count++;
+	  }
+	cache_end_insert();
+
+	*up = c->next;
+	free(c);
+	progress = 1;
+      }
+
+  while ((c = cnames))
+    {
+      cnames = c->next;
+      free(c);
+    }
+
+  return ok ? count : -1;
+}
 /********************************************************/
 
 void dump_cache(time_t now)
@@ -38,6 +38,10 @@ volatile char FTL_terminate = 0;
 static void set_dns_listeners(void);
 static void set_tftp_listeners(void);
 static void check_dns_listeners(time_t now);
+/************ Pi-hole modification ************/
+static void start_dns_workers(void);
+static void run_dns_worker(int slot) __attribute__((noreturn));
+/**********************************************/
 static void sig_handler(int sig);
 static void async_event(int pipe, time_t now);
 static void fatal_event(struct event_desc *ev, char *msg);
@@ -97,6 +101,7 @@ int main_dnsmasq (int argc, char **argv)
   sigaction(SIGUSR2, &sigact, NULL);
   sigaction(SIGHUP, &sigact, NULL);
   sigaction(SIGUSR6, &sigact, NULL); // Pi-hole modification
+  sigaction(SIGTERM, &sigact, NULL); // Pi-hole modification
   sigaction(SIGALRM, &sigact, NULL);
   sigaction(SIGCHLD, &sigact, NULL);
   sigaction(SIGINT, &sigact, NULL);
@@ -1074,6 +1079,35 @@ int main_dnsmasq (int argc, char **argv)
     {
       int timeout = fast_retry(now);
       
+      /************ Pi-hole modification ************/
+      if (daemon->port != 0)
+	{
+	  start_dns_workers();
+	  FTL_cache_adapt(now);
+	  FTL_tcp_pool_expire(now);
+
+	  /* Wake up regularly until the queries in progress have been
+	     answered after handing the listeners over to a new process */
+	  if ((i = FTL_handover_drain()) != -1 &&
+	      (timeout == -1 || timeout > i))
+	    timeout = i;
+
+	  /* Publish the queries in flight to each upstream server */
+	  if ((i = FTL_upstream_inflight(now)) != -1 &&
+	      (timeout == -1 || timeout > i))
+	    timeout = i;
+
+	  /* Warm up the verdict cache after the lists have been reloaded */
+	  if ((i = FTL_verdict_warmup()) != -1 &&
+	      (timeout == -1 || timeout > i))
+	    timeout = i;
+	}
+#ifdef HAVE_DHCP
+      if (daemon->dhcp || daemon->doing_dhcp6)
+	lease_flush(now, 0);
+#endif
+      /**********************************************/
+
       poll_reset();
       
       /* Whilst polling for the dbus, or doing a tftp transfer, wake every quarter second */
@@ -1085,6 +1119,16 @@ int main_dnsmasq (int argc, char **argv)
       else if (is_dad_listeners() &&
 	       (timeout == -1 || timeout > 1000))
 	timeout = 1000;
+
+      /************ Pi-hole modification ************/
+#ifdef HAVE_DHCP
+      /* Wake up when a deferred write of the lease file is due */
+      if ((daemon->dhcp || daemon->doing_dhcp6) &&
+	  (i = lease_flush_timeout()) != -1 &&
+	  (timeout == -1 || timeout > i))
+	timeout = i;
+#endif
+      /**********************************************/
       
       if (daemon->port != 0)
 	set_dns_listeners();
@@ -1188,6 +1232,10 @@ int main_dnsmasq (int argc, char **argv)
       
       now = dnsmasq_time();
 
+      /************ Pi-hole modification ************/
+      FTL_clock_refresh();
+      /**********************************************/
+
       check_log_writer(0);
 
       /* prime. */
@@ -1343,7 +1391,7 @@ static void sig_handler(int sig)
 	event = EVENT_CHILD;
       else if (sig == SIGALRM)
 	event = EVENT_ALARM;
-      else if (sig == SIGUSR6) // Pi-hole modified
+      else if (sig == SIGUSR6 || sig == SIGTERM) // Pi-hole modified
 	event = EVENT_TERM;
       else if (sig == SIGUSR1)
 	event = EVENT_DUMP;
@@ -1499,6 +1547,16 @@ static void async_event(int pipe, time_t now)
 	
       case EVENT_INIT:
 	clear_cache_and_reload(now);
+	/************ Pi-hole modification ************/
+	// Restore the DNS cache of the previous run once the cache has been
+	// loaded on startup (this is done before any query is answered)
+	if (ev.event == EVENT_INIT)
+	  FTL_restore_dns_cache(now);
+	/**********************************************/
+	/************ Pi-hole modification ************/
+	// DNS workers have to pick up the reloaded configuration
+	FTL_restart_dns_workers();
+	/**********************************************/
 	
 	if (daemon->port != 0)
 	  {
@@ -1552,14 +1610,20 @@ static void async_event(int pipe, time_t now)
 		break;
 	    }      
 	  else if (daemon->port != 0)
-	    for (i = 0 ; i < daemon->max_procs; i++)
-	      if (daemon->tcp_pids[i] == p)
-		{
-		  daemon->tcp_pids[i] = 0;
-		  /* tcp_pipes == -1 && tcp_pids == 0 required to free slot */
-		  if (daemon->tcp_pipes[i] == -1)
-		    daemon->metrics[METRIC_TCP_CONNECTIONS]--;
-		}
+	    {
+	      /************ Pi-hole modification ************/
+	      FTL_dns_worker_exited(p);
+	      /**********************************************/
+
+	      for (i = 0 ; i < daemon->max_procs; i++)
+		if (daemon->tcp_pids[i] == p)
+		  {
+		    daemon->tcp_pids[i] = 0;
+		    /* tcp_pipes == -1 && tcp_pids == 0 required to free slot */
+		    if (daemon->tcp_pipes[i] == -1)
+		      daemon->metrics[METRIC_TCP_CONNECTIONS]--;
+		  }
+	    }
 	break;
 	
 #if defined(HAVE_SCRIPT)	
@@ -1641,6 +1705,9 @@ static void async_event(int pipe, time_t now)
 	  }
 #endif
 	
+	/************ Pi-hole modification ************/
+	lease_flush(now, 1);
+	/**********************************************/
 	if (daemon->lease_stream)
 	  fclose(daemon->lease_stream);
 
@@ -1802,6 +1869,11 @@ static void set_dns_listeners(void)
   struct listener *listener;
   struct randfd_list *rfl;
   int i;
+  /************ Pi-hole modification ************/
+  // The listeners are not read anymore once they have been handed over to a
+  // new process
+  const bool handed_over = FTL_handover_poll();
+  /**********************************************/
   
   for (serverfdp = daemon->sfds; serverfdp; serverfdp = serverfdp->next)
     poll_listen(serverfdp->fd, POLLIN);
@@ -1821,14 +1893,18 @@ static void set_dns_listeners(void)
 
   for (listener = daemon->listeners; listener; listener = listener->next)
     {
-      if (listener->fd != -1)
+      /************ Pi-hole modification ************/
+      if (listener->fd != -1 && !handed_over)
 	poll_listen(listener->fd, POLLIN);
+      /**********************************************/
       
       /* Only listen for TCP connections when a process slot
 	 is available. Death of a child goes through the select loop, so
 	 we don't need to explicitly arrange to wake up here,
 	 we'll be called again when a slot becomes available. */
-      if  (listener->tcpfd != -1 && i >= 0)
+      /************ Pi-hole modification ************/
+      if  (listener->tcpfd != -1 && i >= 0 && !handed_over)
+      /**********************************************/
 	poll_listen(listener->tcpfd, POLLIN);
     }
   
@@ -1846,6 +1922,13 @@ static void check_dns_listeners(time_t now)
   int i;
   int pipefd[2];
   
+  /************ Pi-hole modification ************/
+  // Queue UDP replies to be sent in batches
+  FTL_udp_batch_start();
+  // Hand the listeners over to a new process
+  FTL_handover_check();
+  /**********************************************/
+
   for (serverfdp = daemon->sfds; serverfdp; serverfdp = serverfdp->next)
     if (poll_check(serverfdp->fd, POLLIN))
       reply_query(serverfdp->fd, now);
@@ -1882,9 +1965,16 @@ static void check_dns_listeners(time_t now)
 	
   for (listener = daemon->listeners; listener; listener = listener->next)
     {
-
+      /************ Pi-hole modification ************/
+      // Process all datagrams received in a batch and send the replies
+      // before accepting TCP connections
+      FTL_udp_batch_start();
       if (listener->fd != -1 && poll_check(listener->fd, POLLIN))
-	receive_query(listener, now); 
+	do
+	  receive_query(listener, now);
+	while (FTL_recvmsg_pending(listener->fd));
+      FTL_udp_batch_flush();
+      /**********************************************/
       
       /* check to see if we have a free tcp process slot.
 	 Note that we can't assume that because we had
@@ -2077,7 +2167,10 @@ static void check_dns_listeners(time_t now)
 		free(buff);
 	      
 	      for (s = daemon->servers; s; s = s->next)
-		if (s->tcpfd != -1)
+		/************ Pi-hole modification ************/
+		// Keep idle upstream connections for later TCP workers
+		if (s->tcpfd != -1 && !FTL_tcp_pool_put(s, s->tcpfd))
+		/**********************************************/
 		  {
 		    shutdown(s->tcpfd, SHUT_RDWR);
 		    close(s->tcpfd);
@@ -2092,7 +2185,107 @@ static void check_dns_listeners(time_t now)
 	    }
 	}
     }
+
+  /************ Pi-hole modification ************/
+  FTL_udp_batch_flush();
+  /**********************************************/
+}
+
+/************ Pi-hole modification ************/
+/* Fork DNS workers until the configured number of them is running. The
+   workers answer UDP queries received on the listening sockets they share
+   with us (see workers.c) */
+static void start_dns_workers(void)
+{
+  int slot;
+  pid_t p;
+
+  while ((slot = FTL_dns_worker_slot()) > 0)
+    {
+      if ((p = fork()) == -1)
+	{
+	  my_syslog(LOG_ERR, _("cannot fork DNS worker: %s"), strerror(errno));
+	  break;
+	}
+
+      if (p == 0)
+	run_dns_worker(slot);
+
+      FTL_dns_worker_forked(slot, p);
+    }
+}
+
+/* Event loop of the DNS workers. They answer UDP queries and forward them to
+   upstream servers, everything else is done by the main process. Workers
+   terminate as soon as the state they copied from the main process becomes
+   outdated, the main process then forks a new one */
+static void run_dns_worker(int slot)
+{
+  struct listener *listener;
+  struct randfd_list *rfl;
+  time_t now = dnsmasq_time();
+  int i;
+
+  FTL_dns_worker_init(slot);
+  forget_forwards();
+
+  while (!FTL_dns_worker_stale())
+    {
+      int timeout = fast_retry(now);
+
+      poll_reset();
+
+      for (i = 0; i < daemon->numrrand; i++)
+	if (daemon->randomsocks[i].refcount != 0)
+	  poll_listen(daemon->randomsocks[i].fd, POLLIN);
+
+      for (rfl = daemon->rfl_poll; rfl; rfl = rfl->next)
+	poll_listen(rfl->rfd->fd, POLLIN);
+
+      for (listener = daemon->listeners; listener; listener = listener->next)
+	if (listener->fd != -1)
+	  poll_listen(listener->fd, POLLIN);
+
+      /* Check at least once a second if we are outdated */
+      if (timeout == -1 || timeout > 1000)
+	timeout = 1000;
+
+      set_log_writer();
+
+      if (do_poll(timeout) < 0)
+	continue;
+
+      now = dnsmasq_time();
+
+      /************ Pi-hole modification ************/
+      FTL_clock_refresh();
+      /**********************************************/
+
+      check_log_writer(0);
+
+      FTL_udp_batch_start();
+
+      for (i = 0; i < daemon->numrrand; i++)
+	if (daemon->randomsocks[i].refcount != 0 &&
+	    poll_check(daemon->randomsocks[i].fd, POLLIN))
+	  reply_query(daemon->randomsocks[i].fd, now);
+
+      for (rfl = daemon->rfl_poll; rfl; rfl = rfl->next)
+	if (poll_check(rfl->rfd->fd, POLLIN))
+	  reply_query(rfl->rfd->fd, now);
+
+      for (listener = daemon->listeners; listener; listener = listener->next)
+	if (listener->fd != -1 && poll_check(listener->fd, POLLIN))
+	  do
+	    receive_query(listener, now);
+	  while (FTL_recvmsg_pending(listener->fd));
+
+      FTL_udp_batch_flush();
+    }
+
+  FTL_dns_worker_exit();
 }
+/**********************************************/
 
 #ifdef HAVE_DHCP
 int make_icmp_sock(void)
@@ -475,11 +475,31 @@ union bigname {
   union bigname *next; /* freelist */
 };
 
+/************ Pi-hole modification ************/
+/* Payloads of up to KEYBLOCK_LEN bytes are stored in the block itself,
+   larger ones in a contiguous run of a size class (see blockdata.c) */
 struct blockdata {
-  struct blockdata *next;
-  unsigned char key[KEYBLOCK_LEN];
+  union {
+    struct blockdata *next; /* free list */
+    unsigned char *run;     /* payload larger than KEYBLOCK_LEN */
+  };
+  unsigned char key[KEYBLOCK_LEN]; /* payload, size class of run in key[0] */
 };
 
+/* Runs of class n > 0 have 64 << (n - 1) bytes, the last class holds the
+   largest possible RR */
+#define BLOCKDATA_CLASSES 12
+#define BLOCKDATA_SLAB 8192
+
+struct blockdata_stats {
+  size_t blocks, blocks_hwm, blocks_alloced;
+  size_t runs[BLOCKDATA_CLASSES];
+  size_t runs_hwm[BLOCKDATA_CLASSES];
+  size_t slabs, slab_bytes;
+  unsigned long released;
+};
+/**********************************************/
+
 struct crec { 
   struct crec *next, *prev, *hash_next;
   union all_addr addr;
@@ -487,6 +507,10 @@ struct crec {
   /* used as class if DNSKEY/DS, index to source for F_HOSTS */
   unsigned int uid; 
   unsigned int flags;
+  /************ Pi-hole modification ************/
+  /* hash of the name, compared before the name itself (see cache_hash()) */
+  unsigned int name_hash;
+  /**********************************************/
   union {
     char sname[SMALLDNAME];
     union bigname *bname;
@@ -609,6 +633,9 @@ struct server {
 #ifdef HAVE_LOOP
   u32 uid;
 #endif
+  /* Pi-hole modification: queries awaiting a reply and the number last
+     published to FTL (see FTL_upstream_inflight()) */
+  int inflight, inflight_published;
 };
 
 /* First four fields must match struct server in next three definitions.. */
@@ -876,6 +903,11 @@ struct dhcp_lease {
   int vendorclass_count;
 #endif
   struct dhcp_lease *next;
+  /************ Pi-hole modification ************/
+  /* Hash chains of the DHCPv4 lease indexes, see lease.c */
+  struct dhcp_lease *next_addr, *next_hwaddr, *next_clid;
+  unsigned int serial;
+  /**********************************************/
 };
 
 struct dhcp_netid {
@@ -1360,6 +1392,8 @@ struct cache_info {
   int immortal;
 };
 void get_dnsmasq_cache_info(struct cache_info *ci);
+int cache_dump_entries(int fd, time_t now);
+int cache_restore_entries(int fd, time_t now);
 /******************************************************************************************************************/
 char *record_source(unsigned int index);
 int cache_find_non_terminal(char *name, time_t now);
@@ -1370,6 +1404,7 @@ struct crec *cache_find_by_name(struct crec *crecp,
 				char *name, time_t now, unsigned int prot);
 void cache_end_insert(void);
 void cache_start_insert(void);
+int cache_resize(int size, time_t now); // Pi-hole modification
 unsigned int cache_remove_uid(const unsigned int uid);
 int cache_recv_insert(time_t now, int fd);
 struct crec *cache_insert(char *name, union all_addr *addr, unsigned short class, 
@@ -1398,6 +1433,10 @@ void *blockdata_retrieve(struct blockdata *block, size_t len, void *data);
 struct blockdata *blockdata_read(int fd, size_t len);
 void blockdata_write(struct blockdata *block, size_t len, int fd);
 void blockdata_free(struct blockdata *blocks);
+/************ Pi-hole modification ************/
+void blockdata_flush(void);
+void blockdata_get_stats(struct blockdata_stats *stats);
+/**********************************************/
 
 /* domain.c */
 char *get_domain(struct in_addr addr);
@@ -1556,6 +1595,7 @@ void resend_query(void);
 int allocate_rfd(struct randfd_list **fdlp, struct server *serv);
 void free_rfds(struct randfd_list **fdlp);
 int fast_retry(time_t now);
+void forget_forwards(void); // Pi-hole modification
 
 /* network.c */
 int indextoname(int fd, int index, char *name);
@@ -1607,6 +1647,10 @@ char *host_from_dns(struct in_addr addr);
 /* lease.c */
 #ifdef HAVE_DHCP
 void lease_update_file(time_t now);
+/************ Pi-hole modification ************/
+int lease_flush_timeout(void);
+void lease_flush(time_t now, int force);
+/**********************************************/
 void lease_update_dns(int force);
 void lease_init(time_t now);
 struct dhcp_lease *lease4_allocate(struct in_addr addr);
@@ -1721,12 +1765,18 @@ void ubus_event_bcast_connmark_allowlist_resolved(u32 mark, const char *pattern,
 #ifdef HAVE_IPSET
 void ipset_init(void);
 int add_to_ipset(const char *setname, const union all_addr *ipaddr, int flags, int remove);
+/******** Pi-hole modification ********/
+void ipset_flush(void);
+/**************************************/
 #endif
 
 /* nftset.c */
 #ifdef HAVE_NFTSET
 void nftset_init(void);
 int add_to_nftset(const char *setpath, const union all_addr *ipaddr, int flags, int remove);
+/******** Pi-hole modification ********/
+void nftset_flush(void);
+/**************************************/
 #endif
 
 /* pattern.c */
@@ -1882,6 +1932,13 @@ void poll_reset(void);
 int poll_check(int fd, short event);
 void poll_listen(int fd, short event);
 int do_poll(int timeout);
+/************ Pi-hole modification ************/
+int poll_close(int fd);
+/* Registrations of fds with epoll have to be removed before closing them */
+#if !defined(FTLDNS)
+#define close(fd) poll_close(fd)
+#endif
+/**********************************************/
 
 /* rrfilter.c */
 size_t rrfilter(struct dns_header *header, size_t *plen, int mode);
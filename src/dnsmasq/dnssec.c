@@ -16,6 +16,7 @@
 */
 
 #include "dnsmasq.h"
+#include "../dnsmasq_interface.h"
 
 #ifdef HAVE_DNSSEC
 
@@ -487,6 +488,7 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
       void *ctx;
       char *name_start;
       u32 nsigttl, ttl, orig_ttl;
+      unsigned long sig_ttl; /* Pi-hole modification */
 
       failflags &= ~DNSSEC_FAIL_NOSIG;
       
@@ -535,6 +537,14 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
       if (!key && !(crecp = cache_find_by_name(NULL, keyname, now, F_DNSKEY)))
 	return STAT_NEED_KEY;
 
+      /************ Pi-hole modification ************/
+      /* Verification results are cached at most until the records or
+	 the signature expire */
+      sig_ttl = orig_ttl < ttl ? orig_ttl : ttl;
+      if (time_check && difftime(sig_expiration, curtime) < sig_ttl)
+	sig_ttl = difftime(sig_expiration, curtime);
+      /**********************************************/
+
        if (ttl_out)
 	 {
 	   /* 4035 5.3.3 rules on TTLs */
@@ -671,7 +681,8 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
 	      if (dec_counter(validate_counter, NULL))
 		return STAT_ABANDONED;
 	     	      
-	      if (verify(key, keylen, sig, sig_len, digest, hash->digest_size, algo))
+	      /*** Pi-hole modification: cached verification ***/
+	      if (FTL_dnssec_verify(key, keylen, sig, sig_len, digest, hash->digest_size, algo, sig_ttl, now))
 		return STAT_SECURE;
 	    }
 	}
@@ -686,7 +697,8 @@ static int validate_rrset(time_t now, struct dns_header *header, size_t plen, in
 		if (dec_counter(validate_counter, NULL))
 		  return STAT_ABANDONED;
 		
-		if (verify(crecp->addr.key.keydata, crecp->addr.key.keylen, sig, sig_len, digest, hash->digest_size, algo))
+		/*** Pi-hole modification: cached verification ***/
+		if (FTL_dnssec_verify(crecp->addr.key.keydata, crecp->addr.key.keylen, sig, sig_len, digest, hash->digest_size, algo, sig_ttl, now))
 		  return (labels < name_labels) ? STAT_SECURE_WILDCARD : STAT_SECURE;
 		
 		/* An attacker can waste a lot of our CPU by setting up a giant DNSKEY RRSET full of failing
@@ -19,6 +19,10 @@
 static int order(char *qdomain, size_t qlen, struct server *serv);
 static int order_qsort(const void *a, const void *b);
 static int order_servers(struct server *s, struct server *s2);
+/************ Pi-hole modification ************/
+static void build_server_trie(void);
+static ssize_t lookup_trie(char *domain, ssize_t qlen, int *flags, int *nlow, int *nhigh);
+/**********************************************/
 
 /* If the server is USE_RESOLV or LITERAL_ADDRES, it lives on the local_domains chain. */
 #define SERV_IS_LOCAL (SERV_USE_RESOLV | SERV_LITERAL_ADDRESS)
@@ -86,8 +90,231 @@ void build_server_array(void)
   for (count = 0; count < daemon->serverarraysz; count++)
     if (!(daemon->serverarray[count]->flags & SERV_IS_LOCAL))
       daemon->serverarray[count]->arrayposn = count;
+
+  build_server_trie(); // Pi-hole modification
+}
+
+/************ Pi-hole modification ************/
+/* With thousands of domain-specific servers (conditional forwarding,
+   split-DNS, --address), the binary search in lookup_domain() compares
+   strings for every suffix of the query. The domains of the server array
+   are hence also stored in a trie of reversed labels: node 0 is the empty
+   domain, "example.com" is the node "example" below the node "com". The
+   edges are kept in an open-addressing hash table keyed by (parent, label),
+   so the longest matching suffix is found with one hash lookup per label of
+   the query, independent of the number of servers.
+
+   Wildcard servers like *example.com can match in the middle of a
+   label, when there are any, lookup_domain() uses the binary search. */
+struct trie_node {
+  const char *label; /* not terminated, points into the domain of a server */
+  int len, parent;
+  int first;         /* index in serverarray of this domain or -1 */
+};
+
+static struct trie_node *trie_nodes = NULL;
+static int *trie_hash = NULL; /* index of the node + 1, zero if empty */
+static int trie_nodes_hwm = 0, trie_hash_sz = 0, trie_count = 0;
+static int trie_valid = 0;
+
+static unsigned int trie_hash_label(int parent, const char *label, int len)
+{
+  unsigned int h = 2166136261u ^ (unsigned int)parent;
+  int i;
+
+  for (i = 0; i < len; i++)
+    {
+      unsigned int c = (unsigned char)label[i];
+      if (c >= 'A' && c <= 'Z')
+	c += 'a' - 'A';
+      h = (h ^ c) * 16777619u;
+    }
+
+  return h;
+}
+
+/* Compare labels like hostname_order() does */
+static int trie_label_isequal(const struct trie_node *node, const char *label, int len)
+{
+  int i;
+
+  if (node->len != len)
+    return 0;
+
+  for (i = 0; i < len; i++)
+    {
+      unsigned int c1 = (unsigned char)node->label[i], c2 = (unsigned char)label[i];
+      if (c1 >= 'A' && c1 <= 'Z')
+	c1 += 'a' - 'A';
+      if (c2 >= 'A' && c2 <= 'Z')
+	c2 += 'a' - 'A';
+      if (c1 != c2)
+	return 0;
+    }
+
+  return 1;
 }
 
+/* Returns the hash table slot of the label below parent, which is empty if
+   there is no such node */
+static int *trie_slot(int parent, const char *label, int len)
+{
+  unsigned int i = trie_hash_label(parent, label, len) & (trie_hash_sz - 1);
+
+  while (trie_hash[i] != 0)
+    {
+      const struct trie_node *node = &trie_nodes[trie_hash[i] - 1];
+      if (node->parent == parent && trie_label_isequal(node, label, len))
+	break;
+      i = (i + 1) & (trie_hash_sz - 1);
+    }
+
+  return &trie_hash[i];
+}
+
+static void build_server_trie(void)
+{
+  int count, nodes = 1, size;
+
+  trie_valid = 0;
+
+  if (daemon->server_has_wildcard || daemon->serverarraysz == 0)
+    return;
+
+  /* Upper bound of the number of nodes: one per label */
+  for (count = 0; count < daemon->serverarraysz; count++)
+    {
+      struct server *serv = daemon->serverarray[count];
+      char *cp;
+
+      if (serv->flags & SERV_FOR_NODOTS || serv->domain_len == 0)
+	continue;
+
+      for (nodes++, cp = serv->domain; *cp; cp++)
+	if (*cp == '.')
+	  nodes++;
+    }
+
+  /* Keep the hash table at most half full */
+  for (size = 16; size < 2 * nodes; size <<= 1);
+
+  if (nodes > trie_nodes_hwm)
+    {
+      struct trie_node *new;
+
+      nodes += 64; /* A few extra without re-allocating. */
+
+      if (!(new = whine_malloc(nodes * sizeof(struct trie_node))))
+	return;
+
+      free(trie_nodes);
+      trie_nodes = new;
+      trie_nodes_hwm = nodes;
+    }
+
+  if (size > trie_hash_sz)
+    {
+      int *new;
+
+      if (!(new = whine_malloc(size * sizeof(int))))
+	return;
+
+      free(trie_hash);
+      trie_hash = new;
+      trie_hash_sz = size;
+    }
+
+  memset(trie_hash, 0, trie_hash_sz * sizeof(int));
+  trie_nodes[0].label = NULL;
+  trie_nodes[0].len = 0;
+  trie_nodes[0].parent = -1;
+  trie_nodes[0].first = -1;
+  trie_count = 1;
+
+  for (count = 0; count < daemon->serverarraysz; count++)
+    {
+      struct server *serv = daemon->serverarray[count];
+      char *start, *end;
+      int node = 0;
+
+      /* Never found by order() in lookup_domain() */
+      if (serv->flags & SERV_FOR_NODOTS)
+	continue;
+
+      /* Insert the labels right to left */
+      for (end = serv->domain + serv->domain_len; serv->domain_len != 0; end = start - 1)
+	{
+	  int *slot;
+
+	  for (start = end; start > serv->domain && *(start-1) != '.'; start--);
+
+	  if (*(slot = trie_slot(node, start, end - start)) == 0)
+	    {
+	      struct trie_node *new = &trie_nodes[trie_count];
+	      new->label = start;
+	      new->len = end - start;
+	      new->parent = node;
+	      new->first = -1;
+	      *slot = ++trie_count;
+	    }
+	  node = *slot - 1;
+
+	  if (start == serv->domain)
+	    break;
+	}
+
+      /* The array is sorted, this is the first server of this domain */
+      if (trie_nodes[node].first == -1)
+	trie_nodes[node].first = count;
+    }
+
+  trie_valid = 1;
+}
+
+/* Equivalent of the binary search in lookup_domain() when there are no
+   wildcard servers. Like qlen there, returns -1 if nothing matched */
+static ssize_t lookup_trie(char *domain, ssize_t qlen, int *flags, int *nlow, int *nhigh)
+{
+  char *start, *end;
+  int node = 0, *slot;
+
+  /* Find the node of the longest suffix of the query */
+  for (end = domain + qlen; qlen != 0; end = start - 1)
+    {
+      for (start = end; start > domain && *(start-1) != '.'; start--);
+
+      if (*(slot = trie_slot(node, start, end - start)) == 0)
+	break;
+      node = *slot - 1;
+
+      if (start == domain)
+	break;
+    }
+
+  /* Try it and all shorter suffixes, i.e., its parents */
+  while (node != -1)
+    {
+      if (trie_nodes[node].first != -1 &&
+	  filter_servers(trie_nodes[node].first, *flags, nlow, nhigh))
+	{
+	  if (!(daemon->serverarray[*nlow]->flags & SERV_USE_RESOLV))
+	    return 0;
+
+	  /* We've matched a setting which says to use servers without a
+	     domain. Continue the search with empty query. */
+	  *flags |= F_SERVER;
+	  if (node == 0)
+	    break;
+	  node = 0;
+	}
+      else
+	node = trie_nodes[node].parent;
+    }
+
+  return -1;
+}
+/**********************************************/
+
 /* we're looking for the server whose domain is the longest exact match
    to the RH end of qdomain, or a local address if the flags match.
    Add '.' to the LHS of the query string so
@@ -123,6 +350,11 @@ int lookup_domain(char *domain, int flags, int *lowout, int *highout)
   if (qlen == 0 || flags & F_DNSSECOK)
     nodots = 0;
 
+  /************ Pi-hole modification ************/
+  if (trie_valid)
+    qlen = lookup_trie(domain, qlen, &flags, &nlow, &nhigh);
+  else
+  /**********************************************/
   /* Search shorter and shorter RHS substrings for a match */
   while (qlen >= 0)
     {
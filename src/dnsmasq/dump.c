@@ -15,6 +15,7 @@
 */
 
 #include "dnsmasq.h"
+#include "../dnsmasq_interface.h"
 
 #ifdef HAVE_DUMPFILE
 
@@ -138,6 +139,7 @@ static void do_dump_packet(int mask, void *packet, size_t len,
   void *iphdr;
   size_t ipsz;
   int rc;
+  struct iovec iov[4]; // Pi-hole modification
      
   /* if port != -1 it carries a port number 
      which we use as a source or destination when not otherwise
@@ -279,11 +281,24 @@ static void do_dump_packet(int mask, void *packet, size_t len,
   pcap_header.ts_sec = time.tv_sec;
   pcap_header.ts_usec = time.tv_usec;
   
+  /************ Pi-hole modification ************/
+  /* Hand the record to FTL's packet dump thread if it is enabled */
+  iov[0].iov_base = &pcap_header;
+  iov[0].iov_len = sizeof(pcap_header);
+  iov[1].iov_base = iphdr;
+  iov[1].iov_len = ipsz;
+  iov[2].iov_base = &udp;
+  iov[2].iov_len = proto == IPPROTO_UDP ? sizeof(udp) : 0;
+  iov[3].iov_base = packet;
+  iov[3].iov_len = len;
+  /**********************************************/
+  
   if (rc == -1 ||
-      !read_write(daemon->dumpfd, (void *)&pcap_header, sizeof(pcap_header), 0) ||
-      !read_write(daemon->dumpfd, iphdr, ipsz, 0) ||
-      (proto == IPPROTO_UDP && !read_write(daemon->dumpfd, (void *)&udp, sizeof(udp), 0)) ||
-      !read_write(daemon->dumpfd, (void *)packet, len, 0))
+      (!FTL_dump_packet(iov, 4) && // Pi-hole modification
+       (!read_write(daemon->dumpfd, (void *)&pcap_header, sizeof(pcap_header), 0) ||
+	!read_write(daemon->dumpfd, iphdr, ipsz, 0) ||
+	(proto == IPPROTO_UDP && !read_write(daemon->dumpfd, (void *)&udp, sizeof(udp), 0)) ||
+	!read_write(daemon->dumpfd, (void *)packet, len, 0))))
     my_syslog(LOG_ERR, _("failed to write packet dump"));
   else if (option_bool(OPT_EXTRALOG))
     my_syslog(LOG_INFO, _("%u dumping packet %u mask 0x%04x"),  daemon->log_display_id, ++packet_count, mask);
@@ -26,6 +26,7 @@ static struct frec *lookup_frec_dnssec(char *target, int class, int flags, struc
 
 static unsigned short get_id(void);
 static void free_frec(struct frec *f);
+static void set_sentto(struct frec *f, struct server *srv); // Pi-hole modification
 static void query_full(time_t now, char *domain);
 
 static void return_reply(time_t now, struct frec *forward, struct dns_header *header, ssize_t n, int status);
@@ -98,6 +99,12 @@ int send_from(int fd, int nowild, char *packet, size_t len,
 	}
     }
   
+  /************ Pi-hole modification ************/
+  // Replies may be queued to be sent in a batch
+  if (FTL_sendmsg_queue(fd, &msg))
+    return 1;
+  /**********************************************/
+
   while (retry_send(sendmsg(fd, &msg, 0)));
 
   if (errno != 0)
@@ -366,7 +373,7 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
 	      forward->forwardall = 1;
 	    }
 	  else
-	    start = master->last_server;
+	    start = FTL_select_server(first, last, master->last_server); // Pi-hole modification
 	}
     }
   else
@@ -562,7 +569,7 @@ static int forward_query(int udpfd, union mysockaddr *udpaddr,
 
 	      srv->queries++;
 	      forwarded = 1;
-	      forward->sentto = srv;
+	      set_sentto(forward, srv); // Pi-hole modification
 	      if (!forward->forwardall) 
 		break;
 	      forward->forwardall++;
@@ -842,6 +849,19 @@ static size_t process_reply(struct dns_header *header, time_t now, struct server
 	{
 	  int rc = extract_addresses(header, n, daemon->namebuff, now, ipsets, nftsets, is_sign, check_rebind, no_cache, cache_secure);
 
+	  /************ Pi-hole modification ************/
+	  /* Send the set updates of this reply, the sets have to be
+	     updated before the client receives the reply */
+#if defined(HAVE_IPSET) && defined(HAVE_LINUX_NETWORK)
+	  if (ipsets)
+	    ipset_flush();
+#endif
+#ifdef HAVE_NFTSET
+	  if (nftsets)
+	    nftset_flush();
+#endif
+	  /**********************************************/
+
 	  if (rc != 0)
 	    {
 	      header->ancount = htons(0);
@@ -850,6 +870,12 @@ static size_t process_reply(struct dns_header *header, time_t now, struct server
 	      cache_secure = 0;
 	    }
 	  
+	  /************ Pi-hole modification ************/
+	  /* Remember the NSEC/NSEC3 ranges of validated NXDOMAIN replies */
+	  if (rc == 0 && cache_secure && !no_cache)
+	    FTL_nsec_store(header, n, now);
+	  /**********************************************/
+
 	  if (rc == 1)
 	    {
 	      my_syslog(LOG_WARNING, _("possible DNS-rebind attack detected: %s"), daemon->namebuff);
@@ -1060,6 +1086,7 @@ static void dnssec_validate(struct frec *forward, struct dns_header *header,
 		  
 		  new->frec_src.log_id = daemon->log_display_id = ++daemon->log_id;
 		  new->sentto = server;
+		  server->inflight++; // Pi-hole modification
 		  new->rfds = rfds;
 		  new->frec_src.next = NULL;
 		  new->flags &= ~(FREC_DNSKEY_QUERY | FREC_DS_QUERY | FREC_HAS_EXTRADATA);
@@ -1319,7 +1346,7 @@ void reply_query(int fd, time_t now)
       my_syslog(LOG_WARNING, _("reducing DNS packet size for nameserver %s to %d"), daemon->addrbuff, SAFE_PKTSZ);
     }
 
-  forward->sentto = server;
+  set_sentto(forward, server); // Pi-hole modification
 
   /* We have a good answer, and will now validate it or return it. 
      It may be some time before this the validation completes, but we don't need
@@ -1602,8 +1629,11 @@ void receive_query(struct listener *listen, time_t now)
   msg.msg_iov = iov;
   msg.msg_iovlen = 1;
   
-  if ((n = recvmsg(listen->fd, &msg, 0)) == -1)
+  /************ Pi-hole modification ************/
+  // Datagrams may have been received in a batch
+  if ((n = FTL_recvmsg(listen->fd, &msg)) == -1)
     return;
+  /**********************************************/
   
   if (n < (int)sizeof(struct dns_header) || 
       (msg.msg_flags & MSG_TRUNC) ||
@@ -1945,6 +1975,9 @@ void receive_query(struct listener *listen, time_t now)
 	}
       /**********************************************/
       
+      /*** Pi-hole modification: answer names proven not to exist from the cache ***/
+      FTL_nsec_synthesize(header, (size_t)n, now);
+
       m = answer_request(header, ((char *) header) + udp_size, (size_t)n, 
 			 dst_addr_4, netmask, now, ad_reqd, do_bit, have_pseudoheader, &stale, &filtered);
       
@@ -1991,6 +2024,17 @@ void receive_query(struct listener *listen, time_t now)
 	     when it comes back. */
 	  fd = -1;
 	}
+      /************ Pi-hole modification ************/
+      else if (m >= 1 && FTL_prefetch_pending())
+	{
+	  /* The answer is about to expire, forward the query anyway to
+	     refresh it before. Use a new ID so FTL does not attribute this
+	     to the client. */
+	  m = 0;
+	  fd = -1;
+	  daemon->log_display_id = ++daemon->log_id;
+	}
+      /**********************************************/
       
       if (saved_question)
 	{
@@ -2034,6 +2078,9 @@ static ssize_t tcp_talk(int first, int last, int start, unsigned char *packet,
   while (1) 
     {
       int data_sent = 0, timedout = 0;
+      /************ Pi-hole modification ************/
+      int pooled = 0, fresh = 0;
+      /**********************************************/
       struct server *serv;
       
       if (firstsendto == -1)
@@ -2054,6 +2101,18 @@ static ssize_t tcp_talk(int first, int last, int start, unsigned char *packet,
     retry:
       *length = htons(qsize);
       
+      /************ Pi-hole modification ************/
+      // Use an idle connection to this server left by an earlier TCP
+      // worker. If the server has closed it meanwhile, we retry with a
+      // new connection below
+      if (serv->tcpfd == -1 && !pooled && !have_mark &&
+	  (serv->tcpfd = FTL_tcp_pool_get(serv)) != -1)
+	{
+	  pooled = 1;
+	  serv->flags |= SERV_GOT_TCP;
+	}
+      /**********************************************/
+
       if (serv->tcpfd == -1)
 	{
 	  if ((serv->tcpfd = socket(serv->addr.sa.sa_family, SOCK_STREAM, 0)) == -1)
@@ -2100,6 +2159,9 @@ static ssize_t tcp_talk(int first, int last, int start, unsigned char *packet,
 	  
 	  daemon->serverarray[first]->last_server = start;
 	  serv->flags &= ~SERV_GOT_TCP;
+	  /************ Pi-hole modification ************/
+	  fresh = 1;
+	  /**********************************************/
 	}
       
       if ((!data_sent && !read_write(serv->tcpfd, packet, qsize + sizeof(u16), 0)) ||
@@ -2127,6 +2189,10 @@ static ssize_t tcp_talk(int first, int last, int start, unsigned char *packet,
       
       serv->flags |= SERV_GOT_TCP;
       
+      /************ Pi-hole modification ************/
+      FTL_TCP_upstream_reply(&serv->addr, !fresh);
+      /**********************************************/
+
       *servp = serv;
       return rsize;
     }
@@ -2479,6 +2545,9 @@ unsigned char *tcp_request(int confd, time_t now,
 	       saved_question = blockdata_alloc((char *) header, (size_t)size);
 	       saved_size = size;
 	       
+	       /*** Pi-hole modification: answer names proven not to exist from the cache ***/
+	       FTL_nsec_synthesize(header, (size_t)size, now);
+
 	       /* m > 0 if answered from cache */
 	       m = answer_request(header, ((char *) header) + 65536, (size_t)size, 
 				  dst_addr_4, netmask, now, ad_reqd, do_bit, have_pseudoheader, &stale, &filtered);
@@ -2960,6 +3029,33 @@ void free_rfds(struct randfd_list **fdlp)
   *fdlp = NULL;
 }
 
+/************ Pi-hole modification ************/
+/* DNS workers are forked from the main process. The queries it forwarded
+   and their upstream sockets are none of their business */
+void forget_forwards(void)
+{
+  struct frec *f;
+
+  for (f = daemon->frec_list; f; f = f->next)
+    if (f->sentto)
+      free_frec(f);
+}
+/**********************************************/
+
+/************ Pi-hole modification ************/
+/* Every frec in use is counted as in flight at the server it was
+   last sent to, the count moves along when it is sent elsewhere */
+static void set_sentto(struct frec *f, struct server *srv)
+{
+  if (f->sentto == srv)
+    return;
+  if (f->sentto)
+    f->sentto->inflight--;
+  srv->inflight++;
+  f->sentto = srv;
+}
+/**********************************************/
+
 static void free_frec(struct frec *f)
 {
   struct frec_src *last;
@@ -2974,6 +3070,8 @@ static void free_frec(struct frec *f)
     
   f->frec_src.next = NULL;    
   free_rfds(&f->rfds);
+  if (f->sentto)
+    f->sentto->inflight--; // Pi-hole modification
   f->sentto = NULL;
   f->flags = 0;
 
@@ -27,6 +27,119 @@
 */
 
 #include "dnsmasq.h"
+/************ Pi-hole modification ************/
+#include "../dnsmasq_interface.h"
+
+/* SHA-256 is slow on CPUs without crypto extensions and reply matching
+   doesn't need a cryptographic hash, only one which cannot be predicted by
+   someone spoofing replies. With FAST_QUESTION_HASH, SipHash-2-4 keyed with
+   a random secret (chosen at startup) is used instead. Its 64 bit result is
+   stored in the first bytes of the digest, the rest is zero. */
+static int fast_hash = 0;
+static u64 sip_key[2];
+
+struct siphash {
+  u64 v0, v1, v2, v3;
+  u64 m;       /* pending bytes */
+  size_t len;  /* total number of bytes */
+};
+
+#define ROTL(x, b) (u64)(((x) << (b)) | ((x) >> (64 - (b))))
+
+static void sip_round(struct siphash *s)
+{
+  s->v0 += s->v1; s->v1 = ROTL(s->v1, 13); s->v1 ^= s->v0; s->v0 = ROTL(s->v0, 32);
+  s->v2 += s->v3; s->v3 = ROTL(s->v3, 16); s->v3 ^= s->v2;
+  s->v0 += s->v3; s->v3 = ROTL(s->v3, 21); s->v3 ^= s->v0;
+  s->v2 += s->v1; s->v1 = ROTL(s->v1, 17); s->v1 ^= s->v2; s->v2 = ROTL(s->v2, 32);
+}
+
+static void sip_compress(struct siphash *s, u64 m)
+{
+  s->v3 ^= m;
+  sip_round(s);
+  sip_round(s);
+  s->v0 ^= m;
+}
+
+static void sip_init(struct siphash *s)
+{
+  s->v0 = 0x736f6d6570736575ULL ^ sip_key[0];
+  s->v1 = 0x646f72616e646f6dULL ^ sip_key[1];
+  s->v2 = 0x6c7967656e657261ULL ^ sip_key[0];
+  s->v3 = 0x7465646279746573ULL ^ sip_key[1];
+  s->m = 0;
+  s->len = 0;
+}
+
+static void sip_update(struct siphash *s, const unsigned char *data, size_t len)
+{
+  for (; len != 0; len--, data++)
+    {
+      s->m |= (u64)*data << (8 * (s->len & 7));
+      if ((++s->len & 7) == 0)
+	{
+	  sip_compress(s, s->m);
+	  s->m = 0;
+	}
+    }
+}
+
+static u64 sip_final(struct siphash *s)
+{
+  sip_compress(s, s->m | ((u64)s->len << 56));
+  s->v2 ^= 0xff;
+  sip_round(s);
+  sip_round(s);
+  sip_round(s);
+  sip_round(s);
+  return s->v0 ^ s->v1 ^ s->v2 ^ s->v3;
+}
+
+static void fast_hash_init(void)
+{
+  if ((fast_hash = FTL_fast_question_hash()))
+    {
+      sip_key[0] = rand64();
+      sip_key[1] = rand64();
+    }
+}
+
+static unsigned char *fast_hash_questions(struct dns_header *header, size_t plen, char *name)
+{
+  int q;
+  unsigned char *p = (unsigned char *)(header+1);
+  static unsigned char digest[HASH_SIZE];
+  struct siphash s;
+  u64 h;
+
+  sip_init(&s);
+
+  for (q = ntohs(header->qdcount); q != 0; q--)
+    {
+      char *cp, c;
+
+      if (!extract_name(header, plen, &p, name, 1, 4))
+	return NULL; /* bad packet */
+
+      for (cp = name; (c = *cp); cp++)
+	 if (c >= 'A' && c <= 'Z')
+	   *cp += 'a' - 'A';
+
+      sip_update(&s, (unsigned char *)name, cp - name);
+      /* and the class and type as well */
+      sip_update(&s, p, 4);
+
+      p += 4;
+      if (!CHECK_LEN(header, p, plen, 0))
+	return NULL; /* bad packet */
+    }
+
+  h = sip_final(&s);
+  memcpy(digest, &h, sizeof(h));
+  return digest;
+}
+/**********************************************/
 
 #if defined(HAVE_DNSSEC) || defined(HAVE_CRYPTOHASH)
 
@@ -41,6 +154,8 @@ void hash_questions_init(void)
 
   ctx = safe_malloc(hash->context_size);
   digest = safe_malloc(hash->digest_size);
+
+  fast_hash_init(); // Pi-hole modification
 }
 
 unsigned char *hash_questions(struct dns_header *header, size_t plen, char *name)
@@ -48,6 +163,11 @@ unsigned char *hash_questions(struct dns_header *header, size_t plen, char *name
   int q;
   unsigned char *p = (unsigned char *)(header+1);
 
+  /************ Pi-hole modification ************/
+  if (fast_hash)
+    return fast_hash_questions(header, plen, name);
+  /**********************************************/
+
   hash->init(ctx);
 
   for (q = ntohs(header->qdcount); q != 0; q--) 
@@ -93,6 +213,7 @@ static void sha256_final(SHA256_CTX *ctx, BYTE hash[]);
 
 void hash_questions_init(void)
 {
+  fast_hash_init(); // Pi-hole modification
 }
 
 unsigned char *hash_questions(struct dns_header *header, size_t plen, char *name)
@@ -102,6 +223,11 @@ unsigned char *hash_questions(struct dns_header *header, size_t plen, char *name
   SHA256_CTX ctx;
   static BYTE digest[SHA256_BLOCK_SIZE];
   
+  /************ Pi-hole modification ************/
+  if (fast_hash)
+    return fast_hash_questions(header, plen, name);
+  /**********************************************/
+
   sha256_init(&ctx);
     
   for (q = ntohs(header->qdcount); q != 0; q--) 
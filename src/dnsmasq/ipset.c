@@ -73,6 +73,15 @@ static const struct sockaddr_nl snl = { .nl_family = AF_NETLINK };
 static int ipset_sock, old_kernel;
 static char *buffer;
 
+/************ Pi-hole modification ************/
+/* Set updates are not sent one by one. They are collected in buffer and sent
+   to the kernel in a single netlink datagram by ipset_flush(), which is called
+   once all addresses of a reply have been extracted (before the reply is sent
+   to the client) */
+#define BATCH_SZ 8192
+static size_t batch_len = 0;
+/**********************************************/
+
 static inline void add_attr(struct nlmsghdr *nlh, uint16_t type, size_t len, const void *data)
 {
   struct my_nlattr *attr = (void *)nlh + NL_ALIGN(nlh->nlmsg_len);
@@ -91,7 +100,7 @@ void ipset_init(void)
     return;
   
   if (!old_kernel && 
-      (buffer = safe_malloc(BUFF_SZ)) &&
+      (buffer = safe_malloc(BATCH_SZ)) && /* Pi-hole modification */
       (ipset_sock = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER)) != -1 &&
       (bind(ipset_sock, (struct sockaddr *)&snl, sizeof(snl)) != -1))
     return;
@@ -105,6 +114,7 @@ static int new_add_to_ipset(const char *setname, const union all_addr *ipaddr, i
   struct my_nfgenmsg *nfg;
   struct my_nlattr *nested[2];
   uint8_t proto;
+  char *msg;
   int addrsz = (af == AF_INET6) ? IN6ADDRSZ : INADDRSZ;
 
   if (strlen(setname) >= IPSET_MAXNAMELEN) 
@@ -113,14 +123,20 @@ static int new_add_to_ipset(const char *setname, const union all_addr *ipaddr, i
       return -1;
     }
   
-  memset(buffer, 0, BUFF_SZ);
+  /************ Pi-hole modification ************/
+  if (batch_len + BUFF_SZ > BATCH_SZ)
+    ipset_flush();
+  msg = buffer + batch_len;
+  /**********************************************/
+
+  memset(msg, 0, BUFF_SZ);
 
-  nlh = (struct nlmsghdr *)buffer;
+  nlh = (struct nlmsghdr *)msg;
   nlh->nlmsg_len = NL_ALIGN(sizeof(struct nlmsghdr));
   nlh->nlmsg_type = (remove ? IPSET_CMD_DEL : IPSET_CMD_ADD) | (NFNL_SUBSYS_IPSET << 8);
   nlh->nlmsg_flags = NLM_F_REQUEST;
   
-  nfg = (struct my_nfgenmsg *)(buffer + nlh->nlmsg_len);
+  nfg = (struct my_nfgenmsg *)(msg + nlh->nlmsg_len);
   nlh->nlmsg_len += NL_ALIGN(sizeof(struct my_nfgenmsg));
   nfg->nfgen_family = af;
   nfg->version = NFNETLINK_V0;
@@ -129,22 +145,37 @@ static int new_add_to_ipset(const char *setname, const union all_addr *ipaddr, i
   proto = IPSET_PROTOCOL;
   add_attr(nlh, IPSET_ATTR_PROTOCOL, sizeof(proto), &proto);
   add_attr(nlh, IPSET_ATTR_SETNAME, strlen(setname) + 1, setname);
-  nested[0] = (struct my_nlattr *)(buffer + NL_ALIGN(nlh->nlmsg_len));
+  nested[0] = (struct my_nlattr *)(msg + NL_ALIGN(nlh->nlmsg_len));
   nlh->nlmsg_len += NL_ALIGN(sizeof(struct my_nlattr));
   nested[0]->nla_type = NLA_F_NESTED | IPSET_ATTR_DATA;
-  nested[1] = (struct my_nlattr *)(buffer + NL_ALIGN(nlh->nlmsg_len));
+  nested[1] = (struct my_nlattr *)(msg + NL_ALIGN(nlh->nlmsg_len));
   nlh->nlmsg_len += NL_ALIGN(sizeof(struct my_nlattr));
   nested[1]->nla_type = NLA_F_NESTED | IPSET_ATTR_IP;
   add_attr(nlh, 
 	   (af == AF_INET ? IPSET_ATTR_IPADDR_IPV4 : IPSET_ATTR_IPADDR_IPV6) | NLA_F_NET_BYTEORDER,
 	   addrsz, ipaddr);
-  nested[1]->nla_len = (void *)buffer + NL_ALIGN(nlh->nlmsg_len) - (void *)nested[1];
-  nested[0]->nla_len = (void *)buffer + NL_ALIGN(nlh->nlmsg_len) - (void *)nested[0];
+  nested[1]->nla_len = (void *)msg + NL_ALIGN(nlh->nlmsg_len) - (void *)nested[1];
+  nested[0]->nla_len = (void *)msg + NL_ALIGN(nlh->nlmsg_len) - (void *)nested[0];
 	
-  while (retry_send(sendto(ipset_sock, buffer, nlh->nlmsg_len, 0,
+  /************ Pi-hole modification ************/
+  batch_len += NL_ALIGN(nlh->nlmsg_len);
+  return 0;
+}
+
+void ipset_flush(void)
+{
+  size_t len = batch_len;
+
+  if (len == 0)
+    return;
+
+  batch_len = 0;
+  while (retry_send(sendto(ipset_sock, buffer, len, 0,
 			   (struct sockaddr *)&snl, sizeof(snl))));
-								    
-  return errno == 0 ? 0 : -1;
+
+  if (errno != 0)
+    my_syslog(LOG_ERR, _("failed to update ipsets: %s"), strerror(errno));
+  /**********************************************/
 }
 
 
@@ -15,11 +15,144 @@
 */
 
 #include "dnsmasq.h"
+#include "../dnsmasq_interface.h"
 #ifdef HAVE_DHCP
 
 static struct dhcp_lease *leases = NULL, *old_leases = NULL;
 static int dns_dirty, file_dirty, leases_left;
 
+/************ Pi-hole modification ************/
+/* Finding a DHCPv4 lease by address, hardware address or client-id used to
+   walk the list of all leases. With thousands of leases, every DHCP packet
+   walked it several times. The leases are now additionally kept in three
+   hash indexes. Among several leases matching a lookup, the one allocated
+   most recently is returned as that one came first in the list, so the
+   results do not change. The indexes are updated whenever an indexed field
+   changes and when a lease is pruned. DHCPv6 leases are not indexed. */
+#define LEASE_HASH_MIN 64
+#define LEASE_HASH_MAX 65536
+
+static struct dhcp_lease **hash_addr = NULL, **hash_hwaddr = NULL, **hash_clid = NULL;
+static unsigned int hash_mask = 0, lease_serial = 0;
+
+static void lease_hash_init(void)
+{
+  unsigned int size = LEASE_HASH_MIN;
+
+  while (size < LEASE_HASH_MAX && size < (unsigned int)daemon->dhcp_max)
+    size <<= 1;
+
+  /* Without the indexes, the lookups walk the list of leases */
+  if (!(hash_addr = whine_malloc(3 * size * sizeof(struct dhcp_lease *))))
+    return;
+
+  memset(hash_addr, 0, 3 * size * sizeof(struct dhcp_lease *));
+  hash_hwaddr = &hash_addr[size];
+  hash_clid = &hash_addr[2 * size];
+  hash_mask = size - 1;
+}
+
+static unsigned int __attribute__((pure)) hash_bytes(const unsigned char *data, int len, unsigned int hash)
+{
+  /* FNV-1a */
+  while (len-- > 0)
+    hash = (hash ^ *data++) * 16777619u;
+
+  return hash;
+}
+
+static unsigned int __attribute__((const)) addr_bucket(struct in_addr addr)
+{
+  return ((unsigned int)addr.s_addr * 2654435769u) >> 16 & hash_mask;
+}
+
+static unsigned int __attribute__((pure)) hwaddr_bucket(const unsigned char *hwaddr, int hw_len, int hw_type)
+{
+  return hash_bytes(hwaddr, hw_len, 2166136261u ^ (unsigned int)hw_type) & hash_mask;
+}
+
+static unsigned int __attribute__((pure)) clid_bucket(const unsigned char *clid, int clid_len)
+{
+  return hash_bytes(clid, clid_len, 2166136261u) & hash_mask;
+}
+
+static int is_v4_lease(const struct dhcp_lease *lease)
+{
+#ifdef HAVE_DHCP6
+  if (lease->flags & (LEASE_TA | LEASE_NA))
+    return 0;
+#endif
+  (void)lease;
+  return 1;
+}
+
+static int has_hwaddr(const struct dhcp_lease *lease)
+{
+  return lease->hwaddr_len > 0 && lease->hwaddr_len <= DHCP_CHADDR_MAX;
+}
+
+static void hash_unlink(struct dhcp_lease **bucket, struct dhcp_lease *lease, size_t offset)
+{
+  struct dhcp_lease **up;
+
+  for (up = bucket; *up; up = (struct dhcp_lease **)((char *)*up + offset))
+    if (*up == lease)
+      {
+	*up = *(struct dhcp_lease **)((char *)lease + offset);
+	return;
+      }
+}
+
+/* Index the hardware address and the client-id of a lease */
+static void lease_index_client(struct dhcp_lease *lease)
+{
+  unsigned int b;
+
+  if (!hash_mask || !is_v4_lease(lease))
+    return;
+
+  if (has_hwaddr(lease))
+    {
+      b = hwaddr_bucket(lease->hwaddr, lease->hwaddr_len, lease->hwaddr_type);
+      lease->next_hwaddr = hash_hwaddr[b];
+      hash_hwaddr[b] = lease;
+    }
+
+  if (lease->clid && lease->clid_len > 0)
+    {
+      b = clid_bucket(lease->clid, lease->clid_len);
+      lease->next_clid = hash_clid[b];
+      hash_clid[b] = lease;
+    }
+}
+
+static void lease_unindex_client(struct dhcp_lease *lease)
+{
+  if (!hash_mask || !is_v4_lease(lease))
+    return;
+
+  if (has_hwaddr(lease))
+    hash_unlink(&hash_hwaddr[hwaddr_bucket(lease->hwaddr, lease->hwaddr_len, lease->hwaddr_type)],
+		lease, offsetof(struct dhcp_lease, next_hwaddr));
+
+  if (lease->clid && lease->clid_len > 0)
+    hash_unlink(&hash_clid[clid_bucket(lease->clid, lease->clid_len)],
+		lease, offsetof(struct dhcp_lease, next_clid));
+
+  lease->next_hwaddr = lease->next_clid = NULL;
+}
+
+static void lease_unindex(struct dhcp_lease *lease)
+{
+  if (!hash_mask || !is_v4_lease(lease))
+    return;
+
+  lease_unindex_client(lease);
+  hash_unlink(&hash_addr[addr_bucket(lease->addr)], lease, offsetof(struct dhcp_lease, next_addr));
+  lease->next_addr = NULL;
+}
+/**********************************************/
+
 static int read_leases(time_t now, FILE *leasestream)
 {
   unsigned long ei;
@@ -141,6 +274,10 @@ void lease_init(time_t now)
 
   leases_left = daemon->dhcp_max;
 
+  /************ Pi-hole modification ************/
+  lease_hash_init();
+  /**********************************************/
+
   if (option_bool(OPT_LEASE_RO))
     {
       /* run "<lease_change_script> init" once to get the
@@ -243,18 +380,135 @@ static void ourprintf(int *errp, char *format, ...)
   va_end(ap);
 }
 
+/************ Pi-hole modification ************/
+/* With LEASE_WRITE_DELAY, the lease file is written at most once per delay,
+   lease_flush() writes it when a deferred write is due. The leases are then
+   written to a temporary file which replaces the lease file atomically, so a
+   crash while writing cannot leave a truncated file behind. */
+static long long next_write = 0;
+static int write_pending = 0, write_forced = 0;
+
+static long long monotonic_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static const char *lease_tmp_name(void)
+{
+  static char *name = NULL;
+
+  if (!name && (name = whine_malloc(strlen(daemon->lease_file) + 5)))
+    sprintf(name, "%s.new", daemon->lease_file);
+
+  return name;
+}
+
+static int lease_write_deferred(void)
+{
+  if (FTL_lease_write_delay() == 0 || write_forced || monotonic_ms() >= next_write)
+    return 0;
+
+  write_pending = 1;
+  return 1;
+}
+
+/* Redirect ourprintf() to a temporary file, returns the stream of the lease
+   file or NULL if the lease file is rewritten in place */
+static FILE *lease_tmp_open(void)
+{
+  FILE *stream = daemon->lease_stream, *tmp;
+  const char *name;
+  int fd;
+
+  if (FTL_lease_write_delay() == 0 || !(name = lease_tmp_name()))
+    return NULL;
+
+  if ((fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+    return NULL;
+
+  if (!(tmp = fdopen(fd, "w+")))
+    {
+      close(fd);
+      unlink(name);
+      return NULL;
+    }
+
+  daemon->lease_stream = tmp;
+  return stream;
+}
+
+/* Replace the lease file by the temporary file if it has been written
+   completely, keeping the stream of whichever file is the lease file now */
+static int lease_tmp_close(FILE *stream, int err)
+{
+  if (!stream)
+    return err;
+
+  if (!err && rename(lease_tmp_name(), daemon->lease_file) != 0)
+    err = errno;
+
+  if (!err)
+    fclose(stream);
+  else
+    {
+      fclose(daemon->lease_stream);
+      unlink(lease_tmp_name());
+      daemon->lease_stream = stream;
+    }
+
+  return err;
+}
+
+/* Milliseconds until a deferred write of the lease file is due, -1 if none
+   is pending */
+int lease_flush_timeout(void)
+{
+  long long left;
+
+  if (!write_pending)
+    return -1;
+
+  left = next_write - monotonic_ms();
+  return left > 0 ? (int)left : 0;
+}
+
+/* Write the lease file if a deferred write is due, or anyway if forced */
+void lease_flush(time_t now, int force)
+{
+  if (!write_pending || (!force && lease_flush_timeout() > 0))
+    return;
+
+  write_forced = force;
+  lease_update_file(now);
+  write_forced = 0;
+}
+/**********************************************/
+
 void lease_update_file(time_t now)
 {
   struct dhcp_lease *lease;
   time_t next_event;
   int i, err = 0;
+  /************ Pi-hole modification ************/
+  FILE *stream = NULL;
 
+  if (file_dirty != 0 && daemon->lease_stream && lease_write_deferred())
+    ; /* written by lease_flush() */
+  else
+  /**********************************************/
   if (file_dirty != 0 && daemon->lease_stream)
     {
-      errno = 0;
-      rewind(daemon->lease_stream);
-      if (errno != 0 || ftruncate(fileno(daemon->lease_stream), 0) != 0)
-	err = errno;
+      /************ Pi-hole modification ************/
+      if (!(stream = lease_tmp_open()))
+      /**********************************************/
+	{
+	  errno = 0;
+	  rewind(daemon->lease_stream);
+	  if (errno != 0 || ftruncate(fileno(daemon->lease_stream), 0) != 0)
+	    err = errno;
+	}
       
       for (lease = leases; lease; lease = lease->next)
 	{
@@ -336,6 +590,12 @@ void lease_update_file(time_t now)
 	  fsync(fileno(daemon->lease_stream)) < 0)
 	err = errno;
       
+      /************ Pi-hole modification ************/
+      err = lease_tmp_close(stream, err);
+      write_pending = 0;
+      next_write = monotonic_ms() + (err ? LEASE_RETRY * 1000 : (long long)FTL_lease_write_delay());
+      /**********************************************/
+
       if (!err)
 	file_dirty = 0;
     }
@@ -562,6 +822,9 @@ void lease_prune(struct dhcp_lease *target, time_t now)
 	  daemon->metrics[lease->addr.s_addr ? METRIC_LEASES_PRUNED_4 : METRIC_LEASES_PRUNED_6]++;
 
  	  *up = lease->next; /* unlink */
+	  /************ Pi-hole modification ************/
+	  lease_unindex(lease);
+	  /**********************************************/
 	  
 	  /* Put on old_leases list 'till we
 	     can run the script */
@@ -581,6 +844,34 @@ struct dhcp_lease *lease_find_by_client(unsigned char *hwaddr, int hw_len, int h
 {
   struct dhcp_lease *lease;
 
+  /************ Pi-hole modification ************/
+  if (hash_mask)
+    {
+      struct dhcp_lease *found = NULL;
+
+      if (clid && clid_len > 0)
+	for (lease = hash_clid[clid_bucket(clid, clid_len)]; lease; lease = lease->next_clid)
+	  if (clid_len == lease->clid_len &&
+	      memcmp(clid, lease->clid, clid_len) == 0 &&
+	      (!found || lease->serial > found->serial))
+	    found = lease;
+
+      if (found)
+	return found;
+
+      if (hw_len > 0 && hw_len <= DHCP_CHADDR_MAX)
+	for (lease = hash_hwaddr[hwaddr_bucket(hwaddr, hw_len, hw_type)]; lease; lease = lease->next_hwaddr)
+	  if ((!lease->clid || !clid) &&
+	      lease->hwaddr_len == hw_len &&
+	      lease->hwaddr_type == hw_type &&
+	      memcmp(hwaddr, lease->hwaddr, hw_len) == 0 &&
+	      (!found || lease->serial > found->serial))
+	    found = lease;
+
+      return found;
+    }
+  /**********************************************/
+
   if (clid)
     for (lease = leases; lease; lease = lease->next)
       {
@@ -614,6 +905,20 @@ struct dhcp_lease *lease_find_by_addr(struct in_addr addr)
 {
   struct dhcp_lease *lease;
 
+  /************ Pi-hole modification ************/
+  if (hash_mask)
+    {
+      struct dhcp_lease *found = NULL;
+
+      for (lease = hash_addr[addr_bucket(addr)]; lease; lease = lease->next_addr)
+	if (lease->addr.s_addr == addr.s_addr &&
+	    (!found || lease->serial > found->serial))
+	  found = lease;
+
+      return found;
+    }
+  /**********************************************/
+
   for (lease = leases; lease; lease = lease->next)
     {
 #ifdef HAVE_DHCP6
@@ -768,6 +1073,9 @@ static struct dhcp_lease *lease_allocate(void)
   lease->length = 0xffffffff; /* illegal value */
 #endif
   lease->hwaddr_len = 256; /* illegal value */
+  /************ Pi-hole modification ************/
+  lease->serial = ++lease_serial;
+  /**********************************************/
   lease->next = leases;
   leases = lease;
   
@@ -784,6 +1092,14 @@ struct dhcp_lease *lease4_allocate(struct in_addr addr)
     {
       lease->addr = addr;
       daemon->metrics[METRIC_LEASES_ALLOCATED_4]++;
+      /************ Pi-hole modification ************/
+      if (hash_mask)
+	{
+	  unsigned int b = addr_bucket(addr);
+	  lease->next_addr = hash_addr[b];
+	  hash_addr[b] = lease;
+	}
+      /**********************************************/
     }
   
   return lease;
@@ -869,6 +1185,11 @@ void lease_set_hwaddr(struct dhcp_lease *lease, const unsigned char *hwaddr,
   (void)force;
   (void)now;
 
+  /************ Pi-hole modification ************/
+  /* Re-indexed below with the new hardware address and client-id */
+  lease_unindex_client(lease);
+  /**********************************************/
+
   if (hw_len != lease->hwaddr_len ||
       hw_type != lease->hwaddr_type || 
       (hw_len != 0 && memcmp(lease->hwaddr, hwaddr, hw_len) != 0))
@@ -895,7 +1216,12 @@ void lease_set_hwaddr(struct dhcp_lease *lease, const unsigned char *hwaddr,
 	  file_dirty = 1;
 	  free(lease->clid);
 	  if (!(lease->clid = whine_malloc(clid_len)))
-	    return;
+	    {
+	      /************ Pi-hole modification ************/
+	      lease_index_client(lease);
+	      /**********************************************/
+	      return;
+	    }
 #ifdef HAVE_DHCP6
 	  change = 1;
 #endif	   
@@ -913,6 +1239,10 @@ void lease_set_hwaddr(struct dhcp_lease *lease, const unsigned char *hwaddr,
       memcpy(lease->clid, clid, clid_len);
     }
   
+  /************ Pi-hole modification ************/
+  lease_index_client(lease);
+  /**********************************************/
+
 #ifdef HAVE_DHCP6
   if (change)
     slaac_add_addrs(lease, now, force);
@@ -723,6 +723,11 @@ static int release_listener(struct listener *l)
   if (l->tftpfd != -1)
     close(l->tftpfd);
 
+  /************ Pi-hole modification ************/
+  // DNS workers have to close their copies of the sockets
+  FTL_restart_dns_workers();
+  /**********************************************/
+
   free(l);
   return 1;
 }
@@ -905,6 +910,17 @@ static int make_sock(union mysockaddr *addr, int type, int dienow)
   int family = addr->sa.sa_family;
   int fd, rc, opt = 1;
   
+  /************ Pi-hole modification ************/
+  /* Reuse the socket handed over by the previous process, it is bound and
+     configured already */
+  if ((fd = FTL_handover_socket(addr, type)) != -1)
+    {
+      if (type == SOCK_STREAM || family == AF_INET || set_ipv6pktinfo(fd))
+	return fd;
+      goto err;
+    }
+  /**********************************************/
+
   if ((fd = socket(family, type, 0)) == -1)
     {
       int port, errsave;
@@ -1208,6 +1224,8 @@ void create_bound_listeners(int dienow)
 	    new->next = daemon->listeners;
 	    daemon->listeners = new;
 	    iface->done = 1;
+	    // Pi-hole modification: DNS workers have to listen here, too
+	    FTL_restart_dns_workers();
 
 	    /* Don't log the initial set of listen addresses created
                at startup, since this is happening before the logging
@@ -1242,6 +1260,8 @@ void create_bound_listeners(int dienow)
       {
 	new->next = daemon->listeners;
 	daemon->listeners = new;
+	// Pi-hole modification: DNS workers have to listen here, too
+	FTL_restart_dns_workers();
 
 	if (!dienow)
 	  {
@@ -1588,6 +1608,11 @@ void check_servers(int no_loop_check)
   int port = 0, count;
   int locals = 0;
   
+  /************ Pi-hole modification ************/
+  // DNS workers have to pick up the new servers
+  FTL_restart_dns_workers();
+  /**********************************************/
+
 #ifdef HAVE_LOOP
   if (!no_loop_check)
     loop_send_probes();
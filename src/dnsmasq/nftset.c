@@ -28,6 +28,57 @@ static struct nft_ctx *ctx = NULL;
 static const char *cmd_add = "add element %s { %s }";
 static const char *cmd_del = "delete element %s { %s }";
 
+/************ Pi-hole modification ************/
+/* Set updates are collected and run as a single nft transaction by
+   nftset_flush(), which is called once all addresses of a reply have been
+   extracted (before the reply is sent to the client). If the transaction
+   fails, the commands are run one by one to apply the valid ones and to log
+   the failing ones */
+static char *batch = NULL;
+static size_t batch_len = 0, batch_sz = 0;
+
+static int run_cmd(const char *what, const char *cmd)
+{
+  int ret = nft_run_cmd_from_buffer(ctx, cmd);
+  const char *err = nft_ctx_get_error_buffer(ctx);
+  char *err_str, *nl;
+
+  if (ret != 0 && what)
+    {
+      /* Log only first line of error return. */
+      if ((err_str = whine_malloc(strlen(err) + 1)))
+	{
+	  strcpy(err_str, err);
+	  if ((nl = strchr(err_str, '\n')))
+	    *nl = 0;
+	  my_syslog(LOG_ERR,  "nftset %s %s", what, err_str);
+	  free(err_str);
+	}
+    }
+
+  return ret;
+}
+
+void nftset_flush(void)
+{
+  char *cmd, *nl;
+
+  if (batch_len == 0)
+    return;
+
+  if (run_cmd(NULL, batch) != 0)
+    for (cmd = batch; *cmd; cmd = nl + 1)
+      {
+	nl = strchr(cmd, '\n');
+	*nl = 0;
+	run_cmd(cmd, cmd);
+      }
+
+  batch_len = 0;
+  *batch = 0;
+}
+/**********************************************/
+
 void nftset_init()
 {
   ctx = nft_ctx_new(NFT_CTX_DEFAULT);
@@ -41,10 +92,9 @@ void nftset_init()
 int add_to_nftset(const char *setname, const union all_addr *ipaddr, int flags, int remove)
 {
   const char *cmd = remove ? cmd_del : cmd_add;
-  int ret, af = (flags & F_IPV4) ? AF_INET : AF_INET6;
+  int af = (flags & F_IPV4) ? AF_INET : AF_INET6;
   size_t new_sz;
-  char *err_str, *new, *nl;
-  const char *err;
+  char *new;
   static char *cmd_buf = NULL;
   static size_t cmd_buf_sz = 0;
 
@@ -78,23 +128,29 @@ int add_to_nftset(const char *setname, const union all_addr *ipaddr, int flags,
       snprintf(cmd_buf, cmd_buf_sz, cmd, setname, daemon->addrbuff);
     }
 
-  ret = nft_run_cmd_from_buffer(ctx, cmd_buf);
-  err = nft_ctx_get_error_buffer(ctx);
-
-  if (ret != 0)
+  /************ Pi-hole modification ************/
+  new_sz = strlen(cmd_buf);
+  if (batch_len + new_sz + 2 > batch_sz)
     {
-      /* Log only first line of error return. */
-      if ((err_str = whine_malloc(strlen(err) + 1)))
+      if (batch_len != 0 && batch_len + new_sz + 2 > 16384)
+	nftset_flush();
+
+      if (batch_len + new_sz + 2 > batch_sz)
 	{
-	  strcpy(err_str, err);
-	  if ((nl = strchr(err_str, '\n')))
-	    *nl = 0;
-	  my_syslog(LOG_ERR,  "nftset %s %s", setname, err_str);
-	  free(err_str);
+	  if (!(new = whine_realloc(batch, batch_len + new_sz + 2 + 1024)))
+	    return run_cmd(setname, cmd_buf);
+	  batch = new;
+	  batch_sz = batch_len + new_sz + 2 + 1024;
 	}
     }
-  
-  return ret;
+
+  memcpy(batch + batch_len, cmd_buf, new_sz);
+  batch_len += new_sz;
+  batch[batch_len++] = '\n';
+  batch[batch_len] = 0;
+
+  return 0;
+  /**********************************************/
 }
 
 #endif
@@ -16,9 +16,21 @@
 
 #include "dnsmasq.h"
 
-/* Wrapper for poll(). Allocates and extends array of struct pollfds,
-   keeps them in fd order so that we can set and test conditions on
-   fd using a simple but efficient binary chop. */
+/************ Pi-hole modification ************/
+/* Wrapper for epoll() (falling back to poll()). The interface stays the
+   same as below, but the fds are registered with the kernel only once:
+   poll_listen() records the events of an fd for this round and do_poll()
+   passes only the changes since the previous round to epoll_ctl(). Waiting
+   is O(ready fds) instead of the kernel checking every fd on each wakeup.
+
+   Registrations of fds which have not been listened to in a round are
+   removed by do_poll(). dnsmasq's close() is redirected to poll_close()
+   (see dnsmasq.h) which removes the registration before closing: the
+   kernel only drops it itself once no process (e.g. a forked TCP child)
+   has the file open anymore. Should an fd be closed elsewhere and events
+   of the stale registration arrive, the epoll instance is recreated.
+   Forked children use an epoll instance of their own. */
+/**********************************************/
 
 /* poll_reset()
    poll_listen(fd, event)
@@ -39,80 +51,300 @@
     event is OR of POLLIN, POLLOUT, POLLERR, etc
 */
 
-static struct pollfd *pollfds = NULL;
-static nfds_t nfds, arrsize = 0;
+/************ Pi-hole modification ************/
+#undef close
+#ifdef HAVE_LINUX_NETWORK
+#  include <sys/epoll.h>
+#  include <pthread.h>
+#endif
+
+/* State of an fd, indexed by fd */
+struct poll_fd {
+  unsigned long long listened; /* round the fd was listened to in last */
+  unsigned long long ready;    /* round the fd was returned by do_poll() in */
+  unsigned int gen;            /* generation of the epoll registration */
+  short events, revents;
+  short registered;            /* events registered with epoll, 0 if none */
+  char always;                 /* regular file, epoll does not support them */
+};
+
+static struct poll_fd *fds = NULL;
+static int fdsize = 0;
+static unsigned long long poll_round = 1;
+
+/* fds listened to in this round and fds registered with epoll */
+static int *listened = NULL, *registered = NULL;
+static int nlistened = 0, nregistered = 0, arrsize = 0;
+
+/* Buffer for the results of epoll_wait() or poll() */
+static void *results = NULL;
+static int resultsize = 0;
+
+#ifdef HAVE_LINUX_NETWORK
+static int epfd = -1;
+static int epoll_failed = 0, rebuild = 0;
+
+/* Forget the epoll instance, e.g. the one of the parent in a forked child */
+static void poll_forked(void)
+{
+  int i;
+
+  if (epfd != -1)
+    close(epfd);
+  epfd = -1;
+
+  for (i = 0; i < nregistered; i++)
+    fds[registered[i]].registered = 0;
+  nregistered = 0;
+}
+
+static int poll_open(void)
+{
+  static int atfork = 0;
+
+  if (!atfork)
+    {
+      pthread_atfork(NULL, NULL, poll_forked);
+      atfork = 1;
+    }
+
+  if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    {
+      my_syslog(LOG_WARNING, _("cannot create epoll instance, falling back to poll(): %s"), strerror(errno));
+      epoll_failed = 1;
+    }
+
+  return epfd != -1;
+}
+
+/* Pass the events listened to in this round to epoll */
+static void poll_register(int fd)
+{
+  struct poll_fd *p = &fds[fd];
+  struct epoll_event ev;
+  int ret;
+
+  if (!p->registered)
+    p->gen++;
+  ev.events = (unsigned short)p->events;
+  ev.data.u64 = (unsigned int)fd | ((unsigned long long)p->gen << 32);
+
+  ret = epoll_ctl(epfd, p->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev);
+
+  /* Our view of the registration was out of date */
+  if (ret == -1 && (errno == EEXIST || errno == ENOENT))
+    ret = epoll_ctl(epfd, errno == EEXIST ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev);
+
+  if (ret == -1)
+    {
+      /* Regular files are always ready, like with poll() */
+      p->always = (errno == EPERM);
+      p->registered = 0;
+      return;
+    }
+
+  p->registered = p->events;
+}
+
+/* Start over with a new epoll instance, this drops stale registrations */
+static void poll_rebuild(void)
+{
+  poll_forked();
+  rebuild = 0;
+}
+
+static int poll_epoll(int timeout)
+{
+  struct epoll_event one, *events = results ? results : &one;
+  int i, n, hits = 0;
+
+  /* Remove the fds nobody is listening to anymore */
+  for (i = 0; i < nregistered; i++)
+    {
+      struct poll_fd *p = &fds[registered[i]];
+      if (p->registered && p->listened != poll_round)
+	{
+	  epoll_ctl(epfd, EPOLL_CTL_DEL, registered[i], NULL);
+	  p->registered = 0;
+	}
+    }
+
+  nregistered = 0;
+  for (i = 0; i < nlistened; i++)
+    {
+      int fd = listened[i];
+      struct poll_fd *p = &fds[fd];
+
+      if (!p->always && p->registered != p->events)
+	poll_register(fd);
+
+      if (p->registered)
+	registered[nregistered++] = fd;
+      else if (p->always)
+	timeout = 0;
+    }
+
+  if ((n = epoll_wait(epfd, events, results ? resultsize : 1, timeout)) < 0)
+    return n;
+
+  for (i = 0; i < n; i++)
+    {
+      int fd = (int)(events[i].data.u64 & 0xffffffff);
+      struct poll_fd *p = fd < fdsize ? &fds[fd] : NULL;
+
+      /* Event of an fd closed without poll_close() */
+      if (!p || !p->registered || p->gen != (unsigned int)(events[i].data.u64 >> 32))
+	{
+	  rebuild = 1;
+	  continue;
+	}
+
+      p->revents = (short)events[i].events;
+      p->ready = poll_round;
+      hits++;
+    }
 
-/* Binary search. Returns either the pollfd with fd, or
-   if the fd doesn't match, or return equals nfds, the entry
-   to the left of which a new record should be inserted. */
-static nfds_t fd_search(int fd)
+  for (i = 0; i < nlistened; i++)
+    {
+      struct poll_fd *p = &fds[listened[i]];
+      if (p->always)
+	{
+	  p->revents = p->events & (POLLIN | POLLOUT);
+	  p->ready = poll_round;
+	  hits++;
+	}
+    }
+
+  return hits;
+}
+#endif
+
+static int poll_poll(int timeout)
 {
-  nfds_t left, right, mid;
-  
-  if ((right = nfds) == 0)
-    return 0;
-  
-  left = 0;
-  
-  while (1)
+  struct pollfd *pollfds = results;
+  int i, n, hits = 0;
+
+  for (i = 0; i < nlistened; i++)
     {
-      if (right == left + 1)
-	return (pollfds[left].fd >= fd) ? left : right;
-      
-      mid = (left + right)/2;
-      
-      if (pollfds[mid].fd > fd)
-	right = mid;
-      else 
-	left = mid;
+      pollfds[i].fd = listened[i];
+      pollfds[i].events = fds[listened[i]].events;
+      pollfds[i].revents = 0;
     }
+
+  if ((n = poll(pollfds, nlistened, timeout)) <= 0)
+    return n;
+
+  for (i = 0; i < nlistened; i++)
+    if (pollfds[i].revents)
+      {
+	fds[pollfds[i].fd].revents = pollfds[i].revents;
+	fds[pollfds[i].fd].ready = poll_round;
+	hits++;
+      }
+
+  return hits;
 }
 
 void poll_reset(void)
 {
-  nfds = 0;
+  poll_round++;
+  nlistened = 0;
 }
 
 int do_poll(int timeout)
 {
-  return poll(pollfds, nfds, timeout);
+#ifdef HAVE_LINUX_NETWORK
+  if (rebuild)
+    poll_rebuild();
+
+  if (!epoll_failed && (epfd != -1 || poll_open()))
+    return poll_epoll(timeout);
+#endif
+
+  return poll_poll(timeout);
 }
 
 int poll_check(int fd, short event)
 {
-  nfds_t i = fd_search(fd);
-  
-  if (i < nfds && pollfds[i].fd == fd)
-    return pollfds[i].revents & event;
+  if (fd >= 0 && fd < fdsize && fds[fd].ready == poll_round)
+    return fds[fd].revents & event;
 
   return 0;
 }
 
 void poll_listen(int fd, short event)
 {
-   nfds_t i = fd_search(fd);
-  
-   if (i < nfds && pollfds[i].fd == fd)
-     pollfds[i].events |= event;
-   else
-     {
-       if (arrsize == nfds)
-	 {
-	   /* Array too small, extend. */
-	   struct pollfd *new;
-
-	   arrsize = (arrsize == 0) ? 64 : arrsize * 2;
-
-	   if (!(new = whine_realloc(pollfds, arrsize * sizeof(struct pollfd))))
-	     return;
-
-	   pollfds = new;
-	 }
-
-       memmove(&pollfds[i+1], &pollfds[i], (nfds - i) * sizeof(struct pollfd));
-
-       pollfds[i].fd = fd;
-       pollfds[i].events = event;
-       nfds++;
-     }
+  struct poll_fd *p;
+
+  if (fd < 0)
+    return;
+
+  if (fd >= fdsize)
+    {
+      /* Table too small, extend. */
+      int newsize = fdsize == 0 ? 64 : fdsize;
+      struct poll_fd *new;
+
+      while (newsize <= fd)
+	newsize *= 2;
+
+      if (!(new = whine_realloc(fds, newsize * sizeof(struct poll_fd))))
+	return;
+
+      memset(&new[fdsize], 0, (newsize - fdsize) * sizeof(struct poll_fd));
+      fds = new;
+      fdsize = newsize;
+    }
+
+  p = &fds[fd];
+  if (p->listened != poll_round)
+    {
+      if (nlistened == arrsize)
+	{
+	  /* Arrays too small, extend. */
+	  int newsize = (arrsize == 0) ? 64 : arrsize * 2;
+#ifdef HAVE_LINUX_NETWORK
+	  size_t resultlen = sizeof(struct epoll_event) > sizeof(struct pollfd) ?
+	    sizeof(struct epoll_event) : sizeof(struct pollfd);
+#else
+	  size_t resultlen = sizeof(struct pollfd);
+#endif
+	  int *newl, *newr;
+	  void *newres;
+
+	  if (!(newl = whine_realloc(listened, newsize * sizeof(int))))
+	    return;
+	  listened = newl;
+	  if (!(newr = whine_realloc(registered, newsize * sizeof(int))))
+	    return;
+	  registered = newr;
+	  if (!(newres = whine_realloc(results, newsize * resultlen)))
+	    return;
+	  results = newres;
+	  arrsize = resultsize = newsize;
+	}
+
+      p->listened = poll_round;
+      p->events = 0;
+      listened[nlistened++] = fd;
+    }
+
+  p->events |= event;
+}
+
+/* Remove the registration of an fd before closing it */
+int poll_close(int fd)
+{
+#ifdef HAVE_LINUX_NETWORK
+  if (fd >= 0 && fd < fdsize)
+    {
+      if (fds[fd].registered && epfd != -1)
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+      fds[fd].registered = 0;
+      fds[fd].always = 0;
+    }
+#endif
+
+  return close(fd);
 }
+/**********************************************/
@@ -85,8 +85,22 @@ int extract_name(struct dns_header *header, size_t plen, unsigned char **pp,
 	    return 0;
 	  if (!CHECK_LEN(header, p, plen, l))
 	    return 0;
-	  
-	  for(j=0; j<l; j++, p++)
+
+	  /************ Pi-hole modification ************/
+	  /* Copy the characters which need no escaping at once,
+	     usually this is the whole label */
+	  j = 0;
+	  if (isExtract)
+	    {
+	      while (j < l && p[j] != 0 && p[j] != '.' && p[j] != NAME_ESCAPE)
+		j++;
+	      memcpy(cp, p, j);
+	      cp += j;
+	      p += j;
+	    }
+	  /**********************************************/
+
+	  for(; j<l; j++, p++)
 	    if (isExtract)
 	      {
 		unsigned char c = *p;
@@ -793,6 +807,11 @@ int extract_addresses(struct dns_header *header, size_t qlen, char *name, time_t
       else
 	insert = 0; /* NOTE: do not cache data from CNAME queries. */
       
+      // ****************************** Pi-hole modification ******************************
+      // Check all domains along the CNAME path of this reply at once
+      FTL_CNAME_chain(header, qlen, daemon->log_display_id);
+      // **********************************************************************************
+
     cname_loop1:
       if (!(p1 = skip_questions(header, qlen)))
 	return 2;
@@ -1004,18 +1023,29 @@ int extract_addresses(struct dns_header *header, size_t qlen, char *name, time_t
 			return 1;
 		    }
 		  
+		  /************ Pi-hole modification ************/
+		  /* Addresses added to a set recently are not added again */
 #ifdef HAVE_IPSET
 		  if (ipsets && (flags & (F_IPV4 | F_IPV6)))
 		    for (ipsets_cur = ipsets->sets; *ipsets_cur; ipsets_cur++)
-		      if (add_to_ipset(*ipsets_cur, &addr, flags, 0) == 0)
-			log_query((flags & (F_IPV4 | F_IPV6)) | F_IPSET, ipsets->domain, &addr, *ipsets_cur, 1);
+		      if (!FTL_set_recently_added(*ipsets_cur, false, &addr, flags, now) &&
+			  add_to_ipset(*ipsets_cur, &addr, flags, 0) == 0)
+			{
+			  FTL_set_added(*ipsets_cur, false, &addr, flags, attl, now);
+			  log_query((flags & (F_IPV4 | F_IPV6)) | F_IPSET, ipsets->domain, &addr, *ipsets_cur, 1);
+			}
 #endif
 #ifdef HAVE_NFTSET
 		  if (nftsets && (flags & (F_IPV4 | F_IPV6)))
 		    for (nftsets_cur = nftsets->sets; *nftsets_cur; nftsets_cur++)
-		      if (add_to_nftset(*nftsets_cur, &addr, flags, 0) == 0)
-			log_query((flags & (F_IPV4 | F_IPV6)) | F_IPSET, nftsets->domain, &addr, *nftsets_cur, 0);
+		      if (!FTL_set_recently_added(*nftsets_cur, true, &addr, flags, now) &&
+			  add_to_nftset(*nftsets_cur, &addr, flags, 0) == 0)
+			{
+			  FTL_set_added(*nftsets_cur, true, &addr, flags, attl, now);
+			  log_query((flags & (F_IPV4 | F_IPV6)) | F_IPSET, nftsets->domain, &addr, *nftsets_cur, 0);
+			}
 #endif
+		  /**********************************************/
 		}
 	      
 	      if (insert)
@@ -1995,6 +2025,10 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 			
 			stale_flag = F_STALE;
 		      }
+		    /************ Pi-hole modification ************/
+		    else if (stale && !(crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG | F_IMMORTAL)))
+		      FTL_prefetch_check((long)difftime(crecp->ttd, now));
+		    /**********************************************/
 		    
 		    /* don't answer wildcard queries with data not from /etc/hosts
 		       or DHCP leases */
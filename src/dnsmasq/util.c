@@ -19,6 +19,7 @@
 
 
 #include "dnsmasq.h"
+#include "../dnsmasq_interface.h"
 
 #ifdef HAVE_BROKEN_RTC
 #include <sys/times.h>
@@ -288,7 +289,19 @@ unsigned char *do_rfc1035_name(unsigned char *p, char *sval, char *limit)
       if (limit && p > (unsigned char*)limit)
         return NULL;
 
-      for (j = 0; *sval && (*sval != '.'); sval++, j++)
+      /************ Pi-hole modification ************/
+      /* Copy the characters up to the end of the label or the
+	 first escape at once */
+      const char stop[] = { '.', NAME_ESCAPE, 0 };
+      j = strcspn(sval, stop);
+      if (limit && p + j > (unsigned char*)limit)
+	return NULL;
+      memcpy(p, sval, j);
+      p += j;
+      sval += j;
+      /**********************************************/
+
+      for (; *sval && (*sval != '.'); sval++, j++)
 	{
           if (limit && p + 1 > (unsigned char*)limit)
             return NULL;
@@ -814,6 +827,12 @@ void close_fds(long max_fd, int spare1, int spare2, int spare3)
 	      fd == STDOUT_FILENO || fd == STDERR_FILENO || fd == STDIN_FILENO ||
 	      fd == spare1 || fd == spare2 || fd == spare3)
 	    continue;
+
+	  /************ Pi-hole modification ************/
+	  // Keep the sockets handed over by the previous FTL process
+	  if (FTL_handover_inherited(fd))
+	    continue;
+	  /**********************************************/
 	  
 	  close(fd);
 	}
@@ -826,7 +845,8 @@ void close_fds(long max_fd, int spare1, int spare2, int spare3)
   /* fallback, dumb code. */
   for (max_fd--; max_fd >= 0; max_fd--)
     if (max_fd != STDOUT_FILENO && max_fd != STDERR_FILENO && max_fd != STDIN_FILENO &&
-	max_fd != spare1 && max_fd != spare2 && max_fd != spare3)
+	max_fd != spare1 && max_fd != spare2 && max_fd != spare3 &&
+	!FTL_handover_inherited(max_fd)) // Pi-hole modification
       close(max_fd);
 }
 
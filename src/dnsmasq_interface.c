@@ -46,18 +46,62 @@
 #include <stddef.h>
 // get_edestr()
 #include "api/api_helper.h"
-// logg_rate_limit_message()
-#include "database/message-table.h"
+// rate_limit_query(), rate_limit_prefix()
+#include "ratelimit.h"
 // type struct sqlite3_stmt_vec
 #include "vector.h"
 // check_one_struct()
 #include "struct_size.h"
+// update_domain_leaderboards()
+#include "leaderboard.h"
+// heavy_hitters_add()
+#include "heavyhitters.h"
+// cardinality_add()
+#include "cardinality.h"
+// stream_push()
+#include "api/stream.h"
+// statsqueue_push()
+#include "statsqueue.h"
+// FTL_udp_batch_forked()
+#include "udpbatch.h"
+// dns_worker_query_id()
+#include "workers.h"
+// timeseries_update()
+#include "timeseries.h"
+// init_pktdump(), pktdump_trigger()
+#include "pktdump.h"
+// init_querylog()
+#include "querylog.h"
+// init_dnstap()
+#include "dnstap.h"
+// init_federation()
+#include "federation.h"
+// init_gravity_replica()
+#include "database/gravity-replica.h"
+// debug_enabled()
+#include "debuglimit.h"
+// lua_policy_check()
+#include "lua/policy.h"
+// special_name_lookup()
+#include "specialdomains.h"
+// tcp_pool_init()
+#include "tcppool.h"
+// thread_sched_apply()
+#include "threadsched.h"
+// handover_listen()
+#include "handover.h"
+// upstream_probe_state()
+#include "upstream_probe.h"
+// FTL_PROBE()
+#include "probes.h"
+// FTL_warm_verdict()
+#include "warmup.h"
 
 // Private prototypes
 static void print_flags(const unsigned int flags);
-#define query_set_reply(flags, type, addr, query, response) _query_set_reply(flags, type, addr, query, response, __FILE__, __LINE__)
+#define query_set_reply(flags, type, addr, query, response, force_reply) _query_set_reply(flags, type, addr, query, response, force_reply, __FILE__, __LINE__)
 static void _query_set_reply(const unsigned int flags, const enum reply_type reply, const union all_addr *addr, queriesData* query,
-                             const struct timeval response, const char *file, const int line);
+                             const struct timeval response, const enum reply_type force_reply, const char *file, const int line);
 #define FTL_check_blocking(queryID, domainID, clientID) _FTL_check_blocking(queryID, domainID, clientID, __FILE__, __LINE__)
 static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const char* file, const int line);
 static unsigned long converttimeval(const struct timeval time) __attribute__((const));
@@ -67,6 +111,14 @@ static void FTL_forwarded(const unsigned int flags, const char *name, const unio
 static void FTL_reply(const unsigned int flags, const char *name, const union all_addr *addr, const char* arg, const int id, const char* file, const int line);
 static void FTL_upstream_error(const union all_addr *addr, const unsigned int flags, const int id, const char* file, const int line);
 static void FTL_dnssec(const char *result, const union all_addr *addr, const int id, const char* file, const int line);
+static void FTL_mark_externally_blocked(const int id, const char* file, const int line);
+static void capture_state(struct hook_record *record, const union all_addr *addr);
+static void dispatch_hook(struct hook_record *record, const char *name, const char *arg, const char *file, const int line);
+static void apply_forwarded(const struct hook_record *record, const char *name, const char *file, const int line);
+static void apply_reply(const struct hook_record *record, const char *name, const char *arg, const char *file, const int line);
+static void apply_upstream_error(const struct hook_record *record, const char *file, const int line);
+static void apply_dnssec(const struct hook_record *record, const char *arg, const char *file, const int line);
+static void apply_externally_blocked(const struct hook_record *record, const char *file, const int line);
 static void mysockaddr_extract_ip_port(union mysockaddr *server, char ip[ADDRSTRLEN+1], in_port_t *port);
 static void alladdr_extract_ip(union all_addr *addr, const sa_family_t family, char ip[ADDRSTRLEN+1]);
 static void check_pihole_PTR(char *domain);
@@ -79,6 +131,9 @@ static const char *check_dnsmasq_name(const char *name);
 static bool adbit = false;
 static const char *blockingreason = "";
 static enum reply_type force_next_DNS_reply = REPLY_UNKNOWN;
+// Monotonic time of the event applied right now, deferred events are applied
+// after they happened (see statsqueue.c)
+static uint32_t event_ts = 0u;
 static int last_regex_idx = -1;
 static struct ptr_record *pihole_ptr = NULL;
 #define HOSTNAME "Pi-hole hostname"
@@ -177,6 +232,103 @@ void FTL_hook(unsigned int flags, const char *name, union all_addr *addr, char *
 		FTL_reply(flags, name, addr, arg, id, path, line);
 }
 
+// Wire format of the answer records of blocked queries up to the address: a
+// compression pointer to the (first) question, type, class, TTL and RDLENGTH.
+// They are prepared once per type and TTL so adding an answer to a blocked
+// query only copies the template and the address
+#define ANSWER_HEADER_LEN 12
+static struct answer_template {
+	unsigned long ttl;
+	bool valid;
+	unsigned char data[ANSWER_HEADER_LEN];
+} answer_templates[2][2] = {{{ 0 }}};
+
+static const unsigned char *get_answer_template(const unsigned short type, const unsigned long ttl, const bool hostname)
+{
+	const size_t addrlen = type == T_A ? INADDRSZ : IN6ADDRSZ;
+	struct answer_template *tpl = &answer_templates[type == T_A ? 0 : 1][hostname ? 1 : 0];
+
+	// (Re-)build template if the TTL has changed (e.g. after reloading the
+	// config)
+	if(!tpl->valid || tpl->ttl != ttl)
+	{
+		unsigned char *p = tpl->data;
+		PUTSHORT(sizeof(struct dns_header) | 0xc000, p);
+		PUTSHORT(type, p);
+		PUTSHORT(C_IN, p);
+		PUTLONG(ttl, p);
+		PUTSHORT(addrlen, p);
+		tpl->ttl = ttl;
+		tpl->valid = true;
+	}
+
+	return tpl->data;
+}
+
+// Add an A or AAAA answer record for a blocked query. This is equivalent to
+// add_resource_record() with the question name
+static bool add_blocked_answer(struct dns_header *header, char *limit, int *truncp, unsigned char **pp,
+                               const unsigned short type, const unsigned long ttl, const bool hostname,
+                               const void *addr)
+{
+	const size_t addrlen = type == T_A ? INADDRSZ : IN6ADDRSZ;
+	if(*truncp || (limit && *pp + ANSWER_HEADER_LEN + addrlen > (unsigned char*)limit))
+	{
+		*truncp = 1;
+		return false;
+	}
+
+	memcpy(*pp, get_answer_template(type, ttl, hostname), ANSWER_HEADER_LEN);
+	memcpy(*pp + ANSWER_HEADER_LEN, addr, addrlen);
+	*pp += ANSWER_HEADER_LEN + addrlen;
+	header->ancount = htons(ntohs(header->ancount) + 1);
+
+	return true;
+}
+
+// The name of the last question extracted by the hooks below. A packet is
+// looked at by several of them (FTL_make_answer(), FTL_extract_question_flags()
+// and FTL_CNAME_chain() for replies), they reuse the name instead of extracting
+// it again as long as the question in the packet is the same. Only names
+// without compression pointers are cached, their wire form is all they depend on
+static struct {
+	size_t wirelen;
+	unsigned char wire[MAXDNAME];
+	char name[MAXDNAME];
+} last_question = { 0 };
+
+// Extract the name of the first question like extract_name(header, len, p,
+// name, 1, 4) does
+static bool extract_question_name(struct dns_header *header, const size_t len, unsigned char **p, char name[MAXDNAME])
+{
+	unsigned char *wire = (unsigned char *)(header+1);
+	const size_t wirelen = last_question.wirelen;
+	if(wirelen > 0 && sizeof(struct dns_header) + wirelen + 4 <= len &&
+	   memcmp(wire, last_question.wire, wirelen) == 0)
+	{
+		memcpy(name, last_question.name, strlen(last_question.name) + 1);
+		*p = wire + wirelen;
+		return true;
+	}
+
+	*p = wire;
+	if(!extract_name(header, len, p, name, 1, 4))
+		return false;
+
+	// Check that the name consists of labels only
+	last_question.wirelen = 0;
+	unsigned char *label = wire;
+	while(*label != 0 && (*label & 0xc0) == 0)
+		label += *label + 1;
+	if(label + 1 != *p || (size_t)(*p - wire) > sizeof(last_question.wire))
+		return true;
+
+	last_question.wirelen = *p - wire;
+	memcpy(last_question.wire, wire, last_question.wirelen);
+	memcpy(last_question.name, name, strlen(name) + 1);
+	return true;
+}
+
 // This is inspired by make_local_answer()
 size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len, int *ede, const char *file, const int line)
 {
@@ -188,8 +340,8 @@ size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len
 
 	// Get question name
 	char name[MAXDNAME] = { 0 };
-	unsigned char *p = (unsigned char *)(header+1);
-	if (!extract_name(header, len, &p, name, 1, 4))
+	unsigned char *p = NULL;
+	if(!extract_question_name(header, len, &p, name))
 		return 0;
 
 	// Debug logging
@@ -205,6 +357,10 @@ size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len
 	int qtype, flags = 0;
 	GETSHORT(qtype, p);
 
+	// End of the question (extract_name() checked that type and class are
+	// available)
+	unsigned char *qend = p + 2;
+
 	// Set flags based on what we will reply with
 	if(qtype == T_A)
 		flags = F_IPV4; // A type
@@ -337,8 +493,12 @@ size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len
 	if(flags != 0)
 		flags |= F_HOSTS;
 
-	// Skip questions so we can start adding answers (if applicable)
-	if (!(p = skip_questions(header, len)))
+	// Skip questions so we can start adding answers (if applicable). There
+	// is no need to parse the question again in the typical case of a single
+	// question
+	if(ntohs(header->qdcount) == 1)
+		p = qend;
+	else if (!(p = skip_questions(header, len)))
 		return 0;
 
 	// Are we replying to pi.hole / <hostname> / pi.hole.<local> / <hostname>.<local> ?
@@ -366,7 +526,7 @@ size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len
 		}
 
 		// Debug logging
-		if(config.debug & DEBUG_QUERIES)
+		if(debug_enabled(DEBUG_QUERIES))
 		{
 			char ip[ADDRSTRLEN+1] = { 0 };
 			alladdr_extract_ip(&addr, AF_INET, ip);
@@ -374,10 +534,9 @@ size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len
 		}
 
 		// Add A resource record
-		header->ancount = htons(ntohs(header->ancount) + 1);
-		if(add_resource_record(header, limit, &trunc, sizeof(struct dns_header),
-		                       &p, hostname ? daemon->local_ttl : config.block_ttl,
-		                       NULL, T_A, C_IN, (char*)"4", &addr.addr4))
+		if(add_blocked_answer(header, limit, &trunc, &p, T_A,
+		                      hostname ? daemon->local_ttl : config.block_ttl,
+		                      hostname, &addr.addr4))
 			log_query(flags & ~F_IPV6, name, &addr, (char*)blockingreason, 0);
 	}
 
@@ -401,7 +560,7 @@ size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len
 		}
 
 		// Debug logging
-		if(config.debug & DEBUG_QUERIES)
+		if(debug_enabled(DEBUG_QUERIES))
 		{
 			char ip[ADDRSTRLEN+1] = { 0 };
 			alladdr_extract_ip(&addr, AF_INET6, ip);
@@ -409,10 +568,9 @@ size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len
 		}
 
 		// Add AAAA resource record
-		header->ancount = htons(ntohs(header->ancount) + 1);
-		if(add_resource_record(header, limit, &trunc, sizeof(struct dns_header),
-		                       &p, hostname ? daemon->local_ttl : config.block_ttl,
-		                       NULL, T_AAAA, C_IN, (char*)"6", &addr.addr6))
+		if(add_blocked_answer(header, limit, &trunc, &p, T_AAAA,
+		                      hostname ? daemon->local_ttl : config.block_ttl,
+		                      hostname, &addr.addr6))
 			log_query(flags & ~F_IPV4, name, &addr, (char*)blockingreason, 0);
 	}
 
@@ -442,32 +600,6 @@ size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len
 	return p - (unsigned char *)header;
 }
 
-static bool is_pihole_domain(const char *domain)
-{
-	static char *pihole_suffix = NULL;
-	if(!pihole_suffix && daemon->domain_suffix)
-	{
-		// Build "pi.hole.<local suffix>" domain
-		pihole_suffix = calloc(strlen(daemon->domain_suffix) + 9, sizeof(char));
-		strcpy(pihole_suffix, "pi.hole.");
-		strcat(pihole_suffix, daemon->domain_suffix);
-		if(config.debug & DEBUG_QUERIES)
-			logg("Domain suffix is \"%s\"", daemon->domain_suffix);
-	}
-	static char *hostname_suffix = NULL;
-	if(!hostname_suffix && daemon->domain_suffix)
-	{
-		// Build "<hostname>.<local suffix>" domain
-		hostname_suffix = calloc(strlen(hostname()) + strlen(daemon->domain_suffix) + 2, sizeof(char));
-		strcpy(hostname_suffix, hostname());
-		strcat(hostname_suffix, ".");
-		strcat(hostname_suffix, daemon->domain_suffix);
-	}
-	return strcasecmp(domain, "pi.hole") == 0 || strcasecmp(domain, hostname()) == 0 ||
-	       (pihole_suffix && strcasecmp(domain, pihole_suffix) == 0) ||
-	       (hostname_suffix && strcasecmp(domain, hostname_suffix) == 0);
-}
-
 bool _FTL_new_query(const unsigned int flags, const char *name,
                     union mysockaddr *addr, char *arg,
                     const unsigned short qtype, const int id,
@@ -477,7 +609,8 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	// Create new query in data structure
 
 	// Get timestamp
-	const time_t querytimestamp = time(NULL);
+	const time_t querytimestamp = ftl_time();
+	const uint32_t received = query_stage_now();
 
 	// Save request time
 	struct timeval request;
@@ -540,10 +673,16 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	// Check domain name received from dnsmasq
 	name = check_dnsmasq_name(name);
 
+	// Convert domain to lower case
+	char *domainString = strdup(name);
+	const uint32_t domainHash = strtolower_hash(domainString);
+
 	// If domain is "pi.hole" or the local hostname we skip analyzing this query
 	// and, instead, immediately reply with the IP address - these queries are not further analyzed
-	if(is_pihole_domain(name))
+	if(special_name_lookup(domainString, domainHash) == SPECIAL_PIHOLE)
 	{
+		free(domainString);
+
 		if(querytype == TYPE_A || querytype == TYPE_AAAA || querytype == TYPE_ANY)
 		{
 			// "Block" this query by sending the interface IP address
@@ -561,7 +700,7 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 				force_next_DNS_reply = REPLY_IP;
 
 			blockingreason = HOSTNAME;
-			if(config.debug & DEBUG_QUERIES)
+			if(debug_enabled(DEBUG_QUERIES))
 			{
 				logg("Replying to %s with %s", name,
 				     force_next_DNS_reply == REPLY_IP ?
@@ -585,15 +724,12 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	// Skip AAAA queries if user doesn't want to have them analyzed
 	if(!config.analyze_AAAA && querytype == TYPE_AAAA)
 	{
-		if(config.debug & DEBUG_QUERIES)
+		if(debug_enabled(DEBUG_QUERIES))
 			logg("Not analyzing AAAA query");
+		free(domainString);
 		return false;
 	}
 
-	// Convert domain to lower case
-	char *domainString = strdup(name);
-	strtolower(domainString);
-
 	// Get client IP address
 	// The requestor's IP address can be rewritten using EDNS(0) client
 	// subnet (ECS) data), however, we do not rewrite the IPs ::1 and
@@ -633,10 +769,34 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 
 	// Lock shared memory
 	lock_shm();
+
+	// A DNS worker must not decide about queries with outdated lists. The
+	// check is done while holding the lock as the lists are reloaded
+	// while holding it, too
+	if(FTL_dns_worker_stale())
+	{
+		unlock_shm();
+		free(domainString);
+		FTL_dns_worker_exit();
+	}
+
 	const int queryID = counters->queries;
 
+	// Check the rate-limit of the client's subnet before looking up the
+	// client as clients rotating their addresses would create a new one
+	// for every address
+	if(!internal_query && rate_limit_prefix(clientIP, querytimestamp))
+	{
+		force_next_DNS_reply = REPLY_REFUSED;
+		blockingreason = "Rate-limiting";
+		free(domainString);
+		unlock_shm();
+		return true;
+	}
+
 	// Find client IP
 	const int clientID = findClientID(clientIP, true, false);
+	const uint32_t client_identified = query_stage_now();
 
 	// Get client pointer
 	clientsData* client = getClient(clientID, true);
@@ -655,23 +815,8 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	const char *interface = internal_query ? "-" : next_iface.name;
 
 	// Check rate-limit for this client
-	if(!internal_query && config.rate_limit.count > 0 &&
-	   (++client->rate_limit > config.rate_limit.count  || client->flags.rate_limited))
+	if(!internal_query && rate_limit_query(clientID, querytimestamp))
 	{
-		if(!client->flags.rate_limited)
-		{
-			// Log the first rate-limited query for this client in
-			// this interval. We do not log the blocked domain for
-			// privacy reasons
-			logg_rate_limit_message(clientIP, client->rate_limit);
-			// Reset rate-limiting counter so we can count what
-			// comes within the adjacent interval
-			client->rate_limit = 0;
-		}
-
-		// Memorize this client needs rate-limiting
-		client->flags.rate_limited = true;
-
 		// Block this query
 		force_next_DNS_reply = REPLY_REFUSED;
 		blockingreason = "Rate-limiting";
@@ -685,7 +830,7 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	}
 
 	// Log new query if in debug mode
-	if(config.debug & DEBUG_QUERIES)
+	if(debug_enabled(DEBUG_QUERIES))
 	{
 		const char *types = querystr(arg, qtype);
 		logg("**** new %sIPv%d %s query \"%s\" from %s/%s#%d (ID %i, FTL %i, %s:%i)",
@@ -703,7 +848,7 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	if(config.analyze_only_A_AAAA && querytype != TYPE_A && querytype != TYPE_AAAA)
 	{
 		// Don't process this query further here, we already counted it
-		if(config.debug & DEBUG_QUERIES)
+		if(debug_enabled(DEBUG_QUERIES))
 		{
 			const char *types = querystr(arg, qtype);
 			logg("Notice: Skipping new query: %s (%i)", types, id);
@@ -714,7 +859,7 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	}
 
 	// Go through already knows domains and see if it is one of them
-	const int domainID = findDomainID(domainString, true);
+	const int domainID = findDomainID(domainString, domainHash, true);
 
 	// Save everything
 	queriesData* query = getQuery(queryID, false);
@@ -734,10 +879,13 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	query->timestamp = querytimestamp;
 	query->type = querytype;
 	query->qtype = qtype;
-	query->id = id; // Has to be set before calling query_set_status()
+	query->id = dns_worker_query_id(id); // Has to be set before calling query_set_status()
+	add_query_lookup(query->id, queryID);
+	query_stage_start(query, received);
+	query_stage_done(query, STAGE_CLIENT, client_identified);
 
 	// This query is unknown as long as no reply has been found and analyzed
-	counters->status[QUERY_UNKNOWN]++;
+	counter_inc(status[QUERY_UNKNOWN]);
 	query_set_status(query, QUERY_UNKNOWN);
 	query->domainID = domainID;
 	query->clientID = clientID;
@@ -748,13 +896,14 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	query->flags.response_calculated = false;
 	// Initialize reply type
 	query->reply = REPLY_UNKNOWN;
-	counters->reply[REPLY_UNKNOWN]++;
+	counter_inc(reply[REPLY_UNKNOWN]);
 	// Store DNSSEC result for this domain
 	query->dnssec = DNSSEC_UNSPECIFIED;
 	query->CNAME_domainID = -1;
 	// This query is not yet known ad forwarded or blocked
 	query->flags.blocked = false;
 	query->flags.whitelisted = false;
+	query->unsampled = 0u;
 
 	// Indicator that this query was not forwarded so far
 	query->upstreamID = -1;
@@ -767,11 +916,18 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	// Query extended DNS error
 	query->ede = EDE_UNSET;
 
+	// Add query to the query lists of its domain and client
+	link_query(queryID, query);
+	heavy_hitters_add(query, 1);
+	cardinality_add(query);
+
 	// Increase DNS queries counter
 	counters->queries++;
+	FTL_PROBE4(query__new, queryID, domainString, clientIP, qtype);
 
 	// Update overTime data
 	overTime[timeidx].total++;
+	timeseries_update(query->timestamp, 1, 0);
 
 	// Update overTime data structure with the new client
 	change_clientcount(client, 0, 0, timeidx, 1);
@@ -781,7 +937,7 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	client->numQueriesARP++;
 
 	// Update counters
-	counters->querytype[querytype-1]++;
+	counter_inc(querytype[querytype-1]);
 
 	// Process interface information of client (if available)
 	// Skip interface name length 1 to skip "-". No real interface should
@@ -823,7 +979,7 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	// Try to obtain MAC address from dnsmasq's cache (also asks the kernel)
 	if(client->hwlen < 1)
 	{
-		client->hwlen = find_mac(addr, client->hwaddr, 1, time(NULL));
+		client->hwlen = find_mac(addr, client->hwaddr, 1, ftl_time());
 		if(config.debug & DEBUG_ARP)
 		{
 			if(client->hwlen == 6)
@@ -843,6 +999,11 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	if(!internal_query)
 		blockDomain = FTL_check_blocking(queryID, domainID, clientID);
 
+	// The blocking checks may have moved the queries in memory
+	query = getQuery(queryID, true);
+	if(query != NULL)
+		query_stage_done(query, STAGE_BLOCKING, query_stage_now());
+
 	// Free allocated memory
 	free(domainString);
 
@@ -1083,7 +1244,7 @@ static void check_pihole_PTR(char *domain)
 			}
 
 			// Debug logging
-			if(config.debug & DEBUG_QUERIES)
+			if(debug_enabled(DEBUG_QUERIES))
 				logg("Generating PTR response: %s -> %s", pihole_ptr->name, pihole_ptr->ptr);
 
 			return;
@@ -1097,7 +1258,7 @@ inline static void set_dnscache_blockingstatus(DNSCacheData * dns_cache, clients
 	// Memorize blocking status DNS cache for the domain/client combination
 	dns_cache->blocking_status = new_status;
 
-	if(config.debug & DEBUG_QUERIES)
+	if(debug_enabled(DEBUG_QUERIES))
 	{
 		const char *clientip = client ? getstr(client->ippos) : "N/A";
 		logg("DNS cache: %s/%s is %s", clientip, domain, blockingreason);
@@ -1150,7 +1311,7 @@ static bool check_domain_blocked(const char *domain, const int clientID,
 		// Handle reply to this query as configured
 		if(config.reply_when_busy == BUSY_ALLOW)
 		{
-			if(config.debug & DEBUG_QUERIES)
+			if(debug_enabled(DEBUG_QUERIES))
 				logg("Allowing query as gravity database is not available");
 
 			// Permit this query
@@ -1207,8 +1368,14 @@ static bool check_domain_blocked(const char *domain, const int clientID,
 }
 
 // Special domain checking
-static bool special_domain(const queriesData *query, const char *domain)
+static bool special_domain(const queriesData *query, const domainsData *domain)
 {
+	// The names are looked up using the hash computed when the domain was
+	// added (see special_names_init())
+	const enum special_name kind = special_name_lookup(getstr(domain->domainpos), domain->domainhash);
+	if(kind == SPECIAL_NONE)
+		return false;
+
 	// Mozilla canary domain
 	// Network administrators may configure their networks as follows to signal
 	// that their local DNS resolver implemented special features that make the
@@ -1219,7 +1386,7 @@ static bool special_domain(const queriesData *query, const char *domain)
 	// respond with NOERROR, but return no A or AAAA records.
 	// https://support.mozilla.org/en-US/kb/configuring-networks-disable-dns-over-https
 	if(config.special_domains.mozilla_canary &&
-	   strcasecmp(domain, "use-application-dns.net") == 0 &&
+	   kind == SPECIAL_MOZILLA_CANARY &&
 	   (query->type == TYPE_A || query->type == TYPE_AAAA))
 	{
 		blockingreason = "Mozilla canary domain";
@@ -1243,8 +1410,7 @@ static bool special_domain(const queriesData *query, const char *domain)
 	// > mask-h2.icloud.com
 	// https://developer.apple.com/support/prepare-your-network-for-icloud-private-relay
 	if(config.special_domains.icloud_private_relay &&
-	   (strcasecmp(domain, "mask.icloud.com") == 0 ||
-	    strcasecmp(domain, "mask-h2.icloud.com") == 0))
+	   kind == SPECIAL_ICLOUD_PRIVATE_RELAY)
 	{
 		blockingreason = "Apple iCloud Private Relay domain";
 		force_next_DNS_reply = REPLY_NXDOMAIN;
@@ -1281,6 +1447,13 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 		return false;
 	}
 
+	// Clients with the same groups get the same verdict. Check if another
+	// client in this group set has already asked for this domain. The Lua
+	// policy may decide differently for every client
+	if(dns_cache->blocking_status == UNKNOWN_BLOCKED && !query->flags.whitelisted &&
+	   !lua_policy_enabled())
+		get_cached_verdict(domainID, client, query->type, dns_cache);
+
 	// Skip the entire chain of tests if we already know the answer for this
 	// particular client
 	unsigned char blockingStatus = dns_cache->blocking_status;
@@ -1290,7 +1463,7 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 		case UNKNOWN_BLOCKED:
 			// New domain/client combination.
 			// We have to go through all the tests below
-			if(config.debug & DEBUG_QUERIES)
+			if(debug_enabled(DEBUG_QUERIES))
 			{
 				logg("%s is not known", domainstr);
 			}
@@ -1302,7 +1475,7 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 			// return this result early, skipping
 			// all the lengthy tests below
 			blockingreason = "exactly blacklisted";
-			if(config.debug & DEBUG_QUERIES)
+			if(debug_enabled(DEBUG_QUERIES))
 			{
 				logg("%s is known as %s", domainstr, blockingreason);
 			}
@@ -1322,7 +1495,7 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 			// return this result early, skipping
 			// all the lengthy tests below
 			blockingreason = "gravity blocked";
-			if(config.debug & DEBUG_QUERIES)
+			if(debug_enabled(DEBUG_QUERIES))
 			{
 				logg("%s is known as %s", domainstr, blockingreason);
 			}
@@ -1342,7 +1515,7 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 			// return this result early, skipping
 			// all the lengthy tests below
 			blockingreason = "regex blacklisted";
-			if(config.debug & DEBUG_QUERIES)
+			if(debug_enabled(DEBUG_QUERIES))
 			{
 				logg("%s is known as %s", domainstr, blockingreason);
 			}
@@ -1362,7 +1535,7 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 			// Known as whitelisted, we
 			// return this result early, skipping
 			// all the lengthy tests below
-			if(config.debug & DEBUG_QUERIES)
+			if(debug_enabled(DEBUG_QUERIES))
 			{
 				logg("%s is known as not to be blocked (whitelisted)", domainstr);
 			}
@@ -1372,12 +1545,30 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 			return false;
 			break;
 
+		case POLICY_BLOCKED:
+			// Known as blocked by the Lua policy, we
+			// return this result early, skipping
+			// all the lengthy tests below
+			blockingreason = "blocked by Lua policy";
+			if(debug_enabled(DEBUG_QUERIES))
+			{
+				logg("%s is known as %s", domainstr, blockingreason);
+			}
+
+			if(!query->flags.whitelisted)
+			{
+				force_next_DNS_reply = dns_cache->force_reply;
+				query_blocked(query, domain, client, QUERY_BLACKLIST);
+				return true;
+			}
+			break;
+
 		case SPECIAL_DOMAIN:
 			// Known as a special domain, we
 			// return this result early, skipping
 			// all the lengthy tests below
 			blockingreason = "special domain";
-			if(config.debug & DEBUG_QUERIES)
+			if(debug_enabled(DEBUG_QUERIES))
 			{
 				logg("%s is known as special domain", domainstr);;
 			}
@@ -1391,7 +1582,7 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 			// Known as not blocked, we
 			// return this result early, skipping
 			// all the lengthy tests below
-			if(config.debug & DEBUG_QUERIES)
+			if(debug_enabled(DEBUG_QUERIES))
 			{
 				logg("%s is known as not to be blocked", domainstr);
 			}
@@ -1403,7 +1594,7 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 	// Skip all checks and continue if we hit already at least one whitelist in the chain
 	if(query->flags.whitelisted)
 	{
-		if(config.debug & DEBUG_QUERIES)
+		if(debug_enabled(DEBUG_QUERIES))
 		{
 			logg("Query is permitted as at least one whitelist entry matched");
 		}
@@ -1425,8 +1616,39 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 	if(!query->flags.whitelisted)
 		query->flags.whitelisted = in_regex(domainstr, dns_cache, client->id, REGEX_WHITELIST);
 
+	// If not whitelisted: Ask the Lua policy
+	if(!query->flags.whitelisted && lua_policy_enabled())
+	{
+		enum reply_type reply = REPLY_UNKNOWN;
+		const enum policy_verdict verdict =
+			lua_policy_check(domainstr, getstr(client->ippos), querytypes[query->type],
+			                 client->flags.found_group ? getstr(client->groupspos) : "", &reply);
+		if(verdict == POLICY_ALLOW)
+		{
+			// Permit the query like a whitelisted one
+			query->flags.whitelisted = true;
+			dns_cache->blocking_status = WHITELISTED;
+			if(debug_enabled(DEBUG_QUERIES))
+				logg("Lua policy: %s is allowed for %s", domainstr, getstr(client->ippos));
+			free(domainstr);
+			return false;
+		}
+		else if(verdict == POLICY_BLOCK)
+		{
+			blockingreason = "blocked by Lua policy";
+			force_next_DNS_reply = reply;
+			dns_cache->blocking_status = POLICY_BLOCKED;
+			dns_cache->force_reply = reply;
+			query_blocked(query, domain, client, QUERY_BLACKLIST);
+			if(debug_enabled(DEBUG_QUERIES))
+				logg("Lua policy: %s is blocked for %s", domainstr, getstr(client->ippos));
+			free(domainstr);
+			return true;
+		}
+	}
+
 	// Check if this is a special domain
-	if(!query->flags.whitelisted && special_domain(query, domainstr))
+	if(!query->flags.whitelisted && special_domain(query, domain))
 	{
 		// Set DNS cache properties
 		dns_cache->blocking_status = SPECIAL_DOMAIN;
@@ -1436,7 +1658,7 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 		query_blocked(query, domain, client, QUERY_SPECIAL_DOMAIN);
 
 		// Debug output
-		if(config.debug & DEBUG_QUERIES)
+		if(debug_enabled(DEBUG_QUERIES))
 			logg("Special domain: %s is %s", domainstr, blockingreason);
 
 		return true;
@@ -1477,7 +1699,7 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 		query_blocked(query, domain, client, new_status);
 
 		// Debug output
-		if(config.debug & DEBUG_QUERIES)
+		if(debug_enabled(DEBUG_QUERIES))
 		{
 			logg("Blocking %s as %s is %s", domainstr, blockedDomain, blockingreason);
 			if(force_next_DNS_reply != 0)
@@ -1492,53 +1714,113 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 		dns_cache->blocking_status = query->flags.whitelisted ? WHITELISTED : NOT_BLOCKED;
 
 		// Debug output
-		if(config.debug & DEBUG_QUERIES)
+		if(debug_enabled(DEBUG_QUERIES))
 			// client is guaranteed to be non-NULL above
 			logg("DNS cache: %s/%s is %s", getstr(client->ippos), domainstr,
 			     query->flags.whitelisted ? "whitelisted" : "not blocked");
 	}
 
+	// Share the verdict with all clients in the same group set
+	if(db_okay && !lua_policy_enabled())
+		set_cached_verdict(domainID, client, query->type, dns_cache);
+
 	free(domainstr);
 	return blockDomain;
 }
 
-
-bool _FTL_CNAME(const char *dst, const char *src, const int id, const char* file, const int line)
+// Compute the verdict of a domain for the group set of a client without a
+// query and share it through the verdict cache, following the same checks as
+// FTL_check_blocking() above. Used to warm up the verdict cache (see
+// warmup.c), returns true if a new verdict has been stored
+bool FTL_warm_verdict(const int domainID, clientsData *client, const enum query_types query_type)
 {
-	if(config.debug & DEBUG_QUERIES)
-		logg("FTL_CNAME called with: src = %s, dst = %s, id = %d", src, dst, id);
+	domainsData *domain = getDomain(domainID, true);
+	if(domain == NULL || blockingstatus == BLOCKING_DISABLED || lua_policy_enabled() ||
+	   has_cached_verdict(domainID, client, query_type))
+		return false;
 
-	// Does the user want to skip deep CNAME inspection?
-	if(!config.cname_inspection)
+	// _esni. queries may be blocked because of their parent domain, they
+	// are left to FTL_check_blocking()
+	char *domainstr = strdup(getstr(domain->domainpos));
+	if(domainstr == NULL || (config.block_esni && strncasecmp(domainstr, "_esni.", 6u) == 0))
 	{
-		if(config.debug & DEBUG_QUERIES)
-			logg("Skipping analysis as cname inspection is disabled");
+		free(domainstr);
 		return false;
 	}
 
-	// Lock shared memory
-	lock_shm();
+	// The checks below set the fork-private blocking metadata of the
+	// query currently processed
+	const char *old_blockingreason = blockingreason;
+	const enum reply_type old_force_reply = force_next_DNS_reply;
+	const int old_regex_idx = last_regex_idx;
 
-	// Save status and upstreamID in corresponding query identified by dnsmasq's ID
-	const int queryID = findQueryID(id);
-	if(queryID < 0)
+	queriesData query = { 0 };
+	query.type = query_type;
+	DNSCacheData dns_cache = { 0 };
+
+	query.flags.whitelisted = in_whitelist(domainstr, &dns_cache, client) == FOUND;
+	if(!query.flags.whitelisted)
+		query.flags.whitelisted = in_regex(domainstr, &dns_cache, client->id, REGEX_WHITELIST);
+
+	// Verdicts of special domains are not shared
+	bool db_okay = true;
+	if(query.flags.whitelisted)
+		dns_cache.blocking_status = WHITELISTED;
+	else if(special_domain(&query, domain))
+		db_okay = false;
+	else
 	{
-		// This may happen e.g. if the original query was a PTR query
-		// or "pi.hole" and we ignored them altogether
-		unlock_shm();
-		if(config.debug & DEBUG_QUERIES)
-			logg("Skipping analysis as parent query is not found");
-		return false;
+		unsigned char new_status = QUERY_UNKNOWN;
+		if(!check_domain_blocked(domainstr, client->id, client, &query, &dns_cache, &new_status, &db_okay))
+			dns_cache.blocking_status = NOT_BLOCKED;
+	}
+
+	if(db_okay)
+		set_cached_verdict(domainID, client, query_type, &dns_cache);
+
+	blockingreason = old_blockingreason;
+	force_next_DNS_reply = old_force_reply;
+	last_regex_idx = old_regex_idx;
+
+	free(domainstr);
+	return db_okay && dns_cache.blocking_status != UNKNOWN_BLOCKED;
+}
+
+
+// CNAME targets of the reply currently processed by dnsmasq. They are
+// collected and checked at once by FTL_CNAME_chain() so that the calls to
+// FTL_CNAME() for the individual hops only need to look up the result
+static struct {
+	int id;
+	unsigned int hops;
+	int blocked;
+	char *domain[CNAME_CHAIN];
+} cname_chain = { -1, 0, -1, { NULL } };
+
+static void clear_cname_chain(void)
+{
+	for(unsigned int i = 0; i < cname_chain.hops; i++)
+	{
+		free(cname_chain.domain[i]);
+		cname_chain.domain[i] = NULL;
 	}
+	cname_chain.id = -1;
+	cname_chain.hops = 0;
+	cname_chain.blocked = -1;
+}
 
+// Check one hop of a CNAME path. The domain is expected in lower case, the
+// shared memory has to be locked by the caller
+static bool check_CNAME_hop(const int queryID, const char *child_domain, const uint32_t child_hash,
+                            const char *src, const int id)
+{
 	// Get query pointer so we can later extract the client requesting this domain for
 	// the per-client blocking evaluation
 	queriesData* query = getQuery(queryID, true);
 	if(query == NULL)
 	{
 		// Nothing to be done here
-		unlock_shm();
-		if(config.debug & DEBUG_QUERIES)
+		if(debug_enabled(DEBUG_QUERIES))
 			logg("Skipping analysis as parent query is not valid");
 		return false;
 	}
@@ -1556,10 +1838,7 @@ bool _FTL_CNAME(const char *dst, const char *src, const int id, const char* file
 
 	// child_domain = Intermediate domain in CNAME path
 	// This is the domain which was queried later in this chain
-	char *child_domain = strdup(dst);
-	// Convert to lowercase for matching
-	strtolower(child_domain);
-	const int child_domainID = findDomainID(child_domain, false);
+	const int child_domainID = findDomainID(child_domain, child_hash, false);
 
 	// Get client ID from the original query (the entire chain always
 	// belongs to the same client)
@@ -1578,19 +1857,23 @@ bool _FTL_CNAME(const char *dst, const char *src, const int id, const char* file
 		if(parent_domain == NULL)
 		{
 			// Memory error, return
-			free(child_domain);
-			unlock_shm();
 			return false;
 		}
 		parent_domain->blockedcount++;
+		update_domain_leaderboards(parent_domainID);
 
-		// Store query response as CNAME type
+		// Store query response as CNAME type (this is not a deferred
+		// event, the reply is recorded right now)
 		struct timeval response;
 		gettimeofday(&response, 0);
-		query_set_reply(F_CNAME, 0, NULL, query, response);
+		event_ts = query_stage_now();
+		query_set_reply(F_CNAME, 0, NULL, query, response, force_next_DNS_reply);
 
 		// Store domain that was the reason for blocking the entire chain
 		query->CNAME_domainID = child_domainID;
+		domainsData *blocking_domain = getDomain(child_domainID, true);
+		if(blocking_domain != NULL)
+			blocking_domain->cname_blocked = true;
 
 		// Change blocking reason into CNAME-caused blocking
 		if(query->status == QUERY_GRAVITY)
@@ -1624,8 +1907,158 @@ bool _FTL_CNAME(const char *dst, const char *src, const int id, const char* file
 	}
 
 	// Debug logging for deep CNAME inspection (if enabled)
-	if(config.debug & DEBUG_QUERIES)
-		logg("Query %d: CNAME %s ---> %s", id, src, dst);
+	if(debug_enabled(DEBUG_QUERIES))
+		logg("Query %d: CNAME %s ---> %s", id, src, child_domain);
+
+	return block;
+}
+
+void _FTL_CNAME_chain(struct dns_header *header, const size_t qlen, const int id, const char* file, const int line)
+{
+	// Forget about the previous reply
+	clear_cname_chain();
+
+	// Does the user want to skip deep CNAME inspection?
+	if(!config.cname_inspection)
+		return;
+
+	// Follow the CNAME path of this reply the same way extract_addresses()
+	// does it, starting at the queried name
+	char name[MAXDNAME];
+	unsigned char *p = NULL;
+	if(ntohs(header->qdcount) != 1 || !extract_question_name(header, qlen, &p, name))
+		return;
+
+	int qtype;
+	GETSHORT(qtype, p);
+	p += 2; // class
+
+	bool restart = true;
+	unsigned char *p1 = NULL;
+	unsigned int j = 0;
+	while(cname_chain.hops < CNAME_CHAIN)
+	{
+		if(restart)
+		{
+			// Start again at the first answer, looking for the new name
+			if(!(p1 = skip_questions(header, qlen)))
+				return;
+			j = 0;
+			restart = false;
+		}
+		if(j++ >= ntohs(header->ancount))
+			break;
+
+		int res, aqtype, aqclass, ardlen;
+		if(!(res = extract_name(header, qlen, &p1, name, 0, 10)))
+			return;
+		GETSHORT(aqtype, p1);
+		GETSHORT(aqclass, p1);
+		p1 += 4; // TTL
+		GETSHORT(ardlen, p1);
+		unsigned char *endrr = p1 + ardlen;
+		if(!CHECK_LEN(header, endrr, qlen, 0))
+			return;
+
+		if(aqclass != C_IN || res == 2 || aqtype != T_CNAME)
+		{
+			p1 = endrr;
+			continue;
+		}
+
+		// Copy the target of this CNAME into the name we look for next
+		if(!extract_name(header, qlen, &p1, name, 1, 0))
+			return;
+		cname_chain.domain[cname_chain.hops++] = strdup(name);
+		p1 = endrr;
+
+		// dnsmasq does not chase CNAMEs of CNAME queries
+		if(qtype != T_CNAME)
+			restart = true;
+	}
+
+	if(cname_chain.hops == 0)
+		return;
+
+	// Check all hops at once, stop at the first one that is blocked as
+	// dnsmasq stops walking the path there, too
+	lock_shm();
+	// Apply deferred events first to keep the events of each query in order
+	statsqueue_flush();
+	const int queryID = findQueryID(id);
+	if(queryID < 0)
+	{
+		// Not analyzed, FTL_CNAME() handles the individual hops
+		unlock_shm();
+		clear_cname_chain();
+		return;
+	}
+
+	cname_chain.id = id;
+	for(unsigned int i = 0; i < cname_chain.hops; i++)
+	{
+		char *domain = cname_chain.domain[i];
+		const uint32_t hash = strtolower_hash(domain);
+		const char *src = i > 0 ? cname_chain.domain[i-1] : getDomainString(getQuery(queryID, true));
+		if(check_CNAME_hop(queryID, domain, hash, src, id))
+		{
+			cname_chain.blocked = i;
+			break;
+		}
+	}
+	unlock_shm();
+}
+
+bool _FTL_CNAME(const char *dst, const char *src, const int id, const char* file, const int line)
+{
+	if(debug_enabled(DEBUG_QUERIES))
+		logg("FTL_CNAME called with: src = %s, dst = %s, id = %d", src, dst, id);
+
+	// Does the user want to skip deep CNAME inspection?
+	if(!config.cname_inspection)
+	{
+		if(debug_enabled(DEBUG_QUERIES))
+			logg("Skipping analysis as cname inspection is disabled");
+		return false;
+	}
+
+	// Has this hop already been checked together with the entire CNAME path
+	// of this reply?
+	if(cname_chain.id == id)
+	{
+		for(unsigned int i = 0; i < cname_chain.hops; i++)
+		{
+			if(strcasecmp(cname_chain.domain[i], dst) != 0)
+				continue;
+
+			const bool block = cname_chain.blocked == (int)i;
+			if(block)
+				clear_cname_chain();
+			return block;
+		}
+	}
+
+	// Lock shared memory
+	lock_shm();
+	// Apply deferred events first to keep the events of each query in order
+	statsqueue_flush();
+
+	// Save status and upstreamID in corresponding query identified by dnsmasq's ID
+	const int queryID = findQueryID(id);
+	if(queryID < 0)
+	{
+		// This may happen e.g. if the original query was a PTR query
+		// or "pi.hole" and we ignored them altogether
+		unlock_shm();
+		if(debug_enabled(DEBUG_QUERIES))
+			logg("Skipping analysis as parent query is not found");
+		return false;
+	}
+
+	// Convert to lowercase for matching
+	char *child_domain = strdup(dst);
+	const uint32_t child_hash = strtolower_hash(child_domain);
+	const bool block = check_CNAME_hop(queryID, child_domain, child_hash, src, id);
 
 	// Return result
 	free(child_domain);
@@ -1637,9 +2070,8 @@ static void FTL_forwarded(const unsigned int flags, const char *name, const unio
                           unsigned short port, const int id, const char* file, const int line)
 {
 	// Save that this query got forwarded to an upstream server
-
-	// Lock shared memory
-	lock_shm();
+	struct hook_record record = { .type = HOOK_FORWARDED, .flags = flags, .id = id };
+	capture_state(&record, NULL);
 
 	// Get forward destination IP address and port
 	in_port_t upstreamPort = 53;
@@ -1672,12 +2104,23 @@ static void FTL_forwarded(const unsigned int flags, const char *name, const unio
 		}
 	}
 
-	// Convert upstreamIP to lower case
-	char *upstreamIP = strdup(dest);
-	strtolower(upstreamIP);
+	// Store upstreamIP in lower case
+	strncpy(record.name, dest, sizeof(record.name) - 1);
+	strtolower(record.name);
+	record.has_name = true;
+	record.port = upstreamPort;
+
+	dispatch_hook(&record, name, NULL, file, line);
+}
+
+static void apply_forwarded(const struct hook_record *record, const char *name, const char *file, const int line)
+{
+	const char *upstreamIP = record->name;
+	const in_port_t upstreamPort = record->port;
+	const int id = record->id;
 
 	// Debug logging
-	if(config.debug & DEBUG_QUERIES)
+	if(debug_enabled(DEBUG_QUERIES))
 	{
 		logg("**** forwarded %s to %s#%u (ID %i, %s:%i)",
 		     name, upstreamIP, upstreamPort, id, file, line);
@@ -1689,19 +2132,17 @@ static void FTL_forwarded(const unsigned int flags, const char *name, const unio
 	{
 		// This may happen e.g. if the original query was a PTR query or "pi.hole"
 		// as we ignore them altogether
-		free(upstreamIP);
-		unlock_shm();
 		return;
 	}
 
 	// Get query pointer
 	queriesData* query = getQuery(queryID, true);
 	if(query == NULL)
-	{
-		free(upstreamIP);
-		unlock_shm();
 		return;
-	}
+
+	// The first forward ends the dispatch stage of the query
+	query_stage_done(query, STAGE_DISPATCH, event_ts);
+	FTL_PROBE4(query__forwarded, queryID, name, upstreamIP, upstreamPort);
 
 	// Get ID of upstream destination, create new upstream record
 	// if not found in current data structure
@@ -1713,9 +2154,9 @@ static void FTL_forwarded(const unsigned int flags, const char *name, const unio
 	{
 		// Update overTime counts
 		const int timeidx = getOverTimeID(query->timestamp);
-		upstream->overTime[timeidx]++;
+		overTime_add(&upstream->overTime, timeidx, 1);
 		// Update lastQuery timestamp
-		upstream->lastQuery = time(NULL);
+		upstream->lastQuery = ftl_time();
 	}
 
 	// Proceed only if
@@ -1726,8 +2167,6 @@ static void FTL_forwarded(const unsigned int flags, const char *name, const unio
 	//   (this is a special case further described below)
 	if(query->flags.complete && query->status != QUERY_CACHE)
 	{
-		free(upstreamIP);
-		unlock_shm();
 		return;
 	}
 
@@ -1750,14 +2189,12 @@ static void FTL_forwarded(const unsigned int flags, const char *name, const unio
 		// Correct reply timer if a response time has already been calculated
 		if(query->flags.response_calculated)
 		{
-			struct timeval response;
-			gettimeofday(&response, 0);
 			// Reset timer to measure how long it takes until an answer arrives
 			// If a response time has already been calculated, we
 			// can go back in time to measure both the initial cache
 			// lookup and the (now starting) time it takes for the
 			// upstream to respond
-			query->response = converttimeval(response) - query->response;
+			query->response = converttimeval(record->response) - query->response;
 			query->flags.response_calculated = false;
 		}
 	}
@@ -1766,6 +2203,7 @@ static void FTL_forwarded(const unsigned int flags, const char *name, const unio
 		// Normal forwarded query (status is set below)
 		// Hereby, this query is now fully determined
 		query->flags.complete = true;
+		query_update_inflight(query);
 	}
 
 	// Set query status to forwarded only after the
@@ -1773,12 +2211,6 @@ static void FTL_forwarded(const unsigned int flags, const char *name, const unio
 	// from above as otherwise this check will always
 	// be negative
 	query_set_status(query, QUERY_FORWARDED);
-
-	// Release allocated memory
-	free(upstreamIP);
-
-	// Unlock shared memory
-	unlock_shm();
 }
 
 void FTL_dnsmasq_reload(void)
@@ -1786,21 +2218,19 @@ void FTL_dnsmasq_reload(void)
 	// This function is called by the dnsmasq code on receive of SIGHUP
 	// *before* clearing the cache and rereading the lists
 	logg("Reloading DNS cache");
+	reopen_FTL_log();
 	lock_shm();
 
 	// Request reload the privacy level and blocking status
 	set_event(RELOAD_PRIVACY_LEVEL);
 	set_event(RELOAD_BLOCKINGSTATUS);
 
-	// Reread pihole-FTL.conf to see which blocking mode the user wants to use
-	// It is possible to change the blocking mode here as we anyhow clear the
-	// cache and reread all blocking lists
-	// Passing NULL to this function means it has to open the config file on
-	// its own behalf (on initial reading, the config file is already opened)
-	get_blocking_mode(NULL);
-
-	// Reread pihole-FTL.conf to see which debugging flags are set
-	read_debuging_settings(NULL);
+	// Reread pihole-FTL.conf, this includes the blocking mode and the
+	// debugging flags. It is possible to change the blocking mode here as we
+	// anyhow clear the cache and reread all blocking lists. The config has
+	// just been read when this is called on startup
+	if(resolver_ready)
+		reload_FTLconf();
 
 	// Gravity database updates
 	// - (Re-)open gravity database connection
@@ -1844,8 +2274,33 @@ static void mysockaddr_extract_ip_port(union mysockaddr *server, char ip[ADDRSTR
 	}
 }
 
-// Compute cache/upstream response time
-static inline void set_response_time(queriesData *query, const struct timeval response)
+// Weight of a new response in the moving averages used for upstream scoring
+#define UPSTREAM_SCORE_ALPHA 0.05f
+// Response time penalty of an upstream server which always fails [ms]
+#define UPSTREAM_ERROR_PENALTY 1000.0f
+
+// Update the moving averages of the response time and the error rate of an
+// upstream server. A response time of zero marks a failed query
+static void score_upstream(upstreamsData *upstream, const unsigned long response, const bool error)
+{
+	upstream->error_ewma += UPSTREAM_SCORE_ALPHA * ((error ? 1.0f : 0.0f) - upstream->error_ewma);
+	if(error)
+		return;
+
+	// Answering servers need no probes
+	upstream_probe_replied(getstr(upstream->ippos), upstream->port);
+
+	// Convert to milliseconds, the first response initializes the average
+	const float rtime = 0.1f * response;
+	if(upstream->rtime_ewma <= 0.0f)
+		upstream->rtime_ewma = rtime;
+	else
+		upstream->rtime_ewma += UPSTREAM_SCORE_ALPHA * (rtime - upstream->rtime_ewma);
+}
+
+// Compute cache/upstream response time. Upstream response times are also
+// added to the response time histogram of the upstream server
+static inline void set_response_time(queriesData *query, const struct timeval response, const bool upstream)
 {
 	// Do this only if this is the first time we set a reply
 	if(query->flags.response_calculated)
@@ -1854,6 +2309,17 @@ static inline void set_response_time(queriesData *query, const struct timeval re
 	// Convert absolute timestamp to relative timestamp
 	query->response = converttimeval(response) - query->response;
 	query->flags.response_calculated = true;
+	query_stage_finish(query, event_ts);
+
+	if(!upstream || query->upstreamID < 0)
+		return;
+
+	upstreamsData *upstreamData = getUpstream(query->upstreamID, true);
+	if(upstreamData != NULL)
+	{
+		add_upstream_rtime(upstreamData, query->timestamp, query->response);
+		score_upstream(upstreamData, query->response, false);
+	}
 }
 
 // Changes upstream server (only relevant when multiple servers are defined)
@@ -1862,21 +2328,21 @@ static inline void set_response_time(queriesData *query, const struct timeval re
 // first answering upstream server is also the first one we sent the query to.
 // If not, we need to change the upstream server associated with this query to
 // get accurate statistics
-static void update_upstream(queriesData *query, const int id)
+static void update_upstream(queriesData *query, const union mysockaddr *server, const int id)
 {
 	// We use query->flags.response_calculated to check if this is the first
 	// response received for this query and check the family of last server
 	// to see if it is available
-	if(query->flags.response_calculated || last_server.sa.sa_family == 0)
+	if(query->flags.response_calculated || server->sa.sa_family == 0)
 		return;
 
 	char ip[ADDRSTRLEN+1] = { 0 };
 	in_port_t port = 0;
-	mysockaddr_extract_ip_port(&last_server, ip, &port);
+	mysockaddr_extract_ip_port((union mysockaddr*)server, ip, &port);
 	int upstreamID = findUpstreamID(ip, port);
 	if(upstreamID != query->upstreamID)
 	{
-		if(config.debug & DEBUG_QUERIES)
+		if(debug_enabled(DEBUG_QUERIES))
 		{
 			upstreamsData *upstream = getUpstream(query->upstreamID, true);
 			if(upstream)
@@ -1893,33 +2359,132 @@ static void update_upstream(queriesData *query, const int id)
 	}
 }
 
-static void FTL_reply(const unsigned int flags, const char *name, const union all_addr *addr,
-                      const char *arg, const int id, const char* file, const int line)
+// Capture the fork-private state the statistics of an event depend on
+static void capture_state(struct hook_record *record, const union all_addr *addr)
 {
-	// If domain is "pi.hole", we skip this query
-	// We compare case-insensitive here
-	// Hint: name can be NULL, e.g. for NODATA/NXDOMAIN replies
-	if(name != NULL && strcasecmp(name, "pi.hole") == 0)
-	{
-		return;
-	}
-
 	// Get response time before lock because we want to measure upstream not
 	// the lock. The latter may artificially add some extra nanoseconds when
 	// the Pi-hole is currently busy
-	struct timeval response;
-	gettimeofday(&response, 0);
+	gettimeofday(&record->response, 0);
+	record->stage_ts = query_stage_now();
+
+	if(addr != NULL)
+	{
+		memcpy(&record->addr, addr, sizeof(record->addr));
+		record->has_addr = true;
+	}
+	memcpy(&record->server, &last_server, sizeof(record->server));
+	record->adbit = adbit;
+	record->force_reply = force_next_DNS_reply;
+	const ednsData *edns = getEDNS();
+	record->edns_ede = edns != NULL ? edns->ede : EDE_UNSET;
+}
+
+// Process the statistics of an event. They are deferred to the statistics
+// thread if enabled. Events are processed synchronously when debugging
+// queries (the log needs to be in order and contains details not stored in
+// the record) and for blocked queries
+static void dispatch_hook(struct hook_record *record, const char *name, const char *arg, const char *file, const int line)
+{
+	if(!(config.debug & DEBUG_QUERIES) &&
+	   record->force_reply == REPLY_UNKNOWN &&
+	   (record->type == HOOK_FORWARDED || name == NULL || strlen(name) < sizeof(record->name)))
+	{
+		if(record->type != HOOK_FORWARDED && name != NULL)
+		{
+			strcpy(record->name, name);
+			record->has_name = true;
+		}
+		if(statsqueue_push(record))
+			return;
+	}
 
-	// Lock shared memory
 	lock_shm();
+	statsqueue_flush();
+	event_ts = record->stage_ts;
+	switch(record->type)
+	{
+		case HOOK_FORWARDED:
+			apply_forwarded(record, name, file, line);
+			break;
+		case HOOK_REPLY:
+			apply_reply(record, name, arg, file, line);
+			break;
+		case HOOK_DNSSEC:
+			apply_dnssec(record, arg, file, line);
+			break;
+		case HOOK_UPSTREAM_ERROR:
+			apply_upstream_error(record, file, line);
+			break;
+		case HOOK_EXTERNALLY_BLOCKED:
+			apply_externally_blocked(record, file, line);
+			break;
+	}
+	unlock_shm();
+}
+
+// Apply a deferred event, called by the statistics thread while holding the
+// SHM lock
+void FTL_apply_hook(const struct hook_record *record)
+{
+	const char *name = record->has_name ? record->name : NULL;
+	event_ts = record->stage_ts;
+	switch(record->type)
+	{
+		case HOOK_FORWARDED:
+			apply_forwarded(record, "", "deferred", 0);
+			break;
+		case HOOK_REPLY:
+			apply_reply(record, name, "", "deferred", 0);
+			break;
+		case HOOK_DNSSEC:
+			apply_dnssec(record, "", "deferred", 0);
+			break;
+		case HOOK_UPSTREAM_ERROR:
+			apply_upstream_error(record, "deferred", 0);
+			break;
+		case HOOK_EXTERNALLY_BLOCKED:
+			apply_externally_blocked(record, "deferred", 0);
+			break;
+	}
+}
+
+static void FTL_reply(const unsigned int flags, const char *name, const union all_addr *addr,
+                      const char *arg, const int id, const char* file, const int line)
+{
+	// If domain is "pi.hole", we skip this query
+	// We compare case-insensitive here
+	// Hint: name can be NULL, e.g. for NODATA/NXDOMAIN replies
+	if(name != NULL && strcasecmp(name, "pi.hole") == 0)
+	{
+		return;
+	}
+
+	struct hook_record record = { .type = HOOK_REPLY, .flags = flags, .id = id };
+	capture_state(&record, addr);
+	record.bogus = arg != NULL && strstr(arg, "BOGUS") != NULL;
+
+	// Reset last_server to avoid possibly changing the upstream server
+	// again in the next query
+	memset(&last_server, 0, sizeof(last_server));
+
+	dispatch_hook(&record, name, arg, file, line);
+}
+
+static void apply_reply(const struct hook_record *record, const char *name, const char *arg,
+                        const char *file, const int line)
+{
+	const unsigned int flags = record->flags;
+	const int id = record->id;
+	const union all_addr *addr = record->has_addr ? &record->addr : NULL;
+	const struct timeval response = record->response;
 
 	// Save status in corresponding query identified by dnsmasq's ID
 	const int queryID = findQueryID(id);
 	if(queryID < 0)
 	{
 		// This may happen e.g. if the original query was "pi.hole"
-		if(config.debug & DEBUG_QUERIES) logg("FTL_reply(): Query %i has not been found", id);
-		unlock_shm();
+		if(debug_enabled(DEBUG_QUERIES)) logg("FTL_reply(): Query %i has not been found", id);
 		return;
 	}
 
@@ -1944,7 +2509,7 @@ static void FTL_reply(const unsigned int flags, const char *name, const union al
 	const bool stale = flags & F_STALE;
 
 	// Possible debugging output
-	if(config.debug & DEBUG_QUERIES)
+	if(debug_enabled(DEBUG_QUERIES))
 	{
 		// Human-readable answer may be provided by arg
 		// (e.g. for non-cached queries such as SOA)
@@ -1992,7 +2557,7 @@ static void FTL_reply(const unsigned int flags, const char *name, const union al
 		if(!name || strlen(name) == 0)
 			dispname = ".";
 
-		if(cached || last_server.sa.sa_family == 0)
+		if(cached || record->server.sa.sa_family == 0)
 			// Log cache or upstream reply from unknown source
 			logg("**** got %s%s reply: %s is %s (ID %i, %s:%i)",
 			     stale ? "stale ": "", cached ? "cache" : "upstream",
@@ -2001,7 +2566,7 @@ static void FTL_reply(const unsigned int flags, const char *name, const union al
 		{
 			char ip[ADDRSTRLEN+1] = { 0 };
 			in_port_t port = 0;
-			mysockaddr_extract_ip_port(&last_server, ip, &port);
+			mysockaddr_extract_ip_port((union mysockaddr*)&record->server, ip, &port);
 			// Log server which replied to our request
 			logg("**** got %s%s reply from %s#%d: %s is %s (ID %i, %s:%i)",
 			     stale ? "stale ": "", cached ? "cache" : "upstream",
@@ -2014,7 +2579,6 @@ static void FTL_reply(const unsigned int flags, const char *name, const union al
 	if(query == NULL)
 	{
 		// Nothing to be done here
-		unlock_shm();
 		return;
 	}
 
@@ -2022,35 +2586,29 @@ static void FTL_reply(const unsigned int flags, const char *name, const union al
 	if(addr && flags & (F_RCODE | F_SECSTAT) && addr->log.ede != EDE_UNSET)
 	{
 		query->ede = addr->log.ede;
-		if(config.debug & DEBUG_QUERIES)
+		if(debug_enabled(DEBUG_QUERIES))
 			logg("     EDE: %s (%d)", edestr(addr->log.ede), addr->log.ede);
 	}
-	ednsData *edns = getEDNS();
-	if(edns != NULL && edns->ede != EDE_UNSET)
+	if(record->edns_ede != EDE_UNSET)
 	{
-		query->ede = edns->ede;
-		if(config.debug & DEBUG_QUERIES)
-			logg("     EDE: %s (%d)", edestr(edns->ede), edns->ede);
+		query->ede = record->edns_ede;
+		if(debug_enabled(DEBUG_QUERIES))
+			logg("     EDE: %s (%d)", edestr(record->edns_ede), record->edns_ede);
 	}
 
 	// Update upstream server (if applicable)
 	if(!cached)
-		update_upstream(query, id);
-
-	// Reset last_server to avoid possibly changing the upstream server
-	// again in the next query
-	memset(&last_server, 0, sizeof(last_server));
+		update_upstream(query, &record->server, id);
 
 	// Save response time
 	// Skipped internally if already computed
-	set_response_time(query, response);
+	set_response_time(query, response, !cached);
 
 	// We only process the first reply further in here
 	// Check if reply type is still UNKNOWN
 	if(query->reply != REPLY_UNKNOWN)
 	{
 		// Nothing to be done here
-		unlock_shm();
 		return;
 	}
 
@@ -2062,7 +2620,6 @@ static void FTL_reply(const unsigned int flags, const char *name, const union al
 	if(domain == NULL)
 	{
 		// Memory error, skip reply
-		unlock_shm();
 		return;
 	}
 
@@ -2089,7 +2646,7 @@ static void FTL_reply(const unsigned int flags, const char *name, const union al
 		}
 
 		// Save reply type and update individual reply counters
-		query_set_reply(flags, 0, addr, query, response);
+		query_set_reply(flags, 0, addr, query, response, record->force_reply);
 
 		// We know from cache that this domain is either SECURE or
 		// INSECURE, bogus queries are not cached
@@ -2100,8 +2657,8 @@ static void FTL_reply(const unsigned int flags, const char *name, const union al
 
 		// Hereby, this query is now fully determined
 		query->flags.complete = true;
+		query_update_inflight(query);
 
-		unlock_shm();
 		return;
 	}
 
@@ -2119,7 +2676,7 @@ static void FTL_reply(const unsigned int flags, const char *name, const union al
 		query_set_status(query, qs);
 
 		// Save reply type and update individual reply counters
-		query_set_reply(flags, 0, addr, query, response);
+		query_set_reply(flags, 0, addr, query, response, record->force_reply);
 
 		// Set DNSSEC status to INSECURE if it is still unknown
 		if(query->dnssec == DNSSEC_UNSPECIFIED)
@@ -2127,6 +2684,7 @@ static void FTL_reply(const unsigned int flags, const char *name, const union al
 
 		// Hereby, this query is now fully determined
 		query->flags.complete = true;
+		query_update_inflight(query);
 	}
 	else if((flags & (F_FORWARD | F_UPSTREAM)) && isExactMatch)
 	{
@@ -2136,7 +2694,6 @@ static void FTL_reply(const unsigned int flags, const char *name, const union al
 		   query->status == QUERY_EXTERNAL_BLOCKED_NULL ||
 		   query->status == QUERY_EXTERNAL_BLOCKED_NXRA)
 		{
-			unlock_shm();
 			return;
 		}
 
@@ -2151,7 +2708,7 @@ static void FTL_reply(const unsigned int flags, const char *name, const union al
 				// keytag <X>, algo <Y>, digest <Z>)
 				query_set_dnssec(query, DNSSEC_SECURE);
 			}
-			else if(strstr(arg, "BOGUS") != NULL)
+			else if(record->bogus)
 			{
 				// BOGUS DS
 				query_set_dnssec(query, DNSSEC_BOGUS);
@@ -2172,7 +2729,7 @@ static void FTL_reply(const unsigned int flags, const char *name, const union al
 		}
 
 		// Save reply type and update individual reply counters
-		query_set_reply(reply_flags, 0, addr, query, response);
+		query_set_reply(reply_flags, 0, addr, query, response, record->force_reply);
 
 		// Further checks if this is an IP address
 		if(addr)
@@ -2205,7 +2762,7 @@ static void FTL_reply(const unsigned int flags, const char *name, const union al
 			query_set_dnssec(query, DNSSEC_INSECURE);
 
 		// Save reply type and update individual reply counters
-		query_set_reply(flags, 0, addr, query, response);
+		query_set_reply(flags, 0, addr, query, response, record->force_reply);
 	}
 	else if(isExactMatch && !query->flags.complete)
 	{
@@ -2220,10 +2777,8 @@ static void FTL_reply(const unsigned int flags, const char *name, const union al
 	{
 		// DNSSEC proxy mode is enabled. Interpret AD flag
 		// and set DNSSEC status accordingly
-		query_set_dnssec(query, adbit ? DNSSEC_SECURE : DNSSEC_INSECURE);
+		query_set_dnssec(query, record->adbit ? DNSSEC_SECURE : DNSSEC_INSECURE);
 	}
-
-	unlock_shm();
 }
 
 static enum query_status detect_blocked_IP(const unsigned short flags, const union all_addr *addr, const queriesData *query, const domainsData *domain)
@@ -2241,7 +2796,7 @@ static enum query_status detect_blocked_IP(const unsigned short flags, const uni
 		// Skip replies which originated locally. Otherwise, we would
 		// count gravity.list blocked queries as externally blocked.
 		// Also: Do not mark responses of PTR requests as externally blocked.
-		if(config.debug & DEBUG_QUERIES)
+		if(debug_enabled(DEBUG_QUERIES))
 		{
 			const char *cause = (flags & F_HOSTS) ? "origin is HOSTS" : "query is PTR";
 			logg("Skipping detection of external blocking IP for ID %i as %s", query->id, cause);
@@ -2260,7 +2815,7 @@ static enum query_status detect_blocked_IP(const unsigned short flags, const uni
 	// Check for IP block 146.112.61.104 - 146.112.61.110
 	if((flags & F_IPV4) && ipv4Addr >= 0x92703d68 && ipv4Addr <= 0x92703d6e)
 	{
-		if(config.debug & DEBUG_QUERIES)
+		if(debug_enabled(DEBUG_QUERIES))
 		{
 			char answer[ADDRSTRLEN]; answer[0] = '\0';
 			inet_ntop(AF_INET, addr, answer, ADDRSTRLEN);
@@ -2278,7 +2833,7 @@ static enum query_status detect_blocked_IP(const unsigned short flags, const uni
 	        addr->addr6.s6_addr32[2] == 0xffff0000 &&
 	        ipv6Addr >= 0x92703d68 && ipv6Addr <= 0x92703d6e)
 	{
-		if(config.debug & DEBUG_QUERIES)
+		if(debug_enabled(DEBUG_QUERIES))
 		{
 			char answer[ADDRSTRLEN]; answer[0] = '\0';
 			inet_ntop(AF_INET6, addr, answer, ADDRSTRLEN);
@@ -2295,7 +2850,7 @@ static enum query_status detect_blocked_IP(const unsigned short flags, const uni
 	// nothing is reachable under these addresses
 	else if(flags & F_IPV4 && ipv4Addr == 0)
 	{
-		if(config.debug & DEBUG_QUERIES)
+		if(debug_enabled(DEBUG_QUERIES))
 		{
 			logg("Upstream responded with 0.0.0.0, ID %i:\n\t\"%s\" -> \"0.0.0.0\"",
 			     query->id, getstr(domain->domainpos));
@@ -2310,7 +2865,7 @@ static enum query_status detect_blocked_IP(const unsigned short flags, const uni
 	        addr->addr6.s6_addr32[2] == 0 &&
 	        addr->addr6.s6_addr32[3] == 0)
 	{
-		if(config.debug & DEBUG_QUERIES)
+		if(debug_enabled(DEBUG_QUERIES))
 		{
 			logg("Upstream responded with ::, ID %i:\n\t\"%s\" -> \"::\"",
 			     query->id, getstr(domain->domainpos));
@@ -2338,7 +2893,7 @@ static void query_blocked(queriesData* query, domainsData* domain, clientsData*
 		if(upstream != NULL)
 		{
 			const int timeidx = getOverTimeID(query->timestamp);
-			upstream->overTime[timeidx]--;
+			overTime_add(&upstream->overTime, timeidx, -1);
 		}
 	}
 	else if(is_blocked(query->status))
@@ -2351,30 +2906,56 @@ static void query_blocked(queriesData* query, domainsData* domain, clientsData*
 	{
 		// Count as blocked query
 		if(domain != NULL)
+		{
 			domain->blockedcount++;
+			update_domain_leaderboards(query->domainID);
+		}
 		if(client != NULL)
 			change_clientcount(client, 0, 1, -1, 0);
 
 		query->flags.blocked = true;
+		query_remember_blocked(query);
 	}
 
 	// Update status
 	query_set_status(query, new_status);
+	FTL_PROBE3(query__blocked, get_queryID(query), getDomainString(query), new_status);
 }
 
 static void FTL_dnssec(const char *arg, const union all_addr *addr, const int id, const char* file, const int line)
 {
 	// Process DNSSEC result for a domain
+	struct hook_record record = { .type = HOOK_DNSSEC, .id = id };
+	capture_state(&record, addr);
 
-	// Lock shared memory
-	lock_shm();
+	// Iterate through possible values
+	if(strcmp(arg, "SECURE") == 0)
+		record.dnssec = DNSSEC_SECURE;
+	else if(strcmp(arg, "INSECURE") == 0)
+		record.dnssec = DNSSEC_INSECURE;
+	else if(strcmp(arg, "BOGUS") == 0)
+		record.dnssec = DNSSEC_BOGUS;
+	else if(strcmp(arg, "ABANDONED") == 0)
+		record.dnssec = DNSSEC_ABANDONED;
+	else
+	{
+		logg("***** Ignored unknown DNSSEC status \"%s\"", arg);
+		return;
+	}
+
+	dispatch_hook(&record, NULL, arg, file, line);
+}
+
+static void apply_dnssec(const struct hook_record *record, const char *arg, const char *file, const int line)
+{
+	const int id = record->id;
+	const union all_addr *addr = record->has_addr ? &record->addr : NULL;
 
 	// Search for corresponding query identified by ID
 	const int queryID = findQueryID(id);
 	if(queryID < 0)
 	{
 		// This may happen e.g. if the original query was an unhandled query type
-		unlock_shm();
 		return;
 	}
 
@@ -2383,12 +2964,11 @@ static void FTL_dnssec(const char *arg, const union all_addr *addr, const int id
 	if(query == NULL)
 	{
 		// Memory error, skip this DNSSEC details
-		unlock_shm();
 		return;
 	}
 
 	// Debug logging
-	if(config.debug & DEBUG_QUERIES)
+	if(debug_enabled(DEBUG_QUERIES))
 	{
 		// Get domain pointer
 		const domainsData* domain = getDomain(query->domainID, true);
@@ -2402,20 +2982,7 @@ static void FTL_dnssec(const char *arg, const union all_addr *addr, const int id
 	if(addr && addr->log.ede != EDE_UNSET)
 		query->ede = addr->log.ede;
 
-	// Iterate through possible values
-	if(strcmp(arg, "SECURE") == 0)
-		query_set_dnssec(query, DNSSEC_SECURE);
-	else if(strcmp(arg, "INSECURE") == 0)
-		query_set_dnssec(query, DNSSEC_INSECURE);
-	else if(strcmp(arg, "BOGUS") == 0)
-		query_set_dnssec(query, DNSSEC_BOGUS);
-	else if(strcmp(arg, "ABANDONED") == 0)
-		query_set_dnssec(query, DNSSEC_ABANDONED);
-	else
-		logg("***** Ignored unknown DNSSEC status \"%s\"", arg);
-
-	// Unlock shared memory
-	unlock_shm();
+	query_set_dnssec(query, record->dnssec);
 }
 
 static void FTL_upstream_error(const union all_addr *addr, const unsigned int flags, const int id, const char* file, const int line)
@@ -2429,18 +2996,29 @@ static void FTL_upstream_error(const union all_addr *addr, const unsigned int fl
 		return;
 
 	// Record response time before queuing for the lock
-	struct timeval response;
-	gettimeofday(&response, 0);
+	struct hook_record record = { .type = HOOK_UPSTREAM_ERROR, .flags = flags, .id = id };
+	capture_state(&record, addr);
 
-	// Lock shared memory
-	lock_shm();
+	// Reset last_server
+	memset(&last_server, 0, sizeof(last_server));
+
+	// Write the packets leading to this error (if enabled)
+	pktdump_trigger();
+
+	dispatch_hook(&record, NULL, NULL, file, line);
+}
+
+static void apply_upstream_error(const struct hook_record *record, const char *file, const int line)
+{
+	const unsigned int flags = record->flags;
+	const int id = record->id;
+	const union all_addr *addr = &record->addr;
 
 	// Search for corresponding query identified by ID
 	const int queryID = findQueryID(id);
 	if(queryID < 0)
 	{
 		// This may happen e.g. if the original query was an unhandled query type
-		unlock_shm();
 		return;
 	}
 
@@ -2449,12 +3027,19 @@ static void FTL_upstream_error(const union all_addr *addr, const unsigned int fl
 	if(query == NULL)
 	{
 		// Memory error, skip this query
-		unlock_shm();
 		return;
 	}
 
 	// Update upstream server if necessary
-	update_upstream(query, id);
+	update_upstream(query, &record->server, id);
+
+	// Upstream errors lower the score of the upstream server
+	if(!(flags & F_CONFIG) && query->upstreamID > -1)
+	{
+		upstreamsData *upstream = getUpstream(query->upstreamID, true);
+		if(upstream != NULL)
+			score_upstream(upstream, 0, true);
+	}
 
 	// Translate dnsmasq's rcode into something we can use
 	const char *rcodestr = NULL;
@@ -2479,11 +3064,8 @@ static void FTL_upstream_error(const union all_addr *addr, const unsigned int fl
 			break;
 	}
 
-	// Get EDNS data (if available)
-	ednsData *edns = getEDNS();
-
 	// Debug logging
-	if(config.debug & DEBUG_QUERIES)
+	if(debug_enabled(DEBUG_QUERIES))
 	{
 		// Get domain pointer
 		const domainsData* domain = getDomain(query->domainID, true);
@@ -2501,7 +3083,7 @@ static void FTL_upstream_error(const union all_addr *addr, const unsigned int fl
 			logg("**** local error (nowhere to forward to): %s is %s (ID %i, %s:%i)",
 			     domainname, rcodestr, id, file, line);
 		}
-		else if(last_server.sa.sa_family == 0)
+		else if(record->server.sa.sa_family == 0)
 		{
 			// Log error reply from unknown source
 			logg("**** got error reply: %s is %s (ID %i, %s:%i)",
@@ -2511,7 +3093,7 @@ static void FTL_upstream_error(const union all_addr *addr, const unsigned int fl
 		{
 			char ip[ADDRSTRLEN+1] = { 0 };
 			in_port_t port = 0;
-			mysockaddr_extract_ip_port(&last_server, ip, &port);
+			mysockaddr_extract_ip_port((union mysockaddr*)&record->server, ip, &port);
 			// Log server which replied to our request
 			logg("**** got error reply from %s#%d: %s is %s (ID %i, %s:%i)",
 			     ip, port, domainname, rcodestr, id, file, line);
@@ -2528,15 +3110,15 @@ static void FTL_upstream_error(const union all_addr *addr, const unsigned int fl
 			logg("     EDE: %s (%d)", edestr(addr->log.ede), addr->log.ede);
 		}
 
-		if(edns != NULL && edns->ede != EDE_UNSET)
+		if(record->edns_ede != EDE_UNSET)
 		{
-			query->ede = edns->ede;
-			logg("     EDE: %s (%d)", edestr(edns->ede), edns->ede);
+			query->ede = record->edns_ede;
+			logg("     EDE: %s (%d)", edestr(record->edns_ede), record->edns_ede);
 		}
 	}
 	// Check EDNS EDE for DNSSEC status in DNSSEC proxy mode
 	if(option_bool(OPT_DNSSEC_PROXY) &&
-	   edns && edns->ede >= EDE_DNSSEC_BOGUS && edns->ede <= EDE_NO_NSEC)
+	   record->edns_ede >= EDE_DNSSEC_BOGUS && record->edns_ede <= EDE_NO_NSEC)
 	{
 		// DNSSEC proxy mode is enabled and we received a valid DNSSEC
 		// status from the upstream server through ENDS EDE. We need to
@@ -2544,26 +3126,25 @@ static void FTL_upstream_error(const union all_addr *addr, const unsigned int fl
 		query_set_dnssec(query, DNSSEC_BOGUS);
 	}
 	// Set query reply
-	query_set_reply(0, reply, addr, query, response);
-
-	// Reset last_server
-	memset(&last_server, 0, sizeof(last_server));
-
-	// Unlock shared memory
-	unlock_shm();
+	query_set_reply(0, reply, addr, query, record->response, record->force_reply);
 }
 
 static void FTL_mark_externally_blocked(const int id, const char* file, const int line)
 {
-	// Lock shared memory
-	lock_shm();
+	struct hook_record record = { .type = HOOK_EXTERNALLY_BLOCKED, .id = id };
+	capture_state(&record, NULL);
+	dispatch_hook(&record, NULL, NULL, file, line);
+}
+
+static void apply_externally_blocked(const struct hook_record *record, const char *file, const int line)
+{
+	const int id = record->id;
 
 	// Search for corresponding query identified by ID
 	const int queryID = findQueryID(id);
 	if(queryID < 0)
 	{
 		// This may happen e.g. if the original query was an unhandled query type
-		unlock_shm();
 		return;
 	}
 
@@ -2572,7 +3153,6 @@ static void FTL_mark_externally_blocked(const int id, const char* file, const in
 	if(query == NULL)
 	{
 		// Memory error, skip this query
-		unlock_shm();
 		return;
 	}
 
@@ -2581,32 +3161,24 @@ static void FTL_mark_externally_blocked(const int id, const char* file, const in
 	if(domain == NULL)
 	{
 		// Memory error, skip this query
-		unlock_shm();
 		return;
 	}
 
 	// Possible debugging information
-	if(config.debug & DEBUG_QUERIES)
+	if(debug_enabled(DEBUG_QUERIES))
 	{
 		// Get domain name (domain cannot be NULL here)
 		const char *domainname = getstr(domain->domainpos);
 		logg("**** %s externally blocked (ID %i, FTL %i, %s:%i)", domainname, id, queryID, file, line);
 	}
 
-	// Get response time
-	struct timeval response;
-	gettimeofday(&response, 0);
-
 	// Store query as externally blocked
 	clientsData *client = getClient(query->clientID, true);
 	if(client != NULL)
 		query_blocked(query, domain, client, QUERY_EXTERNAL_BLOCKED_NXRA);
 
 	// Store reply type as replied with NXDOMAIN
-	query_set_reply(F_NEG | F_NXDOMAIN, 0, NULL, query, response);
-
-	// Unlock shared memory
-	unlock_shm();
+	query_set_reply(F_NEG | F_NXDOMAIN, 0, NULL, query, record->response, record->force_reply);
 }
 
 void _FTL_header_analysis(const unsigned char header4, const unsigned int rcode, const struct server *server,
@@ -2668,7 +3240,7 @@ void print_flags(const unsigned int flags)
 static void _query_set_reply(const unsigned int flags, const enum reply_type reply,
                              const union all_addr *addr,
                              queriesData *query, const struct timeval response,
-                             const char *file, const int line)
+                             const enum reply_type force_reply, const char *file, const int line)
 {
 	enum reply_type new_reply = REPLY_UNKNOWN;
 	// If reply is set, we use it directly instead of interpreting the flags
@@ -2679,10 +3251,10 @@ static void _query_set_reply(const unsigned int flags, const enum reply_type rep
 	// else: Iterate through possible values by analyzing both the flags and the addr bits
 	else if(flags & F_NEG ||
 	        (flags & F_NOERR && !(flags & (F_IPV4 | F_IPV6))) || // <-- FTL_make_answer() when no A or AAAA is added
-	        force_next_DNS_reply == REPLY_NXDOMAIN ||
-	        force_next_DNS_reply == REPLY_NODATA)
+	        force_reply == REPLY_NXDOMAIN ||
+	        force_reply == REPLY_NODATA)
 	{
-		if(flags & F_NXDOMAIN || force_next_DNS_reply == REPLY_NXDOMAIN)
+		if(flags & F_NXDOMAIN || force_reply == REPLY_NXDOMAIN)
 			// NXDOMAIN
 			new_reply = REPLY_NXDOMAIN;
 		else
@@ -2698,10 +3270,10 @@ static void _query_set_reply(const unsigned int flags, const enum reply_type rep
 	else if(flags & F_RRNAME)
 		// TXT query
 		new_reply = REPLY_RRNAME;
-	else if((flags & F_RCODE && addr != NULL) || force_next_DNS_reply == REPLY_REFUSED)
+	else if((flags & F_RCODE && addr != NULL) || force_reply == REPLY_REFUSED)
 	{
 		if((addr != NULL && addr->log.rcode == REFUSED)
-		   || force_next_DNS_reply == REPLY_REFUSED )
+		   || force_reply == REPLY_REFUSED )
 		{
 			// REFUSED query
 			new_reply = REPLY_REFUSED;
@@ -2714,7 +3286,7 @@ static void _query_set_reply(const unsigned int flags, const enum reply_type rep
 	}
 	else if(flags & F_KEYTAG)
 		new_reply = REPLY_DNSSEC;
-	else if(force_next_DNS_reply == REPLY_NONE)
+	else if(force_reply == REPLY_NONE)
 	{
 		new_reply = REPLY_NONE;
 	}
@@ -2729,7 +3301,7 @@ static void _query_set_reply(const unsigned int flags, const enum reply_type rep
 		new_reply = REPLY_BLOB;
 	}
 
-	if(config.debug & DEBUG_QUERIES)
+	if(debug_enabled(DEBUG_QUERIES))
 	{
 		const char *path = short_path(file);
 		logg("Set reply to %s (%d) in %s:%d", get_query_reply_str(new_reply), new_reply, path, line);
@@ -2738,20 +3310,33 @@ static void _query_set_reply(const unsigned int flags, const enum reply_type rep
 			     get_query_reply_str(query->reply), get_query_reply_str(new_reply));
 	}
 
+	// The first reply completes a query, send it to live stream subscribers
+	const bool first_reply = query->reply == REPLY_UNKNOWN && new_reply != REPLY_UNKNOWN;
+	if(first_reply)
+		stream_push(get_queryID(query));
+
 	// Subtract from old reply counter
-	counters->reply[query->reply]--;
+	counter_dec(reply[query->reply]);
 	// Add to new reply counter
-	counters->reply[new_reply]++;
+	counter_inc(reply[new_reply]);
 	// Store reply type
 	query->reply = new_reply;
 
 	// Save response time
 	// Skipped internally if already computed
-	set_response_time(query, response);
+	set_response_time(query, response, false);
+
+	// Response times are stored in units of 100 us
+	if(first_reply)
+		FTL_PROBE5(query__reply, get_queryID(query), getDomainString(query),
+		           query->status, new_reply, 100ul*query->response);
 }
 
 void FTL_fork_and_bind_sockets(struct passwd *ent_pw)
 {
+	startup_phase_end("resolver");
+	startup_phase_begin("sockets and threads");
+
 	// Going into daemon mode involves storing the
 	// PID of the generated child process. If FTL
 	// is asked to stay in foreground, we just save
@@ -2777,6 +3362,29 @@ void FTL_fork_and_bind_sockets(struct passwd *ent_pw)
 	listen_telnet(TELNETv6);
 	listen_telnet(TELNET_SOCK);
 
+	// Listen for a new FTL process taking over (if enabled). Sockets handed
+	// over by the previous process which we did not reuse are not needed
+	// anymore
+	handover_listen();
+	handover_close_unused();
+
+	// Create the eventfds used to wake up the threads below
+	init_event_fds();
+
+	// Names answered by FTL itself, dnsmasq's config has been read so the
+	// local domain suffix is known
+	special_names_init(daemon->domain_suffix);
+
+	// Pool of idle upstream TCP connections shared by the TCP workers
+	tcp_pool_init();
+
+	// Start thread writing the log (if enabled)
+	if(init_log_buffer() && pthread_create( &threads[LOGWRITER], &attr, log_thread, NULL ) != 0)
+	{
+		logg("Unable to open log writer thread. Exiting...");
+		exit(EXIT_FAILURE);
+	}
+
 	// Start database thread if database is used
 	if(pthread_create( &threads[DB], &attr, DB_thread, NULL ) != 0)
 	{
@@ -2792,6 +3400,56 @@ void FTL_fork_and_bind_sockets(struct passwd *ent_pw)
 		exit(EXIT_FAILURE);
 	}
 
+	// Start thread applying the deferred statistics (if enabled)
+	init_statsqueue();
+	if(config.defer_statistics && pthread_create( &threads[STATS], &attr, statsqueue_thread, NULL ) != 0)
+	{
+		logg("Unable to open statistics thread. Exiting...");
+		exit(EXIT_FAILURE);
+	}
+
+	// Start thread writing dumped packets (if enabled)
+	if(init_pktdump() && pthread_create( &threads[PCAP], &attr, pktdump_thread, NULL ) != 0)
+	{
+		logg("Unable to open packet dump thread. Exiting...");
+		exit(EXIT_FAILURE);
+	}
+
+	// Start thread writing the binary query log (if enabled)
+	if(init_querylog() && pthread_create( &threads[QUERYLOG], &attr, querylog_thread, NULL ) != 0)
+	{
+		logg("Unable to open query log thread. Exiting...");
+		exit(EXIT_FAILURE);
+	}
+
+	// Start thread sending dnstap messages (if enabled)
+	if(init_dnstap() && pthread_create( &threads[DNSTAP], &attr, dnstap_thread, NULL ) != 0)
+	{
+		logg("Unable to open dnstap thread. Exiting...");
+		exit(EXIT_FAILURE);
+	}
+
+	// Start thread fetching the statistics of federation peers (if configured)
+	if(init_federation() && pthread_create( &threads[FEDERATION], &attr, federation_thread, NULL ) != 0)
+	{
+		logg("Unable to open federation thread. Exiting...");
+		exit(EXIT_FAILURE);
+	}
+
+	// Start thread replicating the gravity database of the primary (if configured)
+	if(init_gravity_replica() && pthread_create( &threads[REPLICA], &attr, gravity_replica_thread, NULL ) != 0)
+	{
+		logg("Unable to open gravity replica thread. Exiting...");
+		exit(EXIT_FAILURE);
+	}
+
+	// Start thread probing idle upstream servers (if enabled)
+	if(init_upstream_probe() && pthread_create( &threads[PROBE], &attr, upstream_probe_thread, NULL ) != 0)
+	{
+		logg("Unable to open upstream probe thread. Exiting...");
+		exit(EXIT_FAILURE);
+	}
+
 	// Start thread that will stay in the background until host names needs to
 	// be resolved. If configuration does not ask for never resolving hostnames
 	// (e.g. on CI builds), the thread is never started)
@@ -2817,6 +3475,12 @@ void FTL_fork_and_bind_sockets(struct passwd *ent_pw)
 			if(chown(FTLfiles.FTL_db, ent_pw->pw_uid, ent_pw->pw_gid) == -1)
 				logg("Setting ownership (%i:%i) of %s failed: %s (%i)",
 				ent_pw->pw_uid, ent_pw->pw_gid, FTLfiles.FTL_db, strerror(errno), errno);
+			if(config.binary_querylog && chown(FTLfiles.querylog, ent_pw->pw_uid, ent_pw->pw_gid) == -1)
+				logg("Setting ownership (%i:%i) of %s failed: %s (%i)",
+				ent_pw->pw_uid, ent_pw->pw_gid, FTLfiles.querylog, strerror(errno), errno);
+			if(handover_fd() != -1 && chown(FTLfiles.handover, ent_pw->pw_uid, ent_pw->pw_gid) == -1)
+				logg("Setting ownership (%i:%i) of %s failed: %s (%i)",
+				ent_pw->pw_uid, ent_pw->pw_gid, FTLfiles.handover, strerror(errno), errno);
 			chown_all_shmem(ent_pw);
 		}
 		else
@@ -2862,6 +3526,14 @@ void FTL_fork_and_bind_sockets(struct passwd *ent_pw)
 			daemon->ptr = pihole_ptr;
 		}
 	}
+
+	// All background threads have been started and applied their own CPU
+	// affinity and scheduling settings, now apply those of the DNS event
+	// loop. DNS and TCP workers forked from here on inherit them
+	thread_sched_apply(SCHED_DNS);
+
+	startup_phase_end("sockets and threads");
+	startup_report();
 }
 
 static char *get_ptrname(struct in_addr *addr)
@@ -2955,19 +3627,236 @@ void getCacheInformation(const int sock)
 	// <immortal> cache records never expire (e.g. from /etc/hosts)
 }
 
+void getDNSMetrics(const int sock)
+{
+	// dnsmasq's own counters in Prometheus text format. The metric names
+	// are derived from dnsmasq's names, e.g. dns-queries-forwarded becomes
+	// pihole_ftl_dnsmasq_dns_queries_forwarded
+	for(int i = 0; i < __METRIC_MAX; i++)
+	{
+		char name[64];
+		snprintf(name, sizeof(name), "pihole_ftl_dnsmasq_%s", get_metric_name(i));
+		for(char *c = name; *c != '\0'; c++)
+			if(*c == '-')
+				*c = '_';
+		ssend(sock, "# TYPE %s untyped\n%s %u\n", name, name, daemon->metrics[i]);
+	}
+
+	ssend(sock, "# HELP pihole_ftl_dnsmasq_cache_size Configured size of the DNS cache\n"
+	            "# TYPE pihole_ftl_dnsmasq_cache_size gauge\n"
+	            "pihole_ftl_dnsmasq_cache_size %i\n", daemon->cachesize);
+
+	// Memory of cached records whose data does not fit into a cache entry
+	// (DNSSEC keys, TXT, SRV, ...). Payloads are kept in runs of
+	// increasing size
+	struct blockdata_stats blocks = { 0 };
+	blockdata_get_stats(&blocks);
+	ssend(sock, "# HELP pihole_ftl_dnsmasq_blockdata_blocks Record data blocks in use\n"
+	            "# TYPE pihole_ftl_dnsmasq_blockdata_blocks gauge\n"
+	            "pihole_ftl_dnsmasq_blockdata_blocks{kind=\"used\"} %zu\n"
+	            "pihole_ftl_dnsmasq_blockdata_blocks{kind=\"max\"} %zu\n"
+	            "pihole_ftl_dnsmasq_blockdata_blocks{kind=\"allocated\"} %zu\n"
+	            "# HELP pihole_ftl_dnsmasq_blockdata_runs Contiguous runs of record data in use by size\n"
+	            "# TYPE pihole_ftl_dnsmasq_blockdata_runs gauge\n",
+	      blocks.blocks, blocks.blocks_hwm, blocks.blocks_alloced);
+	for(unsigned int class = 1; class < BLOCKDATA_CLASSES; class++)
+		if(blocks.runs_hwm[class] > 0)
+			ssend(sock, "pihole_ftl_dnsmasq_blockdata_runs{size=\"%zu\"} %zu\n",
+			      (size_t)64 << (class - 1), blocks.runs[class]);
+	ssend(sock, "# HELP pihole_ftl_dnsmasq_blockdata_slab_bytes Memory allocated for runs of record data\n"
+	            "# TYPE pihole_ftl_dnsmasq_blockdata_slab_bytes gauge\n"
+	            "pihole_ftl_dnsmasq_blockdata_slab_bytes %zu\n"
+	            "# HELP pihole_ftl_dnsmasq_blockdata_slabs_released Slabs released when flushing the cache\n"
+	            "# TYPE pihole_ftl_dnsmasq_blockdata_slabs_released counter\n"
+	            "pihole_ftl_dnsmasq_blockdata_slabs_released %lu\n",
+	      blocks.slab_bytes, blocks.released);
+}
+
+// Get the score of the upstream server behind a dnsmasq server, lower is
+// better. Returns a negative value for servers without any responses yet.
+// Servers without responses to client queries are ranked by the latency of
+// the probes sent to them, if any
+static float server_score(const char *ip, const in_port_t port, const float probe_rtt)
+{
+	// Only look up known upstream servers, they are added when dnsmasq
+	// sends them the first query
+	for(int upstreamID = 0; upstreamID < counters->upstreams; upstreamID++)
+	{
+		const upstreamsData *upstream = getUpstream(upstreamID, true);
+		if(upstream == NULL || upstream->port != port ||
+		   strcmp(getstr(upstream->ippos), ip) != 0)
+			continue;
+
+		if(upstream->rtime_ewma <= 0.0f)
+			break;
+
+		return upstream->rtime_ewma + UPSTREAM_ERROR_PENALTY * upstream->error_ewma;
+	}
+
+	return probe_rtt > 0.0f ? probe_rtt : -1.0f;
+}
+
+// Called by forward_query() when dnsmasq sends a query to the server it
+// considers the fastest one (start) out of the servers [first, last). With
+// UPSTREAM_SCORING enabled, the server with the best score is used instead.
+// Servers without responses so far are left to dnsmasq which still
+// periodically sends queries to all servers to probe them. With
+// UPSTREAM_PROBE_INTERVAL, servers not answering probes are skipped as long
+// as there are others. With UPSTREAM_MAX_INFLIGHT, servers with as many
+// queries awaiting a reply are skipped the same way, the query spills over
+// to the next server. When all of them are at the limit, the one with the
+// fewest queries in flight is used
+int FTL_select_server(const int first, const int last, const int start)
+{
+	const bool probing = init_upstream_probe();
+	const int limit = (int)config.upstream_max_inflight;
+	if((!config.upstream_scoring && !probing && limit == 0) || last - first < 2)
+		return start;
+
+	lock_shm();
+	int best = start, fallback = -1, least = -1;
+	float best_score = -1.0f;
+	bool start_down = false, start_full = false;
+	for(int i = first; i < last; i++)
+	{
+		struct server *serv = daemon->serverarray[i];
+		char ip[ADDRSTRLEN+1] = { 0 };
+		in_port_t port = 53;
+		mysockaddr_extract_ip_port(&serv->addr, ip, &port);
+		strtolower(ip);
+
+		float probe_rtt = 0.0f;
+		if(probing)
+		{
+			upstream_probe_register(&serv->addr.sa, ip, port);
+			if(upstream_probe_state(ip, port, &probe_rtt) == PROBE_DOWN)
+			{
+				if(i == start)
+					start_down = true;
+				continue;
+			}
+		}
+
+		if(limit > 0 && serv->inflight >= limit)
+		{
+			if(least < 0 || serv->inflight < daemon->serverarray[least]->inflight)
+				least = i;
+			if(i == start)
+				start_full = true;
+			continue;
+		}
+
+		if(fallback < 0)
+			fallback = i;
+
+		if(!config.upstream_scoring)
+			continue;
+
+		const float score = server_score(ip, port, probe_rtt);
+		if(score >= 0.0f && (best_score < 0.0f || score < best_score))
+		{
+			best = i;
+			best_score = score;
+		}
+	}
+	unlock_shm();
+
+	// Replace a server marked as down or at its limit by the first one
+	// which is neither, or the least busy one if all are at their limit
+	if((start_down || start_full) && best == start)
+	{
+		if(fallback > -1)
+			best = fallback;
+		else if(least > -1)
+			best = least;
+	}
+
+	if(best != start && debug_enabled(DEBUG_QUERIES))
+	{
+		if(best_score >= 0.0f)
+			logg("Upstream scoring: preferring server %d over %d (score %.1f)",
+			     best, start, best_score);
+		else if(start_full)
+			logg("Upstream limit: preferring server %d over %d (%d queries in flight)",
+			     best, start, daemon->serverarray[start]->inflight);
+		else
+			logg("Upstream probing: preferring server %d over %d (not answering probes)",
+			     best, start);
+	}
+
+	return best;
+}
+
+// Publish the number of queries awaiting a reply from each upstream server
+// (counted by dnsmasq in struct server) in upstreamsData. Called from the
+// main loop of the resolver, the numbers are published at most once per
+// second while they keep changing. Returns the time [ms] until the next call
+// is needed or -1 if everything has been published
+int FTL_upstream_inflight(const time_t now)
+{
+	static time_t last_publish = 0;
+
+	bool changed = false;
+	for(struct server *serv = daemon->servers; serv != NULL; serv = serv->next)
+		if(serv->inflight != serv->inflight_published)
+			changed = true;
+	if(!changed)
+		return -1;
+	if(now == last_publish)
+		return 1000;
+	last_publish = now;
+
+	lock_shm();
+	for(int upstreamID = 0; upstreamID < counters->upstreams; upstreamID++)
+	{
+		upstreamsData *upstream = getUpstream(upstreamID, true);
+		if(upstream != NULL)
+			upstream->inflight = 0;
+	}
+
+	// The same upstream server may be configured for several domains
+	for(struct server *serv = daemon->servers; serv != NULL; serv = serv->next)
+	{
+		serv->inflight_published = serv->inflight;
+		if(serv->inflight <= 0)
+			continue;
+
+		char ip[ADDRSTRLEN+1] = { 0 };
+		in_port_t port = 53;
+		mysockaddr_extract_ip_port(&serv->addr, ip, &port);
+		strtolower(ip);
+
+		for(int upstreamID = 0; upstreamID < counters->upstreams; upstreamID++)
+		{
+			upstreamsData *upstream = getUpstream(upstreamID, true);
+			if(upstream != NULL && upstream->port == port &&
+			   strcmp(getstr(upstream->ippos), ip) == 0)
+			{
+				upstream->inflight += serv->inflight;
+				break;
+			}
+		}
+	}
+	unlock_shm();
+
+	return -1;
+}
+
 void FTL_forwarding_retried(const struct server *serv, const int oldID, const int newID, const bool dnssec)
 {
 	// Forwarding to upstream server failed
 
 	if(oldID == newID)
 	{
-		if(config.debug & DEBUG_QUERIES)
+		if(debug_enabled(DEBUG_QUERIES))
 			logg("%d: Ignoring self-retry", oldID);
 		return;
 	}
 
 	// Lock shared memory
 	lock_shm();
+	// Apply deferred events first to keep the events of each query in order
+	statsqueue_flush();
 
 	// Try to obtain destination IP address if available
 	char dest[ADDRSTRLEN];
@@ -2995,7 +3884,7 @@ void FTL_forwarding_retried(const struct server *serv, const int oldID, const in
 	const int upstreamID = findUpstreamID(upstreamIP, upstreamPort);
 
 	// Possible debugging information
-	if(config.debug & DEBUG_QUERIES)
+	if(debug_enabled(DEBUG_QUERIES))
 	{
 		logg("**** RETRIED%s query %i as %i to %s#%d",
 		     dnssec ? " DNSSEC" : "", oldID, newID,
@@ -3007,7 +3896,10 @@ void FTL_forwarding_retried(const struct server *serv, const int oldID, const in
 
 	// Update counter
 	if(upstream != NULL)
+	{
 		upstream->failed++;
+		score_upstream(upstream, 0, true);
+	}
 
 	// Search for corresponding query identified by ID
 	// Retried DNSSEC queries are ignored, we have to flag themselves (newID)
@@ -3066,7 +3958,8 @@ unsigned int FTL_extract_question_flags(struct dns_header *header, const size_t
 
 		// Extract name from this question
 		char name[MAXDNAME];
-		if (!extract_name(header, qlen, &p, name, 1, 4))
+		if (p == (unsigned char *)(header+1) ? !extract_question_name(header, qlen, &p, name) :
+		                                       !extract_name(header, qlen, &p, name, 1, 4))
 			break; // bad packet, go to fallback solution
 
 		// Extract query type
@@ -3085,7 +3978,7 @@ unsigned int FTL_extract_question_flags(struct dns_header *header, const size_t
 			flags |= F_IPV4;
 
 		// Debug logging if enabled
-		if(config.debug & DEBUG_QUERIES)
+		if(debug_enabled(DEBUG_QUERIES))
 		{
 			char *qtype_str = querystr(NULL, qtype);
 			logg("CNAME header: Question was <IN> %s %s", qtype_str, name);
@@ -3096,7 +3989,7 @@ unsigned int FTL_extract_question_flags(struct dns_header *header, const size_t
 
 	// Fall back to IPv4 (type A) when for the unlikely event that we cannot
 	// find any questions in this header
-	if(config.debug & DEBUG_QUERIES)
+	if(debug_enabled(DEBUG_QUERIES))
 		logg("CNAME header: No valid IN question found in header");
 
 	return F_IPV4;
@@ -3121,7 +4014,9 @@ void FTL_TCP_worker_terminating(bool finished)
 	}
 
 	// Possible debug logging
-	if(config.debug != 0)
+	if(config.debug != 0 && dns_worker != 0)
+		logg("DNS worker %u terminating", dns_worker);
+	else if(config.debug != 0)
 	{
 		const char *reason = finished ? "client disconnected" : "timeout";
 		logg("TCP worker terminating (%s)", reason);
@@ -3138,20 +4033,88 @@ void FTL_TCP_worker_terminating(bool finished)
 	// is running into a timeout while it is still processing something and
 	// still holding a lock.
 	if(!is_our_lock())
+	{
+		// Nothing to close if this fork never needed the database
+		if(!gravityDB_opened)
+			return;
 		lock_shm();
+	}
 	// Close dedicated database connections of this fork
 	gravityDB_close();
 	unlock_shm();
 }
 
+// Called by set_dns_listeners() to poll for a new process taking over. Returns
+// true when the listening sockets have been handed over and must not be read
+// anymore
+bool FTL_handover_poll(void)
+{
+	const int fd = handover_fd();
+	if(fd != -1)
+		poll_listen(fd, POLLIN);
+
+	return handover_draining();
+}
+
+// Called by check_dns_listeners() to pass the listening sockets to a new
+// process taking over
+void FTL_handover_check(void)
+{
+	const int fd = handover_fd();
+	if(fd == -1 || !poll_check(fd, POLLIN))
+		return;
+
+	int fds[HANDOVER_FDS_MAX];
+	unsigned int nfds = 0;
+	for(const struct listener *listener = daemon->listeners; listener; listener = listener->next)
+	{
+		if(listener->fd != -1 && nfds < HANDOVER_FDS_MAX)
+			fds[nfds++] = listener->fd;
+		if(listener->tcpfd != -1 && nfds < HANDOVER_FDS_MAX)
+			fds[nfds++] = listener->tcpfd;
+	}
+
+	handover_accept(fds, nfds);
+}
+
+// Called by the DNS event loop whenever it wakes up. Returns the maximum time
+// until it has to wake up again (-1 = no limit)
+int FTL_handover_drain(void)
+{
+	handover_drain();
+	return handover_draining() ? 100 : -1;
+}
+
+// Called by make_sock() before a new listening socket is created
+int FTL_handover_socket(union mysockaddr *addr, int type)
+{
+	return handover_take_socket(&addr->sa, type);
+}
+
+// Called by close_fds() which would close the sockets handed over by the
+// previous process otherwise
+bool FTL_handover_inherited(int fd)
+{
+	return handover_inherited(fd);
+}
+
 // Called when a (forked) TCP worker is created
 // FTL forked to handle TCP connections with dedicated (forked) workers
 // SQLite3's mentions that carrying an open database connection across a
 // fork() can lead to all kinds of locking problems as SQLite3 was not
 // intended to work under such circumstances. Doing so may easily lead
 // to ending up with a corrupted database.
+// Called by the DNS event loop whenever it wakes up
+void FTL_clock_refresh(void)
+{
+	clock_refresh();
+}
+
 void FTL_TCP_worker_created(const int confd)
 {
+	// TCP workers do not run the event loop
+	clock_invalidate();
+
 	if(dnsmasq_debug)
 	{
 		// Nothing to be done here, TCP worker forking does not happen
@@ -3201,13 +4164,32 @@ void FTL_TCP_worker_created(const int confd)
 		return;
 	}
 
-	// Reopen gravity database handle in this fork as the main process's
-	// handle isn't valid here
+	// There is no statistics thread in this fork
+	disable_statsqueue();
+
+	// Datagrams, replies and dumped packets of the main process are none
+	// of our business
+	FTL_udp_batch_forked();
+	pktdump_forked();
+
+	// The main process's gravity database handle isn't valid here, a new
+	// one is opened on demand by the first lookup which needs it
 	if(config.debug != 0)
-		logg("Reopening Gravity database for this fork");
+		logg("Invalidating Gravity database handle for this fork");
 	gravityDB_forked();
 }
 
+// Called by hash_questions_init()
+bool FTL_fast_question_hash(void)
+{
+	return config.fast_question_hash;
+}
+
+unsigned int FTL_lease_write_delay(void)
+{
+	return config.lease_write_delay;
+}
+
 bool FTL_unlink_DHCP_lease(const char *ipaddr)
 {
 	struct dhcp_lease *lease;
@@ -3236,8 +4218,10 @@ bool FTL_unlink_DHCP_lease(const char *ipaddr)
 	{
 		// Unlink the lease for dnsmasq's database
 		lease_prune(lease, now);
-		// Update the lease file
+		// Update the lease file. We are not running in dnsmasq's main
+		// loop, it would not notice a deferred write (LEASE_WRITE_DELAY)
 		lease_update_file(now);
+		lease_flush(now, true);
 		// Argument force == 0 ensures the DNS records are only updated
 		// when unlinking the lease above actually changed something
 		// (variable lease.c:dns_dirty is used here)
@@ -3255,6 +4239,8 @@ void FTL_query_in_progress(const int id)
 
 	// Lock shared memory
 	lock_shm();
+	// Apply deferred events first to keep the events of each query in order
+	statsqueue_flush();
 
 	// Search for corresponding query identified by ID
 	const int queryID = findQueryID(id);
@@ -3275,7 +4261,7 @@ void FTL_query_in_progress(const int id)
 	}
 
 	// Debug logging
-	if(config.debug & DEBUG_QUERIES)
+	if(debug_enabled(DEBUG_QUERIES))
 	{
 		// Get domain pointer
 		const domainsData* domain = getDomain(query->domainID, true);
@@ -3308,6 +4294,8 @@ void FTL_multiple_replies(const int id, int *firstID)
 
 	// Lock shared memory
 	lock_shm();
+	// Apply deferred events first to keep the events of each query in order
+	statsqueue_flush();
 
 	// Search for corresponding query identified by ID
 	const int queryID = findQueryID(id);
@@ -3344,7 +4332,7 @@ void FTL_multiple_replies(const int id, int *firstID)
 	}
 
 	// Debug logging
-	if(config.debug & DEBUG_QUERIES)
+	if(debug_enabled(DEBUG_QUERIES))
 	{
 		logg("**** sending reply %d also to %d", *firstID, queryID);
 	}
@@ -3353,6 +4341,7 @@ void FTL_multiple_replies(const int id, int *firstID)
 	duplicated_query->reply = source_query->reply;
 	duplicated_query->dnssec = source_query->dnssec;
 	duplicated_query->flags.complete = true;
+	query_update_inflight(duplicated_query);
 	duplicated_query->CNAME_domainID = source_query->CNAME_domainID;
 
 	// The original query may have been blocked during CNAME inspection,
@@ -3410,18 +4399,23 @@ static void _query_set_dnssec(queriesData *query, const enum dnssec_status dnsse
 int check_struct_sizes(void)
 {
 	int result = 0;
-	result += check_one_struct("ConfigStruct", sizeof(ConfigStruct), 112, 104);
-	result += check_one_struct("queriesData", sizeof(queriesData), 56, 44);
-	result += check_one_struct("upstreamsData", sizeof(upstreamsData), 616, 604);
-	result += check_one_struct("clientsData", sizeof(clientsData), 672, 648);
-	result += check_one_struct("domainsData", sizeof(domainsData), 24, 20);
-	result += check_one_struct("DNSCacheData", sizeof(DNSCacheData), 16, 16);
+	result += check_one_struct("ConfigStruct", sizeof(ConfigStruct), 280, 248);
+	result += check_one_struct("queriesData", sizeof(queriesData), 60, 60);
+	result += check_one_struct("upstreamsData", sizeof(upstreamsData), 760, 736);
+	result += check_one_struct("clientsData", sizeof(clientsData), 520, 468);
+	result += check_one_struct("domainsData", sizeof(domainsData), 64, 60);
+	result += check_one_struct("DNSCacheData", sizeof(DNSCacheData), 24, 24);
+	result += check_one_struct("verdictCacheData", sizeof(verdictCacheData), 20, 20);
 	result += check_one_struct("ednsData", sizeof(ednsData), 76, 76);
 	result += check_one_struct("overTimeData", sizeof(overTimeData), 32, 24);
-	result += check_one_struct("regexData", sizeof(regexData), 64, 48);
-	result += check_one_struct("SharedMemory", sizeof(SharedMemory), 24, 12);
-	result += check_one_struct("ShmSettings", sizeof(ShmSettings), 16, 16);
-	result += check_one_struct("countersStruct", sizeof(countersStruct), 248, 248);
+	result += check_one_struct("regexData", sizeof(regexData), 88, 68);
+	result += check_one_struct("SharedMemory", sizeof(SharedMemory), 32, 16);
+	result += check_one_struct("ShmSettings", sizeof(ShmSettings), 280, 280);
+	result += check_one_struct("countersStruct", sizeof(countersStruct), 172, 172);
+	result += check_one_struct("queryCountersStruct", sizeof(queryCountersStruct), 18816, 18816);
+	result += check_one_struct("leaderboardsStruct", sizeof(leaderboardsStruct), 2096, 2096);
+	result += check_one_struct("streamRingStruct", sizeof(streamRingStruct), 16392, 16392);
+	result += check_one_struct("timeseriesStruct", sizeof(timeseriesStruct), 42336, 42336);
 	result += check_one_struct("sqlite3_stmt_vec", sizeof(sqlite3_stmt_vec), 32, 16);
 
 	if(result == 0)
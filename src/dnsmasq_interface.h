@@ -12,12 +12,49 @@
 
 // Including stdbool.h here as it is required for defining the boolean prototype of FTL_new_query
 #include <stdbool.h>
+// struct msghdr
+#include <sys/socket.h>
 
 #include "edns0.h"
 
 extern unsigned char* pihole_privacylevel;
 enum protocol { TCP, UDP, INTERNAL };
 
+// Names which do not fit into a hook record are processed synchronously
+#define HOOK_NAMELEN 128
+
+enum hook_type {
+	HOOK_FORWARDED,
+	HOOK_REPLY,
+	HOOK_DNSSEC,
+	HOOK_UPSTREAM_ERROR,
+	HOOK_EXTERNALLY_BLOCKED
+} __attribute__ ((packed));
+
+// Everything the statistics of a dnsmasq event depend on. The fields are
+// captured when the event happens as the fork-private state they are taken
+// from (e.g. the server which sent the most recent reply) may have changed
+// when the record is applied to the shared memory (see statsqueue.c)
+struct hook_record {
+	enum hook_type type;
+	bool has_addr;
+	bool has_name;
+	bool adbit;
+	bool bogus;
+	unsigned char dnssec;
+	unsigned char force_reply;
+	unsigned short port;
+	unsigned int flags;
+	int id;
+	int edns_ede;
+	struct timeval response;
+	// Monotonic time of the event (see query_stage_now())
+	uint32_t stage_ts;
+	union all_addr addr;
+	union mysockaddr server;
+	char name[HOOK_NAMELEN];
+};
+
 void FTL_hook(unsigned int flags, const char *name, union all_addr *addr, char *arg, int id, unsigned short type, const char* file, const int line);
 
 #define FTL_iface(iface, addr, addrfamily) _FTL_iface(iface, addr, addrfamily, __FILE__, __LINE__)
@@ -30,12 +67,15 @@ bool _FTL_new_query(const unsigned int flags, const char *name, union mysockaddr
 void _FTL_header_analysis(const unsigned char header4, const unsigned int rcode, const struct server *server, const int id, const char* file, const int line);
 
 void FTL_forwarding_retried(const struct server *server, const int oldID, const int newID, const bool dnssec);
+int FTL_select_server(const int first, const int last, const int start);
 
 #define FTL_make_answer(header, limit, len, ede) _FTL_make_answer(header, limit, len, ede, __FILE__, __LINE__)
 size_t _FTL_make_answer(struct dns_header *header, char *limit, const size_t len, int *ede, const char* file, const int line);
 
 #define FTL_CNAME(dst, src, id) _FTL_CNAME(dst, src, id, __FILE__, __LINE__)
 bool _FTL_CNAME(const char *dst, const char *src, const int id, const char* file, const int line);
+#define FTL_CNAME_chain(header, qlen, id) _FTL_CNAME_chain(header, qlen, id, __FILE__, __LINE__)
+void _FTL_CNAME_chain(struct dns_header *header, const size_t qlen, const int id, const char* file, const int line);
 
 unsigned int FTL_extract_question_flags(struct dns_header *header, const size_t qlen);
 void FTL_query_in_progress(const int id);
@@ -45,8 +85,72 @@ void FTL_dnsmasq_reload(void);
 void FTL_fork_and_bind_sockets(struct passwd *ent_pw);
 void FTL_TCP_worker_created(const int confd);
 void FTL_TCP_worker_terminating(bool finished);
+void FTL_clock_refresh(void);
+bool FTL_handover_poll(void);
+void FTL_handover_check(void);
+int FTL_handover_drain(void);
+int FTL_upstream_inflight(const time_t now);
+int FTL_handover_socket(union mysockaddr *addr, int type);
+bool FTL_handover_inherited(int fd) __attribute__((pure));
 
 bool FTL_unlink_DHCP_lease(const char *ipaddr);
+bool FTL_fast_question_hash(void) __attribute__((pure));
+unsigned int FTL_lease_write_delay(void) __attribute__((pure));
+
+// Defined in udpbatch.c
+ssize_t FTL_recvmsg(int fd, struct msghdr *msg);
+bool FTL_recvmsg_pending(int fd) __attribute__((pure));
+void FTL_udp_batch_start(void);
+bool FTL_sendmsg_queue(int fd, const struct msghdr *msg);
+void FTL_udp_batch_flush(void);
+
+// Defined in workers.c
+int FTL_dns_worker_slot(void);
+void FTL_dns_worker_forked(const int slot, const pid_t pid);
+void FTL_dns_worker_exited(const pid_t pid);
+void FTL_dns_worker_init(const int slot);
+bool FTL_dns_worker_stale(void);
+void FTL_dns_worker_exit(void) __attribute__((noreturn));
+void FTL_restart_dns_workers(void);
+
+// Defined in prefetch.c
+void FTL_prefetch_check(const long ttl);
+bool FTL_prefetch_pending(void);
+
+// Defined in cacheadapt.c
+void FTL_cache_adapt(const time_t now);
+
+// Defined in warmup.c
+int FTL_verdict_warmup(void);
+
+// Defined in tcppool.c
+int FTL_tcp_pool_get(const struct server *serv);
+bool FTL_tcp_pool_put(const struct server *serv, const int fd);
+void FTL_tcp_pool_expire(const time_t now);
+void FTL_TCP_upstream_reply(const union mysockaddr *addr, const bool reused);
+
+// Defined in setcache.c
+bool FTL_set_recently_added(const char *setname, const bool nft, const union all_addr *addr,
+                            const int flags, const time_t now) __attribute__((pure));
+void FTL_set_added(const char *setname, const bool nft, const union all_addr *addr,
+                   const int flags, const unsigned long ttl, const time_t now);
+
+// Defined in sigcache.c
+int FTL_dnssec_verify(struct blockdata *key_data, unsigned int key_len, unsigned char *sig, size_t sig_len,
+                      unsigned char *digest, size_t digest_len, int algo, const unsigned long ttl,
+                      const time_t now);
+
+// Defined in nseccache.c
+void FTL_nsec_store(struct dns_header *header, const size_t plen, const time_t now);
+void FTL_nsec_synthesize(struct dns_header *header, const size_t plen, const time_t now);
+
+// Defined in dnscache.c
+void FTL_restore_dns_cache(const time_t now);
+
+// Defined in pktdump.c
+bool FTL_dump_packet(const struct iovec *iov, const int iovcnt);
+
+void FTL_apply_hook(const struct hook_record *record);
 
 // defined in src/dnsmasq/cache.c
 extern char *querystr(char *desc, unsigned short type);
@@ -0,0 +1,556 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  dnstap output
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "dnstap.h"
+#include "config.h"
+#include "log.h"
+// lock_shm_shared(), seq_queryID(), getstr()
+#include "shmem.h"
+// getDomainString(), get_query_status_str()
+#include "datastructure.h"
+// hostname()
+#include "daemon.h"
+// killed, thread_names[]
+#include "signals.h"
+// wait_for_event()
+#include "events.h"
+// stream_ring
+#include "api/stream.h"
+#include <stdatomic.h>
+#include <sys/un.h>
+#include <netdb.h>
+// thread_sched_apply()
+#include "threadsched.h"
+
+// With DNSTAP, the dnstap thread sends a CLIENT_QUERY and a CLIENT_RESPONSE
+// message per completed query to a collector listening on DNSTAPSOCKET (a unix
+// socket or host:port for TCP) using bidirectional Frame Streams. Like the
+// binary query log, it reads the queries completed since its last run from the
+// ring of the live query stream (which is also filled by the TCP and DNS
+// workers) so nothing is done in the DNS hot path.
+//
+// FTL does not keep the DNS packets, the messages contain a query with the
+// question only and a response with the question and the response code. The
+// verdict of FTL is sent in the "extra" field of each message as text, e.g.
+//
+//   status=GRAVITY list=12 groups=0,3
+//
+// The messages are queued in a fixed buffer which is sent without blocking.
+// When the collector does not keep up (or is not connected), new messages are
+// dropped. Queries of maximum privacy level are not sent
+
+#define DNSTAP_CONTENT_TYPE "protobuf:dnstap.Dnstap"
+#define DNSTAP_BUFFER 262144u
+// Maximum size of one frame (length and protobuf message)
+#define DNSTAP_FRAME_MAX 2048u
+
+// Frame Streams control frames
+#define FSTRM_CONTROL_ACCEPT 0x01
+#define FSTRM_CONTROL_START 0x02
+#define FSTRM_CONTROL_STOP 0x03
+#define FSTRM_CONTROL_READY 0x04
+#define FSTRM_CONTROL_FIELD_CONTENT_TYPE 0x01
+
+// Field numbers and enums of dnstap.proto
+enum dnstap_field { DNSTAP_IDENTITY = 1, DNSTAP_VERSION = 2, DNSTAP_EXTRA = 3, DNSTAP_MESSAGE = 14, DNSTAP_TYPE = 15 };
+enum message_field { MSG_TYPE = 1, MSG_FAMILY = 2, MSG_QUERY_ADDRESS = 4, MSG_QUERY_TIME_SEC = 8,
+                     MSG_QUERY_TIME_NSEC = 9, MSG_QUERY_MESSAGE = 10, MSG_RESPONSE_TIME_SEC = 12,
+                     MSG_RESPONSE_TIME_NSEC = 13, MSG_RESPONSE_MESSAGE = 14 };
+enum { TYPE_MESSAGE = 1, CLIENT_QUERY = 5, CLIENT_RESPONSE = 6, FAMILY_INET = 1, FAMILY_INET6 = 2 };
+
+static int fd = -1;
+static time_t next_connect = 0;
+static const char *identity = NULL, *version = NULL;
+static unsigned char out[DNSTAP_BUFFER];
+static size_t out_used = 0u, out_sent = 0u;
+static _Atomic unsigned long queued = 0ul, dropped = 0ul, connects = 0ul;
+
+// Protocol buffer encoder writing to a fixed buffer
+struct pb {
+	unsigned char *p;
+	unsigned char *end;
+};
+
+static void pb_varint(struct pb *b, uint64_t value)
+{
+	do
+	{
+		if(b->p >= b->end)
+			return;
+		*b->p++ = (value & 0x7f) | (value > 0x7f ? 0x80 : 0);
+		value >>= 7;
+	} while(value > 0);
+}
+
+static void pb_uint(struct pb *b, const unsigned int field, const uint64_t value)
+{
+	pb_varint(b, field << 3);
+	pb_varint(b, value);
+}
+
+static void pb_fixed32(struct pb *b, const unsigned int field, const uint32_t value)
+{
+	pb_varint(b, field << 3 | 5);
+	for(unsigned int i = 0; i < 4 && b->p < b->end; i++)
+		*b->p++ = (value >> (8 * i)) & 0xff;
+}
+
+static void pb_bytes(struct pb *b, const unsigned int field, const void *data, const size_t len)
+{
+	pb_varint(b, field << 3 | 2);
+	pb_varint(b, len);
+	if(b->p + len > b->end)
+	{
+		b->p = b->end;
+		return;
+	}
+	memcpy(b->p, data, len);
+	b->p += len;
+}
+
+static void put_be32(unsigned char *p, const uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = (value >> 16) & 0xff;
+	p[2] = (value >> 8) & 0xff;
+	p[3] = value & 0xff;
+}
+
+// Encode a DNS message with the question of the query, returns its length
+static size_t dns_message(unsigned char *buf, const size_t size, const char *domain,
+                          const uint16_t qtype, const uint16_t flags)
+{
+	if(size < 12u + 256u + 4u)
+		return 0u;
+
+	memset(buf, 0, 12);
+	buf[2] = flags >> 8;
+	buf[3] = flags & 0xff;
+	buf[5] = 1; // QDCOUNT
+
+	unsigned char *p = buf + 12;
+	const char *label = domain;
+	while(*label != '\0' && strcmp(label, ".") != 0)
+	{
+		const char *dot = strchr(label, '.');
+		const size_t len = dot != NULL ? (size_t)(dot - label) : strlen(label);
+		if(len == 0 || len > 63 || (p - buf - 12) + 1 + len > 254)
+			return 0u;
+		*p++ = (unsigned char)len;
+		memcpy(p, label, len);
+		p += len;
+		label += len + (dot != NULL ? 1 : 0);
+	}
+	*p++ = 0;
+	*p++ = qtype >> 8;
+	*p++ = qtype & 0xff;
+	*p++ = 0;
+	*p++ = 1; // class IN
+	return p - buf;
+}
+
+static uint16_t __attribute__((const)) reply_rcode(const enum reply_type reply)
+{
+	switch(reply)
+	{
+		case REPLY_NXDOMAIN:
+			return 3;
+		case REPLY_SERVFAIL:
+			return 2;
+		case REPLY_REFUSED:
+			return 5;
+		case REPLY_NOTIMP:
+			return 4;
+		case REPLY_UNKNOWN:
+		case REPLY_NODATA:
+		case REPLY_CNAME:
+		case REPLY_IP:
+		case REPLY_DOMAIN:
+		case REPLY_RRNAME:
+		case REPLY_OTHER:
+		case REPLY_DNSSEC:
+		case REPLY_NONE:
+		case REPLY_BLOB:
+		case QUERY_REPLY_MAX:
+		default:
+			return 0;
+	}
+}
+
+// Append one frame containing a dnstap message to the output buffer
+static void add_frame(const unsigned char *message, const size_t msglen, const char *extra)
+{
+	struct pb b = { out + out_used + 4u, out + out_used + DNSTAP_FRAME_MAX };
+	pb_bytes(&b, DNSTAP_IDENTITY, identity, strlen(identity));
+	pb_bytes(&b, DNSTAP_VERSION, version, strlen(version));
+	pb_bytes(&b, DNSTAP_EXTRA, extra, strlen(extra));
+	pb_bytes(&b, DNSTAP_MESSAGE, message, msglen);
+	pb_uint(&b, DNSTAP_TYPE, TYPE_MESSAGE);
+
+	if(b.p >= b.end)
+	{
+		atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	const size_t len = b.p - (out + out_used + 4u);
+	put_be32(out + out_used, len);
+	out_used += 4u + len;
+	atomic_fetch_add_explicit(&queued, 1, memory_order_relaxed);
+}
+
+// Add the messages of a query to the output buffer. Has to be called while
+// holding the SHM lock
+static void add_messages(const int queryID)
+{
+	const queriesData *query = getQuery(queryID, true);
+	if(query == NULL || query->privacylevel >= PRIVACY_MAXIMUM)
+		return;
+
+	const char *domain = getDomainString(query);
+	const char *client = getClientIPString(query);
+	const clientsData *clientdata = getClient(query->clientID, true);
+	if(domain == NULL || client == NULL || clientdata == NULL)
+		return;
+
+	// The verdict of FTL
+	int domainlist_id = -1;
+	if(config.privacylevel < PRIVACY_HIDE_DOMAINS)
+	{
+		const DNSCacheData *dns_cache = getDNSCache(findCacheID(query->domainID, query->clientID, query->type, false), true);
+		if(dns_cache != NULL)
+			domainlist_id = dns_cache->domainlist_id;
+	}
+	char extra[256];
+	snprintf(extra, sizeof(extra), "status=%s list=%d groups=%s",
+	         get_query_status_str(query->status), domainlist_id,
+	         clientdata->groupspos != 0 ? getstr(clientdata->groupspos) : "");
+
+	unsigned char addr[16];
+	unsigned int family = 0;
+	size_t addrlen = 0u;
+	if(inet_pton(AF_INET, client, addr) == 1)
+	{
+		family = FAMILY_INET;
+		addrlen = 4u;
+	}
+	else if(inet_pton(AF_INET6, client, addr) == 1)
+	{
+		family = FAMILY_INET6;
+		addrlen = 16u;
+	}
+
+	// Response times are stored in units of 1/10 ms
+	const uint32_t response = query->flags.response_calculated ? query->response : 0u;
+	const uint64_t response_sec = (uint64_t)query->timestamp + response / 10000u;
+	const uint32_t response_nsec = (response % 10000u) * 100000u;
+
+	for(unsigned int type = CLIENT_QUERY; type <= CLIENT_RESPONSE; type++)
+	{
+		unsigned char wire[300], message[512];
+		const size_t wirelen = type == CLIENT_QUERY ?
+			dns_message(wire, sizeof(wire), domain, query->qtype, 0x0100) :
+			dns_message(wire, sizeof(wire), domain, query->qtype, 0x8180 | reply_rcode(query->reply));
+
+		struct pb b = { message, message + sizeof(message) };
+		pb_uint(&b, MSG_TYPE, type);
+		if(family != 0)
+		{
+			pb_uint(&b, MSG_FAMILY, family);
+			pb_bytes(&b, MSG_QUERY_ADDRESS, addr, addrlen);
+		}
+		pb_uint(&b, MSG_QUERY_TIME_SEC, query->timestamp);
+		pb_fixed32(&b, MSG_QUERY_TIME_NSEC, 0u);
+		if(type == CLIENT_QUERY)
+		{
+			if(wirelen > 0)
+				pb_bytes(&b, MSG_QUERY_MESSAGE, wire, wirelen);
+		}
+		else
+		{
+			pb_uint(&b, MSG_RESPONSE_TIME_SEC, response_sec);
+			pb_fixed32(&b, MSG_RESPONSE_TIME_NSEC, response_nsec);
+			if(wirelen > 0)
+				pb_bytes(&b, MSG_RESPONSE_MESSAGE, wire, wirelen);
+		}
+
+		add_frame(message, b.p - message, extra);
+	}
+}
+
+// Write a control frame (with the content type for READY and START)
+static bool send_control(const uint32_t type)
+{
+	unsigned char frame[64];
+	const bool content_type = type == FSTRM_CONTROL_READY || type == FSTRM_CONTROL_START;
+	const size_t len = 4u + (content_type ? 8u + strlen(DNSTAP_CONTENT_TYPE) : 0u);
+
+	put_be32(frame, 0u); // escape
+	put_be32(frame + 4, len);
+	put_be32(frame + 8, type);
+	if(content_type)
+	{
+		put_be32(frame + 12, FSTRM_CONTROL_FIELD_CONTENT_TYPE);
+		put_be32(frame + 16, strlen(DNSTAP_CONTENT_TYPE));
+		memcpy(frame + 20, DNSTAP_CONTENT_TYPE, strlen(DNSTAP_CONTENT_TYPE));
+	}
+
+	return send(fd, frame, 8u + len, MSG_NOSIGNAL) == (ssize_t)(8u + len);
+}
+
+// Receive the ACCEPT frame of the collector
+static bool receive_accept(void)
+{
+	unsigned char header[12], rest[256];
+	if(recv(fd, header, sizeof(header), MSG_WAITALL) != sizeof(header))
+		return false;
+
+	const uint32_t len = (uint32_t)header[4] << 24 | header[5] << 16 | header[6] << 8 | header[7];
+	const uint32_t type = (uint32_t)header[8] << 24 | header[9] << 16 | header[10] << 8 | header[11];
+	if(header[0] != 0 || header[1] != 0 || header[2] != 0 || header[3] != 0 ||
+	   len < 4u || len - 4u > sizeof(rest) || type != FSTRM_CONTROL_ACCEPT)
+		return false;
+
+	return len == 4u || recv(fd, rest, len - 4u, MSG_WAITALL) == (ssize_t)(len - 4u);
+}
+
+static int open_socket(const char *target)
+{
+	// Unix socket
+	if(target[0] == '/')
+	{
+		struct sockaddr_un addr = { .sun_family = AF_UNIX };
+		if(strlen(target) >= sizeof(addr.sun_path))
+		{
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		strcpy(addr.sun_path, target);
+
+		const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(sock > -1 && connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+		{
+			const int err = errno;
+			close(sock);
+			errno = err;
+			return -1;
+		}
+		return sock;
+	}
+
+	// host:port or [IPv6]:port
+	char host[256];
+	const char *colon = strrchr(target, ':');
+	if(colon == NULL || (size_t)(colon - target) >= sizeof(host))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(host, target, colon - target);
+	host[colon - target] = '\0';
+	if(host[0] == '[' && host[strlen(host) - 1] == ']')
+	{
+		memmove(host, host + 1, strlen(host) - 2);
+		host[strlen(host) - 2] = '\0';
+	}
+
+	struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *res = NULL;
+	const int rc = getaddrinfo(host, colon + 1, &hints, &res);
+	if(rc != 0)
+	{
+		logg("WARNING: Cannot resolve dnstap collector %s: %s", target, gai_strerror(rc));
+		errno = EINVAL;
+		return -1;
+	}
+
+	int sock = -1;
+	for(const struct addrinfo *ai = res; ai != NULL && sock < 0; ai = ai->ai_next)
+	{
+		sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if(sock > -1 && connect(sock, ai->ai_addr, ai->ai_addrlen) != 0)
+		{
+			close(sock);
+			sock = -1;
+		}
+	}
+	freeaddrinfo(res);
+	return sock;
+}
+
+// Connect to the collector and start a Frame Streams session
+static void connect_collector(void)
+{
+	next_connect = time(NULL) + DNSTAP_RECONNECT;
+
+	fd = open_socket(FTLfiles.dnstap);
+	if(fd < 0)
+	{
+		if(atomic_load_explicit(&connects, memory_order_relaxed) == 0)
+			logg("WARNING: Cannot connect to dnstap collector %s: %s", FTLfiles.dnstap, strerror(errno));
+		return;
+	}
+
+	// The handshake is done blocking, messages are sent without blocking
+	const struct timeval tv = { 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if(!send_control(FSTRM_CONTROL_READY) || !receive_accept() || !send_control(FSTRM_CONTROL_START))
+	{
+		logg("WARNING: dnstap collector %s did not accept the connection", FTLfiles.dnstap);
+		close(fd);
+		fd = -1;
+		return;
+	}
+
+	out_used = out_sent = 0u;
+	atomic_fetch_add_explicit(&connects, 1, memory_order_relaxed);
+	logg("Connected to dnstap collector %s", FTLfiles.dnstap);
+}
+
+static void disconnect_collector(void)
+{
+	logg("WARNING: Lost connection to dnstap collector %s: %s", FTLfiles.dnstap, strerror(errno));
+	close(fd);
+	fd = -1;
+	out_used = out_sent = 0u;
+}
+
+// Send as much of the output buffer as possible without blocking
+static void flush_output(void)
+{
+	while(fd > -1 && out_sent < out_used)
+	{
+		const ssize_t ret = send(fd, out + out_sent, out_used - out_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret < 0 && errno == EAGAIN)
+			break;
+		if(ret <= 0)
+		{
+			disconnect_collector();
+			return;
+		}
+		out_sent += ret;
+	}
+
+	// Move what is left to the beginning of the buffer
+	if(out_sent == out_used)
+		out_used = out_sent = 0u;
+	else if(out_sent > 0u)
+	{
+		memmove(out, out + out_sent, out_used - out_sent);
+		out_used -= out_sent;
+		out_sent = 0u;
+	}
+}
+
+// Send the messages of all queries completed since pos, returns the new
+// position
+static unsigned int send_messages(unsigned int pos)
+{
+	const unsigned int head = atomic_load_explicit(&stream_ring->head, memory_order_acquire);
+
+	// Count what has already been overwritten or cannot be sent
+	if(head - pos > STREAM_RING_SIZE)
+	{
+		atomic_fetch_add_explicit(&dropped, 2ul * (head - pos - STREAM_RING_SIZE), memory_order_relaxed);
+		pos = head - STREAM_RING_SIZE;
+	}
+	if(fd < 0)
+	{
+		atomic_fetch_add_explicit(&dropped, 2ul * (head - pos), memory_order_relaxed);
+		return head;
+	}
+
+	while(pos != head)
+	{
+		// Drop the remaining messages if the collector does not keep up
+		if(sizeof(out) - out_used < 2u * DNSTAP_FRAME_MAX)
+		{
+			atomic_fetch_add_explicit(&dropped, 2ul * (head - pos), memory_order_relaxed);
+			return head;
+		}
+
+		// Do not hold the lock while sending
+		lock_shm_shared();
+		for(; pos != head && sizeof(out) - out_used >= 2u * DNSTAP_FRAME_MAX; pos++)
+		{
+			const int queryID = seq_queryID(stream_ring->seqs[pos % STREAM_RING_SIZE]);
+			if(queryID > -1)
+				add_messages(queryID);
+		}
+		unlock_shm_shared();
+
+		flush_output();
+		if(fd < 0)
+			return head;
+	}
+
+	return pos;
+}
+
+// Called before the threads are started
+bool init_dnstap(void)
+{
+	if(!config.dnstap)
+		return false;
+
+	identity = strdup(hostname());
+	version = get_FTL_version();
+	if(identity == NULL)
+		return false;
+
+	// Make stream_push() record completed queries
+	atomic_fetch_add(&stream_ring->subscribers, 1);
+	return true;
+}
+
+void *dnstap_thread(void *val)
+{
+	(void)val;
+
+	// Set thread name
+	thread_names[DNSTAP] = "dnstap";
+	prctl(PR_SET_NAME, thread_names[DNSTAP], 0, 0, 0);
+	thread_sched_apply(DNSTAP);
+
+	unsigned int pos = atomic_load_explicit(&stream_ring->head, memory_order_acquire);
+	while(!killed)
+	{
+		if(fd < 0 && time(NULL) >= next_connect)
+			connect_collector();
+
+		pos = send_messages(pos);
+
+		wait_for_event(DNSTAP, DNSTAP_INTERVAL);
+	}
+
+	// End the session, the collector closes the connection
+	if(fd > -1)
+	{
+		flush_output();
+		if(fd > -1 && out_used == 0u)
+			send_control(FSTRM_CONTROL_STOP);
+		if(fd > -1)
+			close(fd);
+		fd = -1;
+	}
+
+	logg("Terminating dnstap thread");
+	return NULL;
+}
+
+void get_dnstap_stats(struct dnstap_stats *stats)
+{
+	stats->queued = atomic_load_explicit(&queued, memory_order_relaxed);
+	stats->dropped = atomic_load_explicit(&dropped, memory_order_relaxed);
+	stats->connects = atomic_load_explicit(&connects, memory_order_relaxed);
+}
@@ -0,0 +1,31 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  dnstap output prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef DNSTAP_H
+#define DNSTAP_H
+
+#include <stdbool.h>
+
+// Interval in which completed queries are sent [milliseconds]
+#define DNSTAP_INTERVAL 100
+
+// Delay before connecting to the collector again [seconds]
+#define DNSTAP_RECONNECT 5
+
+struct dnstap_stats {
+	unsigned long queued;
+	unsigned long dropped;
+	unsigned long connects;
+};
+
+bool init_dnstap(void);
+void *dnstap_thread(void *val);
+void get_dnstap_stats(struct dnstap_stats *stats);
+
+#endif //DNSTAP_H
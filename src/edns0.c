@@ -43,6 +43,122 @@
 
 static ednsData edns = { 0 };
 
+// Options found by FTL_parse_pseudoheaders(). They are only recorded while
+// walking the OPT record, ECS and MAC options are decoded by getEDNS() if FTL
+// actually uses them. The pointers point into dnsmasq's packet buffer, which
+// is not modified before FTL_new_query() calls getEDNS()
+static struct {
+	const unsigned char *ecs;
+	const unsigned char *mac_byte;
+	const unsigned char *mac_text;
+	unsigned short ecs_len;
+} options = { NULL };
+
+static void decode_ecs(const unsigned char *p, const unsigned short optlen)
+{
+	// EDNS(0) CLIENT SUBNET
+	// RFC 7871              Client Subnet in DNS Queries              6.  Option Format
+	//   This protocol uses an EDNS0 [RFC6891] option to include client
+	//   address information in DNS messages.  The option is structured as
+	//   follows:
+	//
+	//                +0 (MSB)                            +1 (LSB)
+	//      +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+	//   0: |                          OPTION-CODE                          |
+	//      +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+	//   2: |                         OPTION-LENGTH                         |
+	//      +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+	//   4: |                            FAMILY                             |
+	//      +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+	if(optlen < 4)
+		return;
+	short family;
+	GETSHORT(family, p);
+	//      +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+	//   6: |     SOURCE PREFIX-LENGTH      |     SCOPE PREFIX-LENGTH       |
+	//      +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+	unsigned char source_netmask = *p++;
+	p++; // We are not interested in the scope prefix-length. It MUST be 0 in queries
+	//      +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+	//   8: |                           ADDRESS...                          /
+	//      +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+	union all_addr addr = {{ 0 }};
+	const size_t addrlen = optlen - 4;
+	if(family == 1 && addrlen <= sizeof(addr.addr4.s_addr)) // IPv4
+		memcpy(&addr.addr4.s_addr, p, addrlen);
+	else if(family == 2 && addrlen <= sizeof(addr.addr6.s6_addr)) // IPv6
+		memcpy(addr.addr6.s6_addr, p, addrlen);
+	else
+		return;
+
+	char ipaddr[ADDRSTRLEN] = { 0 };
+	inet_ntop(family == 1 ? AF_INET : AF_INET6, &addr.addr4.s_addr, ipaddr, sizeof(ipaddr));
+
+	// Only use /32 (IPv4) and /128 (IPv6) addresses
+	if(!(family == 1 && source_netmask == 32) &&
+	   !(family == 2 && source_netmask == 128))
+	{
+		if(config.debug & DEBUG_EDNS0)
+			logg("EDNS(0) CLIENT SUBNET: %s/%u found (IPv%u)",
+			     ipaddr, source_netmask, family == 1 ? 4 : 6);
+		return;
+	}
+
+	// Copy data to edns struct
+	strncpy(edns.client, ipaddr, ADDRSTRLEN);
+	edns.client[ADDRSTRLEN-1] = '\0';
+
+	// Only set the address as useful when it is not the
+	// loopback address of the distant machine (127.0.0.0/8 or ::1)
+	if((family == 1 && (ntohl(addr.addr4.s_addr) & 0xFF000000) == 0x7F000000) ||
+	   (family == 2 && IN6_IS_ADDR_LOOPBACK(&addr.addr6)))
+	{
+		if(config.debug & DEBUG_EDNS0)
+			logg("EDNS(0) CLIENT SUBNET: Skipped %s/%u (IPv%u loopback address)",
+			     ipaddr, source_netmask, family == 1 ? 4 : 6);
+	}
+	else
+	{
+		edns.client_set = true;
+		if(config.debug & DEBUG_EDNS0)
+			logg("EDNS(0) CLIENT SUBNET: %s/%u - OK (IPv%u)",
+			     ipaddr, source_netmask, family == 1 ? 4 : 6);
+	}
+}
+
+static void decode_mac_byte(const unsigned char *p)
+{
+	// EDNS(0) MAC address (BYTE format)
+	memcpy(edns.mac_byte, p, sizeof(edns.mac_byte));
+	print_mac(edns.mac_text, (unsigned char*)edns.mac_byte, sizeof(edns.mac_byte));
+	edns.mac_set = true;
+	if(config.debug & DEBUG_EDNS0)
+		logg("EDNS(0) MAC address (BYTE format): %s", edns.mac_text);
+}
+
+static void decode_mac_text(const unsigned char *p)
+{
+	// EDNS(0) MAC address (TEXT format)
+	memcpy(edns.mac_text, p, 17);
+	edns.mac_text[17] = '\0';
+	if(sscanf(edns.mac_text, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+	          (unsigned char*)&edns.mac_byte[0],
+	          (unsigned char*)&edns.mac_byte[1],
+	          (unsigned char*)&edns.mac_byte[2],
+	          (unsigned char*)&edns.mac_byte[3],
+	          (unsigned char*)&edns.mac_byte[4],
+	          (unsigned char*)&edns.mac_byte[5]) == 6)
+	{
+		edns.mac_set = true;
+		if(config.debug & DEBUG_EDNS0)
+			logg("EDNS(0) MAC address (TEXT format): %s", edns.mac_text);
+	}
+	else if(config.debug & DEBUG_EDNS0)
+	{
+		logg("         Received MAC address has invalid format!");
+	}
+}
+
 ednsData *getEDNS(void)
 {
 	if(edns.valid)
@@ -50,6 +166,18 @@ ednsData *getEDNS(void)
 		// Return pointer to ednsData structure and reset it for the
 		// next query
 		edns.valid = false;
+
+		// Client subnet and MAC address are only used with EDNS0_ECS
+		if(config.edns0_ecs)
+		{
+			if(options.ecs != NULL)
+				decode_ecs(options.ecs, options.ecs_len);
+			if(options.mac_byte != NULL)
+				decode_mac_byte(options.mac_byte);
+			if(options.mac_text != NULL)
+				decode_mac_text(options.mac_text);
+		}
+
 		return &edns;
 	}
 
@@ -57,6 +185,62 @@ ednsData *getEDNS(void)
 	return NULL;
 }
 
+// Log options FTL does not use when debugging
+static void log_option(const unsigned short code, const unsigned char *p, const unsigned short optlen)
+{
+	if(code == EDNS0_COOKIE && optlen == 8)
+	{
+		// EDNS(0) COOKIE client
+		char pretty_client_cookie[8*2 + 1]; // client: fixed length
+		char *pp = pretty_client_cookie;
+		for(unsigned int j = 0; j < 8; j++)
+			pp += sprintf(pp, "%02X", p[j]);
+		logg("EDNS(0) COOKIE (client-only): %s",
+		     pretty_client_cookie);
+	}
+	else if(code == EDNS0_COOKIE && optlen >= 16 && optlen <= 40)
+	{
+		// EDNS(0) COOKIE client + server
+		unsigned short server_cookie_len = optlen - 8;
+		char pretty_client_cookie[8*2 + 1]; // client: fixed length
+		char *pp = pretty_client_cookie;
+		for(unsigned int j = 0; j < 8; j++)
+			pp += sprintf(pp, "%02X", p[j]);
+		char pretty_server_cookie[server_cookie_len*2 + 1u]; // server: variable length
+		pp = pretty_server_cookie;
+		for(unsigned int j = 0; j < server_cookie_len; j++)
+			pp += sprintf(pp, "%02X", p[8 + j]);
+		logg("EDNS(0) COOKIE (client + server): %s (client), %s (server, %u bytes)",
+		     pretty_client_cookie, pretty_server_cookie, server_cookie_len);
+	}
+	else if(code == EDNS0_MAC_ADDR_BASE64 && optlen == 8)
+	{
+		// EDNS(0) MAC address (BASE format)
+		logg("EDNS(0) MAC address (BASE64 format): NOT IMPLEMENTED");
+	}
+	else if(code == EDNS0_CPE_ID && optlen < 256)
+	{
+		// EDNS(0) CPE-ID, 256 byte arbitrary limit
+		unsigned char payload[optlen + 1u]; // variable length
+		memcpy(payload, p, optlen);
+		payload[optlen] = '\0';
+		char pretty_payload[optlen*5 + 1u];
+		char *pp = pretty_payload;
+		pretty_payload[0] = '\0';
+		for(unsigned int j = 0; j < optlen; j++)
+			pp += sprintf(pp, "0x%02X ", payload[j]);
+		if(optlen > 0)
+			pretty_payload[optlen*5 - 1] = '\0'; // Truncate away the trailing whitespace
+		logg("EDNS(0) CPE-ID (payload size %u): \"%s\" (%s)",
+		     optlen, payload, pretty_payload);
+	}
+	else
+	{
+		// Not implemented, skip this record
+		logg("EDNS(0): option %u with length %u", code, optlen);
+	}
+}
+
 void FTL_parse_pseudoheaders(unsigned char *pheader, const size_t plen)
 {
 	// Return early if we have no pseudoheader (a.k.a. additional records)
@@ -168,12 +352,19 @@ void FTL_parse_pseudoheaders(unsigned char *pheader, const size_t plen)
 	if(edns0_version != 0x00)
 		return;
 
-	// Reset EDNS(0) data
-	memset(&edns, 0, sizeof(ednsData));
+	// Reset EDNS(0) data. Only the flags are reset, the buffers are
+	// overwritten when the corresponding options are decoded
+	edns.client_set = false;
+	edns.mac_set = false;
 	edns.ede = EDE_UNSET;
 	edns.valid = true;
+	memset(&options, 0, sizeof(options));
+
+	// The header is 11 bytes before the beginning of OPTION-DATA
+	if(11u + rdlen > plen)
+		return;
 
-	size_t offset; // The header is 11 bytes before the beginning of OPTION-DATA
+	size_t offset;
 	while ((offset = (p - pheader - 11u)) < rdlen && rdlen < UINT16_MAX)
 	{
 		unsigned short code, optlen;
@@ -194,187 +385,20 @@ void FTL_parse_pseudoheaders(unsigned char *pheader, const size_t plen)
 			logg("EDNS(0) code %u, optlen %u (bytes %zu - %zu of %u)",
 			     code, optlen, offset, offset + optlen, rdlen);
 
-		if (code == EDNS0_ECS && config.edns0_ecs)
-		{
-			// EDNS(0) CLIENT SUBNET
-			// RFC 7871              Client Subnet in DNS Queries              6.  Option Format
-			//   This protocol uses an EDNS0 [RFC6891] option to include client
-			//   address information in DNS messages.  The option is structured as
-			//   follows:
-			//
-			//                +0 (MSB)                            +1 (LSB)
-			//      +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-			//   0: |                          OPTION-CODE                          |
-			//      +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-			//   2: |                         OPTION-LENGTH                         |
-			//      +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-			//   4: |                            FAMILY                             |
-			//      +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-			short family;
-			GETSHORT(family, p);
-			//      +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-			//   6: |     SOURCE PREFIX-LENGTH      |     SCOPE PREFIX-LENGTH       |
-			//      +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-			unsigned char source_netmask = *p++;
-			p++; // We are not interested in the scope prefix-length. It MUST be 0 in queries
-			//      +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-			//   8: |                           ADDRESS...                          /
-			//      +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-			union all_addr addr = {{ 0 }};
-			const size_t addrlen = optlen - 4;
-			if(family == 1 && addrlen <= sizeof(addr.addr4.s_addr)) // IPv4
-				memcpy(&addr.addr4.s_addr, p, addrlen);
-			else if(family == 2 && addrlen <= sizeof(addr.addr6.s6_addr)) // IPv6
-				memcpy(addr.addr6.s6_addr, p, addrlen);
-			else
-				continue;
-
-			// Advance working pointer (we already walked 4 bytes above)
-			p += optlen - 4;
-
-			char ipaddr[ADDRSTRLEN] = { 0 };
-			inet_ntop(family == 1 ? AF_INET : AF_INET6, &addr.addr4.s_addr, ipaddr, sizeof(ipaddr));
-
-			// Only use /32 (IPv4) and /128 (IPv6) addresses
-			if(!(family == 1 && source_netmask == 32) &&
-			   !(family == 2 && source_netmask == 128))
-			{
-				if(config.debug & DEBUG_EDNS0)
-					logg("EDNS(0) CLIENT SUBNET: %s/%u found (IPv%u)",
-					     ipaddr, source_netmask, family == 1 ? 4 : 6);
-				continue;
-			}
-
-			// Copy data to edns struct
-			strncpy(edns.client, ipaddr, ADDRSTRLEN);
-			edns.client[ADDRSTRLEN-1] = '\0';
-
-			// Only set the address as useful when it is not the
-			// loopback address of the distant machine (127.0.0.0/8 or ::1)
-			if((family == 1 && (ntohl(addr.addr4.s_addr) & 0xFF000000) == 0x7F000000) ||
-			   (family == 2 && IN6_IS_ADDR_LOOPBACK(&addr.addr6)))
-			{
-				if(config.debug & DEBUG_EDNS0)
-					logg("EDNS(0) CLIENT SUBNET: Skipped %s/%u (IPv%u loopback address)",
-					     ipaddr, source_netmask, family == 1 ? 4 : 6);
-			}
-			else
-			{
-				edns.client_set = true;
-				if(config.debug & DEBUG_EDNS0)
-					logg("EDNS(0) CLIENT SUBNET: %s/%u - OK (IPv%u)",
-					     ipaddr, source_netmask, family == 1 ? 4 : 6);
-			}
-		}
-		else if(code == EDNS0_COOKIE && optlen == 8)
+		if(code == EDNS0_ECS)
 		{
-			// EDNS(0) COOKIE client
-			unsigned char client_cookie[8];
-			memcpy(client_cookie, p, 8);
-			if(config.debug & DEBUG_EDNS0)
-			{
-				char pretty_client_cookie[8*2 + 1]; // client: fixed length
-				char *pp = pretty_client_cookie;
-				for(unsigned int j = 0; j < 8; j++)
-					pp += sprintf(pp, "%02X", client_cookie[j]);
-				logg("EDNS(0) COOKIE (client-only): %s",
-				     pretty_client_cookie);
-			}
-
-			// Advance working pointer
-			p += 8;
-		}
-		else if(code == EDNS0_COOKIE && optlen >= 16 && optlen <= 40)
-		{
-			// EDNS(0) COOKIE client + server
-			unsigned char client_cookie[8];
-			memcpy(client_cookie, p, 8);
-
-			unsigned short server_cookie_len = optlen - 8;
-			unsigned char server_cookie[server_cookie_len];
-			memcpy(server_cookie, p + 8u, server_cookie_len);
-			if(config.debug & DEBUG_EDNS0)
-			{
-				char pretty_client_cookie[8*2 + 1]; // client: fixed length
-				char *pp = pretty_client_cookie;
-				for(unsigned int j = 0; j < 8; j++)
-					pp += sprintf(pp, "%02X", client_cookie[j]);
-				char pretty_server_cookie[server_cookie_len*2 + 1u]; // server: variable length
-				pp = pretty_server_cookie;
-				for(unsigned int j = 0; j < server_cookie_len; j++)
-					pp += sprintf(pp, "%02X", server_cookie[j]);
-				logg("EDNS(0) COOKIE (client + server): %s (client), %s (server, %u bytes)",
-				     pretty_client_cookie, pretty_server_cookie, server_cookie_len);
-			}
-
-			// Advance working pointer
-			p += optlen;
+			options.ecs = p;
+			options.ecs_len = optlen;
 		}
 		else if(code == EDNS0_MAC_ADDR_BYTE && optlen == 6)
 		{
-			// EDNS(0) MAC address (BYTE format)
-			memcpy(edns.mac_byte, p, sizeof(edns.mac_byte));
-			print_mac(edns.mac_text, (unsigned char*)edns.mac_byte, sizeof(edns.mac_byte));
-			edns.mac_set = true;
-			if(config.debug & DEBUG_EDNS0)
-				logg("EDNS(0) MAC address (BYTE format): %s", edns.mac_text);
-
-			// Advance working pointer
-			p += 6;
+			options.mac_byte = p;
+			options.mac_text = NULL;
 		}
 		else if(code == EDNS0_MAC_ADDR_TEXT && optlen == 17)
 		{
-			// EDNS(0) MAC address (TEXT format)
-			memcpy(edns.mac_text, p, 17);
-			edns.mac_text[17] = '\0';
-			if(sscanf(edns.mac_text, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
-			          (unsigned char*)&edns.mac_byte[0],
-			          (unsigned char*)&edns.mac_byte[1],
-			          (unsigned char*)&edns.mac_byte[2],
-			          (unsigned char*)&edns.mac_byte[3],
-			          (unsigned char*)&edns.mac_byte[4],
-			          (unsigned char*)&edns.mac_byte[5]) == 6)
-			{
-				edns.mac_set = true;
-				if(config.debug & DEBUG_EDNS0)
-					logg("EDNS(0) MAC address (TEXT format): %s", edns.mac_text);
-			}
-			else if(config.debug & DEBUG_EDNS0)
-			{
-				logg("         Received MAC address has invalid format!");
-			}
-
-			// Advance working pointer
-			p += 17;
-		}
-		else if(code == EDNS0_MAC_ADDR_BASE64 && optlen == 8)
-		{
-			// EDNS(0) MAC address (BASE format)
-			if(config.debug & DEBUG_EDNS0)
-				logg("EDNS(0) MAC address (BASE64 format): NOT IMPLEMENTED");
-
-			// Advance working pointer
-			p += 8;
-		}
-		else if(code == EDNS0_CPE_ID && optlen < 256)
-		{
-			// EDNS(0) CPE-ID, 256 byte arbitrary limit
-			unsigned char payload[optlen + 1u]; // variable length
-			memcpy(payload, p, optlen);
-			payload[optlen] = '\0';
-			if(config.debug & DEBUG_EDNS0)
-			{
-				char pretty_payload[optlen*5 + 1u];
-				char *pp = pretty_payload;
-				for(unsigned int j = 0; j < optlen; j++)
-					pp += sprintf(pp, "0x%02X ", payload[j]);
-				pretty_payload[optlen*5 - 1] = '\0'; // Truncate away the trailing whitespace
-				logg("EDNS(0) CPE-ID (payload size %u): \"%s\" (%s)",
-				     optlen, payload, pretty_payload);
-			}
-
-			// Advance working pointer
-			p += optlen;
+			options.mac_text = p;
+			options.mac_byte = NULL;
 		}
 		else if(code == EDNS0_OPTION_EDE && optlen >= 2)
 		{
@@ -407,18 +431,15 @@ void FTL_parse_pseudoheaders(unsigned char *pheader, const size_t plen)
 			// Debug output
 			if(config.debug & DEBUG_EDNS0)
 				logg("EDNS(0) EDE: %s (code %d)", edestr(edns.ede), edns.ede);
-
-			// Advance working pointer
-			p += optlen;
 		}
-		else
+		else if(config.debug & DEBUG_EDNS0)
 		{
-			if(config.debug & DEBUG_EDNS0)
-				logg("EDNS(0): option %u with length %u", code, optlen);
-			// Not implemented, skip this record
-
-			// Advance working pointer
-			p += optlen;
+			// Cookies, CPE-ID and all other options are not used
+			// by FTL, they are only decoded for debugging
+			log_option(code, p, optlen);
 		}
+
+		// Advance working pointer
+		p += optlen;
 	}
-}
\ No newline at end of file
+}
@@ -17,7 +17,8 @@ enum memory_type {
 	DOMAINS,
 	OVERTIME,
 	DNS_CACHE,
-	STRINGS
+	STRINGS,
+	TRIGRAMS
 } __attribute__ ((packed));
 
 enum dnssec_status {
@@ -68,6 +69,18 @@ enum reply_type {
 	QUERY_REPLY_MAX
 	}  __attribute__ ((packed));
 
+// Stages of the query pipeline timed by querytrace.c. Each stage ends at the
+// named event: the client has been identified, the blocking decision has been
+// made, the query has been forwarded or answered, the upstream reply has been
+// recorded
+enum query_stage {
+	STAGE_CLIENT,
+	STAGE_BLOCKING,
+	STAGE_DISPATCH,
+	STAGE_UPSTREAM,
+	QUERY_STAGES
+} __attribute__ ((packed));
+
 enum privacy_level {
 	PRIVACY_SHOW_ALL = 0,
 	PRIVACY_HIDE_DOMAINS,
@@ -126,6 +139,7 @@ enum domain_client_status {
 	REGEX_BLOCKED,
 	WHITELISTED,
 	SPECIAL_DOMAIN,
+	POLICY_BLOCKED,
 	NOT_BLOCKED
 } __attribute__ ((packed));
 
@@ -163,6 +177,8 @@ enum events {
 	REIMPORT_ALIASCLIENTS,
 	PARSE_NEIGHBOR_CACHE,
 	RELOAD_BLOCKINGSTATUS,
+	DUMP_LOCK_STATS,
+	DUMP_PACKETS,
 	EVENTS_MAX
 } __attribute__ ((packed));
 
@@ -190,6 +206,15 @@ enum thread_types {
 	DB,
 	GC,
 	DNSclient,
+	STREAM,
+	STATS,
+	PCAP,
+	QUERYLOG,
+	DNSTAP,
+	FEDERATION,
+	REPLICA,
+	PROBE,
+	LOGWRITER, // keep last, it is terminated after the others
 	THREADS_MAX
 } __attribute__ ((packed));
 
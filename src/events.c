@@ -18,6 +18,12 @@
 #include "config.h"
 // logg()
 #include "log.h"
+// killed, thread_cancellable
+#include "signals.h"
+// eventfd()
+#include <sys/eventfd.h>
+// poll()
+#include <poll.h>
 
 // Private prototypes
 static const char *eventtext(const enum events event);
@@ -25,6 +31,73 @@ static const char *eventtext(const enum events event);
 // Queue containing all possible events
 static volatile atomic_flag eventqueue[EVENTS_MAX] = { ATOMIC_FLAG_INIT };
 
+// Thread processing the individual events
+static const enum thread_types event_thread[EVENTS_MAX] = {
+	[RELOAD_GRAVITY] = DB,
+	[RELOAD_PRIVACY_LEVEL] = DB,
+	[RESOLVE_NEW_HOSTNAMES] = DNSclient,
+	[RERESOLVE_HOSTNAMES] = DNSclient,
+	[RERESOLVE_HOSTNAMES_FORCE] = DNSclient,
+	[REIMPORT_ALIASCLIENTS] = DB,
+	[PARSE_NEIGHBOR_CACHE] = DB,
+	[RELOAD_BLOCKINGSTATUS] = DB,
+	[DUMP_LOCK_STATS] = GC,
+	[DUMP_PACKETS] = PCAP,
+};
+
+// Threads sleep on an eventfd until either an event arrives for them or their
+// next periodic task is due. Writing to an eventfd is async-signal-safe so
+// events can be set from within signal handlers
+static int event_fd[THREADS_MAX] = { [0 ... THREADS_MAX-1] = -1 };
+
+// Create the eventfds. This has to be done after dnsmasq closed all inherited
+// file descriptors but before starting the threads. Events set before are not
+// lost, they are processed on the first iteration of the threads
+void init_event_fds(void)
+{
+	for(unsigned int i = 0; i < THREADS_MAX; i++)
+	{
+		event_fd[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(event_fd[i] < 0)
+			logg("WARNING: Cannot create eventfd for thread %u: %s", i, strerror(errno));
+	}
+}
+
+// Wake up a thread sleeping in wait_for_event()
+void wake_thread(const enum thread_types thread)
+{
+	if(event_fd[thread] > -1)
+		eventfd_write(event_fd[thread], 1);
+}
+
+// Sleep until an event is set for this thread, the thread is woken up, or the
+// timeout [milliseconds] expired. Returns true if the thread has been woken up
+bool wait_for_event(const enum thread_types thread, const int timeout)
+{
+	if(killed)
+		return false;
+
+	// Fall back to sleeping if no eventfd is available
+	if(event_fd[thread] < 0)
+	{
+		thread_sleepms(thread, timeout);
+		return false;
+	}
+
+	struct pollfd pfd = { .fd = event_fd[thread], .events = POLLIN };
+	thread_cancellable[thread] = true;
+	const int rc = poll(&pfd, 1, timeout);
+	thread_cancellable[thread] = false;
+
+	if(rc < 1)
+		return false;
+
+	// Reset the counter of the eventfd
+	eventfd_t value = 0;
+	eventfd_read(event_fd[thread], &value);
+	return true;
+}
+
 // Set/Request event
 // We set the events atomically to ensure no race collisions can happen. If an
 // event has already been requested, this has no consequences as event cannot be
@@ -36,6 +109,9 @@ void _set_event(const enum events event, int line, const char *function, const c
 	if(atomic_flag_test_and_set(&eventqueue[event]))
 		is_set = true;
 
+	// Wake up the thread processing this event
+	wake_thread(event_thread[event]);
+
 	// Possible debug logging
 	if(config.debug & DEBUG_EVENTS)
 	{
@@ -102,6 +178,10 @@ static const char *eventtext(const enum events event)
 			return "RESOLVE_NEW_HOSTNAMES";
 		case RELOAD_BLOCKINGSTATUS:
 			return "RELOAD_BLOCKINGSTATUS";
+		case DUMP_LOCK_STATS:
+			return "DUMP_LOCK_STATS";
+		case DUMP_PACKETS:
+			return "DUMP_PACKETS";
 		case EVENTS_MAX: // fall through
 		default:
 			return "UNKNOWN";
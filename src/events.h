@@ -19,4 +19,8 @@ void _set_event(const enum events event, int line, const char *function, const c
 #define get_and_clear_event(event) _get_and_clear_event(event, __LINE__, __FUNCTION__, __FILE__)
 bool _get_and_clear_event(const enum events event, int line, const char *function, const char *file);
 
+void init_event_fds(void);
+void wake_thread(const enum thread_types thread);
+bool wait_for_event(const enum thread_types thread, const int timeout);
+
 #endif // EVENTS_H
\ No newline at end of file
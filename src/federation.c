@@ -0,0 +1,573 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Federated statistics of multiple FTL nodes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "federation.h"
+#include "config.h"
+// blocked_queries(), cached_queries(), forwarded_queries()
+#include "log.h"
+// getstr(), getDomain(), getClient()
+#include "shmem.h"
+// overTime
+#include "overTime.h"
+// merge_slots(), merge_sketch(), sketch_unique()
+#include "cardinality.h"
+// leaderboard_members()
+#include "leaderboard.h"
+// ssend(), socket_connect()
+#include "api/socket.h"
+// pack_int32(), pack_str32()
+#include "api/api.h"
+// command()
+#include "api/request.h"
+// killed, thread_names[]
+#include "signals.h"
+// wait_for_event()
+#include "events.h"
+// thread_sched_apply()
+#include "threadsched.h"
+
+// With FEDERATION_PEERS, the federation thread fetches a compact summary of
+// the statistics of every peer through their API (>federation) each
+// FEDERATION_INTERVAL seconds. A summary consists of the counters, the
+// overTime slots, the HyperLogLog sketch of the distinct domains and clients
+// and the leaderboards with their names. All parts can be merged: counters
+// and slots (matched by their timestamps) are summed up, sketches are merged
+// by taking the maximum of each register and the counts of the top lists are
+// summed up by name. Names missing on the leaderboard of a node add nothing,
+// so the merged top counts are lower bounds. The >cluster-* API commands
+// merge our own summary with all peers that answered recently. No queries
+// are ever exchanged
+
+// Longest name kept on the top lists
+#define FEDERATION_NAME_MAX 128
+
+// Maximum size of the response of a peer
+#define FEDERATION_RESPONSE 65536
+
+enum federation_list {
+	LIST_DOMAINS,
+	LIST_ADS,
+	LIST_CLIENTS,
+	LIST_BLOCKED_CLIENTS,
+	FEDERATION_LISTS
+};
+
+static const char *const list_names[FEDERATION_LISTS] = {
+	[LIST_DOMAINS] = "domains",
+	[LIST_ADS] = "ads",
+	[LIST_CLIENTS] = "clients",
+	[LIST_BLOCKED_CLIENTS] = "blocked-clients",
+};
+
+static const enum leaderboard_type list_boards[FEDERATION_LISTS] = {
+	[LIST_DOMAINS] = BOARD_PERMITTED_DOMAINS,
+	[LIST_ADS] = BOARD_BLOCKED_DOMAINS,
+	[LIST_CLIENTS] = BOARD_CLIENTS,
+	[LIST_BLOCKED_CLIENTS] = BOARD_BLOCKED_CLIENTS,
+};
+
+typedef struct {
+	int count;
+	char name[FEDERATION_NAME_MAX];
+} federationEntry;
+
+typedef struct {
+	time_t received;
+	int total;
+	int blocked;
+	int cached;
+	int forwarded;
+	unsigned int slots;
+	time_t timestamp[OVERTIME_SLOTS];
+	int slot_total[OVERTIME_SLOTS];
+	int slot_blocked[OVERTIME_SLOTS];
+	cardinalitySlot sketch;
+	unsigned int n[FEDERATION_LISTS];
+	federationEntry top[FEDERATION_LISTS][LEADERBOARD_SIZE];
+} federationSummary;
+
+static struct {
+	char *target;
+	bool failed;
+	federationSummary summary;
+} peers[FEDERATION_PEERS_MAX];
+static unsigned int npeers = 0u;
+
+// Protects the summaries of the peers and our own one. The federation thread
+// fills fetched without holding it
+static pthread_mutex_t federation_lock = PTHREAD_MUTEX_INITIALIZER;
+static federationSummary local, fetched;
+static federationEntry merged[(FEDERATION_PEERS_MAX + 1) * LEADERBOARD_SIZE];
+static char response[FEDERATION_RESPONSE];
+
+// Parse the comma-separated list of peers, returns the number of peers
+unsigned int federation_set_peers(const char *list)
+{
+	for(unsigned int i = 0; i < npeers; i++)
+	{
+		free(peers[i].target);
+		peers[i].target = NULL;
+	}
+	npeers = 0u;
+
+	if(list == NULL)
+		return 0u;
+
+	char *copy = strdup(list);
+	if(copy == NULL)
+		return 0u;
+
+	char *saveptr = NULL;
+	for(char *token = strtok_r(copy, ", \t", &saveptr); token != NULL; token = strtok_r(NULL, ", \t", &saveptr))
+	{
+		if(npeers == FEDERATION_PEERS_MAX)
+		{
+			logg("WARNING: Ignoring federation peer %s, at most %u peers are supported",
+			     token, FEDERATION_PEERS_MAX);
+			continue;
+		}
+		if(strrchr(token, ':') == NULL)
+		{
+			logg("WARNING: Ignoring federation peer %s, expected host:port", token);
+			continue;
+		}
+
+		peers[npeers].target = strdup(token);
+		peers[npeers].failed = false;
+		peers[npeers].summary.received = 0;
+		if(peers[npeers].target != NULL)
+			npeers++;
+	}
+
+	free(copy);
+	return npeers;
+}
+
+// Get the name and count of a leaderboard member, false if it cannot be shared
+static bool local_entry(const enum federation_list list, const int id, federationEntry *entry)
+{
+	const char *name = NULL;
+	if(list == LIST_DOMAINS || list == LIST_ADS)
+	{
+		const domainsData *domain = getDomain(id, true);
+		if(domain == NULL)
+			return false;
+		name = getstr(domain->domainpos);
+		entry->count = list == LIST_ADS ? domain->blockedcount : domain->count - domain->blockedcount;
+	}
+	else
+	{
+		const clientsData *client = getClient(id, true);
+		if(client == NULL)
+			return false;
+		name = getstr(client->ippos);
+		entry->count = list == LIST_BLOCKED_CLIENTS ? client->blockedcount : client->count;
+	}
+
+	if(entry->count < 1 || strlen(name) >= sizeof(entry->name) ||
+	   strcmp(name, HIDDEN_DOMAIN) == 0 || strcmp(name, HIDDEN_CLIENT) == 0)
+		return false;
+
+	strcpy(entry->name, name);
+	return true;
+}
+
+// Summarize our own statistics, needs the SHM lock
+static void local_summary(federationSummary *s)
+{
+	s->received = time(NULL);
+	s->total = total_queries();
+	s->blocked = blocked_queries();
+	s->cached = cached_queries();
+	s->forwarded = forwarded_queries();
+
+	s->slots = OVERTIME_SLOTS;
+	for(unsigned int slot = 0; slot < OVERTIME_SLOTS; slot++)
+	{
+		s->timestamp[slot] = overTime[slot].timestamp;
+		s->slot_total[slot] = overTime[slot].total;
+		s->slot_blocked[slot] = overTime[slot].blocked;
+	}
+
+	memset(&s->sketch, 0, sizeof(s->sketch));
+	merge_slots(0, OVERTIME_SLOTS - 1, &s->sketch);
+
+	// Names are only shared as far as the privacy level permits
+	refresh_privacy_level();
+	for(unsigned int list = 0; list < FEDERATION_LISTS; list++)
+	{
+		s->n[list] = 0u;
+		const enum privacy_level hidden = list < LIST_CLIENTS ? PRIVACY_HIDE_DOMAINS : PRIVACY_HIDE_DOMAINS_CLIENTS;
+		if(config.privacylevel >= hidden)
+			continue;
+
+		int ids[LEADERBOARD_SIZE], threshold = 0;
+		const int members = leaderboard_members(list_boards[list], ids, &threshold);
+		for(int i = 0; i < members; i++)
+			if(local_entry(list, ids[i], &s->top[list][s->n[list]]))
+				s->n[list]++;
+	}
+}
+
+static void send_sketch(const int sock, const char *name, const unsigned char *registers)
+{
+	char hex[2*HLL_SLOT_REGISTERS + 1];
+	for(unsigned int i = 0; i < HLL_SLOT_REGISTERS; i++)
+		sprintf(hex + 2*i, "%02x", registers[i]);
+	ssend(sock, "sketch %s %s\n", name, hex);
+}
+
+// >federation sends our own summary to a peer
+void getFederationSummary(const int sock, const bool istelnet)
+{
+	// The summary is only exchanged in text form
+	if(!istelnet)
+		return;
+
+	pthread_mutex_lock(&federation_lock);
+	local_summary(&local);
+
+	ssend(sock, "counters %i %i %i %i\n", local.total, local.blocked, local.cached, local.forwarded);
+	for(unsigned int slot = 0; slot < local.slots; slot++)
+		ssend(sock, "slot %lli %i %i\n", (long long)local.timestamp[slot],
+		      local.slot_total[slot], local.slot_blocked[slot]);
+	send_sketch(sock, "domains", local.sketch.domains);
+	send_sketch(sock, "clients", local.sketch.clients);
+	for(unsigned int list = 0; list < FEDERATION_LISTS; list++)
+		for(unsigned int i = 0; i < local.n[list]; i++)
+			ssend(sock, "top %s %i %s\n", list_names[list],
+			      local.top[list][i].count, local.top[list][i].name);
+
+	pthread_mutex_unlock(&federation_lock);
+}
+
+static bool parse_sketch(const char *hex, unsigned char *registers)
+{
+	if(strlen(hex) != 2*HLL_SLOT_REGISTERS)
+		return false;
+
+	for(unsigned int i = 0; i < HLL_SLOT_REGISTERS; i++)
+	{
+		unsigned int value = 0;
+		if(sscanf(hex + 2*i, "%2x", &value) != 1 || value > 64u)
+			return false;
+		registers[i] = value;
+	}
+	return true;
+}
+
+// Parse the response of a peer, it is only accepted if it is complete
+static bool parse_summary(char *buf, federationSummary *s)
+{
+	memset(s, 0, sizeof(*s));
+
+	bool counters_seen = false, complete = false;
+	char *saveptr = NULL;
+	for(char *line = strtok_r(buf, "\n", &saveptr); line != NULL; line = strtok_r(NULL, "\n", &saveptr))
+	{
+		long long timestamp = 0;
+		int count = 0;
+		char list[16], name[FEDERATION_NAME_MAX];
+		if(sscanf(line, "counters %i %i %i %i", &s->total, &s->blocked, &s->cached, &s->forwarded) == 4)
+			counters_seen = true;
+		else if(s->slots < OVERTIME_SLOTS &&
+		        sscanf(line, "slot %lli %i %i", &timestamp, &s->slot_total[s->slots], &s->slot_blocked[s->slots]) == 3)
+			s->timestamp[s->slots++] = (time_t)timestamp;
+		else if(strncmp(line, "sketch domains ", 15) == 0)
+		{
+			if(!parse_sketch(line + 15, s->sketch.domains))
+				return false;
+		}
+		else if(strncmp(line, "sketch clients ", 15) == 0)
+		{
+			if(!parse_sketch(line + 15, s->sketch.clients))
+				return false;
+		}
+		else if(sscanf(line, "top %15s %i %127s", list, &count, name) == 3)
+		{
+			for(unsigned int l = 0; l < FEDERATION_LISTS; l++)
+			{
+				if(strcmp(list, list_names[l]) != 0 || s->n[l] == LEADERBOARD_SIZE)
+					continue;
+				federationEntry *entry = &s->top[l][s->n[l]++];
+				entry->count = count;
+				strcpy(entry->name, name);
+			}
+		}
+		else if(strcmp(line, "---EOM---") == 0)
+			complete = true;
+	}
+
+	s->received = time(NULL);
+	return counters_seen && complete;
+}
+
+// Fetch the summary of a peer into fetched
+static bool fetch_peer(const char *target)
+{
+	const int sock = socket_connect(target, FEDERATION_TIMEOUT);
+	if(sock < 0)
+		return false;
+
+	static const char request[] = ">federation\n";
+	size_t used = 0u;
+	if(send(sock, request, sizeof(request) - 1, MSG_NOSIGNAL) == (ssize_t)(sizeof(request) - 1))
+	{
+		// Read until the end of the message
+		while(used < sizeof(response) - 1)
+		{
+			const ssize_t ret = recv(sock, response + used, sizeof(response) - 1 - used, 0);
+			if(ret <= 0)
+				break;
+			used += ret;
+			response[used] = '\0';
+			if(strstr(response + (used > (size_t)ret + 10u ? used - ret - 10u : 0u), "---EOM---") != NULL)
+				break;
+		}
+		send(sock, ">quit\n", 6, MSG_NOSIGNAL);
+	}
+	close(sock);
+
+	response[used] = '\0';
+	return used > 0u && parse_summary(response, &fetched);
+}
+
+// Called before the threads are started
+bool init_federation(void)
+{
+	return npeers > 0u;
+}
+
+void *federation_thread(void *val)
+{
+	(void)val;
+
+	// Set thread name
+	thread_names[FEDERATION] = "federation";
+	prctl(PR_SET_NAME, thread_names[FEDERATION], 0, 0, 0);
+	thread_sched_apply(FEDERATION);
+
+	while(!killed)
+	{
+		for(unsigned int i = 0; i < npeers && !killed; i++)
+		{
+			const bool success = fetch_peer(peers[i].target);
+			if(success)
+			{
+				pthread_mutex_lock(&federation_lock);
+				memcpy(&peers[i].summary, &fetched, sizeof(fetched));
+				pthread_mutex_unlock(&federation_lock);
+			}
+
+			// Log only changes
+			if(!success && !peers[i].failed)
+				logg("WARNING: Cannot fetch statistics of federation peer %s", peers[i].target);
+			else if(success && peers[i].failed)
+				logg("Fetched statistics of federation peer %s again", peers[i].target);
+			peers[i].failed = !success;
+		}
+
+		wait_for_event(FEDERATION, config.federation_interval*1000);
+	}
+
+	logg("Terminating federation thread");
+	return NULL;
+}
+
+// Get our own summary and those of all peers that answered recently, needs
+// the SHM lock and federation_lock. Returns the number of summaries
+static unsigned int collect_summaries(const federationSummary *summaries[FEDERATION_PEERS_MAX + 1], unsigned int *stale)
+{
+	local_summary(&local);
+	summaries[0] = &local;
+
+	unsigned int n = 1u;
+	*stale = 0u;
+	const time_t oldest = time(NULL) - FEDERATION_STALE*config.federation_interval;
+	for(unsigned int i = 0; i < npeers; i++)
+	{
+		if(peers[i].summary.received >= oldest)
+			summaries[n++] = &peers[i].summary;
+		else
+			(*stale)++;
+	}
+	return n;
+}
+
+// >cluster-stats
+void getClusterStats(const int sock, const bool istelnet)
+{
+	pthread_mutex_lock(&federation_lock);
+
+	const federationSummary *summaries[FEDERATION_PEERS_MAX + 1];
+	unsigned int stale = 0u;
+	const unsigned int n = collect_summaries(summaries, &stale);
+
+	int total = 0, blocked = 0, cached = 0, forwarded = 0;
+	cardinalitySlot sketch = { { 0 }, { 0 } };
+	for(unsigned int i = 0; i < n; i++)
+	{
+		total += summaries[i]->total;
+		blocked += summaries[i]->blocked;
+		cached += summaries[i]->cached;
+		forwarded += summaries[i]->forwarded;
+		merge_sketch(&sketch, &summaries[i]->sketch);
+	}
+	pthread_mutex_unlock(&federation_lock);
+
+	unsigned int clients = 0;
+	const unsigned int domains = sketch_unique(&sketch, &clients);
+	const float percentage = total > 0 ? 1e2f*blocked/total : 0.0f;
+
+	if(istelnet)
+	{
+		ssend(sock, "dns_queries_today %i\nads_blocked_today %i\nads_percentage_today %f\n",
+		      total, blocked, percentage);
+		ssend(sock, "queries_forwarded %i\nqueries_cached %i\n", forwarded, cached);
+		ssend(sock, "unique_domains %u\nunique_clients %u\n", domains, clients);
+		ssend(sock, "nodes %u\nnodes_stale %u\n", n, stale);
+	}
+	else
+	{
+		pack_int32(sock, total);
+		pack_int32(sock, blocked);
+		pack_float(sock, percentage);
+		pack_int32(sock, forwarded);
+		pack_int32(sock, cached);
+		pack_int32(sock, (int32_t)domains);
+		pack_int32(sock, (int32_t)clients);
+		pack_int32(sock, (int32_t)n);
+		pack_int32(sock, (int32_t)stale);
+	}
+}
+
+// >cluster-overTime, the slots of the peers are matched by their timestamps
+void getClusterOverTime(const int sock, const bool istelnet)
+{
+	int total[OVERTIME_SLOTS] = { 0 }, blocked[OVERTIME_SLOTS] = { 0 };
+	time_t timestamp[OVERTIME_SLOTS];
+
+	pthread_mutex_lock(&federation_lock);
+
+	const federationSummary *summaries[FEDERATION_PEERS_MAX + 1];
+	unsigned int stale = 0u;
+	const unsigned int n = collect_summaries(summaries, &stale);
+
+	memcpy(timestamp, local.timestamp, sizeof(timestamp));
+	for(unsigned int i = 0; i < n; i++)
+	{
+		for(unsigned int slot = 0; slot < summaries[i]->slots; slot++)
+		{
+			const time_t offset = summaries[i]->timestamp[slot] - timestamp[0];
+			if(offset < 0 || offset % OVERTIME_INTERVAL != 0 || offset / OVERTIME_INTERVAL >= OVERTIME_SLOTS)
+				continue;
+			total[offset / OVERTIME_INTERVAL] += summaries[i]->slot_total[slot];
+			blocked[offset / OVERTIME_INTERVAL] += summaries[i]->slot_blocked[slot];
+		}
+	}
+	pthread_mutex_unlock(&federation_lock);
+
+	if(istelnet)
+	{
+		for(unsigned int slot = 0; slot < OVERTIME_SLOTS; slot++)
+			ssend(sock, "%lli %i %i\n", (long long)timestamp[slot], total[slot], blocked[slot]);
+	}
+	else
+	{
+		pack_map16_start(sock, (uint16_t) OVERTIME_SLOTS);
+		for(unsigned int slot = 0; slot < OVERTIME_SLOTS; slot++)
+		{
+			pack_int32(sock, (int32_t)timestamp[slot]);
+			pack_int32(sock, total[slot]);
+		}
+
+		pack_map16_start(sock, (uint16_t) OVERTIME_SLOTS);
+		for(unsigned int slot = 0; slot < OVERTIME_SLOTS; slot++)
+		{
+			pack_int32(sock, (int32_t)timestamp[slot]);
+			pack_int32(sock, blocked[slot]);
+		}
+	}
+}
+
+static int cmp_entry_name(const void *a, const void *b)
+{
+	const federationEntry *ea = a, *eb = b;
+	return strcmp(ea->name, eb->name);
+}
+
+static int cmp_entry_count(const void *a, const void *b)
+{
+	const federationEntry *ea = a, *eb = b;
+	if(ea->count != eb->count)
+		return eb->count - ea->count;
+	return strcmp(ea->name, eb->name);
+}
+
+// >cluster-top-domains, >cluster-top-ads and >cluster-top-clients [blocked]
+// example: >cluster-top-domains (15)
+void getClusterTop(const char *client_message, const int sock, const bool istelnet)
+{
+	enum federation_list list = LIST_DOMAINS;
+	if(command(client_message, ">cluster-top-ads"))
+		list = LIST_ADS;
+	else if(command(client_message, ">cluster-top-clients"))
+		list = command(client_message, " blocked") ? LIST_BLOCKED_CLIENTS : LIST_CLIENTS;
+
+	// Exit before processing any data if requested via config setting
+	refresh_privacy_level();
+	const enum privacy_level hidden = list < LIST_CLIENTS ? PRIVACY_HIDE_DOMAINS : PRIVACY_HIDE_DOMAINS_CLIENTS;
+	if(config.privacylevel >= hidden)
+		return;
+
+	int count = 10, num = 0;
+	if(sscanf(client_message, "%*[^(](%i)", &num) > 0 && num > 0)
+		count = num;
+
+	pthread_mutex_lock(&federation_lock);
+
+	const federationSummary *summaries[FEDERATION_PEERS_MAX + 1];
+	unsigned int stale = 0u;
+	const unsigned int n = collect_summaries(summaries, &stale);
+
+	// Sum up the counts by name
+	unsigned int entries = 0u;
+	for(unsigned int i = 0; i < n; i++)
+	{
+		memcpy(&merged[entries], summaries[i]->top[list], summaries[i]->n[list]*sizeof(federationEntry));
+		entries += summaries[i]->n[list];
+	}
+	qsort(merged, entries, sizeof(federationEntry), cmp_entry_name);
+
+	unsigned int unique = 0u;
+	for(unsigned int i = 0; i < entries; i++)
+	{
+		if(unique > 0u && strcmp(merged[unique - 1].name, merged[i].name) == 0)
+			merged[unique - 1].count += merged[i].count;
+		else if(unique++ != i)
+			merged[unique - 1] = merged[i];
+	}
+	qsort(merged, unique, sizeof(federationEntry), cmp_entry_count);
+
+	for(unsigned int i = 0; i < unique && (int)i < count; i++)
+	{
+		if(istelnet)
+			ssend(sock, "%u %i %s\n", i, merged[i].count, merged[i].name);
+		else
+		{
+			if(!pack_str32(sock, merged[i].name))
+				break;
+			pack_int32(sock, merged[i].count);
+		}
+	}
+
+	pthread_mutex_unlock(&federation_lock);
+}
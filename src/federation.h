@@ -0,0 +1,34 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Federated statistics prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include <stdbool.h>
+
+// Maximum number of peers
+#define FEDERATION_PEERS_MAX 8
+
+// Time to wait for the summary of a peer [seconds]
+#define FEDERATION_TIMEOUT 2
+
+// Summaries older than this many intervals are not merged
+#define FEDERATION_STALE 3
+
+unsigned int federation_set_peers(const char *list);
+bool init_federation(void) __attribute__((pure));
+void *federation_thread(void *val);
+
+// API commands, the summary needs to be sent while holding the SHM lock
+void getFederationSummary(const int sock, const bool istelnet);
+void getClusterStats(const int sock, const bool istelnet);
+void getClusterOverTime(const int sock, const bool istelnet);
+void getClusterTop(const char *client_message, const int sock, const bool istelnet);
+
+#endif //FEDERATION_H
@@ -26,6 +26,8 @@
 #include <sys/statvfs.h>
 // dirname()
 #include <libgen.h>
+// inotify_init1()
+#include <sys/inotify.h>
 
 // chmod_file() changes the file mode bits of a given file (relative
 // to the directory file descriptor) according to mode. mode is an
@@ -203,3 +205,132 @@ int get_filepath_usage(const char *file, char buffer[64])
 	// Get percentage of disk usage at this path
 	return get_path_usage(path, buffer);
 }
+
+// Configuration files are watched with inotify so their content can be kept
+// in memory and only needs to be parsed again after they have been modified.
+// Each file has a generation counter which is incremented for every change.
+// As the files are commonly replaced (written to a temporary file and renamed)
+// rather than modified in-place, we watch the directories containing them
+static struct {
+	int fd;
+	bool initialized;
+	struct {
+		int wd;
+		unsigned int generation;
+		const char *name;
+		// Used when inotify is not available
+		struct stat st;
+	} files[WATCH_FILES];
+} watch = { -1, false, {{ -1, 0u, NULL, { 0 } }} };
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *watched_path(const enum watched_file file)
+{
+	return file == WATCH_SETUPVARS ? FTLfiles.setupVars : FTLfiles.conf;
+}
+
+static void watch_init(void)
+{
+	watch.initialized = true;
+	watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(watch.fd < 0)
+		logg("WARN: Cannot watch config files, falling back to stat(): %s", strerror(errno));
+
+	for(unsigned int i = 0; i < WATCH_FILES; i++)
+	{
+		const char *path = watched_path(i);
+		const char *slash = strrchr(path, '/');
+		watch.files[i].name = slash != NULL ? slash + 1 : path;
+		// Start with generation 1 so everyone loads the files once
+		watch.files[i].generation = 1u;
+		watch.files[i].wd = -1;
+		if(watch.fd < 0)
+			continue;
+
+		// Watch the directory of the file. Multiple files in the same
+		// directory share the same watch descriptor. We do not watch
+		// IN_MODIFY as the databases in the same directory would
+		// flood us with events
+		char *dir = strdup(path);
+		if(dir == NULL)
+			continue;
+		watch.files[i].wd = inotify_add_watch(watch.fd, dirname(dir),
+		                                      IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+		                                      IN_MOVED_FROM | IN_MOVED_TO);
+		if(watch.files[i].wd < 0)
+			logg("WARN: Cannot watch %s, falling back to stat(): %s", path, strerror(errno));
+		free(dir);
+	}
+}
+
+// Process all pending inotify events
+static void watch_drain(void)
+{
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	while((len = read(watch.fd, buffer, sizeof(buffer))) > 0)
+	{
+		for(char *ptr = buffer; ptr < buffer + len; )
+		{
+			const struct inotify_event *event = (void*)ptr;
+			ptr += sizeof(struct inotify_event) + event->len;
+
+			for(unsigned int i = 0; i < WATCH_FILES; i++)
+			{
+				// Events got lost or the directory is gone, assume
+				// everything changed
+				if(event->mask & (IN_Q_OVERFLOW | IN_IGNORED))
+				{
+					watch.files[i].generation++;
+					if(event->mask & IN_IGNORED && event->wd == watch.files[i].wd)
+						watch.files[i].wd = -1;
+					continue;
+				}
+
+				if(event->wd == watch.files[i].wd && event->len > 0 &&
+				   strcmp(event->name, watch.files[i].name) == 0)
+					watch.files[i].generation++;
+			}
+		}
+	}
+}
+
+// Check if a file has been modified since the caller has last seen it. seen
+// holds the generation seen before and is updated. Initialize it with zero to
+// get true on the first call
+bool file_changed(const enum watched_file file, unsigned int *seen)
+{
+	if(file >= WATCH_FILES)
+		return false;
+
+	pthread_mutex_lock(&watch_lock);
+	if(!watch.initialized)
+		watch_init();
+
+	if(watch.files[file].wd >= 0)
+		watch_drain();
+	else
+	{
+		// No inotify watch on this file, compare file identity and
+		// modification time
+		struct stat st = { 0 };
+		stat(watched_path(file), &st);
+		const struct stat *old = &watch.files[file].st;
+		if(st.st_ino != old->st_ino || st.st_dev != old->st_dev ||
+		   st.st_size != old->st_size ||
+		   st.st_mtim.tv_sec != old->st_mtim.tv_sec ||
+		   st.st_mtim.tv_nsec != old->st_mtim.tv_nsec)
+		{
+			watch.files[file].st = st;
+			watch.files[file].generation++;
+		}
+	}
+
+	// Update seen generation while holding the lock as it may be shared by
+	// multiple threads
+	const bool changed = *seen != watch.files[file].generation;
+	*seen = watch.files[file].generation;
+	pthread_mutex_unlock(&watch_lock);
+
+	return changed;
+}
@@ -17,4 +17,13 @@ void ls_dir(const char* path);
 int get_path_usage(const char *path, char buffer[64]);
 int get_filepath_usage(const char *file, char buffer[64]);
 
+// Configuration files watched for modifications
+enum watched_file {
+	WATCH_SETUPVARS,
+	WATCH_FTLCONF,
+	WATCH_FILES
+} __attribute__ ((packed));
+
+bool file_changed(const enum watched_file file, unsigned int *seen);
+
 #endif //FILE_H
@@ -20,60 +20,60 @@
 #include "signals.h"
 // data getter functions
 #include "datastructure.h"
-// logg_rate_limit_message()
+// log_resource_shortage()
 #include "database/message-table.h"
+// release_rate_limited()
+#include "ratelimit.h"
 // get_nprocs()
 #include <sys/sysinfo.h>
 // get_filepath_usage()
 #include "files.h"
+// get_and_clear_event(), wait_for_event()
+#include "events.h"
+// log_lock_stats()
+#include "lockstats.h"
+// rebuild_leaderboards()
+#include "leaderboard.h"
+// heavy_hitters_add()
+#include "heavyhitters.h"
+// rebuild_client_cardinality()
+#include "cardinality.h"
+// rebuild_trigram_index()
+#include "trigram.h"
+// respcache_invalidate()
+#include "api/respcache.h"
+// report_debug_limits()
+#include "debuglimit.h"
+// gravityDB_recheck_clients()
+#include "database/gravity-db.h"
+// global variable startup
+#include "main.h"
+// thread_sched_apply()
+#include "threadsched.h"
+// publish_shm_stats()
+#include "shmstats.h"
+// reclaim_entries()
+#include "reclaim.h"
+// FTL_PROBE()
+#include "probes.h"
+#include <stdatomic.h>
 
 // Resource checking interval
 // default: 300 seconds
 #define RCinterval 300
 
-bool doGC = false;
-
-// Subtract rate-limitation count from individual client counters
-// As long as client->rate_limit is still larger than the allowed
-// maximum count, the rate-limitation will just continue
-static void reset_rate_limiting(void)
-{
-	for(int clientID = 0; clientID < counters->clients; clientID++)
-	{
-		clientsData *client = getClient(clientID, true);
-		if(!client)
-			continue;
-
-		// Check if we are currently rate-limiting this client
-		if(client->flags.rate_limited)
-		{
-			const char *clientIP = getstr(client->ippos);
+// Maximum number of clients whose groups are rechecked while holding the lock
+#define GROUP_RECHECK_BATCH 16u
 
-			// Check if we want to continue rate limiting
-			if(client->rate_limit > config.rate_limit.count)
-			{
-				logg("Still rate-limiting %s as it made additional %d queries", clientIP, client->rate_limit);
-			}
-			// or if rate-limiting ends for this client now
-			else
-			{
-				logg("Ending rate-limitation of %s", clientIP);
-				client->flags.rate_limited = false;
-			}
-		}
+bool doGC = false;
 
-		// Reset counter
-		client->rate_limit = 0;
-	}
-}
+// Maximum number of queries kept in memory, derived from QUERY_MEMORY_LIMIT
+// (0 = unlimited). Queries beyond it are evicted before they expire
+int max_queries_in_memory = 0;
 
-static time_t lastRateLimitCleaner = 0;
-// Returns how many more seconds until the current rate-limiting interval is over
-time_t get_rate_limit_turnaround(const unsigned int rate_limit_count)
-{
-	const unsigned int how_often = rate_limit_count/config.rate_limit.count;
-	return (time_t)config.rate_limit.interval*how_often - (time(NULL) - lastRateLimitCleaner);
-}
+// All queries before this timestamp have been removed from memory, see
+// queries_kept_since()
+static atomic_llong kept_since = 0;
 
 static int check_space(const char *file, int LastUsage)
 {
@@ -94,6 +94,8 @@ static int check_space(const char *file, int LastUsage)
 
 static void check_load(void)
 {
+	TIME_SCOPE("load_check");
+
 	if(!config.check.load)
 		return;
 
@@ -111,16 +113,296 @@ static void check_load(void)
 		log_resource_shortage(load[2], nprocs, -1, -1, NULL, NULL);
 }
 
+// Remove the counts of an expired query and of the queries it stands for
+static void remove_query_counts(queriesData *query)
+{
+	const int weight = 1 + query->unsampled;
+	counters->queries_unsampled -= query->unsampled;
+
+	// Adjust client counter (total and overTime)
+	clientsData* client = getClient(query->clientID, true);
+	const int timeidx = getOverTimeID(query->timestamp);
+	overTime[timeidx].total -= weight;
+	if(client != NULL)
+		change_clientcount(client, -weight, 0, timeidx, -weight);
+
+	// Adjust domain counter (no overTime information)
+	domainsData* domain = getDomain(query->domainID, true);
+	if(domain != NULL)
+		domain->count -= weight;
+
+	// Adjust per-client top domains and per-domain top clients
+	heavy_hitters_add(query, -weight);
+
+	// Change other counters according to status of this query
+	switch(query->status)
+	{
+		case QUERY_UNKNOWN:
+			// Unknown (?)
+			break;
+		case QUERY_FORWARDED: // (fall through)
+		case QUERY_RETRIED: // (fall through)
+		case QUERY_RETRIED_DNSSEC:
+			// Forwarded to an upstream DNS server
+			// Adjusting counters is done in moveOverTimeMemory()
+			break;
+		case QUERY_CACHE:
+		case QUERY_CACHE_STALE:
+			// Answered from local cache _or_ local config
+			break;
+		case QUERY_GRAVITY: // Blocked by Pi-hole's blocking lists (fall through)
+		case QUERY_BLACKLIST: // Exact blocked (fall through)
+		case QUERY_REGEX: // Regex blocked (fall through)
+		case QUERY_EXTERNAL_BLOCKED_IP: // Blocked by upstream provider (fall through)
+		case QUERY_EXTERNAL_BLOCKED_NXRA: // Blocked by upstream provider (fall through)
+		case QUERY_EXTERNAL_BLOCKED_NULL: // Blocked by upstream provider (fall through)
+		case QUERY_GRAVITY_CNAME: // Gravity domain in CNAME chain (fall through)
+		case QUERY_REGEX_CNAME: // Regex blacklisted domain in CNAME chain (fall through)
+		case QUERY_BLACKLIST_CNAME: // Exactly blacklisted domain in CNAME chain (fall through)
+		case QUERY_DBBUSY: // Blocked because gravity database was busy
+		case QUERY_SPECIAL_DOMAIN: // Blocked by special domain handling
+			if(domain != NULL)
+				domain->blockedcount -= weight;
+			if(client != NULL)
+				change_clientcount(client, 0, -weight, -1, 0);
+			break;
+		case QUERY_IN_PROGRESS: // Don't have to do anything here
+		case QUERY_STATUS_MAX: // fall through
+		default:
+			/* That cannot happen */
+			break;
+	}
+
+	// Update reply counters
+	counter_sub(reply[query->reply], weight);
+
+	// Update type counters
+	if(query->type >= TYPE_A && query->type < TYPE_MAX)
+	{
+		counter_sub(querytype[query->type-1], weight);
+	}
+
+	// Set query again to UNKNOWN to reset the counters
+	query_set_status(query, QUERY_UNKNOWN);
+
+	// Finally, remove the last trace of this query
+	counter_sub(status[QUERY_UNKNOWN], weight);
+}
+
+// Remove the counts of at most GC_SLICE_QUERIES expired queries or as many as
+// can be processed within GC_SLICE_USEC, whatever is reached first. The
+// removed queries are dropped from the ring buffer before the lock is
+// released, readers never see queries whose counts are already gone. Returns
+// the number of removed queries, done is set when no expired queries are left
+//
+// Up to evict queries newer than mintime are removed as well when they have
+// already been stored in the database (or never will be because of the
+// privacy level they were recorded at). Queries of the same second as the
+// last evicted one follow it, the database can then answer for entire
+// seconds (see queries_kept_since())
+static int gc_slice(const time_t mintime, int *evict, bool *done)
+{
+	timer_start(GC_SLICE_TIMER);
+
+	int removed = 0;
+	*done = true;
+	for(long int i = 0; i < counters->queries; i++)
+	{
+		queriesData* query = getQuery(i, true);
+		if(query == NULL)
+			continue;
+
+		// Test if this query is too new
+		const time_t timestamp = query->timestamp;
+		const bool evicted = timestamp > mintime;
+		if(evicted && !((query->flags.database || query->privacylevel >= PRIVACY_MAXIMUM) &&
+		                (*evict > 0 || timestamp < (time_t)atomic_load(&kept_since))))
+			break;
+
+		// Yield the lock when this slice has used up its budget. Reading
+		// the clock is not free, it is only checked every few queries
+		if(removed >= GC_SLICE_QUERIES ||
+		   (removed % 64 == 63 && timer_elapsed_msec(GC_SLICE_TIMER)*1e3 >= GC_SLICE_USEC))
+		{
+			*done = false;
+			break;
+		}
+
+		remove_query_counts(query);
+
+		// Count removed queries
+		removed++;
+		if(evicted)
+			(*evict)--;
+		if(timestamp >= (time_t)atomic_load(&kept_since))
+			atomic_store(&kept_since, (long long)timestamp + 1);
+	}
+
+	// Only perform memory operations when we actually removed queries
+	if(removed > 0)
+	{
+		// Queries are stored in a ring buffer, removing the
+		// oldest ones only advances its tail
+		// Example: (I = now invalid, X = still valid queries, F = free space)
+		//   Before: IIIIIIXXXXFF (tail at first I)
+		//   After:  FFFFFFXXXXFF (tail at first X)
+		remove_oldest_queries(removed);
+
+		// Update DB index as total number of queries reduced
+		lastdbindex -= removed;
+
+		// Cached API responses may contain removed queries
+		respcache_invalidate();
+	}
+
+	timer_stop(GC_SLICE_TIMER);
+	return removed;
+}
+
+// Expired queries are removed in slices. The lock is released in between so
+// queries arriving meanwhile are not delayed until the entire GC run is done.
+// Returns with the lock held unless FTL is terminating
+static bool remove_queries(const time_t mintime, int evict, int *removed, unsigned int *slices)
+{
+	bool done = false;
+	while(!killed)
+	{
+		// Lock FTL's data structure, since it is likely that it will be changed here
+		// Requests should not be processed/answered when data is about to change
+		lock_shm();
+		*removed += gc_slice(mintime, &evict, &done);
+		(*slices)++;
+		if(done)
+			return true;
+		unlock_shm();
+
+		// Give waiting threads a chance to acquire the lock
+		thread_sleepms(GC, 1);
+	}
+
+	return false;
+}
+
+// Has to be called while holding the lock after queries have been removed
+static void rebuild_after_removal(const int removed)
+{
+	// Counts have been reduced above, the leaderboards are
+	// recomputed instead of being adjusted for each query
+	rebuild_leaderboards();
+
+	// Distinct domain counts of clients can not be reduced
+	// either, they are recomputed from the remaining queries
+	if(removed > 0)
+		rebuild_client_cardinality();
+
+	// Prune domains without queries from the search index
+	if(removed > 0)
+		rebuild_trigram_index();
+}
+
+// Evict the oldest queries already stored in the database when there are
+// more than QUERY_MEMORY_LIMIT allows. An eighth of the budget is freed at
+// once so this does not happen again for every few new queries
+static void evict_queries(void)
+{
+	if(max_queries_in_memory <= 0 || counters->queries <= max_queries_in_memory)
+		return;
+
+	const int evict = counters->queries - max_queries_in_memory + max_queries_in_memory/8;
+	int removed = 0;
+	unsigned int slices = 0;
+	timer_start(GC_TIMER);
+	if(!remove_queries(0, evict, &removed, &slices))
+		return;
+
+	if(removed > 0)
+		rebuild_after_removal(removed);
+
+	const double took = timer_stop(GC_TIMER);
+	unlock_shm();
+
+	if(config.debug & DEBUG_GC)
+		logg("Notice: GC evicted %i of %i queries in %u slices (took %.2f ms)", removed, evict, slices, took);
+}
+
+// The API can answer for queries before this timestamp from the database
+// only, they are no longer in memory
+time_t queries_kept_since(void)
+{
+	return (time_t)atomic_load(&kept_since);
+}
+
+// Remove the queries which are older than MAXLOGAGE and everything only they
+// referred to. Returns false if FTL is terminating
+bool run_GC(const time_t now)
+{
+	// Get minimum timestamp to keep (this can be set with MAXLOGAGE)
+	time_t mintime = (now - GCdelay) - config.maxlogage;
+
+	// Align the start time of this GC run to the GCinterval. This will also align with the
+	// oldest overTime interval after GC is done.
+	mintime -= mintime % GCinterval;
+
+	timer_start(GC_TIMER);
+	FTL_PROBE1(gc__start, mintime);
+	if(config.debug & DEBUG_GC)
+	{
+		char timestring[84] = "";
+		get_timestr(timestring, mintime, false);
+		logg("GC starting, mintime: %s (%llu)", timestring, (long long)mintime);
+	}
+
+	int removed = 0;
+	unsigned int slices = 0;
+	if(!remove_queries(mintime, 0, &removed, &slices))
+		return false;
+
+	// The lock is still held after the last slice, determine if
+	// overTime memory needs to get moved
+	moveOverTimeMemory(mintime);
+
+	// Cached API responses may contain old overTime data
+	respcache_invalidate();
+
+	// Reuse the slots of domains and clients without
+	// queries, the search index drops them as well
+	const unsigned int reclaimed = reclaim_entries(now);
+	rebuild_after_removal(removed + (int)reclaimed);
+
+	// Remove no longer referenced strings from the shared
+	// string buffer
+	const size_t freed = compact_strings();
+	if(freed > 0 || config.debug & DEBUG_GC)
+	{
+		char prefix[2] = { 0 };
+		double formatted = 0.0;
+		format_memory_size(prefix, freed, &formatted);
+		logg("Notice: GC freed %.1f %sB of shared string memory", formatted, prefix);
+	}
+
+	const double took = timer_stop(GC_TIMER);
+	FTL_PROBE3(gc__done, removed, reclaimed, (uint64_t)(1e3*took));
+	if(config.debug & DEBUG_GC)
+		logg("Notice: GC removed %i queries in %u slices (took %.2f ms)", removed, slices, took);
+
+	// Release thread lock
+	unlock_shm();
+
+	return true;
+}
+
 void *GC_thread(void *val)
 {
 	// Set thread name
 	thread_names[GC] = "housekeeper";
 	prctl(PR_SET_NAME, thread_names[GC], 0, 0, 0);
+	thread_sched_apply(GC);
 
 	// Remember when we last ran the actions
 	time_t lastGCrun = time(NULL) - time(NULL)%GCinterval;
-	lastRateLimitCleaner = time(NULL);
 	time_t lastResourceCheck = 0;
+	time_t lastDebugReport = time(NULL);
+	time_t nextGroupRecheck = 0;
 
 	// Remember disk usage
 	int LastLogStorageUsage = 0;
@@ -130,11 +412,10 @@ void *GC_thread(void *val)
 	while(!killed)
 	{
 		const time_t now = time(NULL);
-		if((unsigned int)(now - lastRateLimitCleaner) >= config.rate_limit.interval)
+		if(rate_limits_scheduled())
 		{
-			lastRateLimitCleaner = now;
 			lock_shm();
-			reset_rate_limiting();
+			release_rate_limited(now);
 			unlock_shm();
 		}
 
@@ -142,6 +423,26 @@ void *GC_thread(void *val)
 		if(killed)
 			break;
 
+		// Recheck the groups of new clients. This may need several
+		// database queries per client, the lock is released after each
+		// batch of clients so queries are not delayed meanwhile
+		if(!startup && now >= nextGroupRecheck)
+		{
+			unsigned int rechecked;
+			do
+			{
+				lock_shm();
+				rechecked = gravityDB_recheck_clients(now, GROUP_RECHECK_BATCH, &nextGroupRecheck);
+				unlock_shm();
+				if(rechecked == GROUP_RECHECK_BATCH)
+					thread_sleepms(GC, 1);
+			} while(rechecked == GROUP_RECHECK_BATCH && !killed);
+		}
+
+		// Print lock statistics if requested
+		if(get_and_clear_event(DUMP_LOCK_STATS))
+			log_lock_stats();
+
 		// Check available resources
 		if(now - lastResourceCheck >= RCinterval)
 		{
@@ -151,155 +452,60 @@ void *GC_thread(void *val)
 			lastResourceCheck = now;
 		}
 
+		// Report debug messages suppressed by sampling and rate-limiting
+		if(now - lastDebugReport >= DEBUG_REPORT_INTERVAL)
+		{
+			report_debug_limits();
+			lastDebugReport = now;
+		}
+
 		if(now - GCdelay - lastGCrun >= GCinterval || doGC)
 		{
 			doGC = false;
 			// Update lastGCrun timer
 			lastGCrun = now - GCdelay - (now - GCdelay)%GCinterval;
 
-			// Lock FTL's data structure, since it is likely that it will be changed here
-			// Requests should not be processed/answered when data is about to change
-			lock_shm();
-
-			// Get minimum timestamp to keep (this can be set with MAXLOGAGE)
-			time_t mintime = (now - GCdelay) - config.maxlogage;
-
-			// Align the start time of this GC run to the GCinterval. This will also align with the
-			// oldest overTime interval after GC is done.
-			mintime -= mintime % GCinterval;
-
-			if(config.debug & DEBUG_GC)
-			{
-				timer_start(GC_TIMER);
-				char timestring[84] = "";
-				get_timestr(timestring, mintime, false);
-				logg("GC starting, mintime: %s (%llu)", timestring, (long long)mintime);
-			}
-
-			// Process all queries
-			int removed = 0;
-			for(long int i=0; i < counters->queries; i++)
-			{
-				queriesData* query = getQuery(i, true);
-				if(query == NULL)
-					continue;
-
-				// Test if this query is too new
-				if(query->timestamp > mintime)
-					break;
-
-				// Adjust client counter (total and overTime)
-				clientsData* client = getClient(query->clientID, true);
-				const int timeidx = getOverTimeID(query->timestamp);
-				overTime[timeidx].total--;
-				if(client != NULL)
-					change_clientcount(client, -1, 0, timeidx, -1);
-
-				// Adjust domain counter (no overTime information)
-				domainsData* domain = getDomain(query->domainID, true);
-				if(domain != NULL)
-					domain->count--;
-
-				// Get upstream pointer
-
-				// Change other counters according to status of this query
-				switch(query->status)
-				{
-					case QUERY_UNKNOWN:
-						// Unknown (?)
-						break;
-					case QUERY_FORWARDED: // (fall through)
-					case QUERY_RETRIED: // (fall through)
-					case QUERY_RETRIED_DNSSEC:
-						// Forwarded to an upstream DNS server
-						// Adjusting counters is done below in moveOverTimeMemory()
-						break;
-					case QUERY_CACHE:
-					case QUERY_CACHE_STALE:
-						// Answered from local cache _or_ local config
-						break;
-					case QUERY_GRAVITY: // Blocked by Pi-hole's blocking lists (fall through)
-					case QUERY_BLACKLIST: // Exact blocked (fall through)
-					case QUERY_REGEX: // Regex blocked (fall through)
-					case QUERY_EXTERNAL_BLOCKED_IP: // Blocked by upstream provider (fall through)
-					case QUERY_EXTERNAL_BLOCKED_NXRA: // Blocked by upstream provider (fall through)
-					case QUERY_EXTERNAL_BLOCKED_NULL: // Blocked by upstream provider (fall through)
-					case QUERY_GRAVITY_CNAME: // Gravity domain in CNAME chain (fall through)
-					case QUERY_REGEX_CNAME: // Regex blacklisted domain in CNAME chain (fall through)
-					case QUERY_BLACKLIST_CNAME: // Exactly blacklisted domain in CNAME chain (fall through)
-					case QUERY_DBBUSY: // Blocked because gravity database was busy
-					case QUERY_SPECIAL_DOMAIN: // Blocked by special domain handling
-						if(domain != NULL)
-							domain->blockedcount--;
-						if(client != NULL)
-							change_clientcount(client, 0, -1, -1, 0);
-						break;
-					case QUERY_IN_PROGRESS: // Don't have to do anything here
-					case QUERY_STATUS_MAX: // fall through
-					default:
-						/* That cannot happen */
-						break;
-				}
-
-				// Update reply counters
-				counters->reply[query->reply]--;
-
-				// Update type counters
-				if(query->type >= TYPE_A && query->type < TYPE_MAX)
-				{
-					counters->querytype[query->type-1]--;
-				}
-
-				// Set query again to UNKNOWN to reset the counters
-				query_set_status(query, QUERY_UNKNOWN);
-
-				// Finally, remove the last trace of this query
-				counters->status[QUERY_UNKNOWN]--;
-
-				// Count removed queries
-				removed++;
-			}
-
-			// Only perform memory operations when we actually removed queries
-			if(removed > 0)
-			{
-				// Move memory forward to keep only what we want
-				// Note: for overlapping memory blocks, memmove() is a safer approach than memcpy()
-				// Example: (I = now invalid, X = still valid queries, F = free space)
-				//   Before: IIIIIIXXXXFF
-				//   After:  XXXXFFFFFFFF
-				queriesData *dest = getQuery(0, true);
-				queriesData *src = getQuery(removed, true);
-				if(dest && src)
-					memmove(dest, src, (counters->queries - removed)*sizeof(queriesData));
-
-				// Update queries counter
-				counters->queries -= removed;
-				// Update DB index as total number of queries reduced
-				lastdbindex -= removed;
-
-				// ensure remaining memory is zeroed out (marked as "F" in the above example)
-				queriesData *tail = getQuery(counters->queries, true);
-				if(tail)
-					memset(tail, 0, (counters->queries_MAX - counters->queries)*sizeof(queriesData));
-			}
-
-			// Determine if overTime memory needs to get moved
-			moveOverTimeMemory(mintime);
-
-			if(config.debug & DEBUG_GC)
-				logg("Notice: GC removed %i queries (took %.2f ms)", removed, timer_elapsed_msec(GC_TIMER));
-
-			// Release thread lock
-			unlock_shm();
+			if(!run_GC(now))
+				break;
 
 			// After storing data in the database for the next time,
 			// we should scan for old entries, which will then be deleted
 			// to free up pages in the database and prevent it from growing
-			// ever larger and larger
+			// ever larger and larger. Queries beyond ARCHIVEDAYS are
+			// moved into the query archive
 			DBdeleteoldqueries = true;
+			DBarchiveoldqueries = true;
+			wake_thread(DB);
+		}
+
+		// Keep the number of queries in memory within the budget
+		evict_queries();
+
+		// Publish the statistics for local consumers, the object is
+		// removed when SHMEM_STATS is disabled by reloading the config
+		if(config.shmem_stats)
+		{
+			lock_shm_shared();
+			publish_shm_stats();
+			unlock_shm_shared();
 		}
-		thread_sleepms(GC, 1000);
+		else
+			destroy_shm_stats();
+
+		// Sleep until the next task is due or an event arrives
+		time_t next = lastGCrun + GCinterval + GCdelay;
+		if(lastResourceCheck + RCinterval < next)
+			next = lastResourceCheck + RCinterval;
+		if(debug_limits_active() && lastDebugReport + DEBUG_REPORT_INTERVAL < next)
+			next = lastDebugReport + DEBUG_REPORT_INTERVAL;
+		if(nextGroupRecheck < next)
+			next = nextGroupRecheck;
+		// Rate-limited clients are released, the memory budget is
+		// enforced and the statistics are published within a second
+		if(rate_limits_scheduled() || max_queries_in_memory > 0 || config.shmem_stats)
+			next = time(NULL) + 1;
+		const time_t wait = next - time(NULL);
+		wait_for_event(GC, wait > 1 ? (int)wait*1000 : 1000);
 	}
 
 	logg("Terminating GC thread");
@@ -10,7 +10,15 @@
 #ifndef GC_H
 #define GC_H
 
+// time_t
+#include <time.h>
+
 void *GC_thread(void *val);
-time_t get_rate_limit_turnaround(const unsigned int rate_limit_count);
+bool run_GC(const time_t now);
+
+extern bool doGC;
+extern int max_queries_in_memory;
+
+time_t queries_kept_since(void);
 
 #endif //GC_H
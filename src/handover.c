@@ -0,0 +1,423 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Restart handover routines
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "handover.h"
+#include "config.h"
+#include "log.h"
+// counters
+#include "shmem.h"
+// queriesData, clientsData, domainsData, upstreamsData
+#include "datastructure.h"
+// restart_dns_workers()
+#include "workers.h"
+// main_pid()
+#include "signals.h"
+#include <sys/un.h>
+
+// When enabled, a running FTL listens on a unix socket for a new instance of
+// itself. The new process connects before initializing anything, both compare
+// the sizes of the structures kept in shared memory and the running process
+// passes its listening DNS sockets over. It then stops reading from them, lets
+// the queries still in progress finish and terminates, writing a snapshot of
+// the history if the structures match. The new process waits for this, restores
+// the snapshot and reuses the sockets instead of binding new ones. Queries
+// arriving in the meantime wait in the socket buffers instead of being refused
+
+#define HANDOVER_MAGIC "FTLHOVR1"
+// Time the running process waits for queries in progress [milliseconds]
+#define HANDOVER_DRAIN_MSEC 2000
+// Time the new process waits for the running one to terminate [seconds]
+#define HANDOVER_WAIT_SEC 30
+
+enum handover_size { HO_QUERIES, HO_CLIENTS, HO_DOMAINS, HO_UPSTREAMS, HO_COUNTERS, HO_SIZES };
+
+typedef struct {
+	char magic[8];
+	uint32_t sizes[HO_SIZES];
+	// Only set in the reply: the history is handed over as a snapshot
+	bool compatible;
+} handoverMsg;
+
+// Running process
+static int listen_fd = -1;
+static int peer_fd = -1;
+static bool draining = false, terminating = false, compatible = false;
+static struct timespec drain_start;
+
+// New process: sockets received from the previous process not reused so far
+static int inherited[HANDOVER_FDS_MAX];
+static unsigned int num_inherited = 0;
+static bool received = false;
+
+static void get_handover_msg(handoverMsg *msg)
+{
+	memset(msg, 0, sizeof(*msg));
+	memcpy(msg->magic, HANDOVER_MAGIC, sizeof(msg->magic));
+	msg->sizes[HO_QUERIES] = sizeof(queriesData);
+	msg->sizes[HO_CLIENTS] = sizeof(clientsData);
+	msg->sizes[HO_DOMAINS] = sizeof(domainsData);
+	msg->sizes[HO_UPSTREAMS] = sizeof(upstreamsData);
+	msg->sizes[HO_COUNTERS] = sizeof(countersStruct);
+}
+
+static bool get_handover_address(struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if(strlen(FTLfiles.handover) >= sizeof(addr->sun_path))
+	{
+		logg("WARNING: HANDOVERFILE %s is too long", FTLfiles.handover);
+		return false;
+	}
+	strcpy(addr->sun_path, FTLfiles.handover);
+	return true;
+}
+
+// Take over from a running FTL process (if any). This has to be called before
+// the shared memory is initialized as it waits for the running process to
+// terminate
+void handover_request(void)
+{
+	if(!config.handover)
+		return;
+
+	struct sockaddr_un addr;
+	if(!get_handover_address(&addr))
+		return;
+
+	const int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(fd == -1)
+	{
+		logg("WARNING: Cannot create handover socket: %s", strerror(errno));
+		return;
+	}
+
+	if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+	{
+		// No FTL process is running (or it does not support handovers)
+		if(errno != ENOENT && errno != ECONNREFUSED)
+			logg("WARNING: Cannot connect to %s: %s", FTLfiles.handover, strerror(errno));
+		close(fd);
+		return;
+	}
+
+	const struct timeval tv = { HANDOVER_WAIT_SEC, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	handoverMsg msg;
+	get_handover_msg(&msg);
+	if(send(fd, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg))
+	{
+		logg("WARNING: Cannot send handover request: %s", strerror(errno));
+		close(fd);
+		return;
+	}
+
+	// Receive the reply together with the listening sockets
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * HANDOVER_FDS_MAX)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { &msg, sizeof(msg) };
+	struct msghdr mh = { 0 };
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof(control.buf);
+
+	const ssize_t len = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+	if(len != sizeof(msg) || memcmp(msg.magic, HANDOVER_MAGIC, sizeof(msg.magic)) != 0)
+	{
+		logg("WARNING: Invalid handover reply from the running FTL process");
+		close(fd);
+		return;
+	}
+
+	for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg))
+	{
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		const unsigned int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for(unsigned int i = 0; i < n && num_inherited < HANDOVER_FDS_MAX; i++)
+			memcpy(&inherited[num_inherited++], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+	}
+	received = msg.compatible;
+
+	logg("Taking over %u listening sockets from the running FTL process, history is %s",
+	     num_inherited, received ? "handed over" : "imported from the database");
+
+	// The connection is closed when the running process terminates
+	char c;
+	ssize_t rc;
+	while((rc = recv(fd, &c, 1, 0)) > 0 || (rc == -1 && errno == EINTR));
+	if(rc == -1)
+		logg("WARNING: Running FTL process did not terminate: %s", strerror(errno));
+	close(fd);
+}
+
+// Whether the previous process handed its history over
+bool handover_received(void)
+{
+	return received;
+}
+
+static bool same_address(const struct sockaddr *a, const struct sockaddr_storage *b)
+{
+	if(a->sa_family != b->ss_family)
+		return false;
+
+	if(a->sa_family == AF_INET)
+	{
+		struct sockaddr_in a4, b4;
+		memcpy(&a4, a, sizeof(a4));
+		memcpy(&b4, b, sizeof(b4));
+		return a4.sin_port == b4.sin_port &&
+		       a4.sin_addr.s_addr == b4.sin_addr.s_addr;
+	}
+	else if(a->sa_family == AF_INET6)
+	{
+		struct sockaddr_in6 a6, b6;
+		memcpy(&a6, a, sizeof(a6));
+		memcpy(&b6, b, sizeof(b6));
+		return a6.sin6_port == b6.sin6_port &&
+		       a6.sin6_scope_id == b6.sin6_scope_id &&
+		       memcmp(&a6.sin6_addr, &b6.sin6_addr, sizeof(a6.sin6_addr)) == 0;
+	}
+
+	return false;
+}
+
+// Whether the given descriptor is a socket received from the previous process
+bool handover_inherited(const int fd)
+{
+	for(unsigned int i = 0; i < num_inherited; i++)
+		if(inherited[i] == fd)
+			return true;
+
+	return false;
+}
+
+// Return a socket of the given type bound to the given address received from
+// the previous process, -1 if there is none
+int handover_take_socket(const struct sockaddr *addr, const int type)
+{
+	for(unsigned int i = 0; i < num_inherited; i++)
+	{
+		int fdtype = 0;
+		socklen_t len = sizeof(fdtype);
+		if(getsockopt(inherited[i], SOL_SOCKET, SO_TYPE, &fdtype, &len) == -1 || fdtype != type)
+			continue;
+
+		struct sockaddr_storage bound;
+		len = sizeof(bound);
+		if(getsockname(inherited[i], (struct sockaddr*)&bound, &len) == -1 || !same_address(addr, &bound))
+			continue;
+
+		const int fd = inherited[i];
+		inherited[i] = inherited[--num_inherited];
+		return fd;
+	}
+
+	return -1;
+}
+
+// Close the sockets received from the previous process which do not match
+// any of ours, e.g., after the interfaces or ports have been changed
+void handover_close_unused(void)
+{
+	if(num_inherited > 0)
+		logg("Closing %u sockets of the previous FTL process which are not used anymore", num_inherited);
+
+	while(num_inherited > 0)
+		close(inherited[--num_inherited]);
+}
+
+// Listen for a new FTL process
+void handover_listen(void)
+{
+	if(!config.handover)
+		return;
+
+	struct sockaddr_un addr;
+	if(!get_handover_address(&addr))
+		return;
+
+	const int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if(fd == -1)
+	{
+		logg("WARNING: Cannot create handover socket: %s", strerror(errno));
+		return;
+	}
+
+	unlink(addr.sun_path);
+	if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+	   chmod(addr.sun_path, S_IRUSR | S_IWUSR) == -1 ||
+	   listen(fd, 1) == -1)
+	{
+		logg("WARNING: Cannot listen on %s: %s", FTLfiles.handover, strerror(errno));
+		close(fd);
+		return;
+	}
+
+	listen_fd = fd;
+}
+
+// Socket to be polled by the DNS event loop, -1 when not listening
+int handover_fd(void)
+{
+	if(draining || getpid() != main_pid())
+		return -1;
+
+	return listen_fd;
+}
+
+// Hand the given listening sockets over to a connecting process. They are
+// not read anymore after this succeeded
+void handover_accept(const int *fds, const unsigned int nfds)
+{
+	const int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if(fd == -1)
+		return;
+
+	// Only processes of our own user (or root) may take over
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == -1 ||
+	   (cred.uid != 0 && cred.uid != getuid()))
+	{
+		logg("WARNING: Rejecting handover request of another user");
+		close(fd);
+		return;
+	}
+
+	const struct timeval tv = { 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	handoverMsg request, reply;
+	if(recv(fd, &request, sizeof(request), 0) != sizeof(request) ||
+	   memcmp(request.magic, HANDOVER_MAGIC, sizeof(request.magic)) != 0)
+	{
+		logg("WARNING: Invalid handover request from PID %d", (int)cred.pid);
+		close(fd);
+		return;
+	}
+
+	// The history is only handed over if the new process uses the same
+	// structures, the snapshot checks everything else
+	get_handover_msg(&reply);
+	reply.compatible = memcmp(request.sizes, reply.sizes, sizeof(reply.sizes)) == 0;
+
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * HANDOVER_FDS_MAX)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { &reply, sizeof(reply) };
+	struct msghdr mh = { 0 };
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if(nfds > 0)
+	{
+		mh.msg_control = control.buf;
+		mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+
+	if(sendmsg(fd, &mh, MSG_NOSIGNAL) != sizeof(reply))
+	{
+		logg("WARNING: Cannot hand over to PID %d: %s", (int)cred.pid, strerror(errno));
+		close(fd);
+		return;
+	}
+
+	logg("Handing over %u listening sockets to PID %d, history is %s", nfds, (int)cred.pid,
+	     reply.compatible ? "handed over" : "not compatible");
+
+	// The connection is kept open until we terminate, the new process waits
+	// for this
+	peer_fd = fd;
+	compatible = reply.compatible;
+	draining = true;
+	clock_gettime(CLOCK_MONOTONIC, &drain_start);
+
+	// DNS workers read from the sockets, too
+	restart_dns_workers();
+}
+
+// Whether the listening sockets have been handed over
+bool handover_draining(void)
+{
+	return draining;
+}
+
+// Whether there are queries in progress which may still be answered. Queries
+// whose upstream never replied stay in progress until the garbage collection
+// removes them, so only recent ones are waited for. The list of queries in
+// progress is ordered, checking the newest one is sufficient
+static bool queries_in_progress(void)
+{
+	const time_t now = time(NULL);
+	bool pending = false;
+
+	lock_shm();
+	if(counters->inflight > 0)
+	{
+		const queriesData *query = getQuery(seq_queryID(counters->inflight_tail), true);
+		pending = query != NULL && now - (time_t)query->timestamp <= HANDOVER_DRAIN_MSEC / 1000;
+	}
+	unlock_shm();
+
+	return pending;
+}
+
+// Terminate once the queries still in progress have been answered, called on
+// each iteration of the DNS event loop
+void handover_drain(void)
+{
+	if(!draining || terminating)
+		return;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	const long elapsed = (now.tv_sec - drain_start.tv_sec) * 1000L +
+	                     (now.tv_nsec - drain_start.tv_nsec) / 1000000L;
+	const bool pending = queries_in_progress();
+	if(pending && elapsed < HANDOVER_DRAIN_MSEC)
+		return;
+
+	if(pending)
+		logg("Terminating after handover, some queries are still in progress");
+	else
+		logg("Terminating after handover, all queries have been answered (%ld ms)", elapsed);
+
+	terminating = true;
+	kill(getpid(), SIGTERM);
+}
+
+// Whether the history has to be written to a snapshot for the new process
+bool handover_pending(void)
+{
+	return draining && compatible;
+}
+
+void handover_cleanup(void)
+{
+	if(listen_fd == -1 || getpid() != main_pid())
+		return;
+
+	close(listen_fd);
+	listen_fd = -1;
+	unlink(FTLfiles.handover);
+}
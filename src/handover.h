@@ -0,0 +1,35 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Restart handover prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+#include <stdbool.h>
+#include <sys/socket.h>
+
+// Maximum number of listening sockets passed to the new process
+#define HANDOVER_FDS_MAX 64
+
+// New process
+void handover_request(void);
+bool handover_received(void) __attribute__((pure));
+bool handover_inherited(const int fd) __attribute__((pure));
+int handover_take_socket(const struct sockaddr *addr, const int type);
+void handover_close_unused(void);
+
+// Running process
+void handover_listen(void);
+int handover_fd(void);
+void handover_accept(const int *fds, const unsigned int nfds);
+bool handover_draining(void) __attribute__((pure));
+void handover_drain(void);
+bool handover_pending(void) __attribute__((pure));
+void handover_cleanup(void);
+
+#endif //HANDOVER_H
@@ -0,0 +1,167 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Per-client top domains and per-domain top clients
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "heavyhitters.h"
+// INT_MAX
+#include <limits.h>
+// getClient(), getDomain()
+#include "shmem.h"
+
+// All routines in here have to be called while holding the SHM lock
+// (exclusively, except for heavy_hitters_sorted())
+
+// The number of queries of each (client, domain) pair in memory is estimated
+// by a count-min sketch. Each new query increments the pair's counters, the
+// garbage collection decrements them again when it removes the query, so the
+// estimates cover the same time window as all other counters. The estimate
+// never underestimates the true count. Clients and domains keep the pairs
+// with the highest estimates in small top-K arrays which are updated along
+// with the sketch so the API can return them without scanning any queries
+
+// Mix client and domain ID into the column of the given row of the sketch
+static inline unsigned int __attribute__((const)) sketch_column(const int clientID, const int domainID, const unsigned int row)
+{
+	uint64_t h = ((uint64_t)(uint32_t)clientID << 32 | (uint32_t)domainID) + 0x9E3779B97F4A7C15ull * (row + 1u);
+	h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+	h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+	h ^= h >> 31;
+	return (unsigned int)h & (HH_SKETCH_WIDTH - 1);
+}
+
+// Add delta to all counters of a pair and return its new estimate
+static int sketch_add(const int clientID, const int domainID, const int delta)
+{
+	int estimate = INT_MAX;
+	for(unsigned int row = 0; row < HH_SKETCH_DEPTH; row++)
+	{
+		int *counter = &heavy_hitters->counts[row][sketch_column(clientID, domainID, row)];
+		*counter += delta;
+		if(*counter < estimate)
+			estimate = *counter;
+	}
+	return estimate > 0 ? estimate : 0;
+}
+
+// Update the estimate of an ID in a top-K array. New IDs take an unused slot
+// or replace the one with the smallest estimate if theirs is larger. IDs are
+// only added for increments, decrements only update IDs already present
+static void topk_update(heavyHitter *topk, const unsigned int k, const int id, const int count, const bool add)
+{
+	unsigned int minpos = 0;
+	for(unsigned int i = 0; i < k; i++)
+	{
+		if(topk[i].count > 0 && topk[i].id == id)
+		{
+			topk[i].count = count;
+			return;
+		}
+		if(topk[i].count < topk[minpos].count)
+			minpos = i;
+	}
+
+	if(add && count > topk[minpos].count)
+	{
+		topk[minpos].id = id;
+		topk[minpos].count = count;
+	}
+}
+
+// Count (delta = 1) or uncount (delta = -1) a query
+void heavy_hitters_add(const queriesData *query, const int delta)
+{
+	if(heavy_hitters == NULL)
+		return;
+
+	const int count = sketch_add(query->clientID, query->domainID, delta);
+
+	clientsData *client = getClient(query->clientID, true);
+	if(client != NULL)
+		topk_update(client->topdomains, HH_CLIENT_TOPK, query->domainID, count, delta > 0);
+
+	domainsData *domain = getDomain(query->domainID, true);
+	if(domain != NULL)
+		topk_update(domain->topclients, HH_DOMAIN_TOPK, query->clientID, count, delta > 0);
+}
+
+// Re-count all queries in memory, e.g., after restoring a snapshot which does
+// not contain the sketch
+void rebuild_heavy_hitters(void)
+{
+	if(heavy_hitters == NULL)
+		return;
+
+	memset(heavy_hitters, 0, sizeof(*heavy_hitters));
+
+	for(int clientID = 0; clientID < counters->clients; clientID++)
+	{
+		clientsData *client = getClient(clientID, true);
+		if(client != NULL)
+			memset(client->topdomains, 0, sizeof(client->topdomains));
+	}
+
+	for(int domainID = 0; domainID < counters->domains; domainID++)
+	{
+		domainsData *domain = getDomain(domainID, true);
+		if(domain != NULL)
+			memset(domain->topclients, 0, sizeof(domain->topclients));
+	}
+
+	for(int queryID = 0; queryID < counters->queries; queryID++)
+	{
+		const queriesData *query = getQuery(queryID, true);
+		if(query != NULL)
+			heavy_hitters_add(query, 1);
+	}
+}
+
+// Drop the reclaimed domains and clients from the top lists, their IDs may be
+// reused (see reclaim.c)
+void purge_heavy_hitters(void)
+{
+	for(int clientID = 0; clientID < counters->clients; clientID++)
+	{
+		clientsData *client = getClient(clientID, true);
+		if(client == NULL)
+			continue;
+		for(unsigned int i = 0; i < HH_CLIENT_TOPK; i++)
+			if(client->topdomains[i].count > 0 && getDomain(client->topdomains[i].id, true) == NULL)
+				client->topdomains[i].count = 0;
+	}
+
+	for(int domainID = 0; domainID < counters->domains; domainID++)
+	{
+		domainsData *domain = getDomain(domainID, true);
+		if(domain == NULL)
+			continue;
+		for(unsigned int i = 0; i < HH_DOMAIN_TOPK; i++)
+			if(domain->topclients[i].count > 0 && getClient(domain->topclients[i].id, true) == NULL)
+				domain->topclients[i].count = 0;
+	}
+}
+
+static int cmp_heavy_hitter(const void *a, const void *b)
+{
+	const heavyHitter *ha = a, *hb = b;
+	return hb->count - ha->count;
+}
+
+// Copy the used slots of a top-K array sorted by decreasing estimate. Returns
+// the number of entries
+unsigned int heavy_hitters_sorted(const heavyHitter *topk, const unsigned int k, heavyHitter *out)
+{
+	unsigned int n = 0;
+	for(unsigned int i = 0; i < k; i++)
+		if(topk[i].count > 0)
+			out[n++] = topk[i];
+
+	qsort(out, n, sizeof(*out), cmp_heavy_hitter);
+	return n;
+}
@@ -0,0 +1,33 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Per-client top domains and per-domain top clients prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef HEAVYHITTERS_H
+#define HEAVYHITTERS_H
+
+// queriesData, heavyHitter
+#include "datastructure.h"
+
+// Dimensions of the count-min sketch of (client, domain) pairs. The width has
+// to be a power of two
+#define HH_SKETCH_DEPTH 4
+#define HH_SKETCH_WIDTH 32768
+
+// The sketch is stored in shared memory as it is updated by forks, too
+typedef struct {
+	int counts[HH_SKETCH_DEPTH][HH_SKETCH_WIDTH];
+} heavyHittersStruct;
+
+extern heavyHittersStruct *heavy_hitters;
+
+void heavy_hitters_add(const queriesData *query, const int delta);
+void rebuild_heavy_hitters(void);
+void purge_heavy_hitters(void);
+unsigned int heavy_hitters_sorted(const heavyHitter *topk, const unsigned int k, heavyHitter *out);
+
+#endif //HEAVYHITTERS_H
@@ -0,0 +1,42 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Duration statistics helper routines
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+// public prototypes
+#include "histogram.h"
+
+unsigned int __attribute__((const)) hist_bin(const uint64_t usec, const unsigned int bins)
+{
+	if(usec == 0)
+		return 0;
+	const unsigned int bin = 64 - __builtin_clzll(usec);
+	return bin < bins ? bin : bins - 1;
+}
+
+void update_min(uint64_t *min, const uint64_t value)
+{
+	uint64_t old = __atomic_load_n(min, __ATOMIC_RELAXED);
+	while(value < old &&
+	      !__atomic_compare_exchange_n(min, &old, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void update_max(uint64_t *max, const uint64_t value)
+{
+	uint64_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+	while(value > old &&
+	      !__atomic_compare_exchange_n(max, &old, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+uint64_t monotonic_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
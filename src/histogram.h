@@ -0,0 +1,28 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Duration statistics helper prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+// Durations are collected in histograms with logarithmic bins. Bin 0 counts
+// durations below 1 usec, bin i counts durations in [2^(i-1), 2^i) usec, the
+// last bin everything above
+unsigned int hist_bin(const uint64_t usec, const unsigned int bins) __attribute__((const));
+
+// Update minimum or maximum atomically. Several threads may record durations
+// concurrently
+void update_min(uint64_t *min, const uint64_t value);
+void update_max(uint64_t *max, const uint64_t value);
+
+// Get monotonic timestamp in microseconds
+uint64_t monotonic_usec(void);
+
+#endif //HISTOGRAM_H
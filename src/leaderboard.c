@@ -0,0 +1,205 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Top-domain and top-client leaderboards
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "leaderboard.h"
+// INT_MIN
+#include <limits.h>
+// getDomain(), getClient()
+#include "shmem.h"
+// logg()
+#include "log.h"
+// struct config
+#include "config.h"
+// TIME_SCOPE()
+#include "timers.h"
+
+// All routines in here have to be called while holding the SHM lock
+// (exclusively, except for leaderboard_members())
+
+// Find the member with the smallest count
+static int __attribute__((pure)) board_minpos(const leaderboard *board)
+{
+	int minpos = 0;
+	for(int i = 1; i < board->n; i++)
+		if(board->values[i] < board->values[minpos])
+			minpos = i;
+	return minpos;
+}
+
+// Offer an ID which is not on the board. It replaces the member with the
+// smallest count if its own count is larger. Whatever is not on the board
+// afterwards raises the threshold. Returns true if the board changed
+static bool board_offer(leaderboard *board, const int id, const int value, const int minpos)
+{
+	if(board->n < LEADERBOARD_SIZE)
+	{
+		board->ids[board->n] = id;
+		board->values[board->n] = value;
+		board->n++;
+		return true;
+	}
+
+	if(value > board->values[minpos])
+	{
+		board->threshold = MAX(board->threshold, board->values[minpos]);
+		board->ids[minpos] = id;
+		board->values[minpos] = value;
+		return true;
+	}
+
+	board->threshold = MAX(board->threshold, value);
+	return false;
+}
+
+// Report the new count of an ID
+void leaderboard_update(const enum leaderboard_type type, const int id, const int value)
+{
+	if(leaderboards == NULL || type >= LEADERBOARDS)
+		return;
+
+	leaderboard *board = &leaderboards->boards[type];
+	if(!board->valid)
+		return;
+
+	int minpos = 0;
+	for(int i = 0; i < board->n; i++)
+	{
+		if(board->ids[i] == id)
+		{
+			board->values[i] = value;
+			return;
+		}
+		if(board->values[i] < board->values[minpos])
+			minpos = i;
+	}
+
+	board_offer(board, id, value, minpos);
+}
+
+void update_domain_leaderboards(const int domainID)
+{
+	const domainsData *domain = getDomain(domainID, true);
+	if(domain == NULL)
+		return;
+
+	leaderboard_update(BOARD_PERMITTED_DOMAINS, domainID, domain->count - domain->blockedcount);
+	leaderboard_update(BOARD_BLOCKED_DOMAINS, domainID, domain->blockedcount);
+}
+
+void update_client_leaderboards(const int clientID)
+{
+	const clientsData *client = getClient(clientID, true);
+	if(client == NULL)
+		return;
+
+	leaderboard_update(BOARD_CLIENTS, clientID, client->count);
+	leaderboard_update(BOARD_BLOCKED_CLIENTS, clientID, client->blockedcount);
+}
+
+static void start_board(leaderboard *board)
+{
+	board->valid = true;
+	board->n = 0;
+	board->threshold = INT_MIN;
+}
+
+// Add an ID while rebuilding a board, minpos is kept up-to-date
+static void build_offer(leaderboard *board, const int id, const int value, int *minpos)
+{
+	if(board_offer(board, id, value, *minpos) && board->n == LEADERBOARD_SIZE)
+		*minpos = board_minpos(board);
+}
+
+// Compute all leaderboards from scratch. This is done after importing the
+// history and during garbage collection (counts only decrease then and the
+// members would otherwise age out)
+void rebuild_leaderboards(void)
+{
+	TIME_SCOPE("leaderboards_rebuild");
+
+	if(leaderboards == NULL)
+		return;
+
+	leaderboard *permitted = &leaderboards->boards[BOARD_PERMITTED_DOMAINS];
+	leaderboard *blocked = &leaderboards->boards[BOARD_BLOCKED_DOMAINS];
+	start_board(permitted);
+	start_board(blocked);
+	int minpos[LEADERBOARDS] = { 0 };
+	for(int domainID = 0; domainID < counters->domains; domainID++)
+	{
+		const domainsData *domain = getDomain(domainID, true);
+		if(domain == NULL)
+			continue;
+		build_offer(permitted, domainID, domain->count - domain->blockedcount, &minpos[BOARD_PERMITTED_DOMAINS]);
+		build_offer(blocked, domainID, domain->blockedcount, &minpos[BOARD_BLOCKED_DOMAINS]);
+	}
+
+	leaderboard *clients = &leaderboards->boards[BOARD_CLIENTS];
+	leaderboard *blocked_clients = &leaderboards->boards[BOARD_BLOCKED_CLIENTS];
+	start_board(clients);
+	start_board(blocked_clients);
+	for(int clientID = 0; clientID < counters->clients; clientID++)
+	{
+		const clientsData *client = getClient(clientID, true);
+		if(client == NULL)
+			continue;
+		build_offer(clients, clientID, client->count, &minpos[BOARD_CLIENTS]);
+		build_offer(blocked_clients, clientID, client->blockedcount, &minpos[BOARD_BLOCKED_CLIENTS]);
+	}
+
+	if(config.debug & DEBUG_GC)
+	{
+		for(unsigned int i = 0; i < LEADERBOARDS; i++)
+			logg("Leaderboard %u: %i members, threshold %i", i,
+			     leaderboards->boards[i].n, leaderboards->boards[i].threshold);
+	}
+}
+
+// Get the members of a leaderboard and the threshold above which they are
+// exact. Returns the number of members or -1 if the board is not available
+int leaderboard_members(const enum leaderboard_type type, int ids[LEADERBOARD_SIZE], int *threshold)
+{
+	if(leaderboards == NULL || type >= LEADERBOARDS)
+		return -1;
+
+	const leaderboard *board = &leaderboards->boards[type];
+	if(!board->valid)
+		return -1;
+
+	memcpy(ids, board->ids, board->n*sizeof(int));
+	*threshold = board->threshold;
+	return board->n;
+}
+
+// Get the position of an ID on a leaderboard (zero for the largest count) or
+// -1 if it is not on the board
+int leaderboard_rank(const enum leaderboard_type type, const int id)
+{
+	if(leaderboards == NULL || type >= LEADERBOARDS)
+		return -1;
+
+	const leaderboard *board = &leaderboards->boards[type];
+	if(!board->valid)
+		return -1;
+
+	int pos = -1;
+	for(int i = 0; i < board->n; i++)
+		if(board->ids[i] == id)
+			pos = i;
+	if(pos < 0)
+		return -1;
+
+	int rank = 0;
+	for(int i = 0; i < board->n; i++)
+		if(board->values[i] > board->values[pos])
+			rank++;
+	return rank;
+}
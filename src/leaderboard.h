@@ -0,0 +1,52 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Top-domain and top-client leaderboard prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef LEADERBOARD_H
+#define LEADERBOARD_H
+
+#include <stdbool.h>
+
+// Number of candidates kept on each leaderboard
+#define LEADERBOARD_SIZE 64
+
+enum leaderboard_type {
+	BOARD_PERMITTED_DOMAINS,
+	BOARD_BLOCKED_DOMAINS,
+	BOARD_CLIENTS,
+	BOARD_BLOCKED_CLIENTS,
+	LEADERBOARDS
+} __attribute__ ((packed));
+
+// A leaderboard holds the IDs with the highest counts seen so far. Counts are
+// not reliable (they are verified on read), what matters is the threshold: no
+// ID that is not on the board has a count above it. Hence, all members with
+// counts above the threshold are guaranteed to be the exact top entries.
+// Leaderboards are stored in shared memory as they are updated by forks, too
+typedef struct {
+	bool valid;
+	int n;
+	int threshold;
+	int ids[LEADERBOARD_SIZE];
+	int values[LEADERBOARD_SIZE];
+} leaderboard;
+
+typedef struct {
+	leaderboard boards[LEADERBOARDS];
+} leaderboardsStruct;
+
+extern leaderboardsStruct *leaderboards;
+
+void leaderboard_update(const enum leaderboard_type type, const int id, const int value);
+void update_domain_leaderboards(const int domainID);
+void update_client_leaderboards(const int clientID);
+void rebuild_leaderboards(void);
+int leaderboard_members(const enum leaderboard_type type, int ids[LEADERBOARD_SIZE], int *threshold);
+int leaderboard_rank(const enum leaderboard_type type, const int id) __attribute__((pure));
+
+#endif //LEADERBOARD_H
@@ -0,0 +1,175 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Read-only access to the statistics published in shared memory
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+// This file is also built as libftlstats.a for other programs and must not
+// depend on any other part of FTL
+#include "ftlstats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Number of attempts to get a consistent copy before giving up
+#define FTLSTATS_RETRIES 1000
+
+// Statistics older than this are checked for a restart of FTL [s]
+#define FTLSTATS_STALE 5
+
+struct ftlstats_handle {
+	char *name;
+	// Mapped read-only, the structure is not const only for atomic_load()
+	struct ftlstats_shm *shm;
+	size_t size;
+	ino_t inode;
+};
+
+static int map_stats(ftlstats_handle *handle)
+{
+	const int fd = shm_open(handle->name, O_RDONLY, 0);
+	if(fd < 0)
+		return -1;
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct ftlstats_shm))
+	{
+		close(fd);
+		errno = EPROTO;
+		return -1;
+	}
+
+	void *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(ptr == MAP_FAILED)
+		return -1;
+
+	struct ftlstats_shm *shm = ptr;
+	if(shm->magic != FTLSTATS_MAGIC || shm->version != FTLSTATS_VERSION)
+	{
+		munmap(ptr, st.st_size);
+		errno = EPROTO;
+		return -1;
+	}
+
+	if(handle->shm != NULL)
+		munmap(handle->shm, handle->size);
+	handle->shm = shm;
+	handle->size = st.st_size;
+	handle->inode = st.st_ino;
+	return 0;
+}
+
+ftlstats_handle *ftlstats_open(const char *name)
+{
+	ftlstats_handle *handle = calloc(1, sizeof(*handle));
+	if(handle == NULL)
+		return NULL;
+
+	handle->name = strdup(name != NULL ? name : FTLSTATS_SHM_NAME);
+	if(handle->name == NULL || map_stats(handle) != 0)
+	{
+		const int err = errno;
+		free(handle->name);
+		free(handle);
+		errno = err;
+		return NULL;
+	}
+
+	return handle;
+}
+
+// FTL creates a new object when it is restarted, the mapping of the old one
+// stays valid but is no longer updated
+static int check_restart(ftlstats_handle *handle)
+{
+	struct stat st;
+	const int fd = shm_open(handle->name, O_RDONLY, 0);
+	if(fd < 0 || fstat(fd, &st) != 0)
+	{
+		if(fd > -1)
+			close(fd);
+		errno = ESTALE;
+		return -1;
+	}
+	close(fd);
+
+	if(st.st_ino == handle->inode)
+		return 0;
+
+	if(map_stats(handle) != 0)
+	{
+		errno = ESTALE;
+		return -1;
+	}
+	return 0;
+}
+
+static int copy_stats(struct ftlstats_shm *shm, struct ftlstats *stats)
+{
+	// Copy only the fields known to both sides
+	const size_t size = shm->size < sizeof(*stats) ? shm->size : sizeof(*stats);
+	for(unsigned int i = 0; i < FTLSTATS_RETRIES; i++)
+	{
+		const unsigned int seq = atomic_load_explicit(&shm->seq, memory_order_acquire);
+		if(seq & 1u)
+		{
+			// FTL is updating the statistics
+			sched_yield();
+			continue;
+		}
+
+		memcpy(stats, &shm->stats, size);
+		atomic_thread_fence(memory_order_acquire);
+		if(atomic_load_explicit(&shm->seq, memory_order_relaxed) == seq)
+		{
+			if(size < sizeof(*stats))
+				memset((char*)stats + size, 0, sizeof(*stats) - size);
+			return 0;
+		}
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
+
+int ftlstats_read(ftlstats_handle *handle, struct ftlstats *stats)
+{
+	if(handle == NULL || stats == NULL)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if(copy_stats(handle->shm, stats) != 0)
+		return -1;
+
+	if(time(NULL) - stats->updated <= FTLSTATS_STALE)
+		return 0;
+
+	// Old statistics, FTL may have been restarted
+	if(check_restart(handle) != 0)
+		return -1;
+	return copy_stats(handle->shm, stats);
+}
+
+void ftlstats_close(ftlstats_handle *handle)
+{
+	if(handle == NULL)
+		return;
+
+	if(handle->shm != NULL)
+		munmap(handle->shm, handle->size);
+	free(handle->name);
+	free(handle);
+}
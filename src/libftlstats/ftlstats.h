@@ -0,0 +1,105 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Read-only access to the statistics published in shared memory
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef FTLSTATS_H
+#define FTLSTATS_H
+
+// With SHMEM_STATS=true, FTL publishes a summary of its statistics once per
+// second in the shared memory object FTLSTATS_SHM_NAME. Local processes
+// allowed to read it (owner and group of FTL) map it read-only with this
+// library instead of asking the API, FTL does not have to serialize anything
+// and readers never take FTL's locks.
+//
+// Layout contract: struct ftlstats_shm is the content of the object. The
+// version is only incremented on incompatible changes. Compatible changes
+// append fields to struct ftlstats and increase size, readers copy the part
+// they know. All fields have fixed sizes, integers are in host byte order.
+//
+// Consistency: seq is a sequence lock. FTL increments it to an odd value
+// before updating stats and to the next even value afterwards. Readers copy
+// stats and retry if seq was odd or has changed meanwhile (see ftlstats_read())
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define FTLSTATS_SHM_NAME "FTL-stats"
+#define FTLSTATS_MAGIC 0x534c5446u // "FTLS" in little endian
+#define FTLSTATS_VERSION 1u
+
+// Number of overTime slots (24 hours in 10 minute slots)
+#define FTLSTATS_SLOTS 145u
+// Entries per top list and longest name (including the terminating zero)
+#define FTLSTATS_TOP 10u
+#define FTLSTATS_NAME_MAX 128u
+
+enum ftlstats_list {
+	FTLSTATS_TOP_DOMAINS,
+	FTLSTATS_TOP_ADS,
+	FTLSTATS_TOP_CLIENTS,
+	FTLSTATS_TOP_BLOCKED_CLIENTS,
+	FTLSTATS_LISTS
+};
+
+struct ftlstats_entry {
+	int32_t count;
+	char name[FTLSTATS_NAME_MAX];
+};
+
+struct ftlstats {
+	// Time of the last update [s since the epoch] and PID of FTL
+	int64_t updated;
+	int32_t pid;
+	// Queries within the last 24 hours
+	int32_t total;
+	int32_t blocked;
+	int32_t cached;
+	int32_t forwarded;
+	int32_t domains;
+	int32_t clients;
+	// Domains on the adlists
+	int32_t gravity;
+	// 0 = disabled, 1 = enabled, 2 = unknown
+	int32_t blocking;
+	int32_t privacy_level;
+	// overTime, the oldest slot first
+	uint32_t slots;
+	int64_t slot_timestamp[FTLSTATS_SLOTS];
+	int32_t slot_total[FTLSTATS_SLOTS];
+	int32_t slot_blocked[FTLSTATS_SLOTS];
+	int32_t slot_cached[FTLSTATS_SLOTS];
+	int32_t slot_forwarded[FTLSTATS_SLOTS];
+	// Top lists, empty if hidden by the privacy level
+	uint32_t top_n[FTLSTATS_LISTS];
+	struct ftlstats_entry top[FTLSTATS_LISTS][FTLSTATS_TOP];
+};
+
+struct ftlstats_shm {
+	uint32_t magic;
+	uint32_t version;
+	// sizeof(struct ftlstats) of the publishing FTL
+	uint32_t size;
+	atomic_uint seq;
+	struct ftlstats stats;
+};
+
+typedef struct ftlstats_handle ftlstats_handle;
+
+// Map the statistics, name may be NULL for FTLSTATS_SHM_NAME. Returns NULL
+// and sets errno on errors (ENOENT: FTL is not running or does not publish,
+// EPROTO: incompatible version)
+ftlstats_handle *ftlstats_open(const char *name);
+
+// Copy a consistent snapshot of the statistics. Returns 0 on success and -1
+// with errno set otherwise (EAGAIN: FTL was updating them for too long,
+// ESTALE: FTL has been restarted and the statistics cannot be mapped again)
+int ftlstats_read(ftlstats_handle *handle, struct ftlstats *stats);
+
+void ftlstats_close(ftlstats_handle *handle);
+
+#endif //FTLSTATS_H
@@ -0,0 +1,125 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  SHM lock profiling routines
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+// public prototypes
+#include "lockstats.h"
+// logg()
+#include "log.h"
+// hist_bin()
+#include "histogram.h"
+
+// Statistics are collected per process. They are not stored in shared memory
+// as the lock itself is what we are measuring here. Forks (TCP workers) start
+// off with a copy of the statistics of the main process
+static lock_site sites[LOCK_SITES_MAX] = {{ 0 }};
+static unsigned int num_sites = 0;
+
+// Only used when registering new call sites, which happens only once per site
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Find the statistics of a call site, register it if it is not known yet.
+// Returns NULL when all slots are in use
+lock_site *lock_stats_site(const char *func, const int line, const char *file, const bool shared)
+{
+	// Open addressing with linear probing. Sites are never removed, hence
+	// an empty slot terminates the search
+	unsigned int i = ((unsigned int)line * 2654435761u + shared) % LOCK_SITES_MAX;
+	for(unsigned int probe = 0; probe < LOCK_SITES_MAX; probe++, i = (i + 1) % LOCK_SITES_MAX)
+	{
+		const char *site_file = __atomic_load_n(&sites[i].file, __ATOMIC_ACQUIRE);
+		if(site_file == NULL)
+		{
+			// Register new site. Check again under the mutex as another
+			// thread may have been faster
+			pthread_mutex_lock(&sites_lock);
+			if(sites[i].file == NULL)
+			{
+				sites[i].func = func;
+				sites[i].line = line;
+				sites[i].shared = shared;
+				__atomic_store_n(&sites[i].file, file, __ATOMIC_RELEASE);
+				num_sites++;
+				pthread_mutex_unlock(&sites_lock);
+				return &sites[i];
+			}
+			pthread_mutex_unlock(&sites_lock);
+			site_file = sites[i].file;
+		}
+
+		if(sites[i].line == line && sites[i].shared == shared &&
+		   (site_file == file || strcmp(site_file, file) == 0))
+			return &sites[i];
+	}
+
+	// Table is full
+	return NULL;
+}
+
+// Record that a lock has been obtained after waiting for wait_usec
+void lock_stats_acquired(lock_site *site, const uint64_t wait_usec)
+{
+	if(site == NULL)
+		return;
+
+	__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&site->wait_total, wait_usec, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&site->wait_hist[hist_bin(wait_usec, LOCK_HIST_BINS)], 1, __ATOMIC_RELAXED);
+	update_max(&site->wait_max, wait_usec);
+}
+
+// Record that a lock has been released after holding it for hold_usec
+void lock_stats_released(lock_site *site, const uint64_t hold_usec)
+{
+	if(site == NULL)
+		return;
+
+	__atomic_fetch_add(&site->hold_total, hold_usec, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&site->hold_hist[hist_bin(hold_usec, LOCK_HIST_BINS)], 1, __ATOMIC_RELAXED);
+	update_max(&site->hold_max, hold_usec);
+}
+
+// Number of call sites with statistics
+unsigned int lock_stats_sites(void)
+{
+	return num_sites;
+}
+
+// Get the i-th call site with statistics (sites are not stored consecutively)
+const lock_site *lock_stats_get(const unsigned int i)
+{
+	unsigned int n = 0;
+	for(unsigned int j = 0; j < LOCK_SITES_MAX; j++)
+	{
+		if(sites[j].file == NULL)
+			continue;
+		if(n++ == i)
+			return &sites[j];
+	}
+	return NULL;
+}
+
+// Print lock statistics to the log, e.g., on SIGRTMIN+7
+void log_lock_stats(void)
+{
+	logg("SHM lock statistics (%u call sites, times in usec):", num_sites);
+	for(unsigned int i = 0; i < LOCK_SITES_MAX; i++)
+	{
+		const lock_site *site = &sites[i];
+		if(site->file == NULL || site->count == 0)
+			continue;
+
+		logg(" %s() (%s:%i) %s: count %lu, wait avg %lu max %lu, hold avg %lu max %lu",
+		     site->func, site->file, site->line, site->shared ? "shared" : "exclusive",
+		     (unsigned long)site->count,
+		     (unsigned long)(site->wait_total / site->count), (unsigned long)site->wait_max,
+		     (unsigned long)(site->hold_total / site->count), (unsigned long)site->hold_max);
+	}
+}
@@ -0,0 +1,42 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  SHM lock profiling prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef LOCKSTATS_H
+#define LOCKSTATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Maximum number of distinct call sites we keep statistics for
+#define LOCK_SITES_MAX 128
+// Number of histogram bins (see hist_bin())
+#define LOCK_HIST_BINS 20
+
+typedef struct {
+	const char *func;
+	const char *file;
+	int line;
+	bool shared;
+	uint64_t count;
+	uint64_t wait_total;
+	uint64_t wait_max;
+	uint64_t hold_total;
+	uint64_t hold_max;
+	uint64_t wait_hist[LOCK_HIST_BINS];
+	uint64_t hold_hist[LOCK_HIST_BINS];
+} lock_site;
+
+lock_site *lock_stats_site(const char *func, const int line, const char *file, const bool shared);
+void lock_stats_acquired(lock_site *site, const uint64_t wait_usec);
+void lock_stats_released(lock_site *site, const uint64_t hold_usec);
+unsigned int lock_stats_sites(void) __attribute__((pure));
+const lock_site *lock_stats_get(const unsigned int i) __attribute__((pure));
+void log_lock_stats(void);
+
+#endif //LOCKSTATS_H
@@ -24,9 +24,65 @@
 #include "signals.h"
 // logg_fatal_dnsmasq_message()
 #include "database/message-table.h"
+// wake_thread(), wait_for_event()
+#include "events.h"
+// sleepms()
+#include "timers.h"
+#include <stdatomic.h>
+// thread_sched_apply()
+#include "threadsched.h"
+// known_domains(), known_clients()
+#include "reclaim.h"
 
 static bool print_log = true, print_stdout = true;
 
+// Opening, writing and closing the log file for every line is expensive. When
+// LOG_BUFFER is set, the lines are formatted by the logging threads and added
+// to a bounded lock-free multi-producer queue (a ring of fixed-size slots with
+// sequence numbers). The log writer thread collects them and writes them with
+// a single write() to the log file it keeps open. The file is reopened on
+// SIGHUP and when it has been replaced (logrotate). Lines are dropped (and
+// counted) when the queue is full, logging never blocks.
+//
+// Lines longer than a slot, lines logged by forks and lines logged before the
+// log writer thread started or after it stopped are written synchronously
+
+// Maximum length of a queued line (including the prefix)
+#define LOG_LINE_MAX 500
+// Size of the buffer used by the log writer thread for a single write()
+#define LOG_WRITE_MAX 65536
+
+struct log_slot {
+	_Atomic size_t seq;
+	size_t len;
+	char line[LOG_LINE_MAX];
+};
+
+static struct {
+	struct log_slot *slots;
+	size_t mask;
+	_Atomic size_t enqueue;
+	size_t dequeue; // only used by the consumer
+	_Atomic bool enabled;
+	_Atomic bool reopen;
+	_Atomic unsigned int producers;
+	atomic_flag consumer;
+	int fd;
+} ring = { NULL, 0u, 0u, 0u, false, false, 0u, ATOMIC_FLAG_INIT, -1 };
+
+static _Atomic unsigned long lines_written = 0ul, lines_dropped = 0ul;
+
+// Incremented in every forked process, this invalidates the cached IDs
+static unsigned int fork_generation = 0u;
+
+static void log_forked(void)
+{
+	fork_generation++;
+
+	// There is no log writer thread in the fork
+	atomic_store(&ring.enabled, false);
+}
+
 void log_ctrl(bool plog, bool pstdout)
 {
 	print_log = plog;
@@ -49,6 +105,8 @@ void init_FTL_log(void)
 	}
 
 	fclose(logfile);
+
+	pthread_atfork(NULL, NULL, log_forked);
 }
 
 // The size of 84 bytes has been carefully selected for all possible timestamps
@@ -76,9 +134,128 @@ void get_timestr(char * const timestring, const time_t timein, const bool millis
 	}
 }
 
+// Write "[<time> <ID>] " into buffer. The process and thread IDs and the
+// formatted time (per second) are cached for every thread
+static int log_prefix(char *buffer, const size_t size)
+{
+	static __thread struct {
+		bool valid;
+		unsigned int generation;
+		pid_t mpid;
+		time_t sec;
+		char id[42];
+		char time[32];
+	} cache = { false, 0u, -1, -1, "", "" };
+
+	// Get and log PID of current process to avoid ambiguities when more than one
+	// pihole-FTL instance is logging into the same file
+	const int mpid = main_pid(); // Get the process ID of the main FTL process
+	if(!cache.valid || cache.generation != fork_generation || cache.mpid != mpid)
+	{
+		const int pid = getpid(); // Get the process ID of the calling process
+		const int tid = gettid(); // Get the thread ID of the calling process
+
+		// There are four cases we have to differentiate here:
+		if(pid == tid)
+			if(is_fork(mpid, pid))
+				// Fork of the main process
+				snprintf(cache.id, sizeof(cache.id)-1, "%i/F%i", pid, mpid);
+			else
+				// Main process
+				snprintf(cache.id, sizeof(cache.id)-1, "%iM", pid);
+		else
+			if(is_fork(mpid, pid))
+				// Thread of a fork of the main process
+				snprintf(cache.id, sizeof(cache.id)-1, "%i/F%i/T%i", pid, mpid, tid);
+			else
+				// Thread of the main process
+				snprintf(cache.id, sizeof(cache.id)-1, "%i/T%i", pid, tid);
+
+		cache.valid = true;
+		cache.generation = fork_generation;
+		cache.mpid = mpid;
+	}
+
+	// The coarse clock is good enough for the milliseconds shown and does
+	// not need a system call
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME_COARSE, &now);
+	if(now.tv_sec != cache.sec)
+	{
+		struct tm tm;
+		localtime_r(&now.tv_sec, &tm);
+		snprintf(cache.time, sizeof(cache.time), "%d-%02d-%02d %02d:%02d:%02d",
+		         tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+		         tm.tm_hour, tm.tm_min, tm.tm_sec);
+		cache.sec = now.tv_sec;
+	}
+
+	return snprintf(buffer, size, "[%s.%03li %s] ", cache.time,
+	                now.tv_nsec / 1000000, cache.id);
+}
+
+// Format a line and add it to the queue. Returns false if it has to be
+// written synchronously
+static bool __attribute__ ((format (gnu_printf, 3, 0)))
+enqueue_line(const char *prefix, const int plen, const char *format, va_list args)
+{
+	char line[LOG_LINE_MAX];
+	memcpy(line, prefix, plen);
+	const int len = vsnprintf(line + plen, sizeof(line) - plen, format, args);
+	if(len < 0 || (size_t)(plen + len) >= sizeof(line))
+		return false;
+	line[plen + len] = '\n';
+
+	// Reserve a slot, see Vyukov's bounded MPMC queue
+	struct log_slot *slot;
+	size_t pos = atomic_load_explicit(&ring.enqueue, memory_order_relaxed);
+	while(true)
+	{
+		slot = &ring.slots[pos & ring.mask];
+		const size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		const long diff = (long)(seq - pos);
+		if(diff == 0)
+		{
+			if(atomic_compare_exchange_weak_explicit(&ring.enqueue, &pos, pos + 1,
+			                                         memory_order_relaxed,
+			                                         memory_order_relaxed))
+				break;
+		}
+		else if(diff < 0)
+		{
+			// The queue is full, drop the line
+			atomic_fetch_add_explicit(&lines_dropped, 1ul, memory_order_relaxed);
+			return true;
+		}
+		else
+			pos = atomic_load_explicit(&ring.enqueue, memory_order_relaxed);
+	}
+
+	memcpy(slot->line, line, plen + len + 1);
+	slot->len = plen + len + 1;
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+	// Wake up the writer whenever half of the queue has been filled
+	if((pos & (ring.mask >> 1)) == 0)
+		wake_thread(LOGWRITER);
+
+	return true;
+}
+
+static bool __attribute__ ((format (gnu_printf, 3, 0)))
+queue_line(const char *prefix, const int plen, const char *format, va_list args)
+{
+	// sync_FTL_log() waits for lines which are just being added
+	atomic_fetch_add(&ring.producers, 1u);
+	const bool queued = atomic_load(&ring.enabled) && enqueue_line(prefix, plen, format, args);
+	atomic_fetch_sub(&ring.producers, 1u);
+
+	return queued;
+}
+
 void _FTL_log(const bool newline, const bool debug, const char *format, ...)
 {
-	char timestring[84] = "";
+	char prefix[128] = "";
 	va_list args;
 
 	// We have been explicitly asked to not print anything to the log
@@ -89,37 +266,14 @@ void _FTL_log(const bool newline, const bool debug, const char *format, ...)
 	if(debug && !config.debug)
 		return;
 
-	get_timestr(timestring, time(NULL), true);
-
-	// Get and log PID of current process to avoid ambiguities when more than one
-	// pihole-FTL instance is logging into the same file
-	char idstr[42];
-	const int pid = getpid(); // Get the process ID of the calling process
-	const int mpid = main_pid(); // Get the process ID of the main FTL process
-	const int tid = gettid(); // Get the thread ID of the calling process
-
-	// There are four cases we have to differentiate here:
-	if(pid == tid)
-		if(is_fork(mpid, pid))
-			// Fork of the main process
-			snprintf(idstr, sizeof(idstr)-1, "%i/F%i", pid, mpid);
-		else
-			// Main process
-			snprintf(idstr, sizeof(idstr)-1, "%iM", pid);
-	else
-		if(is_fork(mpid, pid))
-			// Thread of a fork of the main process
-			snprintf(idstr, sizeof(idstr)-1, "%i/F%i/T%i", pid, mpid, tid);
-		else
-			// Thread of the main process
-			snprintf(idstr, sizeof(idstr)-1, "%i/T%i", pid, tid);
+	const int plen = log_prefix(prefix, sizeof(prefix));
 
 	// Print to stdout before writing to file
 	if((!daemonmode || cli_mode) && print_stdout)
 	{
 		// Only print time/ID string when not in direct user interaction (CLI mode)
 		if(!cli_mode)
-			printf("[%s %s] ", timestring, idstr);
+			fputs(prefix, stdout);
 		va_start(args, format);
 		vprintf(format, args);
 		va_end(args);
@@ -129,13 +283,19 @@ void _FTL_log(const bool newline, const bool debug, const char *format, ...)
 
 	if(print_log && FTLfiles.log != NULL)
 	{
+		va_start(args, format);
+		const bool queued = queue_line(prefix, plen, format, args);
+		va_end(args);
+		if(queued)
+			return;
+
 		// Open log file
 		FILE *logfile = fopen(FTLfiles.log, "a+");
 
 		// Write to log file
 		if(logfile != NULL)
 		{
-			fprintf(logfile, "[%s %s] ", timestring, idstr);
+			fputs(prefix, logfile);
 			va_start(args, format);
 			vfprintf(logfile, format, args);
 			va_end(args);
@@ -151,6 +311,201 @@ void _FTL_log(const bool newline, const bool debug, const char *format, ...)
 	}
 }
 
+// Allocate the queue. Returns true if the log writer thread is to be started
+bool init_log_buffer(void)
+{
+	if(config.log_buffer == 0 || FTLfiles.log == NULL)
+		return false;
+
+	// Number of slots, rounded down to a power of two
+	size_t slots = 2u;
+	while(2u * slots * sizeof(struct log_slot) <= (size_t)config.log_buffer * 1024u)
+		slots *= 2u;
+
+	ring.slots = calloc(slots, sizeof(struct log_slot));
+	if(ring.slots == NULL)
+	{
+		logg("WARNING: Cannot allocate log buffer, logging synchronously");
+		return false;
+	}
+
+	for(size_t i = 0; i < slots; i++)
+		atomic_init(&ring.slots[i].seq, i);
+	ring.mask = slots - 1u;
+
+	return true;
+}
+
+// Reopen the log file, e.g., after it has been rotated
+void reopen_FTL_log(void)
+{
+	atomic_store(&ring.reopen, true);
+}
+
+// Has the log file been moved or removed?
+static bool log_file_replaced(void)
+{
+	struct stat path, fd;
+	if(stat(FTLfiles.log, &path) != 0 || fstat(ring.fd, &fd) != 0)
+		return true;
+
+	return path.st_dev != fd.st_dev || path.st_ino != fd.st_ino;
+}
+
+static void open_log_file(void)
+{
+	if(ring.fd > -1)
+		close(ring.fd);
+
+	ring.fd = open(FTLfiles.log, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+}
+
+static void write_buffer(const char *buffer, size_t len, const unsigned long lines)
+{
+	if(ring.fd < 0)
+		open_log_file();
+
+	while(len > 0 && ring.fd > -1)
+	{
+		const ssize_t ret = write(ring.fd, buffer, len);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			break;
+		buffer += ret;
+		len -= ret;
+	}
+
+	if(len == 0)
+		atomic_fetch_add_explicit(&lines_written, lines, memory_order_relaxed);
+	else
+		atomic_fetch_add_explicit(&lines_dropped, lines, memory_order_relaxed);
+}
+
+// Write all queued lines. Only one thread may do this at a time
+static void write_lines(void)
+{
+	static char buffer[LOG_WRITE_MAX];
+	static unsigned long reported = 0ul;
+	size_t used = 0u;
+	unsigned long lines = 0ul;
+
+	while(true)
+	{
+		struct log_slot *slot = &ring.slots[ring.dequeue & ring.mask];
+		if(atomic_load_explicit(&slot->seq, memory_order_acquire) != ring.dequeue + 1)
+			break;
+
+		if(used + slot->len > sizeof(buffer))
+		{
+			write_buffer(buffer, used, lines);
+			used = 0u;
+			lines = 0ul;
+		}
+
+		memcpy(buffer + used, slot->line, slot->len);
+		used += slot->len;
+		lines++;
+
+		// Hand the slot back to the producers
+		atomic_store_explicit(&slot->seq, ring.dequeue + ring.mask + 1, memory_order_release);
+		ring.dequeue++;
+	}
+
+	// Tell the user about lines we had to drop
+	const unsigned long dropped = atomic_load_explicit(&lines_dropped, memory_order_relaxed);
+	if(dropped != reported && sizeof(buffer) - used > LOG_LINE_MAX)
+	{
+		used += log_prefix(buffer + used, LOG_LINE_MAX);
+		used += snprintf(buffer + used, LOG_LINE_MAX, "WARNING: %lu log lines dropped\n",
+		                 dropped - reported);
+		reported = dropped;
+	}
+
+	if(used > 0)
+		write_buffer(buffer, used, lines);
+}
+
+// Stop queueing lines and write all queued lines. Called when the log writer
+// thread terminates and before logging a crash
+void sync_FTL_log(void)
+{
+	if(!atomic_exchange(&ring.enabled, false))
+		return;
+
+	// Give lines which are just being added a moment to arrive
+	for(unsigned int i = 0; i < 1000 && atomic_load(&ring.producers) > 0; i++)
+		sched_yield();
+
+	// Wait for the log writer thread (if it is busy) and write what is left
+	for(unsigned int i = 0; i < 100; i++)
+	{
+		if(!atomic_flag_test_and_set(&ring.consumer))
+		{
+			write_lines();
+			atomic_flag_clear(&ring.consumer);
+			return;
+		}
+		sleepms(1);
+	}
+}
+
+static void log_thread_cleanup(void *val)
+{
+	(void)val;
+	sync_FTL_log();
+}
+
+void *log_thread(void *val)
+{
+	(void)val;
+
+	// Set thread name
+	thread_names[LOGWRITER] = "log writer";
+	prctl(PR_SET_NAME, thread_names[LOGWRITER], 0, 0, 0);
+	thread_sched_apply(LOGWRITER);
+
+	// Lines are queued from now on
+	open_log_file();
+	atomic_store(&ring.enabled, true);
+
+	// The thread is cancelled by terminate_threads() while waiting, the
+	// remaining lines are written synchronously from then on
+	pthread_cleanup_push(log_thread_cleanup, NULL);
+
+	time_t checked = 0;
+	while(!killed)
+	{
+		// Do not get cancelled while writing
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		const time_t now = time(NULL);
+		if(atomic_exchange(&ring.reopen, false) ||
+		   (now != checked && log_file_replaced()))
+			open_log_file();
+		checked = now;
+
+		if(!atomic_flag_test_and_set(&ring.consumer))
+		{
+			write_lines();
+			atomic_flag_clear(&ring.consumer);
+		}
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+
+		wait_for_event(LOGWRITER, LOG_INTERVAL);
+	}
+
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+void get_log_stats(struct log_stats *stats)
+{
+	stats->written = atomic_load_explicit(&lines_written, memory_order_relaxed);
+	stats->dropped = atomic_load_explicit(&lines_dropped, memory_order_relaxed);
+}
+
 // Log helper activity (may be script or lua)
 void FTL_log_helper(const unsigned char n, ...)
 {
@@ -262,13 +617,13 @@ void FTL_log_dnsmasq_fatal(const char *format, ...)
 
 void log_counter_info(void)
 {
-	logg(" -> Total DNS queries: %i", counters->queries);
+	logg(" -> Total DNS queries: %i", total_queries());
 	logg(" -> Cached DNS queries: %i", cached_queries());
 	logg(" -> Forwarded DNS queries: %i", forwarded_queries());
 	logg(" -> Blocked DNS queries: %i", blocked_queries());
-	logg(" -> Unknown DNS queries: %i", counters->status[QUERY_UNKNOWN]);
-	logg(" -> Unique domains: %i", counters->domains);
-	logg(" -> Unique clients: %i", counters->clients);
+	logg(" -> Unknown DNS queries: %i", counter_get(status[QUERY_UNKNOWN]));
+	logg(" -> Unique domains: %i", known_domains());
+	logg(" -> Unique clients: %i", known_clients());
 	logg(" -> Known forward destinations: %i", counters->upstreams);
 }
 
@@ -421,16 +776,22 @@ int binbuf_to_escaped_C_literal(const char *src_buf, size_t src_sz,
 	return src - src_buf;
 }
 
+// The queries in memory and the queries left out by sampling they stand for
+int __attribute__ ((pure)) total_queries(void)
+{
+	return counters->queries + counters->queries_unsampled;
+}
+
 int __attribute__ ((pure)) forwarded_queries(void)
 {
-	return counters->status[QUERY_FORWARDED] +
-	       counters->status[QUERY_RETRIED] +
-	       counters->status[QUERY_RETRIED_DNSSEC];
+	return counter_get(status[QUERY_FORWARDED]) +
+	       counter_get(status[QUERY_RETRIED]) +
+	       counter_get(status[QUERY_RETRIED_DNSSEC]);
 }
 
 int __attribute__ ((pure)) cached_queries(void)
 {
-	return counters->status[QUERY_CACHE];
+	return counter_get(status[QUERY_CACHE]);
 }
 
 int __attribute__ ((pure)) blocked_queries(void)
@@ -438,7 +799,7 @@ int __attribute__ ((pure)) blocked_queries(void)
 	int num = 0;
 	for(enum query_status status = 0; status < QUERY_STATUS_MAX; status++)
 		if(is_blocked(status))
-			num += counters->status[status];
+			num += counter_get(status[status]);
 	return num;
 }
 
@@ -13,7 +13,20 @@
 #include <stdbool.h>
 #include <time.h>
 
+// Interval in which the log writer thread writes queued lines [milliseconds]
+#define LOG_INTERVAL 100
+
+struct log_stats {
+	unsigned long written;
+	unsigned long dropped;
+};
+
 void init_FTL_log(void);
+bool init_log_buffer(void);
+void *log_thread(void *val);
+void reopen_FTL_log(void);
+void sync_FTL_log(void);
+void get_log_stats(struct log_stats *stats);
 void log_counter_info(void);
 void format_memory_size(char prefix[2], unsigned long long int bytes,
                         double * const formatted);
@@ -38,6 +51,7 @@ void FTL_log_helper(const unsigned char n, ...);
 int binbuf_to_escaped_C_literal(const char *src_buf, size_t src_sz, char *dst_str, size_t dst_sz);
 
 int forwarded_queries(void)  __attribute__ ((pure));
+int total_queries(void)  __attribute__ ((pure));
 int cached_queries(void)  __attribute__ ((pure));
 int blocked_queries(void)  __attribute__ ((pure));
 
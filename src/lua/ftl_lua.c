@@ -104,7 +104,9 @@ static bool ftl_lua_load_embedded_script(lua_State *L, const char *name, const c
 	// Explanation:
 	// luaL_dostring(L, script)   expands to   (luaL_loadstring(L, script) || lua_pcall(L, 0, LUA_MULTRET, 0))
 	// luaL_loadstring(L, script)   calls   luaL_loadbuffer(L, s, strlen(s), s)
-	if (luaL_loadbufferx(L, script, script_len, name, NULL) || lua_pcall(L, 0, LUA_MULTRET, 0) != 0)
+	// The scripts are embedded as precompiled bytecode unless FTL has been
+	// cross-compiled (see src/lua/scripts/CMakeLists.txt)
+	if (luaL_loadbufferx(L, script, script_len, name, EMBEDDED_SCRIPTS_MODE) || lua_pcall(L, 0, LUA_MULTRET, 0) != 0)
 	{
 		const char *lua_err = lua_tostring(L, -1);
 		printf("LUA error while trying to import %s.lua: %s\n", name, lua_err);
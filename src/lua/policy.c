@@ -0,0 +1,316 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Lua policy hook
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "../FTL.h"
+#include "policy.h"
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "../config.h"
+#include "../log.h"
+
+// When LUA_POLICY is enabled, the function policy() of the script
+// LUA_POLICY_FILE is called for every domain/client/type combination which is
+// not yet in FTL's DNS cache:
+//
+//   function policy(domain, client, qtype, groups)
+//     -- domain: queried domain, client: IP address of the client,
+//     -- qtype: query type ("A", "AAAA", ...), groups: array of group IDs
+//     return nil         -- continue with the domain lists
+//     return "allow"     -- permit the query, skip the domain lists
+//     return "block"     -- block the query using BLOCKINGMODE
+//     return "nxdomain"  -- block the query replying NXDOMAIN
+//     return "nodata"    -- block the query replying NODATA
+//     return "refused"   -- block the query replying REFUSED
+//   end
+//
+// The verdict is stored in the DNS cache, the script is not called again for
+// the same combination until the lists are reloaded. The script is compiled
+// to bytecode once when the lists are (re)loaded. Every process answering
+// queries loads the bytecode into its own Lua state which can only use the
+// base, string, table, math and utf8 libraries. Every call is limited to
+// LUA_POLICY_INSTRUCTIONS virtual machine instructions. Errors permit the
+// query (as if nil had been returned)
+
+// Bytecode of the current script, its generation changes whenever it is
+// recompiled
+static char *bytecode = NULL;
+static size_t bytecode_len = 0u;
+static unsigned int generation = 0u;
+
+// Lua state of this process
+static struct {
+	lua_State *L;
+	pid_t pid;
+	unsigned int generation;
+	size_t memory;
+	int policy;
+	time_t last_error;
+} state = { NULL, 0, 0u, 0u, LUA_NOREF, 0 };
+
+// Append a chunk of bytecode written by lua_dump()
+struct dump_buffer {
+	char *data;
+	size_t len;
+};
+
+static int dump_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+	(void)L;
+	struct dump_buffer *buf = ud;
+	char *data = realloc(buf->data, buf->len + sz);
+	if(data == NULL)
+		return 1;
+	memcpy(data + buf->len, p, sz);
+	buf->data = data;
+	buf->len += sz;
+	return 0;
+}
+
+// Allocator limiting the memory a script can use
+static void *policy_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	size_t *memory = ud;
+	// osize is the type of the object to be allocated if ptr is NULL
+	const size_t old = ptr != NULL ? osize : 0u;
+	if(nsize == 0)
+	{
+		free(ptr);
+		*memory -= old;
+		return NULL;
+	}
+
+	if(nsize > old && *memory + (nsize - old) > LUA_POLICY_MEMORY)
+		return NULL;
+
+	void *new = realloc(ptr, nsize);
+	if(new != NULL)
+		*memory = *memory - old + nsize;
+	return new;
+}
+
+// Count hook terminating scripts running too long
+static void instruction_limit(lua_State *L, lua_Debug *ar)
+{
+	(void)ar;
+	luaL_error(L, "instruction limit (%d) exceeded", (int)config.lua_instructions);
+}
+
+// pihole.log(message) logs a message to FTL's log
+static int policy_log(lua_State *L)
+{
+	logg("Lua policy: %s", luaL_checkstring(L, 1));
+	return 0;
+}
+
+static void log_policy_error(const char *what, lua_State *L)
+{
+	const time_t now = time(NULL);
+	if(now - state.last_error < LUA_POLICY_ERROR_INTERVAL)
+		return;
+	state.last_error = now;
+
+	const char *err = L != NULL ? lua_tostring(L, -1) : NULL;
+	logg("WARN: Lua policy %s: %s", what, err != NULL ? err : "out of memory");
+}
+
+// Compile the policy script to bytecode. Returns true if the policy changed
+bool lua_policy_load(void)
+{
+	if(!config.lua_policy)
+		return false;
+
+	// Compile in a state of its own, the script is not run here. Debug
+	// information is kept for meaningful error messages
+	size_t memory = 0u;
+	lua_State *L = lua_newstate(policy_alloc, &memory);
+	if(L == NULL)
+		return false;
+
+	struct dump_buffer buf = { NULL, 0u };
+	if(luaL_loadfilex(L, FTLfiles.lua_policy, "t") != LUA_OK)
+	{
+		logg("WARN: Cannot load Lua policy: %s", lua_tostring(L, -1));
+		lua_close(L);
+		// Keep the previous policy, if any
+		return false;
+	}
+	if(lua_dump(L, dump_writer, &buf, 0) != 0 || buf.data == NULL)
+	{
+		logg("WARN: Cannot compile Lua policy %s", FTLfiles.lua_policy);
+		lua_close(L);
+		if(buf.data != NULL)
+			free(buf.data);
+		return false;
+	}
+	lua_close(L);
+
+	// Nothing to do if the script did not change
+	if(bytecode != NULL && bytecode_len == buf.len &&
+	   memcmp(bytecode, buf.data, buf.len) == 0)
+	{
+		free(buf.data);
+		return false;
+	}
+
+	if(bytecode != NULL)
+		free(bytecode);
+	bytecode = buf.data;
+	bytecode_len = buf.len;
+	generation++;
+
+	logg("Compiled Lua policy %s (%zu bytes of bytecode)", FTLfiles.lua_policy, bytecode_len);
+	return true;
+}
+
+bool __attribute__((pure)) lua_policy_enabled(void)
+{
+	return bytecode != NULL;
+}
+
+// Create the sandboxed Lua state of this process and run the script once so
+// it can define its functions
+static bool policy_state(void)
+{
+	const pid_t pid = getpid();
+	if(state.L != NULL && state.pid == pid && state.generation == generation)
+		return state.policy != LUA_NOREF;
+
+	// A state inherited from the parent process is a copy we do not need.
+	// It is not closed as this would only touch all of its memory
+	if(state.L != NULL && state.pid == pid)
+		lua_close(state.L);
+	state.L = NULL;
+	state.pid = pid;
+	state.generation = generation;
+	state.memory = 0u;
+	state.policy = LUA_NOREF;
+
+	lua_State *L = lua_newstate(policy_alloc, &state.memory);
+	if(L == NULL)
+	{
+		log_policy_error("initialization failed", NULL);
+		return false;
+	}
+	state.L = L;
+
+	// Only libraries without access to the system
+	luaL_requiref(L, LUA_GNAME, luaopen_base, 1);
+	luaL_requiref(L, LUA_STRLIBNAME, luaopen_string, 1);
+	luaL_requiref(L, LUA_TABLIBNAME, luaopen_table, 1);
+	luaL_requiref(L, LUA_MATHLIBNAME, luaopen_math, 1);
+	luaL_requiref(L, LUA_UTF8LIBNAME, luaopen_utf8, 1);
+	lua_settop(L, 0);
+
+	// Remove functions of the base library loading code or printing
+	static const char *const unsafe[] = { "dofile", "loadfile", "load", "require", "collectgarbage", "print" };
+	for(unsigned int i = 0; i < sizeof(unsafe)/sizeof(unsafe[0]); i++)
+	{
+		lua_pushnil(L);
+		lua_setglobal(L, unsafe[i]);
+	}
+
+	static const luaL_Reg policylib[] = {
+		{"log", policy_log},
+		{NULL, NULL}
+	};
+	luaL_newlib(L, policylib);
+	lua_setglobal(L, LUA_PIHOLELIBNAME);
+
+	// Run the script
+	lua_sethook(L, instruction_limit, LUA_MASKCOUNT, (int)config.lua_instructions);
+	if(luaL_loadbufferx(L, bytecode, bytecode_len, "policy", "b") != LUA_OK ||
+	   lua_pcall(L, 0, 0, 0) != LUA_OK)
+	{
+		log_policy_error("failed", L);
+		lua_settop(L, 0);
+		return false;
+	}
+
+	if(lua_getglobal(L, "policy") != LUA_TFUNCTION)
+	{
+		logg("WARN: Lua policy %s does not define function policy()", FTLfiles.lua_policy);
+		lua_settop(L, 0);
+		return false;
+	}
+	state.policy = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	return true;
+}
+
+// Call the policy for a query. Groups are given as comma-separated list of IDs
+enum policy_verdict lua_policy_check(const char *domain, const char *client, const char *qtype,
+                                     const char *groups, enum reply_type *reply)
+{
+	if(bytecode == NULL || !policy_state())
+		return POLICY_CONTINUE;
+
+	lua_State *L = state.L;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, state.policy);
+	lua_pushstring(L, domain);
+	lua_pushstring(L, client);
+	lua_pushstring(L, qtype);
+
+	// Array of group IDs
+	lua_newtable(L);
+	lua_Integer n = 0;
+	for(const char *p = groups; p != NULL && *p != '\0';)
+	{
+		char *end = NULL;
+		const long id = strtol(p, &end, 10);
+		if(end == p)
+			break;
+		lua_pushinteger(L, id);
+		lua_rawseti(L, -2, ++n);
+		p = *end == ',' ? end + 1 : end;
+	}
+
+	// Reset the instruction counter
+	lua_sethook(L, instruction_limit, LUA_MASKCOUNT, (int)config.lua_instructions);
+	if(lua_pcall(L, 4, 1, 0) != LUA_OK)
+	{
+		log_policy_error("failed", L);
+		lua_settop(L, 0);
+		return POLICY_CONTINUE;
+	}
+
+	enum policy_verdict verdict = POLICY_CONTINUE;
+	*reply = REPLY_UNKNOWN;
+	const char *result = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : NULL;
+	if(result == NULL)
+		verdict = POLICY_CONTINUE;
+	else if(strcmp(result, "allow") == 0)
+		verdict = POLICY_ALLOW;
+	else if(strcmp(result, "block") == 0)
+		verdict = POLICY_BLOCK;
+	else if(strcmp(result, "nxdomain") == 0)
+	{
+		verdict = POLICY_BLOCK;
+		*reply = REPLY_NXDOMAIN;
+	}
+	else if(strcmp(result, "nodata") == 0)
+	{
+		verdict = POLICY_BLOCK;
+		*reply = REPLY_NODATA;
+	}
+	else if(strcmp(result, "refused") == 0)
+	{
+		verdict = POLICY_BLOCK;
+		*reply = REPLY_REFUSED;
+	}
+	else if(strcmp(result, "continue") != 0)
+	{
+		lua_pushfstring(L, "invalid verdict \"%s\"", result);
+		log_policy_error("failed", L);
+	}
+	lua_settop(L, 0);
+
+	return verdict;
+}
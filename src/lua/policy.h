@@ -0,0 +1,34 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Lua policy hook prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef LUA_POLICY_H
+#define LUA_POLICY_H
+
+#include <stdbool.h>
+// enum reply_type
+#include "../enums.h"
+
+// Maximum memory a policy script may allocate per process [bytes]
+#define LUA_POLICY_MEMORY (16u*1024u*1024u)
+
+// Minimum interval between two logged errors of the policy script [seconds]
+#define LUA_POLICY_ERROR_INTERVAL 60
+
+enum policy_verdict {
+	POLICY_CONTINUE,
+	POLICY_ALLOW,
+	POLICY_BLOCK
+} __attribute__ ((packed));
+
+bool lua_policy_load(void);
+bool lua_policy_enabled(void) __attribute__((pure));
+enum policy_verdict lua_policy_check(const char *domain, const char *client, const char *qtype,
+                                     const char *groups, enum reply_type *reply);
+
+#endif //LUA_POLICY_H
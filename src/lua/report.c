@@ -0,0 +1,494 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Lua reports on the data in shared memory
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "../FTL.h"
+#include "report.h"
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "../config.h"
+#include "../log.h"
+#include "../shmem.h"
+#include "../datastructure.h"
+#include "../overTime.h"
+// known_domains(), known_clients()
+#include "../reclaim.h"
+// ssend()
+#include "../api/socket.h"
+
+// The API command ">lua <name>" runs the script <name>.lua of LUA_REPORT_DIR
+// and sends everything it prints to the client. Scripts read FTL's data in
+// place through iterators of the table pihole:
+//
+//   for q in pihole.queries(since) do ... end  -- queries from since on
+//   for c in pihole.clients() do ... end
+//   for d in pihole.domains() do ... end
+//   for o in pihole.overtime() do ... end
+//   local n = pihole.counters()                  -- number of rows
+//
+// Iterators return the same row object in every step, it is a cursor and not a
+// copy of the row. Fields are read from shared memory when they are accessed,
+// strings are only copied into Lua when a string field is accessed. Fields of
+// queries:  id, time, type, status, reply, reply_time, blocked, domain,
+//           client, name, upstream
+// clients:  ip, name, count, blocked, last_query, first_seen
+// domains:  domain, count, blocked
+// overtime: time, total, blocked, cached, forwarded
+//
+// The script holds the shared lock while it runs so DNS queries can be
+// answered, but not recorded. The iterators release the lock every
+// LUA_REPORT_BATCH rows. The data may change in between, queries are followed
+// by their sequence number so no query is visited twice. Scripts can only use
+// the base, string, table, math and utf8 libraries and are terminated after
+// LUA_REPORT_TIMEOUT seconds
+
+enum report_table {
+	REPORT_QUERIES,
+	REPORT_CLIENTS,
+	REPORT_DOMAINS,
+	REPORT_OVERTIME
+} __attribute__ ((packed));
+
+static const char *const report_metatables[] = {
+	"pihole.query", "pihole.client", "pihole.domain", "pihole.overtime"
+};
+
+// Cursor of an iterator. For queries, pos is the sequence number of the
+// current query, for all other tables its index. Rows are visited until end
+// (exclusive)
+struct report_row {
+	enum report_table table;
+	bool valid;
+	unsigned int pos;
+	unsigned int end;
+	unsigned int rows;
+};
+
+struct report_state {
+	int sock;
+	size_t memory;
+	time_t start;
+};
+
+// Allocator limiting the memory a script can use
+static void *report_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	struct report_state *rs = ud;
+	// osize is the type of the object to be allocated if ptr is NULL
+	const size_t old = ptr != NULL ? osize : 0u;
+	if(nsize == 0)
+	{
+		free(ptr);
+		rs->memory -= old;
+		return NULL;
+	}
+
+	if(nsize > old && rs->memory + (nsize - old) > LUA_REPORT_MEMORY)
+		return NULL;
+
+	void *new = realloc(ptr, nsize);
+	if(new != NULL)
+		rs->memory = rs->memory - old + nsize;
+	return new;
+}
+
+static struct report_state *get_state(lua_State *L)
+{
+	void *ud = NULL;
+	lua_getallocf(L, &ud);
+	return ud;
+}
+
+// Count hook terminating scripts running too long
+static void time_limit(lua_State *L, lua_Debug *ar)
+{
+	(void)ar;
+	if(time(NULL) - get_state(L)->start > LUA_REPORT_TIMEOUT)
+		luaL_error(L, "time limit (%d seconds) exceeded", LUA_REPORT_TIMEOUT);
+}
+
+// Let writers waiting for the lock proceed every LUA_REPORT_BATCH rows
+static void report_yield(struct report_row *row)
+{
+	if(++row->rows < LUA_REPORT_BATCH)
+		return;
+
+	row->rows = 0u;
+	unlock_shm_shared();
+	lock_shm_shared();
+}
+
+// print(...) sends a line to the client
+static int report_print(lua_State *L)
+{
+	const int sock = get_state(L)->sock;
+	const int n = lua_gettop(L);
+	for(int i = 1; i <= n; i++)
+	{
+		size_t len = 0u;
+		const char *s = luaL_tolstring(L, i, &len);
+		if(i > 1)
+			swrite(sock, "\t", 1u);
+		swrite(sock, s, len);
+		lua_pop(L, 1);
+	}
+	swrite(sock, "\n", 1u);
+	return 0;
+}
+
+// Resolve the cursor, returns NULL if the row does not exist (anymore)
+static const queriesData *row_query(const struct report_row *row)
+{
+	if(!row->valid)
+		return NULL;
+	const int queryID = seq_queryID(row->pos);
+	const queriesData *query = queryID < 0 ? NULL : getQuery(queryID, false);
+	if(query == NULL || query->magic != MAGICBYTE || query->privacylevel >= PRIVACY_MAXIMUM)
+		return NULL;
+	return query;
+}
+
+static int query_index(lua_State *L)
+{
+	const struct report_row *row = luaL_checkudata(L, 1, report_metatables[REPORT_QUERIES]);
+	const char *field = luaL_checkstring(L, 2);
+	const queriesData *query = row_query(row);
+	if(query == NULL)
+		return 0;
+
+	if(strcmp(field, "time") == 0)
+		lua_pushinteger(L, query->timestamp);
+	else if(strcmp(field, "domain") == 0)
+		lua_pushstring(L, getDomainString(query));
+	else if(strcmp(field, "client") == 0)
+		lua_pushstring(L, getClientIPString(query));
+	else if(strcmp(field, "status") == 0)
+		lua_pushstring(L, get_query_status_str(query->status));
+	else if(strcmp(field, "type") == 0)
+		lua_pushstring(L, query->type < TYPE_MAX ? querytypes[query->type] : "UNKNOWN");
+	else if(strcmp(field, "blocked") == 0)
+		lua_pushboolean(L, query->flags.blocked);
+	else if(strcmp(field, "reply") == 0)
+		lua_pushstring(L, get_query_reply_str(query->reply));
+	else if(strcmp(field, "reply_time") == 0)
+	{
+		// [seconds], nil while the reply is outstanding
+		if(!query->flags.response_calculated)
+			return 0;
+		lua_pushnumber(L, 1e-4*query->response);
+	}
+	else if(strcmp(field, "name") == 0)
+		lua_pushstring(L, getClientNameString(query));
+	else if(strcmp(field, "upstream") == 0)
+	{
+		const upstreamsData *upstream = query->upstreamID < 0 ? NULL : getUpstream(query->upstreamID, true);
+		if(upstream == NULL)
+			return 0;
+		lua_pushstring(L, getstr(upstream->ippos));
+	}
+	else if(strcmp(field, "id") == 0)
+		lua_pushinteger(L, row->pos);
+	else
+		return 0;
+
+	return 1;
+}
+
+static int client_index(lua_State *L)
+{
+	const struct report_row *row = luaL_checkudata(L, 1, report_metatables[REPORT_CLIENTS]);
+	const char *field = luaL_checkstring(L, 2);
+	const clientsData *client = row->valid ? getClient((int)row->pos, true) : NULL;
+	if(client == NULL)
+		return 0;
+
+	if(strcmp(field, "ip") == 0)
+		lua_pushstring(L, getstr(client->ippos));
+	else if(strcmp(field, "name") == 0)
+		lua_pushstring(L, getstr(client->namepos));
+	else if(strcmp(field, "count") == 0)
+		lua_pushinteger(L, client->count);
+	else if(strcmp(field, "blocked") == 0)
+		lua_pushinteger(L, client->blockedcount);
+	else if(strcmp(field, "last_query") == 0)
+		lua_pushinteger(L, client->lastQuery);
+	else if(strcmp(field, "first_seen") == 0)
+		lua_pushinteger(L, client->firstSeen);
+	else
+		return 0;
+
+	return 1;
+}
+
+static int domain_index(lua_State *L)
+{
+	const struct report_row *row = luaL_checkudata(L, 1, report_metatables[REPORT_DOMAINS]);
+	const char *field = luaL_checkstring(L, 2);
+	const domainsData *domain = row->valid ? getDomain((int)row->pos, true) : NULL;
+	if(domain == NULL)
+		return 0;
+
+	if(strcmp(field, "domain") == 0)
+		lua_pushstring(L, getstr(domain->domainpos));
+	else if(strcmp(field, "count") == 0)
+		lua_pushinteger(L, domain->count);
+	else if(strcmp(field, "blocked") == 0)
+		lua_pushinteger(L, domain->blockedcount);
+	else
+		return 0;
+
+	return 1;
+}
+
+static int overtime_index(lua_State *L)
+{
+	const struct report_row *row = luaL_checkudata(L, 1, report_metatables[REPORT_OVERTIME]);
+	const char *field = luaL_checkstring(L, 2);
+	if(!row->valid || row->pos >= OVERTIME_SLOTS)
+		return 0;
+	const overTimeData *slot = &overTime[row->pos];
+
+	if(strcmp(field, "time") == 0)
+		lua_pushinteger(L, slot->timestamp);
+	else if(strcmp(field, "total") == 0)
+		lua_pushinteger(L, slot->total);
+	else if(strcmp(field, "blocked") == 0)
+		lua_pushinteger(L, slot->blocked);
+	else if(strcmp(field, "cached") == 0)
+		lua_pushinteger(L, slot->cached);
+	else if(strcmp(field, "forwarded") == 0)
+		lua_pushinteger(L, slot->forwarded);
+	else
+		return 0;
+
+	return 1;
+}
+
+// Advance the cursor to the next row the script may see. Returns the cursor or
+// nil at the end
+static int report_next(lua_State *L)
+{
+	struct report_row *row = lua_touserdata(L, 1);
+	row->valid = false;
+	for(unsigned int pos = row->pos + 1u; (int)(row->end - pos) > 0; pos++)
+	{
+		report_yield(row);
+		row->pos = pos;
+
+		bool visible = false;
+		switch(row->table)
+		{
+			case REPORT_QUERIES:
+			{
+				// Older queries may have been removed while the
+				// lock was released
+				const unsigned int oldest = query_seq(0);
+				if((int)(pos - oldest) < 0)
+				{
+					pos = oldest - 1u;
+					continue;
+				}
+				row->valid = true;
+				visible = row_query(row) != NULL;
+				break;
+			}
+			case REPORT_CLIENTS:
+				visible = config.privacylevel < PRIVACY_HIDE_DOMAINS_CLIENTS &&
+				          getClient((int)pos, true) != NULL;
+				break;
+			case REPORT_DOMAINS:
+				visible = config.privacylevel < PRIVACY_HIDE_DOMAINS &&
+				          getDomain((int)pos, true) != NULL;
+				break;
+			case REPORT_OVERTIME:
+				visible = overTime[pos].timestamp > 0;
+				break;
+		}
+
+		if(visible)
+		{
+			row->valid = true;
+			lua_settop(L, 1);
+			return 1;
+		}
+		row->valid = false;
+	}
+
+	return 0;
+}
+
+// Push the iterator, its state (the cursor) and a nil control variable
+static int push_iterator(lua_State *L, const enum report_table table, const unsigned int begin,
+                         const unsigned int end)
+{
+	lua_pushcfunction(L, report_next);
+	struct report_row *row = lua_newuserdatauv(L, sizeof(struct report_row), 0);
+	row->table = table;
+	row->valid = false;
+	// The first step advances the cursor onto the first row
+	row->pos = begin - 1u;
+	row->end = end;
+	row->rows = 0u;
+	luaL_setmetatable(L, report_metatables[table]);
+	lua_pushnil(L);
+	return 3;
+}
+
+// pihole.queries([since]) iterates over the queries from the timestamp since on
+static int report_queries(lua_State *L)
+{
+	const lua_Integer since = luaL_optinteger(L, 1, 0);
+
+	// Queries are stored in the order they arrived, find the first one
+	// not older than since
+	int lo = 0, hi = counters->queries;
+	while(lo < hi)
+	{
+		const int mid = lo + (hi - lo) / 2;
+		const queriesData *query = getQuery(mid, false);
+		if(query != NULL && (lua_Integer)query->timestamp < since)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	// New queries arriving while the script runs are not visited
+	return push_iterator(L, REPORT_QUERIES, query_seq(lo), query_seq(counters->queries));
+}
+
+static int report_clients(lua_State *L)
+{
+	return push_iterator(L, REPORT_CLIENTS, 0u, (unsigned int)counters->clients);
+}
+
+static int report_domains(lua_State *L)
+{
+	return push_iterator(L, REPORT_DOMAINS, 0u, (unsigned int)counters->domains);
+}
+
+static int report_overtime(lua_State *L)
+{
+	return push_iterator(L, REPORT_OVERTIME, 0u, OVERTIME_SLOTS);
+}
+
+// pihole.counters() returns the number of rows of all tables
+static int report_counters(lua_State *L)
+{
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, counters->queries);
+	lua_setfield(L, -2, "queries");
+	lua_pushinteger(L, known_clients());
+	lua_setfield(L, -2, "clients");
+	lua_pushinteger(L, known_domains());
+	lua_setfield(L, -2, "domains");
+	lua_pushinteger(L, counters->upstreams);
+	lua_setfield(L, -2, "upstreams");
+	return 1;
+}
+
+static void open_reportlib(lua_State *L)
+{
+	// Only libraries without access to the system
+	luaL_requiref(L, LUA_GNAME, luaopen_base, 1);
+	luaL_requiref(L, LUA_STRLIBNAME, luaopen_string, 1);
+	luaL_requiref(L, LUA_TABLIBNAME, luaopen_table, 1);
+	luaL_requiref(L, LUA_MATHLIBNAME, luaopen_math, 1);
+	luaL_requiref(L, LUA_UTF8LIBNAME, luaopen_utf8, 1);
+	lua_settop(L, 0);
+
+	// Remove functions of the base library loading code
+	static const char *const unsafe[] = { "dofile", "loadfile", "load", "require" };
+	for(unsigned int i = 0; i < sizeof(unsafe)/sizeof(unsafe[0]); i++)
+	{
+		lua_pushnil(L);
+		lua_setglobal(L, unsafe[i]);
+	}
+	lua_pushcfunction(L, report_print);
+	lua_setglobal(L, "print");
+
+	static const lua_CFunction indexes[] = { query_index, client_index, domain_index, overtime_index };
+	for(unsigned int i = 0; i < sizeof(indexes)/sizeof(indexes[0]); i++)
+	{
+		luaL_newmetatable(L, report_metatables[i]);
+		lua_pushcfunction(L, indexes[i]);
+		lua_setfield(L, -2, "__index");
+		lua_pop(L, 1);
+	}
+
+	static const luaL_Reg reportlib[] = {
+		{"queries", report_queries},
+		{"clients", report_clients},
+		{"domains", report_domains},
+		{"overtime", report_overtime},
+		{"counters", report_counters},
+		{NULL, NULL}
+	};
+	luaL_newlib(L, reportlib);
+	lua_setglobal(L, LUA_PIHOLELIBNAME);
+}
+
+void lua_report_run(const char *args, const int sock)
+{
+	// Skip leading white space, the name of the script is the next token
+	while(*args == ' ' || *args == '\t')
+		args++;
+	const size_t len = strcspn(args, " \t\r\n");
+
+	// Only plain names, scripts cannot be outside of LUA_REPORT_DIR
+	bool valid = len > 0 && len <= 64;
+	for(size_t i = 0; i < len && valid; i++)
+		valid = isalnum((unsigned char)args[i]) || args[i] == '_' || args[i] == '-';
+	if(!valid)
+	{
+		ssend(sock, "error: invalid report name\n");
+		return;
+	}
+
+	char path[PATH_MAX];
+	if((size_t)snprintf(path, sizeof(path), "%s/%.*s.lua", FTLfiles.lua_reports, (int)len, args) >= sizeof(path))
+	{
+		ssend(sock, "error: invalid report name\n");
+		return;
+	}
+
+	struct report_state rs = { sock, 0u, time(NULL) };
+	lua_State *L = lua_newstate(report_alloc, &rs);
+	if(L == NULL)
+	{
+		ssend(sock, "error: out of memory\n");
+		return;
+	}
+	open_reportlib(L);
+
+	// Check the time limit every 10000 instructions
+	lua_sethook(L, time_limit, LUA_MASKCOUNT, 10000);
+
+	refresh_privacy_level();
+	if(luaL_loadfilex(L, path, "t") != LUA_OK)
+	{
+		ssend(sock, "error: %s\n", lua_tostring(L, -1));
+		lua_close(L);
+		return;
+	}
+
+	lock_shm_shared();
+	const int ret = lua_pcall(L, 0, 0, 0);
+	unlock_shm_shared();
+
+	if(ret != LUA_OK)
+	{
+		const char *err = lua_tostring(L, -1);
+		ssend(sock, "error: %s\n", err != NULL ? err : "out of memory");
+		if(config.debug & DEBUG_API)
+			logg("Lua report %s failed: %s", path, err != NULL ? err : "out of memory");
+	}
+
+	lua_close(L);
+}
@@ -0,0 +1,27 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Lua report prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef LUA_REPORT_H
+#define LUA_REPORT_H
+
+#include <stdbool.h>
+
+// Maximum memory a report script may allocate [bytes]
+#define LUA_REPORT_MEMORY (64u*1024u*1024u)
+
+// Maximum run time of a report script [seconds]
+#define LUA_REPORT_TIMEOUT 30
+
+// Number of rows an iterator visits before it releases the shared lock for a
+// moment so writers waiting for the lock can proceed
+#define LUA_REPORT_BATCH 4096u
+
+void lua_report_run(const char *args, const int sock);
+
+#endif //LUA_REPORT_H
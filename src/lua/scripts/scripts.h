@@ -10,6 +10,13 @@
 #ifndef LUA_SCRIPTS_H
 #define LUA_SCRIPTS_H
 
+// Bundled scripts are either precompiled bytecode or source code
+#ifdef LUA_EMBEDDED_BYTECODE
+#define EMBEDDED_SCRIPTS_MODE "b"
+#else
+#define EMBEDDED_SCRIPTS_MODE "t"
+#endif
+
 static const char inspect_lua[] = {
 #include "inspect.lua.hex"
 };
@@ -28,6 +28,15 @@
 #include "overTime.h"
 // flush_message_table()
 #include "database/message-table.h"
+// [write,restore]_snapshot()
+#include "snapshot.h"
+#include "dnscache.h"
+// rebuild_leaderboards()
+#include "leaderboard.h"
+// handover_request()
+#include "handover.h"
+// FTL_preload_domainlists()
+#include "datastructure.h"
 
 char * username;
 bool needGC = false;
@@ -35,6 +44,14 @@ bool needDBGC = false;
 bool startup = true;
 volatile int exit_code = EXIT_SUCCESS;
 
+// Load the domain lists while the history is imported
+static void *preload_thread(void *val)
+{
+	prctl(PR_SET_NAME, "preload", 0, 0, 0);
+	FTL_preload_domainlists();
+	return NULL;
+}
+
 int main (int argc, char* argv[])
 {
 	// Get user pihole-FTL is running as
@@ -56,14 +73,25 @@ int main (int argc, char* argv[])
 	log_FTL_version(false);
 
 	// Process pihole-FTL.conf
+	startup_phase_begin("config");
 	read_FTLconf();
+	startup_phase_end("config");
 
 	// Catch signals not handled by dnsmasq
 	// We configure real-time signals later (after dnsmasq has forked)
 	handle_signals();
 
+	// Take over from a running FTL process (if enabled). This waits for it
+	// to terminate so its shared memory objects are gone afterwards
+	startup_phase_begin("handover");
+	handover_request();
+	startup_phase_end("handover");
+
 	// Initialize shared memory
-	if(!init_shmem())
+	startup_phase_begin("shared memory");
+	const bool shmem = init_shmem();
+	startup_phase_end("shared memory");
+	if(!shmem)
 	{
 		logg("Initialization of shared memory failed.");
 		// Check if there is already a running FTL process
@@ -84,21 +112,50 @@ int main (int argc, char* argv[])
 	// Do this before reading the database to make this option not only
 	// useful for interfaces that aren't ready but also for fake-hwclocks
 	// which aren't ready at this point
+	startup_phase_begin("delay");
 	delay_startup();
+	startup_phase_end("delay");
+
+	// Load the gravity set and compile the regex filters in the background,
+	// they do not depend on the history imported below. The per-client regex
+	// data is loaded once the resolver is running
+	pthread_t preload;
+	const bool preloading = pthread_create(&preload, NULL, preload_thread, NULL) == 0;
+	if(!preloading)
+		logg("WARN: Unable to start preload thread, loading lists later");
 
 	// Initialize overTime datastructure
 	initOverTime();
 
 	// Initialize query database (pihole-FTL.db)
+	startup_phase_begin("database");
 	db_init();
 
 	// Flush messages stored in the long-term database
 	flush_message_table();
+	startup_phase_end("database");
 
-	// Try to import queries from long-term database if available
-	if(config.DBimport)
+	// Try to import queries from long-term database if available (unless
+	// they can be restored from a snapshot or have been handed over by the
+	// previous process)
+	startup_phase_begin("history import");
+	if(config.DBimport && !((config.shmem_snapshot || handover_received()) && restore_snapshot()))
 		DB_read_queries();
 
+	// Build the top-domain and top-client leaderboards from the imported
+	// history, they are maintained incrementally from now on
+	rebuild_leaderboards();
+	startup_phase_end("history import");
+
+	// Wait for the lists, they have to be ready before forking
+	if(preloading)
+	{
+		startup_phase_begin("waiting for lists");
+		pthread_join(preload, NULL);
+		FTL_preload_domainlists_done();
+		startup_phase_end("waiting for lists");
+	}
+
 	log_counter_info();
 	check_setupVarsconf();
 
@@ -113,6 +170,7 @@ int main (int argc, char* argv[])
 		for(int i = 0; i < argc_dnsmasq; i++)
 			logg("DEBUG: argv[%i] = \"%s\"", i, argv_dnsmasq[i]);
 	}
+	startup_phase_begin("resolver");
 	main_dnsmasq(argc_dnsmasq, (char**)argv_dnsmasq);
 
 	logg("Shutting down...");
@@ -123,13 +181,21 @@ int main (int argc, char* argv[])
 	// Save new queries to database (if database is used)
 	if(config.DBexport)
 	{
-		lock_shm();
 		int saved;
 		if((saved = DB_save_queries(NULL)) > -1)
 			logg("Finished final database update (stored %d queries)", saved);
-		unlock_shm();
 	}
 
+	// Store messages which have not been stored by the database thread
+	store_queued_messages(NULL);
+
+	// Store the history for the next start (or the process taking over)
+	if(config.shmem_snapshot || handover_pending())
+		write_snapshot();
+
+	// Store the DNS cache for the next start
+	write_dns_cache();
+
 	cleanup(exit_code);
 
 	return exit_code;
@@ -0,0 +1,766 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Aggressive use of DNSSEC-validated cache (RFC 8198)
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#define FTLDNS
+#include "dnsmasq/dnsmasq.h"
+#undef __USE_XOPEN
+#include "FTL.h"
+#include "nseccache.h"
+#include "dnsmasq_interface.h"
+#include "config.h"
+
+// Validated NXDOMAIN replies carry NSEC or NSEC3 records proving that no name
+// exists between two names (or hashes) of the zone. With AGGRESSIVE_NSEC,
+// these ranges are remembered per signer zone and queries for other names
+// falling into them are answered with a negative cache entry instead of
+// being forwarded. This stops random-subdomain queries from reaching the
+// upstream servers once the zone's chain is known. Only NXDOMAIN is
+// synthesized (no NODATA), and only if the complete proof (name and wildcard
+// do not exist, no delegation in between) is found in the remembered ranges.
+// Each zone keeps a bounded number of ranges, expired ones are replaced first
+struct nsec_range {
+	time_t expires;
+	// NSEC: owner and next name
+	char *owner;
+	char *next;
+	// NSEC3: owner and next hash
+	unsigned char hash[NSEC3_HASH_LEN];
+	unsigned char next_hash[NSEC3_HASH_LEN];
+	// NS without SOA (zone cut) or DNAME at the owner
+	bool delegation;
+	bool optout;
+};
+
+struct nsec_zone {
+	char *name;
+	time_t used;
+	bool nsec3;
+	unsigned short iterations;
+	unsigned char salt_len;
+	unsigned char salt[255];
+	unsigned int count;
+	struct nsec_range ranges[NSEC_RANGES];
+};
+
+static struct nsec_zone zones[NSEC_ZONES] = {{ 0 }};
+static struct nseccache_stats stats = { 0 };
+
+static unsigned int __attribute__((pure)) label_count(const char *name)
+{
+	if(*name == '\0')
+		return 0u;
+
+	unsigned int labels = 1u;
+	for(; *name != '\0'; name++)
+		if(*name == '.')
+			labels++;
+	return labels;
+}
+
+// Remove the n leftmost labels of a name
+static const char * __attribute__((pure)) strip_labels(const char *name, unsigned int n)
+{
+	for(; n > 0u && *name != '\0'; n--)
+	{
+		const char *dot = strchr(name, '.');
+		name = dot != NULL ? dot + 1 : name + strlen(name);
+	}
+	return name;
+}
+
+// Is name equal to or below zone? The root zone is the empty name
+static bool is_subdomain(const char *name, const char *zone)
+{
+	return *zone == '\0' || hostname_issubdomain((char*)zone, (char*)name) != 0;
+}
+
+// Compare a label of a with a label of b, case-insensitively
+static int __attribute__((pure)) label_cmp(const char *a, const char *ea, const char *b, const char *eb)
+{
+	for(; a < ea && b < eb; a++, b++)
+	{
+		const int x = tolower((unsigned char)*a), y = tolower((unsigned char)*b);
+		if(x != y)
+			return x < y ? -1 : 1;
+	}
+	if(a < ea)
+		return 1;
+	if(b < eb)
+		return -1;
+	return 0;
+}
+
+// Walk two names label by label starting at the root, return the result of
+// comparing the first differing labels and the number of equal labels
+static int walk_labels(const char *a, const char *b, unsigned int *common)
+{
+	const char *ea = a + strlen(a), *eb = b + strlen(b);
+	unsigned int equal = 0u;
+	int rc = 0;
+
+	while(ea > a && eb > b)
+	{
+		const char *sa = ea, *sb = eb;
+		while(sa > a && sa[-1] != '.')
+			sa--;
+		while(sb > b && sb[-1] != '.')
+			sb--;
+
+		if((rc = label_cmp(sa, ea, sb, eb)) != 0)
+			break;
+
+		equal++;
+		ea = sa > a ? sa - 1 : a;
+		eb = sb > b ? sb - 1 : b;
+	}
+
+	// An ancestor sorts before its descendants
+	if(rc == 0)
+	{
+		if(ea > a)
+			rc = 1;
+		else if(eb > b)
+			rc = -1;
+	}
+
+	*common = equal;
+	return rc;
+}
+
+// Compare two names in canonical DNS order (RFC 4034, 6.1)
+static int __attribute__((pure)) canonical_cmp(const char *a, const char *b)
+{
+	unsigned int common = 0u;
+	return walk_labels(a, b, &common);
+}
+
+// Number of equal rightmost labels of two names
+static unsigned int __attribute__((pure)) common_labels(const char *a, const char *b)
+{
+	unsigned int common = 0u;
+	walk_labels(a, b, &common);
+	return common;
+}
+
+// Check if the type bitmap of an NSEC or NSEC3 record contains a type
+static bool __attribute__((pure)) bitmap_has(const unsigned char *p, const unsigned char *end, const int type)
+{
+	while(end - p >= 2)
+	{
+		const int window = p[0], len = p[1];
+		p += 2;
+		if(len < 1 || len > 32 || end - p < len)
+			return false;
+		if(window == (type >> 8))
+		{
+			const int offset = (type & 0xff) >> 3;
+			return offset < len && (p[offset] & (0x80 >> (type & 7)));
+		}
+		p += len;
+	}
+	return false;
+}
+
+// Decode the first label of a name from base32hex (RFC 4648, 7)
+static int base32_decode_label(const char *in, unsigned char *out, const size_t size)
+{
+	unsigned int bits = 0u, value = 0u;
+	size_t len = 0u;
+	for(; *in != '\0' && *in != '.'; in++)
+	{
+		int c = tolower((unsigned char)*in);
+		if(c >= '0' && c <= '9')
+			c -= '0';
+		else if(c >= 'a' && c <= 'v')
+			c -= 'a' - 10;
+		else
+			return 0;
+
+		value = (value << 5) | (unsigned int)c;
+		bits += 5u;
+		if(bits >= 8u)
+		{
+			if(len == size)
+				return 0;
+			bits -= 8u;
+			out[len++] = (value >> bits) & 0xff;
+		}
+	}
+	// Trailing bits must not carry data
+	if(bits >= 5u || (value & ((1u << bits) - 1u)) != 0u)
+		return 0;
+	return (int)len;
+}
+
+static void free_range(struct nsec_range *range)
+{
+	free(range->owner);
+	free(range->next);
+	range->owner = NULL;
+	range->next = NULL;
+}
+
+static void clear_zone(struct nsec_zone *zone)
+{
+	for(unsigned int i = 0; i < zone->count; i++)
+		free_range(&zone->ranges[i]);
+	zone->count = 0u;
+}
+
+// Get the zone with this name, reusing the least recently used zone for
+// a new one
+static struct nsec_zone *get_zone(const char *name, const time_t now)
+{
+	struct nsec_zone *victim = &zones[0];
+	for(unsigned int i = 0; i < NSEC_ZONES; i++)
+	{
+		struct nsec_zone *zone = &zones[i];
+		if(zone->name != NULL && hostname_isequal(zone->name, name))
+		{
+			zone->used = now;
+			return zone;
+		}
+		if(victim->name != NULL && (zone->name == NULL || zone->used < victim->used))
+			victim = zone;
+	}
+
+	char *copy = strdup(name);
+	if(copy == NULL)
+		return NULL;
+
+	clear_zone(victim);
+	free(victim->name);
+	victim->name = copy;
+	victim->used = now;
+	victim->nsec3 = false;
+	victim->iterations = 0u;
+	victim->salt_len = 0u;
+	return victim;
+}
+
+// Get a slot for a new range, replacing an expired range or, if there is
+// none, the one expiring first
+static struct nsec_range *new_range(struct nsec_zone *zone, const time_t now)
+{
+	if(zone->count < NSEC_RANGES)
+	{
+		struct nsec_range *range = &zone->ranges[zone->count++];
+		memset(range, 0, sizeof(*range));
+		return range;
+	}
+
+	struct nsec_range *victim = &zone->ranges[0];
+	for(unsigned int i = 0; i < zone->count; i++)
+	{
+		struct nsec_range *range = &zone->ranges[i];
+		if(range->expires <= now)
+		{
+			victim = range;
+			break;
+		}
+		if(range->expires < victim->expires)
+			victim = range;
+	}
+	free_range(victim);
+	memset(victim, 0, sizeof(*victim));
+	return victim;
+}
+
+// Find the RRSIG covering the RRset of owner and type in the authority section
+// and return its signer, label count and remaining validity
+static bool find_rrsig(struct dns_header *header, const size_t plen, unsigned char *p, const int count,
+                       const char *owner, const int type, char *signer, unsigned int *labels,
+                       unsigned long *valid, const time_t now)
+{
+	char name[MAXDNAME];
+	for(int i = 0; i < count; i++)
+	{
+		int rrtype, rrclass, rdlen;
+		unsigned long ttl;
+		if(!extract_name(header, plen, &p, name, 1, 10))
+			return false;
+		GETSHORT(rrtype, p);
+		GETSHORT(rrclass, p);
+		GETLONG(ttl, p);
+		GETSHORT(rdlen, p);
+		(void)ttl;
+		if(!CHECK_LEN(header, p, plen, rdlen))
+			return false;
+
+		unsigned char *rdata = p;
+		p += rdlen;
+		if(rrtype != T_RRSIG || rrclass != C_IN || rdlen < 18 || !hostname_isequal(name, owner))
+			continue;
+
+		int covered;
+		unsigned long expiration;
+		GETSHORT(covered, rdata);
+		if(covered != type)
+			continue;
+
+		*labels = rdata[1];
+		rdata += 6;
+		GETLONG(expiration, rdata);
+		rdata += 6;
+		if(!extract_name(header, plen, &rdata, signer, 1, 0))
+			return false;
+
+		// Serial number arithmetic (RFC 4034, 3.1.5)
+		const int32_t left = (int32_t)((uint32_t)expiration - (uint32_t)now);
+		*valid = left > 0 ? (unsigned long)left : 0u;
+		return true;
+	}
+	return false;
+}
+
+// Remember the NSEC and NSEC3 records of a validated NXDOMAIN reply
+void FTL_nsec_store(struct dns_header *header, const size_t plen, const time_t now)
+{
+	if(!config.aggressive_nsec || RCODE(header) != NXDOMAIN)
+		return;
+
+	unsigned char *p;
+	if(!(p = skip_questions(header, plen)) ||
+	   !(p = skip_section(p, ntohs(header->ancount), header, plen)))
+		return;
+
+	unsigned char *const auth = p;
+	const int count = ntohs(header->nscount);
+	char owner[MAXDNAME], next[MAXDNAME], signer[MAXDNAME];
+
+	// The negative answer may be used for the SOA's TTL, limited by its
+	// MINIMUM field (RFC 9077). Without SOA, nothing is remembered
+	unsigned long negttl = 0u;
+	bool have_soa = false;
+	for(int i = 0; i < count; i++)
+	{
+		int rrtype, rrclass, rdlen;
+		unsigned long ttl;
+		if(!extract_name(header, plen, &p, owner, 1, 10))
+			return;
+		GETSHORT(rrtype, p);
+		GETSHORT(rrclass, p);
+		GETLONG(ttl, p);
+		GETSHORT(rdlen, p);
+		if(!CHECK_LEN(header, p, plen, rdlen))
+			return;
+
+		unsigned char *rdata = p;
+		p += rdlen;
+		if(rrtype != T_SOA || rrclass != C_IN)
+			continue;
+
+		unsigned long minimum;
+		if(!(rdata = skip_name(rdata, header, plen, 0)) ||
+		   !(rdata = skip_name(rdata, header, plen, 20)))
+			return;
+		rdata += 16;
+		GETLONG(minimum, rdata);
+		negttl = ttl < minimum ? ttl : minimum;
+		have_soa = true;
+	}
+
+	if(!have_soa || negttl == 0u)
+		return;
+
+	p = auth;
+	for(int i = 0; i < count; i++)
+	{
+		int rrtype, rrclass, rdlen;
+		unsigned long ttl;
+		if(!extract_name(header, plen, &p, owner, 1, 10))
+			return;
+		GETSHORT(rrtype, p);
+		GETSHORT(rrclass, p);
+		GETLONG(ttl, p);
+		GETSHORT(rdlen, p);
+		if(!CHECK_LEN(header, p, plen, rdlen))
+			return;
+
+		unsigned char *rdata = p;
+		unsigned char *const end = p + rdlen;
+		p = end;
+		if((rrtype != T_NSEC && rrtype != T_NSEC3) || rrclass != C_IN || strchr(owner, NAME_ESCAPE) != NULL)
+			continue;
+
+		// The signer is the zone the record belongs to. Records synthesized
+		// from a wildcard (fewer labels signed than the owner has, a literal
+		// wildcard owner does not count its asterisk) only prove the
+		// expanded name
+		unsigned int labels = 0u, owner_labels = label_count(owner);
+		unsigned long valid = 0u;
+		if(!find_rrsig(header, plen, auth, count, owner, rrtype, signer, &labels, &valid, now) ||
+		   strchr(signer, NAME_ESCAPE) != NULL || !is_subdomain(owner, signer))
+			continue;
+		if(owner[0] == '*' && owner[1] == '.')
+			owner_labels--;
+		if(labels < owner_labels)
+			continue;
+
+		if(ttl > negttl)
+			ttl = negttl;
+		if(ttl > valid)
+			ttl = valid;
+		if(ttl == 0u)
+			continue;
+
+		if(rrtype == T_NSEC)
+		{
+			if(!extract_name(header, plen, &rdata, next, 1, 0) || rdata > end ||
+			   strchr(next, NAME_ESCAPE) != NULL || !is_subdomain(next, signer))
+				continue;
+
+			struct nsec_zone *zone = get_zone(signer, now);
+			if(zone == NULL)
+				return;
+			if(zone->nsec3)
+			{
+				clear_zone(zone);
+				zone->nsec3 = false;
+			}
+
+			struct nsec_range *range = NULL;
+			for(unsigned int j = 0; j < zone->count && range == NULL; j++)
+				if(hostname_isequal(zone->ranges[j].owner, owner))
+					range = &zone->ranges[j];
+
+			char *owner_copy = strdup(owner), *next_copy = strdup(next);
+			if(owner_copy == NULL || next_copy == NULL)
+			{
+				free(owner_copy);
+				free(next_copy);
+				return;
+			}
+
+			if(range != NULL)
+				free_range(range);
+			else
+				range = new_range(zone, now);
+
+			range->owner = owner_copy;
+			range->next = next_copy;
+			range->expires = now + ttl;
+			range->delegation = (bitmap_has(rdata, end, T_NS) && !bitmap_has(rdata, end, T_SOA)) ||
+			                    bitmap_has(rdata, end, T_DNAME);
+			range->optout = false;
+			stats.stored++;
+		}
+		else
+		{
+			// Only SHA-1 (the only algorithm defined) and no flags other
+			// than opt-out are understood (RFC 5155, 8.1-8.2)
+			if(rdlen < 5)
+				continue;
+			const unsigned char algo = rdata[0], flags = rdata[1];
+			const unsigned short iterations = (rdata[2] << 8) | rdata[3];
+			const unsigned char salt_len = rdata[4];
+			rdata += 5;
+			if(algo != 1u || (flags & ~1u) != 0u || iterations > daemon->limit[LIMIT_NSEC3_ITERS] ||
+			   end - rdata < salt_len + 1)
+				continue;
+			const unsigned char *salt = rdata;
+			rdata += salt_len;
+			if(*rdata++ != NSEC3_HASH_LEN || end - rdata < (ptrdiff_t)NSEC3_HASH_LEN)
+				continue;
+			const unsigned char *next_hash = rdata;
+			rdata += NSEC3_HASH_LEN;
+
+			// The owner is the base32hex-encoded hash directly below the zone
+			unsigned char hash[NSEC3_HASH_LEN + 5];
+			if(base32_decode_label(owner, hash, sizeof(hash)) != (int)NSEC3_HASH_LEN ||
+			   !hostname_isequal(strip_labels(owner, 1), signer))
+				continue;
+
+			struct nsec_zone *zone = get_zone(signer, now);
+			if(zone == NULL)
+				return;
+			if(!zone->nsec3 || zone->iterations != iterations || zone->salt_len != salt_len ||
+			   memcmp(zone->salt, salt, salt_len) != 0)
+			{
+				clear_zone(zone);
+				zone->nsec3 = true;
+				zone->iterations = iterations;
+				zone->salt_len = salt_len;
+				memcpy(zone->salt, salt, salt_len);
+			}
+
+			struct nsec_range *range = NULL;
+			for(unsigned int j = 0; j < zone->count && range == NULL; j++)
+				if(memcmp(zone->ranges[j].hash, hash, NSEC3_HASH_LEN) == 0)
+					range = &zone->ranges[j];
+			if(range == NULL)
+				range = new_range(zone, now);
+
+			memcpy(range->hash, hash, NSEC3_HASH_LEN);
+			memcpy(range->next_hash, next_hash, NSEC3_HASH_LEN);
+			range->expires = now + ttl;
+			range->delegation = (bitmap_has(rdata, end, T_NS) && !bitmap_has(rdata, end, T_SOA)) ||
+			                    bitmap_has(rdata, end, T_DNAME);
+			range->optout = flags & 1u;
+			stats.stored++;
+		}
+	}
+}
+
+// Find the NSEC proving that name does not exist, i.e. owner < name < next in
+// canonical order where the last NSEC of the zone points back to the apex.
+// exists is set when name is the owner or next name of a range
+static struct nsec_range *nsec_covering(struct nsec_zone *zone, const char *name, const time_t now,
+                                        bool *exists)
+{
+	for(unsigned int i = 0; i < zone->count; i++)
+	{
+		struct nsec_range *range = &zone->ranges[i];
+		if(range->expires <= now)
+			continue;
+
+		const int lo = canonical_cmp(range->owner, name);
+		const int hi = canonical_cmp(name, range->next);
+		if(lo == 0 || hi == 0)
+		{
+			*exists = true;
+			return NULL;
+		}
+
+		const bool last = canonical_cmp(range->next, range->owner) <= 0;
+		if(lo < 0 && (hi < 0 || last))
+			return range;
+	}
+	return NULL;
+}
+
+static bool nsec_prove(struct nsec_zone *zone, const char *name, const time_t now, time_t *expires)
+{
+	bool exists = false;
+	const struct nsec_range *range = nsec_covering(zone, name, now, &exists);
+	if(range == NULL)
+		return false;
+
+	// The name is below a zone cut or DNAME, or it is an empty non-terminal
+	// (a name below it exists)
+	if((range->delegation && is_subdomain(name, range->owner)) || is_subdomain(range->next, name))
+		return false;
+
+	// The closest encloser is the longest common ancestor of the name with
+	// the owner or the next name, there must be no wildcard below it
+	const unsigned int common_owner = common_labels(name, range->owner);
+	const unsigned int common_next = common_labels(name, range->next);
+	const unsigned int common = common_owner > common_next ? common_owner : common_next;
+	const char *encloser = strip_labels(name, label_count(name) - common);
+	if(!is_subdomain(encloser, zone->name))
+		return false;
+
+	char wildcard[MAXDNAME];
+	if(snprintf(wildcard, sizeof(wildcard), *encloser != '\0' ? "*.%s" : "*", encloser) >= (int)sizeof(wildcard))
+		return false;
+
+	const struct nsec_range *wrange = nsec_covering(zone, wildcard, now, &exists);
+	if(wrange == NULL || exists)
+		return false;
+
+	*expires = range->expires < wrange->expires ? range->expires : wrange->expires;
+	return true;
+}
+
+// Hash a name with the zone's NSEC3 parameters (RFC 5155, 5)
+static bool nsec3_hash(const struct nsec_zone *zone, const char *name, unsigned char *out)
+{
+	const struct nettle_hash *hash = hash_find((char*)"sha1");
+	void *ctx = NULL;
+	unsigned char *digest = NULL;
+	if(hash == NULL || hash->digest_size != NSEC3_HASH_LEN || !hash_init(hash, &ctx, &digest))
+		return false;
+
+	char wire[MAXDNAME + 1];
+	strncpy(wire, name, sizeof(wire) - 1);
+	wire[sizeof(wire) - 1] = '\0';
+	const int len = to_wire(wire);
+
+	hash->update(ctx, len, (unsigned char *)wire);
+	hash->update(ctx, zone->salt_len, zone->salt);
+	hash->digest(ctx, hash->digest_size, digest);
+	for(unsigned int i = 0; i < zone->iterations; i++)
+	{
+		hash->update(ctx, hash->digest_size, digest);
+		hash->update(ctx, zone->salt_len, zone->salt);
+		hash->digest(ctx, hash->digest_size, digest);
+	}
+
+	memcpy(out, digest, NSEC3_HASH_LEN);
+	return true;
+}
+
+// Find the NSEC3 matching or covering a hash. match is set when the hash is
+// the owner or the next hash of a range (the name exists), only a matching
+// owner is returned
+static struct nsec_range *nsec3_find(struct nsec_zone *zone, const unsigned char *hash, const time_t now,
+                                     bool *match)
+{
+	for(unsigned int i = 0; i < zone->count; i++)
+	{
+		struct nsec_range *range = &zone->ranges[i];
+		if(range->expires <= now)
+			continue;
+
+		const int lo = memcmp(range->hash, hash, NSEC3_HASH_LEN);
+		if(lo == 0)
+		{
+			*match = true;
+			return range;
+		}
+
+		const int hi = memcmp(hash, range->next_hash, NSEC3_HASH_LEN);
+		if(hi == 0)
+		{
+			*match = true;
+			return NULL;
+		}
+
+		const bool last = memcmp(range->next_hash, range->hash, NSEC3_HASH_LEN) <= 0;
+		if((lo < 0 && (hi < 0 || last)) || (last && hi < 0))
+			return range;
+	}
+	return NULL;
+}
+
+static bool nsec3_prove(struct nsec_zone *zone, const char *name, const time_t now, time_t *expires)
+{
+	// Closest encloser proof (RFC 5155, 8.3): walk up from the name until a
+	// matching hash is found, the name below it (the next closer name) has
+	// to be covered by a range without opt-out
+	unsigned char hash[NSEC3_HASH_LEN];
+	const unsigned int labels = label_count(name), zone_labels = label_count(zone->name);
+	const struct nsec_range *next_closer = NULL;
+	const char *encloser = zone->name;
+	time_t until = 0;
+
+	for(unsigned int i = 0; labels - i > zone_labels; i++)
+	{
+		const char *candidate = strip_labels(name, i);
+		if(!nsec3_hash(zone, candidate, hash))
+			return false;
+
+		bool match = false;
+		const struct nsec_range *range = nsec3_find(zone, hash, now, &match);
+		if(match)
+		{
+			// The name itself exists, or its closest encloser is a zone
+			// cut or DNAME
+			if(i == 0u || (range != NULL && range->delegation))
+				return false;
+			if(range != NULL)
+				until = range->expires;
+			encloser = candidate;
+			break;
+		}
+
+		// Nothing known about this name
+		if(range == NULL)
+			return false;
+		next_closer = range;
+	}
+
+	if(next_closer == NULL || next_closer->optout)
+		return false;
+	if(until == 0 || next_closer->expires < until)
+		until = next_closer->expires;
+
+	char wildcard[MAXDNAME];
+	if(snprintf(wildcard, sizeof(wildcard), *encloser != '\0' ? "*.%s" : "*", encloser) >= (int)sizeof(wildcard) ||
+	   !nsec3_hash(zone, wildcard, hash))
+		return false;
+
+	bool match = false;
+	const struct nsec_range *wrange = nsec3_find(zone, hash, now, &match);
+	if(wrange == NULL || match)
+		return false;
+
+	*expires = wrange->expires < until ? wrange->expires : until;
+	return true;
+}
+
+// Insert a negative cache entry for the question when the remembered ranges
+// prove that the name does not exist. The query is then answered from the
+// cache by answer_request() as if the upstream had returned NXDOMAIN
+void FTL_nsec_synthesize(struct dns_header *header, const size_t plen, const time_t now)
+{
+	if(!config.aggressive_nsec || !option_bool(OPT_DNSSEC_VALID) ||
+	   OPCODE(header) != QUERY || ntohs(header->qdcount) != 1 || (header->hb4 & HB4_CD))
+		return;
+
+	char name[MAXDNAME];
+	int qtype, qclass;
+	unsigned char *p = (unsigned char *)(header + 1);
+	if(!extract_name(header, plen, &p, name, 1, 4))
+		return;
+	GETSHORT(qtype, p);
+	GETSHORT(qclass, p);
+	if(qclass != C_IN || strchr(name, NAME_ESCAPE) != NULL)
+		return;
+
+	// Use the deepest zone the name is in
+	struct nsec_zone *zone = NULL;
+	unsigned int zone_labels = 0u;
+	for(unsigned int i = 0; i < NSEC_ZONES; i++)
+	{
+		if(zones[i].name == NULL || zones[i].count == 0u || !is_subdomain(name, zones[i].name))
+			continue;
+		const unsigned int l = label_count(zones[i].name);
+		if(zone == NULL || l > zone_labels)
+		{
+			zone = &zones[i];
+			zone_labels = l;
+		}
+	}
+	if(zone == NULL)
+		return;
+
+	// Leave names alone that have anything cached or configured locally, or
+	// are sent to servers for specific domains (which are not validated)
+	int first = 0, last = 0;
+	if(cache_find_by_name(NULL, name, now, F_IPV4 | F_IPV6 | F_CNAME | F_RR | F_NXDOMAIN) ||
+	   check_for_local_domain(name, now) ||
+	   !lookup_domain(name, 0, &first, &last) || daemon->serverarray[first]->domain_len != 0)
+		return;
+
+	time_t expires = 0;
+	if(!(zone->nsec3 ? nsec3_prove(zone, name, now, &expires) : nsec_prove(zone, name, now, &expires)) ||
+	   expires <= now)
+		return;
+
+	zone->used = now;
+
+	// The offset of the zone in the name locates the SOA returned in the
+	// authority section (see find_soa() in rfc1035.c)
+	union all_addr addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.rrdata.datalen = strlen(name) - strlen(zone->name);
+	addr.rrdata.rrtype = qtype;
+
+	cache_start_insert();
+	const bool inserted = cache_insert(name, &addr, C_IN, now, expires - now,
+	                                   F_FORWARD | F_NEG | F_NXDOMAIN | F_DNSSECOK) != NULL;
+	cache_end_insert();
+
+	if(inserted)
+		stats.synthesized++;
+}
+
+void get_nseccache_stats(struct nseccache_stats *out)
+{
+	*out = stats;
+	for(unsigned int i = 0; i < NSEC_ZONES; i++)
+	{
+		if(zones[i].name == NULL || zones[i].count == 0u)
+			continue;
+		out->zones++;
+		out->ranges += zones[i].count;
+	}
+}
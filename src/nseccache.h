@@ -0,0 +1,32 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Aggressive use of DNSSEC-validated cache (RFC 8198) prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef NSECCACHE_H
+#define NSECCACHE_H
+
+// Number of signed zones NSEC/NSEC3 ranges are remembered for
+#define NSEC_ZONES 32u
+// Number of ranges remembered per zone
+#define NSEC_RANGES 64u
+// Length of an NSEC3 SHA-1 hash
+#define NSEC3_HASH_LEN 20u
+
+struct nseccache_stats {
+	unsigned long synthesized;
+	unsigned long stored;
+	unsigned int ranges;
+	unsigned int zones;
+};
+
+void get_nseccache_stats(struct nseccache_stats *out);
+
+// FTL_nsec_store() and FTL_nsec_synthesize() are called by dnsmasq and
+// declared in dnsmasq_interface.h
+
+#endif //NSECCACHE_H
@@ -15,6 +15,10 @@
 #include "log.h"
 // data getter functions
 #include "datastructure.h"
+// TIME_SCOPE()
+#include "timers.h"
+// cardinality_move()
+#include "cardinality.h"
 
 overTimeData *overTime = NULL;
 
@@ -42,29 +46,8 @@ static void initSlot(const unsigned int index, const time_t timestamp)
 	overTime[index].cached = 0;
 	overTime[index].forwarded = 0;
 
-	// Zero overTime counter for all known clients
-	for(int clientID = 0; clientID < counters->clients; clientID++)
-	{
-		// Get client pointer
-		clientsData* client = getClient(clientID, true);
-		if(client != NULL)
-		{
-			// Set overTime data to zero
-			client->overTime[index] = 0;
-		}
-	}
-
-	// Zero overTime counter for all known upstream destinations
-	for(int upstreamID = 0; upstreamID < counters->upstreams; upstreamID++)
-	{
-		// Get client pointer
-		upstreamsData* upstream = getUpstream(upstreamID, true);
-		if(upstream != NULL)
-		{
-			// Set overTime data to zero
-			upstream->overTime[index] = 0;
-		}
-	}
+	// The slots of clients and upstreams are zeroed when they expire (see
+	// expire_series()) so new slots are always empty
 }
 
 void initOverTime(void)
@@ -100,6 +83,118 @@ void initOverTime(void)
 	}
 }
 
+// Map an overTime slot onto the ring of chunks of a series
+static inline unsigned int ring_pos(const unsigned int slot)
+{
+	return (slot + counters->overTime_base) % OVERTIME_RING;
+}
+
+int overTime_get(const overTimeSeries *series, const unsigned int slot)
+{
+	if(slot >= OVERTIME_SLOTS)
+		return 0;
+
+	const unsigned int pos = ring_pos(slot);
+	const overTimeChunk *chunk = getOverTimeChunk(series->chunk[pos / OVERTIME_CHUNK_SLOTS]);
+	return chunk != NULL ? chunk->values[pos % OVERTIME_CHUNK_SLOTS] : 0;
+}
+
+void overTime_add(overTimeSeries *series, const unsigned int slot, const int delta)
+{
+	if(slot >= OVERTIME_SLOTS || delta == 0)
+		return;
+
+	const unsigned int pos = ring_pos(slot);
+	unsigned int *index = &series->chunk[pos / OVERTIME_CHUNK_SLOTS];
+	if(getOverTimeChunk(*index) == NULL)
+		*index = alloc_overTime_chunk();
+
+	getOverTimeChunk(*index)->values[pos % OVERTIME_CHUNK_SLOTS] += delta;
+}
+
+int overTime_sum(const overTimeSeries *series)
+{
+	int sum = 0;
+	for(unsigned int i = 0; i < OVERTIME_CHUNKS; i++)
+	{
+		const overTimeChunk *chunk = getOverTimeChunk(series->chunk[i]);
+		if(chunk == NULL)
+			continue;
+		for(unsigned int j = 0; j < OVERTIME_CHUNK_SLOTS; j++)
+			sum += chunk->values[j];
+	}
+	return sum;
+}
+
+void overTime_add_series(overTimeSeries *series, const overTimeSeries *other, const int sign)
+{
+	// Both series share the same ring so we can add them chunk by chunk
+	for(unsigned int i = 0; i < OVERTIME_CHUNKS; i++)
+	{
+		const overTimeChunk *chunk = getOverTimeChunk(other->chunk[i]);
+		if(chunk == NULL)
+			continue;
+
+		// Copy the values first, allocating a chunk may move the pool
+		int values[OVERTIME_CHUNK_SLOTS];
+		memcpy(values, chunk->values, sizeof(values));
+		for(unsigned int j = 0; j < OVERTIME_CHUNK_SLOTS; j++)
+		{
+			if(values[j] == 0)
+				continue;
+			unsigned int *index = &series->chunk[i];
+			if(getOverTimeChunk(*index) == NULL)
+				*index = alloc_overTime_chunk();
+			getOverTimeChunk(*index)->values[j] += sign * values[j];
+		}
+	}
+}
+
+void overTime_unpack(const overTimeSeries *series, int values[OVERTIME_SLOTS])
+{
+	for(unsigned int slot = 0; slot < OVERTIME_SLOTS; slot++)
+		values[slot] = overTime_get(series, slot);
+}
+
+// Return all chunks of a series to the pool
+void overTime_free_series(overTimeSeries *series)
+{
+	for(unsigned int i = 0; i < OVERTIME_CHUNKS; i++)
+	{
+		free_overTime_chunk(series->chunk[i]);
+		series->chunk[i] = 0u;
+	}
+}
+
+// Zero the num oldest slots of a series and return chunks which are empty
+// afterwards to the pool
+static void expire_series(overTimeSeries *series, const unsigned int num)
+{
+	for(unsigned int slot = 0; slot < num; slot++)
+	{
+		const unsigned int pos = ring_pos(slot);
+		overTimeChunk *chunk = getOverTimeChunk(series->chunk[pos / OVERTIME_CHUNK_SLOTS]);
+		if(chunk != NULL)
+			chunk->values[pos % OVERTIME_CHUNK_SLOTS] = 0;
+	}
+
+	for(unsigned int i = 0; i < OVERTIME_CHUNKS; i++)
+	{
+		const overTimeChunk *chunk = getOverTimeChunk(series->chunk[i]);
+		if(chunk == NULL)
+			continue;
+
+		unsigned int j = 0;
+		while(j < OVERTIME_CHUNK_SLOTS && chunk->values[j] == 0)
+			j++;
+		if(j < OVERTIME_CHUNK_SLOTS)
+			continue;
+
+		free_overTime_chunk(series->chunk[i]);
+		series->chunk[i] = 0u;
+	}
+}
+
 bool warned_about_hwclock = false;
 unsigned int _getOverTimeID(time_t timestamp, const char *file, const int line)
 {
@@ -161,6 +256,8 @@ unsigned int _getOverTimeID(time_t timestamp, const char *file, const int line)
 // This routine is called by garbage collection to rearrange the overTime structure for the next hour
 void moveOverTimeMemory(const time_t mintime)
 {
+	TIME_SCOPE("overtime_move");
+
 	const time_t oldestOverTimeIS = overTime[0].timestamp;
 	// Shift SHOULD timestamp into the future by the amount GC is running earlier
 	time_t oldestOverTimeSHOULD = mintime;
@@ -198,6 +295,7 @@ void moveOverTimeMemory(const time_t mintime)
 	memmove(&overTime[0],
 		&overTime[moveOverTime],
 		remainingSlots*sizeof(*overTime));
+	cardinality_move(moveOverTime);
 
 	// Correct time indices of queries. This is necessary because we just moved the slot this index points to
 	for(int queryID = 0; queryID < counters->queries; queryID++)
@@ -208,31 +306,28 @@ void moveOverTimeMemory(const time_t mintime)
 			continue;
 	}
 
-	// Move client-specific overTime memory
+	// Client- and upstream-specific overTime data is stored in a ring, zero
+	// the slots moving out of it and advance its start
 	for(int clientID = 0; clientID < counters->clients; clientID++)
 	{
 		clientsData *client = getClient(clientID, true);
-		if(!client)
-			continue;
-
-		memmove(&(client->overTime[0]),
-		        &(client->overTime[moveOverTime]),
-		        remainingSlots*sizeof(*client->overTime));
+		if(client != NULL)
+			expire_series(&client->overTime, moveOverTime);
 	}
 
-	// Process upstream data
 	for(int upstreamID = 0; upstreamID < counters->upstreams; upstreamID++)
 	{
 		upstreamsData *upstream = getUpstream(upstreamID, true);
-		if(!upstream)
+		if(upstream == NULL)
 			continue;
 
-		// Move upstream-specific overTime memory
-		memmove(&(upstream->overTime[0]),
-		        &(upstream->overTime[moveOverTime]),
-		        remainingSlots*sizeof(*upstream->overTime));
+		expire_series(&upstream->overTime, moveOverTime);
+		for(unsigned int bin = 0; bin < UPSTREAM_RTIME_BINS; bin++)
+			expire_series(&upstream->rtime[bin], moveOverTime);
 	}
 
+	counters->overTime_base = (counters->overTime_base + moveOverTime) % OVERTIME_RING;
+
 	// Iterate over new overTime region and initialize it
 	for(unsigned int timeidx = remainingSlots; timeidx < OVERTIME_SLOTS ; timeidx++)
 	{
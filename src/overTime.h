@@ -27,6 +27,15 @@ unsigned int _getOverTimeID(const time_t timestamp, const char *file, const int
  */
 void moveOverTimeMemory(const time_t mintime);
 
+// Access the sparse overTime data of clients and upstreams. Slots are the same
+// as in the global overTime data
+int overTime_get(const overTimeSeries *series, const unsigned int slot) __attribute__((pure));
+void overTime_add(overTimeSeries *series, const unsigned int slot, const int delta);
+int overTime_sum(const overTimeSeries *series) __attribute__((pure));
+void overTime_add_series(overTimeSeries *series, const overTimeSeries *other, const int sign);
+void overTime_unpack(const overTimeSeries *series, int values[OVERTIME_SLOTS]);
+void overTime_free_series(overTimeSeries *series);
+
 typedef struct {
 	unsigned char magic;
 	int total;
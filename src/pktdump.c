@@ -0,0 +1,314 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Asynchronous packet dump
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#define FTLDNS
+#include "dnsmasq/dnsmasq.h"
+#undef __USE_XOPEN
+#include "FTL.h"
+#include "pktdump.h"
+#include "dnsmasq_interface.h"
+#include "config.h"
+#include "log.h"
+// killed
+#include "signals.h"
+// set_event(), wait_for_event(), wake_thread()
+#include "events.h"
+#include <stdatomic.h>
+// thread_sched_apply()
+#include "threadsched.h"
+
+// dnsmasq writes every dumped packet (--dumpfile) to the pcap file right away.
+// When PCAP_BUFFER is set, dnsmasq's main thread only copies the records into
+// an in-memory ring buffer and the packet dump thread writes them to the file.
+// There is exactly one producer (dnsmasq's main thread) and one consumer (the
+// packet dump thread). The buffer contains the records exactly as they are
+// written to the file. Records which do not fit into the buffer are dropped.
+//
+// When PCAP_MAX_SIZE is set, the file is rotated (dumpfile.1, dumpfile.2, ...)
+// before it grows larger. When PCAP_TRIGGER is set, records are not written
+// continuously but discarded after this many seconds. They are written only
+// when something interesting happens (an upstream server returned an error).
+//
+// Forks have no packet dump thread, they write their packets synchronously
+// (or drop them in trigger mode)
+
+// See dump.c
+struct pcap_file_header {
+	u32 magic_number;
+	u16 version_major;
+	u16 version_minor;
+	u32 thiszone;
+	u32 sigfigs;
+	u32 snaplen;
+	u32 network;
+};
+
+struct pcap_record_header {
+	u32 ts_sec;
+	u32 ts_usec;
+	u32 incl_len;
+	u32 orig_len;
+};
+
+static struct {
+	unsigned char *buf;
+	size_t size;
+	_Atomic size_t head;
+	_Atomic size_t tail;
+	bool enabled;
+} ring = { NULL, 0u, 0u, 0u, false };
+
+// Size of the current file, only used by the packet dump thread
+static size_t file_size = 0u;
+
+static _Atomic unsigned long queued = 0ul, written = 0ul, dropped = 0ul;
+static _Atomic unsigned long rotations = 0ul, triggers = 0ul;
+
+// Allocate the buffer. Returns true if the packet dump thread is to be started
+bool init_pktdump(void)
+{
+	if(config.pktdump.buffer == 0 || daemon->dumpfd == -1)
+		return false;
+
+	ring.size = (size_t)config.pktdump.buffer * 1024u;
+	ring.buf = malloc(ring.size);
+	if(ring.buf == NULL)
+	{
+		logg("WARNING: Cannot allocate packet dump buffer, packets are dumped synchronously");
+		return false;
+	}
+
+	const off_t end = lseek(daemon->dumpfd, 0, SEEK_END);
+	file_size = end > 0 ? (size_t)end : 0u;
+	ring.enabled = true;
+	return true;
+}
+
+// Forks must not add records to a buffer nobody is reading
+void pktdump_forked(void)
+{
+	ring.enabled = false;
+}
+
+// Copy data into the ring buffer starting at position pos
+static void ring_write(const size_t pos, const void *data, const size_t len)
+{
+	const size_t off = pos % ring.size;
+	const size_t first = MIN(len, ring.size - off);
+	memcpy(ring.buf + off, data, first);
+	memcpy(ring.buf, (const unsigned char*)data + first, len - first);
+}
+
+// Copy data out of the ring buffer starting at position pos
+static void ring_read(const size_t pos, void *data, const size_t len)
+{
+	const size_t off = pos % ring.size;
+	const size_t first = MIN(len, ring.size - off);
+	memcpy(data, ring.buf + off, first);
+	memcpy((unsigned char*)data + first, ring.buf, len - first);
+}
+
+// Called by dnsmasq with the parts of a pcap record (header, IP header, UDP
+// header, payload). Returns false if the record has to be written by the
+// caller
+bool FTL_dump_packet(const struct iovec *iov, const int iovcnt)
+{
+	if(!ring.enabled)
+		return ring.buf != NULL && config.pktdump.trigger > 0;
+
+	size_t len = 0u;
+	for(int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	const size_t head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+	const size_t tail = atomic_load_explicit(&ring.tail, memory_order_acquire);
+	if(len > ring.size - (head - tail))
+	{
+		atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+		return true;
+	}
+
+	size_t pos = head;
+	for(int i = 0; i < iovcnt; i++)
+	{
+		ring_write(pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+	atomic_store_explicit(&ring.head, pos, memory_order_release);
+	atomic_fetch_add_explicit(&queued, 1, memory_order_relaxed);
+
+	// Wake up the writer early when the buffer is filling up
+	if(config.pktdump.trigger == 0 && pos - tail > ring.size/2)
+		wake_thread(PCAP);
+
+	return true;
+}
+
+// Write what has been recorded within the last PCAP_TRIGGER seconds
+void pktdump_trigger(void)
+{
+	if(ring.buf != NULL && config.pktdump.trigger > 0)
+		set_event(DUMP_PACKETS);
+}
+
+// Write the bytes [from, to) of the buffer to the file
+static void write_range(size_t from, const size_t to)
+{
+	while(from < to)
+	{
+		const size_t off = from % ring.size;
+		const size_t len = MIN(to - from, ring.size - off);
+		if(!read_write(daemon->dumpfd, ring.buf + off, (int)len, 0))
+		{
+			logg("WARNING: Cannot write packet dump: %s", strerror(errno));
+			return;
+		}
+		from += len;
+		file_size += len;
+	}
+}
+
+// Rename dumpfile to dumpfile.1, dumpfile.1 to dumpfile.2, ... and continue
+// with a new file
+static void rotate(void)
+{
+	char from[PATH_MAX], to[PATH_MAX];
+	for(unsigned int i = config.pktdump.files; i > 0; i--)
+	{
+		if(i > 1)
+			snprintf(from, sizeof(from), "%s.%u", daemon->dump_file, i - 1);
+		else
+			snprintf(from, sizeof(from), "%s", daemon->dump_file);
+		snprintf(to, sizeof(to), "%s.%u", daemon->dump_file, i);
+		if(rename(from, to) != 0 && errno != ENOENT)
+			logg("WARNING: Cannot rename %s to %s: %s", from, to, strerror(errno));
+	}
+
+	// Continue with the current file if we cannot create a new one, we
+	// try again after another PCAP_MAX_SIZE
+	file_size = 0u;
+	const int fd = open(daemon->dump_file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if(fd < 0)
+	{
+		logg("WARNING: Cannot create %s: %s", daemon->dump_file, strerror(errno));
+		return;
+	}
+
+	struct pcap_file_header header = {
+		.magic_number = 0xa1b2c3d4,
+		.version_major = 2,
+		.version_minor = 4,
+		.thiszone = 0,
+		.sigfigs = 0,
+		.snaplen = daemon->edns_pktsz + 200, /* slop for IP/UDP headers */
+		.network = 101 /* DLT_RAW */
+	};
+	if(!read_write(fd, (unsigned char*)&header, sizeof(header), 0) ||
+	   dup2(fd, daemon->dumpfd) < 0)
+		logg("WARNING: Cannot initialize %s: %s", daemon->dump_file, strerror(errno));
+	else
+		file_size = sizeof(header);
+	close(fd);
+
+	atomic_fetch_add_explicit(&rotations, 1, memory_order_relaxed);
+}
+
+// Write all records in the buffer to the file
+static void write_records(void)
+{
+	const size_t head = atomic_load_explicit(&ring.head, memory_order_acquire);
+	const size_t max_size = (size_t)config.pktdump.max_size * 1024u * 1024u;
+	size_t from = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+	size_t pos = from;
+	unsigned long count = 0ul;
+
+	while(pos < head)
+	{
+		struct pcap_record_header record;
+		ring_read(pos, &record, sizeof(record));
+		const size_t len = sizeof(record) + record.incl_len;
+
+		// Rotate the file before this record would exceed the maximum
+		// size (unless it is the first record of the file)
+		const size_t size = file_size + (pos - from);
+		if(max_size > 0 && size + len > max_size && size > sizeof(struct pcap_file_header))
+		{
+			write_range(from, pos);
+			rotate();
+			from = pos;
+		}
+
+		pos += len;
+		count++;
+	}
+
+	write_range(from, pos);
+	atomic_store_explicit(&ring.tail, pos, memory_order_release);
+	atomic_fetch_add_explicit(&written, count, memory_order_relaxed);
+}
+
+// Remove records older than the given time from the buffer
+static void discard_records(const time_t before)
+{
+	const size_t head = atomic_load_explicit(&ring.head, memory_order_acquire);
+	size_t pos = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+
+	while(pos < head)
+	{
+		struct pcap_record_header record;
+		ring_read(pos, &record, sizeof(record));
+		if((time_t)record.ts_sec >= before)
+			break;
+		pos += sizeof(record) + record.incl_len;
+	}
+
+	atomic_store_explicit(&ring.tail, pos, memory_order_release);
+}
+
+void *pktdump_thread(void *val)
+{
+	(void)val;
+
+	// Set thread name
+	thread_names[PCAP] = "packet dump";
+	prctl(PR_SET_NAME, thread_names[PCAP], 0, 0, 0);
+	thread_sched_apply(PCAP);
+
+	while(!killed)
+	{
+		if(config.pktdump.trigger == 0)
+			write_records();
+		else if(get_and_clear_event(DUMP_PACKETS))
+		{
+			atomic_fetch_add_explicit(&triggers, 1, memory_order_relaxed);
+			write_records();
+		}
+		else
+			discard_records(time(NULL) - (time_t)config.pktdump.trigger);
+
+		wait_for_event(PCAP, PKTDUMP_INTERVAL);
+	}
+
+	// Write what is left
+	if(config.pktdump.trigger == 0)
+		write_records();
+
+	logg("Terminating packet dump thread");
+	return NULL;
+}
+
+void get_pktdump_stats(struct pktdump_stats *stats)
+{
+	stats->queued = atomic_load_explicit(&queued, memory_order_relaxed);
+	stats->written = atomic_load_explicit(&written, memory_order_relaxed);
+	stats->dropped = atomic_load_explicit(&dropped, memory_order_relaxed);
+	stats->rotations = atomic_load_explicit(&rotations, memory_order_relaxed);
+	stats->triggers = atomic_load_explicit(&triggers, memory_order_relaxed);
+}
@@ -0,0 +1,33 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Asynchronous packet dump prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef PKTDUMP_H
+#define PKTDUMP_H
+
+#include <stdbool.h>
+
+// Interval in which the writer thread looks at the buffer [milliseconds]
+#define PKTDUMP_INTERVAL 250
+
+struct pktdump_stats {
+	unsigned long queued;
+	unsigned long written;
+	unsigned long dropped;
+	unsigned long rotations;
+	unsigned long triggers;
+};
+
+// FTL_dump_packet() is called by dnsmasq and declared in dnsmasq_interface.h
+bool init_pktdump(void);
+void pktdump_forked(void);
+void pktdump_trigger(void);
+void *pktdump_thread(void *val);
+void get_pktdump_stats(struct pktdump_stats *stats);
+
+#endif //PKTDUMP_H
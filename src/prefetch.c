@@ -0,0 +1,134 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Cache prefetching
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#define FTLDNS
+#include "dnsmasq/dnsmasq.h"
+#undef __USE_XOPEN
+#include "FTL.h"
+#include "prefetch.h"
+#include "dnsmasq_interface.h"
+#include "config.h"
+#include "log.h"
+// lock_shm(), getQuery()
+#include "shmem.h"
+// findQueryID()
+#include "datastructure.h"
+// ftl_time()
+#include "timers.h"
+// leaderboard_rank()
+#include "leaderboard.h"
+// debug_enabled()
+#include "debuglimit.h"
+
+// When a query is answered from the cache with a record expiring within the
+// next PREFETCH_TTL seconds and its domain is one of the PREFETCH most
+// frequently permitted domains, dnsmasq forwards the query once more after
+// answering it (exactly as it does for stale replies). The reply refreshes the
+// cache before the record expires so the next client does not have to wait
+// for the upstream server. Prefetches get a new dnsmasq ID which FTL does not
+// know, i.e., they are not counted as queries of the client triggering them
+
+// dnsmasq ID of the query checked most recently and whether it is to be
+// prefetched. Answers usually contain several records, the query is checked
+// only once
+static int checked_id = -1;
+static bool scheduled = false;
+
+// Domains prefetched recently. Only domains on the leaderboard can be
+// prefetched so there cannot be more of them than it has members
+static struct {
+	int domainID;
+	time_t when;
+} recent[LEADERBOARD_SIZE] = {{ 0 }};
+
+static time_t rate_second = 0;
+static unsigned int rate_count = 0u;
+static unsigned long prefetches = 0u;
+
+// Has this domain been prefetched within the last PREFETCH_TTL seconds?
+// Otherwise, remember it now
+static bool prefetched_recently(const int domainID, const time_t now)
+{
+	unsigned int oldest = 0;
+	for(unsigned int i = 0; i < LEADERBOARD_SIZE; i++)
+	{
+		if(recent[i].when > 0 && recent[i].domainID == domainID)
+		{
+			if(now - recent[i].when < PREFETCH_TTL)
+				return true;
+			oldest = i;
+			break;
+		}
+		if(recent[i].when < recent[oldest].when)
+			oldest = i;
+	}
+
+	recent[oldest].domainID = domainID;
+	recent[oldest].when = now;
+	return false;
+}
+
+// Called by dnsmasq for every upstream record the current query is answered
+// with from the cache, ttl is the remaining lifetime of the record
+void FTL_prefetch_check(const long ttl)
+{
+	if(config.prefetch == 0 || ttl > PREFETCH_TTL ||
+	   checked_id == daemon->log_display_id)
+		return;
+
+	checked_id = daemon->log_display_id;
+	scheduled = false;
+
+	const time_t now = ftl_time();
+	if(now != rate_second)
+	{
+		rate_second = now;
+		rate_count = 0u;
+	}
+	if(rate_count >= PREFETCH_MAX_RATE)
+		return;
+
+	lock_shm();
+	int domainID = -1;
+	const int queryID = findQueryID(daemon->log_display_id);
+	const queriesData *query = queryID < 0 ? NULL : getQuery(queryID, true);
+	if(query != NULL)
+	{
+		const int rank = leaderboard_rank(BOARD_PERMITTED_DOMAINS, query->domainID);
+		if(rank >= 0 && (unsigned int)rank < config.prefetch)
+			domainID = query->domainID;
+	}
+	unlock_shm();
+
+	if(domainID < 0 || prefetched_recently(domainID, now))
+		return;
+
+	rate_count++;
+	prefetches++;
+	scheduled = true;
+
+	if(debug_enabled(DEBUG_QUERIES))
+		logg("**** prefetching %s (ID %i, TTL %lis)",
+		     daemon->namebuff, daemon->log_display_id, ttl);
+}
+
+// Called by dnsmasq after the current query has been answered from the cache.
+// Returns true if it should be forwarded to refresh the cache
+bool FTL_prefetch_pending(void)
+{
+	const bool pending = scheduled && checked_id == daemon->log_display_id;
+	scheduled = false;
+	return pending;
+}
+
+unsigned long get_prefetch_count(void)
+{
+	return prefetches;
+}
@@ -0,0 +1,24 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Cache prefetching prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+// Cached records of popular domains are refreshed when they are requested
+// less than PREFETCH_TTL seconds before they expire [seconds]
+#define PREFETCH_TTL 10
+
+// Maximum number of prefetches per second
+#define PREFETCH_MAX_RATE 10
+
+// FTL_prefetch_check() and FTL_prefetch_pending() are called by dnsmasq and
+// declared in dnsmasq_interface.h
+unsigned long get_prefetch_count(void) __attribute__((pure));
+
+#endif //PREFETCH_H
@@ -0,0 +1,49 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  USDT probe definitions
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef PROBES_H
+#define PROBES_H
+
+// Static tracepoints of provider "ftl" for bpftrace, perf and SystemTap. They
+// compile to a single NOP and are only active while a tracer is attached, e.g.
+//   bpftrace -e 'usdt:/usr/bin/pihole-FTL:ftl:query__reply { printf("%s %d\n", str(arg1), arg4); }'
+//
+// query__new(queryID, domain, client IP, query type)
+// query__blocked(queryID, domain, status)
+// query__forwarded(queryID, domain, upstream IP, upstream port)
+// query__reply(queryID, domain, status, reply type, response time [us])
+// lock__acquire(func, file, line, waited [us])
+// lock__release(func, file, line, held [us])
+// lock__shared__acquire(func, file, line, waited [us])
+// lock__shared__release(func, file, line, held [us])
+// gc__start(oldest timestamp kept)
+// gc__done(removed queries, reclaimed domains and clients, took [us])
+// db__save__start()
+// db__save__done(stored queries or -1, took [us])
+//
+// Arguments are evaluated even without a tracer attached, they should be
+// cheap to compute. Without sys/sdt.h (systemtap-sdt-dev), there are no probes
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define FTL_PROBE(name) DTRACE_PROBE(ftl, name)
+#define FTL_PROBE1(name, a) DTRACE_PROBE1(ftl, name, a)
+#define FTL_PROBE2(name, a, b) DTRACE_PROBE2(ftl, name, a, b)
+#define FTL_PROBE3(name, a, b, c) DTRACE_PROBE3(ftl, name, a, b, c)
+#define FTL_PROBE4(name, a, b, c, d) DTRACE_PROBE4(ftl, name, a, b, c, d)
+#define FTL_PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(ftl, name, a, b, c, d, e)
+#else
+#define FTL_PROBE(name) do { } while(0)
+#define FTL_PROBE1(name, a) do { } while(0)
+#define FTL_PROBE2(name, a, b) do { } while(0)
+#define FTL_PROBE3(name, a, b, c) do { } while(0)
+#define FTL_PROBE4(name, a, b, c, d) do { } while(0)
+#define FTL_PROBE5(name, a, b, c, d, e) do { } while(0)
+#endif
+
+#endif //PROBES_H
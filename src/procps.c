@@ -16,6 +16,8 @@
 #include <unistd.h>
 
 #define PROCESS_NAME   "pihole-FTL"
+// Prefix of the mappings of FTL's shared memory objects (see shmem.c)
+#define SHM_MAPPING    "/dev/shm/"
 
 static bool get_process_name(const pid_t pid, char name[16])
 {
@@ -157,3 +159,126 @@ bool check_running_FTL(void)
 	closedir(dirPos);
 	return process_running;
 }
+
+// Get the IDs of the children of a process, returns their number
+unsigned int get_child_processes(const pid_t parent, pid_t *pids, const unsigned int max)
+{
+	DIR *dirPos = opendir("/proc");
+	if(dirPos == NULL)
+		return 0u;
+
+	unsigned int num = 0u;
+	struct dirent *entry;
+	while(num < max && (entry = readdir(dirPos)) != NULL)
+	{
+		if(entry->d_type != DT_DIR)
+			continue;
+		if(entry->d_name[0] < '0' || entry->d_name[0] > '9')
+			continue;
+
+		const pid_t pid = strtol(entry->d_name, NULL, 10);
+		pid_t ppid = 0;
+		if(get_process_ppid(pid, &ppid) && ppid == parent)
+			pids[num++] = pid;
+	}
+
+	closedir(dirPos);
+	return num;
+}
+
+static void add_memory_usage(struct proc_memory_usage *usage, const struct proc_memory_usage *add)
+{
+	usage->rss += add->rss;
+	usage->pss += add->pss;
+	usage->uss += add->uss;
+}
+
+// Group the mappings which have been read since the last header line
+static void account_mapping(struct proc_memory *mem, const char *path, const struct proc_memory_usage *usage)
+{
+	add_memory_usage(&mem->total, usage);
+
+	const char *shm = strncmp(path, SHM_MAPPING "FTL-", sizeof(SHM_MAPPING "FTL-") - 1) == 0 ?
+	                  path + sizeof(SHM_MAPPING) - 1 : NULL;
+	if(shm != NULL)
+	{
+		add_memory_usage(&mem->shm, usage);
+
+		// Objects which have been resized are unlinked and mapped again,
+		// mappings of the old ones are marked as deleted
+		char name[sizeof(mem->segment[0].name)] = { 0 };
+		strncpy(name, shm, sizeof(name) - 1);
+		char *deleted = strstr(name, " (deleted)");
+		if(deleted != NULL)
+			*deleted = '\0';
+
+		unsigned int i = 0u;
+		while(i < mem->segments && strcmp(mem->segment[i].name, name) != 0)
+			i++;
+		if(i == mem->segments)
+		{
+			if(mem->segments == PROC_MEMORY_SEGMENTS)
+				return;
+			strcpy(mem->segment[i].name, name);
+			mem->segments++;
+		}
+		add_memory_usage(&mem->segment[i].usage, usage);
+	}
+	else if(path[0] == '\0' || strcmp(path, "[heap]") == 0 || strcmp(path, "[stack]") == 0)
+		add_memory_usage(&mem->heap, usage);
+	else
+		add_memory_usage(&mem->other, usage);
+}
+
+// Get the memory of a process broken down by the kind of its mappings from
+// /proc/<pid>/smaps (smaps_rollup has no per-mapping information)
+bool get_process_memory(const pid_t pid, struct proc_memory *mem)
+{
+	memset(mem, 0, sizeof(*mem));
+
+	char filename[sizeof("/proc/%u/smaps") + sizeof(int)*3];
+	snprintf(filename, sizeof(filename), "/proc/%d/smaps", pid);
+	FILE *f = fopen(filename, "r");
+	if(f == NULL)
+		return false;
+
+	char path[PATH_MAX] = { 0 };
+	struct proc_memory_usage usage = { 0 };
+	bool mapping = false;
+	char line[PATH_MAX + 128];
+	while(fgets(line, sizeof(line), f) != NULL)
+	{
+		unsigned long value = 0ul;
+		char key[32] = { 0 };
+		if(sscanf(line, "%31[A-Za-z_]: %lu kB", key, &value) == 2)
+		{
+			if(strcmp(key, "Rss") == 0)
+				usage.rss = value;
+			else if(strcmp(key, "Pss") == 0)
+				usage.pss = value;
+			else if(strcmp(key, "Private_Clean") == 0 || strcmp(key, "Private_Dirty") == 0)
+				usage.uss += value;
+			continue;
+		}
+
+		// Header line of the next mapping:
+		// <start>-<end> <perms> <offset> <dev> <inode> [<path>]
+		unsigned long start, end;
+		int offset = 0;
+		if(sscanf(line, "%lx-%lx %*s %*s %*s %*s %n", &start, &end, &offset) < 2 || offset == 0)
+			continue;
+
+		if(mapping)
+			account_mapping(mem, path, &usage);
+		memset(&usage, 0, sizeof(usage));
+		mapping = true;
+
+		strncpy(path, line + offset, sizeof(path) - 1);
+		path[strcspn(path, "\n")] = '\0';
+	}
+	if(mapping)
+		account_mapping(mem, path, &usage);
+
+	fclose(f);
+	return true;
+}
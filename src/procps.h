@@ -10,6 +10,38 @@
 
 #ifndef PROCPS_H
 #define PROCPS_H
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Maximum number of FTL shared memory objects reported per process
+#define PROC_MEMORY_SEGMENTS 48
+
+// Memory of a group of mappings [kB]. USS (unique set size) is the memory
+// which would be freed if the process terminated, PSS (proportional set size)
+// additionally contains the process' share of memory shared with others
+struct proc_memory_usage {
+	unsigned long rss;
+	unsigned long pss;
+	unsigned long uss;
+};
+
+struct proc_memory {
+	struct proc_memory_usage total;
+	// Sum of all FTL shared memory objects
+	struct proc_memory_usage shm;
+	// Heap and anonymous mappings (malloc(), SQLite, thread stacks)
+	struct proc_memory_usage heap;
+	// Everything else (binary, libraries, other files)
+	struct proc_memory_usage other;
+	unsigned int segments;
+	struct {
+		char name[32];
+		struct proc_memory_usage usage;
+	} segment[PROC_MEMORY_SEGMENTS];
+};
+
 bool check_running_FTL(void);
+unsigned int get_child_processes(const pid_t parent, pid_t *pids, const unsigned int max);
+bool get_process_memory(const pid_t pid, struct proc_memory *mem);
 
 #endif // POCPS_H
\ No newline at end of file
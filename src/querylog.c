@@ -0,0 +1,370 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Binary query log
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "querylog.h"
+#include "config.h"
+#include "log.h"
+// lock_shm_shared(), seq_queryID()
+#include "shmem.h"
+// getDomainString(), get_query_status_str()
+#include "datastructure.h"
+// killed, thread_names[]
+#include "signals.h"
+// wait_for_event()
+#include "events.h"
+// stream_ring
+#include "api/stream.h"
+#include <stdatomic.h>
+// thread_sched_apply()
+#include "threadsched.h"
+
+// With log-queries, dnsmasq writes several text lines per query to
+// pihole.log. With BINARY_QUERY_LOG, the query log thread writes one compact
+// record per completed query to QUERYLOGFILE instead. It reads the queries
+// completed since its last run from the ring of the live query stream (which
+// is also filled by the TCP and DNS workers) and is counted as one of its
+// subscribers. "pihole-FTL querylog [file]" decodes the file.
+//
+// The file starts with the magic "PHQL" and a version byte followed by three
+// reserved bytes. All integers are stored little-endian, each record is
+//
+//   u16 length of the rest of the record
+//   u32 timestamp (seconds since the epoch)
+//   u32 response time (1/10 ms, zero if unknown)
+//   u8  status, u8 type, u8 reply, u8 DNSSEC status (FTL's enums)
+//   u16 query type (RR type)
+//   u16 port of the upstream server (zero if not forwarded)
+//   i16 extended DNS error (-1 if none)
+//   u8  length + domain, u8 length + client IP, u8 length + upstream IP
+//
+// Queries of maximum privacy level are not logged, domains and clients are
+// hidden according to the privacy level like everywhere else
+
+#define QUERYLOG_MAGIC "PHQL"
+#define QUERYLOG_FIXED 18u
+#define QUERYLOG_RECORD_MAX (2u + QUERYLOG_FIXED + 3u*256u)
+#define QUERYLOG_BUFFER 65536u
+
+static int fd = -1;
+static char buffer[QUERYLOG_BUFFER];
+static size_t used = 0u;
+static _Atomic unsigned long written = 0ul, dropped = 0ul;
+
+static void put_u16(unsigned char *p, const uint16_t value)
+{
+	p[0] = value & 0xff;
+	p[1] = value >> 8;
+}
+
+static void put_u32(unsigned char *p, const uint32_t value)
+{
+	put_u16(p, value & 0xffff);
+	put_u16(p + 2, value >> 16);
+}
+
+static uint16_t __attribute__((pure)) get_u16(const unsigned char *p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t __attribute__((pure)) get_u32(const unsigned char *p)
+{
+	return get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static unsigned char *put_str(unsigned char *p, const char *str)
+{
+	const size_t len = strlen(str) < 255u ? strlen(str) : 255u;
+	*p++ = (unsigned char)len;
+	memcpy(p, str, len);
+	return p + len;
+}
+
+// Create (or append to) the log file, write the header to new files
+static bool open_querylog(void)
+{
+	if(fd > -1)
+		close(fd);
+
+	fd = open(FTLfiles.querylog, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+	if(fd < 0)
+	{
+		logg("WARNING: Cannot open binary query log %s: %s", FTLfiles.querylog, strerror(errno));
+		return false;
+	}
+
+	if(lseek(fd, 0, SEEK_END) == 0)
+	{
+		const unsigned char header[8] = { 'P', 'H', 'Q', 'L', QUERYLOG_VERSION, 0, 0, 0 };
+		if(write(fd, header, sizeof(header)) != sizeof(header))
+			logg("WARNING: Cannot write to binary query log %s: %s", FTLfiles.querylog, strerror(errno));
+	}
+
+	return true;
+}
+
+// Has the log file been moved or removed (logrotate)?
+static bool querylog_replaced(void)
+{
+	struct stat path, file;
+	if(stat(FTLfiles.querylog, &path) != 0 || fstat(fd, &file) != 0)
+		return true;
+
+	return path.st_dev != file.st_dev || path.st_ino != file.st_ino;
+}
+
+// Called before the threads are started and before dropping privileges
+bool init_querylog(void)
+{
+	if(!config.binary_querylog || !open_querylog())
+		return false;
+
+	// Make stream_push() record completed queries
+	atomic_fetch_add(&stream_ring->subscribers, 1);
+	return true;
+}
+
+static void flush_buffer(const unsigned long records)
+{
+	const char *p = buffer;
+	size_t len = used;
+	while(len > 0 && fd > -1)
+	{
+		const ssize_t ret = write(fd, p, len);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			break;
+		p += ret;
+		len -= ret;
+	}
+
+	used = 0u;
+	atomic_fetch_add_explicit(len == 0 ? &written : &dropped, records, memory_order_relaxed);
+}
+
+// Add the record of a query to the buffer. Has to be called while holding the
+// SHM lock
+static bool add_record(const int queryID)
+{
+	const queriesData *query = getQuery(queryID, true);
+	if(query == NULL || query->privacylevel >= PRIVACY_MAXIMUM)
+		return false;
+
+	const char *domain = getDomainString(query);
+	const char *client = getClientIPString(query);
+	if(domain == NULL || client == NULL)
+		return false;
+
+	const char *upstream = "";
+	uint16_t port = 0;
+	if(query->upstreamID > -1)
+	{
+		const upstreamsData *up = getUpstream(query->upstreamID, true);
+		if(up != NULL)
+		{
+			upstream = getstr(up->ippos);
+			port = up->port;
+		}
+	}
+
+	unsigned char *p = (unsigned char*)buffer + used + 2u;
+	put_u32(p, query->timestamp);
+	put_u32(p + 4, query->flags.response_calculated ? query->response : 0u);
+	p[8] = query->status;
+	p[9] = query->type;
+	p[10] = query->reply;
+	p[11] = query->dnssec;
+	put_u16(p + 12, query->qtype);
+	put_u16(p + 14, port);
+	put_u16(p + 16, (uint16_t)(int16_t)query->ede);
+	p = put_str(p + QUERYLOG_FIXED, domain);
+	p = put_str(p, client);
+	p = put_str(p, upstream);
+
+	const size_t len = p - (unsigned char*)buffer - used;
+	put_u16((unsigned char*)buffer + used, len - 2u);
+	used += len;
+	return true;
+}
+
+// Write all queries completed since pos, returns the new position
+static unsigned int write_records(unsigned int pos)
+{
+	const unsigned int head = atomic_load_explicit(&stream_ring->head, memory_order_acquire);
+
+	// Count what has already been overwritten
+	if(head - pos > STREAM_RING_SIZE)
+	{
+		atomic_fetch_add_explicit(&dropped, head - pos - STREAM_RING_SIZE, memory_order_relaxed);
+		pos = head - STREAM_RING_SIZE;
+	}
+
+	while(pos != head)
+	{
+		// Do not hold the lock while writing to the file
+		unsigned long records = 0ul;
+		lock_shm_shared();
+		for(; pos != head && used + QUERYLOG_RECORD_MAX <= sizeof(buffer); pos++)
+		{
+			const int queryID = seq_queryID(stream_ring->seqs[pos % STREAM_RING_SIZE]);
+			if(queryID > -1 && add_record(queryID))
+				records++;
+		}
+		unlock_shm_shared();
+
+		flush_buffer(records);
+	}
+
+	return pos;
+}
+
+void *querylog_thread(void *val)
+{
+	(void)val;
+
+	// Set thread name
+	thread_names[QUERYLOG] = "query log";
+	prctl(PR_SET_NAME, thread_names[QUERYLOG], 0, 0, 0);
+	thread_sched_apply(QUERYLOG);
+
+	unsigned int pos = atomic_load_explicit(&stream_ring->head, memory_order_acquire);
+	time_t checked = 0;
+	while(!killed)
+	{
+		wait_for_event(QUERYLOG, QUERYLOG_INTERVAL);
+
+		const time_t now = time(NULL);
+		if(now != checked && querylog_replaced())
+			open_querylog();
+		checked = now;
+
+		pos = write_records(pos);
+	}
+
+	logg("Terminating query log thread");
+	return NULL;
+}
+
+void get_querylog_stats(struct querylog_stats *stats)
+{
+	stats->written = atomic_load_explicit(&written, memory_order_relaxed);
+	stats->dropped = atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+static const char * __attribute__((const)) dnssec_str(const unsigned char dnssec)
+{
+	switch(dnssec)
+	{
+		case DNSSEC_UNSPECIFIED:
+			return "-";
+		case DNSSEC_SECURE:
+			return "SECURE";
+		case DNSSEC_INSECURE:
+			return "INSECURE";
+		case DNSSEC_BOGUS:
+			return "BOGUS";
+		case DNSSEC_ABANDONED:
+			return "ABANDONED";
+		default:
+			return "?";
+	}
+}
+
+// Copy a length-prefixed string, returns NULL if it exceeds the record
+static const unsigned char *get_str(const unsigned char *p, const unsigned char *end, char out[256])
+{
+	if(p >= end || p + 1 + *p > end)
+		return NULL;
+
+	memcpy(out, p + 1, *p);
+	out[*p] = '\0';
+	return p + 1 + *p;
+}
+
+// pihole-FTL querylog [file]: print the records as text, one line per query
+int decode_querylog(const char *file)
+{
+	FILE *fp = fopen(file, "r");
+	if(fp == NULL)
+	{
+		printf("Cannot open %s: %s\n", file, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	unsigned char header[8];
+	if(fread(header, sizeof(header), 1, fp) != 1 || memcmp(header, QUERYLOG_MAGIC, 4) != 0)
+	{
+		printf("%s is not a binary query log\n", file);
+		fclose(fp);
+		return EXIT_FAILURE;
+	}
+	if(header[4] != QUERYLOG_VERSION)
+	{
+		printf("%s has version %u, expected %u\n", file, header[4], QUERYLOG_VERSION);
+		fclose(fp);
+		return EXIT_FAILURE;
+	}
+
+	unsigned char record[QUERYLOG_RECORD_MAX];
+	unsigned char lenbuf[2];
+	while(fread(lenbuf, sizeof(lenbuf), 1, fp) == 1)
+	{
+		const uint16_t len = get_u16(lenbuf);
+		if(len < QUERYLOG_FIXED + 3u || len > sizeof(record) || fread(record, len, 1, fp) != 1)
+		{
+			printf("Truncated or corrupt record, stopping\n");
+			fclose(fp);
+			return EXIT_FAILURE;
+		}
+
+		char domain[256], client[256], upstream[256];
+		const unsigned char *end = record + len;
+		const unsigned char *p = get_str(record + QUERYLOG_FIXED, end, domain);
+		if(p != NULL)
+			p = get_str(p, end, client);
+		if(p != NULL)
+			p = get_str(p, end, upstream);
+		if(p == NULL)
+		{
+			printf("Corrupt record, stopping\n");
+			fclose(fp);
+			return EXIT_FAILURE;
+		}
+
+		char timestr[84] = "";
+		get_timestr(timestr, (time_t)get_u32(record), false);
+
+		const unsigned char type = record[9];
+		char qtype[12];
+		if(type < TYPE_MAX && type != TYPE_OTHER)
+			snprintf(qtype, sizeof(qtype), "%s", querytypes[type]);
+		else
+			snprintf(qtype, sizeof(qtype), "TYPE%u", get_u16(record + 12));
+
+		const uint32_t response = get_u32(record + 4);
+		printf("%s %s %s %s %s %s %s %u.%ums",
+		       timestr, client, qtype, domain,
+		       record[8] < QUERY_STATUS_MAX ? get_query_status_str(record[8]) : "?",
+		       record[10] < QUERY_REPLY_MAX ? get_query_reply_str(record[10]) : "?",
+		       dnssec_str(record[11]),
+		       response / 10u, response % 10u);
+		if(upstream[0] != '\0')
+			printf(" %s#%u", upstream, get_u16(record + 14));
+		const int16_t ede = (int16_t)get_u16(record + 16);
+		if(ede > -1)
+			printf(" EDE=%i", ede);
+		printf("\n");
+	}
+
+	fclose(fp);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,32 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Binary query log prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef QUERYLOG_H
+#define QUERYLOG_H
+
+#include <stdbool.h>
+
+// Interval in which completed queries are written [milliseconds]
+#define QUERYLOG_INTERVAL 100
+
+// Format version stored in the file header, increase when the record layout
+// or the meaning of the stored enums changes
+#define QUERYLOG_VERSION 1
+
+struct querylog_stats {
+	unsigned long written;
+	unsigned long dropped;
+};
+
+bool init_querylog(void);
+void *querylog_thread(void *val);
+void get_querylog_stats(struct querylog_stats *stats);
+int decode_querylog(const char *file);
+
+#endif //QUERYLOG_H
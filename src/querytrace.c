@@ -0,0 +1,131 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Query pipeline stage timing routines
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+// public prototypes
+#include "querytrace.h"
+// query_counters
+#include "shmem.h"
+// config
+#include "config.h"
+// hist_bin()
+#include "histogram.h"
+
+// The durations of the pipeline stages of all queries are collected in
+// histograms in shared memory (query_counters->stages). The stages of a query
+// end in different hooks, the query remembers when its last stage ended.
+// Queries taking longer than SLOW_QUERY_THRESHOLD from being received until
+// their reply has been recorded are kept with the durations of their stages
+// in a small ring (query_counters->slow)
+//
+// The stages of the queries in progress are kept in a table of their own
+// (query_counters->inflight_stages) rather than in every query in memory. A
+// query whose slot has been taken by a newer one is no longer timed
+
+// Get monotonic timestamp in microseconds, truncated to 32 bits. Unsigned
+// wrap-around keeps differences correct for durations of up to 71 minutes
+uint32_t query_stage_now(void)
+{
+	return (uint32_t)monotonic_usec();
+}
+
+// Get the stages of a query in progress, NULL if they are no longer known
+static queryStageSlot *stage_slot(const queriesData *query)
+{
+	const unsigned int seq = query_seq(get_queryID(query));
+	queryStageSlot *slot = &query_counters->inflight_stages[seq % QUERY_STAGE_SLOTS];
+	return slot->seq == seq ? slot : NULL;
+}
+
+// The query has been received at the given time
+void query_stage_start(queriesData *query, const uint32_t received)
+{
+	const unsigned int seq = query_seq(get_queryID(query));
+	queryStageSlot *slot = &query_counters->inflight_stages[seq % QUERY_STAGE_SLOTS];
+	slot->seq = seq;
+	slot->ts = received;
+	slot->stage = STAGE_CLIENT;
+	memset(slot->us, 0, sizeof(slot->us));
+}
+
+// A stage of the query ended now. Stages which are not the next stage of this
+// query (e.g., a second forward of the same query) are ignored
+void query_stage_done(queriesData *query, const enum query_stage stage, const uint32_t now)
+{
+	queryStageSlot *slot = stage_slot(query);
+	if(slot == NULL || slot->stage != stage)
+		return;
+
+	const uint32_t usec = now - slot->ts;
+	queryStageStats *s = &query_counters->stages[stage];
+	__atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->total, usec, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->hist[hist_bin(usec, QUERY_STAGE_BINS)], 1, __ATOMIC_RELAXED);
+	update_max(&s->max, usec);
+
+	if(stage < STAGE_UPSTREAM)
+		slot->us[stage] = usec < UINT16_MAX ? usec : UINT16_MAX;
+	slot->ts = now;
+	slot->stage = stage + 1;
+}
+
+// The (first) reply of the query has been recorded. Queries answered without
+// forwarding them end with the dispatch stage. This has to be called while
+// holding the SHM lock
+void query_stage_finish(queriesData *query, const uint32_t now)
+{
+	queryStageSlot *slot = stage_slot(query);
+	if(slot == NULL || (slot->stage != STAGE_DISPATCH && slot->stage != STAGE_UPSTREAM))
+		return;
+
+	const bool forwarded = slot->stage == STAGE_UPSTREAM;
+	const uint32_t upstream = forwarded ? now - slot->ts : 0u;
+	query_stage_done(query, slot->stage, now);
+	slot->stage = QUERY_STAGES;
+
+	// Queries analyzed while hiding domains are never traced
+	if(config.slow_query_threshold == 0 || query->privacylevel >= PRIVACY_HIDE_DOMAINS)
+		return;
+
+	uint64_t total = upstream;
+	for(unsigned int i = 0; i < STAGE_UPSTREAM; i++)
+		total += slot->us[i];
+	if(total < 1000u*config.slow_query_threshold)
+		return;
+
+	// Remember this query in the ring of slow queries
+	slowQueryTrace *trace = &query_counters->slow[query_counters->slow_next++ % SLOW_QUERY_TRACES];
+	trace->timestamp = query->timestamp;
+	trace->domainID = query->domainID;
+	trace->clientID = query->clientID;
+	trace->qtype = query->qtype;
+	trace->status = query->status;
+	for(unsigned int i = 0; i < STAGE_UPSTREAM; i++)
+		trace->stage_us[i] = slot->us[i];
+	trace->stage_us[STAGE_UPSTREAM] = upstream;
+}
+
+const char *query_stage_name(const enum query_stage stage)
+{
+	switch(stage)
+	{
+		case STAGE_CLIENT:
+			return "client";
+		case STAGE_BLOCKING:
+			return "blocking";
+		case STAGE_DISPATCH:
+			return "dispatch";
+		case STAGE_UPSTREAM:
+			return "upstream";
+		case QUERY_STAGES: // Fall through
+		default:
+			return "unknown";
+	}
+}
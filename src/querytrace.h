@@ -0,0 +1,58 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Query pipeline stage timing prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef QUERYTRACE_H
+#define QUERYTRACE_H
+
+#include <stdint.h>
+// queriesData
+#include "datastructure.h"
+
+// Number of histogram bins (see hist_bin())
+#define QUERY_STAGE_BINS 24
+
+// Number of slow queries remembered (see SLOW_QUERY_THRESHOLD)
+#define SLOW_QUERY_TRACES 32
+
+typedef struct {
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+	uint64_t hist[QUERY_STAGE_BINS];
+} queryStageStats;
+
+typedef struct {
+	uint32_t timestamp;
+	int domainID;
+	int clientID;
+	uint16_t qtype;
+	enum query_status status;
+	uint32_t stage_us[QUERY_STAGES];
+} slowQueryTrace;
+
+// Number of queries in progress whose stages can be timed at the same time
+#define QUERY_STAGE_SLOTS 1024
+
+// Monotonic time [usec, truncated] at which the last pipeline stage of a query
+// in progress ended and the durations [usec, saturated] of the stages before
+// the upstream stage. Slots are taken by the sequence number of the query
+typedef struct {
+	unsigned int seq;
+	uint32_t ts;
+	uint16_t us[STAGE_UPSTREAM];
+	enum query_stage stage;
+} queryStageSlot;
+
+uint32_t query_stage_now(void);
+void query_stage_start(queriesData *query, const uint32_t received);
+void query_stage_done(queriesData *query, const enum query_stage stage, const uint32_t now);
+void query_stage_finish(queriesData *query, const uint32_t now);
+const char *query_stage_name(const enum query_stage stage) __attribute__((const));
+
+#endif //QUERYTRACE_H
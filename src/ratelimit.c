@@ -0,0 +1,342 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Client rate-limiting
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "ratelimit.h"
+// getClient()
+#include "shmem.h"
+// getstr()
+#include "datastructure.h"
+#include "config.h"
+#include "log.h"
+// logg_rate_limit_message()
+#include "database/message-table.h"
+// wake_thread()
+#include "events.h"
+// TIME_SCOPE()
+#include "timers.h"
+// inet_pton()
+#include <arpa/inet.h>
+
+// Every client has a token bucket holding up to RATE_LIMIT_COUNT tokens which
+// is refilled at RATE_LIMIT_COUNT tokens per RATE_LIMIT_INTERVAL. Buckets are
+// refilled lazily whenever a client sends a query, each query takes a token.
+// A client whose bucket is empty is rate-limited until the bucket is full
+// again. Refused queries keep taking tokens (up to one interval in advance)
+// so clients continuing to flood us remain rate-limited. The release of a
+// rate-limited client is scheduled on a timing wheel, this avoids scanning
+// all clients periodically
+
+// A zero interval would refill buckets infinitely fast
+static unsigned int __attribute__((pure)) rate_interval(void)
+{
+	return config.rate_limit.interval > 0 ? config.rate_limit.interval : 1u;
+}
+
+// Refill the bucket of a client up to now
+static void refill(clientsData *client, const time_t now)
+{
+	if(now <= client->rate.refilled)
+		return;
+
+	const float capacity = config.rate_limit.count;
+	client->rate.tokens += (float)(now - client->rate.refilled) * capacity / rate_interval();
+	if(client->rate.tokens > capacity)
+		client->rate.tokens = capacity;
+	client->rate.refilled = now;
+}
+
+// Seconds until the bucket of a client is full
+static time_t __attribute__((pure)) time_to_full(const clientsData *client)
+{
+	const float missing = config.rate_limit.count - client->rate.tokens;
+	const time_t seconds = (time_t)(missing * rate_interval() / config.rate_limit.count + 0.999f);
+	return seconds > 0 ? seconds : 1;
+}
+
+static void schedule_release(const int clientID, clientsData *client, const time_t when)
+{
+	int *slot = &rate_limit_wheel->slots[when % RATE_LIMIT_WHEEL_SLOTS];
+	client->rate.release = when;
+	client->rate.next = *slot;
+	*slot = clientID;
+
+	// The housekeeper sleeps long while no releases are scheduled
+	if(rate_limit_wheel->scheduled++ == 0)
+		wake_thread(GC);
+}
+
+void init_rate_limit_wheel(void)
+{
+	rate_limit_wheel->processed = time(NULL);
+	rate_limit_wheel->scheduled = 0u;
+	for(unsigned int i = 0; i < RATE_LIMIT_WHEEL_SLOTS; i++)
+		rate_limit_wheel->slots[i] = -1;
+	memset(rate_limit_wheel->prefixes, 0, sizeof(rate_limit_wheel->prefixes));
+}
+
+// With RATE_LIMIT_PREFIX, all clients within the same IPv4 or IPv6 subnet
+// additionally share a bucket holding RATE_LIMIT_PREFIX_COUNT tokens. This
+// catches clients rotating their addresses (e.g. IPv6 privacy addresses) and
+// is checked before the client is looked up, so a subnet sending too many
+// queries cannot create new clients either. There is a single prefix length
+// per family, the longest prefix matching an address is therefore the address
+// masked to this length and the buckets are kept in a hash table.
+//
+// The table has a fixed size. A new subnet takes an unused slot or the slot of
+// a subnet whose bucket is fullest, i.e., which has been idle longest. Buckets
+// of rate-limited subnets are never evicted. If all candidate slots are taken
+// by rate-limited subnets, the new subnet is not tracked (its clients are still
+// limited individually by RATE_LIMIT). Refused queries are not counted for the
+// client, rate-limited subnets are released lazily by their next query after
+// their bucket is full again
+
+static unsigned char __attribute__((pure)) prefix_length(const unsigned char family)
+{
+	return family == AF_INET ? config.rate_limit.prefix_v4 : config.rate_limit.prefix_v6;
+}
+
+static void refill_prefix(rateLimitPrefix *prefix, const time_t now)
+{
+	if(now <= prefix->refilled)
+		return;
+
+	const float capacity = config.rate_limit.prefix_count;
+	prefix->tokens += (float)(now - prefix->refilled) * capacity / rate_interval();
+	if(prefix->tokens > capacity)
+		prefix->tokens = capacity;
+	prefix->refilled = now;
+}
+
+static void format_prefix(const rateLimitPrefix *prefix, char buffer[INET6_ADDRSTRLEN + 4])
+{
+	inet_ntop(prefix->family, prefix->addr, buffer, INET6_ADDRSTRLEN);
+	const size_t len = strlen(buffer);
+	snprintf(buffer + len, INET6_ADDRSTRLEN + 4 - len, "/%u", prefix_length(prefix->family));
+}
+
+// Find the bucket of a subnet or a slot for it, NULL if there is none
+static rateLimitPrefix *find_prefix(const unsigned char family, const unsigned char addr[16], const time_t now)
+{
+	// FNV-1a hash of the family and the masked address
+	uint32_t hash = 2166136261u ^ family;
+	hash *= 16777619u;
+	for(unsigned int i = 0; i < 16; i++)
+	{
+		hash ^= addr[i];
+		hash *= 16777619u;
+	}
+
+	rateLimitPrefix *candidate = NULL;
+	for(unsigned int i = 0; i < RATE_LIMIT_PREFIX_PROBES; i++)
+	{
+		rateLimitPrefix *prefix = &rate_limit_wheel->prefixes[(hash + i) % RATE_LIMIT_PREFIXES];
+		if(prefix->family == family && memcmp(prefix->addr, addr, sizeof(prefix->addr)) == 0)
+			return prefix;
+
+		if(prefix->family == 0)
+		{
+			if(candidate == NULL || candidate->family != 0)
+				candidate = prefix;
+			continue;
+		}
+
+		refill_prefix(prefix, now);
+		if(prefix->limited && prefix->tokens >= config.rate_limit.prefix_count)
+		{
+			char buffer[INET6_ADDRSTRLEN + 4];
+			format_prefix(prefix, buffer);
+			logg("Ending rate-limitation of %s", buffer);
+			prefix->limited = false;
+		}
+		if(!prefix->limited && (candidate == NULL ||
+		   (candidate->family != 0 && prefix->tokens > candidate->tokens)))
+			candidate = prefix;
+	}
+
+	if(candidate != NULL)
+	{
+		candidate->family = family;
+		memcpy(candidate->addr, addr, sizeof(candidate->addr));
+		candidate->limited = false;
+		candidate->tokens = config.rate_limit.prefix_count;
+		candidate->refused = 0u;
+		candidate->refilled = now;
+	}
+	return candidate;
+}
+
+// Take a token for a query from the subnet of this client. Returns true if the
+// query is to be refused
+bool rate_limit_prefix(const char *clientIP, const time_t now)
+{
+	if(config.rate_limit.prefix_count == 0 || rate_limit_wheel == NULL)
+		return false;
+
+	unsigned char addr[16] = { 0 };
+	const unsigned char family = strchr(clientIP, ':') != NULL ? AF_INET6 : AF_INET;
+	const unsigned char len = prefix_length(family);
+	if(len == 0 || inet_pton(family, clientIP, addr) != 1)
+		return false;
+
+	// Mask the address to the prefix length
+	const unsigned int bytes = family == AF_INET ? 4u : 16u;
+	for(unsigned int i = 0; i < bytes; i++)
+	{
+		if(8u*i >= len)
+			addr[i] = 0;
+		else if(8u*(i + 1) > len)
+			addr[i] &= (unsigned char)(0xff << (8u*(i + 1) - len));
+	}
+
+	rateLimitPrefix *prefix = find_prefix(family, addr, now);
+	if(prefix == NULL)
+		return false;
+
+	refill_prefix(prefix, now);
+	if(prefix->limited && prefix->tokens >= config.rate_limit.prefix_count)
+		prefix->limited = false;
+
+	if(prefix->limited)
+	{
+		if(prefix->tokens > -(float)config.rate_limit.prefix_count)
+			prefix->tokens -= 1.0f;
+		prefix->refused++;
+		return true;
+	}
+
+	if(prefix->tokens >= 1.0f)
+	{
+		prefix->tokens -= 1.0f;
+		return false;
+	}
+
+	// The bucket is empty, rate-limit this subnet until it is full again
+	prefix->limited = true;
+	prefix->refused = 1u;
+	const float missing = config.rate_limit.prefix_count - prefix->tokens;
+	time_t turnaround = (time_t)(missing * rate_interval() / config.rate_limit.prefix_count + 0.999f);
+	if(turnaround < 1)
+		turnaround = 1;
+
+	char buffer[INET6_ADDRSTRLEN + 4];
+	format_prefix(prefix, buffer);
+	logg_rate_limit_message(buffer, config.rate_limit.prefix_count, turnaround);
+
+	return true;
+}
+
+// Take a token for a query of this client. Returns true if the query is to be
+// refused
+bool rate_limit_query(const int clientID, const time_t now)
+{
+	if(config.rate_limit.count == 0 || rate_limit_wheel == NULL)
+		return false;
+
+	clientsData *client = getClient(clientID, true);
+	if(client == NULL)
+		return false;
+
+	refill(client, now);
+
+	if(client->flags.rate_limited)
+	{
+		// Count refused queries, too, but never more than one
+		// interval in advance
+		if(client->rate.tokens > -(float)config.rate_limit.count)
+			client->rate.tokens -= 1.0f;
+		client->rate.refused++;
+		return true;
+	}
+
+	if(client->rate.tokens >= 1.0f)
+	{
+		client->rate.tokens -= 1.0f;
+		return false;
+	}
+
+	// The bucket is empty, rate-limit this client until it is full again
+	client->flags.rate_limited = true;
+	client->rate.refused = 1u;
+	const time_t turnaround = time_to_full(client);
+	schedule_release(clientID, client, now + turnaround);
+
+	// Log the first rate-limited query for this client. We do not log
+	// the blocked domain for privacy reasons
+	logg_rate_limit_message(getstr(client->ippos), config.rate_limit.count, turnaround);
+
+	return true;
+}
+
+// Release all clients which are due up to now
+void release_rate_limited(const time_t now)
+{
+	TIME_SCOPE("rate_limit_release");
+
+	if(rate_limit_wheel == NULL)
+		return;
+
+	// Visit every slot at most once, even when we have not been called
+	// for a long time
+	time_t second = rate_limit_wheel->processed + 1;
+	if(now - second >= RATE_LIMIT_WHEEL_SLOTS)
+		second = now - RATE_LIMIT_WHEEL_SLOTS + 1;
+
+	for(; second <= now && rate_limit_wheel->scheduled > 0; second++)
+	{
+		int *slot = &rate_limit_wheel->slots[second % RATE_LIMIT_WHEEL_SLOTS];
+		int clientID = *slot;
+		*slot = -1;
+
+		while(clientID >= 0)
+		{
+			clientsData *client = getClient(clientID, true);
+			if(client == NULL)
+				break;
+			const int next = client->rate.next;
+			rate_limit_wheel->scheduled--;
+
+			if(client->rate.release > now)
+			{
+				// Not yet due, the wheel has wrapped around
+				schedule_release(clientID, client, client->rate.release);
+			}
+			else
+			{
+				refill(client, now);
+				const char *clientIP = getstr(client->ippos);
+				if(config.rate_limit.count > 0 &&
+				   client->rate.tokens < config.rate_limit.count)
+				{
+					// The client has continued sending queries
+					logg("Still rate-limiting %s as it made additional %u queries",
+					     clientIP, client->rate.refused);
+					client->rate.refused = 0u;
+					schedule_release(clientID, client, now + time_to_full(client));
+				}
+				else
+				{
+					logg("Ending rate-limitation of %s", clientIP);
+					client->flags.rate_limited = false;
+				}
+			}
+
+			clientID = next;
+		}
+	}
+
+	rate_limit_wheel->processed = now;
+}
+
+// Are there any rate-limited clients waiting for their release?
+bool rate_limits_scheduled(void)
+{
+	return rate_limit_wheel != NULL && rate_limit_wheel->scheduled > 0;
+}
@@ -0,0 +1,55 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Client rate-limiting prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdbool.h>
+#include <time.h>
+
+// Number of one-second slots of the timing wheel releasing rate-limited
+// clients. Releases further in the future wrap around and are skipped until
+// they are due
+#define RATE_LIMIT_WHEEL_SLOTS 256
+
+// Number of subnets (see RATE_LIMIT_PREFIX) which can be tracked at the same
+// time and the number of slots searched for a subnet
+#define RATE_LIMIT_PREFIXES 2048
+#define RATE_LIMIT_PREFIX_PROBES 16
+
+// Token bucket of a subnet, family is zero for unused slots
+typedef struct {
+	unsigned char family;
+	bool limited;
+	unsigned char addr[16];
+	float tokens;
+	unsigned int refused;
+	time_t refilled;
+} rateLimitPrefix;
+
+// Rate-limited clients are linked into the slot of the second they are to be
+// released in. The wheel and the buckets of the subnets are stored in shared
+// memory as clients are rate-limited by forks, too
+typedef struct {
+	time_t processed;
+	unsigned int scheduled;
+	int slots[RATE_LIMIT_WHEEL_SLOTS];
+	rateLimitPrefix prefixes[RATE_LIMIT_PREFIXES];
+} rateLimitWheel;
+
+extern rateLimitWheel *rate_limit_wheel;
+
+// All routines in here have to be called while holding the SHM lock
+void init_rate_limit_wheel(void);
+bool rate_limit_query(const int clientID, const time_t now);
+bool rate_limit_prefix(const char *clientIP, const time_t now);
+void release_rate_limited(const time_t now);
+bool rate_limits_scheduled(void) __attribute__((pure));
+
+#endif //RATELIMIT_H
@@ -0,0 +1,242 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Reclamation of unused domains and clients
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "reclaim.h"
+#include "config.h"
+// logg()
+#include "log.h"
+// counters, query_counters, purge_lookups(), purge_dns_cache(), clear_verdict_cache()
+#include "shmem.h"
+// getDomain(), getClient()
+#include "datastructure.h"
+// queries_kept_since()
+#include "gc.h"
+// overTime_free_series()
+#include "overTime.h"
+// purge_heavy_hitters()
+#include "heavyhitters.h"
+// gravityDB_forget_client()
+#include "database/gravity-db.h"
+
+// Domains and clients are never removed while queries refer to them. Once GC
+// has removed the last of their queries and they have not been seen for
+// RECLAIM_GRACE seconds, their slots are marked with RECLAIMEDBYTE and reused
+// for new domains and clients. Queries cannot refer to reclaimed slots: any
+// query referring to a domain (also as a CNAME) or a client is at least as old
+// as its last lookup and all queries older than queries_kept_since() are gone.
+//
+// The entries of the DNS cache belonging to reclaimed domains and clients are
+// removed here, as are the other places remembering IDs (lookup tables, top
+// lists, verdict cache, slow queries). Entries of the DNS cache which have not
+// been looked up since the same time are removed as well, their blocking
+// status is determined again when the client queries the domain the next time.
+// The generation of a slot is incremented whenever it is reclaimed, entries of
+// the DNS cache remember the generations of their domain and client and are
+// stale when either of them differs (see _findCacheID()).
+//
+// Reclaimed slots are linked in ascending order through their count so the
+// lowest ones are reused first, those at the end of the arrays are cut off.
+// This compacts the arrays over time and keeps all loops over them short
+
+// Get the next slot for a new domain, counters->domains if it is to be
+// appended. A slot that has been reclaimed before keeps only its generation
+int new_domain_slot(void)
+{
+	int domainID = counters->domains_free;
+	domainsData *domain = domainID > -1 && domainID < counters->domains ? getDomain(domainID, false) : NULL;
+	if(domain != NULL && domain->magic == RECLAIMEDBYTE)
+	{
+		counters->domains_free = domain->count;
+		counters->domains_reclaimed--;
+	}
+	else
+	{
+		// The list is empty (or has been damaged)
+		counters->domains_free = -1;
+		domainID = counters->domains;
+		domain = getDomain(domainID, false);
+		if(domain == NULL)
+			return -1;
+	}
+
+	if(domain->magic == RECLAIMEDBYTE)
+	{
+		const unsigned char generation = domain->generation;
+		memset(domain, 0, sizeof(*domain));
+		domain->generation = generation;
+	}
+
+	return domainID;
+}
+
+// Same as above for a new client
+int new_client_slot(void)
+{
+	int clientID = counters->clients_free;
+	clientsData *client = clientID > -1 && clientID < counters->clients ? getClient(clientID, false) : NULL;
+	if(client != NULL && client->magic == RECLAIMEDBYTE)
+	{
+		counters->clients_free = client->count;
+		counters->clients_reclaimed--;
+	}
+	else
+	{
+		counters->clients_free = -1;
+		clientID = counters->clients;
+		client = getClient(clientID, false);
+		if(client == NULL)
+			return -1;
+	}
+
+	if(client->magic == RECLAIMEDBYTE)
+	{
+		const unsigned char generation = client->generation;
+		memset(client, 0, sizeof(*client));
+		client->generation = generation;
+	}
+
+	return clientID;
+}
+
+// Number of domains and clients in memory
+int known_domains(void)
+{
+	return counters->domains - counters->domains_reclaimed;
+}
+
+int known_clients(void)
+{
+	return counters->clients - counters->clients_reclaimed;
+}
+
+static bool reclaim_domain(domainsData *domain, const time_t before)
+{
+	if(domain->count != 0 || domain->blockedcount != 0 ||
+	   (time_t)domain->last_seen >= before)
+		return false;
+
+	domain->magic = RECLAIMEDBYTE;
+	domain->generation++;
+	return true;
+}
+
+static bool reclaim_client(clientsData *client, const time_t before)
+{
+	// Alias-clients and the clients they manage refer to each other,
+	// rate-limited clients are waiting to be released and the queries
+	// counted in numQueriesARP have not been stored in the network table
+	if(client->count != 0 || client->blockedcount != 0 ||
+	   client->lastQuery >= before || client->firstSeen >= before ||
+	   client->flags.aliasclient || client->aliasclient_id > -1 ||
+	   client->flags.rate_limited || client->numQueriesARP > 0)
+		return false;
+
+	overTime_free_series(&client->overTime);
+	gravityDB_forget_client(client);
+	client->magic = RECLAIMEDBYTE;
+	client->generation++;
+	return true;
+}
+
+// Cut off the reclaimed slots at the end and link the others
+static void relink_domains(void)
+{
+	while(counters->domains > 0 && getDomain(counters->domains - 1, false)->magic == RECLAIMEDBYTE)
+		counters->domains--;
+
+	counters->domains_free = -1;
+	counters->domains_reclaimed = 0;
+	for(int domainID = counters->domains - 1; domainID >= 0; domainID--)
+	{
+		domainsData *domain = getDomain(domainID, false);
+		if(domain->magic != RECLAIMEDBYTE)
+			continue;
+		domain->count = counters->domains_free;
+		counters->domains_free = domainID;
+		counters->domains_reclaimed++;
+	}
+}
+
+static void relink_clients(void)
+{
+	while(counters->clients > 0 && getClient(counters->clients - 1, false)->magic == RECLAIMEDBYTE)
+		counters->clients--;
+
+	counters->clients_free = -1;
+	counters->clients_reclaimed = 0;
+	for(int clientID = counters->clients - 1; clientID >= 0; clientID--)
+	{
+		clientsData *client = getClient(clientID, false);
+		if(client->magic != RECLAIMEDBYTE)
+			continue;
+		client->count = counters->clients_free;
+		counters->clients_free = clientID;
+		counters->clients_reclaimed++;
+	}
+}
+
+// Reclaim the domains and clients which have not been seen for RECLAIM_GRACE
+// seconds and are no longer referred to by any query. Has to be called while
+// holding the lock, returns the number of reclaimed domains and clients
+unsigned int reclaim_entries(const time_t now)
+{
+	if(config.reclaim_grace == 0u)
+		return 0u;
+
+	time_t before = now - (time_t)config.reclaim_grace;
+	if(queries_kept_since() < before)
+		before = queries_kept_since();
+	if(before <= 0)
+		return 0u;
+
+	unsigned int num_domains = 0u, num_clients = 0u;
+	for(int domainID = 0; domainID < counters->domains; domainID++)
+	{
+		domainsData *domain = getDomain(domainID, true);
+		if(domain != NULL && reclaim_domain(domain, before))
+			num_domains++;
+	}
+	for(int clientID = 0; clientID < counters->clients; clientID++)
+	{
+		clientsData *client = getClient(clientID, true);
+		if(client != NULL && reclaim_client(client, before))
+			num_clients++;
+	}
+
+	// Entries of the DNS cache also expire while their domain and client
+	// are still in use
+	const int num_cache = purge_dns_cache(before);
+	if(num_domains == 0u && num_clients == 0u)
+	{
+		if(config.debug & DEBUG_GC && num_cache > 0)
+			logg("Notice: GC removed %i DNS cache entries", num_cache);
+		return 0u;
+	}
+
+	purge_lookups();
+	purge_heavy_hitters();
+	clear_verdict_cache();
+	for(unsigned int i = 0; i < SLOW_QUERY_TRACES; i++)
+	{
+		slowQueryTrace *trace = &query_counters->slow[i];
+		if(getDomain(trace->domainID, true) == NULL || getClient(trace->clientID, true) == NULL)
+			trace->domainID = -1;
+	}
+
+	relink_domains();
+	relink_clients();
+
+	if(config.debug & DEBUG_GC)
+		logg("Notice: GC reclaimed %u domains and %u clients, %i and %i slots are free, %i DNS cache entries removed",
+		     num_domains, num_clients, counters->domains_reclaimed, counters->clients_reclaimed, num_cache);
+
+	return num_domains + num_clients;
+}
@@ -0,0 +1,22 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Reclamation of unused domains and clients prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+// time_t
+#include <time.h>
+
+unsigned int reclaim_entries(const time_t now);
+int new_domain_slot(void);
+int new_client_slot(void);
+int known_domains(void) __attribute__((pure));
+int known_clients(void) __attribute__((pure));
+
+#endif //RECLAIM_H
@@ -25,20 +25,38 @@
 #include "config.h"
 // cli_stuff()
 #include "args.h"
+// regex_prefilter_scan()
+#include "regex_prefilter.h"
+// debug_enabled()
+#include "debuglimit.h"
 
 // Safety-measure for future extensions
 #if TYPE_MAX > 30
 #error "Too many query types to be handled by a 32-bit integer"
 #endif
 
+// Large regex tables are compiled by up to REGEX_MAX_THREADS threads, each of
+// them compiling at least REGEX_PER_THREAD regex
+#define REGEX_MAX_THREADS 8
+#define REGEX_PER_THREAD 32
+
+// Number of executions before the average cost of a regex is judged
+#define REGEX_SLOW_MIN_CALLS 50u
+
 const char *regextype[REGEX_MAX] = { "blacklist", "whitelist", "CLI" };
 
 static regexData *white_regex = NULL;
 static regexData *black_regex = NULL;
 static regexData   *cli_regex = NULL;
 static unsigned int num_regex[REGEX_MAX] = { 0 };
+static regex_prefilter *prefilter[REGEX_MAX] = { NULL };
+// Arenas holding the compiled regex read from the database (see REGEX_ARENA),
+// one for every thread which compiled them
+static tre_arena_t *arenas[REGEX_MAX][REGEX_MAX_THREADS] = {{ NULL }};
 unsigned int regex_change = 0;
 
+static void load_regex_from_database(void);
+
 static inline regexData *get_regex_ptr(const enum regex_type regexid)
 {
 	switch (regexid)
@@ -137,14 +155,28 @@ unsigned int __attribute__((pure)) get_num_regex(const enum regex_type regexid)
 	return num_regex[regexid];
 }
 
+// Get the array of all regex of one type (process-private)
+const regexData * __attribute__((pure)) get_regex_data(const enum regex_type regexid)
+{
+	return get_regex_ptr(regexid);
+}
+
 #define FTL_REGEX_SEP ";"
 /* Compile regular expressions into data structures that can be used with
    regexec() to match against a string */
-static bool compile_regex(const char *regexin, const enum regex_type regexid, const int dbidx)
+// Regex may be compiled by several threads, their warnings are serialized
+static pthread_mutex_t regex_warning_lock = PTHREAD_MUTEX_INITIALIZER;
+static void regex_warning(const enum regex_type regexid, const char *warning, const int dbidx, const char *regexin)
 {
-	regexData *regex = get_regex_ptr(regexid);
-	int index = num_regex[regexid]++;
+	pthread_mutex_lock(&regex_warning_lock);
+	logg_regex_warning(regextype[regexid], warning, dbidx, regexin);
+	pthread_mutex_unlock(&regex_warning_lock);
+}
 
+// Compile a regex into the given entry. This only touches the entry itself and
+// may be called from several threads at the same time for different entries
+static bool compile_regex_entry(regexData *regex, const char *regexin, const enum regex_type regexid, const int dbidx)
+{
 	// Extract possible Pi-hole extensions
 	char rgxbuf[strlen(regexin) + 1u];
 	// Parse special FTL syntax if present
@@ -168,10 +200,10 @@ static bool compile_regex(const char *regexin, const enum regex_type regexid, co
 			if(sscanf(part, "querytype=%63s", extra))
 			{
 				// Warn if specified more than one querytype option
-				if(regex[index].ext.query_type != 0)
-					logg_regex_warning(regextype[regexid],
-					                   "Overwriting previous querytype setting",
-					                   dbidx, regexin);
+				if(regex->ext.query_type != 0)
+					regex_warning(regexid,
+					              "Overwriting previous querytype setting",
+					              dbidx, regexin);
 
 				// Check if the first letter is a "!"
 				// This means that the query type matching is inverted
@@ -197,16 +229,16 @@ static bool compile_regex(const char *regexin, const enum regex_type regexid, co
 						// Check for querytype
 						if(strcasecmp(token, querytypes[type]) == 0)
 						{
-							regex[index].ext.query_type ^= 1 << type;
+							regex->ext.query_type ^= 1 << type;
 							break;
 						}
 					}
 					// Check if we found a valid query type
-					if(regex[index].ext.query_type == 0)
+					if(regex->ext.query_type == 0)
 					{
-						logg_regex_warning(regextype[regexid],
-						                   "Unknown query type",
-						                   dbidx, regexin);
+						regex_warning(regexid,
+						              "Unknown query type",
+						              dbidx, regexin);
 						free(buf);
 						return false;
 					}
@@ -217,14 +249,14 @@ static bool compile_regex(const char *regexin, const enum regex_type regexid, co
 
 				// Invert query types if requested
 				if(inverted)
-					regex[index].ext.query_type = ~regex[index].ext.query_type;
+					regex->ext.query_type = ~regex->ext.query_type;
 
-				if(regex[index].ext.query_type != 0 && config.debug & DEBUG_REGEX)
+				if(regex->ext.query_type != 0 && config.debug & DEBUG_REGEX)
 				{
 					logg("    Hint: This regex matches only specific query types:");
 					for(int i = TYPE_A; i < TYPE_MAX; i++)
 					{
-						if(regex[index].ext.query_type & (1 << i))
+						if(regex->ext.query_type & (1 << i))
 							logg("      - %s", querytypes[i]);
 					}
 				}
@@ -232,7 +264,7 @@ static bool compile_regex(const char *regexin, const enum regex_type regexid, co
 			// option: ";invert"
 			else if(strcasecmp(part, "invert") == 0)
 			{
-				regex[index].ext.inverted = true;
+				regex->ext.inverted = true;
 
 				// Debug output
 				if(config.debug & DEBUG_REGEX)
@@ -248,59 +280,59 @@ static bool compile_regex(const char *regexin, const enum regex_type regexid, co
 				if(strcasecmp(extra, "NODATA") == 0)
 				{
 					type = "NODATA";
-					regex[index].ext.reply = REPLY_NODATA;
+					regex->ext.reply = REPLY_NODATA;
 				}
 				else if(strcasecmp(extra, "NXDOMAIN") == 0)
 				{
 					type = "NXDOMAIN";
-					regex[index].ext.reply = REPLY_NXDOMAIN;
+					regex->ext.reply = REPLY_NXDOMAIN;
 				}
 				else if(strcasecmp(extra, "REFUSED") == 0)
 				{
 					type = "REFUSED";
-					regex[index].ext.reply = REPLY_REFUSED;
+					regex->ext.reply = REPLY_REFUSED;
 				}
 				else if(strcasecmp(extra, "IP") == 0)
 				{
 					type = "IP";
-					regex[index].ext.reply = REPLY_IP;
+					regex->ext.reply = REPLY_IP;
 				}
-				else if(inet_pton(AF_INET, extra, &regex[index].ext.addr4) == 1)
+				else if(inet_pton(AF_INET, extra, &regex->ext.addr4) == 1)
 				{
 					// Custom IPv4 target
 					type = extra;
-					regex[index].ext.reply = REPLY_IP;
-					regex[index].ext.custom_ip4 = true;
+					regex->ext.reply = REPLY_IP;
+					regex->ext.custom_ip4 = true;
 				}
-				else if(inet_pton(AF_INET6, extra, &regex[index].ext.addr6) == 1)
+				else if(inet_pton(AF_INET6, extra, &regex->ext.addr6) == 1)
 				{
 					// Custom IPv6 target
 					type = extra;
-					regex[index].ext.reply = REPLY_IP;
-					regex[index].ext.custom_ip6 = true;
+					regex->ext.reply = REPLY_IP;
+					regex->ext.custom_ip6 = true;
 				}
 				else if(strcasecmp(extra, "NONE") == 0)
 				{
 					type = "NONE";
-					regex[index].ext.reply = REPLY_NONE;
+					regex->ext.reply = REPLY_NONE;
 				}
 				else
 				{
 					char msg[64] = { 0 };
 					snprintf(msg, sizeof(msg)-1, "Unknown reply type \"%s\"", extra);
-					logg_regex_warning(regextype[regexid], msg, dbidx, regexin);
+					regex_warning(regexid, msg, dbidx, regexin);
 				}
 
 				// Debug output
-				if(config.debug & DEBUG_REGEX && regex[index].ext.reply != REPLY_UNKNOWN)
+				if(config.debug & DEBUG_REGEX && regex->ext.reply != REPLY_UNKNOWN)
 					logg("   This regex will result in a custom reply: %s", type);
 			}
 			else
 			{
 				char hint[40 + strlen(part)];
 				snprintf(hint, sizeof(hint)-1, "Option \"%s\" not known, ignoring it.", part);
-				logg_regex_warning(regextype[regexid], hint,
-				                   dbidx, regexin);
+				regex_warning(regexid, hint,
+				              dbidx, regexin);
 			}
 		}
 		free(buf);
@@ -313,28 +345,125 @@ static bool compile_regex(const char *regexin, const enum regex_type regexid, co
 
 	// We use the extended RegEx flavor (ERE) and specify that matching should
 	// always be case INsensitive
-	const int errcode = regcomp(&regex[index].regex, rgxbuf, REG_EXTENDED | REG_ICASE | REG_NOSUB);
+	const int errcode = regcomp(&regex->regex, rgxbuf, REG_EXTENDED | REG_ICASE | REG_NOSUB);
 	if(errcode != 0)
 	{
 		// Get error string and log it
-		const size_t length = regerror(errcode, &regex[index].regex, NULL, 0);
+		const size_t length = regerror(errcode, &regex->regex, NULL, 0);
 		char *buffer = calloc(length, sizeof(char));
-		(void) regerror (errcode, &regex[index].regex, buffer, length);
-		logg_regex_warning(regextype[regexid], buffer, dbidx, regexin);
+		(void) regerror (errcode, &regex->regex, buffer, length);
+		regex_warning(regexid, buffer, dbidx, regexin);
 		free(buffer);
-		regex[index].available = false;
+		regex->available = false;
 		return false;
 	}
 
 	// Store compiled regex string in buffer
-	regex[index].string = strdup(regexin);
-	regex[index].available = true;
+	regex->string = strdup(regexin);
+	regex->available = true;
+
+	// Extract required literals for the prefilter
+	bool suffix = false;
+	regex->literals = regex_prefilter_literals(rgxbuf, &suffix);
+	regex->suffix = suffix;
+	if(config.debug & DEBUG_REGEX)
+	{
+		if(suffix)
+			logg("   Suffix regex: \"%s\" and all its subdomains", regex->literals[0]);
+		else if(regex->literals != NULL)
+			for(char **literal = regex->literals; *literal != NULL; literal++)
+				logg("   Prefilter literal: \"%s\"", *literal);
+		else
+			logg("   No prefilter literal, this regex is always executed");
+	}
 
 	return true;
 }
 
-static int match_regex(const char *input, DNSCacheData* dns_cache, const int clientID,
-                       const enum regex_type regexid, const bool regextest)
+static bool compile_regex(const char *regexin, const enum regex_type regexid, const int dbidx)
+{
+	regexData *regex = get_regex_ptr(regexid);
+	const unsigned int index = num_regex[regexid]++;
+
+	return compile_regex_entry(&regex[index], regexin, regexid, dbidx);
+}
+
+// Accumulate the cost of executing a regex and warn once if its average cost
+// exceeds the configured threshold
+static void account_regex(regexData *regex, const enum regex_type regexid,
+                          const bool matched, const long long nsec)
+{
+	regex->stats.calls++;
+	if(matched)
+		regex->stats.matches++;
+	if(nsec > 0)
+		regex->stats.nsec += nsec;
+
+	if(regex->slow || config.regex_slow_threshold == 0 ||
+	   regex->stats.calls < REGEX_SLOW_MIN_CALLS)
+		return;
+
+	const double avg_usec = 1e-3 * regex->stats.nsec / regex->stats.calls;
+	if(avg_usec <= config.regex_slow_threshold)
+		return;
+
+	regex->slow = true;
+	char msg[96] = { 0 };
+	snprintf(msg, sizeof(msg)-1, "Slow regex: %.1f usec per execution on average (%u executions)",
+	         avg_usec, regex->stats.calls);
+	logg_regex_warning(regextype[regexid], msg, regex->database_id, regex->string);
+}
+
+// Iterate over the regex of one type enabled for a client, see
+// get_per_client_regex() for the layout of the per-client bitset
+struct enabled_regex {
+	const uint64_t *row;   // NULL: all regex are enabled
+	unsigned int words;    // length of row
+	unsigned int base;     // bit of the first regex of this type
+	unsigned int num;      // number of regex of this type
+	unsigned int next;     // index of the next block of 64 regex
+	uint64_t bits;         // remaining regex of the current block
+};
+
+// Get the enablement bits of the regex start ... start + 63 of this type
+static uint64_t enabled_block(const struct enabled_regex *it, const unsigned int start)
+{
+	const unsigned int left = it->num - start;
+	const uint64_t mask = left >= 64u ? ~0ULL : (1ULL << left) - 1u;
+	if(it->row == NULL)
+		return mask;
+
+	// Blocks are not aligned to the words of the row in general
+	const unsigned int pos = it->base + start;
+	const unsigned int word = pos / 64u, shift = pos % 64u;
+	uint64_t bits = it->row[word] >> shift;
+	if(shift > 0u && word + 1u < it->words)
+		bits |= it->row[word + 1u] << (64u - shift);
+	return bits & mask;
+}
+
+// Get the next enabled regex, returns false when there are no more
+static bool next_enabled_regex(struct enabled_regex *it, unsigned int *index)
+{
+	while(it->bits == 0u)
+	{
+		if(64u*it->next >= it->num)
+			return false;
+		it->bits = enabled_block(it, 64u*it->next);
+		it->next++;
+	}
+	*index = 64u*(it->next - 1u) + (unsigned int)__builtin_ctzll(it->bits);
+	// Clear lowest set bit
+	it->bits &= it->bits - 1u;
+	return true;
+}
+
+// The matching loop is compiled twice from the same source: with debug set,
+// it logs the outcome of every regex, without it all logging is removed by the
+// compiler. match_regex() selects the variant once per call
+static inline __attribute__((always_inline))
+int match_regex_body(const char *input, DNSCacheData* dns_cache, const int clientID,
+                     const enum regex_type regexid, const bool regextest, const bool debug)
 {
 	int match_idx = -1;
 	regexData *regex = get_regex_ptr(regexid);
@@ -348,19 +477,57 @@ static int match_regex(const char *input, DNSCacheData* dns_cache, const int cli
 	if(regex_change != counters->regex_change)
 	{
 		logg("Reloading externally changed regular expressions");
-		read_regex_from_database();
+		load_regex_from_database();
+		regex_change = counters->regex_change;
 		// Update regex pointer as it will have changed (free_regex has
 		// been called)
 		regex = get_regex_ptr(regexid);
 	}
 
-	// Loop over all configured regex filters of this type
-	for(unsigned int index = 0; index < num_regex[regexid]; index++)
+	// Determine in a single pass which regex can possibly match
+	const regex_prefilter *pf = prefilter[regexid];
+	uint64_t candidates[REGEX_PREFILTER_WORDS(num_regex[regexid])];
+	if(pf != NULL)
+		regex_prefilter_scan(pf, input, candidates);
+
+	// Regular expressions of all types are stored in one bitset per client
+	struct enabled_regex it = { NULL, 0u, 0u, num_regex[regexid], 0u, 0u };
+	if(regexid == REGEX_WHITELIST)
+		it.base = num_regex[REGEX_BLACKLIST];
+	else if(regexid == REGEX_CLI)
+		it.base = num_regex[REGEX_BLACKLIST] + num_regex[REGEX_WHITELIST];
+
+	// Only use regular expressions enabled for this client
+	// We allow clientID = -1 to get all regex (for testing)
+	if(clientID >= 0)
+	{
+		it.row = get_per_client_regex(clientID);
+		it.words = per_client_regex_words();
+		if(it.row == NULL)
+			it.num = 0u;
+
+		if(debug && debug_enabled(DEBUG_REGEX))
+		{
+			unsigned int enabled = 0u;
+			for(unsigned int start = 0u; start < it.num; start += 64u)
+				enabled += __builtin_popcountll(enabled_block(&it, start));
+			clientsData* client = getClient(clientID, true);
+			if(client != NULL)
+				logg("Regex %s: %u of %u regex enabled for client %s",
+				     regextype[regexid], enabled, num_regex[regexid],
+				     getstr(client->ippos));
+		}
+	}
+
+	// Loop over all configured regex filters of this type enabled for this
+	// client
+	unsigned int index;
+	while(next_enabled_regex(&it, &index))
 	{
 		// Only check regex which have been successfully compiled ...
 		if(!regex[index].available)
 		{
-			if(config.debug & DEBUG_REGEX)
+			if(debug && debug_enabled(DEBUG_REGEX))
 			{
 				logg("Regex %s (%u, DB ID %d) \"%s\" is NOT AVAILABLE",
 				     regextype[regexid], index, regex[index].database_id,
@@ -368,39 +535,44 @@ static int match_regex(const char *input, DNSCacheData* dns_cache, const int cli
 			}
 			continue;
 		}
-		// ... and are enabled for this client
-		int regexID = index;
-		if(regexid == REGEX_WHITELIST)
-			regexID += num_regex[REGEX_BLACKLIST];
-		else if(regexid == REGEX_CLI)
-			regexID += num_regex[REGEX_BLACKLIST] +
-			           num_regex[REGEX_WHITELIST];
-
-		// Only use regular expressions enabled for this client
-		// We allow clientID = -1 to get all regex (for testing)
-		if(clientID >= 0 && !get_per_client_regex(clientID, regexID))
+		// Skip regex which cannot match as their literal is not
+		// contained in the input
+		const bool candidate = pf != NULL && (candidates[index / 64] & (1ULL << (index % 64)));
+		if(pf != NULL && !candidate && !regex[index].suffix)
 		{
-			if(config.debug & DEBUG_REGEX)
+			if(debug && debug_enabled(DEBUG_REGEX))
 			{
-				clientsData* client = getClient(clientID, true);
-				if(client != NULL)
-				{
-					logg("Regex %s (%u, DB ID %d) \"%s\" NOT ENABLED for client %s",
-					     regextype[regexid], index, regex[index].database_id,
-					     regex[index].string, getstr(client->ippos));
-				}
+				logg("Regex %s (%u, DB ID %i) NO match: \"%s\" vs. \"%s\""
+				     " (skipped by prefilter)",
+				     regextype[regexid], index, regex[index].database_id,
+				     input, regex[index].string);
 			}
 			continue;
 		}
 
 		// Try to match the compiled regular expression against input
-		if(config.debug & DEBUG_REGEX)
+		if(debug && debug_enabled(DEBUG_REGEX))
 			logg("Executing: index = %d, preg = %p, str = \"%s\", pmatch = %p", index, &regex[index].regex, input, &match);
+		int retval;
+		if(pf != NULL && regex[index].suffix)
+		{
+			// Suffix regex have already been matched by the prefilter
+			retval = candidate ? REG_OK : REG_NOMATCH;
+		}
+		else
+		{
+			struct timespec start, end;
+			clock_gettime(CLOCK_MONOTONIC, &start);
 #ifdef USE_TRE_REGEX
-		int retval = tre_regexec(&regex[index].regex, input, 0, match, 0);
+			retval = tre_regexec(&regex[index].regex, input, 0, match, 0);
 #else
-		int retval = regexec(&regex[index].regex, input, 0, NULL, 0);
+			retval = regexec(&regex[index].regex, input, 0, NULL, 0);
 #endif
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			account_regex(&regex[index], regexid, retval == REG_OK,
+			              (end.tv_sec - start.tv_sec) * 1000000000LL +
+			              (end.tv_nsec - start.tv_nsec));
+		}
 		// regexec() returns REG_OK for a successful match or REG_NOMATCH for failure.
 		if ((retval == REG_OK && !regex[index].ext.inverted) ||
 		    (retval == REG_NOMATCH && regex[index].ext.inverted))
@@ -413,7 +585,7 @@ static int match_regex(const char *input, DNSCacheData* dns_cache, const int cli
 				{
 					if(!(regex[index].ext.query_type & (1 << dns_cache->query_type)))
 					{
-						if(config.debug & DEBUG_REGEX)
+						if(debug && debug_enabled(DEBUG_REGEX))
 						{
 							logg("Regex %s (%u, DB ID %i) NO match: \"%s\" vs. \"%s\""
 								" (skipped because of query type mismatch)",
@@ -432,7 +604,7 @@ static int match_regex(const char *input, DNSCacheData* dns_cache, const int cli
 			match_idx = regex[index].database_id;
 
 			// Print match message when in regex debug mode
-			if(config.debug & DEBUG_REGEX)
+			if(debug && debug_enabled(DEBUG_REGEX))
 			{
 				// Approximate regex matching mode
 				logg("Regex %s (%u, DB ID %i) >> MATCH: \"%s\" vs. \"%s\"",
@@ -496,7 +668,7 @@ static int match_regex(const char *input, DNSCacheData* dns_cache, const int cli
 		}
 
 		// Print no match message when in regex debug mode
-		if(config.debug & DEBUG_REGEX && match_idx == -1)
+		if(debug && match_idx == -1 && debug_enabled(DEBUG_REGEX))
 		{
 			logg("Regex %s (%u, DB ID %i) NO match: \"%s\" vs. \"%s\"",
 			     regextype[regexid], index, regex[index].database_id,
@@ -508,6 +680,27 @@ static int match_regex(const char *input, DNSCacheData* dns_cache, const int cli
 	return match_idx;
 }
 
+static int match_regex_lean(const char *input, DNSCacheData* dns_cache, const int clientID,
+                            const enum regex_type regexid, const bool regextest)
+{
+	return match_regex_body(input, dns_cache, clientID, regexid, regextest, false);
+}
+
+static int match_regex_debug(const char *input, DNSCacheData* dns_cache, const int clientID,
+                             const enum regex_type regexid, const bool regextest)
+{
+	return match_regex_body(input, dns_cache, clientID, regexid, regextest, true);
+}
+
+static int match_regex(const char *input, DNSCacheData* dns_cache, const int clientID,
+                       const enum regex_type regexid, const bool regextest)
+{
+	if(config.debug & DEBUG_REGEX)
+		return match_regex_debug(input, dns_cache, clientID, regexid, regextest);
+	else
+		return match_regex_lean(input, dns_cache, clientID, regexid, regextest);
+}
+
 bool in_regex(const char *domain, DNSCacheData *dns_cache, const int clientID, const enum regex_type regexid)
 {
 	// For performance reasons, the regex evaluations is executed only if the
@@ -526,6 +719,61 @@ bool in_regex(const char *domain, DNSCacheData *dns_cache, const int clientID, c
 	return false;
 }
 
+// Free all regex of one type
+static void free_regex_type(const enum regex_type regexid)
+{
+	regexData *regex = get_regex_ptr(regexid);
+
+	// Reset counter for number of regex
+	const unsigned int oldcount = num_regex[regexid];
+	num_regex[regexid] = 0;
+
+	// Free prefilter of this regex type
+	regex_prefilter_free(&prefilter[regexid]);
+
+	// Exit early if the regex has already been freed (or has never been used)
+	if(regex == NULL)
+		return;
+
+	if(config.debug & DEBUG_DATABASE)
+	{
+		logg("Going to free %i entries in %s regex struct",
+		     oldcount, regextype[regexid]);
+	}
+
+	// Loop over entries with this regex type
+	for(unsigned int index = 0; index < oldcount; index++)
+	{
+		if(!regex[index].available)
+			continue;
+
+		regfree(&regex[index].regex);
+
+		// Also free buffered regex strings
+		if(regex[index].string != NULL)
+		{
+			free(regex[index].string);
+			regex[index].string = NULL;
+		}
+		regex_prefilter_free_literals(&regex[index].literals);
+	}
+
+	if(config.debug & DEBUG_DATABASE)
+	{
+		logg("Loop done, freeing regex pointer (%p)", regex);
+	}
+
+	// Free the compiled regex in one go
+	for(unsigned int i = 0; i < REGEX_MAX_THREADS; i++)
+	{
+		tre_arena_free(arenas[regexid][i]);
+		arenas[regexid][i] = NULL;
+	}
+
+	// Free array with regex datastructure
+	free_regex_ptr(regexid);
+}
+
 static void free_regex(void)
 {
 	// Return early if we don't use any regex filters
@@ -549,47 +797,7 @@ static void free_regex(void)
 	// Free regex datastructure
 	// Loop over regex types
 	for(enum regex_type regexid = REGEX_BLACKLIST; regexid < REGEX_MAX; regexid++)
-	{
-		regexData *regex = get_regex_ptr(regexid);
-
-		// Reset counter for number of regex
-		const unsigned int oldcount = num_regex[regexid];
-		num_regex[regexid] = 0;
-
-		// Exit early if the regex has already been freed (or has never been used)
-		if(regex == NULL)
-			continue;
-
-		if(config.debug & DEBUG_DATABASE)
-		{
-			logg("Going to free %i entries in %s regex struct",
-			     oldcount, regextype[regexid]);
-		}
-
-		// Loop over entries with this regex type
-		for(unsigned int index = 0; index < oldcount; index++)
-		{
-			if(!regex[index].available)
-				continue;
-
-			regfree(&regex[index].regex);
-
-			// Also free buffered regex strings
-			if(regex[index].string != NULL)
-			{
-				free(regex[index].string);
-				regex[index].string = NULL;
-			}
-		}
-
-		if(config.debug & DEBUG_DATABASE)
-		{
-			logg("Loop done, freeing regex pointer (%p)", regex);
-		}
-
-		// Free array with regex datastructure
-		free_regex_ptr(regexid);
-	}
+		free_regex_type(regexid);
 }
 
 // This function does three things:
@@ -617,6 +825,95 @@ void reload_per_client_regex(clientsData *client)
 		                                  "vw_regex_whitelist");
 }
 
+// Compile the regex of one table using several threads
+typedef struct {
+	regexData *regex;
+	char **patterns;
+	int *rowids;
+	unsigned int count;
+	unsigned int next;
+	unsigned int threads;
+	enum regex_type regexid;
+} regexCompileJob;
+
+static void compile_regex_job(regexCompileJob *job)
+{
+	// Every thread compiles into an arena of its own
+	tre_arena_t *arena = NULL;
+	if(config.regex_arena)
+	{
+		const unsigned int thread = __atomic_fetch_add(&job->threads, 1u, __ATOMIC_RELAXED);
+		arena = arenas[job->regexid][thread] = tre_arena_new();
+		tre_arena_use(arena);
+	}
+
+	// Every thread takes the next regex not yet taken by any other thread
+	unsigned int index;
+	while((index = __atomic_fetch_add(&job->next, 1u, __ATOMIC_RELAXED)) < job->count)
+	{
+		if(config.debug & DEBUG_REGEX)
+		{
+			logg("Compiling %s regex %u (DB ID %i): %s",
+			     regextype[job->regexid], index, job->rowids[index], job->patterns[index]);
+		}
+
+		compile_regex_entry(&job->regex[index], job->patterns[index],
+		                    job->regexid, job->rowids[index]);
+		job->regex[index].database_id = job->rowids[index];
+	}
+
+	if(arena != NULL)
+		tre_arena_use(NULL);
+}
+
+static void *compile_regex_thread(void *arg)
+{
+	compile_regex_job(arg);
+	return NULL;
+}
+
+static void compile_regex_parallel(regexCompileJob *job)
+{
+	// Use one thread per REGEX_PER_THREAD regex, limited by the number of
+	// available processors. The calling thread is one of them
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads > REGEX_MAX_THREADS)
+		threads = REGEX_MAX_THREADS;
+	if(threads > job->count / REGEX_PER_THREAD)
+		threads = job->count / REGEX_PER_THREAD;
+
+	pthread_t tid[REGEX_MAX_THREADS];
+	long started = 0;
+	for(long i = 1; i < threads; i++)
+	{
+		if(pthread_create(&tid[started], NULL, compile_regex_thread, job) != 0)
+		{
+			logg("WARN: Cannot start regex compilation thread: %s", strerror(errno));
+			break;
+		}
+		started++;
+	}
+
+	compile_regex_job(job);
+
+	for(long i = 0; i < started; i++)
+		pthread_join(tid[i], NULL);
+
+	if(config.debug & DEBUG_REGEX)
+	{
+		size_t used = 0u, allocated = 0u;
+		for(unsigned int i = 0; i < REGEX_MAX_THREADS; i++)
+		{
+			size_t u = 0u, a = 0u;
+			tre_arena_size(arenas[job->regexid][i], &u, &a);
+			used += u;
+			allocated += a;
+		}
+		logg("Compiled %u %s regex using %li threads (arenas: %zu of %zu bytes used)",
+		     job->count, regextype[job->regexid], started + 1, used, allocated);
+	}
+}
+
 static void read_regex_table(const enum regex_type regexid)
 {
 	// Get table ID
@@ -639,19 +936,6 @@ static void read_regex_table(const enum regex_type regexid)
 		return;
 	}
 
-	// Allocate memory for regex
-	regexData *regex = NULL;
-	if(regexid == REGEX_BLACKLIST)
-	{
-		black_regex = calloc(count, sizeof(regexData));
-		regex = black_regex;
-	}
-	else
-	{
-		white_regex = calloc(count, sizeof(regexData));
-		regex = white_regex;
-	}
-
 	// Connect to regex table
 	if(!gravityDB_getTable(tableID))
 	{
@@ -660,6 +944,23 @@ static void read_regex_table(const enum regex_type regexid)
 		return;
 	}
 
+	// Read all regex before compiling them. The database is only accessed
+	// by this thread
+	regexCompileJob job = { .regexid = regexid };
+	job.patterns = calloc(count, sizeof(char*));
+	job.rowids = calloc(count, sizeof(int));
+	job.regex = calloc(count, sizeof(regexData));
+	if(job.patterns == NULL || job.rowids == NULL || job.regex == NULL)
+	{
+		logg("read_regex_from_database(): Memory allocation failed for %d %s regex",
+		     count, regextype[regexid]);
+		gravityDB_finalizeTable();
+		free(job.patterns);
+		free(job.rowids);
+		free(job.regex);
+		return;
+	}
+
 	// Walk database table
 	const char *domain = NULL;
 	int rowid = 0;
@@ -667,10 +968,10 @@ static void read_regex_table(const enum regex_type regexid)
 	{
 		// Avoid buffer overflow if database table changed
 		// since we counted its entries
-		if(num_regex[regexid] >= (unsigned int)count)
+		if(job.count >= (unsigned int)count)
 		{
 			logg("INFO: read_regex_table(%s) exiting early to avoid overflow (%d/%d).",
-			     regextype[regexid], num_regex[regexid], count);
+			     regextype[regexid], job.count, count);
 			break;
 		}
 
@@ -683,23 +984,33 @@ static void read_regex_table(const enum regex_type regexid)
 		if(strlen(domain) < 1)
 			continue;
 
-		// Compile this regex
-		if(config.debug & DEBUG_REGEX)
-		{
-			logg("Compiling %s regex %i (DB ID %i): %s",
-			     regextype[regexid], num_regex[regexid], rowid, domain);
-		}
-
-		compile_regex(domain, regexid, rowid);
-		regex[num_regex[regexid]-1].database_id = rowid;
-
-		// Signal other forks that the regex data has changed and should be updated
-		regex_change = ++counters->regex_change;
+		job.patterns[job.count] = strdup(domain);
+		job.rowids[job.count] = rowid;
+		job.count++;
 	}
 
 	// Finalize statement and close gravity database handle
 	gravityDB_finalizeTable();
 
+	// Compile all regex into the new array
+	compile_regex_parallel(&job);
+
+	for(unsigned int i = 0; i < job.count; i++)
+		free(job.patterns[i]);
+	free(job.patterns);
+	free(job.rowids);
+
+	// Install the new array
+	if(regexid == REGEX_BLACKLIST)
+		black_regex = job.regex;
+	else
+		white_regex = job.regex;
+	num_regex[regexid] = job.count;
+
+	// Compile the literals of all regex of this type into the prefilter
+	if(config.regex_prefilter)
+		prefilter[regexid] = regex_prefilter_build(job.regex, num_regex[regexid]);
+
 	if(config.debug & DEBUG_DATABASE)
 	{
 		logg("Read %i %s regex entries",
@@ -708,7 +1019,52 @@ static void read_regex_table(const enum regex_type regexid)
 	}
 }
 
-void read_regex_from_database(void)
+// Loop over all clients and ensure we have enough space and load per-client
+// regex data, not all of the regex read and compiled will also be used by all
+// clients
+static void reload_all_per_client_regex(void)
+{
+	if(config.debug & DEBUG_DATABASE)
+		logg("Loading per-client regex data");
+	for(int clientID = 0; clientID < counters->clients; clientID++)
+	{
+		// Get client pointer
+		clientsData *client = getClient(clientID, true);
+		// Skip invalid and alias-clients
+		if(client == NULL || client->flags.aliasclient)
+			continue;
+
+		// Clients with the same groups have the same regex enabled, copy
+		// the row of the first such client loaded in this pass instead
+		// of querying the database again
+		int sourceID = -1;
+		if(client->flags.found_group)
+		{
+			for(int i = 0; i < clientID; i++)
+			{
+				const clientsData *other = getClient(i, true);
+				if(other != NULL && !other->flags.aliasclient &&
+				   other->flags.found_group &&
+				   (other->groupspos == client->groupspos ||
+				    strcmp(getstr(other->groupspos), getstr(client->groupspos)) == 0))
+				{
+					sourceID = i;
+					break;
+				}
+			}
+		}
+
+		if(sourceID > -1)
+		{
+			add_per_client_regex(clientID);
+			copy_per_client_regex(clientID, sourceID);
+		}
+		else
+			reload_per_client_regex(client);
+	}
+}
+
+static void load_regex_from_database(void)
 {
 	// Free regex filters
 	// This routine is safe to be called even when there
@@ -724,32 +1080,72 @@ void read_regex_from_database(void)
 	// Read and compile regex whitelist
 	read_regex_table(REGEX_WHITELIST);
 
-	// Loop over all clients and ensure we have enough space and load
-	// per-client regex data, not all of the regex read and compiled above
-	// will also be used by all clients
-	if(config.debug & DEBUG_DATABASE)
-		logg("Loading per-client regex data");
-	for(int clientID = 0; clientID < counters->clients; clientID++)
+	// Load per-client regex data
+	reload_all_per_client_regex();
+
+	// Print message to FTL's log after reloading regex filters
+	logg("Compiled %i whitelist and %i blacklist regex filters for %i clients in %.1f msec",
+	     num_regex[REGEX_WHITELIST], num_regex[REGEX_BLACKLIST],
+	     counters->clients, timer_stop(REGEX_TIMER));
+}
+
+void read_regex_from_database(void)
+{
+	load_regex_from_database();
+
+	// Signal other forks that the regex data has changed and should be updated
+	regex_change = ++counters->regex_change;
+}
+
+// Read and compile the regex of both types without loading the per-client
+// regex data. Used during startup before the clients have been imported
+void preload_regex_from_database(void)
+{
+	read_regex_table(REGEX_BLACKLIST);
+	read_regex_table(REGEX_WHITELIST);
+	logg("Compiled %i whitelist and %i blacklist regex filters",
+	     num_regex[REGEX_WHITELIST], num_regex[REGEX_BLACKLIST]);
+}
+
+// Recompile only the regex types whose rows have changed in the database. The
+// per-client regex data is always reloaded as the group assignments or the
+// index of the whitelist regex may have changed
+void update_regex_from_database(const bool blacklist, const bool whitelist)
+{
+	// Start timer for regex compilation analysis
+	timer_start(REGEX_TIMER);
+
+	if(blacklist)
 	{
-		// Get client pointer
-		clientsData *client = getClient(clientID, true);
-		// Skip invalid and alias-clients
-		if(client == NULL || client->flags.aliasclient)
-			continue;
+		free_regex_type(REGEX_BLACKLIST);
+		read_regex_table(REGEX_BLACKLIST);
+	}
 
-		reload_per_client_regex(client);
+	if(whitelist)
+	{
+		free_regex_type(REGEX_WHITELIST);
+		read_regex_table(REGEX_WHITELIST);
 	}
 
+	// Load per-client regex data
+	reload_all_per_client_regex();
+
+	// Signal other forks that the regex data has changed and should be updated
+	if(blacklist || whitelist)
+		regex_change = ++counters->regex_change;
+
 	// Print message to FTL's log after reloading regex filters
-	logg("Compiled %i whitelist and %i blacklist regex filters for %i clients in %.1f msec",
-	     num_regex[REGEX_WHITELIST], num_regex[REGEX_BLACKLIST],
-	     counters->clients, timer_elapsed_msec(REGEX_TIMER));
+	logg("%s %i whitelist and %s %i blacklist regex filters for %i clients in %.1f msec",
+	     whitelist ? "Compiled" : "Kept", num_regex[REGEX_WHITELIST],
+	     blacklist ? "compiled" : "kept", num_regex[REGEX_BLACKLIST],
+	     counters->clients, timer_stop(REGEX_TIMER));
 }
 
 int regex_test(const bool debug_mode, const bool quiet, const char *domainin, const char *regexin)
 {
 	// Prepare counters and regex memories
 	counters = calloc(1, sizeof(countersStruct));
+	query_counters = calloc(1, sizeof(queryCountersStruct));
 	// Disable terminal output during config config file parsing
 	log_ctrl(false, false);
 	// Process pihole-FTL.conf to get gravity.db
@@ -848,7 +1244,7 @@ bool regex_get_redirect(const int dbID, struct in_addr *addr4, struct in6_addr *
 	// Get internal regex ID from database regex ID
 	const int regexID = regex_id_from_database_id(dbID);
 
-	if(config.debug & DEBUG_REGEX)
+	if(debug_enabled(DEBUG_REGEX))
 		logg("Regex: %d (database) -> %d (internal)", dbID, regexID);
 
 	// Check internal regex ID for validity, return early if negative
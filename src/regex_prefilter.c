@@ -0,0 +1,637 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Regex literal prefilter
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+// public prototypes
+#include "regex_prefilter.h"
+// logg()
+#include "log.h"
+// struct config
+#include "config.h"
+
+// Most regex filters contain a literal every matching domain has to contain,
+// e.g. "doubleclick" in "(^|\.)doubleclick\.(com|net)$". The literals of all
+// regex of one type are compiled into a single Aho-Corasick automaton which
+// determines in one pass over the domain which regex can possibly match. Only
+// these candidates have to be executed. Regex without such a literal (and
+// inverted regex) are always candidates.
+//
+// Regex of the form (^|\.)example\.com$ (a domain and all its subdomains) are
+// not executed at all. Their domains are stored in a hash table which is
+// probed for every parent domain of the input in a single right-to-left walk
+struct regex_prefilter {
+	// Map of (lowercase) input characters to automaton input classes. Class 0
+	// is used for all characters not appearing in any literal
+	unsigned char classes[256];
+	unsigned int num_classes;
+	// Transition table with num_nodes * num_classes entries, node 0 is root
+	int32_t *next;
+	unsigned int num_nodes;
+	// Next node with an output on the failure path (0 = none)
+	int32_t *dict;
+	// First output whose literal ends in this node (-1 = none). Outputs are
+	// the regex index and the next output ending in the same node
+	int32_t *first;
+	int32_t *out_regex;
+	int32_t *out_next;
+	// Bitmap of regex which are always candidates
+	uint64_t *always;
+	unsigned int num;
+	// Open addressing hash table of suffix regex domains (size is a power of
+	// two). Each slot holds the first suffix output (-1 = empty slot)
+	uint64_t *sfx_hash;
+	int32_t *sfx_first;
+	size_t sfx_size;
+	// Suffix outputs: regex index, domain and next regex with the same domain
+	int32_t *sfx_regex;
+	const char **sfx_domain;
+	int32_t *sfx_next;
+	unsigned int sfx_count;
+};
+
+// Hash of a domain suffix, computed from right to left
+#define SUFFIX_HASH_BASIS 14695981039346656037ULL
+static inline uint64_t __attribute__((const)) suffix_hash_step(const uint64_t hash, const unsigned char c)
+{
+	return (hash ^ tolower(c)) * 1099511628211ULL;
+}
+
+static uint64_t __attribute__((pure)) suffix_hash(const char *domain)
+{
+	uint64_t hash = SUFFIX_HASH_BASIS;
+	for(size_t i = strlen(domain); i > 0; i--)
+		hash = suffix_hash_step(hash, domain[i-1]);
+	return hash;
+}
+
+// Detect regex of the form (^|\.)example\.com$ matching a domain and all its
+// subdomains. Returns the domain in lowercase or NULL
+static char *parse_suffix(const char *pattern)
+{
+	const char *p;
+	if(strncmp(pattern, "(^|\\.)", 6) == 0 || strncmp(pattern, "(\\.|^)", 6) == 0)
+		p = pattern + 6;
+	else
+		return NULL;
+
+	const size_t len = strlen(p);
+	if(len < 2 || p[len-1] != '$')
+		return NULL;
+
+	char domain[len];
+	size_t n = 0u;
+	for(size_t i = 0; i < len - 1; i++)
+	{
+		if(p[i] == '\\' && p[i+1] == '.')
+		{
+			// Labels may neither be empty nor start the domain
+			if(n == 0 || domain[n-1] == '.')
+				return NULL;
+			domain[n++] = '.';
+			i++;
+		}
+		else if(isalnum((unsigned char)p[i]) || p[i] == '-' || p[i] == '_')
+			domain[n++] = tolower((unsigned char)p[i]);
+		else
+			return NULL;
+	}
+
+	if(n == 0 || domain[n-1] == '.')
+		return NULL;
+
+	return strndup(domain, n);
+}
+
+
+// Skip a bracket expression starting at pattern[i] = '['. Returns the index
+// after the closing bracket or 0 if the bracket expression is not terminated
+static size_t __attribute__((pure)) skip_bracket(const char *pattern, const size_t len, size_t i)
+{
+	i++;
+	if(i < len && pattern[i] == '^')
+		i++;
+	// A closing bracket at the beginning is part of the list
+	if(i < len && pattern[i] == ']')
+		i++;
+	while(i < len)
+	{
+		// Character classes, collating symbols and equivalence classes
+		if(pattern[i] == '[' && i + 1 < len &&
+		   (pattern[i+1] == ':' || pattern[i+1] == '.' || pattern[i+1] == '='))
+		{
+			const char *end = strchr(pattern + i + 2, pattern[i+1]);
+			if(end == NULL || end[1] != ']')
+				return 0;
+			i = end - pattern + 2;
+		}
+		else if(pattern[i] == ']')
+			return i + 1;
+		else
+			i++;
+	}
+	return 0;
+}
+
+// Skip a group starting at pattern[i] = '('. Returns the index after the
+// closing parenthesis or 0 if the group is not terminated
+static size_t __attribute__((pure)) skip_group(const char *pattern, const size_t len, size_t i)
+{
+	unsigned int depth = 0;
+	while(i < len)
+	{
+		if(pattern[i] == '\\')
+			i += 2;
+		else if(pattern[i] == '[')
+		{
+			if((i = skip_bracket(pattern, len, i)) == 0)
+				return 0;
+		}
+		else if(pattern[i] == '(')
+		{
+			depth++;
+			i++;
+		}
+		else if(pattern[i] == ')')
+		{
+			i++;
+			if(--depth == 0)
+				return i;
+		}
+		else
+			i++;
+	}
+	return 0;
+}
+
+// Set of literals of which (at least) one has to be contained in every string
+// matched by a (part of a) regular expression
+typedef struct {
+	char *literal[REGEX_PREFILTER_MAX_LITERALS];
+	unsigned int num;
+	size_t minlen;
+} literal_set;
+
+static void free_literal_set(literal_set *set)
+{
+	for(unsigned int i = 0; i < set->num; i++)
+		free(set->literal[i]);
+	set->num = 0u;
+	set->minlen = 0u;
+}
+
+// Prefer sets with longer literals, then sets with fewer literals
+static bool __attribute__((pure)) better_literal_set(const literal_set *a, const literal_set *b)
+{
+	if(b->num == 0u)
+		return a->num > 0u;
+	return a->minlen > b->minlen || (a->minlen == b->minlen && a->num < b->num);
+}
+
+// Replace best by candidate if the candidate is better, free the other one
+static void keep_better_literal_set(literal_set *best, literal_set *candidate)
+{
+	if(better_literal_set(candidate, best))
+	{
+		free_literal_set(best);
+		*best = *candidate;
+	}
+	else
+		free_literal_set(candidate);
+	candidate->num = 0u;
+}
+
+static bool parse_alternation(const char *pattern, const size_t start, const size_t end, literal_set *set);
+
+// Get the best set of required literals of a sequence without top-level
+// alternation in pattern[start, end)
+static bool parse_sequence(const char *pattern, const size_t start, const size_t end, literal_set *best)
+{
+	char run[end - start + 1u];
+	size_t runlen = 0u;
+	literal_set candidate = { .num = 0u };
+	best->num = 0u;
+
+	for(size_t i = start; i <= end;)
+	{
+		const unsigned char c = i < end ? pattern[i] : '\0';
+		bool literal = false, quantifier = false;
+		unsigned char lit = c;
+		switch(c)
+		{
+			case '\0':
+				// End of sequence
+				i++;
+				break;
+			case '\\':
+				// Only escaped punctuation characters are
+				// literals, everything else (\w, \d, \b,
+				// back-references, ...) ends the literal
+				if(i + 1 >= end)
+					goto failure;
+				if(ispunct((unsigned char)pattern[i+1]))
+				{
+					literal = true;
+					lit = pattern[i+1];
+				}
+				i += 2;
+				break;
+			case '(':
+			{
+				// A group is required unless it is followed by
+				// a quantifier allowing it to be omitted
+				const size_t group = i;
+				if((i = skip_group(pattern, end, i)) == 0)
+					goto failure;
+				if(i < end && (pattern[i] == '*' || pattern[i] == '?' || pattern[i] == '{'))
+					break;
+				if(parse_alternation(pattern, group + 1, i - 1, &candidate))
+					keep_better_literal_set(best, &candidate);
+				break;
+			}
+			case '[':
+				if((i = skip_bracket(pattern, end, i)) == 0)
+					goto failure;
+				break;
+			case '{':
+			{
+				// Bound: the preceding character is optional
+				const char *close = memchr(pattern + i, '}', end - i);
+				if(close == NULL)
+					goto failure;
+				i = close - pattern + 1;
+				quantifier = true;
+				break;
+			}
+			case '*':
+			case '?':
+				// The preceding character is optional
+				quantifier = true;
+				i++;
+				break;
+			default:
+				// Plain (printable ASCII) characters are
+				// literals, '+' keeps the preceding character,
+				// anchors and '.' end the literal
+				literal = c < 0x80 && isprint(c) &&
+				          c != '.' && c != '^' && c != '$' &&
+				          c != '+' && c != ')';
+				i++;
+				break;
+		}
+
+		if(literal)
+		{
+			run[runlen++] = tolower(lit);
+			continue;
+		}
+
+		// Remove optional character from the current literal
+		if(quantifier && runlen > 0)
+			runlen--;
+
+		// Remember the best literal (set) found so far
+		if(runlen > 0)
+		{
+			candidate.literal[0] = strndup(run, runlen);
+			candidate.num = 1u;
+			candidate.minlen = runlen;
+			keep_better_literal_set(best, &candidate);
+		}
+		runlen = 0;
+	}
+
+	return best->num > 0u;
+
+failure:
+	free_literal_set(best);
+	return false;
+}
+
+// Get the set of required literals of pattern[start, end). Every branch of an
+// alternation has to contribute at least one literal
+static bool parse_alternation(const char *pattern, const size_t start, const size_t end, literal_set *set)
+{
+	set->num = 0u;
+	set->minlen = SIZE_MAX;
+	for(size_t i = start, branch = start; i <= end;)
+	{
+		if(i < end && pattern[i] == '\\')
+			i += 2;
+		else if(i < end && pattern[i] == '[')
+		{
+			if((i = skip_bracket(pattern, end, i)) == 0)
+				break;
+		}
+		else if(i < end && pattern[i] == '(')
+		{
+			if((i = skip_group(pattern, end, i)) == 0)
+				break;
+		}
+		else if(i == end || pattern[i] == '|')
+		{
+			literal_set branchset = { .num = 0u };
+			if(!parse_sequence(pattern, branch, i, &branchset))
+				break;
+			if(set->num + branchset.num > REGEX_PREFILTER_MAX_LITERALS)
+			{
+				free_literal_set(&branchset);
+				break;
+			}
+			memcpy(&set->literal[set->num], branchset.literal, branchset.num * sizeof(char*));
+			set->num += branchset.num;
+			if(branchset.minlen < set->minlen)
+				set->minlen = branchset.minlen;
+
+			// Done after the last branch
+			if(i == end)
+				return true;
+			branch = ++i;
+		}
+		else
+			i++;
+	}
+
+	free_literal_set(set);
+	return false;
+}
+
+// Extract the literals of which at least one is contained in every string
+// matched by this (extended, case insensitive) regular expression. The
+// literals are returned in lowercase as NULL-terminated array, NULL is returned
+// if no such literals could be determined. For suffix regex, the only literal
+// is the domain and suffix is set to true
+char **regex_prefilter_literals(const char *pattern, bool *suffix)
+{
+	*suffix = false;
+	char *domain = parse_suffix(pattern);
+	if(domain != NULL)
+	{
+		char **literals = calloc(2u, sizeof(char*));
+		if(literals == NULL)
+		{
+			free(domain);
+			return NULL;
+		}
+		literals[0] = domain;
+		*suffix = true;
+		return literals;
+	}
+
+	// Inline options such as (?~1) may change the meaning of everything
+	// following them
+	if(strstr(pattern, "(?") != NULL)
+		return NULL;
+
+	literal_set set = { .num = 0u };
+	if(!parse_alternation(pattern, 0u, strlen(pattern), &set))
+		return NULL;
+
+	char **literals = calloc(set.num + 1u, sizeof(char*));
+	if(literals == NULL)
+	{
+		free_literal_set(&set);
+		return NULL;
+	}
+	memcpy(literals, set.literal, set.num * sizeof(char*));
+	return literals;
+}
+
+void regex_prefilter_free_literals(char ***literals)
+{
+	if(*literals == NULL)
+		return;
+
+	for(char **literal = *literals; *literal != NULL; literal++)
+		free(*literal);
+	free(*literals);
+	*literals = NULL;
+}
+
+// Compile the literals of all available regex into one automaton
+regex_prefilter *regex_prefilter_build(const regexData *regex, const unsigned int num)
+{
+	regex_prefilter *prefilter = calloc(1, sizeof(regex_prefilter));
+	if(prefilter == NULL)
+		return NULL;
+	prefilter->num = num;
+
+	// Assign input classes to all characters used in literals
+	size_t max_nodes = 1u, max_outputs = 1u, suffixes = 0u;
+	prefilter->num_classes = 1u;
+	for(unsigned int index = 0; index < num; index++)
+	{
+		if(!regex[index].available || regex[index].literals == NULL)
+			continue;
+		if(regex[index].suffix)
+		{
+			suffixes++;
+			continue;
+		}
+		if(regex[index].ext.inverted)
+			continue;
+		for(char **literal = regex[index].literals; *literal != NULL; literal++, max_outputs++)
+			for(const unsigned char *p = (const unsigned char*)*literal; *p; p++, max_nodes++)
+				if(prefilter->classes[*p] == 0)
+					prefilter->classes[*p] = prefilter->num_classes++;
+	}
+
+	const unsigned int nc = prefilter->num_classes;
+	prefilter->next = malloc(max_nodes * nc * sizeof(int32_t));
+	prefilter->dict = calloc(max_nodes, sizeof(int32_t));
+	prefilter->first = malloc(max_nodes * sizeof(int32_t));
+	prefilter->out_regex = malloc(max_outputs * sizeof(int32_t));
+	prefilter->out_next = malloc(max_outputs * sizeof(int32_t));
+	prefilter->always = calloc(REGEX_PREFILTER_WORDS(num), sizeof(uint64_t));
+	prefilter->sfx_size = 2u;
+	while(prefilter->sfx_size < 2u * suffixes)
+		prefilter->sfx_size *= 2u;
+	prefilter->sfx_hash = calloc(prefilter->sfx_size, sizeof(uint64_t));
+	prefilter->sfx_first = malloc(prefilter->sfx_size * sizeof(int32_t));
+	prefilter->sfx_regex = malloc((suffixes + 1u) * sizeof(int32_t));
+	prefilter->sfx_domain = malloc((suffixes + 1u) * sizeof(char*));
+	prefilter->sfx_next = malloc((suffixes + 1u) * sizeof(int32_t));
+	int32_t *fail = calloc(max_nodes, sizeof(int32_t));
+	int32_t *queue = malloc(max_nodes * sizeof(int32_t));
+	if(prefilter->next == NULL || prefilter->dict == NULL || prefilter->first == NULL ||
+	   prefilter->out_regex == NULL || prefilter->out_next == NULL ||
+	   prefilter->always == NULL || prefilter->sfx_hash == NULL ||
+	   prefilter->sfx_first == NULL || prefilter->sfx_regex == NULL ||
+	   prefilter->sfx_domain == NULL || prefilter->sfx_next == NULL ||
+	   fail == NULL || queue == NULL)
+	{
+		logg("regex_prefilter_build(): Failed to allocate memory");
+		free(fail);
+		free(queue);
+		regex_prefilter_free(&prefilter);
+		return NULL;
+	}
+	memset(prefilter->next, -1, max_nodes * nc * sizeof(int32_t));
+	memset(prefilter->first, -1, max_nodes * sizeof(int32_t));
+	memset(prefilter->sfx_first, -1, prefilter->sfx_size * sizeof(int32_t));
+
+	// Insert literals into the trie and suffix domains into the hash table
+	unsigned int literals = 0u, outputs = 0u, sfx_outputs = 0u;
+	prefilter->num_nodes = 1u;
+	for(unsigned int index = 0; index < num; index++)
+	{
+		if(!regex[index].available)
+			continue;
+		if(regex[index].suffix && regex[index].literals != NULL)
+		{
+			const char *domain = regex[index].literals[0];
+			const uint64_t hash = suffix_hash(domain);
+			const size_t mask = prefilter->sfx_size - 1u;
+			size_t slot = hash & mask;
+			while(prefilter->sfx_first[slot] != -1 && prefilter->sfx_hash[slot] != hash)
+				slot = (slot + 1u) & mask;
+			prefilter->sfx_hash[slot] = hash;
+			prefilter->sfx_regex[sfx_outputs] = index;
+			prefilter->sfx_domain[sfx_outputs] = domain;
+			prefilter->sfx_next[sfx_outputs] = prefilter->sfx_first[slot];
+			prefilter->sfx_first[slot] = sfx_outputs++;
+			continue;
+		}
+		if(regex[index].ext.inverted || regex[index].literals == NULL)
+		{
+			prefilter->always[index / 64] |= 1ULL << (index % 64);
+			continue;
+		}
+
+		for(char **literal = regex[index].literals; *literal != NULL; literal++)
+		{
+			int32_t node = 0;
+			for(const unsigned char *p = (const unsigned char*)*literal; *p; p++)
+			{
+				int32_t *next = &prefilter->next[node * nc + prefilter->classes[*p]];
+				if(*next == -1)
+					*next = prefilter->num_nodes++;
+				node = *next;
+			}
+			prefilter->out_regex[outputs] = index;
+			prefilter->out_next[outputs] = prefilter->first[node];
+			prefilter->first[node] = outputs++;
+		}
+		literals++;
+	}
+
+	// Compute failure links and complete the transition table (breadth-first)
+	unsigned int head = 0u, tail = 0u;
+	for(unsigned int cl = 0; cl < nc; cl++)
+	{
+		int32_t *next = &prefilter->next[cl];
+		if(*next == -1)
+			*next = 0;
+		else
+			queue[tail++] = *next;
+	}
+	while(head < tail)
+	{
+		const int32_t node = queue[head++];
+		for(unsigned int cl = 0; cl < nc; cl++)
+		{
+			int32_t *next = &prefilter->next[node * nc + cl];
+			const int32_t fallback = prefilter->next[fail[node] * nc + cl];
+			if(*next == -1)
+			{
+				*next = fallback;
+				continue;
+			}
+			fail[*next] = fallback;
+			prefilter->dict[*next] = prefilter->first[fallback] != -1 ? fallback : prefilter->dict[fallback];
+			queue[tail++] = *next;
+		}
+	}
+	free(fail);
+	free(queue);
+	prefilter->sfx_count = sfx_outputs;
+
+	if(config.debug & DEBUG_REGEX)
+		logg("Regex prefilter: %u of %u regex with literals, %u nodes, %u input classes, %u suffix regex",
+		     literals, num, prefilter->num_nodes, nc, sfx_outputs);
+
+	return prefilter;
+}
+
+void regex_prefilter_free(regex_prefilter **prefilter)
+{
+	if(*prefilter == NULL)
+		return;
+
+	free((*prefilter)->next);
+	free((*prefilter)->dict);
+	free((*prefilter)->first);
+	free((*prefilter)->out_regex);
+	free((*prefilter)->out_next);
+	free((*prefilter)->always);
+	free((*prefilter)->sfx_hash);
+	free((*prefilter)->sfx_first);
+	free((*prefilter)->sfx_regex);
+	free((*prefilter)->sfx_domain);
+	free((*prefilter)->sfx_next);
+	free(*prefilter);
+	*prefilter = NULL;
+}
+
+// Mark all suffix regex matching the domain starting at input + start
+static void scan_suffix(const regex_prefilter *prefilter, const char *input, const size_t start,
+                        const uint64_t hash, uint64_t *candidates)
+{
+	const size_t mask = prefilter->sfx_size - 1u;
+	for(size_t slot = hash & mask; prefilter->sfx_first[slot] != -1; slot = (slot + 1u) & mask)
+	{
+		if(prefilter->sfx_hash[slot] != hash)
+			continue;
+
+		// Verify the domain to rule out hash collisions
+		for(int32_t o = prefilter->sfx_first[slot]; o != -1; o = prefilter->sfx_next[o])
+		{
+			if(strcasecmp(input + start, prefilter->sfx_domain[o]) == 0)
+			{
+				const int32_t index = prefilter->sfx_regex[o];
+				candidates[index / 64] |= 1ULL << (index % 64);
+			}
+		}
+		return;
+	}
+}
+
+// Mark all regex which can possibly match the input in the candidates bitmap.
+// Suffix regex are marked only if they do match
+void regex_prefilter_scan(const regex_prefilter *prefilter, const char *input, uint64_t *candidates)
+{
+	memcpy(candidates, prefilter->always, REGEX_PREFILTER_WORDS(prefilter->num) * sizeof(uint64_t));
+
+	const unsigned int nc = prefilter->num_classes;
+	int32_t node = 0;
+	for(const unsigned char *p = (const unsigned char*)input; *p; p++)
+	{
+		node = prefilter->next[node * nc + prefilter->classes[tolower(*p)]];
+		for(int32_t out = prefilter->first[node] != -1 ? node : prefilter->dict[node];
+		    out > 0; out = prefilter->dict[out])
+		{
+			for(int32_t o = prefilter->first[out]; o != -1; o = prefilter->out_next[o])
+			{
+				const int32_t index = prefilter->out_regex[o];
+				candidates[index / 64] |= 1ULL << (index % 64);
+			}
+		}
+	}
+
+	// Check the input and all its parent domains against the suffix regex
+	if(prefilter->sfx_count == 0u)
+		return;
+	uint64_t hash = SUFFIX_HASH_BASIS;
+	for(size_t i = strlen(input); i > 0; i--)
+	{
+		hash = suffix_hash_step(hash, input[i-1]);
+		if(i == 1 || input[i-2] == '.')
+			scan_suffix(prefilter, input, i - 1, hash, candidates);
+	}
+}
@@ -0,0 +1,32 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Regex literal prefilter prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef REGEX_PREFILTER_H
+#define REGEX_PREFILTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+// regexData
+#include "regex_r.h"
+
+typedef struct regex_prefilter regex_prefilter;
+
+// Maximum number of alternative literals per regex
+#define REGEX_PREFILTER_MAX_LITERALS 8u
+
+// Number of 64-bit words needed for a candidate bitmap of num regex
+#define REGEX_PREFILTER_WORDS(num) ((num)/64u + 1u)
+
+char **regex_prefilter_literals(const char *pattern, bool *suffix) __attribute__((malloc));
+void regex_prefilter_free_literals(char ***literals);
+regex_prefilter *regex_prefilter_build(const regexData *regex, const unsigned int num);
+void regex_prefilter_free(regex_prefilter **prefilter);
+void regex_prefilter_scan(const regex_prefilter *prefilter, const char *input, uint64_t *candidates);
+
+#endif //REGEX_PREFILTER_H
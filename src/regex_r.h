@@ -28,6 +28,10 @@ extern const char *regextype[];
 
 typedef struct {
 	bool available :1;
+	// Matches a domain and all its subdomains, (^|\.)example\.com$
+	bool suffix :1;
+	// A warning about the cost of this regex has been logged
+	bool slow :1;
 	struct {
 		bool inverted :1;
 		bool custom_ip4 :1;
@@ -39,14 +43,25 @@ typedef struct {
 	} ext;
 	int database_id;
 	char *string;
+	// Literals of which every match contains at least one (prefilter)
+	char **literals;
+	// Cost of executing this regex in this process
+	struct {
+		unsigned int calls;
+		unsigned int matches;
+		uint64_t nsec;
+	} stats;
 	regex_t regex;
 } regexData;
 
 unsigned int get_num_regex(const enum regex_type regexid) __attribute__((pure));
+const regexData *get_regex_data(const enum regex_type regexid) __attribute__((pure));
 bool in_regex(const char *domain, DNSCacheData *dns_cache, const int clientID, const enum regex_type regexid);
 void allocate_regex_client_enabled(clientsData *client, const int clientID);
 void reload_per_client_regex(clientsData *client);
 void read_regex_from_database(void);
+void preload_regex_from_database(void);
+void update_regex_from_database(const bool blacklist, const bool whitelist);
 bool regex_get_redirect(const int regexID, struct in_addr *addr4, struct in6_addr *addr6);
 
 int regex_test(const bool debug_mode, const bool quiet, const char *domainin, const char *regexin);
@@ -31,6 +31,10 @@
 #include "database/message-table.h"
 // Eventqueue routines
 #include "events.h"
+// poll()
+#include <poll.h>
+// thread_sched_apply()
+#include "threadsched.h"
 
 static bool res_initialized = false;
 
@@ -317,109 +321,521 @@ char *resolveHostname(const char *addr)
 	return hostname;
 }
 
-// Resolve upstream destination host names
-static size_t resolveAndAddHostname(size_t ippos, size_t oldnamepos)
+// How many PTR queries are in flight at most
+#define PTR_MAX_INFLIGHT 32
+// How many host names are resolved before they are stored under one lock
+#define PTR_BATCH_SIZE 256
+// How long to wait for the reply to a PTR query [milliseconds]
+#define PTR_TIMEOUT 2000
+
+// A host name to be resolved for a client or an upstream server. Strings are
+// copies as shared memory may be resized or compacted while resolving
+struct ptr_job {
+	int id;
+	char *ipaddr;
+	char *oldname;
+	char *newname;
+	bool pending;
+	bool lookup;
+};
+
+// Number of host name lookups and of those not returning a name
+static unsigned int lookups = 0, failed_lookups = 0;
+
+void get_resolver_stats(unsigned int *total, unsigned int *failed)
 {
-	// Get IP and host name strings. They are cloned in case shared memory is
-	// resized before the next lock
-	lock_shm();
-	char *ipaddr = strdup(getstr(ippos));
-	char *oldname = strdup(getstr(oldnamepos));
-	unlock_shm();
+	*total = __atomic_load_n(&lookups, __ATOMIC_RELAXED);
+	*failed = __atomic_load_n(&failed_lookups, __ATOMIC_RELAXED);
+}
+
+// Check if the resolution of a client or upstream server is delayed because
+// earlier lookups did not return a host name
+static bool resolve_backoff(const resolveState *state, const char *ipaddr, const time_t now)
+{
+	if(state->next <= now)
+		return false;
+
+	if(config.debug & DEBUG_RESOLVER)
+		logg("Skipping %s because %u lookups failed, next attempt in %i seconds",
+		     ipaddr, state->failures, (int)(state->next - now));
+	return true;
+}
 
-	// Test if we want to resolve host names, otherwise all calls to resolveHostname()
-	// and getNameFromIP() can be skipped as they will all return empty names (= no records)
-	if(!resolve_this_name(ipaddr))
+// Update the resolution state after a lookup. Failed lookups are retried with
+// exponential backoff, the delay is jittered by +/- 25% so entries which
+// failed together are not retried together
+static void update_resolve_state(resolveState *state, const bool found, const time_t now)
+{
+	state->last = now;
+	if(found)
 	{
-		if(config.debug & DEBUG_RESOLVER)
-			logg(" ---> \"\" (configured to not resolve host name)");
+		state->failures = 0;
+		state->next = 0;
+		return;
+	}
 
-		// Free allocated memory
-		free(ipaddr);
-		free(oldname);
+	time_t delay = RESOLVE_BACKOFF_MIN;
+	for(unsigned int i = 0; i < state->failures && delay < RESOLVE_BACKOFF_MAX; i++)
+		delay *= 2;
+	if(delay > RESOLVE_BACKOFF_MAX)
+		delay = RESOLVE_BACKOFF_MAX;
+	const time_t jitter = delay / 4;
+	state->next = now + delay - jitter + random() % (2*jitter + 1);
+	state->failures++;
+}
 
-		// Return fixed position of empty string
-		return 0;
+static void free_ptr_jobs(struct ptr_job *jobs, const unsigned int n)
+{
+	for(unsigned int i = 0; i < n; i++)
+	{
+		free(jobs[i].ipaddr);
+		free(jobs[i].oldname);
+		free(jobs[i].newname);
 	}
+	free(jobs);
+}
 
-	// Important: Don't hold a lock while resolving as the main thread
-	// (dnsmasq) needs to be operable during the call to resolveHostname()
-	char *newname = resolveHostname(ipaddr);
+// Add a job, the caller holds the lock
+static void add_ptr_job(struct ptr_job *jobs, unsigned int *n, const int id,
+                        const size_t ippos, const size_t namepos)
+{
+	struct ptr_job *job = &jobs[(*n)++];
+	job->id = id;
+	job->ipaddr = strdup(getstr(ippos));
+	job->oldname = strdup(getstr(namepos));
+	job->newname = NULL;
+	job->pending = false;
+	job->lookup = false;
+}
 
-	// If no hostname was found, try to obtain hostname from the network table
-	// This may be disabled due to a user setting
-	if(strlen(newname) == 0 && config.names_from_netdb)
+// Encode the reverse lookup name of an address in DNS wire format. Returns
+// the length of the name or 0 if the address is invalid
+static size_t ptr_qname(const char *addr, unsigned char *buf)
+{
+	size_t len = 0;
+	struct in6_addr a6;
+	struct in_addr a4;
+	if(inet_pton(AF_INET, addr, &a4) == 1)
 	{
-		free(newname);
-		newname = getNameFromIP(NULL, ipaddr);
-		if(newname != NULL && config.debug & DEBUG_RESOLVER)
-			logg(" ---> \"%s\" (provided by database)", newname);
+		const unsigned char *b = (const unsigned char *)&a4.s_addr;
+		for(int i = 3; i >= 0; i--)
+		{
+			const int n = sprintf((char *)buf + len + 1, "%u", b[i]);
+			buf[len] = (unsigned char)n;
+			len += n + 1;
+		}
+		memcpy(buf + len, "\7in-addr\4arpa", 14);
+		return len + 14;
+	}
+	else if(inet_pton(AF_INET6, addr, &a6) == 1)
+	{
+		static const char hex[] = "0123456789abcdef";
+		for(int i = 15; i >= 0; i--)
+		{
+			buf[len++] = 1;
+			buf[len++] = hex[a6.s6_addr[i] & 0x0f];
+			buf[len++] = 1;
+			buf[len++] = hex[a6.s6_addr[i] >> 4];
+		}
+		memcpy(buf + len, "\3ip6\4arpa", 10);
+		return len + 10;
 	}
 
-	// Only store new newname if it is valid and differs from oldname
-	// We do not need to check for oldname == NULL as names are
-	// always initialized with an empty string at position 0
-	if(newname != NULL && strcmp(oldname, newname) != 0)
+	return 0;
+}
+
+// Expand a (possibly compressed) domain name of a DNS message into dotted
+// form. Returns the position after the name or 0 if the message is malformed
+static size_t expand_name(const unsigned char *msg, const size_t msglen, size_t pos,
+                          char *name, const size_t namelen)
+{
+	size_t end = 0, outlen = 0;
+	unsigned int jumps = 0;
+	name[0] = '\0';
+	while(pos < msglen)
 	{
-		lock_shm();
-		size_t newnamepos = addstr(newname);
-		// newname has already been checked against NULL
-		// so we can safely free it
-		free(newname);
-		free(ipaddr);
-		free(oldname);
-		unlock_shm();
-		return newnamepos;
+		const unsigned char label = msg[pos];
+		if(label == 0)
+			return end > 0 ? end : pos + 1;
+
+		if((label & 0xc0) == 0xc0)
+		{
+			// Compression pointer, guard against loops
+			if(pos + 1 >= msglen || ++jumps > 64)
+				return 0;
+			if(end == 0)
+				end = pos + 2;
+			pos = ((label & 0x3f) << 8) | msg[pos + 1];
+			continue;
+		}
+
+		if(label > 63 || pos + 1 + label > msglen || outlen + label + 2 > namelen)
+			return 0;
+
+		if(outlen > 0)
+			name[outlen++] = '.';
+		memcpy(name + outlen, msg + pos + 1, label);
+		outlen += label;
+		name[outlen] = '\0';
+		pos += label + 1;
 	}
-	else if(config.debug & DEBUG_SHMEM)
+
+	return 0;
+}
+
+// Get the host name from the reply to a PTR query. Returns false if the reply
+// does not contain a PTR record
+static bool parse_ptr_reply(const unsigned char *msg, const size_t len, char *host, const size_t hostlen)
+{
+	// Header: ID, flags, QDCOUNT, ANCOUNT, NSCOUNT, ARCOUNT
+	if(len < 12 || !(msg[2] & 0x80) || (msg[3] & 0x0f) != 0)
+		return false;
+	const unsigned int qdcount = (msg[4] << 8) | msg[5];
+	unsigned int ancount = (msg[6] << 8) | msg[7];
+
+	char name[NI_MAXHOST];
+	size_t pos = 12;
+	for(unsigned int i = 0; i < qdcount; i++)
 	{
-		// Debugging output
-		logg("Not adding \"%s\" to buffer (unchanged)", oldname);
+		if((pos = expand_name(msg, len, pos, name, sizeof(name))) == 0 || pos + 4 > len)
+			return false;
+		pos += 4;
 	}
 
-	if(newname != NULL)
-		free(newname);
-	free(ipaddr);
-	free(oldname);
+	while(ancount-- > 0)
+	{
+		if((pos = expand_name(msg, len, pos, name, sizeof(name))) == 0 || pos + 10 > len)
+			return false;
+		const unsigned int type = (msg[pos] << 8) | msg[pos + 1];
+		const size_t rdlen = (msg[pos + 8] << 8) | msg[pos + 9];
+		pos += 10;
+		if(pos + rdlen > len)
+			return false;
+		// Skip CNAMEs and other records preceding the PTR record
+		if(type == 12)
+			return expand_name(msg, len, pos, host, hostlen) != 0 && host[0] != '\0';
+		pos += rdlen;
+	}
 
-	// Not changed, return old namepos
-	return oldnamepos;
+	return false;
+}
+
+static long long ptr_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+// Send PTR queries for all pending jobs to a name server, at most
+// PTR_MAX_INFLIGHT of them at a time, and match the replies. Jobs a host name
+// was found for are no longer pending afterwards
+static void ptr_lookup(struct ptr_job *jobs, const unsigned int n, const struct sockaddr_in *ns)
+{
+	const int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0 || connect(fd, (const struct sockaddr *)ns, sizeof(*ns)) != 0)
+	{
+		logg("WARN: Cannot create socket for resolving host names: %s", strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		return;
+	}
+
+	struct {
+		unsigned int job;
+		uint16_t id;
+		long long deadline;
+		bool active;
+	} inflight[PTR_MAX_INFLIGHT] = {{ 0 }};
+	static uint16_t next_id = 0;
+	if(next_id == 0)
+		next_id = (uint16_t)(time(NULL) ^ getpid());
+
+	unsigned int next = 0, active = 0;
+	while(!killed)
+	{
+		// Fill free slots with new queries
+		for(unsigned int slot = 0; slot < PTR_MAX_INFLIGHT && next < n; slot++)
+		{
+			if(inflight[slot].active)
+				continue;
+			while(next < n && !jobs[next].pending)
+				next++;
+			if(next == n)
+				break;
+
+			// Header with RD set and a single question
+			unsigned char query[12 + 128 + 4] = { 0 };
+			const uint16_t id = next_id++;
+			query[0] = id >> 8;
+			query[1] = id & 0xff;
+			query[2] = 0x01;
+			query[5] = 1;
+			const size_t qlen = ptr_qname(jobs[next].ipaddr, query + 12);
+			if(qlen == 0)
+			{
+				next++;
+				continue;
+			}
+			// QTYPE PTR, QCLASS IN
+			query[12 + qlen + 1] = 12;
+			query[12 + qlen + 3] = 1;
+			if(send(fd, query, 12 + qlen + 4, 0) < 0)
+			{
+				if(config.debug & DEBUG_RESOLVER)
+					logg("Sending PTR query for %s failed: %s", jobs[next].ipaddr, strerror(errno));
+				next++;
+				continue;
+			}
+
+			inflight[slot].job = next++;
+			inflight[slot].id = id;
+			inflight[slot].deadline = ptr_now_ms() + PTR_TIMEOUT;
+			inflight[slot].active = true;
+			active++;
+		}
+
+		if(active == 0)
+			break;
+
+		// Wait for replies until the earliest deadline
+		long long wait = PTR_TIMEOUT;
+		const long long now = ptr_now_ms();
+		for(unsigned int slot = 0; slot < PTR_MAX_INFLIGHT; slot++)
+			if(inflight[slot].active && inflight[slot].deadline - now < wait)
+				wait = inflight[slot].deadline - now;
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		if(poll(&pfd, 1, wait > 0 ? (int)wait : 0) > 0 && pfd.revents & POLLERR)
+		{
+			// The name server is not reachable (e.g. ICMP port
+			// unreachable), there is no point in waiting for replies
+			if(config.debug & DEBUG_RESOLVER)
+				logg("Name server not reachable, skipping remaining PTR queries");
+			break;
+		}
+
+		// Process all replies received so far. Only read while replies are
+		// pending as recv() logs a warning when it would block
+		unsigned char reply[4096];
+		ssize_t len;
+		while(poll(&pfd, 1, 0) > 0 && pfd.revents & POLLIN &&
+		      (len = recv(fd, reply, sizeof(reply), 0)) >= 12)
+		{
+			const uint16_t id = (reply[0] << 8) | reply[1];
+			for(unsigned int slot = 0; slot < PTR_MAX_INFLIGHT; slot++)
+			{
+				if(!inflight[slot].active || inflight[slot].id != id)
+					continue;
+
+				struct ptr_job *job = &jobs[inflight[slot].job];
+				char host[NI_MAXHOST] = { 0 };
+				if(parse_ptr_reply(reply, len, host, sizeof(host)))
+				{
+					job->newname = strdup(valid_hostname(host, job->ipaddr) ? host : "[invalid host name]");
+					job->pending = false;
+					if(config.debug & DEBUG_RESOLVER)
+						logg("%s ---> \"%s\"", job->ipaddr, job->newname);
+				}
+				inflight[slot].active = false;
+				active--;
+				break;
+			}
+		}
+
+		// Give up on queries which timed out
+		const long long later = ptr_now_ms();
+		for(unsigned int slot = 0; slot < PTR_MAX_INFLIGHT; slot++)
+		{
+			if(inflight[slot].active && inflight[slot].deadline <= later)
+			{
+				inflight[slot].active = false;
+				active--;
+			}
+		}
+	}
+
+	close(fd);
+}
+
+// Resolve the host names of a batch of jobs. FTL itself is asked first, then
+// the system-configured resolver (necessary for docker and friends) and
+// finally the network table
+static void resolve_ptr_jobs(struct ptr_job *jobs, const unsigned int n)
+{
+	unsigned int pending = 0;
+	for(unsigned int i = 0; i < n; i++)
+	{
+		struct ptr_job *job = &jobs[i];
+		// Hidden clients (privacy settings) and the internal client
+		if(strcmp(job->ipaddr, "0.0.0.0") == 0)
+			job->newname = strdup("hidden");
+		else if(strcmp(job->ipaddr, "::") == 0)
+			job->newname = strdup("pi.hole");
+		else if(!resolve_this_name(job->ipaddr))
+			job->newname = strdup("");
+		else
+		{
+			job->pending = true;
+			job->lookup = true;
+			pending++;
+		}
+	}
+
+	if(pending > 0)
+	{
+		// INADDR_LOOPBACK is in host byte order, however, in_addr has to
+		// be in network byte order, convert it here if necessary
+		struct sockaddr_in ftl = { 0 };
+		ftl.sin_family = AF_INET;
+		ftl.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		ftl.sin_port = htons(config.dns_port);
+		ptr_lookup(jobs, n, &ftl);
+
+		// res_init() reads resolv.conf to get the system's name servers
+		if(!res_initialized)
+		{
+			res_init();
+			res_initialized = true;
+		}
+		const struct sockaddr_in *sys = &_res.nsaddr_list[0];
+		if(_res.nscount > 0 && sys->sin_family == AF_INET &&
+		   (sys->sin_addr.s_addr != ftl.sin_addr.s_addr || sys->sin_port != ftl.sin_port))
+			ptr_lookup(jobs, n, sys);
+	}
+
+	for(unsigned int i = 0; i < n && !killed; i++)
+	{
+		struct ptr_job *job = &jobs[i];
+		if(job->pending)
+		{
+			job->pending = false;
+			job->newname = strdup("");
+		}
+
+		// If no hostname was found, try to obtain hostname from the
+		// network table. This may be disabled due to a user setting
+		if(strlen(job->newname) == 0 && resolve_this_name(job->ipaddr) && config.names_from_netdb)
+		{
+			char *name = getNameFromIP(NULL, job->ipaddr);
+			if(name != NULL)
+			{
+				free(job->newname);
+				job->newname = name;
+				if(config.debug & DEBUG_RESOLVER)
+					logg("%s ---> \"%s\" (provided by database)", job->ipaddr, name);
+			}
+		}
+	}
+}
+
+// Resolve the host names of all jobs in batches and store the results of each
+// batch under a single lock
+static void run_ptr_jobs(struct ptr_job *jobs, const unsigned int n, const bool upstreams)
+{
+	const time_t now = time(NULL);
+	for(unsigned int start = 0; start < n && !killed; start += PTR_BATCH_SIZE)
+	{
+		const unsigned int num = n - start < PTR_BATCH_SIZE ? n - start : PTR_BATCH_SIZE;
+		struct ptr_job *batch = &jobs[start];
+		resolve_ptr_jobs(batch, num);
+
+		lock_shm();
+		for(unsigned int i = 0; i < num; i++)
+		{
+			const struct ptr_job *job = &batch[i];
+			size_t *ippos = NULL, *namepos = NULL;
+			resolveState *state = NULL;
+			clientsData *client = NULL;
+			upstreamsData *upstream = NULL;
+			if(upstreams && (upstream = getUpstream(job->id, true)) != NULL)
+			{
+				ippos = &upstream->ippos;
+				namepos = &upstream->namepos;
+				state = &upstream->resolve;
+			}
+			else if(!upstreams && (client = getClient(job->id, true)) != NULL)
+			{
+				ippos = &client->ippos;
+				namepos = &client->namepos;
+				state = &client->resolve;
+			}
+
+			// The client may have been reclaimed while we were resolving
+			// (see reclaim.c), its slot may even belong to another client
+			// now. The shared string buffer may have been compacted,
+			// hence we compare strings, not positions
+			if(!upstreams && (client == NULL || strcmp(getstr(*ippos), job->ipaddr) != 0))
+				continue;
+			if(ippos == NULL || strcmp(getstr(*ippos), job->ipaddr) != 0)
+			{
+				logg("ERROR: Unable to store host name of %s %i, skipping...",
+				     upstreams ? "upstream" : "client", job->id);
+				continue;
+			}
+
+			// Only store new name if it differs from the old one
+			if(strcmp(getstr(*namepos), job->newname) != 0)
+				*namepos = addstr(job->newname);
+			else if(config.debug & DEBUG_SHMEM)
+				logg("Not adding \"%s\" to buffer (unchanged)", job->newname);
+
+			// Mark entry as not new
+			if(upstreams)
+				upstream->new = false;
+			else
+				client->flags.new = false;
+
+			if(job->lookup)
+			{
+				const bool found = strlen(job->newname) > 0;
+				update_resolve_state(state, found, now);
+				__atomic_add_fetch(&lookups, 1, __ATOMIC_RELAXED);
+				if(!found)
+					__atomic_add_fetch(&failed_lookups, 1, __ATOMIC_RELAXED);
+			}
+
+			if(config.debug & DEBUG_RESOLVER)
+				logg("%s %s -> \"%s\"", upstreams ? "Upstream" : "Client",
+				     job->ipaddr, job->newname);
+		}
+		unlock_shm();
+	}
 }
 
 // Resolve client host names
 static void resolveClients(const bool onlynew, const bool force_refreshing)
 {
+	TIME_SCOPE("resolve_clients");
+
 	const time_t now = time(NULL);
-	// Lock counter access here, we use a copy in the following loop
-	lock_shm();
-	int clientscount = counters->clients;
-	unlock_shm();
 
+	// Collect the clients to be resolved under a single lock
+	lock_shm();
+	const int clientscount = counters->clients;
+	struct ptr_job *jobs = calloc(clientscount > 0 ? clientscount : 1, sizeof(*jobs));
+	if(jobs == NULL)
+	{
+		unlock_shm();
+		return;
+	}
+	unsigned int n = 0;
 	int skipped = 0;
 	for(int clientID = 0; clientID < clientscount; clientID++)
 	{
-		// Memory access needs to get locked
-		lock_shm();
-		// Get client pointer for the first time (reading data)
-		clientsData* client = getClient(clientID, true);
+		// Slots of reclaimed clients are skipped
+		const clientsData* client = getClient(clientID, true);
 		if(client == NULL)
 		{
-			logg("ERROR: Unable to get client pointer (1) with ID %i, skipping...", clientID);
 			skipped++;
-			unlock_shm();
 			continue;
 		}
 
 		// Skip alias-clients
 		if(client->flags.aliasclient)
-		{
-			unlock_shm();
 			continue;
-		}
 
-		bool newflag = client->flags.new;
-		size_t ippos = client->ippos;
-		size_t oldnamepos = client->namepos;
+		const char *ipaddr = getstr(client->ippos);
+		const char *oldname = getstr(client->namepos);
 
 		// Only try to resolve host names of clients which were recently active if we are re-resolving
 		// Limit for a "recently active" client is two hours ago
@@ -428,32 +844,26 @@ static void resolveClients(const bool onlynew, const bool force_refreshing)
 			if(config.debug & DEBUG_RESOLVER)
 			{
 				logg("Skipping client %s (%s) because it was inactive for %i seconds",
-				     getstr(ippos), getstr(oldnamepos), (int)(now - client->lastQuery));
+				     ipaddr, oldname, (int)(now - client->lastQuery));
 			}
-			unlock_shm();
 			continue;
 		}
 
-		unlock_shm();
-
 		// If onlynew flag is set, we will only resolve new clients
 		// If not, we will try to re-resolve all known clients
-		if(!force_refreshing && onlynew && !newflag)
+		if(!force_refreshing && onlynew && !client->flags.new)
 		{
 			if(config.debug & DEBUG_RESOLVER)
 			{
 				logg("Skipping client %s (%s) because it is not new",
-				     getstr(ippos), getstr(oldnamepos));
+				     ipaddr, oldname);
 			}
 			skipped++;
 			continue;
 		}
 
 		// Check if we want to resolve an IPv6 address
-		bool IPv6 = false;
-		const char *ipaddr = NULL;
-		if((ipaddr = getstr(ippos)) != NULL && strstr(ipaddr,":") != NULL)
-			IPv6 = true;
+		const bool IPv6 = strstr(ipaddr, ":") != NULL;
 
 		// If we're in refreshing mode (onlynew == false), we skip clients if
 		// 1. We should not refresh any hostnames
@@ -463,7 +873,7 @@ static void resolveClients(const bool onlynew, const bool force_refreshing)
 		if(onlynew == false &&
 		   (config.refresh_hostnames == REFRESH_NONE ||
 		   (config.refresh_hostnames == REFRESH_IPV4_ONLY && IPv6) ||
-		   (config.refresh_hostnames == REFRESH_UNKNOWN && oldnamepos != 0)))
+		   (config.refresh_hostnames == REFRESH_UNKNOWN && client->namepos != 0)))
 		{
 			if(config.debug & DEBUG_RESOLVER)
 			{
@@ -476,45 +886,26 @@ static void resolveClients(const bool onlynew, const bool force_refreshing)
 					reason = "Looking only for unknown hostnames";
 
 				logg("Skipping client %s (%s) because it should not be refreshed: %s",
-				     getstr(ippos), getstr(oldnamepos), reason);
+				     ipaddr, oldname, reason);
 			}
 			skipped++;
-			if(config.debug & DEBUG_RESOLVER)
-			{
-				lock_shm();
-				logg("Client %s -> \"%s\" already known", getstr(ippos), getstr(oldnamepos));
-				unlock_shm();
-			}
 			continue;
 		}
 
-		// Obtain/update hostname of this client
-		size_t newnamepos = resolveAndAddHostname(ippos, oldnamepos);
-
-		lock_shm();
-		// Get client pointer for the second time (writing data)
-		// We cannot use the same pointer again as we released
-		// the lock in between so we cannot know if something
-		// happened to the shared memory object (resize event)
-		client = getClient(clientID, true);
-		if(client == NULL)
+		// Skip clients without host name until their next attempt is due
+		if(!force_refreshing && resolve_backoff(&client->resolve, ipaddr, now))
 		{
-			logg("ERROR: Unable to get client pointer (2) with ID %i, skipping...", clientID);
 			skipped++;
-			unlock_shm();
 			continue;
 		}
 
-		// Store obtained host name (may be unchanged)
-		client->namepos = newnamepos;
-		// Mark entry as not new
-		client->flags.new = false;
-
-		if(config.debug & DEBUG_RESOLVER)
-			logg("Client %s -> \"%s\" is new", getstr(ippos), getstr(newnamepos));
-
-		unlock_shm();
+		add_ptr_job(jobs, &n, clientID, client->ippos, client->namepos);
 	}
+	unlock_shm();
+
+	// Obtain/update host names of these clients
+	run_ptr_jobs(jobs, n, false);
+	free_ptr_jobs(jobs, n);
 
 	if(config.debug & DEBUG_RESOLVER)
 	{
@@ -526,31 +917,31 @@ static void resolveClients(const bool onlynew, const bool force_refreshing)
 // Resolve upstream destination host names
 static void resolveUpstreams(const bool onlynew)
 {
+	TIME_SCOPE("resolve_upstreams");
+
 	const time_t now = time(NULL);
-	// Lock counter access here, we use a copy in the following loop
-	lock_shm();
-	int upstreams = counters->upstreams;
-	unlock_shm();
 
+	// Collect the upstream servers to be resolved under a single lock
+	lock_shm();
+	const int upstreams = counters->upstreams;
+	struct ptr_job *jobs = calloc(upstreams > 0 ? upstreams : 1, sizeof(*jobs));
+	if(jobs == NULL)
+	{
+		unlock_shm();
+		return;
+	}
+	unsigned int n = 0;
 	int skipped = 0;
 	for(int upstreamID = 0; upstreamID < upstreams; upstreamID++)
 	{
-		// Memory access needs to get locked
-		lock_shm();
-		// Get upstream pointer for the first time (reading data)
-		upstreamsData* upstream = getUpstream(upstreamID, true);
+		const upstreamsData* upstream = getUpstream(upstreamID, true);
 		if(upstream == NULL)
 		{
 			logg("ERROR: Unable to get upstream pointer with ID %i, skipping...", upstreamID);
 			skipped++;
-			unlock_shm();
 			continue;
 		}
 
-		bool newflag = upstream->new;
-		size_t ippos = upstream->ippos;
-		size_t oldnamepos = upstream->namepos;
-
 		// Only try to resolve host names of upstream servers which were recently active
 		// Limit for a "recently active" upstream server is two hours ago
 		if(upstream->lastQuery < now - 2*60*60)
@@ -558,54 +949,40 @@ static void resolveUpstreams(const bool onlynew)
 			if(config.debug & DEBUG_RESOLVER)
 			{
 				logg("Skipping upstream %s (%s) because it was inactive for %i seconds",
-				     getstr(ippos), getstr(oldnamepos), (int)(now - upstream->lastQuery));
+				     getstr(upstream->ippos), getstr(upstream->namepos),
+				     (int)(now - upstream->lastQuery));
 			}
-			unlock_shm();
 			continue;
 		}
-		unlock_shm();
 
 		// If onlynew flag is set, we will only resolve new upstream destinations
 		// If not, we will try to re-resolve all known upstream destinations
-		if(onlynew && !newflag)
+		if(onlynew && !upstream->new)
 		{
 			skipped++;
 			if(config.debug & DEBUG_RESOLVER)
 			{
-				lock_shm();
-				logg("Upstream %s -> \"%s\" already known", getstr(ippos), getstr(oldnamepos));
-				unlock_shm();
+				logg("Upstream %s -> \"%s\" already known",
+				     getstr(upstream->ippos), getstr(upstream->namepos));
 			}
 			continue;
 		}
 
-		// Obtain/update hostname of this client
-		size_t newnamepos = resolveAndAddHostname(ippos, oldnamepos);
-
-		lock_shm();
-		// Get upstream pointer for the second time (writing data)
-		// We cannot use the same pointer again as we released
-		// the lock in between so we cannot know if something
-		// happened to the shared memory object (resize event)
-		upstream = getUpstream(upstreamID, true);
-		if(upstream == NULL)
+		// Skip upstream servers without host name until their next
+		// attempt is due
+		if(resolve_backoff(&upstream->resolve, getstr(upstream->ippos), now))
 		{
-			logg("ERROR: Unable to get upstream pointer with ID %i, skipping...", upstreamID);
 			skipped++;
-			unlock_shm();
 			continue;
 		}
 
-		// Store obtained host name (may be unchanged)
-		upstream->namepos = newnamepos;
-		// Mark entry as not new
-		upstream->new = false;
-
-		if(config.debug & DEBUG_RESOLVER)
-			logg("Upstream %s -> \"%s\" is new", getstr(ippos), getstr(newnamepos));
-
-		unlock_shm();
+		add_ptr_job(jobs, &n, upstreamID, upstream->ippos, upstream->namepos);
 	}
+	unlock_shm();
+
+	// Obtain/update host names of these upstream servers
+	run_ptr_jobs(jobs, n, true);
+	free_ptr_jobs(jobs, n);
 
 	if(config.debug & DEBUG_RESOLVER)
 	{
@@ -619,10 +996,14 @@ void *DNSclient_thread(void *val)
 	// Set thread name
 	thread_names[DNSclient] = "DNS client";
 	prctl(PR_SET_NAME, thread_names[DNSclient], 0, 0, 0);
+	thread_sched_apply(DNSclient);
 
 	// Initial delay until we first try to resolve anything
 	thread_sleepms(DNSclient, 2000);
 
+	// All known host names are refreshed every RERESOLVE_INTERVAL seconds
+	time_t next_reresolve = time(NULL) - time(NULL)%RERESOLVE_INTERVAL + RERESOLVE_INTERVAL;
+
 	// Run as long as this thread is not canceled
 	while(!killed)
 	{
@@ -644,8 +1025,9 @@ void *DNSclient_thread(void *val)
 			break;
 
 		// Run every hour to update possibly changed client host names
-		if(resolver_ready && (time(NULL) % RERESOLVE_INTERVAL == 0))
+		if(resolver_ready && time(NULL) >= next_reresolve)
 		{
+			next_reresolve = time(NULL) - time(NULL)%RERESOLVE_INTERVAL + RERESOLVE_INTERVAL;
 			set_event(RERESOLVE_HOSTNAMES);      // done below
 		}
 
@@ -672,8 +1054,11 @@ void *DNSclient_thread(void *val)
 			resolveUpstreams(false);
 		}
 
-		// Idle for 1 sec
-		thread_sleepms(DNSclient, 1000);
+		// Sleep until new host names need to be resolved or the next
+		// refresh is due. New host names are not resolved before the
+		// resolver is ready, check again in a second
+		const time_t wait = next_reresolve - time(NULL);
+		wait_for_event(DNSclient, resolver_ready && wait > 1 ? (int)wait*1000 : 1000);
 	}
 
 	logg("Terminating resolver thread");
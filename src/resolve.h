@@ -14,6 +14,7 @@ void *DNSclient_thread(void *val);
 char *resolveHostname(const char *addr);
 bool resolve_names(void) __attribute__((pure));
 bool resolve_this_name(const char *ipaddr) __attribute__((pure));
+void get_resolver_stats(unsigned int *total, unsigned int *failed);
 
 // musl does not define MAXHOSTNAMELEN
 // If it is not defined, we set the value
@@ -0,0 +1,84 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Recently updated ipset/nftset elements
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#define FTLDNS
+#include "dnsmasq/dnsmasq.h"
+#undef __USE_XOPEN
+#include "FTL.h"
+#include "setcache.h"
+#include "dnsmasq_interface.h"
+#include "config.h"
+
+// dnsmasq adds every address of a reply to the ipsets and nftsets configured
+// for the domain, even if the address has been added a moment ago. With
+// IPSET_DEDUP, the elements added recently are remembered until the TTL of
+// their record (at most IPSET_DEDUP seconds) has passed and are not added
+// again before. The elements are kept in a direct-mapped table, an element
+// displaced by another one is simply added again next time. Every process
+// (DNS and TCP workers) has its own table
+struct set_element {
+	uint64_t key;
+	union all_addr addr;
+	time_t expires;
+};
+
+static struct set_element *elements = NULL;
+
+static uint64_t __attribute__((pure)) set_key(const char *setname, const bool nft, const int flags)
+{
+	// FNV-1a over the name of the set, its kind and the address family
+	uint64_t hash = 14695981039346656037ULL ^ (nft ? 1u : 0u) ^ (flags & F_IPV6 ? 2u : 0u);
+	for(const unsigned char *p = (const unsigned char*)setname; *p; p++)
+		hash = (hash ^ *p) * 1099511628211ULL;
+	return hash;
+}
+
+static size_t __attribute__((pure)) addr_len(const int flags)
+{
+	return flags & F_IPV6 ? IN6ADDRSZ : INADDRSZ;
+}
+
+static struct set_element *get_element(const uint64_t key, const union all_addr *addr, const int flags)
+{
+	uint64_t hash = key;
+	const unsigned char *p = (const unsigned char*)addr;
+	for(size_t i = 0; i < addr_len(flags); i++)
+		hash = (hash ^ p[i]) * 1099511628211ULL;
+
+	return &elements[(hash ^ (hash >> 32)) & (SETCACHE_SIZE - 1)];
+}
+
+bool FTL_set_recently_added(const char *setname, const bool nft, const union all_addr *addr,
+                            const int flags, const time_t now)
+{
+	if(config.ipset_dedup == 0 || elements == NULL)
+		return false;
+
+	const uint64_t key = set_key(setname, nft, flags);
+	const struct set_element *element = get_element(key, addr, flags);
+	return element->key == key && element->expires > now &&
+	       memcmp(&element->addr, addr, addr_len(flags)) == 0;
+}
+
+void FTL_set_added(const char *setname, const bool nft, const union all_addr *addr,
+                   const int flags, const unsigned long ttl, const time_t now)
+{
+	if(config.ipset_dedup == 0)
+		return;
+
+	if(elements == NULL && (elements = calloc(SETCACHE_SIZE, sizeof(*elements))) == NULL)
+		return;
+
+	const uint64_t key = set_key(setname, nft, flags);
+	struct set_element *element = get_element(key, addr, flags);
+	element->key = key;
+	memcpy(&element->addr, addr, addr_len(flags));
+	element->expires = now + (time_t)(ttl < config.ipset_dedup ? ttl : config.ipset_dedup);
+}
@@ -0,0 +1,19 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Recently updated ipset/nftset elements prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef SETCACHE_H
+#define SETCACHE_H
+
+// Number of recently added set elements remembered (power of two)
+#define SETCACHE_SIZE 4096
+
+// FTL_set_recently_added() and FTL_set_added() are called by dnsmasq and
+// declared in dnsmasq_interface.h
+
+#endif //SETCACHE_H
@@ -12,6 +12,10 @@
 #include "log.h"
 #include "config.h"
 #include "setupVars.h"
+// file_changed()
+#include "files.h"
+// hashStr()
+#include "datastructure.h"
 
 int setupVarsElements = 0;
 char ** setupVarsArray = NULL;
@@ -255,3 +259,272 @@ void check_blocking_status(void)
 
 	logg("Blocking status is %s", message);
 }
+
+// Exclusion lists are precompiled into a hash set of exact entries and a list
+// of substrings (entries starting with '*')
+typedef struct {
+	char **exact;
+	unsigned int size;
+	char **wildcard;
+	unsigned int wildcards;
+} exclusionList;
+
+// Parsed content of setupVars.conf. API threads hold a reference while using
+// a snapshot, it is freed when the last reference is dropped after the file
+// has been replaced by a new snapshot
+struct setupVars_snapshot {
+	unsigned int refs;
+	unsigned int nvars;
+	char **keys;
+	char **values;
+	exclusionList lists[SETUPVARS_LISTS];
+};
+
+static struct setupVars_snapshot *snapshot = NULL;
+static unsigned int snapshot_generation = 0u;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *list_key(const enum setupVars_list list)
+{
+	return list == EXCLUDE_DOMAINS ? "API_EXCLUDE_DOMAINS" : "API_EXCLUDE_CLIENTS";
+}
+
+static void free_snapshot(struct setupVars_snapshot *snap)
+{
+	for(unsigned int i = 0; i < snap->nvars; i++)
+	{
+		free(snap->keys[i]);
+		free(snap->values[i]);
+	}
+	if(snap->keys != NULL)
+		free(snap->keys);
+	if(snap->values != NULL)
+		free(snap->values);
+	for(unsigned int i = 0; i < SETUPVARS_LISTS; i++)
+	{
+		exclusionList *list = &snap->lists[i];
+		for(unsigned int j = 0; j < list->size; j++)
+			if(list->exact[j] != NULL)
+				free(list->exact[j]);
+		for(unsigned int j = 0; j < list->wildcards; j++)
+			free(list->wildcard[j]);
+		if(list->exact != NULL)
+			free(list->exact);
+		if(list->wildcard != NULL)
+			free(list->wildcard);
+	}
+	free(snap);
+}
+
+// Split a comma-separated list into an exclusion list
+static void compile_list(exclusionList *list, const char *value)
+{
+	if(value == NULL || value[0] == '\0')
+		return;
+
+	// Count entries to size the hash table (load factor below 1/2)
+	unsigned int entries = 1;
+	for(const char *c = value; *c; c++)
+		if(*c == ',')
+			entries++;
+	unsigned int size = 4;
+	while(size < 2*entries)
+		size *= 2;
+
+	list->exact = calloc(size, sizeof(char*));
+	list->wildcard = calloc(entries, sizeof(char*));
+	if(list->exact == NULL || list->wildcard == NULL)
+		return;
+	list->size = size;
+
+	for(const char *p = value; ; )
+	{
+		const size_t len = strcspn(p, ",");
+		// Skip empty tokens (strtok() did this before)
+		if(len > 0)
+		{
+			if(p[0] == '*')
+			{
+				if((list->wildcard[list->wildcards] = strndup(p + 1, len - 1)) != NULL)
+					list->wildcards++;
+			}
+			else
+			{
+				char *entry = strndup(p, len);
+				if(entry != NULL)
+				{
+					unsigned int i = hashStr(entry) & (size - 1);
+					while(list->exact[i] != NULL && strcmp(list->exact[i], entry) != 0)
+						i = (i + 1) & (size - 1);
+					if(list->exact[i] == NULL)
+						list->exact[i] = entry;
+					else
+						free(entry);
+				}
+			}
+		}
+		if(p[len] == '\0')
+			break;
+		p += len + 1;
+	}
+}
+
+// Parse setupVars.conf into a new snapshot
+static struct setupVars_snapshot *load_snapshot(void)
+{
+	struct setupVars_snapshot *snap = calloc(1, sizeof(struct setupVars_snapshot));
+	if(snap == NULL)
+		return NULL;
+	snap->refs = 1;
+
+	FILE *fp = fopen(FTLfiles.setupVars, "r");
+	if(fp == NULL)
+	{
+		logg("WARN: Reading setupVars.conf failed: %s", strerror(errno));
+		return snap;
+	}
+
+	char *line = NULL;
+	size_t linesize = 0;
+	unsigned int capacity = 0;
+	while(getline(&line, &linesize, fp) != -1)
+	{
+		// Strip (possible) newline
+		line[strcspn(line, "\n")] = '\0';
+
+		// Skip comment lines and lines without assignment
+		char *equals = strchr(line, '=');
+		if(line[0] == '#' || line[0] == ';' || equals == NULL)
+			continue;
+		*equals = '\0';
+
+		// The first occurrence of a key wins
+		bool known = false;
+		for(unsigned int i = 0; i < snap->nvars && !known; i++)
+			known = strcmp(snap->keys[i], line) == 0;
+		if(known)
+			continue;
+
+		if(snap->nvars == capacity)
+		{
+			capacity = capacity > 0 ? 2*capacity : 64;
+			char **keys = realloc(snap->keys, capacity*sizeof(char*));
+			if(keys == NULL)
+				break;
+			snap->keys = keys;
+			char **values = realloc(snap->values, capacity*sizeof(char*));
+			if(values == NULL)
+				break;
+			snap->values = values;
+		}
+
+		char *key = strdup(line);
+		char *value = strdup(equals + 1);
+		if(key == NULL || value == NULL)
+		{
+			if(key != NULL)
+				free(key);
+			if(value != NULL)
+				free(value);
+			break;
+		}
+		snap->keys[snap->nvars] = key;
+		snap->values[snap->nvars] = value;
+		snap->nvars++;
+	}
+	if(line != NULL)
+		free(line);
+	fclose(fp);
+
+	for(unsigned int i = 0; i < SETUPVARS_LISTS; i++)
+		compile_list(&snap->lists[i], setupVars_value(snap, list_key(i)));
+
+	return snap;
+}
+
+// Get a reference to the parsed content of setupVars.conf. The file is parsed
+// again only if it has been modified since it was parsed the last time. The
+// reference has to be released using setupVars_put()
+struct setupVars_snapshot *setupVars_get(void)
+{
+	pthread_mutex_lock(&snapshot_lock);
+	if(file_changed(WATCH_SETUPVARS, &snapshot_generation) || snapshot == NULL)
+	{
+		struct setupVars_snapshot *snap = load_snapshot();
+		if(snap != NULL)
+		{
+			if(snapshot != NULL && --snapshot->refs == 0)
+				free_snapshot(snapshot);
+			snapshot = snap;
+		}
+	}
+
+	struct setupVars_snapshot *snap = snapshot;
+	if(snap != NULL)
+		snap->refs++;
+	pthread_mutex_unlock(&snapshot_lock);
+
+	return snap;
+}
+
+void setupVars_put(struct setupVars_snapshot *snap)
+{
+	if(snap == NULL)
+		return;
+
+	pthread_mutex_lock(&snapshot_lock);
+	const bool last = --snap->refs == 0;
+	pthread_mutex_unlock(&snapshot_lock);
+
+	if(last)
+		free_snapshot(snap);
+}
+
+// Get the value of a key, returns NULL if it is not set
+const char *setupVars_value(const struct setupVars_snapshot *snap, const char *key)
+{
+	if(snap == NULL)
+		return NULL;
+
+	for(unsigned int i = 0; i < snap->nvars; i++)
+		if(strcmp(snap->keys[i], key) == 0)
+			return snap->values[i];
+
+	return NULL;
+}
+
+// Check if a string is excluded by one of the API exclusion lists. This
+// is the precompiled equivalent of insetupVarsArray()
+bool setupVars_excluded(const struct setupVars_snapshot *snap, const enum setupVars_list which, const char *str)
+{
+	// Check for possible NULL pointer
+	// (this is valid input, e.g. if clients[i].name is unspecified)
+	if(snap == NULL || str == NULL || which >= SETUPVARS_LISTS)
+		return false;
+
+	const exclusionList *list = &snap->lists[which];
+	if(list->size > 0)
+	{
+		unsigned int i = hashStr(str) & (list->size - 1);
+		while(list->exact[i] != NULL)
+		{
+			if(strcmp(list->exact[i], str) == 0)
+				return true;
+			i = (i + 1) & (list->size - 1);
+		}
+	}
+
+	for(unsigned int i = 0; i < list->wildcards; i++)
+		if(strstr(str, list->wildcard[i]) != NULL)
+			return true;
+
+	return false;
+}
+
+// Does the exclusion list have any entries?
+bool setupVars_has_list(const struct setupVars_snapshot *snap, const enum setupVars_list which)
+{
+	if(snap == NULL || which >= SETUPVARS_LISTS)
+		return false;
+	return snap->lists[which].size > 0;
+}
@@ -20,6 +20,20 @@ char* find_equals(const char* s) __attribute__((pure));
 void trim_whitespace(char *string);
 void check_blocking_status(void);
 
+// Cached and parsed setupVars.conf
+enum setupVars_list {
+	EXCLUDE_DOMAINS,
+	EXCLUDE_CLIENTS,
+	SETUPVARS_LISTS
+} __attribute__ ((packed));
+
+struct setupVars_snapshot;
+struct setupVars_snapshot *setupVars_get(void);
+void setupVars_put(struct setupVars_snapshot *snap);
+const char *setupVars_value(const struct setupVars_snapshot *snap, const char *key) __attribute__((pure));
+bool setupVars_excluded(const struct setupVars_snapshot *snap, const enum setupVars_list which, const char *str) __attribute__((pure));
+bool setupVars_has_list(const struct setupVars_snapshot *snap, const enum setupVars_list which) __attribute__((pure));
+
 extern enum blocking_status blockingstatus;
 
 #endif //SETUPVARS_H
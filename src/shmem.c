@@ -30,23 +30,62 @@
 #include "database/message-table.h"
 // check_running_FTL()
 #include "procps.h"
+// lock_stats_*()
+#include "lockstats.h"
+// monotonic_usec()
+#include "histogram.h"
+// leaderboardsStruct
+#include "leaderboard.h"
+// heavyHittersStruct
+#include "heavyhitters.h"
+// cardinalityStruct
+#include "cardinality.h"
+// streamRingStruct
+#include "api/stream.h"
+// rateLimitWheel
+#include "ratelimit.h"
+// timeseriesStruct
+#include "timeseries.h"
+// debugLimitsStruct
+#include "debuglimit.h"
+// TIME_SCOPE()
+#include "timers.h"
+// FTL_PROBE()
+#include "probes.h"
 
 /// The version of shared memory used
-#define SHARED_MEMORY_VERSION 14
+#define SHARED_MEMORY_VERSION 33
 
 /// The name of the shared memory. Use this when connecting to the shared memory.
 #define SHMEM_PATH "/dev/shm"
 #define SHARED_LOCK_NAME "FTL-lock"
 #define SHARED_STRINGS_NAME "FTL-strings"
+#define SHARED_STRINGS_LOOKUP_NAME "FTL-strings-lookup"
 #define SHARED_COUNTERS_NAME "FTL-counters"
+#define SHARED_QUERY_COUNTERS_NAME "FTL-query-counters"
+#define SHARED_LEADERBOARDS_NAME "FTL-leaderboards"
+#define SHARED_HEAVY_HITTERS_NAME "FTL-heavy-hitters"
+#define SHARED_CARDINALITY_NAME "FTL-cardinality"
+#define SHARED_TRIGRAM_INDEX_NAME "FTL-trigram-index"
+#define SHARED_TRIGRAM_CHUNKS_NAME "FTL-trigram-chunks"
+#define SHARED_RATE_LIMIT_NAME "FTL-rate-limit"
+#define SHARED_STREAM_NAME "FTL-stream"
+#define SHARED_DEBUG_LIMITS_NAME "FTL-debug-limits"
 #define SHARED_DOMAINS_NAME "FTL-domains"
+#define SHARED_DOMAINS_LOOKUP_NAME "FTL-domains-lookup"
 #define SHARED_CLIENTS_NAME "FTL-clients"
+#define SHARED_CLIENTS_LOOKUP_NAME "FTL-clients-lookup"
 #define SHARED_QUERIES_NAME "FTL-queries"
+#define SHARED_QUERIES_LOOKUP_NAME "FTL-queries-lookup"
 #define SHARED_UPSTREAMS_NAME "FTL-upstreams"
 #define SHARED_OVERTIME_NAME "FTL-overTime"
+#define SHARED_OVERTIME_CHUNKS_NAME "FTL-overTime-chunks"
+#define SHARED_TIMESERIES_NAME "FTL-timeseries"
 #define SHARED_SETTINGS_NAME "FTL-settings"
 #define SHARED_DNS_CACHE "FTL-dns-cache"
+#define SHARED_DNS_CACHE_LOOKUP "FTL-dns-cache-lookup"
 #define SHARED_PER_CLIENT_REGEX "FTL-per-client-regex"
+#define SHARED_VERDICT_CACHE "FTL-verdict-cache"
 
 // Allocation step for FTL-strings bucket. This is somewhat special as we use
 // this as a general-purpose storage which should always be large enough. If,
@@ -55,46 +94,120 @@
 // the next lock round
 #define STRINGS_ALLOC_STEP (10*pagesize)
 
+// Minimum number of overTime chunks added to the pool at once
+#define OVERTIME_CHUNKS_ALLOC_STEP 256
+// Minimum number of trigram index chunks added to the pool at once
+#define TRIGRAM_CHUNKS_ALLOC_STEP 4096
+
 // Global counters struct
 countersStruct *counters = NULL;
+queryCountersStruct *query_counters = NULL;
+leaderboardsStruct *leaderboards = NULL;
+heavyHittersStruct *heavy_hitters = NULL;
+cardinalityStruct *cardinality = NULL;
+trigramIndexStruct *trigram_index = NULL;
+rateLimitWheel *rate_limit_wheel = NULL;
+streamRingStruct *stream_ring = NULL;
+debugLimitsStruct *debug_limits = NULL;
+timeseriesStruct *timeseries = NULL;
 
 /// The pointer in shared memory to the shared string buffer
 static SharedMemory shm_lock = { 0 };
 static SharedMemory shm_strings = { 0 };
+static SharedMemory shm_strings_lookup = { 0 };
 static SharedMemory shm_counters = { 0 };
+static SharedMemory shm_query_counters = { 0 };
+static SharedMemory shm_leaderboards = { 0 };
+static SharedMemory shm_heavy_hitters = { 0 };
+static SharedMemory shm_cardinality = { 0 };
+static SharedMemory shm_trigram_index = { 0 };
+static SharedMemory shm_trigram_chunks = { 0 };
+static SharedMemory shm_rate_limit = { 0 };
+static SharedMemory shm_stream = { 0 };
+static SharedMemory shm_debug_limits = { 0 };
 static SharedMemory shm_domains = { 0 };
+static SharedMemory shm_domains_lookup = { 0 };
 static SharedMemory shm_clients = { 0 };
+static SharedMemory shm_clients_lookup = { 0 };
 static SharedMemory shm_queries = { 0 };
+static SharedMemory shm_queries_lookup = { 0 };
 static SharedMemory shm_upstreams = { 0 };
 static SharedMemory shm_overTime = { 0 };
+static SharedMemory shm_overTime_chunks = { 0 };
+static SharedMemory shm_timeseries = { 0 };
 static SharedMemory shm_settings = { 0 };
 static SharedMemory shm_dns_cache = { 0 };
+static SharedMemory shm_dns_cache_lookup = { 0 };
 static SharedMemory shm_per_client_regex = { 0 };
-
-static SharedMemory *sharedMemories[] = { &shm_lock,
-                                          &shm_strings,
-                                          &shm_counters,
-                                          &shm_domains,
-                                          &shm_clients,
-                                          &shm_queries,
-                                          &shm_upstreams,
-                                          &shm_overTime,
-                                          &shm_settings,
-                                          &shm_dns_cache,
-                                          &shm_per_client_regex };
+static SharedMemory shm_verdict_cache = { 0 };
+
+// Objects created by tools running next to FTL (see shmem_private()) get the
+// PID of the process appended to their names
+static pid_t private_pid = 0;
+
+static SharedMemory *const sharedMemories[] = { &shm_lock,
+                                                &shm_strings,
+                                                &shm_strings_lookup,
+                                                &shm_counters,
+                                                &shm_query_counters,
+                                                &shm_leaderboards,
+                                                &shm_heavy_hitters,
+                                                &shm_cardinality,
+                                                &shm_trigram_index,
+                                                &shm_trigram_chunks,
+                                                &shm_rate_limit,
+                                                &shm_stream,
+                                                &shm_debug_limits,
+                                                &shm_domains,
+                                                &shm_domains_lookup,
+                                                &shm_clients,
+                                                &shm_clients_lookup,
+                                                &shm_queries,
+                                                &shm_queries_lookup,
+                                                &shm_upstreams,
+                                                &shm_overTime,
+                                                &shm_overTime_chunks,
+                                                &shm_timeseries,
+                                                &shm_settings,
+                                                &shm_dns_cache,
+                                                &shm_dns_cache_lookup,
+                                                &shm_per_client_regex,
+                                                &shm_verdict_cache };
 #define NUM_SHMEM (sizeof(sharedMemories)/sizeof(SharedMemory*))
+_Static_assert(NUM_SHMEM <= SHM_MAX_OBJECTS, "Increase SHM_MAX_OBJECTS");
 
 // Variable size array structs
 static queriesData *queries = NULL;
 static clientsData *clients = NULL;
+
+// Fixed-size verdict cache, the size does not change at runtime
+static verdictCacheData *verdict_cache = NULL;
+static unsigned int verdict_cache_MAX = 0u;
 static domainsData *domains = NULL;
 static upstreamsData *upstreams = NULL;
 static DNSCacheData *dns_cache = NULL;
+static overTimeChunk *overTime_chunks = NULL;
+static trigramChunk *trigram_chunks = NULL;
+static lookupEntry *domains_lookup = NULL;
+static clientLookupEntry *clients_lookup = NULL;
+static lookupEntry *dns_cache_lookup = NULL;
+static lookupEntry *queries_lookup = NULL;
+static lookupEntry *strings_lookup = NULL;
+
+// Namespaces of the clients lookup table
+enum client_key_type {
+	CLIENT_KEY_IPV4 = 1,
+	CLIENT_KEY_IPV6,
+	CLIENT_KEY_ALIAS,
+	CLIENT_KEY_STRING
+} __attribute__ ((packed));
 
 typedef struct {
 	struct {
 		pthread_mutex_t outer;
 		pthread_mutex_t inner;
+		pthread_rwlock_t rw;
+		volatile bool rw_exclusive;
 	} lock;
 	struct {
 		volatile pid_t pid;
@@ -104,14 +217,41 @@ typedef struct {
 static ShmLock *shmLock = NULL;
 static ShmSettings *shmSettings = NULL;
 
+// Statistics of the string buffer compaction
+static struct {
+	unsigned int generation;
+	size_t last_freed;
+	size_t total_freed;
+} strings_gc = { 0 };
+
+// Number of shared (read-only) locks held by the current thread
+static __thread unsigned int shared_locks = 0;
+
+// Lock profiling: call site and time of the currently held locks
+static lock_site *exclusive_site = NULL;
+static uint64_t exclusive_since = 0;
+static __thread lock_site *shared_site = NULL;
+static __thread uint64_t shared_since = 0;
+
 static int pagesize;
+// Size of (transparent) huge pages, zero if huge pages are not used
+static size_t hugepagesize = 0;
 static unsigned int local_shm_counter = 0;
+// Generations of the objects as mapped by this process
+static unsigned int local_generations[SHM_MAX_OBJECTS] = { 0 };
 static pid_t shmem_pid = 0;
 static size_t used_shmem = 0u;
-static size_t get_optimal_object_size(const size_t objsize, const size_t minsize);
+static size_t get_optimal_object_size(const size_t objsize, const size_t minsize, const bool huge);
 
 // Private prototypes
 static void *enlarge_shmem_struct(const char type);
+static void detect_hugepages(void);
+static void advise_hugepages(SharedMemory *sharedMemory);
+static void resize_domains_lookup(void);
+static void resize_clients_lookup(void);
+static void resize_dns_cache_lookup(void);
+static void resize_queries_lookup(void);
+static void resize_strings_lookup(void);
 
 static int get_dev_shm_usage(char buffer[64])
 {
@@ -136,11 +276,11 @@ static int get_dev_shm_usage(char buffer[64])
 static void verify_shmem_pid(void)
 {
 	// Open shared memory settings object
-	const int settingsfd = shm_open(SHARED_SETTINGS_NAME, O_RDONLY, S_IRUSR | S_IWUSR);
+	const int settingsfd = shm_open(shm_settings.name, O_RDONLY, S_IRUSR | S_IWUSR);
 	if(settingsfd == -1)
 	{
 		logg("FATAL: verify_shmem_pid(): Failed to open shared memory object \"%s\": %s",
-			SHARED_SETTINGS_NAME, strerror(errno));
+			shm_settings.name, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
@@ -148,7 +288,7 @@ static void verify_shmem_pid(void)
 	if(read(settingsfd, &shms, sizeof(shms)) != sizeof(shms))
 	{
 		logg("FATAL: verify_shmem_pid(): Failed to read %zu bytes from shared memory object \"%s\": %s",
-			sizeof(shms), SHARED_SETTINGS_NAME, strerror(errno));
+			sizeof(shms), shm_settings.name, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
@@ -258,6 +398,271 @@ bool strcmp_escaped(const char *a, const char *b)
 }
 
 
+// Return the number of slots a lookup table needs to index num objects. This is
+// the smallest power of two with at most 50% load, but at least one page
+static size_t __attribute__((pure)) get_lookup_size(const size_t num, const size_t objsize)
+{
+	size_t size = 1u;
+	while(size < 2*num || size*objsize < (size_t)pagesize)
+		size <<= 1;
+	return size;
+}
+
+// Mark all slots of a lookup table as empty
+static void clear_lookup(lookupEntry *table, const size_t size)
+{
+	for(size_t i = 0; i < size; i++)
+	{
+		table[i].hash = 0u;
+		table[i].id = -1;
+	}
+}
+
+// Insert an object into a lookup table using linear probing. The table can
+// never be full as it is always kept at most half-filled
+static void insert_lookup(lookupEntry *table, const size_t size, const uint32_t hash, const int id)
+{
+	const size_t mask = size - 1;
+	size_t i = hash & mask;
+	while(table[i].id != -1)
+		i = (i + 1) & mask;
+
+	table[i].hash = hash;
+	table[i].id = id;
+}
+
+// Domains stored in compressed form (see COMPRESS_DOMAINS) start with this
+// byte, followed by their first label, a terminating zero and the position of
+// the remainder of the domain. The remainder is stored the same way (or in
+// full), so domains sharing a suffix share its storage like DNS name
+// compression pointers do. The byte is escaped in all other strings
+#define COMPRESSED_DOMAIN '\x01'
+// Domains are split into at most this many nodes, the remainder is stored in
+// full. Labels are limited to 63 characters by RFC 1035
+#define COMPRESSED_DEPTH_MAX 8
+#define COMPRESSED_LABEL_MAX 63
+// Size of the buffers compressed domains are expanded into by getstr()
+#define EXPANDED_DOMAIN_LEN 1024
+#define EXPANDED_DOMAIN_BUFFERS 16
+
+// Spaces would break our telnet API which uses them as delimiters, the marker
+// byte of compressed domains must not appear in any other string
+static inline char __attribute__((const)) escape_char(const char c)
+{
+	return c == ' ' || c == COMPRESSED_DOMAIN ? '~' : c;
+}
+
+// Hash len bytes of a string as they would be stored after escaping (see
+// str_escape()) without actually creating an escaped copy of the string. N is
+// set to the number of characters that need to be escaped
+static uint32_t __attribute__((pure)) hash_escaped(const char *input, const size_t len, unsigned int *N)
+{
+	// Jenkins' One-at-a-Time hash
+	uint32_t hash = 0;
+	*N = 0;
+	for(size_t i = 0; i < len; i++)
+	{
+		char c = input[i];
+		if(c == ' ' || c == COMPRESSED_DOMAIN)
+		{
+			c = '~';
+			(*N)++;
+		}
+		hash += c;
+		hash += hash << 10;
+		hash ^= hash >> 6;
+	}
+
+	hash += hash << 3;
+	hash ^= hash >> 11;
+	hash += hash << 15;
+	return hash;
+}
+
+// Compare the first len bytes of input (escaped on the fly) with an already
+// stored string
+static bool __attribute__((pure)) equal_escaped(const char *stored, const char *input, const size_t len)
+{
+	for(size_t i = 0; i < len; i++)
+	{
+		const char c = escape_char(input[i]);
+		if(stored[i] != c)
+			return false;
+	}
+	// The stored string has to end here as well
+	return stored[len] == '\0';
+}
+
+// Find a string in the strings lookup table. The base pointer is the string
+// buffer the lookup table refers to. Returns -1 if the string is not known
+static int __attribute__((pure)) find_string(const char *base, const uint32_t hash, const char *input, const size_t len)
+{
+	const size_t mask = counters->strings_lookup_MAX - 1;
+	for(size_t i = hash & mask; strings_lookup[i].id != -1; i = (i + 1) & mask)
+	{
+		const int pos = strings_lookup[i].id;
+		if(strings_lookup[i].hash == hash &&
+		   equal_escaped(&base[pos], input, len))
+			return pos;
+	}
+
+	// Not found
+	return -1;
+}
+
+static void insert_string_lookup(const uint32_t hash, const size_t pos)
+{
+	insert_lookup(strings_lookup, counters->strings_lookup_MAX, hash, (int)pos);
+	counters->strings++;
+}
+
+// Encode a node of a compressed domain: the label (escaped) and the position
+// of the remainder. Returns the length of the node
+static size_t encode_domain_node(char node[2 + COMPRESSED_LABEL_MAX + sizeof(uint32_t)],
+                                 const char *label, const size_t len, const uint32_t suffix)
+{
+	node[0] = COMPRESSED_DOMAIN;
+	for(size_t i = 0; i < len; i++)
+		node[1 + i] = escape_char(label[i]);
+	node[1 + len] = '\0';
+	memcpy(&node[2 + len], &suffix, sizeof(suffix));
+	return 2 + len + sizeof(suffix);
+}
+
+// Find a node of a compressed domain in the strings lookup table. The base
+// pointer is the string buffer the lookup table refers to. Returns -1 if the
+// node is not known
+static int __attribute__((pure)) find_domain_node(const char *base, const uint32_t hash, const char *node, const size_t len)
+{
+	const size_t mask = counters->strings_lookup_MAX - 1;
+	for(size_t i = hash & mask; strings_lookup[i].id != -1; i = (i + 1) & mask)
+	{
+		const int pos = strings_lookup[i].id;
+		if(strings_lookup[i].hash == hash && base[pos] == COMPRESSED_DOMAIN &&
+		   strcmp(&base[pos + 1], &node[1]) == 0 &&
+		   memcmp(&base[pos + len - sizeof(uint32_t)], &node[len - sizeof(uint32_t)], sizeof(uint32_t)) == 0)
+			return pos;
+	}
+
+	// Not found
+	return -1;
+}
+
+// Store a node of a compressed domain unless it is already known
+static int add_domain_node(const char *node, const size_t len)
+{
+	unsigned int N = 0;
+	const uint32_t hash = hash_escaped(node, len, &N);
+	const int known = find_domain_node(shm_strings.ptr, hash, node, len);
+	if(known > -1)
+		return known;
+
+	if(shm_strings.size - shmSettings->next_str_pos < len)
+		return -1;
+
+	const size_t pos = shmSettings->next_str_pos;
+	memcpy(&((char*)shm_strings.ptr)[pos], node, len);
+	shmSettings->next_str_pos += len;
+	insert_string_lookup(hash, pos);
+
+	return pos;
+}
+
+// Store a domain split into its first label and the (recursively compressed)
+// remainder. Only domains with at least three labels are split, shorter ones
+// are stored in full
+static size_t add_compressed_domain(const char *domain, const unsigned int depth)
+{
+	const char *dot = strchr(domain, '.');
+	if(depth >= COMPRESSED_DEPTH_MAX || dot == NULL || dot == domain ||
+	   dot - domain > COMPRESSED_LABEL_MAX || strchr(dot + 1, '.') == NULL)
+		return addstr(domain);
+
+	const size_t suffix = add_compressed_domain(dot + 1, depth + 1);
+
+	char node[2 + COMPRESSED_LABEL_MAX + sizeof(uint32_t)];
+	const size_t len = encode_domain_node(node, domain, dot - domain, (uint32_t)suffix);
+	const int pos = add_domain_node(node, len);
+
+	// Store the domain in full if there is not enough memory left
+	return pos > -1 ? (size_t)pos : addstr(domain);
+}
+
+// Store a domain, compressed if enabled in pihole-FTL.conf. The position can
+// be used with getstr() the same way as those returned by addstr()
+size_t adddomain(const char *domain)
+{
+	if(!config.compress_domains || domain == NULL)
+		return addstr(domain);
+
+	return add_compressed_domain(domain, 0);
+}
+
+// Expand a compressed domain into one of a few thread-local buffers. The
+// returned string remains valid until EXPANDED_DOMAIN_BUFFERS more compressed
+// domains have been expanded by the same thread
+static const char *expand_domain(size_t pos)
+{
+	static __thread char expanded[EXPANDED_DOMAIN_BUFFERS][EXPANDED_DOMAIN_LEN];
+	static __thread unsigned int next = 0;
+	char *buffer = expanded[next++ % EXPANDED_DOMAIN_BUFFERS];
+
+	const char *base = shm_strings.ptr;
+	size_t len = 0;
+	for(unsigned int depth = 0; depth <= COMPRESSED_DEPTH_MAX && pos < shmSettings->next_str_pos; depth++)
+	{
+		const char *str = &base[pos];
+		const bool compressed = str[0] == COMPRESSED_DOMAIN;
+		if(compressed)
+			str++;
+
+		const size_t n = strlen(str);
+		if(len + n + 2 > EXPANDED_DOMAIN_LEN)
+			break;
+		memcpy(&buffer[len], str, n);
+		len += n;
+
+		if(!compressed)
+			break;
+
+		// Continue with the remainder of the domain
+		uint32_t suffix = 0;
+		memcpy(&suffix, &str[n + 1], sizeof(suffix));
+		pos = suffix;
+		buffer[len++] = '.';
+	}
+	buffer[len] = '\0';
+
+	return buffer;
+}
+
+static void resize_strings_lookup(void)
+{
+	// Save the current content of the table. We re-insert entries based on
+	// their stored hash so we do not have to re-hash the strings themselves
+	const size_t oldsize = counters->strings_lookup_MAX;
+	lookupEntry *old = calloc(oldsize, sizeof(lookupEntry));
+	if(old == NULL)
+	{
+		logg("FATAL: Memory allocation failed! Exiting");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(old, strings_lookup, oldsize*sizeof(lookupEntry));
+
+	const size_t size = get_lookup_size(counters->strings + 1, sizeof(lookupEntry));
+	realloc_shm(&shm_strings_lookup, size, sizeof(lookupEntry), true);
+	strings_lookup = (lookupEntry*)shm_strings_lookup.ptr;
+	counters->strings_lookup_MAX = size;
+
+	// Re-insert all entries into the resized table
+	clear_lookup(strings_lookup, size);
+	for(size_t i = 0; i < oldsize; i++)
+		if(old[i].id != -1)
+			insert_lookup(strings_lookup, size, old[i].hash, old[i].id);
+
+	free(old);
+}
+
 size_t addstr(const char *input)
 {
 	if(input == NULL)
@@ -289,32 +694,47 @@ size_t addstr(const char *input)
 		len = avail_mem;
 	}
 
+	// Check if this string is already stored in the shared string buffer. If
+	// so, we can simply return its position instead of storing it again
 	unsigned int N = 0;
-	char *str = str_escape(input, &N);
+	const uint32_t hash = hash_escaped(input, len - 1, &N);
+	const int known = find_string(shm_strings.ptr, hash, input, len - 1);
+	if(known > -1)
+		return known;
 
 	if(N > 0)
-		logg("INFO: FTL replaced %u invalid characters with ~ in the query \"%s\"", N, str);
+		logg("INFO: FTL replaced %u invalid characters with ~ in the query \"%.*s\"", N, (int)(len - 1), input);
 
 	// Debugging output
 	if(config.debug & DEBUG_SHMEM)
-		logg("Adding \"%s\" (len %zu) to buffer. next_str_pos is %u", str, len, shmSettings->next_str_pos);
+		logg("Adding \"%.*s\" (len %zu) to buffer. next_str_pos is %u", (int)(len - 1), input, len, shmSettings->next_str_pos);
 
-	// Copy the C string pointed by str into the shared string buffer
-	strncpy(&((char*)shm_strings.ptr)[shmSettings->next_str_pos], str, len);
-	free(str);
+	// Copy the C string pointed by input into the shared string buffer. Any
+	// spaces are replaced by ~ as our telnet API uses space delimiters
+	const size_t pos = shmSettings->next_str_pos;
+	char *dest = &((char*)shm_strings.ptr)[pos];
+	for(size_t i = 0; i < len - 1; i++)
+		dest[i] = escape_char(input[i]);
+	dest[len - 1] = '\0';
 
 	// Increment string length counter
 	shmSettings->next_str_pos += len;
 
+	// Remember where this string is stored
+	insert_string_lookup(hash, pos);
+
 	// Return start of stored string
-	return (shmSettings->next_str_pos - len);
+	return pos;
 }
 
 const char *_getstr(const size_t pos, const char *func, const int line, const char *file)
 {
 	// Only access the string memory if this memory region has already been set
 	if(pos < shmSettings->next_str_pos)
-		return &((const char*)shm_strings.ptr)[pos];
+	{
+		const char *str = &((const char*)shm_strings.ptr)[pos];
+		return str[0] == COMPRESSED_DOMAIN ? expand_domain(pos) : str;
+	}
 	else
 	{
 		logg("WARN: Tried to access %zu in %s() (%s:%i) but next_str_pos is %u", pos, func, file, line, shmSettings->next_str_pos);
@@ -322,6 +742,746 @@ const char *_getstr(const size_t pos, const char *func, const int line, const ch
 	}
 }
 
+// Rehash all known domains into the (possibly resized) lookup table
+static void rehash_domains_lookup(void)
+{
+	const size_t size = counters->domains_lookup_MAX;
+	clear_lookup(domains_lookup, size);
+	for(int domainID = 0; domainID < counters->domains; domainID++)
+	{
+		if(domains[domainID].magic != MAGICBYTE)
+			continue;
+		insert_lookup(domains_lookup, size, domains[domainID].domainhash, domainID);
+	}
+}
+
+static void resize_domains_lookup(void)
+{
+	const size_t size = get_lookup_size(counters->domains_MAX, sizeof(lookupEntry));
+	realloc_shm(&shm_domains_lookup, size, sizeof(lookupEntry), true);
+	domains_lookup = (lookupEntry*)shm_domains_lookup.ptr;
+	counters->domains_lookup_MAX = size;
+
+	// The slot of each domain depends on the table size, hence, all
+	// entries have to be re-inserted
+	rehash_domains_lookup();
+}
+
+// Find a domain in the lookup table. Returns -1 if the domain is not known
+int find_domain_lookup(const uint32_t hash, const char *domain)
+{
+	const size_t mask = counters->domains_lookup_MAX - 1;
+	for(size_t i = hash & mask; domains_lookup[i].id != -1; i = (i + 1) & mask)
+	{
+		// Quicker test: Does the domain match the pre-computed hash?
+		if(domains_lookup[i].hash != hash)
+			continue;
+
+		// If so, compare the full domain using strcmp
+		const int domainID = domains_lookup[i].id;
+		if(domains[domainID].magic == MAGICBYTE &&
+		   strcmp(getstr(domains[domainID].domainpos), domain) == 0)
+			return domainID;
+	}
+
+	// Not found
+	return -1;
+}
+
+// Add a new domain to the lookup table
+void add_domain_lookup(const uint32_t hash, const int domainID)
+{
+	insert_lookup(domains_lookup, counters->domains_lookup_MAX, hash, domainID);
+}
+
+// Jenkins' One-at-a-Time hash over a binary buffer
+static uint32_t __attribute__((pure)) hashBytes(const unsigned char *buf, const size_t len)
+{
+	uint32_t hash = 0;
+	for(size_t i = 0; i < len; i++)
+	{
+		hash += buf[i];
+		hash += hash << 10;
+		hash ^= hash >> 6;
+	}
+
+	hash += hash << 3;
+	hash ^= hash >> 11;
+	hash += hash << 15;
+	return hash;
+}
+
+// Compute the lookup key of a client. IP addresses are stored in their binary
+// form, alias-clients are stored by their ID in a separate namespace. Anything
+// else (should not happen) is stored by the hash of its string
+static void get_client_key(const char *clientIP, const bool aliasclient, clientLookupEntry *key)
+{
+	memset(key, 0, sizeof(*key));
+	int aliasclient_id = 0;
+	if(aliasclient && sscanf(clientIP, "aliasclient-%i", &aliasclient_id) == 1)
+	{
+		key->type = CLIENT_KEY_ALIAS;
+		memcpy(key->addr, &aliasclient_id, sizeof(aliasclient_id));
+	}
+	else if(inet_pton(AF_INET, clientIP, key->addr) == 1)
+		key->type = CLIENT_KEY_IPV4;
+	else if(inet_pton(AF_INET6, clientIP, key->addr) == 1)
+		key->type = CLIENT_KEY_IPV6;
+	else
+	{
+		key->type = CLIENT_KEY_STRING;
+		key->hash = hashStr(clientIP);
+		return;
+	}
+
+	// Include the namespace in the hash so that, e.g., alias-client 1 and
+	// IPv4 address 1.0.0.0 do not share a common probe sequence
+	key->hash = hashBytes(key->addr, sizeof(key->addr)) ^ key->type;
+}
+
+static void insert_client_lookup(const clientLookupEntry *key, const int clientID)
+{
+	const size_t mask = counters->clients_lookup_MAX - 1;
+	size_t i = key->hash & mask;
+	while(clients_lookup[i].id != -1)
+		i = (i + 1) & mask;
+
+	clients_lookup[i] = *key;
+	clients_lookup[i].id = clientID;
+}
+
+static void resize_clients_lookup(void)
+{
+	// Save the current content of the table. We cannot rely on re-creating
+	// the keys from the clients' strings here as the alias-client flag may
+	// not have been set yet
+	const size_t oldsize = counters->clients_lookup_MAX;
+	clientLookupEntry *old = calloc(oldsize, sizeof(clientLookupEntry));
+	if(old == NULL)
+	{
+		logg("FATAL: Memory allocation failed! Exiting");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(old, clients_lookup, oldsize*sizeof(clientLookupEntry));
+
+	const size_t size = get_lookup_size(counters->clients_MAX, sizeof(clientLookupEntry));
+	realloc_shm(&shm_clients_lookup, size, sizeof(clientLookupEntry), true);
+	clients_lookup = (clientLookupEntry*)shm_clients_lookup.ptr;
+	counters->clients_lookup_MAX = size;
+
+	// Re-insert all entries into the resized table
+	for(size_t i = 0; i < size; i++)
+		clients_lookup[i].id = -1;
+	for(size_t i = 0; i < oldsize; i++)
+		if(old[i].id != -1)
+			insert_client_lookup(&old[i], old[i].id);
+
+	free(old);
+}
+
+// Find a client in the lookup table. Returns -1 if the client is not known
+int find_client_lookup(const char *clientIP, const bool aliasclient)
+{
+	clientLookupEntry key;
+	get_client_key(clientIP, aliasclient, &key);
+
+	const size_t mask = counters->clients_lookup_MAX - 1;
+	for(size_t i = key.hash & mask; clients_lookup[i].id != -1; i = (i + 1) & mask)
+	{
+		const clientLookupEntry *entry = &clients_lookup[i];
+		if(entry->hash != key.hash || entry->type != key.type ||
+		   memcmp(entry->addr, key.addr, sizeof(key.addr)) != 0)
+			continue;
+
+		const int clientID = entry->id;
+		if(clients[clientID].magic != MAGICBYTE)
+			continue;
+
+		// Only clients without a binary key need a full string comparison
+		if(key.type == CLIENT_KEY_STRING &&
+		   strcmp(getstr(clients[clientID].ippos), clientIP) != 0)
+			continue;
+
+		return clientID;
+	}
+
+	// Not found
+	return -1;
+}
+
+// Add a new client to the lookup table
+void add_client_lookup(const char *clientIP, const bool aliasclient, const int clientID)
+{
+	clientLookupEntry key;
+	get_client_key(clientIP, aliasclient, &key);
+	insert_client_lookup(&key, clientID);
+}
+
+// Remove reclaimed domains and clients from the lookup tables. Entries cannot
+// be deleted from the middle of a probe sequence, the tables are rebuilt
+void purge_lookups(void)
+{
+	rehash_domains_lookup();
+
+	const size_t size = counters->clients_lookup_MAX;
+	clientLookupEntry *old = calloc(size, sizeof(clientLookupEntry));
+	if(old == NULL)
+	{
+		logg("FATAL: Memory allocation failed! Exiting");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(old, clients_lookup, size*sizeof(clientLookupEntry));
+
+	for(size_t i = 0; i < size; i++)
+		clients_lookup[i].id = -1;
+	for(size_t i = 0; i < size; i++)
+		if(old[i].id != -1 && clients[old[i].id].magic == MAGICBYTE)
+			insert_client_lookup(&old[i], old[i].id);
+
+	free(old);
+}
+
+// Compute the hash of the (domainID, clientID, query_type) tuple identifying
+// a DNS cache entry
+static uint32_t __attribute__((pure)) hash_dns_cache_key(const int domainID, const int clientID, const enum query_types query_type)
+{
+	const int key[3] = { domainID, clientID, query_type };
+	return hashBytes((const unsigned char*)key, sizeof(key));
+}
+
+// Rehash all DNS cache entries into the (possibly resized) lookup table
+static void rehash_dns_cache_lookup(void)
+{
+	const size_t size = counters->dns_cache_lookup_MAX;
+	clear_lookup(dns_cache_lookup, size);
+	for(int cacheID = 0; cacheID < counters->dns_cache_size; cacheID++)
+	{
+		const DNSCacheData *entry = &dns_cache[cacheID];
+		if(entry->magic != MAGICBYTE)
+			continue;
+		insert_lookup(dns_cache_lookup, size,
+		              hash_dns_cache_key(entry->domainID, entry->clientID, entry->query_type),
+		              cacheID);
+	}
+}
+
+static void resize_dns_cache_lookup(void)
+{
+	const size_t size = get_lookup_size(counters->dns_cache_MAX, sizeof(lookupEntry));
+	realloc_shm(&shm_dns_cache_lookup, size, sizeof(lookupEntry), true);
+	dns_cache_lookup = (lookupEntry*)shm_dns_cache_lookup.ptr;
+	counters->dns_cache_lookup_MAX = size;
+
+	// The slot of each entry depends on the table size, hence, all
+	// entries have to be re-inserted
+	rehash_dns_cache_lookup();
+}
+
+// Remove the DNS cache entries of reclaimed domains and clients and those not
+// looked up since before. The remaining entries are moved to the front of the
+// array so it does not grow when new domains and clients take over the
+// reclaimed slots. Cache IDs are not remembered across lock boundaries, only
+// the lookup table has to be rebuilt. Returns the number of removed entries
+int purge_dns_cache(const time_t before)
+{
+	const uint16_t before_hour = (uint16_t)(before / 3600);
+	int kept = 0;
+	for(int cacheID = 0; cacheID < counters->dns_cache_size; cacheID++)
+	{
+		const DNSCacheData *entry = &dns_cache[cacheID];
+		if(entry->magic != MAGICBYTE ||
+		   entry->domainID < 0 || entry->domainID >= counters->domains ||
+		   domains[entry->domainID].magic != MAGICBYTE ||
+		   entry->clientID < 0 || entry->clientID >= counters->clients ||
+		   clients[entry->clientID].magic != MAGICBYTE)
+			continue;
+
+		// Only entries whose last lookup was in an hour which ended
+		// before are stale. The hours wrap around after seven years
+		const uint16_t age = before_hour - entry->last_hour;
+		if(age > 0u && age < 0x8000u)
+			continue;
+
+		if(kept != cacheID)
+			dns_cache[kept] = *entry;
+		kept++;
+	}
+
+	const int removed = counters->dns_cache_size - kept;
+	if(removed == 0)
+		return 0;
+
+	memset(&dns_cache[kept], 0, removed*sizeof(DNSCacheData));
+	counters->dns_cache_size = kept;
+	rehash_dns_cache_lookup();
+
+	return removed;
+}
+
+// Find a DNS cache entry in the lookup table. Returns -1 if there is no entry
+// for the given tuple
+int find_dns_cache_lookup(const int domainID, const int clientID, const enum query_types query_type)
+{
+	const uint32_t hash = hash_dns_cache_key(domainID, clientID, query_type);
+	const size_t mask = counters->dns_cache_lookup_MAX - 1;
+	for(size_t i = hash & mask; dns_cache_lookup[i].id != -1; i = (i + 1) & mask)
+	{
+		if(dns_cache_lookup[i].hash != hash)
+			continue;
+
+		const DNSCacheData *entry = &dns_cache[dns_cache_lookup[i].id];
+		if(entry->magic == MAGICBYTE &&
+		   entry->domainID == domainID &&
+		   entry->clientID == clientID &&
+		   entry->query_type == query_type)
+			return dns_cache_lookup[i].id;
+	}
+
+	// Not found
+	return -1;
+}
+
+// Add a new DNS cache entry to the lookup table
+void add_dns_cache_lookup(const int domainID, const int clientID, const enum query_types query_type, const int cacheID)
+{
+	insert_lookup(dns_cache_lookup, counters->dns_cache_lookup_MAX,
+	              hash_dns_cache_key(domainID, clientID, query_type), cacheID);
+}
+
+// Translate a logical query ID into the slot of the queries ring buffer. The
+// oldest query in memory (logical ID 0) is stored at slot queries_tail
+static inline int __attribute__((pure)) query_slot(const int queryID)
+{
+	return (counters->queries_tail + queryID) % counters->queries_MAX;
+}
+
+// Insert a query into the lookup table. The table stores the ring buffer slot
+// of the query as it does not change during the lifetime of a query (as
+// opposed to the logical query ID). dnsmasq IDs are unique, however, if we
+// should encounter the same ID twice, the more recent query takes over. The
+// dnsmasq IDs are used as hashes directly as they are strictly increasing and,
+// hence, map onto consecutive slots
+static void insert_query_lookup(const int id, const int slot)
+{
+	const size_t mask = counters->queries_lookup_MAX - 1;
+	size_t i = (uint32_t)id & mask;
+	while(queries_lookup[i].id != -1 && queries_lookup[i].hash != (uint32_t)id)
+		i = (i + 1) & mask;
+
+	queries_lookup[i].hash = (uint32_t)id;
+	queries_lookup[i].id = slot;
+}
+
+// Remove a query from the lookup table. Subsequent entries are shifted back so
+// we do not have to leave tombstones behind which would lengthen the probe
+// sequences over time
+static void delete_query_lookup(const int id, const int slot)
+{
+	const size_t mask = counters->queries_lookup_MAX - 1;
+	size_t i = (uint32_t)id & mask;
+	while(queries_lookup[i].id != -1 &&
+	      (queries_lookup[i].hash != (uint32_t)id || queries_lookup[i].id != slot))
+		i = (i + 1) & mask;
+
+	// Not found
+	if(queries_lookup[i].id == -1)
+		return;
+
+	for(size_t j = (i + 1) & mask; queries_lookup[j].id != -1; j = (j + 1) & mask)
+	{
+		// Move the entry at j into the hole at i unless its home slot
+		// lies cyclically in (i, j]
+		const size_t home = queries_lookup[j].hash & mask;
+		if(((j - home) & mask) < ((j - i) & mask))
+			continue;
+		queries_lookup[i] = queries_lookup[j];
+		i = j;
+	}
+	queries_lookup[i].hash = 0u;
+	queries_lookup[i].id = -1;
+}
+
+// Re-insert all queries currently in memory into the lookup table
+static void rehash_queries_lookup(void)
+{
+	clear_lookup(queries_lookup, counters->queries_lookup_MAX);
+	for(int queryID = 0; queryID < counters->queries; queryID++)
+	{
+		const int slot = query_slot(queryID);
+		if(queries[slot].magic != MAGICBYTE)
+			continue;
+		insert_query_lookup(queries[slot].id, slot);
+	}
+}
+
+static void resize_queries_lookup(void)
+{
+	const size_t size = get_lookup_size(counters->queries_MAX, sizeof(lookupEntry));
+	realloc_shm(&shm_queries_lookup, size, sizeof(lookupEntry), true);
+	queries_lookup = (lookupEntry*)shm_queries_lookup.ptr;
+	counters->queries_lookup_MAX = size;
+
+	rehash_queries_lookup();
+}
+
+// Find the query with a given dnsmasq ID. Returns -1 if the query is not known
+int find_query_lookup(const int id)
+{
+	const size_t mask = counters->queries_lookup_MAX - 1;
+	for(size_t i = (uint32_t)id & mask; queries_lookup[i].id != -1; i = (i + 1) & mask)
+	{
+		if(queries_lookup[i].hash != (uint32_t)id)
+			continue;
+
+		// Verify the query is (still) what we expect it to be
+		const int slot = queries_lookup[i].id;
+		const int queryID = (slot - counters->queries_tail + counters->queries_MAX) % counters->queries_MAX;
+		if(queryID < counters->queries &&
+		   queries[slot].magic == MAGICBYTE &&
+		   queries[slot].id == id)
+			return queryID;
+
+		// There can be only one slot per dnsmasq ID
+		break;
+	}
+
+	// Not found
+	return -1;
+}
+
+// Add a new query to the lookup table
+void add_query_lookup(const int id, const int queryID)
+{
+	insert_query_lookup(id, query_slot(queryID));
+}
+
+// Remove the num oldest queries from memory. This only advances the tail of
+// the queries ring buffer, no memory has to be moved. The logical IDs of all
+// remaining queries decrease by num
+void remove_oldest_queries(const int num)
+{
+	for(int queryID = 0; queryID < num && queryID < counters->queries; queryID++)
+	{
+		const int slot = query_slot(queryID);
+		delete_query_lookup(queries[slot].id, slot);
+		query_remove_inflight(&queries[slot]);
+		memset(&queries[slot], 0, sizeof(queriesData));
+	}
+
+	counters->queries_tail = query_slot(num);
+	counters->queries -= num;
+	counters->queries_seq += num;
+}
+
+// Queries get a sequence number which, unlike their logical ID, does not
+// change when older queries are removed. Sequence numbers of removed queries
+// do no longer map onto a query ID
+unsigned int query_seq(const int queryID)
+{
+	return counters->queries_seq + (unsigned int)queryID;
+}
+
+// Returns -1 if the query is not in memory (anymore)
+int seq_queryID(const unsigned int seq)
+{
+	const unsigned int queryID = seq - counters->queries_seq;
+	return queryID < (unsigned int)counters->queries ? (int)queryID : -1;
+}
+
+// Get the logical ID of a query from its position in the ring buffer
+int get_queryID(const queriesData *query)
+{
+	const int slot = (int)(query - queries);
+	return (slot - counters->queries_tail + counters->queries_MAX) % counters->queries_MAX;
+}
+
+// The queries ring buffer has been enlarged from oldMAX to queries_MAX slots.
+// If the used part of the ring wrapped around the end of the old buffer, we
+// move the part between tail and the old end to the end of the new buffer
+static void unwrap_queries(const int oldMAX)
+{
+	const int tail = counters->queries_tail;
+	if(tail + counters->queries <= oldMAX)
+		return;
+
+	const int num = oldMAX - tail;
+	const int newtail = counters->queries_MAX - num;
+	memmove(&queries[newtail], &queries[tail], num*sizeof(queriesData));
+	memset(&queries[tail], 0, (newtail - tail)*sizeof(queriesData));
+	counters->queries_tail = newtail;
+
+	// Slots of the moved queries have changed
+	rehash_queries_lookup();
+}
+
+static size_t relocate_string(char *newbuf, size_t *newpos, const size_t pos);
+
+// Copy a node of a compressed domain into the new (compacted) string buffer
+// after its remainder, which changes its position, too
+static size_t relocate_domain_node(char *newbuf, size_t *newpos, const char *str)
+{
+	const size_t label = strlen(&str[1]);
+	uint32_t suffix = 0;
+	memcpy(&suffix, &str[2 + label], sizeof(suffix));
+	suffix = (uint32_t)relocate_string(newbuf, newpos, suffix);
+
+	char node[2 + COMPRESSED_LABEL_MAX + sizeof(uint32_t)];
+	const size_t len = encode_domain_node(node, &str[1], label, suffix);
+	unsigned int N = 0;
+	const uint32_t hash = hash_escaped(node, len, &N);
+	const int known = find_domain_node(newbuf, hash, node, len);
+	if(known > -1)
+		return known;
+
+	memcpy(&newbuf[*newpos], node, len);
+	insert_string_lookup(hash, *newpos);
+	*newpos += len;
+
+	return *newpos - len;
+}
+
+// Copy a string into the new (compacted) string buffer unless an identical
+// string has already been copied before. Returns the new position of the string
+static size_t relocate_string(char *newbuf, size_t *newpos, const size_t pos)
+{
+	// Position zero is always the empty string
+	if(pos == 0 || pos >= shmSettings->next_str_pos)
+		return 0;
+
+	const char *str = &((const char*)shm_strings.ptr)[pos];
+	if(str[0] == COMPRESSED_DOMAIN)
+		return relocate_domain_node(newbuf, newpos, str);
+
+	const size_t len = strlen(str);
+	unsigned int N = 0;
+	const uint32_t hash = hash_escaped(str, len, &N);
+	const int known = find_string(newbuf, hash, str, len);
+	if(known > -1)
+		return known;
+
+	// Store string at the end of the new buffer
+	memcpy(&newbuf[*newpos], str, len + 1);
+	insert_string_lookup(hash, *newpos);
+	*newpos += len + 1;
+
+	return *newpos - len - 1;
+}
+
+// Remove all strings no longer referenced by any client, domain, or upstream
+// from the shared string buffer. All referenced strings are moved to the
+// beginning of the buffer and the positions stored in the objects are
+// rewritten accordingly. This has to be called while holding the SHM lock.
+// Returns the number of bytes freed
+size_t compact_strings(void)
+{
+	TIME_SCOPE("strings_compact");
+
+	const size_t oldsize = shmSettings->next_str_pos;
+	char *newbuf = calloc(oldsize, sizeof(char));
+	if(newbuf == NULL)
+	{
+		logg("WARN: Cannot compact shared strings: Memory allocation failed");
+		return 0;
+	}
+
+	// Start with an empty strings lookup table, it is re-populated with
+	// the positions in the new buffer
+	clear_lookup(strings_lookup, counters->strings_lookup_MAX);
+	counters->strings = 0;
+
+	// The verdict cache is keyed by the position of the group strings
+	clear_verdict_cache();
+
+	// Mark and copy all strings still in use. Position zero remains being
+	// the empty string
+	size_t newpos = 1;
+	for(int clientID = 0; clientID < counters->clients; clientID++)
+	{
+		clientsData *client = &clients[clientID];
+		if(client->magic != MAGICBYTE)
+			continue;
+		client->ippos = relocate_string(newbuf, &newpos, client->ippos);
+		client->namepos = relocate_string(newbuf, &newpos, client->namepos);
+		client->groupspos = relocate_string(newbuf, &newpos, client->groupspos);
+		client->ifacepos = relocate_string(newbuf, &newpos, client->ifacepos);
+	}
+	for(int domainID = 0; domainID < counters->domains; domainID++)
+	{
+		domainsData *domain = &domains[domainID];
+		if(domain->magic != MAGICBYTE)
+			continue;
+		domain->domainpos = relocate_string(newbuf, &newpos, domain->domainpos);
+	}
+	for(int upstreamID = 0; upstreamID < counters->upstreams; upstreamID++)
+	{
+		upstreamsData *upstream = &upstreams[upstreamID];
+		if(upstream->magic != MAGICBYTE)
+			continue;
+		upstream->ippos = relocate_string(newbuf, &newpos, upstream->ippos);
+		upstream->namepos = relocate_string(newbuf, &newpos, upstream->namepos);
+	}
+
+	// Replace the shared string buffer by the compacted one and zero out
+	// the no longer used remainder
+	memcpy(shm_strings.ptr, newbuf, newpos);
+	memset(&((char*)shm_strings.ptr)[newpos], 0, oldsize - newpos);
+	shmSettings->next_str_pos = newpos;
+	free(newbuf);
+
+	// Any string position obtained before this point is invalid now
+	strings_gc.generation++;
+	strings_gc.last_freed = oldsize - newpos;
+	strings_gc.total_freed += strings_gc.last_freed;
+
+	return strings_gc.last_freed;
+}
+
+// The string generation changes whenever compact_strings() has been run. Code
+// holding string positions across lock windows can use it to detect that
+// these positions have become invalid
+unsigned int __attribute__((pure)) get_strings_generation(void)
+{
+	return strings_gc.generation;
+}
+
+// Get usage statistics of the shared string buffer
+void get_shm_usage(unsigned int *resizes, unsigned int *remaps, size_t *allocated)
+{
+	*resizes = shmSettings->global_shm_counter;
+	*remaps = shmSettings->remaps;
+	*allocated = used_shmem;
+}
+
+// Get the number of live entries, the capacity and the bytes used and allocated
+// of the growing shared memory objects. The caller has to hold the SHM lock
+void get_shm_breakdown(struct shm_object_usage usage[SHM_USAGE_OBJECTS])
+{
+	memset(usage, 0, SHM_USAGE_OBJECTS*sizeof(*usage));
+
+	usage[SHM_USAGE_QUERIES].entries = counters->queries;
+	usage[SHM_USAGE_QUERIES].capacity = counters->queries_MAX;
+	usage[SHM_USAGE_QUERIES].used = counters->queries*sizeof(queriesData);
+	usage[SHM_USAGE_QUERIES].allocated = shm_queries.size + shm_queries_lookup.size;
+
+	usage[SHM_USAGE_CLIENTS].entries = counters->clients - counters->clients_reclaimed;
+	usage[SHM_USAGE_CLIENTS].capacity = counters->clients_MAX;
+	usage[SHM_USAGE_CLIENTS].used = counters->clients*sizeof(clientsData);
+	usage[SHM_USAGE_CLIENTS].allocated = shm_clients.size + shm_clients_lookup.size;
+
+	usage[SHM_USAGE_DOMAINS].entries = counters->domains - counters->domains_reclaimed;
+	usage[SHM_USAGE_DOMAINS].capacity = counters->domains_MAX;
+	usage[SHM_USAGE_DOMAINS].used = counters->domains*sizeof(domainsData);
+	usage[SHM_USAGE_DOMAINS].allocated = shm_domains.size + shm_domains_lookup.size;
+
+	usage[SHM_USAGE_UPSTREAMS].entries = counters->upstreams;
+	usage[SHM_USAGE_UPSTREAMS].capacity = counters->upstreams_MAX;
+	usage[SHM_USAGE_UPSTREAMS].used = counters->upstreams*sizeof(upstreamsData);
+	usage[SHM_USAGE_UPSTREAMS].allocated = shm_upstreams.size;
+
+	usage[SHM_USAGE_DNS_CACHE].entries = counters->dns_cache_size;
+	usage[SHM_USAGE_DNS_CACHE].capacity = counters->dns_cache_MAX;
+	usage[SHM_USAGE_DNS_CACHE].used = counters->dns_cache_size*sizeof(DNSCacheData);
+	usage[SHM_USAGE_DNS_CACHE].allocated = shm_dns_cache.size + shm_dns_cache_lookup.size;
+
+	usage[SHM_USAGE_STRINGS].entries = counters->strings;
+	usage[SHM_USAGE_STRINGS].used = shmSettings->next_str_pos;
+	usage[SHM_USAGE_STRINGS].allocated = shm_strings.size + shm_strings_lookup.size;
+
+	// One row of per_client_regex_words() words per client, entries are
+	// (client, regex) pairs
+	const unsigned int num_regex_tot = get_num_regex(REGEX_MAX);
+	const size_t row = per_client_regex_words()*sizeof(uint64_t);
+	usage[SHM_USAGE_PER_CLIENT_REGEX].entries = counters->clients*num_regex_tot;
+	usage[SHM_USAGE_PER_CLIENT_REGEX].capacity = row > 0 ? shm_per_client_regex.size/row*num_regex_tot : 0u;
+	usage[SHM_USAGE_PER_CLIENT_REGEX].used = counters->clients*row;
+	usage[SHM_USAGE_PER_CLIENT_REGEX].allocated = shm_per_client_regex.size;
+
+	// Chunk 0 is never used, free chunks are linked through their first
+	// value (see free_overTime_chunk())
+	unsigned int free_chunks = 0u;
+	for(unsigned int chunk = counters->overTime_chunks_free;
+	    chunk != 0u && chunk < (unsigned int)counters->overTime_chunks && free_chunks < (unsigned int)counters->overTime_chunks;
+	    chunk = (unsigned int)overTime_chunks[chunk].values[0])
+		free_chunks++;
+	const unsigned int chunks = counters->overTime_chunks - 1u - free_chunks;
+	usage[SHM_USAGE_OVERTIME].entries = chunks;
+	usage[SHM_USAGE_OVERTIME].capacity = counters->overTime_chunks_MAX - 1u;
+	usage[SHM_USAGE_OVERTIME].used = shm_overTime.size + chunks*sizeof(overTimeChunk);
+	usage[SHM_USAGE_OVERTIME].allocated = shm_overTime.size + shm_overTime_chunks.size;
+}
+
+const char * __attribute__((const)) get_shm_usage_name(const enum shm_usage_object object)
+{
+	switch(object)
+	{
+		case SHM_USAGE_QUERIES:
+			return "queries";
+		case SHM_USAGE_CLIENTS:
+			return "clients";
+		case SHM_USAGE_DOMAINS:
+			return "domains";
+		case SHM_USAGE_UPSTREAMS:
+			return "upstreams";
+		case SHM_USAGE_DNS_CACHE:
+			return "dns_cache";
+		case SHM_USAGE_STRINGS:
+			return "strings";
+		case SHM_USAGE_PER_CLIENT_REGEX:
+			return "per_client_regex";
+		case SHM_USAGE_OVERTIME:
+			return "overTime";
+		case SHM_USAGE_OBJECTS:
+			break;
+	}
+	return "unknown";
+}
+
+// Get how often the i-th shared memory object has been resized and remapped
+void get_shm_object_usage(const unsigned int i, unsigned int *resizes, unsigned int *remaps)
+{
+	*resizes = i < NUM_SHMEM ? shmSettings->objects[i].generation : 0u;
+	*remaps = i < NUM_SHMEM ? shmSettings->objects[i].remaps : 0u;
+}
+
+// Get the i-th shared memory object, NULL when there are no more objects
+const SharedMemory * __attribute__((const)) get_shm_object(const unsigned int i)
+{
+	if(i >= NUM_SHMEM)
+		return NULL;
+	return sharedMemories[i];
+}
+
+void get_strings_usage(size_t *used, size_t *allocated, size_t *last_freed, size_t *total_freed)
+{
+	*used = shmSettings->next_str_pos;
+	*allocated = shm_strings.size;
+	*last_freed = strings_gc.last_freed;
+	*total_freed = strings_gc.total_freed;
+}
+
+/// Create a readers-writer lock for shared memory
+static void create_rwlock(pthread_rwlock_t *lock) {
+	logg("Creating readers-writer lock");
+	pthread_rwlockattr_t lock_attr = {};
+
+	// Initialize the lock attributes
+	pthread_rwlockattr_init(&lock_attr);
+
+	// Allow the lock to be used by other processes
+	pthread_rwlockattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED);
+
+#ifdef __GLIBC__
+	// Prefer writers so the DNS resolver is not starved by readers
+	pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+
+	// Initialize the lock
+	pthread_rwlock_init(lock, &lock_attr);
+
+	// Destroy the lock attributes since we're done with it
+	pthread_rwlockattr_destroy(&lock_attr);
+}
+
 /// Create a mutex for shared memory
 static pthread_mutex_t create_mutex(void) {
 	logg("Creating mutex");
@@ -346,32 +1506,79 @@ static pthread_mutex_t create_mutex(void) {
 	return lock;
 }
 
+// Index of a shared memory object in sharedMemories[]
+static unsigned int __attribute__((pure)) shm_index(const SharedMemory *sharedMemory)
+{
+	unsigned int i = 0;
+	while(i < NUM_SHMEM - 1 && sharedMemories[i] != sharedMemory)
+		i++;
+	return i;
+}
+
+// Remap an object if another process resized it since we mapped it
+static bool remap_object(SharedMemory *sharedMemory, const size_t size1, const size_t size2)
+{
+	const unsigned int i = shm_index(sharedMemory);
+	if(local_generations[i] == shmSettings->objects[i].generation)
+		return false;
+
+	realloc_shm(sharedMemory, size1, size2, false);
+	local_generations[i] = shmSettings->objects[i].generation;
+	shmSettings->objects[i].remaps++;
+	return true;
+}
+
 static void remap_shm(void)
 {
-	// Remap shared object pointers which might have changed
-	realloc_shm(&shm_queries, counters->queries_MAX, sizeof(queriesData), false);
+	// Remap the objects which have been resized (their pointers might have
+	// changed), all others are still valid
+	bool remapped = false;
+	remapped |= remap_object(&shm_queries, counters->queries_MAX, sizeof(queriesData));
 	queries = (queriesData*)shm_queries.ptr;
 
-	realloc_shm(&shm_domains, counters->domains_MAX, sizeof(domainsData), false);
+	remapped |= remap_object(&shm_queries_lookup, counters->queries_lookup_MAX, sizeof(lookupEntry));
+	queries_lookup = (lookupEntry*)shm_queries_lookup.ptr;
+
+	remapped |= remap_object(&shm_domains, counters->domains_MAX, sizeof(domainsData));
 	domains = (domainsData*)shm_domains.ptr;
 
-	realloc_shm(&shm_clients, counters->clients_MAX, sizeof(clientsData), false);
+	remapped |= remap_object(&shm_domains_lookup, counters->domains_lookup_MAX, sizeof(lookupEntry));
+	domains_lookup = (lookupEntry*)shm_domains_lookup.ptr;
+
+	remapped |= remap_object(&shm_clients, counters->clients_MAX, sizeof(clientsData));
 	clients = (clientsData*)shm_clients.ptr;
 
-	realloc_shm(&shm_upstreams, counters->upstreams_MAX, sizeof(upstreamsData), false);
+	remapped |= remap_object(&shm_clients_lookup, counters->clients_lookup_MAX, sizeof(clientLookupEntry));
+	clients_lookup = (clientLookupEntry*)shm_clients_lookup.ptr;
+
+	remapped |= remap_object(&shm_upstreams, counters->upstreams_MAX, sizeof(upstreamsData));
 	upstreams = (upstreamsData*)shm_upstreams.ptr;
 
-	realloc_shm(&shm_dns_cache, counters->dns_cache_MAX, sizeof(DNSCacheData), false);
+	remapped |= remap_object(&shm_dns_cache, counters->dns_cache_MAX, sizeof(DNSCacheData));
 	dns_cache = (DNSCacheData*)shm_dns_cache.ptr;
 
-	realloc_shm(&shm_per_client_regex, counters->per_client_regex_MAX, sizeof(bool), false);
+	remapped |= remap_object(&shm_overTime_chunks, counters->overTime_chunks_MAX, sizeof(overTimeChunk));
+	overTime_chunks = (overTimeChunk*)shm_overTime_chunks.ptr;
+
+	remapped |= remap_object(&shm_trigram_chunks, trigram_index->chunks_MAX, sizeof(trigramChunk));
+	trigram_chunks = (trigramChunk*)shm_trigram_chunks.ptr;
+
+	remapped |= remap_object(&shm_dns_cache_lookup, counters->dns_cache_lookup_MAX, sizeof(lookupEntry));
+	dns_cache_lookup = (lookupEntry*)shm_dns_cache_lookup.ptr;
+
+	remapped |= remap_object(&shm_per_client_regex, counters->per_client_regex_MAX, sizeof(bool));
 	// per-client-regex bools are not exposed by a global pointer
 
-	realloc_shm(&shm_strings, counters->strings_MAX, sizeof(char), false);
+	remapped |= remap_object(&shm_strings, counters->strings_MAX, sizeof(char));
 	// strings are not exposed by a global pointer
 
+	remapped |= remap_object(&shm_strings_lookup, counters->strings_lookup_MAX, sizeof(lookupEntry));
+	strings_lookup = (lookupEntry*)shm_strings_lookup.ptr;
+
 	// Update local counter to reflect that we absorbed this change
 	local_shm_counter = shmSettings->global_shm_counter;
+	if(remapped)
+		shmSettings->remaps++;
 }
 
 // Obtain SHMEM lock
@@ -380,6 +1587,7 @@ void _lock_shm(const char *func, const int line, const char *file)
 	if(config.debug & DEBUG_LOCKS)
 		logg("Waiting for SHM lock in %s() (%s:%i)", func, file, line);
 
+	const uint64_t wait_start = monotonic_usec();
 	int result = pthread_mutex_lock(&shmLock->lock.outer);
 
 	if(result != 0)
@@ -394,8 +1602,32 @@ void _lock_shm(const char *func, const int line, const char *file)
 		result = pthread_mutex_consistent(&shmLock->lock.outer);
 		if(result != 0)
 			logg("Failed to make outer SHM lock consistent: %s", strerror(result));
+
+		// Readers-writer locks are not robust. If the dead process held
+		// the exclusive lock, nobody else can hold any lock as readers
+		// cannot enter when there is a writer. Hence, we can safely
+		// re-initialize the readers-writer lock here
+		if(shmLock->lock.rw_exclusive)
+		{
+			logg("Owner of outer SHM lock died while holding exclusive lock, re-initializing readers-writer lock");
+			create_rwlock(&shmLock->lock.rw);
+			shmLock->lock.rw_exclusive = false;
+		}
 	}
 
+	// Wait until all readers are gone. New readers are blocked from
+	// entering as soon as we are waiting here
+	result = pthread_rwlock_wrlock(&shmLock->lock.rw);
+	if(result != 0)
+		logg("Error when obtaining exclusive SHM lock: %s", strerror(result));
+	shmLock->lock.rw_exclusive = true;
+
+	// Account wait time to this call site
+	exclusive_since = monotonic_usec();
+	exclusive_site = lock_stats_site(func, line, file, false);
+	lock_stats_acquired(exclusive_site, exclusive_since - wait_start);
+	FTL_PROBE4(lock__acquire, func, file, line, exclusive_since - wait_start);
+
 	// Store lock owner after lock has been acquired and was made consistent (if required)
 	shmLock->owner.pid = getpid();
 	shmLock->owner.tid = gettid();
@@ -447,48 +1679,229 @@ void _unlock_shm(const char* func, const int line, const char * file)
 	shmLock->owner.pid = 0;
 	shmLock->owner.tid = 0;
 
-	if(config.debug & DEBUG_LOCKS)
-		logg("Removed lock in %s() (%s:%i)", func, file, line);
+	if(config.debug & DEBUG_LOCKS)
+		logg("Removed lock in %s() (%s:%i)", func, file, line);
+
+	if(result != 0)
+		logg("Failed to unlock inner SHM lock: %s", strerror(result));
+
+	// Account hold time to the call site that obtained the lock
+	const uint64_t held = monotonic_usec() - exclusive_since;
+	lock_stats_released(exclusive_site, held);
+	exclusive_site = NULL;
+	FTL_PROBE4(lock__release, func, file, line, held);
+
+	// Let readers in again
+	shmLock->lock.rw_exclusive = false;
+	result = pthread_rwlock_unlock(&shmLock->lock.rw);
+	if(result != 0)
+		logg("Failed to unlock exclusive SHM lock: %s", strerror(result));
+
+	result = pthread_mutex_unlock(&shmLock->lock.outer);
+	if(result != 0)
+		logg("Failed to unlock outer SHM lock: %s", strerror(result));
+}
+
+// Obtain shared (read-only) SHMEM lock. Any number of threads can hold a
+// shared lock at the same time, however, nobody can hold a shared lock while
+// someone else holds the exclusive lock (and vice versa). Shared memory must
+// not be modified while holding only a shared lock
+void _lock_shm_shared(const char *func, const int line, const char *file)
+{
+	if(config.debug & DEBUG_LOCKS)
+		logg("Waiting for shared SHM lock in %s() (%s:%i)", func, file, line);
+
+	const uint64_t wait_start = monotonic_usec();
+	while(true)
+	{
+		const int result = pthread_rwlock_rdlock(&shmLock->lock.rw);
+		if(result != 0)
+			logg("Error when obtaining shared SHM lock: %s", strerror(result));
+
+		// Check if this process needs to remap the shared memory objects
+		if(shmSettings == NULL ||
+		   local_shm_counter == shmSettings->global_shm_counter)
+			break;
+
+		// We cannot remap while other threads of this process may be
+		// reading. Obtain the exclusive lock once (which remaps the
+		// objects) and try again
+		pthread_rwlock_unlock(&shmLock->lock.rw);
+		_lock_shm(func, line, file);
+		_unlock_shm(func, line, file);
+	}
+
+	// Account wait time to this call site (only for the outermost shared
+	// lock of this thread)
+	if(shared_locks++ == 0)
+	{
+		shared_since = monotonic_usec();
+		shared_site = lock_stats_site(func, line, file, true);
+		lock_stats_acquired(shared_site, shared_since - wait_start);
+		FTL_PROBE4(lock__shared__acquire, func, file, line, shared_since - wait_start);
+	}
+
+	if(config.debug & DEBUG_LOCKS)
+		logg("Obtained shared SHM lock for %s() (%s:%i)", func, file, line);
+}
+
+// Release shared SHMEM lock
+void _unlock_shm_shared(const char* func, const int line, const char * file)
+{
+	if(config.debug & DEBUG_LOCKS && shared_locks == 0)
+		logg("ERROR: Tried to unlock shared lock but we do not hold any");
+
+	// Account hold time to the call site that obtained the lock
+	if(--shared_locks == 0)
+	{
+		const uint64_t held = monotonic_usec() - shared_since;
+		lock_stats_released(shared_site, held);
+		shared_site = NULL;
+		FTL_PROBE4(lock__shared__release, func, file, line, held);
+	}
+
+	const int result = pthread_rwlock_unlock(&shmLock->lock.rw);
+	if(result != 0)
+		logg("Failed to unlock shared SHM lock: %s", strerror(result));
+
+	if(config.debug & DEBUG_LOCKS)
+		logg("Removed shared lock in %s() (%s:%i)", func, file, line);
+}
+
+// Return if the current thread holds a shared lock
+bool is_shared_lock(void)
+{
+	return shared_locks > 0;
+}
+
+// Return if we locked this mutex (PID and TID match)
+bool is_our_lock(void)
+{
+	if(shmLock->owner.pid == getpid() &&
+	   shmLock->owner.tid == gettid())
+		return true;
+	return false;
+}
+
+// Create the shared memory objects of this process under private names so they
+// do not collide with the objects of a running FTL instance
+void shmem_private(void)
+{
+	private_pid = getpid();
+}
+
+bool init_shmem()
+{
+	// Get kernel's page size
+	pagesize = getpagesize();
+
+	// Check if we can (and should) use huge pages
+	detect_hugepages();
+
+	/****************************** shared memory lock ******************************/
+	// Try to create shared memory object
+	shm_lock = create_shm(SHARED_LOCK_NAME, sizeof(ShmLock));
+	if(shm_lock.ptr == NULL)
+		return false;
+
+	shmLock = (ShmLock*)shm_lock.ptr;
+	shmLock->lock.outer = create_mutex();
+	shmLock->lock.inner = create_mutex();
+	create_rwlock(&shmLock->lock.rw);
+	shmLock->lock.rw_exclusive = false;
+
+	/****************************** shared counters struct ******************************/
+	// Try to create shared memory object
+	shm_counters = create_shm(SHARED_COUNTERS_NAME, sizeof(countersStruct));
+	if(shm_counters.ptr == NULL)
+		return false;
+
+	counters = (countersStruct*)shm_counters.ptr;
+
+	/****************************** shared query counters struct ******************************/
+	// Try to create shared memory object
+	shm_query_counters = create_shm(SHARED_QUERY_COUNTERS_NAME, sizeof(queryCountersStruct));
+	if(shm_query_counters.ptr == NULL)
+		return false;
+
+	query_counters = (queryCountersStruct*)shm_query_counters.ptr;
+
+	/****************************** shared leaderboards struct ******************************/
+	// Try to create shared memory object. The leaderboards are invalid
+	// until they are built for the first time
+	shm_leaderboards = create_shm(SHARED_LEADERBOARDS_NAME, sizeof(leaderboardsStruct));
+	if(shm_leaderboards.ptr == NULL)
+		return false;
+
+	leaderboards = (leaderboardsStruct*)shm_leaderboards.ptr;
+
+	/****************************** shared heavy hitters sketch ******************************/
+	// Try to create shared memory object
+	shm_heavy_hitters = create_shm(SHARED_HEAVY_HITTERS_NAME, sizeof(heavyHittersStruct));
+	if(shm_heavy_hitters.ptr == NULL)
+		return false;
+
+	heavy_hitters = (heavyHittersStruct*)shm_heavy_hitters.ptr;
+
+	/****************************** shared cardinality sketches ******************************/
+	// Try to create shared memory object
+	shm_cardinality = create_shm(SHARED_CARDINALITY_NAME, sizeof(cardinalityStruct));
+	if(shm_cardinality.ptr == NULL)
+		return false;
+
+	cardinality = (cardinalityStruct*)shm_cardinality.ptr;
+
+	/****************************** shared trigram index of domains ******************************/
+	// Try to create shared memory object
+	shm_trigram_index = create_shm(SHARED_TRIGRAM_INDEX_NAME, sizeof(trigramIndexStruct));
+	if(shm_trigram_index.ptr == NULL)
+		return false;
+
+	trigram_index = (trigramIndexStruct*)shm_trigram_index.ptr;
+
+	const size_t trigram_chunks_MAX = get_optimal_object_size(sizeof(trigramChunk), TRIGRAM_CHUNKS_ALLOC_STEP, false);
+	shm_trigram_chunks = create_shm(SHARED_TRIGRAM_CHUNKS_NAME, trigram_chunks_MAX*sizeof(trigramChunk));
+	if(shm_trigram_chunks.ptr == NULL)
+		return false;
+	trigram_chunks = (trigramChunk*)shm_trigram_chunks.ptr;
+
+	trigram_index->chunks_MAX = trigram_chunks_MAX;
+	// Chunk zero marks empty buckets and is never handed out
+	trigram_index->chunks = 1;
 
-	if(result != 0)
-		logg("Failed to unlock inner SHM lock: %s", strerror(result));
+	/****************************** shared rate-limit wheel ******************************/
+	// Try to create shared memory object
+	shm_rate_limit = create_shm(SHARED_RATE_LIMIT_NAME, sizeof(rateLimitWheel));
+	if(shm_rate_limit.ptr == NULL)
+		return false;
 
-	result = pthread_mutex_unlock(&shmLock->lock.outer);
-	if(result != 0)
-		logg("Failed to unlock outer SHM lock: %s", strerror(result));
-}
+	rate_limit_wheel = (rateLimitWheel*)shm_rate_limit.ptr;
+	init_rate_limit_wheel();
 
-// Return if we locked this mutex (PID and TID match)
-bool is_our_lock(void)
-{
-	if(shmLock->owner.pid == getpid() &&
-	   shmLock->owner.tid == gettid())
-		return true;
-	return false;
-}
+	/****************************** shared query stream ring ******************************/
+	// Try to create shared memory object
+	shm_stream = create_shm(SHARED_STREAM_NAME, sizeof(streamRingStruct));
+	if(shm_stream.ptr == NULL)
+		return false;
 
-bool init_shmem()
-{
-	// Get kernel's page size
-	pagesize = getpagesize();
+	stream_ring = (streamRingStruct*)shm_stream.ptr;
 
-	/****************************** shared memory lock ******************************/
+	/****************************** shared debug limits ******************************/
 	// Try to create shared memory object
-	shm_lock = create_shm(SHARED_LOCK_NAME, sizeof(ShmLock));
-	if(shm_lock.ptr == NULL)
+	shm_debug_limits = create_shm(SHARED_DEBUG_LIMITS_NAME, sizeof(debugLimitsStruct));
+	if(shm_debug_limits.ptr == NULL)
 		return false;
 
-	shmLock = (ShmLock*)shm_lock.ptr;
-	shmLock->lock.outer = create_mutex();
-	shmLock->lock.inner = create_mutex();
+	debug_limits = (debugLimitsStruct*)shm_debug_limits.ptr;
+	init_debug_limits();
 
-	/****************************** shared counters struct ******************************/
+	/****************************** shared time series struct ******************************/
 	// Try to create shared memory object
-	shm_counters = create_shm(SHARED_COUNTERS_NAME, sizeof(countersStruct));
-	if(shm_counters.ptr == NULL)
+	shm_timeseries = create_shm(SHARED_TIMESERIES_NAME, sizeof(timeseriesStruct));
+	if(shm_timeseries.ptr == NULL)
 		return false;
 
-	counters = (countersStruct*)shm_counters.ptr;
+	timeseries = (timeseriesStruct*)shm_timeseries.ptr;
 
 	/****************************** shared settings struct ******************************/
 	// Try to create shared memory object
@@ -499,13 +1912,22 @@ bool init_shmem()
 	shmSettings = (ShmSettings*)shm_settings.ptr;
 	shmSettings->version = SHARED_MEMORY_VERSION;
 	shmSettings->global_shm_counter = 0;
+	shmSettings->remaps = 0;
+	atomic_init(&shmSettings->workers_generation, 0u);
 	shmSettings->pid = shmem_pid = getpid();
 
 	/****************************** shared strings buffer ******************************/
 	// Try to create shared memory object
-	shm_strings = create_shm(SHARED_STRINGS_NAME, STRINGS_ALLOC_STEP);
+	// Start with the configured capacity (rounded up to full pages) but
+	// not less than one allocation step
+	size_t size = STRINGS_ALLOC_STEP;
+	if(config.prealloc.strings > size)
+		size = config.prealloc.strings;
+	size = get_optimal_object_size(1, size, true);
+	shm_strings = create_shm(SHARED_STRINGS_NAME, size);
 	if(shm_strings.ptr == NULL)
 		return false;
+	advise_hugepages(&shm_strings);
 
 	counters->strings_MAX = shm_strings.size;
 
@@ -513,8 +1935,21 @@ bool init_shmem()
 	((char*)shm_strings.ptr)[0] = '\0';
 	shmSettings->next_str_pos = 1;
 
+	/****************************** shared strings lookup table ******************************/
+	// Each domain needs one string, each client two (IP and host name)
+	size = get_lookup_size(1 + config.prealloc.domains + 2*config.prealloc.clients, sizeof(lookupEntry));
+	// Try to create shared memory object
+	shm_strings_lookup = create_shm(SHARED_STRINGS_LOOKUP_NAME, size*sizeof(lookupEntry));
+	if(shm_strings_lookup.ptr == NULL)
+		return false;
+
+	strings_lookup = (lookupEntry*)shm_strings_lookup.ptr;
+	counters->strings_lookup_MAX = size;
+	counters->strings = 0;
+	clear_lookup(strings_lookup, size);
+
 	/****************************** shared domains struct ******************************/
-	size_t size = get_optimal_object_size(sizeof(domainsData), 1);
+	size = get_optimal_object_size(sizeof(domainsData), config.prealloc.domains > 0 ? config.prealloc.domains : 1, false);
 	// Try to create shared memory object
 	shm_domains = create_shm(SHARED_DOMAINS_NAME, size*sizeof(domainsData));
 	if(shm_domains.ptr == NULL)
@@ -522,9 +1957,24 @@ bool init_shmem()
 
 	domains = (domainsData*)shm_domains.ptr;
 	counters->domains_MAX = size;
+	counters->domains_free = -1;
+
+	/****************************** shared domains lookup table ******************************/
+	// The table has (at least) twice as many slots as there are domains to
+	// keep the probe sequences short. The number of slots is always a power
+	// of two so we can use a bit mask instead of a modulo operation
+	size = get_lookup_size(counters->domains_MAX, sizeof(lookupEntry));
+	// Try to create shared memory object
+	shm_domains_lookup = create_shm(SHARED_DOMAINS_LOOKUP_NAME, size*sizeof(lookupEntry));
+	if(shm_domains_lookup.ptr == NULL)
+		return false;
+
+	domains_lookup = (lookupEntry*)shm_domains_lookup.ptr;
+	counters->domains_lookup_MAX = size;
+	clear_lookup(domains_lookup, size);
 
 	/****************************** shared clients struct ******************************/
-	size = get_optimal_object_size(sizeof(clientsData), 1);
+	size = get_optimal_object_size(sizeof(clientsData), config.prealloc.clients > 0 ? config.prealloc.clients : 1, false);
 	// Try to create shared memory object
 	shm_clients = create_shm(SHARED_CLIENTS_NAME, size*sizeof(clientsData));
 	if(shm_clients.ptr == NULL)
@@ -532,9 +1982,22 @@ bool init_shmem()
 
 	clients = (clientsData*)shm_clients.ptr;
 	counters->clients_MAX = size;
+	counters->clients_free = -1;
+
+	/****************************** shared clients lookup table ******************************/
+	size = get_lookup_size(counters->clients_MAX, sizeof(clientLookupEntry));
+	// Try to create shared memory object
+	shm_clients_lookup = create_shm(SHARED_CLIENTS_LOOKUP_NAME, size*sizeof(clientLookupEntry));
+	if(shm_clients_lookup.ptr == NULL)
+		return false;
+
+	clients_lookup = (clientLookupEntry*)shm_clients_lookup.ptr;
+	counters->clients_lookup_MAX = size;
+	for(size_t i = 0; i < size; i++)
+		clients_lookup[i].id = -1;
 
 	/****************************** shared upstreams struct ******************************/
-	size = get_optimal_object_size(sizeof(upstreamsData), 1);
+	size = get_optimal_object_size(sizeof(upstreamsData), 1, false);
 	// Try to create shared memory object
 	shm_upstreams = create_shm(SHARED_UPSTREAMS_NAME, size*sizeof(upstreamsData));
 	if(shm_upstreams.ptr == NULL)
@@ -543,17 +2006,49 @@ bool init_shmem()
 
 	counters->upstreams_MAX = size;
 
+	/****************************** shared overTime chunks pool ******************************/
+	size = get_optimal_object_size(sizeof(overTimeChunk), OVERTIME_CHUNKS_ALLOC_STEP, false);
+	// Try to create shared memory object
+	shm_overTime_chunks = create_shm(SHARED_OVERTIME_CHUNKS_NAME, size*sizeof(overTimeChunk));
+	if(shm_overTime_chunks.ptr == NULL)
+		return false;
+	overTime_chunks = (overTimeChunk*)shm_overTime_chunks.ptr;
+
+	counters->overTime_chunks_MAX = size;
+	// Chunk zero marks unallocated chunks and is never handed out
+	counters->overTime_chunks = 1;
+	counters->overTime_chunks_free = 0u;
+
 	/****************************** shared queries struct ******************************/
+	// The queries struct grows in steps of pagesize queries, so we round the
+	// configured capacity up to the next multiple of that
+	size = pagesize;
+	if(config.prealloc.queries > size)
+		size = (config.prealloc.queries + pagesize - 1) / pagesize * pagesize;
+	size = get_optimal_object_size(sizeof(queriesData), size, true);
 	// Try to create shared memory object
-	shm_queries = create_shm(SHARED_QUERIES_NAME, pagesize*sizeof(queriesData));
+	shm_queries = create_shm(SHARED_QUERIES_NAME, size*sizeof(queriesData));
 	if(shm_queries.ptr == NULL)
 		return false;
+	advise_hugepages(&shm_queries);
 	queries = (queriesData*)shm_queries.ptr;
 
-	counters->queries_MAX = pagesize;
+	counters->queries_MAX = size;
+	counters->queries_tail = 0;
+
+	/****************************** shared queries lookup table ******************************/
+	size = get_lookup_size(counters->queries_MAX, sizeof(lookupEntry));
+	// Try to create shared memory object
+	shm_queries_lookup = create_shm(SHARED_QUERIES_LOOKUP_NAME, size*sizeof(lookupEntry));
+	if(shm_queries_lookup.ptr == NULL)
+		return false;
+
+	queries_lookup = (lookupEntry*)shm_queries_lookup.ptr;
+	counters->queries_lookup_MAX = size;
+	clear_lookup(queries_lookup, size);
 
 	/****************************** shared overTime struct ******************************/
-	size = get_optimal_object_size(sizeof(overTimeData), OVERTIME_SLOTS);
+	size = get_optimal_object_size(sizeof(overTimeData), OVERTIME_SLOTS, false);
 	// Try to create shared memory object
 	shm_overTime = create_shm(SHARED_OVERTIME_NAME, size*sizeof(overTimeData));
 	if(shm_overTime.ptr == NULL)
@@ -563,7 +2058,7 @@ bool init_shmem()
 	overTime = (overTimeData*)shm_overTime.ptr;
 
 	/****************************** shared DNS cache struct ******************************/
-	size = get_optimal_object_size(sizeof(DNSCacheData), 1);
+	size = get_optimal_object_size(sizeof(DNSCacheData), config.prealloc.dns_cache > 0 ? config.prealloc.dns_cache : 1, false);
 	// Try to create shared memory object
 	shm_dns_cache = create_shm(SHARED_DNS_CACHE, size*sizeof(DNSCacheData));
 	if(shm_dns_cache.ptr == NULL)
@@ -572,6 +2067,33 @@ bool init_shmem()
 	dns_cache = (DNSCacheData*)shm_dns_cache.ptr;
 	counters->dns_cache_MAX = size;
 
+	/****************************** shared DNS cache lookup table ******************************/
+	size = get_lookup_size(counters->dns_cache_MAX, sizeof(lookupEntry));
+	// Try to create shared memory object
+	shm_dns_cache_lookup = create_shm(SHARED_DNS_CACHE_LOOKUP, size*sizeof(lookupEntry));
+	if(shm_dns_cache_lookup.ptr == NULL)
+		return false;
+
+	dns_cache_lookup = (lookupEntry*)shm_dns_cache_lookup.ptr;
+	counters->dns_cache_lookup_MAX = size;
+	clear_lookup(dns_cache_lookup, size);
+
+	/****************************** shared verdict cache ******************************/
+	// The verdict cache is a fixed-size, direct-mapped table. Its size is
+	// a power of two so we can use a bit mask instead of a modulo operation
+	if(config.verdict_cache_size > 0)
+	{
+		verdict_cache_MAX = 1u;
+		while(verdict_cache_MAX < config.verdict_cache_size)
+			verdict_cache_MAX *= 2u;
+		shm_verdict_cache = create_shm(SHARED_VERDICT_CACHE, verdict_cache_MAX*sizeof(verdictCacheData));
+		if(shm_verdict_cache.ptr == NULL)
+			return false;
+
+		verdict_cache = (verdictCacheData*)shm_verdict_cache.ptr;
+		clear_verdict_cache();
+	}
+
 	/****************************** shared per-client regex buffer ******************************/
 	size = pagesize; // Allocate one pagesize initially. This may be expanded later on
 	// Try to create shared memory object
@@ -599,6 +2121,7 @@ void destroy_shmem(void)
 	{
 		pthread_mutex_destroy(&shmLock->lock.inner);
 		pthread_mutex_destroy(&shmLock->lock.outer);
+		pthread_rwlock_destroy(&shmLock->lock.rw);
 	}
 	shmLock = NULL;
 
@@ -613,6 +2136,62 @@ void destroy_shmem(void)
 /// \param size the size to allocate
 /// \return a structure with a pointer to the mounted shared memory. The pointer
 /// will always be valid, because if it failed FTL will have exited.
+// Check if transparent huge pages can be used for shared memory. Shared
+// memory objects live on tmpfs where MAP_HUGETLB is not supported, the
+// kernel can, however, back them with transparent huge pages if enabled
+static void detect_hugepages(void)
+{
+	hugepagesize = 0;
+	if(!config.shmem_hugepages)
+		return;
+
+	char buffer[128] = { 0 };
+	FILE *fp = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+	if(fp == NULL || fgets(buffer, sizeof(buffer), fp) == NULL)
+	{
+		logg("Huge pages for shared memory are not supported by the kernel, using normal pages");
+		if(fp != NULL)
+			fclose(fp);
+		return;
+	}
+	fclose(fp);
+
+	// The active setting is enclosed in square brackets
+	if(strstr(buffer, "[never]") != NULL || strstr(buffer, "[deny]") != NULL)
+	{
+		logg("Huge pages for shared memory are disabled in the kernel, using normal pages");
+		return;
+	}
+
+	// Get size of huge pages, use the most common size if unknown
+	size_t size = 2*1024*1024;
+	fp = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+	if(fp != NULL)
+	{
+		if(fscanf(fp, "%zu", &size) != 1 || size < (size_t)pagesize)
+			size = 2*1024*1024;
+		fclose(fp);
+	}
+
+	hugepagesize = size;
+	logg("Using huge pages of size %zu for shared memory", hugepagesize);
+}
+
+// Ask the kernel to back this shared memory object by huge pages
+static void advise_hugepages(SharedMemory *sharedMemory)
+{
+	if(hugepagesize == 0 || sharedMemory->ptr == NULL)
+		return;
+
+	sharedMemory->hugepages = true;
+	if(madvise(sharedMemory->ptr, sharedMemory->size, MADV_HUGEPAGE) != 0)
+	{
+		// Not fatal, the kernel will use normal pages
+		logg("WARN: Cannot use huge pages for \"%s\": %s",
+		     sharedMemory->name, strerror(errno));
+	}
+}
+
 static SharedMemory create_shm(const char *name, const size_t size)
 {
 	char df[64] =  { 0 };
@@ -624,10 +2203,23 @@ static SharedMemory create_shm(const char *name, const size_t size)
 	if(config.check.shmem > 0 && percentage > config.check.shmem)
 		log_resource_shortage(-1.0, 0, percentage, -1, SHMEM_PATH, df);
 
+	if(private_pid > 0)
+	{
+		// The name is needed as long as the object exists
+		const size_t len = strlen(name) + 16;
+		char *private_name = calloc(len, sizeof(char));
+		if(private_name != NULL)
+		{
+			snprintf(private_name, len, "%s-%d", name, (int)private_pid);
+			name = private_name;
+		}
+	}
+
 	SharedMemory sharedMemory = {
 		.name = name,
 		.size = size,
-		.ptr = NULL
+		.ptr = NULL,
+		.hugepages = false
 	};
 
 	// Create the shared memory file in read/write mode with 600 (u+rw) permissions
@@ -662,8 +2254,10 @@ static SharedMemory create_shm(const char *name, const size_t size)
 	// We only add here as this is a new file
 	used_shmem += size;
 
-	// Create shared memory mapping
-	void *shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	// Create shared memory mapping. The pages are populated right away as
+	// they will be used anyway. This avoids page faults while holding the
+	// SHM lock later on
+	void *shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
 
 	// Check for `mmap` error
 	if(shm == MAP_FAILED)
@@ -692,40 +2286,52 @@ static void *enlarge_shmem_struct(const char type)
 	{
 		case QUERIES:
 			sharedMemory = &shm_queries;
-			allocation_step = pagesize;
+			allocation_step = get_optimal_object_size(sizeof(queriesData), pagesize, true);
 			sizeofobj = sizeof(queriesData);
 			counter = &counters->queries_MAX;
 			break;
 		case CLIENTS:
 			sharedMemory = &shm_clients;
-			allocation_step = get_optimal_object_size(sizeof(clientsData), 1);
+			allocation_step = get_optimal_object_size(sizeof(clientsData), 1, false);
 			sizeofobj = sizeof(clientsData);
 			counter = &counters->clients_MAX;
 			break;
 		case DOMAINS:
 			sharedMemory = &shm_domains;
-			allocation_step = get_optimal_object_size(sizeof(domainsData), 1);
+			allocation_step = get_optimal_object_size(sizeof(domainsData), 1, false);
 			sizeofobj = sizeof(domainsData);
 			counter = &counters->domains_MAX;
 			break;
 		case UPSTREAMS:
 			sharedMemory = &shm_upstreams;
-			allocation_step = get_optimal_object_size(sizeof(upstreamsData), 1);
+			allocation_step = get_optimal_object_size(sizeof(upstreamsData), 1, false);
 			sizeofobj = sizeof(upstreamsData);
 			counter = &counters->upstreams_MAX;
 			break;
+		case OVERTIME:
+			sharedMemory = &shm_overTime_chunks;
+			allocation_step = get_optimal_object_size(sizeof(overTimeChunk), OVERTIME_CHUNKS_ALLOC_STEP, false);
+			sizeofobj = sizeof(overTimeChunk);
+			counter = &counters->overTime_chunks_MAX;
+			break;
 		case DNS_CACHE:
 			sharedMemory = &shm_dns_cache;
-			allocation_step = get_optimal_object_size(sizeof(DNSCacheData), 1);
+			allocation_step = get_optimal_object_size(sizeof(DNSCacheData), 1, false);
 			sizeofobj = sizeof(DNSCacheData);
 			counter = &counters->dns_cache_MAX;
 			break;
 		case STRINGS:
 			sharedMemory = &shm_strings;
-			allocation_step = STRINGS_ALLOC_STEP;
+			allocation_step = get_optimal_object_size(1, STRINGS_ALLOC_STEP, true);
 			sizeofobj = 1;
 			counter = &counters->strings_MAX;
 			break;
+		case TRIGRAMS:
+			sharedMemory = &shm_trigram_chunks;
+			allocation_step = get_optimal_object_size(sizeof(trigramChunk), TRIGRAM_CHUNKS_ALLOC_STEP, false);
+			sizeofobj = sizeof(trigramChunk);
+			counter = &trigram_index->chunks_MAX;
+			break;
 		default:
 			logg("Invalid argument in enlarge_shmem_struct(%i)", type);
 			return 0;
@@ -795,9 +2401,12 @@ static bool realloc_shm(SharedMemory *sharedMemory, const size_t size1, const si
 		// needed after having called f[tl]allocate()
 		close(fd);
 
-		// Update shm counters to indicate that at least one shared memory object changed
+		// Update shm counters to indicate that this shared memory object changed
+		const unsigned int i = shm_index(sharedMemory);
 		shmSettings->global_shm_counter++;
+		shmSettings->objects[i].generation++;
 		local_shm_counter++;
+		local_generations[i]++;
 	}
 
 	void *new_ptr = mremap(sharedMemory->ptr, sharedMemory->size, size, MREMAP_MAYMOVE);
@@ -826,6 +2435,11 @@ static bool realloc_shm(SharedMemory *sharedMemory, const size_t size1, const si
 	sharedMemory->ptr = new_ptr;
 	sharedMemory->size = size;
 
+	// The mapping may have been extended, make sure the new part is backed
+	// by huge pages as well
+	if(sharedMemory->hugepages)
+		advise_hugepages(sharedMemory);
+
 	return true;
 }
 
@@ -860,8 +2474,18 @@ static size_t __attribute__((const)) gcd(size_t a, size_t b)
 // shared memory objects. This routine works by computing the LCM
 // of two numbers, the pagesize and the size of a single element
 // in the shared memory object
-static size_t get_optimal_object_size(const size_t objsize, const size_t minsize)
+static size_t get_optimal_object_size(const size_t objsize, const size_t minsize, const bool huge)
 {
+	// Objects backed by huge pages are rounded up to full huge pages. The
+	// LCM of the huge page size and the object size may be several huge
+	// pages large, hence, we accept that the object size may exceed the
+	// last huge page by less than one object
+	if(huge && hugepagesize > 0)
+	{
+		const size_t bytes = (minsize*objsize + hugepagesize - 1) / hugepagesize * hugepagesize;
+		return (bytes + objsize - 1) / objsize;
+	}
+
 	// optsize and minsize are in units of objsize
 	const size_t optsize = pagesize / gcd(pagesize, objsize);
 	if(optsize < minsize)
@@ -906,18 +2530,51 @@ static size_t get_optimal_object_size(const size_t objsize, const size_t minsize
 	}
 }
 
+// Enlarge the queries struct to hold at least num more queries in a single
+// step. Growing it one allocation step at a time is slow for many queries as
+// every step allocates the entire object again
+void shm_reserve_queries(const unsigned int num)
+{
+	const size_t needed = (size_t)counters->queries + num + 1;
+	const int oldMAX = counters->queries_MAX;
+	if(needed <= (size_t)oldMAX)
+		return;
+
+	// Round up to a multiple of the allocation step of enlarge_shmem_struct()
+	const size_t step = get_optimal_object_size(sizeof(queriesData), pagesize, true);
+	const size_t newMAX = oldMAX + (needed - oldMAX + step - 1) / step * step;
+	if(newMAX > INT_MAX)
+		return;
+
+	realloc_shm(&shm_queries, newMAX, sizeof(queriesData), true);
+	queries = (queriesData*)shm_queries.ptr;
+	counters->queries_MAX = newMAX;
+	unwrap_queries(oldMAX);
+
+	// The queries lookup table grows alongside the queries struct
+	if(get_lookup_size(counters->queries_MAX, sizeof(lookupEntry)) > (size_t)counters->queries_lookup_MAX)
+		resize_queries_lookup();
+}
+
 // Enlarge shared memory to be able to hold at least one new record
 void shm_ensure_size(void)
 {
 	if(counters->queries >= counters->queries_MAX-1)
 	{
 		// Have to reallocate shared memory
+		const int oldMAX = counters->queries_MAX;
 		queries = enlarge_shmem_struct(QUERIES);
 		if(queries == NULL)
 		{
 			logg("FATAL: Memory allocation failed! Exiting");
 			exit(EXIT_FAILURE);
 		}
+		unwrap_queries(oldMAX);
+	}
+	if(get_lookup_size(counters->queries_MAX, sizeof(lookupEntry)) > (size_t)counters->queries_lookup_MAX)
+	{
+		// The queries lookup table grows alongside the queries struct
+		resize_queries_lookup();
 	}
 	if(counters->upstreams >= counters->upstreams_MAX-1)
 	{
@@ -939,6 +2596,11 @@ void shm_ensure_size(void)
 			exit(EXIT_FAILURE);
 		}
 	}
+	if(get_lookup_size(counters->clients_MAX, sizeof(clientLookupEntry)) > (size_t)counters->clients_lookup_MAX)
+	{
+		// The clients lookup table grows alongside the clients struct
+		resize_clients_lookup();
+	}
 	if(counters->domains >= counters->domains_MAX-1)
 	{
 		// Have to reallocate shared memory
@@ -949,6 +2611,11 @@ void shm_ensure_size(void)
 			exit(EXIT_FAILURE);
 		}
 	}
+	if(get_lookup_size(counters->domains_MAX, sizeof(lookupEntry)) > (size_t)counters->domains_lookup_MAX)
+	{
+		// The domains lookup table grows alongside the domains struct
+		resize_domains_lookup();
+	}
 	if(counters->dns_cache_size >= counters->dns_cache_MAX-1)
 	{
 		// Have to reallocate shared memory
@@ -959,6 +2626,16 @@ void shm_ensure_size(void)
 			exit(EXIT_FAILURE);
 		}
 	}
+	if(get_lookup_size(counters->dns_cache_MAX, sizeof(lookupEntry)) > (size_t)counters->dns_cache_lookup_MAX)
+	{
+		// The DNS cache lookup table grows alongside the DNS cache struct
+		resize_dns_cache_lookup();
+	}
+	if(2*(counters->strings + 1) > counters->strings_lookup_MAX)
+	{
+		// Keep the strings lookup table at most half-filled
+		resize_strings_lookup();
+	}
 	if(shmSettings->next_str_pos + STRINGS_ALLOC_STEP >= shm_strings.size)
 	{
 		// Have to reallocate shared memory
@@ -970,20 +2647,243 @@ void shm_ensure_size(void)
 	}
 }
 
-void reset_per_client_regex(const int clientID)
+// Shared memory objects stored in a snapshot of the history (see snapshot.c).
+// The lock and the settings belong to the running process, the per-client
+// regex data is rebuilt when loading the domain lists and the verdict cache
+// is simply started from scratch
+static SharedMemory *snapshotObjects[] = { &shm_counters,
+                                           &shm_query_counters,
+                                           &shm_overTime,
+                                           &shm_timeseries,
+                                           &shm_strings,
+                                           &shm_strings_lookup,
+                                           &shm_domains,
+                                           &shm_domains_lookup,
+                                           &shm_clients,
+                                           &shm_clients_lookup,
+                                           &shm_queries,
+                                           &shm_queries_lookup,
+                                           &shm_upstreams,
+                                           &shm_dns_cache,
+                                           &shm_dns_cache_lookup,
+                                           &shm_overTime_chunks };
+#define NUM_SNAPSHOT_OBJECTS (sizeof(snapshotObjects)/sizeof(SharedMemory*))
+// The first four objects have a fixed size
+#define NUM_FIXED_SNAPSHOT_OBJECTS 4u
+
+typedef struct {
+	int version;
+	unsigned int num_objects;
+	unsigned int next_str_pos;
+	size_t structs[8];
+	size_t sizes[NUM_SNAPSHOT_OBJECTS];
+} shmSnapshotHeader;
+
+// A snapshot can only be restored by a binary with identical structs
+static void get_snapshot_structs(size_t structs[8])
+{
+	structs[0] = sizeof(countersStruct);
+	structs[1] = sizeof(queryCountersStruct);
+	structs[2] = sizeof(queriesData);
+	structs[3] = sizeof(clientsData);
+	structs[4] = sizeof(domainsData);
+	structs[5] = sizeof(upstreamsData);
+	structs[6] = sizeof(DNSCacheData);
+	structs[7] = sizeof(clientLookupEntry);
+}
+
+// Write all history-related shared memory objects to a file. Has to be called
+// while holding the SHM lock
+bool shm_snapshot_write(FILE *fp)
+{
+	shmSnapshotHeader header = { 0 };
+	header.version = SHARED_MEMORY_VERSION;
+	header.num_objects = NUM_SNAPSHOT_OBJECTS;
+	header.next_str_pos = shmSettings->next_str_pos;
+	get_snapshot_structs(header.structs);
+	for(unsigned int i = 0; i < NUM_SNAPSHOT_OBJECTS; i++)
+		header.sizes[i] = snapshotObjects[i]->size;
+
+	if(fwrite(&header, sizeof(header), 1, fp) != 1)
+		return false;
+
+	for(unsigned int i = 0; i < NUM_SNAPSHOT_OBJECTS; i++)
+		if(fwrite(snapshotObjects[i]->ptr, 1, header.sizes[i], fp) != header.sizes[i])
+			return false;
+
+	return true;
+}
+
+// Check that an object of num elements of size objsize has the size stored in
+// the snapshot
+static bool __attribute__((const)) snapshot_size_ok(const int num, const size_t objsize, const size_t size)
 {
-	const unsigned int num_regex_tot = get_num_regex(REGEX_MAX); // total number
-	for(unsigned int i = 0u; i < num_regex_tot; i++)
+	return num >= 0 && (size_t)num * objsize == size;
+}
+
+// Lookup tables are addressed with a bit mask
+static bool __attribute__((const)) snapshot_lookup_ok(const int num, const size_t objsize, const size_t size)
+{
+	return num > 0 && (num & (num - 1)) == 0 && snapshot_size_ok(num, objsize, size);
+}
+
+// Verify the counters stored in the snapshot describe the objects following
+// them. Nothing in the snapshot can be trusted before this has been done as
+// the counters are used to index all other objects
+static bool snapshot_counters_ok(const shmSnapshotHeader *header, const countersStruct *c)
+{
+	const size_t *sizes = header->sizes;
+	return snapshot_size_ok(c->strings_MAX, sizeof(char), sizes[4]) &&
+	       header->next_str_pos > 0 && header->next_str_pos <= sizes[4] &&
+	       snapshot_lookup_ok(c->strings_lookup_MAX, sizeof(lookupEntry), sizes[5]) &&
+	       snapshot_size_ok(c->domains_MAX, sizeof(domainsData), sizes[6]) &&
+	       c->domains >= 0 && c->domains <= c->domains_MAX &&
+	       snapshot_lookup_ok(c->domains_lookup_MAX, sizeof(lookupEntry), sizes[7]) &&
+	       snapshot_size_ok(c->clients_MAX, sizeof(clientsData), sizes[8]) &&
+	       c->clients >= 0 && c->clients <= c->clients_MAX &&
+	       c->domains_free >= -1 && c->domains_free < c->domains &&
+	       c->clients_free >= -1 && c->clients_free < c->clients &&
+	       c->domains_reclaimed >= 0 && c->domains_reclaimed <= c->domains &&
+	       c->clients_reclaimed >= 0 && c->clients_reclaimed <= c->clients &&
+	       snapshot_lookup_ok(c->clients_lookup_MAX, sizeof(clientLookupEntry), sizes[9]) &&
+	       snapshot_size_ok(c->queries_MAX, sizeof(queriesData), sizes[10]) &&
+	       c->queries_MAX > 0 && c->queries >= 0 && c->queries < c->queries_MAX &&
+	       c->queries_tail >= 0 && c->queries_tail < c->queries_MAX &&
+	       snapshot_lookup_ok(c->queries_lookup_MAX, sizeof(lookupEntry), sizes[11]) &&
+	       snapshot_size_ok(c->upstreams_MAX, sizeof(upstreamsData), sizes[12]) &&
+	       c->upstreams >= 0 && c->upstreams <= c->upstreams_MAX &&
+	       snapshot_size_ok(c->dns_cache_MAX, sizeof(DNSCacheData), sizes[13]) &&
+	       c->dns_cache_size >= 0 && c->dns_cache_size <= c->dns_cache_MAX &&
+	       snapshot_lookup_ok(c->dns_cache_lookup_MAX, sizeof(lookupEntry), sizes[14]) &&
+	       snapshot_size_ok(c->overTime_chunks_MAX, sizeof(overTimeChunk), sizes[15]) &&
+	       c->overTime_chunks > 0 && c->overTime_chunks <= c->overTime_chunks_MAX &&
+	       c->overTime_chunks_free < (unsigned int)c->overTime_chunks &&
+	       c->overTime_base < OVERTIME_RING;
+}
+
+// Replace all history-related shared memory objects by the content of a file
+// written by shm_snapshot_write(). The snapshot is validated entirely before
+// anything is changed, shared memory is left untouched if it is rejected. Has
+// to be called while holding the SHM lock
+bool shm_snapshot_read(FILE *fp)
+{
+	shmSnapshotHeader header;
+	if(fread(&header, sizeof(header), 1, fp) != 1)
+	{
+		logg("Snapshot is truncated");
+		return false;
+	}
+
+	size_t structs[8];
+	get_snapshot_structs(structs);
+	if(header.version != SHARED_MEMORY_VERSION ||
+	   header.num_objects != NUM_SNAPSHOT_OBJECTS ||
+	   memcmp(header.structs, structs, sizeof(structs)) != 0)
+	{
+		logg("Snapshot has been written by an incompatible version");
+		return false;
+	}
+
+	for(unsigned int i = 0; i < NUM_FIXED_SNAPSHOT_OBJECTS; i++)
+	{
+		if(header.sizes[i] != snapshotObjects[i]->size)
+		{
+			logg("Snapshot has an unexpected size of \"%s\"", snapshotObjects[i]->name);
+			return false;
+		}
+	}
+
+	// The counters are the first object in the snapshot
+	const long start = ftell(fp);
+	countersStruct snap_counters;
+	if(start < 0 || fread(&snap_counters, sizeof(snap_counters), 1, fp) != 1 ||
+	   !snapshot_counters_ok(&header, &snap_counters))
+	{
+		logg("Snapshot is inconsistent");
+		return false;
+	}
+
+	// Check the file contains all objects (and nothing else)
+	size_t total = 0u;
+	for(unsigned int i = 0; i < NUM_SNAPSHOT_OBJECTS; i++)
+		total += header.sizes[i];
+	if(fseek(fp, 0L, SEEK_END) != 0 || ftell(fp) != start + (long)total ||
+	   fseek(fp, start, SEEK_SET) != 0)
+	{
+		logg("Snapshot is truncated");
+		return false;
+	}
+
+	// The per-client regex object is not part of the snapshot
+	const int per_client_regex_MAX = counters->per_client_regex_MAX;
+
+	for(unsigned int i = 0; i < NUM_SNAPSHOT_OBJECTS; i++)
+	{
+		SharedMemory *sharedMemory = snapshotObjects[i];
+		if(sharedMemory->size != header.sizes[i])
+			realloc_shm(sharedMemory, header.sizes[i], 1, true);
+
+		// We cannot go back once we started overwriting shared memory
+		if(fread(sharedMemory->ptr, 1, header.sizes[i], fp) != header.sizes[i])
+		{
+			logg("FATAL: shm_snapshot_read(): Failed to read \"%s\" from snapshot: %s",
+			     sharedMemory->name, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	counters->per_client_regex_MAX = per_client_regex_MAX;
+	shmSettings->next_str_pos = header.next_str_pos;
+
+	// Update the pointers to the objects which have been resized
+	remap_shm();
+
+	// dnsmasq IDs are only valid in the process which assigned them
+	for(int slot = 0; slot < counters->queries_MAX; slot++)
+		queries[slot].id = 0;
+	clear_lookup(queries_lookup, counters->queries_lookup_MAX);
+
+	// The verdicts refer to the domains and groups of the previous process
+	clear_verdict_cache();
+
+	return true;
+}
+
+// The per-client regex buffer stores one row of 64-bit words per client. Bit i
+// of a row is set when regex i (blacklist, whitelist, CLI regex, see
+// match_regex()) is enabled for this client. Rows have a fixed length for
+// the currently loaded regex, all rows are reloaded when the regex change
+unsigned int __attribute__((pure)) per_client_regex_words(void)
+{
+	return (get_num_regex(REGEX_MAX) + 63u) / 64u;
+}
+
+// Get the row of a client, NULL if it is out of bounds
+static uint64_t *per_client_regex_row(const int clientID, const char *func)
+{
+	const unsigned int words = per_client_regex_words();
+	const size_t end = ((size_t)clientID + 1u) * words * sizeof(uint64_t);
+	if(clientID < 0 || end > shm_per_client_regex.size)
 	{
-		// Zero-initialize/reset (= false) all regex (white + black)
-		set_per_client_regex(clientID, i, false);
+		logg("ERROR: %s(%d): Out of bounds (%zu > %d * %u words, shm_per_client_regex.size = %zu)!",
+		     func, clientID, end, counters->clients, words, shm_per_client_regex.size);
+		return NULL;
 	}
+	return (uint64_t*)shm_per_client_regex.ptr + (size_t)clientID * words;
+}
+
+void reset_per_client_regex(const int clientID)
+{
+	// Zero-initialize/reset (= false) all regex (white + black)
+	uint64_t *row = per_client_regex_row(clientID, __FUNCTION__);
+	if(row != NULL)
+		memset(row, 0, per_client_regex_words() * sizeof(uint64_t));
 }
 
 void add_per_client_regex(unsigned int clientID)
 {
-	const unsigned int num_regex_tot = get_num_regex(REGEX_MAX); // total number
-	const size_t size = get_optimal_object_size(1, counters->clients * num_regex_tot);
+	const size_t row = per_client_regex_words() * sizeof(uint64_t);
+	const size_t size = get_optimal_object_size(1, counters->clients * row, false);
 	if(size > shm_per_client_regex.size &&
 	   realloc_shm(&shm_per_client_regex, 1, size, true))
 	{
@@ -992,34 +2892,33 @@ void add_per_client_regex(unsigned int clientID)
 	}
 }
 
-bool get_per_client_regex(const int clientID, const int regexID)
+// Get the words of the row of a client, NULL if it is out of bounds
+const uint64_t *get_per_client_regex(const int clientID)
 {
-	const unsigned int num_regex_tot = get_num_regex(REGEX_MAX); // total number
-	const unsigned int id = clientID * num_regex_tot + regexID;
-	const size_t maxval = shm_per_client_regex.size / sizeof(bool);
-	if(id > maxval)
-	{
-		logg("ERROR: get_per_client_regex(%d, %d): Out of bounds (%d > %d * %d, shm_per_client_regex.size = %zd)!",
-		     clientID, regexID,
-		     id, counters->clients, num_regex_tot, maxval);
-		return false;
-	}
-	return ((bool*) shm_per_client_regex.ptr)[id];
+	return per_client_regex_row(clientID, __FUNCTION__);
 }
 
 void set_per_client_regex(const int clientID, const int regexID, const bool value)
 {
-	const unsigned int num_regex_tot = get_num_regex(REGEX_MAX); // total number
-	const unsigned int id = clientID * num_regex_tot + regexID;
-	const size_t maxval = shm_per_client_regex.size / sizeof(bool);
-	if(id > maxval)
-	{
-		logg("ERROR: set_per_client_regex(%d, %d, %s): Out of bounds (%d > %d * %d, shm_per_client_regex.size = %zd)!",
-		     clientID, regexID, value ? "true" : "false",
-		     id, counters->clients, num_regex_tot, maxval);
+	uint64_t *row = per_client_regex_row(clientID, __FUNCTION__);
+	if(row == NULL || regexID < 0 || (unsigned int)regexID >= get_num_regex(REGEX_MAX))
 		return;
-	}
-	((bool*) shm_per_client_regex.ptr)[id] = value;
+
+	const uint64_t bit = 1ULL << (regexID % 64);
+	if(value)
+		row[regexID / 64] |= bit;
+	else
+		row[regexID / 64] &= ~bit;
+}
+
+// Clients with the same groups have the same regex enabled, copy the row of
+// another client instead of querying the database again
+void copy_per_client_regex(const int clientID, const int sourceID)
+{
+	uint64_t *row = per_client_regex_row(clientID, __FUNCTION__);
+	const uint64_t *source = per_client_regex_row(sourceID, __FUNCTION__);
+	if(row != NULL && source != NULL && row != source)
+		memcpy(row, source, per_client_regex_words() * sizeof(uint64_t));
 }
 
 static inline bool check_range(int ID, int MAXID, const char* type, const char *func, int line, const char *file)
@@ -1038,6 +2937,11 @@ static inline bool check_range(int ID, int MAXID, const char* type, const char *
 
 static inline bool check_magic(int ID, bool checkMagic, unsigned char magic, const char *type, const char *func, int line, const char *file)
 {
+	// Reclaimed slots are expected, stale references to them are detected
+	// by the caller getting NULL
+	if(checkMagic && magic == RECLAIMEDBYTE)
+		return false;
+
 	// Check magic only if requested (skipped for new entries which are uninitialized)
 	if(checkMagic && magic != MAGICBYTE)
 	{
@@ -1057,7 +2961,7 @@ queriesData* _getQuery(int queryID, bool checkMagic, int line, const char *func,
 		return NULL;
 
 	// We are not in a locked situation, return a NULL pointer
-	if(config.debug & DEBUG_LOCKS && !is_our_lock())
+	if(config.debug & DEBUG_LOCKS && !is_our_lock() && !is_shared_lock())
 	{
 		logg("ERROR: Tried to obtain query pointer without lock in %s() (%s:%i)!",
 		     func, short_path(file), line);
@@ -1065,9 +2969,13 @@ queriesData* _getQuery(int queryID, bool checkMagic, int line, const char *func,
 		return NULL;
 	}
 
-	if(check_range(queryID, counters->queries_MAX, "query", func, line, file) &&
-	   check_magic(queryID, checkMagic, queries[queryID].magic, "query", func, line, file))
-		return &queries[queryID];
+	if(!check_range(queryID, counters->queries_MAX, "query", func, line, file))
+		return NULL;
+
+	// Translate logical query ID into its slot in the ring buffer
+	const int slot = query_slot(queryID);
+	if(check_magic(queryID, checkMagic, queries[slot].magic, "query", func, line, file))
+		return &queries[slot];
 	else
 		return NULL;
 }
@@ -1079,7 +2987,7 @@ clientsData* _getClient(int clientID, bool checkMagic, int line, const char *fun
 		return NULL;
 
 	// We are not in a locked situation, return a NULL pointer
-	if(config.debug & DEBUG_LOCKS && !is_our_lock())
+	if(config.debug & DEBUG_LOCKS && !is_our_lock() && !is_shared_lock())
 	{
 		logg("ERROR: Tried to obtain client pointer without lock in %s() (%s:%i)!",
 		     func, short_path(file), line);
@@ -1101,7 +3009,7 @@ domainsData* _getDomain(int domainID, bool checkMagic, int line, const char *fun
 		return NULL;
 
 	// We are not in a locked situation, return a NULL pointer
-	if(config.debug & DEBUG_LOCKS && !is_our_lock())
+	if(config.debug & DEBUG_LOCKS && !is_our_lock() && !is_shared_lock())
 	{
 		logg("ERROR: Tried to obtain domain pointer without lock in %s() (%s:%i)!",
 		     func, short_path(file), line);
@@ -1123,7 +3031,7 @@ upstreamsData* _getUpstream(int upstreamID, bool checkMagic, int line, const cha
 		return NULL;
 
 	// We are not in a locked situation, return a NULL pointer
-	if(config.debug & DEBUG_LOCKS && !is_our_lock())
+	if(config.debug & DEBUG_LOCKS && !is_our_lock() && !is_shared_lock())
 	{
 		logg("ERROR: Tried to obtain upstream pointer without lock in %s() (%s:%i)!",
 		     func, short_path(file), line);
@@ -1145,7 +3053,7 @@ DNSCacheData* _getDNSCache(int cacheID, bool checkMagic, int line, const char *f
 		return NULL;
 
 	// We are not in a locked situation, return a NULL pointer
-	if(config.debug & DEBUG_LOCKS && !is_our_lock())
+	if(config.debug & DEBUG_LOCKS && !is_our_lock() && !is_shared_lock())
 	{
 		logg("ERROR: Tried to obtain cache pointer without lock in %s() (%s:%i)!",
 		     func, short_path(file), line);
@@ -1159,3 +3067,124 @@ DNSCacheData* _getDNSCache(int cacheID, bool checkMagic, int line, const char *f
 	else
 		return NULL;
 }
+
+// Get a chunk of the overTime pool, NULL if the chunk is not allocated. Chunk
+// indices are bounds-checked as they may come from a restored snapshot
+overTimeChunk *getOverTimeChunk(const unsigned int chunk)
+{
+	if(chunk == 0u || chunk >= (unsigned int)counters->overTime_chunks)
+		return NULL;
+
+	return &overTime_chunks[chunk];
+}
+
+// Get a zeroed chunk from the overTime pool. Free chunks are reused before the
+// pool grows. The pool may be moved, the caller must not hold chunk pointers
+// across this call
+unsigned int alloc_overTime_chunk(void)
+{
+	unsigned int chunk = counters->overTime_chunks_free;
+	if(chunk != 0u)
+	{
+		// Free chunks are linked through their first value
+		const unsigned int next = (unsigned int)overTime_chunks[chunk].values[0];
+		counters->overTime_chunks_free = next < (unsigned int)counters->overTime_chunks ? next : 0u;
+	}
+	else
+	{
+		if(counters->overTime_chunks >= counters->overTime_chunks_MAX)
+		{
+			// Have to reallocate shared memory
+			overTime_chunks = enlarge_shmem_struct(OVERTIME);
+			if(overTime_chunks == NULL)
+			{
+				logg("FATAL: Memory allocation failed! Exiting");
+				exit(EXIT_FAILURE);
+			}
+		}
+		chunk = (unsigned int)counters->overTime_chunks++;
+	}
+
+	memset(&overTime_chunks[chunk], 0, sizeof(overTimeChunk));
+	return chunk;
+}
+
+// Return a chunk to the overTime pool
+void free_overTime_chunk(const unsigned int chunk)
+{
+	if(getOverTimeChunk(chunk) == NULL)
+		return;
+
+	overTime_chunks[chunk].values[0] = (int)counters->overTime_chunks_free;
+	counters->overTime_chunks_free = chunk;
+}
+
+// Get a chunk of the trigram index pool, NULL if the chunk is not allocated
+trigramChunk *getTrigramChunk(const unsigned int chunk)
+{
+	if(chunk == 0u || chunk >= (unsigned int)trigram_index->chunks)
+		return NULL;
+
+	return &trigram_chunks[chunk];
+}
+
+// Get an empty chunk from the trigram index pool. Chunks are only returned
+// all at once when the index is rebuilt. The pool may be moved, the caller
+// must not hold chunk pointers across this call
+unsigned int alloc_trigram_chunk(void)
+{
+	if(trigram_index->chunks >= trigram_index->chunks_MAX)
+	{
+		// Have to reallocate shared memory
+		trigram_chunks = enlarge_shmem_struct(TRIGRAMS);
+		if(trigram_chunks == NULL)
+		{
+			logg("FATAL: Memory allocation failed! Exiting");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	const unsigned int chunk = (unsigned int)trigram_index->chunks++;
+	memset(&trigram_chunks[chunk], 0, sizeof(trigramChunk));
+	return chunk;
+}
+
+// Get the verdict cache slot of a (domain, group set, query type) tuple. The
+// slot may be occupied by another tuple. Returns NULL if the verdict cache is
+// disabled
+verdictCacheData *get_verdict_slot(const int domainID, const size_t groupspos, const enum query_types query_type)
+{
+	if(verdict_cache == NULL)
+		return NULL;
+
+	uint32_t hash = (uint32_t)domainID * 2654435761u;
+	hash ^= (uint32_t)groupspos * 2246822519u;
+	hash ^= (uint32_t)query_type * 3266489917u;
+	hash ^= hash >> 15;
+	return &verdict_cache[hash & (verdict_cache_MAX - 1u)];
+}
+
+void clear_verdict_cache(void)
+{
+	if(verdict_cache == NULL)
+		return;
+
+	for(unsigned int i = 0; i < verdict_cache_MAX; i++)
+		verdict_cache[i].domainID = -1;
+}
+
+// The DNS workers are restarted whenever this generation changes (see
+// workers.c)
+unsigned int get_workers_generation(void)
+{
+	if(shmSettings == NULL)
+		return 0u;
+
+	return atomic_load(&shmSettings->workers_generation);
+}
+
+void next_workers_generation(void)
+{
+	if(shmSettings != NULL)
+		atomic_fetch_add(&shmSettings->workers_generation, 1u);
+}
@@ -14,21 +14,58 @@
 #include <sys/stat.h>        /* For mode constants */
 #include <fcntl.h>           /* For O_* constants */
 #include <stdbool.h>
+// atomic_int
+#include <stdatomic.h>
 
 // TYPE_MAX
 #include "datastructure.h"
+// queryStageStats
+#include "querytrace.h"
+// trigramChunk
+#include "trigram.h"
+
+// Number of recently blocked queries remembered for >recentBlocked
+#define RECENT_BLOCKED 64
 
 typedef struct {
     const char *name;
     size_t size;
     void *ptr;
+    bool hugepages;
 } SharedMemory;
 
+// Slot of an open-addressing lookup table mapping hashes to object IDs
+typedef struct {
+	uint32_t hash;
+	int id;
+} lookupEntry;
+
+// Slot of the clients lookup table. Clients are keyed by their binary address
+// rather than by their string representation
+typedef struct {
+	uint32_t hash;
+	int id;
+	unsigned char type;
+	unsigned char addr[16];
+} clientLookupEntry;
+
+// Upper limit of the number of shared memory objects
+#define SHM_MAX_OBJECTS 32
+
 typedef struct {
 	int version;
 	pid_t pid;
 	unsigned int global_shm_counter;
 	unsigned int next_str_pos;
+	unsigned int remaps;
+	// Changed whenever DNS workers have to be restarted (see workers.c)
+	atomic_uint workers_generation;
+	// Resizes and remaps of each object (index of get_shm_object()). Other
+	// processes remap only the objects whose generation changed
+	struct {
+		unsigned int generation;
+		unsigned int remaps;
+	} objects[SHM_MAX_OBJECTS];
 } ShmSettings;
 
 typedef struct {
@@ -37,22 +74,76 @@ typedef struct {
 	int clients;
 	int domains;
 	int queries_MAX;
+	int queries_tail;
+	unsigned int queries_seq;
+	int queries_lookup_MAX;
 	int upstreams_MAX;
 	int clients_MAX;
+	int clients_lookup_MAX;
 	int domains_MAX;
+	int domains_lookup_MAX;
 	int strings_MAX;
+	int strings_lookup_MAX;
+	int strings;
 	int gravity;
 	int dns_cache_size;
 	int dns_cache_MAX;
+	int dns_cache_lookup_MAX;
+	unsigned int dns_cache_epoch;
+	unsigned int dns_cache_status_epoch[NOT_BLOCKED + 1];
 	int per_client_regex_MAX;
 	unsigned int regex_change;
-	int querytype[TYPE_MAX-1];
-	int status[QUERY_STATUS_MAX];
-	int reply[QUERY_REPLY_MAX];
+	int overTime_chunks;
+	int overTime_chunks_MAX;
+	unsigned int overTime_chunks_free;
+	unsigned int overTime_base;
+	// Lists of reclaimed domain and client slots (see reclaim.c), -1 if
+	// empty, and the number of reclaimed slots below domains and clients
+	int domains_free;
+	int clients_free;
+	int domains_reclaimed;
+	int clients_reclaimed;
+	// List of the queries in progress (see query_update_inflight())
+	int inflight;
+	unsigned int inflight_head;
+	unsigned int inflight_tail;
+	// Sum of the queries the queries in memory stand for in addition to
+	// themselves (see queriesData.unsampled)
+	int queries_unsampled;
 } countersStruct;
 
 extern countersStruct *counters;
 
+// Per-type, per-status and per-reply query counters. These live in their own
+// shared memory object and are updated atomically so they can be read
+// without the SHM lock. Each array starts on its own cache line
+typedef struct {
+	atomic_int querytype[TYPE_MAX-1] __attribute__((aligned(64)));
+	atomic_int status[QUERY_STATUS_MAX] __attribute__((aligned(64)));
+	atomic_int reply[QUERY_REPLY_MAX] __attribute__((aligned(64)));
+	// Durations of the query pipeline stages (see querytrace.c)
+	queryStageStats stages[QUERY_STAGES] __attribute__((aligned(64)));
+	// Stages of the queries in progress (see querytrace.c)
+	queryStageSlot inflight_stages[QUERY_STAGE_SLOTS];
+	// Ring of the most recent slow queries, written and read while
+	// holding the SHM lock
+	slowQueryTrace slow[SLOW_QUERY_TRACES];
+	unsigned int slow_next;
+	// Ring of the sequence numbers of the most recently blocked queries,
+	// written and read while holding the SHM lock
+	unsigned int recent_blocked[RECENT_BLOCKED];
+	unsigned int recent_blocked_next;
+} queryCountersStruct;
+
+extern queryCountersStruct *query_counters;
+
+// Relaxed atomic access to the query counters, e.g., counter_inc(status[i])
+#define counter_inc(counter) atomic_fetch_add_explicit(&query_counters->counter, 1, memory_order_relaxed)
+#define counter_dec(counter) atomic_fetch_sub_explicit(&query_counters->counter, 1, memory_order_relaxed)
+#define counter_get(counter) atomic_load_explicit(&query_counters->counter, memory_order_relaxed)
+#define counter_add(counter, n) atomic_fetch_add_explicit(&query_counters->counter, n, memory_order_relaxed)
+#define counter_sub(counter, n) atomic_fetch_sub_explicit(&query_counters->counter, n, memory_order_relaxed)
+
 #ifdef SHMEM_PRIVATE
 /// Create shared memory
 ///
@@ -83,14 +174,35 @@ void _lock_shm(const char* func, const int line, const char* file);
 #define lock_log() _lock_log(__FUNCTION__, __LINE__, __FILE__)
 void _lock_log(const char* func, const int line, const char* file);
 
+/// Block until a shared (read-only) lock can be obtained
+#define lock_shm_shared() _lock_shm_shared(__FUNCTION__, __LINE__, __FILE__)
+void _lock_shm_shared(const char* func, const int line, const char* file);
+#define unlock_shm_shared() _unlock_shm_shared(__FUNCTION__, __LINE__, __FILE__)
+void _unlock_shm_shared(const char* func, const int line, const char* file);
+
 // Return if the current mutex locked the SHM lock
 bool is_our_lock(void);
+// Return if the current thread holds a shared SHM lock
+bool is_shared_lock(void) __attribute__((pure));
 
 // This ensures we have enough space available for more objects
 // The function should only be called from within _lock() and when reading
 // content from the database
 void shm_ensure_size(void);
 
+// Sparse overTime storage of clients and upstreams (see overTime.c)
+overTimeChunk *getOverTimeChunk(const unsigned int chunk) __attribute__((pure));
+unsigned int alloc_overTime_chunk(void);
+void free_overTime_chunk(const unsigned int chunk);
+// Pool of the trigram index of domains (see trigram.c)
+trigramChunk *getTrigramChunk(const unsigned int chunk) __attribute__((pure));
+unsigned int alloc_trigram_chunk(void);
+// Make room for num more queries at once (e.g., before importing them)
+void shm_reserve_queries(const unsigned int num);
+// Store and restore the history in shared memory (see snapshot.c)
+bool shm_snapshot_write(FILE *fp);
+bool shm_snapshot_read(FILE *fp);
+
 /// Unlock the lock. Only call this if there is an active lock.
 #define unlock_shm() _unlock_shm(__FUNCTION__, __LINE__, __FILE__)
 void _unlock_shm(const char* func, const int line, const char* file);
@@ -99,11 +211,42 @@ void _unlock_log(const char* func, const int line, const char * file);
 
 /// Block until a lock can be obtained
 
+void shmem_private(void);
 bool init_shmem(void);
 void destroy_shmem(void);
 size_t addstr(const char *str);
+size_t adddomain(const char *domain);
 #define getstr(pos) _getstr(pos, __FUNCTION__, __LINE__, __FILE__)
 const char *_getstr(const size_t pos, const char *func, const int line, const char *file);
+size_t compact_strings(void);
+unsigned int get_strings_generation(void) __attribute__((pure));
+void get_shm_usage(unsigned int *resizes, unsigned int *remaps, size_t *allocated);
+void get_strings_usage(size_t *used, size_t *allocated, size_t *last_freed, size_t *total_freed);
+const SharedMemory *get_shm_object(const unsigned int i) __attribute__((const));
+void get_shm_object_usage(const unsigned int i, unsigned int *resizes, unsigned int *remaps);
+
+// Usage of the shared memory objects growing with the data kept in memory.
+// Bytes include the lookup tables of the objects. Strings have no fixed entry
+// size, their capacity is given in bytes only
+enum shm_usage_object {
+	SHM_USAGE_QUERIES,
+	SHM_USAGE_CLIENTS,
+	SHM_USAGE_DOMAINS,
+	SHM_USAGE_UPSTREAMS,
+	SHM_USAGE_DNS_CACHE,
+	SHM_USAGE_STRINGS,
+	SHM_USAGE_PER_CLIENT_REGEX,
+	SHM_USAGE_OVERTIME,
+	SHM_USAGE_OBJECTS
+};
+struct shm_object_usage {
+	unsigned int entries;
+	unsigned int capacity;
+	size_t used;
+	size_t allocated;
+};
+void get_shm_breakdown(struct shm_object_usage usage[SHM_USAGE_OBJECTS]);
+const char *get_shm_usage_name(const enum shm_usage_object object) __attribute__((const));
 
 /**
  * Escapes a string by replacing special characters, such as spaces
@@ -134,10 +277,42 @@ void chown_all_shmem(struct passwd *ent_pw);
 // Get details about shared memory used by FTL
 void log_shmem_details(void);
 
+// Hash lookup table mapping dnsmasq IDs to queries
+int find_query_lookup(const int id) __attribute__((pure));
+void add_query_lookup(const int id, const int queryID);
+void remove_oldest_queries(const int num);
+unsigned int query_seq(const int queryID) __attribute__((pure));
+int seq_queryID(const unsigned int seq) __attribute__((pure));
+int get_queryID(const queriesData *query) __attribute__((pure));
+
+// Hash lookup table for domains
+int find_domain_lookup(const uint32_t hash, const char *domain);
+void add_domain_lookup(const uint32_t hash, const int domainID);
+
+// Hash lookup table for clients and alias-clients
+int find_client_lookup(const char *clientIP, const bool aliasclient);
+void add_client_lookup(const char *clientIP, const bool aliasclient, const int clientID);
+void purge_lookups(void);
+int purge_dns_cache(const time_t before);
+
+// Hash lookup table for the per-client DNS cache
+int find_dns_cache_lookup(const int domainID, const int clientID, const enum query_types query_type) __attribute__((pure));
+void add_dns_cache_lookup(const int domainID, const int clientID, const enum query_types query_type, const int cacheID);
+
+// Verdict cache shared by clients with identical groups
+verdictCacheData *get_verdict_slot(const int domainID, const size_t groupspos, const enum query_types query_type) __attribute__((pure));
+void clear_verdict_cache(void);
+
+// Generation of the state copied by the DNS workers
+unsigned int get_workers_generation(void);
+void next_workers_generation(void);
+
 // Per-client regex buffer storing whether or not a specific regex is enabled for a particular client
+unsigned int per_client_regex_words(void) __attribute__((pure));
 void add_per_client_regex(unsigned int clientID);
 void reset_per_client_regex(const int clientID);
-bool get_per_client_regex(const int clientID, const int regexID);
+const uint64_t *get_per_client_regex(const int clientID);
 void set_per_client_regex(const int clientID, const int regexID, const bool value);
+void copy_per_client_regex(const int clientID, const int sourceID);
 
 #endif //SHARED_MEMORY_SERVER_H
@@ -0,0 +1,189 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Statistics published in shared memory
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "shmstats.h"
+// struct ftlstats_shm
+#include "libftlstats/ftlstats.h"
+#include "config.h"
+// logg(), blocked_queries(), cached_queries(), forwarded_queries()
+#include "log.h"
+// counters, getstr()
+#include "shmem.h"
+// getDomain(), getClient()
+#include "datastructure.h"
+// overTime
+#include "overTime.h"
+// leaderboard_members()
+#include "leaderboard.h"
+// blockingstatus
+#include "setupVars.h"
+// known_domains(), known_clients()
+#include "reclaim.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+
+// With SHMEM_STATS, the housekeeper thread copies a summary of the statistics
+// into a shared memory object of the layout defined in
+// libftlstats/ftlstats.h once per second. Local consumers read it with
+// libftlstats without involving FTL at all. In contrast to the other shared
+// memory objects, its layout is a stable contract and it is readable by the
+// group of FTL
+
+static struct ftlstats_shm *shm = NULL;
+static bool failed = false;
+
+// The summary is assembled here and copied into shared memory at once to
+// keep the window in which readers have to retry short
+static struct ftlstats stats;
+
+static const enum leaderboard_type list_boards[FTLSTATS_LISTS] = {
+	[FTLSTATS_TOP_DOMAINS] = BOARD_PERMITTED_DOMAINS,
+	[FTLSTATS_TOP_ADS] = BOARD_BLOCKED_DOMAINS,
+	[FTLSTATS_TOP_CLIENTS] = BOARD_CLIENTS,
+	[FTLSTATS_TOP_BLOCKED_CLIENTS] = BOARD_BLOCKED_CLIENTS,
+};
+
+static bool create_stats(void)
+{
+	// Remove the object of a previous instance which did not exit cleanly
+	shm_unlink(FTLSTATS_SHM_NAME);
+
+	const int fd = shm_open(FTLSTATS_SHM_NAME, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP);
+	if(fd < 0)
+	{
+		logg("WARNING: Cannot create shared memory object \"%s\": %s",
+		     FTLSTATS_SHM_NAME, strerror(errno));
+		return false;
+	}
+
+	// fchmod() as the umask may remove the group permission
+	if(fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP) != 0 ||
+	   ftruncate(fd, sizeof(*shm)) != 0 ||
+	   (shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		logg("WARNING: Cannot set up shared memory object \"%s\": %s",
+		     FTLSTATS_SHM_NAME, strerror(errno));
+		shm = NULL;
+		close(fd);
+		shm_unlink(FTLSTATS_SHM_NAME);
+		return false;
+	}
+	close(fd);
+
+	shm->magic = FTLSTATS_MAGIC;
+	shm->version = FTLSTATS_VERSION;
+	shm->size = sizeof(shm->stats);
+	atomic_init(&shm->seq, 0u);
+	return true;
+}
+
+static int cmp_entry(const void *a, const void *b)
+{
+	const struct ftlstats_entry *ea = a, *eb = b;
+	return (eb->count > ea->count) - (eb->count < ea->count);
+}
+
+// Get the name and count of a leaderboard member, false if it cannot be shown
+static bool get_entry(const enum ftlstats_list list, const int id, struct ftlstats_entry *entry)
+{
+	const char *name = NULL;
+	if(list == FTLSTATS_TOP_DOMAINS || list == FTLSTATS_TOP_ADS)
+	{
+		const domainsData *domain = getDomain(id, true);
+		if(domain == NULL)
+			return false;
+		name = getstr(domain->domainpos);
+		entry->count = list == FTLSTATS_TOP_ADS ? domain->blockedcount : domain->count - domain->blockedcount;
+	}
+	else
+	{
+		const clientsData *client = getClient(id, true);
+		if(client == NULL)
+			return false;
+		name = client->namepos != 0 ? getstr(client->namepos) : getstr(client->ippos);
+		entry->count = list == FTLSTATS_TOP_BLOCKED_CLIENTS ? client->blockedcount : client->count;
+	}
+
+	if(entry->count < 1 || strcmp(name, HIDDEN_DOMAIN) == 0 || strcmp(name, HIDDEN_CLIENT) == 0)
+		return false;
+
+	strncpy(entry->name, name, sizeof(entry->name) - 1);
+	entry->name[sizeof(entry->name) - 1] = '\0';
+	return true;
+}
+
+static void get_top(const enum ftlstats_list list)
+{
+	struct ftlstats_entry entries[LEADERBOARD_SIZE];
+	unsigned int n = 0u;
+
+	const enum privacy_level hidden = list < FTLSTATS_TOP_CLIENTS ? PRIVACY_HIDE_DOMAINS : PRIVACY_HIDE_DOMAINS_CLIENTS;
+	int ids[LEADERBOARD_SIZE], threshold = 0;
+	const int members = config.privacylevel < hidden ? leaderboard_members(list_boards[list], ids, &threshold) : 0;
+	for(int i = 0; i < members; i++)
+		if(get_entry(list, ids[i], &entries[n]))
+			n++;
+
+	qsort(entries, n, sizeof(entries[0]), cmp_entry);
+	stats.top_n[list] = n < FTLSTATS_TOP ? n : FTLSTATS_TOP;
+	memset(stats.top[list], 0, sizeof(stats.top[list]));
+	memcpy(stats.top[list], entries, stats.top_n[list]*sizeof(entries[0]));
+}
+
+// Needs the (shared) SHM lock
+void publish_shm_stats(void)
+{
+	if(shm == NULL && (failed || !(failed = !create_stats())))
+		return;
+
+	stats.updated = time(NULL);
+	stats.pid = getpid();
+	stats.total = total_queries();
+	stats.blocked = blocked_queries();
+	stats.cached = cached_queries();
+	stats.forwarded = forwarded_queries();
+	stats.domains = known_domains();
+	stats.clients = known_clients();
+	stats.gravity = counters->gravity;
+	stats.blocking = blockingstatus;
+	stats.privacy_level = config.privacylevel;
+
+	stats.slots = OVERTIME_SLOTS < FTLSTATS_SLOTS ? OVERTIME_SLOTS : FTLSTATS_SLOTS;
+	const unsigned int first = OVERTIME_SLOTS - stats.slots;
+	for(unsigned int slot = 0; slot < stats.slots; slot++)
+	{
+		stats.slot_timestamp[slot] = overTime[first + slot].timestamp;
+		stats.slot_total[slot] = overTime[first + slot].total;
+		stats.slot_blocked[slot] = overTime[first + slot].blocked;
+		stats.slot_cached[slot] = overTime[first + slot].cached;
+		stats.slot_forwarded[slot] = overTime[first + slot].forwarded;
+	}
+
+	for(unsigned int list = 0; list < FTLSTATS_LISTS; list++)
+		get_top(list);
+
+	// Sequence lock, see libftlstats/ftlstats.h
+	const unsigned int seq = atomic_load_explicit(&shm->seq, memory_order_relaxed);
+	atomic_store_explicit(&shm->seq, seq + 1u, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	memcpy(&shm->stats, &stats, sizeof(stats));
+	atomic_store_explicit(&shm->seq, seq + 2u, memory_order_release);
+}
+
+void destroy_shm_stats(void)
+{
+	if(shm == NULL)
+		return;
+
+	munmap(shm, sizeof(*shm));
+	shm = NULL;
+	shm_unlink(FTLSTATS_SHM_NAME);
+}
@@ -0,0 +1,16 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Statistics published in shared memory prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef SHMSTATS_H
+#define SHMSTATS_H
+
+void publish_shm_stats(void);
+void destroy_shm_stats(void);
+
+#endif //SHMSTATS_H
@@ -0,0 +1,126 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  DNSSEC signature verification cache
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#define FTLDNS
+#include "dnsmasq/dnsmasq.h"
+#undef __USE_XOPEN
+#include "FTL.h"
+#include "sigcache.h"
+#include "dnsmasq_interface.h"
+#include "config.h"
+
+// The same RRsets are validated again for different queries whenever they are
+// not cached by dnsmasq, e.g. the DNSKEY and DS RRsets of popular zones. The
+// public key operations are expensive on small devices, so with
+// DNSSEC_SIGCACHE > 0, the outcome of verifying a signature with a key is
+// remembered until the records or the signature expire. Entries are
+// identified by the digest of the RRset and the RRSIG fields (which covers
+// owner, class, type, rdata, signer, key tag and validity period) and a hash
+// of the signature and the key. They are kept in a direct-mapped table, an
+// entry displaced by another one is simply verified again next time. Every
+// process (DNS and TCP workers) has its own table
+struct sig_entry {
+	uint64_t key;
+	time_t expires;
+	unsigned char digest[SIGCACHE_DIGEST];
+	unsigned char digest_len;
+	unsigned char algo;
+	bool valid;
+};
+
+static struct sig_entry *entries = NULL;
+static unsigned int size = 0u;
+static struct sigcache_stats stats = { 0 };
+
+static uint64_t __attribute__((pure)) sig_key(const unsigned char *key, const unsigned int key_len,
+                                              const unsigned char *sig, const size_t sig_len,
+                                              const unsigned char *digest, const size_t digest_len,
+                                              const int algo)
+{
+	// FNV-1a over the algorithm, the key, the signature and the digest.
+	// The lengths are included so different splits cannot collide
+	uint64_t hash = 14695981039346656037ULL ^ (unsigned char)algo;
+	hash = (hash ^ key_len) * 1099511628211ULL;
+	for(unsigned int i = 0; i < key_len; i++)
+		hash = (hash ^ key[i]) * 1099511628211ULL;
+	hash = (hash ^ sig_len) * 1099511628211ULL;
+	for(size_t i = 0; i < sig_len; i++)
+		hash = (hash ^ sig[i]) * 1099511628211ULL;
+	for(size_t i = 0; i < digest_len; i++)
+		hash = (hash ^ digest[i]) * 1099511628211ULL;
+	return hash;
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Verify a signature, or return the result of an earlier verification of the
+// same signature of the same RRset with the same key. ttl is the number of
+// seconds the result may be used for, i.e. the TTL of the RRset limited by the
+// expiration of the signature
+int FTL_dnssec_verify(struct blockdata *key_data, unsigned int key_len, unsigned char *sig, size_t sig_len,
+                      unsigned char *digest, size_t digest_len, int algo, const unsigned long ttl,
+                      const time_t now)
+{
+	if(config.dnssec_sigcache == 0 || digest_len > SIGCACHE_DIGEST || ttl == 0)
+	{
+		const uint64_t start = thread_cpu_ns();
+		const int valid = verify(key_data, key_len, sig, sig_len, digest, digest_len, algo);
+		stats.cpu_ns += thread_cpu_ns() - start;
+		return valid;
+	}
+
+	if(entries == NULL)
+	{
+		if((entries = calloc(config.dnssec_sigcache, sizeof(*entries))) == NULL)
+			return verify(key_data, key_len, sig, sig_len, digest, digest_len, algo);
+		size = config.dnssec_sigcache;
+	}
+
+	// The key is stored in (possibly several) blocks
+	const unsigned char *key = blockdata_retrieve(key_data, key_len, NULL);
+	if(key == NULL)
+		return 0;
+
+	const uint64_t hash = sig_key(key, key_len, sig, sig_len, digest, digest_len, algo);
+	struct sig_entry *entry = &entries[(hash ^ (hash >> 32)) & (size - 1)];
+	if(entry->key == hash && entry->expires > now && entry->algo == (unsigned char)algo &&
+	   entry->digest_len == digest_len && memcmp(entry->digest, digest, digest_len) == 0)
+	{
+		stats.hits++;
+		return entry->valid;
+	}
+
+	stats.misses++;
+	if(entry->expires > now)
+		stats.evictions++;
+
+	const uint64_t start = thread_cpu_ns();
+	const int valid = verify(key_data, key_len, sig, sig_len, digest, digest_len, algo);
+	stats.cpu_ns += thread_cpu_ns() - start;
+
+	entry->key = hash;
+	entry->expires = now + (time_t)ttl;
+	memcpy(entry->digest, digest, digest_len);
+	entry->digest_len = digest_len;
+	entry->algo = algo;
+	entry->valid = valid;
+
+	return valid;
+}
+
+void get_sigcache_stats(struct sigcache_stats *out)
+{
+	memcpy(out, &stats, sizeof(stats));
+}
@@ -0,0 +1,33 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  DNSSEC signature verification cache prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef SIGCACHE_H
+#define SIGCACHE_H
+
+#include <stdint.h>
+
+// Maximum number of cached verification results
+#define SIGCACHE_MAX 65536u
+// Largest digest of a supported DNSSEC algorithm (SHA-512)
+#define SIGCACHE_DIGEST 64u
+
+struct sigcache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	// CPU time spent verifying signatures [nsec]
+	uint64_t cpu_ns;
+};
+
+void get_sigcache_stats(struct sigcache_stats *out);
+
+// FTL_dnssec_verify() is called by dnsmasq and declared in
+// dnsmasq_interface.h
+
+#endif //SIGCACHE_H
@@ -133,6 +133,9 @@ void generate_backtrace(void)
 
 static void __attribute__((noreturn)) signal_handler(int sig, siginfo_t *si, void *unused)
 {
+	// Write the crash report synchronously
+	sync_FTL_log();
+
 	logg("!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!");
 	logg("---------------------------->  FTL crashed!  <----------------------------");
 	logg("!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!");
@@ -318,6 +321,11 @@ static void SIGRT_handler(int signum, siginfo_t *si, void *unused)
 		// Parse neighbor cache
 		set_event(PARSE_NEIGHBOR_CACHE);
 	}
+	else if(rtsig == 7)
+	{
+		// Print SHM lock statistics to the log
+		set_event(DUMP_LOCK_STATS);
+	}
 
 	// Restore errno before returning back to previous context
 	errno = _errno;
@@ -0,0 +1,215 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Shared memory snapshot routines
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "snapshot.h"
+// shm_snapshot_{read,write}()
+#include "shmem.h"
+#include "config.h"
+#include "log.h"
+// getQuery(), getClient()
+#include "datastructure.h"
+// dbopen(), get_max_query_ID(), lastdbindex
+#include "database/common.h"
+// set_event()
+#include "events.h"
+// doGC
+#include "gc.h"
+// GIT_HASH
+#include "version.h"
+// rebuild_heavy_hitters()
+#include "heavyhitters.h"
+// rebuild_cardinality()
+#include "cardinality.h"
+// rebuild_trigram_index()
+#include "trigram.h"
+
+// On shutdown, the history held in shared memory is written to a file which is
+// restored on the next start instead of importing the queries from the
+// long-term database. The snapshot is only used if nothing it depends on has
+// changed in the meantime
+
+#define SNAPSHOT_MAGIC "FTLSNAP1"
+
+typedef struct {
+	char magic[8];
+	char commit[41];
+	time_t timestamp;
+	long int lastdbindex;
+	long int last_query_ID;
+	int maxlogage;
+	enum privacy_level privacylevel;
+	bool analyze_only_A_AAAA;
+	bool ignore_localhost;
+} snapshotHeader;
+
+static long int get_last_query_ID(void)
+{
+	sqlite3 *db = dbopen(false);
+	if(db == NULL)
+		return DB_FAILED;
+
+	const long int id = get_max_query_ID(db);
+	dbclose(&db);
+	return id;
+}
+
+static void get_snapshot_header(snapshotHeader *header)
+{
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+	strncpy(header->commit, GIT_HASH, sizeof(header->commit) - 1);
+	header->timestamp = time(NULL);
+	header->last_query_ID = get_last_query_ID();
+	header->maxlogage = config.maxlogage;
+	header->privacylevel = config.privacylevel;
+	header->analyze_only_A_AAAA = config.analyze_only_A_AAAA;
+	header->ignore_localhost = config.ignore_localhost;
+}
+
+// Write the history to the snapshot file. This has to be done after the final
+// database update as the snapshot is rejected if the database changes later
+void write_snapshot(void)
+{
+	snapshotHeader header;
+	get_snapshot_header(&header);
+
+	// The snapshot contains the entire query history, only we may read it
+	const int fd = open(FTLfiles.shmem_snapshot, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	FILE *fp = fd != -1 ? fdopen(fd, "w") : NULL;
+	if(fp == NULL)
+	{
+		if(fd != -1)
+			close(fd);
+		logg("WARNING: Cannot write snapshot %s: %s", FTLfiles.shmem_snapshot, strerror(errno));
+		return;
+	}
+
+	lock_shm();
+	header.lastdbindex = lastdbindex;
+	const int queries = counters->queries;
+	bool okay = fwrite(&header, sizeof(header), 1, fp) == 1 && shm_snapshot_write(fp);
+	unlock_shm();
+
+	if(fclose(fp) != 0)
+		okay = false;
+
+	if(okay)
+		logg("Stored %i queries in snapshot %s", queries, FTLfiles.shmem_snapshot);
+	else
+	{
+		logg("WARNING: Failed to write snapshot %s: %s", FTLfiles.shmem_snapshot, strerror(errno));
+		unlink(FTLfiles.shmem_snapshot);
+	}
+}
+
+// Check if the snapshot still describes the current state
+static bool snapshot_valid(const snapshotHeader *stored)
+{
+	snapshotHeader current;
+	get_snapshot_header(&current);
+
+	if(memcmp(stored->magic, current.magic, sizeof(current.magic)) != 0 ||
+	   strncmp(stored->commit, current.commit, sizeof(current.commit)) != 0)
+		logg("Not restoring snapshot written by a different version of FTL");
+	else if(stored->timestamp > current.timestamp ||
+	        current.timestamp - stored->timestamp > current.maxlogage)
+		logg("Not restoring outdated snapshot");
+	else if(stored->last_query_ID != current.last_query_ID)
+		logg("Not restoring snapshot as the long-term database has changed");
+	else if(stored->maxlogage != current.maxlogage ||
+	        stored->privacylevel != current.privacylevel ||
+	        stored->analyze_only_A_AAAA != current.analyze_only_A_AAAA ||
+	        stored->ignore_localhost != current.ignore_localhost)
+		logg("Not restoring snapshot as the configuration has changed");
+	else
+		return true;
+
+	return false;
+}
+
+// Restore the history from the snapshot file (if available). Returns false if
+// the queries have to be imported from the database instead
+bool restore_snapshot(void)
+{
+	FILE *fp = fopen(FTLfiles.shmem_snapshot, "r");
+	if(fp == NULL)
+	{
+		if(errno != ENOENT)
+			logg("WARNING: Cannot read snapshot %s: %s", FTLfiles.shmem_snapshot, strerror(errno));
+		return false;
+	}
+
+	// A snapshot is used at most once. Its content is outdated as soon as
+	// we start answering queries
+	unlink(FTLfiles.shmem_snapshot);
+
+	snapshotHeader header;
+	if(fread(&header, sizeof(header), 1, fp) != 1 || !snapshot_valid(&header))
+	{
+		fclose(fp);
+		return false;
+	}
+
+	lock_shm();
+	if(!shm_snapshot_read(fp))
+	{
+		unlock_shm();
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+
+	// Queries still waiting for a reply will never get one
+	for(int queryID = 0; queryID < counters->queries; queryID++)
+	{
+		queriesData *query = getQuery(queryID, true);
+		if(query != NULL)
+		{
+			query->flags.complete = true;
+			query_update_inflight(query);
+		}
+	}
+
+	// Re-read the group settings of all clients as they would be after
+	// importing them from the database
+	for(int clientID = 0; clientID < counters->clients; clientID++)
+	{
+		clientsData *client = getClient(clientID, true);
+		if(client == NULL)
+			continue;
+		client->flags.found_group = false;
+		client->reread_groups = 0u;
+
+		// The rate-limit wheel is not part of the snapshot, start
+		// with full buckets
+		client->flags.rate_limited = false;
+		memset(&client->rate, 0, sizeof(client->rate));
+	}
+	FTL_reset_per_client_domain_status(~0u);
+
+	// The sketches and the search index are not part of the snapshot
+	rebuild_heavy_hitters();
+	rebuild_cardinality();
+	rebuild_trigram_index();
+
+	// Queries which had not been stored before shutting down are stored
+	// now
+	lastdbindex = header.lastdbindex;
+	unlock_shm();
+
+	// Move the overTime data to the current time and synchronize the
+	// alias-clients with the database
+	doGC = true;
+	set_event(REIMPORT_ALIASCLIENTS);
+
+	logg("Restored %i queries from snapshot", counters->queries);
+	return true;
+}
@@ -0,0 +1,16 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Shared memory snapshot prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+void write_snapshot(void);
+bool restore_snapshot(void);
+
+#endif //SNAPSHOT_H
@@ -0,0 +1,154 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Built-in special domain names
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+// public prototypes
+#include "specialdomains.h"
+// hashStr(), strtolower()
+#include "datastructure.h"
+// hostname()
+#include "daemon.h"
+// logg()
+#include "log.h"
+// config
+#include "config.h"
+
+// All names FTL handles itself (pi.hole, the host name of this machine, both
+// with the local domain suffix, and the special domains) are stored in a small
+// open-addressing table. Its size is chosen such that no two names share a
+// slot so a lookup needs a single hash and string comparison. Names are stored
+// in lower case and looked up with the hash of the lower-cased domain which is
+// computed when the query arrives anyway
+#define SPECIAL_NAMES_MAX 8u
+#define SPECIAL_TABLE_MAX 1024u
+
+typedef struct {
+	char *name;
+	uint32_t hash;
+	enum special_name kind;
+} specialName;
+
+static specialName names[SPECIAL_NAMES_MAX] = {{ 0 }};
+static unsigned int num_names = 0u;
+static specialName *table = NULL;
+static uint32_t table_mask = 0u;
+
+static void add_name(const char *prefix, const char *suffix, const enum special_name kind)
+{
+	if(num_names >= SPECIAL_NAMES_MAX || prefix == NULL || prefix[0] == '\0')
+		return;
+
+	char *name = NULL;
+	if(suffix != NULL)
+	{
+		if(asprintf(&name, "%s.%s", prefix, suffix) < 1)
+			return;
+	}
+	else if((name = strdup(prefix)) == NULL)
+		return;
+	strtolower(name);
+
+	// Skip duplicates, e.g., a host name of "pi.hole"
+	const uint32_t hash = hashStr(name);
+	for(unsigned int i = 0; i < num_names; i++)
+	{
+		if(names[i].hash == hash && strcmp(names[i].name, name) == 0)
+		{
+			free(name);
+			return;
+		}
+	}
+
+	names[num_names].name = name;
+	names[num_names].hash = hash;
+	names[num_names].kind = kind;
+	num_names++;
+}
+
+// Try to place all names into a table of the given size without collisions
+static bool fill_table(specialName *slots, const uint32_t mask)
+{
+	memset(slots, 0, (mask + 1u) * sizeof(specialName));
+	for(unsigned int i = 0; i < num_names; i++)
+	{
+		specialName *slot = &slots[names[i].hash & mask];
+		if(slot->name != NULL)
+			return false;
+		*slot = names[i];
+	}
+	return true;
+}
+
+// Build the table of special names. This has to be called after dnsmasq has
+// read its config as the local domain suffix is needed
+void special_names_init(const char *domain_suffix)
+{
+	// Free previous names (if any)
+	for(unsigned int i = 0; i < num_names; i++)
+		free(names[i].name);
+	num_names = 0u;
+	if(table != NULL)
+		free(table);
+	table = NULL;
+
+	add_name("pi.hole", NULL, SPECIAL_PIHOLE);
+	add_name(hostname(), NULL, SPECIAL_PIHOLE);
+	if(domain_suffix != NULL)
+	{
+		add_name("pi.hole", domain_suffix, SPECIAL_PIHOLE);
+		add_name(hostname(), domain_suffix, SPECIAL_PIHOLE);
+	}
+	add_name("use-application-dns.net", NULL, SPECIAL_MOZILLA_CANARY);
+	add_name("mask.icloud.com", NULL, SPECIAL_ICLOUD_PRIVATE_RELAY);
+	add_name("mask-h2.icloud.com", NULL, SPECIAL_ICLOUD_PRIVATE_RELAY);
+
+	// Find the smallest table without collisions
+	for(uint32_t size = 8u; size <= SPECIAL_TABLE_MAX; size *= 2u)
+	{
+		specialName *slots = calloc(size, sizeof(specialName));
+		if(slots == NULL)
+			break;
+		if(fill_table(slots, size - 1u))
+		{
+			table = slots;
+			table_mask = size - 1u;
+			break;
+		}
+		free(slots);
+	}
+
+	if(config.debug & DEBUG_QUERIES)
+	{
+		logg("Special names (%u, table size %u%s):", num_names,
+		     table != NULL ? table_mask + 1u : 0u,
+		     table != NULL ? "" : ", using linear search");
+		for(unsigned int i = 0; i < num_names; i++)
+			logg("  %s", names[i].name);
+	}
+}
+
+// Get the kind of a lower-cased domain, hash is hashStr(domain)
+enum special_name special_name_lookup(const char *domain, const uint32_t hash)
+{
+	if(table != NULL)
+	{
+		const specialName *slot = &table[hash & table_mask];
+		if(slot->name != NULL && slot->hash == hash && strcmp(slot->name, domain) == 0)
+			return slot->kind;
+		return SPECIAL_NONE;
+	}
+
+	// Fallback if no collision-free table could be built
+	for(unsigned int i = 0; i < num_names; i++)
+		if(names[i].hash == hash && strcmp(names[i].name, domain) == 0)
+			return names[i].kind;
+
+	return SPECIAL_NONE;
+}
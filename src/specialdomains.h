@@ -0,0 +1,25 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Built-in special domain name prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef SPECIALDOMAINS_H
+#define SPECIALDOMAINS_H
+
+#include <stdint.h>
+
+enum special_name {
+	SPECIAL_NONE,
+	SPECIAL_PIHOLE,
+	SPECIAL_MOZILLA_CANARY,
+	SPECIAL_ICLOUD_PRIVATE_RELAY
+} __attribute__ ((packed));
+
+void special_names_init(const char *domain_suffix);
+enum special_name special_name_lookup(const char *domain, const uint32_t hash) __attribute__((pure));
+
+#endif //SPECIALDOMAINS_H
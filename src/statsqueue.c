@@ -0,0 +1,172 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Deferred statistics accounting
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#define FTLDNS
+#include "dnsmasq/dnsmasq.h"
+#undef __USE_XOPEN
+#include "FTL.h"
+#include "statsqueue.h"
+// struct hook_record, FTL_apply_hook()
+#include "dnsmasq_interface.h"
+#include "config.h"
+#include "log.h"
+// lock_shm()
+#include "shmem.h"
+// killed
+#include "signals.h"
+// wake_thread(), wait_for_event()
+#include "events.h"
+#include <stdatomic.h>
+// thread_sched_apply()
+#include "threadsched.h"
+
+// When DEFER_STATISTICS is enabled, dnsmasq's main process does not update the
+// statistics while it is answering queries. It only records the events in this
+// queue and the statistics thread applies them in batches. There is exactly
+// one producer (dnsmasq's main thread). Records are only consumed while
+// holding the SHM lock, either by the statistics thread or by the main thread
+// itself before it changes a query synchronously, this keeps the events of
+// each query in order
+static struct {
+	struct hook_record *records;
+	_Atomic unsigned int head;
+	_Atomic unsigned int tail;
+	bool enabled;
+	_Atomic unsigned long deferred;
+	_Atomic unsigned long flushed;
+	_Atomic unsigned long overflows;
+} queue = { NULL, 0u, 0u, false, 0ul, 0ul, 0ul };
+
+void init_statsqueue(void)
+{
+	if(!config.defer_statistics)
+		return;
+
+	queue.records = calloc(STATSQUEUE_SLOTS, sizeof(struct hook_record));
+	if(queue.records == NULL)
+	{
+		logg("WARNING: Cannot allocate statistics queue, statistics are updated synchronously");
+		return;
+	}
+
+	queue.enabled = true;
+}
+
+// Forks (TCP workers) have no statistics thread, they process all events
+// synchronously. Records copied from the main process are applied there
+void disable_statsqueue(void)
+{
+	queue.enabled = false;
+}
+
+// Add a record to the queue. Returns false if the record has to be processed
+// synchronously as the queue is disabled or full
+bool statsqueue_push(const struct hook_record *record)
+{
+	if(!queue.enabled || killed)
+		return false;
+
+	const unsigned int head = atomic_load_explicit(&queue.head, memory_order_relaxed);
+	const unsigned int tail = atomic_load_explicit(&queue.tail, memory_order_acquire);
+	if(head - tail >= STATSQUEUE_SLOTS)
+	{
+		atomic_fetch_add_explicit(&queue.overflows, 1ul, memory_order_relaxed);
+		return false;
+	}
+
+	memcpy(&queue.records[head % STATSQUEUE_SLOTS], record, sizeof(*record));
+	atomic_store_explicit(&queue.head, head + 1u, memory_order_release);
+	atomic_fetch_add_explicit(&queue.deferred, 1ul, memory_order_relaxed);
+
+	// The statistics thread sleeps when the queue is empty
+	if(head == tail)
+		wake_thread(STATS);
+
+	return true;
+}
+
+// Apply up to max queued records. Has to be called while holding the SHM lock
+static unsigned int apply_records(const unsigned int max)
+{
+	const unsigned int head = atomic_load_explicit(&queue.head, memory_order_acquire);
+	unsigned int tail = atomic_load_explicit(&queue.tail, memory_order_relaxed);
+
+	unsigned int applied = 0u;
+	while(tail != head && applied < max)
+	{
+		FTL_apply_hook(&queue.records[tail % STATSQUEUE_SLOTS]);
+		tail++;
+		applied++;
+	}
+
+	// Release the slots only after the records have been applied
+	atomic_store_explicit(&queue.tail, tail, memory_order_release);
+	return applied;
+}
+
+// Apply all queued records before an event is processed synchronously. Has to
+// be called while holding the SHM lock
+void statsqueue_flush(void)
+{
+	if(!queue.enabled ||
+	   atomic_load_explicit(&queue.head, memory_order_acquire) ==
+	   atomic_load_explicit(&queue.tail, memory_order_relaxed))
+		return;
+
+	const unsigned int applied = apply_records(STATSQUEUE_SLOTS);
+	atomic_fetch_add_explicit(&queue.flushed, applied, memory_order_relaxed);
+}
+
+static bool queue_empty(void)
+{
+	return atomic_load_explicit(&queue.head, memory_order_acquire) ==
+	       atomic_load_explicit(&queue.tail, memory_order_acquire);
+}
+
+void *statsqueue_thread(void *val)
+{
+	// Set thread name
+	thread_names[STATS] = "statistics";
+	prctl(PR_SET_NAME, thread_names[STATS], 0, 0, 0);
+	thread_sched_apply(STATS);
+
+	while(!killed)
+	{
+		// Sleep until the first record arrives
+		if(queue_empty())
+		{
+			wait_for_event(STATS, 1000);
+			continue;
+		}
+
+		// Apply records in batches, the lock is released in between so
+		// new queries are not waiting for too long
+		lock_shm();
+		apply_records(STATSQUEUE_BATCH);
+		unlock_shm();
+	}
+
+	// Apply what is left before the final database update
+	lock_shm();
+	apply_records(STATSQUEUE_SLOTS);
+	unlock_shm();
+
+	logg("Terminating statistics thread");
+	return NULL;
+}
+
+void get_statsqueue_stats(struct statsqueue_stats *stats)
+{
+	stats->deferred = atomic_load_explicit(&queue.deferred, memory_order_relaxed);
+	stats->flushed = atomic_load_explicit(&queue.flushed, memory_order_relaxed);
+	stats->overflows = atomic_load_explicit(&queue.overflows, memory_order_relaxed);
+	stats->pending = atomic_load_explicit(&queue.head, memory_order_relaxed) -
+	                 atomic_load_explicit(&queue.tail, memory_order_relaxed);
+}
@@ -0,0 +1,37 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Deferred statistics accounting prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef STATSQUEUE_H
+#define STATSQUEUE_H
+
+#include <stdbool.h>
+
+// Number of records the queue can hold (has to be a power of two)
+#define STATSQUEUE_SLOTS 1024
+// Maximum number of records applied while holding the SHM lock once
+#define STATSQUEUE_BATCH 256
+
+// struct hook_record is defined in dnsmasq_interface.h
+struct hook_record;
+
+struct statsqueue_stats {
+	unsigned long deferred;
+	unsigned long flushed;
+	unsigned long overflows;
+	unsigned int pending;
+};
+
+void init_statsqueue(void);
+void disable_statsqueue(void);
+bool statsqueue_push(const struct hook_record *record);
+void statsqueue_flush(void);
+void *statsqueue_thread(void *val);
+void get_statsqueue_stats(struct statsqueue_stats *stats);
+
+#endif //STATSQUEUE_H
@@ -11,6 +11,10 @@
 #include "../FTL.h"
 //#include "syscalls.h" is implicitly done in FTL.h
 #include "../log.h"
+// alloc_stats_*()
+#include "../allocstats.h"
+// config.alloc_stats
+#include "../config.h"
 
 #undef calloc
 void* __attribute__((malloc)) __attribute__((alloc_size(1,2))) FTLcalloc(const size_t nmemb, const size_t size, const char *file, const char *func, const int line)
@@ -38,6 +42,9 @@ void* __attribute__((malloc)) __attribute__((alloc_size(1,2))) FTLcalloc(const s
 		logg("FATAL: Memory allocation (%zu x %zu) failed in %s() (%s:%i)",
 		     nmemb, size, func, file, line);
 
+	if(config.alloc_stats)
+		alloc_stats_alloc(ptr, nmemb*size, file, func, line);
+
 	// Restore errno value
 	errno = _errno;
 
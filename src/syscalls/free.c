@@ -11,6 +11,10 @@
 #include "../FTL.h"
 //#include "syscalls.h" is implicitly done in FTL.h
 #include "../log.h"
+// alloc_stats_*()
+#include "../allocstats.h"
+// config.alloc_stats
+#include "../config.h"
 
 #undef free
 void FTLfree(void *ptr, const char *file, const char *func, const int line)
@@ -25,5 +29,8 @@ void FTLfree(void *ptr, const char *file, const char *func, const int line)
 		return;
 	}
 
+	if(config.alloc_stats)
+		alloc_stats_free(ptr);
+
 	free(ptr);
 }
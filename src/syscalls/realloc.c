@@ -11,6 +11,10 @@
 #include "../FTL.h"
 //#include "syscalls.h" is implicitly done in FTL.h
 #include "../log.h"
+// alloc_stats_*()
+#include "../allocstats.h"
+// config.alloc_stats
+#include "../config.h"
 
 #undef realloc
 void __attribute__((alloc_size(2))) *FTLrealloc(void *ptr_in, const size_t size, const char * file, const char * func, const int line)
@@ -24,6 +28,10 @@ void __attribute__((alloc_size(2))) *FTLrealloc(void *ptr_in, const size_t size,
 	// then the call is equivalent to free(ptr). Unless ptr is NULL, it must
 	// have been returned by an earlier call to malloc(), calloc() or realloc().
 	// If the area pointed to was moved, a free(ptr) is done implicitly.
+	// Stop tracking the old memory before it is released (and possibly
+	// handed out to another thread)
+	const size_t old_size = config.alloc_stats ? alloc_stats_free(ptr_in) : 0u;
+
 	void *ptr_out = NULL;
 	do
 	{
@@ -42,6 +50,15 @@ void __attribute__((alloc_size(2))) *FTLrealloc(void *ptr_in, const size_t size,
 		logg("FATAL: Memory reallocation (%p -> %zu) failed in %s() (%s:%i)",
 		     ptr_in, size, func, file, line);
 
+	// The old memory is still there if the call failed
+	if(config.alloc_stats)
+	{
+		if(ptr_out != NULL)
+			alloc_stats_alloc(ptr_out, size, file, func, line);
+		else if(size > 0 && old_size > 0)
+			alloc_stats_alloc(ptr_in, old_size, file, func, line);
+	}
+
 	// Restore errno value
 	errno = _errno;
 
@@ -11,6 +11,10 @@
 #include "../FTL.h"
 //#include "syscalls.h" is implicitly done in FTL.h
 #include "../log.h"
+// alloc_stats_*()
+#include "../allocstats.h"
+// config.alloc_stats
+#include "../config.h"
 
 #undef vasprintf
 int FTLvasprintf(const char *file, const char *func, const int line, char **buffer, const char *format, va_list args)
@@ -54,6 +58,9 @@ int FTLvasprintf(const char *file, const char *func, const int line, char **buff
 		                      stdout, _errno, format, func, file, line);
 	}
 
+	else if(config.alloc_stats)
+		alloc_stats_alloc(*buffer, (size_t)length + 1u, file, func, line);
+
 	// Restore errno value
 	errno = _errno;
 
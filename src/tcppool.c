@@ -0,0 +1,256 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Pool of persistent upstream TCP connections
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#define FTLDNS
+#include "dnsmasq/dnsmasq.h"
+#undef __USE_XOPEN
+#include "FTL.h"
+#include "tcppool.h"
+#include "dnsmasq_interface.h"
+#include "config.h"
+#include "log.h"
+// lock_shm()
+#include "shmem.h"
+// findUpstreamID()
+#include "datastructure.h"
+
+// dnsmasq answers every TCP connection of a client in a forked TCP worker. The
+// worker opens its own TCP connections to the upstream servers and closes them
+// when it terminates, so every client connection pays the TCP handshake with
+// the upstream server again. When TCP_POOL_IDLE is set, workers hand their
+// upstream connections over to a pool instead. The next worker (or the main
+// process) forwarding a query to the same server takes a connection from there.
+//
+// The pool is a datagram socket pair created before any worker is forked. Idle
+// connections are queued in it as SCM_RIGHTS messages, the kernel keeps them
+// open while they are in flight. This way the pool is shared by all processes
+// without any locking. Connections idle for longer than TCP_POOL_IDLE seconds
+// or closed by the server are discarded
+static int pool[2] = { -1, -1 };
+
+struct pool_entry {
+	union mysockaddr addr;
+	union mysockaddr source_addr;
+	char interface[IF_NAMESIZE+1];
+	time_t idle_since;
+};
+
+// Create the pool, this has to be done before forking the TCP workers
+void tcp_pool_init(void)
+{
+	if(config.tcp_pool_idle == 0 || pool[0] != -1)
+		return;
+
+	if(socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pool) != 0)
+	{
+		logg("WARNING: Cannot create pool of upstream TCP connections: %s", strerror(errno));
+		pool[0] = pool[1] = -1;
+	}
+}
+
+static bool __attribute__((pure)) pool_enabled(void)
+{
+	// Connections carrying the connection mark of a client must not be
+	// used for other clients
+	return pool[0] != -1 && !option_bool(OPT_CONNTRACK);
+}
+
+static bool same_server(const struct pool_entry *entry, const struct server *serv)
+{
+	return sockaddr_isequal(&entry->addr, &serv->addr) &&
+	       entry->source_addr.sa.sa_family == serv->source_addr.sa.sa_family &&
+	       (serv->source_addr.sa.sa_family != AF_INET ||
+	        entry->source_addr.in.sin_addr.s_addr == serv->source_addr.in.sin_addr.s_addr) &&
+	       (serv->source_addr.sa.sa_family != AF_INET6 ||
+	        IN6_ARE_ADDR_EQUAL(&entry->source_addr.in6.sin6_addr, &serv->source_addr.in6.sin6_addr)) &&
+	       strcmp(entry->interface, serv->interface) == 0;
+}
+
+// A connection closed by the server (or with unexpected data pending) is
+// readable while it should be idle
+static bool connection_usable(const int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	return poll(&pfd, 1, 0) == 0;
+}
+
+static bool pool_send(const struct pool_entry *entry, const int fd)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { .iov_base = (void*)entry, .iov_len = sizeof(*entry) };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = control.buf, .msg_controllen = sizeof(control.buf)
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	ssize_t ret;
+	while((ret = sendmsg(pool[0], &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) == -1 && errno == EINTR);
+	return ret == (ssize_t)sizeof(*entry);
+}
+
+// Returns the file descriptor of the connection, -1 if the pool is empty
+static int pool_recv(struct pool_entry *entry)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { .iov_base = entry, .iov_len = sizeof(*entry) };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = control.buf, .msg_controllen = sizeof(control.buf)
+	};
+
+	while(true)
+	{
+		ssize_t ret;
+		while((ret = recvmsg(pool[1], &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+		if(ret == -1)
+			return -1;
+
+		int fd = -1;
+		const struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+		if(ret == (ssize_t)sizeof(*entry) && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) && fd != -1)
+			return fd;
+
+		// Should not happen, skip this message
+		if(fd != -1)
+			close(fd);
+	}
+}
+
+static void close_connection(const int fd)
+{
+	shutdown(fd, SHUT_RDWR);
+	close(fd);
+}
+
+// Take an idle connection to this server from the pool. Returns -1 if there is
+// none. Connections to other servers are put back, expired ones are closed
+int FTL_tcp_pool_get(const struct server *serv)
+{
+	if(!pool_enabled())
+		return -1;
+
+	const time_t now = dnsmasq_time();
+	struct pool_entry entries[TCP_POOL_SCAN_MAX];
+	int fds[TCP_POOL_SCAN_MAX];
+	unsigned int n = 0u;
+	int best = -1;
+
+	for(unsigned int i = 0; i < TCP_POOL_SCAN_MAX; i++)
+	{
+		struct pool_entry *entry = &entries[n];
+		const int fd = pool_recv(entry);
+		if(fd == -1)
+			break;
+
+		if(difftime(now, entry->idle_since) >= config.tcp_pool_idle || !connection_usable(fd))
+		{
+			close_connection(fd);
+			continue;
+		}
+
+		// Prefer the connection used most recently, the server is least
+		// likely to have closed it
+		if(serv != NULL && same_server(entry, serv) &&
+		   (best == -1 || entry->idle_since >= entries[best].idle_since))
+			best = (int)n;
+
+		fds[n++] = fd;
+	}
+
+	// Put back everything we do not use
+	for(unsigned int i = 0; i < n; i++)
+	{
+		if((int)i == best)
+			continue;
+		if(pool_send(&entries[i], fds[i]))
+			close(fds[i]);
+		else
+			close_connection(fds[i]);
+	}
+
+	return best > -1 ? fds[best] : -1;
+}
+
+// Hand a connection which is not needed any longer over to the pool. Returns
+// false if the pool cannot take it, the caller has to close it then
+bool FTL_tcp_pool_put(const struct server *serv, const int fd)
+{
+	if(!pool_enabled() || fd == -1)
+		return false;
+
+	struct pool_entry entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.addr = serv->addr;
+	entry.source_addr = serv->source_addr;
+	memcpy(entry.interface, serv->interface, sizeof(entry.interface));
+	entry.idle_since = dnsmasq_time();
+
+	if(!connection_usable(fd) || !pool_send(&entry, fd))
+		return false;
+
+	// The kernel holds a reference to the connection now
+	close(fd);
+	return true;
+}
+
+// Close the connections which have been idle for too long, called by the main
+// process
+void FTL_tcp_pool_expire(const time_t now)
+{
+	static time_t last = 0;
+	if(!pool_enabled() || now - last < (time_t)config.tcp_pool_idle)
+		return;
+
+	last = now;
+	FTL_tcp_pool_get(NULL);
+}
+
+// Count a reply received over TCP from an upstream server on a new or on a
+// reused connection
+void FTL_TCP_upstream_reply(const union mysockaddr *addr, const bool reused)
+{
+	char ip[ADDRSTRLEN] = { 0 };
+	in_port_t port;
+	if(addr->sa.sa_family == AF_INET6)
+	{
+		inet_ntop(AF_INET6, &addr->in6.sin6_addr, ip, ADDRSTRLEN);
+		port = ntohs(addr->in6.sin6_port);
+	}
+	else
+	{
+		inet_ntop(AF_INET, &addr->in.sin_addr, ip, ADDRSTRLEN);
+		port = ntohs(addr->in.sin_port);
+	}
+
+	lock_shm();
+	upstreamsData *upstream = getUpstream(findUpstreamID(ip, port), true);
+	if(upstream != NULL)
+	{
+		if(reused)
+			upstream->tcp.reused++;
+		else
+			upstream->tcp.opened++;
+	}
+	unlock_shm();
+}
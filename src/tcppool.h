@@ -0,0 +1,20 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Pool of persistent upstream TCP connections prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef TCPPOOL_H
+#define TCPPOOL_H
+
+// Maximum number of idle connections looked at when taking one from the pool
+#define TCP_POOL_SCAN_MAX 64
+
+// FTL_tcp_pool_get() and the other functions called by dnsmasq are declared in
+// dnsmasq_interface.h
+void tcp_pool_init(void);
+
+#endif //TCPPOOL_H
@@ -0,0 +1,155 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  CPU affinity and scheduling of FTL's threads
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "threadsched.h"
+#include "log.h"
+// sched_setaffinity(), sched_setscheduler()
+#include <sched.h>
+// setpriority()
+#include <sys/resource.h>
+// syscall(), SYS_gettid
+#include <sys/syscall.h>
+
+// The settings are read from pihole-FTL.conf once at startup, before any of
+// the threads is created. Each thread applies its own settings when it
+// starts. Targets without settings keep what they inherited from the thread
+// which created them
+static struct {
+	bool cpus_set;
+	bool policy_set;
+	bool nice_set;
+	int policy;
+	int nice;
+	cpu_set_t cpus;
+} settings[SCHED_TARGETS] = {{ 0 }};
+
+// Names used in the config keys, e.g., CPU_AFFINITY_DATABASE
+static const char *const names[SCHED_TARGETS] = {
+	[DB] = "DATABASE",
+	[GC] = "HOUSEKEEPER",
+	[DNSclient] = "DNSCLIENT",
+	[STREAM] = "STREAM",
+	[STATS] = "STATISTICS",
+	[PCAP] = "PCAP",
+	[QUERYLOG] = "QUERYLOG",
+	[DNSTAP] = "DNSTAP",
+	[FEDERATION] = "FEDERATION",
+	[REPLICA] = "REPLICA",
+	[PROBE] = "PROBE",
+	[LOGWRITER] = "LOGWRITER",
+	[SCHED_DNS] = "DNS",
+	[SCHED_API] = "API",
+};
+
+const char * __attribute__((const)) thread_sched_name(const unsigned int target)
+{
+	return target < SCHED_TARGETS ? names[target] : NULL;
+}
+
+// Parse a list of CPUs like "0,2-3"
+bool thread_sched_set_cpus(const unsigned int target, const char *cpulist)
+{
+	if(target >= SCHED_TARGETS || cpulist == NULL)
+		return false;
+
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	const char *p = cpulist;
+	while(*p != '\0')
+	{
+		char *end = NULL;
+		const long first = strtol(p, &end, 10);
+		long last = first;
+		if(end == p)
+			return false;
+		p = end;
+		if(*p == '-')
+		{
+			p++;
+			last = strtol(p, &end, 10);
+			if(end == p)
+				return false;
+			p = end;
+		}
+		if(first < 0 || last < first || last >= CPU_SETSIZE)
+			return false;
+		for(long cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, &cpus);
+
+		while(*p == ',' || *p == ' ')
+			p++;
+	}
+
+	if(CPU_COUNT(&cpus) == 0)
+		return false;
+
+	settings[target].cpus = cpus;
+	settings[target].cpus_set = true;
+	return true;
+}
+
+bool thread_sched_set_policy(const unsigned int target, const char *policy)
+{
+	if(target >= SCHED_TARGETS || policy == NULL)
+		return false;
+
+	if(strcasecmp(policy, "normal") == 0)
+		settings[target].policy = SCHED_OTHER;
+	else if(strcasecmp(policy, "batch") == 0)
+		settings[target].policy = SCHED_BATCH;
+	else if(strcasecmp(policy, "idle") == 0)
+		settings[target].policy = SCHED_IDLE;
+	else
+		return false;
+
+	settings[target].policy_set = true;
+	return true;
+}
+
+bool thread_sched_set_nice(const unsigned int target, const int nice)
+{
+	if(target >= SCHED_TARGETS || nice < -20 || nice > 19)
+		return false;
+
+	settings[target].nice = nice;
+	settings[target].nice_set = true;
+	return true;
+}
+
+// Apply the settings of a target to the calling thread. On Linux, all of
+// these act on the calling thread only (not on the entire process) when
+// given its thread ID
+void thread_sched_apply(const unsigned int target)
+{
+	if(target >= SCHED_TARGETS)
+		return;
+
+	const pid_t tid = (pid_t)syscall(SYS_gettid);
+
+	if(settings[target].cpus_set &&
+	   sched_setaffinity(tid, sizeof(settings[target].cpus), &settings[target].cpus) != 0)
+		logg("WARNING: Unable to set CPU affinity of %s thread: %s",
+		     names[target], strerror(errno));
+
+	if(settings[target].policy_set)
+	{
+		const struct sched_param param = { .sched_priority = 0 };
+		if(sched_setscheduler(tid, settings[target].policy, &param) != 0)
+			logg("WARNING: Unable to set scheduling policy of %s thread: %s",
+			     names[target], strerror(errno));
+	}
+
+	// Lowering the niceness (raising the priority) requires CAP_SYS_NICE
+	if(settings[target].nice_set &&
+	   setpriority(PRIO_PROCESS, (id_t)tid, settings[target].nice) != 0)
+		logg("WARNING: Unable to set nice value of %s thread: %s",
+		     names[target], strerror(errno));
+}
@@ -0,0 +1,30 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  CPU affinity and scheduling of FTL's threads prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef THREADSCHED_H
+#define THREADSCHED_H
+
+#include <stdbool.h>
+// enum thread_types
+#include "enums.h"
+
+// Besides the background threads (enum thread_types), the DNS event loop
+// (main process and its DNS workers) and the telnet API threads can be
+// configured
+#define SCHED_DNS THREADS_MAX
+#define SCHED_API (THREADS_MAX + 1)
+#define SCHED_TARGETS (THREADS_MAX + 2)
+
+const char *thread_sched_name(const unsigned int target) __attribute__((const));
+bool thread_sched_set_cpus(const unsigned int target, const char *cpulist);
+bool thread_sched_set_policy(const unsigned int target, const char *policy);
+bool thread_sched_set_nice(const unsigned int target, const int nice);
+void thread_sched_apply(const unsigned int target);
+
+#endif //THREADSCHED_H
@@ -11,9 +11,31 @@
 #include "FTL.h"
 #include "timers.h"
 #include "log.h"
+// FTL_gettid()
+#include "daemon.h"
+// update_min(), update_max(), monotonic_usec()
+#include "histogram.h"
 
 struct timespec t0[NUMTIMERS];
 
+// Statistics of all timers of this process. The enumerated timers occupy the
+// first slots, named timers are added by timer_register(). Several threads
+// may record durations concurrently, hence all updates are atomic. Entries
+// are never removed, pointers to them stay valid
+static timer_stats registry[TIMER_STATS_MAX] = {
+	[DATABASE_WRITE_TIMER] = { .name = "database_write", .min = UINT64_MAX },
+	[EXIT_TIMER] = { .name = "exit", .min = UINT64_MAX },
+	[GC_TIMER] = { .name = "gc", .min = UINT64_MAX },
+	[GC_SLICE_TIMER] = { .name = "gc_slice", .min = UINT64_MAX },
+	[LISTS_TIMER] = { .name = "lists_reload", .min = UINT64_MAX },
+	[REGEX_TIMER] = { .name = "regex_compile", .min = UINT64_MAX },
+	[ARP_TIMER] = { .name = "neighbor_cache", .min = UINT64_MAX },
+	[DATABASE_FLUSH_TIMER] = { .name = "database_flush", .min = UINT64_MAX },
+	[DATABASE_MAINTENANCE_TIMER] = { .name = "database_maintenance", .min = UINT64_MAX },
+};
+static unsigned int num_timers = NUMTIMERS;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void timer_start(const enum timers i)
 {
 	if(i >= NUMTIMERS)
@@ -21,7 +43,7 @@ void timer_start(const enum timers i)
 		logg("Code error: Timer %i not defined in timer_start().", i);
 		exit(EXIT_FAILURE);
 	}
-	clock_gettime(CLOCK_REALTIME, &t0[i]);
+	clock_gettime(CLOCK_MONOTONIC, &t0[i]);
 }
 
 static struct timespec diff(struct timespec start, struct timespec end)
@@ -48,11 +70,263 @@ double timer_elapsed_msec(const enum timers i)
 		exit(EXIT_FAILURE);
 	}
 	struct timespec t1, td;
-	clock_gettime(CLOCK_REALTIME, &t1);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
 	td = diff(t0[i], t1);
 	return td.tv_sec * 1e3 + td.tv_nsec * 1e-6;
 }
 
+// Record the time elapsed since timer_start() in the statistics of this timer
+// and return it
+double timer_stop(const enum timers i)
+{
+	const double msec = timer_elapsed_msec(i);
+	timer_record(&registry[i], (uint64_t)(msec * 1e3));
+	return msec;
+}
+
+// Get the histogram bin for a duration. Bins have a relative width of at most
+// 2^-TIMER_SUB_BITS, similar to an HDR histogram
+static unsigned int __attribute__((const)) timer_hist_bin(const uint64_t usec)
+{
+	const uint64_t sub = 1u << TIMER_SUB_BITS;
+	if(usec < sub)
+		return usec;
+	const unsigned int msb = 63 - __builtin_clzll(usec);
+	const unsigned int shift = msb - TIMER_SUB_BITS;
+	const unsigned int bin = (shift + 1) * sub + ((usec >> shift) & (sub - 1));
+	return bin < TIMER_HIST_BINS ? bin : TIMER_HIST_BINS - 1;
+}
+
+// Smallest duration counted in a histogram bin
+static uint64_t __attribute__((const)) hist_lower(const unsigned int bin)
+{
+	const uint64_t sub = 1u << TIMER_SUB_BITS;
+	if(bin < sub)
+		return bin;
+	const unsigned int shift = bin / sub - 1;
+	return (sub + bin % sub) << shift;
+}
+
+// Get the timer with the given name, it is created if it does not exist yet.
+// Returns NULL if there are too many timers
+timer_stats *timer_register(const char *name)
+{
+	timer_stats *stats = NULL;
+	pthread_mutex_lock(&registry_lock);
+	for(unsigned int i = 0; i < num_timers; i++)
+	{
+		if(strcmp(registry[i].name, name) == 0)
+		{
+			stats = &registry[i];
+			break;
+		}
+	}
+	if(stats == NULL && num_timers < TIMER_STATS_MAX)
+	{
+		stats = &registry[num_timers];
+		stats->name = name;
+		stats->min = UINT64_MAX;
+		// Publish the new entry only after it has been initialized
+		__atomic_store_n(&num_timers, num_timers + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&registry_lock);
+
+	if(stats == NULL)
+		logg("WARN: Cannot register timer %s, there are already %u timers", name, TIMER_STATS_MAX);
+	return stats;
+}
+
+void timer_record(timer_stats *stats, const uint64_t usec)
+{
+	if(stats == NULL)
+		return;
+	__atomic_fetch_add(&stats->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->total, usec, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->hist[timer_hist_bin(usec)], 1, __ATOMIC_RELAXED);
+	update_min(&stats->min, usec);
+	update_max(&stats->max, usec);
+}
+
+// Start a scoped timer (see TIME_SCOPE()). The timer is registered when the
+// scope is entered for the first time and remembered in *stats
+scoped_timer timer_scope_begin(timer_stats **stats, const char *name)
+{
+	timer_stats *s = __atomic_load_n(stats, __ATOMIC_ACQUIRE);
+	if(s == NULL)
+	{
+		s = timer_register(name);
+		__atomic_store_n(stats, s, __ATOMIC_RELEASE);
+	}
+	return (scoped_timer){ s, monotonic_usec() };
+}
+
+void timer_scope_end(scoped_timer *timer)
+{
+	timer_record(timer->stats, monotonic_usec() - timer->start);
+}
+
+unsigned int timer_stats_num(void)
+{
+	return __atomic_load_n(&num_timers, __ATOMIC_ACQUIRE);
+}
+
+const timer_stats *timer_stats_get(const unsigned int i)
+{
+	if(i >= timer_stats_num())
+		return NULL;
+	return &registry[i];
+}
+
+// Estimate the p-quantile (0 <= p <= 1) of the recorded durations [usec] as
+// the middle of the histogram bin it falls into
+uint64_t timer_stats_percentile(const timer_stats *stats, const double p)
+{
+	uint64_t counts[TIMER_HIST_BINS], total = 0;
+	for(unsigned int i = 0; i < TIMER_HIST_BINS; i++)
+		total += counts[i] = __atomic_load_n(&stats->hist[i], __ATOMIC_RELAXED);
+	if(total == 0)
+		return 0;
+
+	const uint64_t rank = (uint64_t)(p * (total - 1));
+	uint64_t seen = 0;
+	for(unsigned int i = 0; i < TIMER_HIST_BINS - 1; i++)
+	{
+		seen += counts[i];
+		if(seen > rank)
+			return (hist_lower(i) + hist_lower(i + 1)) / 2;
+	}
+	return __atomic_load_n(&stats->max, __ATOMIC_RELAXED);
+}
+
+// Reset the statistics of the named timer or of all timers when name is NULL.
+// Durations recorded concurrently may be partially lost. Returns false if
+// there is no such timer
+bool timer_stats_reset(const char *name)
+{
+	bool found = false;
+	const unsigned int num = timer_stats_num();
+	for(unsigned int i = 0; i < num; i++)
+	{
+		timer_stats *stats = &registry[i];
+		if(name != NULL && strcmp(stats->name, name) != 0)
+			continue;
+
+		__atomic_store_n(&stats->count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats->total, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats->min, UINT64_MAX, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats->max, 0, __ATOMIC_RELAXED);
+		for(unsigned int j = 0; j < TIMER_HIST_BINS; j++)
+			__atomic_store_n(&stats->hist[j], 0, __ATOMIC_RELAXED);
+		found = true;
+	}
+	return found;
+}
+
+// Wall clock time (seconds) for timestamps on the hot paths. The DNS event
+// loop refreshes it once per wakeup (see clock_refresh()) so all queries
+// handled in the same iteration share one clock read. Threads and TCP forks,
+// which do not run the event loop, read the coarse clock instead
+static __thread time_t loop_time = 0;
+
+static time_t coarse_time(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME_COARSE, &now);
+	return now.tv_sec;
+}
+
+void clock_refresh(void)
+{
+	loop_time = coarse_time();
+}
+
+// Stop using the event loop time in the current thread until it is refreshed
+// again, e.g., after forking a process which does not run the event loop
+void clock_invalidate(void)
+{
+	loop_time = 0;
+}
+
+// Let the current thread run at a simulated time, used by the soak benchmark
+// to replay days of queries in minutes
+void clock_set(const time_t now)
+{
+	loop_time = now;
+}
+
+time_t ftl_time(void)
+{
+	return loop_time != 0 ? loop_time : coarse_time();
+}
+
+// Phases of the startup, some of them run concurrently. They are identified by
+// their name and logged together by startup_report() once the resolver is
+// ready
+static struct {
+	const char *name;
+	uint64_t start;
+	uint64_t end;
+	bool main;
+} phases[STARTUP_PHASES_MAX];
+static unsigned int num_phases = 0u;
+static uint64_t startup_time = 0u;
+static pthread_mutex_t phases_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void startup_phase_begin(const char *name)
+{
+	const uint64_t now = monotonic_usec();
+	pthread_mutex_lock(&phases_lock);
+	if(startup_time == 0u)
+		startup_time = now;
+	if(num_phases < STARTUP_PHASES_MAX)
+	{
+		phases[num_phases].name = name;
+		phases[num_phases].start = now;
+		phases[num_phases].end = 0u;
+		phases[num_phases].main = FTL_gettid() == getpid();
+		num_phases++;
+	}
+	pthread_mutex_unlock(&phases_lock);
+}
+
+void startup_phase_end(const char *name)
+{
+	const uint64_t now = monotonic_usec();
+	pthread_mutex_lock(&phases_lock);
+	for(unsigned int i = num_phases; i-- > 0u;)
+	{
+		if(strcmp(phases[i].name, name) == 0 && phases[i].end == 0u)
+		{
+			phases[i].end = now;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&phases_lock);
+}
+
+// Log the start (relative to the first phase) and duration of all phases.
+// Phases running in a helper thread are marked as concurrent
+void startup_report(void)
+{
+	const uint64_t now = monotonic_usec();
+	pthread_mutex_lock(&phases_lock);
+	logg("Startup report (%u phases, %.1f ms until ready):",
+	     num_phases, 1e-3*(now - startup_time));
+	for(unsigned int i = 0u; i < num_phases; i++)
+	{
+		if(phases[i].end == 0u)
+			logg("   %-28s +%9.1f ms  (not finished)%s", phases[i].name,
+			     1e-3*(phases[i].start - startup_time),
+			     phases[i].main ? "" : "  concurrent");
+		else
+			logg("   %-28s +%9.1f ms %9.1f ms%s", phases[i].name,
+			     1e-3*(phases[i].start - startup_time),
+			     1e-3*(phases[i].end - phases[i].start),
+			     phases[i].main ? "" : "  concurrent");
+	}
+	pthread_mutex_unlock(&phases_lock);
+}
+
 void sleepms(const int milliseconds)
 {
 	struct timeval tv;
@@ -10,21 +10,78 @@
 #ifndef TIMERS_H
 #define TIMERS_H
 
+#include <stdint.h>
+#include <stdbool.h>
+// time_t
+#include <time.h>
+
 // Timer enumeration
 enum timers {
 	DATABASE_WRITE_TIMER,
 	EXIT_TIMER,
 	GC_TIMER,
+	GC_SLICE_TIMER,
 	LISTS_TIMER,
 	REGEX_TIMER,
 	ARP_TIMER,
+	DATABASE_FLUSH_TIMER,
+	DATABASE_MAINTENANCE_TIMER,
 	LAST_TIMER
 	} __attribute__ ((packed));
 
 #define NUMTIMERS LAST_TIMER
 
+// Maximum number of named timers, including the enumerated ones above
+#define TIMER_STATS_MAX 64
+// Number of histogram bins. Durations below 2^TIMER_SUB_BITS usec have a bin
+// each, every further power of two is split into 2^TIMER_SUB_BITS bins. The
+// last bin counts everything above (about two hours)
+#define TIMER_SUB_BITS 2
+#define TIMER_HIST_BINS 128
+// Maximum number of phases in the startup report
+#define STARTUP_PHASES_MAX 24
+
+typedef struct {
+	const char *name;
+	uint64_t count;
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+	uint64_t hist[TIMER_HIST_BINS];
+} timer_stats;
+
+typedef struct {
+	timer_stats *stats;
+	uint64_t start;
+} scoped_timer;
+
 void timer_start(const enum timers i);
 double timer_elapsed_msec(const enum timers i);
+double timer_stop(const enum timers i);
+timer_stats *timer_register(const char *name);
+void timer_record(timer_stats *stats, const uint64_t usec);
+scoped_timer timer_scope_begin(timer_stats **stats, const char *name);
+void timer_scope_end(scoped_timer *timer);
+unsigned int timer_stats_num(void) __attribute__((pure));
+const timer_stats *timer_stats_get(const unsigned int i) __attribute__((pure));
+uint64_t timer_stats_percentile(const timer_stats *stats, const double p);
+bool timer_stats_reset(const char *name);
+void startup_phase_begin(const char *name);
+void startup_phase_end(const char *name);
+void startup_report(void);
 void sleepms(const int milliseconds);
+time_t ftl_time(void);
+void clock_refresh(void);
+void clock_invalidate(void);
+void clock_set(const time_t now);
+
+// Account the time until the end of the enclosing scope to the named timer.
+// The timer is looked up only the first time this line is executed
+#define TIME_SCOPE(name) TIME_SCOPE_(name, __LINE__)
+#define TIME_SCOPE_(name, line) TIME_SCOPE__(name, line)
+#define TIME_SCOPE__(name, line) \
+	static timer_stats *scope_stats_##line = NULL; \
+	scoped_timer scope_timer_##line __attribute__((cleanup(timer_scope_end))) = \
+		timer_scope_begin(&scope_stats_##line, name)
 
 #endif //TIMERS_H
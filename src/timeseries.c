@@ -0,0 +1,96 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Multi-resolution query time series
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "timeseries.h"
+
+// Every query is counted in the slot of its interval in each of the tiers.
+// Slots are addressed by the absolute interval number modulo the size of the
+// ring, so they never have to be moved. A slot still holding an older
+// interval is recycled the first time a query of a newer interval arrives.
+// Unlike overTime, the counts are kept when queries are garbage collected,
+// the coarser tiers go back further than the queries in memory
+static const struct {
+	unsigned int interval;
+	unsigned int slots;
+	unsigned int offset;
+} tiers[] = {
+	{   10u,  360u,    0u }, // 10 seconds for one hour
+	{   60u, 1440u,  360u }, // 1 minute for one day
+	{  600u, 1008u, 1800u }, // 10 minutes for one week
+	{ 3600u,  720u, 2808u }, // 1 hour for 30 days
+};
+#define NUM_TIERS (sizeof(tiers)/sizeof(tiers[0]))
+
+// Add new queries (total) or change their blocking status (blocked) in all
+// tiers
+void timeseries_update(const uint32_t timestamp, const int total, const int blocked)
+{
+	for(unsigned int t = 0; t < NUM_TIERS; t++)
+	{
+		const uint32_t interval = timestamp / tiers[t].interval;
+		const uint32_t start = interval * tiers[t].interval;
+		timeseriesSlot *slot = &timeseries->slots[tiers[t].offset + interval % tiers[t].slots];
+
+		// The slot already holds a newer interval, the query is too old for
+		// this tier
+		if(slot->start > start)
+			continue;
+
+		if(slot->start < start)
+		{
+			slot->start = start;
+			slot->total = 0;
+			slot->blocked = 0;
+		}
+
+		slot->total += total;
+		slot->blocked += blocked;
+	}
+}
+
+// Get the tier with the given interval length (in seconds), -1 if there is
+// no such tier
+int __attribute__((const)) timeseries_tier(const unsigned int interval)
+{
+	for(unsigned int t = 0; t < NUM_TIERS; t++)
+		if(tiers[t].interval == interval)
+			return t;
+	return -1;
+}
+
+unsigned int __attribute__((const)) timeseries_tier_slots(const int tier)
+{
+	return tiers[tier].slots;
+}
+
+// Get the i-th slot (counting from the oldest one) of the window of a tier
+// ending with the current interval. The timestamp is centered in the interval
+// as for overTime. Intervals without queries have zero counts
+void timeseries_get(const int tier, const unsigned int i, const time_t now,
+                    time_t *timestamp, int *total, int *blocked)
+{
+	const uint32_t newest = (uint32_t)now / tiers[tier].interval;
+	const uint32_t interval = newest - (tiers[tier].slots - 1u) + i;
+	const uint32_t start = interval * tiers[tier].interval;
+	const timeseriesSlot *slot = &timeseries->slots[tiers[tier].offset + interval % tiers[tier].slots];
+
+	*timestamp = start + tiers[tier].interval / 2;
+	if(slot->start == start)
+	{
+		*total = slot->total;
+		*blocked = slot->blocked;
+	}
+	else
+	{
+		*total = 0;
+		*blocked = 0;
+	}
+}
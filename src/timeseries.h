@@ -0,0 +1,41 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Multi-resolution query time series prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef TIMESERIES_H
+#define TIMESERIES_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Total number of slots of all tiers (see tiers[] in timeseries.c)
+#define TIMESERIES_SLOTS 3528
+
+typedef struct {
+	// Start of the interval this slot currently counts queries of
+	uint32_t start;
+	int total;
+	int blocked;
+} timeseriesSlot;
+
+// Rings of query counts at increasing interval lengths (10 seconds to one
+// hour). They live in shared memory as queries are also added by the forks.
+// Updated while holding the SHM lock exclusively and read holding it shared
+typedef struct {
+	timeseriesSlot slots[TIMESERIES_SLOTS];
+} timeseriesStruct;
+
+extern timeseriesStruct *timeseries;
+
+void timeseries_update(const uint32_t timestamp, const int total, const int blocked);
+int timeseries_tier(const unsigned int interval) __attribute__((const));
+unsigned int timeseries_tier_slots(const int tier) __attribute__((const));
+void timeseries_get(const int tier, const unsigned int i, const time_t now,
+                    time_t *timestamp, int *total, int *blocked);
+
+#endif //TIMESERIES_H
@@ -14,8 +14,6 @@
 #include "log.h"
 // get_hardware_address()
 #include "dhcp-discover.h"
-// sleepms()
-#include "timers.h"
 // check_capability()
 #include "capabilities.h"
 #include <linux/capability.h>
@@ -23,13 +21,13 @@
 #include <linux/if_packet.h>
 #include <linux/if_ether.h>
 #include <linux/if_arp.h>
+#include <linux/rtnetlink.h>
+#include <sys/epoll.h>
 //htons etc
 #include <arpa/inet.h>
 
-// How many threads do we spawn at maximum?
-// This is also the limit for interfaces
-// we scan for DHCP activity.
-#define MAXTHREADS 32
+// How many interfaces do we scan at maximum?
+#define MAX_IFACES 32
 
 // How many MAC addresses do we store per IP address?
 #define MAX_MACS 3
@@ -37,8 +35,19 @@
 // How many ARP requests do we send per IP address?
 #define NUM_SCANS 10
 
-// How long do we wait for ARP replies in each scan [seconds]?
-#define ARP_TIMEOUT 1
+// How long do we wait for ARP replies after the last request [milliseconds]?
+#define ARP_TIMEOUT 1000
+
+// ARP requests are sent at an adaptive rate on each interface [packets per
+// second]. The rate is halved whenever requests or replies are dropped and
+// increased by an eighth in every ARP_RATE_INTERVAL without drops
+#define ARP_RATE_INITIAL 1000
+#define ARP_RATE_MIN 50
+#define ARP_RATE_MAX 20000
+#define ARP_RATE_INTERVAL 100
+
+// How many ARP requests do we send back-to-back at most?
+#define ARP_BURST 64
 
 // Protocol definitions
 #define PROTO_ARP 0x0806
@@ -49,6 +58,7 @@
 #define ARP_REQUEST 0x01
 #define ARP_REPLY 0x02
 #define BUF_SIZE 60
+#define ARP_REQUEST_LEN 42
 
 // ARP header struct
 // See https://en.wikipedia.org/wiki/Address_Resolution_Protocol#Packet_structure
@@ -89,51 +99,75 @@ enum status {
 	STATUS_COMPLETE
 } __attribute__ ((packed));
 
-struct thread_data {
+struct scan_data {
 	bool scan_all :1;
 	bool extreme :1;
 	char iface[IF_NAMESIZE + 1];
 	char ipstr[INET_ADDRSTRLEN];
 	unsigned char mac[MAC_LENGTH];
 	enum status status;
+	int fd;
+	int ifindex;
 	int dst_cidr;
+	// Round of requests currently being sent and the index of the next
+	// address to be requested in this round
 	unsigned int num_scans;
+	uint32_t next;
 	unsigned int total_scans;
 	size_t result_size;
 	uint32_t scanned_addresses;
+	// Pacing of the requests
+	double rate;
+	double tokens;
+	double max_rate;
+	uint64_t last_refill;
+	uint64_t last_adapted;
+	unsigned int drops;
+	unsigned long total_drops;
+	// Number of replies received and time the last request has been sent
+	// in each round. Replies of rounds older than evaluated are complete
+	unsigned int round_replies[10*NUM_SCANS];
+	uint64_t round_done[10*NUM_SCANS];
+	unsigned int evaluated;
 	const char *error;
 	struct ifaddrs *ifa;
 	union {
 		struct arp_result_extreme *result_extreme;
 		struct arp_result *result;
 	};
+	unsigned char request[BUF_SIZE];
+	struct sockaddr_ll socket_address;
 	struct sockaddr_in src_addr;
 	struct sockaddr_in dst_addr;
 	struct sockaddr_in mask;
 };
 
-// Sends multiple ARP who-has request on interface ifindex, using source mac src_mac and source ip src_ip.
-// Iterates over all IP addresses in the range of dst_ip/cidr.
-static int send_arps(const int fd, const int ifindex, struct thread_data *thread_data)
+static uint64_t monotonic_msec(void)
 {
-	int err = -1;
-	unsigned char buffer[BUF_SIZE];
-	memset(buffer, 0, sizeof(buffer));
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+// Prepare the ARP who-has request sent on interface ifindex, using source mac
+// src_mac and source ip src_ip. Only the target IP address changes afterwards
+static void build_request(struct scan_data *scan)
+{
+	unsigned char *buffer = scan->request;
+	memset(buffer, 0, sizeof(scan->request));
 
 	// Construct the Ethernet header
-	struct sockaddr_ll socket_address;
-	socket_address.sll_family = AF_PACKET;
-	socket_address.sll_protocol = htons(ETH_P_ARP);
-	socket_address.sll_ifindex = ifindex;
-	socket_address.sll_hatype = htons(ARPHRD_ETHER);
-	socket_address.sll_pkttype = PACKET_BROADCAST;
-	socket_address.sll_halen = MAC_LENGTH;
-	socket_address.sll_addr[6] = 0;
-	socket_address.sll_addr[7] = 0;
+	struct sockaddr_ll *socket_address = &scan->socket_address;
+	memset(socket_address, 0, sizeof(*socket_address));
+	socket_address->sll_family = AF_PACKET;
+	socket_address->sll_protocol = htons(ETH_P_ARP);
+	socket_address->sll_ifindex = scan->ifindex;
+	socket_address->sll_hatype = htons(ARPHRD_ETHER);
+	socket_address->sll_pkttype = PACKET_BROADCAST;
+	socket_address->sll_halen = MAC_LENGTH;
 
 	struct ethhdr *send_req = (struct ethhdr *) buffer;
 	struct arp_header *arp_req = (struct arp_header *) (buffer + ETH2_HEADER_LEN);
-	ssize_t ret;
 
 	// Destination is the broadcast address
 	memset(send_req->h_dest, 0xff, MAC_LENGTH);
@@ -142,9 +176,9 @@ static int send_arps(const int fd, const int ifindex, struct thread_data *thread
 	memset(arp_req->target_mac, 0x00, MAC_LENGTH);
 
 	// Source MAC to our own MAC address
-	memcpy(send_req->h_source, thread_data->mac, MAC_LENGTH);
-	memcpy(arp_req->sender_mac, thread_data->mac, MAC_LENGTH);
-	memcpy(socket_address.sll_addr, thread_data->mac, MAC_LENGTH);
+	memcpy(send_req->h_source, scan->mac, MAC_LENGTH);
+	memcpy(arp_req->sender_mac, scan->mac, MAC_LENGTH);
+	memcpy(socket_address->sll_addr, scan->mac, MAC_LENGTH);
 
 	// Protocol type is ARP
 	send_req->h_proto = htons(ETH_P_ARP);
@@ -157,44 +191,108 @@ static int send_arps(const int fd, const int ifindex, struct thread_data *thread
 	arp_req->opcode = htons(ARP_REQUEST);
 
 	// Copy IP address to arp_req
-	memcpy(arp_req->sender_ip, &thread_data->src_addr.sin_addr.s_addr, sizeof(thread_data->src_addr.sin_addr.s_addr));
+	memcpy(arp_req->sender_ip, &scan->src_addr.sin_addr.s_addr, sizeof(scan->src_addr.sin_addr.s_addr));
+}
 
-	// Loop over all possible IP addresses in the range dst_ip/cidr
-	// We start at 1 because the first IP address has already been set above
-	struct in_addr dst_ip = thread_data->dst_addr.sin_addr;
-	for(unsigned int i = 0; i < (1u << (32 - thread_data->dst_cidr)); i++)
+// Send as many ARP requests as the current rate allows. Iterates over all IP
+// addresses in the range of dst_ip/cidr, once per round
+static int send_arps(struct scan_data *scan, const uint64_t now)
+{
+	// Refill the token bucket
+	scan->tokens += scan->rate * (double)(now - scan->last_refill) / 1000.0;
+	scan->last_refill = now;
+	if(scan->tokens > ARP_BURST)
+		scan->tokens = ARP_BURST;
+
+	struct arp_header *arp_req = (struct arp_header *) (scan->request + ETH2_HEADER_LEN);
+	while(scan->tokens >= 1.0 && scan->num_scans < scan->total_scans)
 	{
 		// Fill in target IP address
+		struct in_addr dst_ip;
+		dst_ip.s_addr = htonl(ntohl(scan->dst_addr.sin_addr.s_addr) + scan->next);
 		memcpy(arp_req->target_ip, &dst_ip.s_addr, sizeof(dst_ip.s_addr));
 
 #ifdef DEBUG
-		printf("Sending ARP request for %s@%s\n", inet_ntoa(*dst_ip), iface);
+		printf("Sending ARP request for %s@%s\n", inet_ntoa(dst_ip), scan->iface);
 #endif
 
 		// Send ARP request
-		ret = sendto(fd, buffer, 42, 0, (struct sockaddr *) &socket_address, sizeof(socket_address));
-		if (ret == -1)
+		const ssize_t ret = sendto(scan->fd, scan->request, ARP_REQUEST_LEN, 0,
+		                           (struct sockaddr *) &scan->socket_address,
+		                           sizeof(scan->socket_address));
+		if(ret == -1)
 		{
-			err = errno;
-			thread_data->error = strerror(err);
-			goto out;
+			// The queue of the interface is full, retry this address
+			// later at a lower rate
+			if(errno == EAGAIN || errno == ENOBUFS)
+			{
+				scan->drops++;
+				break;
+			}
+
+			scan->error = strerror(errno);
+			return -1;
 		}
+		scan->tokens -= 1.0;
+		scan->scanned_addresses++;
 
-		// Increment IP address
-		dst_ip.s_addr = htonl(ntohl(dst_ip.s_addr) + 1);
+		// Advance to the next IP address or round
+		if(++scan->next == scan->result_size)
+		{
+			scan->round_done[scan->num_scans++] = now;
+			scan->next = 0;
+		}
+	}
+
+	return 0;
+}
+
+// Adapt the rate to drops of requests and replies since the last call
+static void adapt_rate(struct scan_data *scan, const uint64_t now)
+{
+	scan->last_adapted = now;
+
+	// Replies the kernel dropped because we did not read them in time
+	struct tpacket_stats stats;
+	socklen_t len = sizeof(stats);
+	if(getsockopt(scan->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len) == 0)
+		scan->drops += stats.tp_drops;
+
+	// Devices which replied in the previous round but not in this one hint
+	// at requests or replies lost on the way. Rounds are evaluated once
+	// their replies had ARP_TIMEOUT to arrive
+	bool lost = false;
+	while(scan->evaluated < scan->num_scans &&
+	      scan->round_done[scan->evaluated] + ARP_TIMEOUT <= now)
+	{
+		const unsigned int k = scan->evaluated++;
+		if(k > 0 && 10*scan->round_replies[k] < 9*scan->round_replies[k - 1])
+			lost = true;
+	}
 
-		thread_data->scanned_addresses++;
+	if(scan->drops > 0 || lost)
+	{
+		scan->rate /= 2;
+		if(scan->rate < ARP_RATE_MIN)
+			scan->rate = ARP_RATE_MIN;
+	}
+	else if(scan->num_scans < scan->total_scans)
+	{
+		scan->rate += scan->rate / 8;
+		if(scan->rate > ARP_RATE_MAX)
+			scan->rate = ARP_RATE_MAX;
 	}
+	if(scan->rate > scan->max_rate)
+		scan->max_rate = scan->rate;
 
-	err = 0;
-out:
-	return err;
+	scan->total_drops += scan->drops;
+	scan->drops = 0;
 }
 
 static int create_arp_socket(const int ifindex, const char *iface, const char **error)
 {
-	// Create socket for ARP communications
-	const int arp_socket = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ARP));
+	// Create non-blocking socket for ARP communications
+	const int arp_socket = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, htons(ETH_P_ARP));
 	if(arp_socket < 0)
 	{
 		*error = strerror(errno);
@@ -219,33 +317,23 @@ static int create_arp_socket(const int ifindex, const char *iface, const char **
 		return -1;
 	}
 
-	// Set timeout
-	struct timeval tv;
-	tv.tv_sec = ARP_TIMEOUT;
-	tv.tv_usec = 0;
-	if (setsockopt(arp_socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
-	{
-		*error = strerror(errno);
-#ifdef DEBUG
-		printf("Unable to set timeout for ARP communications on interface %s: %s\n", iface, *error);
-#endif
-		close(arp_socket);
-		return -1;
-	}
+	// Replies to bursts of requests arrive in bursts, too
+	const int rcvbuf = 1 << 20;
+	setsockopt(arp_socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
 
 	return arp_socket;
 }
 
 static void add_result(struct in_addr *rcv_ip, unsigned char *sender_mac,
-                       struct thread_data *thread_data, const unsigned int scan_id)
+                       struct scan_data *scan, const unsigned int scan_id)
 {
 
 	// Check if we have already found this IP address
-	uint32_t i = ntohl(rcv_ip->s_addr) - ntohl(thread_data->dst_addr.sin_addr.s_addr);
-	if(i >= thread_data->result_size)
+	uint32_t i = ntohl(rcv_ip->s_addr) - ntohl(scan->dst_addr.sin_addr.s_addr);
+	if(i >= scan->result_size)
 	{
 		printf("Received IP address %s out of range for interface %s (%u >= %zu)\n",
-		       inet_ntoa(*rcv_ip), thread_data->iface, i, thread_data->result_size);
+		       inet_ntoa(*rcv_ip), scan->iface, i, scan->result_size);
 		return;
 	}
 
@@ -253,9 +341,9 @@ static void add_result(struct in_addr *rcv_ip, unsigned char *sender_mac,
 	unsigned int j = 0;
 	for(; j < MAX_MACS; j++)
 	{
-		unsigned char *mac = thread_data->extreme ?
-		                       thread_data->result_extreme[i].device[j].mac :
-		                       thread_data->result[i].device[j].mac;
+		unsigned char *mac = scan->extreme ?
+		                       scan->result_extreme[i].device[j].mac :
+		                       scan->result[i].device[j].mac;
 		// Check if received MAC is already stored in result[i].device[j].mac
 		if(memcmp(mac, sender_mac, MAC_LENGTH) == 0)
 		{
@@ -269,15 +357,19 @@ static void add_result(struct in_addr *rcv_ip, unsigned char *sender_mac,
 			break;
 		}
 	}
+	if(j == MAX_MACS)
+		return;
 
 	// Memorize that we have received a reply for this IP address
-	thread_data->extreme ?
-	  thread_data->result_extreme[i].device[j].replied[scan_id]++ :
-	  thread_data->result[i].device[j].replied[scan_id]++;
+	unsigned char *replied = scan->extreme ?
+	                           &scan->result_extreme[i].device[j].replied[scan_id] :
+	                           &scan->result[i].device[j].replied[scan_id];
+	if((*replied)++ == 0)
+		scan->round_replies[scan_id]++;
 }
 
-// Read all ARP responses
-static ssize_t read_arp(const int fd, struct thread_data *thread_data)
+// Read all ARP responses received so far
+static ssize_t read_arp(struct scan_data *scan)
 {
 	ssize_t ret = 0;
 	unsigned char buffer[BUF_SIZE];
@@ -285,24 +377,25 @@ static ssize_t read_arp(const int fd, struct thread_data *thread_data)
 	// Read ARP responses
 	while(ret >= 0)
 	{
-		ret = recvfrom(fd, buffer, BUF_SIZE, 0, NULL, NULL);
+		ret = recvfrom(scan->fd, buffer, BUF_SIZE, 0, NULL, NULL);
 		if (ret == -1)
 		{
 			if(errno == EAGAIN)
 			{
-				// Timeout
+				// Nothing more to read
 				ret = 0;
 				break;
 			}
 
 			// Error
-			thread_data->error = strerror(errno);
-			printf("recvfrom(): %s", thread_data->error);
+			scan->error = strerror(errno);
+			printf("recvfrom(): %s", scan->error);
 			break;
 		}
 		struct ethhdr *rcv_resp = (struct ethhdr *) buffer;
 		struct arp_header *arp_resp = (struct arp_header *) (buffer + ETH2_HEADER_LEN);
-		if (ntohs(rcv_resp->h_proto) != PROTO_ARP)
+		if (ret < ETH2_HEADER_LEN + (ssize_t)sizeof(struct arp_header) ||
+		    ntohs(rcv_resp->h_proto) != PROTO_ARP)
 		{
 #ifdef DEBUG
 			printf("Not an ARP packet");
@@ -324,7 +417,7 @@ static ssize_t read_arp(const int fd, struct thread_data *thread_data)
 
 #ifdef DEBUG
 		printf("%-16s %-20s\t%02x:%02x:%02x:%02x:%02x:%02x",
-		     thread_data->iface, inet_ntoa(sender_a),
+		     scan->iface, inet_ntoa(sender_a),
 		     arp_resp->sender_mac[0],
 		     arp_resp->sender_mac[1],
 		     arp_resp->sender_mac[2],
@@ -332,7 +425,15 @@ static ssize_t read_arp(const int fd, struct thread_data *thread_data)
 		     arp_resp->sender_mac[4],
 		     arp_resp->sender_mac[5]);
 #endif
-		add_result(&sender_a, arp_resp->sender_mac, thread_data, thread_data->num_scans);
+		// Sending and receiving overlap: a reply belongs to the round in
+		// which its address has been requested most recently. Addresses
+		// behind the next one to be requested are still in the previous
+		// round. Replies to addresses not requested yet are not ours
+		const uint32_t i = ntohl(sender_a.s_addr) - ntohl(scan->dst_addr.sin_addr.s_addr);
+		if(i < scan->next)
+			add_result(&sender_a, arp_resp->sender_mac, scan, scan->num_scans);
+		else if(scan->num_scans > 0)
+			add_result(&sender_a, arp_resp->sender_mac, scan, scan->num_scans - 1);
 	}
 
 	return ret;
@@ -360,63 +461,57 @@ static const char *get_hostname(const struct in_addr *addr)
 	return hostname;
 }
 
-static void *arp_scan_iface(void *args)
+// Prepare scanning an interface. Returns false if the interface is not scanned
+static bool prepare_iface(struct scan_data *scan)
 {
-	// Get thread_data pointer
-	struct thread_data *thread_data = (struct thread_data*)args;
-
 	// Get interface details
-	struct ifaddrs *ifa = thread_data->ifa;
+	struct ifaddrs *ifa = scan->ifa;
 
 	// Get interface name
-	const char *iface = thread_data->iface;
-
-	// Set interface name as thread name
-	prctl(PR_SET_NAME, iface, 0, 0, 0);
+	const char *iface = scan->iface;
 
 	// Get interface netmask
-	memcpy(&thread_data->mask, ifa->ifa_netmask, sizeof(thread_data->mask));
+	memcpy(&scan->mask, ifa->ifa_netmask, sizeof(scan->mask));
 
 	// Convert subnet to CIDR
-	thread_data->dst_cidr = netmask_to_cidr(&thread_data->mask.sin_addr);
+	scan->dst_cidr = netmask_to_cidr(&scan->mask.sin_addr);
 
 	// Get interface index
-	const int ifindex = if_nametoindex(iface);
+	scan->ifindex = if_nametoindex(iface);
 
 	// Scan only interfaces with CIDR >= 24
-	if(thread_data->dst_cidr < 24 && !thread_data->scan_all)
+	if(scan->dst_cidr < 24 && !scan->scan_all)
 	{
-		thread_data->status = STATUS_SKIPPED_CIDR_MISMATCH;
+		scan->status = STATUS_SKIPPED_CIDR_MISMATCH;
 #ifdef DEBUG
-		printf("Skipped interface %s (%s/%i)\n", iface, thread_data->ipstr, thread_data->dst_cidr);
+		printf("Skipped interface %s (%s/%i)\n", iface, scan->ipstr, scan->dst_cidr);
 #endif
-		pthread_exit(NULL);
+		return false;
 	}
 #ifdef DEBUG
-	printf("Scanning interface %s (%s/%i)...\n", iface, thread_data->ipstr, thread_data->dst_cidr);
+	printf("Scanning interface %s (%s/%i)...\n", iface, scan->ipstr, scan->dst_cidr);
 #endif
-	thread_data->status = STATUS_SCANNING;
 
 	// Create socket for ARP communications
-	const int arp_socket = create_arp_socket(ifindex, iface, &thread_data->error);
+	scan->fd = create_arp_socket(scan->ifindex, iface, &scan->error);
 
 	// Cannot create socket, likely a permission error
-	if(arp_socket < 0)
+	if(scan->fd < 0)
 	{
-		thread_data->status = STATUS_ERROR;
-		pthread_exit(NULL);
+		scan->status = STATUS_ERROR;
+		return false;
 	}
 
 	// Get hardware address of client machine
-	get_hardware_address(arp_socket, iface, thread_data->mac);
+	get_hardware_address(scan->fd, iface, scan->mac);
 
 	// Define destination IP address by masking source IP with netmask
-	thread_data->dst_addr.sin_addr.s_addr = thread_data->src_addr.sin_addr.s_addr & thread_data->mask.sin_addr.s_addr;
+	scan->dst_addr.sin_addr.s_addr = scan->src_addr.sin_addr.s_addr & scan->mask.sin_addr.s_addr;
 
 	// Allocate memory for ARP response buffer
-	const size_t arp_result_len = 1 << (32 - thread_data->dst_cidr);
-	thread_data->result_size = arp_result_len;
-	if(thread_data->extreme)
+	const size_t arp_result_len = 1 << (32 - scan->dst_cidr);
+	scan->result_size = arp_result_len;
+	if(scan->extreme)
 	{
 		// Allocate extreme memory for ARP response buffer
 		struct arp_result_extreme *result = calloc(arp_result_len, sizeof(struct arp_result_extreme));
@@ -424,11 +519,12 @@ static void *arp_scan_iface(void *args)
 		{
 			// Memory allocation failed due to insufficient memory being
 			// available
-			thread_data->status = STATUS_ERROR;
-			thread_data->error = strerror(ENOMEM);
-			pthread_exit(NULL);
+			scan->status = STATUS_ERROR;
+			scan->error = strerror(ENOMEM);
+			close(scan->fd);
+			return false;
 		}
-		thread_data->result_extreme = result;
+		scan->result_extreme = result;
 	}
 	else
 	{
@@ -438,69 +534,179 @@ static void *arp_scan_iface(void *args)
 		{
 			// Memory allocation failed due to insufficient memory being
 			// available
-			thread_data->status = STATUS_ERROR;
-			thread_data->error = strerror(ENOMEM);
-			pthread_exit(NULL);
+			scan->status = STATUS_ERROR;
+			scan->error = strerror(ENOMEM);
+			close(scan->fd);
+			return false;
 		}
-		thread_data->result = result;
+		scan->result = result;
+	}
+
+	build_request(scan);
+	scan->rate = ARP_RATE_INITIAL;
+	scan->max_rate = ARP_RATE_INITIAL;
+	scan->last_refill = scan->last_adapted = monotonic_msec();
+	scan->status = STATUS_SCANNING;
+
+	return true;
+}
+
+// Finish scanning an interface
+static void finish_iface(struct scan_data *scan, const bool error)
+{
+	// Close socket
+	if(close(scan->fd) != 0 || error)
+		scan->status = STATUS_ERROR;
+	else
+		scan->status = STATUS_COMPLETE;
+	scan->fd = -1;
+}
+
+// Scan all interfaces at once. A single loop sends paced requests on all
+// interfaces and receives replies while the requests are still being sent
+static void scan_ifaces(struct scan_data *scans, const unsigned int num)
+{
+	const int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(epfd < 0)
+	{
+		printf("Unable to create epoll instance: %s\n", strerror(errno));
+		for(unsigned int i = 0; i < num; i++)
+			if(scans[i].status == STATUS_SCANNING)
+				finish_iface(&scans[i], true);
+		return;
 	}
 
-	for(thread_data->num_scans = 0; thread_data->num_scans < thread_data->total_scans; thread_data->num_scans++)
+	unsigned int active = 0;
+	for(unsigned int i = 0; i < num; i++)
 	{
-#ifdef DEBUG
-		printf("Still scanning interface %s (%s/%i) %i%%...\n", iface, thread_data->ipstr, thread_data->dst_cidr, 100*scan_id/thread_data->total_scans);
-#endif
-		// Send ARP requests to all IPs in subnet
-		if(send_arps(arp_socket, ifindex, thread_data) != 0)
+		if(scans[i].status != STATUS_SCANNING)
+			continue;
+
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &scans[i] };
+		if(epoll_ctl(epfd, EPOLL_CTL_ADD, scans[i].fd, &ev) != 0)
 		{
-			thread_data->status = STATUS_ERROR;
-			break;
+			scans[i].error = strerror(errno);
+			finish_iface(&scans[i], true);
+			continue;
 		}
+		active++;
+	}
 
-		// Read ARP responses
-		if(read_arp(arp_socket, thread_data) != 0)
+	unsigned int progress = 0;
+	uint64_t last_progress = monotonic_msec();
+	while(active > 0)
+	{
+		const uint64_t now = monotonic_msec();
+		int timeout = ARP_RATE_INTERVAL;
+		for(unsigned int i = 0; i < num; i++)
 		{
-			thread_data->status = STATUS_ERROR;
-			break;
+			struct scan_data *scan = &scans[i];
+			if(scan->status != STATUS_SCANNING)
+				continue;
+
+			if(send_arps(scan, now) != 0)
+			{
+				finish_iface(scan, true);
+				active--;
+				continue;
+			}
+
+			if(now - scan->last_adapted >= ARP_RATE_INTERVAL)
+				adapt_rate(scan, now);
+
+			if(scan->num_scans < scan->total_scans)
+			{
+				// Wait until the next request may be sent
+				const int wait = (int)((1.0 - scan->tokens) * 1000.0 / scan->rate) + 1;
+				if(wait < timeout)
+					timeout = wait;
+			}
+			else if(now >= scan->round_done[scan->total_scans - 1] + ARP_TIMEOUT)
+			{
+				// All replies had their time to arrive
+				finish_iface(scan, false);
+				active--;
+			}
 		}
-	}
 
-	// Close socket
-	if(close(arp_socket) != 0)
-		thread_data->status = STATUS_ERROR;
+		// Print progress once per second
+		if(now - last_progress >= 1000)
+		{
+			uint64_t num_scans = 0, total_scans = 0;
+			for(unsigned int i = 0; i < num; i++)
+			{
+				if(scans[i].status == STATUS_SCANNING ||
+				   scans[i].status == STATUS_COMPLETE)
+				{
+					// Also add up scans for completed interfaces
+					num_scans += scans[i].scanned_addresses;
+					total_scans += scans[i].total_scans * scans[i].result_size;
+				}
+			}
+			// Calculate progress (total number of scans / total number of addresses)
+			// We add 1 to total_scans to avoid division by zero
+			const unsigned int new_progress = 100 * num_scans / (total_scans + 1);
+			if(new_progress > progress)
+			{
+				// Print progress
+				printf(" %i%% ", new_progress);
+
+				// Update progress
+				progress = new_progress;
+			}
+			putc('.', stdout);
 
-	if(thread_data->status != STATUS_ERROR)
-		thread_data->status = STATUS_COMPLETE;
+			// Flush stdout
+			fflush(stdout);
+			last_progress = now;
+		}
+
+		if(active == 0)
+			break;
+
+		// Receive replies until the next request is due
+		struct epoll_event events[MAX_IFACES];
+		const int n = epoll_wait(epfd, events, MAX_IFACES, timeout);
+		for(int i = 0; i < n; i++)
+		{
+			struct scan_data *scan = events[i].data.ptr;
+			if(scan->status == STATUS_SCANNING && read_arp(scan) != 0)
+			{
+				finish_iface(scan, true);
+				active--;
+			}
+		}
+	}
 
-	pthread_exit(NULL);
+	close(epfd);
 }
 
-static void print_results(struct thread_data *thread_data)
+static void print_results(struct scan_data *scan)
 {
 
-	if(thread_data->status == STATUS_SKIPPED_CIDR_MISMATCH)
+	if(scan->status == STATUS_SKIPPED_CIDR_MISMATCH)
 	{
 		printf("Skipped interface %s (%s/%i) because of too large network (use -a or -x to force scanning this interface)\n\n",
-		       thread_data->iface, thread_data->ipstr, thread_data->dst_cidr);
+		       scan->iface, scan->ipstr, scan->dst_cidr);
 		return;
 	}
 
-	if(thread_data->status == STATUS_ERROR)
+	if(scan->status == STATUS_ERROR)
 	{
 		printf("Error scanning interface %s (%s/%i)%s%s\n\n",
-		       thread_data->iface, thread_data->ipstr, thread_data->dst_cidr,
-		       thread_data->error ? ": " : "", thread_data->error ? thread_data->error : "");
+		       scan->iface, scan->ipstr, scan->dst_cidr,
+		       scan->error ? ": " : "", scan->error ? scan->error : "");
 		return;
 	}
 
 	// Check if there are any results
 	bool any_replies = false;
-	for(unsigned int i = 0; i < thread_data->result_size; i++)
+	for(unsigned int i = 0; i < scan->result_size; i++)
 		for(unsigned int j = 0; j < MAX_MACS; j++)
-			for(unsigned int k = 0; k < thread_data->total_scans; k++)
-				if(thread_data->extreme)
+			for(unsigned int k = 0; k < scan->total_scans; k++)
+				if(scan->extreme)
 				{
-					if(thread_data->result_extreme[i].device[j].replied[k])
+					if(scan->result_extreme[i].device[j].replied[k])
 					{
 						any_replies = true;
 						break;
@@ -508,7 +714,7 @@ static void print_results(struct thread_data *thread_data)
 				}
 				else
 				{
-					if(thread_data->result[i].device[j].replied[k])
+					if(scan->result[i].device[j].replied[k])
 					{
 						any_replies = true;
 						break;
@@ -519,23 +725,23 @@ static void print_results(struct thread_data *thread_data)
 	if(!any_replies)
 	{
 		printf("No devices replied on interface %s (%s/%i)\n\n",
-		       thread_data->iface, thread_data->ipstr, thread_data->dst_cidr);
+		       scan->iface, scan->ipstr, scan->dst_cidr);
 		return;
 	}
 
 	// If there is at least one result, print header
-	printf("ARP scan on interface %s (%s/%i) finished\n",
-	       thread_data->iface, thread_data->ipstr, thread_data->dst_cidr);
+	printf("ARP scan on interface %s (%s/%i) finished (up to %.0f requests per second, %lu dropped)\n",
+	       scan->iface, scan->ipstr, scan->dst_cidr, scan->max_rate, scan->total_drops);
 	printf("%-16s %-16s %-24s %-17s  %s\n",
 	       "IP address", "Interface", "Hostname", "MAC address", "Reply rate");
 
 	// Add our own IP address to the results so IP conflicts can be detected
 	// (our own IP address is not included in the ARP scan)
-	for(unsigned int i = 0; i < thread_data->total_scans; i++)
-		add_result(&thread_data->src_addr.sin_addr, thread_data->mac, thread_data, i);
+	for(unsigned int i = 0; i < scan->total_scans; i++)
+		add_result(&scan->src_addr.sin_addr, scan->mac, scan, i);
 
 	// Print results
-	for(unsigned int i = 0; i < thread_data->result_size; i++)
+	for(unsigned int i = 0; i < scan->result_size; i++)
 	{
 		unsigned int j = 0, replied_devices = 0;
 
@@ -543,21 +749,21 @@ static void print_results(struct thread_data *thread_data)
 		for(j = 0; j < MAX_MACS; j++)
 		{
 			// Check if result[i].mac[j] is all-zero, if so, skip this entry
-			unsigned char *mac = thread_data->extreme ?
-			                       thread_data->result_extreme[i].device[j].mac :
-			                       thread_data->result[i].device[j].mac;
+			unsigned char *mac = scan->extreme ?
+			                       scan->result_extreme[i].device[j].mac :
+			                       scan->result[i].device[j].mac;
 			if(memcmp(mac, "\x00\x00\x00\x00\x00\x00", 6) == 0)
 				break;
 
 			bool replied = false;
 			unsigned char replies = 0u;
 			unsigned char multiple_replies = 0;
-			const unsigned char *rp = thread_data->extreme ?
-							thread_data->result_extreme[i].device[j].replied :
-							thread_data->result[i].device[j].replied;
+			const unsigned char *rp = scan->extreme ?
+							scan->result_extreme[i].device[j].replied :
+							scan->result[i].device[j].replied;
 
 			// Check if IP address replied
-			for(unsigned int k = 0; k < thread_data->total_scans; k++)
+			for(unsigned int k = 0; k < scan->total_scans; k++)
 			{
 				replied |= rp[k] > 0;
 				replies += rp[k] > 0 ? 1 : 0;
@@ -571,35 +777,155 @@ static void print_results(struct thread_data *thread_data)
 
 			// Convert IP address to string
 			struct in_addr ip = { 0 };
-			ip.s_addr = htonl(ntohl(thread_data->dst_addr.sin_addr.s_addr) + i);
-			inet_ntop(AF_INET, &ip, thread_data->ipstr, INET_ADDRSTRLEN);
+			ip.s_addr = htonl(ntohl(scan->dst_addr.sin_addr.s_addr) + i);
+			inet_ntop(AF_INET, &ip, scan->ipstr, INET_ADDRSTRLEN);
 
 			// Print MAC address
 			printf("%-16s %-16s %-24s %02x:%02x:%02x:%02x:%02x:%02x  %3u %%\n",
-			       thread_data->ipstr, thread_data->iface,
+			       scan->ipstr, scan->iface,
 			       get_hostname(&ip),
 			       mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
-			       replies * 100 / thread_data->total_scans);
+			       replies * 100 / scan->total_scans);
 
 #ifdef DEBUG
-			for(unsigned int k = 0; k < thread_data->total_scans; k++)
+			for(unsigned int k = 0; k < scan->total_scans; k++)
 				printf(" %s", rp[k] > 0 ? "X" : "-");
 #endif
 		if(multiple_replies > 0)
 			printf("INFO: Received multiple replies from %02x:%02x:%02x:%02x:%02x:%02x for %s in %i scan%s\n",
 			       mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
-			       thread_data->ipstr, multiple_replies, multiple_replies > 1 ? "s" : "");
+			       scan->ipstr, multiple_replies, multiple_replies > 1 ? "s" : "");
 		}
 
 		// Print warning if we received multiple replies
 		if(replied_devices > 1)
 			printf("WARNING: Received replies for %s from %i devices\n",
-			       thread_data->ipstr, replied_devices);
+			       scan->ipstr, replied_devices);
 	}
 	putc('\n', stdout);
 }
 
-int run_arp_scan(const bool scan_all, const bool extreme_mode)
+// Add a device found on an interface to the kernel's neighbor cache. The entry
+// is added as stale, i.e., the kernel verifies it before using it. Existing
+// entries are left alone. Returns true if the entry has been added
+static bool add_neighbor(const int fd, const int ifindex, const struct in_addr *ip,
+                         const unsigned char *mac, const char **error)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct ndmsg ndm;
+		char attrs[RTA_SPACE(IPV4_LENGTH) + RTA_SPACE(MAC_LENGTH)];
+	} req = {
+		.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ndmsg)),
+		.nlh.nlmsg_type = RTM_NEWNEIGH,
+		.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL | NLM_F_ACK,
+		.ndm.ndm_family = AF_INET,
+		.ndm.ndm_ifindex = ifindex,
+		.ndm.ndm_state = NUD_STALE
+	};
+
+	struct rtattr *rta = (struct rtattr*)(void*)((char*)&req + NLMSG_ALIGN(req.nlh.nlmsg_len));
+	rta->rta_type = NDA_DST;
+	rta->rta_len = RTA_LENGTH(IPV4_LENGTH);
+	memcpy(RTA_DATA(rta), &ip->s_addr, IPV4_LENGTH);
+	req.nlh.nlmsg_len = NLMSG_ALIGN(req.nlh.nlmsg_len) + RTA_SPACE(IPV4_LENGTH);
+
+	rta = (struct rtattr*)(void*)((char*)&req + req.nlh.nlmsg_len);
+	rta->rta_type = NDA_LLADDR;
+	rta->rta_len = RTA_LENGTH(MAC_LENGTH);
+	memcpy(RTA_DATA(rta), mac, MAC_LENGTH);
+	req.nlh.nlmsg_len += RTA_SPACE(MAC_LENGTH);
+
+	struct sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+	if(sendto(fd, &req, req.nlh.nlmsg_len, 0, (struct sockaddr*)&kernel, sizeof(kernel)) < 0)
+	{
+		*error = strerror(errno);
+		return false;
+	}
+
+	// Wait for the acknowledgement
+	char buffer[1024] __attribute__ ((aligned(NLMSG_ALIGNTO)));
+	const ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+	if(len < 0)
+	{
+		*error = strerror(errno);
+		return false;
+	}
+	const struct nlmsghdr *nlh = (struct nlmsghdr*)(void*)buffer;
+	if(NLMSG_OK(nlh, len) && nlh->nlmsg_type == NLMSG_ERROR)
+	{
+		const struct nlmsgerr *err = NLMSG_DATA(nlh);
+		// Existing entries are not an error
+		if(err->error != 0)
+		{
+			if(err->error != -EEXIST)
+				*error = strerror(-err->error);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Add all devices which replied on an interface to the kernel's neighbor cache
+// so FTL's next parse_neighbor_cache() records them in the network table.
+// Addresses with replies from more than one device are skipped
+static void add_to_neighbor_cache(struct scan_data *scan)
+{
+	if(scan->status != STATUS_COMPLETE)
+		return;
+
+	const int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if(fd < 0)
+	{
+		printf("Unable to open netlink socket: %s\n", strerror(errno));
+		return;
+	}
+
+	unsigned int added = 0;
+	const char *error = NULL;
+	for(unsigned int i = 0; i < scan->result_size && error == NULL; i++)
+	{
+		struct in_addr ip = { 0 };
+		ip.s_addr = htonl(ntohl(scan->dst_addr.sin_addr.s_addr) + i);
+
+		// Skip our own address
+		if(ip.s_addr == scan->src_addr.sin_addr.s_addr)
+			continue;
+
+		const unsigned char *mac = NULL;
+		unsigned int devices = 0;
+		for(unsigned int j = 0; j < MAX_MACS; j++)
+		{
+			const unsigned char *rp = scan->extreme ?
+			                            scan->result_extreme[i].device[j].replied :
+			                            scan->result[i].device[j].replied;
+			for(unsigned int k = 0; k < scan->total_scans; k++)
+			{
+				if(rp[k] > 0)
+				{
+					mac = scan->extreme ?
+					        scan->result_extreme[i].device[j].mac :
+					        scan->result[i].device[j].mac;
+					devices++;
+					break;
+				}
+			}
+		}
+
+		if(devices == 1 && add_neighbor(fd, scan->ifindex, &ip, mac, &error))
+			added++;
+	}
+	close(fd);
+
+	if(error != NULL)
+		printf("Unable to add devices on interface %s to the neighbor cache: %s\n",
+		       scan->iface, error);
+	printf("Added %u device%s on interface %s to the neighbor cache\n\n",
+	       added, added != 1 ? "s" : "", scan->iface);
+}
+
+int run_arp_scan(const bool scan_all, const bool extreme_mode, const bool update_neighbors)
 {
 	// Check if we are capable of sending ARP packets
 	if(!check_capability(CAP_NET_RAW))
@@ -608,28 +934,28 @@ int run_arp_scan(const bool scan_all, const bool extreme_mode)
 		return EXIT_FAILURE;
 	}
 
-	puts("Discovering IPv4 hosts on the network using the Address Resolution Protocol (ARP)...\n");
+	// Check if we are capable of modifying the neighbor cache
+	if(update_neighbors && !check_capability(CAP_NET_ADMIN))
+	{
+		puts("Error: Insufficient permissions or capabilities (needs CAP_NET_ADMIN). Try running as root (sudo)");
+		return EXIT_FAILURE;
+	}
 
-	// Get interface names for available interfaces on this machine
-	// and launch a thread for each one
-	pthread_t scanthread[MAXTHREADS];
-	pthread_attr_t attr;
-	// Initialize thread attributes object with default attribute values
-	pthread_attr_init(&attr);
+	puts("Discovering IPv4 hosts on the network using the Address Resolution Protocol (ARP)...\n");
 
 	struct ifaddrs *addrs, *tmp;
 	getifaddrs(&addrs);
 	tmp = addrs;
 
 	// Loop until there are no more interfaces available
-	// or we reached the maximum number of threads
-	unsigned int tid = 0;
+	// or we reached the maximum number of interfaces
+	unsigned int num = 0;
 
-	struct thread_data thread_data[MAXTHREADS] = {0};
+	struct scan_data scans[MAX_IFACES] = {0};
 
-	while(tmp != NULL && tid < MAXTHREADS)
+	while(tmp != NULL && num < MAX_IFACES)
 	{
-		// Create a thread for interfaces of type AF_INET
+		// Scan interfaces of type AF_INET
 		if(tmp->ifa_addr && tmp->ifa_addr->sa_family == AF_INET)
 		{
 			// Skip interface scan if ...
@@ -644,29 +970,23 @@ int run_arp_scan(const bool scan_all, const bool extreme_mode)
 				continue;
 			}
 
-			thread_data[tid].ifa = tmp;
-			strncpy(thread_data[tid].iface, tmp->ifa_name, sizeof(thread_data[tid].iface) - 1);
+			scans[num].ifa = tmp;
+			scans[num].fd = -1;
+			strncpy(scans[num].iface, tmp->ifa_name, sizeof(scans[num].iface) - 1);
 
 			// Get interface IPv4 address
-			memcpy(&thread_data[tid].src_addr, tmp->ifa_addr, sizeof(thread_data[tid].src_addr));
-			inet_ntop(AF_INET, &thread_data[tid].src_addr.sin_addr, thread_data[tid].ipstr, INET_ADDRSTRLEN);
+			memcpy(&scans[num].src_addr, tmp->ifa_addr, sizeof(scans[num].src_addr));
+			inet_ntop(AF_INET, &scans[num].src_addr.sin_addr, scans[num].ipstr, INET_ADDRSTRLEN);
 
-			thread_data[tid].extreme = extreme_mode;
-			thread_data[tid].scan_all = scan_all || extreme_mode;
-			thread_data[tid].total_scans = extreme_mode ? 10*NUM_SCANS : NUM_SCANS;
+			scans[num].extreme = extreme_mode;
+			scans[num].scan_all = scan_all || extreme_mode;
+			scans[num].total_scans = extreme_mode ? 10*NUM_SCANS : NUM_SCANS;
 
 			// Always skip the loopback interface
-			if(thread_data[tid].src_addr.sin_addr.s_addr != htonl(INADDR_LOOPBACK))
+			if(scans[num].src_addr.sin_addr.s_addr != htonl(INADDR_LOOPBACK))
 			{
-				// Create thread
-				if(pthread_create(&scanthread[tid], &attr, arp_scan_iface, &thread_data[tid] ) != 0)
-				{
-					printf("Unable to launch thread for interface %s, skipping...\n",
-						tmp->ifa_name);
-				}
-
-				// Increase thread ID
-				tid++;
+				prepare_iface(&scans[num]);
+				num++;
 			}
 		}
 
@@ -674,73 +994,26 @@ int run_arp_scan(const bool scan_all, const bool extreme_mode)
 		tmp = tmp->ifa_next;
 	}
 
-	// Wait for all threads to finish scanning
-	bool all_done = false;
-	unsigned int progress = 0;
-	while(!all_done)
-	{
-		all_done = true;
-		uint64_t num_scans = 0, total_scans = 0;
-		for(unsigned int i = 0; i < tid; i++)
-		{
-			if(thread_data[i].status == STATUS_INITIALIZING ||
-			   thread_data[i].status == STATUS_SCANNING)
-			{
-				// At least one thread is still scanning
-				all_done = false;
-			}
-			if(thread_data[i].status == STATUS_SCANNING ||
-			   thread_data[i].status == STATUS_COMPLETE)
-			{
-				// Also add up scans for completed threads
-				num_scans += thread_data[i].scanned_addresses;
-				total_scans +=  thread_data[i].total_scans * thread_data[i].result_size;
-			}
-		}
-		if(!all_done)
-		{
-			// Calculate progress (total number of scans / total number of addresses)
-			// We add 1 to total_scans to avoid division by zero
-			const unsigned int new_progress = 100 * num_scans / (total_scans + 1);
-			if(new_progress > progress)
-			{
-				// Print progress
-				printf(" %i%% ", new_progress);
-
-				// Update progress
-				progress = new_progress;
-			}
-
-			putc('.', stdout);
-
-			// Flush stdout
-			fflush(stdout);
-
-			// Sleep for 1 second
-			sleepms(1000);
-		}
-	}
+	// Scan all interfaces
+	scan_ifaces(scans, num);
 	puts("100%\n");
 
-	// Wait for all threads to join back with us
-	for(unsigned int i = 0; i < tid; i++)
-		pthread_join(scanthread[i], NULL);
-
-	// Destroy the thread attributes object, since we are done with it
-	pthread_attr_destroy(&attr);
-
 	// Free linked-list of interfaces on this client
 	freeifaddrs(addrs);
 
-	// Loop over thread results and print them
-	for(unsigned int i = 0; i < tid; i++)
+	// Loop over results and print them
+	for(unsigned int i = 0; i < num; i++)
 	{
 		// Print results
-		print_results(&thread_data[i]);
+		print_results(&scans[i]);
+
+		// Add results to the neighbor cache
+		if(update_neighbors)
+			add_to_neighbor_cache(&scans[i]);
 
 		// Free allocated memory
-		if(thread_data[i].result != NULL)
-			free(thread_data[i].result);
+		if(scans[i].result != NULL)
+			free(scans[i].result);
 	}
 
 	return EXIT_SUCCESS;
@@ -11,6 +11,6 @@
 #ifndef ARP_SCAN_H
 #define ARP_SCAN_H
 
-int run_arp_scan(const bool scan_all, const bool extreme_mode);
+int run_arp_scan(const bool scan_all, const bool extreme_mode, const bool update_neighbors);
 
 #endif // ARP_SCAN_H
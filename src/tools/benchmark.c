@@ -0,0 +1,1595 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Query pipeline benchmark
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#define FTLDNS
+#include "dnsmasq/dnsmasq.h"
+#undef __USE_XOPEN
+#include "FTL.h"
+#include "benchmark.h"
+#include "dnsmasq_interface.h"
+#include "log.h"
+// read_FTLconf()
+#include "config.h"
+// cli_mode
+#include "args.h"
+// init_shmem()
+#include "shmem.h"
+// initOverTime()
+#include "overTime.h"
+// blockingstatus
+#include "setupVars.h"
+// FTL_reload_all_domainlists()
+#include "datastructure.h"
+// pihole_sqlite3_initialize()
+#include "database/sqlite3-ext.h"
+// in_gravity()
+#include "database/gravity-db.h"
+// in_regex()
+#include "regex_r.h"
+// special_names_init()
+#include "specialdomains.h"
+// startup
+#include "main.h"
+// dns_worker_query_id()
+#include "workers.h"
+// run_GC()
+#include "gc.h"
+// known_domains(), known_clients()
+#include "reclaim.h"
+// lock_stats_get()
+#include "lockstats.h"
+// clock_set()
+#include "timers.h"
+
+// socket_connect()
+#include "api/socket.h"
+
+#include <arpa/inet.h>
+#include <stdatomic.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <poll.h>
+
+// pihole-FTL benchmark replays a trace of queries through the same hooks
+// dnsmasq calls for every query: FTL_new_query() (including the blocking
+// checks), and, for queries which are not blocked, the hooks of the forwarded
+// query and of the reply. No packets are sent, the upstream server and the
+// replies are simulated. Each line of the trace describes one query:
+//
+//   <client IP> <type> <domain> [forward|cache|nxdomain]
+//
+// The last field selects how a permitted query is answered (default: by the
+// upstream server). Empty lines and lines starting with # are ignored.
+// test/benchmark.sh generates a synthetic gravity database and trace
+
+enum replay_kind {
+	REPLAY_FORWARD,
+	REPLAY_CACHE,
+	REPLAY_NXDOMAIN
+};
+
+struct trace_query {
+	union mysockaddr client;
+	char *domain;
+	unsigned short qtype;
+	enum replay_kind kind;
+};
+
+static const struct {
+	const char *name;
+	unsigned short qtype;
+} qtypes[] = {
+	{ "A", T_A }, { "NS", T_NS }, { "CNAME", T_CNAME }, { "SOA", T_SOA },
+	{ "PTR", T_PTR }, { "MX", T_MX }, { "TXT", T_TXT }, { "AAAA", T_AAAA },
+	{ "SRV", T_SRV }, { "NAPTR", T_NAPTR }, { "DS", T_DS }, { "RRSIG", T_RRSIG },
+	{ "DNSKEY", T_DNSKEY }, { "SVCB", 64 }, { "HTTPS", 65 }, { "ANY", T_ANY }
+};
+
+static bool parse_qtype(const char *name, unsigned short *qtype)
+{
+	for(unsigned int i = 0; i < sizeof(qtypes)/sizeof(qtypes[0]); i++)
+	{
+		if(strcasecmp(name, qtypes[i].name) == 0)
+		{
+			*qtype = qtypes[i].qtype;
+			return true;
+		}
+	}
+
+	// TYPE123 notation of RFC 3597
+	unsigned int num = 0;
+	if(sscanf(name, "TYPE%u", &num) == 1 && num > 0 && num < 65536)
+	{
+		*qtype = num;
+		return true;
+	}
+
+	return false;
+}
+
+static bool parse_line(char *line, struct trace_query *q)
+{
+	char client[INET6_ADDRSTRLEN] = { 0 }, type[16] = { 0 }, domain[256] = { 0 }, kind[16] = { 0 };
+	const int n = sscanf(line, "%45s %15s %255s %15s", client, type, domain, kind);
+	if(n < 3 || !parse_qtype(type, &q->qtype))
+		return false;
+
+	memset(&q->client, 0, sizeof(q->client));
+	if(inet_pton(AF_INET, client, &q->client.in.sin_addr) == 1)
+	{
+		q->client.in.sin_family = AF_INET;
+		q->client.in.sin_port = htons(53000);
+	}
+	else if(inet_pton(AF_INET6, client, &q->client.in6.sin6_addr) == 1)
+	{
+		q->client.in6.sin6_family = AF_INET6;
+		q->client.in6.sin6_port = htons(53000);
+	}
+	else
+		return false;
+
+	if(n < 4 || strcmp(kind, "forward") == 0)
+		q->kind = REPLAY_FORWARD;
+	else if(strcmp(kind, "cache") == 0)
+		q->kind = REPLAY_CACHE;
+	else if(strcmp(kind, "nxdomain") == 0)
+		q->kind = REPLAY_NXDOMAIN;
+	else
+		return false;
+
+	q->domain = strdup(domain);
+	return q->domain != NULL;
+}
+
+// Read the whole trace before replaying it so parsing is not measured
+static struct trace_query *read_trace(const char *path, size_t *num)
+{
+	FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if(fp == NULL)
+	{
+		printf("Cannot open trace %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	struct trace_query *trace = NULL;
+	size_t size = 0u, lineno = 0u;
+	char *line = NULL;
+	size_t linelen = 0u;
+	*num = 0u;
+	while(getline(&line, &linelen, fp) != -1)
+	{
+		lineno++;
+		if(line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+			continue;
+
+		if(*num == size)
+		{
+			size = size > 0 ? 2*size : 4096u;
+			struct trace_query *new = realloc(trace, size*sizeof(*trace));
+			if(new == NULL)
+			{
+				printf("Cannot allocate memory for the trace\n");
+				free(trace);
+				trace = NULL;
+				break;
+			}
+			trace = new;
+		}
+
+		if(!parse_line(line, &trace[*num]))
+		{
+			printf("Skipping invalid line %zu of the trace: %s", lineno, line);
+			continue;
+		}
+		(*num)++;
+	}
+
+	free(line);
+	if(fp != stdin)
+		fclose(fp);
+
+	return trace;
+}
+
+// Simulated upstream server and answer. FTL derives the port of the upstream
+// server from the sockaddr_in surrounding the address dnsmasq passes
+static struct sockaddr_in upstream_addr;
+#define upstream (*(union all_addr*)(void*)&upstream_addr.sin_addr)
+static union all_addr answer;
+
+// Replay one query, returns true if it was blocked
+static bool replay(const struct trace_query *q, const int id)
+{
+	// Blocked queries are answered by dnsmasq right away
+	if(FTL_new_query(F_QUERY | F_FORWARD, q->domain, (union mysockaddr*)&q->client,
+	                 (char*)"query", q->qtype, id, UDP))
+		return true;
+
+	switch(q->kind)
+	{
+		case REPLAY_CACHE:
+			FTL_hook(F_FORWARD | F_IPV4, q->domain, &answer, NULL, id, q->qtype, __FILE__, __LINE__);
+			break;
+		case REPLAY_FORWARD:
+			FTL_hook(F_FORWARD | F_SERVER | F_IPV4, q->domain, &upstream, (char*)"query", id, 53, __FILE__, __LINE__);
+			FTL_hook(F_FORWARD | F_UPSTREAM | F_IPV4, q->domain, &answer, NULL, id, q->qtype, __FILE__, __LINE__);
+			break;
+		case REPLAY_NXDOMAIN:
+			FTL_hook(F_FORWARD | F_SERVER | F_IPV4, q->domain, &upstream, (char*)"query", id, 53, __FILE__, __LINE__);
+			FTL_hook(F_FORWARD | F_UPSTREAM | F_NEG | F_NXDOMAIN, q->domain, NULL, NULL, id, q->qtype, __FILE__, __LINE__);
+			break;
+	}
+
+	return false;
+}
+
+static int cmp_latency(const void *a, const void *b)
+{
+	const uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const uint32_t *sorted, const size_t num, const double p)
+{
+	return 1e-3*sorted[(size_t)(p*(double)(num - 1))];
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// Set up FTL's configuration and shared memory without starting the resolver
+static bool benchmark_init(const char *conf, const bool verbose)
+{
+	// Only show FTL's log when asked to
+	cli_mode = true;
+	log_ctrl(false, verbose);
+
+	// Use the default settings unless a config file is given. Queries are
+	// neither stored in nor imported from the long-term database, and
+	// clients are not rate-limited
+	FTLfiles.conf = FTLfiles.snapConf = (char*)(conf != NULL ? conf : "/dev/null");
+	read_FTLconf();
+	config.DBimport = false;
+	config.DBexport = false;
+	config.rate_limit.count = 0;
+
+	// Shared memory objects of this process must not collide with the ones
+	// of a running FTL
+	shmem_private();
+	if(!init_shmem())
+	{
+		printf("Cannot initialize shared memory\n");
+		destroy_shmem();
+		return false;
+	}
+	initOverTime();
+
+	return true;
+}
+
+// Load gravity, the domain lists and the regex filters like FTL does once it
+// has started
+static void load_lists(const char *gravity_db)
+{
+	if(gravity_db != NULL)
+		FTLfiles.gravity_db = strdup(gravity_db);
+
+	// Pi-hole's SQLite3 extensions are used by the gravity database
+	pihole_sqlite3_initialize();
+	blockingstatus = BLOCKING_ENABLED;
+	FTL_reload_all_domainlists();
+	// There is no local domain suffix without dnsmasq's config
+	special_names_init(NULL);
+	// New clients get their regex filters only once starting up is done
+	startup = false;
+}
+
+// Prepare the state replay() needs
+static bool replay_init(void)
+{
+	// dnsmasq has not been started, its state is empty
+	daemon = calloc(1, sizeof(*daemon));
+	if(daemon == NULL)
+		return false;
+	daemon->port = NAMESERVER_PORT;
+
+	upstream_addr.sin_family = AF_INET;
+	upstream_addr.sin_port = htons(NAMESERVER_PORT);
+	inet_pton(AF_INET, "192.0.2.53", &upstream_addr.sin_addr);
+	inet_pton(AF_INET, "198.51.100.1", &answer.addr4);
+
+	return true;
+}
+
+int run_benchmark(const char *trace_file, const char *gravity_db, const char *conf,
+                  const unsigned int passes, const bool verbose)
+{
+	size_t num = 0u;
+	struct trace_query *trace = read_trace(trace_file, &num);
+	if(trace == NULL || num == 0u)
+	{
+		printf("No queries to replay\n");
+		return EXIT_FAILURE;
+	}
+
+	if(!benchmark_init(conf, verbose))
+		return EXIT_FAILURE;
+	load_lists(gravity_db);
+
+	if(!replay_init())
+	{
+		destroy_shmem();
+		return EXIT_FAILURE;
+	}
+
+	const size_t total = num*passes;
+	uint32_t *latency = calloc(total, sizeof(uint32_t));
+	if(latency == NULL)
+	{
+		printf("Cannot allocate memory for %zu latencies\n", total);
+		destroy_shmem();
+		return EXIT_FAILURE;
+	}
+
+	size_t blocked = 0u;
+	const uint64_t start = now_ns();
+	for(size_t i = 0u; i < total; i++)
+	{
+		const uint64_t t0 = now_ns();
+		if(replay(&trace[i % num], (int)(i + 1)))
+			blocked++;
+		const uint64_t ns = now_ns() - t0;
+		latency[i] = ns < UINT32_MAX ? (uint32_t)ns : UINT32_MAX;
+	}
+	const double elapsed = 1e-9*(double)(now_ns() - start);
+
+	qsort(latency, total, sizeof(uint32_t), cmp_latency);
+	printf("Replayed %zu queries (%zu per pass, %u pass%s) in %.3f s\n",
+	       total, num, passes, passes == 1 ? "" : "es", elapsed);
+	printf("Throughput: %.0f queries/s\n", (double)total/elapsed);
+	printf("Latency [us]: p50 %.2f, p90 %.2f, p99 %.2f, p99.9 %.2f, max %.2f\n",
+	       percentile(latency, total, 0.5), percentile(latency, total, 0.9),
+	       percentile(latency, total, 0.99), percentile(latency, total, 0.999),
+	       1e-3*latency[total - 1]);
+	printf("Blocked: %zu (%.1f%%), domains: %d, clients: %d, gravity: %d\n",
+	       blocked, 100.0*(double)blocked/(double)total,
+	       counters->domains, counters->clients, counters->gravity);
+	for(unsigned int i = 0; i < QUERY_STAGES; i++)
+	{
+		const queryStageStats *stage = &query_counters->stages[i];
+		printf("Stage %-8s: %lu queries, mean %.2f us, max %lu us\n",
+		       query_stage_name(i), (unsigned long)stage->count,
+		       stage->count > 0 ? (double)stage->total/(double)stage->count : 0.0,
+		       (unsigned long)stage->max);
+	}
+
+	free(latency);
+	for(size_t i = 0u; i < num; i++)
+		free(trace[i].domain);
+	free(trace);
+	destroy_shmem();
+
+	return EXIT_SUCCESS;
+}
+
+// pihole-FTL benchmark-shm times the lookup primitives of the shared memory
+// objects while their number of entries grows from 1k to 1M. Each of them is
+// expected to take (amortized) constant time, a cost growing with the number
+// of entries indicates a linear scan
+
+// Number of lookups timed per operation and size
+#define SHM_LOOKUPS 100000u
+
+struct shm_result {
+	const char *op;
+	unsigned int entries;
+	double ns;
+};
+
+static struct shm_result *results = NULL;
+static unsigned int num_results = 0u;
+
+static void add_result(const char *op, const unsigned int entries, const uint64_t t0, const unsigned int ops)
+{
+	struct shm_result *new = realloc(results, (num_results + 1)*sizeof(*results));
+	if(new == NULL)
+		return;
+	results = new;
+	results[num_results].op = op;
+	results[num_results].entries = entries;
+	results[num_results].ns = ops > 0 ? (double)(now_ns() - t0)/ops : 0.0;
+	num_results++;
+}
+
+// xorshift32, the lookup keys must not be accessed in the order they were
+// inserted in
+static uint32_t rnd(void)
+{
+	static uint32_t x = 2463534242u;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+int run_shm_benchmark(const unsigned int max, const bool json, const bool verbose)
+{
+	if(!benchmark_init(NULL, verbose))
+		return EXIT_FAILURE;
+
+	// All names are generated before timing anything
+	char **strs = calloc(max, sizeof(char*)), **domains = calloc(max, sizeof(char*)), **clients = calloc(max, sizeof(char*));
+	size_t *strpos = calloc(max, sizeof(size_t));
+	uint32_t *hashes = calloc(max, sizeof(uint32_t));
+	if(strs == NULL || domains == NULL || clients == NULL || strpos == NULL || hashes == NULL)
+	{
+		printf("Cannot allocate memory for %u entries\n", max);
+		destroy_shmem();
+		return EXIT_FAILURE;
+	}
+	for(unsigned int i = 0u; i < max; i++)
+	{
+		char buffer[64];
+		snprintf(buffer, sizeof(buffer), "string%u.bench", i);
+		strs[i] = strdup(buffer);
+		snprintf(buffer, sizeof(buffer), "d%u.example.com", i);
+		domains[i] = strdup(buffer);
+		snprintf(buffer, sizeof(buffer), "10.%u.%u.%u", (i >> 16) & 0xFF, (i >> 8) & 0xFF, i & 0xFF);
+		clients[i] = strdup(buffer);
+		if(strs[i] == NULL || domains[i] == NULL || clients[i] == NULL)
+		{
+			printf("Cannot allocate memory for %u entries\n", max);
+			destroy_shmem();
+			return EXIT_FAILURE;
+		}
+		hashes[i] = hashStr(domains[i]);
+	}
+
+	lock_shm();
+	size_t checksum = 0u;
+	unsigned int n = 0u;
+	for(unsigned int size = 1000u; size <= max; size = size < max && size*10u > max ? max : size*10u)
+	{
+		const unsigned int grow = size - n;
+		const unsigned int lookups = size < SHM_LOOKUPS ? size : SHM_LOOKUPS;
+
+		// Strings. Like everywhere else in FTL, shm_ensure_size() makes
+		// room for the next entry before it is added
+		uint64_t t0 = now_ns();
+		for(unsigned int i = n; i < size; i++)
+		{
+			shm_ensure_size();
+			strpos[i] = addstr(strs[i]);
+		}
+		add_result("addstr_new", size, t0, grow);
+
+		t0 = now_ns();
+		for(unsigned int i = 0u; i < lookups; i++)
+			checksum += addstr(strs[rnd() % size]);
+		add_result("addstr_known", size, t0, lookups);
+
+		t0 = now_ns();
+		for(unsigned int i = 0u; i < lookups; i++)
+			checksum += (unsigned char)getstr(strpos[rnd() % size])[0];
+		add_result("getstr", size, t0, lookups);
+
+		// Domains
+		t0 = now_ns();
+		for(unsigned int i = n; i < size; i++)
+		{
+			shm_ensure_size();
+			findDomainID(domains[i], hashes[i], true);
+		}
+		add_result("findDomainID_new", size, t0, grow);
+
+		t0 = now_ns();
+		for(unsigned int i = 0u; i < lookups; i++)
+		{
+			const unsigned int j = rnd() % size;
+			checksum += findDomainID(domains[j], hashes[j], true);
+		}
+		add_result("findDomainID_known", size, t0, lookups);
+
+		// Clients are created as alias-clients, creating regular clients
+		// consults the long-term database
+		t0 = now_ns();
+		for(unsigned int i = n; i < size; i++)
+		{
+			shm_ensure_size();
+			findClientID(clients[i], false, true);
+		}
+		add_result("findClientID_new", size, t0, grow);
+
+		t0 = now_ns();
+		for(unsigned int i = 0u; i < lookups; i++)
+			checksum += findClientID(clients[rnd() % size], false, true);
+		add_result("findClientID_known", size, t0, lookups);
+
+		// DNS cache entries (domain i, client i)
+		t0 = now_ns();
+		for(unsigned int i = n; i < size; i++)
+		{
+			shm_ensure_size();
+			findCacheID(i, i, TYPE_A, true);
+		}
+		add_result("findCacheID_new", size, t0, grow);
+
+		t0 = now_ns();
+		for(unsigned int i = 0u; i < lookups; i++)
+		{
+			const int j = rnd() % size;
+			checksum += findCacheID(j, j, TYPE_A, false);
+		}
+		add_result("findCacheID_known", size, t0, lookups);
+
+		t0 = now_ns();
+		for(unsigned int i = 0u; i < lookups; i++)
+		{
+			const int j = rnd() % size;
+			checksum += findCacheID(j, j, TYPE_AAAA, false);
+		}
+		add_result("findCacheID_unknown", size, t0, lookups);
+
+		// Queries with dnsmasq IDs 1 ... size, the way FTL_new_query()
+		// adds them
+		t0 = now_ns();
+		for(unsigned int i = n; i < size; i++)
+		{
+			shm_ensure_size();
+			const int queryID = counters->queries;
+			queriesData *query = getQuery(queryID, false);
+			if(query == NULL)
+				break;
+			query->magic = MAGICBYTE;
+			query->id = dns_worker_query_id(i + 1);
+			add_query_lookup(query->id, queryID);
+			counters->queries++;
+		}
+		add_result("addQuery", size, t0, grow);
+
+		t0 = now_ns();
+		for(unsigned int i = 0u; i < lookups; i++)
+			checksum += findQueryID(1 + rnd() % size);
+		add_result("findQueryID_known", size, t0, lookups);
+
+		t0 = now_ns();
+		for(unsigned int i = 0u; i < lookups; i++)
+			checksum += findQueryID(size + 1 + rnd() % size);
+		add_result("findQueryID_unknown", size, t0, lookups);
+
+		n = size;
+		if(size == max)
+			break;
+	}
+	unlock_shm();
+
+	if(json)
+	{
+		printf("[\n");
+		for(unsigned int i = 0u; i < num_results; i++)
+			printf("  {\"op\":\"%s\",\"entries\":%u,\"ns_per_op\":%.1f}%s\n",
+			       results[i].op, results[i].entries, results[i].ns,
+			       i + 1 < num_results ? "," : "");
+		printf("]\n");
+	}
+	else
+	{
+		printf("op,entries,ns_per_op\n");
+		for(unsigned int i = 0u; i < num_results; i++)
+			printf("%s,%u,%.1f\n", results[i].op, results[i].entries, results[i].ns);
+	}
+	// Only printed to keep the compiler from optimizing the lookups away
+	if(verbose)
+		logg("Checksum: %zu", checksum);
+
+	for(unsigned int i = 0u; i < max; i++)
+	{
+		free(strs[i]);
+		free(domains[i]);
+		free(clients[i]);
+	}
+	free(strs);
+	free(domains);
+	free(clients);
+	free(strpos);
+	free(hashes);
+	free(results);
+	destroy_shmem();
+
+	return EXIT_SUCCESS;
+}
+
+// pihole-FTL benchmark-lists calls the functions checking a domain against
+// gravity, the exact black- and whitelist and the regex filters for every
+// domain of a corpus (one domain per line). The first pass shows the cost with
+// cold caches (SQLite's page cache, the CPU caches), the later passes the cost
+// once they are warm. The backend is selected by the config file
+// (GRAVITY_IN_MEMORY, GRAVITY_MMAP)
+
+static enum db_result check_gravity(const char *domain, clientsData *client, DNSCacheData *dns_cache)
+{
+	(void)dns_cache;
+	return in_gravity(domain, client);
+}
+
+static enum db_result check_blacklist(const char *domain, clientsData *client, DNSCacheData *dns_cache)
+{
+	return in_blacklist(domain, dns_cache, client);
+}
+
+static enum db_result check_whitelist(const char *domain, clientsData *client, DNSCacheData *dns_cache)
+{
+	return in_whitelist(domain, dns_cache, client);
+}
+
+static enum db_result check_regex_black(const char *domain, clientsData *client, DNSCacheData *dns_cache)
+{
+	return in_regex(domain, dns_cache, client->id, REGEX_BLACKLIST) ? FOUND : NOT_FOUND;
+}
+
+static enum db_result check_regex_white(const char *domain, clientsData *client, DNSCacheData *dns_cache)
+{
+	return in_regex(domain, dns_cache, client->id, REGEX_WHITELIST) ? FOUND : NOT_FOUND;
+}
+
+static const struct {
+	const char *name;
+	enum db_result (*check)(const char *domain, clientsData *client, DNSCacheData *dns_cache);
+} list_checks[] = {
+	{ "in_gravity", check_gravity },
+	{ "in_blacklist", check_blacklist },
+	{ "in_whitelist", check_whitelist },
+	{ "regex black", check_regex_black },
+	{ "regex white", check_regex_white }
+};
+
+static char **read_corpus(const char *path, size_t *num)
+{
+	FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if(fp == NULL)
+	{
+		printf("Cannot open corpus %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	char **corpus = NULL;
+	size_t size = 0u;
+	char *line = NULL;
+	size_t linelen = 0u;
+	*num = 0u;
+	while(getline(&line, &linelen, fp) != -1)
+	{
+		char domain[256] = { 0 };
+		if(line[0] == '#' || sscanf(line, "%255s", domain) != 1)
+			continue;
+
+		if(*num == size)
+		{
+			size = size > 0 ? 2*size : 4096u;
+			char **new = realloc(corpus, size*sizeof(*corpus));
+			if(new == NULL)
+			{
+				printf("Cannot allocate memory for the corpus\n");
+				break;
+			}
+			corpus = new;
+		}
+
+		// Domains are matched in lower case
+		strtolower(domain);
+		if((corpus[*num] = strdup(domain)) == NULL)
+			break;
+		(*num)++;
+	}
+
+	free(line);
+	if(fp != stdin)
+		fclose(fp);
+
+	return corpus;
+}
+
+int run_lists_benchmark(const char *corpus_file, const char *gravity_db, const char *conf,
+                        const unsigned int passes, const bool verbose)
+{
+	size_t num = 0u;
+	char **corpus = read_corpus(corpus_file, &num);
+	if(corpus == NULL || num == 0u)
+	{
+		printf("No domains to check\n");
+		free(corpus);
+		return EXIT_FAILURE;
+	}
+
+	if(!benchmark_init(conf, verbose))
+		return EXIT_FAILURE;
+	load_lists(gravity_db);
+
+	uint32_t *latency = calloc(num, sizeof(uint32_t));
+	if(latency == NULL)
+	{
+		printf("Cannot allocate memory for %zu latencies\n", num);
+		destroy_shmem();
+		return EXIT_FAILURE;
+	}
+
+	lock_shm();
+	// All lookups are done for the same client, it is in the default group
+	const int clientID = findClientID("10.0.0.1", true, false);
+	clientsData *client = getClient(clientID, true);
+	if(client == NULL)
+	{
+		unlock_shm();
+		free(latency);
+		destroy_shmem();
+		return EXIT_FAILURE;
+	}
+	DNSCacheData dns_cache = { .domainlist_id = -1 };
+
+	if(config.gravity_in_memory)
+		printf("Gravity: in memory");
+	else if(config.sqlite.gravity_mmap > 0)
+		printf("Gravity: SQLite, memory map of %u MiB", config.sqlite.gravity_mmap);
+	else
+		printf("Gravity: SQLite");
+	printf(", %d domains, %u blacklist and %u whitelist regex, %zu domains in the corpus\n",
+	       counters->gravity, get_num_regex(REGEX_BLACKLIST), get_num_regex(REGEX_WHITELIST), num);
+	printf("%-14s %8s %10s %10s %10s %10s\n", "[ns/lookup]", "hits", "cold", "warm", "warm p50", "warm p99");
+
+	for(unsigned int c = 0u; c < sizeof(list_checks)/sizeof(list_checks[0]); c++)
+	{
+		size_t hits = 0u;
+		double cold = 0.0, warm = 0.0;
+		for(unsigned int pass = 0u; pass < passes; pass++)
+		{
+			const uint64_t start = now_ns();
+			for(size_t i = 0u; i < num; i++)
+			{
+				const uint64_t t0 = now_ns();
+				const enum db_result result = list_checks[c].check(corpus[i], client, &dns_cache);
+				const uint64_t ns = now_ns() - t0;
+				latency[i] = ns < UINT32_MAX ? (uint32_t)ns : UINT32_MAX;
+				if(pass == 0u && result == FOUND)
+					hits++;
+			}
+			const double mean = (double)(now_ns() - start)/(double)num;
+			if(pass == 0u)
+				cold = mean;
+			else
+				warm += mean/(passes - 1);
+		}
+
+		// Percentiles of the last pass
+		qsort(latency, num, sizeof(uint32_t), cmp_latency);
+		if(passes > 1)
+			printf("%-14s %8zu %10.0f %10.0f %10.0f %10.0f\n", list_checks[c].name, hits, cold, warm,
+			       1e3*percentile(latency, num, 0.5), 1e3*percentile(latency, num, 0.99));
+		else
+			printf("%-14s %8zu %10.0f %10s %10.0f %10.0f\n", list_checks[c].name, hits, cold, "-",
+			       1e3*percentile(latency, num, 0.5), 1e3*percentile(latency, num, 0.99));
+	}
+	unlock_shm();
+
+	free(latency);
+	for(size_t i = 0u; i < num; i++)
+		free(corpus[i]);
+	free(corpus);
+	destroy_shmem();
+
+	return EXIT_SUCCESS;
+}
+
+// pihole-FTL benchmark-api opens a number of concurrent connections to FTL's
+// API and sends a weighted mix of commands as fast as the answers arrive.
+// Targets given as host:port are telnet endpoints, absolute paths the unix
+// socket which answers in MessagePack. Optionally, DNS queries are sent at a
+// fixed rate to a DNS server at the same time: first alone for a baseline,
+// then while the API is under load, so the impact of the API load on the DNS
+// latency can be read directly from the report
+
+// Maximum number of commands in the mix
+#define API_MIX_MAX 32
+// Default command mix, each command may be followed by :<weight>
+#define API_MIX_DEFAULT ">stats:4,>overTime:2,>top-domains:2,>top-clients:1,>forward-dest:1"
+// Timeout for connecting and for each response [seconds]
+#define API_TIMEOUT 5
+// Number of distinct domains queried by the DNS load generator
+#define DNS_LOAD_DOMAINS 200
+
+struct api_mix {
+	char *cmd;
+	unsigned int weight;
+};
+
+struct latencies {
+	uint32_t *ns;
+	size_t num;
+	size_t size;
+};
+
+struct api_client {
+	pthread_t thread;
+	uint32_t seed;
+	struct latencies samples[API_MIX_MAX];
+	unsigned long errors[API_MIX_MAX];
+};
+
+static struct api_mix mix[API_MIX_MAX];
+static unsigned int mix_len = 0u, mix_total = 0u;
+static const struct api_benchmark *api_opts = NULL;
+static atomic_bool api_stop = false;
+
+static void add_latency(struct latencies *l, const uint64_t ns)
+{
+	if(l->num == l->size)
+	{
+		const size_t size = l->size > 0u ? 2u*l->size : 1024u;
+		uint32_t *new = realloc(l->ns, size*sizeof(uint32_t));
+		if(new == NULL)
+			return;
+		l->ns = new;
+		l->size = size;
+	}
+	l->ns[l->num++] = ns < UINT32_MAX ? (uint32_t)ns : UINT32_MAX;
+}
+
+static bool parse_mix(const char *spec)
+{
+	char *copy = strdup(spec);
+	if(copy == NULL)
+		return false;
+
+	char *saveptr = NULL;
+	for(char *entry = strtok_r(copy, ",", &saveptr); entry != NULL; entry = strtok_r(NULL, ",", &saveptr))
+	{
+		if(mix_len == API_MIX_MAX)
+		{
+			printf("At most %u commands are supported in the mix\n", API_MIX_MAX);
+			free(copy);
+			return false;
+		}
+
+		unsigned int weight = 1u;
+		char *colon = strrchr(entry, ':');
+		if(colon != NULL && sscanf(colon + 1, "%u", &weight) == 1)
+			*colon = '\0';
+		if(entry[0] != '>' || weight == 0u)
+		{
+			printf("Invalid command in the mix: %s\n", entry);
+			free(copy);
+			return false;
+		}
+
+		mix[mix_len].cmd = strdup(entry);
+		mix[mix_len].weight = weight;
+		mix_total += weight;
+		mix_len++;
+	}
+
+	free(copy);
+	return mix_len > 0u;
+}
+
+// Scanner for MessagePack responses, it skips complete objects until it finds
+// the end-of-message marker (0xc1, never used by MessagePack itself)
+struct mp_scanner {
+	size_t skip;
+	unsigned int header;
+	unsigned int have;
+	uint32_t len;
+	unsigned int extra;
+};
+
+static bool mp_scan(struct mp_scanner *s, const unsigned char *data, const size_t len)
+{
+	for(size_t i = 0u; i < len;)
+	{
+		if(s->skip > 0u)
+		{
+			const size_t n = s->skip < len - i ? s->skip : len - i;
+			s->skip -= n;
+			i += n;
+			continue;
+		}
+
+		const unsigned char c = data[i++];
+
+		// Collecting the length of a string, binary or extension object
+		if(s->header > 0u)
+		{
+			s->len = (s->len << 8) | c;
+			if(++s->have == s->header)
+			{
+				s->skip = (size_t)s->len + s->extra;
+				s->header = 0u;
+			}
+			continue;
+		}
+
+		s->len = 0u;
+		s->have = 0u;
+		s->extra = 0u;
+		if(c == 0xc1)
+			return true;
+		else if(c >= 0xa0 && c <= 0xbf)
+			s->skip = c & 0x1f;
+		else if(c == 0xc4 || c == 0xd9)
+			s->header = 1u;
+		else if(c == 0xc5 || c == 0xda)
+			s->header = 2u;
+		else if(c == 0xc6 || c == 0xdb)
+			s->header = 4u;
+		else if(c >= 0xc7 && c <= 0xc9)
+		{
+			s->header = c == 0xc7 ? 1u : c == 0xc8 ? 2u : 4u;
+			s->extra = 1u;
+		}
+		else if(c == 0xcc || c == 0xd0)
+			s->skip = 1u;
+		else if(c == 0xcd || c == 0xd1 || c == 0xdc || c == 0xde)
+			s->skip = 2u;
+		else if(c == 0xca || c == 0xce || c == 0xd2 || c == 0xdd || c == 0xdf)
+			s->skip = 4u;
+		else if(c == 0xcb || c == 0xcf || c == 0xd3)
+			s->skip = 8u;
+		else if(c >= 0xd4 && c <= 0xd8)
+			s->skip = 1u + (1u << (c - 0xd4));
+		// Everything else (fixint, fixmap, fixarray, nil, bool) has no
+		// payload, elements of maps and arrays follow as separate objects
+	}
+	return false;
+}
+
+static int api_connect(const char *target)
+{
+	if(target[0] != '/')
+		return socket_connect(target, API_TIMEOUT);
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if(strlen(target) >= sizeof(addr.sun_path))
+		return -1;
+	strcpy(addr.sun_path, target);
+
+	const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sock < 0)
+		return -1;
+	if(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		close(sock);
+		return -1;
+	}
+
+	const struct timeval tv = { API_TIMEOUT, 0 };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	return sock;
+}
+
+// Send a command and read its complete response
+static bool api_request(const int sock, const char *cmd, const bool telnet)
+{
+	char request[256];
+	const int len = snprintf(request, sizeof(request), "%s\n", cmd);
+	if(len < 0 || (size_t)len >= sizeof(request) ||
+	   send(sock, request, len, MSG_NOSIGNAL) != len)
+		return false;
+
+	static const char eom[] = "---EOM---\n\n";
+	unsigned char buffer[65536];
+	char tail[2*sizeof(eom)] = { 0 };
+	struct mp_scanner scanner = { 0 };
+	while(true)
+	{
+		const ssize_t n = recv(sock, buffer, sizeof(buffer), 0);
+		if(n <= 0)
+			return false;
+
+		if(!telnet)
+		{
+			if(mp_scan(&scanner, buffer, n))
+				return true;
+			continue;
+		}
+
+		// The marker may be split across two reads
+		const size_t keep = sizeof(eom) - 1u;
+		const size_t add = (size_t)n < keep ? (size_t)n : keep;
+		memmove(tail, tail + add, keep - add);
+		memcpy(tail + keep - add, buffer + n - add, add);
+		if(memcmp(tail, eom, keep) == 0)
+			return true;
+	}
+}
+
+static void *api_client_thread(void *val)
+{
+	struct api_client *client = val;
+	const bool telnet = api_opts->target[0] != '/';
+	int sock = -1;
+	while(!atomic_load(&api_stop))
+	{
+		// Weighted random choice of the next command
+		client->seed ^= client->seed << 13;
+		client->seed ^= client->seed >> 17;
+		client->seed ^= client->seed << 5;
+		unsigned int pick = client->seed % mix_total, i = 0u;
+		while(pick >= mix[i].weight)
+			pick -= mix[i++].weight;
+
+		const uint64_t t0 = now_ns();
+		if(sock < 0)
+			sock = api_connect(api_opts->target);
+		if(sock > -1 && api_request(sock, mix[i].cmd, telnet))
+		{
+			add_latency(&client->samples[i], now_ns() - t0);
+			continue;
+		}
+
+		// Reconnect after errors
+		client->errors[i]++;
+		if(sock > -1)
+			close(sock);
+		sock = -1;
+		if(!atomic_load(&api_stop))
+			usleep(10000);
+	}
+
+	if(sock > -1)
+		close(sock);
+	return NULL;
+}
+
+// DNS load generator, phase 0 is the baseline, phase 1 runs along with the
+// API load
+struct dns_phase {
+	struct latencies samples;
+	unsigned long sent;
+	unsigned long answered;
+};
+
+static struct dns_phase dns_phases[2];
+static atomic_uint dns_phase = 0u;
+
+static void *dns_load_thread(void *val)
+{
+	const int sock = *(const int*)val;
+	static uint64_t sent_ns[65536];
+	static unsigned char sent_phase[65536];
+	const uint64_t interval = 1000000000u / api_opts->qps;
+	uint64_t next = now_ns();
+	uint16_t id = 0u;
+	uint32_t seed = 2463534242u;
+
+	while(!atomic_load(&api_stop))
+	{
+		const uint64_t now = now_ns();
+		if(now >= next)
+		{
+			// Query h<N>.example.com IN A
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			unsigned char packet[64] = { 0 };
+			id++;
+			packet[0] = id >> 8;
+			packet[1] = id & 0xff;
+			packet[2] = 0x01; // RD
+			packet[5] = 1; // QDCOUNT
+			char label[16];
+			const int llen = snprintf(label, sizeof(label), "h%u", seed % DNS_LOAD_DOMAINS);
+			size_t plen = 12u;
+			packet[plen++] = llen;
+			memcpy(packet + plen, label, llen);
+			plen += llen;
+			memcpy(packet + plen, "\x07" "example" "\x03" "com" "\x00" "\x00\x01" "\x00\x01", 17);
+			plen += 17;
+
+			const unsigned int phase = atomic_load(&dns_phase);
+			sent_ns[id] = now;
+			sent_phase[id] = phase;
+			if(send(sock, packet, plen, 0) == (ssize_t)plen)
+				dns_phases[phase].sent++;
+			next += interval;
+			// Do not try to catch up after stalls
+			if(next + 100u*interval < now)
+				next = now;
+			continue;
+		}
+
+		struct pollfd pfd = { .fd = sock, .events = POLLIN };
+		const int timeout = (int)((next - now) / 1000000u);
+		if(poll(&pfd, 1, timeout) < 1)
+			continue;
+
+		unsigned char reply[512];
+		const ssize_t n = recv(sock, reply, sizeof(reply), MSG_DONTWAIT);
+		if(n < 12)
+			continue;
+		const uint16_t rid = (uint16_t)(reply[0] << 8 | reply[1]);
+		if(sent_ns[rid] == 0u)
+			continue;
+		struct dns_phase *phase = &dns_phases[sent_phase[rid]];
+		add_latency(&phase->samples, now_ns() - sent_ns[rid]);
+		phase->answered++;
+		sent_ns[rid] = 0u;
+	}
+
+	return NULL;
+}
+
+static int dns_connect(const char *target)
+{
+	char host[256];
+	const char *colon = strrchr(target, ':');
+	if(colon == NULL || (size_t)(colon - target) >= sizeof(host))
+		return -1;
+	memcpy(host, target, colon - target);
+	host[colon - target] = '\0';
+
+	struct addrinfo hints = { .ai_socktype = SOCK_DGRAM }, *res = NULL;
+	if(getaddrinfo(host, colon + 1, &hints, &res) != 0)
+		return -1;
+
+	int sock = -1;
+	for(const struct addrinfo *ai = res; ai != NULL && sock < 0; ai = ai->ai_next)
+	{
+		sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if(sock > -1 && connect(sock, ai->ai_addr, ai->ai_addrlen) != 0)
+		{
+			close(sock);
+			sock = -1;
+		}
+	}
+	freeaddrinfo(res);
+	return sock;
+}
+
+static void print_dns_phase(const char *name, struct dns_phase *phase, const bool json, const bool last)
+{
+	struct latencies *l = &phase->samples;
+	if(l->num > 0u)
+		qsort(l->ns, l->num, sizeof(uint32_t), cmp_latency);
+	const double p50 = l->num > 0u ? percentile(l->ns, l->num, 0.5) : 0.0;
+	const double p99 = l->num > 0u ? percentile(l->ns, l->num, 0.99) : 0.0;
+	const double max = l->num > 0u ? 1e-3*l->ns[l->num - 1] : 0.0;
+	if(json)
+		printf("    \"%s\":{\"sent\":%lu,\"answered\":%lu,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}%s\n",
+		       name, phase->sent, phase->answered, p50, p99, max, last ? "" : ",");
+	else
+		printf("%-20s %10lu %10lu %10.1f %10.1f %10.1f\n", name, phase->sent, phase->answered, p50, p99, max);
+}
+
+int run_api_benchmark(const struct api_benchmark *opts)
+{
+	cli_mode = true;
+	api_opts = opts;
+	if(!parse_mix(opts->mix != NULL ? opts->mix : API_MIX_DEFAULT))
+		return EXIT_FAILURE;
+
+	int dns_sock = -1;
+	pthread_t dns_thread;
+	if(opts->dns != NULL)
+	{
+		if((dns_sock = dns_connect(opts->dns)) < 0)
+		{
+			printf("Cannot connect to DNS server %s\n", opts->dns);
+			return EXIT_FAILURE;
+		}
+		if(pthread_create(&dns_thread, NULL, dns_load_thread, &dns_sock) != 0)
+		{
+			printf("Cannot start DNS load generator\n");
+			return EXIT_FAILURE;
+		}
+
+		// Baseline without API load
+		sleep(opts->seconds);
+		atomic_store(&dns_phase, 1u);
+	}
+
+	struct api_client *clients = calloc(opts->connections, sizeof(struct api_client));
+	if(clients == NULL)
+	{
+		printf("Cannot allocate memory for %u connections\n", opts->connections);
+		return EXIT_FAILURE;
+	}
+
+	const uint64_t start = now_ns();
+	unsigned int started = 0u;
+	for(; started < opts->connections; started++)
+	{
+		clients[started].seed = 2463534242u + 7919u*started;
+		if(pthread_create(&clients[started].thread, NULL, api_client_thread, &clients[started]) != 0)
+		{
+			printf("Cannot start more than %u connections\n", started);
+			break;
+		}
+	}
+
+	sleep(opts->seconds);
+	atomic_store(&api_stop, true);
+	for(unsigned int i = 0u; i < started; i++)
+		pthread_join(clients[i].thread, NULL);
+	const double elapsed = 1e-9*(double)(now_ns() - start);
+	if(dns_sock > -1)
+	{
+		pthread_join(dns_thread, NULL);
+		close(dns_sock);
+	}
+
+	if(opts->json)
+		printf("{\n  \"api\":[\n");
+	else
+	{
+		printf("API: %u connection%s to %s for %.1f s\n", started, started == 1u ? "" : "s", opts->target, elapsed);
+		printf("%-30s %10s %10s %10s %10s %10s %10s\n", "command", "requests", "req/s", "errors", "p50 [us]", "p99 [us]", "max [us]");
+	}
+
+	unsigned long total = 0u, errors = 0u;
+	for(unsigned int c = 0u; c < mix_len; c++)
+	{
+		// Merge the latencies of all connections
+		struct latencies all = { 0 };
+		unsigned long cmd_errors = 0u;
+		for(unsigned int i = 0u; i < started; i++)
+		{
+			const struct latencies *l = &clients[i].samples[c];
+			for(size_t j = 0u; j < l->num; j++)
+				add_latency(&all, l->ns[j]);
+			cmd_errors += clients[i].errors[c];
+			free(l->ns);
+		}
+		if(all.num > 0u)
+			qsort(all.ns, all.num, sizeof(uint32_t), cmp_latency);
+		const double p50 = all.num > 0u ? percentile(all.ns, all.num, 0.5) : 0.0;
+		const double p99 = all.num > 0u ? percentile(all.ns, all.num, 0.99) : 0.0;
+		const double max = all.num > 0u ? 1e-3*all.ns[all.num - 1] : 0.0;
+		if(opts->json)
+			printf("    {\"command\":\"%s\",\"requests\":%zu,\"rps\":%.1f,\"errors\":%lu,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}%s\n",
+			       mix[c].cmd, all.num, (double)all.num/elapsed, cmd_errors, p50, p99, max,
+			       c + 1 < mix_len ? "," : "");
+		else
+			printf("%-30s %10zu %10.1f %10lu %10.1f %10.1f %10.1f\n", mix[c].cmd, all.num,
+			       (double)all.num/elapsed, cmd_errors, p50, p99, max);
+		total += all.num;
+		errors += cmd_errors;
+		free(all.ns);
+	}
+
+	if(opts->json)
+		printf("  ],\n  \"requests\":%lu,\n  \"rps\":%.1f,\n  \"errors\":%lu%s\n",
+		       total, (double)total/elapsed, errors, opts->dns != NULL ? "," : "");
+	else
+		printf("%-30s %10lu %10.1f %10lu\n", "total", total, (double)total/elapsed, errors);
+
+	if(opts->dns != NULL)
+	{
+		if(opts->json)
+			printf("  \"dns\":{\n");
+		else
+		{
+			printf("\nDNS: %u queries/s to %s\n", opts->qps, opts->dns);
+			printf("%-20s %10s %10s %10s %10s %10s\n", "phase", "sent", "answered", "p50 [us]", "p99 [us]", "max [us]");
+		}
+		print_dns_phase("baseline", &dns_phases[0], opts->json, false);
+		print_dns_phase("api_load", &dns_phases[1], opts->json, true);
+		if(opts->json)
+			printf("  }\n");
+		free(dns_phases[0].samples.ns);
+		free(dns_phases[1].samples.ns);
+	}
+
+	if(opts->json)
+		printf("}\n");
+
+	for(unsigned int i = 0u; i < mix_len; i++)
+		free(mix[i].cmd);
+	free(clients);
+
+	return errors > 0u && total == 0u ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// pihole-FTL benchmark-soak replays days of traffic in accelerated time. FTL's
+// clock advances with the replayed queries and the garbage collection runs
+// every GCinterval, just like in the housekeeper thread. Active clients are
+// replaced by new ones at a steady rate (devices coming and going, temporary
+// IPv6 addresses) and a share of the queries is for names never seen before.
+// After each GC run, the sizes of the shared memory objects and of the
+// process, the duration of the GC run and the longest lock hold are recorded.
+//
+// Once MAXLOGAGE and RECLAIM_GRACE have passed, everything older is removed or
+// reclaimed and memory has to stay flat. The test fails if it grows by more
+// than the given percentage until the end, or if the GC runs at the end take
+// more than twice as long as right after the warm-up
+
+struct soak_sample {
+	double hours;
+	int queries, domains, clients, domain_slots, client_slots;
+	size_t shm;
+	struct shm_object_usage usage[SHM_USAGE_OBJECTS];
+	unsigned long rss, pss; // kB
+	double gc_ms;
+	uint64_t lock_hold; // upper bound [us]
+};
+
+// Resident and proportional set size of this process [kB]
+static void get_process_memory(unsigned long *rss, unsigned long *pss)
+{
+	*rss = *pss = 0ul;
+	FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+	if(fp == NULL)
+		return;
+
+	char line[256];
+	while(fgets(line, sizeof(line), fp) != NULL)
+		if(sscanf(line, "Rss: %lu kB", rss) != 1)
+			sscanf(line, "Pss: %lu kB", pss);
+	fclose(fp);
+}
+
+// Upper bound of the longest SHM lock hold since the last call [us], derived
+// from the hold time histograms of all call sites
+static uint64_t lock_hold_bound(uint64_t prev[LOCK_HIST_BINS])
+{
+	uint64_t bound = 0u;
+	for(unsigned int bin = 0; bin < LOCK_HIST_BINS; bin++)
+	{
+		uint64_t sum = 0u;
+		for(unsigned int i = 0; i < lock_stats_sites(); i++)
+			sum += lock_stats_get(i)->hold_hist[bin];
+		if(sum > prev[bin])
+			bound = (uint64_t)1 << bin;
+		prev[bin] = sum;
+	}
+	return bound;
+}
+
+static void take_sample(struct soak_sample *sample, const double hours, const double gc_ms,
+                        uint64_t lock_hist[LOCK_HIST_BINS])
+{
+	unsigned int resizes = 0u, remaps = 0u;
+
+	lock_shm();
+	sample->hours = hours;
+	sample->queries = counters->queries;
+	sample->domains = known_domains();
+	sample->clients = known_clients();
+	sample->domain_slots = counters->domains;
+	sample->client_slots = counters->clients;
+	get_shm_usage(&resizes, &remaps, &sample->shm);
+	get_shm_breakdown(sample->usage);
+	unlock_shm();
+
+	get_process_memory(&sample->rss, &sample->pss);
+	sample->gc_ms = gc_ms;
+	sample->lock_hold = lock_hold_bound(lock_hist);
+}
+
+// Check that a value did not grow by more than max_growth percent from the
+// first sample after the warm-up until the end
+static bool check_growth(const char *what, const double first, const double last,
+                         const unsigned int max_growth)
+{
+	const double growth = first > 0.0 ? 100.0*(last - first)/first : 0.0;
+	const bool ok = growth <= (double)max_growth;
+	printf("# %s %s: %.0f -> %.0f (%+.1f%%, limit %u%%)\n",
+	       ok ? "PASS" : "FAIL", what, first, last, growth, max_growth);
+	return ok;
+}
+
+// The bytes used by each shared memory object are given as <name>_bytes
+static void print_sample(const struct soak_sample *sample, const bool json, const bool last)
+{
+	if(json)
+	{
+		printf("  {\"hours\":%.2f,\"queries\":%d,\"domains\":%d,\"clients\":%d,"
+		       "\"domain_slots\":%d,\"client_slots\":%d,\"shm_bytes\":%zu,",
+		       sample->hours, sample->queries, sample->domains, sample->clients,
+		       sample->domain_slots, sample->client_slots, sample->shm);
+		for(unsigned int i = 0; i < SHM_USAGE_OBJECTS; i++)
+			printf("\"%s_bytes\":%zu,", get_shm_usage_name(i), sample->usage[i].used);
+		printf("\"rss_kb\":%lu,\"pss_kb\":%lu,\"gc_ms\":%.2f,\"lock_hold_us\":%lu}%s\n",
+		       sample->rss, sample->pss, sample->gc_ms,
+		       (unsigned long)sample->lock_hold, last ? "" : ",");
+	}
+	else
+	{
+		printf("%.2f,%d,%d,%d,%d,%d,%zu,",
+		       sample->hours, sample->queries, sample->domains, sample->clients,
+		       sample->domain_slots, sample->client_slots, sample->shm);
+		for(unsigned int i = 0; i < SHM_USAGE_OBJECTS; i++)
+			printf("%zu,", sample->usage[i].used);
+		printf("%lu,%lu,%.2f,%lu\n", sample->rss, sample->pss, sample->gc_ms,
+		       (unsigned long)sample->lock_hold);
+	}
+}
+
+static void client_address(union mysockaddr *addr, const unsigned int client)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->in.sin_family = AF_INET;
+	addr->in.sin_port = htons(53000);
+	addr->in.sin_addr.s_addr = htonl(0x0a000000u | (client & 0xffffffu));
+}
+
+int run_soak_benchmark(const struct soak_benchmark *opts)
+{
+	if(!benchmark_init(opts->conf, opts->verbose))
+		return EXIT_FAILURE;
+	load_lists(opts->gravity_db);
+	if(!replay_init())
+	{
+		destroy_shmem();
+		return EXIT_FAILURE;
+	}
+
+	// Memory is only expected to be flat once the oldest queries are
+	// removed and their domains and clients are reclaimed
+	const time_t warmup = (time_t)config.maxlogage + (time_t)config.reclaim_grace + 2*GCinterval;
+	const time_t duration = (time_t)opts->days * 86400;
+	if(duration < warmup + 4*GCinterval)
+	{
+		printf("A soak test of %u day%s is shorter than the warm-up of %.1f hours\n",
+		       opts->days, opts->days == 1 ? "" : "s", (double)warmup/3600.0);
+		destroy_shmem();
+		return EXIT_FAILURE;
+	}
+
+	const unsigned int cycles = (unsigned int)(duration / GCinterval);
+	struct soak_sample *samples = calloc(cycles, sizeof(*samples));
+	unsigned int *active = calloc(opts->clients, sizeof(*active));
+	if(samples == NULL || active == NULL)
+	{
+		printf("Cannot allocate memory for %u samples\n", cycles);
+		free(samples);
+		free(active);
+		destroy_shmem();
+		return EXIT_FAILURE;
+	}
+	unsigned int next_client = 1u;
+	for(unsigned int i = 0; i < opts->clients; i++)
+		active[i] = next_client++;
+
+	// Start at the current time (overTime has been initialized for it),
+	// aligned to the GC interval like the housekeeper does
+	const time_t now = time(NULL);
+	const time_t start = now - now % GCinterval;
+
+	if(opts->json)
+		printf("[\n");
+	else
+	{
+		printf("hours,queries,domains,clients,domain_slots,client_slots,shm_bytes,");
+		for(unsigned int i = 0; i < SHM_USAGE_OBJECTS; i++)
+			printf("%s_bytes,", get_shm_usage_name(i));
+		printf("rss_kb,pss_kb,gc_ms,lock_hold_us\n");
+	}
+
+	uint64_t lock_hist[LOCK_HIST_BINS] = { 0 };
+	lock_hold_bound(lock_hist);
+	unsigned int unique = 0u, baseline = 0u;
+	int id = 0;
+	// Clients replaced per GC interval, in thousandths
+	const unsigned int churn = opts->clients * opts->churn * 10u * GCinterval / 3600u;
+	unsigned int churn_acc = 0u;
+	for(unsigned int cycle = 0; cycle < cycles; cycle++)
+	{
+		const time_t t0 = start + (time_t)cycle * GCinterval;
+
+		// Replace some of the active clients by new ones
+		for(churn_acc += churn; churn_acc >= 1000u; churn_acc -= 1000u)
+			active[rnd() % opts->clients] = next_client++;
+
+		for(unsigned int i = 0; i < opts->queries; i++)
+		{
+			clock_set(t0 + (time_t)((uint64_t)i * GCinterval / opts->queries));
+
+			struct trace_query q = { .qtype = T_A };
+			char domain[64];
+			const unsigned int r = rnd() % 100u;
+			if(r < 75u)
+			{
+				// Popular names, skewed towards the first ones
+				const unsigned int x = rnd() % 20000u;
+				snprintf(domain, sizeof(domain), "site%u.example.org", rnd() % (x + 1u));
+				q.kind = REPLAY_CACHE;
+			}
+			else if(r < 95u)
+			{
+				snprintf(domain, sizeof(domain), "u%u.soak%u.net", unique++, rnd() % 1000u);
+				q.kind = REPLAY_FORWARD;
+			}
+			else
+			{
+				snprintf(domain, sizeof(domain), "nx%u.invalid", unique++);
+				q.kind = REPLAY_NXDOMAIN;
+			}
+			if(rnd() % 4u == 0u)
+				q.qtype = T_AAAA;
+			q.domain = domain;
+			client_address(&q.client, active[rnd() % opts->clients]);
+			replay(&q, ++id);
+		}
+
+		// Without the database, the network table is not updated. The
+		// queries counted for it are dropped like after storing them as
+		// clients which are still counted there are never reclaimed
+		lock_shm();
+		for(int clientID = 0; clientID < counters->clients; clientID++)
+		{
+			clientsData *client = getClient(clientID, true);
+			if(client != NULL)
+				client->numQueriesARP = 0;
+		}
+		unlock_shm();
+
+		// Garbage collection at the end of the interval
+		const time_t t1 = t0 + GCinterval;
+		clock_set(t1);
+		const uint64_t gc_start = now_ns();
+		run_GC(t1);
+		const double gc_ms = 1e-6*(double)(now_ns() - gc_start);
+
+		take_sample(&samples[cycle], (double)(t1 - start)/3600.0, gc_ms, lock_hist);
+		print_sample(&samples[cycle], opts->json, cycle + 1 == cycles);
+		if(baseline == 0u && t1 - start >= warmup)
+			baseline = cycle;
+	}
+	if(opts->json)
+		printf("]\n");
+	clock_invalidate();
+
+	// Compare the first samples after the warm-up with the last ones, GC
+	// durations are averaged over a tenth of them as they are noisy
+	const struct soak_sample *first = &samples[baseline], *last = &samples[cycles - 1];
+	const unsigned int window = (cycles - baseline) / 10u + 1u;
+	double gc_first = 0.0, gc_last = 0.0;
+	uint64_t lock_first = 0u, lock_last = 0u;
+	for(unsigned int i = 0; i < window; i++)
+	{
+		gc_first += samples[baseline + i].gc_ms / window;
+		gc_last += samples[cycles - 1 - i].gc_ms / window;
+		if(samples[baseline + i].lock_hold > lock_first)
+			lock_first = samples[baseline + i].lock_hold;
+		if(samples[cycles - 1 - i].lock_hold > lock_last)
+			lock_last = samples[cycles - 1 - i].lock_hold;
+	}
+
+	printf("# Replayed %d queries of %u clients over %u days, warm-up until hour %.1f\n",
+	       id, next_client - 1u, opts->days, first->hours);
+	bool ok = true;
+	ok &= check_growth("shared memory [bytes]", (double)first->shm, (double)last->shm, opts->growth);
+	for(unsigned int i = 0; i < SHM_USAGE_OBJECTS; i++)
+	{
+		char what[64];
+		snprintf(what, sizeof(what), "%s [bytes]", get_shm_usage_name(i));
+		ok &= check_growth(what, (double)first->usage[i].used, (double)last->usage[i].used, opts->growth);
+	}
+	ok &= check_growth("domain slots", first->domain_slots, last->domain_slots, opts->growth);
+	ok &= check_growth("client slots", first->client_slots, last->client_slots, opts->growth);
+	ok &= check_growth("RSS [kB]", (double)first->rss, (double)last->rss, opts->growth);
+
+	// Allow for a millisecond of noise on fast machines
+	const bool gc_ok = gc_last <= 2.0*gc_first + 1.0;
+	printf("# %s GC duration [ms]: %.2f -> %.2f (limit twice as long)\n",
+	       gc_ok ? "PASS" : "FAIL", gc_first, gc_last);
+	printf("# INFO longest lock hold [us]: < %lu -> < %lu\n",
+	       (unsigned long)lock_first, (unsigned long)lock_last);
+	ok &= gc_ok;
+
+	free(samples);
+	free(active);
+	destroy_shmem();
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,52 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Query pipeline benchmark prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+int run_benchmark(const char *trace, const char *gravity_db, const char *conf,
+                  const unsigned int passes, const bool verbose);
+int run_lists_benchmark(const char *corpus, const char *gravity_db, const char *conf,
+                        const unsigned int passes, const bool verbose);
+int run_shm_benchmark(const unsigned int max, const bool json, const bool verbose);
+
+struct api_benchmark {
+	// host:port of a telnet endpoint or path of the unix socket
+	const char *target;
+	// Commands with optional weights, e.g. ">stats:4,>top-domains:1"
+	const char *mix;
+	// host:port of the DNS server to send queries to at the same time
+	const char *dns;
+	unsigned int connections;
+	unsigned int seconds;
+	unsigned int qps;
+	bool json;
+};
+
+int run_api_benchmark(const struct api_benchmark *opts);
+
+struct soak_benchmark {
+	const char *gravity_db;
+	const char *conf;
+	unsigned int days;
+	// Queries replayed per GC interval
+	unsigned int queries;
+	// Clients active at the same time and percentage replaced per hour
+	unsigned int clients;
+	unsigned int churn;
+	// Maximum memory growth after the warm-up [%]
+	unsigned int growth;
+	bool json;
+	bool verbose;
+};
+
+int run_soak_benchmark(const struct soak_benchmark *opts);
+
+#endif // BENCHMARK_H
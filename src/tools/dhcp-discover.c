@@ -21,6 +21,7 @@
 #include "capabilities.h"
 
 #include <sys/time.h>
+#include <poll.h>
 // SIOCGIFHWADDR
 #include <sys/ioctl.h>
 #include <fcntl.h>
@@ -43,14 +44,11 @@
 #define DHCP_SERVER_PORT   67
 #define DHCP_CLIENT_PORT   68
 
-// Maximum time we wait for incoming DHCPOFFERs
-// (seconds)
-#define DHCPOFFER_TIMEOUT 10
+// How many interfaces do we scan for DHCP activity at maximum?
+#define MAX_IFACES 32
 
-// How many threads do we spawn at maximum?
-// This is also the limit for interfaces
-// we scan for DHCP activity.
-#define MAXTHREADS 32
+// How many DHCP servers do we remember at maximum?
+#define MAX_SERVERS 64
 
 // Probe DHCP servers responding to the broadcast address
 #define PROBE_BCAST
@@ -58,15 +56,13 @@
 // Should we generate test data for DHCP option 249?
 //#define TEST_OPT_249
 
-// Global lock used by all threads
-static pthread_mutex_t lock;
-static void __attribute__((format(gnu_printf, 1, 2))) printf_locked(const char *format, ...)
+// Human-readable messages go to stderr when the results are printed as JSON
+static bool json_output = false;
+static void __attribute__((format(gnu_printf, 1, 2))) print_info(const char *format, ...)
 {
 	va_list args;
 	va_start(args, format);
-	pthread_mutex_lock(&lock);
-	vprintf(format, args);
-	pthread_mutex_unlock(&lock);
+	vfprintf(json_output ? stderr : stdout, format, args);
 	va_end(args);
 }
 
@@ -93,17 +89,17 @@ static int create_dhcp_socket(const char *iname)
 	const int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 	if(sock < 0)
 	{
-		printf_locked("Error: Could not create socket for interface %s!\n", iname);
+		print_info("Error: Could not create socket for interface %s!\n", iname);
 		return -1;
 	}
 
 #ifdef DEBUG
-	printf_locked("DHCP socket: %d\n", sock);
+	print_info("DHCP socket: %d\n", sock);
 #endif
 	// set the reuse address flag so we don't get errors when restarting
 	if(setsockopt(sock,SOL_SOCKET, SO_REUSEADDR, (char *)&flag, sizeof(flag))<0)
 	{
-		printf_locked("Error: Could not set reuse address option on DHCP socket (%s)!\n", iname);
+		print_info("Error: Could not set reuse address option on DHCP socket (%s)!\n", iname);
 		close(sock);
 		return -1;
 	}
@@ -111,7 +107,7 @@ static int create_dhcp_socket(const char *iname)
 	// set the broadcast option - we need this to listen to DHCP broadcast messages
 	if(setsockopt(sock, SOL_SOCKET,SO_BROADCAST, (char *)&flag, sizeof flag) < 0)
 	{
-		printf_locked("Error: Could not set broadcast option on DHCP socket (%s)!\n", iname);
+		print_info("Error: Could not set broadcast option on DHCP socket (%s)!\n", iname);
 		close(sock);
 		return -1;
 	}
@@ -120,7 +116,7 @@ static int create_dhcp_socket(const char *iname)
 	strncpy(interface.ifr_ifrn.ifrn_name, iname, IFNAMSIZ-1);
 	if(setsockopt(sock,SOL_SOCKET, SO_BINDTODEVICE, (char *)&interface, sizeof(interface)) < 0)
 	{
-		printf_locked("Error: Could not bind socket to interface %s (%s)\n",
+		print_info("Error: Could not bind socket to interface %s (%s)\n",
 		              iname, strerror(errno));
 		close(sock);
 		return -1;
@@ -129,7 +125,7 @@ static int create_dhcp_socket(const char *iname)
 	// bind the socket
 	if(bind(sock, (struct sockaddr *)&dhcp_socket, sizeof(dhcp_socket)) < 0)
 	{
-		printf_locked("Error: Could not bind to DHCP socket (interface %s, port %d, %s)\n",
+		print_info("Error: Could not bind to DHCP socket (interface %s, port %d, %s)\n",
 		              iname, DHCP_CLIENT_PORT, strerror(errno));
 		close(sock);
 		return -1;
@@ -148,15 +144,15 @@ int get_hardware_address(const int sock, const char *iname, unsigned char *mac)
 	int ret = 0;
 	if((ret = ioctl(sock, SIOCGIFHWADDR, &ifr)) < 0)
 	{
-		printf_locked(" Error: Could not get hardware address of interface %s: %s\n", iname, strerror(errno));
+		print_info(" Error: Could not get hardware address of interface %s: %s\n", iname, strerror(errno));
 		return false;
 	}
 	memcpy(&mac[0], &ifr.ifr_hwaddr.sa_data, 6);
 #ifdef DEBUG
-	printf_locked("Hardware address of this interface: ");
+	print_info("Hardware address of this interface: ");
 	for (uint8_t i = 0; i < 6; ++i)
-		printf_locked("%02x%s", mac[i], i < 5 ? ":" : "");
-	printf_locked("\n");
+		print_info("%02x%s", mac[i], i < 5 ? ":" : "");
+	print_info("\n");
 #endif
 	return true;
 }
@@ -226,12 +222,12 @@ static bool send_dhcp_discover(const int sock, const uint32_t xid, const char *i
 	target.sin_addr.s_addr = INADDR_BROADCAST;
 
 #ifdef DEBUG
-	printf_locked("Sending DHCPDISCOVER on interface %s@%s ... \n", inet_ntoa(target.sin_addr), iface);
-	printf_locked("DHCPDISCOVER XID: %lu (0x%X)\n", (unsigned long) ntohl(discover_packet.xid), ntohl(discover_packet.xid));
-	printf_locked("DHCDISCOVER ciaddr:  %s\n", inet_ntoa(discover_packet.ciaddr));
-	printf_locked("DHCDISCOVER yiaddr:  %s\n", inet_ntoa(discover_packet.yiaddr));
-	printf_locked("DHCDISCOVER siaddr:  %s\n", inet_ntoa(discover_packet.siaddr));
-	printf_locked("DHCDISCOVER giaddr:  %s\n", inet_ntoa(discover_packet.giaddr));
+	print_info("Sending DHCPDISCOVER on interface %s@%s ... \n", inet_ntoa(target.sin_addr), iface);
+	print_info("DHCPDISCOVER XID: %lu (0x%X)\n", (unsigned long) ntohl(discover_packet.xid), ntohl(discover_packet.xid));
+	print_info("DHCDISCOVER ciaddr:  %s\n", inet_ntoa(discover_packet.ciaddr));
+	print_info("DHCDISCOVER yiaddr:  %s\n", inet_ntoa(discover_packet.yiaddr));
+	print_info("DHCDISCOVER siaddr:  %s\n", inet_ntoa(discover_packet.siaddr));
+	print_info("DHCDISCOVER giaddr:  %s\n", inet_ntoa(discover_packet.giaddr));
 #endif
 	// send the DHCPDISCOVER packet
 	const int bytes = sendto(sock, (char *)&discover_packet, sizeof(discover_packet), 0, (struct sockaddr *)&target, sizeof(target));
@@ -242,13 +238,13 @@ static bool send_dhcp_discover(const int sock, const uint32_t xid, const char *i
 		// meaningful error message for ENOKEY returned by wireguard interfaces
 		// (see https://www.wireguard.com/papers/wireguard.pdf, page 5)
 		const char *error = errno == ENOKEY ? "No route to host (no such peer available)" : strerror(errno);
-		printf_locked("Error: Could not send DHCPDISCOVER to %s@%s: %s\n",
+		print_info("Error: Could not send DHCPDISCOVER to %s@%s: %s\n",
 		              inet_ntoa(target.sin_addr), iface, error);
 		return false;
 	}
 
 #ifdef DEBUG
-	printf_locked("Sent %d bytes\n", bytes);
+	print_info("Sent %d bytes\n", bytes);
 #endif
 	return true;
 }
@@ -504,105 +500,153 @@ static void print_dhcp_offer(struct in_addr source, struct dhcp_packet_data *off
 	printf("\n");
 }
 
-// receives a DHCP packet
-static bool receive_dhcp_packet(void *buffer, int buffer_size, const char *iface, int sock, const time_t start_time, struct sockaddr_in *address)
-{
-	struct timeval tv;
-	fd_set readfds;
-	int recv_result;
-	socklen_t address_size;
-
-	// Wait for data to arrive
-	tv.tv_sec = 0;
-	tv.tv_usec = 100000;
-	FD_ZERO(&readfds);
-	FD_SET(sock, &readfds);
-	// see "man select" for the "sock + 1"
-	select(sock + 1, &readfds, NULL, NULL, &tv);
-
-	// make sure some data has arrived
-	if(!FD_ISSET(sock, &readfds))
-		return false;
+struct dhcp_iface {
+	char name[IF_NAMESIZE + 1];
+	int sock;
+	uint32_t xid;
+	unsigned char mac[MAX_DHCP_CHADDR_LENGTH];
+	unsigned int responses;
+	unsigned int offers;
+	struct dhcp_offer {
+		struct in_addr source;
+		struct in_addr server;
+		struct dhcp_packet_data packet;
+	} *offer;
+};
 
-	address_size = sizeof(struct sockaddr_in);
-	recv_result = recvfrom(sock, (char *)buffer, buffer_size, 0, (struct sockaddr *)address, &address_size);
+// DHCP servers which answered, every server is counted once per interface
+static struct {
+	unsigned int iface;
+	struct in_addr addr;
+} servers[MAX_SERVERS];
+static unsigned int num_servers = 0;
 
-	printf_locked("\n* Received %d bytes from %s:%s\n", recv_result, iface, inet_ntoa(address->sin_addr));
-#ifdef DEBUG
-	printf_locked("  after waiting for %f seconds\n", difftime(time(NULL), start_time));
-#endif
-	// Return on error
-	if(recv_result == -1)
+static uint64_t monotonic_msec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
+}
+
+// Find an option in a DHCP packet. Returns a pointer to its data or NULL
+static const unsigned char *find_dhcp_option(const struct dhcp_packet_data *packet, const uint8_t type, uint8_t *len)
+{
+	// We start from 4 as the first 32 bit are the DHCP magic coockie
+	for(unsigned int x = 4; x < MAX_DHCP_OPTIONS_LENGTH - 2;)
 	{
-		printf_locked(" recvfrom() failed on %s, error: %s\n", iface, strerror(errno));
-		return false;
+		const uint8_t opttype = packet->options[x++];
+		if(opttype == 0 || opttype == 255)
+			break;
+		const uint8_t optlen = packet->options[x++];
+		if(x + optlen > MAX_DHCP_OPTIONS_LENGTH)
+			break;
+		if(opttype == type)
+		{
+			*len = optlen;
+			return (const unsigned char*)&packet->options[x];
+		}
+		x += optlen;
 	}
 
-	return true;
+	return NULL;
 }
 
-// waits for a DHCPOFFER message from one or more DHCP servers
-static int get_dhcp_offer(const int sock, const uint32_t xid, const char *iface, unsigned char *mac)
+// Remember a DHCP server. Returns true if it has not answered on this
+// interface before
+static bool add_dhcp_server(const unsigned int iface, const struct in_addr addr)
 {
-	struct dhcp_packet_data offer_packet;
-	struct sockaddr_in source;
-#ifdef DEBUG
-	unsigned int responses = 0;
-#endif
-	unsigned int valid_responses = 0;
-	time_t start_time;
-	time_t current_time;
+	for(unsigned int i = 0; i < num_servers; i++)
+		if(servers[i].iface == iface && servers[i].addr.s_addr == addr.s_addr)
+			return false;
+
+	if(num_servers >= MAX_SERVERS)
+		return false;
 
-	time(&start_time);
+	servers[num_servers].iface = iface;
+	servers[num_servers].addr = addr;
+	num_servers++;
+	return true;
+}
 
-	// receive as many responses as we can
-	while(time(&current_time) && (current_time-start_time) < DHCPOFFER_TIMEOUT)
+// receives all DHCP packets waiting on a socket
+static void receive_dhcp_packets(struct dhcp_iface *ifaces, const unsigned int idx, const uint64_t start_time)
+{
+	struct dhcp_iface *iface = &ifaces[idx];
+	while(true)
 	{
+		struct dhcp_packet_data offer_packet;
+		struct sockaddr_in source;
 		memset(&source, 0, sizeof(source));
 		memset(&offer_packet, 0, sizeof(offer_packet));
 
-		if(!receive_dhcp_packet(&offer_packet, sizeof(offer_packet), iface, sock, start_time, &source))
-			continue;
-#ifdef DEBUG
-		else
-			responses++;
-#endif
-
-		if(pthread_mutex_lock(&lock) != 0)
-			return -1;
+		socklen_t address_size = sizeof(struct sockaddr_in);
+		const ssize_t recv_result = recvfrom(iface->sock, (char *)&offer_packet, sizeof(offer_packet), MSG_DONTWAIT,
+		                                     (struct sockaddr *)&source, &address_size);
+		if(recv_result == -1)
+		{
+			// Return on error
+			if(errno != EAGAIN)
+				print_info(" recvfrom() failed on %s, error: %s\n", iface->name, strerror(errno));
+			return;
+		}
 
+		iface->responses++;
+		print_info("\n* Received %zd bytes from %s:%s\n", recv_result, iface->name, inet_ntoa(source.sin_addr));
 #ifdef DEBUG
-		printf(" DHCPOFFER XID: %lu (0x%X)\n", (unsigned long) ntohl(offer_packet.xid), ntohl(offer_packet.xid));
+		print_info("  after waiting for %f seconds\n", (monotonic_msec() - start_time) / 1000.0);
+		print_info(" DHCPOFFER XID: %lu (0x%X)\n", (unsigned long) ntohl(offer_packet.xid), ntohl(offer_packet.xid));
+#else
+		(void)start_time;
 #endif
 
 		// check packet xid to see if its the same as the one we used in the discover packet
-		if(ntohl(offer_packet.xid) != xid)
+		if(ntohl(offer_packet.xid) != iface->xid)
 		{
-			printf("  DHCPOFFER XID (%lu) does not match our DHCPDISCOVER XID (%lu) - ignoring packet (not for us)\n",
-			       (unsigned long) ntohl(offer_packet.xid), (unsigned long) xid);
-
-			pthread_mutex_unlock(&lock);
+			print_info("  DHCPOFFER XID (%lu) does not match our DHCPDISCOVER XID (%lu) - ignoring packet (not for us)\n",
+			           (unsigned long) ntohl(offer_packet.xid), (unsigned long) iface->xid);
 			continue;
 		}
 
 		// check hardware address
-		if(memcmp(offer_packet.chaddr, mac, 6) != 0)
+		if(memcmp(offer_packet.chaddr, iface->mac, 6) != 0)
 		{
-			printf("  DHCPOFFER hardware address did not match our own - ignoring packet (not for us)\n");
+			print_info("  DHCPOFFER hardware address did not match our own - ignoring packet (not for us)\n");
 
-			printf("  DHCPREQUEST chaddr: ");
+			print_info("  DHCPREQUEST chaddr: ");
 			for(uint8_t x = 0; x < 6; x++)
-				printf("%02x%s", mac[x], x < 5 ? ":" : "");
-			printf(" (our MAC address)\n");
+				print_info("%02x%s", iface->mac[x], x < 5 ? ":" : "");
+			print_info(" (our MAC address)\n");
 
-			printf("  DHCPOFFER   chaddr: ");
+			print_info("  DHCPOFFER   chaddr: ");
 			for(uint8_t x = 0; x < 6; x++)
-				printf("%02x%s", offer_packet.chaddr[x], x < 5 ? ":" : "");
-			printf(" (response MAC address)\n");
+				print_info("%02x%s", offer_packet.chaddr[x], x < 5 ? ":" : "");
+			print_info(" (response MAC address)\n");
+			continue;
+		}
 
-			pthread_mutex_unlock(&lock);
+		// The server is identified by its server identifier (option 54),
+		// or by the address the offer has been sent from
+		struct in_addr server = source.sin_addr;
+		uint8_t len = 0;
+		const unsigned char *server_id = find_dhcp_option(&offer_packet, 54, &len);
+		if(server_id != NULL && len == sizeof(server.s_addr))
+			memcpy(&server.s_addr, server_id, sizeof(server.s_addr));
+		add_dhcp_server(idx, server);
+
+		// Memorize the offer for the JSON output
+		if(json_output)
+		{
+			struct dhcp_offer *offer = realloc(iface->offer, (iface->offers + 1) * sizeof(*offer));
+			if(offer == NULL)
+				continue;
+			iface->offer = offer;
+			offer[iface->offers].source = source.sin_addr;
+			offer[iface->offers].server = server;
+			offer[iface->offers].packet = offer_packet;
+			iface->offers++;
 			continue;
 		}
+		iface->offers++;
 
 		printf("  Offered IP address: ");
 		if(offer_packet.yiaddr.s_addr != 0)
@@ -625,9 +669,9 @@ static int get_dhcp_offer(const int sock, const uint32_t xid, const char *iface,
 		printf("  BOOTP server: ");
 		if(offer_packet.sname[0] != 0)
 		{
-			size_t len = strlen(offer_packet.sname);
-			char buffer[4*len + 9];
-			binbuf_to_escaped_C_literal(offer_packet.sname, len, buffer, sizeof(buffer));
+			size_t slen = strnlen(offer_packet.sname, sizeof(offer_packet.sname));
+			char buffer[4*slen + 9];
+			binbuf_to_escaped_C_literal(offer_packet.sname, slen, buffer, sizeof(buffer));
 			printf("%s\n", buffer);
 		}
 		else
@@ -636,9 +680,9 @@ static int get_dhcp_offer(const int sock, const uint32_t xid, const char *iface,
 		printf("  BOOTP file: ");
 		if(offer_packet.file[0] != 0)
 		{
-			size_t len = strlen(offer_packet.file);
-			char buffer[4*len + 9];
-			binbuf_to_escaped_C_literal(offer_packet.file, len, buffer, sizeof(buffer));
+			size_t flen = strnlen(offer_packet.file, sizeof(offer_packet.file));
+			char buffer[4*flen + 9];
+			binbuf_to_escaped_C_literal(offer_packet.file, flen, buffer, sizeof(buffer));
 			printf("%s\n", buffer);
 		}
 		else
@@ -646,61 +690,156 @@ static int get_dhcp_offer(const int sock, const uint32_t xid, const char *iface,
 
 		printf("  DHCP options:\n");
 		print_dhcp_offer(source.sin_addr, &offer_packet);
-		pthread_mutex_unlock(&lock);
+	}
+}
 
-		valid_responses++;
+// Print a string as JSON string
+static void print_json_string(const char *str, const size_t len)
+{
+	putchar('"');
+	for(size_t i = 0; i < len; i++)
+	{
+		const unsigned char c = str[i];
+		if(c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if(c < 0x20 || c >= 0x7f)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
 	}
-#ifdef DEBUG
-	printf(" Responses seen while scanning:    %d\n", responses);
-	printf(" Responses meant for this machine: %d\n\n", valid_responses);
-#endif
-	return valid_responses;
+	putchar('"');
 }
 
-static void *dhcp_discover_iface(void *args)
+// Print the options of a DHCP offer as JSON object. Options are named as in
+// dnsmasq, unknown options are printed as hex string
+static void print_json_options(const struct dhcp_packet_data *packet)
 {
-	int valid_responses = -1;
-	// Get interface details
-	const char *iface = ((struct ifaddrs*)args)->ifa_name;
+	putchar('{');
+	const char *sep = "";
+	for(unsigned int x = 4; x < MAX_DHCP_OPTIONS_LENGTH - 2;)
+	{
+		const uint8_t opttype = packet->options[x++];
+		if(opttype == 0 || opttype == 255)
+			break;
+		const uint8_t optlen = packet->options[x++];
+		if(x + optlen > MAX_DHCP_OPTIONS_LENGTH)
+			break;
+		const unsigned char *data = (const unsigned char*)&packet->options[x];
+		x += optlen;
 
-	// Set interface name as thread name
-	prctl(PR_SET_NAME, iface, 0, 0, 0);
+		unsigned int flags = 0;
+		const char *name = NULL;
+		for(unsigned int i = 0; opttab[i].name != NULL; i++)
+		{
+			if(opttab[i].val == opttype)
+			{
+				name = opttab[i].name;
+				flags = opttab[i].size;
+				break;
+			}
+		}
 
+		if(name != NULL)
+			printf("%s\"%s\":", sep, name);
+		else
+			printf("%s\"option-%u\":", sep, opttype);
+		sep = ",";
+
+		if(name != NULL && (flags & OT_ADDR_LIST))
+		{
+			putchar('[');
+			for(unsigned int n = 0; n < optlen/4u; n++)
+				printf("%s\"%u.%u.%u.%u\"", n > 0 ? "," : "",
+				       data[4*n], data[4*n+1], data[4*n+2], data[4*n+3]);
+			putchar(']');
+		}
+		else if(name != NULL && (flags & OT_NAME))
+			print_json_string((const char*)data, optlen);
+		else if(name != NULL && (flags & (OT_DEC | OT_TIME)) &&
+		        (optlen == 1 || optlen == 2 || optlen == 4))
+		{
+			uint32_t number = 0;
+			for(unsigned int n = 0; n < optlen; n++)
+				number = (number << 8) | data[n];
+			printf("%u", number);
+		}
+		else
+		{
+			putchar('"');
+			for(unsigned int n = 0; n < optlen; n++)
+				printf("%02x", data[n]);
+			putchar('"');
+		}
+	}
+	putchar('}');
+}
+
+// Print the results of all interfaces as JSON object
+static void print_json_results(const struct dhcp_iface *ifaces, const unsigned int num,
+                               const unsigned int timeout, const unsigned int expected,
+                               const uint64_t elapsed)
+{
+	printf("{\"timeout\":%u,\"expected\":%u,\"servers\":%u,\"elapsed\":%.3f,\"interfaces\":[",
+	       timeout, expected, num_servers, elapsed / 1000.0);
+	for(unsigned int i = 0; i < num; i++)
+	{
+		const struct dhcp_iface *iface = &ifaces[i];
+		printf("%s{\"interface\":", i > 0 ? "," : "");
+		print_json_string(iface->name, strlen(iface->name));
+		printf(",\"probed\":%s,\"responses\":%u,\"offers\":[",
+		       iface->sock >= 0 ? "true" : "false", iface->responses);
+		for(unsigned int j = 0; j < iface->offers; j++)
+		{
+			const struct dhcp_offer *offer = &iface->offer[j];
+			printf("%s{\"source\":\"%s\"", j > 0 ? "," : "", inet_ntoa(offer->source));
+			printf(",\"server\":\"%s\"", inet_ntoa(offer->server));
+			printf(",\"offered\":\"%s\"", inet_ntoa(offer->packet.yiaddr));
+			printf(",\"next-server\":\"%s\"", inet_ntoa(offer->packet.siaddr));
+			printf(",\"relay\":\"%s\"", inet_ntoa(offer->packet.giaddr));
+			printf(",\"bootp-server\":");
+			print_json_string(offer->packet.sname, strnlen(offer->packet.sname, sizeof(offer->packet.sname)));
+			printf(",\"bootp-file\":");
+			print_json_string(offer->packet.file, strnlen(offer->packet.file, sizeof(offer->packet.file)));
+			printf(",\"options\":");
+			print_json_options(&offer->packet);
+			putchar('}');
+		}
+		printf("]}");
+	}
+	printf("]}\n");
+}
+
+// Prepare probing an interface and send the DHCPDISCOVER
+static bool dhcp_discover_iface(struct dhcp_iface *iface)
+{
 	// create socket for DHCP communications
-	const int dhcp_socket = create_dhcp_socket(iface);
+	iface->sock = create_dhcp_socket(iface->name);
 
 	// Cannot create socket, likely a permission error
-	if(dhcp_socket < 0)
-		goto end_dhcp_discover_iface;
+	if(iface->sock < 0)
+		return false;
 
 	// get hardware address of client machine
-	unsigned char mac[MAX_DHCP_CHADDR_LENGTH] = { 0 };
-	get_hardware_address(dhcp_socket, iface, mac);
+	get_hardware_address(iface->sock, iface->name, iface->mac);
 
 	// Generate pseudo-random transaction ID
-	srand(time(NULL));
-	const uint32_t xid = random();
+	iface->xid = random();
 
 	// Probe servers on this interface
-	if(!send_dhcp_discover(dhcp_socket, xid, iface, mac))
-		goto end_dhcp_discover_iface;
-
-	// wait for a DHCPOFFER packet
-	valid_responses = get_dhcp_offer(dhcp_socket, xid, iface, mac);
-
-end_dhcp_discover_iface:
-	// Close socket if we created one
-	if(dhcp_socket > 0)
-		close(dhcp_socket);
-
-	if(valid_responses >= 0)
-		printf_locked("DHCP packets received on interface %s: %u\n", iface, valid_responses);
+	if(!send_dhcp_discover(iface->sock, iface->xid, iface->name, iface->mac))
+	{
+		close(iface->sock);
+		iface->sock = -1;
+		return false;
+	}
 
-	pthread_exit(NULL);
+	return true;
 }
 
-int run_dhcp_discover(void)
+int run_dhcp_discover(const bool json, const unsigned int expected, const unsigned int timeout)
 {
+	json_output = json;
+
 	// Check if we are capable of binding to port 67 (DHCP)
 	// DHCP uses normal UDP datagrams, so we cdon't need CAP_NET_RAW
 	if(!check_capability(CAP_NET_BIND_SERVICE))
@@ -716,35 +855,23 @@ int run_dhcp_discover(void)
 	// Only print to terminal, disable log file
 	log_ctrl(false, true);
 
-	printf("Scanning all your interfaces for DHCP servers\n");
-	printf("Timeout: %d seconds\n", DHCPOFFER_TIMEOUT);
-
-	// Get interface names for available interfaces on this machine
-	// and launch a thread for each one
-	pthread_t scanthread[MAXTHREADS];
-	pthread_attr_t attr;
-	// Initialize thread attributes object with default attribute values
-	pthread_attr_init(&attr);
-
-	// Create processing/logging lock
-	pthread_mutexattr_t lock_attr = {};
-	// Initialize the lock attributes
-	pthread_mutexattr_init(&lock_attr);
-	// Initialize the lock
-	pthread_mutex_init(&lock, &lock_attr);
-	// Destroy the lock attributes since we're done with it
-	pthread_mutexattr_destroy(&lock_attr);
+	print_info("Scanning all your interfaces for DHCP servers\n");
+	print_info("Timeout: %u seconds\n", timeout);
+	if(expected > 0)
+		print_info("Expecting %u DHCP server%s to answer\n", expected, expected > 1 ? "s" : "");
 
 	struct ifaddrs *addrs, *tmp;
 	getifaddrs(&addrs);
 	tmp = addrs;
 
-	// Loop until there are no more interfaces available
-	// or we reached the maximum number of threads
-	int tid = 0;
-	while(tmp != NULL && tid < MAXTHREADS)
+	// Probe all interfaces at once, the replies are collected below
+	struct dhcp_iface ifaces[MAX_IFACES];
+	struct pollfd fds[MAX_IFACES];
+	unsigned int num = 0;
+	srand(time(NULL));
+	while(tmp != NULL && num < MAX_IFACES)
 	{
-		// Create a thread for interfaces of type AF_INET (IPv4)
+		// Probe interfaces of type AF_INET (IPv4)
 		if(tmp->ifa_addr && tmp->ifa_addr->sa_family == AF_INET)
 		{
 			// Skip interface scan if ...
@@ -759,29 +886,70 @@ int run_dhcp_discover(void)
 				continue;
 			}
 
-			// Create a probing thread for this interface
-			if(pthread_create(&scanthread[tid], &attr, dhcp_discover_iface, tmp ) != 0)
-			{
-				printf_locked("Unable to launch thread for interface %s, skipping...",
-				              tmp->ifa_name);
-				tmp = tmp->ifa_next;
-				continue;
-			}
-
-			// Increase thread ID
-			tid++;
+			memset(&ifaces[num], 0, sizeof(ifaces[num]));
+			strncpy(ifaces[num].name, tmp->ifa_name, sizeof(ifaces[num].name) - 1);
+			dhcp_discover_iface(&ifaces[num]);
+			fds[num].fd = ifaces[num].sock;
+			fds[num].events = POLLIN;
+			num++;
 		}
 
 		// Advance to the next interface
 		tmp = tmp->ifa_next;
 	}
 
-	// Wait for all threads to join back with us
-	for(tid--; tid > -1; tid--)
-		pthread_join(scanthread[tid], NULL);
-
 	// Free linked-list of interfaces on this client
 	freeifaddrs(addrs);
 
+	// Receive replies until the timeout is reached or all expected servers
+	// have answered. poll() ignores the negative descriptors of interfaces
+	// we could not probe
+	const uint64_t start_time = monotonic_msec();
+	uint64_t now = start_time;
+	while(now - start_time < 1000u*timeout && (expected == 0 || num_servers < expected))
+	{
+		const int ret = poll(fds, num, (int)(1000u*timeout - (now - start_time)));
+		if(ret < 0 && errno != EINTR)
+		{
+			print_info("Error: poll() failed: %s\n", strerror(errno));
+			break;
+		}
+
+		for(unsigned int i = 0; ret > 0 && i < num; i++)
+			if(fds[i].revents & POLLIN)
+				receive_dhcp_packets(ifaces, i, start_time);
+
+		now = monotonic_msec();
+	}
+
+	if(expected > 0 && num_servers >= expected)
+		print_info("\nAll expected DHCP servers answered after %.1f seconds\n", (now - start_time) / 1000.0);
+	else
+		print_info("\n");
+
+	for(unsigned int i = 0; i < num; i++)
+	{
+		// Close socket if we created one
+		if(ifaces[i].sock >= 0)
+		{
+			close(ifaces[i].sock);
+			print_info("DHCP packets received on interface %s: %u\n", ifaces[i].name, ifaces[i].offers);
+		}
+	}
+
+	if(json_output)
+		print_json_results(ifaces, num, timeout, expected, now - start_time);
+
+	for(unsigned int i = 0; i < num; i++)
+		if(ifaces[i].offer != NULL)
+			free(ifaces[i].offer);
+
+	// Fail if not all expected servers answered
+	if(expected > 0 && num_servers < expected)
+	{
+		print_info("Only %u of %u expected DHCP servers answered\n", num_servers, expected);
+		return EXIT_FAILURE;
+	}
+
 	return EXIT_SUCCESS;
 }
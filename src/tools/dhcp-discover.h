@@ -11,7 +11,11 @@
 #ifndef DHCP_DISCOVER_H
 #define DHCP_DISCOVER_H
 
-int run_dhcp_discover(void);
+// Default time we wait for incoming DHCPOFFERs
+// (seconds)
+#define DHCPOFFER_TIMEOUT 10
+
+int run_dhcp_discover(const bool json, const unsigned int expected, const unsigned int timeout);
 int get_hardware_address(const int sock, const char *iname, unsigned char *mac);
 
 #endif // DHCP_DISCOVER_H
@@ -10,29 +10,39 @@
 
 #include "tools/gravity-parseList.h"
 #include "args.h"
-#include <regex.h>
 #include "database/sqlite3.h"
+// gravity_set_compile()
+#include "database/gravity-set.h"
+#include <sys/mman.h>
+// open()
+#include <fcntl.h>
 
-// Define valid domain patterns
-// No need to include uppercase letters, as we convert to lowercase in gravity_ParseFileIntoDomains() already
-// Adapted from https://stackoverflow.com/a/30007882
-// - Added "(?:...)" to form non-capturing groups (slightly faster)
-#define TLD_PATTERN "[a-z0-9][a-z0-9-]{0,61}[a-z0-9]"
-#define SUBDOMAIN_PATTERN "([a-z0-9_-]{0,63}\\.)"
-
+// Valid domains are validated with a handwritten validator equivalent to the
+// following regular expressions (lines have to be matched entirely). There is
+// no need to include uppercase letters, as the lists are converted to
+// lowercase before they are parsed
+// - TLD:       [a-z0-9][a-z0-9-]{0,61}[a-z0-9]
+// - subdomain: ([a-z0-9_-]{0,63}\.)
+//
 // supported exact style: subdomain.domain.tld
 // SUBDOMAIN_PATTERN is mandatory for exact style, disallowing TLD blocking
-#define VALID_DOMAIN_REXEX SUBDOMAIN_PATTERN"+"TLD_PATTERN
-
+//   (SUBDOMAIN)+TLD
+//
 // supported ABP style: ||subdomain.domain.tlp^
 // SUBDOMAIN_PATTERN is optional for ABP style, allowing TLD blocking: ||tld^
 // See https://github.com/pi-hole/pi-hole/pull/5240
-#define ABP_DOMAIN_REXEX "\\|\\|"SUBDOMAIN_PATTERN"*"TLD_PATTERN"\\^"
+//   \|\|(SUBDOMAIN)*TLD\^
+#define MAX_LABEL_LEN 63
 
 // A list of items of common local hostnames not to report as unusable
 // Some lists (i.e StevenBlack's) contain these as they are supposed to be used as HOST files
 // but flagging them as unusable causes more confusion than it's worth - so we suppress them from the output
-#define FALSE_POSITIVES "^(localhost|localhost.localdomain|local|broadcasthost|localhost|ip6-localhost|ip6-loopback|lo0 localhost|ip6-localnet|ip6-mcastprefix|ip6-allnodes|ip6-allrouters|ip6-allhosts)$"
+// A dot matches any character (these used to be a regular expression)
+static const char *false_positives[] = {
+	"localhost", "localhost.localdomain", "local", "broadcasthost",
+	"ip6-localhost", "ip6-loopback", "lo0 localhost", "ip6-localnet",
+	"ip6-mcastprefix", "ip6-allnodes", "ip6-allrouters", "ip6-allhosts"
+};
 
 // Print progress for files larger than 10 MB
 // This is to avoid printing progress for small files
@@ -42,207 +52,647 @@
 // Number of invalid domains to print before skipping the rest
 #define MAX_INVALID_DOMAINS 5
 
-int gravity_parseList(const char *infile, const char *outfile, const char *adlistIDstr)
+// The memory-mapped list is split into chunks of about this size at line
+// boundaries. Chunks are validated, sorted and deduplicated by up to
+// PARSE_MAX_THREADS worker threads. The sorted runs of all chunks are merged
+// while inserting, so every domain is inserted once and in the order of the
+// gravity index
+#define PARSE_CHUNK_SIZE (4*1024*1024)
+#define PARSE_MAX_THREADS 8
+
+// Sorted runs are kept in memory up to this size, further runs are written to
+// a temporary file next to the database (external merge sort)
+#define SORT_MEMORY (64*1024*1024)
+
+// Number of rows of a run in the temporary file read at once while merging
+#define SORT_READ_ROWS 4096
+
+// Number of rows inserted by a single multi-row INSERT statement
+#define INSERT_BATCH 200
+
+// Character classes of the validator
+#define CHAR_LABEL (1 << 0) // [a-z0-9_-]
+#define CHAR_TLD   (1 << 1) // [a-z0-9-]
+#define CHAR_ALNUM (1 << 2) // [a-z0-9]
+static unsigned char chartab[256] = { 0 };
+
+// The list being parsed, rows are offsets into it
+static const char *list_map = NULL;
+
+struct parse_row {
+	size_t offset;
+	size_t len;
+};
+
+// A sorted run of domains. Runs in the temporary file are read in blocks of
+// SORT_READ_ROWS rows into rows[]
+struct sort_run {
+	struct parse_row *rows;
+	size_t nrows;
+	size_t pos;
+	off_t offset;
+	size_t remaining;
+};
+
+struct sort_state {
+	struct sort_run *runs;
+	unsigned int nruns;
+	size_t memory;
+	int fd;
+	off_t size;
+	// Merge heap of run indices ordered by their current row
+	unsigned int *heap;
+};
+
+struct parse_chunk {
+	const char *start;
+	size_t len;
+	pthread_t thread;
+	bool running;
+	// Valid domains of this chunk
+	struct parse_row *rows;
+	size_t nrows;
+	size_t rows_size;
+	bool oom;
+	unsigned int valid_domains;
+	unsigned int invalid_domains;
+	// First invalid domains of this chunk
+	unsigned int invalid_samples;
+	struct parse_row invalid_sample[MAX_INVALID_DOMAINS];
+};
+
+static void init_chartab(void)
 {
-	const char *info = cli_info();
-	const char *tick = cli_tick();
-	const char *cross = cli_cross();
-	const char *over = cli_over();
+	for(unsigned int c = 'a'; c <= 'z'; c++)
+		chartab[c] = CHAR_LABEL | CHAR_TLD | CHAR_ALNUM;
+	for(unsigned int c = '0'; c <= '9'; c++)
+		chartab[c] = CHAR_LABEL | CHAR_TLD | CHAR_ALNUM;
+	chartab['-'] = CHAR_LABEL | CHAR_TLD;
+	chartab['_'] = CHAR_LABEL;
+}
 
-	// Open input file
-	FILE *fpin = fopen(infile, "r");
-	if(fpin == NULL)
+// Validate (SUBDOMAIN)+TLD (or (SUBDOMAIN)*TLD if no subdomain is required)
+static bool valid_domain(const char *s, const size_t n, const bool need_subdomain)
+{
+	size_t label = 0;
+	bool subdomain = false;
+	for(size_t i = 0; i < n; i++)
 	{
-		printf("%s  %s Unable to open %s for reading\n", over, cross, infile);
-		return EXIT_FAILURE;
+		const unsigned char c = (unsigned char)s[i];
+		if(c == '.')
+		{
+			if(i - label > MAX_LABEL_LEN)
+				return false;
+			label = i + 1;
+			subdomain = true;
+		}
+		else if(!(chartab[c] & CHAR_LABEL))
+			return false;
 	}
 
-	// Open output file
-	sqlite3 *db = NULL;
-	sqlite3_stmt *stmt = NULL;
-	if(sqlite3_open_v2(outfile, &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK)
+	if(need_subdomain && !subdomain)
+		return false;
+
+	// The last label is the TLD
+	const size_t tld = n - label;
+	if(tld < 2 || tld > MAX_LABEL_LEN)
+		return false;
+	for(size_t i = label; i < n; i++)
+		if(!(chartab[(unsigned char)s[i]] & CHAR_TLD))
+			return false;
+
+	return (chartab[(unsigned char)s[label]] & CHAR_ALNUM) &&
+	       (chartab[(unsigned char)s[n-1]] & CHAR_ALNUM);
+}
+
+static bool is_false_positive(const char *s, const size_t n)
+{
+	for(unsigned int i = 0; i < sizeof(false_positives)/sizeof(false_positives[0]); i++)
 	{
-		printf("%s  %s Unable to open database file %s for writing\n", over, cross, outfile);
-		fclose(fpin);
-		return EXIT_FAILURE;
+		const char *fp = false_positives[i];
+		if(strlen(fp) != n)
+			continue;
+
+		size_t j = 0;
+		while(j < n && (fp[j] == '.' || fp[j] == s[j]))
+			j++;
+		if(j == n)
+			return true;
 	}
-	// Get size of input file
-	fseek(fpin, 0L, SEEK_END);
-	const size_t fsize = ftell(fpin);
-	rewind(fpin);
+	return false;
+}
+
+// Domains are sorted by their bytes like SQLite's BINARY collation does
+static int cmp_rows(const void *a, const void *b)
+{
+	const struct parse_row *ra = a, *rb = b;
+	const size_t len = ra->len < rb->len ? ra->len : rb->len;
+	const int cmp = memcmp(list_map + ra->offset, list_map + rb->offset, len);
+	if(cmp != 0)
+		return cmp;
+	return (ra->len > rb->len) - (ra->len < rb->len);
+}
 
-	// Compile regular expression to validate domains
-	regex_t exact_regex, abp_regex, false_positives_regex;
-	if(regcomp(&exact_regex, VALID_DOMAIN_REXEX, REG_EXTENDED) != 0)
+static void add_row(struct parse_chunk *chunk, const size_t offset, const size_t len)
+{
+	if(chunk->nrows == chunk->rows_size)
 	{
-		printf("%s  %s Unable to compile regular expression to validate exact domains\n",
-		       over, cross);
-		fclose(fpin);
-		sqlite3_close(db);
-		return EXIT_FAILURE;
+		const size_t size = chunk->rows_size > 0 ? 2*chunk->rows_size : 4096;
+		struct parse_row *rows = realloc(chunk->rows, size*sizeof(*rows));
+		if(rows == NULL)
+		{
+			chunk->oom = true;
+			return;
+		}
+		chunk->rows = rows;
+		chunk->rows_size = size;
 	}
-	if(regcomp(&abp_regex, ABP_DOMAIN_REXEX, REG_EXTENDED) != 0)
+
+	chunk->rows[chunk->nrows].offset = offset;
+	chunk->rows[chunk->nrows].len = len;
+	chunk->nrows++;
+}
+
+// Validate all lines of a chunk
+static void *parse_chunk(void *arg)
+{
+	struct parse_chunk *chunk = arg;
+	const char *end = chunk->start + chunk->len;
+	const char *line = chunk->start;
+	while(line < end)
 	{
-		printf("%s  %s Unable to compile regular expression to validate ABP-style domains\n",
-		       over, cross);
-		fclose(fpin);
-		sqlite3_close(db);
-		return EXIT_FAILURE;
+		const char *nl = memchr(line, '\n', end - line);
+		const char *next = nl != NULL ? nl + 1 : end;
+		size_t len = (nl != NULL ? nl : end) - line;
+
+		// Remove trailing dot (convert FQDN to domain)
+		if(len > 0 && line[len-1] == '.')
+			len--;
+
+		const size_t offset = line - list_map;
+		if(line[0] != '|' && valid_domain(line, len, true))
+		{
+			// Exact match found
+			add_row(chunk, offset, len);
+			chunk->valid_domains++;
+		}
+		else if(len > 3 && line[0] == '|' && line[1] == '|' && line[len-1] == '^' &&
+		        valid_domain(line + 2, len - 3, false))
+		{
+			// ABP-style match (see comments above)
+			add_row(chunk, offset, len);
+			chunk->valid_domains++;
+		}
+		else if(!is_false_positive(line, len))
+		{
+			// No match - This is an invalid domain
+			// False positives don't count as invalid domains
+			if(chunk->invalid_samples < MAX_INVALID_DOMAINS)
+			{
+				// Check if we have this domain already
+				bool found = false;
+				for(unsigned int i = 0; i < chunk->invalid_samples; i++)
+				{
+					const struct parse_row *sample = &chunk->invalid_sample[i];
+					if(sample->len == len && memcmp(list_map + sample->offset, line, len) == 0)
+					{
+						found = true;
+						break;
+					}
+				}
+
+				// If not found, add it to the list
+				if(!found)
+				{
+					chunk->invalid_sample[chunk->invalid_samples].offset = offset;
+					chunk->invalid_sample[chunk->invalid_samples].len = len;
+					chunk->invalid_samples++;
+				}
+			}
+			chunk->invalid_domains++;
+		}
+
+		line = next;
 	}
-	if(regcomp(&false_positives_regex, FALSE_POSITIVES, REG_EXTENDED | REG_NOSUB) != 0)
+
+	// Sort the domains of this chunk and remove duplicates
+	qsort(chunk->rows, chunk->nrows, sizeof(*chunk->rows), cmp_rows);
+	size_t nrows = 0;
+	for(size_t i = 0; i < chunk->nrows; i++)
+		if(nrows == 0 || cmp_rows(&chunk->rows[nrows-1], &chunk->rows[i]) != 0)
+			chunk->rows[nrows++] = chunk->rows[i];
+	chunk->nrows = nrows;
+
+	return NULL;
+}
+
+// Assign the next chunk of the file to a worker and start it
+static void start_chunk(struct parse_chunk *chunk, const char *map, const size_t fsize, size_t *next)
+{
+	chunk->start = map + *next;
+	chunk->len = fsize - *next;
+	if(chunk->len > PARSE_CHUNK_SIZE)
 	{
-		printf("%s  %s Unable to compile regular expression to identify false positives\n",
-		       over, cross);
-		fclose(fpin);
-		sqlite3_close(db);
-		return EXIT_FAILURE;
+		// Extend the chunk to the end of the line
+		const char *nl = memchr(chunk->start + PARSE_CHUNK_SIZE, '\n', chunk->len - PARSE_CHUNK_SIZE);
+		if(nl != NULL)
+			chunk->len = nl + 1 - chunk->start;
 	}
+	*next += chunk->len;
 
-	// Begin transaction
-	if(sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL) != SQLITE_OK)
+	chunk->nrows = 0;
+	chunk->oom = false;
+	chunk->valid_domains = chunk->invalid_domains = 0;
+	chunk->invalid_samples = 0;
+
+	// Parse the chunk ourselves if no thread can be started
+	if(pthread_create(&chunk->thread, NULL, parse_chunk, chunk) != 0)
 	{
-		printf("%s  %s Unable to begin transaction to insert domains into database file %s\n",
-		       over, cross, outfile);
-		fclose(fpin);
-		sqlite3_close(db);
-		return EXIT_FAILURE;
+		parse_chunk(chunk);
+		chunk->running = false;
 	}
+	else
+		chunk->running = true;
+}
 
-	// Prepare SQL statement
-	const char *sql = "INSERT INTO gravity (domain, adlist_id) VALUES (?, ?);";
-	if(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+// Wait for all workers, e.g., before bailing out
+static void stop_chunks(struct parse_chunk *chunks, const unsigned int nchunks)
+{
+	for(unsigned int i = 0; i < nchunks; i++)
 	{
-		printf("%s  %s Unable to prepare SQL statement to insert domains into database file %s\n",
-		       over, cross, outfile);
-		fclose(fpin);
-		sqlite3_close(db);
-		return EXIT_FAILURE;
+		if(chunks[i].running)
+			pthread_join(chunks[i].thread, NULL);
+		chunks[i].running = false;
+		free(chunks[i].rows);
+		chunks[i].rows = NULL;
 	}
+}
 
-	// Bind adlistID
-	const int adlistID = atoi(adlistIDstr);
-	if(sqlite3_bind_int(stmt, 2, adlistID) != SQLITE_OK)
+// Read the next block of a run from the temporary file
+static bool refill_run(struct sort_run *run, const int fd)
+{
+	const size_t rows = run->remaining < SORT_READ_ROWS ? run->remaining : SORT_READ_ROWS;
+	const size_t bytes = rows*sizeof(*run->rows);
+	if(pread(fd, run->rows, bytes, run->offset) != (ssize_t)bytes)
+		return false;
+
+	run->offset += bytes;
+	run->remaining -= rows;
+	run->nrows = rows;
+	run->pos = 0;
+	return true;
+}
+
+// Keep the sorted run of a chunk. Runs exceeding SORT_MEMORY are written to the
+// temporary file
+static bool add_run(struct sort_state *sort, struct parse_chunk *chunk, const char *dbfile)
+{
+	struct sort_run *runs = realloc(sort->runs, (sort->nruns + 1)*sizeof(*runs));
+	if(runs == NULL)
+		return false;
+	sort->runs = runs;
+	struct sort_run *run = &sort->runs[sort->nruns];
+	memset(run, 0, sizeof(*run));
+
+	const size_t bytes = chunk->nrows*sizeof(*chunk->rows);
+	if(sort->memory + bytes <= SORT_MEMORY)
 	{
-		printf("%s  %s Unable to bind adlistID to SQL statement to insert domains into database file %s\n",
-		       over, cross, outfile);
-		fclose(fpin);
-		sqlite3_close(db);
-		return EXIT_FAILURE;
+		// Take over the rows of the chunk
+		run->rows = realloc(chunk->rows, bytes);
+		if(run->rows == NULL)
+			return false;
+		run->nrows = chunk->nrows;
+		chunk->rows = NULL;
+		chunk->rows_size = 0;
+		sort->memory += bytes;
+		sort->nruns++;
+		return true;
 	}
 
-	// Parse list file line by line
-	char *line = NULL;
-	size_t lineno = 0;
-	size_t len = 0;
-	ssize_t read = 0;
-	size_t total_read = 0;
-	int last_progress = 0;
-	char *invalid_domains_list[MAX_INVALID_DOMAINS] = { NULL };
-	unsigned int invalid_domains_list_len = 0;
-	unsigned int exact_domains = 0, abp_domains = 0, invalid_domains = 0;
-	while((read = getline(&line, &len, fpin)) != -1)
+	if(sort->fd < 0)
+	{
+		// The temporary file is removed as soon as it is closed
+		char *tmpname = calloc(strlen(dbfile) + 16, sizeof(char));
+		if(tmpname == NULL)
+			return false;
+		sprintf(tmpname, "%s.sort-XXXXXX", dbfile);
+		sort->fd = mkstemp(tmpname);
+		if(sort->fd > -1)
+			unlink(tmpname);
+		free(tmpname);
+		if(sort->fd < 0)
+			return false;
+	}
+
+	for(size_t done = 0; done < bytes; )
 	{
-		// Update total read bytes
-		total_read += read;
-		lineno++;
+		const ssize_t ret = pwrite(sort->fd, (const char*)chunk->rows + done, bytes - done, sort->size + done);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			return false;
+		done += ret;
+	}
 
-		// Remove trailing newline
-		if(line[read-1] == '\n')
-			line[--read] = '\0';
+	run->rows = calloc(SORT_READ_ROWS, sizeof(*run->rows));
+	if(run->rows == NULL)
+		return false;
+	run->offset = sort->size;
+	run->remaining = chunk->nrows;
+	sort->size += bytes;
+	sort->nruns++;
 
-		// Remove trailing dot (convert FQDN to domain)
-		if(line[read-1] == '.')
-			line[--read] = '\0';
+	return refill_run(run, sort->fd);
+}
+
+static void free_runs(struct sort_state *sort)
+{
+	for(unsigned int i = 0; i < sort->nruns; i++)
+		free(sort->runs[i].rows);
+	free(sort->runs);
+	free(sort->heap);
+	if(sort->fd > -1)
+		close(sort->fd);
+}
+
+static bool heap_less(const struct sort_state *sort, const unsigned int a, const unsigned int b)
+{
+	const struct sort_run *ra = &sort->runs[sort->heap[a]];
+	const struct sort_run *rb = &sort->runs[sort->heap[b]];
+	return cmp_rows(&ra->rows[ra->pos], &rb->rows[rb->pos]) < 0;
+}
 
+static void heap_down(struct sort_state *sort, unsigned int n, unsigned int i)
+{
+	while(2*i + 1 < n)
+	{
+		unsigned int child = 2*i + 1;
+		if(child + 1 < n && heap_less(sort, child + 1, child))
+			child++;
+		if(!heap_less(sort, child, i))
+			break;
+		const unsigned int tmp = sort->heap[i];
+		sort->heap[i] = sort->heap[child];
+		sort->heap[child] = tmp;
+		i = child;
+	}
+}
+
+// Domains of a list are passed in sorted order to a sink inserting them into
+// the database. If the database still holds the domains of the previous run
+// of this list (delta mode), the sink walks the previous snapshot alongside
+// and only inserts new and deletes removed domains
+struct domain_sink {
+	sqlite3_stmt *batch;
+	sqlite3_stmt *single;
+	// Removed domains are collected and deleted at once in the end, this
+	// does not depend on an index on the domains
+	sqlite3_stmt *remove;
+	sqlite3_stmt *purge;
+	const char *domain[INSERT_BATCH];
+	int len[INSERT_BATCH];
+	unsigned int n;
+	// Unprocessed part of the previous snapshot (delta mode only)
+	bool delta;
+	const char *old;
+	const char *old_end;
+	// New snapshot being written, may be NULL
+	FILE *snapshot;
+	unsigned int inserted;
+	unsigned int deleted;
+};
 
-		regmatch_t match = { 0 };
-		// Validate line
-		if(line[0] != '|' &&                                 // <- Not an ABP-style match
-		   regexec(&exact_regex, line, 1, &match, 0) == 0 && // <- Regex match
-		   match.rm_so == 0 && match.rm_eo == read)          // <- Match covers entire line
+// Insert the queued domains using the multi-row INSERT statement if the
+// batch is full
+static bool sink_flush(struct domain_sink *sink)
+{
+	sqlite3_stmt *stmt = sink->n == INSERT_BATCH ? sink->batch : sink->single;
+	for(unsigned int i = 0; i < sink->n; i++)
+	{
+		if(sqlite3_bind_text(stmt, stmt == sink->batch ? i + 1 : 1, sink->domain[i], sink->len[i], SQLITE_STATIC) != SQLITE_OK)
+			return false;
+		if(stmt == sink->single || i == sink->n - 1)
 		{
-			// Exact match found
-			// Append domain to database using prepared statement
-			if(sqlite3_bind_text(stmt, 1, line, -1, SQLITE_STATIC) != SQLITE_OK)
-			{
-				printf("%s  %s Unable to bind domain to SQL statement to insert domains into database file %s\n",
-				       over, cross, outfile);
-				fclose(fpin);
-				sqlite3_close(db);
-				return EXIT_FAILURE;
-			}
 			if(sqlite3_step(stmt) != SQLITE_DONE)
-			{
-				printf("%s  %s Unable to insert domain into database file %s\n", over, cross, outfile);
-				fclose(fpin);
-				sqlite3_close(db);
-				return EXIT_FAILURE;
-			}
+				return false;
 			sqlite3_reset(stmt);
-			// Increment counter
-			exact_domains++;
 		}
-		else if(line[0] == '|' &&                               // <- ABP-style match
-		        regexec(&abp_regex, line, 1, &match, 0) == 0 && // <- Regex match
-		        match.rm_so == 0 && match.rm_eo == read)        // <- Match covers entire line
+	}
+
+	sink->inserted += sink->n;
+	sink->n = 0;
+	return true;
+}
+
+static bool sink_delete(struct domain_sink *sink, const char *domain, const size_t len)
+{
+	if(sqlite3_bind_text(sink->remove, 1, domain, (int)len, SQLITE_STATIC) != SQLITE_OK ||
+	   sqlite3_step(sink->remove) != SQLITE_DONE)
+		return false;
+	sqlite3_reset(sink->remove);
+	sink->deleted++;
+	return true;
+}
+
+static int cmp_domains(const char *a, const size_t alen, const char *b, const size_t blen)
+{
+	const int cmp = memcmp(a, b, alen < blen ? alen : blen);
+	if(cmp != 0)
+		return cmp;
+	return (alen > blen) - (alen < blen);
+}
+
+// Pass the next domain (in sorted order) to the sink
+static bool sink_domain(struct domain_sink *sink, const char *domain, const size_t len)
+{
+	if(sink->snapshot != NULL &&
+	   (fwrite(domain, 1, len, sink->snapshot) != len || fputc('\n', sink->snapshot) == EOF))
+	{
+		// The snapshot is optional
+		fclose(sink->snapshot);
+		sink->snapshot = NULL;
+	}
+
+	// Delete domains of the previous run sorting before this domain and
+	// skip this domain if it is already in the database
+	while(sink->delta && sink->old < sink->old_end)
+	{
+		const char *nl = memchr(sink->old, '\n', sink->old_end - sink->old);
+		const char *next = nl != NULL ? nl + 1 : sink->old_end;
+		const size_t oldlen = (nl != NULL ? nl : sink->old_end) - sink->old;
+		const int cmp = cmp_domains(sink->old, oldlen, domain, len);
+		if(cmp > 0)
+			break;
+
+		if(cmp < 0 && !sink_delete(sink, sink->old, oldlen))
+			return false;
+		sink->old = next;
+		if(cmp == 0)
+			return true;
+	}
+
+	sink->domain[sink->n] = domain;
+	sink->len[sink->n] = (int)len;
+	if(++sink->n == INSERT_BATCH)
+		return sink_flush(sink);
+
+	return true;
+}
+
+// Delete the remaining domains of the previous run and insert queued domains
+static bool sink_finish(struct domain_sink *sink)
+{
+	while(sink->delta && sink->old < sink->old_end)
+	{
+		const char *nl = memchr(sink->old, '\n', sink->old_end - sink->old);
+		const char *next = nl != NULL ? nl + 1 : sink->old_end;
+		if(!sink_delete(sink, sink->old, (nl != NULL ? nl : sink->old_end) - sink->old))
+			return false;
+		sink->old = next;
+	}
+
+	if(sink->deleted > 0 && sqlite3_step(sink->purge) != SQLITE_DONE)
+		return false;
+
+	return sink_flush(sink);
+}
+
+struct parse_result {
+	unsigned int exact_domains;
+	unsigned int abp_domains;
+	unsigned int invalid_domains;
+	unsigned int valid_domains;
+	unsigned int invalid_samples;
+	char *invalid_sample[MAX_INVALID_DOMAINS];
+};
+
+// Merge all runs and pass every domain once to the sink
+static bool merge_runs(struct sort_state *sort, struct domain_sink *sink, struct parse_result *result)
+{
+	if(sort->nruns == 0)
+		return true;
+
+	sort->heap = calloc(sort->nruns, sizeof(*sort->heap));
+	if(sort->heap == NULL)
+		return false;
+	unsigned int n = 0;
+	for(unsigned int i = 0; i < sort->nruns; i++)
+		if(sort->runs[i].nrows > 0)
+			sort->heap[n++] = i;
+	for(unsigned int i = n/2; i-- > 0; )
+		heap_down(sort, n, i);
+
+	bool have_last = false;
+	struct parse_row last = { 0 };
+	while(n > 0)
+	{
+		struct sort_run *run = &sort->runs[sort->heap[0]];
+		const struct parse_row row = run->rows[run->pos];
+
+		// Skip domains found in more than one chunk
+		if(!have_last || cmp_rows(&last, &row) != 0)
 		{
-			// ABP-style match (see comments above)
+			if(list_map[row.offset] == '|')
+				result->abp_domains++;
+			else
+				result->exact_domains++;
 
-			// Append pattern to database using prepared statement
-			if(sqlite3_bind_text(stmt, 1, line, -1, SQLITE_STATIC) != SQLITE_OK)
-			{
-				printf("%s  %s Unable to bind domain to SQL statement to insert domains into database file %s\n",
-				       over, cross, outfile);
-				fclose(fpin);
-				sqlite3_close(db);
-				return EXIT_FAILURE;
-			}
-			if(sqlite3_step(stmt) != SQLITE_DONE)
+			if(!sink_domain(sink, list_map + row.offset, row.len))
+				return false;
+			last = row;
+			have_last = true;
+		}
+
+		// Advance this run and restore the heap order
+		if(++run->pos == run->nrows)
+		{
+			if(run->remaining > 0)
 			{
-				printf("%s  %s Unable to insert domain into database file %s\n", over, cross, outfile);
-				fclose(fpin);
-				sqlite3_close(db);
-				return EXIT_FAILURE;
+				if(!refill_run(run, sort->fd))
+					return false;
 			}
-			sqlite3_reset(stmt);
-			abp_domains++;
+			else
+				sort->heap[0] = sort->heap[--n];
 		}
-		else
+		heap_down(sort, n, 0);
+	}
+
+	return true;
+}
+
+// Parse the list in chunks validated and sorted by worker threads. The sorted
+// runs are merged by merge_runs()
+static bool parse_list(const size_t fsize, const char *infile, const char *outfile,
+                       struct sort_state *sort, struct parse_result *result)
+{
+	const char *info = cli_info();
+	const char *cross = cli_cross();
+	const char *over = cli_over();
+
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads > PARSE_MAX_THREADS)
+		threads = PARSE_MAX_THREADS;
+	if(threads < 1)
+		threads = 1;
+	init_chartab();
+
+	// Chunks are collected in the order they have been assigned to the
+	// workers
+	struct parse_chunk chunks[PARSE_MAX_THREADS] = {{ 0 }};
+	const unsigned int nchunks = (unsigned int)threads;
+	size_t next = 0;
+	for(unsigned int i = 0; i < nchunks && next < fsize; i++)
+		start_chunk(&chunks[i], list_map, fsize, &next);
+
+	int last_progress = 0;
+	for(unsigned int cur = 0; chunks[cur].start != NULL; cur = (cur + 1) % nchunks)
+	{
+		struct parse_chunk *chunk = &chunks[cur];
+		if(chunk->running)
+			pthread_join(chunk->thread, NULL);
+		chunk->running = false;
+
+		// Keep the sorted domains of this chunk until all chunks are done
+		if(chunk->oom || (chunk->nrows > 0 && !add_run(sort, chunk, outfile)))
 		{
-			// No match - This is an invalid domain or a false positive
+			printf("%s  %s Unable to allocate memory for domains of %s\n", over, cross, infile);
+			stop_chunks(chunks, nchunks);
+			return false;
+		}
 
-			// Ignore false positives - they don't count as invalid domains
-			if(regexec(&false_positives_regex, line, 0, NULL, 0) != 0)
-			{
-				// Add the domain to invalid_domains_list only
-				// if the list contains < MAX_INVALID_DOMAINS
-				if(invalid_domains_list_len < MAX_INVALID_DOMAINS)
-				{
-					// Check if we have this domain already
-					bool found = false;
-					for(unsigned int i = 0; i < invalid_domains_list_len; i++)
-					{
-						if(strcmp(invalid_domains_list[i], line) == 0)
-						{
-							found = true;
-							break;
-						}
-					}
+		// Increment counters
+		result->valid_domains += chunk->valid_domains;
+		result->invalid_domains += chunk->invalid_domains;
 
-					// If not found, add it to the list
-					if(!found)
-						invalid_domains_list[invalid_domains_list_len++] = strdup(line);
+		// Add the invalid domains of this chunk to the sample only if
+		// it contains < MAX_INVALID_DOMAINS
+		for(unsigned int i = 0; i < chunk->invalid_samples && result->invalid_samples < MAX_INVALID_DOMAINS; i++)
+		{
+			const struct parse_row *sample = &chunk->invalid_sample[i];
+			const char *domain = list_map + sample->offset;
 
+			// Check if we have this domain already
+			bool found = false;
+			for(unsigned int j = 0; j < result->invalid_samples; j++)
+			{
+				if(strlen(result->invalid_sample[j]) == sample->len &&
+				   memcmp(result->invalid_sample[j], domain, sample->len) == 0)
+				{
+					found = true;
+					break;
 				}
-				invalid_domains++;
 			}
+
+			// If not found, add it to the list
+			if(!found)
+				result->invalid_sample[result->invalid_samples++] = strndup(domain, sample->len);
 		}
 
-		// Print progress if the file is large enough every 100 lines
-		if(fsize > PRINT_PROGRESS_THRESHOLD && lineno % 100 == 1)
+		// Print progress if the file is large enough
+		if(fsize > PRINT_PROGRESS_THRESHOLD)
 		{
 			// Calculate progress
-			const int progress = (int)(100.0*total_read/fsize);
+			const int progress = (int)(100.0*(chunk->start + chunk->len - list_map)/fsize);
 			// Print progress if it has changed
 			if(progress > last_progress)
 			{
@@ -251,84 +701,414 @@ int gravity_parseList(const char *infile, const char *outfile, const char *adlis
 				last_progress = progress;
 			}
 		}
+
+		// Hand the next chunk of the file to this worker
+		if(next < fsize)
+			start_chunk(chunk, list_map, fsize, &next);
+		else
+			chunk->start = NULL;
+	}
+	stop_chunks(chunks, nchunks);
+
+	return true;
+}
+
+// Snapshot of the sorted domains of a list stored next to the list after each
+// run. The header line is followed by the sample of invalid entries (one per
+// line) and the domains of the list (one per line)
+#define SNAPSHOT_SUFFIX ".sorted"
+#define SNAPSHOT_VERSION 1
+
+struct list_snapshot {
+	const char *map;
+	size_t size;
+	size_t list_size;
+	uint64_t checksum;
+	struct parse_result counts;
+	const char *sample[MAX_INVALID_DOMAINS];
+	size_t sample_len[MAX_INVALID_DOMAINS];
+	const char *domains;
+};
+
+// Checksum of the downloaded list
+static uint64_t __attribute__((pure)) list_checksum(const char *data, const size_t len)
+{
+	// FNV-1a on 64-bit words
+	uint64_t hash = 0xcbf29ce484222325ULL ^ len;
+	size_t i = 0;
+	for(; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3ULL;
+	}
+	for(; i < len; i++)
+		hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+
+	return hash;
+}
+
+static void free_snapshot(struct list_snapshot *snap)
+{
+	if(snap->map != NULL)
+		munmap((void*)snap->map, snap->size);
+	snap->map = NULL;
+}
+
+// Load the snapshot of the previous run of this list
+static bool load_snapshot(const char *file, const int adlistID, struct list_snapshot *snap)
+{
+	const int fd = open(file, O_RDONLY);
+	if(fd < 0)
+		return false;
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	void *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(ptr == MAP_FAILED)
+		return false;
+	snap->map = ptr;
+	snap->size = st.st_size;
+
+	// Parse header line
+	const char *end = snap->map + snap->size;
+	const char *nl = memchr(snap->map, '\n', snap->size);
+	char header[256];
+	if(nl == NULL || (size_t)(nl - snap->map) >= sizeof(header))
+	{
+		free_snapshot(snap);
+		return false;
+	}
+	memcpy(header, snap->map, nl - snap->map);
+	header[nl - snap->map] = '\0';
+
+	int version = 0, adlist = 0;
+	unsigned long long list_size = 0, checksum = 0;
+	struct parse_result *c = &snap->counts;
+	if(sscanf(header, "PHGS %i %i %llu %llx %u %u %u %u %u", &version, &adlist,
+	          &list_size, &checksum, &c->exact_domains, &c->abp_domains,
+	          &c->invalid_domains, &c->valid_domains, &c->invalid_samples) != 9 ||
+	   version != SNAPSHOT_VERSION || adlist != adlistID ||
+	   c->invalid_samples > MAX_INVALID_DOMAINS)
+	{
+		free_snapshot(snap);
+		return false;
+	}
+	snap->list_size = list_size;
+	snap->checksum = checksum;
+
+	// Sample of invalid entries
+	const char *line = nl + 1;
+	for(unsigned int i = 0; i < c->invalid_samples; i++)
+	{
+		nl = memchr(line, '\n', end - line);
+		if(nl == NULL)
+		{
+			free_snapshot(snap);
+			return false;
+		}
+		snap->sample[i] = line;
+		snap->sample_len[i] = nl - line;
+		line = nl + 1;
+	}
+	snap->domains = line;
+
+	return true;
+}
+
+// Create a new snapshot, its domains are written by the sink. The counts are
+// not known yet, space is reserved for them in the header
+static FILE *create_snapshot(const char *file, const int adlistID, const size_t list_size,
+                             const uint64_t checksum, const struct parse_result *result)
+{
+	FILE *fp = fopen(file, "w");
+	if(fp == NULL)
+		return NULL;
+
+	fprintf(fp, "PHGS %i %i %llu %016llx %-60s\n", SNAPSHOT_VERSION, adlistID,
+	        (unsigned long long)list_size, (unsigned long long)checksum, "");
+	for(unsigned int i = 0; i < result->invalid_samples; i++)
+		fprintf(fp, "%s\n", result->invalid_sample[i]);
+
+	if(ferror(fp))
+	{
+		fclose(fp);
+		unlink(file);
+		return NULL;
+	}
+
+	return fp;
+}
+
+// Write the counts into the header of the new snapshot and close it
+static bool finish_snapshot(FILE *fp, const int adlistID, const size_t list_size,
+                            const uint64_t checksum, const struct parse_result *result)
+{
+	char counts[61];
+	snprintf(counts, sizeof(counts), "%u %u %u %u %u", result->exact_domains, result->abp_domains,
+	         result->invalid_domains, result->valid_domains, result->invalid_samples);
+	const bool okay = fflush(fp) == 0 && fseek(fp, 0, SEEK_SET) == 0 &&
+	                  fprintf(fp, "PHGS %i %i %llu %016llx %-60s\n", SNAPSHOT_VERSION, adlistID,
+	                          (unsigned long long)list_size, (unsigned long long)checksum, counts) > 0;
+	return fclose(fp) == 0 && okay;
+}
+
+int gravity_parseList(const char *infile, const char *outfile, const char *adlistIDstr)
+{
+	const char *info = cli_info();
+	const char *tick = cli_tick();
+	const char *cross = cli_cross();
+	const char *over = cli_over();
+
+	// Open input file
+	const int fd = open(infile, O_RDONLY);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0)
+	{
+		printf("%s  %s Unable to open %s for reading\n", over, cross, infile);
+		if(fd > -1)
+			close(fd);
+		return EXIT_FAILURE;
+	}
+
+	// Map the entire file
+	const size_t fsize = st.st_size;
+	const char *map = NULL;
+	if(fsize > 0)
+	{
+		void *ptr = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(ptr == MAP_FAILED)
+		{
+			printf("%s  %s Unable to map %s into memory: %s\n", over, cross, infile, strerror(errno));
+			close(fd);
+			return EXIT_FAILURE;
+		}
+		map = ptr;
 	}
+	close(fd);
+	list_map = map;
+
+	int ret = EXIT_FAILURE;
+	sqlite3 *db = NULL;
+	sqlite3_stmt *stmt = NULL, *batch = NULL, *remove = NULL, *purge = NULL;
+	struct sort_state sort = { .runs = NULL, .fd = -1 };
+	struct domain_sink sink = { .snapshot = NULL };
+	struct parse_result result = { 0 };
+	const int adlistID = atoi(adlistIDstr);
 
-	// Finalize SQL statement
-	if(sqlite3_finalize(stmt) != SQLITE_OK)
+	// Compare the list with the snapshot of the previous run
+	const uint64_t checksum = list_checksum(map, fsize);
+	struct list_snapshot old = { .map = NULL };
+	char *snapfile = calloc(strlen(infile) + sizeof(SNAPSHOT_SUFFIX) + 4, sizeof(char));
+	char *sql = calloc(INSERT_BATCH, 20);
+	if(snapfile == NULL || sql == NULL)
+	{
+		printf("%s  %s Unable to allocate memory\n", over, cross);
+		goto end;
+	}
+	sprintf(snapfile, "%s"SNAPSHOT_SUFFIX, infile);
+	const bool have_old = load_snapshot(snapfile, adlistID, &old);
+	const bool unchanged = have_old && old.list_size == fsize && old.checksum == checksum;
+
+	// Open output file
+	if(sqlite3_open_v2(outfile, &db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK)
+	{
+		printf("%s  %s Unable to open database file %s for writing\n", over, cross, outfile);
+		goto end;
+	}
+
+	// Begin transaction
+	if(sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL) != SQLITE_OK)
+	{
+		printf("%s  %s Unable to begin transaction to insert domains into database file %s\n",
+		       over, cross, outfile);
+		goto end;
+	}
+
+	// Prepare SQL statements inserting a single domain and INSERT_BATCH
+	// domains at once. The adlist ID is the same for all of them
+	size_t pos = sprintf(sql, "INSERT INTO gravity (domain, adlist_id) VALUES (?,%d)", adlistID);
+	if(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+	{
+		printf("%s  %s Unable to prepare SQL statement to insert domains into database file %s\n",
+		       over, cross, outfile);
+		goto end;
+	}
+	for(unsigned int i = 1; i < INSERT_BATCH; i++)
+		pos += sprintf(sql + pos, ",(?,%d)", adlistID);
+	if(sqlite3_prepare_v2(db, sql, -1, &batch, NULL) != SQLITE_OK)
+	{
+		printf("%s  %s Unable to prepare SQL statement to insert domains into database file %s\n",
+		       over, cross, outfile);
+		goto end;
+	}
+	sink.batch = batch;
+	sink.single = stmt;
+
+	// gravity.sh builds a new database, so there are usually no domains of
+	// this list in it. If there are as many as in the snapshot, they are
+	// those of the previous run and only the changes are applied
+	sqlite3_int64 db_rows = -1;
+	sprintf(sql, "SELECT COUNT(*) FROM gravity WHERE adlist_id = %d;", adlistID);
+	sqlite3_stmt *count = NULL;
+	if(sqlite3_prepare_v2(db, sql, -1, &count, NULL) == SQLITE_OK &&
+	   sqlite3_step(count) == SQLITE_ROW)
+		db_rows = sqlite3_column_int64(count, 0);
+	sqlite3_finalize(count);
+	if(db_rows < 0)
+	{
+		printf("%s  %s Unable to count domains of this list in database file %s\n",
+		       over, cross, outfile);
+		goto end;
+	}
+
+	sink.delta = have_old && db_rows == old.counts.exact_domains + old.counts.abp_domains;
+	if(sink.delta)
+	{
+		sink.old = old.domains;
+		sink.old_end = old.map + old.size;
+
+		// Prepare SQL statements collecting and deleting removed domains
+		sprintf(sql, "DELETE FROM gravity WHERE adlist_id = %d AND domain IN (SELECT domain FROM temp.gravity_removed);", adlistID);
+		if(sqlite3_exec(db, "CREATE TEMP TABLE gravity_removed (domain TEXT);", NULL, NULL, NULL) != SQLITE_OK ||
+		   sqlite3_prepare_v2(db, "INSERT INTO temp.gravity_removed (domain) VALUES (?);", -1, &remove, NULL) != SQLITE_OK ||
+		   sqlite3_prepare_v2(db, sql, -1, &purge, NULL) != SQLITE_OK)
+		{
+			printf("%s  %s Unable to prepare SQL statement to delete domains from database file %s\n",
+			       over, cross, outfile);
+			goto end;
+		}
+		sink.remove = remove;
+		sink.purge = purge;
+	}
+	else if(db_rows > 0)
+	{
+		sprintf(sql, "DELETE FROM gravity WHERE adlist_id = %d;", adlistID);
+		if(sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK)
+		{
+			printf("%s  %s Unable to delete domains of this list from database file %s\n",
+			       over, cross, outfile);
+			goto end;
+		}
+	}
+
+	if(unchanged)
+	{
+		// The list has not changed since the previous run, the snapshot
+		// holds its sorted and validated domains
+		result.exact_domains = old.counts.exact_domains;
+		result.abp_domains = old.counts.abp_domains;
+		result.invalid_domains = old.counts.invalid_domains;
+		result.valid_domains = old.counts.valid_domains;
+		for(unsigned int i = 0; i < old.counts.invalid_samples; i++)
+			result.invalid_sample[result.invalid_samples++] = strndup(old.sample[i], old.sample_len[i]);
+
+		// Nothing to be done if the database holds them already
+		for(const char *line = old.domains; !sink.delta && line < old.map + old.size; )
+		{
+			const char *nl = memchr(line, '\n', old.map + old.size - line);
+			const char *next = nl != NULL ? nl + 1 : old.map + old.size;
+			if(!sink_domain(&sink, line, (nl != NULL ? nl : old.map + old.size) - line))
+			{
+				printf("%s  %s Unable to insert domain into database file %s\n", over, cross, outfile);
+				goto end;
+			}
+			line = next;
+		}
+		if(!sink.delta && !sink_flush(&sink))
+		{
+			printf("%s  %s Unable to insert domain into database file %s\n", over, cross, outfile);
+			goto end;
+		}
+	}
+	else
+	{
+		if(!parse_list(fsize, infile, outfile, &sort, &result))
+			goto end;
+
+		// Write a new snapshot while inserting (optional)
+		sprintf(sql, "%s.tmp", snapfile);
+		sink.snapshot = create_snapshot(sql, adlistID, fsize, checksum, &result);
+
+		// Append domains to database using prepared statements
+		if(!merge_runs(&sort, &sink, &result) || !sink_finish(&sink))
+		{
+			printf("%s  %s Unable to insert domain into database file %s\n", over, cross, outfile);
+			goto end;
+		}
+	}
+
+	// Finalize SQL statements
+	const int rc1 = sqlite3_finalize(stmt), rc2 = sqlite3_finalize(batch);
+	const int rc3 = sqlite3_finalize(remove), rc4 = sqlite3_finalize(purge);
+	stmt = batch = remove = purge = NULL;
+	if(rc1 != SQLITE_OK || rc2 != SQLITE_OK || rc3 != SQLITE_OK || rc4 != SQLITE_OK)
 	{
 		printf("%s  %s Unable to finalize SQL statement to insert domains into database file %s\n",
 		       over, cross, outfile);
-		fclose(fpin);
-		sqlite3_close(db);
-		return EXIT_FAILURE;
+		goto end;
 	}
 
 	// Update database properties
 	// Are ABP patterns used?
-	if(abp_domains > 0)
+	if(result.abp_domains > 0)
 	{
-		sql = "INSERT OR REPLACE INTO info (property,value) VALUES ('abp_domains',1);";
-		if(sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK)
+		const char *abp_sql = "INSERT OR REPLACE INTO info (property,value) VALUES ('abp_domains',1);";
+		if(sqlite3_exec(db, abp_sql, NULL, NULL, NULL) != SQLITE_OK)
 		{
 			printf("%s  %s Unable to update database properties in database file %s\n",
 			       over, cross, outfile);
-			fclose(fpin);
-			sqlite3_close(db);
-			return EXIT_FAILURE;
+			goto end;
 		}
 	}
 
 	// Update number of domains and update timestamp on this list
-	sql = "UPDATE adlist SET number = ?, invalid_domains = ?, date_updated = cast(strftime('%s', 'now') as int) WHERE id = ?;";
-	if(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+	const char *update_sql = "UPDATE adlist SET number = ?, invalid_domains = ?, date_updated = cast(strftime('%s', 'now') as int) WHERE id = ?;";
+	if(sqlite3_prepare_v2(db, update_sql, -1, &stmt, NULL) != SQLITE_OK)
 	{
 		printf("%s  %s Unable to prepare SQL statement to update adlist properties in database file %s\n",
 		       over, cross, outfile);
-		fclose(fpin);
-		sqlite3_close(db);
-		return EXIT_FAILURE;
+		goto end;
 	}
 
 	// Update date
-	if(sqlite3_bind_int(stmt, 1, exact_domains) != SQLITE_OK)
+	if(sqlite3_bind_int(stmt, 1, result.exact_domains) != SQLITE_OK)
 	{
 		printf("%s  %s Unable to bind number of domains to SQL statement to update adlist properties in database file %s\n",
 		       over, cross, outfile);
-		fclose(fpin);
-		sqlite3_close(db);
-		return EXIT_FAILURE;
+		goto end;
 	}
-	if(sqlite3_bind_int(stmt, 2, invalid_domains) != SQLITE_OK)
+	if(sqlite3_bind_int(stmt, 2, result.invalid_domains) != SQLITE_OK)
 	{
 		printf("%s  %s Unable to bind number of invalid domains to SQL statement to update adlist properties in database file %s\n",
 		       over, cross, outfile);
-		fclose(fpin);
-		sqlite3_close(db);
-		return EXIT_FAILURE;
+		goto end;
 	}
 	if(sqlite3_bind_int(stmt, 3, adlistID) != SQLITE_OK)
 	{
 		printf("%s  %s Unable to bind adlist ID to SQL statement to update adlist properties in database file %s\n",
 		       over, cross, outfile);
-		fclose(fpin);
-		sqlite3_close(db);
-		return EXIT_FAILURE;
+		goto end;
 	}
 	if(sqlite3_step(stmt) != SQLITE_DONE)
 	{
 		printf("%s  %s Unable to update adlist properties in database file %s\n",
 		       over, cross, outfile);
-		fclose(fpin);
-		sqlite3_close(db);
-		return EXIT_FAILURE;
+		goto end;
 	}
-	if(sqlite3_finalize(stmt) != SQLITE_OK)
+	const int rc = sqlite3_finalize(stmt);
+	stmt = NULL;
+	if(rc != SQLITE_OK)
 	{
 		printf("%s  %s Unable to finalize SQL statement to update adlist properties in database file %s\n",
 		       over, cross, outfile);
-		fclose(fpin);
-		sqlite3_close(db);
-		return EXIT_FAILURE;
+		goto end;
 	}
 
 	// End transaction
@@ -336,35 +1116,89 @@ int gravity_parseList(const char *infile, const char *outfile, const char *adlis
 	{
 		printf("%s  %s Unable to end transaction to insert domains into database file %s (database file may be corrupted)\n",
 		       over, cross, outfile);
-		fclose(fpin);
-		sqlite3_close(db);
-		return EXIT_FAILURE;
+		goto end;
+	}
+
+	// Replace the snapshot of the previous run. Without a new snapshot,
+	// the previous one does not match the database anymore
+	if(!unchanged)
+	{
+		FILE *snapshot = sink.snapshot;
+		sink.snapshot = NULL;
+		if(snapshot == NULL || !finish_snapshot(snapshot, adlistID, fsize, checksum, &result) ||
+		   rename(sql, snapfile) != 0)
+		{
+			unlink(sql);
+			unlink(snapfile);
+		}
 	}
 
 	// Print summary
 	printf("%s  %s Parsed %u exact domains and %u ABP-style domains (ignored %u non-domain entries)\n",
-	       over, tick, exact_domains, abp_domains, invalid_domains);
-	if(invalid_domains_list_len > 0)
+	       over, tick, result.exact_domains, result.abp_domains, result.invalid_domains);
+	if(result.valid_domains > result.exact_domains + result.abp_domains)
+		printf("%s  %s Removed %u duplicate entries\n", over, info,
+		       result.valid_domains - result.exact_domains - result.abp_domains);
+	if(unchanged)
+		printf("%s  %s List unchanged since the previous run\n", over, info);
+	else if(sink.delta)
+		printf("%s  %s Applied changes since the previous run: %u domains added, %u removed\n",
+		       over, info, sink.inserted, sink.deleted);
+	if(result.invalid_samples > 0)
 	{
 		puts("      Sample of non-domain entries:");
-		for(unsigned int i = 0; i < invalid_domains_list_len; i++)
-			printf("        - \"%s\"\n", invalid_domains_list[i]);
+		for(unsigned int i = 0; i < result.invalid_samples; i++)
+			printf("        - \"%s\"\n", result.invalid_sample[i]);
 		puts("");
 	}
 
-	// Free memory
-	free(line);
-	regfree(&exact_regex);
-	regfree(&abp_regex);
-	regfree(&false_positives_regex);
-	for(unsigned int i = 0; i < invalid_domains_list_len; i++)
-		if(invalid_domains_list[i] != NULL)
-			free(invalid_domains_list[i]);
-
-	// Close files
-	fclose(fpin);
+	ret = EXIT_SUCCESS;
+
+end:
+	if(sink.snapshot != NULL)
+	{
+		// A half-written snapshot is useless
+		fclose(sink.snapshot);
+		sprintf(sql, "%s.tmp", snapfile);
+		unlink(sql);
+	}
+	free_runs(&sort);
+	sqlite3_finalize(stmt);
+	sqlite3_finalize(batch);
+	sqlite3_finalize(remove);
+	sqlite3_finalize(purge);
+	// Closing the database rolls back unfinished transactions
 	sqlite3_close(db);
 
-	// Return success
+	// Free memory
+	free_snapshot(&old);
+	if(map != NULL)
+		munmap((void*)map, fsize);
+	list_map = NULL;
+	for(unsigned int i = 0; i < result.invalid_samples; i++)
+		if(result.invalid_sample[i] != NULL)
+			free(result.invalid_sample[i]);
+	free(snapfile);
+	free(sql);
+
+	return ret;
+}
+
+// Compile the gravity domains of the database into a binary index which can be
+// memory-mapped by FTL. This needs to be run after all lists have been parsed
+int gravity_compile(const char *dbfile)
+{
+	const char *tick = cli_tick();
+	const char *cross = cli_cross();
+	const char *over = cli_over();
+
+	size_t count = 0;
+	if(!gravity_set_compile(dbfile, &count))
+	{
+		printf("%s  %s Unable to compile gravity index for %s\n", over, cross, dbfile);
+		return EXIT_FAILURE;
+	}
+
+	printf("%s  %s Compiled gravity index with %zu unique domains\n", over, tick, count);
 	return EXIT_SUCCESS;
 }
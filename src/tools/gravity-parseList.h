@@ -11,3 +11,4 @@
 #include "FTL.h"
 
 int gravity_parseList(const char *infile, const char *outfile, const char *adlistID);
+int gravity_compile(const char *dbfile);
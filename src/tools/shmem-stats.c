@@ -0,0 +1,70 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Shared memory statistics reader
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "shmem-stats.h"
+// Only the public interface of the library is used here so this doubles as
+// an example for other consumers
+#include "libftlstats/ftlstats.h"
+
+static const char *list_names[FTLSTATS_LISTS] = {
+	[FTLSTATS_TOP_DOMAINS] = "top-domains",
+	[FTLSTATS_TOP_ADS] = "top-ads",
+	[FTLSTATS_TOP_CLIENTS] = "top-clients",
+	[FTLSTATS_TOP_BLOCKED_CLIENTS] = "top-blocked-clients",
+};
+
+// Print the statistics published by a running FTL with SHMEM_STATS=true
+int run_shmem_stats(const char *name)
+{
+	struct ftlstats_handle *handle = ftlstats_open(name);
+	if(handle == NULL)
+	{
+		printf("Cannot open shared memory statistics: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	static struct ftlstats stats;
+	if(ftlstats_read(handle, &stats) != 0)
+	{
+		printf("Cannot read shared memory statistics: %s\n", strerror(errno));
+		ftlstats_close(handle);
+		return EXIT_FAILURE;
+	}
+	ftlstats_close(handle);
+
+	printf("updated %lld\n", (long long)stats.updated);
+	printf("pid %d\n", stats.pid);
+	printf("dns_queries_today %d\n", stats.total);
+	printf("ads_blocked_today %d\n", stats.blocked);
+	printf("queries_cached %d\n", stats.cached);
+	printf("queries_forwarded %d\n", stats.forwarded);
+	printf("unique_domains %d\n", stats.domains);
+	printf("unique_clients %d\n", stats.clients);
+	printf("domains_being_blocked %d\n", stats.gravity);
+	printf("status %s\n", stats.blocking == 0 ? "disabled" : stats.blocking == 1 ? "enabled" : "unknown");
+	printf("privacy_level %d\n", stats.privacy_level);
+
+	// Only the last slot with queries is of interest here
+	for(unsigned int slot = stats.slots; slot-- > 0;)
+		if(stats.slot_total[slot] > 0)
+		{
+			printf("last_slot %lld %d %d %d %d\n", (long long)stats.slot_timestamp[slot],
+			       stats.slot_total[slot], stats.slot_blocked[slot],
+			       stats.slot_cached[slot], stats.slot_forwarded[slot]);
+			break;
+		}
+
+	for(unsigned int list = 0; list < FTLSTATS_LISTS; list++)
+		for(unsigned int i = 0; i < stats.top_n[list]; i++)
+			printf("%s %u %d %s\n", list_names[list], i, stats.top[list][i].count, stats.top[list][i].name);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,155 @@
+/*
+  tre-arena.c - Arenas for compiled regexps
+
+  This software is released under a BSD-style license.
+  See the file LICENSE for details and copyright.
+
+*/
+
+/*
+  FTL: Compiling a regexp allocates its TNFA in many small blocks.  With
+  thousands of regexps, these fragment the heap and freeing them on the next
+  reload takes a long time.  While an arena is set for a thread with
+  tre_arena_use(), tre_compile() allocates the TNFA from it instead.  The
+  blocks of all regexps compiled into an arena are contiguous and they are
+  freed together with the arena.  The temporary memory used while compiling
+  (the AST, stacks, ...) is still allocated from the heap.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tre-internal.h"
+#include "xmalloc.h"
+
+/* Size of the chunks an arena is made of, larger blocks get a chunk of their
+   own.  Chunks are larger than glibc's mmap() threshold, their memory is
+   returned to the system when the arena is freed. */
+#define TRE_ARENA_CHUNK_SIZE (256 * 1024)
+#define TRE_ARENA_ALIGN (sizeof(max_align_t))
+
+typedef struct tre_arena_chunk {
+  struct tre_arena_chunk *next;
+  size_t size;
+  size_t used;
+  max_align_t data[];
+} tre_arena_chunk_t;
+
+struct tre_arena {
+  tre_arena_chunk_t *chunks;
+  size_t used;
+  size_t allocated;
+};
+
+/* The arena of the calling thread, regexps are compiled by several threads
+   at the same time. */
+static __thread tre_arena_t *current_arena = NULL;
+
+tre_arena_t *
+tre_arena_new(void)
+{
+  return xcalloc(1, sizeof(tre_arena_t));
+}
+
+void
+tre_arena_use(tre_arena_t *arena)
+{
+  current_arena = arena;
+}
+
+tre_arena_t *
+tre_arena_current(void)
+{
+  return current_arena;
+}
+
+/* Returns a zeroed block of the arena of the calling thread, or of the heap
+   if there is none. */
+void *
+tre_arena_calloc(size_t nmemb, size_t size)
+{
+  tre_arena_t *arena = current_arena;
+  tre_arena_chunk_t *chunk;
+  size_t bytes;
+
+  if (arena == NULL)
+    return xcalloc(nmemb, size);
+
+  if (size != 0 && nmemb > ((size_t)-1 - TRE_ARENA_ALIGN) / size)
+    return NULL;
+  bytes = (nmemb * size + TRE_ARENA_ALIGN - 1) & ~(TRE_ARENA_ALIGN - 1);
+
+  chunk = arena->chunks;
+  if (chunk == NULL || chunk->size - chunk->used < bytes)
+    {
+      size_t chunk_size = TRE_ARENA_CHUNK_SIZE;
+      if (bytes > chunk_size - sizeof(*chunk))
+	chunk_size = bytes + sizeof(*chunk);
+      chunk = xmalloc(chunk_size);
+      if (chunk == NULL)
+	return NULL;
+      chunk->size = chunk_size - sizeof(*chunk);
+      chunk->used = 0;
+
+      /* Keep filling the current chunk if the new one is used up by a
+	 single large block. */
+      if (arena->chunks != NULL && bytes >= chunk->size)
+	{
+	  chunk->next = arena->chunks->next;
+	  arena->chunks->next = chunk;
+	}
+      else
+	{
+	  chunk->next = arena->chunks;
+	  arena->chunks = chunk;
+	}
+      arena->allocated += chunk_size;
+    }
+
+  void *ptr = (char *)chunk->data + chunk->used;
+  chunk->used += bytes;
+  arena->used += bytes;
+  memset(ptr, 0, bytes);
+  return ptr;
+}
+
+/* Blocks of an arena are only freed together with it. */
+void
+tre_arena_block_free(void *ptr)
+{
+  if (current_arena == NULL)
+    xfree(ptr);
+}
+
+/* Returns the memory used by the blocks of an arena and the memory allocated
+   for its chunks. */
+void
+tre_arena_size(const tre_arena_t *arena, size_t *used, size_t *allocated)
+{
+  *used = arena != NULL ? arena->used : 0;
+  *allocated = arena != NULL ? arena->allocated + sizeof(*arena) : 0;
+}
+
+void
+tre_arena_free(tre_arena_t *arena)
+{
+  tre_arena_chunk_t *chunk, *next;
+
+  if (arena == NULL)
+    return;
+  if (current_arena == arena)
+    current_arena = NULL;
+
+  for (chunk = arena->chunks; chunk != NULL; chunk = next)
+    {
+      next = chunk->next;
+      xfree(chunk);
+    }
+  xfree(arena);
+}
+
+/* EOF */
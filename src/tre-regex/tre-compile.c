@@ -29,6 +29,12 @@
 #include "tre.h"
 #include "xmalloc.h"
 
+/* FTL: The TNFA is allocated from the arena of the calling thread, if any
+   (see tre-arena.c). */
+#define tnfa_malloc(size) tre_arena_calloc(1, size)
+#define tnfa_calloc(nmemb, size) tre_arena_calloc(nmemb, size)
+#define tnfa_free(ptr) tre_arena_block_free(ptr)
+
 /*
   Algorithms to setup tags so that submatch addressing can be done.
 */
@@ -243,7 +249,7 @@ tre_add_tags(tre_mem_t mem, tre_stack_t *stack, tre_ast_node_t *tree,
 		  tnfa->submatch_data[id].parents = NULL;
 		  if (i > 0)
 		    {
-		      int *p = xmalloc(sizeof(*p) * (i + 1));
+		      int *p = tnfa_malloc(sizeof(*p) * (i + 1));
 		      if (p == NULL)
 			{
 			  status = REG_ESPACE;
@@ -1639,7 +1645,7 @@ tre_make_trans(tre_pos_and_tags_t *p1, tre_pos_and_tags_t *p2,
 	      {
 		for (i = 0; p1->neg_classes[i] != (tre_ctype_t)0; i++);
 		trans->neg_classes =
-		  xmalloc(sizeof(*trans->neg_classes) * (i + 1));
+		  tnfa_malloc(sizeof(*trans->neg_classes) * (i + 1));
 		if (trans->neg_classes == NULL)
 		  return REG_ESPACE;
 		for (i = 0; p1->neg_classes[i] != (tre_ctype_t)0; i++)
@@ -1661,13 +1667,13 @@ tre_make_trans(tre_pos_and_tags_t *p1, tre_pos_and_tags_t *p2,
 
 	    /* If we are overwriting a transition, free the old tag array. */
 	    if (trans->tags != NULL)
-	      xfree(trans->tags);
+	      tnfa_free(trans->tags);
 	    trans->tags = NULL;
 
 	    /* If there were any tags, allocate an array and fill it. */
 	    if (i + j > 0)
 	      {
-		trans->tags = xmalloc(sizeof(*trans->tags) * (i + j + 1));
+		trans->tags = tnfa_malloc(sizeof(*trans->tags) * (i + j + 1));
 		if (!trans->tags)
 		  return REG_ESPACE;
 		i = 0;
@@ -1702,7 +1708,7 @@ tre_make_trans(tre_pos_and_tags_t *p1, tre_pos_and_tags_t *p2,
 	    if (p1->params || p2->params)
 	      {
 		if (!trans->params)
-		  trans->params = xmalloc(sizeof(*trans->params)
+		  trans->params = tnfa_malloc(sizeof(*trans->params)
 					  * TRE_PARAM_LAST);
 		if (!trans->params)
 		  return REG_ESPACE;
@@ -1718,7 +1724,7 @@ tre_make_trans(tre_pos_and_tags_t *p1, tre_pos_and_tags_t *p2,
 	    else
 	      {
 		if (trans->params)
-		  xfree(trans->params);
+		  tnfa_free(trans->params);
 		trans->params = NULL;
 	      }
 
@@ -1913,9 +1919,10 @@ tre_compile(regex_t *preg, const tre_char_t *regex, size_t n, int cflags)
     ERROR_EXIT(REG_ESUBREG);
 
   /* Allocate the TNFA struct. */
-  tnfa = xcalloc(1, sizeof(tre_tnfa_t));
+  tnfa = tnfa_calloc(1, sizeof(tre_tnfa_t));
   if (tnfa == NULL)
     ERROR_EXIT(REG_ESPACE);
+  tnfa->arena = tre_arena_current() != NULL;
   tnfa->have_backrefs = parse_ctx.max_backref >= 0;
   tnfa->have_approx = parse_ctx.have_approx;
   tnfa->num_submatches = parse_ctx.submatch_id;
@@ -1936,7 +1943,7 @@ tre_compile(regex_t *preg, const tre_char_t *regex, size_t n, int cflags)
 
       if (tnfa->num_tags > 0)
 	{
-	  tag_directions = xmalloc(sizeof(*tag_directions)
+	  tag_directions = tnfa_malloc(sizeof(*tag_directions)
 				   * (tnfa->num_tags + 1));
 	  if (tag_directions == NULL)
 	    ERROR_EXIT(REG_ESPACE);
@@ -1944,12 +1951,12 @@ tre_compile(regex_t *preg, const tre_char_t *regex, size_t n, int cflags)
 	  memset(tag_directions, -1,
 		 sizeof(*tag_directions) * (tnfa->num_tags + 1));
 	}
-      tnfa->minimal_tags = xcalloc((unsigned)tnfa->num_tags * 2 + 1,
+      tnfa->minimal_tags = tnfa_calloc((unsigned)tnfa->num_tags * 2 + 1,
 				   sizeof(tnfa->minimal_tags));
       if (tnfa->minimal_tags == NULL)
 	ERROR_EXIT(REG_ESPACE);
 
-      submatch_data = xcalloc((unsigned)parse_ctx.submatch_id,
+      submatch_data = tnfa_calloc((unsigned)parse_ctx.submatch_id,
 			      sizeof(*submatch_data));
       if (submatch_data == NULL)
 	ERROR_EXIT(REG_ESPACE);
@@ -2017,7 +2024,7 @@ tre_compile(regex_t *preg, const tre_char_t *regex, size_t n, int cflags)
       add += counts[i] + 1;
       counts[i] = 0;
     }
-  transitions = xcalloc((unsigned)add + 1, sizeof(*transitions));
+  transitions = tnfa_calloc((unsigned)add + 1, sizeof(*transitions));
   if (transitions == NULL)
     ERROR_EXIT(REG_ESPACE);
   tnfa->transitions = transitions;
@@ -2036,7 +2043,7 @@ tre_compile(regex_t *preg, const tre_char_t *regex, size_t n, int cflags)
       int count = 0;
       tre_cint_t k;
       DPRINT(("Characters that can start a match:"));
-      tnfa->firstpos_chars = xcalloc(256, sizeof(char));
+      tnfa->firstpos_chars = tnfa_calloc(256, sizeof(char));
       if (tnfa->firstpos_chars == NULL)
 	ERROR_EXIT(REG_ESPACE);
       for (p = tree->firstpos; p->position >= 0; p++)
@@ -2063,7 +2070,7 @@ tre_compile(regex_t *preg, const tre_char_t *regex, size_t n, int cflags)
 	      {
 		DPRINT(("first char must be %d\n", k));
 		tnfa->first_char = k;
-		xfree(tnfa->firstpos_chars);
+		tnfa_free(tnfa->firstpos_chars);
 		tnfa->firstpos_chars = NULL;
 		break;
 	      }
@@ -2111,7 +2118,7 @@ tre_compile(regex_t *preg, const tre_char_t *regex, size_t n, int cflags)
       p++;
     }
 
-  initial = xcalloc((unsigned)i + 1, sizeof(tre_tnfa_transition_t));
+  initial = tnfa_calloc((unsigned)i + 1, sizeof(tre_tnfa_transition_t));
   if (initial == NULL)
     ERROR_EXIT(REG_ESPACE);
   tnfa->initial = initial;
@@ -2128,7 +2135,7 @@ tre_compile(regex_t *preg, const tre_char_t *regex, size_t n, int cflags)
 	{
 	  int j;
 	  for (j = 0; p->tags[j] >= 0; j++);
-	  initial[i].tags = xmalloc(sizeof(*p->tags) * (j + 1));
+	  initial[i].tags = tnfa_malloc(sizeof(*p->tags) * (j + 1));
 	  if (!initial[i].tags)
 	    ERROR_EXIT(REG_ESPACE);
 	  memcpy(initial[i].tags, p->tags, sizeof(*p->tags) * (j + 1));
@@ -2136,7 +2143,7 @@ tre_compile(regex_t *preg, const tre_char_t *regex, size_t n, int cflags)
       initial[i].params = NULL;
       if (p->params)
 	{
-	  initial[i].params = xmalloc(sizeof(*p->params) * TRE_PARAM_LAST);
+	  initial[i].params = tnfa_malloc(sizeof(*p->params) * TRE_PARAM_LAST);
 	  if (!initial[i].params)
 	    ERROR_EXIT(REG_ESPACE);
 	  memcpy(initial[i].params, p->params,
@@ -2190,6 +2197,13 @@ tre_free(regex_t *preg)
   if (!tnfa)
     return;
 
+  /* FTL: The TNFA is freed together with its arena. */
+  if (tnfa->arena)
+    {
+      preg->TRE_REGEX_T_FIELD = NULL;
+      return;
+    }
+
   for (i = 0; i < tnfa->num_transitions; i++)
     if (tnfa->transitions[i].state)
       {
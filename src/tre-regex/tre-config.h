@@ -72,6 +72,9 @@
 
 /* Define if you want TRE to use alloca() instead of malloc() when allocating
    memory needed for regexec operations. */
+/* FTL: This keeps match_regex() free of heap allocations. The parallel,
+   backtracking and approximate matchers take their scratch space from the
+   stack frame of tre_regexec(), do not undefine this. */
 #define TRE_USE_ALLOCA 1
 
 /* Define to include the system regex.h from TRE regex.h */
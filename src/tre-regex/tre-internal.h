@@ -249,6 +249,8 @@ struct tnfa {
   int have_backrefs;
   int have_approx;
   int params_depth;
+  /* FTL: Allocated from an arena (see tre-arena.c) */
+  int arena;
 };
 
 int
@@ -257,6 +259,16 @@ tre_compile(regex_t *preg, const tre_char_t *regex, size_t n, int cflags);
 void
 tre_free(regex_t *preg);
 
+/* FTL: Allocation of TNFAs from arenas (see tre-arena.c) */
+tre_arena_t *
+tre_arena_current(void);
+
+void *
+tre_arena_calloc(size_t nmemb, size_t size);
+
+void
+tre_arena_block_free(void *ptr);
+
 void
 tre_fill_pmatch(size_t nmatch, regmatch_t pmatch[], int cflags,
 		const tre_tnfa_t *tnfa, int *tags, int match_eo);
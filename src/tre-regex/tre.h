@@ -151,6 +151,23 @@ tre_regerror(int errcode, const regex_t *preg, char *errbuf,
 extern void
 tre_regfree(regex_t *preg);
 
+/* FTL: While an arena is set for a thread, the regexps it compiles are
+   allocated from the arena.  tre_regfree() does nothing for them, they are
+   freed together with the arena (see tre-arena.c). */
+typedef struct tre_arena tre_arena_t;
+
+extern tre_arena_t *
+tre_arena_new(void);
+
+extern void
+tre_arena_use(tre_arena_t *arena);
+
+extern void
+tre_arena_size(const tre_arena_t *arena, size_t *used, size_t *allocated);
+
+extern void
+tre_arena_free(tre_arena_t *arena);
+
 #ifdef TRE_WCHAR
 #ifdef HAVE_WCHAR_H
 #include <wchar.h>
@@ -0,0 +1,165 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Trigram index of domain strings
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "trigram.h"
+// getDomain(), getstr(), alloc_trigram_chunk()
+#include "shmem.h"
+// fnmatch()
+#include <fnmatch.h>
+// UINT_MAX
+#include <limits.h>
+
+// All routines in here have to be called while holding the SHM lock
+// (exclusively, except for search_domains())
+
+// Every trigram (three consecutive characters) of a domain is hashed into one
+// of TRIGRAM_BUCKETS buckets, each bucket lists the IDs of all domains
+// containing a trigram hashed into it. A substring search only has to check
+// the domains of the smallest bucket of any trigram of the searched string
+// instead of all domains. Different trigrams may share a bucket, candidates
+// are always verified against the actual domain.
+//
+// Domains are never removed from memory, but they are pruned from the index
+// once no query of them is left. The index is rebuilt from the remaining
+// domains for this after the garbage collection removed queries
+
+static inline unsigned int __attribute__((const)) trigram_bucket(const unsigned char a, const unsigned char b, const unsigned char c)
+{
+	uint32_t h = ((uint32_t)a << 16 | (uint32_t)b << 8 | c) * 2654435761u;
+	return (h >> 16) & (TRIGRAM_BUCKETS - 1);
+}
+
+static void bucket_add(const unsigned int bucket, const int domainID)
+{
+	trigramChunk *chunk = getTrigramChunk(trigram_index->head[bucket]);
+
+	// Domains are added one after the other, a domain containing several
+	// trigrams of the same bucket is only listed once
+	if(chunk != NULL && chunk->used > 0 && chunk->ids[chunk->used - 1] == domainID)
+		return;
+
+	if(chunk == NULL || chunk->used >= TRIGRAM_CHUNK_IDS)
+	{
+		const unsigned int new = alloc_trigram_chunk();
+		chunk = getTrigramChunk(new);
+		chunk->next = trigram_index->head[bucket];
+		trigram_index->head[bucket] = new;
+	}
+
+	chunk->ids[chunk->used++] = domainID;
+}
+
+void trigram_add_domain(const int domainID, domainsData *domain)
+{
+	if(trigram_index == NULL || domain->indexed)
+		return;
+
+	const unsigned char *str = (const unsigned char*)getstr(domain->domainpos);
+	const size_t len = strlen((const char*)str);
+	for(size_t i = 0; i + 2 < len; i++)
+		bucket_add(trigram_bucket(str[i], str[i+1], str[i+2]), domainID);
+
+	domain->indexed = true;
+}
+
+void rebuild_trigram_index(void)
+{
+	if(trigram_index == NULL)
+		return;
+
+	memset(trigram_index->head, 0, sizeof(trigram_index->head));
+	trigram_index->chunks = 1;
+
+	for(int domainID = 0; domainID < counters->domains; domainID++)
+	{
+		domainsData *domain = getDomain(domainID, true);
+		if(domain == NULL)
+			continue;
+
+		domain->indexed = false;
+		if(domain->count > 0)
+			trigram_add_domain(domainID, domain);
+	}
+}
+
+// Number of domains listed in a bucket
+static unsigned int __attribute__((pure)) bucket_size(const unsigned int bucket)
+{
+	unsigned int size = 0;
+	for(const trigramChunk *chunk = getTrigramChunk(trigram_index->head[bucket]);
+	    chunk != NULL; chunk = getTrigramChunk(chunk->next))
+		size += chunk->used;
+	return size;
+}
+
+// Check if a domain matches the pattern and still has queries in memory
+static bool domain_matches(const int domainID, const char *pattern)
+{
+	const domainsData *domain = getDomain(domainID, true);
+	return domain != NULL && domain->count > 0 &&
+	       fnmatch(pattern, getstr(domain->domainpos), 0) == 0;
+}
+
+// Find up to max domains matching a shell wildcard pattern (* and ?). A
+// pattern without wildcards matches all domains containing it. Returns the
+// number of matching domains stored in ids (newest domains first)
+int search_domains(const char *pattern, int *ids, const int max)
+{
+	// Match substrings if no wildcard is given
+	char glob[256];
+	if(strpbrk(pattern, "*?") == NULL)
+		snprintf(glob, sizeof(glob), "*%s*", pattern);
+	else
+		snprintf(glob, sizeof(glob), "%s", pattern);
+
+	// Find the smallest bucket of all trigrams of the literal parts of the
+	// pattern
+	unsigned int best = TRIGRAM_BUCKETS, best_size = UINT_MAX;
+	size_t run = 0;
+	for(const unsigned char *p = (const unsigned char*)glob; trigram_index != NULL && *p != '\0'; p++)
+	{
+		if(*p == '*' || *p == '?')
+		{
+			run = 0;
+			continue;
+		}
+		if(++run < 3)
+			continue;
+
+		const unsigned int bucket = trigram_bucket(p[-2], p[-1], p[0]);
+		const unsigned int size = bucket_size(bucket);
+		if(size < best_size)
+		{
+			best = bucket;
+			best_size = size;
+		}
+	}
+
+	int found = 0;
+	if(best < TRIGRAM_BUCKETS)
+	{
+		for(const trigramChunk *chunk = getTrigramChunk(trigram_index->head[best]);
+		    chunk != NULL && found < max; chunk = getTrigramChunk(chunk->next))
+			for(int i = (int)chunk->used - 1; i >= 0 && found < max; i--)
+				if(domain_matches(chunk->ids[i], glob))
+					ids[found++] = chunk->ids[i];
+	}
+	else
+	{
+		// No literal part of the pattern is long enough to use the
+		// index, check all domains
+		for(int domainID = counters->domains - 1; domainID >= 0 && found < max; domainID--)
+			if(domain_matches(domainID, glob))
+				ids[found++] = domainID;
+	}
+
+	return found;
+}
@@ -0,0 +1,41 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Trigram index of domain strings prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef TRIGRAM_H
+#define TRIGRAM_H
+
+// domainsData
+#include "datastructure.h"
+
+// Number of buckets trigrams are hashed into, has to be a power of two
+#define TRIGRAM_BUCKETS 65536
+#define TRIGRAM_CHUNK_IDS 14
+
+// Domain IDs of a bucket are stored in a list of chunks, newest first
+typedef struct {
+	unsigned int next;
+	unsigned int used;
+	int ids[TRIGRAM_CHUNK_IDS];
+} trigramChunk;
+
+typedef struct {
+	// Newest chunk of each bucket, zero if the bucket is empty
+	unsigned int head[TRIGRAM_BUCKETS];
+	// Chunks in use and allocated in the pool (chunk zero is never used)
+	int chunks;
+	int chunks_MAX;
+} trigramIndexStruct;
+
+extern trigramIndexStruct *trigram_index;
+
+void trigram_add_domain(const int domainID, domainsData *domain);
+void rebuild_trigram_index(void);
+int search_domains(const char *pattern, int *ids, const int max);
+
+#endif //TRIGRAM_H
@@ -0,0 +1,250 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Batched UDP receiving and sending
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#define FTLDNS
+#include "dnsmasq/dnsmasq.h"
+#undef __USE_XOPEN
+#include "FTL.h"
+#include "udpbatch.h"
+#include "dnsmasq_interface.h"
+#include "config.h"
+#include "log.h"
+
+// dnsmasq receives and answers one UDP datagram per system call. When
+// UDP_BATCH is larger than one, all datagrams waiting on a listening socket
+// are read with a single recvmmsg() call and handed to receive_query() one
+// after another. Replies sent while dnsmasq processes the sockets which poll()
+// reported are queued and sent with a single sendmmsg() call per socket.
+// Everything here runs in dnsmasq's main thread only
+
+// Large enough for the IP_PKTINFO and IPV6_PKTINFO control messages
+#define UDP_CONTROL_LEN 128
+
+struct udp_slot {
+	union {
+		struct cmsghdr align; // this ensures alignment
+		char buf[UDP_CONTROL_LEN];
+	} control;
+	struct sockaddr_storage name;
+	struct iovec iov;
+};
+
+struct udp_batch {
+	struct mmsghdr msgs[UDP_BATCH_MAX];
+	struct udp_slot slots[UDP_BATCH_MAX];
+	unsigned char *packets;
+	size_t pktsz;
+};
+
+// Datagrams received from socket rx_fd, rx_next is the next one to be
+// processed
+static struct udp_batch rx = { .packets = NULL };
+static int rx_fd = -1;
+static unsigned int rx_count = 0u, rx_next = 0u;
+
+// Replies waiting to be sent, tx_fds holds the socket of each of them
+static struct udp_batch tx = { .packets = NULL };
+static int tx_fds[UDP_BATCH_MAX];
+static unsigned int tx_count = 0u;
+static bool tx_active = false;
+
+static struct udp_batch_stats stats = { 0 };
+
+static bool alloc_batch(struct udp_batch *batch)
+{
+	if(batch->packets != NULL)
+		return true;
+
+	batch->pktsz = daemon->edns_pktsz;
+	batch->packets = calloc(UDP_BATCH_MAX, batch->pktsz);
+	if(batch->packets == NULL)
+	{
+		logg("WARNING: Cannot allocate UDP batch buffers, disabling batched UDP I/O");
+		config.udp_batch = 1u;
+		return false;
+	}
+
+	for(unsigned int i = 0; i < UDP_BATCH_MAX; i++)
+	{
+		batch->slots[i].iov.iov_base = batch->packets + i*batch->pktsz;
+		batch->msgs[i].msg_hdr.msg_iov = &batch->slots[i].iov;
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+		batch->msgs[i].msg_hdr.msg_name = &batch->slots[i].name;
+		batch->msgs[i].msg_hdr.msg_control = batch->slots[i].control.buf;
+	}
+
+	return true;
+}
+
+// Hand the next datagram of the batch to the caller as if it had been read by
+// recvmsg() into the caller's buffers
+static ssize_t next_datagram(struct msghdr *msg)
+{
+	const struct msghdr *hdr = &rx.msgs[rx_next].msg_hdr;
+	const size_t len = rx.msgs[rx_next].msg_len;
+	rx_next++;
+
+	memcpy(msg->msg_iov[0].iov_base, hdr->msg_iov[0].iov_base, len);
+
+	if(msg->msg_namelen > hdr->msg_namelen)
+		msg->msg_namelen = hdr->msg_namelen;
+	memcpy(msg->msg_name, hdr->msg_name, msg->msg_namelen);
+
+	msg->msg_flags = hdr->msg_flags;
+	if(msg->msg_controllen < hdr->msg_controllen)
+		msg->msg_flags |= MSG_CTRUNC;
+	else
+		msg->msg_controllen = hdr->msg_controllen;
+	memcpy(msg->msg_control, hdr->msg_control, msg->msg_controllen);
+
+	return (ssize_t)len;
+}
+
+// Drop-in replacement for recvmsg(fd, msg, 0) on dnsmasq's listening sockets
+ssize_t FTL_recvmsg(int fd, struct msghdr *msg)
+{
+	if(rx_fd == fd && rx_next < rx_count)
+		return next_datagram(msg);
+
+	if(config.udp_batch < 2 || msg->msg_iovlen != 1 || !alloc_batch(&rx))
+		return recvmsg(fd, msg, 0);
+
+	// Receive into buffers of the same size as the caller's so that
+	// datagrams are truncated exactly as they would have been without
+	// batching
+	const size_t pktsz = MIN(msg->msg_iov[0].iov_len, rx.pktsz);
+	const socklen_t controllen = MIN(msg->msg_controllen, (socklen_t)UDP_CONTROL_LEN);
+	for(unsigned int i = 0; i < config.udp_batch; i++)
+	{
+		rx.slots[i].iov.iov_len = pktsz;
+		rx.msgs[i].msg_hdr.msg_namelen = sizeof(rx.slots[i].name);
+		rx.msgs[i].msg_hdr.msg_controllen = controllen;
+		rx.msgs[i].msg_hdr.msg_flags = 0;
+	}
+
+	int n;
+	do
+	{
+		n = recvmmsg(fd, rx.msgs, config.udp_batch, MSG_DONTWAIT, NULL);
+	}
+	while(n < 0 && errno == EINTR);
+
+	if(n < 0)
+		return -1;
+
+	rx_fd = fd;
+	rx_count = (unsigned int)n;
+	rx_next = 0u;
+	stats.recv_calls++;
+	stats.recv_datagrams += rx_count;
+
+	if(rx_count == 0)
+		return 0;
+
+	return next_datagram(msg);
+}
+
+// Are there more datagrams of socket fd waiting to be processed?
+bool FTL_recvmsg_pending(int fd)
+{
+	return rx_fd == fd && rx_next < rx_count;
+}
+
+// Start queueing replies instead of sending them right away
+void FTL_udp_batch_start(void)
+{
+	tx_active = config.udp_batch > 1 && alloc_batch(&tx);
+}
+
+// Queue a datagram which would otherwise be sent by sendmsg(fd, msg, 0).
+// Returns false if it has to be sent by the caller
+bool FTL_sendmsg_queue(int fd, const struct msghdr *msg)
+{
+	if(!tx_active || msg->msg_iovlen != 1 ||
+	   msg->msg_iov[0].iov_len > tx.pktsz ||
+	   msg->msg_namelen > sizeof(tx.slots[0].name) ||
+	   msg->msg_controllen > UDP_CONTROL_LEN)
+		return false;
+
+	// Make room for this datagram
+	if(tx_count >= config.udp_batch)
+	{
+		FTL_udp_batch_flush();
+		tx_active = true;
+	}
+
+	struct udp_slot *slot = &tx.slots[tx_count];
+	struct msghdr *hdr = &tx.msgs[tx_count].msg_hdr;
+	memcpy(slot->iov.iov_base, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
+	slot->iov.iov_len = msg->msg_iov[0].iov_len;
+	memcpy(&slot->name, msg->msg_name, msg->msg_namelen);
+	hdr->msg_namelen = msg->msg_namelen;
+	if(msg->msg_controllen > 0)
+		memcpy(slot->control.buf, msg->msg_control, msg->msg_controllen);
+	hdr->msg_control = msg->msg_controllen > 0 ? slot->control.buf : NULL;
+	hdr->msg_controllen = msg->msg_controllen;
+	hdr->msg_flags = 0;
+	tx_fds[tx_count++] = fd;
+
+	return true;
+}
+
+// Send all queued datagrams and stop queueing
+void FTL_udp_batch_flush(void)
+{
+	tx_active = false;
+
+	unsigned int i = 0;
+	while(i < tx_count)
+	{
+		// Send consecutive datagrams of the same socket at once
+		unsigned int j = i + 1;
+		while(j < tx_count && tx_fds[j] == tx_fds[i])
+			j++;
+
+		int n = sendmmsg(tx_fds[i], &tx.msgs[i], j - i, 0);
+		if(n < 0 && errno == EINTR)
+			continue;
+
+		stats.send_calls++;
+		if(n <= 0)
+		{
+			// The first datagram could not be sent, handle it like
+			// send_from() does and continue with the remaining ones
+			while(retry_send(sendmsg(tx_fds[i], &tx.msgs[i].msg_hdr, 0)));
+#ifdef HAVE_LINUX_NETWORK
+			// If interface is still in DAD, EINVAL results - ignore that
+			if(errno != 0 && errno != EINVAL)
+				my_syslog(LOG_ERR, _("failed to send packet: %s"), strerror(errno));
+#endif
+			n = 1;
+		}
+
+		stats.send_datagrams += (unsigned int)n;
+		i += (unsigned int)n;
+	}
+
+	tx_count = 0u;
+}
+
+// Forks must neither send the replies queued by the main process nor process
+// its received datagrams a second time
+void FTL_udp_batch_forked(void)
+{
+	tx_active = false;
+	tx_count = 0u;
+	rx_fd = -1;
+	rx_count = rx_next = 0u;
+}
+
+void get_udp_batch_stats(struct udp_batch_stats *out)
+{
+	memcpy(out, &stats, sizeof(stats));
+}
@@ -0,0 +1,30 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Batched UDP receiving and sending prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef UDPBATCH_H
+#define UDPBATCH_H
+
+#include <stdbool.h>
+
+// Maximum number of datagrams received or sent with a single system call
+#define UDP_BATCH_MAX 64
+
+struct udp_batch_stats {
+	unsigned long recv_calls;
+	unsigned long recv_datagrams;
+	unsigned long send_calls;
+	unsigned long send_datagrams;
+};
+
+// FTL_recvmsg() and the other functions called by dnsmasq are declared in
+// dnsmasq_interface.h
+void FTL_udp_batch_forked(void);
+void get_udp_batch_stats(struct udp_batch_stats *stats);
+
+#endif //UDPBATCH_H
@@ -0,0 +1,295 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Upstream health probing
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "upstream_probe.h"
+#include "config.h"
+// logg()
+#include "log.h"
+// killed, thread_names[]
+#include "signals.h"
+// thread_sched_apply()
+#include "threadsched.h"
+// strtolower()
+#include "datastructure.h"
+#include <poll.h>
+
+// Without probing, a server that stopped answering is only noticed when
+// queries of clients time out. With UPSTREAM_PROBE_INTERVAL, the probe thread
+// sends a query for the root NS records (answered from the cache of any
+// resolver) to every upstream server which did not answer a client query in
+// the last interval. Servers whose last UPSTREAM_PROBE_FAILURES probes were
+// lost are marked down and skipped by the server selection until they answer
+// again, the probe latency is used to rank servers without replies to client
+// queries (see FTL_select_server()). The servers are registered by the
+// resolver whenever they are candidates for a query
+struct probe_target {
+	union {
+		struct sockaddr sa;
+		struct sockaddr_in in;
+		struct sockaddr_in6 in6;
+	} addr;
+	char ip[INET6_ADDRSTRLEN];
+	in_port_t port;
+	time_t registered;
+	time_t replied;
+	time_t next_probe;
+	struct timespec sent;
+	unsigned short id;
+	bool pending;
+	bool down;
+	unsigned int failures;
+	float rtt; // moving average of the probe latency [ms]
+};
+
+// Weight of a new probe in the moving average of the latency
+#define UPSTREAM_PROBE_ALPHA 0.25f
+
+static struct probe_target targets[UPSTREAM_PROBE_MAX] = {{{{ 0 }}, { 0 }, 0, 0, 0, 0, { 0 }, 0, false, false, 0u, 0.0f }};
+static unsigned int ntargets = 0u;
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool init_upstream_probe(void)
+{
+	return config.upstream_probe_interval > 0u;
+}
+
+// Needs probe_lock
+static struct probe_target *find_target(const char *ip, const in_port_t port)
+{
+	for(unsigned int i = 0; i < ntargets; i++)
+		if(targets[i].port == port && strcmp(targets[i].ip, ip) == 0)
+			return &targets[i];
+	return NULL;
+}
+
+void upstream_probe_register(const struct sockaddr *addr, const char *ip, const in_port_t port)
+{
+	if(!init_upstream_probe())
+		return;
+
+	const time_t now = time(NULL);
+	pthread_mutex_lock(&probe_lock);
+	struct probe_target *target = find_target(ip, port);
+	if(target == NULL && ntargets < UPSTREAM_PROBE_MAX)
+	{
+		target = &targets[ntargets++];
+		memset(target, 0, sizeof(*target));
+		memcpy(&target->addr, addr, addr->sa_family == AF_INET ?
+		       sizeof(target->addr.in) : sizeof(target->addr.in6));
+		strncpy(target->ip, ip, sizeof(target->ip) - 1);
+		target->port = port;
+		target->replied = now;
+		target->next_probe = now + config.upstream_probe_interval;
+	}
+	if(target != NULL)
+		target->registered = now;
+	pthread_mutex_unlock(&probe_lock);
+}
+
+// A client query was answered, the server needs no probe for a while
+void upstream_probe_replied(const char *ip, const in_port_t port)
+{
+	if(!init_upstream_probe())
+		return;
+
+	pthread_mutex_lock(&probe_lock);
+	struct probe_target *target = find_target(ip, port);
+	if(target != NULL)
+	{
+		target->replied = time(NULL);
+		target->failures = 0u;
+		if(target->down)
+		{
+			target->down = false;
+			logg("Upstream server %s#%u is answering again", target->ip, target->port);
+		}
+	}
+	pthread_mutex_unlock(&probe_lock);
+}
+
+enum probe_state upstream_probe_state(const char *ip, const in_port_t port, float *rtt)
+{
+	if(!init_upstream_probe())
+		return PROBE_UNKNOWN;
+
+	enum probe_state state = PROBE_UNKNOWN;
+	pthread_mutex_lock(&probe_lock);
+	const struct probe_target *target = find_target(ip, port);
+	if(target != NULL)
+	{
+		if(target->down)
+			state = PROBE_DOWN;
+		else if(target->rtt > 0.0f)
+			state = PROBE_UP;
+		if(rtt != NULL)
+			*rtt = target->rtt;
+	}
+	pthread_mutex_unlock(&probe_lock);
+	return state;
+}
+
+static double elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return 1e3*(now.tv_sec - start->tv_sec) + 1e-6*(now.tv_nsec - start->tv_nsec);
+}
+
+// Send a query for ". IN NS", needs probe_lock
+static void send_probe(struct probe_target *target, const int sock, const time_t now)
+{
+	unsigned char packet[17] = { 0 };
+	target->id = (unsigned short)random();
+	packet[0] = target->id >> 8;
+	packet[1] = target->id & 0xff;
+	packet[2] = 0x01; // RD
+	packet[5] = 1;    // QDCOUNT
+	packet[12] = 0;   // root
+	packet[14] = 2;   // NS
+	packet[16] = 1;   // IN
+
+	const socklen_t len = target->addr.sa.sa_family == AF_INET ?
+	                      sizeof(target->addr.in) : sizeof(target->addr.in6);
+	clock_gettime(CLOCK_MONOTONIC, &target->sent);
+	target->next_probe = now + config.upstream_probe_interval;
+	if(sock > -1 && sendto(sock, packet, sizeof(packet), 0, &target->addr.sa, len) == (ssize_t)sizeof(packet))
+		target->pending = true;
+	else
+		target->failures++;
+}
+
+// Needs probe_lock
+static void probe_lost(struct probe_target *target)
+{
+	target->pending = false;
+	if(++target->failures >= UPSTREAM_PROBE_FAILURES && !target->down)
+	{
+		target->down = true;
+		logg("WARNING: Upstream server %s#%u is not answering probes, not using it until it does",
+		     target->ip, target->port);
+	}
+}
+
+static void receive_probe(const int sock)
+{
+	unsigned char packet[512];
+	union {
+		struct sockaddr sa;
+		struct sockaddr_in in;
+		struct sockaddr_in6 in6;
+	} from;
+	socklen_t fromlen = sizeof(from);
+	const ssize_t len = recvfrom(sock, packet, sizeof(packet), MSG_DONTWAIT, &from.sa, &fromlen);
+	// Need a reply (QR) with a header
+	if(len < 12 || !(packet[2] & 0x80))
+		return;
+
+	const unsigned short id = (packet[0] << 8) | packet[1];
+	const unsigned char rcode = packet[3] & 0x0f;
+
+	char ip[INET6_ADDRSTRLEN] = { 0 };
+	in_port_t port;
+	if(from.sa.sa_family == AF_INET)
+	{
+		inet_ntop(AF_INET, &from.in.sin_addr, ip, INET6_ADDRSTRLEN);
+		port = ntohs(from.in.sin_port);
+	}
+	else
+	{
+		inet_ntop(AF_INET6, &from.in6.sin6_addr, ip, INET6_ADDRSTRLEN);
+		port = ntohs(from.in6.sin6_port);
+	}
+	strtolower(ip);
+
+	pthread_mutex_lock(&probe_lock);
+	struct probe_target *target = find_target(ip, port);
+	if(target != NULL && target->pending && target->id == id)
+	{
+		target->pending = false;
+		// SERVFAIL and REFUSED mean the server cannot resolve for us
+		if(rcode == 2 || rcode == 5)
+			probe_lost(target);
+		else
+		{
+			const float rtt = elapsed_ms(&target->sent);
+			target->rtt = target->rtt > 0.0f ? target->rtt + UPSTREAM_PROBE_ALPHA * (rtt - target->rtt) : rtt;
+			target->failures = 0u;
+			if(target->down)
+			{
+				target->down = false;
+				logg("Upstream server %s#%u is answering probes again (%.1f ms)",
+				     target->ip, target->port, rtt);
+			}
+		}
+	}
+	pthread_mutex_unlock(&probe_lock);
+}
+
+void *upstream_probe_thread(void *val)
+{
+	(void)val;
+
+	// Set thread name
+	thread_names[PROBE] = "probe";
+	prctl(PR_SET_NAME, thread_names[PROBE], 0, 0, 0);
+	thread_sched_apply(PROBE);
+
+	struct pollfd fds[2] = {
+		{ .fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0), .events = POLLIN },
+		{ .fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0), .events = POLLIN },
+	};
+	if(fds[0].fd < 0 && fds[1].fd < 0)
+	{
+		logg("WARNING: Cannot create sockets for upstream probes: %s", strerror(errno));
+		return NULL;
+	}
+
+	while(!killed)
+	{
+		const time_t now = time(NULL);
+
+		pthread_mutex_lock(&probe_lock);
+		for(unsigned int i = 0; i < ntargets; i++)
+		{
+			struct probe_target *target = &targets[i];
+
+			// Forget servers which are no longer configured
+			if(now - target->registered > UPSTREAM_PROBE_STALE)
+			{
+				targets[i--] = targets[--ntargets];
+				continue;
+			}
+
+			if(target->pending && elapsed_ms(&target->sent) >= 1e3*UPSTREAM_PROBE_TIMEOUT)
+				probe_lost(target);
+
+			// Only idle servers are probed, servers marked as down get
+			// no client queries
+			if(!target->pending && now >= target->next_probe &&
+			   (target->down || now - target->replied >= (time_t)config.upstream_probe_interval))
+				send_probe(target, target->addr.sa.sa_family == AF_INET ? fds[0].fd : fds[1].fd, now);
+		}
+		pthread_mutex_unlock(&probe_lock);
+
+		// Wait for replies for up to a second
+		if(poll(fds, 2, 1000) > 0)
+			for(unsigned int i = 0; i < 2; i++)
+				if(fds[i].revents & POLLIN)
+					receive_probe(fds[i].fd);
+	}
+
+	for(unsigned int i = 0; i < 2; i++)
+		if(fds[i].fd > -1)
+			close(fds[i].fd);
+
+	logg("Terminating upstream probe thread");
+	return NULL;
+}
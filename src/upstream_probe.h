@@ -0,0 +1,40 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Upstream health probing prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef UPSTREAM_PROBE_H
+#define UPSTREAM_PROBE_H
+
+#include <stdbool.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// Maximum number of probed upstream servers
+#define UPSTREAM_PROBE_MAX 32
+// Time to wait for the reply to a probe [seconds]
+#define UPSTREAM_PROBE_TIMEOUT 2
+// Consecutive lost probes marking a server as down
+#define UPSTREAM_PROBE_FAILURES 2
+// Servers not selectable for this long are no longer probed [seconds]
+#define UPSTREAM_PROBE_STALE 600
+
+enum probe_state {
+	PROBE_UNKNOWN,
+	PROBE_UP,
+	PROBE_DOWN
+} __attribute__ ((packed));
+
+bool init_upstream_probe(void) __attribute__((pure));
+void *upstream_probe_thread(void *val);
+
+// Called by the resolver
+void upstream_probe_register(const struct sockaddr *addr, const char *ip, const in_port_t port);
+void upstream_probe_replied(const char *ip, const in_port_t port);
+enum probe_state upstream_probe_state(const char *ip, const in_port_t port, float *rtt);
+
+#endif //UPSTREAM_PROBE_H
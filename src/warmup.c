@@ -0,0 +1,223 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Verdict cache warm-up
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#define FTLDNS
+#include "dnsmasq/dnsmasq.h"
+#undef __USE_XOPEN
+#include "FTL.h"
+#include "warmup.h"
+#include "dnsmasq_interface.h"
+#include "config.h"
+#include "log.h"
+// counters, lock_shm()
+#include "shmem.h"
+// gravityDB_prepare_client_statements()
+#include "database/gravity-db.h"
+
+// Whenever the lists have been (re)loaded, a new epoch of FTL's DNS cache is
+// started and every domain has to be checked against the lists again the first
+// time it is queried. Instead of letting the clients wait for this, the
+// verdicts of the VERDICT_WARMUP most frequently queried domains are computed
+// beforehand for the group sets of all clients with queries in memory, both for
+// A and AAAA queries. On startup, the counts of the domains come from the
+// history imported from the long-term database.
+//
+// This is done by the resolver in batches of WARMUP_BATCH verdicts between the
+// queries it answers, the verdicts are shared with all clients through the
+// verdict cache (see get_cached_verdict()). Warming up starts over when another
+// epoch is started before it has finished
+
+static const enum query_types warmup_types[] = { TYPE_A, TYPE_AAAA };
+#define NUM_WARMUP_TYPES (sizeof(warmup_types)/sizeof(warmup_types[0]))
+
+static unsigned int warm_epoch = 0u;
+static bool pending = false;
+
+// Most frequently queried domains (a min-heap of their counts while they are
+// selected) and the clients representing the group sets
+static struct warmup_domain {
+	int domainID;
+	int count;
+} *domains = NULL;
+static unsigned int num_domains = 0u;
+static int groupsets[WARMUP_GROUPSETS] = { 0 };
+static unsigned int num_groupsets = 0u;
+
+// Progress of the warm-up
+static int next_client = 0;
+static unsigned int next_verdict = 0u;
+static unsigned int computed = 0u;
+
+static void sift_down(unsigned int i)
+{
+	while(true)
+	{
+		unsigned int min = i;
+		const unsigned int l = 2*i + 1, r = 2*i + 2;
+		if(l < num_domains && domains[l].count < domains[min].count)
+			min = l;
+		if(r < num_domains && domains[r].count < domains[min].count)
+			min = r;
+		if(min == i)
+			return;
+
+		const struct warmup_domain tmp = domains[i];
+		domains[i] = domains[min];
+		domains[min] = tmp;
+		i = min;
+	}
+}
+
+static int __attribute__((pure)) cmp_count(const void *a, const void *b)
+{
+	const int count_a = ((const struct warmup_domain *)a)->count;
+	const int count_b = ((const struct warmup_domain *)b)->count;
+	return count_a < count_b ? 1 : count_a > count_b ? -1 : 0;
+}
+
+// Select the most frequently queried domains, the most frequent one first
+static bool select_domains(void)
+{
+	struct warmup_domain *new = realloc(domains, config.verdict_warmup * sizeof(*domains));
+	if(new == NULL)
+		return false;
+	domains = new;
+	num_domains = 0u;
+
+	for(int domainID = 0; domainID < counters->domains; domainID++)
+	{
+		const domainsData *domain = getDomain(domainID, true);
+		if(domain == NULL || domain->count <= 0)
+			continue;
+
+		if(num_domains < config.verdict_warmup)
+		{
+			domains[num_domains].domainID = domainID;
+			domains[num_domains].count = domain->count;
+			if(++num_domains == config.verdict_warmup)
+				for(unsigned int i = num_domains / 2; i-- > 0;)
+					sift_down(i);
+		}
+		else if(domain->count > domains[0].count)
+		{
+			domains[0].domainID = domainID;
+			domains[0].count = domain->count;
+			sift_down(0);
+		}
+	}
+
+	qsort(domains, num_domains, sizeof(*domains), cmp_count);
+	return num_domains > 0u;
+}
+
+// Find one client of every group set. The groups of clients which have not
+// sent a query since the lists were reloaded are determined here, this is what
+// their next query would do otherwise. Returns true when all clients have been
+// looked at
+static bool select_groupsets(unsigned int *budget)
+{
+	for(; next_client < counters->clients; next_client++)
+	{
+		if(*budget == 0u || num_groupsets == WARMUP_GROUPSETS)
+			return num_groupsets == WARMUP_GROUPSETS;
+
+		clientsData *client = getClient(next_client, true);
+		if(client == NULL || client->count <= 0 || client->flags.aliasclient)
+			continue;
+
+		if(!client->flags.found_group)
+		{
+			(*budget)--;
+			if(!gravityDB_prepare_client_statements(client))
+				continue;
+		}
+
+		bool known = false;
+		for(unsigned int i = 0; i < num_groupsets; i++)
+		{
+			const clientsData *other = getClient(groupsets[i], true);
+			if(other != NULL && other->groupspos == client->groupspos)
+				known = true;
+		}
+		if(!known)
+			groupsets[num_groupsets++] = next_client;
+	}
+
+	return true;
+}
+
+// Called in every iteration of dnsmasq's main loop. Returns the time [ms] until
+// the next call is needed or -1 if there is nothing to do
+int FTL_verdict_warmup(void)
+{
+	if(config.verdict_warmup == 0u || config.verdict_cache_size == 0u)
+		return -1;
+
+	// Nothing to do until the next epoch is started
+	if(!pending && counters->dns_cache_epoch == warm_epoch)
+		return -1;
+
+	lock_shm();
+
+	// Start over when a new epoch has been started
+	if(counters->dns_cache_epoch != warm_epoch)
+	{
+		warm_epoch = counters->dns_cache_epoch;
+		pending = select_domains();
+		num_groupsets = 0u;
+		next_client = 0;
+		next_verdict = 0u;
+		computed = 0u;
+	}
+
+	if(!pending)
+	{
+		unlock_shm();
+		return -1;
+	}
+
+	unsigned int budget = WARMUP_BATCH;
+	if(!select_groupsets(&budget))
+	{
+		unlock_shm();
+		return 0;
+	}
+
+	const unsigned int num_verdicts = num_domains * num_groupsets * NUM_WARMUP_TYPES;
+	for(; next_verdict < num_verdicts && budget > 0u; next_verdict++)
+	{
+		const unsigned int type = next_verdict % NUM_WARMUP_TYPES;
+		const unsigned int groupset = (next_verdict / NUM_WARMUP_TYPES) % num_groupsets;
+		const unsigned int domain = next_verdict / NUM_WARMUP_TYPES / num_groupsets;
+
+		// The client may have been reclaimed in the meantime
+		clientsData *client = getClient(groupsets[groupset], true);
+		if(client == NULL || !client->flags.found_group)
+			continue;
+
+		budget--;
+		if(FTL_warm_verdict(domains[domain].domainID, client, warmup_types[type]))
+			computed++;
+	}
+
+	if(next_verdict < num_verdicts)
+	{
+		unlock_shm();
+		return 0;
+	}
+
+	pending = false;
+	if(config.debug & DEBUG_QUERIES)
+		logg("Verdict cache warmed up: %u verdicts computed for %u domains and %u group sets",
+		     computed, num_domains, num_groupsets);
+
+	unlock_shm();
+	return -1;
+}
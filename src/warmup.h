@@ -0,0 +1,26 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Verdict cache warm-up prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include "datastructure.h"
+
+// Number of verdicts computed in one iteration of the resolver's main loop
+#define WARMUP_BATCH 32
+
+// Maximum number of group sets the verdicts are computed for
+#define WARMUP_GROUPSETS 16
+
+// Defined in dnsmasq_interface.c
+bool FTL_warm_verdict(const int domainID, clientsData *client, const enum query_types query_type);
+
+// FTL_verdict_warmup() is called by dnsmasq and declared in dnsmasq_interface.h
+
+#endif //WARMUP_H
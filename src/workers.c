@@ -0,0 +1,193 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  DNS worker processes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#define FTLDNS
+#include "dnsmasq/dnsmasq.h"
+#undef __USE_XOPEN
+#include "FTL.h"
+#include "workers.h"
+#include "dnsmasq_interface.h"
+#include "config.h"
+#include "log.h"
+// get_workers_generation()
+#include "shmem.h"
+// main_pid()
+#include "signals.h"
+// dnsmasq_debug
+#include "args.h"
+// disable_statsqueue()
+#include "statsqueue.h"
+// FTL_udp_batch_forked()
+#include "udpbatch.h"
+// pktdump_forked()
+#include "pktdump.h"
+// gravityDB_forked()
+#include "database/gravity-db.h"
+// handover_draining()
+#include "handover.h"
+
+// dnsmasq answers all UDP queries in a single event loop. When DNS_WORKERS is
+// set, the main process forks this many workers which answer UDP queries
+// received on the listening sockets they share with the main process (the
+// kernel wakes up all processes waiting for a socket, the first one reads the
+// datagram). Workers have their own dnsmasq cache and upstream sockets, they
+// share FTL's shared memory objects (statistics, caches of blocking decisions)
+// with the main process in the same way as TCP workers do.
+//
+// Everything else (the lists, the blocking status, the upstream servers, ...)
+// is a copy of the main process' state at the time the worker was forked.
+// Whenever this state changes, the main process advances the workers
+// generation. Workers notice this and terminate, the main process forks new
+// ones with the current state
+unsigned int dns_worker = 0u;
+
+static struct {
+	pid_t pid;
+	time_t started;
+} workers[DNS_WORKERS_MAX + 1] = {{ 0 }};
+
+// Generation of the state the most recently forked worker has been created
+// with, it is inherited by the worker
+static unsigned int fork_generation = 0u;
+
+static unsigned long workers_started = 0u;
+
+// Queries of the main process and of the workers may have identical dnsmasq
+// IDs. The index of the process is stored in the lowest bits of FTL's IDs
+int dns_worker_query_id(const int id)
+{
+	if(config.dns_workers == 0)
+		return id;
+
+	return (int)(((unsigned int)id << DNS_WORKER_ID_BITS) | dns_worker);
+}
+
+// Called in every iteration of dnsmasq's main loop. Returns the index of a
+// worker which is to be forked now or zero
+int FTL_dns_worker_slot(void)
+{
+	if(config.dns_workers == 0 || dnsmasq_debug || getpid() != main_pid() || handover_draining())
+		return 0;
+
+	// Upstream servers with a fixed source address or port use sockets
+	// shared by all processes. Replies could be received by the wrong one
+	if(daemon->sfds != NULL)
+	{
+		static bool warned = false;
+		if(!warned)
+			logg("WARNING: DNS workers disabled as upstream servers use fixed source addresses");
+		warned = true;
+		return 0;
+	}
+
+	const time_t now = time(NULL);
+	for(unsigned int i = 1; i <= config.dns_workers; i++)
+	{
+		if(workers[i].pid != 0 || now - workers[i].started < DNS_WORKER_RESTART_DELAY)
+			continue;
+
+		// Remember when we tried to start this worker, this limits the
+		// rate of restarts if forking fails or the worker dies
+		workers[i].started = now;
+		fork_generation = get_workers_generation();
+		return (int)i;
+	}
+
+	return 0;
+}
+
+// Called in the main process after a worker has been forked
+void FTL_dns_worker_forked(const int slot, const pid_t pid)
+{
+	workers[slot].pid = pid;
+	workers_started++;
+
+	if(config.debug != 0)
+		logg("Started DNS worker %i (PID %i)", slot, (int)pid);
+}
+
+// Called in the main process when a child process has terminated
+void FTL_dns_worker_exited(const pid_t pid)
+{
+	for(unsigned int i = 1; i <= DNS_WORKERS_MAX; i++)
+	{
+		if(workers[i].pid != pid)
+			continue;
+
+		workers[i].pid = 0;
+		if(config.debug != 0)
+			logg("DNS worker %u (PID %i) terminated", i, (int)pid);
+		return;
+	}
+}
+
+// Called in a freshly forked worker
+void FTL_dns_worker_init(const int slot)
+{
+	dns_worker = (unsigned int)slot;
+
+	// Terminate together with the main process. SIGALRM terminates forks
+	// gracefully (see sig_handler() in dnsmasq.c)
+	prctl(PR_SET_PDEATHSIG, SIGALRM);
+	if(getppid() != main_pid())
+		_exit(0);
+
+	// The main process' statistics queue, UDP batches, packet dump buffer
+	// and database connection are none of our business
+	disable_statsqueue();
+	FTL_udp_batch_forked();
+	pktdump_forked();
+	gravityDB_forked();
+}
+
+// Has the state of the main process changed since this worker was forked?
+bool FTL_dns_worker_stale(void)
+{
+	return dns_worker != 0 && get_workers_generation() != fork_generation;
+}
+
+// Terminate this worker
+void FTL_dns_worker_exit(void)
+{
+	FTL_TCP_worker_terminating(true);
+	flush_log();
+	_exit(0);
+}
+
+// Restart all workers, e.g., because the lists have been reloaded
+void restart_dns_workers(void)
+{
+	if(config.dns_workers > 0)
+		next_workers_generation();
+}
+
+// Called by dnsmasq when its configuration, servers or listeners change
+void FTL_restart_dns_workers(void)
+{
+	restart_dns_workers();
+}
+
+// Index of the worker with this PID, zero if it is no worker
+unsigned int get_dns_worker_index(const pid_t pid)
+{
+	for(unsigned int i = 1; i <= DNS_WORKERS_MAX; i++)
+		if(workers[i].pid == pid)
+			return i;
+	return 0u;
+}
+
+void get_dns_workers_stats(struct dns_workers_stats *stats)
+{
+	stats->running = 0u;
+	for(unsigned int i = 1; i <= DNS_WORKERS_MAX; i++)
+		if(workers[i].pid != 0)
+			stats->running++;
+	stats->started = workers_started;
+}
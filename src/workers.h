@@ -0,0 +1,40 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  DNS worker process prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Maximum number of DNS workers, the index of the worker (zero for the main
+// process) is stored in the lowest DNS_WORKER_ID_BITS of FTL's query IDs
+#define DNS_WORKER_ID_BITS 4
+#define DNS_WORKERS_MAX ((1 << DNS_WORKER_ID_BITS) - 1)
+
+// Minimum delay between two starts of the same worker [seconds]
+#define DNS_WORKER_RESTART_DELAY 1
+
+struct dns_workers_stats {
+	unsigned int running;
+	unsigned long started;
+};
+
+// Index of the worker this process is, zero in the main process
+extern unsigned int dns_worker;
+
+int dns_worker_query_id(const int id) __attribute__((pure));
+void restart_dns_workers(void);
+void get_dns_workers_stats(struct dns_workers_stats *stats);
+unsigned int get_dns_worker_index(const pid_t pid) __attribute__((pure));
+
+// FTL_dns_worker_slot() and the other functions called by dnsmasq are
+// declared in dnsmasq_interface.h
+
+#endif //WORKERS_H
@@ -0,0 +1,120 @@
+#!/usr/bin/env bash
+# Pi-hole: A black hole for Internet advertisements
+# (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+# Network-wide ad blocking via your own hardware.
+#
+# FTL Engine
+# Time the gravity, exact and regex list lookups for several list sizes and
+# gravity backends
+#
+# This file is copyright under the latest version of the EUPL.
+# Please see LICENSE file for your rights under this license.
+#
+# Usage: test/benchmark-lists.sh [pihole-FTL] ["gravity sizes"] ["regex counts"]
+
+set -e
+
+FTL="${1:-./pihole-FTL}"
+SIZES="${2:-100000 1000000 5000000}"
+REGEXES="${3:-10 100 1000 5000}"
+# Number of domains checked, each of them is checked three times (one cold and
+# two warm passes)
+CORPUS=20000
+
+dir="$(mktemp -d)"
+trap 'rm -rf "${dir}"' EXIT
+
+# Gravity database: the schema of the test database, synthetic content.
+# gravity(size, regex)
+gravity() {
+	{
+		sed '/vvv Test content following vvv/q' "$(dirname "$0")/gravity.db.sql"
+		cat <<EOF
+INSERT INTO adlist (id,address,number,status) VALUES (1,'https://example.com/adlist.txt',$1,2);
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < $1)
+  INSERT INTO gravity (domain,adlist_id) SELECT 'ad' || i || '.tracker' || (i % 997) || '.com', 1 FROM n;
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < $1 / 100)
+  INSERT INTO gravity (domain,adlist_id) SELECT '||abp' || i || '.net^', 1 FROM n;
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < 1000)
+  INSERT INTO domainlist (type,domain) SELECT 1, 'black' || i || '.example.com' FROM n;
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < 1000)
+  INSERT INTO domainlist (type,domain) SELECT 0, 'white' || i || '.example.com' FROM n;
+-- Index created by gravity.sh after downloading the lists
+CREATE INDEX idx_gravity ON gravity (domain, adlist_id);
+INSERT INTO info VALUES('gravity_count',$1);
+INSERT INTO info VALUES('abp_domains',0);
+COMMIT;
+EOF
+	} | "${FTL}" sqlite3 "$2"
+}
+
+# Replace the regex filters of a database by n blacklist and n/5 whitelist regex
+# regex(db, n)
+regex() {
+	"${FTL}" sqlite3 "$1" <<EOF
+DELETE FROM domainlist WHERE type IN (2,3);
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < $2)
+  INSERT INTO domainlist (type,domain) SELECT 3, '(^|\.)ads?[0-9]*\.net' || i || '\.(com|net)$' FROM n;
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < $2 / 5 + 1)
+  INSERT INTO domainlist (type,domain) SELECT 2, '^allowed[0-9]+\.net' || i || '\.com$' FROM n;
+EOF
+}
+
+# Corpus: gravity hits, subdomains of ABP entries, exact black- and whitelist
+# hits, regex hits and unique names
+corpus() {
+	awk -v n="${CORPUS}" -v gravity="$1" -v regex="$2" 'BEGIN {
+		srand(42)
+		for(i = 0; i < n; i++) {
+			r = rand()
+			if(r < 0.30) {
+				j = 1 + int(gravity * rand())
+				print "ad" j ".tracker" (j % 997) ".com"
+			} else if(r < 0.35)
+				print "cdn" i ".abp" (1 + int(gravity / 100 * rand())) ".net"
+			else if(r < 0.37)
+				print "black" (1 + int(1000 * rand())) ".example.com"
+			else if(r < 0.39)
+				print "white" (1 + int(1000 * rand())) ".example.com"
+			else if(r < 0.44)
+				print "ads" int(100 * rand()) ".net" (1 + int(regex * rand())) ".com"
+			else
+				print "u" i ".random" int(1000 * rand()) ".org"
+		}
+	}' > "${dir}/corpus.txt"
+}
+
+printf 'GRAVITY_IN_MEMORY=true\n' > "${dir}/memory.conf"
+printf 'GRAVITY_IN_MEMORY=false\n' > "${dir}/sqlite.conf"
+printf 'GRAVITY_IN_MEMORY=false\nGRAVITY_MMAP=2047\n' > "${dir}/mmap.conf"
+
+run() {
+	"${FTL}" benchmark-lists -p 3 -c "${dir}/$2.conf" -d "$1" "${dir}/corpus.txt"
+	echo
+}
+
+# Gravity size and backend with 100 regex, exact and ABP-style gravity matching
+for size in ${SIZES}; do
+	echo "=== ${size} gravity domains ==="
+	gravity "${size}" "${dir}/gravity.db"
+	regex "${dir}/gravity.db" 100
+	corpus "${size}" 100
+	for abp in 0 1; do
+		"${FTL}" sqlite3 "${dir}/gravity.db" "UPDATE info SET value = ${abp} WHERE property = 'abp_domains';"
+		for backend in memory sqlite mmap; do
+			echo "--- ${backend}, ABP-style matching: ${abp} ---"
+			run "${dir}/gravity.db" "${backend}"
+		done
+	done
+	rm "${dir}/gravity.db"
+done
+
+# Number of regex filters
+size="${SIZES%% *}"
+gravity "${size}" "${dir}/gravity.db"
+for n in ${REGEXES}; do
+	echo "=== ${n} regex filters ==="
+	regex "${dir}/gravity.db" "${n}"
+	corpus "${size}" "${n}"
+	run "${dir}/gravity.db" memory
+done
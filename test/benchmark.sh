@@ -0,0 +1,80 @@
+#!/usr/bin/env bash
+# Pi-hole: A black hole for Internet advertisements
+# (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+# Network-wide ad blocking via your own hardware.
+#
+# FTL Engine
+# Replay a synthetic query trace through FTL's query pipeline
+#
+# This file is copyright under the latest version of the EUPL.
+# Please see LICENSE file for your rights under this license.
+#
+# Usage: test/benchmark.sh [pihole-FTL] [queries] [gravity domains] [regex] [clients]
+
+set -e
+
+FTL="${1:-./pihole-FTL}"
+QUERIES="${2:-200000}"
+GRAVITY="${3:-1000000}"
+REGEX="${4:-50}"
+CLIENTS="${5:-250}"
+# Number of distinct permitted domains, they are queried with a skewed
+# popularity so most of them end up in FTL's caches
+POPULAR=20000
+
+dir="$(mktemp -d)"
+trap 'rm -rf "${dir}"' EXIT
+
+# Gravity database: the schema of the test database, synthetic content
+{
+	sed '/vvv Test content following vvv/q' "$(dirname "$0")/gravity.db.sql"
+	cat <<EOF
+INSERT INTO adlist (id,address,number,status) VALUES (1,'https://example.com/adlist.txt',${GRAVITY},2);
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < ${GRAVITY})
+  INSERT INTO gravity (domain,adlist_id) SELECT 'ad' || i || '.tracker' || (i % 997) || '.com', 1 FROM n;
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < ${REGEX})
+  INSERT INTO domainlist (type,domain) SELECT 3, '(^|\.)ads?[0-9]*\.' || 'net' || i || '\.(com|net)$' FROM n;
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < ${REGEX} / 5 + 1)
+  INSERT INTO domainlist (type,domain) SELECT 0, 'allowed' || i || '.tracker' || i || '.com' FROM n;
+WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i < ${CLIENTS} / 10 + 1)
+  INSERT INTO client (ip) SELECT '10.0.' || (i / 256) || '.' || (i % 256) FROM n;
+-- Index created by gravity.sh after downloading the lists
+CREATE INDEX idx_gravity ON gravity (domain, adlist_id);
+INSERT INTO info VALUES('gravity_count',${GRAVITY});
+COMMIT;
+EOF
+} | "${FTL}" sqlite3 "${dir}/gravity.db"
+
+# Query trace: most queries are permitted domains with a skewed popularity,
+# answered from the cache once they have been seen, some are gravity and regex
+# hits and some are unique names
+awk -v n="${QUERIES}" -v gravity="${GRAVITY}" -v regex="${REGEX}" \
+    -v clients="${CLIENTS}" -v popular="${POPULAR}" 'BEGIN {
+	srand(42)
+	split("A A A A AAAA AAAA HTTPS PTR TXT", types, " ")
+	for(i = 0; i < n; i++) {
+		client = int(clients * rand() ^ 2)
+		type = types[1 + int(9 * rand())]
+		r = rand()
+		if(r < 0.70) {
+			domain = "site" int(popular * rand() ^ 3) ".example.org"
+			kind = seen[domain type]++ ? "cache" : "forward"
+		} else if(r < 0.85) {
+			j = 1 + int(gravity * rand())
+			domain = "ad" j ".tracker" (j % 997) ".com"
+			kind = "forward"
+		} else if(r < 0.90) {
+			domain = "ads" int(100 * rand()) ".net" (1 + int(regex * rand())) ".com"
+			kind = "forward"
+		} else if(r < 0.97) {
+			domain = "u" i ".random" int(1000 * rand()) ".net"
+			kind = "forward"
+		} else {
+			domain = "nx" i ".invalid"
+			kind = "nxdomain"
+		}
+		printf "10.0.%d.%d %s %s %s\n", client / 256, client % 256, type, domain, kind
+	}
+}' > "${dir}/trace.txt"
+
+"${FTL}" benchmark -d "${dir}/gravity.db" "${dir}/trace.txt"
@@ -0,0 +1,72 @@
+#!/usr/bin/env bash
+# Pi-hole: A black hole for Internet advertisements
+# (c) 2023 Pi-hole, LLC (https://pi-hole.net)
+# Network-wide ad blocking via your own hardware.
+#
+# FTL Engine
+# Training workload of the profile-guided build (make pihole-FTL-pgo): the
+# query replay and list benchmarks and, when running as root, the API
+# benchmark against the instrumented binary running in private mount and
+# network namespaces (so it cannot interfere with an installed Pi-hole)
+#
+# This file is copyright under the latest version of the EUPL.
+# Please see LICENSE file for your rights under this license.
+#
+# Usage: test/pgo-train.sh <pihole-FTL>
+
+set -e
+
+FTL="$(realpath "${1:-./pihole-FTL}")"
+TEST="$(dirname "$(realpath "$0")")"
+
+# Query pipeline (and SQLite3 while creating the gravity database)
+"${TEST}/benchmark.sh" "${FTL}" 100000 200000 50 250
+
+# Gravity, exact and regex list lookups
+"${TEST}/benchmark-lists.sh" "${FTL}" "100000" "10 100"
+
+if [[ "$(id -u)" != "0" ]] || ! command -v unshare > /dev/null || ! command -v ip > /dev/null; then
+	echo "Skipping the API training (needs root, unshare and ip)"
+	exit 0
+fi
+
+dir="$(mktemp -d)"
+trap 'rm -rf "${dir}"' EXIT
+"${FTL}" sqlite3 "${dir}/gravity.db" < "${TEST}/gravity.db.sql"
+echo "BLOCKING_ENABLED=true" > "${dir}/setupVars.conf"
+cat > "${dir}/pihole-FTL.conf" <<EOT
+LOGFILE=${dir}/FTL.log
+PIDFILE=${dir}/pihole-FTL.pid
+PORTFILE=${dir}/pihole-FTL.port
+SOCKETFILE=${dir}/FTL.sock
+DBFILE=${dir}/pihole-FTL.db
+GRAVITYDB=${dir}/gravity.db
+SETUPVARSFILE=${dir}/setupVars.conf
+MACVENDORDB=${dir}/macvendor.db
+EOT
+
+# The instrumented binary writes its profile when it exits, the DNS queries
+# of the API benchmark are answered by FTL itself (no upstream servers)
+unshare --mount --net --propagation private bash -e -s "${FTL}" "${dir}" <<'EOT'
+FTL="$1"
+dir="$2"
+ip link set lo up
+mount -t tmpfs tmpfs /dev/shm
+# Hide the config of an installed Pi-hole, FTL then reads pihole-FTL.conf
+# from the working directory
+if [[ -d /etc/pihole ]]; then
+	mount -t tmpfs tmpfs /etc/pihole
+fi
+cd "${dir}"
+"${FTL}" -f -- -p 53 --conf-file=/dev/null --no-resolv --address=/#/192.0.2.1 \
+                --listen-address=127.0.0.1 --bind-interfaces > "${dir}/dnsmasq.log" 2>&1 &
+pid=$!
+for i in $(seq 1 30); do
+	[[ -S "${dir}/FTL.sock" ]] && break
+	sleep 1
+done
+"${FTL}" benchmark-api -s 127.0.0.1:4711 -n 8 -t 20 -q 127.0.0.1:53 -r 1000
+"${FTL}" benchmark-api -s "${dir}/FTL.sock" -n 4 -t 10
+kill -TERM "${pid}"
+wait "${pid}" || true
+EOT
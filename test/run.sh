@@ -56,6 +56,14 @@ cp test/dnsmasq.conf /etc/dnsmasq.conf
 # Prepare local powerDNS resolver
 bash test/pdns/setup.sh
 
+# Replay three days of traffic in accelerated time, the shared memory and the
+# RSS must not keep growing. This has to be done before FTL is started
+if ! ./pihole-FTL benchmark-soak > soak.log; then
+  echo "pihole-FTL benchmark-soak failed:"
+  grep "^#" soak.log
+  exit 1
+fi
+
 # Set restrictive umask
 OLDUMASK=$(umask)
 umask 0022
@@ -473,6 +473,23 @@
   [[ ${lines[28]} == "" ]]
 }
 
+@test "Unterminated request is answered" {
+  run bash -c 'printf ">stats" | timeout 2 nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == "domains_being_blocked 5" ]]
+}
+
+@test "Cluster statistics without peers match the local statistics" {
+  run bash -c 'echo ">cluster-stats >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == "dns_queries_today 54" ]]
+  [[ ${lines[2]} == "ads_blocked_today 15" ]]
+  [[ ${lines[4]} == "queries_forwarded 27" ]]
+  [[ ${lines[5]} == "queries_cached 12" ]]
+  [[ ${lines[8]} == "nodes 1" ]]
+  [[ ${lines[9]} == "nodes_stale 0" ]]
+}
+
 # Here and below: It is not meaningful to assume a particular order
 # here as the values are sorted before output. It is unpredictable in
 # which order they may come out. While this has always been the same
@@ -521,6 +538,35 @@
   [[ "${lines[@]}" == *" 1 ."* ]]
 }
 
+@test "Top domains of a client and top clients of a domain" {
+  run bash -c 'echo ">top-client-domains 127.0.0.1 (3) >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == "0 "* ]]
+  [[ ${lines[3]} == "2 "* ]]
+  [[ ${lines[4]} == "" ]]
+  run bash -c 'echo ">top-domain-clients gravity.ftl >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == "0 "* ]]
+}
+
+@test "Distinct domains and clients are estimated" {
+  run bash -c 'echo ">unique >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == "unique_domains "* ]]
+  [[ ${lines[2]} == "unique_clients "* ]]
+  [[ ${lines[2]} != "unique_clients 0" ]]
+}
+
+@test "Domains can be searched" {
+  run bash -c 'echo ">search-domains egex1 >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" == *"4 regex1.ftl"* ]]
+  run bash -c 'echo ">search-domains *.ftl (1) >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == *".ftl" ]]
+  [[ ${lines[2]} == "" ]]
+}
+
 @test "Top Ads" {
   run bash -c 'echo ">top-ads (20) >quit" | nc -v 127.0.0.1 4711'
   printf "%s\n" "${lines[@]}"
@@ -654,6 +700,15 @@
   [[ ${lines[2]} == "" ]]
 }
 
+@test "Get all queries (paginated) shows expected content" {
+  run bash -c 'echo ">getallqueries page 2 cursor 1 >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == *" TXT version.bind 127.0.0.1 3 2 6 "*" N/A -1 N/A#0 \"\" \"1\""* ]]
+  [[ ${lines[2]} == *" A blacklisted.ftl 127.0.0.1 5 2 4 "*" N/A 5 N/A#0 \"\" \"2\""* ]]
+  [[ ${lines[3]} == "cursor 3" ]]
+  [[ ${lines[4]} == "" ]]
+}
+
 @test "Recent blocked shows expected content" {
   run bash -c 'echo ">recentBlocked >quit" | nc -v 127.0.0.1 4711'
   printf "%s\n" "${lines[@]}"
@@ -661,19 +716,138 @@
   [[ ${lines[2]} == "" ]]
 }
 
+@test "Shared string statistics are reported" {
+  run bash -c 'echo ">strings >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == "strings: "* ]]
+  [[ ${lines[2]} == "bytes used: "* ]]
+  [[ ${lines[3]} == "bytes allocated: "* ]]
+  [[ ${lines[4]} == "last compaction freed: "* ]]
+  [[ ${lines[5]} == "total compaction freed: "* ]]
+  [[ ${lines[6]} == "" ]]
+}
+
+@test "Shared memory statistics are reported" {
+  run bash -c 'echo ">shmem >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == "resizes: "* ]]
+  [[ ${lines[2]} == "remaps: "* ]]
+  [[ ${lines[3]} == "bytes allocated: "* ]]
+  [[ ${lines[4]} == "" ]]
+}
+
+@test "Shared memory usage is broken down by object" {
+  run bash -c 'echo ">shmem-usage >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == "queries "* ]]
+  [[ "${lines[@]}" == *"dns_cache "* ]]
+  [[ "${lines[@]}" == *"overTime "* ]]
+  [[ ${lines[9]} == "remaps: "* ]]
+}
+
+@test "SHM lock statistics are reported" {
+  run bash -c 'echo ">lockstats >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" == *"_FTL_new_query "*"/dnsmasq_interface.c:"*" exclusive "* ]]
+  [[ "${lines[@]}" == *"process_request "*"/api/request.c:"*" shared "* ]]
+}
+
+@test "Database latency statistics are reported" {
+  run bash -c 'echo ">dblatency >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" == *"pihole-FTL.db begin "* ]]
+  [[ "${lines[@]}" == *"pihole-FTL.db commit "* ]]
+  [[ "${lines[@]}" == *"gravity.db read "* ]]
+}
+
+@test "Heap allocations are accounted by call site" {
+  run bash -c 'echo ">allocstats >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" == *" shmem.c:"* ]]
+  [[ "${lines[@]}" != *"disabled"* ]]
+}
+
+@test "Memory of the main process is broken down by mappings" {
+  run bash -c 'echo ">memory >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" == *" main FTL-queries "* ]]
+  [[ "${lines[@]}" == *" main heap-sqlite "* ]]
+  [[ "${lines[@]}" == *"0 all total "* ]]
+}
+
+@test "API responses can be compressed per connection" {
+  run bash -c 'printf ">compress zstd\n>compress deflate 6\n>quit\n" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == "compress none" ]]
+  [[ "${lines[@]}" == *"compress deflate 6"* ]]
+}
+
+@test "Housekeeping job durations are available and can be reset" {
+  run bash -c 'echo ">timers >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" == *"lists_reload "* ]]
+  run bash -c 'echo ">timers reset lists_reload >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[1]} == "Reset" ]]
+  run bash -c 'echo ">timers >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" != *"lists_reload "* ]]
+}
+
+@test "Query pipeline stage durations are available" {
+  run bash -c 'echo ">querystages >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" == *"client "* ]]
+  [[ "${lines[@]}" == *"blocking "* ]]
+  [[ "${lines[@]}" == *"dispatch "* ]]
+  [[ "${lines[@]}" == *"upstream "* ]]
+}
+
+@test "Metrics are exported in Prometheus format" {
+  run bash -c 'echo ">metrics >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" == *"# TYPE pihole_ftl_queries gauge"* ]]
+  [[ "${lines[@]}" == *"pihole_ftl_query_status{status=\"GRAVITY\"} "* ]]
+  [[ "${lines[@]}" == *"pihole_ftl_dnsmasq_dns_queries_forwarded "* ]]
+  [[ "${lines[@]}" == *"pihole_ftl_shm_bytes{segment=\"FTL-queries\"} "* ]]
+  [[ "${lines[@]}" == *"pihole_ftl_lock_wait_microseconds_bucket{"*"le=\"+Inf\"} "* ]]
+  run bash -c 'printf "GET /metrics HTTP/1.0\r\n\r\n" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" == *"HTTP/1.0 200 OK"* ]]
+  [[ "${lines[@]}" == *"# TYPE pihole_ftl_queries gauge"* ]]
+}
+
+@test "API command statistics are reported" {
+  run bash -c 'echo ">apistats >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" == *">stats "* ]]
+  [[ "${lines[@]}" == *">getallqueries-domain "* ]]
+  [[ "${lines[@]}" == *">apistats 0 0 0"* ]]
+}
+
+@test "Regex cost statistics are reported" {
+  run bash -c 'echo ">regexstats >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" == *"blacklist 6 "*" regex[0-9].ftl"* ]]
+  [[ "${lines[@]}" == *"whitelist 3 "*" regex2"* ]]
+}
+
 @test "pihole-FTL.db schema is as expected" {
   run bash -c './pihole-FTL sqlite3 /etc/pihole/pihole-FTL.db .dump'
   printf "%s\n" "${lines[@]}"
-  [[ "${lines[@]}" == *"CREATE TABLE IF NOT EXISTS \"query_storage\" (id INTEGER PRIMARY KEY AUTOINCREMENT, timestamp INTEGER NOT NULL, type INTEGER NOT NULL, status INTEGER NOT NULL, domain INTEGER NOT NULL, client INTEGER NOT NULL, forward INTEGER, additional_info INTEGER, reply_type INTEGER, reply_time REAL, dnssec INTEGER);"* ]]
-  [[ "${lines[@]}" == *"CREATE INDEX idx_queries_timestamps ON \"query_storage\" (timestamp);"* ]]
+  [[ "${lines[@]}" == *"CREATE TABLE IF NOT EXISTS \"query_storage\" (id INTEGER PRIMARY KEY AUTOINCREMENT, timestamp INTEGER NOT NULL, type INTEGER NOT NULL, status INTEGER NOT NULL, domain INTEGER NOT NULL, client INTEGER NOT NULL, forward INTEGER, additional_info INTEGER, reply_type INTEGER, reply_time REAL, dnssec INTEGER, sample INTEGER);"* ]]
+  [[ "${lines[@]}" == *"CREATE INDEX query_storage_timestamp_client_status_idx ON query_storage (timestamp, client, status);"* ]]
+  [[ "${lines[@]}" == *"CREATE INDEX query_storage_client_timestamp_idx ON query_storage (client, timestamp);"* ]]
+  [[ "${lines[@]}" == *"CREATE INDEX query_storage_status_timestamp_idx ON query_storage (status, timestamp);"* ]]
+  [[ "${lines[@]}" != *"idx_queries_timestamps"* ]]
   [[ "${lines[@]}" == *"CREATE TABLE ftl (id INTEGER PRIMARY KEY NOT NULL, value BLOB NOT NULL);"* ]]
   [[ "${lines[@]}" == *"CREATE TABLE counters (id INTEGER PRIMARY KEY NOT NULL, value INTEGER NOT NULL);"* ]]
   [[ "${lines[@]}" == *"CREATE TABLE IF NOT EXISTS \"network\" (id INTEGER PRIMARY KEY NOT NULL, hwaddr TEXT UNIQUE NOT NULL, interface TEXT NOT NULL, firstSeen INTEGER NOT NULL, lastQuery INTEGER NOT NULL, numQueries INTEGER NOT NULL, macVendor TEXT, aliasclient_id INTEGER);"* ]]
   [[ "${lines[@]}" == *"CREATE TABLE IF NOT EXISTS \"network_addresses\" (network_id INTEGER NOT NULL, ip TEXT UNIQUE NOT NULL, lastSeen INTEGER NOT NULL DEFAULT (cast(strftime('%s', 'now') as int)), name TEXT, nameUpdated INTEGER, FOREIGN KEY(network_id) REFERENCES network(id));"* ]]
   [[ "${lines[@]}" == *"CREATE TABLE aliasclient (id INTEGER PRIMARY KEY NOT NULL, name TEXT NOT NULL, comment TEXT);"* ]]
-  [[ "${lines[@]}" == *"INSERT INTO ftl VALUES(0,12);"* ]] # Expecting FTL database version 12
+  [[ "${lines[@]}" == *"INSERT INTO ftl VALUES(0,17);"* ]] # Expecting FTL database version 17
   # vvv This has been added in version 10 vvv
-  [[ "${lines[@]}" == *"CREATE VIEW queries AS SELECT id, timestamp, type, status, CASE typeof(domain) WHEN 'integer' THEN (SELECT domain FROM domain_by_id d WHERE d.id = q.domain) ELSE domain END domain,CASE typeof(client) WHEN 'integer' THEN (SELECT ip FROM client_by_id c WHERE c.id = q.client) ELSE client END client,CASE typeof(forward) WHEN 'integer' THEN (SELECT forward FROM forward_by_id f WHERE f.id = q.forward) ELSE forward END forward,CASE typeof(additional_info) WHEN 'integer' THEN (SELECT content FROM addinfo_by_id a WHERE a.id = q.additional_info) ELSE additional_info END additional_info, reply_type, reply_time, dnssec FROM query_storage q;"* ]]
+  [[ "${lines[@]}" == *"CREATE VIEW queries AS SELECT id, timestamp, type, status, CASE typeof(domain) WHEN 'integer' THEN (SELECT domain FROM domain_by_id d WHERE d.id = q.domain) ELSE domain END domain,CASE typeof(client) WHEN 'integer' THEN (SELECT ip FROM client_by_id c WHERE c.id = q.client) ELSE client END client,CASE typeof(forward) WHEN 'integer' THEN (SELECT forward FROM forward_by_id f WHERE f.id = q.forward) ELSE forward END forward,CASE typeof(additional_info) WHEN 'integer' THEN (SELECT content FROM addinfo_by_id a WHERE a.id = q.additional_info) ELSE additional_info END additional_info, reply_type, reply_time, dnssec, sample FROM query_storage q;"* ]]
   [[ "${lines[@]}" == *"CREATE TABLE domain_by_id (id INTEGER PRIMARY KEY, domain TEXT NOT NULL);"* ]]
   [[ "${lines[@]}" == *"CREATE TABLE client_by_id (id INTEGER PRIMARY KEY, ip TEXT NOT NULL, name TEXT);"* ]]
   [[ "${lines[@]}" == *"CREATE TABLE forward_by_id (id INTEGER PRIMARY KEY, forward TEXT NOT NULL);"* ]]
@@ -1310,8 +1484,8 @@
   run bash -c 'grep -c "Aliasclient ID 127.0.0.6 -> 0" /var/log/pihole/FTL.log'
   printf "Found ID: %s\n" "${lines[@]}"
   [[ ${lines[0]} == "1" ]]
-  run bash -c 'grep -c "Client .* (127.0.0.6) IS  managed by this alias-client, adding counts" /var/log/pihole/FTL.log'
-  printf "Adding counts: %s\n" "${lines[@]}"
+  run bash -c 'grep -c "Client .* (127.0.0.6) joins alias-client \"some-aliasclient\" (aliasclient-0)" /var/log/pihole/FTL.log'
+  printf "Joining: %s\n" "${lines[@]}"
   [[ ${lines[0]} == "1" ]]
 }
 